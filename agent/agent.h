@@ -36,6 +36,7 @@
 #include "../common/sysutils.h" /* (gnupg_fd_t) */
 #include "../common/session-env.h"
 #include "../common/shareddefs.h"
+#include "../common/metrics.h"
 
 /* To convey some special hash algorithms we use algorithm numbers
    reserved for application use. */
@@ -105,6 +106,14 @@ struct
   unsigned long max_cache_ttl;     /* Default. */
   unsigned long max_cache_ttl_ssh; /* for SSH. */
 
+  /* The time in seconds unprotected keys are kept in the cache.  A
+   * value of 0 disables this.  */
+  unsigned long key_cache_ttl;
+
+  /* The number of keys generated in advance for each key parameter.
+   * A value of 0 disables the key pool.  */
+  unsigned int keypool_size;
+
   /* Flag disallowing bypassing of the warning.  */
   int enforce_passphrase_constraints;
 
@@ -230,6 +239,9 @@ struct server_control_s
   /* Private data of the SCdaemon (call-scd.c). */
   struct scd_local_s *scd_local;
 
+  /* The current request and trace id of the connection.  */
+  struct metric_request_s request;
+
   /* Environment settings for the connection.  */
   session_env_t session_env;
   char *lc_ctype;
@@ -340,6 +352,20 @@ cache_mode_t;
 typedef int (*lookup_ttl_t)(const char *hexgrip);
 
 
+/* The key derived from a passphrase by agent_unprotect_with_kek.
+ * Objects of this type should be allocated in secure memory.  */
+struct unprotect_kek_s
+{
+  unsigned int is_set:1;  /* KEY is valid for SALT and COUNT.  */
+  unsigned int is_new:1;  /* KEY has been derived by the last call.  */
+  unsigned char salt[8];
+  unsigned long count;
+  size_t keylen;
+  unsigned char key[32];
+};
+typedef struct unprotect_kek_s *unprotect_kek_t;
+
+
 /* This is a special version of the usual _() gettext macro.  It
    assumes a server connection control variable with the name "ctrl"
    and uses that to translate a string according to the locale set for
@@ -398,6 +424,8 @@ gpg_error_t agent_print_status (ctrl_t ctrl, const char *keyword,
      GPGRT_ATTR_PRINTF(3,4);
 void bump_key_eventcounter (void);
 void bump_card_eventcounter (void);
+void get_card_eventcounters (unsigned int *r_card,
+                             unsigned int *r_key_change);
 void start_command_handler (ctrl_t, gnupg_fd_t, gnupg_fd_t);
 gpg_error_t pinentry_loopback (ctrl_t, const char *keyword,
                                unsigned char **buffer, size_t *size,
@@ -422,6 +450,8 @@ gpg_error_t ssh_search_control_file (ssh_control_file_t cf,
                                      int *r_disabled,
                                      int *r_ttl, int *r_confirm);
 
+void initialize_module_command_ssh (void);
+void ssh_flush_identity_cache (void);
 void start_command_handler_ssh (ctrl_t, gnupg_fd_t);
 
 /*-- findkey.c --*/
@@ -446,7 +476,10 @@ gpg_error_t agent_public_key_from_file (ctrl_t ctrl,
                                         gcry_sexp_t *result);
 int agent_is_dsa_key (gcry_sexp_t s_key);
 int agent_is_eddsa_key (gcry_sexp_t s_key);
+void initialize_module_findkey (void);
 int agent_key_available (const unsigned char *grip);
+gpg_error_t agent_list_keygrips (unsigned char (**r_grips)[20],
+                                 size_t *r_ngrips);
 gpg_error_t agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
                                       int *r_keytype,
                                       unsigned char **r_shadow_info);
@@ -478,6 +511,7 @@ int agent_clear_passphrase (ctrl_t ctrl,
 			    const char *keyinfo, cache_mode_t cache_mode);
 
 /*-- cache.c --*/
+struct stat;
 void initialize_module_cache (void);
 void deinitialize_module_cache (void);
 void agent_cache_housekeeping (void);
@@ -485,10 +519,33 @@ void agent_flush_cache (int pincache_only);
 int agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
                      const char *data, int ttl);
 char *agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode);
+void agent_put_key_cache (ctrl_t ctrl, const char *key,
+                          cache_mode_t cache_mode, const char *passphrase,
+                          const struct stat *st, const unsigned char *skey);
+unsigned char *agent_get_key_cache (ctrl_t ctrl, const char *key,
+                                    cache_mode_t cache_mode,
+                                    const struct stat *st);
+void agent_flush_key_cache (const char *key);
+void agent_put_cache_kek (ctrl_t ctrl, const char *key,
+                          cache_mode_t cache_mode, const char *passphrase,
+                          unprotect_kek_t kek);
+void agent_get_cache_kek (ctrl_t ctrl, const char *key,
+                          cache_mode_t cache_mode, const char *passphrase,
+                          unprotect_kek_t kek);
 void agent_store_cache_hit (const char *key);
 
 
 /*-- pksign.c --*/
+/* One signing job for agent_pksign_multi.  */
+struct pksign_multi_job_s
+{
+  unsigned char grip[KEYGRIP_LEN];
+  int algo;                              /* The hash algorithm.  */
+  unsigned char digest[MAX_DIGEST_LEN];
+  size_t digestlen;
+  char *desc;                            /* The key description or NULL.  */
+};
+
 gpg_error_t agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
                              const char *desc_text,
                              gcry_sexp_t *signature_sexp,
@@ -497,11 +554,48 @@ gpg_error_t agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
 gpg_error_t agent_pksign (ctrl_t ctrl, const char *cache_nonce,
                           const char *desc_text,
                           membuf_t *outbuf, cache_mode_t cache_mode);
+gpg_error_t agent_pksign_batch (ctrl_t ctrl, const char *cache_nonce,
+                                const char *desc_text, cache_mode_t cache_mode,
+                                const unsigned char *digests, size_t digestlen,
+                                size_t ndigests,
+                                gpg_error_t (*cb)(void *opaque,
+                                                  const void *sig,
+                                                  size_t siglen),
+                                void *opaque);
+gpg_error_t agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                                cache_mode_t cache_mode,
+                                struct pksign_multi_job_s *jobs,
+                                unsigned int njobs,
+                                gpg_error_t (*cb)(void *opaque,
+                                                  unsigned int idx,
+                                                  const void *sig,
+                                                  size_t siglen),
+                                void *opaque);
 
 /*-- pkdecrypt.c --*/
 int agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
                      const unsigned char *ciphertext, size_t ciphertextlen,
                      membuf_t *outbuf, int *r_padding);
+gpg_error_t agent_pkdecrypt_batch (ctrl_t ctrl, const char *desc_text,
+                                   const unsigned char *ciphertexts,
+                                   size_t ciphertextslen,
+                                   gpg_error_t (*cb)(void *opaque,
+                                                     unsigned int idx,
+                                                     const void *plain,
+                                                     size_t plainlen,
+                                                     int padding),
+                                   void *opaque);
+gpg_error_t agent_pkdecrypt_trial (ctrl_t ctrl,
+                                   const unsigned char (*grips)[20],
+                                   unsigned int ngrips,
+                                   const unsigned char *ciphertext,
+                                   size_t ciphertextlen,
+                                   gpg_error_t (*cb)(void *opaque,
+                                                     unsigned int idx,
+                                                     gpg_error_t keyerr,
+                                                     const void *plain,
+                                                     size_t plainlen),
+                                   void *opaque);
 
 /*-- genkey.c --*/
 int check_passphrase_constraints (ctrl_t ctrl, const char *pw,
@@ -515,9 +609,43 @@ int agent_genkey (ctrl_t ctrl, const char *cache_nonce,
 gpg_error_t agent_protect_and_store (ctrl_t ctrl, gcry_sexp_t s_skey,
                                      char **passphrase_addr);
 
+/*-- workpool.c --*/
+void initialize_module_workpool (void);
+void workpool_set_worker (void);
+void workpool_pre_syscall (void);
+void workpool_post_syscall (void);
+gpg_error_t workpool_pk_decrypt (gcry_sexp_t *r_plain, gcry_sexp_t s_data,
+                                 gcry_sexp_t s_skey);
+void workpool_pk_decrypt_many (gcry_sexp_t s_data,
+                               gcry_sexp_t *s_skeys, unsigned int nkeys,
+                               gcry_sexp_t *r_plains, gpg_error_t *r_errs);
+gpg_error_t workpool_pk_sign (gcry_sexp_t *r_sig, gcry_sexp_t s_hash,
+                              gcry_sexp_t s_skey);
+void workpool_pk_sign_many (gcry_sexp_t *s_hashes, gcry_sexp_t *s_skeys,
+                            unsigned int njobs,
+                            gcry_sexp_t *r_sigs, gpg_error_t *r_errs);
+gpg_error_t workpool_pk_verify (gcry_sexp_t s_sig, gcry_sexp_t s_hash,
+                                gcry_sexp_t s_pkey);
+gpg_error_t workpool_pk_genkey (gcry_sexp_t *r_key, gcry_sexp_t s_parms);
+void workpool_protect_many (unsigned char **plainkeys, char **passphrases,
+                            unsigned int njobs, unsigned long s2k_count,
+                            unsigned char **r_results, size_t *r_resultlens,
+                            gpg_error_t *r_errs);
+void workpool_s2k_many (char **passphrases, unsigned char **salts,
+                        unsigned int njobs, unsigned long s2k_count,
+                        unsigned char **r_keys, size_t keylen,
+                        gpg_error_t *r_errs);
+
+/*-- keypool.c --*/
+void initialize_module_keypool (void);
+int keypool_take (gcry_sexp_t *r_key, gcry_sexp_t s_parms);
+void keypool_reconfigure (void);
+
 /*-- protect.c --*/
 void set_s2k_calibration_time (unsigned int milliseconds);
 unsigned long get_calibrated_s2k_count (void);
+void enable_s2k_calibration_file (void);
+void prepare_s2k_calibration (void (*unprotect)(void), void (*protect)(void));
 unsigned long get_standard_s2k_count (void);
 unsigned char get_standard_s2k_count_rfc4880 (void);
 unsigned long get_standard_s2k_time (void);
@@ -528,6 +656,10 @@ gpg_error_t agent_unprotect (ctrl_t ctrl,
                      const unsigned char *protectedkey, const char *passphrase,
                      gnupg_isotime_t protected_at,
                      unsigned char **result, size_t *resultlen);
+gpg_error_t agent_unprotect_with_kek (ctrl_t ctrl,
+                     const unsigned char *protectedkey, const char *passphrase,
+                     unprotect_kek_t kek, gnupg_isotime_t protected_at,
+                     unsigned char **result, size_t *resultlen);
 int agent_private_key_type (const unsigned char *privatekey);
 unsigned char *make_shadow_info (const char *serialno, const char *idstring);
 int agent_shadow_key (const unsigned char *pubkey,
@@ -23,9 +23,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <npth.h>
 
 #include "agent.h"
+#include "../common/metrics.h"
 
 /* The default TTL for DATA items.  This has no configure
  * option because it is expected that clients provide a TTL.  */
@@ -34,6 +37,18 @@
 /* The size of the encryption key in bytes.  */
 #define ENCRYPTION_KEYSIZE (128/8)
 
+/* The number of hash buckets of the cache.  Must be a power of 2.  */
+#define CACHE_BUCKETS 1024
+
+/* Unused slots are removed after this many seconds.  */
+#define UNUSED_SLOT_TTL (60*30)
+
+METRIC_DEFINE_COUNTER (m_cache_hits, "cache_hits");
+METRIC_DEFINE_COUNTER (m_cache_misses, "cache_misses");
+
+/* Marker for an item which is not in the expiry heap.  */
+#define NOT_IN_HEAP ((size_t)(-1))
+
 /* A mutex used to serialize access to the cache.  */
 static npth_mutex_t cache_lock;
 /* The encryption context.  This is the only place where the
@@ -50,24 +65,61 @@ static gcry_cipher_hd_t encryption_handle;
 
 struct secret_data_s {
   int  totallen; /* This includes the padding and space for AESWRAP. */
-  char data[1];  /* A string.  */
+  char data[1];  /* A string or a canonical S-expression.  */
+};
+
+/* The identification of the key file an unprotected key was read
+ * from.  */
+struct key_stamp_s {
+  off_t size;
+  time_t mtime;
+  ino_t ino;
 };
 
 /* The cache object.  */
 typedef struct cache_item_s *ITEM;
 struct cache_item_s {
-  ITEM next;
+  ITEM next;        /* Next item in the same hash bucket.  */
   time_t created;
   time_t accessed;  /* Not updated for CACHE_MODE_DATA */
   int ttl;  /* max. lifetime given in seconds, -1 one means infinite */
   struct secret_data_s *pw;
+  /* An unprotected private key which has been unlocked using PW.  It
+   * is removed along with PW but not later than at SKEY_EXPIRES.  */
+  struct secret_data_s *skey;
+  time_t skey_expires;
+  struct key_stamp_s skey_stamp;
+  /* The key derived from PW for the protection of a private key.  */
+  struct secret_data_s *kek;
   cache_mode_t cache_mode;
   int restricted;  /* The value of ctrl->restricted is part of the key.  */
+  time_t deadline;  /* The time housekeeping needs to look at the item. */
+  size_t heap_pos;  /* Index into EXPIRY_HEAP or NOT_IN_HEAP.  */
   char key[1];
 };
 
-/* The cache himself.  */
-static ITEM thecache;
+/* The cache himself.  This is a hash table indexed by the key; the
+ * cache mode and the restricted flag are compared while walking the
+ * bucket.  Items with the same key are kept in their order of
+ * insertion with the newest first.  */
+static ITEM thecache[CACHE_BUCKETS];
+
+/* The number of items in the cache.  */
+static size_t cache_items;
+
+/* A binary min-heap of the items sorted by their deadline so that
+ * housekeeping only needs to look at items which are due.  Items
+ * which never expire are not in the heap.  EXPIRY_HEAP_SIZE is
+ * always at least CACHE_ITEMS so that updating an item never needs
+ * to allocate memory.  */
+static ITEM *expiry_heap;
+static size_t expiry_heap_len;
+static size_t expiry_heap_size;
+
+/* The values of the max-cache-ttl options used to compute the
+ * deadlines.  If they are changed all deadlines are recomputed.  */
+static unsigned long heap_max_cache_ttl;
+static unsigned long heap_max_cache_ttl_ssh;
 
 /* NULL or the last cache key stored by agent_store_cache_hit.  */
 static char *last_stored_cache_key;
@@ -143,12 +195,13 @@ release_data (struct secret_data_s *data)
    xfree (data);
 }
 
+/* Encrypt the LENGTH bytes at BUFFER and store them in a new data
+ * object at R_DATA.  */
 static gpg_error_t
-new_data (const char *string, struct secret_data_s **r_data)
+new_data (const void *buffer, size_t length, struct secret_data_s **r_data)
 {
   gpg_error_t err;
   struct secret_data_s *d, *d_enc;
-  size_t length;
   int total;
 
   *r_data = NULL;
@@ -157,8 +210,6 @@ new_data (const char *string, struct secret_data_s **r_data)
   if (err)
     return err;
 
-  length = strlen (string) + 1;
-
   /* We pad the data to 32 bytes so that it get more complicated
      finding something out by watching allocation patterns.  This is
      usually not possible but we better assume nothing about our secure
@@ -169,7 +220,7 @@ new_data (const char *string, struct secret_data_s **r_data)
   d = xtrymalloc_secure (sizeof *d + total - 1);
   if (!d)
     return gpg_error_from_syserror ();
-  memcpy (d->data, string, length);
+  memcpy (d->data, buffer, length);
 
   d_enc = xtrymalloc (sizeof *d_enc + total - 1);
   if (!d_enc)
@@ -193,79 +244,324 @@ new_data (const char *string, struct secret_data_s **r_data)
 }
 
 
+/* Decrypt DATA into a buffer allocated in secure memory and store it
+ * at R_VALUE.  The buffer has the padding of DATA appended.  */
+static gpg_error_t
+get_data (struct secret_data_s *data, char **r_value)
+{
+  gpg_error_t err;
+  char *value;
+
+  *r_value = NULL;
 
-/* Check whether there are items to expire.  */
-static void
-housekeeping (void)
+  if (data->totallen < 32)
+    return gpg_error (GPG_ERR_INV_LENGTH);
+  err = init_encryption ();
+  if (err)
+    return err;
+  value = xtrymalloc_secure (data->totallen - 8);
+  if (!value)
+    return gpg_error_from_syserror ();
+  err = gcry_cipher_decrypt (encryption_handle,
+                             value, data->totallen - 8,
+                             data->data, data->totallen);
+  if (err)
+    {
+      xfree (value);
+      return err;
+    }
+  *r_value = value;
+  return 0;
+}
+
+
+
+/* The hash function for the cache keys.  */
+static unsigned int
+cache_hash (const char *key)
 {
-  ITEM r, rprev;
-  time_t current = gnupg_get_time ();
+  const unsigned char *s = (const unsigned char *)key;
+  unsigned int hash = 2166136261u;  /* FNV-1a */
 
-  /* First expire the actual data */
-  for (r=thecache; r; r = r->next)
+  for (; *s; s++)
+    hash = (hash ^ *s) * 16777619u;
+  return hash & (CACHE_BUCKETS - 1);
+}
+
+
+/* Store the maximum lifetime of item R counted from its creation at
+ * R_MAXTTL.  Returns false if there is no such limit.  */
+static int
+item_max_ttl (ITEM r, unsigned long *r_maxttl)
+{
+  switch (r->cache_mode)
+    {
+    case CACHE_MODE_DATA:
+    case CACHE_MODE_PIN:
+      return 0;  /* No MAX TTL here.  */
+    case CACHE_MODE_SSH: *r_maxttl = opt.max_cache_ttl_ssh; break;
+    default: *r_maxttl = opt.max_cache_ttl; break;
+    }
+  return 1;
+}
+
+
+/* Return the time after which housekeeping needs to look at item R
+ * or 0 if it never expires.  This must match the conditions used by
+ * expire_item.  */
+static time_t
+item_deadline (ITEM r)
+{
+  time_t deadline = 0;
+  time_t t;
+  unsigned long maxttl;
+
+  if (r->pw)
     {
-      if (r->cache_mode == CACHE_MODE_PIN)
-        ; /* Don't let it expire - scdaemon explicitly flushes them.  */
-      else if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
+      /* PIN items don't expire - scdaemon explicitly flushes them.  */
+      if (r->cache_mode != CACHE_MODE_PIN && r->ttl >= 0)
+        deadline = r->accessed + r->ttl;
+      if (item_max_ttl (r, &maxttl))
         {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s'.%d (%ds after last access)\n",
-                       r->key, r->restricted, r->ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
+          t = r->created + maxttl;
+          if (!deadline || t < deadline)
+            deadline = t;
         }
+      if (r->skey && (!deadline || r->skey_expires < deadline))
+        deadline = r->skey_expires;
+    }
+  else if (r->ttl >= 0)
+    deadline = r->accessed + UNUSED_SLOT_TTL;
+
+  return deadline;
+}
+
+
+static void
+heap_set (size_t pos, ITEM r)
+{
+  expiry_heap[pos] = r;
+  r->heap_pos = pos;
+}
+
+
+static void
+heap_sift_up (size_t pos)
+{
+  ITEM r = expiry_heap[pos];
+  size_t parent;
+
+  while (pos)
+    {
+      parent = (pos - 1) / 2;
+      if (expiry_heap[parent]->deadline <= r->deadline)
+        break;
+      heap_set (pos, expiry_heap[parent]);
+      pos = parent;
+    }
+  heap_set (pos, r);
+}
+
+
+static void
+heap_sift_down (size_t pos)
+{
+  ITEM r = expiry_heap[pos];
+  size_t child;
+
+  for (;;)
+    {
+      child = 2 * pos + 1;
+      if (child >= expiry_heap_len)
+        break;
+      if (child + 1 < expiry_heap_len
+          && (expiry_heap[child + 1]->deadline
+              < expiry_heap[child]->deadline))
+        child++;
+      if (r->deadline <= expiry_heap[child]->deadline)
+        break;
+      heap_set (pos, expiry_heap[child]);
+      pos = child;
+    }
+  heap_set (pos, r);
+}
+
+
+static void
+heap_remove (ITEM r)
+{
+  size_t pos = r->heap_pos;
+  ITEM last;
+
+  if (pos == NOT_IN_HEAP)
+    return;
+  r->heap_pos = NOT_IN_HEAP;
+  last = expiry_heap[--expiry_heap_len];
+  if (last == r)
+    return;
+  heap_set (pos, last);
+  heap_sift_up (pos);
+  heap_sift_down (last->heap_pos);
+}
+
+
+/* Recompute the deadline of R and update its position in the heap.
+ * This needs to be called after any change of the fields used by
+ * item_deadline.  */
+static void
+update_item (ITEM r)
+{
+  r->deadline = item_deadline (r);
+  if (!r->deadline)
+    heap_remove (r);
+  else if (r->heap_pos == NOT_IN_HEAP)
+    {
+      log_assert (expiry_heap_len < expiry_heap_size);
+      heap_set (expiry_heap_len++, r);
+      heap_sift_up (r->heap_pos);
+    }
+  else
+    {
+      heap_sift_up (r->heap_pos);
+      heap_sift_down (r->heap_pos);
+    }
+}
+
+
+/* Recompute all deadlines.  This is required after a change of the
+ * max-cache-ttl options.  */
+static void
+rebuild_heap (void)
+{
+  unsigned int idx;
+  ITEM r;
+
+  expiry_heap_len = 0;
+  for (idx=0; idx < CACHE_BUCKETS; idx++)
+    for (r = thecache[idx]; r; r = r->next)
+      {
+        r->heap_pos = NOT_IN_HEAP;
+        update_item (r);
+      }
+  heap_max_cache_ttl = opt.max_cache_ttl;
+  heap_max_cache_ttl_ssh = opt.max_cache_ttl_ssh;
+}
+
+
+/* Release the unprotected key of item R.  */
+static void
+release_skey (ITEM r)
+{
+  release_data (r->skey);
+  r->skey = NULL;
+}
+
+
+/* Release the passphrase of item R and the keys derived from it or
+ * unlocked with it.  */
+static void
+release_pw (ITEM r)
+{
+  release_data (r->pw);
+  r->pw = NULL;
+  release_data (r->kek);
+  r->kek = NULL;
+  release_skey (r);
+}
+
+
+/* Remove item R from the cache and release it.  */
+static void
+remove_item (ITEM r)
+{
+  ITEM *rp;
+
+  heap_remove (r);
+  for (rp = &thecache[cache_hash (r->key)]; *rp; rp = &(*rp)->next)
+    if (*rp == r)
+      {
+        *rp = r->next;
+        break;
+      }
+  release_pw (r);
+  xfree (r);
+  cache_items--;
+}
+
+
+/* Expire the data of item R or remove it; CURRENT is the current
+ * time.  Returns true if the item has been removed.  */
+static int
+expire_item (ITEM r, time_t current)
+{
+  unsigned long maxttl;
+
+  if (r->skey && r->skey_expires < current)
+    {
+      if (DBG_CACHE)
+        log_debug ("  expired unprotected key of '%s'.%d\n",
+                   r->key, r->restricted);
+      release_skey (r);
+    }
+
+  /* First expire the actual data */
+  if (r->cache_mode == CACHE_MODE_PIN)
+    ; /* Don't let it expire - scdaemon explicitly flushes them.  */
+  else if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
+    {
+      if (DBG_CACHE)
+        log_debug ("  expired '%s'.%d (%ds after last access)\n",
+                   r->key, r->restricted, r->ttl);
+      release_pw (r);
+      r->accessed = current;
     }
 
   /* Second, make sure that we also remove them based on the created
    * stamp so that the user has to enter it from time to time.  We
    * don't do this for data items which are used to storage secrets in
    * meory and are not user entered passphrases etc.  */
-  for (r=thecache; r; r = r->next)
+  if (r->pw && item_max_ttl (r, &maxttl) && r->created + maxttl < current)
     {
-      unsigned long maxttl;
-
-      switch (r->cache_mode)
-        {
-        case CACHE_MODE_DATA:
-        case CACHE_MODE_PIN:
-          continue;  /* No MAX TTL here.  */
-        case CACHE_MODE_SSH: maxttl = opt.max_cache_ttl_ssh; break;
-        default: maxttl = opt.max_cache_ttl; break;
-        }
-      if (r->pw && r->created + maxttl < current)
-        {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s'.%d (%lus after creation)\n",
-                       r->key, r->restricted, opt.max_cache_ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
-        }
+      if (DBG_CACHE)
+        log_debug ("  expired '%s'.%d (%lus after creation)\n",
+                   r->key, r->restricted, maxttl);
+      release_pw (r);
+      r->accessed = current;
     }
 
   /* Third, make sure that we don't have too many items in the list.
    * Expire old and unused entries after 30 minutes.  */
-  for (rprev=NULL, r=thecache; r; )
+  if (!r->pw && r->ttl >= 0 && r->accessed + UNUSED_SLOT_TTL < current)
     {
-      if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
-        {
-          ITEM r2 = r->next;
-          if (DBG_CACHE)
-            log_debug ("  removed '%s'.%d (mode %d) (slot not used for 30m)\n",
-                       r->key, r->restricted, r->cache_mode);
-          xfree (r);
-          if (!rprev)
-            thecache = r2;
-          else
-            rprev->next = r2;
-          r = r2;
-        }
-      else
-        {
-          rprev = r;
-          r = r->next;
-        }
+      if (DBG_CACHE)
+        log_debug ("  removed '%s'.%d (mode %d) (slot not used for 30m)\n",
+                   r->key, r->restricted, r->cache_mode);
+      remove_item (r);
+      return 1;
+    }
+
+  update_item (r);
+  return 0;
+}
+
+
+/* Check whether there are items to expire.  */
+static void
+housekeeping (void)
+{
+  time_t current = gnupg_get_time ();
+  ITEM r;
+
+  if (heap_max_cache_ttl != opt.max_cache_ttl
+      || heap_max_cache_ttl_ssh != opt.max_cache_ttl_ssh)
+    rebuild_heap ();
+
+  while (expiry_heap_len && expiry_heap[0]->deadline < current)
+    {
+      r = expiry_heap[0];
+      if (!expire_item (r, current) && r->deadline
+          && r->deadline < current)
+        break;  /* Not expected - avoid looping.  */
     }
 }
 
@@ -294,6 +590,7 @@ void
 agent_flush_cache (int pincache_only)
 {
   ITEM r;
+  unsigned int idx;
   int res;
 
   if (DBG_CACHE)
@@ -303,19 +600,20 @@ agent_flush_cache (int pincache_only)
   if (res)
     log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
 
-  for (r=thecache; r; r = r->next)
-    {
-      if (pincache_only && r->cache_mode != CACHE_MODE_PIN)
-        continue;
-      if (r->pw)
-        {
-          if (DBG_CACHE)
-            log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = 0;
-        }
-    }
+  for (idx=0; idx < CACHE_BUCKETS; idx++)
+    for (r=thecache[idx]; r; r = r->next)
+      {
+        if (pincache_only && r->cache_mode != CACHE_MODE_PIN)
+          continue;
+        if (r->pw)
+          {
+            if (DBG_CACHE)
+              log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
+            release_pw (r);
+            r->accessed = 0;
+            update_item (r);
+          }
+      }
 
   res = npth_mutex_unlock (&cache_lock);
   if (res)
@@ -348,6 +646,7 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
 {
   gpg_error_t err = 0;
   ITEM r;
+  unsigned int hash;
   int res;
   int restricted = ctrl? ctrl->restricted : -1;
 
@@ -373,7 +672,8 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
   if ((!ttl && data) || cache_mode == CACHE_MODE_IGNORE)
     goto out;
 
-  for (r=thecache; r; r = r->next)
+  hash = cache_hash (key);
+  for (r=thecache[hash]; r; r = r->next)
     {
       if (cache_mode == CACHE_MODE_PIN && data)
         {
@@ -398,22 +698,38 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
   if (r) /* Replace.  */
     {
       if (r->pw)
-        {
-          release_data (r->pw);
-          r->pw = NULL;
-        }
+        release_pw (r);
       if (data)
         {
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
-          err = new_data (data, &r->pw);
+          err = new_data (data, strlen (data) + 1, &r->pw);
           if (err)
             log_error ("error replacing cache item: %s\n", gpg_strerror (err));
         }
+      update_item (r);
     }
   else if (data) /* Insert.  */
     {
+      if (cache_items >= expiry_heap_size)
+        {
+          /* Make sure that all items fit into the heap.  */
+          size_t newsize = expiry_heap_size? 2 * expiry_heap_size : 64;
+          ITEM *newheap;
+
+          newheap = xtryrealloc (expiry_heap, newsize * sizeof *newheap);
+          if (!newheap)
+            {
+              err = gpg_error_from_syserror ();
+              log_error ("error inserting cache item: %s\n",
+                         gpg_strerror (err));
+              goto out;
+            }
+          expiry_heap = newheap;
+          expiry_heap_size = newsize;
+        }
+
       r = xtrycalloc (1, sizeof *r + strlen (key));
       if (!r)
         err = gpg_error_from_syserror ();
@@ -424,13 +740,16 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
-          err = new_data (data, &r->pw);
+          r->heap_pos = NOT_IN_HEAP;
+          err = new_data (data, strlen (data) + 1, &r->pw);
           if (err)
             xfree (r);
           else
             {
-              r->next = thecache;
-              thecache = r;
+              r->next = thecache[hash];
+              thecache[hash] = r;
+              cache_items++;
+              update_item (r);
             }
         }
       if (err)
@@ -446,6 +765,48 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
 }
 
 
+/* Return the item with a value for KEY which matches CACHE_MODE and
+ * RESTRICTED or NULL if there is none.  The cache must be locked.  */
+static ITEM
+find_item (const char *key, cache_mode_t cache_mode, int restricted)
+{
+  ITEM r;
+
+  for (r=thecache[cache_hash (key)]; r; r = r->next)
+    {
+      if (!r->pw)
+        continue;
+      if (cache_mode == CACHE_MODE_PIN)
+        {
+          if (!strcmp (r->key, key))
+            break;
+        }
+      else if (((cache_mode != CACHE_MODE_USER
+                 && cache_mode != CACHE_MODE_NONCE)
+                || cache_mode_equal (r->cache_mode, cache_mode))
+               && r->restricted == restricted
+               && !strcmp (r->key, key))
+        break;
+    }
+  return r;
+}
+
+
+/* Return true if item R holds PASSPHRASE.  */
+static int
+item_has_passphrase (ITEM r, const char *passphrase)
+{
+  char *pw;
+  int yes;
+
+  if (get_data (r->pw, &pw))
+    return 0;
+  yes = !strcmp (pw, passphrase);
+  xfree (pw);
+  return yes;
+}
+
+
 /* Try to find an item in the cache.  Returns NULL if not found or an
  * malloced string with the value.  */
 char *
@@ -457,7 +818,6 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
   int res;
   int last_stored = 0;
   int restricted = ctrl? ctrl->restricted : -1;
-  int yes;
 
   if (cache_mode == CACHE_MODE_IGNORE)
     return NULL;
@@ -480,53 +840,30 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
                last_stored? " (stored cache key)":"");
   housekeeping ();
 
-  for (r=thecache; r; r = r->next)
+  r = find_item (key, cache_mode, restricted);
+  if (r)
     {
-      if (cache_mode == CACHE_MODE_PIN)
-        yes = (r->pw && !strcmp (r->key, key));
-      else if (r->pw
-               && ((cache_mode != CACHE_MODE_USER
-                    && cache_mode != CACHE_MODE_NONCE)
-                   || cache_mode_equal (r->cache_mode, cache_mode))
-               && r->restricted == restricted
-               && !strcmp (r->key, key))
-        yes = 1;
-      else
-        yes = 0;
-
-      if (yes)
+      /* Note: To avoid races KEY may not be accessed anymore below.
+       * Note also that we don't update the accessed time for data
+       * items.  */
+      if (r->cache_mode != CACHE_MODE_DATA)
         {
-          /* Note: To avoid races KEY may not be accessed anymore
-           * below.  Note also that we don't update the accessed time
-           * for data items.  */
-          if (r->cache_mode != CACHE_MODE_DATA)
-            r->accessed = gnupg_get_time ();
-          if (DBG_CACHE)
-            log_debug ("... hit\n");
-          if (r->pw->totallen < 32)
-            err = gpg_error (GPG_ERR_INV_LENGTH);
-          else if ((err = init_encryption ()))
-            ;
-          else if (!(value = xtrymalloc_secure (r->pw->totallen - 8)))
-            err = gpg_error_from_syserror ();
-          else
-            {
-              err = gcry_cipher_decrypt (encryption_handle,
-                                         value, r->pw->totallen - 8,
-                                         r->pw->data, r->pw->totallen);
-            }
-          if (err)
-            {
-              xfree (value);
-              value = NULL;
-              log_error ("retrieving cache entry '%s'.%d failed: %s\n",
-                         key, restricted, gpg_strerror (err));
-            }
-          break;
+          r->accessed = gnupg_get_time ();
+          update_item (r);
         }
+      if (DBG_CACHE)
+        log_debug ("... hit\n");
+      err = get_data (r->pw, &value);
+      if (err)
+        log_error ("retrieving cache entry '%s'.%d failed: %s\n",
+                   r->key, restricted, gpg_strerror (err));
     }
   if (DBG_CACHE && value == NULL)
     log_debug ("... miss\n");
+  if (value)
+    metric_inc (&m_cache_hits);
+  else
+    metric_inc (&m_cache_misses);
 
  out:
   res = npth_mutex_unlock (&cache_lock);
@@ -537,6 +874,220 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
 }
 
 
+/* Store the unprotected private key SKEY, given as canonical
+ * S-expression, with the cache item for KEY.  ST describes the key
+ * file SKEY has been read from; it must have been retrieved before
+ * reading the file.  The key is only stored if the item still holds
+ * PASSPHRASE, which has been used to unprotect it, and is removed
+ * along with the passphrase but not later than after
+ * opt.key_cache_ttl seconds.  */
+void
+agent_put_key_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
+                     const char *passphrase, const struct stat *st,
+                     const unsigned char *skey)
+{
+  gpg_error_t err;
+  ITEM r;
+  size_t skeylen;
+  int res;
+  int restricted = ctrl? ctrl->restricted : -1;
+
+  if (!opt.key_cache_ttl || !st || !passphrase
+      || cache_mode == CACHE_MODE_IGNORE || cache_mode == CACHE_MODE_PIN
+      || cache_mode == CACHE_MODE_DATA)
+    return;
+  skeylen = gcry_sexp_canon_len (skey, 0, NULL, NULL);
+  if (!skeylen)
+    return;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  if (DBG_CACHE)
+    log_debug ("agent_put_key_cache '%s'.%d (mode %d)\n",
+               key, restricted, cache_mode);
+  housekeeping ();
+
+  r = find_item (key, cache_mode, restricted);
+  if (!r || !item_has_passphrase (r, passphrase))
+    goto out;  /* The passphrase has been changed in the meantime.  */
+
+  release_skey (r);
+  err = new_data (skey, skeylen, &r->skey);
+  if (err)
+    log_error ("error storing unprotected key: %s\n", gpg_strerror (err));
+  else
+    {
+      r->skey_expires = gnupg_get_time () + opt.key_cache_ttl;
+      r->skey_stamp.size = st->st_size;
+      r->skey_stamp.mtime = st->st_mtime;
+      r->skey_stamp.ino = st->st_ino;
+    }
+  update_item (r);
+
+ out:
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+}
+
+
+/* Return the unprotected private key stored with the cache item for
+ * KEY if it has been read from the key file described by ST.  Returns
+ * NULL if not found or a buffer allocated in secure memory with the
+ * key as canonical S-expression.  Like agent_get_cache this counts as
+ * an access to the passphrase.  */
+unsigned char *
+agent_get_key_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
+                     const struct stat *st)
+{
+  gpg_error_t err;
+  ITEM r;
+  char *value = NULL;
+  int res;
+  int restricted = ctrl? ctrl->restricted : -1;
+
+  if (!opt.key_cache_ttl || cache_mode == CACHE_MODE_IGNORE)
+    return NULL;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  if (DBG_CACHE)
+    log_debug ("agent_get_key_cache '%s'.%d (mode %d) ...\n",
+               key, restricted, cache_mode);
+  housekeeping ();
+
+  r = find_item (key, cache_mode, restricted);
+  if (r && r->skey
+      && r->skey_stamp.size == st->st_size
+      && r->skey_stamp.mtime == st->st_mtime
+      && r->skey_stamp.ino == st->st_ino)
+    {
+      r->accessed = gnupg_get_time ();
+      update_item (r);
+      if (DBG_CACHE)
+        log_debug ("... hit\n");
+      err = get_data (r->skey, &value);
+      if (err)
+        log_error ("retrieving unprotected key '%s'.%d failed: %s\n",
+                   key, restricted, gpg_strerror (err));
+    }
+  else if (DBG_CACHE)
+    log_debug ("... miss\n");
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+
+  return (unsigned char *)value;
+}
+
+
+/* Remove all unprotected keys stored for KEY.  This needs to be
+ * called when a key file is changed or removed.  */
+void
+agent_flush_key_cache (const char *key)
+{
+  ITEM r;
+  int res;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  for (r=thecache[cache_hash (key)]; r; r = r->next)
+    if (r->skey && !strcmp (r->key, key))
+      {
+        if (DBG_CACHE)
+          log_debug ("  flushing unprotected key of '%s'.%d\n",
+                     r->key, r->restricted);
+        release_skey (r);
+        update_item (r);
+      }
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+}
+
+
+/* Store the key KEK which has been derived from PASSPHRASE with the
+ * cache item for KEY if that item still holds PASSPHRASE.  The key is
+ * removed along with the passphrase.  */
+void
+agent_put_cache_kek (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
+                     const char *passphrase, unprotect_kek_t kek)
+{
+  gpg_error_t err;
+  ITEM r;
+  int res;
+  int restricted = ctrl? ctrl->restricted : -1;
+
+  if (!kek->is_set || cache_mode == CACHE_MODE_IGNORE
+      || cache_mode == CACHE_MODE_PIN || cache_mode == CACHE_MODE_DATA)
+    return;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  r = find_item (key, cache_mode, restricted);
+  if (r && item_has_passphrase (r, passphrase))
+    {
+      if (DBG_CACHE)
+        log_debug ("agent_put_cache_kek '%s'.%d\n", r->key, restricted);
+      release_data (r->kek);
+      r->kek = NULL;
+      err = new_data (kek, sizeof *kek, &r->kek);
+      if (err)
+        log_error ("error storing derived key: %s\n", gpg_strerror (err));
+    }
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+}
+
+
+/* Fill KEK with the key stored by agent_put_cache_kek with the cache
+ * item for KEY.  If there is no such key or the item does not hold
+ * PASSPHRASE anymore KEK is cleared.  */
+void
+agent_get_cache_kek (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
+                     const char *passphrase, unprotect_kek_t kek)
+{
+  ITEM r;
+  char *value;
+  int res;
+  int restricted = ctrl? ctrl->restricted : -1;
+
+  memset (kek, 0, sizeof *kek);
+  if (cache_mode == CACHE_MODE_IGNORE)
+    return;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  r = find_item (key, cache_mode, restricted);
+  if (r && r->kek && item_has_passphrase (r, passphrase)
+      && !get_data (r->kek, &value))
+    {
+      memcpy (kek, value, sizeof *kek);
+      wipememory (value, sizeof *kek);
+      xfree (value);
+      kek->is_new = 0;
+    }
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+}
+
+
 /* Store the key for the last successful cache hit.  That value is
    used by agent_get_cache if the requested KEY is given as NULL.
    NULL may be used to remove that key. */
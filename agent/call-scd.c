@@ -46,6 +46,9 @@
 #define MAX_OPEN_FDS 20
 #endif
 
+/* Maximum number of idle connections to the scdaemon kept for reuse.  */
+#define MAX_IDLE_SCD_CTX 8
+
 /* Definition of module local data of the CTRL structure.  */
 struct scd_local_s
 {
@@ -57,6 +60,9 @@ struct scd_local_s
                              used with this connection. */
   unsigned int in_use: 1; /* CTX is in use.  */
   unsigned int invalid:1; /* CTX is invalid, should be released.  */
+
+  /* The trace id last sent on CTX or "?" if not known.  */
+  char trace_id[METRIC_TRACE_ID_LEN+1];
 };
 
 
@@ -109,6 +115,12 @@ static assuan_context_t primary_scd_ctx;
    any connection. */
 static int primary_scd_ctx_reusable;
 
+/* Additional connections which have been reset and are not in use by
+   any connection.  They are reused instead of connecting again to
+   the scdaemon's socket.  */
+static assuan_context_t idle_scd_ctx[MAX_IDLE_SCD_CTX];
+static int n_idle_scd_ctx;
+
 
 
 /* Local prototypes.  */
@@ -145,6 +157,7 @@ agent_scd_dump_state (void)
             primary_scd_ctx,
             (long)assuan_get_pid (primary_scd_ctx),
             primary_scd_ctx_reusable);
+  log_info ("agent_scd_dump_state: idle connections=%d\n", n_idle_scd_ctx);
   if (socket_name)
     log_info ("agent_scd_dump_state: socket='%s'\n", socket_name);
 }
@@ -271,6 +284,9 @@ wait_child_thread (void *arg)
       primary_scd_ctx = NULL;
       primary_scd_ctx_reusable = 0;
 
+      while (n_idle_scd_ctx)
+        assuan_release (idle_scd_ctx[--n_idle_scd_ctx]);
+
       xfree (socket_name);
       socket_name = NULL;
 
@@ -284,6 +300,23 @@ wait_child_thread (void *arg)
 }
 
 
+/* Pass the trace id of the client connection CTRL on to the SCdaemon
+ * unless it has already been done.  */
+static void
+update_scd_trace_id (ctrl_t ctrl)
+{
+  struct scd_local_s *sl = ctrl->scd_local;
+  char line[ASSUAN_LINELENGTH];
+
+  if (!strcmp (sl->trace_id, ctrl->request.trace_id))
+    return;
+  snprintf (line, sizeof line, "OPTION trace-id=%s", ctrl->request.trace_id);
+  /* Errors are ignored; older SCdaemons do not know this option.  */
+  assuan_transact (sl->ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  strcpy (sl->trace_id, ctrl->request.trace_id);
+}
+
+
 /* Fork off the SCdaemon if this has not already been done.  Lock the
    daemon and make sure that a proper context has been setup in CTRL.
    This function might also lock the daemon, which means that the
@@ -300,6 +333,7 @@ start_scd (ctrl_t ctrl)
   int i;
   int rc;
   char *abs_homedir = NULL;
+  int reused = 0;
 
   if (opt.disable_scdaemon)
     return gpg_error (GPG_ERR_NOT_SUPPORTED);
@@ -307,6 +341,7 @@ start_scd (ctrl_t ctrl)
   if (ctrl->scd_local && ctrl->scd_local->ctx)
     {
       ctrl->scd_local->in_use = 1;
+      update_scd_trace_id (ctrl);
       return 0; /* Okay, the context is fine.  */
     }
 
@@ -351,11 +386,21 @@ start_scd (ctrl_t ctrl)
     {
       ctx = primary_scd_ctx;
       primary_scd_ctx_reusable = 0;
+      reused = 1;
       if (opt.verbose)
         log_info ("new connection to SCdaemon established (reusing)\n");
       goto leave;
     }
 
+  if (n_idle_scd_ctx)
+    {
+      ctx = idle_scd_ctx[--n_idle_scd_ctx];
+      reused = 1;
+      if (opt.verbose)
+        log_info ("new connection to SCdaemon established (reusing idle)\n");
+      goto leave;
+    }
+
   rc = assuan_new (&ctx);
   if (rc)
     {
@@ -510,6 +555,9 @@ start_scd (ctrl_t ctrl)
 
   primary_scd_ctx = ctx;
   primary_scd_ctx_reusable = 0;
+  /* A new scdaemon did not report the card events which happened
+     before it started; thus consider the cards as changed.  */
+  bump_card_eventcounter ();
 
   {
     npth_t thread;
@@ -545,6 +593,10 @@ start_scd (ctrl_t ctrl)
     {
       ctrl->scd_local->invalid = 0;
       ctrl->scd_local->ctx = ctx;
+      /* A reused context may carry the trace id of another
+       * connection.  */
+      strcpy (ctrl->scd_local->trace_id, reused? "?" : "");
+      update_scd_trace_id (ctrl);
     }
   return err;
 }
@@ -595,6 +647,19 @@ agent_reset_scd (ctrl_t ctrl)
                                    NULL, NULL, NULL, NULL, NULL, NULL);
                   primary_scd_ctx_reusable = 1;
                 }
+              else if (n_idle_scd_ctx < MAX_IDLE_SCD_CTX
+                       && !ctrl->scd_local->invalid
+                       && !assuan_transact (ctrl->scd_local->ctx, "RESTART",
+                                            NULL, NULL, NULL, NULL,
+                                            NULL, NULL))
+                {
+                  /* Keep an additional connection for reuse by the
+                     next connection; this saves the connect and the
+                     startup of a new connection thread in the
+                     scdaemon.  The RESTART releases the card used by
+                     this connection.  */
+                  idle_scd_ctx[n_idle_scd_ctx++] = ctrl->scd_local->ctx;
+                }
               else
                 assuan_release (ctrl->scd_local->ctx);
               ctrl->scd_local->ctx = NULL;
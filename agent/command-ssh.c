@@ -51,6 +51,7 @@
 #ifdef HAVE_UCRED_H
 #include <ucred.h>
 #endif
+#include <npth.h>
 
 #include "agent.h"
 
@@ -227,6 +228,50 @@ struct ssh_control_file_s
 };
 
 
+/* The status of a file used to detect changes.  */
+struct ssh_file_stamp_s
+{
+  int exists;
+  off_t size;
+  time_t mtime;
+  ino_t ino;
+};
+
+
+/* The encoded identities from the control file as sent by
+   ssh_handler_request_identities.  They are valid as long as the
+   control file and the key files have not been changed.  */
+struct ssh_identity_cache_s
+{
+  int valid;
+  unsigned int generation;   /* Incremented by ssh_flush_identity_cache.  */
+  struct ssh_file_stamp_s control_stamp;
+  unsigned int ngrips;       /* Number of enabled keys in the file.  */
+  unsigned char (*grips)[20];
+  struct ssh_file_stamp_s *grip_stamps;
+  u32 nkeys;                 /* Number of identities in BLOBS.  */
+  void *blobs;
+  size_t blobslen;
+};
+
+
+/* The encoded identities of the card keys as sent by
+   ssh_handler_request_identities.  They are valid as long as no card
+   event has been signaled by the scdaemon and the shadow key files
+   still exist.  */
+struct ssh_card_cache_s
+{
+  int valid;
+  unsigned int card_eventno; /* The card event counters at the time */
+  unsigned int key_eventno;  /* the keys were read.                 */
+  unsigned int ngrips;       /* Number of card keys.  */
+  unsigned char (*grips)[20];
+  u32 nkeys;                 /* Number of identities in BLOBS.  */
+  void *blobs;
+  size_t blobslen;
+};
+
+
 /* Prototypes.  */
 static gpg_error_t ssh_handler_request_identities (ctrl_t ctrl,
 						   estream_t request,
@@ -274,6 +319,14 @@ struct peer_info_s
 
 /* Global variables.  */
 
+/* The cache of the identities and the mutex to serialize access.  */
+static struct ssh_identity_cache_s identity_cache;
+static npth_mutex_t identity_cache_lock;
+
+/* The cache of the card identities and the mutex to serialize access.  */
+static struct ssh_card_cache_s card_cache;
+static npth_mutex_t card_cache_lock;
+
 
 /* Associating request types with the corresponding request
    handlers.  */
@@ -2466,90 +2519,167 @@ card_key_available (ctrl_t ctrl, const struct card_key_info_s *keyinfo,
 */
 
 
-/* Handler for the "request_identities" command.  */
-static gpg_error_t
-ssh_handler_request_identities (ctrl_t ctrl,
-                                estream_t request, estream_t response)
+void
+initialize_module_command_ssh (void)
 {
-  u32 key_counter;
-  estream_t key_blobs;
-  gcry_sexp_t key_public;
-  gpg_error_t err;
-  int ret;
-  ssh_control_file_t cf = NULL;
-  gpg_error_t ret_err;
+  int err;
 
-  (void)request;
+  err = npth_mutex_init (&identity_cache_lock, NULL);
+  if (err)
+    log_fatal ("error initializing ssh identity cache lock: %s\n",
+               strerror (err));
+  err = npth_mutex_init (&card_cache_lock, NULL);
+  if (err)
+    log_fatal ("error initializing ssh card cache lock: %s\n",
+               strerror (err));
+}
 
-  /* Prepare buffer stream.  */
 
-  key_public = NULL;
-  key_counter = 0;
+/* Store the status of the open file FP or of the file FNAME at R_ST.
+   A file which does not exist is also described.  */
+static void
+get_file_stamp (FILE *fp, const char *fname, struct ssh_file_stamp_s *r_st)
+{
+  struct stat st;
 
-  key_blobs = es_fopenmem (0, "r+b");
-  if (! key_blobs)
-    {
-      err = gpg_error_from_syserror ();
-      goto out;
-    }
+  memset (r_st, 0, sizeof *r_st);
+  if (fp? fstat (fileno (fp), &st) : stat (fname, &st))
+    return;
+  r_st->exists = 1;
+  r_st->size = st.st_size;
+  r_st->mtime = st.st_mtime;
+  r_st->ino = st.st_ino;
+}
 
-  /* First check whether a key is currently available in the card
-     reader - this should be allowed even without being listed in
-     sshcontrol. */
 
-  if (!opt.disable_scdaemon)
+static int
+same_file_stamp (struct ssh_file_stamp_s *a, struct ssh_file_stamp_s *b)
+{
+  return (a->exists == b->exists
+          && a->size == b->size
+          && a->mtime == b->mtime
+          && a->ino == b->ino);
+}
+
+
+/* Store the status of the key file for GRIP at R_ST.  */
+static void
+get_key_file_stamp (const unsigned char *grip, struct ssh_file_stamp_s *r_st)
+{
+  char hexgrip[40+4+1];
+  char *fname;
+
+  bin2hex (grip, 20, hexgrip);
+  strcpy (hexgrip+40, ".key");
+  fname = make_filename_try (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
+                             hexgrip, NULL);
+  if (fname)
+    get_file_stamp (NULL, fname, r_st);
+  else
+    memset (r_st, 0, sizeof *r_st);
+  xfree (fname);
+}
+
+
+static void
+release_identity_cache (void)
+{
+  identity_cache.valid = 0;
+  xfree (identity_cache.grips);
+  identity_cache.grips = NULL;
+  xfree (identity_cache.grip_stamps);
+  identity_cache.grip_stamps = NULL;
+  identity_cache.ngrips = 0;
+  es_free (identity_cache.blobs);
+  identity_cache.blobs = NULL;
+  identity_cache.blobslen = 0;
+  identity_cache.nkeys = 0;
+}
+
+
+/* Invalidate the cached identities.  This is called after a key file
+   has been changed by us.  */
+void
+ssh_flush_identity_cache (void)
+{
+  identity_cache.generation++;
+  identity_cache.valid = 0;
+}
+
+
+/* Return true if the cached identities are still valid.  The cache
+   must be locked.  */
+static int
+identity_cache_is_valid (void)
+{
+  struct ssh_file_stamp_s st;
+  char *fname;
+  unsigned int i;
+
+  if (!identity_cache.valid)
+    return 0;
+
+  fname = make_filename_try (gnupg_homedir (), SSH_CONTROL_FILE_NAME, NULL);
+  if (!fname)
+    return 0;
+  get_file_stamp (NULL, fname, &st);
+  xfree (fname);
+  if (!st.exists || !same_file_stamp (&st, &identity_cache.control_stamp))
+    return 0;
+
+  for (i=0; i < identity_cache.ngrips; i++)
     {
-      char *serialno;
-      struct card_key_info_s *keyinfo_list;
-      struct card_key_info_s *keyinfo;
+      get_key_file_stamp (identity_cache.grips[i], &st);
+      if (!same_file_stamp (&st, identity_cache.grip_stamps + i))
+        return 0;
+    }
 
-      /* Scan device(s), and get list of KEYGRIP.  */
-      err = agent_card_serialno (ctrl, &serialno, NULL);
-      if (!err)
-        {
-          xfree (serialno);
-          err = agent_card_keyinfo (ctrl, NULL, GCRY_PK_USAGE_AUTH,
-                                    &keyinfo_list);
-        }
+  return identity_cache.valid; /* Might have been flushed meanwhile.  */
+}
 
-      if (err)
-        {
-          if (opt.verbose)
-            log_info (_("error getting list of cards: %s\n"),
-                      gpg_strerror (err));
-          goto scd_out;
-        }
 
-      for (keyinfo = keyinfo_list; keyinfo; keyinfo = keyinfo->next)
-        {
-          char *cardsn;
+/* Write the identities of all registered and non-disabled keys to
+   KEY_BLOBS and store their number at R_COUNT.  The result is taken
+   from the cache if possible.  The cache must be locked.  */
+static gpg_error_t
+send_control_file_identities (ctrl_t ctrl, estream_t key_blobs, u32 *r_count)
+{
+  gpg_error_t err;
+  ssh_control_file_t cf = NULL;
+  estream_t blobs = NULL;
+  gcry_sexp_t key_public = NULL;
+  unsigned int generation, maxgrips;
+  void *tmp;
+  u32 count = 0;
 
-          if (card_key_available (ctrl, keyinfo, &key_public, &cardsn))
-            continue;
+  *r_count = 0;
 
-          err = ssh_send_key_public (key_blobs, key_public, cardsn);
-          if (err && opt.verbose)
-            gcry_log_debugsxp ("pubkey", key_public);
-          gcry_sexp_release (key_public);
-          key_public = NULL;
-          xfree (cardsn);
-          if (err)
-            {
-              agent_card_free_keyinfo (keyinfo_list);
-              goto out;
-            }
+  if (identity_cache_is_valid ())
+    {
+      if (es_write (key_blobs, identity_cache.blobs, identity_cache.blobslen,
+                    NULL))
+        return gpg_error_from_syserror ();
+      *r_count = identity_cache.nkeys;
+      return 0;
+    }
 
-          key_counter++;
-        }
+  release_identity_cache ();
+  generation = identity_cache.generation;
+  maxgrips = 0;
 
-      agent_card_free_keyinfo (keyinfo_list);
+  blobs = es_fopenmem (0, "r+b");
+  if (!blobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto out;
     }
 
- scd_out:
-  /* Then look at all the registered and non-disabled keys. */
   err = open_control_file (&cf, 0);
   if (err)
     goto out;
+  /* Take the status of the files before reading them so that a
+     concurrent change invalidates the cache.  */
+  get_file_stamp (cf->fp, NULL, &identity_cache.control_stamp);
 
   while (!read_control_file_item (cf))
     {
@@ -2562,6 +2692,31 @@ ssh_handler_request_identities (ctrl_t ctrl,
       log_assert (strlen (cf->item.hexgrip) == 40);
       hex2bin (cf->item.hexgrip, grip, sizeof (grip));
 
+      if (identity_cache.ngrips == maxgrips)
+        {
+          maxgrips += 16;
+          tmp = xtryrealloc (identity_cache.grips,
+                             maxgrips * sizeof *identity_cache.grips);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              goto out;
+            }
+          identity_cache.grips = tmp;
+          tmp = xtryrealloc (identity_cache.grip_stamps,
+                             maxgrips * sizeof *identity_cache.grip_stamps);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              goto out;
+            }
+          identity_cache.grip_stamps = tmp;
+        }
+      memcpy (identity_cache.grips[identity_cache.ngrips], grip, 20);
+      get_key_file_stamp (grip,
+                          identity_cache.grip_stamps + identity_cache.ngrips);
+      identity_cache.ngrips++;
+
       err = agent_public_key_from_file (ctrl, grip, &key_public);
       if (err)
         {
@@ -2571,16 +2726,258 @@ ssh_handler_request_identities (ctrl_t ctrl,
           continue;
         }
 
-      err = ssh_send_key_public (key_blobs, key_public, NULL);
+      err = ssh_send_key_public (blobs, key_public, NULL);
       if (err)
         goto out;
       gcry_sexp_release (key_public);
       key_public = NULL;
 
-      key_counter++;
+      count++;
     }
   err = 0;
 
+  if (es_fclose_snatch (blobs, &identity_cache.blobs,
+                        &identity_cache.blobslen))
+    {
+      blobs = NULL;
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+  blobs = NULL;
+  identity_cache.nkeys = count;
+
+  if (es_write (key_blobs, identity_cache.blobs, identity_cache.blobslen,
+                NULL))
+    {
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+  *r_count = count;
+
+  /* Keep the result unless a key file has been changed meanwhile.  */
+  if (generation == identity_cache.generation)
+    identity_cache.valid = 1;
+
+ out:
+  gcry_sexp_release (key_public);
+  es_fclose (blobs);
+  close_control_file (cf);
+  if (err)
+    release_identity_cache ();
+  return err;
+}
+
+
+static void
+release_card_cache (void)
+{
+  card_cache.valid = 0;
+  xfree (card_cache.grips);
+  card_cache.grips = NULL;
+  card_cache.ngrips = 0;
+  es_free (card_cache.blobs);
+  card_cache.blobs = NULL;
+  card_cache.blobslen = 0;
+  card_cache.nkeys = 0;
+}
+
+
+/* Return true if the cached card identities are still valid.  The
+   cache must be locked.  */
+static int
+card_cache_is_valid (void)
+{
+  unsigned int card_eventno, key_eventno;
+  unsigned int i;
+
+  if (!card_cache.valid)
+    return 0;
+
+  get_card_eventcounters (&card_eventno, &key_eventno);
+  if (card_eventno != card_cache.card_eventno
+      || key_eventno != card_cache.key_eventno)
+    return 0;
+
+  for (i=0; i < card_cache.ngrips; i++)
+    if (agent_key_available (card_cache.grips[i]))
+      return 0;
+
+  return 1;
+}
+
+
+/* Write the identities of the authentication keys on the available
+   cards to KEY_BLOBS and store their number at R_COUNT.  The result
+   is taken from the cache if no card event happened since it was
+   read.  Errors getting the keys from the cards are not returned.
+   The cache must be locked.  */
+static gpg_error_t
+send_card_identities (ctrl_t ctrl, estream_t key_blobs, u32 *r_count)
+{
+  gpg_error_t err;
+  char *serialno;
+  struct card_key_info_s *keyinfo_list = NULL;
+  struct card_key_info_s *keyinfo;
+  gcry_sexp_t key_public = NULL;
+  estream_t blobs = NULL;
+  unsigned int n;
+  u32 count = 0;
+
+  *r_count = 0;
+
+  if (card_cache_is_valid ())
+    {
+      if (es_write (key_blobs, card_cache.blobs, card_cache.blobslen, NULL))
+        return gpg_error_from_syserror ();
+      *r_count = card_cache.nkeys;
+      return 0;
+    }
+
+  release_card_cache ();
+
+  /* Scan device(s), and get list of KEYGRIP.  The event counters are
+     taken after the scdaemon has been started so that any card event
+     while we read the keys invalidates the result.  */
+  err = agent_card_serialno (ctrl, &serialno, NULL);
+  if (!err)
+    {
+      xfree (serialno);
+      get_card_eventcounters (&card_cache.card_eventno,
+                              &card_cache.key_eventno);
+      err = agent_card_keyinfo (ctrl, NULL, GCRY_PK_USAGE_AUTH,
+                                &keyinfo_list);
+    }
+  if (err)
+    {
+      if (opt.verbose)
+        log_info (_("error getting list of cards: %s\n"),
+                  gpg_strerror (err));
+      return 0;
+    }
+
+  blobs = es_fopenmem (0, "r+b");
+  if (!blobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+
+  for (n=0, keyinfo = keyinfo_list; keyinfo; keyinfo = keyinfo->next)
+    n++;
+  card_cache.grips = xtrycalloc (n? n : 1, sizeof *card_cache.grips);
+  if (!card_cache.grips)
+    {
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+
+  for (keyinfo = keyinfo_list; keyinfo; keyinfo = keyinfo->next)
+    {
+      char *cardsn;
+
+      if (card_key_available (ctrl, keyinfo, &key_public, &cardsn))
+        continue;
+
+      err = ssh_send_key_public (blobs, key_public, cardsn);
+      if (err && opt.verbose)
+        gcry_log_debugsxp ("pubkey", key_public);
+      gcry_sexp_release (key_public);
+      key_public = NULL;
+      xfree (cardsn);
+      if (err)
+        goto out;
+
+      hex2bin (keyinfo->keygrip, card_cache.grips[card_cache.ngrips], 20);
+      card_cache.ngrips++;
+      count++;
+    }
+
+  if (es_fclose_snatch (blobs, &card_cache.blobs, &card_cache.blobslen))
+    {
+      blobs = NULL;
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+  blobs = NULL;
+  card_cache.nkeys = count;
+
+  if (es_write (key_blobs, card_cache.blobs, card_cache.blobslen, NULL))
+    {
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+  *r_count = count;
+
+  /* Without a card the devices need to be scanned again the next
+     time; the scdaemon does not signal a new reader.  */
+  if (keyinfo_list)
+    card_cache.valid = 1;
+
+ out:
+  gcry_sexp_release (key_public);
+  es_fclose (blobs);
+  agent_card_free_keyinfo (keyinfo_list);
+  if (err)
+    release_card_cache ();
+  return err;
+}
+
+
+/* Handler for the "request_identities" command.  */
+static gpg_error_t
+ssh_handler_request_identities (ctrl_t ctrl,
+                                estream_t request, estream_t response)
+{
+  u32 key_counter;
+  estream_t key_blobs;
+  gpg_error_t err;
+  int ret;
+  gpg_error_t ret_err;
+  u32 count;
+
+  (void)request;
+
+  /* Prepare buffer stream.  */
+
+  key_counter = 0;
+
+  key_blobs = es_fopenmem (0, "r+b");
+  if (! key_blobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto out;
+    }
+
+  /* First check whether a key is currently available in the card
+     reader - this should be allowed even without being listed in
+     sshcontrol. */
+
+  if (!opt.disable_scdaemon)
+    {
+      err = npth_mutex_lock (&card_cache_lock);
+      if (err)
+        log_fatal ("failed to acquire ssh card cache lock: %s\n",
+                   strerror (err));
+      err = send_card_identities (ctrl, key_blobs, &count);
+      if (npth_mutex_unlock (&card_cache_lock))
+        log_fatal ("failed to release ssh card cache lock\n");
+      if (err)
+        goto out;
+      key_counter += count;
+    }
+
+  /* Then look at all the registered and non-disabled keys.  */
+  err = npth_mutex_lock (&identity_cache_lock);
+  if (err)
+    log_fatal ("failed to acquire ssh identity cache lock: %s\n",
+               strerror (err));
+  err = send_control_file_identities (ctrl, key_blobs, &count);
+  if (npth_mutex_unlock (&identity_cache_lock))
+    log_fatal ("failed to release ssh identity cache lock\n");
+  if (err)
+    goto out;
+  key_counter += count;
+
   ret = es_fseek (key_blobs, 0, SEEK_SET);
   if (ret)
     {
@@ -2591,8 +2988,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
  out:
   /* Send response.  */
 
-  gcry_sexp_release (key_public);
-
   if (!err)
     {
       ret_err = stream_write_byte (response, SSH_RESPONSE_IDENTITIES_ANSWER);
@@ -2609,7 +3004,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
     }
 
   es_fclose (key_blobs);
-  close_control_file (cf);
 
   return ret_err;
 }
@@ -41,6 +41,7 @@
 #include "../common/ssh-utils.h"
 #include "../common/asshelp.h"
 #include "../common/server-help.h"
+#include "../common/metrics.h"
 
 
 /* Maximum allowed size of the inquired ciphertext.  */
@@ -51,8 +52,18 @@
 #define MAXLEN_KEYDATA 8192
 /* Maximum length of a secret to store under one key.  */
 #define MAXLEN_PUT_SECRET 4096
+/* Maximum allowed size of the inquired digests for PKSIGN_BATCH.  */
+#define MAXLEN_DIGESTS (64*1024)
+/* Maximum allowed size of the inquired jobs for PKSIGN_MULTI.  */
+#define MAXLEN_SIGNJOBS (64*1024)
+/* Maximum allowed size of the inquired ciphertexts for PKDECRYPT_BATCH.  */
+#define MAXLEN_CIPHERTEXTS (64*MAXLEN_CIPHERTEXT)
 /* The size of the import/export KEK key (in bytes).  */
 #define KEYWRAP_KEYSIZE (128/8)
+/* Maximum number of keys deferred by IMPORT_KEY --defer.  */
+#define MAX_IMPORT_BATCH 64
+/* Maximum number of keygrips accepted by EXPORT_KEY --multi.  */
+#define MAX_EXPORT_BATCH 32
 
 /* A shortcut to call assuan_set_error using an gpg_err_code_t and a
    text string.  */
@@ -64,6 +75,22 @@
 #error MAX_DIGEST_LEN shorter than keygrip
 #endif
 
+/* The keys deferred by IMPORT_KEY --defer.  The keys still need to
+   be protected with their passphrases and written to disk; this is
+   done for all of them at once by flush_import_batch.  */
+struct import_batch_s
+{
+  unsigned int count;
+  unsigned char grips[MAX_IMPORT_BATCH][20];
+  int force[MAX_IMPORT_BATCH];
+  unsigned char *keys[MAX_IMPORT_BATCH];  /* Secure memory.  */
+  char *passphrases[MAX_IMPORT_BATCH];
+  unsigned char *results[MAX_IMPORT_BATCH];
+  size_t resultlens[MAX_IMPORT_BATCH];
+  gpg_error_t errs[MAX_IMPORT_BATCH];
+};
+
+
 /* Data used to associate an Assuan context with local server data.
    This is this modules local part of the server_control_s struct.  */
 struct server_local_s
@@ -104,6 +131,9 @@ struct server_local_s
   /* Malloced KEK for the export_key command.  */
   void *export_key;
 
+  /* Keys deferred by IMPORT_KEY --defer or NULL.  */
+  struct import_batch_s *import_batch;
+
   /* Client is aware of the error code GPG_ERR_FULLY_CANCELED.  */
   int allow_fully_canceled;
 
@@ -169,6 +199,8 @@ struct
 
 /*  Local prototypes.  */
 static int command_has_option (const char *cmd, const char *cmdopt);
+static gpg_error_t option_handler (assuan_context_t ctx,
+                                   const char *key, const char *value);
 
 
 
@@ -493,6 +525,18 @@ bump_card_eventcounter (void)
 }
 
 
+/* Store the counters of card events and of possible changes to card
+   keys at R_CARD and R_KEY_CHANGE.  Information about the keys on the
+   cards is stale if one of them changed.  This function is assured
+   not to do any context switches. */
+void
+get_card_eventcounters (unsigned int *r_card, unsigned int *r_key_change)
+{
+  *r_card = eventcounter.card;
+  *r_key_change = eventcounter.maybe_key_change;
+}
+
+
 
 
 static const char hlp_istrusted[] =
@@ -598,16 +642,134 @@ cmd_marktrusted (assuan_context_t ctx, char *line)
 
 
 
+/* Return the list of keys on the cards.  The list is cached in the
+ * local server object as long as no card events happened; NULL is
+ * returned if there are no card keys or on error.  */
+static struct card_key_info_s *
+get_card_keyinfo_list (ctrl_t ctrl)
+{
+  struct card_key_info_s *keyinfo_on_cards;
+
+  if (ctrl->server_local->last_card_keyinfo.ki
+      && ctrl->server_local->last_card_keyinfo.eventno == eventcounter.card
+      && (ctrl->server_local->last_card_keyinfo.maybe_key_change
+          == eventcounter.maybe_key_change))
+    {
+      keyinfo_on_cards = ctrl->server_local->last_card_keyinfo.ki;
+    }
+  else if (!agent_card_keyinfo (ctrl, NULL, 0, &keyinfo_on_cards))
+    {
+      agent_card_free_keyinfo (ctrl->server_local->last_card_keyinfo.ki);
+      ctrl->server_local->last_card_keyinfo.ki = keyinfo_on_cards;
+      ctrl->server_local->last_card_keyinfo.eventno = eventcounter.card;
+      ctrl->server_local->last_card_keyinfo.maybe_key_change
+        = eventcounter.maybe_key_change;
+    }
+  else
+    keyinfo_on_cards = NULL;
+
+  return keyinfo_on_cards;
+}
+
+
+/* Return a digit describing the secret key GRIP for HAVEKEY --info.
+ * *CARDS_FETCHED and *CARDS are used to ask the card daemon only
+ * once and only if needed.  */
+static char
+havekey_info (ctrl_t ctrl, const unsigned char *grip,
+              int *cards_fetched, struct card_key_info_s **cards)
+{
+  struct card_key_info_s *l;
+  char hexgrip[40+1];
+  int keytype;
+  char *pw;
+
+  if (agent_key_info_from_file (ctrl, grip, &keytype, NULL))
+    return '0';
+
+  bin2hex (grip, 20, hexgrip);
+  if (keytype == PRIVATE_KEY_SHADOWED)
+    {
+      if (!*cards_fetched)
+        {
+          *cards = get_card_keyinfo_list (ctrl);
+          *cards_fetched = 1;
+        }
+      for (l = *cards; l; l = l->next)
+        if (!memcmp (l->keygrip, hexgrip, 40))
+          return '4';
+    }
+
+  pw = agent_get_cache (ctrl, hexgrip, CACHE_MODE_NORMAL);
+  if (pw)
+    {
+      xfree (pw);
+      return '3';
+    }
+
+  return keytype == PRIVATE_KEY_SHADOWED? '2' : '1';
+}
+
+
 static const char hlp_havekey[] =
-  "HAVEKEY <hexstrings_with_keygrips>\n"
+  "HAVEKEY [--info] <hexstrings_with_keygrips>\n"
   "\n"
   "Return success if at least one of the secret keys with the given\n"
-  "keygrips is available.";
+  "keygrips is available.\n"
+  "\n"
+  "With --info the command returns a string with one digit for each\n"
+  "keygrip in the given order:\n"
+  "\n"
+  "  0 = no secret key\n"
+  "  1 = secret key available\n"
+  "  2 = secret key stored on a smartcard\n"
+  "  3 = passphrase of the secret key is cached\n"
+  "  4 = smartcard with the secret key is inserted";
 static gpg_error_t
 cmd_havekey (assuan_context_t ctx, char *line)
 {
+  ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err;
   unsigned char buf[20];
+  int opt_info;
+  membuf_t mb;
+  int cards_fetched = 0;
+  struct card_key_info_s *cards = NULL;
+  char c, *result;
+  size_t len;
+
+  opt_info = has_option (line, "--info");
+  line = skip_options (line);
+
+  if (opt_info)
+    {
+      init_membuf (&mb, 64);
+      do
+        {
+          err = parse_keygrip (ctx, line, buf);
+          if (err)
+            {
+              xfree (get_membuf (&mb, NULL));
+              return leave_cmd (ctx, err);
+            }
+
+          c = havekey_info (ctrl, buf, &cards_fetched, &cards);
+          put_membuf (&mb, &c, 1);
+
+          while (*line && *line != ' ' && *line != '\t')
+            line++;
+          while (*line == ' ' || *line == '\t')
+            line++;
+        }
+      while (*line);
+
+      result = get_membuf (&mb, &len);
+      if (!result)
+        return leave_cmd (ctx, gpg_error_from_syserror ());
+      err = assuan_send_data (ctx, result, len);
+      xfree (result);
+      return leave_cmd (ctx, err);
+    }
 
   do
     {
@@ -650,6 +812,27 @@ cmd_sigkey (assuan_context_t ctx, char *line)
 }
 
 
+/* Return a malloced key description from the escaped string DESC as
+ * received from the client.  DESC is modified.  Returns NULL on
+ * error.  */
+static char *
+make_keydesc (ctrl_t ctrl, char *desc)
+{
+  /* Note, that we only need to replace the + characters and should
+     leave the other escaping in place because the escaped string is
+     send verbatim to the pinentry which does the unescaping (but not
+     the + replacing) */
+  plus_to_blank (desc);
+
+  if (ctrl->restricted)
+    return strconcat ((ctrl->restricted == 2
+                       ? _("Note: Request from the web browser.")
+                       : _("Note: Request from a remote site.")  ),
+                      "%0A%0A", desc, NULL);
+  return xtrystrdup (desc);
+}
+
+
 static const char hlp_setkeydesc[] =
   "SETKEYDESC plus_percent_escaped_string\n"
   "\n"
@@ -680,29 +863,42 @@ cmd_setkeydesc (assuan_context_t ctx, char *line)
   if (!*desc)
     return set_error (GPG_ERR_ASS_PARAMETER, "no description given");
 
-  /* Note, that we only need to replace the + characters and should
-     leave the other escaping in place because the escaped string is
-     send verbatim to the pinentry which does the unescaping (but not
-     the + replacing) */
-  plus_to_blank (desc);
-
   xfree (ctrl->server_local->keydesc);
-
-  if (ctrl->restricted)
-    {
-      ctrl->server_local->keydesc = strconcat
-        ((ctrl->restricted == 2
-         ? _("Note: Request from the web browser.")
-         : _("Note: Request from a remote site.")  ), "%0A%0A", desc, NULL);
-    }
-  else
-    ctrl->server_local->keydesc = xtrystrdup (desc);
+  ctrl->server_local->keydesc = make_keydesc (ctrl, desc);
   if (!ctrl->server_local->keydesc)
     return out_of_core ();
   return 0;
 }
 
 
+/* Return the hash algorithm given by the --hash option in LINE, 0 if
+ * there is no such option or -1 for an unknown algorithm.  */
+static int
+parse_hash_option (const char *line)
+{
+  if (!has_option_name (line, "--hash"))
+    return 0;
+  if (has_option (line, "--hash=sha1"))
+    return GCRY_MD_SHA1;
+  else if (has_option (line, "--hash=sha224"))
+    return GCRY_MD_SHA224;
+  else if (has_option (line, "--hash=sha256"))
+    return GCRY_MD_SHA256;
+  else if (has_option (line, "--hash=sha384"))
+    return GCRY_MD_SHA384;
+  else if (has_option (line, "--hash=sha512"))
+    return GCRY_MD_SHA512;
+  else if (has_option (line, "--hash=rmd160"))
+    return GCRY_MD_RMD160;
+  else if (has_option (line, "--hash=md5"))
+    return GCRY_MD_MD5;
+  else if (has_option (line, "--hash=tls-md5sha1"))
+    return MD_USER_TLS_MD5SHA1;
+  else
+    return -1;
+}
+
+
 static const char hlp_sethash[] =
   "SETHASH (--hash=<name>)|(<algonumber>) <hexstring>\n"
   "\n"
@@ -721,29 +917,9 @@ cmd_sethash (assuan_context_t ctx, char *line)
 
   /* Parse the alternative hash options which may be used instead of
      the algo number.  */
-  if (has_option_name (line, "--hash"))
-    {
-      if (has_option (line, "--hash=sha1"))
-        algo = GCRY_MD_SHA1;
-      else if (has_option (line, "--hash=sha224"))
-        algo = GCRY_MD_SHA224;
-      else if (has_option (line, "--hash=sha256"))
-        algo = GCRY_MD_SHA256;
-      else if (has_option (line, "--hash=sha384"))
-        algo = GCRY_MD_SHA384;
-      else if (has_option (line, "--hash=sha512"))
-        algo = GCRY_MD_SHA512;
-      else if (has_option (line, "--hash=rmd160"))
-        algo = GCRY_MD_RMD160;
-      else if (has_option (line, "--hash=md5"))
-        algo = GCRY_MD_MD5;
-      else if (has_option (line, "--hash=tls-md5sha1"))
-        algo = MD_USER_TLS_MD5SHA1;
-      else
-        return set_error (GPG_ERR_ASS_PARAMETER, "invalid hash algorithm");
-    }
-  else
-    algo = 0;
+  algo = parse_hash_option (line);
+  if (algo == -1)
+    return set_error (GPG_ERR_ASS_PARAMETER, "invalid hash algorithm");
 
   line = skip_options (line);
 
@@ -828,6 +1004,240 @@ cmd_pksign (assuan_context_t ctx, char *line)
 }
 
 
+/* Send one signature of PKSIGN_BATCH to the client.  */
+static gpg_error_t
+pksign_batch_cb (void *opaque, const void *sig, size_t siglen)
+{
+  assuan_context_t ctx = opaque;
+  gpg_error_t err;
+
+  err = assuan_send_data (ctx, sig, siglen);
+  if (!err)
+    err = assuan_send_data (ctx, NULL, 0);  /* Flush.  */
+  return err;
+}
+
+
+static const char hlp_pksign_batch[] =
+  "PKSIGN_BATCH --hash=<name> [<cache_nonce>]\n"
+  "\n"
+  "Sign many digests with the key set by SIGKEY.  The digests are\n"
+  "requested with the inquiry DIGESTS as the concatenation of the\n"
+  "binary digests, each of the length of the hash algorithm <name>.\n"
+  "For each digest a signature is returned as canonical encoded\n"
+  "S-expression in the same order.  The key is read and unprotected\n"
+  "only once for the entire batch.";
+static gpg_error_t
+cmd_pksign_batch (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  cache_mode_t cache_mode = CACHE_MODE_NORMAL;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  unsigned char *digests = NULL;
+  size_t digestslen, digestlen;
+  char *cache_nonce = NULL;
+  char *p;
+  int algo;
+
+  algo = parse_hash_option (line);
+  if (!algo)
+    {
+      err = set_error (GPG_ERR_ASS_PARAMETER, "no hash algorithm given");
+      goto leave;
+    }
+  else if (algo == -1)
+    {
+      err = set_error (GPG_ERR_ASS_PARAMETER, "invalid hash algorithm");
+      goto leave;
+    }
+  if (algo == MD_USER_TLS_MD5SHA1)
+    digestlen = 36;
+  else
+    digestlen = gcry_md_get_algo_dlen (algo);
+
+  line = skip_options (line);
+
+  for (p=line; *p && *p != ' ' && *p != '\t'; p++)
+    ;
+  *p = '\0';
+  if (*line)
+    cache_nonce = xtrystrdup (line);
+
+  if (opt.ignore_cache_for_signing)
+    cache_mode = CACHE_MODE_IGNORE;
+  else if (!ctrl->server_local->use_cache_for_signing)
+    cache_mode = CACHE_MODE_IGNORE;
+
+  err = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", MAXLEN_DIGESTS);
+  if (!err)
+    err = assuan_inquire (ctx, "DIGESTS", &digests, &digestslen,
+                          MAXLEN_DIGESTS);
+  if (err)
+    goto leave;
+  if (!digestslen || (digestslen % digestlen))
+    {
+      err = set_error (GPG_ERR_ASS_PARAMETER, "invalid length of digests");
+      goto leave;
+    }
+
+  ctrl->digest.algo = algo;
+  ctrl->digest.raw_value = 0;
+  err = agent_pksign_batch (ctrl, cache_nonce, ctrl->server_local->keydesc,
+                            cache_mode, digests, digestlen,
+                            digestslen / digestlen, pksign_batch_cb, ctx);
+
+ leave:
+  xfree (digests);
+  xfree (cache_nonce);
+  xfree (ctrl->server_local->keydesc);
+  ctrl->server_local->keydesc = NULL;
+  return leave_cmd (ctx, err);
+}
+
+
+/* Send one signature of PKSIGN_MULTI to the client.  */
+static gpg_error_t
+pksign_multi_cb (void *opaque, unsigned int idx,
+                 const void *sig, size_t siglen)
+{
+  (void)idx;
+  return pksign_batch_cb (opaque, sig, siglen);
+}
+
+
+static const char hlp_pksign_multi[] =
+  "PKSIGN_MULTI [<cache_nonce>]\n"
+  "\n"
+  "Sign digests with several keys.  The jobs are requested with the\n"
+  "inquiry SIGNJOBS as lines of the form\n"
+  "\n"
+  "  <hexgrip> <hashalgo> <hexdigest> [<description>]\n"
+  "\n"
+  "where <hashalgo> is the numeric hash algorithm and <description>\n"
+  "is escaped as for SETKEYDESC.  For each job a signature is returned\n"
+  "as canonical encoded S-expression in the same order.  The keys are\n"
+  "unlocked one after the other but signatures with on-disk keys are\n"
+  "created concurrently.";
+static gpg_error_t
+cmd_pksign_multi (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  cache_mode_t cache_mode = CACHE_MODE_NORMAL;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  unsigned char *value = NULL;
+  size_t valuelen;
+  char *text = NULL;
+  char *cache_nonce = NULL;
+  struct pksign_multi_job_s *jobs = NULL;
+  unsigned int njobs, n;
+  char *fields[4];
+  char *p, *pend;
+  int nfields;
+
+  line = skip_options (line);
+
+  for (p=line; *p && *p != ' ' && *p != '\t'; p++)
+    ;
+  *p = '\0';
+  if (*line)
+    cache_nonce = xtrystrdup (line);
+
+  if (opt.ignore_cache_for_signing)
+    cache_mode = CACHE_MODE_IGNORE;
+  else if (!ctrl->server_local->use_cache_for_signing)
+    cache_mode = CACHE_MODE_IGNORE;
+
+  err = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", MAXLEN_SIGNJOBS);
+  if (!err)
+    err = assuan_inquire (ctx, "SIGNJOBS", &value, &valuelen,
+                          MAXLEN_SIGNJOBS);
+  if (err)
+    goto leave;
+
+  text = xtrymalloc (valuelen + 1);
+  if (!text)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  memcpy (text, value, valuelen);
+  text[valuelen] = 0;
+
+  for (njobs=0, p=text; *p; p++)
+    if (*p == '\n')
+      njobs++;
+  if (p > text && p[-1] != '\n')
+    njobs++;
+  if (!njobs)
+    {
+      err = set_error (GPG_ERR_ASS_PARAMETER, "no jobs given");
+      goto leave;
+    }
+  jobs = xtrycalloc (njobs, sizeof *jobs);
+  if (!jobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  for (n=0, p=text; n < njobs && *p; n++, p = pend)
+    {
+      pend = strchr (p, '\n');
+      if (pend)
+        *pend++ = 0;
+      else
+        pend = p + strlen (p);
+
+      nfields = split_fields (p, fields, DIM (fields));
+      if (nfields < 3)
+        {
+          err = set_error (GPG_ERR_ASS_PARAMETER, "invalid job line");
+          goto leave;
+        }
+      err = parse_keygrip (ctx, fields[0], jobs[n].grip);
+      if (err)
+        goto leave;
+      jobs[n].algo = atoi (fields[1]);
+      if (!jobs[n].algo || gcry_md_test_algo (jobs[n].algo))
+        {
+          err = set_error (GPG_ERR_UNSUPPORTED_ALGORITHM, NULL);
+          goto leave;
+        }
+      jobs[n].digestlen = gcry_md_get_algo_dlen (jobs[n].algo);
+      if (jobs[n].digestlen > MAX_DIGEST_LEN
+          || strlen (fields[2]) != 2 * jobs[n].digestlen
+          || hex2bin (fields[2], jobs[n].digest, jobs[n].digestlen) < 0)
+        {
+          err = set_error (GPG_ERR_ASS_PARAMETER, "invalid digest");
+          goto leave;
+        }
+      if (nfields > 3)
+        {
+          jobs[n].desc = make_keydesc (ctrl, fields[3]);
+          if (!jobs[n].desc)
+            {
+              err = out_of_core ();
+              goto leave;
+            }
+        }
+    }
+  njobs = n;
+
+  err = agent_pksign_multi (ctrl, cache_nonce, cache_mode, jobs, njobs,
+                            pksign_multi_cb, ctx);
+
+ leave:
+  if (jobs)
+    for (n=0; n < njobs; n++)
+      xfree (jobs[n].desc);
+  xfree (jobs);
+  xfree (text);
+  xfree (value);
+  xfree (cache_nonce);
+  return leave_cmd (ctx, err);
+}
+
+
 static const char hlp_pkdecrypt[] =
   "PKDECRYPT [<options>]\n"
   "\n"
@@ -869,9 +1279,153 @@ cmd_pkdecrypt (assuan_context_t ctx, char *line)
       if (!rc)
         rc = write_and_clear_outbuf (ctx, &outbuf);
     }
-  xfree (ctrl->server_local->keydesc);
-  ctrl->server_local->keydesc = NULL;
-  return leave_cmd (ctx, rc);
+  xfree (ctrl->server_local->keydesc);
+  ctrl->server_local->keydesc = NULL;
+  return leave_cmd (ctx, rc);
+}
+
+
+/* Send one result of PKDECRYPT_BATCH to the client.  */
+static gpg_error_t
+pkdecrypt_batch_cb (void *opaque, unsigned int idx,
+                    const void *plain, size_t plainlen, int padding)
+{
+  assuan_context_t ctx = opaque;
+  gpg_error_t err = 0;
+
+  if (padding != -1)
+    err = print_assuan_status (ctx, "PADDING", "%u %d", idx, padding);
+  if (!err)
+    err = assuan_send_data (ctx, plain, plainlen);
+  if (!err)
+    err = assuan_send_data (ctx, NULL, 0);  /* Flush.  */
+  return err;
+}
+
+
+static const char hlp_pkdecrypt_batch[] =
+  "PKDECRYPT_BATCH\n"
+  "\n"
+  "Decrypt many ciphertexts with the key set by SETKEY.  The\n"
+  "ciphertexts are requested with the inquiry CIPHERTEXTS as\n"
+  "concatenated canonical encoded S-expressions.  The results are\n"
+  "returned in the same order as canonical encoded S-expressions.  If\n"
+  "the padding of a result is known the status line\n"
+  "\n"
+  "  PADDING <index> <padding>\n"
+  "\n"
+  "is emitted before that result; <index> counts from 0.  The key is\n"
+  "read and unprotected only once for the entire batch.";
+static gpg_error_t
+cmd_pkdecrypt_batch (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  unsigned char *value;
+  size_t valuelen;
+
+  (void)line;
+
+  err = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", MAXLEN_CIPHERTEXTS);
+  if (!err)
+    err = assuan_inquire (ctx, "CIPHERTEXTS",
+                          &value, &valuelen, MAXLEN_CIPHERTEXTS);
+  if (err)
+    return err;
+
+  err = agent_pkdecrypt_batch (ctrl, ctrl->server_local->keydesc,
+                               value, valuelen, pkdecrypt_batch_cb, ctx);
+  xfree (value);
+  xfree (ctrl->server_local->keydesc);
+  ctrl->server_local->keydesc = NULL;
+  return leave_cmd (ctx, err);
+}
+
+
+/* Send one result of PKDECRYPT_TRIAL to the client.  */
+static gpg_error_t
+pkdecrypt_trial_cb (void *opaque, unsigned int idx, gpg_error_t keyerr,
+                    const void *plain, size_t plainlen)
+{
+  assuan_context_t ctx = opaque;
+  gpg_error_t err;
+
+  if (keyerr)
+    return print_assuan_status (ctx, "TRIAL_ERROR", "%u %u", idx, keyerr);
+
+  err = assuan_send_data (ctx, plain, plainlen);
+  if (!err)
+    err = assuan_send_data (ctx, NULL, 0);  /* Flush.  */
+  return err;
+}
+
+
+static const char hlp_pkdecrypt_trial[] =
+  "PKDECRYPT_TRIAL <hexgrip> [<hexgrip>...]\n"
+  "\n"
+  "Trial decrypt one ciphertext with each of the given keys.  This is\n"
+  "used for messages with hidden recipients.  The ciphertext is\n"
+  "requested with the inquiry CIPHERTEXT.  All keys which can be used\n"
+  "without user interaction are tried concurrently.  For each key in\n"
+  "the given order either the decrypted value is returned as canonical\n"
+  "encoded S-expression or the status line\n"
+  "\n"
+  "  TRIAL_ERROR <index> <errorcode>\n"
+  "\n"
+  "is emitted; <index> counts from 0.  Keys stored on a smartcard and\n"
+  "protected keys without a cached passphrase are not tried.";
+static gpg_error_t
+cmd_pkdecrypt_trial (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  unsigned char (*grips)[20] = NULL;
+  unsigned int ngrips, n;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  char *p;
+
+  /* Count the keygrips.  */
+  for (ngrips=0, p=line; *p; ngrips++)
+    {
+      while (*p && *p != ' ' && *p != '\t')
+        p++;
+      while (*p == ' ' || *p == '\t')
+        p++;
+    }
+  if (!ngrips)
+    return leave_cmd (ctx, set_error (GPG_ERR_ASS_PARAMETER,
+                                      "no keygrip given"));
+
+  grips = xtrycalloc (ngrips, sizeof *grips);
+  if (!grips)
+    return leave_cmd (ctx, gpg_error_from_syserror ());
+  for (n=0; n < ngrips; n++)
+    {
+      err = parse_keygrip (ctx, line, grips[n]);
+      if (err)
+        goto leave;
+      while (*line && *line != ' ' && *line != '\t')
+        line++;
+      while (*line == ' ' || *line == '\t')
+        line++;
+    }
+
+  err = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", MAXLEN_CIPHERTEXT);
+  if (!err)
+    err = assuan_inquire (ctx, "CIPHERTEXT",
+                          &value, &valuelen, MAXLEN_CIPHERTEXT);
+  if (err)
+    goto leave;
+
+  err = agent_pkdecrypt_trial (ctrl,
+                               (const unsigned char (*)[20])grips, ngrips,
+                               value, valuelen, pkdecrypt_trial_cb, ctx);
+
+ leave:
+  xfree (value);
+  xfree (grips);
+  return leave_cmd (ctx, err);
 }
 
 
@@ -1285,7 +1839,6 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
   ctrl_t ctrl = assuan_get_pointer (ctx);
   int err;
   unsigned char grip[20];
-  DIR *dir = NULL;
   int list_mode;
   int opt_data, opt_ssh_fpr, opt_with_ssh;
   ssh_control_file_t cf = NULL;
@@ -1327,21 +1880,7 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
   /* Take the keyinfo for cards from our local cache.  Actually this
    * cache could be a global one but then we would need to employ
    * reference counting. */
-  if (ctrl->server_local->last_card_keyinfo.ki
-      && ctrl->server_local->last_card_keyinfo.eventno == eventcounter.card
-      && (ctrl->server_local->last_card_keyinfo.maybe_key_change
-          == eventcounter.maybe_key_change))
-    {
-      keyinfo_on_cards = ctrl->server_local->last_card_keyinfo.ki;
-    }
-  else if (!agent_card_keyinfo (ctrl, NULL, 0, &keyinfo_on_cards))
-    {
-      agent_card_free_keyinfo (ctrl->server_local->last_card_keyinfo.ki);
-      ctrl->server_local->last_card_keyinfo.ki = keyinfo_on_cards;
-      ctrl->server_local->last_card_keyinfo.eventno = eventcounter.card;
-      ctrl->server_local->last_card_keyinfo.maybe_key_change
-        = eventcounter.maybe_key_change;
-    }
+  keyinfo_on_cards = get_card_keyinfo_list (ctrl);
 
   if (list_mode == 2)
     {
@@ -1368,35 +1907,17 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
     }
   else if (list_mode)
     {
-      char *dirname;
-      struct dirent *dir_entry;
+      unsigned char (*grips)[20];
+      size_t ngrips, idx;
 
-      dirname = make_filename_try (gnupg_homedir (),
-                                   GNUPG_PRIVATE_KEYS_DIR, NULL);
-      if (!dirname)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-      dir = opendir (dirname);
-      if (!dir)
-        {
-          err = gpg_error_from_syserror ();
-          xfree (dirname);
-          goto leave;
-        }
-      xfree (dirname);
+      err = agent_list_keygrips (&grips, &ngrips);
+      if (err)
+        goto leave;
 
-      while ( (dir_entry = readdir (dir)) )
+      for (idx=0; idx < ngrips; idx++)
         {
-          if (strlen (dir_entry->d_name) != 44
-              || strcmp (dir_entry->d_name + 40, ".key"))
-            continue;
-          strncpy (hexgrip, dir_entry->d_name, 40);
-          hexgrip[40] = 0;
-
-          if ( hex2bin (hexgrip, grip, 20) < 0 )
-            continue; /* Bad hex string.  */
+          memcpy (grip, grips[idx], 20);
+          bin2hex (grip, 20, hexgrip);
 
           disabled = ttl = confirm = is_ssh = 0;
           if (opt_with_ssh)
@@ -1406,7 +1927,7 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
               if (!err)
                 is_ssh = 1;
               else if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
-                goto leave;
+                break;
             }
 
           on_card = 0;
@@ -1417,9 +1938,11 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
           err = do_one_keyinfo (ctrl, grip, ctx, opt_data, opt_ssh_fpr, is_ssh,
                                 ttl, disabled, confirm, on_card);
           if (err)
-            goto leave;
+            break;
         }
-      err = 0;
+      xfree (grips);
+      if (err)
+        goto leave;
     }
   else
     {
@@ -1448,8 +1971,6 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
 
  leave:
   ssh_close_control_file (cf);
-  if (dir)
-    closedir (dir);
   if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
     leave_cmd (ctx, err);
   return err;
@@ -2139,8 +2660,89 @@ cmd_keywrap_key (assuan_context_t ctx, char *line)
 
 
 
+/* Protect the keys deferred by IMPORT_KEY --defer using the worker
+   threads and write them to disk.  Returns the first error.  */
+static gpg_error_t
+flush_import_batch (ctrl_t ctrl)
+{
+  struct import_batch_s *batch = ctrl->server_local->import_batch;
+  gpg_error_t err, firsterr = 0;
+  unsigned long s2k_count;
+  unsigned int i;
+  char hexgrip[41];
+
+  if (!batch || !batch->count)
+    return 0;
+
+  /* Calibrate here if needed; this may not run in a worker.  */
+  s2k_count = ctrl->s2k_count? ctrl->s2k_count : get_standard_s2k_count ();
+  workpool_protect_many (batch->keys, batch->passphrases, batch->count,
+                         s2k_count, batch->results, batch->resultlens,
+                         batch->errs);
+
+  for (i=0; i < batch->count; i++)
+    {
+      err = batch->errs[i];
+      if (!err)
+        err = agent_write_private_key (batch->grips[i],
+                                       batch->results[i],
+                                       batch->resultlens[i],
+                                       batch->force[i], NULL, NULL);
+      if (err)
+        {
+          bin2hex (batch->grips[i], 20, hexgrip);
+          log_error ("error importing key %s: %s\n",
+                     hexgrip, gpg_strerror (err));
+          if (!firsterr)
+            firsterr = err;
+        }
+      xfree (batch->results[i]);
+      xfree (batch->passphrases[i]);
+      xfree (batch->keys[i]);
+    }
+  batch->count = 0;
+
+  return firsterr;
+}
+
+
+/* Add the unprotected KEY with GRIP to the import batch of CTRL.  The
+   key shall be protected with PASSPHRASE.  On success the function
+   takes ownership of KEY and PASSPHRASE.  If the batch is full it is
+   flushed first and its error is returned; KEY is then not added.  */
+static gpg_error_t
+defer_import_key (ctrl_t ctrl, const unsigned char *grip,
+                  unsigned char *key, char *passphrase, int force)
+{
+  struct import_batch_s *batch = ctrl->server_local->import_batch;
+  gpg_error_t err;
+
+  if (!batch)
+    {
+      batch = xtrycalloc (1, sizeof *batch);
+      if (!batch)
+        return gpg_error_from_syserror ();
+      ctrl->server_local->import_batch = batch;
+    }
+  if (batch->count == MAX_IMPORT_BATCH)
+    {
+      err = flush_import_batch (ctrl);
+      if (err)
+        return err;
+    }
+
+  memcpy (batch->grips[batch->count], grip, 20);
+  batch->force[batch->count] = force;
+  batch->keys[batch->count] = key;
+  batch->passphrases[batch->count] = passphrase;
+  batch->count++;
+  return 0;
+}
+
+
 static const char hlp_import_key[] =
-  "IMPORT_KEY [--unattended] [--force] [<cache_nonce>]\n"
+  "IMPORT_KEY [--unattended] [--force] [--defer] [<cache_nonce>]\n"
+  "IMPORT_KEY --flush\n"
   "\n"
   "Import a secret key into the key store.  The key is expected to be\n"
   "encrypted using the current session's key wrapping key (cf. command\n"
@@ -2148,7 +2750,13 @@ static const char hlp_import_key[] =
   "no arguments but uses the inquiry \"KEYDATA\" to ask for the actual\n"
   "key data.  The unwrapped key must be a canonical S-expression.  The\n"
   "option --unattended tries to import the key as-is without any\n"
-  "re-encryption.  Existing key can be overwritten with --force.";
+  "re-encryption.  Existing key can be overwritten with --force.\n"
+  "\n"
+  "With --defer a key which needs to be protected with a passphrase is\n"
+  "only queued.  The queued keys are protected in parallel and stored\n"
+  "by \"IMPORT_KEY --flush\", when the queue is full, or at the end of\n"
+  "the connection.  An error storing a queued key is thus returned by\n"
+  "the command which triggered the storing.";
 static gpg_error_t
 cmd_import_key (assuan_context_t ctx, char *line)
 {
@@ -2156,6 +2764,7 @@ cmd_import_key (assuan_context_t ctx, char *line)
   gpg_error_t err;
   int opt_unattended;
   int force;
+  int opt_defer = 0;
   unsigned char *wrappedkey = NULL;
   size_t wrappedkeylen;
   gcry_cipher_hd_t cipherhd = NULL;
@@ -2172,6 +2781,12 @@ cmd_import_key (assuan_context_t ctx, char *line)
   if (ctrl->restricted)
     return leave_cmd (ctx, gpg_error (GPG_ERR_FORBIDDEN));
 
+  if (has_option (line, "--flush"))
+    {
+      err = flush_import_batch (ctrl);
+      goto leave;
+    }
+
   if (!ctrl->server_local->import_key)
     {
       err = gpg_error (GPG_ERR_MISSING_KEY);
@@ -2180,6 +2795,7 @@ cmd_import_key (assuan_context_t ctx, char *line)
 
   opt_unattended = has_option (line, "--unattended");
   force = has_option (line, "--force");
+  opt_defer = has_option (line, "--defer");
   line = skip_options (line);
 
   for (p=line; *p && *p != ' ' && *p != '\t'; p++)
@@ -2312,7 +2928,16 @@ cmd_import_key (assuan_context_t ctx, char *line)
         goto leave;
     }
 
-  if (passphrase)
+  if (passphrase && opt_defer)
+    {
+      err = defer_import_key (ctrl, grip, key, passphrase, force);
+      if (!err)
+        {
+          key = NULL;
+          passphrase = NULL;
+        }
+    }
+  else if (passphrase)
     {
       err = agent_protect (key, passphrase, &finalkey, &finalkeylen,
                            ctrl->s2k_count, -1);
@@ -2338,8 +2963,220 @@ cmd_import_key (assuan_context_t ctx, char *line)
 
 
 
+/* Wrap KEY of length KEYLEN with the export key of this session.  On
+   success the wrapped key is stored at R_WRAPPEDKEY and its length at
+   R_WRAPPEDKEYLEN.  */
+static gpg_error_t
+wrap_export_key (ctrl_t ctrl, const unsigned char *key, size_t keylen,
+                 unsigned char **r_wrappedkey, size_t *r_wrappedkeylen)
+{
+  gpg_error_t err;
+  gcry_cipher_hd_t cipherhd;
+  unsigned char *wrappedkey;
+  size_t wrappedkeylen;
+
+  *r_wrappedkey = NULL;
+
+  err = gcry_cipher_open (&cipherhd, GCRY_CIPHER_AES128,
+                          GCRY_CIPHER_MODE_AESWRAP, 0);
+  if (err)
+    return err;
+  err = gcry_cipher_setkey (cipherhd,
+                            ctrl->server_local->export_key, KEYWRAP_KEYSIZE);
+  if (err)
+    goto leave;
+
+  wrappedkeylen = keylen + 8;
+  wrappedkey = xtrymalloc (wrappedkeylen);
+  if (!wrappedkey)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  err = gcry_cipher_encrypt (cipherhd, wrappedkey, wrappedkeylen, key, keylen);
+  if (err)
+    {
+      xfree (wrappedkey);
+      goto leave;
+    }
+  *r_wrappedkey = wrappedkey;
+  *r_wrappedkeylen = wrappedkeylen;
+
+ leave:
+  gcry_cipher_close (cipherhd);
+  return err;
+}
+
+
+/* The core of EXPORT_KEY --multi.  LINE has the keygrips.  The keys
+   are unprotected one after the other; the passphrase of the first
+   one is cached under a fresh nonce so that further keys with the
+   same passphrase do not require another prompt.  The S2K of the
+   re-protection is then done concurrently.  *CACHE_NONCE_ADDR is the
+   nonce given by the caller or NULL and may be replaced.  */
+static gpg_error_t
+export_key_multi (assuan_context_t ctx, int openpgp,
+                  char **cache_nonce_addr, char *line)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err = 0;
+  unsigned char grips[MAX_EXPORT_BATCH][20];
+  gcry_sexp_t s_skeys[MAX_EXPORT_BATCH];
+  char *passphrases[MAX_EXPORT_BATCH];
+  gpg_error_t errs[MAX_EXPORT_BATCH];
+  unsigned char *keys[MAX_EXPORT_BATCH];
+  size_t keylens[MAX_EXPORT_BATCH];
+  gcry_sexp_t convkeys[MAX_EXPORT_BATCH];
+  char *convpassphrases[MAX_EXPORT_BATCH];
+  unsigned char *convresults[MAX_EXPORT_BATCH];
+  size_t convresultlens[MAX_EXPORT_BATCH];
+  gpg_error_t converrs[MAX_EXPORT_BATCH];
+  unsigned int convidx[MAX_EXPORT_BATCH];
+  unsigned int ngrips, nconv, n;
+  unsigned char *shadow_info;
+  unsigned char *wrappedkey = NULL;
+  size_t wrappedkeylen;
+  int new_nonce = 0;
+  char *p;
+
+  memset (s_skeys, 0, sizeof s_skeys);
+  memset (passphrases, 0, sizeof passphrases);
+  memset (keys, 0, sizeof keys);
+
+  for (ngrips=0, p=line; *p; )
+    {
+      if (ngrips == MAX_EXPORT_BATCH)
+        return set_error (GPG_ERR_TOO_MANY, "too many keygrips");
+      err = parse_keygrip (ctx, p, grips[ngrips]);
+      if (err)
+        return err;
+      ngrips++;
+      while (*p && !spacep (p))
+        p++;
+      while (spacep (p))
+        p++;
+    }
+  if (!ngrips)
+    return set_error (GPG_ERR_ASS_PARAMETER, "no keygrip given");
+
+  /* Get the keys from the files.  This may ask for passphrases and
+     is thus done in order.  */
+  for (n=0; n < ngrips; n++)
+    {
+      shadow_info = NULL;
+      if (agent_key_available (grips[n]))
+        errs[n] = gpg_error (GPG_ERR_NO_SECKEY);
+      else
+        errs[n] = agent_key_from_file (ctrl, *cache_nonce_addr,
+                                       ctrl->server_local->keydesc, grips[n],
+                                       &shadow_info, CACHE_MODE_IGNORE, NULL,
+                                       &s_skeys[n],
+                                       openpgp ? &passphrases[n] : NULL);
+      if (!errs[n] && shadow_info)
+        errs[n] = gpg_error (GPG_ERR_UNUSABLE_SECKEY);
+      xfree (shadow_info);
+      if (!errs[n] && openpgp && !passphrases[n])
+        errs[n] = agent_ask_new_passphrase
+          (ctrl, _("This key (or subkey) is not protected with a passphrase."
+                   "  Please enter a new passphrase to export it."),
+           &passphrases[n]);
+      if (gpg_err_code (errs[n]) == GPG_ERR_FULLY_CANCELED)
+        {
+          err = errs[n];
+          goto leave;
+        }
+      if (!errs[n] && openpgp && !*cache_nonce_addr)
+        {
+          char buf[12];
+
+          gcry_create_nonce (buf, 12);
+          *cache_nonce_addr = bin2hex (buf, 12, NULL);
+          if (*cache_nonce_addr
+              && agent_put_cache (ctrl, *cache_nonce_addr, CACHE_MODE_NONCE,
+                                  passphrases[n], CACHE_TTL_NONCE))
+            {
+              xfree (*cache_nonce_addr);
+              *cache_nonce_addr = NULL;
+            }
+          else if (*cache_nonce_addr)
+            new_nonce = 1;
+        }
+    }
+
+  /* Convert the keys into the transfer format.  */
+  if (openpgp)
+    {
+      for (n=nconv=0; n < ngrips; n++)
+        if (!errs[n])
+          {
+            convidx[nconv] = n;
+            convkeys[nconv] = s_skeys[n];
+            convpassphrases[nconv] = passphrases[n];
+            nconv++;
+          }
+      convert_to_openpgp_many (ctrl, convkeys, convpassphrases, nconv,
+                               convresults, convresultlens, converrs);
+      for (n=0; n < nconv; n++)
+        {
+          keys[convidx[n]] = convresults[n];
+          keylens[convidx[n]] = convresultlens[n];
+          errs[convidx[n]] = converrs[n];
+        }
+    }
+  else
+    {
+      for (n=0; n < ngrips; n++)
+        if (!errs[n])
+          errs[n] = make_canon_sexp_pad (s_skeys[n], 1,
+                                         &keys[n], &keylens[n]);
+    }
+
+  if (new_nonce)
+    {
+      assuan_write_status (ctx, "CACHE_NONCE", *cache_nonce_addr);
+      xfree (ctrl->server_local->last_cache_nonce);
+      ctrl->server_local->last_cache_nonce = *cache_nonce_addr;
+      *cache_nonce_addr = NULL;
+    }
+
+  /* Send the wrapped keys.  */
+  for (n=0; n < ngrips; n++)
+    {
+      wrappedkeylen = 0;
+      if (!errs[n])
+        errs[n] = wrap_export_key (ctrl, keys[n], keylens[n],
+                                   &wrappedkey, &wrappedkeylen);
+      err = print_assuan_status (ctx, "EXPORT_KEY_RESULT", "%u %u %zu",
+                                 n, errs[n], errs[n]? 0 : wrappedkeylen);
+      if (!err && !errs[n])
+        {
+          assuan_begin_confidential (ctx);
+          err = assuan_send_data (ctx, wrappedkey, wrappedkeylen);
+          if (!err)
+            err = assuan_send_data (ctx, NULL, 0);  /* Flush.  */
+          assuan_end_confidential (ctx);
+        }
+      xfree (wrappedkey);
+      wrappedkey = NULL;
+      if (err)
+        goto leave;
+    }
+
+ leave:
+  for (n=0; n < ngrips; n++)
+    {
+      gcry_sexp_release (s_skeys[n]);
+      xfree (passphrases[n]);
+      xfree (keys[n]);
+    }
+  return err;
+}
+
+
 static const char hlp_export_key[] =
   "EXPORT_KEY [--cache-nonce=<nonce>] [--openpgp] <hexstring_with_keygrip>\n"
+  "EXPORT_KEY [--cache-nonce=<nonce>] [--openpgp] --multi <keygrips>\n"
   "\n"
   "Export a secret key from the key store.  The key will be encrypted\n"
   "using the current session's key wrapping key (cf. command KEYWRAP_KEY)\n"
@@ -2349,7 +3186,18 @@ static const char hlp_export_key[] =
   "If --openpgp is used, the secret key material will be exported in RFC 4880\n"
   "compatible passphrase-protected form.  Without --openpgp, the secret key\n"
   "material will be exported in the clear (after prompting the user to unlock\n"
-  "it, if needed).\n";
+  "it, if needed).\n"
+  "\n"
+  "With --multi up to 32 space separated keygrips are accepted.  For each\n"
+  "of them, in order, the status line\n"
+  "\n"
+  "  EXPORT_KEY_RESULT <index> <errcode> <length>\n"
+  "\n"
+  "is emitted followed by <length> bytes of data with the wrapped key.\n"
+  "<index> counts from 0; if <errcode> is not 0 the key could not be\n"
+  "exported and no data is sent for it.  Keys with the same passphrase\n"
+  "share the salt of the re-protection so that the S2K is computed only\n"
+  "once for them.\n";
 static gpg_error_t
 cmd_export_key (assuan_context_t ctx, char *line)
 {
@@ -2359,10 +3207,9 @@ cmd_export_key (assuan_context_t ctx, char *line)
   gcry_sexp_t s_skey = NULL;
   unsigned char *key = NULL;
   size_t keylen;
-  gcry_cipher_hd_t cipherhd = NULL;
   unsigned char *wrappedkey = NULL;
   size_t wrappedkeylen;
-  int openpgp;
+  int openpgp, multi;
   char *cache_nonce;
   char *passphrase = NULL;
   unsigned char *shadow_info = NULL;
@@ -2373,6 +3220,7 @@ cmd_export_key (assuan_context_t ctx, char *line)
     return leave_cmd (ctx, gpg_error (GPG_ERR_FORBIDDEN));
 
   openpgp = has_option (line, "--openpgp");
+  multi = has_option (line, "--multi");
   cache_nonce = option_value (line, "--cache-nonce");
   if (cache_nonce)
     {
@@ -2396,6 +3244,12 @@ cmd_export_key (assuan_context_t ctx, char *line)
       goto leave;
     }
 
+  if (multi)
+    {
+      err = export_key_multi (ctx, openpgp, &cache_nonce, line);
+      goto leave;
+    }
+
   err = parse_keygrip (ctx, line, grip);
   if (err)
     goto leave;
@@ -2465,30 +3319,11 @@ cmd_export_key (assuan_context_t ctx, char *line)
   gcry_sexp_release (s_skey);
   s_skey = NULL;
 
-  err = gcry_cipher_open (&cipherhd, GCRY_CIPHER_AES128,
-                          GCRY_CIPHER_MODE_AESWRAP, 0);
-  if (err)
-    goto leave;
-  err = gcry_cipher_setkey (cipherhd,
-                            ctrl->server_local->export_key, KEYWRAP_KEYSIZE);
-  if (err)
-    goto leave;
-
-  wrappedkeylen = keylen + 8;
-  wrappedkey = xtrymalloc (wrappedkeylen);
-  if (!wrappedkey)
-    {
-      err = gpg_error_from_syserror ();
-      goto leave;
-    }
-
-  err = gcry_cipher_encrypt (cipherhd, wrappedkey, wrappedkeylen, key, keylen);
+  err = wrap_export_key (ctrl, key, keylen, &wrappedkey, &wrappedkeylen);
   if (err)
     goto leave;
   xfree (key);
   key = NULL;
-  gcry_cipher_close (cipherhd);
-  cipherhd = NULL;
 
   assuan_begin_confidential (ctx);
   err = assuan_send_data (ctx, wrappedkey, wrappedkeylen);
@@ -2499,7 +3334,6 @@ cmd_export_key (assuan_context_t ctx, char *line)
   xfree (cache_nonce);
   xfree (passphrase);
   xfree (wrappedkey);
-  gcry_cipher_close (cipherhd);
   xfree (key);
   gcry_sexp_release (s_skey);
   xfree (ctrl->server_local->keydesc);
@@ -3088,6 +3922,47 @@ cmd_reloadagent (assuan_context_t ctx, char *line)
 }
 
 
+static const char hlp_options[] =
+  "OPTIONS [--reset] {<name>=<value>}\n"
+  "\n"
+  "Set several options with one command.  Each argument is processed\n"
+  "the same way as by the OPTION command; the values must be\n"
+  "percent-plus escaped.  With --reset a RESET is done first.  This\n"
+  "allows a client to set up a new connection in one round trip.";
+static gpg_error_t
+cmd_options (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err = 0;
+  char *p, *value;
+
+  if (has_option (line, "--reset"))
+    reset_notify (ctx, NULL);
+  line = skip_options (line);
+
+  while (!err && *line)
+    {
+      for (p = line; *p && !spacep (p); p++)
+        ;
+      if (*p)
+        *p++ = 0;
+      value = strchr (line, '=');
+      if (!value)
+        err = set_error (GPG_ERR_ASS_SYNTAX, "name=value expected");
+      else
+        {
+          *value++ = 0;
+          percent_plus_unescape_inplace (value, 0);
+          err = option_handler (ctx, line, value);
+        }
+      while (spacep (p))
+        p++;
+      line = p;
+    }
+
+  return leave_cmd (ctx, err);
+}
+
+
 
 static const char hlp_getinfo[] =
   "GETINFO <what>\n"
@@ -3108,6 +3983,7 @@ static const char hlp_getinfo[] =
   "  std_startup_env - List the standard startup environment.\n"
   "  getenv NAME     - Return value of envvar NAME.\n"
   "  connections     - Return number of active connections.\n"
+  "  metrics         - Return the performance counters.\n"
   "  jent_active     - Returns OK if Libgcrypt's JENT is active.\n"
   "  restricted      - Returns OK if the connection is in restricted mode.\n"
   "  cmd_has_option CMD OPT\n"
@@ -3268,6 +4144,16 @@ cmd_getinfo (assuan_context_t ctx, char *line)
                 get_agent_active_connection_count ());
       rc = assuan_send_data (ctx, numbuf, strlen (numbuf));
     }
+  else if (!strcmp (line, "metrics"))
+    {
+      char *s = metrics_format ();
+
+      if (!s)
+        rc = gpg_error_from_syserror ();
+      else
+        rc = assuan_send_data (ctx, s, strlen (s));
+      xfree (s);
+    }
   else if (!strcmp (line, "jent_active"))
     {
 #if GCRYPT_VERSION_NUMBER >= 0x010800
@@ -3416,6 +4302,10 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
           break;
         }
     }
+  else if (!strcmp (key, "trace-id"))
+    {
+      err = metric_request_set_trace_id (&ctrl->request, value);
+    }
   else
     err = gpg_error (GPG_ERR_UNKNOWN_OPTION);
 
@@ -3425,6 +4315,17 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
 
 
 
+/* Called by libassuan before all commands.  */
+static gpg_error_t
+pre_cmd_notify (assuan_context_t ctx, const char *cmd)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  metric_request_begin (&ctrl->request, cmd);
+  return 0;
+}
+
+
 /* Called by libassuan after all commands. ERR is the error from the
    last assuan operation and not the one returned from the command. */
 static void
@@ -3432,13 +4333,21 @@ post_cmd_notify (assuan_context_t ctx, gpg_error_t err)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
 
-  (void)err;
+  metric_request_end (&ctrl->request, err);
 
   /* Switch off any I/O monitor controlled logging pausing. */
   ctrl->server_local->pause_io_logging = 0;
 }
 
 
+static uint64_t
+connection_count (void)
+{
+  return get_agent_active_connection_count ();
+}
+METRIC_DEFINE_FUNC (m_connections, "connections", connection_count);
+
+
 /* This function is called by libassuan for all I/O.  We use it here
    to disable logging for the GETEVENTCOUNTER commands.  This is so
    that the debug output won't get cluttered by this primitive
@@ -3498,6 +4407,16 @@ command_has_option (const char *cmd, const char *cmdopt)
       if (!strcmp (cmdopt, "repeat"))
           return 1;
     }
+  else if (!strcmp (cmd, "IMPORT_KEY"))
+    {
+      if (!strcmp (cmdopt, "defer"))
+          return 1;
+    }
+  else if (!strcmp (cmd, "EXPORT_KEY"))
+    {
+      if (!strcmp (cmdopt, "multi"))
+          return 1;
+    }
 
   return 0;
 }
@@ -3522,7 +4441,11 @@ register_commands (assuan_context_t ctx)
     { "SETKEYDESC",     cmd_setkeydesc,hlp_setkeydesc },
     { "SETHASH",        cmd_sethash,   hlp_sethash },
     { "PKSIGN",         cmd_pksign,    hlp_pksign },
+    { "PKSIGN_BATCH",   cmd_pksign_batch, hlp_pksign_batch },
+    { "PKSIGN_MULTI",   cmd_pksign_multi, hlp_pksign_multi },
     { "PKDECRYPT",      cmd_pkdecrypt, hlp_pkdecrypt },
+    { "PKDECRYPT_BATCH", cmd_pkdecrypt_batch, hlp_pkdecrypt_batch },
+    { "PKDECRYPT_TRIAL", cmd_pkdecrypt_trial, hlp_pkdecrypt_trial },
     { "GENKEY",         cmd_genkey,    hlp_genkey },
     { "READKEY",        cmd_readkey,   hlp_readkey },
     { "GET_PASSPHRASE", cmd_get_passphrase, hlp_get_passphrase },
@@ -3548,6 +4471,7 @@ register_commands (assuan_context_t ctx)
     { "KILLAGENT",      cmd_killagent,  hlp_killagent },
     { "RELOADAGENT",    cmd_reloadagent,hlp_reloadagent },
     { "GETINFO",        cmd_getinfo,   hlp_getinfo },
+    { "OPTIONS",        cmd_options,   hlp_options },
     { "KEYTOCARD",      cmd_keytocard, hlp_keytocard },
     { NULL }
   };
@@ -3560,9 +4484,11 @@ register_commands (assuan_context_t ctx)
       if (rc)
         return rc;
     }
+  assuan_register_pre_cmd_notify (ctx, pre_cmd_notify);
   assuan_register_post_cmd_notify (ctx, post_cmd_notify);
   assuan_register_reset_notify (ctx, reset_notify);
   assuan_register_option_handler (ctx, option_handler);
+  metric_register (&m_connections);
   return 0;
 }
 
@@ -3680,6 +4606,11 @@ start_command_handler (ctrl_t ctrl, gnupg_fd_t listen_fd, gnupg_fd_t fd)
         }
     }
 
+  /* Store the keys the client did not flush.  */
+  if (flush_import_batch (ctrl))
+    log_error ("storing the deferred keys failed\n");
+  xfree (ctrl->server_local->import_batch);
+
   /* Clear the keyinfo cache.  */
   agent_card_free_keyinfo (ctrl->server_local->last_card_keyinfo.ki);
 
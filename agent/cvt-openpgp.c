@@ -1088,12 +1088,12 @@ convert_from_openpgp_native (ctrl_t ctrl,
    parameters in that array and replace them by one opaque encoded
    mpi.  NPKEY is the number of public key parameters and NSKEY is
    the number of secret key parameters (including the public ones).
+   S2KKEY is the key of length S2KKEYLEN derived from the passphrase.
    On success the array will have NPKEY+1 elements.  */
 static gpg_error_t
 apply_protection (gcry_mpi_t *array, int npkey, int nskey,
-                  const char *passphrase,
-                  int protect_algo, void *protect_iv, size_t protect_ivlen,
-                  int s2k_mode, int s2k_algo, byte *s2k_salt, u32 s2k_count)
+                  const unsigned char *s2kkey, size_t s2kkeylen,
+                  int protect_algo, void *protect_iv, size_t protect_ivlen)
 {
   gpg_error_t err;
   int i, j;
@@ -1151,8 +1151,7 @@ apply_protection (gcry_mpi_t *array, int npkey, int nskey,
   err = gcry_cipher_open (&cipherhd, protect_algo,
                           GCRY_CIPHER_MODE_CFB, GCRY_CIPHER_SECURE);
   if (!err)
-    err = hash_passphrase_and_set_key (passphrase, cipherhd, protect_algo,
-                                       s2k_mode, s2k_algo, s2k_salt, s2k_count);
+    err = gcry_cipher_setkey (cipherhd, s2kkey, s2kkeylen);
   if (!err)
     err = gcry_cipher_setiv (cipherhd, protect_iv, protect_ivlen);
   if (!err)
@@ -1309,12 +1308,15 @@ extract_private_key (gcry_sexp_t s_key, int req_private_key_data,
     }
 }
 
-/* Convert our key S_KEY into an OpenPGP key transfer format.  On
+/* Convert our key S_KEY into an OpenPGP key transfer format using
+   the key S2KKEY of length S2KKEYLEN which has been derived with the
+   iterated and salted S2K from SALT and the encoded S2K_COUNT.  On
    success a canonical encoded S-expression is stored at R_TRANSFERKEY
-   and its length at R_TRANSFERKEYLEN; this S-expression is also
-   padded to a multiple of 64 bits.  */
-gpg_error_t
-convert_to_openpgp (ctrl_t ctrl, gcry_sexp_t s_key, const char *passphrase,
+   and its length at R_TRANSFERKEYLEN.  */
+static gpg_error_t
+build_transfer_key (gcry_sexp_t s_key,
+                    const unsigned char *s2kkey, size_t s2kkeylen,
+                    const unsigned char *salt, unsigned long s2k_count,
                     unsigned char **r_transferkey, size_t *r_transferkeylen)
 {
   gpg_error_t err;
@@ -1324,12 +1326,8 @@ convert_to_openpgp (ctrl_t ctrl, gcry_sexp_t s_key, const char *passphrase,
   gcry_sexp_t curve = NULL;
   gcry_sexp_t flags = NULL;
   char protect_iv[16];
-  char salt[8];
-  unsigned long s2k_count;
   int i, j;
 
-  (void)ctrl;
-
   *r_transferkey = NULL;
 
   for (i=0; i < DIM (array); i++)
@@ -1341,14 +1339,8 @@ convert_to_openpgp (ctrl_t ctrl, gcry_sexp_t s_key, const char *passphrase,
     return err;
 
   gcry_create_nonce (protect_iv, sizeof protect_iv);
-  gcry_create_nonce (salt, sizeof salt);
-  /* We need to use the encoded S2k count.  It is not possible to
-     encode it after it has been used because the encoding procedure
-     may round the value up.  */
-  s2k_count = get_standard_s2k_count_rfc4880 ();
-  err = apply_protection (array, npkey, nskey, passphrase,
-                          GCRY_CIPHER_AES, protect_iv, sizeof protect_iv,
-                          3, GCRY_MD_SHA1, salt, s2k_count);
+  err = apply_protection (array, npkey, nskey, s2kkey, s2kkeylen,
+                          GCRY_CIPHER_AES, protect_iv, sizeof protect_iv);
   /* Turn it into the transfer key S-expression.  Note that we always
      return a protected key.  */
   if (!err)
@@ -1393,7 +1385,7 @@ convert_to_openpgp (ctrl_t ctrl, gcry_sexp_t s_key, const char *passphrase,
                                curve,
                                tmpkey,
                                (int)sizeof protect_iv, protect_iv,
-                               (int)sizeof salt, salt,
+                               8, salt,
                                countbuf);
       gcry_sexp_release (tmpkey);
       if (!err)
@@ -1408,3 +1400,139 @@ convert_to_openpgp (ctrl_t ctrl, gcry_sexp_t s_key, const char *passphrase,
 
   return err;
 }
+
+
+/* Convert our key S_KEY into an OpenPGP key transfer format.  On
+   success a canonical encoded S-expression is stored at R_TRANSFERKEY
+   and its length at R_TRANSFERKEYLEN; this S-expression is also
+   padded to a multiple of 64 bits.  */
+gpg_error_t
+convert_to_openpgp (ctrl_t ctrl, gcry_sexp_t s_key, const char *passphrase,
+                    unsigned char **r_transferkey, size_t *r_transferkeylen)
+{
+  gpg_error_t err;
+  unsigned char salt[8];
+  unsigned char *s2kkey;
+  size_t s2kkeylen;
+  unsigned long s2k_count;
+
+  (void)ctrl;
+
+  *r_transferkey = NULL;
+
+  s2kkeylen = gcry_cipher_get_algo_keylen (GCRY_CIPHER_AES);
+  s2kkey = xtrymalloc_secure (s2kkeylen);
+  if (!s2kkey)
+    return gpg_error_from_syserror ();
+
+  gcry_create_nonce (salt, sizeof salt);
+  /* We need to use the encoded S2k count.  It is not possible to
+     encode it after it has been used because the encoding procedure
+     may round the value up.  */
+  s2k_count = get_standard_s2k_count_rfc4880 ();
+  err = s2k_hash_passphrase (passphrase, GCRY_MD_SHA1, 3, salt, s2k_count,
+                             s2kkey, s2kkeylen);
+  if (!err)
+    err = build_transfer_key (s_key, s2kkey, s2kkeylen, salt, s2k_count,
+                              r_transferkey, r_transferkeylen);
+  xfree (s2kkey);
+  return err;
+}
+
+
+/* Convert the NKEYS keys S_KEYS protected with the respective
+   passphrase of PASSPHRASES into the OpenPGP key transfer format.
+   Keys with the same passphrase share the salt so that the expensive
+   S2K is done only once per distinct passphrase; these derivations
+   run concurrently in the worker pool.  The results are stored as
+   with convert_to_openpgp at the arrays R_TRANSFERKEYS,
+   R_TRANSFERKEYLENS and R_ERRS which need to have NKEYS elements.  */
+void
+convert_to_openpgp_many (ctrl_t ctrl, gcry_sexp_t *s_keys, char **passphrases,
+                         unsigned int nkeys,
+                         unsigned char **r_transferkeys,
+                         size_t *r_transferkeylens, gpg_error_t *r_errs)
+{
+  gpg_error_t err;
+  unsigned int *group = NULL;
+  char **grppassphrases = NULL;
+  unsigned char *salts = NULL;
+  unsigned char **saltptrs = NULL;
+  unsigned char *s2kkeys = NULL;
+  unsigned char **s2kkeyptrs = NULL;
+  gpg_error_t *grperrs = NULL;
+  unsigned int ngroups, i, j;
+  size_t s2kkeylen;
+  unsigned long s2k_count;
+
+  (void)ctrl;
+
+  for (i=0; i < nkeys; i++)
+    {
+      r_transferkeys[i] = NULL;
+      r_transferkeylens[i] = 0;
+      r_errs[i] = 0;
+    }
+  if (!nkeys)
+    return;
+
+  s2kkeylen = gcry_cipher_get_algo_keylen (GCRY_CIPHER_AES);
+  group = xtrycalloc (nkeys, sizeof *group);
+  grppassphrases = xtrycalloc (nkeys, sizeof *grppassphrases);
+  salts = xtrymalloc (nkeys * 8);
+  saltptrs = xtrycalloc (nkeys, sizeof *saltptrs);
+  s2kkeys = xtrymalloc_secure (nkeys * s2kkeylen);
+  s2kkeyptrs = xtrycalloc (nkeys, sizeof *s2kkeyptrs);
+  grperrs = xtrycalloc (nkeys, sizeof *grperrs);
+  if (!group || !grppassphrases || !salts || !saltptrs
+      || !s2kkeys || !s2kkeyptrs || !grperrs)
+    {
+      err = gpg_error_from_syserror ();
+      for (i=0; i < nkeys; i++)
+        r_errs[i] = err;
+      goto leave;
+    }
+
+  /* Assign each key to the group of its passphrase.  */
+  ngroups = 0;
+  for (i=0; i < nkeys; i++)
+    {
+      for (j=0; j < ngroups; j++)
+        if (!strcmp (grppassphrases[j], passphrases[i]))
+          break;
+      if (j == ngroups)
+        {
+          grppassphrases[j] = passphrases[i];
+          saltptrs[j] = salts + j * 8;
+          s2kkeyptrs[j] = s2kkeys + j * s2kkeylen;
+          gcry_create_nonce (saltptrs[j], 8);
+          ngroups++;
+        }
+      group[i] = j;
+    }
+
+  s2k_count = get_standard_s2k_count_rfc4880 ();
+  workpool_s2k_many (grppassphrases, saltptrs, ngroups, s2k_count,
+                     s2kkeyptrs, s2kkeylen, grperrs);
+
+  for (i=0; i < nkeys; i++)
+    {
+      j = group[i];
+      if (grperrs[j])
+        r_errs[i] = grperrs[j];
+      else
+        r_errs[i] = build_transfer_key (s_keys[i], s2kkeyptrs[j], s2kkeylen,
+                                        saltptrs[j], s2k_count,
+                                        r_transferkeys + i,
+                                        r_transferkeylens + i);
+    }
+
+ leave:
+  xfree (s2kkeys);
+  xfree (s2kkeyptrs);
+  xfree (saltptrs);
+  xfree (salts);
+  xfree (grppassphrases);
+  xfree (group);
+  xfree (grperrs);
+}
@@ -33,5 +33,9 @@ gpg_error_t convert_to_openpgp (ctrl_t ctrl, gcry_sexp_t s_key,
                                 const char *passphrase,
                                 unsigned char **r_transferkey,
                                 size_t *r_transferkeylen);
+void convert_to_openpgp_many (ctrl_t ctrl, gcry_sexp_t *s_keys,
+                              char **passphrases, unsigned int nkeys,
+                              unsigned char **r_transferkeys,
+                              size_t *r_transferkeylens, gpg_error_t *r_errs);
 
 #endif /*GNUPG_AGENT_CVT_OPENPGP_H*/
@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <npth.h> /* (we use pth_sleep) */
 
 #include "agent.h"
@@ -39,6 +40,8 @@
 #define O_BINARY 0
 #endif
 
+static void forget_key_index_entry (const unsigned char *grip);
+
 /* Helper to pass data to the check callback of the unprotect function. */
 struct try_unprotect_arg_s
 {
@@ -211,6 +214,9 @@ agent_write_private_key (const unsigned char *grip,
   char hexgrip[40+4+1];
 
   bin2hex (grip, 20, hexgrip);
+  agent_flush_key_cache (hexgrip);
+  ssh_flush_identity_cache ();
+  forget_key_index_entry (grip);
   strcpy (hexgrip+40, ".key");
 
   fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
@@ -573,6 +579,33 @@ agent_modify_description (const char *in, const char *comment,
 
 
 
+/* Unprotect KEYBUF using the passphrase PW which has been taken from
+ * the cache item KEY.  The key derived from PW is stored with that
+ * item so that the next call does not need to run the S2K function
+ * again.  */
+static gpg_error_t
+unprotect_cached (ctrl_t ctrl, const unsigned char *keybuf, const char *pw,
+                  const char *key, cache_mode_t cache_mode,
+                  unsigned char **result, size_t *resultlen)
+{
+  gpg_error_t err;
+  unprotect_kek_t kek;
+
+  kek = xtrymalloc_secure (sizeof *kek);
+  if (!kek)
+    return agent_unprotect (ctrl, keybuf, pw, NULL, result, resultlen);
+
+  agent_get_cache_kek (ctrl, key, cache_mode, pw, kek);
+  err = agent_unprotect_with_kek (ctrl, keybuf, pw, kek, NULL,
+                                  result, resultlen);
+  if (!err && kek->is_new)
+    agent_put_cache_kek (ctrl, key, cache_mode, pw, kek);
+  wipememory (kek, sizeof *kek);
+  xfree (kek);
+  return err;
+}
+
+
 /* Unprotect the canconical encoded S-expression key in KEYBUF.  GRIP
    should be the hex encoded keygrip of that key to be used with the
    caching mechanism. DESC_TEXT may be set to override the default
@@ -581,12 +614,13 @@ agent_modify_description (const char *in, const char *comment,
    NULL, the function succeeded and the key was protected the used
    passphrase (entered or from the cache) is stored there; if not NULL
    will be stored.  The caller needs to free the returned
-   passphrase. */
+   passphrase.  If STAMP is not NULL it describes the key file and
+   the unprotected key is put into the cache.  */
 static gpg_error_t
 unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
            unsigned char **keybuf, const unsigned char *grip,
            cache_mode_t cache_mode, lookup_ttl_t lookup_ttl,
-           char **r_passphrase)
+           const struct stat *stamp, char **r_passphrase)
 {
   struct pin_entry_info_s *pi;
   struct try_unprotect_arg_s arg;
@@ -608,7 +642,8 @@ unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
       pw = agent_get_cache (ctrl, cache_nonce, CACHE_MODE_NONCE);
       if (pw)
         {
-          rc = agent_unprotect (ctrl, *keybuf, pw, NULL, &result, &resultlen);
+          rc = unprotect_cached (ctrl, *keybuf, pw, cache_nonce,
+                                 CACHE_MODE_NONCE, &result, &resultlen);
           if (!rc)
             {
               if (r_passphrase)
@@ -633,11 +668,14 @@ unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
       pw = agent_get_cache (ctrl, hexgrip, cache_mode);
       if (pw)
         {
-          rc = agent_unprotect (ctrl, *keybuf, pw, NULL, &result, &resultlen);
+          rc = unprotect_cached (ctrl, *keybuf, pw, hexgrip, cache_mode,
+                                 &result, &resultlen);
           if (!rc)
             {
               if (cache_mode == CACHE_MODE_NORMAL)
                 agent_store_cache_hit (hexgrip);
+              agent_put_key_cache (ctrl, hexgrip, cache_mode, pw, stamp,
+                                   result);
               if (r_passphrase)
                 *r_passphrase = pw;
               else
@@ -777,6 +815,8 @@ unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
           agent_put_cache (ctrl, hexgrip, cache_mode, pi->pin,
                            lookup_ttl? lookup_ttl (hexgrip) : 0);
           agent_store_cache_hit (hexgrip);
+          agent_put_key_cache (ctrl, hexgrip, cache_mode, pi->pin, stamp,
+                               arg.unprotected_key);
           if (r_passphrase && *pi->pin)
             *r_passphrase = xtrystrdup (pi->pin);
         }
@@ -934,6 +974,9 @@ remove_key_file (const unsigned char *grip)
   char hexgrip[40+4+1];
 
   bin2hex (grip, 20, hexgrip);
+  agent_flush_key_cache (hexgrip);
+  ssh_flush_identity_cache ();
+  forget_key_index_entry (grip);
   strcpy (hexgrip+40, ".key");
   fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
                          hexgrip, NULL);
@@ -944,6 +987,25 @@ remove_key_file (const unsigned char *grip)
 }
 
 
+/* Store the file status of the key file for GRIP at ST.  */
+static gpg_error_t
+stat_key_file (const unsigned char *grip, struct stat *st)
+{
+  gpg_error_t err = 0;
+  char *fname;
+  char hexgrip[40+4+1];
+
+  bin2hex (grip, 20, hexgrip);
+  strcpy (hexgrip+40, ".key");
+  fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
+                         hexgrip, NULL);
+  if (stat (fname, st))
+    err = gpg_error_from_syserror ();
+  xfree (fname);
+  return err;
+}
+
+
 /* Return the secret key as an S-Exp in RESULT after locating it using
    the GRIP.  If the operation shall be diverted to a token, an
    allocated S-expression with the shadow_info part from the file is
@@ -958,7 +1020,9 @@ remove_key_file (const unsigned char *grip)
    R_PASSPHRASE is not NULL, the function succeeded and the key was
    protected the used passphrase (entered or from the cache) is stored
    there; if not NULL will be stored.  The caller needs to free the
-   returned passphrase.   */
+   returned passphrase.  If the option --key-cache-ttl is used and
+   R_PASSPHRASE is NULL an unprotected key from the cache may be
+   returned instead of reading the file.  */
 gpg_error_t
 agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
                      const char *desc_text,
@@ -972,6 +1036,8 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   gcry_sexp_t s_skey;
   nvc_t keymeta = NULL;
   char *desc_text_buffer = NULL;  /* Used in case we extend DESC_TEXT.  */
+  struct stat stamp_buffer;
+  struct stat *stamp = NULL;
 
   *result = NULL;
   if (shadow_info)
@@ -979,6 +1045,28 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   if (r_passphrase)
     *r_passphrase = NULL;
 
+  /* The file status needs to be taken before the file is read so
+   * that a concurrent change of the file can't lead to a cached key
+   * with the status of the new file.  */
+  if (opt.key_cache_ttl && cache_mode != CACHE_MODE_IGNORE
+      && !stat_key_file (grip, &stamp_buffer))
+    {
+      stamp = &stamp_buffer;
+      if (!r_passphrase)
+        {
+          char hexgrip[40+1];
+
+          bin2hex (grip, 20, hexgrip);
+          buf = agent_get_key_cache (ctrl, hexgrip, cache_mode, stamp);
+          if (buf)
+            {
+              if (cache_mode == CACHE_MODE_NORMAL)
+                agent_store_cache_hit (hexgrip);
+              goto unprotected;
+            }
+        }
+    }
+
   err = read_key_file (grip, &s_skey, &keymeta);
   if (err)
     {
@@ -1062,7 +1150,7 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
 	if (!err)
 	  {
 	    err = unprotect (ctrl, cache_nonce, desc_text_final, &buf, grip,
-                            cache_mode, lookup_ttl, r_passphrase);
+                             cache_mode, lookup_ttl, stamp, r_passphrase);
 	    if (err)
 	      log_error ("failed to unprotect the secret key: %s\n",
 			 gpg_strerror (err));
@@ -1117,6 +1205,7 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
       return err;
     }
 
+ unprotected:
   buflen = gcry_sexp_canon_len (buf, 0, NULL, NULL);
   err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
   wipememory (buf, buflen);
@@ -1481,6 +1570,218 @@ agent_public_key_from_file (ctrl_t ctrl,
 
 
 
+/* An entry of the in-memory index of the private key directory.  */
+struct key_index_entry_s
+{
+  unsigned char grip[20];
+  int have_info;      /* The fields below are valid.  */
+  off_t size;         /* The status of the key file ...  */
+  time_t mtime;
+  ino_t ino;
+  time_t info_time;   /* ... when it was read at this time.  */
+  int keytype;
+  unsigned char *shadow_info;
+};
+
+/* The index of the private key directory.  It is used by
+ * agent_key_available and agent_key_info_from_file and is rebuilt
+ * whenever the status of the directory has changed.  The directory
+ * and the key files are considered to be unchanged only if their
+ * mtime is older than the time they were read; the timestamps have a
+ * resolution of only a second.  */
+static struct
+{
+  int valid;
+  unsigned int generation;  /* Incremented for each change of a key.  */
+  time_t mtime;             /* The status of the directory ...  */
+  ino_t ino;
+  time_t scan_time;         /* ... when it was read at this time.  */
+  size_t nentries;
+  struct key_index_entry_s *entries;  /* Sorted by grip.  */
+} key_index;
+
+/* The mutex used to serialize access to the index.  */
+static npth_mutex_t key_index_lock;
+
+
+void
+initialize_module_findkey (void)
+{
+  int err;
+
+  err = npth_mutex_init (&key_index_lock, NULL);
+  if (err)
+    log_fatal ("error initializing key index lock: %s\n", strerror (err));
+}
+
+
+static void
+lock_key_index (void)
+{
+  int err;
+
+  err = npth_mutex_lock (&key_index_lock);
+  if (err)
+    log_fatal ("failed to acquire key index lock: %s\n", strerror (err));
+}
+
+
+static void
+unlock_key_index (void)
+{
+  int err;
+
+  err = npth_mutex_unlock (&key_index_lock);
+  if (err)
+    log_fatal ("failed to release key index lock: %s\n", strerror (err));
+}
+
+
+static int
+compare_key_index_entries (const void *a, const void *b)
+{
+  return memcmp (a, b, 20);
+}
+
+
+static void
+release_key_index_entries (struct key_index_entry_s *entries, size_t n)
+{
+  size_t i;
+
+  for (i=0; i < n; i++)
+    xfree (entries[i].shadow_info);
+  xfree (entries);
+}
+
+
+/* Return the entry for GRIP or NULL.  The index must be locked.  */
+static struct key_index_entry_s *
+find_key_index_entry (const unsigned char *grip)
+{
+  return bsearch (grip, key_index.entries, key_index.nentries,
+                  sizeof *key_index.entries, compare_key_index_entries);
+}
+
+
+/* Make sure that the index describes the private key directory.
+ * Returns 0 if the index may be used.  The index must be locked.  */
+static gpg_error_t
+refresh_key_index (void)
+{
+  gpg_error_t err;
+  char *dirname;
+  DIR *dir = NULL;
+  struct dirent *dir_entry;
+  struct stat st;
+  struct key_index_entry_s *entries = NULL;
+  struct key_index_entry_s *old;
+  char hexgrip[40+1];
+  size_t nentries, maxentries, i;
+  unsigned int generation;
+  time_t scan_time;
+  void *tmp;
+
+  dirname = make_filename_try (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR, NULL);
+  if (!dirname)
+    return gpg_error_from_syserror ();
+  if (stat (dirname, &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (key_index.valid && key_index.mtime == st.st_mtime
+      && key_index.ino == st.st_ino && key_index.mtime < key_index.scan_time)
+    {
+      err = 0;
+      goto leave;
+    }
+
+  generation = key_index.generation;
+  scan_time = time (NULL);
+  dir = opendir (dirname);
+  if (!dir)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  nentries = maxentries = 0;
+  while ((dir_entry = readdir (dir)))
+    {
+      if (strlen (dir_entry->d_name) != 44
+          || strcmp (dir_entry->d_name + 40, ".key"))
+        continue;
+      if (nentries == maxentries)
+        {
+          maxentries += 64;
+          tmp = xtryrealloc (entries, maxentries * sizeof *entries);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+          entries = tmp;
+        }
+      memset (entries + nentries, 0, sizeof *entries);
+      memcpy (hexgrip, dir_entry->d_name, 40);
+      hexgrip[40] = 0;
+      if (hex2bin (hexgrip, entries[nentries].grip, 20) < 0)
+        continue; /* Bad hex string.  */
+      nentries++;
+    }
+  qsort (entries, nentries, sizeof *entries, compare_key_index_entries);
+
+  /* Keep the info of the keys which are still there.  */
+  for (i=0; i < nentries; i++)
+    {
+      old = find_key_index_entry (entries[i].grip);
+      if (old && old->have_info)
+        {
+          entries[i] = *old;
+          old->shadow_info = NULL;
+        }
+    }
+
+  release_key_index_entries (key_index.entries, key_index.nentries);
+  key_index.entries = entries;
+  key_index.nentries = nentries;
+  entries = NULL;
+  key_index.mtime = st.st_mtime;
+  key_index.ino = st.st_ino;
+  key_index.scan_time = scan_time;
+  key_index.valid = (generation == key_index.generation);
+  err = 0;
+
+ leave:
+  if (dir)
+    closedir (dir);
+  xfree (entries);
+  xfree (dirname);
+  return err;
+}
+
+
+/* Tell the index that the key file for GRIP is going to be changed
+ * or removed.  */
+static void
+forget_key_index_entry (const unsigned char *grip)
+{
+  struct key_index_entry_s *entry;
+
+  lock_key_index ();
+  key_index.generation++;
+  key_index.valid = 0;
+  entry = find_key_index_entry (grip);
+  if (entry)
+    {
+      entry->have_info = 0;
+      xfree (entry->shadow_info);
+      entry->shadow_info = NULL;
+    }
+  unlock_key_index ();
+}
+
+
 /* Check whether the secret key identified by GRIP is available.
    Returns 0 is the key is available.  */
 int
@@ -1490,6 +1791,15 @@ agent_key_available (const unsigned char *grip)
   char *fname;
   char hexgrip[40+4+1];
 
+  lock_key_index ();
+  if (!refresh_key_index ())
+    {
+      result = find_key_index_entry (grip)? 0 : -1;
+      unlock_key_index ();
+      return result;
+    }
+  unlock_key_index ();
+
   bin2hex (grip, 20, hexgrip);
   strcpy (hexgrip+40, ".key");
 
@@ -1501,6 +1811,23 @@ agent_key_available (const unsigned char *grip)
 }
 
 
+/* Store a copy of the canonical S-expression SHADOW_INFO at
+ * R_SHADOW_INFO.  */
+static gpg_error_t
+copy_shadow_info (const unsigned char *shadow_info,
+                  unsigned char **r_shadow_info)
+{
+  size_t n;
+
+  n = gcry_sexp_canon_len (shadow_info, 0, NULL, NULL);
+  log_assert (n);
+  *r_shadow_info = xtrymalloc (n);
+  if (!*r_shadow_info)
+    return gpg_error_from_syserror ();
+  memcpy (*r_shadow_info, shadow_info, n);
+  return 0;
+}
+
 
 /* Return the information about the secret key specified by the binary
    keygrip GRIP.  If the key is a shadowed one the shadow information
@@ -1514,6 +1841,12 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   unsigned char *buf;
   size_t len;
   int keytype;
+  struct key_index_entry_s *entry;
+  struct stat st;
+  int use_index = 0;
+  unsigned int generation = 0;
+  const unsigned char *s;
+  unsigned char *shadow_info = NULL;
 
   (void)ctrl;
 
@@ -1522,6 +1855,34 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   if (r_shadow_info)
     *r_shadow_info = NULL;
 
+  lock_key_index ();
+  if (!refresh_key_index ())
+    {
+      entry = find_key_index_entry (grip);
+      if (!entry)
+        {
+          unlock_key_index ();
+          return gpg_error (GPG_ERR_NOT_FOUND);
+        }
+      if (entry->have_info && !stat_key_file (grip, &st)
+          && entry->size == st.st_size && entry->mtime == st.st_mtime
+          && entry->ino == st.st_ino && entry->mtime < entry->info_time)
+        {
+          err = 0;
+          if (r_shadow_info && entry->shadow_info)
+            err = copy_shadow_info (entry->shadow_info, r_shadow_info);
+          if (!err && r_keytype)
+            *r_keytype = entry->keytype;
+          unlock_key_index ();
+          return err;
+        }
+      /* Take the status before reading the file so that a concurrent
+       * change does not go unnoticed.  */
+      use_index = !stat_key_file (grip, &st);
+      generation = key_index.generation;
+    }
+  unlock_key_index ();
+
   {
     gcry_sexp_t sexp;
 
@@ -1550,38 +1911,80 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
          from such a key. */
       break;
     case PRIVATE_KEY_SHADOWED:
-      if (r_shadow_info)
-        {
-          const unsigned char *s;
-          size_t n;
-
-          err = agent_get_shadow_info (buf, &s);
-          if (!err)
-            {
-              n = gcry_sexp_canon_len (s, 0, NULL, NULL);
-              log_assert (n);
-              *r_shadow_info = xtrymalloc (n);
-              if (!*r_shadow_info)
-                err = gpg_error_from_syserror ();
-              else
-                memcpy (*r_shadow_info, s, n);
-            }
-        }
+      err = agent_get_shadow_info (buf, &s);
+      if (!err)
+        err = copy_shadow_info (s, &shadow_info);
       break;
     default:
       err = gpg_error (GPG_ERR_BAD_SECKEY);
       break;
     }
 
+  if (!err && r_shadow_info && shadow_info)
+    err = copy_shadow_info (shadow_info, r_shadow_info);
   if (!err && r_keytype)
     *r_keytype = keytype;
 
+  if (!err && use_index)
+    {
+      lock_key_index ();
+      entry = find_key_index_entry (grip);
+      if (entry && generation == key_index.generation)
+        {
+          xfree (entry->shadow_info);
+          entry->shadow_info = shadow_info;
+          shadow_info = NULL;
+          entry->keytype = keytype;
+          entry->size = st.st_size;
+          entry->mtime = st.st_mtime;
+          entry->ino = st.st_ino;
+          entry->info_time = time (NULL);
+          entry->have_info = 1;
+        }
+      unlock_key_index ();
+    }
+
+  xfree (shadow_info);
   xfree (buf);
   return err;
 }
 
 
-
+/* Store an array with the keygrips of all keys in the private key
+ * directory at R_GRIPS and their number at R_NGRIPS.  The caller
+ * needs to release the array.  */
+gpg_error_t
+agent_list_keygrips (unsigned char (**r_grips)[20], size_t *r_ngrips)
+{
+  gpg_error_t err;
+  unsigned char (*grips)[20];
+  size_t i;
+
+  *r_grips = NULL;
+  *r_ngrips = 0;
+
+  lock_key_index ();
+  err = refresh_key_index ();
+  if (err)
+    goto leave;
+  grips = xtrycalloc (key_index.nentries + 1, sizeof *grips);
+  if (!grips)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=0; i < key_index.nentries; i++)
+    memcpy (grips[i], key_index.entries[i].grip, 20);
+  *r_grips = grips;
+  *r_ngrips = key_index.nentries;
+
+ leave:
+  unlock_key_index ();
+  return err;
+}
+
+
+
 /* Delete the key with GRIP from the disk after having asked for
  * confirmation using DESC_TEXT.  If FORCE is set the function won't
  * require a confirmation via Pinentry or warns if the key is also
@@ -467,7 +467,10 @@ agent_genkey (ctrl_t ctrl, const char *cache_nonce,
       passphrase = passphrase_buffer;
     }
 
-  rc = gcry_pk_genkey (&s_key, s_keyparam );
+  if (keypool_take (&s_key, s_keyparam))
+    rc = 0;
+  else
+    rc = workpool_pk_genkey (&s_key, s_keyparam);
   gcry_sexp_release (s_keyparam);
   if (rc)
     {
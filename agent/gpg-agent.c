@@ -105,6 +105,8 @@ enum cmd_and_opt_values
   oDefCacheTTL,
   oDefCacheTTLSSH,
   oMaxCacheTTL,
+  oKeyCacheTTL,
+  oKeypoolSize,
   oMaxCacheTTLSSH,
   oEnforcePassphraseConstraints,
   oMinPassphraseLen,
@@ -236,6 +238,10 @@ static gpgrt_opt_t opts[] = {
                 /* */     N_("|N|set maximum PIN cache lifetime to N seconds")),
   ARGPARSE_s_u (oMaxCacheTTLSSH, "max-cache-ttl-ssh",
                 /* */     N_("|N|set maximum SSH key lifetime to N seconds")),
+  ARGPARSE_s_u (oKeyCacheTTL,    "key-cache-ttl",
+                /* */     N_("|N|keep unprotected keys for N seconds")),
+  ARGPARSE_s_u (oKeypoolSize,    "keypool-size",
+                /* */     N_("|N|generate N keys in advance")),
   ARGPARSE_s_n (oIgnoreCacheForSigning, "ignore-cache-for-signing",
                 /* */    N_("do not use the PIN cache when signing")),
   ARGPARSE_s_n (oNoAllowExternalCache,  "no-allow-external-cache",
@@ -850,6 +856,8 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.def_cache_ttl_ssh = DEFAULT_CACHE_TTL_SSH;
       opt.max_cache_ttl = MAX_CACHE_TTL;
       opt.max_cache_ttl_ssh = MAX_CACHE_TTL_SSH;
+      opt.key_cache_ttl = 0;
+      opt.keypool_size = 0;
       opt.enforce_passphrase_constraints = 0;
       opt.min_passphrase_len = MIN_PASSPHRASE_LEN;
       opt.min_passphrase_nonalpha = MIN_PASSPHRASE_NONALPHA;
@@ -913,6 +921,8 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
     case oDefCacheTTLSSH: opt.def_cache_ttl_ssh = pargs->r.ret_ulong; break;
     case oMaxCacheTTL: opt.max_cache_ttl = pargs->r.ret_ulong; break;
     case oMaxCacheTTLSSH: opt.max_cache_ttl_ssh = pargs->r.ret_ulong; break;
+    case oKeyCacheTTL: opt.key_cache_ttl = pargs->r.ret_ulong; break;
+    case oKeypoolSize: opt.keypool_size = pargs->r.ret_ulong; break;
 
     case oEnforcePassphraseConstraints:
       opt.enforce_passphrase_constraints=1;
@@ -1001,7 +1011,9 @@ thread_init_once (void)
       npth_initialized++;
       npth_init ();
     }
-  gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+  /* The clamp functions are npth_unprotect and npth_protect except
+   * in the threads of the worker pool.  */
+  gpgrt_set_syscall_clamp (workpool_pre_syscall, workpool_post_syscall);
   /* Now that we have set the syscall clamp we need to tell Libgcrypt
    * that it should get them from libgpg-error.  Note that Libgcrypt
    * has already been initialized but at that point nPth was not
@@ -1022,6 +1034,11 @@ initialize_modules (void)
   initialize_module_call_pinentry ();
   initialize_module_call_scd ();
   initialize_module_trustlist ();
+  initialize_module_workpool ();
+  initialize_module_keypool ();
+  initialize_module_command_ssh ();
+  initialize_module_findkey ();
+  enable_s2k_calibration_file ();
 }
 
 
@@ -2025,6 +2042,7 @@ reread_configuration (void)
   xfree (twopart);
   finalize_rereadable_options ();
   set_debug ();
+  keypool_reconfigure ();
 }
 
 
@@ -2781,6 +2799,17 @@ start_connection_thread_ssh (void *arg)
 }
 
 
+/* The thread to calibrate the S2K count at startup.  */
+static void *
+s2k_calibration_thread (void *arg)
+{
+  (void)arg;
+
+  prepare_s2k_calibration (npth_unprotect, npth_protect);
+  return NULL;
+}
+
+
 /* Connection handler loop.  Wait for connection requests and spawn a
    thread after accepting a connection.  */
 static void
@@ -2881,6 +2910,18 @@ handle_connections (gnupg_fd_t listen_fd,
     }
 #endif /*HAVE_W32_SYSTEM*/
 
+  /* Calibrate the S2K count now so that the first protect operation
+     does not need to wait for it.  */
+  if (!opt.s2k_count)
+    {
+      npth_t thread;
+
+      ret = npth_create (&thread, &tattr, s2k_calibration_thread, NULL);
+      if (ret)
+        log_error ("error spawning s2k calibration thread: %s\n",
+                   strerror (ret));
+    }
+
   /* Set a flag to tell call-scd.c that it may enable event
      notifications.  */
   opt.sigusr2_enabled = 1;
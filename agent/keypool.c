@@ -0,0 +1,360 @@
+/* keypool.c - Generate keys in advance
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Generating an RSA key takes seconds.  With --keypool-size N the
+ * agent remembers the key parameters of the GENKEY requests and a
+ * background thread keeps up to N keys for each of them ready.  A
+ * later GENKEY with the same parameters takes one of these keys and
+ * then only needs to protect and store it.  The parameters are
+ * compared in their canonical encoding; at most MAX_KEYPOOL_SPECS
+ * different parameters are pooled.
+ *
+ * The keys are kept as returned by gcry_pk_genkey; Libgcrypt
+ * allocates the S-expression of a private key in secure memory.  The
+ * background thread generates one key at a time and does so without
+ * holding the nPth lock, like the threads of the worker pool.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <npth.h>
+
+#include "agent.h"
+#include "../common/metrics.h"
+
+
+/* Maximum number of different key parameters.  */
+#define MAX_KEYPOOL_SPECS 8
+
+/* Maximum number of keys kept for one key parameter.  */
+#define MAX_KEYPOOL_SIZE  64
+
+
+/* A pregenerated key.  */
+typedef struct keypool_key_s *keypool_key_t;
+struct keypool_key_s
+{
+  keypool_key_t next;
+  gcry_sexp_t key;
+};
+
+/* The keys for one key parameter.  */
+struct keypool_spec_s
+{
+  char *params;         /* The canonical encoded key parameter.  */
+  size_t paramslen;
+  gcry_sexp_t s_params; /* The same as an S-expression.  */
+  keypool_key_t keys;   /* The list of ready keys.  */
+  unsigned int nkeys;   /* The length of that list.  */
+  int failed;           /* Generating a key failed; do not retry.  */
+};
+typedef struct keypool_spec_s *keypool_spec_t;
+
+
+METRIC_DEFINE_COUNTER (m_hits, "keypool_hits");
+METRIC_DEFINE_COUNTER (m_misses, "keypool_misses");
+METRIC_DEFINE_GAUGE (m_keys, "keypool_keys");
+
+
+static struct
+{
+  int initialized;        /* The module has been initialized.  */
+  int started;            /* Starting the thread has been tried.  */
+  npth_mutex_t lock;      /* Protects the fields below.  */
+  npth_cond_t cond;       /* Signaled when keys are needed.  */
+  struct keypool_spec_s specs[MAX_KEYPOOL_SPECS];
+  unsigned int nspecs;
+} keypool;
+
+
+void
+initialize_module_keypool (void)
+{
+  int rc;
+
+  if (keypool.initialized)
+    return;
+
+  rc = npth_mutex_init (&keypool.lock, NULL);
+  if (!rc)
+    rc = npth_cond_init (&keypool.cond, NULL);
+  if (rc)
+    log_fatal ("error initializing the key pool: %s\n", strerror (rc));
+  keypool.initialized = 1;
+}
+
+
+static void
+keypool_lock (void)
+{
+  int rc = npth_mutex_lock (&keypool.lock);
+  if (rc)
+    log_fatal ("%s: failed to acquire mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+static void
+keypool_unlock (void)
+{
+  int rc = npth_mutex_unlock (&keypool.lock);
+  if (rc)
+    log_fatal ("%s: failed to release mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+/* Return the configured number of keys per key parameter.  */
+static unsigned int
+pool_size (void)
+{
+  return opt.keypool_size > MAX_KEYPOOL_SIZE? MAX_KEYPOOL_SIZE
+    /**/                                    : opt.keypool_size;
+}
+
+
+/* Release the keys of SPEC in excess of N.  Must be called with the
+ * lock held.  */
+static void
+trim_spec (keypool_spec_t spec, unsigned int n)
+{
+  keypool_key_t k;
+
+  while (spec->nkeys > n)
+    {
+      k = spec->keys;
+      spec->keys = k->next;
+      spec->nkeys--;
+      gcry_sexp_release (k->key);
+      xfree (k);
+      metric_dec (&m_keys);
+    }
+}
+
+
+/* Return the spec lacking the most keys or NULL if all are complete.
+ * Must be called with the lock held.  */
+static keypool_spec_t
+next_spec (void)
+{
+  keypool_spec_t spec = NULL;
+  unsigned int i;
+
+  for (i=0; i < keypool.nspecs; i++)
+    if (!keypool.specs[i].failed
+        && keypool.specs[i].nkeys < pool_size ()
+        && (!spec || keypool.specs[i].nkeys < spec->nkeys))
+      spec = keypool.specs + i;
+  return spec;
+}
+
+
+/* The thread function of the key generator.  */
+static void *
+keypool_thread (void *arg)
+{
+  keypool_spec_t spec;
+  keypool_key_t k;
+  gcry_sexp_t key;
+  gpg_error_t err;
+
+  (void)arg;
+
+  workpool_set_worker ();
+
+  keypool_lock ();
+  for (;;)
+    {
+      while (!(spec = next_spec ()))
+        npth_cond_wait (&keypool.cond, &keypool.lock);
+      keypool_unlock ();
+
+      /* Specs are never removed, thus SPEC stays valid.  */
+      key = NULL;
+      npth_unprotect ();
+      err = gcry_pk_genkey (&key, spec->s_params);
+      npth_protect ();
+
+      k = err? NULL : xtrymalloc (sizeof *k);
+      if (!err && !k)
+        err = gpg_error_from_syserror ();
+      keypool_lock ();
+      if (err)
+        {
+          log_error ("generating a key for the pool failed: %s\n",
+                     gpg_strerror (err));
+          spec->failed = 1;
+          gcry_sexp_release (key);
+        }
+      else if (spec->nkeys >= pool_size ())
+        {
+          gcry_sexp_release (key);
+          xfree (k);
+        }
+      else
+        {
+          k->key = key;
+          k->next = spec->keys;
+          spec->keys = k;
+          spec->nkeys++;
+          metric_inc (&m_keys);
+        }
+    }
+
+  return NULL;
+}
+
+
+/* Start the key generator thread.  */
+static void
+start_thread (void)
+{
+  npth_attr_t tattr;
+  npth_t thread;
+  int rc;
+
+  keypool.started = 1;
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      log_error ("error preparing the key pool thread: %s\n", strerror (rc));
+      return;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  rc = npth_create (&thread, &tattr, keypool_thread, NULL);
+  if (rc)
+    log_error ("error spawning the key pool thread: %s\n", strerror (rc));
+  else
+    npth_setname_np (thread, "keypool");
+  npth_attr_destroy (&tattr);
+}
+
+
+/* Add a spec for the canonical key parameter PARAMS of length
+ * PARAMSLEN.  Returns NULL if there is no space for another spec.
+ * Must be called with the lock held.  */
+static keypool_spec_t
+add_spec (const char *params, size_t paramslen)
+{
+  keypool_spec_t spec;
+
+  if (keypool.nspecs == MAX_KEYPOOL_SPECS)
+    return NULL;
+
+  spec = keypool.specs + keypool.nspecs;
+  memset (spec, 0, sizeof *spec);
+  spec->params = xtrymalloc (paramslen);
+  if (!spec->params)
+    return NULL;
+  memcpy (spec->params, params, paramslen);
+  spec->paramslen = paramslen;
+  if (gcry_sexp_sscan (&spec->s_params, NULL, params, paramslen))
+    {
+      xfree (spec->params);
+      return NULL;
+    }
+  keypool.nspecs++;
+  return spec;
+}
+
+
+/* Take a pregenerated key for the key parameter S_PARMS.  On success
+ * true is returned and the key is stored at R_KEY.  If no key is
+ * available false is returned and keys for S_PARMS will be generated
+ * in the background.  */
+int
+keypool_take (gcry_sexp_t *r_key, gcry_sexp_t s_parms)
+{
+  keypool_spec_t spec = NULL;
+  keypool_key_t k = NULL;
+  char *params;
+  size_t len;
+  unsigned int i;
+
+  *r_key = NULL;
+  if (!keypool.initialized || !pool_size ())
+    return 0;
+
+  len = gcry_sexp_sprint (s_parms, GCRYSEXP_FMT_CANON, NULL, 0);
+  params = len? xtrymalloc (len) : NULL;
+  if (!params)
+    return 0;
+  len = gcry_sexp_sprint (s_parms, GCRYSEXP_FMT_CANON, params, len);
+
+  keypool_lock ();
+  for (i=0; i < keypool.nspecs; i++)
+    if (keypool.specs[i].paramslen == len
+        && !memcmp (keypool.specs[i].params, params, len))
+      {
+        spec = keypool.specs + i;
+        break;
+      }
+  if (!spec)
+    spec = add_spec (params, len);
+  if (spec && spec->keys)
+    {
+      k = spec->keys;
+      spec->keys = k->next;
+      spec->nkeys--;
+      metric_dec (&m_keys);
+    }
+  if (spec && !spec->failed)
+    {
+      if (!keypool.started)
+        start_thread ();
+      npth_cond_signal (&keypool.cond);
+    }
+  keypool_unlock ();
+  xfree (params);
+
+  if (!k)
+    {
+      metric_inc (&m_misses);
+      return 0;
+    }
+  metric_inc (&m_hits);
+  *r_key = k->key;
+  xfree (k);
+  return 1;
+}
+
+
+/* To be called after the options have been re-read.  Releases the
+ * keys not anymore needed and lets the generator fill up the pool
+ * again.  */
+void
+keypool_reconfigure (void)
+{
+  unsigned int i;
+
+  if (!keypool.initialized)
+    return;
+
+  keypool_lock ();
+  for (i=0; i < keypool.nspecs; i++)
+    {
+      trim_spec (keypool.specs + i, pool_size ());
+      keypool.specs[i].failed = 0;
+    }
+  npth_cond_signal (&keypool.cond);
+  keypool_unlock ();
+}
@@ -29,6 +29,103 @@
 #include "agent.h"
 
 
+/* Store the decryption result S_PLAIN as canonical encoded
+   S-expression in OUTBUF.  */
+static void
+put_plain_sexp (gcry_sexp_t s_plain, membuf_t *outbuf)
+{
+  char *buf;
+  size_t len;
+
+  if (DBG_CRYPTO)
+    {
+      log_debug ("plain: ");
+      gcry_sexp_dump (s_plain);
+    }
+  len = gcry_sexp_sprint (s_plain, GCRYSEXP_FMT_CANON, NULL, 0);
+  log_assert (len);
+  buf = xmalloc_secure (len);
+  len = gcry_sexp_sprint (s_plain, GCRYSEXP_FMT_CANON, buf, len);
+  log_assert (len);
+  if (*buf == '(')
+    put_membuf (outbuf, buf, len);
+  else
+    {
+      /* Old style libgcrypt: This is only an S-expression
+         part. Turn it into a complete S-expression. */
+      put_membuf (outbuf, "(5:value", 8);
+      put_membuf (outbuf, buf, len);
+      put_membuf (outbuf, ")", 2);
+    }
+  wipememory (buf, len);
+  xfree (buf);
+}
+
+
+/* Decrypt the S-expression S_CIPHER with the key S_SKEY or, if
+   SHADOW_INFO is not NULL, with the card key for the keygrip in CTRL
+   and write the result to OUTBUF.  CIPHERTEXT is the canonical
+   encoded S_CIPHER.  The padding information is stored at R_PADDING
+   with -1 for not known.  */
+static gpg_error_t
+do_pkdecrypt (ctrl_t ctrl, const char *desc_text,
+              gcry_sexp_t s_skey, const unsigned char *shadow_info,
+              const unsigned char *ciphertext, size_t ciphertextlen,
+              gcry_sexp_t s_cipher, membuf_t *outbuf, int *r_padding)
+{
+  gcry_sexp_t s_plain = NULL;
+  int rc;
+  char *buf = NULL;
+  size_t len;
+
+  *r_padding = -1;
+
+  if (shadow_info)
+    { /* divert operation to the smartcard */
+
+      if (!gcry_sexp_canon_len (ciphertext, ciphertextlen, NULL, NULL))
+        {
+          rc = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+
+      rc = divert_pkdecrypt (ctrl, desc_text, ctrl->keygrip, ciphertext,
+                             shadow_info, &buf, &len, r_padding);
+      if (rc)
+        {
+          log_error ("smartcard decryption failed: %s\n", gpg_strerror (rc));
+          goto leave;
+        }
+
+      put_membuf_printf (outbuf, "(5:value%u:", (unsigned int)len);
+      put_membuf (outbuf, buf, len);
+      put_membuf (outbuf, ")", 2);
+    }
+  else
+    { /* No smartcard, but a private key */
+/*       if (DBG_CRYPTO ) */
+/*         { */
+/*           log_debug ("skey: "); */
+/*           gcry_sexp_dump (s_skey); */
+/*         } */
+
+      rc = workpool_pk_decrypt (&s_plain, s_cipher, s_skey);
+      if (rc)
+        {
+          log_error ("decryption failed: %s\n", gpg_strerror (rc));
+          goto leave;
+        }
+
+      put_plain_sexp (s_plain, outbuf);
+    }
+
+ leave:
+  gcry_sexp_release (s_plain);
+  xfree (buf);
+  return rc;
+}
+
+
 /* DECRYPT the stuff in ciphertext which is expected to be a S-Exp.
    Try to get the key from CTRL and write the decoded stuff back to
    OUTFP.   The padding information is stored at R_PADDING with -1
@@ -38,11 +135,9 @@ agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
                  const unsigned char *ciphertext, size_t ciphertextlen,
                  membuf_t *outbuf, int *r_padding)
 {
-  gcry_sexp_t s_skey = NULL, s_cipher = NULL, s_plain = NULL;
+  gcry_sexp_t s_skey = NULL, s_cipher = NULL;
   unsigned char *shadow_info = NULL;
   int rc;
-  char *buf = NULL;
-  size_t len;
 
   *r_padding = -1;
 
@@ -76,70 +171,251 @@ agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
       goto leave;
     }
 
-  if (shadow_info)
-    { /* divert operation to the smartcard */
+  rc = do_pkdecrypt (ctrl, desc_text, s_skey, shadow_info,
+                     ciphertext, ciphertextlen, s_cipher, outbuf, r_padding);
 
-      if (!gcry_sexp_canon_len (ciphertext, ciphertextlen, NULL, NULL))
+ leave:
+  gcry_sexp_release (s_skey);
+  gcry_sexp_release (s_cipher);
+  xfree (shadow_info);
+  return rc;
+}
+
+
+/* Decrypt the concatenated canonical encoded S-expressions of
+   CIPHERTEXTSLEN bytes at CIPHERTEXTS with the key from CTRL.  The
+   key is read and unprotected only once.  For each ciphertext CB is
+   called with OPAQUE, the index of the ciphertext, the result as
+   canonical S-expression, and the padding information; an error
+   returned by CB stops the batch.  */
+gpg_error_t
+agent_pkdecrypt_batch (ctrl_t ctrl, const char *desc_text,
+                       const unsigned char *ciphertexts,
+                       size_t ciphertextslen,
+                       gpg_error_t (*cb)(void *opaque, unsigned int idx,
+                                         const void *plain, size_t plainlen,
+                                         int padding),
+                       void *opaque)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_skey = NULL;
+  gcry_sexp_t s_cipher = NULL;
+  unsigned char *shadow_info = NULL;
+  membuf_t outbuf;
+  char *buf;
+  size_t off, n, len, buflen;
+  unsigned int idx;
+  int padding;
+
+  if (!ctrl->have_keygrip)
+    {
+      log_error ("speculative decryption not yet supported\n");
+      return gpg_error (GPG_ERR_NO_SECKEY);
+    }
+
+  err = agent_key_from_file (ctrl, NULL, desc_text,
+                             ctrl->keygrip, &shadow_info,
+                             CACHE_MODE_NORMAL, NULL, &s_skey, NULL);
+  if (err)
+    {
+      if (gpg_err_code (err) != GPG_ERR_NO_SECKEY)
+        log_error ("failed to read the secret key\n");
+      goto leave;
+    }
+
+  for (off=0, idx=0; off < ciphertextslen; off += n, idx++)
+    {
+      n = gcry_sexp_canon_len (ciphertexts + off, ciphertextslen - off,
+                               NULL, NULL);
+      if (!n)
         {
-          rc = gpg_error (GPG_ERR_INV_SEXP);
+          err = gpg_error (GPG_ERR_INV_SEXP);
           goto leave;
         }
-
-      rc = divert_pkdecrypt (ctrl, desc_text, ctrl->keygrip, ciphertext,
-                             shadow_info, &buf, &len, r_padding);
-      if (rc)
+      err = gcry_sexp_sscan (&s_cipher, NULL,
+                             (const char*)ciphertexts + off, n);
+      if (err)
         {
-          log_error ("smartcard decryption failed: %s\n", gpg_strerror (rc));
+          log_error ("failed to convert ciphertext: %s\n", gpg_strerror (err));
+          err = gpg_error (GPG_ERR_INV_DATA);
           goto leave;
         }
 
-      put_membuf_printf (outbuf, "(5:value%u:", (unsigned int)len);
-      put_membuf (outbuf, buf, len);
-      put_membuf (outbuf, ")", 2);
+      init_membuf_secure (&outbuf, 1024);
+      err = do_pkdecrypt (ctrl, desc_text, s_skey, shadow_info,
+                          ciphertexts + off, n, s_cipher, &outbuf, &padding);
+      gcry_sexp_release (s_cipher);
+      s_cipher = NULL;
+      buf = get_membuf (&outbuf, &buflen);
+      if (!err && !buf)
+        err = gpg_error_from_syserror ();
+      if (!err)
+        {
+          /* Strip the Nul which may follow the S-expression.  */
+          len = gcry_sexp_canon_len (buf, buflen, NULL, NULL);
+          if (!len)
+            err = gpg_error (GPG_ERR_INV_SEXP);
+          else
+            err = cb (opaque, idx, buf, len, padding);
+        }
+      if (buf)
+        {
+          wipememory (buf, buflen);
+          xfree (buf);
+        }
+      if (err)
+        goto leave;
     }
-  else
-    { /* No smartcard, but a private key */
-/*       if (DBG_CRYPTO ) */
-/*         { */
-/*           log_debug ("skey: "); */
-/*           gcry_sexp_dump (s_skey); */
-/*         } */
 
-      rc = gcry_pk_decrypt (&s_plain, s_cipher, s_skey);
-      if (rc)
+ leave:
+  gcry_sexp_release (s_skey);
+  gcry_sexp_release (s_cipher);
+  xfree (shadow_info);
+  return err;
+}
+
+
+/* Trial decrypt the canonical encoded S-expression CIPHERTEXT with
+   each of the NGRIPS keys given by their keygrips GRIPS.  This is
+   used for messages with hidden recipients.  Only keys which can be
+   used without user interaction are tried: Keys stored on a
+   smartcard are skipped with GPG_ERR_NOT_SUPPORTED and protected keys
+   without a cached passphrase return a cancel error.  All usable keys
+   are tried concurrently using the worker pool.  For each key CB is
+   called in the order of GRIPS with OPAQUE, the index of the key, an
+   error code and, on success, the result as canonical S-expression.
+   An error returned by CB stops the processing.  */
+gpg_error_t
+agent_pkdecrypt_trial (ctrl_t ctrl,
+                       const unsigned char (*grips)[20], unsigned int ngrips,
+                       const unsigned char *ciphertext, size_t ciphertextlen,
+                       gpg_error_t (*cb)(void *opaque, unsigned int idx,
+                                         gpg_error_t keyerr,
+                                         const void *plain, size_t plainlen),
+                       void *opaque)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_cipher = NULL;
+  gcry_sexp_t *s_skeys = NULL;
+  gcry_sexp_t *s_plains = NULL;
+  gpg_error_t *errs = NULL;
+  unsigned int *map = NULL;
+  unsigned int i, j, nkeys;
+  pinentry_mode_t saved_pinentry_mode;
+  int keytype;
+  membuf_t outbuf;
+  char *buf;
+  size_t len, buflen;
+
+  err = gcry_sexp_sscan (&s_cipher, NULL, (const char*)ciphertext,
+                         ciphertextlen);
+  if (err)
+    {
+      log_error ("failed to convert ciphertext: %s\n", gpg_strerror (err));
+      return gpg_error (GPG_ERR_INV_DATA);
+    }
+
+  s_skeys = xtrycalloc (ngrips, sizeof *s_skeys);
+  s_plains = xtrycalloc (ngrips, sizeof *s_plains);
+  errs = xtrycalloc (ngrips, sizeof *errs);
+  map = xtrycalloc (ngrips, sizeof *map);
+  if (!s_skeys || !s_plains || !errs || !map)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Load all keys which can be used without asking the user.  Using
+     the cancel mode for the pinentry makes sure that we won't pop up
+     a passphrase prompt in case the cache expired meanwhile.  */
+  saved_pinentry_mode = ctrl->pinentry_mode;
+  ctrl->pinentry_mode = PINENTRY_MODE_CANCEL;
+  for (i=nkeys=0; i < ngrips; i++)
+    {
+      errs[i] = agent_key_info_from_file (ctrl, grips[i], &keytype, NULL);
+      if (errs[i])
+        continue;
+      if (keytype == PRIVATE_KEY_SHADOWED)
         {
-          log_error ("decryption failed: %s\n", gpg_strerror (rc));
+          errs[i] = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          continue;
+        }
+      errs[i] = agent_key_from_file (ctrl, NULL, NULL, grips[i], NULL,
+                                     CACHE_MODE_NORMAL, NULL,
+                                     &s_skeys[nkeys], NULL);
+      if (errs[i])
+        continue;
+      map[nkeys++] = i;
+    }
+  ctrl->pinentry_mode = saved_pinentry_mode;
+
+  if (DBG_CRYPTO)
+    log_debug ("trial decryption with %u of %u keys\n", nkeys, ngrips);
+
+  /* Decrypt with all loaded keys concurrently.  MAP gives the index
+     into GRIPS for each loaded key.  */
+  if (nkeys)
+    {
+      gpg_error_t *keyerrs;
+
+      keyerrs = xtrycalloc (nkeys, sizeof *keyerrs);
+      if (!keyerrs)
+        {
+          err = gpg_error_from_syserror ();
           goto leave;
         }
+      workpool_pk_decrypt_many (s_cipher, s_skeys, nkeys, s_plains, keyerrs);
+      for (i=0; i < nkeys; i++)
+        errs[map[i]] = keyerrs[i];
+      xfree (keyerrs);
+    }
+
+  for (i=j=0; i < ngrips; i++)
+    {
+      gcry_sexp_t s_plain = NULL;
+
+      if (j < nkeys && map[j] == i)
+        s_plain = s_plains[j++];
 
-      if (DBG_CRYPTO)
+      if (errs[i] || !s_plain)
         {
-          log_debug ("plain: ");
-          gcry_sexp_dump (s_plain);
+          err = cb (opaque, i, errs[i]? errs[i] : gpg_error (GPG_ERR_NO_SECKEY),
+                    NULL, 0);
+          if (err)
+            goto leave;
+          continue;
         }
-      len = gcry_sexp_sprint (s_plain, GCRYSEXP_FMT_CANON, NULL, 0);
-      log_assert (len);
-      buf = xmalloc (len);
-      len = gcry_sexp_sprint (s_plain, GCRYSEXP_FMT_CANON, buf, len);
-      log_assert (len);
-      if (*buf == '(')
-        put_membuf (outbuf, buf, len);
+
+      init_membuf_secure (&outbuf, 1024);
+      put_plain_sexp (s_plain, &outbuf);
+      buf = get_membuf (&outbuf, &buflen);
+      if (!buf)
+        err = gpg_error_from_syserror ();
       else
         {
-          /* Old style libgcrypt: This is only an S-expression
-             part. Turn it into a complete S-expression. */
-          put_membuf (outbuf, "(5:value", 8);
-          put_membuf (outbuf, buf, len);
-          put_membuf (outbuf, ")", 2);
+          len = gcry_sexp_canon_len (buf, buflen, NULL, NULL);
+          if (!len)
+            err = gpg_error (GPG_ERR_INV_SEXP);
+          else
+            err = cb (opaque, i, 0, buf, len);
+          wipememory (buf, buflen);
+          xfree (buf);
         }
+      if (err)
+        goto leave;
     }
 
-
  leave:
-  gcry_sexp_release (s_skey);
-  gcry_sexp_release (s_plain);
+  if (s_skeys)
+    for (i=0; i < ngrips; i++)
+      gcry_sexp_release (s_skeys[i]);
+  if (s_plains)
+    for (i=0; i < ngrips; i++)
+      gcry_sexp_release (s_plains[i]);
+  xfree (s_skeys);
+  xfree (s_plains);
+  xfree (errs);
+  xfree (map);
   gcry_sexp_release (s_cipher);
-  xfree (buf);
-  xfree (shadow_info);
-  return rc;
+  return err;
 }
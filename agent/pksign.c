@@ -273,56 +273,61 @@ do_encode_raw_pkcs1 (const byte *md, size_t mdlen, unsigned int nbits,
 
 
 
-/* SIGN whatever information we have accumulated in CTRL and return
- * the signature S-expression.  LOOKUP is an optional function to
- * provide a way for lower layers to ask for the caching TTL.  If a
- * CACHE_NONCE is given that cache item is first tried to get a
- * passphrase.  If OVERRIDEDATA is not NULL, OVERRIDEDATALEN bytes
- * from this buffer are used instead of the data in CTRL.  The
- * override feature is required to allow the use of Ed25519 with ssh
- * because Ed25519 does the hashing itself.  */
-gpg_error_t
-agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
-                 const char *desc_text,
-		 gcry_sexp_t *signature_sexp,
-                 cache_mode_t cache_mode, lookup_ttl_t lookup_ttl,
-                 const void *overridedata, size_t overridedatalen)
+/* Sign DATALEN bytes at DATA with the secret key S_SKEY or, if
+ * SHADOW_INFO is given or NO_SHADOW_INFO is set, with the card key for
+ * the keygrip in CTRL and return the signature S-expression.  The
+ * hash algorithm is taken from CTRL.  */
+/* Encode the hash DATA of DATALEN bytes for signing with the
+ * software key S_SKEY using the hash algorithm from CTRL and store it
+ * at R_HASH.  R_CHECK is set if the signature needs to be verified
+ * after creation.  */
+static gpg_error_t
+encode_hash_for_skey (ctrl_t ctrl, gcry_sexp_t s_skey,
+                      const unsigned char *data, int datalen,
+                      gcry_sexp_t *r_hash, int *r_check)
 {
-  gpg_error_t err = 0;
-  gcry_sexp_t s_skey = NULL;
-  gcry_sexp_t s_sig  = NULL;
-  gcry_sexp_t s_hash = NULL;
-  gcry_sexp_t s_pkey = NULL;
-  unsigned char *shadow_info = NULL;
-  int no_shadow_info = 0;
-  const unsigned char *data;
-  int datalen;
-  int check_signature = 0;
-
-  if (overridedata)
-    {
-      data = overridedata;
-      datalen = overridedatalen;
-    }
+  gpg_error_t err;
+  int dsaalgo = 0;
+
+  *r_check = 0;
+  if (agent_is_eddsa_key (s_skey))
+    err = do_encode_eddsa (data, datalen,
+                           r_hash);
+  else if (ctrl->digest.algo == MD_USER_TLS_MD5SHA1)
+    err = do_encode_raw_pkcs1 (data, datalen,
+                               gcry_pk_get_nbits (s_skey),
+                               r_hash);
+  else if ( (dsaalgo = agent_is_dsa_key (s_skey)) )
+    err = do_encode_dsa (data, datalen,
+                         dsaalgo, s_skey,
+                         r_hash);
   else
+    err = do_encode_md (data, datalen,
+                        ctrl->digest.algo,
+                        r_hash,
+                        ctrl->digest.raw_value);
+
+  if (!err && dsaalgo == 0 && GCRYPT_VERSION_NUMBER < 0x010700)
     {
-      data = ctrl->digest.value;
-      datalen = ctrl->digest.valuelen;
+      /* It's RSA and Libgcrypt < 1.7 */
+      *r_check = 1;
     }
 
-  if (!ctrl->have_keygrip)
-    return gpg_error (GPG_ERR_NO_SECKEY);
+  return err;
+}
 
-  err = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
-                             &shadow_info, cache_mode, lookup_ttl,
-                             &s_skey, NULL);
-  if (gpg_err_code (err) == GPG_ERR_NO_SECKEY)
-    no_shadow_info = 1;
-  else if (err)
-    {
-      log_error ("failed to read the secret key\n");
-      goto leave;
-    }
+
+static gpg_error_t
+do_pksign (ctrl_t ctrl, const char *desc_text, gcry_sexp_t s_skey,
+           const unsigned char *shadow_info, int no_shadow_info,
+           const unsigned char *data, int datalen,
+           gcry_sexp_t *signature_sexp)
+{
+  gpg_error_t err = 0;
+  gcry_sexp_t s_sig  = NULL;
+  gcry_sexp_t s_hash = NULL;
+  gcry_sexp_t s_pkey = NULL;
+  int check_signature = 0;
 
   if (shadow_info || no_shadow_info)
     {
@@ -496,34 +501,13 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
   else
     {
       /* No smartcard, but a private key (in S_SKEY). */
-      int dsaalgo = 0;
 
       /* Put the hash into a sexp */
-      if (agent_is_eddsa_key (s_skey))
-        err = do_encode_eddsa (data, datalen,
-                               &s_hash);
-      else if (ctrl->digest.algo == MD_USER_TLS_MD5SHA1)
-        err = do_encode_raw_pkcs1 (data, datalen,
-                                   gcry_pk_get_nbits (s_skey),
-                                   &s_hash);
-      else if ( (dsaalgo = agent_is_dsa_key (s_skey)) )
-        err = do_encode_dsa (data, datalen,
-                             dsaalgo, s_skey,
-                             &s_hash);
-      else
-        err = do_encode_md (data, datalen,
-                            ctrl->digest.algo,
-                            &s_hash,
-                            ctrl->digest.raw_value);
+      err = encode_hash_for_skey (ctrl, s_skey, data, datalen,
+                                  &s_hash, &check_signature);
       if (err)
         goto leave;
 
-      if (dsaalgo == 0 && GCRYPT_VERSION_NUMBER < 0x010700)
-        {
-          /* It's RSA and Libgcrypt < 1.7 */
-          check_signature = 1;
-        }
-
       if (DBG_CRYPTO)
         {
           gcry_log_debugsxp ("skey", s_skey);
@@ -531,7 +515,7 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
         }
 
       /* sign */
-      err = gcry_pk_sign (&s_sig, s_hash, s_skey);
+      err = workpool_pk_sign (&s_sig, s_hash, s_skey);
       if (err)
         {
           log_error ("signing failed: %s\n", gpg_strerror (err));
@@ -562,7 +546,7 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
         }
 
       if (!err)
-        err = gcry_pk_verify (s_sig, s_hash, sexp_key);
+        err = workpool_pk_verify (s_sig, s_hash, sexp_key);
 
       if (err)
         {
@@ -578,8 +562,68 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
   *signature_sexp = s_sig;
 
   gcry_sexp_release (s_pkey);
-  gcry_sexp_release (s_skey);
   gcry_sexp_release (s_hash);
+
+  return err;
+}
+
+
+/* SIGN whatever information we have accumulated in CTRL and return
+ * the signature S-expression.  LOOKUP is an optional function to
+ * provide a way for lower layers to ask for the caching TTL.  If a
+ * CACHE_NONCE is given that cache item is first tried to get a
+ * passphrase.  If OVERRIDEDATA is not NULL, OVERRIDEDATALEN bytes
+ * from this buffer are used instead of the data in CTRL.  The
+ * override feature is required to allow the use of Ed25519 with ssh
+ * because Ed25519 does the hashing itself.  */
+gpg_error_t
+agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
+                 const char *desc_text,
+		 gcry_sexp_t *signature_sexp,
+                 cache_mode_t cache_mode, lookup_ttl_t lookup_ttl,
+                 const void *overridedata, size_t overridedatalen)
+{
+  gpg_error_t err = 0;
+  gcry_sexp_t s_skey = NULL;
+  gcry_sexp_t s_sig  = NULL;
+  unsigned char *shadow_info = NULL;
+  int no_shadow_info = 0;
+  const unsigned char *data;
+  int datalen;
+
+  if (overridedata)
+    {
+      data = overridedata;
+      datalen = overridedatalen;
+    }
+  else
+    {
+      data = ctrl->digest.value;
+      datalen = ctrl->digest.valuelen;
+    }
+
+  if (!ctrl->have_keygrip)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+
+  err = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
+                             &shadow_info, cache_mode, lookup_ttl,
+                             &s_skey, NULL);
+  if (gpg_err_code (err) == GPG_ERR_NO_SECKEY)
+    no_shadow_info = 1;
+  else if (err)
+    {
+      log_error ("failed to read the secret key\n");
+      goto leave;
+    }
+
+  err = do_pksign (ctrl, desc_text, s_skey, shadow_info, no_shadow_info,
+                   data, datalen, &s_sig);
+
+ leave:
+
+  *signature_sexp = s_sig;
+
+  gcry_sexp_release (s_skey);
   xfree (shadow_info);
 
   return err;
@@ -621,3 +665,229 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
 
   return err;
 }
+
+
+/* Sign the NDIGESTS digests of DIGESTLEN bytes each at DIGESTS with
+ * the key set in CTRL using the hash algorithm from CTRL.  The key is
+ * read and unprotected only once for all digests.  For each
+ * signature CB is called with OPAQUE and the signature as canonical
+ * encoded S-expression; an error returned by CB stops the batch.  */
+gpg_error_t
+agent_pksign_batch (ctrl_t ctrl, const char *cache_nonce,
+                    const char *desc_text, cache_mode_t cache_mode,
+                    const unsigned char *digests, size_t digestlen,
+                    size_t ndigests,
+                    gpg_error_t (*cb)(void *opaque,
+                                      const void *sig, size_t siglen),
+                    void *opaque)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_skey = NULL;
+  gcry_sexp_t s_sig = NULL;
+  unsigned char *shadow_info = NULL;
+  int no_shadow_info = 0;
+  char *buf = NULL;
+  size_t len, idx;
+
+  if (!ctrl->have_keygrip)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+
+  err = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
+                             &shadow_info, cache_mode, NULL, &s_skey, NULL);
+  if (gpg_err_code (err) == GPG_ERR_NO_SECKEY)
+    no_shadow_info = 1;
+  else if (err)
+    {
+      log_error ("failed to read the secret key\n");
+      goto leave;
+    }
+
+  for (idx=0; idx < ndigests; idx++)
+    {
+      err = do_pksign (ctrl, desc_text, s_skey, shadow_info, no_shadow_info,
+                       digests + idx * digestlen, digestlen, &s_sig);
+      if (err)
+        goto leave;
+
+      len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, NULL, 0);
+      log_assert (len);
+      buf = xtrymalloc (len);
+      if (!buf)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, buf, len);
+      log_assert (len);
+      gcry_sexp_release (s_sig);
+      s_sig = NULL;
+
+      err = cb (opaque, buf, len);
+      xfree (buf);
+      buf = NULL;
+      if (err)
+        goto leave;
+    }
+
+ leave:
+  gcry_sexp_release (s_sig);
+  gcry_sexp_release (s_skey);
+  xfree (shadow_info);
+  xfree (buf);
+  return err;
+}
+
+
+/* Sign the NJOBS jobs JOBS, each with its own key, hash algorithm and
+ * description.  Keys are read and unprotected one after the other,
+ * which also serializes pinentry prompts and smartcard operations;
+ * the signatures with software keys are then created concurrently by
+ * the worker pool.  For each job CB is called in order with OPAQUE,
+ * the index of the job and the signature as canonical encoded
+ * S-expression; an error returned by CB stops the processing.  The
+ * first error of any job is returned.  */
+gpg_error_t
+agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                    cache_mode_t cache_mode,
+                    struct pksign_multi_job_s *jobs, unsigned int njobs,
+                    gpg_error_t (*cb)(void *opaque, unsigned int idx,
+                                      const void *sig, size_t siglen),
+                    void *opaque)
+{
+  gpg_error_t err = 0;
+  gcry_sexp_t *s_sigs, *s_skeys, *s_hashes, *sw_sigs;
+  gpg_error_t *sw_errs;
+  unsigned int *map;
+  int *checks;
+  unsigned char *shadow_info;
+  unsigned char saved_keygrip[KEYGRIP_LEN];
+  int saved_have_keygrip;
+  unsigned int i, n;
+  char *buf = NULL;
+  size_t len;
+
+  memcpy (saved_keygrip, ctrl->keygrip, KEYGRIP_LEN);
+  saved_have_keygrip = ctrl->have_keygrip;
+
+  s_sigs = xtrycalloc (njobs, sizeof *s_sigs);
+  s_skeys = xtrycalloc (njobs, sizeof *s_skeys);
+  s_hashes = xtrycalloc (njobs, sizeof *s_hashes);
+  sw_sigs = xtrycalloc (njobs, sizeof *sw_sigs);
+  sw_errs = xtrycalloc (njobs, sizeof *sw_errs);
+  map = xtrycalloc (njobs, sizeof *map);
+  checks = xtrycalloc (njobs, sizeof *checks);
+  if (!s_sigs || !s_skeys || !s_hashes || !sw_sigs || !sw_errs
+      || !map || !checks)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Get all keys.  Smartcard keys are used right away; for software
+   * keys only the hash is prepared.  */
+  for (i=n=0; i < njobs; i++)
+    {
+      gcry_sexp_t s_skey = NULL;
+      int no_shadow_info = 0;
+
+      memcpy (ctrl->keygrip, jobs[i].grip, KEYGRIP_LEN);
+      ctrl->have_keygrip = 1;
+      ctrl->digest.algo = jobs[i].algo;
+      ctrl->digest.raw_value = 0;
+      memcpy (ctrl->digest.value, jobs[i].digest, jobs[i].digestlen);
+      ctrl->digest.valuelen = jobs[i].digestlen;
+
+      shadow_info = NULL;
+      err = agent_key_from_file (ctrl, cache_nonce, jobs[i].desc,
+                                 ctrl->keygrip, &shadow_info, cache_mode,
+                                 NULL, &s_skey, NULL);
+      if (gpg_err_code (err) == GPG_ERR_NO_SECKEY)
+        no_shadow_info = 1;
+      else if (err)
+        {
+          log_error ("failed to read the secret key\n");
+          goto leave;
+        }
+
+      if (shadow_info || no_shadow_info)
+        {
+          err = do_pksign (ctrl, jobs[i].desc, s_skey, shadow_info,
+                           no_shadow_info, jobs[i].digest, jobs[i].digestlen,
+                           &s_sigs[i]);
+          gcry_sexp_release (s_skey);
+          xfree (shadow_info);
+          if (err)
+            goto leave;
+          continue;
+        }
+
+      s_skeys[n] = s_skey;
+      err = encode_hash_for_skey (ctrl, s_skey,
+                                  jobs[i].digest, jobs[i].digestlen,
+                                  &s_hashes[n], &checks[n]);
+      map[n++] = i;
+      if (err)
+        goto leave;
+    }
+
+  /* Create the signatures with software keys concurrently.  */
+  if (n)
+    workpool_pk_sign_many (s_hashes, s_skeys, n, sw_sigs, sw_errs);
+  for (i=0; i < n; i++)
+    {
+      err = sw_errs[i];
+      if (!err && checks[i])
+        err = workpool_pk_verify (sw_sigs[i], s_hashes[i], s_skeys[i]);
+      if (err)
+        {
+          log_error ("signing failed: %s\n", gpg_strerror (err));
+          goto leave;
+        }
+      s_sigs[map[i]] = sw_sigs[i];
+      sw_sigs[i] = NULL;
+    }
+
+  /* Return the signatures in order.  */
+  for (i=0; i < njobs; i++)
+    {
+      len = gcry_sexp_sprint (s_sigs[i], GCRYSEXP_FMT_CANON, NULL, 0);
+      log_assert (len);
+      buf = xtrymalloc (len);
+      if (!buf)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      len = gcry_sexp_sprint (s_sigs[i], GCRYSEXP_FMT_CANON, buf, len);
+      log_assert (len);
+
+      err = cb (opaque, i, buf, len);
+      xfree (buf);
+      buf = NULL;
+      if (err)
+        goto leave;
+    }
+
+ leave:
+  for (i=0; i < njobs; i++)
+    {
+      if (s_sigs)
+        gcry_sexp_release (s_sigs[i]);
+      if (s_skeys)
+        gcry_sexp_release (s_skeys[i]);
+      if (s_hashes)
+        gcry_sexp_release (s_hashes[i]);
+      if (sw_sigs)
+        gcry_sexp_release (sw_sigs[i]);
+    }
+  xfree (s_sigs);
+  xfree (s_skeys);
+  xfree (s_hashes);
+  xfree (sw_sigs);
+  xfree (sw_errs);
+  xfree (map);
+  xfree (checks);
+  memcpy (ctrl->keygrip, saved_keygrip, KEYGRIP_LEN);
+  ctrl->have_keygrip = saved_have_keygrip;
+  return err;
+}
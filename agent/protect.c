@@ -42,6 +42,12 @@
 #include "cvt-openpgp.h"
 #include "../common/sexp-parse.h"
 #include "../common/openpgpdefs.h"  /* For s2k functions.  */
+#include "../common/sysutils.h"
+
+
+/* The name of the file in the homedir used to keep the calibrated
+ * S2K count across restarts.  */
+#define S2K_CALIBRATION_NAME "s2k-calibration"
 
 
 /* The protection mode for encryption.  The supported modes for
@@ -75,6 +81,9 @@ static const struct {
 static unsigned int s2k_calibration_time = AGENT_S2K_CALIBRATION;
 static unsigned long s2k_calibrated_count;
 
+/* If set the calibrated count is stored in the homedir.  */
+static int s2k_calibration_file_enabled;
+
 
 /* A helper object for time measurement.  */
 struct calibrate_time_s
@@ -168,9 +177,11 @@ calibrate_s2k_count_one (unsigned long count)
 
 
 /* Measure the time we need to do the hash operations and deduce an
-   S2K count which requires roughly some targeted amount of time.  */
+   S2K count which requires roughly MSTIME milliseconds.  With QUIET
+   set nothing is logged and the function may be called without
+   holding the nPth lock.  */
 static unsigned long
-calibrate_s2k_count (void)
+calibrate_s2k_count (unsigned int mstime, int quiet)
 {
   unsigned long count;
   unsigned long ms;
@@ -178,19 +189,19 @@ calibrate_s2k_count (void)
   for (count = 65536; count; count *= 2)
     {
       ms = calibrate_s2k_count_one (count);
-      if (opt.verbose > 1)
+      if (!quiet && opt.verbose > 1)
         log_info ("S2K calibration: %lu -> %lums\n", count, ms);
-      if (ms > s2k_calibration_time)
+      if (ms > mstime)
         break;
     }
 
-  count = (unsigned long)(((double)count / ms) * s2k_calibration_time);
+  count = (unsigned long)(((double)count / ms) * mstime);
   count /= 1024;
   count *= 1024;
   if (count < 65536)
     count = 65536;
 
-  if (opt.verbose)
+  if (!quiet && opt.verbose)
     {
       ms = calibrate_s2k_count_one (count);
       log_info ("S2K calibration: %lu -> %lums\n", count, ms);
@@ -200,6 +211,185 @@ calibrate_s2k_count (void)
 }
 
 
+/* Return a string identifying the machine and the Libgcrypt version
+ * for which a calibration is valid or NULL on error.  We use the
+ * hardware features detected by Libgcrypt and, if available, the CPU
+ * model so that a homedir shared by different machines or a copied
+ * homedir is calibrated again.  The hostname is not used because it
+ * changes with every start of a container.  */
+static char *
+calibration_stamp (void)
+{
+  gcry_md_hd_t md;
+  estream_t fp;
+  char line[256];
+  char *hwflags;
+  char *result;
+
+  if (gcry_md_open (&md, GCRY_MD_SHA1, 0))
+    return NULL;
+  gcry_md_write (md, gcry_check_version (NULL),
+                 strlen (gcry_check_version (NULL)));
+  hwflags = gcry_get_config (0, "hwflags");
+  if (hwflags)
+    {
+      gcry_md_write (md, hwflags, strlen (hwflags));
+      gcry_free (hwflags);
+    }
+  fp = es_fopen ("/proc/cpuinfo", "r");
+  if (fp)
+    {
+      while (es_fgets (line, sizeof line, fp))
+        if (!strncmp (line, "model name", 10))
+          {
+            gcry_md_write (md, line, strlen (line));
+            break;
+          }
+      es_fclose (fp);
+    }
+
+  result = xtrymalloc (2*20+1);
+  if (result)
+    bin2hex (gcry_md_read (md, GCRY_MD_SHA1), 20, result);
+  gcry_md_close (md);
+  return result;
+}
+
+
+/* Return the count stored in the calibration file or 0 if there is no
+ * valid one.  The file has one line with the calibration time, the
+ * stamp as returned by calibration_stamp and the count.  */
+static unsigned long
+read_s2k_calibration (void)
+{
+  char *fname, *stamp;
+  estream_t fp;
+  char line[256];
+  char *fields[3];
+  unsigned long count = 0;
+
+  fname = make_filename_try (gnupg_homedir (), S2K_CALIBRATION_NAME, NULL);
+  if (!fname)
+    return 0;
+  fp = es_fopen (fname, "r");
+  xfree (fname);
+  if (!fp)
+    return 0;
+  if (!es_fgets (line, sizeof line, fp))
+    *line = 0;
+  es_fclose (fp);
+
+  trim_spaces (line);
+  stamp = calibration_stamp ();
+  if (stamp
+      && split_fields (line, fields, DIM (fields)) == 3
+      && strtoul (fields[0], NULL, 10) == s2k_calibration_time
+      && !strcmp (fields[1], stamp))
+    {
+      count = strtoul (fields[2], NULL, 10);
+      if (count < 65536 || count > 0xffffffff)
+        count = 0;
+    }
+  xfree (stamp);
+
+  if (count && opt.verbose)
+    log_info ("S2K calibration: using stored count %lu\n", count);
+  return count;
+}
+
+
+/* Store COUNT in the calibration file.  Errors are only logged
+ * because we can calibrate again at the next start.  */
+static void
+write_s2k_calibration (unsigned long count)
+{
+  gpg_error_t err;
+  char *fname = NULL;
+  char *tmpfname = NULL;
+  char *stamp;
+  estream_t fp;
+
+  stamp = calibration_stamp ();
+  if (!stamp)
+    return;
+  fname = make_filename_try (gnupg_homedir (), S2K_CALIBRATION_NAME, NULL);
+  if (fname)
+    tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!fname || !tmpfname)
+    goto leave;
+
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_info ("can't create '%s': %s\n", tmpfname, gpg_strerror (err));
+      goto leave;
+    }
+  es_fprintf (fp, "%u %s %lu\n", s2k_calibration_time, stamp, count);
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_info ("error writing '%s': %s\n", tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    {
+      log_info ("error renaming '%s': %s\n", tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (stamp);
+}
+
+
+/* Store the calibrated count in the homedir so that the agent doesn't
+ * need to calibrate again after a restart.  This is not done by
+ * default because the module is also used by tools and tests.  */
+void
+enable_s2k_calibration_file (void)
+{
+  s2k_calibration_file_enabled = 1;
+}
+
+
+/* Make sure that a calibrated count is available.  This is used to
+ * do the calibration in a background thread at startup: UNPROTECT is
+ * called before and PROTECT after the actual measurement so that
+ * other threads can run meanwhile.  */
+void
+prepare_s2k_calibration (void (*unprotect)(void), void (*protect)(void))
+{
+  unsigned int mstime;
+  unsigned long count;
+
+  if (s2k_calibrated_count)
+    return;
+  if (s2k_calibration_file_enabled
+      && (s2k_calibrated_count = read_s2k_calibration ()))
+    return;
+
+  mstime = s2k_calibration_time;
+  unprotect ();
+  count = calibrate_s2k_count (mstime, 1);
+  protect ();
+
+  /* Someone might have been faster or changed the calibration time
+   * while we were not holding the lock.  */
+  if (s2k_calibrated_count || mstime != s2k_calibration_time)
+    return;
+  if (opt.verbose)
+    log_info ("S2K calibration: %lu (%ums)\n", count, mstime);
+  s2k_calibrated_count = count;
+  if (s2k_calibration_file_enabled)
+    write_s2k_calibration (count);
+}
+
+
 /* Set the calibration time.  This may be called early at startup or
  * at any time.  Thus it should one set variables.  */
 void
@@ -219,8 +409,14 @@ set_s2k_calibration_time (unsigned int milliseconds)
 unsigned long
 get_calibrated_s2k_count (void)
 {
+  if (!s2k_calibrated_count && s2k_calibration_file_enabled)
+    s2k_calibrated_count = read_s2k_calibration ();
   if (!s2k_calibrated_count)
-    s2k_calibrated_count = calibrate_s2k_count ();
+    {
+      s2k_calibrated_count = calibrate_s2k_count (s2k_calibration_time, 0);
+      if (s2k_calibration_file_enabled)
+        write_s2k_calibration (s2k_calibrated_count);
+    }
 
   /* Enforce a lower limit.  */
   return s2k_calibrated_count < 65536 ? 65536 : s2k_calibrated_count;
@@ -768,13 +964,17 @@ agent_protect (const unsigned char *plainkey, const char *passphrase,
 
 
 
-/* Do the actual decryption and check the return list for consistency.  */
+/* Do the actual decryption and check the return list for consistency.
+   If KEK is not NULL and holds a key for S2KSALT and S2KCOUNT that
+   key is used instead of hashing PASSPHRASE; otherwise the key
+   derived from PASSPHRASE is stored there.  */
 static gpg_error_t
 do_decryption (const unsigned char *aad_begin, size_t aad_len,
                const unsigned char *aadhole_begin, size_t aadhole_len,
                const unsigned char *protected, size_t protectedlen,
                const char *passphrase,
                const unsigned char *s2ksalt, unsigned long s2kcount,
+               unprotect_kek_t kek,
                const unsigned char *iv, size_t ivlen,
                int prot_cipher, int prot_cipher_keylen, int is_ocb,
                unsigned char **result)
@@ -812,7 +1012,11 @@ do_decryption (const unsigned char *aad_begin, size_t aad_len,
     rc = out_of_core ();
 
   /* Hash the passphrase and set the key.  */
-  if (!rc)
+  if (!rc && kek && kek->is_set && kek->count == s2kcount
+      && kek->keylen == prot_cipher_keylen
+      && !memcmp (kek->salt, s2ksalt, 8))
+    rc = gcry_cipher_setkey (hd, kek->key, prot_cipher_keylen);
+  else if (!rc)
     {
       unsigned char *key;
 
@@ -825,6 +1029,15 @@ do_decryption (const unsigned char *aad_begin, size_t aad_len,
                                 3, s2ksalt, s2kcount, key, prot_cipher_keylen);
           if (!rc)
             rc = gcry_cipher_setkey (hd, key, prot_cipher_keylen);
+          if (!rc && kek && prot_cipher_keylen <= sizeof kek->key)
+            {
+              memcpy (kek->key, key, prot_cipher_keylen);
+              memcpy (kek->salt, s2ksalt, 8);
+              kek->count = s2kcount;
+              kek->keylen = prot_cipher_keylen;
+              kek->is_set = 1;
+              kek->is_new = 1;
+            }
           xfree (key);
         }
     }
@@ -1062,6 +1275,24 @@ agent_unprotect (ctrl_t ctrl,
                  const unsigned char *protectedkey, const char *passphrase,
                  gnupg_isotime_t protected_at,
                  unsigned char **result, size_t *resultlen)
+{
+  return agent_unprotect_with_kek (ctrl, protectedkey, passphrase, NULL,
+                                   protected_at, result, resultlen);
+}
+
+
+/* Same as agent_unprotect but with the derived key KEK.  If KEK
+   holds a key for the S2K parameters of PROTECTEDKEY it is used
+   instead of PASSPHRASE; this avoids the costly S2K function.
+   Otherwise or if that key does not work the key derived from
+   PASSPHRASE is stored at KEK and its IS_NEW flag is set.  On error
+   the content of KEK must not be used.  */
+gpg_error_t
+agent_unprotect_with_kek (ctrl_t ctrl,
+                          const unsigned char *protectedkey,
+                          const char *passphrase, unprotect_kek_t kek,
+                          gnupg_isotime_t protected_at,
+                          unsigned char **result, size_t *resultlen)
 {
   static const struct {
     const char *name; /* Name of the protection method. */
@@ -1094,6 +1325,8 @@ agent_unprotect (ctrl_t ctrl,
 
   if (protected_at)
     *protected_at = 0;
+  if (kek)
+    kek->is_new = 0;
 
   s = protectedkey;
   if (*s != '(')
@@ -1293,12 +1526,28 @@ agent_unprotect (ctrl_t ctrl,
   rc = do_decryption (aad_begin, aad_end - aad_begin,
                       aadhole_begin, aadhole_end - aadhole_begin,
                       s, n,
-                      passphrase, s2ksalt, s2kcount,
+                      passphrase, s2ksalt, s2kcount, kek,
                       iv, is_ocb? 12:16,
                       prot_cipher, prot_cipher_keylen, is_ocb,
                       &cleartext);
+  if (rc && kek && kek->is_set && !kek->is_new)
+    {
+      /* The given key did not work - try the passphrase.  */
+      kek->is_set = 0;
+      rc = do_decryption (aad_begin, aad_end - aad_begin,
+                          aadhole_begin, aadhole_end - aadhole_begin,
+                          s, n,
+                          passphrase, s2ksalt, s2kcount, kek,
+                          iv, is_ocb? 12:16,
+                          prot_cipher, prot_cipher_keylen, is_ocb,
+                          &cleartext);
+    }
   if (rc)
-    return rc;
+    {
+      if (kek)
+        wipememory (kek, sizeof *kek);
+      return rc;
+    }
 
   rc = merge_lists (protectedkey, prot_begin-protectedkey, cleartext,
                     is_ocb? NULL : sha1hash,
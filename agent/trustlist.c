@@ -52,6 +52,13 @@ typedef struct trustitem_s trustitem_t;
 /* Malloced table and its allocated size with all trust items. */
 static trustitem_t *trusttable;
 static size_t trusttablesize;
+/* Hash index into TRUSTTABLE using open addressing.  Each slot holds
+   the index of the item plus one or 0 if the slot is empty.  The
+   number of slots is a power of two and at least twice the number of
+   items.  Only the first item of a fingerprint is indexed because
+   that is the one a linear scan would find.  */
+static unsigned int *trustindex;
+static size_t trustindexsize;
 /* A mutex used to protect the table. */
 static npth_mutex_t trusttable_lock;
 
@@ -124,6 +131,73 @@ clear_trusttable (void)
   xfree (trusttable);
   trusttable = NULL;
   trusttablesize = 0;
+  xfree (trustindex);
+  trustindex = NULL;
+  trustindexsize = 0;
+}
+
+
+/* Return the first slot to probe in an index of INDEXSIZE slots for
+   the fingerprint FPR.  A fingerprint is a hash value anyway.  */
+static inline size_t
+trustindex_slot (const unsigned char *fpr, size_t indexsize)
+{
+  return (((size_t)fpr[0] << 24 | fpr[1] << 16 | fpr[2] << 8 | fpr[3])
+          & (indexsize - 1));
+}
+
+
+/* Build a hash index for the NITEMS items of TABLE and store it at
+   R_INDEX and its number of slots at R_INDEXSIZE.  */
+static gpg_error_t
+build_trustindex (const trustitem_t *table, size_t nitems,
+                  unsigned int **r_index, size_t *r_indexsize)
+{
+  unsigned int *index;
+  size_t indexsize, i, slot;
+
+  for (indexsize = 16; indexsize < 2 * nitems; indexsize *= 2)
+    ;
+  index = xtrycalloc (indexsize, sizeof *index);
+  if (!index)
+    return gpg_error_from_syserror ();
+
+  for (i=0; i < nitems; i++)
+    {
+      for (slot = trustindex_slot (table[i].fpr, indexsize);
+           index[slot];
+           slot = (slot + 1) & (indexsize - 1))
+        if (!memcmp (table[index[slot]-1].fpr, table[i].fpr, 20))
+          break;
+      if (!index[slot])
+        index[slot] = i + 1;
+    }
+
+  *r_index = index;
+  *r_indexsize = indexsize;
+  return 0;
+}
+
+
+/* Return the trust item for the binary fingerprint FPR or NULL.  The
+   trusttable needs to be locked.  */
+static trustitem_t *
+find_trustitem (const unsigned char *fpr)
+{
+  size_t slot;
+  trustitem_t *ti;
+
+  if (!trustindex)
+    return NULL;
+  for (slot = trustindex_slot (fpr, trustindexsize);
+       trustindex[slot];
+       slot = (slot + 1) & (trustindexsize - 1))
+    {
+      ti = trusttable + trustindex[slot] - 1;
+      if (!memcmp (ti->fpr, fpr, 20))
+        return ti;
+    }
+  return NULL;
 }
 
 
@@ -334,6 +408,8 @@ read_trustfiles (void)
   trustitem_t *table, *ti;
   int tableidx;
   size_t tablesize;
+  unsigned int *index;
+  size_t indexsize;
   char *fname;
   int allow_include = 1;
 
@@ -380,7 +456,7 @@ read_trustfiles (void)
       return err;
     }
 
-  /* Fixme: we should drop duplicates and sort the table. */
+  /* The order of the table is kept for LISTTRUSTED.  */
   ti = xtryrealloc (table, (tableidx?tableidx:1) * sizeof *table);
   if (!ti)
     {
@@ -388,11 +464,19 @@ read_trustfiles (void)
       xfree (table);
       return err;
     }
+  err = build_trustindex (ti, tableidx, &index, &indexsize);
+  if (err)
+    {
+      xfree (ti);
+      return err;
+    }
 
-  /* Replace the trusttable.  */
-  xfree (trusttable);
+  /* Replace the trusttable and its index.  */
+  clear_trusttable ();
   trusttable = ti;
   trusttablesize = tableidx;
+  trustindex = index;
+  trustindexsize = indexsize;
   return 0;
 }
 
@@ -407,7 +491,7 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
   gpg_error_t err = 0;
   int locked = already_locked;
   trustitem_t *ti;
-  size_t len;
+  int disabled;
   unsigned char fprbin[20];
 
   if (r_disabled)
@@ -435,35 +519,34 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
         }
     }
 
-  if (trusttable)
+  ti = find_trustitem (fprbin);
+  if (ti)
     {
-      for (ti=trusttable, len = trusttablesize; len; ti++, len--)
-        if (!memcmp (ti->fpr, fprbin, 20))
-          {
-            if (ti->flags.disabled && r_disabled)
-              *r_disabled = 1;
-
-            /* Print status messages only if we have not been called
-               in a locked state.  */
-            if (already_locked)
-              ;
-            else if (ti->flags.relax)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
-              }
-            else if (ti->flags.cm)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
-              }
-
-            if (!err)
-              err = ti->flags.disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
-            goto leave;
-          }
+      /* TI may not be used after unlocking.  */
+      disabled = ti->flags.disabled;
+      if (disabled && r_disabled)
+        *r_disabled = 1;
+
+      /* Print status messages only if we have not been called in a
+         locked state.  */
+      if (already_locked)
+        ;
+      else if (ti->flags.relax)
+        {
+          unlock_trusttable ();
+          locked = 0;
+          err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
+        }
+      else if (ti->flags.cm)
+        {
+          unlock_trusttable ();
+          locked = 0;
+          err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
+        }
+
+      if (!err)
+        err = disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
+      goto leave;
     }
   err = gpg_error (GPG_ERR_NOT_TRUSTED);
 
@@ -0,0 +1,561 @@
+/* workpool.c - Run public key operations in worker threads
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* nPth is cooperative: only the thread holding the nPth lock runs and
+ * a connection thread doing an RSA-4096 decryption stalls all other
+ * connections until it is done.  The public key operations are thus
+ * handed to a small pool of worker threads which run them without
+ * holding the nPth lock; the connection thread waits on a condition
+ * variable and thereby lets other connections proceed.  The workers
+ * are started on first use and are kept for the lifetime of the
+ * process.  The S2K based protection of a batch of imported keys is
+ * run by the workers as well.
+ *
+ * Libgcrypt calls the system call clamp of libgpg-error around
+ * blocking system calls, for example when gathering entropy.  The
+ * clamp functions of this module do nothing in a worker thread
+ * because those threads do not hold the nPth lock while running a
+ * job.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <npth.h>
+
+#include "agent.h"
+#include "../common/metrics.h"
+
+
+/* Maximum number of worker threads.  */
+#define MAX_WORKPOOL_THREADS 8
+
+
+/* The operations run by the workers.  */
+enum workpool_ops
+  {
+    WORKPOOL_PK_DECRYPT,
+    WORKPOOL_PK_SIGN,
+    WORKPOOL_PK_VERIFY,
+    WORKPOOL_PK_GENKEY,
+    WORKPOOL_PROTECT,
+    WORKPOOL_S2K
+  };
+
+/* A job for the worker pool.  The worker may only work on the data
+ * of the job; in particular it may not call any log function.  */
+typedef struct workpool_job_s *workpool_job_t;
+struct workpool_job_s
+{
+  workpool_job_t next;
+  enum workpool_ops op;
+  gcry_sexp_t result;
+  gcry_sexp_t data;
+  gcry_sexp_t key;
+  const unsigned char *plainkey;  /* Used by WORKPOOL_PROTECT.  */
+  const char *passphrase;
+  unsigned long s2k_count;
+  const unsigned char *s2ksalt;   /* Used by WORKPOOL_S2K.  */
+  unsigned char *protkey;         /* Also the key of WORKPOOL_S2K.  */
+  size_t protkeylen;
+  gpg_error_t err;
+  int done;
+};
+
+
+METRIC_DEFINE_COUNTER (m_jobs, "workpool_jobs");
+METRIC_DEFINE_GAUGE (m_queued, "workpool_queued");
+METRIC_DEFINE_HISTOGRAM (m_job_usec, "workpool_job_usec");
+
+
+static struct
+{
+  int initialized;        /* The module has been initialized.  */
+  int started;            /* Starting the workers has been tried.  */
+  unsigned int nworkers;  /* Number of running workers.  */
+  npth_key_t worker_key;  /* Set to non-NULL in the worker threads.  */
+  npth_mutex_t lock;      /* Protects the fields below.  */
+  npth_cond_t work_cond;  /* Signaled when new jobs are available.  */
+  npth_cond_t done_cond;  /* Signaled when a job has finished.  */
+  workpool_job_t head;    /* The queue of jobs not yet started.  */
+  workpool_job_t tail;
+} workpool;
+
+
+/* Return true if the calling thread is a worker.  */
+static int
+is_worker (void)
+{
+  return workpool.initialized && npth_getspecific (workpool.worker_key);
+}
+
+
+/* Mark the calling thread as a worker.  To be called by threads
+ * which run Libgcrypt functions without holding the nPth lock.  */
+void
+workpool_set_worker (void)
+{
+  npth_setspecific (workpool.worker_key, &workpool);
+}
+
+
+/* The system call clamp used by gpg-agent.  */
+void
+workpool_pre_syscall (void)
+{
+  if (!is_worker ())
+    npth_unprotect ();
+}
+
+void
+workpool_post_syscall (void)
+{
+  if (!is_worker ())
+    npth_protect ();
+}
+
+
+void
+initialize_module_workpool (void)
+{
+  int rc;
+
+  if (workpool.initialized)
+    return;
+
+  rc = npth_mutex_init (&workpool.lock, NULL);
+  if (!rc)
+    rc = npth_cond_init (&workpool.work_cond, NULL);
+  if (!rc)
+    rc = npth_cond_init (&workpool.done_cond, NULL);
+  if (!rc)
+    rc = npth_key_create (&workpool.worker_key, NULL);
+  if (rc)
+    log_fatal ("error initializing the worker pool: %s\n", strerror (rc));
+  workpool.initialized = 1;
+}
+
+
+static void
+workpool_lock (void)
+{
+  int rc = npth_mutex_lock (&workpool.lock);
+  if (rc)
+    log_fatal ("%s: failed to acquire mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+static void
+workpool_unlock (void)
+{
+  int rc = npth_mutex_unlock (&workpool.lock);
+  if (rc)
+    log_fatal ("%s: failed to release mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+/* Do the actual work of JOB.  */
+static void
+run_job (workpool_job_t job)
+{
+  switch (job->op)
+    {
+    case WORKPOOL_PK_DECRYPT:
+      job->err = gcry_pk_decrypt (&job->result, job->data, job->key);
+      break;
+    case WORKPOOL_PK_SIGN:
+      job->err = gcry_pk_sign (&job->result, job->data, job->key);
+      break;
+    case WORKPOOL_PK_VERIFY:
+      job->err = gcry_pk_verify (job->result, job->data, job->key);
+      break;
+    case WORKPOOL_PK_GENKEY:
+      job->err = gcry_pk_genkey (&job->result, job->data);
+      break;
+    case WORKPOOL_PROTECT:
+      job->err = agent_protect (job->plainkey, job->passphrase,
+                                &job->protkey, &job->protkeylen,
+                                job->s2k_count, -1);
+      break;
+    case WORKPOOL_S2K:
+      job->err = s2k_hash_passphrase (job->passphrase, GCRY_MD_SHA1, 3,
+                                      job->s2ksalt, job->s2k_count,
+                                      job->protkey, job->protkeylen);
+      break;
+    }
+}
+
+
+/* The thread function of a pool worker.  */
+static void *
+workpool_worker (void *arg)
+{
+  workpool_job_t job;
+
+  (void)arg;
+
+  npth_setspecific (workpool.worker_key, &workpool);
+
+  workpool_lock ();
+  for (;;)
+    {
+      while (!workpool.head)
+        npth_cond_wait (&workpool.work_cond, &workpool.lock);
+      job = workpool.head;
+      workpool.head = job->next;
+      if (!workpool.head)
+        workpool.tail = NULL;
+      metric_dec (&m_queued);
+      workpool_unlock ();
+
+      npth_unprotect ();
+      run_job (job);
+      npth_protect ();
+
+      workpool_lock ();
+      job->done = 1;
+      npth_cond_broadcast (&workpool.done_cond);
+    }
+
+  return NULL;
+}
+
+
+/* Start the workers.  There is no point in using the pool on a
+ * single CPU system and thus no workers are started in that case.  */
+static void
+start_workers (void)
+{
+  long ncpu = 1;
+  npth_attr_t tattr;
+  npth_t thread;
+  int i, rc;
+
+  workpool.started = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  if (ncpu < 2)
+    return;
+  if (ncpu > MAX_WORKPOOL_THREADS)
+    ncpu = MAX_WORKPOOL_THREADS;
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      log_error ("error preparing worker threads: %s\n", strerror (rc));
+      return;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+
+  for (i=0; i < ncpu; i++)
+    {
+      rc = npth_create (&thread, &tattr, workpool_worker, NULL);
+      if (rc)
+        {
+          log_error ("error spawning worker thread: %s\n", strerror (rc));
+          break;
+        }
+      npth_setname_np (thread, "pk-worker");
+      workpool.nworkers++;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (opt.verbose > 1 && workpool.nworkers)
+    log_info ("started %u worker threads\n", workpool.nworkers);
+}
+
+
+/* Run the NJOBS jobs in the array JOBS in worker threads and wait for
+ * the completion of all of them.  If no workers are available the
+ * jobs are run by the calling thread.  */
+static void
+workpool_run_many (workpool_job_t jobs, unsigned int njobs)
+{
+  uint64_t start;
+  unsigned int i;
+
+  if (workpool.initialized && !workpool.started)
+    start_workers ();
+  if (!workpool.nworkers)
+    {
+      for (i=0; i < njobs; i++)
+        run_job (jobs + i);
+      return;
+    }
+
+  start = metric_usec ();
+  workpool_lock ();
+  for (i=0; i < njobs; i++)
+    {
+      jobs[i].next = NULL;
+      jobs[i].done = 0;
+      if (workpool.tail)
+        workpool.tail->next = jobs + i;
+      else
+        workpool.head = jobs + i;
+      workpool.tail = jobs + i;
+      metric_inc (&m_jobs);
+      metric_inc (&m_queued);
+    }
+  if (njobs > 1)
+    npth_cond_broadcast (&workpool.work_cond);
+  else
+    npth_cond_signal (&workpool.work_cond);
+  for (i=0; i < njobs; i++)
+    while (!jobs[i].done)
+      npth_cond_wait (&workpool.done_cond, &workpool.lock);
+  workpool_unlock ();
+  metric_observe (&m_job_usec, metric_usec () - start);
+}
+
+
+/* Run JOB in a worker thread and wait for its completion.  If no
+ * workers are available the job is run by the calling thread.  */
+static gpg_error_t
+workpool_run (workpool_job_t job)
+{
+  workpool_run_many (job, 1);
+  return job->err;
+}
+
+
+/* Same as gcry_pk_decrypt but run in a worker thread.  */
+gpg_error_t
+workpool_pk_decrypt (gcry_sexp_t *r_plain, gcry_sexp_t s_data,
+                     gcry_sexp_t s_skey)
+{
+  struct workpool_job_s job;
+
+  memset (&job, 0, sizeof job);
+  job.op = WORKPOOL_PK_DECRYPT;
+  job.data = s_data;
+  job.key = s_skey;
+  workpool_run (&job);
+  *r_plain = job.result;
+  return job.err;
+}
+
+
+/* Decrypt S_DATA with each of the NKEYS keys S_SKEYS concurrently.
+ * The results of gcry_pk_decrypt are stored at the arrays R_PLAINS
+ * and R_ERRS which need to have NKEYS elements.  */
+void
+workpool_pk_decrypt_many (gcry_sexp_t s_data,
+                          gcry_sexp_t *s_skeys, unsigned int nkeys,
+                          gcry_sexp_t *r_plains, gpg_error_t *r_errs)
+{
+  struct workpool_job_s *jobs;
+  unsigned int i;
+
+  jobs = xtrycalloc (nkeys, sizeof *jobs);
+  if (!jobs)
+    {
+      /* Fall back to one job at a time.  */
+      for (i=0; i < nkeys; i++)
+        r_errs[i] = workpool_pk_decrypt (r_plains + i, s_data, s_skeys[i]);
+      return;
+    }
+
+  for (i=0; i < nkeys; i++)
+    {
+      jobs[i].op = WORKPOOL_PK_DECRYPT;
+      jobs[i].data = s_data;
+      jobs[i].key = s_skeys[i];
+    }
+  workpool_run_many (jobs, nkeys);
+  for (i=0; i < nkeys; i++)
+    {
+      r_plains[i] = jobs[i].result;
+      r_errs[i] = jobs[i].err;
+    }
+  xfree (jobs);
+}
+
+
+/* Same as gcry_pk_sign but run in a worker thread.  */
+gpg_error_t
+workpool_pk_sign (gcry_sexp_t *r_sig, gcry_sexp_t s_hash, gcry_sexp_t s_skey)
+{
+  struct workpool_job_s job;
+
+  memset (&job, 0, sizeof job);
+  job.op = WORKPOOL_PK_SIGN;
+  job.data = s_hash;
+  job.key = s_skey;
+  workpool_run (&job);
+  *r_sig = job.result;
+  return job.err;
+}
+
+
+/* Sign each of the NJOBS hashes S_HASHES with the respective key
+ * S_SKEYS concurrently.  The results of gcry_pk_sign are stored at the
+ * arrays R_SIGS and R_ERRS which need to have NJOBS elements.  */
+void
+workpool_pk_sign_many (gcry_sexp_t *s_hashes, gcry_sexp_t *s_skeys,
+                       unsigned int njobs,
+                       gcry_sexp_t *r_sigs, gpg_error_t *r_errs)
+{
+  struct workpool_job_s *jobs;
+  unsigned int i;
+
+  jobs = xtrycalloc (njobs, sizeof *jobs);
+  if (!jobs)
+    {
+      /* Fall back to one job at a time.  */
+      for (i=0; i < njobs; i++)
+        r_errs[i] = workpool_pk_sign (r_sigs + i, s_hashes[i], s_skeys[i]);
+      return;
+    }
+
+  for (i=0; i < njobs; i++)
+    {
+      jobs[i].op = WORKPOOL_PK_SIGN;
+      jobs[i].data = s_hashes[i];
+      jobs[i].key = s_skeys[i];
+    }
+  workpool_run_many (jobs, njobs);
+  for (i=0; i < njobs; i++)
+    {
+      r_sigs[i] = jobs[i].result;
+      r_errs[i] = jobs[i].err;
+    }
+  xfree (jobs);
+}
+
+
+/* Same as gcry_pk_verify but run in a worker thread.  */
+gpg_error_t
+workpool_pk_verify (gcry_sexp_t s_sig, gcry_sexp_t s_hash, gcry_sexp_t s_pkey)
+{
+  struct workpool_job_s job;
+
+  memset (&job, 0, sizeof job);
+  job.op = WORKPOOL_PK_VERIFY;
+  job.result = s_sig;
+  job.data = s_hash;
+  job.key = s_pkey;
+  return workpool_run (&job);
+}
+
+
+/* Same as gcry_pk_genkey but run in a worker thread.  */
+gpg_error_t
+workpool_pk_genkey (gcry_sexp_t *r_key, gcry_sexp_t s_parms)
+{
+  struct workpool_job_s job;
+
+  memset (&job, 0, sizeof job);
+  job.op = WORKPOOL_PK_GENKEY;
+  job.data = s_parms;
+  workpool_run (&job);
+  *r_key = job.result;
+  return job.err;
+}
+
+
+/* Protect each of the NJOBS keys PLAINKEYS with the respective
+ * passphrase of PASSPHRASES concurrently using S2K_COUNT iterations,
+ * which must not be 0.  The results of agent_protect are stored at the
+ * arrays R_RESULTS, R_RESULTLENS and R_ERRS which need to have NJOBS
+ * elements.  */
+void
+workpool_protect_many (unsigned char **plainkeys, char **passphrases,
+                       unsigned int njobs, unsigned long s2k_count,
+                       unsigned char **r_results, size_t *r_resultlens,
+                       gpg_error_t *r_errs)
+{
+  struct workpool_job_s *jobs;
+  unsigned int i;
+
+  jobs = xtrycalloc (njobs, sizeof *jobs);
+  if (!jobs)
+    {
+      /* Fall back to doing it in this thread.  */
+      for (i=0; i < njobs; i++)
+        r_errs[i] = agent_protect (plainkeys[i], passphrases[i],
+                                   r_results + i, r_resultlens + i,
+                                   s2k_count, -1);
+      return;
+    }
+
+  for (i=0; i < njobs; i++)
+    {
+      jobs[i].op = WORKPOOL_PROTECT;
+      jobs[i].plainkey = plainkeys[i];
+      jobs[i].passphrase = passphrases[i];
+      jobs[i].s2k_count = s2k_count;
+    }
+  workpool_run_many (jobs, njobs);
+  for (i=0; i < njobs; i++)
+    {
+      r_results[i] = jobs[i].protkey;
+      r_resultlens[i] = jobs[i].protkeylen;
+      r_errs[i] = jobs[i].err;
+    }
+  xfree (jobs);
+}
+
+
+/* Derive the keys for the NJOBS passphrases PASSPHRASES concurrently
+ * using the OpenPGP iterated and salted S2K with SHA-1, the
+ * respective salt of SALTS and the encoded S2K_COUNT.  The KEYLEN
+ * bytes of each key are stored at the caller provided buffers R_KEYS
+ * and the error codes at R_ERRS; both arrays need to have NJOBS
+ * elements.  */
+void
+workpool_s2k_many (char **passphrases, unsigned char **salts,
+                   unsigned int njobs, unsigned long s2k_count,
+                   unsigned char **r_keys, size_t keylen,
+                   gpg_error_t *r_errs)
+{
+  struct workpool_job_s *jobs;
+  unsigned int i;
+
+  jobs = xtrycalloc (njobs, sizeof *jobs);
+  if (!jobs)
+    {
+      /* Fall back to doing it in this thread.  */
+      for (i=0; i < njobs; i++)
+        r_errs[i] = s2k_hash_passphrase (passphrases[i], GCRY_MD_SHA1, 3,
+                                         salts[i], s2k_count,
+                                         r_keys[i], keylen);
+      return;
+    }
+
+  for (i=0; i < njobs; i++)
+    {
+      jobs[i].op = WORKPOOL_S2K;
+      jobs[i].passphrase = passphrases[i];
+      jobs[i].s2ksalt = salts[i];
+      jobs[i].s2k_count = s2k_count;
+      jobs[i].protkey = r_keys[i];
+      jobs[i].protkeylen = keylen;
+    }
+  workpool_run_many (jobs, njobs);
+  for (i=0; i < njobs; i++)
+    r_errs[i] = jobs[i].err;
+  xfree (jobs);
+}
@@ -136,9 +136,13 @@ set_libassuan_log_cats (unsigned int newcats)
 
 
 
+/* Send the option NAME with VALUE to the server at CTX.  If BUNDLE is
+ * not NULL the option is instead appended to BUNDLE in the format
+ * used by the OPTIONS command of gpg-agent.  */
 static gpg_error_t
 send_one_option (assuan_context_t ctx, gpg_err_source_t errsource,
-                 const char *name, const char *value, int use_putenv)
+                 const char *name, const char *value, int use_putenv,
+                 membuf_t *bundle)
 {
   gpg_error_t err;
   char *optstr;
@@ -147,6 +151,19 @@ send_one_option (assuan_context_t ctx, gpg_err_source_t errsource,
 
   if (!value || !*value)
     err = 0;  /* Avoid sending empty strings.  */
+  else if (bundle)
+    {
+      optstr = percent_plus_escape (value);
+      if (!optstr)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          put_membuf_printf (bundle, " %s%s=%s",
+                             use_putenv? "putenv=":"", name, optstr);
+          xfree (optstr);
+          err = 0;
+        }
+    }
   else if (asprintf (&optstr, "OPTION %s%s=%s",
                      use_putenv? "putenv=":"", name, value) < 0)
     err = gpg_error_from_syserror ();
@@ -160,16 +177,15 @@ send_one_option (assuan_context_t ctx, gpg_err_source_t errsource,
 }
 
 
-/* Send the assuan commands pertaining to the pinentry environment.  The
-   OPT_* arguments are optional and may be used to override the
-   defaults taken from the current locale. */
-gpg_error_t
-send_pinentry_environment (assuan_context_t ctx,
-                           gpg_err_source_t errsource,
-                           const char *opt_lc_ctype,
-                           const char *opt_lc_messages,
-                           session_env_t session_env)
-
+/* Worker for send_pinentry_environment.  If BUNDLE is not NULL the
+ * options are not sent but appended to BUNDLE.  */
+static gpg_error_t
+do_send_pinentry_environment (assuan_context_t ctx,
+                              gpg_err_source_t errsource,
+                              const char *opt_lc_ctype,
+                              const char *opt_lc_messages,
+                              session_env_t session_env,
+                              membuf_t *bundle)
 {
   gpg_error_t err = 0;
 #if defined(HAVE_SETLOCALE)
@@ -189,10 +205,10 @@ send_pinentry_environment (assuan_context_t ctx,
         continue;
 
       if (assname)
-        err = send_one_option (ctx, errsource, assname, value, 0);
+        err = send_one_option (ctx, errsource, assname, value, 0, bundle);
       else
         {
-          err = send_one_option (ctx, errsource, name, value, 1);
+          err = send_one_option (ctx, errsource, name, value, 1, bundle);
           if (gpg_err_code (err) == GPG_ERR_UNKNOWN_OPTION)
             err = 0;  /* Server too old; can't pass the new envvars.  */
         }
@@ -220,7 +236,8 @@ send_pinentry_environment (assuan_context_t ctx,
   if (opt_lc_ctype || (dft_ttyname && dft_lc))
     {
       err = send_one_option (ctx, errsource, "lc-ctype",
-                             opt_lc_ctype ? opt_lc_ctype : dft_lc, 0);
+                             opt_lc_ctype ? opt_lc_ctype : dft_lc, 0,
+                             bundle);
     }
 #if defined(HAVE_SETLOCALE) && defined(LC_CTYPE)
   if (old_lc)
@@ -246,7 +263,8 @@ send_pinentry_environment (assuan_context_t ctx,
   if (opt_lc_messages || (dft_ttyname && dft_lc))
     {
       err = send_one_option (ctx, errsource, "lc-messages",
-                             opt_lc_messages ? opt_lc_messages : dft_lc, 0);
+                             opt_lc_messages ? opt_lc_messages : dft_lc, 0,
+                             bundle);
     }
 #if defined(HAVE_SETLOCALE) && defined(LC_MESSAGES)
   if (old_lc)
@@ -262,6 +280,82 @@ send_pinentry_environment (assuan_context_t ctx,
 }
 
 
+/* Send the assuan commands pertaining to the pinentry environment.  The
+   OPT_* arguments are optional and may be used to override the
+   defaults taken from the current locale. */
+gpg_error_t
+send_pinentry_environment (assuan_context_t ctx,
+                           gpg_err_source_t errsource,
+                           const char *opt_lc_ctype,
+                           const char *opt_lc_messages,
+                           session_env_t session_env)
+
+{
+  return do_send_pinentry_environment (ctx, errsource,
+                                       opt_lc_ctype, opt_lc_messages,
+                                       session_env, NULL);
+}
+
+
+/* Tell the server on CTX to log its requests with TRACE_ID.  Nothing
+ * is done for a NULL or empty TRACE_ID.  Errors are ignored because
+ * old servers do not know this option.  */
+void
+send_trace_id (assuan_context_t ctx, const char *trace_id)
+{
+  char line[ASSUAN_LINELENGTH];
+
+  if (!trace_id || !*trace_id)
+    return;
+  snprintf (line, sizeof line, "OPTION trace-id=%s", trace_id);
+  assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+
+/* Reset the agent connection CTX and send the pinentry environment
+ * with a single OPTIONS command.  Returns GPG_ERR_NOT_SUPPORTED if the
+ * agent does not know that command or the options do not fit into
+ * one line; the caller should then fall back to RESET and
+ * send_pinentry_environment.  */
+static gpg_error_t
+send_pinentry_environment_bundle (assuan_context_t ctx,
+                                  gpg_err_source_t errsource,
+                                  const char *opt_lc_ctype,
+                                  const char *opt_lc_messages,
+                                  session_env_t session_env)
+{
+  gpg_error_t err;
+  membuf_t mb;
+  char *line;
+
+  init_membuf (&mb, 256);
+  put_membuf_str (&mb, "OPTIONS --reset");
+  err = do_send_pinentry_environment (ctx, errsource,
+                                      opt_lc_ctype, opt_lc_messages,
+                                      session_env, &mb);
+  put_membuf (&mb, "", 1);
+  line = get_membuf (&mb, NULL);
+  if (err)
+    {
+      xfree (line);
+      return err;
+    }
+  if (!line)
+    return gpg_error_from_syserror ();
+
+  if (strlen (line) >= ASSUAN_LINELENGTH)
+    err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+  else
+    {
+      err = assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+      if (gpg_err_code (err) == GPG_ERR_ASS_UNKNOWN_CMD)
+        err = gpg_error (GPG_ERR_NOT_SUPPORTED);  /* Old agent.  */
+    }
+  xfree (line);
+  return err;
+}
+
+
 /* Lock a spawning process.  The caller needs to provide the address
    of a variable to store the lock information and the name or the
    process.  */
@@ -567,15 +661,21 @@ start_new_service (assuan_context_t *r_ctx,
     log_debug ("connection to the %s established\n", printed_name);
 
   if (module_name_id == GNUPG_MODULE_NAME_AGENT)
-    err = assuan_transact (ctx, "RESET",
-                           NULL, NULL, NULL, NULL, NULL, NULL);
-
-  if (!err
-      && module_name_id == GNUPG_MODULE_NAME_AGENT)
     {
-      err = send_pinentry_environment (ctx, errsource,
-                                       opt_lc_ctype, opt_lc_messages,
-                                       session_env);
+      /* Try to do the RESET and send the environment in one round
+       * trip first.  */
+      err = send_pinentry_environment_bundle (ctx, errsource,
+                                              opt_lc_ctype, opt_lc_messages,
+                                              session_env);
+      if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+        {
+          err = assuan_transact (ctx, "RESET",
+                                 NULL, NULL, NULL, NULL, NULL, NULL);
+          if (!err)
+            err = send_pinentry_environment (ctx, errsource,
+                                             opt_lc_ctype, opt_lc_messages,
+                                             session_env);
+        }
       if (gpg_err_code (err) == GPG_ERR_FORBIDDEN
           && gpg_err_source (err) == GPG_ERR_SOURCE_GPGAGENT)
         {
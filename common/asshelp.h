@@ -52,6 +52,9 @@ send_pinentry_environment (assuan_context_t ctx,
                            const char *opt_lc_messages,
                            session_env_t session_env);
 
+/* Send "OPTION trace-id" if TRACE_ID is not empty.  */
+void send_trace_id (assuan_context_t ctx, const char *trace_id);
+
 /* This function is used by the call-agent.c modules to fire up a new
    agent.  */
 gpg_error_t
@@ -81,6 +81,39 @@ b64dec_start (struct b64state *state, const char *title)
 }
 
 
+/* Decode the NQUADS*4 base64 characters at IN into the NQUADS*3 bytes
+   at OUT.  Decoding stops at the first quad which contains a
+   character which is not in the base64 alphabet; this includes pad
+   characters and white space.  Returns the number of quads decoded.
+   OUT may be the same as IN for in-place decoding.  This is the core
+   of the decoder and also used by other base64 decoders of GnuPG.  */
+size_t
+b64dec_quads (void *out, const void *in, size_t nquads)
+{
+  const unsigned char *s = in;
+  unsigned char *d = out;
+  size_t n;
+  unsigned int c0, c1, c2, c3;
+  u32 v;
+
+  for (n=0; n < nquads; n++, s += 4, d += 3)
+    {
+      c0 = asctobin[s[0] & 0x7f] | (s[0] & 0x80);
+      c1 = asctobin[s[1] & 0x7f] | (s[1] & 0x80);
+      c2 = asctobin[s[2] & 0x7f] | (s[2] & 0x80);
+      c3 = asctobin[s[3] & 0x7f] | (s[3] & 0x80);
+      if (((c0 | c1 | c2 | c3) & 0x80))
+        break;  /* Not a base64 character.  */
+      v = (c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
+      d[0] = v >> 16;
+      d[1] = v >> 8;
+      d[2] = v;
+    }
+
+  return n;
+}
+
+
 /* Do in-place decoding of base-64 data of LENGTH in BUFFER.  Stores the
    new length of the buffer at R_NBYTES. */
 gpg_error_t
@@ -167,6 +200,18 @@ b64dec_proc (struct b64state *state, void *buffer, size_t length,
         case s_b64_3:
           {
             int c;
+            size_t n;
+
+            if (ds == s_b64_0 && length >= 4
+                && (n = b64dec_quads (d, s, length / 4)))
+              {
+                /* Fast path for complete quads; the for loop skips
+                   the last character.  */
+                d += 3 * n;
+                s += 4 * n - 1;
+                length -= 4 * n - 1;
+                break;
+              }
 
             if (*s == '-' && state->title)
               {
@@ -138,6 +138,79 @@ static const u32 crc_table[256] = {
   0x56d11cce, 0x56575035, 0x575bc9c3, 0x57dd8538
 };
 
+/* To process 4 bytes at once the CRC is kept in the high 24 bits of
+   a 32 bit word and CRC_SLICES[N] gives the CRC of a byte followed by
+   N zero bytes.  These tables are derived from CRC_TABLE on first
+   use.  */
+static u32 crc_slices[4][256];
+static int crc_slices_initialized;
+
+
+
+/* Compute the slicing tables for update_crc.  */
+static void
+init_crc_slices (void)
+{
+  int i, n;
+  u32 t;
+
+  for (i=0; i < 256; i++)
+    crc_slices[0][i] = crc_table[i] << 8;
+  for (n=1; n < 4; n++)
+    for (i=0; i < 256; i++)
+      {
+        t = crc_slices[n-1][i];
+        crc_slices[n][i] = (t << 8) ^ crc_slices[0][t >> 24];
+      }
+  crc_slices_initialized = 1;
+}
+
+
+/* Update the OpenPGP CRC with the NBYTES at BUFFER and return the
+   new CRC.  */
+static u32
+update_crc (u32 crc, const unsigned char *buffer, size_t nbytes)
+{
+  u32 r;
+
+  if (!crc_slices_initialized)
+    init_crc_slices ();
+
+  r = crc << 8;
+  for (; nbytes >= 4; buffer += 4, nbytes -= 4)
+    {
+      r ^= ((u32)buffer[0] << 24) | ((u32)buffer[1] << 16)
+           | ((u32)buffer[2] << 8) | buffer[3];
+      r = (crc_slices[3][r >> 24] ^ crc_slices[2][(r >> 16) & 0xff]
+           ^ crc_slices[1][(r >> 8) & 0xff] ^ crc_slices[0][r & 0xff]);
+    }
+  for (; nbytes; buffer++, nbytes--)
+    r = (r << 8) ^ crc_slices[0][(r >> 24) ^ *buffer];
+
+  return r >> 8;
+}
+
+
+/* Encode the NQUADS*3 bytes at IN into the NQUADS*4 base64 characters
+   at OUT.  Neither linefeeds nor a terminating Nul are written.  This
+   is the core of the encoder and also used by other base64 encoders
+   of GnuPG.  */
+void
+b64enc_quads (char *out, const void *in, size_t nquads)
+{
+  const unsigned char *p = in;
+  u32 v;
+
+  for (; nquads; nquads--, p += 3, out += 4)
+    {
+      v = ((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2];
+      out[0] = bintoasc[(v >> 18) & 077];
+      out[1] = bintoasc[(v >> 12) & 077];
+      out[2] = bintoasc[(v >> 6) & 077];
+      out[3] = bintoasc[v & 077];
+    }
+}
+
 
 static gpg_error_t
 enc_start (struct b64state *state, FILE *fp, estream_t stream,
@@ -197,14 +270,41 @@ my_fputs (const char *string, struct b64state *state)
 }
 
 
+/* Encode the NQUADS*3 bytes at IN and write them to the stream of
+   STATE.  A linefeed is appended if the line is complete; NQUADS may
+   thus not be larger than the number of quads left in the current
+   line.  Returns -1 on error.  */
+static int
+write_quads (struct b64state *state, const unsigned char *in, size_t nquads)
+{
+  char line[64+1];
+  size_t n = nquads * 4;
+
+  assert (state->quad_count + nquads <= (64/4));
+  b64enc_quads (line, in, nquads);
+  state->quad_count += nquads;
+  if (state->quad_count >= (64/4))
+    {
+      state->quad_count = 0;
+      if (!(state->flags & B64ENC_NO_LINEFEEDS))
+        line[n++] = '\n';
+    }
+
+  if (state->stream)
+    return es_write (state->stream, line, n, NULL)? -1 : 0;
+  else
+    return fwrite (line, n, 1, state->fp) != 1? -1 : 0;
+}
+
+
 /* Write NBYTES from BUFFER to the Base 64 stream identified by
    STATE. With BUFFER and NBYTES being 0, merely do a fflush on the
    stream. */
 gpg_error_t
 b64enc_write (struct b64state *state, const void *buffer, size_t nbytes)
 {
-  unsigned char radbuf[4];
-  int idx, quad_count;
+  int idx;
+  size_t n;
   const unsigned char *p;
 
   if (state->lasterr)
@@ -235,59 +335,40 @@ b64enc_write (struct b64state *state, const void *buffer, size_t nbytes)
     }
 
   idx = state->idx;
-  quad_count = state->quad_count;
   assert (idx < 4);
-  memcpy (radbuf, state->radbuf, idx);
 
   if ( (state->flags & B64ENC_USE_PGPCRC) )
-    {
-      size_t n;
-      u32 crc = state->crc;
-
-      for (p=buffer, n=nbytes; n; p++, n-- )
-        crc = ((u32)crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ *p];
-      state->crc = (crc & 0x00ffffff);
-    }
+    state->crc = update_crc (state->crc, buffer, nbytes);
 
-  for (p=buffer; nbytes; p++, nbytes--)
+  p = buffer;
+  if (idx)
     {
-      radbuf[idx++] = *p;
-      if (idx > 2)
+      /* Complete the quad from the last call.  */
+      for (; nbytes && idx < 3; p++, nbytes--)
+        state->radbuf[idx++] = *p;
+      if (idx < 3)
         {
-          char tmp[4];
-
-          tmp[0] = bintoasc[(*radbuf >> 2) & 077];
-          tmp[1] = bintoasc[(((*radbuf<<4)&060)|((radbuf[1] >> 4)&017))&077];
-          tmp[2] = bintoasc[(((radbuf[1]<<2)&074)|((radbuf[2]>>6)&03))&077];
-          tmp[3] = bintoasc[radbuf[2]&077];
-          if (state->stream)
-            {
-              for (idx=0; idx < 4; idx++)
-                es_putc (tmp[idx], state->stream);
-              idx = 0;
-              if (es_ferror (state->stream))
-                goto write_error;
-            }
-          else
-            {
-              for (idx=0; idx < 4; idx++)
-                putc (tmp[idx], state->fp);
-              idx = 0;
-              if (ferror (state->fp))
-                goto write_error;
-            }
-          if (++quad_count >= (64/4))
-            {
-              quad_count = 0;
-              if (!(state->flags & B64ENC_NO_LINEFEEDS)
-                  && my_fputs ("\n", state) == EOF)
-                goto write_error;
-            }
+          state->idx = idx;
+          return 0;
         }
+      if (write_quads (state, state->radbuf, 1))
+        goto write_error;
     }
-  memcpy (state->radbuf, radbuf, idx);
-  state->idx = idx;
-  state->quad_count = quad_count;
+
+  /* Write as much as possible in full lines.  */
+  while (nbytes >= 3)
+    {
+      n = (64/4) - state->quad_count;
+      if (n > nbytes / 3)
+        n = nbytes / 3;
+      if (write_quads (state, p, n))
+        goto write_error;
+      p += n * 3;
+      nbytes -= n * 3;
+    }
+
+  memcpy (state->radbuf, p, nbytes);
+  state->idx = nbytes;
   return 0;
 
  write_error:
@@ -93,6 +93,19 @@
    is to check at runtime whether link(2) works for a specific lock
    file.
 
+   On Linux the lock is in addition protected by an open file
+   description lock (F_OFD_SETLKW) on a second file with the suffix
+   ".lock.ofd".  That file is created on the first use and never
+   removed.  Processes waiting for the lock then block in the kernel
+   and are woken up as soon as the lock is released instead of
+   polling the lock file with increasing sleep intervals.  The
+   hardlink lock is still taken after the OFD lock so that older
+   versions of this module and processes on other hosts are still
+   locked out; among processes using the OFD lock it can always be
+   taken at once.  OFD locks are not used on NFS where they are
+   forwarded to the lock manager of the server and on systems which
+   do not support them.
+
 
    How to use:
    ===========
@@ -211,6 +224,11 @@
 
      HAVE_W32CE_SYSTEM   - Currently only used by GnuPG.
 
+     HAVE_STATFS         - Define if statfs(2) and sys/vfs.h are
+     HAVE_SYS_VFS_H        available.  They are required to use OFD
+                           locks.  If config.h is not used they
+                           default to defined on Linux.
+
    Note that there is a test program t-dotlock which has compile
    instructions at its end.  At least for SMBFS and CIFS it is
    important that 64 bit versions of stat are used; most programming
@@ -277,6 +295,10 @@
 #if !defined (HAVE_CONFIG_H) && defined (HAVE_POSIX_SYSTEM)
 # define HAVE_SIGNAL_H 1
 #endif
+#if !defined (HAVE_CONFIG_H) && defined (__linux__)
+# define HAVE_STATFS 1
+# define HAVE_SYS_VFS_H 1
+#endif
 
 /* Standard headers.  */
 #include <stdlib.h>
@@ -301,6 +323,9 @@
 #ifdef HAVE_SIGNAL_H
 # include <signal.h>
 #endif
+#if defined (HAVE_STATFS) && defined (HAVE_SYS_VFS_H)
+# include <sys/vfs.h>
+#endif
 #ifdef DOTLOCK_USE_PTHREAD
 # include <pthread.h>
 #endif
@@ -321,6 +346,17 @@
 #include "dotlock.h"
 
 
+/* Use OFD locks if the system supports them and we are able to
+   detect NFS.  */
+#if defined (HAVE_POSIX_SYSTEM) && defined (F_OFD_SETLKW) \
+    && defined (HAVE_STATFS) && defined (HAVE_SYS_VFS_H)
+# define DOTLOCK_USE_OFD 1
+#endif
+
+/* The magic number of NFS in the f_type field of struct statfs.  */
+#define DOTLOCK_NFS_SUPER_MAGIC 0x6969
+
+
 /* Define constants for file name construction.  */
 #if !defined(DIRSEP_C) && !defined(EXTSEP_S)
 # ifdef HAVE_DOSISH_SYSTEM
@@ -408,6 +444,10 @@ struct dotlock_handle
   size_t nodename_off; /* Offset in TNAME of the nodename part. */
   size_t nodename_len; /* Length of the nodename part.          */
 #endif /*!HAVE_DOSISH_SYSTEM */
+#ifdef DOTLOCK_USE_OFD
+  int ofd_fd;          /* The fd of the OFD lock file or -1.    */
+#endif
+
 };
 
 
@@ -637,6 +677,59 @@ use_hardlinks_p (const char *tname)
 #endif /*HAVE_POSIX_SYSTEM */
 
 
+#ifdef DOTLOCK_USE_OFD
+/* Return true if FNAME is stored on NFS or if that can't be
+   determined.  */
+static int
+on_nfs_p (const char *fname)
+{
+  struct statfs sf;
+
+  if (statfs (fname, &sf))
+    return 1;
+  return sf.f_type == DOTLOCK_NFS_SUPER_MAGIC;
+}
+
+
+/* Open the file for the OFD lock of H which is FILE_TO_LOCK with the
+   suffix ".lock.ofd".  Stores the file descriptor at H or -1 if OFD
+   locks can't be used; we then resort to the hardlink or O_EXCL lock
+   alone.  */
+static void
+open_ofd_file (dotlock_t h, const char *file_to_lock)
+{
+  char *fname;
+  int flags;
+  int fd;
+
+  h->ofd_fd = -1;
+
+  fname = xtrymalloc (strlen (file_to_lock) + 10);
+  if (!fname)
+    return;
+  strcpy (stpcpy (fname, file_to_lock), EXTSEP_S "lock" EXTSEP_S "ofd");
+
+  flags = O_RDWR|O_CREAT;
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+  do
+    fd = open (fname, flags, S_IRUSR|S_IRGRP|S_IROTH|S_IWUSR);
+  while (fd == -1 && errno == EINTR);
+  if (fd == -1)
+    my_debug_1 ("can't use an OFD lock for '%s'\n", fname);
+  else
+    {
+#ifndef O_CLOEXEC
+      fcntl (fd, F_SETFD, FD_CLOEXEC);
+#endif
+      h->ofd_fd = fd;
+    }
+  xfree (fname);
+}
+#endif /*DOTLOCK_USE_OFD*/
+
+
 
 #ifdef  HAVE_POSIX_SYSTEM
 /* Locking core for Unix.  It used a temporary file and the link
@@ -651,6 +744,11 @@ dotlock_create_unix (dotlock_t h, const char *file_to_lock)
   int dirpartlen;
   struct utsname utsbuf;
   size_t tnamelen;
+#ifdef DOTLOCK_USE_OFD
+  int use_ofd;
+
+  h->ofd_fd = -1;
+#endif
 
   snprintf (pidstr, sizeof pidstr, "%10d\n", (int)getpid() );
 
@@ -725,6 +823,11 @@ dotlock_create_unix (dotlock_t h, const char *file_to_lock)
     }
   fd = -1;
 
+#ifdef DOTLOCK_USE_OFD
+  /* Check this now because in O_EXCL mode the file is removed.  */
+  use_ofd = !on_nfs_p (h->tname);
+#endif
+
   /* Check whether we support hard links.  */
   switch (use_hardlinks_p (h->tname))
     {
@@ -757,6 +860,10 @@ dotlock_create_unix (dotlock_t h, const char *file_to_lock)
       return NULL;
     }
   strcpy (stpcpy (h->lockname, file_to_lock), EXTSEP_S "lock");
+#ifdef DOTLOCK_USE_OFD
+  if (use_ofd)
+    open_ofd_file (h, file_to_lock);
+#endif
   UNLOCK_all_lockfiles ();
   if (h->use_o_excl)
     my_debug_1 ("locking for '%s' done via O_EXCL\n", h->lockname);
@@ -941,6 +1048,11 @@ dotlock_destroy_unix (dotlock_t h)
   if (h->tname && !h->use_o_excl)
     unlink (h->tname);
   xfree (h->tname);
+#ifdef DOTLOCK_USE_OFD
+  /* Closing the file also releases the OFD lock.  */
+  if (h->ofd_fd != -1)
+    close (h->ofd_fd);
+#endif
 }
 #endif /*HAVE_POSIX_SYSTEM*/
 
@@ -1000,6 +1112,97 @@ dotlock_destroy (dotlock_t h)
 
 
 
+#ifdef DOTLOCK_USE_OFD
+/* Take the OFD lock of H.  The remaining time is stored at TIMEOUT
+   for use with the hardlink lock.  Returns 0 on success and -1 on
+   error.  */
+static int
+dotlock_take_ofd (dotlock_t h, long *timeout)
+{
+  struct flock fl;
+  int wtime = 0;
+  int announced = 0;
+  struct timeval tv;
+  int saveerrno;
+
+  memset (&fl, 0, sizeof fl);
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+
+  for (;;)
+    {
+      if (!fcntl (h->ofd_fd, F_OFD_SETLK, &fl))
+        return 0;
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EACCES)
+        break;
+
+      if (!*timeout)
+        {
+          my_set_errno (EACCES);
+          return -1;
+        }
+
+      if (*timeout < 0)
+        {
+          /* Block until the lock has been released.  */
+          if (!announced && maybe_deadlock (h))
+            {
+              my_info_1 (_("waiting for lock %s...\n"), h->lockname);
+              announced = 1;
+            }
+          if (!fcntl (h->ofd_fd, F_OFD_SETLKW, &fl))
+            return 0;
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+
+      /* There is no timed variant of F_OFD_SETLKW; thus we poll with
+         short retry intervals of 5ms, 10ms, 20ms, 40ms and 80ms.  */
+      if (!wtime)
+        wtime = 5;
+      else if (wtime < 80)
+        wtime *= 2;
+      if (wtime > *timeout)
+        wtime = *timeout;
+      *timeout -= wtime;
+
+      tv.tv_sec = wtime / 1000;
+      tv.tv_usec = (wtime % 1000) * 1000;
+      select (0, NULL, NULL, NULL, &tv);
+    }
+
+  saveerrno = errno;
+  my_error_2 (_("lock '%s' not made: %s\n"), h->lockname, strerror (errno));
+  my_set_errno (saveerrno);
+  return -1;
+}
+
+
+/* Release the OFD lock of H.  */
+static void
+dotlock_release_ofd (dotlock_t h)
+{
+  struct flock fl;
+  int saveerrno = errno;
+
+  memset (&fl, 0, sizeof fl);
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 1;
+  if (fcntl (h->ofd_fd, F_OFD_SETLK, &fl))
+    my_error_2 ("release_dotlock: error unlocking '%s': %s\n",
+                h->lockname, strerror (errno));
+  my_set_errno (saveerrno);
+}
+#endif /*DOTLOCK_USE_OFD*/
+
+
 #ifdef HAVE_POSIX_SYSTEM
 /* Unix specific code of make_dotlock.  Returns 0 on success and -1 on
    error.  */
@@ -1248,6 +1451,17 @@ dotlock_take (dotlock_t h, long timeout)
 #ifdef HAVE_DOSISH_SYSTEM
   ret = dotlock_take_w32 (h, timeout);
 #else /*!HAVE_DOSISH_SYSTEM*/
+# ifdef DOTLOCK_USE_OFD
+  if (h->ofd_fd != -1)
+    {
+      if (dotlock_take_ofd (h, &timeout))
+        return -1;
+      ret = dotlock_take_unix (h, timeout);
+      if (ret)
+        dotlock_release_ofd (h);
+      return ret;
+    }
+# endif /*DOTLOCK_USE_OFD*/
   ret = dotlock_take_unix (h, timeout);
 #endif /*!HAVE_DOSISH_SYSTEM*/
 
@@ -1345,6 +1559,13 @@ dotlock_release (dotlock_t h)
   ret = dotlock_release_w32 (h);
 #else
   ret = dotlock_release_unix (h);
+# ifdef DOTLOCK_USE_OFD
+  /* We release the OFD lock even if the lock file could not be
+     removed; otherwise a long running process would lock out all
+     other processes until it terminates.  */
+  if (h->ofd_fd != -1)
+    dotlock_release_ofd (h);
+# endif
 #endif
 
   if (!ret)
@@ -69,8 +69,16 @@
 #if __linux__
 # include <sys/types.h>
 # include <dirent.h>
+# include <sys/syscall.h>
 #endif /*__linux__ */
 
+/* Use close_range(2) or closefrom(3) to close the file descriptors
+ * after a fork if one of them is available.  */
+#if defined(HAVE_CLOSE_RANGE) || defined(HAVE_CLOSEFROM) \
+    || (defined(__linux__) && defined(SYS_close_range))
+# define USE_CLOSE_RANGE 1
+#endif
+
 #include "util.h"
 #include "i18n.h"
 #include "sysutils.h"
@@ -183,6 +191,49 @@ get_max_fds (void)
 }
 
 
+#ifdef USE_CLOSE_RANGE
+/* Close the file descriptors from LOW to HIGH or, if HIGH is -1, all
+ * descriptors starting at LOW.  Returns -1 if the system does not
+ * support this.  */
+static int
+close_fd_range (int low, int high)
+{
+#if defined(HAVE_CLOSE_RANGE)
+  return close_range (low, high == -1? ~0U : high, 0);
+#elif defined(__linux__) && defined(SYS_close_range)
+  return syscall (SYS_close_range, low, high == -1? ~0U : high, 0);
+#else /*HAVE_CLOSEFROM*/
+  if (high == -1)
+    closefrom (low);
+  else
+    for (; low <= high; low++)
+      close (low);
+  return 0;
+#endif
+}
+
+
+/* Close all file descriptors from FIRST on except for those in the
+ * list EXCEPT using close_fd_range.  Returns -1 if this is not
+ * supported by the system.  */
+static int
+close_fds_by_range (int first, int *except)
+{
+  int i;
+
+  for (i=0; except && except[i] != -1; i++)
+    {
+      if (except[i] < first)
+        continue;
+      if (except[i] > first && close_fd_range (first, except[i] - 1))
+        return -1;
+      first = except[i] + 1;
+    }
+  return close_fd_range (first, -1);
+}
+#endif /*USE_CLOSE_RANGE*/
+
+
 /* Close all file descriptors starting with descriptor FIRST.  If
    EXCEPT is not NULL, it is expected to be a list of file descriptors
    which shall not be closed.  This list shall be sorted in ascending
@@ -190,9 +241,23 @@ get_max_fds (void)
 void
 close_all_fds (int first, int *except)
 {
-  int max_fd = get_max_fds ();
+  int max_fd;
   int fd, i, except_start;
 
+#ifdef USE_CLOSE_RANGE
+  /* This takes the same time regardless of the limit on the number of
+   * open files, which may be huge.  It also avoids the opendir in
+   * get_max_fds which is not async-signal-safe.  Old kernels return
+   * ENOSYS; we then fall back to closing them one by one.  */
+  if (!close_fds_by_range (first, except))
+    {
+      gpg_err_set_errno (0);
+      return;
+    }
+#endif /*USE_CLOSE_RANGE*/
+
+  max_fd = get_max_fds ();
+
   if (except)
     {
       except_start = 0;
@@ -96,6 +96,10 @@ typedef struct
   int eof_seen;
   int delayed_rc;
   int print_only_name; /* Flags indicating that fname is not a real file.  */
+#ifdef HAVE_POSIX_FADVISE
+  int readahead;       /* 0 = not yet checked, 1 = active, -1 = unusable.  */
+  off_t offset;        /* File offset after the last read.  */
+#endif
   char fname[1];       /* Name of the file.  */
 } file_filter_ctx_t;
 
@@ -145,6 +149,11 @@ typedef struct
 #define OP_MIN_PARTIAL_CHUNK	  512
 #define OP_MIN_PARTIAL_CHUNK_2POW 9
 
+/* The size of the partial chunks we write doubles with each full
+ * chunk up to this size.  The format allows chunks of up to 2^30
+ * bytes but we need to buffer an entire chunk.  */
+#define OP_MAX_PARTIAL_CHUNK	  (1024*1024)
+
 /* The context we use for the block filter (used to handle OpenPGP
    length information header).  */
 typedef struct
@@ -155,6 +164,9 @@ typedef struct
   int partial;	   /* 1 = partial header, 2 in last partial packet.  */
   char *buffer;	   /* Used for partial header.  */
   size_t buflen;   /* Used size of buffer.  */
+  size_t chunk;    /* Size of the next partial chunk to write; this is
+                      also the allocated size of BUFFER.  */
+  int chunk_2pow;  /* The power of 2 of CHUNK.  */
   int first_c;	   /* First character of a partial header (which is > 0).  */
   int eof;
 }
@@ -443,6 +455,36 @@ fd_cache_open (const char *fname, const char *mode)
 }
 
 
+#ifdef HAVE_POSIX_FADVISE
+/* Tell the kernel that we will soon read the next SIZE bytes from the
+   file of A after having read NREAD bytes.  The kernel then starts
+   reading in the background while we are processing the current
+   buffer.  This is a no-op for pipes and other unseekable files.  */
+static void
+file_readahead (file_filter_ctx_t *a, size_t nread, size_t size)
+{
+  if (a->readahead < 0)
+    return;
+
+  if (!a->readahead)
+    {
+      a->offset = lseek (a->fp, 0, SEEK_CUR);
+      if (a->offset == (off_t)(-1)
+          || posix_fadvise (a->fp, 0, 0, POSIX_FADV_SEQUENTIAL))
+        {
+          a->readahead = -1;
+          return;
+        }
+      a->readahead = 1;
+    }
+  else
+    a->offset += nread;
+
+  posix_fadvise (a->fp, a->offset, size, POSIX_FADV_WILLNEED);
+}
+#endif /*HAVE_POSIX_FADVISE*/
+
+
 static int
 file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
 	     size_t * ret_len)
@@ -534,6 +576,10 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
                   rc = 0;
                 }
             }
+#ifdef HAVE_POSIX_FADVISE
+          if (nbytes && !a->delayed_rc)
+            file_readahead (a, nbytes, size);
+#endif
 #endif
 	  *ret_len = nbytes;
 	}
@@ -596,6 +642,9 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
       a->delayed_rc = 0;
       a->keep_open = 0;
       a->no_cache = 0;
+#ifdef HAVE_POSIX_FADVISE
+      a->readahead = 0;
+#endif
     }
   else if (control == IOBUFCTRL_DESC)
     {
@@ -966,60 +1015,59 @@ block_filter (void *opaque, int control, iobuf_t chain, byte * buffer,
     {
       if (a->partial)
 	{			/* the complicated openpgp scheme */
-	  size_t blen, n, nbytes = size + a->buflen;
-
-	  assert (a->buflen <= OP_MIN_PARTIAL_CHUNK);
-	  if (nbytes < OP_MIN_PARTIAL_CHUNK)
+	  size_t n;
+
+	  /* We write chunks of size A->CHUNK and double that size after
+	   * each chunk.  Thus a long stream is split into few large
+	   * chunks while a short message does not need a large buffer.
+	   * Data is written directly from BUF if we do not have buffered
+	   * data; otherwise it is collected in A->BUFFER.  */
+	  p = buf;
+	  while (!rc && size)
 	    {
-	      /* not enough to write a partial block out; so we store it */
-	      if (!a->buffer)
-		a->buffer = xmalloc (OP_MIN_PARTIAL_CHUNK);
-	      memcpy (a->buffer + a->buflen, buf, size);
-	      a->buflen += size;
-	    }
-	  else
-	    {			/* okay, we can write out something */
-	      /* do this in a loop to use the most efficient block lengths */
-	      p = buf;
-	      do
+	      if (!a->buflen && size >= a->chunk)
+		n = a->chunk;
+	      else
 		{
-		  /* find the best matching block length - this is limited
-		   * by the size of the internal buffering */
-		  for (blen = OP_MIN_PARTIAL_CHUNK * 2,
-		       c = OP_MIN_PARTIAL_CHUNK_2POW + 1; blen <= nbytes;
-		       blen *= 2, c++)
-		    ;
-		  blen /= 2;
-		  c--;
-		  /* write the partial length header */
-		  assert (c <= 0x1f);	/*;-) */
-		  c |= 0xe0;
-		  iobuf_put (chain, c);
-		  if ((n = a->buflen))
-		    {		/* write stuff from the buffer */
-		      assert (n == OP_MIN_PARTIAL_CHUNK);
-		      if (iobuf_write (chain, a->buffer, n))
-			rc = gpg_error_from_syserror ();
-		      a->buflen = 0;
-		      nbytes -= n;
-		    }
-		  if ((n = nbytes) > blen)
-		    n = blen;
-		  if (n && iobuf_write (chain, p, n))
+		  if (!a->buffer)
+		    a->buffer = xmalloc (a->chunk);
+		  n = a->chunk - a->buflen;
+		  if (n > size)
+		    n = size;
+		  memcpy (a->buffer + a->buflen, p, n);
+		  a->buflen += n;
+		  p += n;
+		  size -= n;
+		  if (a->buflen < a->chunk)
+		    break;  /* Wait for more data.  */
+		}
+
+	      /* Write the partial length header and the chunk.  */
+	      log_assert (a->chunk_2pow <= 30);
+	      if (iobuf_put (chain, 0xe0 | a->chunk_2pow))
+		rc = gpg_error_from_syserror ();
+	      else if (a->buflen)
+		{
+		  if (iobuf_write (chain, a->buffer, a->buflen))
+		    rc = gpg_error_from_syserror ();
+		  a->buflen = 0;
+		}
+	      else
+		{
+		  if (iobuf_write (chain, p, n))
 		    rc = gpg_error_from_syserror ();
 		  p += n;
-		  nbytes -= n;
+		  size -= n;
 		}
-	      while (!rc && nbytes >= OP_MIN_PARTIAL_CHUNK);
-	      /* store the rest in the buffer */
-	      if (!rc && nbytes)
+
+	      /* Grow the chunk size.  The buffer needs to be
+	       * reallocated but it is empty at this point.  */
+	      if (a->chunk < OP_MAX_PARTIAL_CHUNK)
 		{
-		  assert (!a->buflen);
-		  assert (nbytes < OP_MIN_PARTIAL_CHUNK);
-		  if (!a->buffer)
-		    a->buffer = xmalloc (OP_MIN_PARTIAL_CHUNK);
-		  memcpy (a->buffer, p, nbytes);
-		  a->buflen = nbytes;
+		  a->chunk *= 2;
+		  a->chunk_2pow++;
+		  xfree (a->buffer);
+		  a->buffer = NULL;
 		}
 	    }
 	}
@@ -1031,7 +1079,11 @@ block_filter (void *opaque, int control, iobuf_t chain, byte * buffer,
       if (DBG_IOBUF)
 	log_debug ("init block_filter %p\n", a);
       if (a->partial)
-	a->count = 0;
+	{
+	  a->count = 0;
+	  a->chunk = OP_MIN_PARTIAL_CHUNK;
+	  a->chunk_2pow = OP_MIN_PARTIAL_CHUNK_2POW;
+	}
       else if (a->use == IOBUF_INPUT)
 	a->count = a->size = 0;
       else
@@ -1820,6 +1872,50 @@ iobuf_pop_filter (iobuf_t a, int (*f) (void *opaque, int control,
 }
 
 
+/* Ask the filter of A to read up to *R_LEN bytes into BUF.  On
+   return *R_LEN is set to the number of bytes actually read.  If the
+   filter signals EOF, it is told to free itself and A->FILTER_EOF is
+   set; any other error is recorded in A->ERROR.  Returns the return
+   code of the filter.  */
+static int
+filter_underflow (iobuf_t a, byte *buf, size_t *r_len)
+{
+  int rc;
+
+  rc = a->filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain, buf, r_len);
+
+  if (DBG_IOBUF)
+    log_debug ("iobuf-%d.%d: A->FILTER() returned rc=%d (%s), read %lu bytes\n",
+	       a->no, a->subno,
+	       rc, rc == 0 ? "ok" : rc == -1 ? "EOF" : gpg_strerror (rc),
+	       (ulong) *r_len);
+
+  if (rc == -1)
+    /* EOF.  */
+    {
+      size_t dummy_len = 0;
+      int rc2;
+
+      /* Tell the filter to free itself */
+      if ((rc2 = a->filter (a->filter_ov, IOBUFCTRL_FREE, a->chain,
+                            NULL, &dummy_len)))
+	log_error ("IOBUFCTRL_FREE failed: %s\n", gpg_strerror (rc2));
+
+      /* Free everything except for the internal buffer.  */
+      if (a->filter_ov && a->filter_ov_owner)
+	xfree (a->filter_ov);
+      a->filter_ov = NULL;
+      a->filter = NULL;
+      a->filter_eof = 1;
+    }
+  else if (rc)
+    /* Record the error.  */
+    a->error = rc;
+
+  return rc;
+}
+
+
 /****************
  * read underflow: read at least one byte into the buffer and return
  * the first byte or -1 on EOF.
@@ -1918,35 +2014,15 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	   A->FILTER.  */
 	rc = 0;
       else
-	rc = a->filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain,
-			&a->d.buf[a->d.len], &len);
+	rc = filter_underflow (a, &a->d.buf[a->d.len], &len);
       a->d.len += len;
 
-      if (DBG_IOBUF)
-	log_debug ("iobuf-%d.%d: A->FILTER() returned rc=%d (%s), read %lu bytes\n",
-		   a->no, a->subno,
-		   rc, rc == 0 ? "ok" : rc == -1 ? "EOF" : gpg_strerror (rc),
-		   (ulong) len);
 /*  	    if( a->no == 1 ) */
 /*                   log_hexdump ("     data:", a->d.buf, len); */
 
       if (rc == -1)
 	/* EOF.  */
 	{
-	  size_t dummy_len = 0;
-
-	  /* Tell the filter to free itself */
-	  if ((rc = a->filter (a->filter_ov, IOBUFCTRL_FREE, a->chain,
-			       NULL, &dummy_len)))
-	    log_error ("IOBUFCTRL_FREE failed: %s\n", gpg_strerror (rc));
-
-	  /* Free everything except for the internal buffer.  */
-	  if (a->filter_ov && a->filter_ov_owner)
-	    xfree (a->filter_ov);
-	  a->filter_ov = NULL;
-	  a->filter = NULL;
-	  a->filter_eof = 1;
-
 	  if (clear_pending_eof && a->d.len == 0 && a->chain)
 	    /* We don't need to keep this filter around at all:
 
@@ -1975,10 +2051,8 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	    return -1;
 	}
       else if (rc)
-	/* Record the error.  */
+	/* The error has been recorded by filter_underflow.  */
 	{
-	  a->error = rc;
-
 	  if (a->d.len == 0)
 	    /* There is no buffered data.  Immediately return EOF.  */
 	    return -1;
@@ -1994,12 +2068,34 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 }
 
 
+/* Write the NBYTES at BUF using the filter of A.  This is used to
+   flush the internal buffer but also to hand a caller's buffer
+   directly to the filter.  */
 static int
-filter_flush (iobuf_t a)
+filter_flush_buffer (iobuf_t a, byte *buf, size_t nbytes)
 {
   size_t len;
   int rc;
 
+  len = nbytes;
+  rc = a->filter (a->filter_ov, IOBUFCTRL_FLUSH, a->chain, buf, &len);
+  if (!rc && len != nbytes)
+    {
+      log_info ("filter_flush did not write all!\n");
+      rc = GPG_ERR_INTERNAL;
+    }
+  else if (rc)
+    a->error = rc;
+
+  return rc;
+}
+
+
+static int
+filter_flush (iobuf_t a)
+{
+  int rc;
+
   if (a->use == IOBUF_OUTPUT_TEMP)
     {				/* increase the temp buffer */
       size_t newsize = a->d.size + iobuf_buffer_size;
@@ -2016,15 +2112,8 @@ filter_flush (iobuf_t a)
     log_bug ("flush on non-output iobuf\n");
   else if (!a->filter)
     log_bug ("filter_flush: no filter\n");
-  len = a->d.len;
-  rc = a->filter (a->filter_ov, IOBUFCTRL_FLUSH, a->chain, a->d.buf, &len);
-  if (!rc && len != a->d.len)
-    {
-      log_info ("filter_flush did not write all!\n");
-      rc = GPG_ERR_INTERNAL;
-    }
-  else if (rc)
-    a->error = rc;
+
+  rc = filter_flush_buffer (a, a->d.buf, a->d.len);
   a->d.len = 0;
 
   return rc;
@@ -2100,6 +2189,30 @@ iobuf_read (iobuf_t a, void *buffer, unsigned int buflen)
   n = 0;
   do
     {
+      if (buf && a->use == IOBUF_INPUT && a->d.start == a->d.len
+          && buflen - n >= a->d.size
+          && a->filter && !a->filter_eof && !a->error)
+	/* The internal buffer is empty and the caller wants at least
+	   as much as it can hold.  Let the filter read directly into
+	   BUFFER to avoid a copy.  */
+	{
+	  size_t len = a->d.size;
+	  int rc;
+
+	  rc = filter_underflow (a, buf, &len);
+	  n += len;
+	  buf += len;
+	  if (!rc && !len)
+	    {
+	      /* Same as an empty read via underflow.  */
+	      a->nbytes += n;
+	      return n ? n : -1 /*EOF*/;
+	    }
+	  /* On EOF or error the next iteration takes care of popping
+	     the filter or returning the pending error.  */
+	  continue;
+	}
+
       if (n < buflen && a->d.start < a->d.len)
 	/* Drain the buffer.  */
 	{
@@ -2214,6 +2327,20 @@ iobuf_write (iobuf_t a, const void *buffer, unsigned int buflen)
 
   do
     {
+      if (a->use == IOBUF_OUTPUT && a->filter && !a->d.len
+          && buflen >= a->d.size)
+	/* The internal buffer is empty and BUFFER would fill it
+	   completely.  Hand it directly to the filter to avoid a
+	   copy.  */
+	{
+	  rc = filter_flush_buffer (a, (byte *)buf, a->d.size);
+	  if (rc)
+	    return rc;
+	  buflen -= a->d.size;
+	  buf += a->d.size;
+	  continue;
+	}
+
       if (buflen && a->d.len < a->d.size)
 	{
 	  unsigned size = a->d.size - a->d.len;
@@ -2514,6 +2641,10 @@ iobuf_seek (iobuf_t a, off_t newpos)
 	  log_error ("can't lseek: %s\n", strerror (errno));
 	  return -1;
 	}
+#ifdef HAVE_POSIX_FADVISE
+      if (b->readahead > 0)
+        b->readahead = 0;  /* Re-read the offset on the next read.  */
+#endif
 #endif
       /* Discard the buffer it is not a temp stream.  */
       a->d.len = 0;
@@ -389,11 +389,16 @@ int iobuf_cancel (iobuf_t iobuf);
        is that if an error occurs and no data has yet been written, it
        is essential that *LEN be set to 0!
 
+       Note: BUF is not necessarily the filter's internal buffer;
+       iobuf_read may pass the caller's buffer to avoid a copy.
+
      IOBUFCTRL_FLUSH: Called with this value to write out any
        collected data.  *LEN is the number of bytes in BUF that need
        to be written out.  Returns 0 on success and a GPG_ERR_* code
        otherwise.  *LEN must be set to the number of bytes that were
-       written out.
+       written out.  The filter must not modify BUF because it may be
+       the buffer passed to iobuf_write, which is handed over without
+       copying if it is at least as large as the internal buffer.
 
      IOBUFCTRL_CANCEL: Called with this value when iobuf_cancel() is
        called on the pipeline.
@@ -323,6 +323,23 @@ base64_reader_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
 
           while (n < count && parm->readpos < parm->linelen )
             {
+              if (!idx && count - n >= 3
+                  && parm->linelen - parm->readpos >= 4)
+                {
+                  /* Fast path for complete quads.  */
+                  size_t nquads = (parm->linelen - parm->readpos) / 4;
+
+                  if (nquads > (count - n) / 3)
+                    nquads = (count - n) / 3;
+                  nquads = b64dec_quads (buffer + n,
+                                         parm->line + parm->readpos, nquads);
+                  if (nquads)
+                    {
+                      n += 3 * nquads;
+                      parm->readpos += 4 * nquads;
+                      continue;
+                    }
+                }
               c = parm->line[parm->readpos++];
               if (c == '\n' || c == ' ' || c == '\r' || c == '\t')
                 continue;
@@ -396,25 +413,21 @@ simple_reader_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
 {
   struct reader_cb_parm_s *parm = cb_value;
   size_t n;
-  int c = 0;
 
   *nread = 0;
   if (!buffer)
     return -1; /* not supported */
 
-  for (n=0; n < count; n++)
+  if (es_read (parm->fp, buffer, count, &n))
     {
-      c = es_getc (parm->fp);
-      if (c == EOF)
-        {
-          parm->eof_seen = 1;
-          if (es_ferror (parm->fp))
-            return -1;
-          if (n)
-            break; /* Return what we have before an EOF.  */
-          return -1;
-        }
-      *(byte *)buffer++ = c;
+      parm->eof_seen = 1;
+      return -1;
+    }
+  if (n < count)
+    {
+      parm->eof_seen = 1;
+      if (!n)
+        return -1;
     }
 
   *nread = n;
@@ -428,8 +441,9 @@ static int
 base64_writer_cb (void *cb_value, const void *buffer, size_t count)
 {
   struct writer_cb_parm_s *parm = cb_value;
-  unsigned char radbuf[4];
-  int i, c, idx, quad_count;
+  char line[64 + sizeof LF];
+  int idx, quad_count;
+  size_t n;
   const unsigned char *p;
   estream_t stream = parm->stream;
 
@@ -451,32 +465,45 @@ base64_writer_cb (void *cb_value, const void *buffer, size_t count)
 
   idx = parm->base64.idx;
   quad_count = parm->base64.quad_count;
-  for (i=0; i < idx; i++)
-    radbuf[i] = parm->base64.radbuf[i];
+  p = buffer;
 
-  for (p=buffer; count; p++, count--)
+  /* Complete a pending quad.  */
+  for (; idx && idx < 3 && count; p++, count--)
+    parm->base64.radbuf[idx++] = *p;
+  if (idx == 3)
     {
-      radbuf[idx++] = *p;
-      if (idx > 2)
+      b64enc_quads (line, parm->base64.radbuf, 1);
+      es_write (stream, line, 4, NULL);
+      if (++quad_count >= (64/4))
         {
-          idx = 0;
-          c = bintoasc[(*radbuf >> 2) & 077];
-          es_putc (c, stream);
-          c = bintoasc[(((*radbuf<<4)&060)|((radbuf[1] >> 4)&017))&077];
-          es_putc (c, stream);
-          c = bintoasc[(((radbuf[1]<<2)&074)|((radbuf[2]>>6)&03))&077];
-          es_putc (c, stream);
-          c = bintoasc[radbuf[2]&077];
-          es_putc (c, stream);
-          if (++quad_count >= (64/4))
-            {
-              es_fputs (LF, stream);
-              quad_count = 0;
-            }
+          es_fputs (LF, stream);
+          quad_count = 0;
+        }
+      idx = 0;
+    }
+
+  /* Write the complete quads line by line.  */
+  while (!idx && count >= 3)
+    {
+      n = (64/4) - quad_count;
+      if (n > count / 3)
+        n = count / 3;
+      b64enc_quads (line, p, n);
+      p += 3 * n;
+      count -= 3 * n;
+      quad_count += n;
+      n *= 4;
+      if (quad_count >= (64/4))
+        {
+          memcpy (line + n, LF, strlen (LF));
+          n += strlen (LF);
+          quad_count = 0;
         }
+      es_write (stream, line, n, NULL);
     }
-  for (i=0; i < idx; i++)
-    parm->base64.radbuf[i] = radbuf[i];
+
+  for (; count; p++, count--)
+    parm->base64.radbuf[idx++] = *p;
   parm->base64.idx = idx;
   parm->base64.quad_count = quad_count;
 
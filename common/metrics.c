@@ -0,0 +1,268 @@
+/* metrics.c - Performance counters for the daemons
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: (LGPL-3.0-or-later OR GPL-2.0-or-later)
+ */
+
+/* The daemons keep a few counters, gauges and histograms which are
+ * returned by their "GETINFO metrics" commands and collected by
+ * "gpgconf --show-metrics".  Each metric is printed on one line:
+ *
+ *   NAME:c:VALUE:                        for a counter
+ *   NAME:g:VALUE:                        for a gauge
+ *   NAME:h:COUNT:SUM:B0:B1:...:B15:      for a histogram
+ *
+ * where the histogram buckets are as described in metrics.h.  Adding
+ * a new metric does not change the format.
+ *
+ * A client may also give each of its connections a trace id with
+ * "OPTION trace-id=ID".  The server then logs each request done on
+ * the connection as a span line
+ *
+ *   trace:ID:PGMNAME:COMMAND:USEC:ERRCODE:
+ *
+ * and passes the id on to the servers it calls itself.  watchgnupg
+ * --traces aggregates these lines by trace id.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_GETTIMEOFDAY
+# include <sys/time.h>
+#endif
+
+#include "util.h"
+#include "membuf.h"
+#include "metrics.h"
+
+
+/* The list of registered metrics in the order of registration.  */
+static metric_t metrics_head;
+static metric_t *metrics_tail = &metrics_head;
+
+/* The request metrics of the Assuan servers.  */
+METRIC_DEFINE_COUNTER (m_requests, "requests");
+METRIC_DEFINE_COUNTER (m_request_errors, "request_errors");
+METRIC_DEFINE_GAUGE (m_requests_active, "requests_active");
+METRIC_DEFINE_HISTOGRAM (m_request_usec, "request_usec");
+
+
+void
+metric_register (metric_t m)
+{
+  if (m->registered)
+    return;
+  m->registered = 1;
+  m->next = NULL;
+  *metrics_tail = m;
+  metrics_tail = &m->next;
+}
+
+
+void
+metric_add (metric_t m, uint64_t n)
+{
+  if (!m->registered)
+    metric_register (m);
+  m->value += n;
+}
+
+
+void
+metric_set (metric_t m, uint64_t value)
+{
+  if (!m->registered)
+    metric_register (m);
+  m->value = value;
+}
+
+
+void
+metric_dec (metric_t m)
+{
+  if (!m->registered)
+    metric_register (m);
+  if (m->value)
+    m->value--;
+}
+
+
+void
+metric_observe (metric_t m, uint64_t value)
+{
+  uint64_t limit;
+  int i;
+
+  if (!m->registered)
+    metric_register (m);
+  m->value++;
+  m->sum += value;
+  for (i=0, limit=1; i < METRIC_BUCKETS - 1 && value >= limit; i++)
+    limit <<= 2;
+  m->buckets[i]++;
+}
+
+
+uint64_t
+metric_usec (void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (!clock_gettime (CLOCK_MONOTONIC, &ts))
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+#ifdef HAVE_GETTIMEOFDAY
+  {
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  }
+#else
+  return (uint64_t)time (NULL) * 1000000;
+#endif
+}
+
+
+/* The trace id of this process if it is a client.  */
+static char client_trace_id[METRIC_TRACE_ID_LEN+1];
+
+
+/* To be called by the pre command notify handler of an Assuan server
+ * for the command CMD.  */
+void
+metric_request_begin (metric_request_t req, const char *cmd)
+{
+  metric_inc (&m_requests);
+  metric_inc (&m_requests_active);
+  mem2str (req->cmd, cmd? cmd : "", sizeof req->cmd);
+  req->start = metric_usec ();
+}
+
+
+/* To be called by the post command notify handler of an Assuan server
+ * with the request REQ started by metric_request_begin.  */
+void
+metric_request_end (metric_request_t req, gpg_error_t err)
+{
+  uint64_t usec;
+
+  if (!req->start)
+    return;
+  usec = metric_usec () - req->start;
+  req->start = 0;
+  metric_dec (&m_requests_active);
+  if (err)
+    metric_inc (&m_request_errors);
+  metric_observe (&m_request_usec, usec);
+  if (*req->trace_id)
+    metric_trace_span (req->trace_id, req->cmd, usec, err);
+}
+
+
+/* Set the trace id of the connection with REQ to VALUE as given by an
+ * Assuan option.  An empty VALUE switches tracing off.  */
+gpg_error_t
+metric_request_set_trace_id (metric_request_t req, const char *value)
+{
+  size_t n;
+
+  n = strlen (value);
+  if (n > METRIC_TRACE_ID_LEN || strspn (value, "0123456789abcdefABCDEF") != n)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  strcpy (req->trace_id, value);
+  return 0;
+}
+
+
+/* Create a new trace id for the requests of this client process.  */
+void
+metric_new_trace_id (void)
+{
+  unsigned char nonce[METRIC_TRACE_ID_LEN/2];
+
+  gcry_create_nonce (nonce, sizeof nonce);
+  bin2hex (nonce, sizeof nonce, client_trace_id);
+}
+
+
+/* Return the trace id of this client process or an empty string.  */
+const char *
+metric_trace_id (void)
+{
+  return client_trace_id;
+}
+
+
+/* Log a span NAME of the trace TRACE_ID which took USEC and ended
+ * with ERR.  */
+void
+metric_trace_span (const char *trace_id, const char *name,
+                   uint64_t usec, gpg_error_t err)
+{
+  log_info ("trace:%s:%s:%s:%llu:%u:\n", trace_id,
+            gpgrt_strusage (11), name,
+            (unsigned long long)usec, gpg_err_code (err));
+}
+
+
+char *
+metrics_format (void)
+{
+  membuf_t mb;
+  metric_t m;
+  int i;
+
+  init_membuf (&mb, 1024);
+  for (m = metrics_head; m; m = m->next)
+    {
+      switch (m->type)
+        {
+        case METRIC_COUNTER:
+        case METRIC_GAUGE:
+          put_membuf_printf (&mb, "%s:%c:%llu:\n", m->name,
+                             m->type == METRIC_COUNTER? 'c':'g',
+                             (unsigned long long)(m->getvalue
+                                                  ? m->getvalue ()
+                                                  : m->value));
+          break;
+        case METRIC_HISTOGRAM:
+          put_membuf_printf (&mb, "%s:h:%llu:%llu:", m->name,
+                             (unsigned long long)m->value,
+                             (unsigned long long)m->sum);
+          for (i=0; i < METRIC_BUCKETS; i++)
+            put_membuf_printf (&mb, "%llu:",
+                               (unsigned long long)m->buckets[i]);
+          put_membuf (&mb, "\n", 1);
+          break;
+        }
+    }
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
@@ -0,0 +1,114 @@
+/* metrics.h - Performance counters for the daemons
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: (LGPL-3.0-or-later OR GPL-2.0-or-later)
+ */
+
+#ifndef GNUPG_COMMON_METRICS_H
+#define GNUPG_COMMON_METRICS_H
+
+/* The types of a metric.  */
+#define METRIC_COUNTER   1  /* A value which only increases.  */
+#define METRIC_GAUGE     2  /* A value which may go up and down.  */
+#define METRIC_HISTOGRAM 3  /* A distribution of values.  */
+
+/* The number of buckets of a histogram.  Bucket N counts the values
+ * below 4^N; the last bucket counts all larger values.  For
+ * latencies in microseconds the last bucket thus starts at about 18
+ * minutes.  */
+#define METRIC_BUCKETS 16
+
+/* A metric.  Metrics are static objects defined using the macros
+ * below; they are added to the list of metrics on their first update
+ * or by metric_register.  The functions are not thread-safe; in the
+ * nPth based daemons this is not a problem as long as they are not
+ * called while the nPth lock is released.  */
+typedef struct metric_s *metric_t;
+struct metric_s
+{
+  metric_t next;
+  const char *name;
+  int type;
+  uint64_t (*getvalue) (void);  /* If set, the value is computed.  */
+  int registered;
+  uint64_t value;               /* The value or number of observations. */
+  uint64_t sum;                 /* The sum of the observed values.  */
+  uint64_t buckets[METRIC_BUCKETS];
+};
+
+#define METRIC_DEFINE_COUNTER(var,name) \
+  static struct metric_s var = { NULL, (name), METRIC_COUNTER }
+#define METRIC_DEFINE_GAUGE(var,name) \
+  static struct metric_s var = { NULL, (name), METRIC_GAUGE }
+#define METRIC_DEFINE_HISTOGRAM(var,name) \
+  static struct metric_s var = { NULL, (name), METRIC_HISTOGRAM }
+#define METRIC_DEFINE_FUNC(var,name,func) \
+  static struct metric_s var = { NULL, (name), METRIC_GAUGE, (func) }
+#define METRIC_DEFINE_COUNTER_FUNC(var,name,func) \
+  static struct metric_s var = { NULL, (name), METRIC_COUNTER, (func) }
+
+void metric_register (metric_t m);
+void metric_add (metric_t m, uint64_t n);
+#define metric_inc(m) metric_add ((m), 1)
+void metric_set (metric_t m, uint64_t value);
+void metric_dec (metric_t m);
+void metric_observe (metric_t m, uint64_t value);
+
+/* Return a monotonic time in microseconds.  */
+uint64_t metric_usec (void);
+
+/* The length of a trace id in hex digits.  */
+#define METRIC_TRACE_ID_LEN 16
+
+/* The state of the current request of an Assuan server connection.
+ * TRACE_ID is set by the client with "OPTION trace-id" and is kept
+ * for the lifetime of the connection.  */
+struct metric_request_s
+{
+  uint64_t start;     /* The start time or 0 for no active request.  */
+  char cmd[24];       /* The name of the command.  */
+  char trace_id[METRIC_TRACE_ID_LEN+1];  /* The trace id or empty.  */
+};
+typedef struct metric_request_s *metric_request_t;
+
+/* Record the requests of an Assuan server.  */
+void metric_request_begin (metric_request_t req, const char *cmd);
+void metric_request_end (metric_request_t req, gpg_error_t err);
+gpg_error_t metric_request_set_trace_id (metric_request_t req,
+                                         const char *value);
+
+/* The trace id of a client process.  */
+void metric_new_trace_id (void);
+const char *metric_trace_id (void);
+void metric_trace_span (const char *trace_id, const char *name,
+                        uint64_t usec, gpg_error_t err);
+
+/* Return all metrics in a malloced string.  */
+char *metrics_format (void);
+
+
+#endif /*GNUPG_COMMON_METRICS_H*/
@@ -43,11 +43,30 @@
 #include "util.h"
 #include "name-value.h"
 
+/* Containers with at least this many entries get an index of the
+ * names on the first lookup.  */
+#define NVC_INDEX_MIN 8
+
+/* The number of buckets of the index.  */
+#define NVC_INDEX_SIZE 64
+
+/* An item of the index: all entries with the same name.  */
+struct nvc_name_s
+{
+  struct nvc_name_s *next;       /* Next item in the bucket.  */
+  struct name_value_entry *first;
+  struct name_value_entry *last;
+};
+
 struct name_value_container
 {
   struct name_value_entry *first;
   struct name_value_entry *last;
   unsigned int private_key_mode:1;
+  unsigned int index_valid:1;    /* INDEX and the NEXT_SAME links of
+                                  * the entries are valid.  */
+  unsigned int nentries;
+  struct nvc_name_s *index[NVC_INDEX_SIZE];
 };
 
 
@@ -56,6 +75,11 @@ struct name_value_entry
   struct name_value_entry *prev;
   struct name_value_entry *next;
 
+  /* The container and, if its index is valid, the next entry with
+     the same name.  */
+  struct name_value_container *container;
+  struct name_value_entry *next_same;
+
   /* The name.  Comments and blank lines have NAME set to NULL.  */
   char *name;
 
@@ -124,6 +148,120 @@ nve_release (nve_t entry, int private_key_mode)
 }
 
 
+/* Release the index of PK.  */
+static void
+index_release (nvc_t pk)
+{
+  struct nvc_name_s *item, *next;
+  int i;
+
+  for (i=0; i < NVC_INDEX_SIZE; i++)
+    {
+      for (item = pk->index[i]; item; item = next)
+        {
+          next = item->next;
+          xfree (item);
+        }
+      pk->index[i] = NULL;
+    }
+  pk->index_valid = 0;
+}
+
+
+/* Return the bucket for NAME.  Names are case-insensitive.  */
+static unsigned int
+index_hash (const char *name)
+{
+  unsigned int h = 0;
+
+  for (; *name; name++)
+    h = h * 31 + ascii_tolower (*(const unsigned char *)name);
+  return h % NVC_INDEX_SIZE;
+}
+
+
+/* Return the index item of PK for NAME or NULL.  */
+static struct nvc_name_s *
+index_find (nvc_t pk, const char *name)
+{
+  struct nvc_name_s *item;
+
+  for (item = pk->index[index_hash (name)]; item; item = item->next)
+    if (item->first && !ascii_strcasecmp (item->first->name, name))
+      return item;
+  return NULL;
+}
+
+
+/* Add the entry E to the index of PK.  E must be the last entry of PK
+ * with its name.  Returns -1 on error.  */
+static int
+index_append (nvc_t pk, nve_t e)
+{
+  struct nvc_name_s *item;
+  unsigned int h;
+
+  e->next_same = NULL;
+  item = index_find (pk, e->name);
+  if (item)
+    {
+      item->last->next_same = e;
+      item->last = e;
+      return 0;
+    }
+
+  item = xtrymalloc (sizeof *item);
+  if (!item)
+    return -1;
+  h = index_hash (e->name);
+  item->first = item->last = e;
+  item->next = pk->index[h];
+  pk->index[h] = item;
+  return 0;
+}
+
+
+/* Build the index of PK.  On error no index is used.  */
+static void
+index_build (nvc_t pk)
+{
+  nve_t e;
+
+  index_release (pk);
+  for (e = pk->first; e; e = e->next)
+    if (e->name && index_append (pk, e))
+      {
+        index_release (pk);
+        return;
+      }
+  pk->index_valid = 1;
+}
+
+
+/* Remove the entry E from the index of PK.  */
+static void
+index_remove (nvc_t pk, nve_t e)
+{
+  struct nvc_name_s *item;
+  nve_t x, prev;
+
+  item = index_find (pk, e->name);
+  if (!item)
+    return;
+  for (prev = NULL, x = item->first; x && x != e; prev = x, x = x->next_same)
+    ;
+  if (!x)
+    return;
+  if (prev)
+    prev->next_same = e->next_same;
+  else
+    item->first = e->next_same;  /* An empty item is skipped by
+                                  * index_find.  */
+  if (item->last == e)
+    item->last = prev;
+}
+
+
 /* Release a private key container structure.  */
 void
 nvc_release (nvc_t pk)
@@ -133,6 +271,8 @@ nvc_release (nvc_t pk)
   if (pk == NULL)
     return;
 
+  index_release (pk);
+
   for (e = pk->first; e; e = next)
     {
       next = e->next;
@@ -381,6 +521,7 @@ _nvc_add (nvc_t pk, char *name, char *value, strlist_t raw_value,
   e->name = name;
   e->value = value;
   e->raw_value = raw_value;
+  e->container = pk;
 
   if (pk->first)
     {
@@ -426,6 +567,13 @@ _nvc_add (nvc_t pk, char *name, char *value, strlist_t raw_value,
     }
   else
     pk->first = pk->last = e;
+  pk->nentries++;
+
+  /* Appending keeps the index valid.  Entries inserted in the middle
+   * need a rebuild of the index on the next lookup.  */
+  if (pk->index_valid && name
+      && (e != pk->last || index_append (pk, e)))
+    index_release (pk);
 
  leave:
   if (err)
@@ -501,6 +649,10 @@ nvc_set (nvc_t pk, const char *name, const char *value)
 void
 nvc_delete (nvc_t pk, nve_t entry)
 {
+  if (pk->index_valid && entry->name)
+    index_remove (pk, entry);
+  pk->nentries--;
+
   if (entry->prev)
     entry->prev->next = entry->next;
   else
@@ -550,6 +702,16 @@ nve_t
 nvc_lookup (nvc_t pk, const char *name)
 {
   nve_t entry;
+  struct nvc_name_s *item;
+
+  if (!pk->index_valid && pk->nentries >= NVC_INDEX_MIN)
+    index_build (pk);
+  if (pk->index_valid)
+    {
+      item = index_find (pk, name);
+      return item? item->first : NULL;
+    }
+
   for (entry = pk->first; entry; entry = entry->next)
     if (entry->name && ascii_strcasecmp (entry->name, name) == 0)
       return entry;
@@ -572,6 +734,10 @@ nve_next (nve_t entry)
 nve_t
 nve_next_value (nve_t entry, const char *name)
 {
+  if (entry->container->index_valid
+      && entry->name && !ascii_strcasecmp (entry->name, name))
+    return entry->next_same;
+
   for (entry = entry->next; entry; entry = entry->next)
     if (entry->name && ascii_strcasecmp (entry->name, name) == 0)
       return entry;
@@ -711,8 +877,9 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
 
       if (name && (spacep (buf) || *p == 0))
 	{
-	  /* A continuation.  */
-	  if (append_to_strlist_try (&raw_value, buf) == NULL)
+	  /* A continuation.  The list is built in reverse order to
+	     avoid walking it for each line.  */
+	  if (add_to_strlist_try (&raw_value, buf) == NULL)
 	    {
 	      err = my_error_from_syserror ();
 	      goto leave;
@@ -723,6 +890,7 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
       /* No continuation.  Add the current entry if any.  */
       if (raw_value)
 	{
+	  strlist_rev (&raw_value);
 	  err = _nvc_add (*result, name, NULL, raw_value, 1);
 	  if (err)
 	    goto leave;
@@ -777,7 +945,10 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
 
   /* Add the final entry.  */
   if (raw_value)
-    err = _nvc_add (*result, name, NULL, raw_value, 1);
+    {
+      strlist_rev (&raw_value);
+      err = _nvc_add (*result, name, NULL, raw_value, 1);
+    }
 
  leave:
   gpgrt_free (buf);
@@ -43,7 +43,7 @@ typedef enum
     SELECT_SAME,
     SELECT_SUB,
     SELECT_NONEMPTY,
-    SELECT_ISTRUE,
+    SELECT_ISTRUE, /* The numerical operators are ISTRUE to GT.  */
     SELECT_EQ, /* Numerically equal.  */
     SELECT_LE,
     SELECT_GE,
@@ -64,7 +64,11 @@ struct recsel_expr_s
   unsigned int not:1;   /* Negate operators. */
   unsigned int disjun:1;/* Start of a disjunction.  */
   unsigned int xcase:1; /* String match is case sensitive.  */
+  int propid;           /* The id of the property as set by
+                         * recsel_set_propids or 0.  */
   const char *value;    /* (Points into NAME.)  */
+  const char *lcvalue;  /* VALUE in lowercase if !XCASE; else VALUE.  */
+  size_t valuelen;      /* strlen of VALUE.  */
   long numvalue;        /* strtol of VALUE.  */
   char name[1];         /* Name of the property.  */
 };
@@ -116,6 +120,28 @@ my_memstr (const void *buffer, size_t buflen, const char *sub)
 }
 
 
+/* A case-insensitive version of my_memstr for a SUB which is already
+ * in lowercase.  */
+static const char *
+my_memstr_lc (const void *buffer, size_t buflen, const char *sub)
+{
+  const unsigned char *buf = buffer;
+  const unsigned char *s = (const unsigned char *)sub;
+  size_t n, i;
+
+  for (n = 0; n < buflen; n++)
+    if (ascii_tolower (buf[n]) == *s)
+      {
+        for (i = 1; n + i < buflen && s[i]
+               && ascii_tolower (buf[n+i]) == s[i]; i++)
+          ;
+        if (!s[i])
+          return (const char*)buf + n;
+      }
+  return NULL;
+}
+
+
 /* Return a pointer to the next logical connection operator or NULL if
  * none.  */
 static char *
@@ -247,7 +273,8 @@ recsel_parse_expr (recsel_expr_t *selector, const char *expression)
   if (next_lc)
     *next_lc = 0;  /* Terminate this term.  */
 
-  se = xtrymalloc (sizeof *se + strlen (expr));
+  /* The extra space is used for the lowercase copy of the value.  */
+  se = xtrymalloc (sizeof *se + 2 * strlen (expr) + 1);
   if (!se)
     return my_error_from_syserror ();
   strcpy (se->name, expr);
@@ -255,6 +282,7 @@ recsel_parse_expr (recsel_expr_t *selector, const char *expression)
   se->not = 0;
   se->disjun = disjun;
   se->xcase = xcase;
+  se->propid = 0;
 
   if (!se_head)
     se_head = se;
@@ -436,6 +464,15 @@ recsel_parse_expr (recsel_expr_t *selector, const char *expression)
     }
 
   se->numvalue = strtol (se->value, NULL, 0);
+  se->valuelen = strlen (se->value);
+  if (xcase)
+    se->lcvalue = se->value;
+  else
+    {
+      char *p = se->name + strlen (expr) + 1;
+
+      se->lcvalue = ascii_strlwr (strcpy (p, se->value));
+    }
 
   if (next_lc)
     {
@@ -503,24 +540,42 @@ recsel_dump (recsel_expr_t selector)
 }
 
 
-/* Return true if the record RECORD has been selected.  The GETVAL
- * function is called with COOKIE and the NAME of a property used in
- * the expression.  */
-int
-recsel_select (recsel_expr_t selector,
-               const char *(*getval)(void *cookie, const char *propname),
-               void *cookie)
+/* Map the property names of SELECTOR to ids using GETID.  GETID shall
+ * return 0 for an unknown name.  The ids are passed to the GETVAL
+ * function of recsel_select_id so that it does not need to compare
+ * the names for each record.  */
+void
+recsel_set_propids (recsel_expr_t selector,
+                    int (*getid)(const char *propname))
+{
+  recsel_expr_t se;
+
+  for (se = selector; se; se = se->next)
+    se->propid = getid (se->name);
+}
+
+
+/* Common code for recsel_select and recsel_select_id.  */
+static int
+do_select (recsel_expr_t selector,
+           const char *(*getval)(void *cookie, const char *propname),
+           const char *(*getval_id)(void *cookie, int propid,
+                                    const char *propname),
+           void *cookie)
 {
   recsel_expr_t se;
   const char *value;
   size_t selen, valuelen;
-  long numvalue;
+  long numvalue = 0;
   int result = 1;
 
   se = selector;
   while (se)
     {
-      value = getval? getval (cookie, se->name) : NULL;
+      if (getval_id)
+        value = getval_id (cookie, se->propid, se->name);
+      else
+        value = getval? getval (cookie, se->name) : NULL;
       if (!value)
         value = "";
 
@@ -532,8 +587,9 @@ recsel_select (recsel_expr_t selector,
       else /* Field has a value.  */
         {
           valuelen = strlen (value);
-          numvalue = strtol (value, NULL, 0);
-          selen = strlen (se->value);
+          if (se->op >= SELECT_ISTRUE && se->op <= SELECT_GT)
+            numvalue = strtol (value, NULL, 0);
+          selen = se->valuelen;
 
           switch (se->op)
             {
@@ -541,13 +597,14 @@ recsel_select (recsel_expr_t selector,
               if (se->xcase)
                 result = (valuelen==selen && !memcmp (value,se->value,selen));
               else
-                result = (valuelen==selen && !memicmp (value,se->value,selen));
+                result = (valuelen==selen
+                          && !ascii_memcasecmp (value, se->lcvalue, selen));
               break;
             case SELECT_SUB:
               if (se->xcase)
                 result = !!my_memstr (value, valuelen, se->value);
               else
-                result = !!memistr (value, valuelen, se->value);
+                result = !!my_memstr_lc (value, valuelen, se->lcvalue);
               break;
             case SELECT_NONEMPTY:
               result = !!valuelen;
@@ -622,3 +679,27 @@ recsel_select (recsel_expr_t selector,
 
   return result;
 }
+
+
+/* Return true if the record RECORD has been selected.  The GETVAL
+ * function is called with COOKIE and the NAME of a property used in
+ * the expression.  */
+int
+recsel_select (recsel_expr_t selector,
+               const char *(*getval)(void *cookie, const char *propname),
+               void *cookie)
+{
+  return do_select (selector, getval, NULL, cookie);
+}
+
+
+/* Same as recsel_select but GETVAL is called with COOKIE, the id of
+ * the property as set by recsel_set_propids and its NAME.  */
+int
+recsel_select_id (recsel_expr_t selector,
+                  const char *(*getval)(void *cookie, int propid,
+                                        const char *propname),
+                  void *cookie)
+{
+  return do_select (selector, NULL, getval, cookie);
+}
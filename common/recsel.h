@@ -38,6 +38,12 @@ void recsel_dump (recsel_expr_t selector);
 int recsel_select (recsel_expr_t selector,
                    const char *(*getval)(void *cookie, const char *propname),
                    void *cookie);
+void recsel_set_propids (recsel_expr_t selector,
+                         int (*getid)(const char *propname));
+int recsel_select_id (recsel_expr_t selector,
+                      const char *(*getval)(void *cookie, int propid,
+                                            const char *propname),
+                      void *cookie);
 
 
 #endif /*GNUPG_COMMON_RECSEL_H*/
@@ -428,6 +428,67 @@ run_modification_tests (void)
 }
 
 
+/* Test the lookups in a container large enough to be indexed.  */
+static void
+run_index_tests (void)
+{
+  gpg_error_t err;
+  nvc_t pk;
+  nve_t e;
+  char name[20];
+  char *buf;
+  int i, n;
+
+  pk = my_nvc_new ();
+  assert (pk);
+
+  for (i=0; i < 40; i++)
+    {
+      snprintf (name, sizeof name, "Name%d:", i % 10);
+      err = nvc_add (pk, name, i < 10? "first" : "more");
+      assert (!err);
+    }
+
+  for (i=0; i < 10; i++)
+    {
+      snprintf (name, sizeof name, "NAME%d:", i);
+      e = nvc_lookup (pk, name);
+      assert (e);
+      assert (strcmp (nve_value (e), "first") == 0);
+      for (n=1; (e = nve_next_value (e, name)); n++)
+        assert (strcmp (nve_value (e), "more") == 0);
+      assert (n == 4);
+    }
+  assert (!nvc_lookup (pk, "Name10:"));
+
+  /* Entries added in the middle invalidate the index.  */
+  err = nvc_add (pk, "Name3:", "last");
+  assert (!err);
+  e = nvc_lookup (pk, "Name3:");
+  for (n=1; nve_next_value (e, "Name3:"); n++)
+    e = nve_next_value (e, "Name3:");
+  assert (n == 5);
+  assert (strcmp (nve_value (e), "last") == 0);
+
+  nvc_delete_named (pk, "Name3:");
+  assert (!nvc_lookup (pk, "Name3:"));
+  nvc_delete (pk, nvc_lookup (pk, "Name4:"));
+  e = nvc_lookup (pk, "Name4:");
+  assert (e && strcmp (nve_value (e), "more") == 0);
+
+  err = nvc_add (pk, "Name3:", "again");
+  assert (!err);
+  e = nvc_lookup (pk, "Name3:");
+  assert (e && strcmp (nve_value (e), "again") == 0);
+  assert (!nve_next_value (e, "Name3:"));
+
+  buf = nvc_to_string (pk);
+  assert (strstr (buf, "Name3: again\n"));
+  xfree (buf);
+  nvc_release (pk);
+}
+
+
 void
 convert (const char *fname)
 {
@@ -595,9 +656,11 @@ main (int argc, char **argv)
     case TEST:
       run_tests ();
       run_modification_tests ();
+      run_index_tests ();
       private_key_mode = 1;
       run_tests ();
       run_modification_tests ();
+      run_index_tests ();
       break;
 
     case CONVERT:
@@ -383,6 +383,65 @@ run_test_2 (void)
 }
 
 
+static int
+test_3_getid (const char *name)
+{
+  if (!strcmp (name, "uid"))
+    return 1;
+  else if (!strcmp (name, "one"))
+    return 2;
+  else
+    return 0;
+}
+
+static const char *
+test_3_getval (void *cookie, int propid, const char *name)
+{
+  if (propid != test_3_getid (name))
+    fail (0, 0);
+  switch (propid)
+    {
+    case 1: return "Foo Bar <foo@EXAMPLE.org>";
+    case 2: return "1";
+    default: return cookie;
+    }
+}
+
+static void
+run_test_3 (void)
+{
+  gpg_error_t err;
+  recsel_expr_t se = NULL;
+
+  ADDEXPR ("uid =~ @Example.ORG>");
+  recsel_set_propids (se, test_3_getid);
+  if (!recsel_select_id (se, test_3_getval, NULL))
+    fail (0, 0);
+  FREEEXPR();
+  ADDEXPR ("-c uid =~ @Example.ORG>");
+  recsel_set_propids (se, test_3_getid);
+  if (recsel_select_id (se, test_3_getval, NULL))
+    fail (0, 0);
+  FREEEXPR();
+  ADDEXPR ("uid = foo bar <FOO@example.org>");
+  recsel_set_propids (se, test_3_getid);
+  if (!recsel_select_id (se, test_3_getval, NULL))
+    fail (0, 0);
+  FREEEXPR();
+  ADDEXPR ("uid =~ example.orgx");
+  recsel_set_propids (se, test_3_getid);
+  if (recsel_select_id (se, test_3_getval, NULL))
+    fail (0, 0);
+  FREEEXPR();
+  ADDEXPR ("one == 1 && nothing -z");
+  recsel_set_propids (se, test_3_getid);
+  if (!recsel_select_id (se, test_3_getval, NULL))
+    fail (0, 0);
+
+  FREEEXPR();
+}
+
+
 
 int
 main (int argc, char **argv)
@@ -432,6 +491,7 @@ main (int argc, char **argv)
   run_test_1 ();
   run_test_1b ();
   run_test_2 ();
+  run_test_3 ();
   /* Fixme: We should add test for complex conditions.  */
 
   return 0;
@@ -166,11 +166,13 @@ gpg_error_t b64enc_start_es (struct b64state *state, estream_t fp,
 gpg_error_t b64enc_write (struct b64state *state,
                           const void *buffer, size_t nbytes);
 gpg_error_t b64enc_finish (struct b64state *state);
+void b64enc_quads (char *out, const void *in, size_t nquads);
 
 gpg_error_t b64dec_start (struct b64state *state, const char *title);
 gpg_error_t b64dec_proc (struct b64state *state, void *buffer, size_t length,
                          size_t *r_nbytes);
 gpg_error_t b64dec_finish (struct b64state *state);
+size_t b64dec_quads (void *out, const void *in, size_t nquads);
 
 /*-- sexputil.c */
 char *canon_sexp_to_string (const unsigned char *canon, size_t canonlen);
@@ -156,17 +156,13 @@ cdb_init(struct cdb *cdbp, int fd)
   cdbp->cdb_fsize = st.st_size;
   cdbp->cdb_mem = mem;
 
-#if 0
-  /* XXX don't know well about madvise syscall -- is it legal
-     to set different options for parts of one mmap() region?
-     There is also posix_madvise() exist, with POSIX_MADV_RANDOM etc...
-  */
-#ifdef MADV_RANDOM
-  /* set madvise() parameters. Ignore errors for now if system
-     doesn't support it */
+#if !defined(_WIN32) && defined(MADV_RANDOM) && defined(MADV_WILLNEED)
+  /* The toc is needed for every lookup but the rest of the file is
+     accessed by hash probes and thus read-ahead is useless.  Advices
+     work on whole pages; thus the toc page is flagged after the rest.
+     Ignore errors because the advice is just a hint.  */
+  madvise(mem, fsize, MADV_RANDOM);
   madvise(mem, 2048, MADV_WILLNEED);
-  madvise(mem + 2048, cdbp->cdb_fsize - 2048, MADV_RANDOM);
-#endif
 #endif
 
   cdbp->cdb_vpos = cdbp->cdb_vlen = 0;
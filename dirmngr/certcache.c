@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -32,9 +33,13 @@
 #include "../common/ksba-io-support.h"
 #include "crlfetch.h"
 #include "certcache.h"
+#include "../common/metrics.h"
 
 #define MAX_NONPERM_CACHED_CERTS 1000
 
+METRIC_DEFINE_COUNTER (m_cache_hits, "certcache_hits");
+METRIC_DEFINE_COUNTER (m_cache_misses, "certcache_misses");
+
 /* Constants used to classify search patterns.  */
 enum pattern_class
   {
@@ -56,16 +61,25 @@ enum pattern_class
 /* A certificate cache item.  This consists of a the KSBA cert object
    and some meta data for easier lookup.  We use a hash table to keep
    track of all items and use the (randomly distributed) first byte of
-   the fingerprint directly as the hash which makes it pretty easy. */
+   the fingerprint directly as the hash which makes it pretty easy.
+   Valid items are also linked into the secondary hash tables indexed
+   by subject DN, issuer DN, issuer DN plus serial number, and subject
+   key identifier.  */
 struct cert_item_s
 {
   struct cert_item_s *next; /* Next item with the same hash value. */
+  struct cert_item_s *next_subject; /* Next in the subject index.  */
+  struct cert_item_s *next_issuer;  /* Next in the issuer index.  */
+  struct cert_item_s *next_sn;      /* Next in the issuer+sn index.  */
+  struct cert_item_s *next_ski;     /* Next in the keyid index.  */
   ksba_cert_t cert;         /* The KSBA cert object or NULL is this is
                                not a valid item.  */
   unsigned char fpr[20];    /* The fingerprint of this object. */
   char *issuer_dn;          /* The malloced issuer DN.  */
   ksba_sexp_t sn;           /* The malloced serial number  */
   char *subject_dn;         /* The malloced subject DN - maybe NULL.  */
+  ksba_sexp_t ski;          /* The malloced subject key identifier - maybe
+                               NULL.  */
 
   /* If this field is set the certificate has been taken from some
    * configuration and shall not be flushed from the cache.  */
@@ -81,6 +95,13 @@ typedef struct cert_item_s *cert_item_t;
    the first byte of the fingerprint.  */
 static cert_item_t cert_cache[256];
 
+/* The secondary indices.  */
+#define CERT_INDEX_SIZE 256
+static cert_item_t subject_index[CERT_INDEX_SIZE];
+static cert_item_t issuer_index[CERT_INDEX_SIZE];
+static cert_item_t sn_index[CERT_INDEX_SIZE];
+static cert_item_t ski_index[CERT_INDEX_SIZE];
+
 /* This is the global cache_lock variable. In general locking is not
    needed but it would take extra efforts to make sure that no
    indirect use of npth functions is done, so we simply lock it
@@ -224,6 +245,105 @@ cert_compute_fpr (ksba_cert_t cert, unsigned char *digest)
 
 
 
+/* Return the index hash value for the string S.  */
+static unsigned int
+hash_string (const char *s)
+{
+  unsigned int h = 0;
+
+  for (; *s; s++)
+    h = h * 31 + *(const unsigned char *)s;
+  return h % CERT_INDEX_SIZE;
+}
+
+
+/* Return the index hash value for the canonical S-expression SEXP,
+   which is a single atom like a serial number or keyid, combined
+   with the hash value H.  */
+static unsigned int
+hash_canon_atom (ksba_sexp_t sexp, unsigned int h)
+{
+  const unsigned char *p = sexp;
+  unsigned long n;
+
+  if (!p || *p != '(')
+    return h;
+  for (n=0, p++; *p >= '0' && *p <= '9'; p++)
+    n = n*10 + (*p - '0');
+  if (*p != ':')
+    return h;
+  for (p++; n; n--, p++)
+    h = h * 31 + *p;
+  return h % CERT_INDEX_SIZE;
+}
+
+
+/* Unlink the item CI from the secondary index at TABLE[IDX] using
+   the link field at offset OFF.  */
+static void
+unlink_from_index (cert_item_t *table, unsigned int idx, cert_item_t ci,
+                   size_t off)
+{
+  cert_item_t *cip;
+
+  for (cip = &table[idx]; *cip;
+       cip = (cert_item_t *)((char *)*cip + off))
+    if (*cip == ci)
+      {
+        *cip = *(cert_item_t *)((char *)ci + off);
+        break;
+      }
+}
+
+
+/* Link the valid item CI into the secondary indices.  */
+static void
+link_cache_slot (cert_item_t ci)
+{
+  unsigned int h;
+
+  if (ci->subject_dn)
+    {
+      h = hash_string (ci->subject_dn);
+      ci->next_subject = subject_index[h];
+      subject_index[h] = ci;
+    }
+  h = hash_string (ci->issuer_dn);
+  ci->next_issuer = issuer_index[h];
+  issuer_index[h] = ci;
+  h = hash_canon_atom (ci->sn, h);
+  ci->next_sn = sn_index[h];
+  sn_index[h] = ci;
+  if (ci->ski)
+    {
+      h = hash_canon_atom (ci->ski, 0);
+      ci->next_ski = ski_index[h];
+      ski_index[h] = ci;
+    }
+}
+
+
+/* Remove the valid item CI from the secondary indices.  */
+static void
+unlink_cache_slot (cert_item_t ci)
+{
+  unsigned int h;
+
+  if (ci->subject_dn)
+    unlink_from_index (subject_index, hash_string (ci->subject_dn), ci,
+                       offsetof (struct cert_item_s, next_subject));
+  h = hash_string (ci->issuer_dn);
+  unlink_from_index (issuer_index, h, ci,
+                     offsetof (struct cert_item_s, next_issuer));
+  unlink_from_index (sn_index, hash_canon_atom (ci->sn, h), ci,
+                     offsetof (struct cert_item_s, next_sn));
+  if (ci->ski)
+    unlink_from_index (ski_index, hash_canon_atom (ci->ski, 0), ci,
+                       offsetof (struct cert_item_s, next_ski));
+  ci->next_subject = ci->next_issuer = ci->next_sn = ci->next_ski = NULL;
+}
+
+
 /* Cleanup one slot.  This releases all resourses but keeps the actual
    slot in the cache marked for reuse. */
 static void
@@ -234,12 +354,16 @@ clean_cache_slot (cert_item_t ci)
   if (!ci->cert)
     return; /* Already cleaned.  */
 
+  if (ci->issuer_dn && ci->sn)
+    unlink_cache_slot (ci);
   ksba_free (ci->sn);
   ci->sn = NULL;
   ksba_free (ci->issuer_dn);
   ci->issuer_dn = NULL;
   ksba_free (ci->subject_dn);
   ci->subject_dn = NULL;
+  ksba_free (ci->ski);
+  ci->ski = NULL;
   cert = ci->cert;
   ci->cert = NULL;
 
@@ -344,6 +468,9 @@ put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
       return gpg_error (GPG_ERR_INV_CERT_OBJ);
     }
   ci->subject_dn = ksba_cert_get_subject (cert, 0);
+  if (ksba_cert_get_subj_key_id (cert, NULL, &ci->ski))
+    ci->ski = NULL;
+  link_cache_slot (ci);
   ci->permanent = !!permanent;
   ci->trustclasses = trustclass;
 
@@ -892,10 +1019,12 @@ get_cert_byfpr (const unsigned char *fpr)
       {
         ksba_cert_ref (ci->cert);
         release_cache_lock ();
+        metric_inc (&m_cache_hits);
         return ci->cert;
       }
 
   release_cache_lock ();
+  metric_inc (&m_cache_misses);
   return NULL;
 }
 
@@ -945,24 +1074,23 @@ get_cert_byhexfpr (const char *string)
 ksba_cert_t
 get_cert_bysn (const char *issuer_dn, ksba_sexp_t serialno)
 {
-  /* Simple and inefficient implementation.   fixme! */
   cert_item_t ci;
-  int i;
+  unsigned int h;
 
+  h = hash_canon_atom (serialno, hash_string (issuer_dn));
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn)
-            && !compare_serialno (ci->sn, serialno))
-          {
-            ksba_cert_ref (ci->cert);
-            release_cache_lock ();
-            return ci->cert;
-          }
-    }
+  for (ci=sn_index[h]; ci; ci = ci->next_sn)
+    if (!strcmp (ci->issuer_dn, issuer_dn)
+        && !compare_serialno (ci->sn, serialno))
+      {
+        ksba_cert_ref (ci->cert);
+        release_cache_lock ();
+        metric_inc (&m_cache_hits);
+        return ci->cert;
+      }
 
   release_cache_lock ();
+  metric_inc (&m_cache_misses);
   return NULL;
 }
 
@@ -972,22 +1100,17 @@ get_cert_bysn (const char *issuer_dn, ksba_sexp_t serialno)
 ksba_cert_t
 get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 {
-  /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
-  int i;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn))
-          if (!seq--)
-            {
-              ksba_cert_ref (ci->cert);
-              release_cache_lock ();
-              return ci->cert;
-            }
-    }
+  for (ci=issuer_index[hash_string (issuer_dn)]; ci; ci = ci->next_issuer)
+    if (!strcmp (ci->issuer_dn, issuer_dn))
+      if (!seq--)
+        {
+          ksba_cert_ref (ci->cert);
+          release_cache_lock ();
+          return ci->cert;
+        }
 
   release_cache_lock ();
   return NULL;
@@ -999,26 +1122,40 @@ get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 ksba_cert_t
 get_cert_bysubject (const char *subject_dn, unsigned int seq)
 {
-  /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
-  int i;
 
   if (!subject_dn)
     return NULL;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && ci->subject_dn
-            && !strcmp (ci->subject_dn, subject_dn))
-          if (!seq--)
-            {
-              ksba_cert_ref (ci->cert);
-              release_cache_lock ();
-              return ci->cert;
-            }
-    }
+  for (ci=subject_index[hash_string (subject_dn)]; ci; ci = ci->next_subject)
+    if (!strcmp (ci->subject_dn, subject_dn))
+      if (!seq--)
+        {
+          ksba_cert_ref (ci->cert);
+          release_cache_lock ();
+          return ci->cert;
+        }
+
+  release_cache_lock ();
+  return NULL;
+}
+
+
+/* Return the certificate with the subject key identifier KEYID.  */
+static ksba_cert_t
+get_cert_byski (ksba_sexp_t keyid)
+{
+  cert_item_t ci;
+
+  acquire_cache_read_lock ();
+  for (ci=ski_index[hash_canon_atom (keyid, 0)]; ci; ci = ci->next_ski)
+    if (!cmp_simple_canon_sexp (keyid, ci->ski))
+      {
+        ksba_cert_ref (ci->cert);
+        release_cache_lock ();
+        return ci->cert;
+      }
 
   release_cache_lock ();
   return NULL;
@@ -1462,20 +1599,19 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
 
       /* For efficiency reasons we won't use get_cert_bysubject here. */
       acquire_cache_read_lock ();
-      for (i=0; i < 256; i++)
-        for (ci=cert_cache[i]; ci; ci = ci->next)
-          if (ci->cert && ci->subject_dn
-              && !strcmp (ci->subject_dn, subject_dn))
-            for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
-              if (!memcmp (ci->fpr, cr->fpr, 20))
-                {
-                  ksba_cert_ref (ci->cert);
-                  release_cache_lock ();
-                  if (DBG_LOOKUP)
-                    log_debug ("%s: certificate found in the cache"
-                               " via ocsp_certs\n", __func__);
-                  return ci->cert; /* We use this certificate. */
-                }
+      i = hash_string (subject_dn);
+      for (ci=subject_index[i]; ci; ci = ci->next_subject)
+        if (!strcmp (ci->subject_dn, subject_dn))
+          for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
+            if (!memcmp (ci->fpr, cr->fpr, 20))
+              {
+                ksba_cert_ref (ci->cert);
+                release_cache_lock ();
+                if (DBG_LOOKUP)
+                  log_debug ("%s: certificate found in the cache"
+                             " via ocsp_certs\n", __func__);
+                return ci->cert; /* We use this certificate. */
+              }
       release_cache_lock ();
       if (DBG_LOOKUP)
         log_debug ("find_cert_bysubject: certificate not in ocsp_certs\n");
@@ -1505,28 +1641,14 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
    * by keyid.  */
   if (!subject_dn && keyid)
     {
-      int i;
-      cert_item_t ci;
-      ksba_sexp_t ski;
-
-      acquire_cache_read_lock ();
-      for (i=0; i < 256; i++)
-        for (ci=cert_cache[i]; ci; ci = ci->next)
-          if (ci->cert && !ksba_cert_get_subj_key_id (ci->cert, NULL, &ski))
-            {
-              if (!cmp_simple_canon_sexp (keyid, ski))
-                {
-                  ksba_free (ski);
-                  ksba_cert_ref (ci->cert);
-                  release_cache_lock ();
-                  if (DBG_LOOKUP)
-                    log_debug ("%s: certificate found in the cache"
-                               " via ski\n", __func__);
-                  return ci->cert;
-                }
-              ksba_free (ski);
-            }
-      release_cache_lock ();
+      cert = get_cert_byski (keyid);
+      if (cert)
+        {
+          if (DBG_LOOKUP)
+            log_debug ("%s: certificate found in the cache"
+                       " via ski\n", __func__);
+          return cert;
+        }
     }
 
   if (DBG_LOOKUP)
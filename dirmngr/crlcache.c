@@ -98,6 +98,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <npth.h>
 #ifndef HAVE_W32_SYSTEM
 #include <sys/utsname.h>
 #endif
@@ -119,11 +120,22 @@
 #define DBDIRFILE "DIR.txt"
 #define DBDIRVERSION 1
 
+/* A CRL which has been used since it was loaded is refreshed by the
+   housekeeping if it expires within this number of seconds.  */
+#define CRL_REFRESH_AHEAD (60*60)
+
 /* The number of DB files we may have open at one time.  We need to
    limit this because there is no guarantee that the number of issuers
-   has a upper limit.  We are currently using mmap, so it is a good
-   idea anyway to limit the number of opened cache files. */
-#define MAX_OPEN_DB_FILES 5
+   has a upper limit.  An open file is kept mapped into memory so that
+   a lookup does not need any system call; with S/MIME the number of
+   issuers in use is usually not that large and thus we keep enough
+   files open to avoid reopening them all the time.  */
+#define MAX_OPEN_DB_FILES 32
+
+/* Parsing a large CRL is CPU bound and does not block.  After this
+   number of items the parser lets other threads run; in particular
+   the thread prefetching the CRL from the network.  */
+#define CRL_YIELD_ITEMS 1000
 
 #ifndef O_BINARY
 # define O_BINARY 0
@@ -159,9 +171,10 @@ struct crl_cache_entry_s
   struct cdb *cdb;             /* The cache file handle or NULL if not open. */
 
   unsigned int cdb_use_count;  /* Current use count. */
-  unsigned int cdb_lru_count;  /* Used for LRU purposes. */
+  unsigned int cdb_lru_count;  /* Value of DB_LRU_CLOCK at the last use. */
   int dbfile_checked;          /* Set to true if the dbfile_hash value has
                                   been checked one. */
+  int used;                    /* Looked up since it was loaded.  */
 };
 
 
@@ -184,6 +197,17 @@ static crl_cache_entry_t find_entry (crl_cache_entry_t first,
    right at startup.  */
 static crl_cache_t current_cache;
 
+/* A counter incremented with each use of a DB file.  It is used to
+   find the least recently used file.  */
+static unsigned int db_lru_clock;
+
+/* The URLs of the CRLs which are currently refreshed in the
+   background.  */
+static strlist_t refreshing_urls;
+
+static int refreshable_url_p (const char *url);
+static void start_crl_refresh (const char *url);
+
 
 
 
@@ -361,20 +385,30 @@ next_line_from_file (estream_t fp, gpg_error_t *r_err)
 }
 
 
+/* Close the DB file of ENTRY if it is open.  */
+static void
+close_db_file (crl_cache_entry_t entry)
+{
+  int fd;
+
+  if (!entry->cdb)
+    return;
+  fd = cdb_fileno (entry->cdb);
+  cdb_free (entry->cdb);
+  xfree (entry->cdb);
+  entry->cdb = NULL;
+  if (close (fd))
+    log_error (_("error closing cache file: %s\n"), strerror(errno));
+}
+
+
 /* Release one cache entry.  */
 static void
 release_one_cache_entry (crl_cache_entry_t entry)
 {
   if (entry)
     {
-      if (entry->cdb)
-        {
-          int fd = cdb_fileno (entry->cdb);
-          cdb_free (entry->cdb);
-          xfree (entry->cdb);
-          if (close (fd))
-            log_error (_("error closing cache file: %s\n"), strerror(errno));
-        }
+      close_db_file (entry);
       xfree (entry->release_ptr);
       xfree (entry->check_trust_anchor);
       xfree (entry);
@@ -1081,6 +1115,7 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
   if (entry->cdb)
     {
       entry->cdb_use_count++;
+      entry->cdb_lru_count = ++db_lru_clock;
       return entry->cdb;
     }
 
@@ -1114,12 +1149,7 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
 
 /*       log_debug ("CACHE: closing file at cdb=%p\n", last_e->cdb); */
 
-      fd = cdb_fileno (last_e->cdb);
-      cdb_free (last_e->cdb);
-      xfree (last_e->cdb);
-      last_e->cdb = NULL;
-      if (close (fd))
-        log_error (_("error closing cache file: %s\n"), strerror(errno));
+      close_db_file (last_e);
       open_count--;
     }
 
@@ -1165,7 +1195,7 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
   xfree (fname);
 
   entry->cdb_use_count = 1;
-  entry->cdb_lru_count = 0;
+  entry->cdb_lru_count = ++db_lru_clock;
 
   return entry->cdb;
 }
@@ -1179,10 +1209,7 @@ unlock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
   else if (!entry->cdb_use_count)
     log_error (_("calling unlock_db_file on an unlocked file\n"));
   else
-    {
-      entry->cdb_use_count--;
-      entry->cdb_lru_count++;
-    }
+    entry->cdb_use_count--;
 
   /* If the entry was marked for deletion in the meantime do it now.
      We do this for the sake of Pth thread safeness. */
@@ -1291,13 +1318,31 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
       log_info (_("no CRL available for issuer id %s\n"), issuer_hash );
       return CRL_CACHE_DONTKNOW;
     }
+  entry->used = 1;
 
   gnupg_get_isotime (current_time);
   if (strcmp (entry->next_update, current_time) < 0 )
     {
-      log_info (_("cached CRL for issuer id %s too old; update required\n"),
-                issuer_hash);
-      return CRL_CACHE_DONTKNOW;
+      gnupg_isotime_t tmptime;
+
+      /* In grace mode we use a recently expired CRL and fetch the new
+         one in the background.  */
+      gnupg_copy_time (tmptime, entry->next_update);
+      if (opt.crl_grace_period
+          && !add_seconds_to_isotime (tmptime, opt.crl_grace_period)
+          && strcmp (tmptime, current_time) >= 0
+          && refreshable_url_p (entry->url))
+        {
+          log_info (_("cached CRL for issuer id %s too old;"
+                      " using it while it is refreshed\n"), issuer_hash);
+          start_crl_refresh (entry->url);
+        }
+      else
+        {
+          log_info (_("cached CRL for issuer id %s too old;"
+                      " update required\n"), issuer_hash);
+          return CRL_CACHE_DONTKNOW;
+        }
     }
   if (force_refresh)
     {
@@ -1836,6 +1881,7 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
   int algo = 0;
   int use_pss = 0;
   size_t n;
+  unsigned int nitems = 0;
 
   (void)fname;
 
@@ -1917,6 +1963,12 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
               }
 
             ksba_free (serial);
+
+            if (!(++nitems % CRL_YIELD_ITEMS))
+              {
+                npth_unprotect ();
+                npth_protect ();
+              }
           }
           break;
 
@@ -2353,13 +2405,7 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
           if (!e->cdb_use_count && e->cdb
               && !strcmp (e->issuer_hash, entry->issuer_hash))
             {
-              int fd = cdb_fileno (e->cdb);
-              cdb_free (e->cdb);
-              xfree (e->cdb);
-              e->cdb = NULL;
-              if (close (fd))
-                log_error (_("error closing cache file: %s\n"),
-                           strerror(errno));
+              close_db_file (e);
               any = 1;
               break;
             }
@@ -2411,6 +2457,165 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
 }
 
 
+/* Return true if the CRL fetched from URL may be refreshed by
+   fetching it again.  CRLs loaded from a file have the file name as
+   URL.  */
+static int
+refreshable_url_p (const char *url)
+{
+  return (url
+          && (!strncmp (url, "http:", 5) || !strncmp (url, "https:", 6)
+              || !strncmp (url, "ldap:", 5) || !strncmp (url, "ldaps:", 6)));
+}
+
+
+/* Fetch the CRL from URL and insert it into the cache.  */
+static void
+refresh_crl (ctrl_t ctrl, const char *url)
+{
+  gpg_error_t err;
+  ksba_reader_t reader;
+  strlist_t sl, *slp;
+
+  if (strlist_find (refreshing_urls, url))
+    return;  /* Already in progress.  */
+  sl = add_to_strlist_try (&refreshing_urls, url);
+  if (!sl)
+    {
+      log_error ("error refreshing CRL from '%s': %s\n",
+                 url, gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  if (opt.verbose)
+    log_info ("refreshing CRL from '%s'\n", url);
+  err = crl_fetch (ctrl, url, &reader);
+  if (!err)
+    {
+      err = crl_cache_insert (ctrl, url, reader);
+      crl_close_reader (reader);
+    }
+  if (err)
+    log_info ("refreshing CRL from '%s' failed: %s\n",
+              url, gpg_strerror (err));
+
+  for (slp = &refreshing_urls; *slp; slp = &(*slp)->next)
+    if (*slp == sl)
+      {
+        *slp = sl->next;
+        xfree (sl);
+        break;
+      }
+}
+
+
+/* The thread started by start_crl_refresh.  */
+static void *
+crl_refresh_thread (void *arg)
+{
+  char *url = arg;
+  ctrl_t ctrl;
+
+  ctrl = xtrycalloc (1, sizeof *ctrl);
+  if (!ctrl)
+    log_error ("error allocating thread object: %s\n",
+               gpg_strerror (gpg_error_from_syserror ()));
+  else
+    {
+      dirmngr_init_default_ctrl (ctrl);
+      if (current_cache)
+        refresh_crl (ctrl, url);
+      dirmngr_deinit_default_ctrl (ctrl);
+      xfree (ctrl);
+    }
+  xfree (url);
+  return NULL;
+}
+
+
+/* Start a thread to refresh the CRL fetched from URL.  */
+static void
+start_crl_refresh (const char *url)
+{
+  npth_attr_t tattr;
+  npth_t thread;
+  char *urlcopy;
+  int rc;
+
+  if (strlist_find (refreshing_urls, url))
+    return;
+  urlcopy = xtrystrdup (url);
+  if (!urlcopy)
+    return;
+
+  rc = npth_attr_init (&tattr);
+  if (!rc)
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+      rc = npth_create (&thread, &tattr, crl_refresh_thread, urlcopy);
+      npth_attr_destroy (&tattr);
+    }
+  if (rc)
+    {
+      log_error ("error spawning CRL refresh thread: %s\n", strerror (rc));
+      xfree (urlcopy);
+    }
+}
+
+
+/* Refresh the CRLs which are in use and are about to expire.  This
+   is called by the housekeeping thread so that the CRLs are replaced
+   while the old ones are still valid; a client request thus rarely
+   needs to wait for a CRL download.  While the new CRL is fetched
+   and parsed into a temporary file the old one keeps serving
+   requests.  */
+void
+crl_cache_housekeeping (ctrl_t ctrl)
+{
+  crl_cache_entry_t e;
+  strlist_t urls = NULL;
+  strlist_t sl;
+  gnupg_isotime_t current_time, tmptime;
+
+  if (!current_cache)
+    return;
+
+  /* Collect the URLs first; the list of entries may change while we
+     are fetching.  */
+  gnupg_get_isotime (current_time);
+  for (e = current_cache->entries; e; e = e->next)
+    {
+      if (e->deleted || !e->used || !refreshable_url_p (e->url))
+        continue;
+
+      gnupg_copy_time (tmptime, current_time);
+      add_seconds_to_isotime (tmptime, CRL_REFRESH_AHEAD);
+      if (strcmp (e->next_update, tmptime) > 0)
+        continue; /* Not yet due.  */
+      if (*e->last_refresh)
+        {
+          /* Same threshold as used for force-crl-refresh.  */
+          gnupg_copy_time (tmptime, e->last_refresh);
+          add_seconds_to_isotime (tmptime, 30 * 60);
+          if (strcmp (tmptime, current_time) > 0)
+            continue;
+        }
+
+      e->used = 0;
+      if (!strlist_find (urls, e->url) && !add_to_strlist_try (&urls, e->url))
+        {
+          log_error ("error collecting CRLs to refresh: %s\n",
+                     gpg_strerror (gpg_error_from_syserror ()));
+          break;
+        }
+    }
+
+  for (sl = urls; sl; sl = sl->next)
+    refresh_crl (ctrl, sl->d);
+  free_strlist (urls);
+}
+
+
 /* Print one cached entry E in a human readable format to stream
    FP. Return 0 on success. */
 static gpg_error_t
@@ -21,6 +21,7 @@
 #include <config.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <npth.h>
 
@@ -34,12 +35,38 @@
 # include "ldap-wrapper.h"
 #endif
 
+/* Size of the buffer filled by the prefetch thread.  */
+#define PREFETCH_BUFSIZE (256 * 1024)
+
+/* A CRL downloaded via HTTP is read from the network by a separate
+   thread into a ring buffer while the ksba parser consumes the ring.
+   Thus the download continues while the parser, the signature hash
+   and the writing of the cache file are busy.  The object is shared
+   by the prefetch thread and the reader; the last one to drop its
+   reference releases it.  */
+struct prefetch_s
+{
+  npth_mutex_t lock;
+  npth_cond_t cond;         /* Signaled on any change of the state.  */
+  int refcount;
+  estream_t fp;             /* The HTTP stream; only used by the thread.  */
+  unsigned char *buffer;    /* The ring buffer.  */
+  size_t start;             /* Offset of the first filled byte.  */
+  size_t count;             /* Number of filled bytes.  */
+  int eof;                  /* The thread has seen EOF.  */
+  int stop;                 /* The reader is gone; the thread shall stop.  */
+  gpg_error_t err;          /* A read error seen by the thread.  */
+};
+typedef struct prefetch_s *prefetch_t;
+
+
 /* For detecting armored CRLs received via HTTP (yes, such CRLS really
    exits, e.g. http://grid.fzk.de/ca/gridka-crl.pem at least in June
    2008) we need a context in the reader callback.  */
 struct reader_cb_context_s
 {
   estream_t fp;             /* The stream used with the ksba reader.  */
+  prefetch_t prefetch;      /* If not NULL read from this instead of FP.  */
   int checked:1;            /* PEM/binary detection ahs been done.    */
   int is_pem:1;             /* The file stream is PEM encoded.        */
   struct b64state b64state; /* The state used for Base64 decoding.    */
@@ -98,12 +125,200 @@ get_file_reader (ksba_reader_t reader)
 
 
 
+/* Drop a reference to PF and release it if it was the last one.  */
+static void
+prefetch_unref (prefetch_t pf)
+{
+  int last;
+
+  npth_mutex_lock (&pf->lock);
+  last = !--pf->refcount;
+  npth_mutex_unlock (&pf->lock);
+  if (!last)
+    return;
+
+  es_fclose (pf->fp);
+  npth_cond_destroy (&pf->cond);
+  npth_mutex_destroy (&pf->lock);
+  xfree (pf->buffer);
+  xfree (pf);
+}
+
+
+/* The prefetch thread.  It reads directly into the free part of the
+   ring; the reader only touches the filled part and thus the lock
+   need not be held while reading.  */
+static void *
+prefetch_thread (void *arg)
+{
+  prefetch_t pf = arg;
+  gpg_error_t err = 0;
+  size_t pos, len, nread;
+
+  npth_mutex_lock (&pf->lock);
+  while (!pf->stop && !pf->eof && !pf->err)
+    {
+      if (pf->count == PREFETCH_BUFSIZE)
+        {
+          npth_cond_wait (&pf->cond, &pf->lock);
+          continue;
+        }
+      pos = (pf->start + pf->count) % PREFETCH_BUFSIZE;
+      len = PREFETCH_BUFSIZE - pf->count;
+      if (pos + len > PREFETCH_BUFSIZE)
+        len = PREFETCH_BUFSIZE - pos;
+      npth_mutex_unlock (&pf->lock);
+
+      nread = 0;
+      if (es_read (pf->fp, pf->buffer + pos, len, &nread))
+        err = gpg_error_from_syserror ();
+      else if (!nread && es_ferror (pf->fp))
+        err = gpg_error (GPG_ERR_EIO);
+
+      npth_mutex_lock (&pf->lock);
+      pf->count += nread;
+      if (err)
+        pf->err = err;
+      else if (!nread)
+        pf->eof = 1;
+      npth_cond_broadcast (&pf->cond);
+    }
+  npth_mutex_unlock (&pf->lock);
+
+  prefetch_unref (pf);
+  return NULL;
+}
+
+
+/* Start a prefetch thread for the stream FP.  On success the stream
+   is owned by the new object which is stored at R_PF.  */
+static gpg_error_t
+prefetch_start (estream_t fp, prefetch_t *r_pf)
+{
+  prefetch_t pf;
+  npth_attr_t tattr;
+  npth_t thread;
+  int rc;
+
+  *r_pf = NULL;
+
+  pf = xtrycalloc (1, sizeof *pf);
+  if (!pf)
+    return gpg_error_from_syserror ();
+  pf->buffer = xtrymalloc (PREFETCH_BUFSIZE);
+  if (!pf->buffer)
+    {
+      rc = errno;
+      xfree (pf);
+      return gpg_error_from_errno (rc);
+    }
+  rc = npth_mutex_init (&pf->lock, NULL);
+  if (!rc)
+    {
+      rc = npth_cond_init (&pf->cond, NULL);
+      if (rc)
+        npth_mutex_destroy (&pf->lock);
+    }
+  if (rc)
+    {
+      xfree (pf->buffer);
+      xfree (pf);
+      return gpg_error_from_errno (rc);
+    }
+  pf->fp = fp;
+  pf->refcount = 2;
+
+  rc = npth_attr_init (&tattr);
+  if (!rc)
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+      rc = npth_create (&thread, &tattr, prefetch_thread, pf);
+      npth_attr_destroy (&tattr);
+    }
+  if (rc)
+    {
+      pf->fp = NULL;  /* Not owned on error.  */
+      npth_cond_destroy (&pf->cond);
+      npth_mutex_destroy (&pf->lock);
+      xfree (pf->buffer);
+      xfree (pf);
+      return gpg_error_from_errno (rc);
+    }
+
+  *r_pf = pf;
+  return 0;
+}
+
+
+/* Tell the prefetch thread of PF to stop and drop our reference.
+   The thread may still be blocked in a read; it releases the object
+   when that returns.  */
+static void
+prefetch_release (prefetch_t pf)
+{
+  if (!pf)
+    return;
+  npth_mutex_lock (&pf->lock);
+  pf->stop = 1;
+  npth_cond_broadcast (&pf->cond);
+  npth_mutex_unlock (&pf->lock);
+  prefetch_unref (pf);
+}
+
+
+/* Read up to NBYTES from the ring of PF into BUFFER.  Waits until
+   the prefetch thread has data, an error, or EOF.  */
+static int
+prefetch_read (prefetch_t pf, char *buffer, size_t nbytes, size_t *nread)
+{
+  gpg_error_t err = 0;
+  size_t n, len;
+
+  *nread = 0;
+  if (!nbytes)
+    return 0;
+
+  npth_mutex_lock (&pf->lock);
+  while (!pf->count && !pf->eof && !pf->err)
+    npth_cond_wait (&pf->cond, &pf->lock);
+  if (pf->count)
+    {
+      n = nbytes < pf->count? nbytes : pf->count;
+      len = PREFETCH_BUFSIZE - pf->start;
+      if (len > n)
+        len = n;
+      memcpy (buffer, pf->buffer + pf->start, len);
+      if (len < n)
+        memcpy (buffer + len, pf->buffer, n - len);
+      pf->start = (pf->start + n) % PREFETCH_BUFSIZE;
+      pf->count -= n;
+      *nread = n;
+      npth_cond_broadcast (&pf->cond);
+    }
+  else if (pf->err)
+    err = pf->err;
+  else
+    err = gpg_error (GPG_ERR_EOF);
+  npth_mutex_unlock (&pf->lock);
+
+  return err;
+}
+
+
 static int
 my_es_read (void *opaque, char *buffer, size_t nbytes, size_t *nread)
 {
   struct reader_cb_context_s *cb_ctx = opaque;
   int result;
 
+  if (cb_ctx->prefetch)
+    {
+      result = prefetch_read (cb_ctx->prefetch, buffer, nbytes, nread);
+      if (result)
+        return result;
+      goto got_data;
+    }
+
   result = es_read (cb_ctx->fp, buffer, nbytes, nread);
   if (result)
     return result;
@@ -114,6 +329,8 @@ my_es_read (void *opaque, char *buffer, size_t nbytes, size_t *nread)
   if (!nread && es_ferror (cb_ctx->fp))
     return gpg_error (GPG_ERR_EIO);
 
+ got_data:
+
   if (!cb_ctx->checked && *nread)
     {
       int c = *(unsigned char *)buffer;
@@ -197,6 +414,10 @@ crl_fetch (ctrl_t ctrl, const char *url, ksba_reader_t *reader)
             err = gpg_error_from_syserror ();
           else if (!(err = ksba_reader_new (reader)))
             {
+              /* Without a prefetch thread we read the stream
+               * directly.  */
+              if (!prefetch_start (httpfp, &cb_ctx->prefetch))
+                httpfp = NULL;
               cb_ctx->fp = httpfp;
               err = ksba_reader_set_cb (*reader, &my_es_read, cb_ctx);
               if (!err)
@@ -219,6 +440,8 @@ crl_fetch (ctrl_t ctrl, const char *url, ksba_reader_t *reader)
                          gpg_strerror (err));
               ksba_reader_release (*reader);
               *reader = NULL;
+              if (cb_ctx)
+                prefetch_release (cb_ctx->prefetch);
               xfree (cb_ctx);
             }
         }
@@ -486,6 +709,7 @@ crl_close_reader (ksba_reader_t reader)
   if (cb_ctx)
     {
       /* This is an HTTP context. */
+      prefetch_release (cb_ctx->prefetch);
       if (cb_ctx->fp)
         es_fclose (cb_ctx->fp);
       /* Release the base64 decoder state.  */
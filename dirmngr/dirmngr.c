@@ -63,6 +63,7 @@
 #include "certcache.h"
 #include "crlcache.h"
 #include "crlfetch.h"
+#include "ocsp.h"
 #include "misc.h"
 #if USE_LDAP
 # include "ldapserver.h"
@@ -131,6 +132,9 @@ enum cmd_and_opt_values {
   oOCSPMaxClockSkew,
   oOCSPMaxPeriod,
   oOCSPCurrentPeriod,
+  oCRLGracePeriod,
+  oWKDCacheTTL,
+  oWKDCacheNegativeTTL,
   oMaxReplies,
   oHkpCaCert,
   oFakedSystemTime,
@@ -149,8 +153,10 @@ enum cmd_and_opt_values {
   oStandardResolver,
   oRecursiveResolver,
   oResolverTimeout,
+  oDnsCacheSize,
   oConnectTimeout,
   oConnectQuickTimeout,
+  oMaxNetworkJobs,
   oListenBacklog,
   aTest
 };
@@ -224,9 +230,11 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oStandardResolver, "standard-resolver", "@"),
   ARGPARSE_s_n (oRecursiveResolver, "recursive-resolver", "@"),
   ARGPARSE_s_i (oResolverTimeout, "resolver-timeout", "@"),
+  ARGPARSE_s_i (oDnsCacheSize, "dns-cache-size", "@"),
   ARGPARSE_s_s (oNameServer, "nameserver", "@"),
   ARGPARSE_s_i (oConnectTimeout, "connect-timeout", "@"),
   ARGPARSE_s_i (oConnectQuickTimeout, "connect-quick-timeout", "@"),
+  ARGPARSE_s_u (oMaxNetworkJobs, "max-network-jobs", "@"),
 
 
   ARGPARSE_header ("Keyserver", N_("Configuration for Keyservers")),
@@ -283,6 +291,9 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_header (NULL, N_("Other options")),
 
   ARGPARSE_s_n (oForce,    "force",    N_("force loading of outdated CRLs")),
+  ARGPARSE_s_i (oCRLGracePeriod, "crl-grace-period", "@"),
+  ARGPARSE_s_i (oWKDCacheTTL, "wkd-cache-ttl", "@"),
+  ARGPARSE_s_i (oWKDCacheNegativeTTL, "wkd-cache-negative-ttl", "@"),
   ARGPARSE_s_s (oSocketName, "socket-name", "@"),  /* Only for debugging.  */
 
 
@@ -322,6 +333,11 @@ static struct debug_flags_s debug_flags [] =
 #define DEFAULT_CONNECT_TIMEOUT       (15*1000)  /* 15 seconds */
 #define DEFAULT_CONNECT_QUICK_TIMEOUT ( 2*1000)  /*  2 seconds */
 
+#define DEFAULT_MAX_NETWORK_JOBS 16
+
+#define DEFAULT_WKD_CACHE_TTL          (60*60)  /* 1 hour */
+#define DEFAULT_WKD_CACHE_NEGATIVE_TTL (10*60)  /* 10 minutes */
+
 /* For the cleanup handler we need to keep track of the socket's name.  */
 static const char *socket_name;
 /* If the socket has been redirected, this is the name of the
@@ -647,6 +663,9 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.ocsp_max_clock_skew = 10 * 60;      /* 10 minutes.  */
       opt.ocsp_max_period = 90 * 86400;       /* 90 days.  */
       opt.ocsp_current_period = 3 * 60 * 60;  /* 3 hours. */
+      opt.crl_grace_period = 0;
+      opt.wkd_cache_ttl = DEFAULT_WKD_CACHE_TTL;
+      opt.wkd_cache_negative_ttl = DEFAULT_WKD_CACHE_NEGATIVE_TTL;
       opt.max_replies = DEFAULT_MAX_REPLIES;
       while (opt.ocsp_signer)
         {
@@ -664,8 +683,10 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       disable_check_own_socket = 0;
       enable_standard_resolver (0);
       set_dns_timeout (0);
+      set_dns_cache_size (-1);
       opt.connect_timeout = 0;
       opt.connect_quick_timeout = 0;
+      opt.max_network_jobs = DEFAULT_MAX_NETWORK_JOBS;
       return 1;
     }
 
@@ -722,6 +743,15 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
     case oOCSPMaxClockSkew: opt.ocsp_max_clock_skew = pargs->r.ret_int; break;
     case oOCSPMaxPeriod: opt.ocsp_max_period = pargs->r.ret_int; break;
     case oOCSPCurrentPeriod: opt.ocsp_current_period = pargs->r.ret_int; break;
+    case oCRLGracePeriod:
+      opt.crl_grace_period = pargs->r.ret_int > 0? pargs->r.ret_int : 0;
+      break;
+    case oWKDCacheTTL:
+      opt.wkd_cache_ttl = pargs->r.ret_int > 0? pargs->r.ret_int : 0;
+      break;
+    case oWKDCacheNegativeTTL:
+      opt.wkd_cache_negative_ttl = pargs->r.ret_int > 0? pargs->r.ret_int : 0;
+      break;
 
     case oMaxReplies: opt.max_replies = pargs->r.ret_int; break;
 
@@ -767,6 +797,10 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       set_dns_timeout (pargs->r.ret_int);
       break;
 
+    case oDnsCacheSize:
+      set_dns_cache_size (pargs->r.ret_int);
+      break;
+
     case oConnectTimeout:
       opt.connect_timeout = pargs->r.ret_ulong * 1000;
       break;
@@ -775,6 +809,10 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.connect_quick_timeout = pargs->r.ret_ulong * 1000;
       break;
 
+    case oMaxNetworkJobs:
+      opt.max_network_jobs = pargs->r.ret_ulong;
+      break;
+
     default:
       return 0; /* Not handled. */
     }
@@ -1496,6 +1534,8 @@ main (int argc, char **argv)
       if (argc)
         wrong_args ("--flush");
       rc = crl_cache_flush();
+      ocsp_cache_deinit (1);
+      wkd_cache_deinit (1);
     }
   else if (cmd == aGPGConfTest)
     dirmngr_exit (0);
@@ -1527,8 +1567,12 @@ static void
 cleanup (void)
 {
   crl_cache_deinit ();
+  ocsp_cache_deinit (0);
+  wkd_cache_deinit (0);
   cert_cache_deinit (1);
   reload_dns_stuff (1);
+  http_release_idle_connections (1);
+  http_release_tls_cache ();
 
 #if USE_LDAP
   ldapserver_list_free (opt.ldapservers);
@@ -1841,9 +1885,13 @@ dirmngr_sighup_action (void)
   set_tor_mode ();
   cert_cache_deinit (0);
   crl_cache_deinit ();
+  ocsp_cache_deinit (0);
+  wkd_cache_deinit (0);
   cert_cache_init (hkp_cacert_filenames);
   crl_cache_init ();
   reload_dns_stuff (0);
+  http_release_idle_connections (1);
+  http_release_tls_cache ();
   ks_hkp_reload ();
 }
 
@@ -1933,7 +1981,9 @@ housekeeping_thread (void *arg)
   dirmngr_init_default_ctrl (&ctrlbuf);
 
   dns_stuff_housekeeping ();
+  http_release_idle_connections (0);
   ks_hkp_housekeeping (curtime);
+  crl_cache_housekeeping (&ctrlbuf);
   if (network_activity_seen)
     {
       network_activity_seen = 0;
@@ -103,6 +103,7 @@ struct
 
   unsigned int connect_timeout;       /* Timeout for connect.  */
   unsigned int connect_quick_timeout; /* Shorter timeout for connect.  */
+  unsigned int max_network_jobs;  /* Max. concurrent network commands.  */
 
   int disable_http;       /* Do not use HTTP at all.  */
   int disable_ldap;       /* Do not use LDAP at all.  */
@@ -124,6 +125,12 @@ struct
 
   int allow_ocsp;     /* Allow using OCSP. */
 
+  unsigned int crl_grace_period; /* Seconds an expired CRL may be used
+                                    while it is refreshed.  */
+
+  unsigned int wkd_cache_ttl;          /* Seconds to cache a WKD key.  */
+  unsigned int wkd_cache_negative_ttl; /* Ditto for a not found result. */
+
   int max_replies;
   unsigned int ldaptimeout;
 
@@ -256,6 +263,13 @@ void domaininfo_set_wkd_supported (const char *domain);
 void domaininfo_set_wkd_not_supported (const char *domain);
 void domaininfo_set_wkd_not_found (const char *domain);
 
+/*-- wkdcache.c --*/
+gpg_error_t wkd_cache_get (const char *addrspec, void **r_data,
+                           size_t *r_datalen, char **r_source);
+void wkd_cache_put (const char *addrspec, const void *data, size_t datalen,
+                    const char *source);
+void wkd_cache_deinit (int remove_file);
+
 /*-- workqueue.c --*/
 typedef const char *(*wqtask_t)(ctrl_t ctrl, const char *args);
 
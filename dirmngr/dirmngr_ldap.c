@@ -93,7 +93,8 @@ enum
     oTls,
 
     oOnlySearchTimeout,
-    oLogWithPID
+    oLogWithPID,
+    oServer
   };
 
 
@@ -118,6 +119,7 @@ static gpgrt_opt_t opts[] = {
   { oAttr,     "attr",      2, N_("|STRING|return the attribute STRING")},
   { oOnlySearchTimeout, "only-search-timeout", 0, "@"},
   { oLogWithPID,"log-with-pid", 0, "@"},
+  { oServer,   "server",    0, "@"},
   ARGPARSE_end ()
 };
 
@@ -133,6 +135,7 @@ struct my_opt_s
   unsigned int alarm_timeout; /* And for the alarm based timeout.  */
   int multi;
   int force_tls;
+  int keep_connection; /* Keep the LDAP connection open (server mode).  */
 
   estream_t outstream;    /* Send output to this stream.  */
 
@@ -150,11 +153,24 @@ struct my_opt_s
 typedef struct my_opt_s *my_opt_t;
 
 
+/* In server mode the LDAP connection of the last request is kept
+   open for the next request.  */
+static struct
+{
+  LDAP *ld;
+  char *host;
+  int port;
+  int usetls;
+} conn_cache;
+
+
 /* Prototypes.  */
 #ifndef HAVE_W32_SYSTEM
 static void catch_alarm (int dummy);
 #endif
+static void clear_timeout (void);
 static int process_url (my_opt_t myopt, const char *url);
+static int run_server (my_opt_t myopt);
 
 
 
@@ -200,6 +216,7 @@ main (int argc, char **argv)
   struct my_opt_s my_opt_buffer;
   my_opt_t myopt = &my_opt_buffer;
   char *malloced_buffer1 = NULL;
+  int server_mode = 0;
 
   memset (&my_opt_buffer, 0, sizeof my_opt_buffer);
 
@@ -257,6 +274,7 @@ main (int argc, char **argv)
             log_set_prefix (NULL, oldflags | GPGRT_LOG_WITH_PID);
           }
           break;
+        case oServer: server_mode = myopt->keep_connection = 1; break;
 
         default :
           pargs.err = ARGPARSE_PRINT_ERROR;
@@ -292,7 +310,7 @@ main (int argc, char **argv)
 
   if (log_get_errorcount (0))
     exit (2);
-  if (argc < 1)
+  if (argc < 1 && !server_mode)
     gpgrt_usage (1);
 
   if (myopt->alarm_timeout)
@@ -312,9 +330,14 @@ main (int argc, char **argv)
 #endif
     }
 
-  for (; argc; argc--, argv++)
-    if (process_url (myopt, *argv))
-      any_err = 1;
+  if (server_mode)
+    any_err = run_server (myopt);
+  else
+    {
+      for (; argc; argc--, argv++)
+        if (process_url (myopt, *argv))
+          any_err = 1;
+    }
 
   xfree (malloced_buffer1);
   return any_err;
@@ -331,6 +354,8 @@ catch_alarm (int dummy)
 
 
 #ifdef HAVE_W32_SYSTEM
+static HANDLE alarm_timer;
+
 static DWORD CALLBACK
 alarm_thread (void *arg)
 {
@@ -350,7 +375,7 @@ set_timeout (my_opt_t myopt)
   if (myopt->alarm_timeout)
     {
 #ifdef HAVE_W32_SYSTEM
-      static HANDLE timer;
+      HANDLE timer = alarm_timer;
       LARGE_INTEGER due_time;
 
       /* A negative value is a relative time.  */
@@ -372,6 +397,7 @@ set_timeout (my_opt_t myopt)
 
           if (CreateThread (&sec_attr, 0, alarm_thread, timer, 0, &tid))
             log_error ("failed to create alarm thread\n");
+          alarm_timer = timer;
         }
       else /* Retrigger the timer.  */
         SetWaitableTimer (timer, &due_time, 0, NULL, NULL, 0);
@@ -382,6 +408,19 @@ set_timeout (my_opt_t myopt)
 }
 
 
+/* Stop the timer started by set_timeout.  */
+static void
+clear_timeout (void)
+{
+#ifdef HAVE_W32_SYSTEM
+  if (alarm_timer)
+    CancelWaitableTimer (alarm_timer);
+#else
+  alarm (0);
+#endif
+}
+
+
 /* Helper for fetch_ldap().  */
 static int
 print_ldap_entries (my_opt_t myopt, LDAP *ld, LDAPMessage *msg, char *want_attr)
@@ -551,80 +590,17 @@ print_ldap_entries (my_opt_t myopt, LDAP *ld, LDAPMessage *msg, char *want_attr)
 
 
 
-/* Helper for the URL based LDAP query. */
+/* Connect and bind to the LDAP server HOST:PORT using the credentials
+   from MYOPT.  On success the new handle is stored at R_LD and 0 is
+   returned.  */
 static int
-fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
+connect_ldap (my_opt_t myopt, char *host, int port, int usetls,
+              LDAP **r_ld)
 {
   LDAP *ld;
-  LDAPMessage *msg;
-  int rc = 0;
-  char *host, *dn, *filter, *attrs[2], *attr;
-  int port;
   int ret;
-  int usetls;
-
-  host     = myopt->host?   myopt->host   : ludp->lud_host;
-  port     = myopt->port?   myopt->port   : ludp->lud_port;
-  dn       = myopt->dn?     myopt->dn     : ludp->lud_dn;
-  filter   = myopt->filter? myopt->filter : ludp->lud_filter;
-  attrs[0] = myopt->attr?   myopt->attr   : ludp->lud_attrs? ludp->lud_attrs[0]:NULL;
-  attrs[1] = NULL;
-  attr = attrs[0];
-
-  if (!port && myopt->force_tls)
-    port = 636;
-  else if (!port)
-    port = (ludp->lud_scheme && !strcmp (ludp->lud_scheme, "ldaps"))? 636:389;
-
-  if (myopt->verbose)
-    {
-      log_info (_("processing url '%s'\n"), url);
-      if (myopt->force_tls)
-        log_info ("forcing tls\n");
-      else
-        log_info ("not forcing tls\n");
 
-      if (myopt->user)
-        log_info (_("          user '%s'\n"), myopt->user);
-      if (myopt->pass)
-        log_info (_("          pass '%s'\n"), *myopt->pass?"*****":"");
-      if (host)
-        log_info (_("          host '%s'\n"), host);
-      log_info (_("          port %d\n"), port);
-      if (dn)
-        log_info (_("            DN '%s'\n"), dn);
-      if (filter)
-        log_info (_("        filter '%s'\n"), filter);
-      if (myopt->multi && !myopt->attr && ludp->lud_attrs)
-        {
-          int i;
-          for (i=0; ludp->lud_attrs[i]; i++)
-            log_info (_("          attr '%s'\n"), ludp->lud_attrs[i]);
-        }
-      else if (attr)
-        log_info (_("          attr '%s'\n"), attr);
-    }
-
-
-  if (!host || !*host)
-    {
-      log_error (_("no host name in '%s'\n"), url);
-      return -1;
-    }
-  if (!myopt->multi && !attr)
-    {
-      log_error (_("no attribute given for query '%s'\n"), url);
-      return -1;
-    }
-
-  if (!myopt->multi && !myopt->attr
-      && ludp->lud_attrs && ludp->lud_attrs[0] && ludp->lud_attrs[1])
-    log_info (_("WARNING: using first attribute only\n"));
-
-  set_timeout (myopt);
-
-  usetls = (myopt->force_tls
-            || (ludp->lud_scheme && !strcmp (ludp->lud_scheme, "ldaps")));
+  *r_ld = NULL;
 #if HAVE_W32_SYSTEM
   if (1)
     {
@@ -707,6 +683,145 @@ fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
       return -1;
     }
 
+  *r_ld = ld;
+  return 0;
+}
+
+
+/* Release the connection LD.  In server mode the connection is kept
+   for the next request unless an error occurred as indicated by
+   FAILED.  */
+static void
+release_connection (my_opt_t myopt, LDAP *ld, int failed)
+{
+  if (myopt->keep_connection && !failed && ld == conn_cache.ld)
+    return;
+  if (ld == conn_cache.ld)
+    {
+      conn_cache.ld = NULL;
+      xfree (conn_cache.host);
+      conn_cache.host = NULL;
+    }
+  ldap_unbind (ld);
+}
+
+
+/* Return a connection to HOST:PORT at R_LD.  In server mode an open
+   connection to the same server is reused and R_REUSED is set in
+   this case.  */
+static int
+get_connection (my_opt_t myopt, char *host, int port, int usetls,
+                LDAP **r_ld, int *r_reused)
+{
+  *r_reused = 0;
+  if (myopt->keep_connection && conn_cache.ld)
+    {
+      if (conn_cache.port == port && conn_cache.usetls == usetls
+          && !ascii_strcasecmp (conn_cache.host, host))
+        {
+          *r_ld = conn_cache.ld;
+          *r_reused = 1;
+          return 0;
+        }
+      release_connection (myopt, conn_cache.ld, 1);
+    }
+
+  if (connect_ldap (myopt, host, port, usetls, r_ld))
+    return -1;
+
+  if (myopt->keep_connection)
+    {
+      conn_cache.host = xtrystrdup (host);
+      if (conn_cache.host)
+        {
+          conn_cache.ld = *r_ld;
+          conn_cache.port = port;
+          conn_cache.usetls = usetls;
+        }
+    }
+  return 0;
+}
+
+
+
+/* Helper for the URL based LDAP query. */
+static int
+fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
+{
+  LDAP *ld;
+  LDAPMessage *msg = NULL;
+  int rc = 0;
+  char *host, *dn, *filter, *attrs[2], *attr;
+  int port;
+  int usetls;
+  int reused;
+
+  host     = myopt->host?   myopt->host   : ludp->lud_host;
+  port     = myopt->port?   myopt->port   : ludp->lud_port;
+  dn       = myopt->dn?     myopt->dn     : ludp->lud_dn;
+  filter   = myopt->filter? myopt->filter : ludp->lud_filter;
+  attrs[0] = myopt->attr?   myopt->attr   : ludp->lud_attrs? ludp->lud_attrs[0]:NULL;
+  attrs[1] = NULL;
+  attr = attrs[0];
+
+  if (!port && myopt->force_tls)
+    port = 636;
+  else if (!port)
+    port = (ludp->lud_scheme && !strcmp (ludp->lud_scheme, "ldaps"))? 636:389;
+
+  if (myopt->verbose)
+    {
+      log_info (_("processing url '%s'\n"), url);
+      if (myopt->force_tls)
+        log_info ("forcing tls\n");
+      else
+        log_info ("not forcing tls\n");
+
+      if (myopt->user)
+        log_info (_("          user '%s'\n"), myopt->user);
+      if (myopt->pass)
+        log_info (_("          pass '%s'\n"), *myopt->pass?"*****":"");
+      if (host)
+        log_info (_("          host '%s'\n"), host);
+      log_info (_("          port %d\n"), port);
+      if (dn)
+        log_info (_("            DN '%s'\n"), dn);
+      if (filter)
+        log_info (_("        filter '%s'\n"), filter);
+      if (myopt->multi && !myopt->attr && ludp->lud_attrs)
+        {
+          int i;
+          for (i=0; ludp->lud_attrs[i]; i++)
+            log_info (_("          attr '%s'\n"), ludp->lud_attrs[i]);
+        }
+      else if (attr)
+        log_info (_("          attr '%s'\n"), attr);
+    }
+
+
+  if (!host || !*host)
+    {
+      log_error (_("no host name in '%s'\n"), url);
+      return -1;
+    }
+  if (!myopt->multi && !attr)
+    {
+      log_error (_("no attribute given for query '%s'\n"), url);
+      return -1;
+    }
+
+  if (!myopt->multi && !myopt->attr
+      && ludp->lud_attrs && ludp->lud_attrs[0] && ludp->lud_attrs[1])
+    log_info (_("WARNING: using first attribute only\n"));
+
+  set_timeout (myopt);
+
+  usetls = (myopt->force_tls
+            || (ludp->lud_scheme && !strcmp (ludp->lud_scheme, "ldaps")));
+  if (get_connection (myopt, host, port, usetls, &ld, &reused))
+    return -1;
+
+ again:
   set_timeout (myopt);
   npth_unprotect ();
   rc = ldap_search_st (ld, dn, ludp->lud_scope, filter,
@@ -715,11 +830,31 @@ fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
                        0,
                        &myopt->timeout, &msg);
   npth_protect ();
+  if (reused && (rc == LDAP_SERVER_DOWN
+#ifdef LDAP_CONNECT_ERROR
+                 || rc == LDAP_CONNECT_ERROR
+#endif
+                 ))
+    {
+      /* The server closed the kept connection; try a fresh one.  */
+      if (myopt->verbose)
+        log_info ("kept connection to '%s:%d' lost; reconnecting\n",
+                  host, port);
+      ldap_msgfree (msg);
+      msg = NULL;
+      release_connection (myopt, ld, 1);
+      if (get_connection (myopt, host, port, usetls, &ld, &reused))
+        return -1;
+      reused = 0;
+      goto again;
+    }
   if (rc == LDAP_SIZELIMIT_EXCEEDED && myopt->multi)
     {
       if (es_fwrite ("E\0\0\0\x09truncated", 14, 1, myopt->outstream) != 1)
         {
           log_error (_("error writing to stdout: %s\n"), strerror (errno));
+          ldap_msgfree (msg);
+          release_connection (myopt, ld, 0);
           return -1;
         }
     }
@@ -729,8 +864,8 @@ fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
                  url, ldap_err2string (rc));
       if (rc != LDAP_NO_SUCH_OBJECT)
         {
-          /* FIXME: Need deinit (ld)?  */
           /* Hmmm: Do we need to released MSG in case of an error? */
+          release_connection (myopt, ld, 1);
           return -1;
         }
     }
@@ -738,7 +873,7 @@ fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
   rc = print_ldap_entries (myopt, ld, msg, myopt->multi? NULL:attr);
 
   ldap_msgfree (msg);
-  ldap_unbind (ld);
+  release_connection (myopt, ld, 0);
   return rc;
 }
 
@@ -771,3 +906,132 @@ process_url (my_opt_t myopt, const char *url)
   ldap_free_urldesc (ludp);
   return rc;
 }
+
+
+/* Process one request line of the server mode.  The line consists of
+   space delimited and plus-percent escaped arguments; these are the
+   options --multi, --dn, --filter and --attr followed by the URLs.
+   The output is written to the stream of REQOPT.  */
+static int
+process_request (my_opt_t reqopt, char *line)
+{
+  char *fields[64];
+  int nfields, i;
+  int any_err = 0;
+
+  nfields = split_fields (line, fields, DIM (fields));
+  for (i=0; i < nfields; i++)
+    percent_plus_unescape_inplace (fields[i], 0);
+
+  for (i=0; i < nfields && !strncmp (fields[i], "--", 2); i++)
+    {
+      if (!strcmp (fields[i], "--"))
+        {
+          i++;
+          break;
+        }
+      else if (!strcmp (fields[i], "--multi"))
+        reqopt->multi = 1;
+      else if (i+1 < nfields && !strcmp (fields[i], "--dn"))
+        reqopt->dn = fields[++i];
+      else if (i+1 < nfields && !strcmp (fields[i], "--filter"))
+        reqopt->filter = fields[++i];
+      else if (i+1 < nfields && !strcmp (fields[i], "--attr"))
+        reqopt->attr = fields[++i];
+      else
+        {
+          log_error ("invalid request argument '%s'\n", fields[i]);
+          return -1;
+        }
+    }
+
+  if (i == nfields)
+    {
+      log_error ("no URL given in request\n");
+      return -1;
+    }
+  for (; i < nfields; i++)
+    if (process_url (reqopt, fields[i]))
+      any_err = 1;
+  return any_err;
+}
+
+
+/* Run in server mode: Read requests from stdin, one per line, and
+   answer each with the length of the output as a 4 byte big endian
+   value followed by the output.  Errors are only logged and result in
+   a short or empty answer.  The connection to the LDAP server is kept
+   between requests; the process terminates on EOF.  */
+static int
+run_server (my_opt_t myopt)
+{
+  struct my_opt_s reqopt;
+  char *line = NULL;
+  size_t linesize = 0;
+  size_t maxlen;
+  ssize_t n;
+  void *data;
+  size_t datalen;
+  unsigned char hdr[4];
+  int rc = 0;
+
+  es_set_binary (es_stdin);
+  for (;;)
+    {
+      maxlen = 65536;
+      n = es_read_line (es_stdin, &line, &linesize, &maxlen);
+      if (n < 0)
+        {
+          log_error ("error reading request: %s\n", strerror (errno));
+          rc = -1;
+          break;
+        }
+      if (!n)
+        break;  /* EOF */
+      if (!maxlen)
+        {
+          log_error ("request line too long\n");
+          rc = -1;
+          break;
+        }
+      trim_spaces (line);
+
+      reqopt = *myopt;
+      reqopt.outstream = es_fopenmem (0, "w+b");
+      if (!reqopt.outstream)
+        {
+          log_error ("error allocating memory stream: %s\n",
+                     strerror (errno));
+          rc = -1;
+          break;
+        }
+      process_request (&reqopt, line);
+      clear_timeout ();
+
+      if (es_fclose_snatch (reqopt.outstream, &data, &datalen))
+        {
+          log_error ("error closing memory stream: %s\n", strerror (errno));
+          rc = -1;
+          break;
+        }
+      hdr[0] = datalen >> 24;
+      hdr[1] = datalen >> 16;
+      hdr[2] = datalen >> 8;
+      hdr[3] = datalen;
+      if (es_fwrite (hdr, 4, 1, es_stdout) != 1
+          || (datalen && es_fwrite (data, datalen, 1, es_stdout) != 1)
+          || es_fflush (es_stdout))
+        {
+          log_error (_("error writing to stdout: %s\n"), strerror (errno));
+          es_free (data);
+          rc = -1;
+          break;
+        }
+      es_free (data);
+    }
+
+  es_free (line);
+  if (conn_cache.ld)
+    release_connection (myopt, conn_cache.ld, 1);
+  return rc;
+}
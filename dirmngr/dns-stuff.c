@@ -38,6 +38,7 @@
 # include <windows.h>
 # include <iphlpapi.h>
 #else
+# include <sys/select.h>
 # if HAVE_SYSTEM_RESOLVER
 #  include <netinet/in.h>
 #  include <arpa/nameser.h>
@@ -114,6 +115,23 @@
 /* The default timeout in seconds for libdns requests.  */
 #define DEFAULT_TIMEOUT 30
 
+/* The default number of entries in the DNS cache.  */
+#define DEFAULT_DNS_CACHE_SIZE 100
+
+/* The maximum time in seconds we cache a positive answer regardless
+ * of its TTL.  */
+#define DNS_CACHE_MAX_TTL 3600
+
+/* The time in seconds we cache negative answers without a SOA record
+ * and the maximum time for negative answers.  */
+#define DNS_CACHE_NEG_TTL      60
+#define DNS_CACHE_NEG_MAX_TTL 300
+
+/* The time in seconds we cache results of address lookups.  The
+ * resolver functions do not tell us the TTL of the address records
+ * and thus we use a fixed and short time.  */
+#define DNS_CACHE_ADDR_TTL 60
+
 
 #define RESOLV_CONF_NAME "/etc/resolv.conf"
 
@@ -158,6 +176,42 @@ static struct
 } cached_inet_support;
 
 
+/* An item of the DNS cache.  */
+struct dns_cache_item_s;
+typedef struct dns_cache_item_s *dns_cache_item_t;
+struct dns_cache_item_s
+{
+  dns_cache_item_t next;
+  time_t expires;          /* The item is valid until this time.  */
+  int qtype;               /* The query type or 0 for an address lookup.  */
+  unsigned short port;     /* For address lookups the port, */
+  int family;              /* the requested family, */
+  int socktype;            /* and the requested socket type.  */
+  unsigned int negative:1; /* This is a negative answer.  */
+  unsigned int with_canonname:1; /* The canonical name was looked up.  */
+#ifdef USE_LIBDNS
+  struct dns_packet *ans;  /* The answer for a query.  */
+#endif
+  gpg_error_t err;         /* The error of a failed address lookup.  */
+  dns_addrinfo_t dai;      /* The result of an address lookup.  */
+  char *canonname;         /* The canonical name or NULL.  */
+  char name[1];            /* The queried name.  */
+};
+
+/* The DNS cache.  Items are kept in most recently used order.  */
+static struct
+{
+  dns_cache_item_t items;
+  unsigned int nitems;
+  int size;                /* Max. number of items; 0 disables the cache.  */
+  unsigned long hits;
+  unsigned long neg_hits;
+  unsigned long misses;
+} dns_cache = { NULL, 0, DEFAULT_DNS_CACHE_SIZE };
+
+static void flush_dns_cache (void);
+
+
 
 #ifdef USE_LIBDNS
 /* Libdns global data.  */
@@ -237,6 +291,7 @@ enable_dns_tormode (int new_circuit)
       counter++;
     }
   tor_mode = 1;
+  flush_dns_cache ();
 }
 
 
@@ -245,6 +300,7 @@ void
 disable_dns_tormode (void)
 {
   tor_mode = 0;
+  flush_dns_cache ();
 }
 
 
@@ -291,6 +347,22 @@ set_dns_timeout (int seconds)
 }
 
 
+/* Set the maximum number of entries in the DNS cache to SIZE.  A
+ * value of 0 disables the cache and a negative value sets the
+ * default size.  */
+void
+set_dns_cache_size (int size)
+{
+  if (size < 0)
+    size = DEFAULT_DNS_CACHE_SIZE;
+  else if (size > 10000)
+    size = 10000;
+
+  dns_cache.size = size;
+  flush_dns_cache ();
+}
+
+
 /* Change the default IP address of the nameserver to IPADDR.  The
    address needs to be a numerical IP address and will be used for the
    next DNS query.  Note that this is only used in Tor mode.  */
@@ -304,6 +376,7 @@ set_dns_nameserver (const char *ipaddr)
   libdns_reinit_pending = 1;
   libdns_tor_port = 0;  /* Start again with the default port.  */
 #endif
+  flush_dns_cache ();
 }
 
 
@@ -320,6 +393,350 @@ free_dns_addrinfo (dns_addrinfo_t ai)
 }
 
 
+/* Store a copy of the address list AI at R_COPY.  */
+static gpg_error_t
+copy_dns_addrinfo (dns_addrinfo_t ai, dns_addrinfo_t *r_copy)
+{
+  dns_addrinfo_t *tail = r_copy;
+
+  *r_copy = NULL;
+  for (; ai; ai = ai->next)
+    {
+      *tail = xtrymalloc (sizeof **tail);
+      if (!*tail)
+        {
+          gpg_error_t err = gpg_error_from_syserror ();
+          free_dns_addrinfo (*r_copy);
+          *r_copy = NULL;
+          return err;
+        }
+      memcpy (*tail, ai, sizeof **tail);
+      (*tail)->next = NULL;
+      tail = &(*tail)->next;
+    }
+  return 0;
+}
+
+
+static void
+release_dns_cache_item (dns_cache_item_t item)
+{
+#ifdef USE_LIBDNS
+  dns_free (item->ans);
+#endif
+  free_dns_addrinfo (item->dai);
+  xfree (item->canonname);
+  xfree (item);
+}
+
+
+/* Remove all items from the DNS cache.  */
+static void
+flush_dns_cache (void)
+{
+  dns_cache_item_t item;
+
+  while ((item = dns_cache.items))
+    {
+      dns_cache.items = item->next;
+      release_dns_cache_item (item);
+    }
+  dns_cache.nitems = 0;
+}
+
+
+/* Remove all expired items from the DNS cache.  */
+static void
+purge_dns_cache (void)
+{
+  dns_cache_item_t item, *prev;
+  time_t now = gnupg_get_time ();
+
+  for (prev = &dns_cache.items; (item = *prev); )
+    if (item->expires <= now)
+      {
+        *prev = item->next;
+        release_dns_cache_item (item);
+        dns_cache.nitems--;
+      }
+    else
+      prev = &item->next;
+}
+
+
+/* Return the cached answer for a query of type QTYPE for NAME.  For
+ * an address lookup QTYPE is 0 and PORT, FAMILY, SOCKTYPE, and
+ * WITH_CANONNAME are the parameters of the lookup.  Returns NULL if
+ * there is no valid item.  The item is owned by the cache and only
+ * valid until the next call of a cache function.  */
+static dns_cache_item_t
+lookup_dns_cache (int qtype, const char *name, unsigned short port,
+                  int family, int socktype, int with_canonname)
+{
+  dns_cache_item_t item, *prev;
+  time_t now;
+
+  if (!dns_cache.size)
+    return NULL;
+
+  now = gnupg_get_time ();
+  for (prev = &dns_cache.items; (item = *prev); prev = &item->next)
+    {
+      if (item->qtype != qtype || ascii_strcasecmp (item->name, name))
+        continue;
+      if (!qtype && (item->port != port || item->family != family
+                     || item->socktype != socktype
+                     || (with_canonname && !item->with_canonname)))
+        continue;
+
+      if (item->expires <= now)
+        {
+          *prev = item->next;
+          release_dns_cache_item (item);
+          dns_cache.nitems--;
+          break;
+        }
+
+      /* Move the item to the front.  */
+      *prev = item->next;
+      item->next = dns_cache.items;
+      dns_cache.items = item;
+      if (item->negative)
+        dns_cache.neg_hits++;
+      else
+        dns_cache.hits++;
+      if (opt_debug)
+        log_debug ("dns: cache hit for '%s' (type %d, %lu s left)\n",
+                   name, qtype, (unsigned long)(item->expires - now));
+      return item;
+    }
+
+  dns_cache.misses++;
+  return NULL;
+}
+
+
+/* Allocate a new cache item for NAME.  */
+static dns_cache_item_t
+new_dns_cache_item (int qtype, const char *name)
+{
+  dns_cache_item_t item;
+
+  item = xtrycalloc (1, sizeof *item + strlen (name));
+  if (item)
+    {
+      item->qtype = qtype;
+      strcpy (item->name, name);
+    }
+  return item;
+}
+
+
+/* Insert ITEM which is valid for TTL seconds into the DNS cache.  The
+ * cache takes ownership of ITEM.  */
+static void
+insert_dns_cache (dns_cache_item_t item, unsigned int ttl)
+{
+  dns_cache_item_t *prev;
+
+  if (!ttl || !dns_cache.size)
+    {
+      release_dns_cache_item (item);
+      return;
+    }
+
+  item->expires = gnupg_get_time () + ttl;
+  item->next = dns_cache.items;
+  dns_cache.items = item;
+  dns_cache.nitems++;
+
+  /* Drop the least recently used items.  */
+  if (dns_cache.nitems > dns_cache.size)
+    {
+      time_t now = gnupg_get_time ();
+      dns_cache_item_t old;
+
+      for (prev = &dns_cache.items; (old = *prev); )
+        if (old->expires <= now)
+          {
+            *prev = old->next;
+            release_dns_cache_item (old);
+            dns_cache.nitems--;
+          }
+        else
+          prev = &old->next;
+    }
+  if (dns_cache.nitems > dns_cache.size)
+    {
+      unsigned int n;
+
+      for (n=1, prev = &dns_cache.items; n < dns_cache.size; n++)
+        prev = &(*prev)->next;
+      while ((item = (*prev)->next))
+        {
+          (*prev)->next = item->next;
+          release_dns_cache_item (item);
+          dns_cache.nitems--;
+        }
+    }
+}
+
+
+/* Store the result of an address lookup in the DNS cache.  */
+static void
+cache_dns_addrinfo (const char *name, unsigned short port,
+                    int family, int socktype, gpg_error_t err,
+                    dns_addrinfo_t dai, const char *canonname,
+                    int with_canonname)
+{
+  dns_cache_item_t item;
+  unsigned int ttl;
+
+  if (!dns_cache.size)
+    return;
+  if (!err)
+    ttl = DNS_CACHE_ADDR_TTL;
+  else if (gpg_err_code (err) == GPG_ERR_NO_NAME)
+    ttl = DNS_CACHE_NEG_TTL;
+  else
+    return;  /* We do not cache temporary errors.  */
+
+  item = new_dns_cache_item (0, name);
+  if (!item)
+    return;
+  item->port = port;
+  item->family = family;
+  item->socktype = socktype;
+  item->with_canonname = !!with_canonname;
+  item->err = err;
+  item->negative = !!err;
+  if ((!err && copy_dns_addrinfo (dai, &item->dai))
+      || (canonname && !(item->canonname = xtrystrdup (canonname))))
+    {
+      release_dns_cache_item (item);
+      return;
+    }
+  insert_dns_cache (item, ttl);
+}
+
+
+/* Return the result of an address lookup from the DNS cache.  Returns
+ * true if the result has been taken from the cache; the return code
+ * is then stored at R_ERR.  */
+static int
+cached_dns_addrinfo (const char *name, unsigned short port,
+                     int family, int socktype, gpg_error_t *r_err,
+                     dns_addrinfo_t *r_dai, char **r_canonname)
+{
+  dns_cache_item_t item;
+
+  item = lookup_dns_cache (0, name, port, family, socktype, !!r_canonname);
+  if (!item)
+    return 0;
+
+  *r_dai = NULL;
+  if (r_canonname)
+    *r_canonname = NULL;
+  *r_err = item->err;
+  if (*r_err)
+    return 1;
+
+  *r_err = copy_dns_addrinfo (item->dai, r_dai);
+  if (!*r_err && r_canonname && item->canonname)
+    {
+      *r_canonname = xtrystrdup (item->canonname);
+      if (!*r_canonname)
+        {
+          *r_err = gpg_error_from_syserror ();
+          free_dns_addrinfo (*r_dai);
+          *r_dai = NULL;
+        }
+    }
+  return 1;
+}
+
+
+#ifdef USE_LIBDNS
+/* Return the number of seconds the answer ANS may be cached.  This is
+ * the lowest TTL of the answer records or, for a negative answer, the
+ * TTL given by the SOA record.  Returns 0 if ANS may not be cached
+ * and stores at R_NEGATIVE whether this is a negative answer.  */
+static unsigned int
+dns_answer_ttl (struct dns_packet *ans, int *r_negative)
+{
+  struct dns_rr rr;
+  struct dns_rr_i rri;
+  struct dns_soa soa;
+  unsigned int ttl;
+  int any = 0;
+  int derr;
+
+  *r_negative = 0;
+  switch (dns_p_rcode (ans))
+    {
+    case DNS_RC_NOERROR: break;
+    case DNS_RC_NXDOMAIN: break;
+    default: return 0;  /* Server failures are not cached.  */
+    }
+
+  ttl = DNS_CACHE_MAX_TTL;
+  memset (&rri, 0, sizeof rri);
+  dns_rr_i_init (&rri);
+  rri.section = DNS_S_AN;
+  while (dns_rr_grep (&rr, 1, &rri, ans, &derr))
+    {
+      any = 1;
+      if (rr.ttl < ttl)
+        ttl = rr.ttl;
+    }
+  if (any)
+    return ttl;
+
+  *r_negative = 1;
+  ttl = DNS_CACHE_NEG_TTL;
+  memset (&rri, 0, sizeof rri);
+  dns_rr_i_init (&rri);
+  rri.section = DNS_S_NS;
+  rri.type = DNS_T_SOA;
+  if (dns_rr_grep (&rr, 1, &rri, ans, &derr)
+      && !dns_soa_parse (&soa, &rr, ans))
+    ttl = rr.ttl < soa.minimum? rr.ttl : soa.minimum;  /* See rfc-2308 */
+  if (ttl > DNS_CACHE_NEG_MAX_TTL)
+    ttl = DNS_CACHE_NEG_MAX_TTL;
+  return ttl;
+}
+#endif /*USE_LIBDNS*/
+
+
+#ifdef USE_LIBDNS
+/* Return a copy of the answer packet ANS or NULL on error.  */
+static struct dns_packet *
+copy_dns_packet (struct dns_packet *ans, gpg_error_t *r_err)
+{
+  struct dns_packet *copy;
+  int derr = 0;
+
+  copy = dns_p_copy (dns_p_make (ans->end, &derr), ans);
+  if (!copy)
+    *r_err = gpg_error_from_errno (derr? derr : ENOMEM);
+  return copy;
+}
+#endif /*USE_LIBDNS*/
+
+
+/* Store the current counters of the DNS cache at the provided
+ * addresses.  */
+void
+get_dns_cache_stats (unsigned int *r_entries, unsigned long *r_hits,
+                     unsigned long *r_neg_hits, unsigned long *r_misses)
+{
+  *r_entries = dns_cache.nitems;
+  *r_hits = dns_cache.hits;
+  *r_neg_hits = dns_cache.neg_hits;
+  *r_misses = dns_cache.misses;
+}
+
+
 #ifndef HAVE_W32_SYSTEM
 /* Return H_ERRNO mapped to a gpg-error code.  Will never return 0. */
 static gpg_error_t
@@ -696,8 +1113,10 @@ reload_dns_stuff (int force)
   (void)force;
 #endif
 
-  /* We also flush the IPv4/v6 support flag cache.  */
+  /* We also flush the IPv4/v6 support flag cache and the DNS
+   * cache.  */
   cached_inet_support.valid = 0;
+  flush_dns_cache ();
 }
 
 
@@ -710,6 +1129,8 @@ dns_stuff_housekeeping (void)
    * later than 10 minutes after it changed.  This way the user does
    * not need a reload.  */
   cached_inet_support.valid = 0;
+
+  purge_dns_cache ();
 }
 
 
@@ -825,6 +1246,169 @@ libdns_res_wait (struct dns_resolver *res)
 
 
 #ifdef USE_LIBDNS
+/* Query for the QTYPE records of NAME.  On success the answer is
+ * stored at R_ANS; the caller must release it using dns_free.  The
+ * answer is taken from the DNS cache if possible.  */
+static gpg_error_t
+libdns_res_query (ctrl_t ctrl, const char *name, enum dns_type qtype,
+                  struct dns_packet **r_ans)
+{
+  gpg_error_t err;
+  struct dns_resolver *res = NULL;
+  struct dns_packet *ans;
+  dns_cache_item_t item;
+  unsigned int ttl;
+  int derr, negative;
+
+  *r_ans = NULL;
+
+  item = lookup_dns_cache (qtype, name, 0, 0, 0, 0);
+  if (item)
+    {
+      err = 0;
+      *r_ans = copy_dns_packet (item->ans, &err);
+      return err;
+    }
+
+  err = libdns_res_open (ctrl, &res);
+  if (err)
+    goto leave;
+
+  err = libdns_res_submit (res, name, qtype, DNS_C_IN);
+  if (err)
+    goto leave;
+
+  err = libdns_res_wait (res);
+  if (err)
+    goto leave;
+
+  ans = dns_res_fetch (res, &derr);
+  if (!ans)
+    {
+      err = libdns_error_to_gpg_error (derr);
+      goto leave;
+    }
+
+  ttl = dns_cache.size? dns_answer_ttl (ans, &negative) : 0;
+  if (ttl && (item = new_dns_cache_item (qtype, name)))
+    {
+      item->negative = negative;
+      item->ans = copy_dns_packet (ans, &err);
+      err = 0;
+      if (item->ans)
+        insert_dns_cache (item, ttl);
+      else
+        release_dns_cache_item (item);
+    }
+
+  *r_ans = ans;
+
+ leave:
+  dns_res_close (res);
+  return err;
+}
+#endif /*USE_LIBDNS*/
+
+
+#ifdef USE_LIBDNS
+/* Wait up to TIMEOUT seconds until one of the N lookups in AIS can
+ * make progress.  NULL items in AIS are ignored.  */
+static void
+libdns_ai_poll_many (struct dns_addrinfo **ais, int n, int timeout)
+{
+  fd_set rset, wset;
+  struct timeval tv;
+  int i, fd, events;
+  int maxfd = -1;
+
+  tv.tv_sec = timeout;
+  tv.tv_usec = 0;
+  FD_ZERO (&rset);
+  FD_ZERO (&wset);
+  for (i=0; i < n; i++)
+    {
+      if (!ais[i] || !(events = dns_ai_events (ais[i])))
+        continue;
+      fd = dns_ai_pollfd (ais[i]);
+      if (fd < 0 || fd >= FD_SETSIZE)
+        {
+          tv.tv_sec = 0;  /* Can't wait for it - do not block.  */
+          continue;
+        }
+      if ((events & DNS_POLLIN))
+        FD_SET (fd, &rset);
+      if ((events & DNS_POLLOUT))
+        FD_SET (fd, &wset);
+      if (fd > maxfd)
+        maxfd = fd;
+    }
+  if (maxfd == -1)
+    return;
+
+  my_unprotect ();
+  select (maxfd + 1, &rset, &wset, NULL, &tv);
+  my_protect ();
+}
+
+
+/* Helper for resolve_name_libdns to take all available entries from
+ * the lookup AI and prepend them to the list at DAIHEAD.  If
+ * R_CANONNAME is not NULL and not yet set, the canonical name is
+ * stored there.  Returns GPG_ERR_EAGAIN if the lookup is still in
+ * progress and GPG_ERR_ENOENT if it is finished.  */
+static gpg_error_t
+libdns_ai_collect (struct dns_addrinfo *ai,
+                   dns_addrinfo_t *daihead, char **r_canonname)
+{
+  gpg_error_t err;
+  dns_addrinfo_t dai;
+  struct addrinfo *ent;
+
+  for (;;)
+    {
+      err = libdns_error_to_gpg_error (dns_ai_nextent (&ent, ai));
+      if (err)
+        return err;
+
+      if (r_canonname && ! *r_canonname && ent && ent->ai_canonname)
+        {
+          *r_canonname = xtrystrdup (ent->ai_canonname);
+          if (!*r_canonname)
+            {
+              err = gpg_error_from_syserror ();
+              xfree (ent);
+              return err;
+            }
+          /* Libdns appends the root zone part which is problematic
+           * for most other functions - strip it.  */
+          if (**r_canonname && (*r_canonname)[strlen (*r_canonname)-1] == '.')
+            (*r_canonname)[strlen (*r_canonname)-1] = 0;
+        }
+
+      dai = xtrymalloc (sizeof *dai);
+      if (dai == NULL)
+        {
+          err = gpg_error_from_syserror ();
+          xfree (ent);
+          return err;
+        }
+
+      dai->family = ent->ai_family;
+      dai->socktype = ent->ai_socktype;
+      dai->protocol = ent->ai_protocol;
+      dai->addrlen = ent->ai_addrlen;
+      memcpy (dai->addr, ent->ai_addr, ent->ai_addrlen);
+      dai->next = *daihead;
+      *daihead = dai;
+
+      xfree (ent);
+    }
+}
+
+
+/* Resolve NAME using libdns.  If no address family is requested, the
+ * A and the AAAA records are queried in parallel, each using its own
+ * resolver, and the answers are combined.  */
 static gpg_error_t
 resolve_name_libdns (ctrl_t ctrl, const char *name, unsigned short port,
                      int want_family, int want_socktype,
@@ -832,15 +1416,14 @@ resolve_name_libdns (ctrl_t ctrl, const char *name, unsigned short port,
 {
   gpg_error_t err;
   dns_addrinfo_t daihead = NULL;
-  dns_addrinfo_t dai;
   struct dns_resolver *res = NULL;
-  struct dns_addrinfo *ai = NULL;
+  struct dns_addrinfo *ais[2] = { NULL, NULL };
+  gpg_error_t qerr[2] = { 0, 0 };
   struct addrinfo hints;
-  struct addrinfo *ent;
   char portstr_[21];
   char *portstr = NULL;
   char *namebuf = NULL;
-  int derr;
+  int derr, i, nais, pending;
 
   *r_dai = NULL;
   if (r_canonname)
@@ -859,11 +1442,6 @@ resolve_name_libdns (ctrl_t ctrl, const char *name, unsigned short port,
       portstr = portstr_;
     }
 
-  err = libdns_res_open (ctrl, &res);
-  if (err)
-    goto leave;
-
-
   if (is_ip_address (name))
     {
       hints.ai_flags |= AI_NUMERICHOST;
@@ -882,73 +1460,75 @@ resolve_name_libdns (ctrl_t ctrl, const char *name, unsigned short port,
         }
     }
 
-  ai = dns_ai_open (name, portstr, 0, &hints, res, &derr);
-  if (!ai)
+  /* Start the lookups.  A resolver handles only one query at a time
+   * and thus we need one for each lookup.  */
+  nais = (want_family == AF_UNSPEC && !(hints.ai_flags & AI_NUMERICHOST)
+          && !opt_disable_ipv4 && !opt_disable_ipv6)? 2 : 1;
+  for (i=0; i < nais; i++)
     {
-      err = libdns_error_to_gpg_error (derr);
-      goto leave;
+      err = libdns_res_open (ctrl, &res);
+      if (err)
+        goto leave;
+      if (nais > 1)
+        hints.ai_family = i? AF_INET6 : AF_INET;
+      ais[i] = dns_ai_open (name, portstr, 0, &hints, res, &derr);
+      dns_res_close (res);  /* AIS[i] holds a reference.  */
+      res = NULL;
+      if (!ais[i])
+        {
+          err = libdns_error_to_gpg_error (derr);
+          goto leave;
+        }
     }
 
-  /* Loop over all records.  */
+  /* Run the lookups until all are done.  */
   for (;;)
     {
-      err = libdns_error_to_gpg_error (dns_ai_nextent (&ent, ai));
-      if (gpg_err_code (err) == GPG_ERR_ENOENT)
-        {
-          if (daihead)
-            err = 0; /* We got some results, we're good.  */
-          break; /* Ready.  */
-        }
-      if (gpg_err_code (err) == GPG_ERR_EAGAIN)
-        {
-          if (dns_ai_elapsed (ai) > opt_timeout)
-            {
-              err = gpg_error (GPG_ERR_DNS_TIMEOUT);
-              goto leave;
-            }
-
-          my_unprotect ();
-          dns_ai_poll (ai, 1);
-          my_protect ();
-          continue;
-        }
-      if (err)
-        goto leave;
-
-      if (r_canonname && ! *r_canonname && ent && ent->ai_canonname)
+      for (pending = i = 0; i < nais; i++)
         {
-          *r_canonname = xtrystrdup (ent->ai_canonname);
-          if (!*r_canonname)
+          if (!ais[i])
+            continue;
+          err = libdns_ai_collect (ais[i], &daihead, r_canonname);
+          if (gpg_err_code (err) == GPG_ERR_EAGAIN)
             {
-              err = gpg_error_from_syserror ();
-              goto leave;
+              if (dns_ai_elapsed (ais[i]) > opt_timeout)
+                {
+                  err = gpg_error (GPG_ERR_DNS_TIMEOUT);
+                  goto leave;
+                }
+              pending++;
+              continue;
             }
-          /* Libdns appends the root zone part which is problematic
-           * for most other functions - strip it.  */
-          if (**r_canonname && (*r_canonname)[strlen (*r_canonname)-1] == '.')
-            (*r_canonname)[strlen (*r_canonname)-1] = 0;
+          if (gpg_err_code (err) == GPG_ERR_ENOENT)
+            err = 0;  /* Ready.  */
+          qerr[i] = err;
+          dns_ai_close (ais[i]);
+          ais[i] = NULL;
         }
+      if (!pending)
+        break;
 
-      dai = xtrymalloc (sizeof *dai);
-      if (dai == NULL)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-
-      dai->family = ent->ai_family;
-      dai->socktype = ent->ai_socktype;
-      dai->protocol = ent->ai_protocol;
-      dai->addrlen = ent->ai_addrlen;
-      memcpy (dai->addr, ent->ai_addr, ent->ai_addrlen);
-      dai->next = daihead;
-      daihead = dai;
+      libdns_ai_poll_many (ais, nais, 1);
+    }
 
-      xfree (ent);
-  }
+  /* We got some results, we're good.  Otherwise return the error of
+   * the first lookup which failed.  */
+  err = 0;
+  if (!daihead)
+    {
+      for (i=0; i < nais; i++)
+        if (qerr[i])
+          {
+            err = qerr[i];
+            break;
+          }
+      if (!err)
+        err = gpg_error (GPG_ERR_ENOENT);
+    }
 
  leave:
-  dns_ai_close (ai);
+  for (i=0; i < DIM (ais); i++)
+    dns_ai_close (ais[i]);
   dns_res_close (res);
 
   if (err)
@@ -1099,6 +1679,13 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
                   dns_addrinfo_t *r_ai, char **r_canonname)
 {
   gpg_error_t err;
+  int cacheable;
+
+  cacheable = !is_ip_address (name);
+  if (cacheable && cached_dns_addrinfo (name, port, want_family,
+                                        want_socktype, &err,
+                                        r_ai, r_canonname))
+    goto leave;
 
 #ifdef USE_LIBDNS
   if (!standard_resolver)
@@ -1113,6 +1700,12 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
 #endif /*USE_LIBDNS*/
     err = resolve_name_standard (ctrl, name, port, want_family, want_socktype,
                                  r_ai, r_canonname);
+  if (cacheable)
+    cache_dns_addrinfo (name, port, want_family, want_socktype, err,
+                        *r_ai, r_canonname? *r_canonname : NULL,
+                        !!r_canonname);
+
+ leave:
   if (opt_debug)
     log_debug ("dns: resolve_dns_name(%s): %s\n", name, gpg_strerror (err));
   return err;
@@ -1128,7 +1721,6 @@ resolve_addr_libdns (ctrl_t ctrl,
 {
   gpg_error_t err;
   char host[DNS_D_MAXNAME + 1];
-  struct dns_resolver *res = NULL;
   struct dns_packet *ans = NULL;
   struct dns_ptr ptr;
   int derr;
@@ -1155,25 +1747,10 @@ resolve_addr_libdns (ctrl_t ctrl,
     goto leave;
 
 
-  err = libdns_res_open (ctrl, &res);
+  err = libdns_res_query (ctrl, host, DNS_T_PTR, &ans);
   if (err)
     goto leave;
 
-  err = libdns_res_submit (res, host, DNS_T_PTR, DNS_C_IN);
-  if (err)
-    goto leave;
-
-  err = libdns_res_wait (res);
-  if (err)
-    goto leave;
-
-  ans = dns_res_fetch (res, &derr);
-  if (!ans)
-    {
-      err = libdns_error_to_gpg_error (derr);
-      goto leave;
-    }
-
   /* Check the rcode.  */
   switch (dns_p_rcode (ans))
     {
@@ -1249,7 +1826,6 @@ resolve_addr_libdns (ctrl_t ctrl,
 
  leave:
   dns_free (ans);
-  dns_res_close (res);
   return err;
 }
 #endif /*USE_LIBDNS*/
@@ -1434,7 +2010,6 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
                      unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
 {
   gpg_error_t err;
-  struct dns_resolver *res = NULL;
   struct dns_packet *ans = NULL;
   struct dns_rr rr;
   struct dns_rr_i rri;
@@ -1449,31 +2024,16 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
            : (want_certtype - DNS_CERTTYPE_RRBASE));
 
 
-  err = libdns_res_open (ctrl, &res);
-  if (err)
-    goto leave;
-
   if (dns_d_anchor (host, sizeof host, name, strlen (name)) >= sizeof host)
     {
       err = gpg_error (GPG_ERR_ENAMETOOLONG);
       goto leave;
     }
 
-  err = libdns_res_submit (res, name, qtype, DNS_C_IN);
-  if (err)
-    goto leave;
-
-  err = libdns_res_wait (res);
+  err = libdns_res_query (ctrl, name, qtype, &ans);
   if (err)
     goto leave;
 
-  ans = dns_res_fetch (res, &derr);
-  if (!ans)
-    {
-      err = libdns_error_to_gpg_error (derr);
-      goto leave;
-    }
-
   /* Check the rcode.  */
   switch (dns_p_rcode (ans))
     {
@@ -1595,7 +2155,6 @@ get_dns_cert_libdns (ctrl_t ctrl, const char *name, int want_certtype,
 
  leave:
   dns_free (ans);
-  dns_res_close (res);
   return err;
 }
 #endif /*USE_LIBDNS*/
@@ -1871,7 +2430,6 @@ getsrv_libdns (ctrl_t ctrl,
                const char *name, struct srventry **list, unsigned int *r_count)
 {
   gpg_error_t err;
-  struct dns_resolver *res = NULL;
   struct dns_packet *ans = NULL;
   struct dns_rr rr;
   struct dns_rr_i rri;
@@ -1879,31 +2437,16 @@ getsrv_libdns (ctrl_t ctrl,
   int derr;
   unsigned int srvcount = 0;
 
-  err = libdns_res_open (ctrl, &res);
-  if (err)
-    goto leave;
-
   if (dns_d_anchor (host, sizeof host, name, strlen (name)) >= sizeof host)
     {
       err = gpg_error (GPG_ERR_ENAMETOOLONG);
       goto leave;
     }
 
-  err = libdns_res_submit (res, name, DNS_T_SRV, DNS_C_IN);
-  if (err)
-    goto leave;
-
-  err = libdns_res_wait (res);
+  err = libdns_res_query (ctrl, name, DNS_T_SRV, &ans);
   if (err)
     goto leave;
 
-  ans = dns_res_fetch (res, &derr);
-  if (!ans)
-    {
-      err = libdns_error_to_gpg_error (derr);
-      goto leave;
-    }
-
   /* Check the rcode.  */
   switch (dns_p_rcode (ans))
     {
@@ -1959,7 +2502,6 @@ getsrv_libdns (ctrl_t ctrl,
       *list = NULL;
     }
   dns_free (ans);
-  dns_res_close (res);
   return err;
 }
 #endif /*USE_LIBDNS*/
@@ -2238,30 +2780,14 @@ gpg_error_t
 get_dns_cname_libdns (ctrl_t ctrl, const char *name, char **r_cname)
 {
   gpg_error_t err;
-  struct dns_resolver *res;
   struct dns_packet *ans = NULL;
   struct dns_cname cname;
   int derr;
 
-  err = libdns_res_open (ctrl, &res);
-  if (err)
-    goto leave;
-
-  err = libdns_res_submit (res, name, DNS_T_CNAME, DNS_C_IN);
+  err = libdns_res_query (ctrl, name, DNS_T_CNAME, &ans);
   if (err)
     goto leave;
 
-  err = libdns_res_wait (res);
-  if (err)
-    goto leave;
-
-  ans = dns_res_fetch (res, &derr);
-  if (!ans)
-    {
-      err = libdns_error_to_gpg_error (derr);
-      goto leave;
-    }
-
   /* Check the rcode.  */
   switch (dns_p_rcode (ans))
     {
@@ -2297,7 +2823,6 @@ get_dns_cname_libdns (ctrl_t ctrl, const char *name, char **r_cname)
 
  leave:
   dns_free (ans);
-  dns_res_close (res);
   return err;
 }
 #endif /*USE_LIBDNS*/
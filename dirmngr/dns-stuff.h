@@ -106,6 +106,13 @@ void set_dns_disable_ipv6 (int yes);
 /* Set the timeout for libdns requests to SECONDS.  */
 void set_dns_timeout (int seconds);
 
+/* Set the maximum number of entries in the DNS cache.  */
+void set_dns_cache_size (int size);
+
+/* Return the counters of the DNS cache.  */
+void get_dns_cache_stats (unsigned int *r_entries, unsigned long *r_hits,
+                          unsigned long *r_neg_hits, unsigned long *r_misses);
+
 /* Calling this function with YES set to True forces the use of the
  * standard resolver even if dirmngr has been built with support for
  * an alternative resolver.  */
@@ -128,6 +128,30 @@
 
 #define HTTP_PROXY_ENV           "http_proxy"
 #define MAX_LINELEN 20000  /* Max. length of a HTTP header line. */
+
+/* The size of the buffer of the stream used to read the response.
+ * A large buffer lets us read the socket or the TLS layer in a few
+ * large chunks instead of many small ones.  */
+#define READ_BUFFER_SIZE (32*1024)
+
+/* The default size of a block used to store the response headers.  */
+#define HEADER_ARENA_SIZE 4096
+
+/* The maximum number of idle connections kept for reuse in total and
+ * per host, and the time in seconds an idle connection is kept.  The
+ * idle time is below the 5 seconds keep-alive timeout of a default
+ * Apache configuration so that we rarely try to use a connection
+ * which has just been closed by the server.  */
+#define MAX_IDLE_CONNECTIONS          16
+#define MAX_IDLE_CONNECTIONS_PER_HOST  2
+#define MAX_IDLE_TIME                  4
+
+/* The maximum number of cached TLS sessions and of cached results of
+ * the server certificate verification, and the time in seconds those
+ * cache entries are used.  */
+#define MAX_TLS_CACHE_ENTRIES         32
+#define MAX_TLS_SESSION_TIME         600
+#define MAX_TLS_VERIFY_TIME          300
 #define VALID_URI_CHARS "abcdefghijklmnopqrstuvwxyz"   \
                         "ABCDEFGHIJKLMNOPQRSTUVWXYZ"   \
                         "01234567890@"                 \
@@ -155,6 +179,7 @@ static gpg_error_t send_request (ctrl_t ctrl, http_t hd, const char *httphost,
                                  strlist_t headers);
 static char *build_rel_path (parsed_uri_t uri);
 static gpg_error_t parse_response (http_t hd);
+static void release_headers (http_t hd);
 
 static gpg_error_t connect_server (ctrl_t ctrl,
                                    const char *server, unsigned short port,
@@ -208,6 +233,13 @@ struct cookie_s
      the content length.  */
   uint64_t content_length;
   unsigned int content_length_valid:1;
+
+  /* The number of bytes read from the socket.  */
+  uint64_t nread;
+
+  /* If not NULL the connection may be kept for reuse under this key
+   * after the entire body has been read.  */
+  char *pool_key;
 };
 typedef struct cookie_s *cookie_t;
 
@@ -270,12 +302,25 @@ struct http_session_s
 struct header_s
 {
   struct header_s *next;
-  char *value;    /* The value of the header (malloced).  */
+  char *value;    /* The value of the header (in the arena).  */
   char name[1];   /* The name of the header (canonicalized). */
 };
 typedef struct header_s *header_t;
 
 
+/* A block of memory to store the headers of a response.  All headers
+ * are allocated from a list of such blocks so that they can be
+ * released at once.  */
+struct header_arena_s
+{
+  struct header_arena_s *next;
+  size_t size;    /* The allocated size of DATA.  */
+  size_t used;    /* The number of used bytes of DATA.  */
+  char data[1];
+};
+typedef struct header_arena_s *header_arena_t;
+
+
 #if SIZEOF_UNSIGNED_LONG == 8
 # define HTTP_CONTEXT_MAGIC 0x0068545470435458 /* "hTTpCTX" */
 #else
@@ -291,6 +336,9 @@ struct http_context_s
   my_socket_t sock;
   unsigned int in_data:1;
   unsigned int is_http_0_9:1;
+  unsigned int keep_alive:1;  /* The server will keep the connection.  */
+  char *pool_key;             /* Key for the connection pool or NULL.  */
+  char *tls_cache_key;        /* Key for the TLS session cache or NULL.  */
   estream_t fp_read;
   estream_t fp_write;
   void *write_cookie;
@@ -302,7 +350,32 @@ struct http_context_s
   size_t buffer_size;
   unsigned int flags;
   header_t headers;      /* Received headers. */
+  header_arena_t header_arena;  /* Storage for HEADERS.  */
+};
+
+
+/* An idle connection kept for reuse.  */
+struct idle_conn_s
+{
+  struct idle_conn_s *next;
+  char *key;               /* Scheme, server, port, Host, and flags.  */
+  my_socket_t sock;
+  http_session_t session;  /* The session used for TLS or NULL.  */
+  time_t since;            /* Time the connection became idle.  */
+};
+typedef struct idle_conn_s *idle_conn_t;
+
+
+/* An entry of the TLS session cache or of the verification cache.  */
+struct tls_cache_s
+{
+  struct tls_cache_s *next;
+  time_t created;          /* Time the entry was created.  */
+  void *data;              /* The session data or NULL.  */
+  size_t datalen;
+  char key[1];             /* The lookup key.  */
 };
+typedef struct tls_cache_s *tls_cache_t;
 
 
 /* Two flags to enable verbose and debug mode.  Although currently not
@@ -323,6 +396,14 @@ static strlist_t cfg_ca_certlist;
 /* The global callback for net activity.  */
 static void (*netactivity_cb)(void);
 
+/* The idle connections with the most recently used first.  */
+static idle_conn_t idle_connections;
+
+/* The cached TLS sessions and the fingerprints of successfully
+ * verified server certificates; the most recent entries first.  */
+static tls_cache_t tls_session_cache;
+static tls_cache_t tls_verify_cache;
+
 
 
 #if defined(HAVE_W32_SYSTEM) && !defined(HTTP_NO_WSASTARTUP)
@@ -927,6 +1008,254 @@ http_session_set_timeout (http_session_t sess, unsigned int timeout)
 
 
 
+static void
+release_idle_conn (idle_conn_t conn)
+{
+  my_socket_unref (conn->sock, NULL, NULL);
+  http_session_unref (conn->session);
+  xfree (conn->key);
+  xfree (conn);
+}
+
+
+/* Close idle connections.  With ALL set all of them are closed and
+ * otherwise only those which have been idle for too long.  */
+void
+http_release_idle_connections (int all)
+{
+  idle_conn_t conn, *prev;
+  time_t now = gnupg_get_time ();
+
+  for (prev = &idle_connections; (conn = *prev); )
+    if (all || now - conn->since > MAX_IDLE_TIME)
+      {
+        *prev = conn->next;
+        release_idle_conn (conn);
+      }
+    else
+      prev = &conn->next;
+}
+
+
+/* Keep the connection described by SOCK and SESSION for reuse under
+ * KEY.  This takes ownership of all arguments.  */
+static void
+put_idle_conn (char *key, my_socket_t sock, http_session_t session)
+{
+  idle_conn_t conn, *prev;
+  int n, nhost;
+
+  http_release_idle_connections (0);
+
+  conn = xtrycalloc (1, sizeof *conn);
+  if (!conn)
+    {
+      my_socket_unref (sock, NULL, NULL);
+      http_session_unref (session);
+      xfree (key);
+      return;
+    }
+  conn->key = key;
+  conn->sock = sock;
+  conn->session = session;
+  conn->since = gnupg_get_time ();
+  if (session)
+    {
+      /* The callbacks are only used for the handshake and their
+       * arguments may not be valid anymore.  */
+      session->verify_cb = NULL;
+      session->verify_cb_value = NULL;
+      session->cert_log_cb = NULL;
+    }
+  if (opt_debug)
+    log_debug ("http.c:keeping connection %p (fd %d) for '%s'\n",
+               sock, (int)sock->fd, key);
+
+  conn->next = idle_connections;
+  idle_connections = conn;
+
+  /* Enforce the limits by dropping the oldest connections.  */
+  for (n = nhost = 0, prev = &idle_connections; (conn = *prev); )
+    {
+      n++;
+      if (!strcmp (conn->key, key))
+        nhost++;
+      if (n > MAX_IDLE_CONNECTIONS
+          || (nhost > MAX_IDLE_CONNECTIONS_PER_HOST && !strcmp (conn->key, key)))
+        {
+          *prev = conn->next;
+          release_idle_conn (conn);
+          n--;
+        }
+      else
+        prev = &conn->next;
+    }
+}
+
+
+/* Return true if the idle connection CONN can't be used anymore.  A
+ * readable socket here means that the server closed the connection
+ * or sent data we do not expect; in both cases we can't use it.  */
+static int
+idle_conn_dead_p (idle_conn_t conn)
+{
+  fd_set rfds;
+  struct timeval tv;
+
+#if HTTP_USE_GNUTLS
+  if (conn->session && conn->session->tls_session
+      && gnutls_record_check_pending (conn->session->tls_session))
+    return 1;
+#endif /*HTTP_USE_GNUTLS*/
+
+  FD_ZERO (&rfds);
+  FD_SET (FD2INT (conn->sock->fd), &rfds);
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  /* We use the plain select because this does not block.  */
+  return select (FD2INT (conn->sock->fd) + 1, &rfds, NULL, NULL, &tv) != 0;
+}
+
+
+/* Return an idle connection for KEY or NULL if there is none.  */
+static idle_conn_t
+take_idle_conn (const char *key)
+{
+  idle_conn_t conn, *prev;
+
+  http_release_idle_connections (0);
+
+  for (prev = &idle_connections; (conn = *prev); )
+    {
+      if (strcmp (conn->key, key))
+        {
+          prev = &conn->next;
+          continue;
+        }
+      *prev = conn->next;
+      if (!idle_conn_dead_p (conn))
+        return conn;
+      if (opt_debug)
+        log_debug ("http.c:connection %p for '%s' was closed by the peer\n",
+                   conn->sock, key);
+      release_idle_conn (conn);
+    }
+  return NULL;
+}
+
+
+/* Release the entries of the TLS cache at R_CACHE which are older
+ * than MAXAGE seconds or all of them if MAXAGE is 0.  */
+static void
+expire_tls_cache (tls_cache_t *r_cache, time_t maxage)
+{
+  tls_cache_t item;
+  time_t now = gnupg_get_time ();
+
+  while ((item = *r_cache))
+    if (!maxage || now - item->created > maxage)
+      {
+        *r_cache = item->next;
+#if HTTP_USE_GNUTLS
+        gnutls_free (item->data);
+#endif
+        xfree (item);
+      }
+    else
+      r_cache = &item->next;
+}
+
+
+/* Release all cached TLS sessions and verification results.  This is
+ * required if the set of trusted certificates changes.  */
+void
+http_release_tls_cache (void)
+{
+  expire_tls_cache (&tls_session_cache, 0);
+  expire_tls_cache (&tls_verify_cache, 0);
+}
+
+
+/* Return the entry for KEY from the TLS cache at R_CACHE after
+ * removing entries older than MAXAGE.  Returns NULL if not found.  */
+static tls_cache_t
+find_tls_cache (tls_cache_t *r_cache, time_t maxage, const char *key)
+{
+  tls_cache_t item;
+
+  expire_tls_cache (r_cache, maxage);
+  for (item = *r_cache; item; item = item->next)
+    if (!strcmp (item->key, key))
+      return item;
+  return NULL;
+}
+
+
+/* Put an entry for KEY with DATA into the TLS cache at R_CACHE,
+ * replacing an existing entry for KEY.  This takes ownership of
+ * DATA, which must have been allocated by the TLS library.  */
+static void
+put_tls_cache (tls_cache_t *r_cache, const char *key,
+               void *data, size_t datalen)
+{
+  tls_cache_t item, *prev;
+  int n;
+
+  for (prev = r_cache; (item = *prev); prev = &item->next)
+    if (!strcmp (item->key, key))
+      {
+        *prev = item->next;
+        item->next = NULL;
+        expire_tls_cache (&item, 0);
+        break;
+      }
+
+  item = xtrymalloc (sizeof *item + strlen (key));
+  if (!item)
+    {
+#if HTTP_USE_GNUTLS
+      gnutls_free (data);
+#endif
+      return;
+    }
+  strcpy (item->key, key);
+  item->created = gnupg_get_time ();
+  item->data = data;
+  item->datalen = datalen;
+  item->next = *r_cache;
+  *r_cache = item;
+
+  /* Enforce the limit by dropping the oldest entries.  */
+  for (n = 0, prev = r_cache; (item = *prev); prev = &item->next)
+    if (++n == MAX_TLS_CACHE_ENTRIES)
+      {
+        expire_tls_cache (&item->next, 0);
+        break;
+      }
+}
+
+
+#if HTTP_USE_GNUTLS
+/* Store the TLS session of HD for resumption by later connections to
+ * the same server.  */
+static void
+store_tls_session (http_t hd)
+{
+  gnutls_datum_t sdata;
+
+  if (!hd->tls_cache_key || !hd->session || !hd->session->tls_session)
+    return;
+  if (gnutls_session_get_data2 (hd->session->tls_session, &sdata) < 0)
+    return;
+  if (opt_debug)
+    log_debug ("http.c:storing TLS session for '%s'\n", hd->tls_cache_key);
+  put_tls_cache (&tls_session_cache, hd->tls_cache_key,
+                 sdata.data, sdata.size);
+}
+#endif /*HTTP_USE_GNUTLS*/
+
+
+
 
 /* Start a HTTP retrieval and on success store at R_HD a context
    pointer for completing the request and to wait for the response.
@@ -969,6 +1298,7 @@ http_open (ctrl_t ctrl, http_t *r_hd, http_req_t reqtype, const char *url,
       if (hd->fp_write)
         es_fclose (hd->fp_write);
       http_session_unref (hd->session);
+      xfree (hd->pool_key);
       xfree (hd);
     }
   else
@@ -1157,9 +1487,25 @@ http_wait_response (http_t hd)
       hd->read_cookie = NULL;
       return err;
     }
+  es_setvbuf (hd->fp_read, NULL, _IOFBF, READ_BUFFER_SIZE);
 
   err = parse_response (hd);
 
+#if HTTP_USE_GNUTLS
+  /* The response has been received and thus also a session ticket
+   * sent by a TLS 1.3 server right after the handshake.  */
+  if (!err && use_tls)
+    store_tls_session (hd);
+#endif /*HTTP_USE_GNUTLS*/
+
+  /* If the server keeps the connection open, the read cookie puts it
+   * into the pool once the body has been read.  */
+  if (!err && hd->keep_alive && hd->pool_key)
+    {
+      cookie->pool_key = hd->pool_key;
+      hd->pool_key = NULL;
+    }
+
   if (!err)
     err = es_onclose (hd->fp_read, 1, fp_onclose_notification, hd);
 
@@ -1214,14 +1560,10 @@ http_close (http_t hd, int keep_read_stream)
     es_fclose (hd->fp_write);
   http_session_unref (hd->session);
   hd->magic = 0xdeadbeef;
+  xfree (hd->pool_key);
+  xfree (hd->tls_cache_key);
   http_release_parsed_uri (hd->uri);
-  while (hd->headers)
-    {
-      header_t tmp = hd->headers->next;
-      xfree (hd->headers->value);
-      xfree (hd->headers);
-      hd->headers = tmp;
-    }
+  release_headers (hd);
   xfree (hd->buffer);
   xfree (hd);
 }
@@ -1799,6 +2141,44 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
   server = *hd->uri->host ? hd->uri->host : "localhost";
   port = hd->uri->port ? hd->uri->port : 80;
 
+  /* Plain GET requests to the server may reuse a connection and keep
+   * it open for the next request.  We do not do this for Tor and
+   * proxies to keep the behaviour of those connections simple.  */
+  if (hd->req_type == HTTP_REQ_GET
+      && !(hd->flags & (HTTP_FLAG_SHUTDOWN | HTTP_FLAG_FORCE_TOR
+                        | HTTP_FLAG_IGNORE_CL))
+      && !(proxy && *proxy)
+      && !((hd->flags & HTTP_FLAG_TRY_PROXY)
+           && (http_proxy = getenv (HTTP_PROXY_ENV)) && *http_proxy))
+    {
+      idle_conn_t conn;
+
+      hd->pool_key = es_bsprintf ("%s://%s:%hu %s %u",
+                                  hd->uri->use_tls? "https":"http",
+                                  server, port, httphost? httphost : "",
+                                  hd->session? hd->session->flags : 0);
+      if (!hd->pool_key)
+        return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+      conn = take_idle_conn (hd->pool_key);
+      if (conn)
+        {
+          if (opt_debug)
+            log_debug ("http.c:reusing connection %p (fd %d) for '%s'\n",
+                       conn->sock, (int)conn->sock->fd, conn->key);
+          hd->sock = conn->sock;
+          conn->sock = NULL;
+          if (hd->uri->use_tls)
+            {
+              /* The TLS state lives in the session object.  */
+              http_session_unref (hd->session);
+              hd->session = conn->session;
+              conn->session = NULL;
+            }
+          release_idle_conn (conn);
+          goto connected;
+        }
+    }
+
   /* Try to use SNI.  */
   if (hd->uri->use_tls)
     {
@@ -1813,6 +2193,10 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
           err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
           return err;
         }
+      xfree (hd->tls_cache_key);
+      hd->tls_cache_key = es_bsprintf ("%s:%hu %s %u", server, port,
+                                       hd->session->servername,
+                                       hd->session->flags);
 
 #if HTTP_USE_NTBTLS
       err = ntbtls_set_hostname (hd->session->tls_session,
@@ -2113,6 +2497,18 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
       gnutls_transport_set_push_function (hd->session->tls_session,
                                           my_gnutls_write);
 
+      /* Try to resume a cached session to save a full handshake.  */
+      if (hd->tls_cache_key)
+        {
+          tls_cache_t item;
+
+          item = find_tls_cache (&tls_session_cache, MAX_TLS_SESSION_TIME,
+                                 hd->tls_cache_key);
+          if (item)
+            gnutls_session_set_data (hd->session->tls_session,
+                                     item->data, item->datalen);
+        }
+
     handshake_again:
       do
         {
@@ -2145,6 +2541,10 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
           return gpg_err_make (default_errsource, GPG_ERR_NETWORK);
         }
 
+      if (opt_debug && gnutls_session_is_resumed (hd->session->tls_session))
+        log_debug ("http.c:resumed TLS session for '%s'\n",
+                   hd->tls_cache_key);
+
       hd->session->verify.done = 0;
       if (tls_callback)
         err = tls_callback (hd, hd->session, 0);
@@ -2161,6 +2561,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
 
 #endif /*HTTP_USE_GNUTLS*/
 
+ connected:
   if (auth || hd->uri->auth)
     {
       char *myauth;
@@ -2222,13 +2623,14 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
         snprintf (portstr, sizeof portstr, ":%u", port);
 
       request = es_bsprintf
-        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s",
+        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s%s",
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" : "OOPS",
          *p == '/' ? "" : "/", p,
          httphost? httphost : server,
          portstr,
+         hd->pool_key? "Connection: keep-alive\r\n" : "",
          authstr? authstr:"");
     }
   xfree (p);
@@ -2374,6 +2776,48 @@ capitalize_header_name (char *name)
 }
 
 
+/* Allocate N bytes for the headers of HD.  The memory is released by
+ * release_headers.  */
+static void *
+header_alloc (http_t hd, size_t n)
+{
+  header_arena_t a = hd->header_arena;
+  void *p;
+
+  n = (n + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+  if (!a || a->size - a->used < n)
+    {
+      size_t size = n > HEADER_ARENA_SIZE? n : HEADER_ARENA_SIZE;
+
+      a = xtrymalloc (sizeof *a + size);
+      if (!a)
+        return NULL;
+      a->size = size;
+      a->used = 0;
+      a->next = hd->header_arena;
+      hd->header_arena = a;
+    }
+  p = a->data + a->used;
+  a->used += n;
+  return p;
+}
+
+
+/* Release all stored headers of HD.  */
+static void
+release_headers (http_t hd)
+{
+  header_arena_t a;
+
+  hd->headers = NULL;
+  while ((a = hd->header_arena))
+    {
+      hd->header_arena = a->next;
+      xfree (a);
+    }
+}
+
+
 /* Store an HTTP header line in LINE away.  Line continuation is
    supported as well as merging of headers with the same name. This
    function may modify LINE. */
@@ -2400,11 +2844,10 @@ store_header (http_t hd, char *line)
       if (!hd->headers)
         return GPG_ERR_PROTOCOL_VIOLATION;
       n += strlen (hd->headers->value);
-      p = xtrymalloc (n+1);
+      p = header_alloc (hd, n+1);
       if (!p)
         return gpg_err_code_from_syserror ();
       strcpy (stpcpy (p, hd->headers->value), line);
-      xfree (hd->headers->value);
       hd->headers->value = p;
       return 0;
     }
@@ -2425,25 +2868,22 @@ store_header (http_t hd, char *line)
     {
       /* We have already seen a line with that name.  Thus we assume
        * it is a comma separated list and merge them.  */
-      p = strconcat (h->value, ",", value, NULL);
+      p = header_alloc (hd, strlen (h->value) + 1 + strlen (value) + 1);
       if (!p)
         return gpg_err_code_from_syserror ();
-      xfree (h->value);
+      strcpy (stpcpy (stpcpy (p, h->value), ","), value);
       h->value = p;
       return 0;
     }
 
-  /* Append a new header. */
-  h = xtrymalloc (sizeof *h + strlen (line));
+  /* Append a new header.  The value is stored right after the
+   * name.  */
+  n = strlen (line);
+  h = header_alloc (hd, sizeof *h + n + strlen (value) + 1);
   if (!h)
     return gpg_err_code_from_syserror ();
   strcpy (h->name, line);
-  h->value = xtrymalloc (strlen (value)+1);
-  if (!h->value)
-    {
-      xfree (h);
-      return gpg_err_code_from_syserror ();
-    }
+  h->value = h->name + n + 1;
   strcpy (h->value, value);
   h->next = hd->headers;
   hd->headers = h;
@@ -2504,15 +2944,13 @@ parse_response (http_t hd)
   size_t maxlen, len;
   cookie_t cookie = hd->read_cookie;
   const char *s;
+  uint64_t consumed = 0;
+  int truncated = 0;
+
+  hd->keep_alive = 0;
 
   /* Delete old header lines.  */
-  while (hd->headers)
-    {
-      header_t tmp = hd->headers->next;
-      xfree (hd->headers->value);
-      xfree (hd->headers);
-      hd->headers = tmp;
-    }
+  release_headers (hd);
 
   /* Wait for the status line. */
   do
@@ -2526,6 +2964,7 @@ parse_response (http_t hd)
 	return GPG_ERR_TRUNCATED; /* Line has been truncated. */
       if (!len)
 	return GPG_ERR_EOF;
+      consumed += len;
 
       if (opt_debug || (hd->flags & HTTP_FLAG_LOG_RESP))
         log_debug_string (line, "http.c:response:\n");
@@ -2569,6 +3008,9 @@ parse_response (http_t hd)
       /* Note, that we can silently ignore truncated lines. */
       if (!len)
 	return GPG_ERR_EOF;
+      if (!maxlen)
+        truncated = 1;
+      consumed += len;
       /* Trim line endings of empty lines. */
       if ((*line == '\r' && line[1] == '\n') || *line == '\n')
 	*line = 0;
@@ -2592,6 +3034,27 @@ parse_response (http_t hd)
         {
           cookie->content_length_valid = 1;
           cookie->content_length = string_to_u64 (s);
+
+          /* Some of the body may already be in the stream's buffer;
+           * subtract it so that we stop reading at the end of the
+           * body and not only when the server closes the
+           * connection.  */
+          if (!truncated && cookie->nread >= consumed)
+            {
+              if (cookie->nread - consumed > cookie->content_length)
+                truncated = 1;  /* More data than announced.  */
+              else
+                cookie->content_length -= cookie->nread - consumed;
+            }
+          else
+            truncated = 1;
+
+          /* A server answering our HTTP/1.0 request with a persistent
+           * connection needs to tell us so.  */
+          s = http_get_header (hd, "Connection");
+          if (!truncated && s && ascii_memistr (s, strlen (s), "keep-alive")
+              && !http_get_header (hd, "Transfer-Encoding"))
+            hd->keep_alive = 1;
         }
     }
 
@@ -2887,12 +3350,223 @@ connect_with_timeout (assuan_fd_t sock,
 }
 
 
+/* Return a clock in milliseconds for measuring time spans.  */
+static unsigned long
+get_msec_clock (void)
+{
+#ifdef HAVE_W32_SYSTEM
+  return GetTickCount ();
+#else
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+
+/* Switch SOCK into non-blocking mode if NONBLOCK is set or back into
+ * blocking mode.  */
+static gpg_error_t
+set_socket_nonblocking (assuan_fd_t sock, int nonblock)
+{
+#ifdef HAVE_W32_SYSTEM
+  unsigned long along = !!nonblock;
+
+  if (ioctlsocket (FD2INT (sock), FIONBIO, &along))
+    return my_wsagetlasterror ();
+#else
+  int oflags;
+
+  oflags = fcntl (sock, F_GETFL, 0);
+  if (fcntl (sock, F_SETFL, (nonblock? (oflags | O_NONBLOCK)
+                             /**/   : (oflags & ~O_NONBLOCK))))
+    return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+#endif
+  return 0;
+}
+
+
+/* The delay in milliseconds before the next connection attempt is
+ * started while earlier attempts are still pending.  This is the
+ * value recommended by RFC 8305.  */
+#define CONNECTION_ATTEMPT_DELAY 250
+
+/* The maximum number of pending connection attempts.  */
+#define MAX_PENDING_CONNECTS 8
+
+/* Connect to one of the NADDRS addresses at ADDRS in the way
+ * described by RFC 8305 ("Happy Eyeballs"): The connection attempts
+ * are started in the given order with a delay of
+ * CONNECTION_ATTEMPT_DELAY and the first connection established is
+ * used.  The next attempt is started right away if an attempt fails.
+ * TIMEOUT is the timeout in milliseconds for each attempt; 0 uses no
+ * timeout.  On success the socket is stored at R_SOCK; if no
+ * connection could be established ASSUAN_INVALID_FD is stored there
+ * and the error of the last attempt at R_LAST_ERR.  An error is only
+ * returned if a socket could not be created.  */
+static gpg_error_t
+connect_addrlist (dns_addrinfo_t *addrs, int naddrs, unsigned int timeout,
+                  assuan_fd_t *r_sock, gpg_error_t *r_last_err)
+{
+  gpg_error_t err = 0;
+  struct {
+    assuan_fd_t sock;
+    unsigned long started;
+  } pending[MAX_PENDING_CONNECTS];
+  int npending = 0;
+  int next = 0;
+  unsigned long now, last_start = 0, wait, left;
+  assuan_fd_t sock = ASSUAN_INVALID_FD;
+  fd_set rset, wset;
+  struct timeval tval;
+  int i, n, maxfd, syserr;
+  socklen_t slen;
+
+  *r_sock = ASSUAN_INVALID_FD;
+
+  while (sock == ASSUAN_INVALID_FD)
+    {
+      now = get_msec_clock ();
+      if (next < naddrs && npending < MAX_PENDING_CONNECTS
+          && (!npending || now - last_start >= CONNECTION_ATTEMPT_DELAY))
+        {
+          dns_addrinfo_t ai = addrs[next++];
+          assuan_fd_t s;
+
+          s = my_sock_new_for_addr (ai->addr, ai->socktype, ai->protocol);
+          if (s == ASSUAN_INVALID_FD)
+            {
+              err = gpg_err_make (default_errsource,
+                                  gpg_err_code_from_syserror ());
+              log_error ("error creating socket: %s\n", gpg_strerror (err));
+              break;
+            }
+          err = set_socket_nonblocking (s, 1);
+          if (!err && assuan_sock_connect (s, (struct sockaddr *)ai->addr,
+                                           ai->addrlen))
+            err = gpg_err_make (default_errsource,
+                                gpg_err_code_from_syserror ());
+          else if (!err)
+            {
+              sock = s;  /* Immediate connect.  */
+              break;
+            }
+          if (gpg_err_code (err) == GPG_ERR_EINPROGRESS
+#ifdef HAVE_W32_SYSTEM
+              || gpg_err_code (err) == GPG_ERR_EAGAIN
+#endif
+              )
+            {
+              err = 0;
+              pending[npending].sock = s;
+              pending[npending].started = now;
+              npending++;
+              last_start = now;
+            }
+          else
+            {
+              *r_last_err = err;
+              err = 0;
+              assuan_sock_close (s);
+            }
+          continue;
+        }
+      if (!npending)
+        break;  /* All attempts failed.  */
+
+      /* Wait until an attempt finishes, the next attempt is due, or
+       * the first pending attempt times out.  */
+      wait = (unsigned long)(-1);
+      if (next < naddrs && npending < MAX_PENDING_CONNECTS)
+        wait = CONNECTION_ATTEMPT_DELAY - (now - last_start);
+      if (timeout)
+        for (i=0; i < npending; i++)
+          {
+            left = (now - pending[i].started >= timeout)? 0
+              /**/ : timeout - (now - pending[i].started);
+            if (left < wait)
+              wait = left;
+          }
+
+      FD_ZERO (&rset);
+      maxfd = 0;
+      for (i=0; i < npending; i++)
+        {
+          FD_SET (FD2INT (pending[i].sock), &rset);
+          if (FD2INT (pending[i].sock) > maxfd)
+            maxfd = FD2INT (pending[i].sock);
+        }
+      wset = rset;
+      tval.tv_sec = wait / 1000;
+      tval.tv_usec = (wait % 1000) * 1000;
+      n = my_select (maxfd+1, &rset, &wset, NULL,
+                     wait == (unsigned long)(-1)? NULL : &tval);
+      if (n < 0)
+        {
+          err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+          if (gpg_err_code (err) == GPG_ERR_EINTR)
+            {
+              err = 0;
+              continue;
+            }
+          *r_last_err = err;
+          err = 0;
+          break;
+        }
+
+      now = get_msec_clock ();
+      for (i=0; i < npending && sock == ASSUAN_INVALID_FD; i++)
+        {
+          if (n && (FD_ISSET (FD2INT (pending[i].sock), &rset)
+                    || FD_ISSET (FD2INT (pending[i].sock), &wset)))
+            {
+              slen = sizeof (syserr);
+              if (getsockopt (FD2INT (pending[i].sock), SOL_SOCKET, SO_ERROR,
+                              (void*)&syserr, &slen) < 0)
+                *r_last_err = gpg_err_make (default_errsource,
+                                            gpg_err_code_from_syserror ());
+              else if (syserr)
+                *r_last_err = gpg_err_make (default_errsource,
+                                            gpg_err_code_from_errno (syserr));
+              else
+                {
+                  sock = pending[i].sock;  /* Connected.  */
+                  pending[i] = pending[--npending];
+                  break;
+                }
+            }
+          else if (timeout && now - pending[i].started >= timeout)
+            *r_last_err = gpg_err_make (default_errsource, GPG_ERR_ETIMEDOUT);
+          else
+            continue;
+
+          /* This attempt failed.  */
+          assuan_sock_close (pending[i].sock);
+          pending[i--] = pending[--npending];
+        }
+    }
+
+  for (i=0; i < npending; i++)
+    assuan_sock_close (pending[i].sock);
+
+  if (sock != ASSUAN_INVALID_FD)
+    {
+      set_socket_nonblocking (sock, 0);
+      *r_sock = sock;
+    }
+  return err;
+}
+
+
 /* Actually connect to a server.  On success 0 is returned and the
  * file descriptor for the socket is stored at R_SOCK; on error an
  * error code is returned and ASSUAN_INVALID_FD is stored at R_SOCK.
  * TIMEOUT is the connect timeout in milliseconds.  Note that the
  * function tries to connect to all known addresses and the timeout is
- * for each one. */
+ * for each one.  If a host has several addresses the connection
+ * attempts are run in parallel with a short delay as described by
+ * RFC 8305. */
 static gpg_error_t
 connect_server (ctrl_t ctrl, const char *server, unsigned short port,
                 unsigned int flags, const char *srvtag, unsigned int timeout,
@@ -2906,6 +3580,8 @@ connect_server (ctrl_t ctrl, const char *server, unsigned short port,
   int srv, connected, v4_valid, v6_valid;
   gpg_error_t last_err = 0;
   struct srventry *serverlist = NULL;
+  dns_addrinfo_t *usable, *addrs;
+  int naddrs, i, j, k, first;
 
   *r_sock = ASSUAN_INVALID_FD;
 
@@ -2991,7 +3667,22 @@ connect_server (ctrl_t ctrl, const char *server, unsigned short port,
         }
       hostfound = 1;
 
-      for (ai = aibuf; ai && !connected; ai = ai->next)
+      /* Collect the usable addresses and interleave the address
+       * families, starting with the family of the first address, as
+       * suggested by RFC 8305.  */
+      for (naddrs = 0, ai = aibuf; ai; ai = ai->next)
+        naddrs++;
+      usable = xtrycalloc (2 * naddrs + 1, sizeof *usable);
+      if (!usable)
+        {
+          err = gpg_err_make (default_errsource,
+                              gpg_err_code_from_syserror ());
+          free_dns_addrinfo (aibuf);
+          xfree (serverlist);
+          return err;
+        }
+      addrs = usable + naddrs;
+      for (naddrs = 0, ai = aibuf; ai; ai = ai->next)
         {
           if (ai->family == AF_INET
               && ((flags & HTTP_FLAG_IGNORE_IPv4) || !v4_valid))
@@ -2999,33 +3690,68 @@ connect_server (ctrl_t ctrl, const char *server, unsigned short port,
           if (ai->family == AF_INET6
               && ((flags & HTTP_FLAG_IGNORE_IPv6) || !v6_valid))
             continue;
-
-          if (sock != ASSUAN_INVALID_FD)
-            assuan_sock_close (sock);
-          sock = my_sock_new_for_addr (ai->addr, ai->socktype, ai->protocol);
-          if (sock == ASSUAN_INVALID_FD)
+          usable[naddrs++] = ai;
+        }
+      for (i = j = k = 0, first = 1; k < naddrs; first = !first)
+        {
+          if (first)
             {
-              err = gpg_err_make (default_errsource,
-                                  gpg_err_code_from_syserror ());
-              log_error ("error creating socket: %s\n", gpg_strerror (err));
-              free_dns_addrinfo (aibuf);
-              xfree (serverlist);
-              return err;
+              while (i < naddrs && usable[i]->family != usable[0]->family)
+                i++;
+              if (i < naddrs)
+                addrs[k++] = usable[i++];
+            }
+          else
+            {
+              while (j < naddrs && usable[j]->family == usable[0]->family)
+                j++;
+              if (j < naddrs)
+                addrs[k++] = usable[j++];
             }
+        }
 
+      if (naddrs)
+        {
           anyhostaddr = 1;
-          err = connect_with_timeout (sock, (struct sockaddr *)ai->addr,
-                                      ai->addrlen, timeout);
-          if (err)
+          if (naddrs == 1)
             {
-              last_err = err;
+              sock = my_sock_new_for_addr (addrs[0]->addr, addrs[0]->socktype,
+                                           addrs[0]->protocol);
+              if (sock == ASSUAN_INVALID_FD)
+                {
+                  err = gpg_err_make (default_errsource,
+                                      gpg_err_code_from_syserror ());
+                  log_error ("error creating socket: %s\n",
+                             gpg_strerror (err));
+                }
+              else
+                {
+                  last_err = connect_with_timeout
+                    (sock, (struct sockaddr *)addrs[0]->addr,
+                     addrs[0]->addrlen, timeout);
+                  if (last_err)
+                    {
+                      assuan_sock_close (sock);
+                      sock = ASSUAN_INVALID_FD;
+                    }
+                }
             }
           else
+            err = connect_addrlist (addrs, naddrs, timeout, &sock, &last_err);
+          if (err)
+            {
+              xfree (usable);
+              free_dns_addrinfo (aibuf);
+              xfree (serverlist);
+              return err;
+            }
+          if (sock != ASSUAN_INVALID_FD)
             {
               connected = 1;
               notify_netactivity ();
             }
         }
+      xfree (usable);
       free_dns_addrinfo (aibuf);
     }
 
@@ -3214,6 +3940,8 @@ cookie_read (void *cookie, void *buffer, size_t size)
       nread = read_server (c->sock->fd, buffer, size);
     }
 
+  if (nread > 0)
+    c->nread += nread;
   if (c->content_length_valid && nread > 0)
     {
       if (nread < c->content_length)
@@ -3354,6 +4082,21 @@ cookie_close (void *cookie)
   if (!c)
     return 0;
 
+  /* Keep the connection if the body has been read completely.  */
+  if (c->pool_key && c->sock && c->content_length_valid && !c->content_length
+      && (!c->use_tls || (c->session && c->session->tls_session)))
+    {
+      if (!c->use_tls)
+        {
+          http_session_unref (c->session);
+          c->session = NULL;
+        }
+      put_idle_conn (c->pool_key, c->sock, c->session);
+      xfree (c);
+      return 0;
+    }
+  xfree (c->pool_key);
+
 #if HTTP_USE_NTBTLS
   if (c->use_tls && c->session && c->session->tls_session)
     {
@@ -3393,6 +4136,8 @@ http_verify_server_credentials (http_session_t sess)
   unsigned int certlistlen;
   gnutls_x509_crt_t cert;
   gpg_error_t err = 0;
+  unsigned char fpr[32];
+  char *verifykey = NULL;
 
   sess->verify.done = 1;
   sess->verify.status = 0;
@@ -3405,7 +4150,33 @@ http_verify_server_credentials (http_session_t sess)
       return gpg_error (GPG_ERR_GENERAL);
     }
 
-  rc = gnutls_certificate_verify_peers2 (sess->tls_session, &status);
+  /* A leaf certificate which has recently passed the verification
+   * needs no new path validation.  */
+  certlist = gnutls_certificate_get_peers (sess->tls_session, &certlistlen);
+  if (certlistlen)
+    {
+      gcry_md_hash_buffer (GCRY_MD_SHA256, fpr,
+                           certlist[0].data, certlist[0].size);
+      verifykey = xtrymalloc (2 * sizeof fpr + 20);
+      if (verifykey)
+        {
+          bin2hex (fpr, sizeof fpr, verifykey);
+          snprintf (verifykey + 2 * sizeof fpr, 20, " %u", sess->flags);
+        }
+    }
+  if (verifykey && find_tls_cache (&tls_verify_cache, MAX_TLS_VERIFY_TIME,
+                                   verifykey))
+    {
+      rc = 0;
+      status = 0;
+    }
+  else
+    {
+      rc = gnutls_certificate_verify_peers2 (sess->tls_session, &status);
+      if (!rc && !status && verifykey)
+        put_tls_cache (&tls_verify_cache, verifykey, NULL, 0);
+    }
+  xfree (verifykey);
   if (rc)
     {
       log_error ("%s: %s\n", errprefix, gnutls_strerror (rc));
@@ -3441,7 +4212,6 @@ http_verify_server_credentials (http_session_t sess)
         err = gpg_error (GPG_ERR_GENERAL);
     }
 
-  certlist = gnutls_certificate_get_peers (sess->tls_session, &certlistlen);
   if (!certlistlen)
     {
       log_error ("%s: %s\n", errprefix, "server did not send a certificate");
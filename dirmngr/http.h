@@ -134,6 +134,10 @@ void http_register_tls_ca (const char *fname);
 void http_register_cfg_ca (const char *fname);
 void http_register_netactivity_cb (void (*cb)(void));
 
+/* Close idle connections kept for reuse.  */
+void http_release_idle_connections (int all);
+void http_release_tls_cache (void);
+
 
 gpg_error_t http_session_new (http_session_t *r_session,
                               const char *intended_hostname,
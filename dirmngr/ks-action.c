@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 #include "misc.h"
@@ -34,6 +35,23 @@
 # include "ldap-parse-uri.h"
 #endif
 
+/* The maximum number of keys fetched in parallel by ks_action_get.  */
+#define MAX_PARALLEL_GETS 8
+
+
+/* A job to fetch a key from a HKP keyserver in its own thread.  */
+struct get_job_s
+{
+  struct server_control_s ctrl;  /* A private control object.  */
+  parsed_uri_t uri;
+  const char *pattern;
+  npth_t thread;
+  int started;       /* The thread has been started.  */
+  estream_t fp;      /* The fetched data in a memory stream.  */
+  gpg_error_t err;
+};
+
+
 /* Called by the engine's help functions to print the actual help.  */
 gpg_error_t
 ks_print_help (ctrl_t ctrl, const char *text)
@@ -136,6 +154,49 @@ ks_action_resolve (ctrl_t ctrl, uri_item_t keyservers)
 }
 
 
+/* Copy the search result from IN to OUT line by line.  Unlike
+ * copy_stream this does not wait for a block of data and thus each
+ * record is passed on as soon as it has been received.  An error
+ * writing to OUT, for example because the client closed the
+ * connection, stops the copying.  */
+static gpg_error_t
+copy_search_result (estream_t in, estream_t out)
+{
+  gpg_error_t err = 0;
+  char *line = NULL;
+  size_t linesize = 0;
+  size_t maxlen;
+  gpgrt_ssize_t len;
+
+  for (;;)
+    {
+      maxlen = 16384;
+      len = es_read_line (in, &line, &linesize, &maxlen);
+      if (len < 0)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      if (!len)
+        break;  /* EOF.  */
+      if (!maxlen)
+        {
+          err = gpg_error (GPG_ERR_LINE_TOO_LONG);
+          log_error ("error reading search result: %s\n",
+                     gpg_strerror (err));
+          break;
+        }
+      if (es_write (out, line, len, NULL))
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+    }
+  es_free (line);
+  return err;
+}
+
+
 /* Search all configured keyservers for keys matching PATTERNS and
    write the result to the provided output stream.  */
 gpg_error_t
@@ -161,25 +222,31 @@ ks_action_search (ctrl_t ctrl, uri_item_t keyservers,
   for (uri = keyservers; !err && uri; uri = uri->next)
     {
       int is_http = uri->parsed_uri->is_http;
-      int is_ldap = 0;
       unsigned int http_status = 0;
 #if USE_LDAP
-      is_ldap = (strcmp (uri->parsed_uri->scheme, "ldap") == 0
-		 || strcmp (uri->parsed_uri->scheme, "ldaps") == 0
-		 || strcmp (uri->parsed_uri->scheme, "ldapi") == 0);
-#endif
-      if (is_http || is_ldap)
+      int is_ldap = (strcmp (uri->parsed_uri->scheme, "ldap") == 0
+                     || strcmp (uri->parsed_uri->scheme, "ldaps") == 0
+                     || strcmp (uri->parsed_uri->scheme, "ldapi") == 0);
+
+      if (is_ldap)
         {
+          /* The LDAP engine writes the result while it is paging
+           * through it.  */
           any_server = 1;
-#if USE_LDAP
-	  if (is_ldap)
-	    err = ks_ldap_search (ctrl, uri->parsed_uri, patterns->d, &infp);
-	  else
+          err = ks_ldap_search (ctrl, uri->parsed_uri, patterns->d, outfp);
+          if (!err)
+            {
+              any_results = 1;
+              break;
+            }
+        }
+      else
 #endif
-	    {
-	      err = ks_hkp_search (ctrl, uri->parsed_uri, patterns->d,
-                                   &infp, &http_status);
-	    }
+      if (is_http)
+        {
+          any_server = 1;
+          err = ks_hkp_search (ctrl, uri->parsed_uri, patterns->d,
+                               &infp, &http_status);
 
           if (err == gpg_error (GPG_ERR_NO_DATA)
               && http_status == 404 /* not found */)
@@ -191,7 +258,7 @@ ks_action_search (ctrl_t ctrl, uri_item_t keyservers,
 
           if (!err)
             {
-              err = copy_stream (infp, outfp);
+              err = copy_search_result (infp, outfp);
               es_fclose (infp);
               any_results = 1;
               break;
@@ -207,11 +274,142 @@ ks_action_search (ctrl_t ctrl, uri_item_t keyservers,
 }
 
 
+/* The thread function to fetch a key for ks_action_get.  The data is
+ * read into a memory stream so that the network I/O of all jobs can
+ * overlap.  */
+static void *
+get_job_thread (void *arg)
+{
+  struct get_job_s *job = arg;
+  estream_t infp;
+
+  job->err = ks_hkp_get (&job->ctrl, job->uri, job->pattern, &infp);
+  if (!job->err)
+    {
+      job->fp = es_fopenmem (0, "w+b");
+      if (!job->fp)
+        job->err = gpg_error_from_syserror ();
+      else
+        job->err = copy_stream (infp, job->fp);
+      es_fclose (infp);
+    }
+  return NULL;
+}
+
+
+/* Wait for JOB, write its data to OUTFP, and release its
+ * resources.  Returns the error of the job or of writing the data; the
+ * latter is flagged by setting R_WRITE_ERR.  */
+static gpg_error_t
+finish_get_job (struct get_job_s *job, estream_t outfp, int *r_write_err)
+{
+  gpg_error_t err;
+
+  *r_write_err = 0;
+  if (job->started)
+    npth_join (job->thread, NULL);
+  job->started = 0;
+
+  err = job->err;
+  if (!err && outfp)
+    {
+      es_rewind (job->fp);
+      err = copy_stream (job->fp, outfp);
+      if (!err && es_fflush (outfp))
+        err = gpg_error_from_syserror ();
+      if (err)
+        *r_write_err = 1;
+    }
+  es_fclose (job->fp);
+  job->fp = NULL;
+  dirmngr_deinit_default_ctrl (&job->ctrl);
+  return err;
+}
+
+
+/* Fetch the keys matching PATTERNS from the HKP keyserver URI using
+ * up to MAX_PARALLEL_GETS threads and write them to OUTFP.  The keys
+ * are written in the order of PATTERNS as soon as they are available.
+ * Returns an error only if writing to OUTFP failed; the first error
+ * of a fetch is stored at R_FIRST_ERR and R_ANY_DATA is set if a key
+ * was written.  Keyservers which are a pool of hosts spread the
+ * requests over the hosts because each request selects a random
+ * host.  */
+static gpg_error_t
+get_parallel (ctrl_t ctrl, parsed_uri_t uri, strlist_t patterns,
+              estream_t outfp, gpg_error_t *r_first_err, int *r_any_data)
+{
+  gpg_error_t err = 0;
+  struct get_job_s jobs[MAX_PARALLEL_GETS];
+  npth_attr_t tattr;
+  strlist_t sl;
+  unsigned int head, tail;  /* The ring of running jobs.  */
+  int rc, write_err;
+
+  memset (jobs, 0, sizeof jobs);
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    return gpg_error_from_errno (rc);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+
+  head = tail = 0;
+  sl = patterns;
+  while (!err && (sl || head != tail))
+    {
+      if (sl && head - tail < MAX_PARALLEL_GETS)
+        {
+          struct get_job_s *job = jobs + (head++ % MAX_PARALLEL_GETS);
+
+          dirmngr_init_default_ctrl (&job->ctrl);
+          job->ctrl.timeout = ctrl->timeout;
+          job->ctrl.http_no_crl = ctrl->http_no_crl;
+          xfree (job->ctrl.http_proxy);
+          job->ctrl.http_proxy = NULL;
+          if (ctrl->http_proxy
+              && !(job->ctrl.http_proxy = xtrystrdup (ctrl->http_proxy)))
+            job->err = gpg_error_from_syserror ();
+          job->uri = uri;
+          job->pattern = sl->d;
+          sl = sl->next;
+          if (!job->err)
+            {
+              rc = npth_create (&job->thread, &tattr, get_job_thread, job);
+              if (rc)
+                get_job_thread (job);  /* Do it in this thread.  */
+              else
+                job->started = 1;
+            }
+          continue;
+        }
+
+      err = finish_get_job (jobs + (tail++ % MAX_PARALLEL_GETS), outfp,
+                            &write_err);
+      dirmngr_tick (ctrl);
+      if (!err)
+        *r_any_data = 1;
+      else if (!write_err)
+        {
+          *r_first_err = err;
+          err = 0;
+        }
+    }
+
+  /* Wait for the remaining jobs after a write error.  */
+  while (head != tail)
+    finish_get_job (jobs + (tail++ % MAX_PARALLEL_GETS), NULL, &write_err);
+
+  npth_attr_destroy (&tattr);
+  return err;
+}
+
+
 /* Get the requested keys (matching PATTERNS) using all configured
-   keyservers and write the result to the provided output stream.  */
+   keyservers and write the result to the provided output stream.
+   With PARALLEL set keys from HKP keyservers are fetched in
+   parallel.  */
 gpg_error_t
 ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
-	       strlist_t patterns, estream_t outfp)
+	       strlist_t patterns, int parallel, estream_t outfp)
 {
   gpg_error_t err = 0;
   gpg_error_t first_err = 0;
@@ -247,7 +445,14 @@ ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
       if (is_hkp_s || is_http_s || is_ldap)
         {
           any_server = 1;
-          for (sl = patterns; !err && sl; sl = sl->next)
+          sl = patterns;
+          if (is_hkp_s && parallel && patterns->next)
+            {
+              err = get_parallel (ctrl, uri->parsed_uri, patterns, outfp,
+                                  &first_err, &any_data);
+              sl = NULL;  /* All patterns have been processed.  */
+            }
+          for (; !err && sl; sl = sl->next)
             {
 #if USE_LDAP
 	      if (is_ldap)
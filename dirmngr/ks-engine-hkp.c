@@ -41,6 +41,7 @@
 #include "../common/userids.h"
 #include "dns-stuff.h"
 #include "ks-engine.h"
+#include "../common/metrics.h"
 
 /* Substitutes for missing Mingw macro.  The EAI_SYSTEM mechanism
    seems not to be available (probably because there is only one set
@@ -71,6 +72,21 @@
 /* Number of retries done in case of transient errors.  */
 #define SEND_REQUEST_EXTRA_RETRIES 5
 
+/* The weight of a new sample for the moving averages of the response
+ * time and the error rate of a host is 1/HOST_STATS_WEIGHT.  */
+#define HOST_STATS_WEIGHT 8
+
+/* With a chance of 1/HOST_EXPLORE_RATE a host of a pool is selected
+ * at random instead of by its statistics so that the statistics of
+ * the other hosts are refreshed.  */
+#define HOST_EXPLORE_RATE 10
+
+/* If another host of a pool is available, a connection attempt is
+ * given up after HEDGE_RTT_FACTOR times the average response time of
+ * the host, but not before MIN_HEDGE_TIMEOUT seconds.  */
+#define HEDGE_RTT_FACTOR  4
+#define MIN_HEDGE_TIMEOUT 2
+
 
 enum ks_protocol { KS_PROTOCOL_HKP, KS_PROTOCOL_HKPS, KS_PROTOCOL_MAX };
 
@@ -105,6 +121,9 @@ struct hostinfo_s
   unsigned short port[KS_PROTOCOL_MAX];
                      /* The port used by the host for all protocols, 0
                         if unknown.  */
+  unsigned int nrequests; /* Number of requests sent to the host.  */
+  unsigned int rtt;  /* Moving average of the response time in ms.  */
+  unsigned int errrate; /* Moving average of the error rate in 1/1000. */
   char name[1];      /* The hostname.  */
 };
 
@@ -152,6 +171,9 @@ create_new_hostinfo (const char *name)
   hi->iporname = NULL;
   hi->port[KS_PROTOCOL_HKP] = 0;
   hi->port[KS_PROTOCOL_HKPS] = 0;
+  hi->nrequests = 0;
+  hi->rtt = 0;
+  hi->errrate = 0;
 
   /* Add it to the hosttable. */
   for (idx=0; idx < hosttable_size; idx++)
@@ -222,33 +244,73 @@ host_in_pool_p (hostinfo_t hi, int tblidx)
 }
 
 
-/* Select a random host.  Consult HI->pool which indices into the global
-   hosttable.  Returns index into HI->pool or -1 if no host could be
-   selected.  */
+/* Return the score of host HI; lower is better.  This is the average
+ * response time weighted by the error rate.  A host without requests
+ * has a score of 0 so that it is tried first.  */
+static int
+host_score (hostinfo_t hi)
+{
+  if (!hi->nrequests)
+    return 0;
+  return (int)(hi->rtt + hi->rtt * hi->errrate / 250);
+}
+
+
+/* Return the best score of the alive hosts in the pool of HI or -1
+ * if there is no alive host other than the one with the hosttable
+ * index EXCLUDE.  */
 static int
-select_random_host (hostinfo_t hi)
+best_pool_score (hostinfo_t hi, int exclude)
+{
+  int pidx, idx, score;
+  int best = -1;
+
+  for (idx = 0; idx < hi->pool_len && (pidx = hi->pool[idx]) != -1; idx++)
+    if (pidx != exclude && hosttable[pidx] && !hosttable[pidx]->dead)
+      {
+        score = host_score (hosttable[pidx]);
+        if (best == -1 || score < best)
+          best = score;
+      }
+  return best;
+}
+
+
+/* Select a host from a pool.  Consult HI->pool which indices into the
+   global hosttable.  The host is randomly selected from the alive
+   hosts with a score near the best score; sometimes it is selected
+   from all alive hosts to explore the others.  The host with the
+   hosttable index EXCLUDE is not selected if there is another alive
+   host; use -1 to consider all hosts.  Returns index into HI->pool or
+   -1 if no host could be selected.  */
+static int
+select_pool_host (hostinfo_t hi, int exclude)
 {
   int *tbl;
   size_t tblsize;
   int pidx, idx;
+  int best, explore;
 
-  /* We create a new table so that we randomly select only from
-     currently alive hosts.  */
-  for (idx = 0, tblsize = 0;
-       idx < hi->pool_len && (pidx = hi->pool[idx]) != -1;
-       idx++)
-    if (hosttable[pidx] && !hosttable[pidx]->dead)
-      tblsize++;
-  if (!tblsize)
-    return -1; /* No hosts.  */
+  best = best_pool_score (hi, exclude);
+  if (best == -1)
+    {
+      exclude = -1;
+      best = best_pool_score (hi, exclude);
+      if (best == -1)
+        return -1; /* No hosts.  */
+    }
+  explore = !(get_uint_nonce () % HOST_EXPLORE_RATE);
 
-  tbl = xtrymalloc (tblsize * sizeof *tbl);
+  /* We create a new table so that we randomly select only from the
+     currently alive hosts with a good score.  */
+  tbl = xtrymalloc (hi->pool_len * sizeof *tbl);
   if (!tbl)
     return -1;
   for (idx = 0, tblsize = 0;
        idx < hi->pool_len && (pidx = hi->pool[idx]) != -1;
        idx++)
-    if (hosttable[pidx] && !hosttable[pidx]->dead)
+    if (pidx != exclude && hosttable[pidx] && !hosttable[pidx]->dead
+        && (explore || host_score (hosttable[pidx]) <= best + best / 2))
       tbl[tblsize++] = pidx;
 
   if (tblsize == 1)  /* Save a get_uint_nonce.  */
@@ -468,6 +530,7 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
   int is_pool;
   int new_hosts = 0;
   char *cname;
+  int exclude, best;
 
   *r_host = NULL;
   if (r_httpflags)
@@ -595,18 +658,28 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
             return gpg_error_from_syserror ();
         }
 
-      /* If the currently selected host is now marked dead, force a
-         re-selection .  */
+      /* If the currently selected host is now marked dead or is much
+         slower than the best other host, force a re-selection.  A
+         forced re-selection tries to avoid the current host.  */
+      exclude = -1;
       if (force_reselect)
-        hi->poolidx = -1;
+        {
+          exclude = hi->poolidx;
+          hi->poolidx = -1;
+        }
       else if (hi->poolidx >= 0 && hi->poolidx < hosttable_size
                && hosttable[hi->poolidx] && hosttable[hi->poolidx]->dead)
         hi->poolidx = -1;
+      else if (hi->poolidx >= 0 && hi->poolidx < hosttable_size
+               && hosttable[hi->poolidx]
+               && (best = best_pool_score (hi, hi->poolidx)) != -1
+               && host_score (hosttable[hi->poolidx]) > 2 * best)
+        hi->poolidx = -1;
 
       /* Select a host if needed.  */
       if (hi->poolidx == -1)
         {
-          hi->poolidx = select_random_host (hi);
+          hi->poolidx = select_pool_host (hi, exclude);
           if (hi->poolidx == -1)
             {
               log_error ("no alive host found in pool '%s'\n", name);
@@ -700,16 +773,15 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
 }
 
 
-/* Mark the host NAME as dead.  NAME may be given as an URL.  Returns
-   true if a host was really marked as dead or was already marked dead
-   (e.g. by a concurrent session).  */
+/* Return the index into the hosttable for the host NAME or -1 if not
+   found.  NAME may be given as an URL.  */
 static int
-mark_host_dead (const char *name)
+find_hostinfo_for_request (const char *name)
 {
   const char *host;
   char *host_buffer = NULL;
   parsed_uri_t parsed_uri = NULL;
-  int done = 0;
+  int idx = -1;
 
   if (name && *name && !http_parse_uri (&parsed_uri, name, 1))
     {
@@ -717,7 +789,7 @@ mark_host_dead (const char *name)
         {
           host_buffer = strconcat ("[", parsed_uri->host, "]", NULL);
           if (!host_buffer)
-            log_error ("out of core in mark_host_dead");
+            log_error ("out of core in find_hostinfo_for_request");
           host = host_buffer;
         }
       else
@@ -727,27 +799,118 @@ mark_host_dead (const char *name)
     host = name;
 
   if (host && *host && strcmp (host, "localhost"))
+    idx = find_hostinfo (host);
+
+  http_release_parsed_uri (parsed_uri);
+  xfree (host_buffer);
+  return idx;
+}
+
+
+/* Mark the host NAME as dead.  NAME may be given as an URL.  Returns
+   true if a host was really marked as dead or was already marked dead
+   (e.g. by a concurrent session).  */
+static int
+mark_host_dead (const char *name)
+{
+  hostinfo_t hi;
+  int idx;
+
+  idx = find_hostinfo_for_request (name);
+  if (idx == -1)
+    return 0;
+
+  hi = hosttable[idx];
+  log_info ("marking host '%s' as dead%s\n",
+            hi->name, hi->dead? " (again)":"");
+  hi->dead = 1;
+  hi->died_at = gnupg_get_time ();
+  if (!hi->died_at)
+    hi->died_at = 1;
+  return 1;
+}
+
+
+/* Update the statistics of the host used for REQUEST with a request
+   which took USEC microseconds and FAILED or not.  */
+static void
+update_host_stats (const char *request, uint64_t usec, int failed)
+{
+  hostinfo_t hi;
+  int idx;
+  unsigned int ms, errsample;
+
+  if (npth_mutex_lock (&hosttable_lock))
+    log_fatal ("failed to acquire mutex\n");
+
+  idx = find_hostinfo_for_request (request);
+  if (idx != -1)
     {
-      hostinfo_t hi;
-      int idx;
+      hi = hosttable[idx];
+      /* Cap the time at 1000 seconds so that the score can't
+       * overflow.  */
+      ms = usec / 1000 > 1000000? 1000000 : usec / 1000;
+      errsample = failed? 1000 : 0;
+      if (!hi->nrequests)
+        {
+          hi->rtt = ms;
+          hi->errrate = errsample;
+        }
+      else
+        {
+          hi->rtt = ((HOST_STATS_WEIGHT - 1) * hi->rtt + ms)
+                     / HOST_STATS_WEIGHT;
+          hi->errrate = ((HOST_STATS_WEIGHT - 1) * hi->errrate + errsample)
+                         / HOST_STATS_WEIGHT;
+        }
+      if (hi->nrequests < 0xffffffff)
+        hi->nrequests++;
+    }
 
-      idx = find_hostinfo (host);
-      if (idx != -1)
+  if (npth_mutex_unlock (&hosttable_lock))
+    log_fatal ("failed to release mutex\n");
+}
+
+
+/* Return the connect timeout to use for REQUEST.  This is the
+   standard timeout unless the host of REQUEST is a member of a pool
+   with another alive host.  In that case we do not wait much longer
+   than the host usually needs to respond but try another host
+   instead.  */
+static unsigned int
+hedge_timeout (ctrl_t ctrl, const char *request)
+{
+  unsigned int timeout = ctrl->timeout;
+  unsigned int hedge;
+  hostinfo_t hi;
+  int idx, idx2;
+
+  if (npth_mutex_lock (&hosttable_lock))
+    log_fatal ("failed to acquire mutex\n");
+
+  idx = find_hostinfo_for_request (request);
+  if (idx != -1 && hosttable[idx]->nrequests)
+    {
+      hi = hosttable[idx];
+      for (idx2=0; idx2 < hosttable_size; idx2++)
+        if (hosttable[idx2] && hosttable[idx2]->pool
+            && host_in_pool_p (hosttable[idx2], idx)
+            && best_pool_score (hosttable[idx2], idx) != -1)
+          break;
+      if (idx2 < hosttable_size)
         {
-          hi = hosttable[idx];
-          log_info ("marking host '%s' as dead%s\n",
-                    hi->name, hi->dead? " (again)":"");
-          hi->dead = 1;
-          hi->died_at = gnupg_get_time ();
-          if (!hi->died_at)
-            hi->died_at = 1;
-          done = 1;
+          hedge = (HEDGE_RTT_FACTOR * hi->rtt + 999) / 1000;
+          if (hedge < MIN_HEDGE_TIMEOUT)
+            hedge = MIN_HEDGE_TIMEOUT;
+          if (!timeout || hedge < timeout)
+            timeout = hedge;
         }
     }
 
-  http_release_parsed_uri (parsed_uri);
-  xfree (host_buffer);
-  return done;
+  if (npth_mutex_unlock (&hosttable_lock))
+    log_fatal ("failed to release mutex\n");
+
+  return timeout;
 }
 
 
@@ -956,6 +1119,14 @@ ks_hkp_print_hosttable (ctrl_t ctrl)
         if (err)
 	  goto leave;
 
+        if (hi->nrequests)
+          err = ks_printf_help (ctrl, "  .       rtt=%ums errors=%u.%u%% "
+                                "requests=%u score=%d",
+                                hi->rtt, hi->errrate / 10, hi->errrate % 10,
+                                hi->nrequests, host_score (hi));
+        if (err)
+	  goto leave;
+
         if (hi->pool)
           {
             init_membuf (&mb, 256);
@@ -1151,6 +1322,7 @@ ks_hkp_housekeeping (time_t curtime)
           || hi->died_at > curtime)
         {
           hi->dead = 0;
+          hi->nrequests = 0;  /* Start over with the statistics.  */
           log_info ("resurrected host '%s'", hi->name);
         }
     }
@@ -1177,6 +1349,7 @@ ks_hkp_reload (void)
       if (!hi)
         continue;
       hi->iporname_valid = 0;
+      hi->nrequests = 0;
       if (!hi->dead)
         continue;
       hi->dead = 0;
@@ -1209,8 +1382,11 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   estream_t fp = NULL;
   char *request_buffer = NULL;
   parsed_uri_t uri = NULL;
+  uint64_t start;
+  unsigned int http_status = 0;
 
   *r_fp = NULL;
+  start = metric_usec ();
 
   err = http_parse_uri (&uri, request, 0);
   if (err)
@@ -1230,7 +1406,7 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   if (err)
     goto leave;
   http_session_set_log_cb (session, cert_log_cb);
-  http_session_set_timeout (session, ctrl->timeout);
+  http_session_set_timeout (session, hedge_timeout (ctrl, request));
 
   err = http_open (ctrl, &http,
                    post_cb? HTTP_REQ_POST : HTTP_REQ_GET,
@@ -1288,10 +1464,11 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
       httpflags |= HTTP_FLAG_FORCE_TLS;
     }
 
+  http_status = http_get_status_code (http);
   if (r_http_status)
-    *r_http_status = http_get_status_code (http);
+    *r_http_status = http_status;
 
-  switch (http_get_status_code (http))
+  switch (http_status)
     {
     case 200:
       err = 0;
@@ -1348,6 +1525,11 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   http = NULL;
 
  leave:
+  /* Only network errors and server errors count against the host;
+   * for example a 404 is a valid response.  The statistics are kept
+   * for the host originally selected even after a redirection.  */
+  update_host_stats (redirinfo.orig_url, metric_usec () - start,
+                     err && (!http_status || http_status >= 500));
   http_close (http, 0);
   http_session_release (session);
   xfree (request_buffer);
@@ -52,6 +52,17 @@
 #ifndef HAVE_TIMEGM
 time_t timegm(struct tm *tm);
 #endif
+
+/* The number of entries requested per page of a search.  */
+#define LDAP_SEARCH_PAGE_SIZE 200
+
+/* The number of keys requested at once by ks_ldap_get.  */
+#define LDAP_PARALLEL_GETS 8
+
+/* Paged results (RFC-2696) are only used with OpenLDAP.  */
+#if !defined(_WIN32) && defined(LDAP_CONTROL_PAGEDRESULTS)
+# define USE_PAGED_RESULTS 1
+#endif
 
 /* Convert an LDAP error to a GPG error.  */
 static int
@@ -884,14 +895,21 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
 	"pgpkeycreatetime", "modifytimestamp", "pgpkeysize", "pgpkeytype",
 	NULL
       };
-    /* 1 if we want just attribute types; 0 if we want both attribute
-       types and values.  */
-    int attrsonly = 0;
-
-    int count;
-
+    char *certid_attrs[] = { "pgpcertid", NULL };
+    /* The set of keys to fetch.  */
+    strlist_t seen = NULL;
+    strlist_t sl;
+    char **certids = NULL;
+    int *msgids = NULL;
+    int ncertids, next, i;
+    LDAPMessage *each;
+
+    /* First phase: Get only the certids of the matching entries.
+       The server returns one entry for each user id of a key; thus
+       fetching the key itself with this search would transfer it
+       several times.  */
     ldap_err = ldap_search_s (ldap_conn, basedn, LDAP_SCOPE_SUBTREE,
-			      filter, attrs, attrsonly, &message);
+			      filter, certid_attrs, 0, &message);
     if (ldap_err)
       {
 	err = ldap_err_to_gpg_err (ldap_err);
@@ -901,87 +919,116 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
 	goto out;
       }
 
-    count = ldap_count_entries (ldap_conn, message);
-    if (count < 1)
+    /* There may be more than one unique result for a given keyID,
+       so we should fetch them all (test this by fetching short key
+       id 0xDEADBEEF).  */
+    for (each = ldap_first_entry (ldap_conn, message);
+	 each;
+	 each = ldap_next_entry (ldap_conn, each))
       {
-	log_error ("gpgkeys: key %s not found on keyserver\n", keyspec);
-
-	if (count == -1)
-	  err = ldap_to_gpg_err (ldap_conn);
-	else
-	  err = gpg_error (GPG_ERR_NO_DATA);
+	char **certid = ldap_get_values (ldap_conn, each, "pgpcertid");
 
-	goto out;
+	if (certid && certid[0] && !strlist_find (seen, certid[0]))
+	  append_to_strlist (&seen, certid[0]);
+	ldap_value_free (certid);
       }
+    ldap_msgfree (message);
+    message = NULL;
 
-    {
-      /* There may be more than one unique result for a given keyID,
-	 so we should fetch them all (test this by fetching short key
-	 id 0xDEADBEEF). */
-
-      /* The set of entries that we've seen.  */
-      strlist_t seen = NULL;
-      LDAPMessage *each;
-
-      for (each = ldap_first_entry (ldap_conn, message);
-	   each;
-	   each = ldap_next_entry (ldap_conn, each))
-	{
-	  char **vals;
-	  char **certid;
-
-	  /* Use the long keyid to remove duplicates.  The LDAP
-	     server returns the same keyid more than once if there
-	     are multiple user IDs on the key.  Note that this does
-	     NOT mean that a keyid that exists multiple times on the
-	     keyserver will not be fetched.  It means that each KEY,
-	     no matter how many user IDs share its keyid, will be
-	     fetched only once.  If a keyid that belongs to more
-	     than one key is fetched, the server quite properly
-	     responds with all matching keys. -ds */
-
-	  certid = ldap_get_values (ldap_conn, each, "pgpcertid");
-	  if (certid && certid[0])
-	    {
-	      if (! strlist_find (seen, certid[0]))
-		{
-		  /* It's not a duplicate, add it */
+    ncertids = strlist_length (seen);
+    if (!ncertids)
+      {
+	log_error ("gpgkeys: key %s not found on keyserver\n", keyspec);
+	err = gpg_error (GPG_ERR_NO_DATA);
+	goto leave_get;
+      }
 
-		  add_to_strlist (&seen, certid[0]);
+    certids = xtrycalloc (ncertids, sizeof *certids);
+    msgids = xtrycalloc (ncertids, sizeof *msgids);
+    fp = es_fopenmem (0, "rw");
+    if (!certids || !msgids || !fp)
+      {
+	err = gpg_error_from_syserror ();
+	goto leave_get;
+      }
+    for (i=0, sl=seen; sl; sl = sl->next)
+      certids[i++] = sl->d;
+
+    /* Second phase: Fetch the keys.  Up to LDAP_PARALLEL_GETS
+       requests are sent before waiting for the results, so that the
+       round trips overlap.  The keys are written in the order of the
+       first phase.  */
+    next = 0;
+    for (i=0; i < ncertids; i++)
+      {
+	for (; next < ncertids && next < i + LDAP_PARALLEL_GETS; next++)
+	  {
+	    char *certid_filter = xtryasprintf ("(pgpcertid=%s)",
+						certids[next]);
 
-		  if (! fp)
-		    fp = es_fopenmem(0, "rw");
+	    if (!certid_filter)
+	      {
+		err = gpg_error_from_syserror ();
+		goto leave_get;
+	      }
+	    ldap_err = ldap_search_ext (ldap_conn, basedn,
+					LDAP_SCOPE_SUBTREE, certid_filter,
+					attrs, 0, NULL, NULL, NULL, 0,
+					&msgids[next]);
+	    xfree (certid_filter);
+	    if (ldap_err)
+	      {
+		err = ldap_err_to_gpg_err (ldap_err);
+		log_error ("gpgkeys: LDAP search error: %s\n",
+			   ldap_err2string (ldap_err));
+		goto leave_get;
+	      }
+	  }
 
-		  extract_keys (fp, ldap_conn, certid[0], each);
+	if (ldap_result (ldap_conn, msgids[i], LDAP_MSG_ALL, NULL,
+			 &message) == -1)
+	  {
+	    err = ldap_to_gpg_err (ldap_conn);
+	    log_error ("gpgkeys: unable to retrieve key %s "
+		       "from keyserver\n", certids[i]);
+	    goto leave_get;
+	  }
 
-		  vals = ldap_get_values (ldap_conn, each, pgpkeyattr);
-		  if (! vals)
-		    {
-		      err = ldap_to_gpg_err (ldap_conn);
-		      log_error("gpgkeys: unable to retrieve key %s "
-				"from keyserver\n", certid[0]);
-		      goto out;
-		    }
-		  else
-		    {
-		      /* We should strip the new lines.  */
-		      es_fprintf (fp, "KEY 0x%s BEGIN\n", certid[0]);
-		      es_fputs (vals[0], fp);
-		      es_fprintf (fp, "\nKEY 0x%s END\n", certid[0]);
+	/* Use the first entry; all entries of a certid carry the
+	   same key.  */
+	each = ldap_first_entry (ldap_conn, message);
+	if (each)
+	  {
+	    char **vals;
 
-		      ldap_value_free (vals);
-		    }
-		}
-	    }
+	    extract_keys (fp, ldap_conn, certids[i], each);
 
-	  ldap_value_free (certid);
-	}
+	    vals = ldap_get_values (ldap_conn, each, pgpkeyattr);
+	    if (! vals)
+	      {
+		err = ldap_to_gpg_err (ldap_conn);
+		log_error("gpgkeys: unable to retrieve key %s "
+			  "from keyserver\n", certids[i]);
+		goto leave_get;
+	      }
+	    else
+	      {
+		/* We should strip the new lines.  */
+		es_fprintf (fp, "KEY 0x%s BEGIN\n", certids[i]);
+		es_fputs (vals[0], fp);
+		es_fprintf (fp, "\nKEY 0x%s END\n", certids[i]);
 
-      free_strlist (seen);
+		ldap_value_free (vals);
+	      }
+	  }
+	ldap_msgfree (message);
+	message = NULL;
+      }
 
-      if (! fp)
-	err = gpg_error (GPG_ERR_NO_DATA);
-    }
+  leave_get:
+    xfree (msgids);
+    xfree (certids);
+    free_strlist (seen);
   }
 
  out:
@@ -1012,11 +1059,229 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
   return err;
 }
 
-/* Search the keyserver identified by URI for keys matching PATTERN.
-   On success R_FP has an open stream to read the data.  */
+/* Run one page of a search.  COOKIE holds the cookie returned for
+   the previous page or is empty for the first page; on return it has
+   the cookie for the next page or is empty if there are no more
+   entries.  The caller needs to release the cookie with ber_memfree
+   and the result stored at R_RES with ldap_msgfree.  Without support
+   for paged results the entire result is returned as one page.  */
+static int
+search_page (LDAP *ldap_conn, char *basedn, char *filter, char **attrs,
+	     struct berval *cookie, LDAPMessage **r_res)
+{
+  int ldap_err;
+#ifdef USE_PAGED_RESULTS
+  LDAPControl *pagectrl = NULL;
+  LDAPControl *serverctrls[2];
+  LDAPControl **resctrls = NULL;
+  LDAPControl *ctrl;
+  ber_int_t count;
+  int errcode;
+
+  *r_res = NULL;
+
+  /* The control is not critical so that a server which does not
+     support it returns the whole result at once.  */
+  ldap_err = ldap_create_page_control (ldap_conn, LDAP_SEARCH_PAGE_SIZE,
+				       cookie, 0, &pagectrl);
+  if (ldap_err)
+    return ldap_err;
+  serverctrls[0] = pagectrl;
+  serverctrls[1] = NULL;
+
+  ldap_err = ldap_search_ext_s (ldap_conn, basedn, LDAP_SCOPE_SUBTREE,
+				filter, attrs, 0, serverctrls, NULL, NULL,
+				0, r_res);
+  ldap_control_free (pagectrl);
+  ber_memfree (cookie->bv_val);
+  cookie->bv_val = NULL;
+  cookie->bv_len = 0;
+  if (ldap_err != LDAP_SUCCESS && ldap_err != LDAP_SIZELIMIT_EXCEEDED)
+    return ldap_err;
+
+  if (*r_res
+      && !ldap_parse_result (ldap_conn, *r_res, &errcode, NULL, NULL, NULL,
+			     &resctrls, 0)
+      && resctrls)
+    {
+      ctrl = ldap_control_find (LDAP_CONTROL_PAGEDRESULTS, resctrls, NULL);
+      if (ctrl
+	  && ldap_parse_pageresponse_control (ldap_conn, ctrl, &count, cookie))
+	{
+	  cookie->bv_val = NULL;
+	  cookie->bv_len = 0;
+	}
+      ldap_controls_free (resctrls);
+    }
+#else /*!USE_PAGED_RESULTS*/
+  *r_res = NULL;
+  cookie->bv_val = NULL;
+  cookie->bv_len = 0;
+  ldap_err = ldap_search_s (ldap_conn, basedn, LDAP_SCOPE_SUBTREE,
+			    filter, attrs, 0, r_res);
+#endif /*!USE_PAGED_RESULTS*/
+
+  return ldap_err;
+}
+
+
+/* Print the keys of the search result RES not yet listed in DUPELIST
+   to FP and add them to DUPELIST.  Returns the number of printed
+   keys.  */
+static int
+print_search_page (LDAP *ldap_conn, LDAPMessage *res, strlist_t *dupelist,
+		   estream_t fp)
+{
+  char **vals;
+  LDAPMessage *each;
+  int count = 0;
+
+  for (each = ldap_first_entry (ldap_conn, res);
+       each;
+       each = ldap_next_entry (ldap_conn, each))
+    {
+      char **certid;
+      LDAPMessage *uids;
+
+      certid = ldap_get_values (ldap_conn, each, "pgpcertid");
+      if (! certid || ! certid[0])
+	continue;
+
+      /* Have we seen this certid before? */
+      if (! strlist_find (*dupelist, certid[0]))
+	{
+	  add_to_strlist (dupelist, certid[0]);
+	  count++;
+
+	  es_fprintf (fp, "pub:%s:",certid[0]);
+
+	  vals = ldap_get_values (ldap_conn, each, "pgpkeytype");
+	  if (vals)
+	    {
+	      /* The LDAP server doesn't exactly handle this
+		 well. */
+	      if (strcasecmp (vals[0], "RSA") == 0)
+		es_fputs ("1", fp);
+	      else if (strcasecmp (vals[0], "DSS/DH") == 0)
+		es_fputs ("17", fp);
+	      ldap_value_free (vals);
+	    }
+
+	  es_fputc (':', fp);
+
+	  vals = ldap_get_values (ldap_conn, each, "pgpkeysize");
+	  if (vals)
+	    {
+	      /* Not sure why, but some keys are listed with a
+		 key size of 0.  Treat that like an unknown. */
+	      if (atoi (vals[0]) > 0)
+		es_fprintf (fp, "%d", atoi (vals[0]));
+	      ldap_value_free (vals);
+	    }
+
+	  es_fputc (':', fp);
+
+	  /* YYYYMMDDHHmmssZ */
+
+	  vals = ldap_get_values (ldap_conn, each, "pgpkeycreatetime");
+	  if(vals && strlen (vals[0]) == 15)
+	    {
+	      es_fprintf (fp, "%u",
+			  (unsigned int) ldap2epochtime(vals[0]));
+	      ldap_value_free (vals);
+	    }
+
+	  es_fputc (':', fp);
+
+	  vals = ldap_get_values (ldap_conn, each, "pgpkeyexpiretime");
+	  if (vals && strlen (vals[0]) == 15)
+	    {
+	      es_fprintf (fp, "%u",
+			  (unsigned int) ldap2epochtime (vals[0]));
+	      ldap_value_free (vals);
+	    }
+
+	  es_fputc (':', fp);
+
+	  vals = ldap_get_values (ldap_conn, each, "pgprevoked");
+	  if (vals)
+	    {
+	      if (atoi (vals[0]) == 1)
+		es_fprintf (fp, "r");
+	      ldap_value_free (vals);
+	    }
+
+	  vals = ldap_get_values (ldap_conn, each, "pgpdisabled");
+	  if (vals)
+	    {
+	      if (atoi (vals[0]) ==1)
+		es_fprintf (fp, "d");
+	      ldap_value_free (vals);
+	    }
+
+#if 0
+	  /* This is not yet specified in the keyserver
+	     protocol, but may be someday. */
+	  es_fputc (':', fp);
+
+	  vals = ldap_get_values (ldap_conn, each, "modifytimestamp");
+	  if(vals && strlen (vals[0]) == 15)
+	    {
+	      es_fprintf (fp, "%u",
+			  (unsigned int) ldap2epochtime (vals[0]));
+	      ldap_value_free (vals);
+	    }
+#endif
+
+	  es_fprintf (fp, "\n");
+
+	  /* Now print all the uids that have this certid.  Entries
+	     of the key on a later page are not considered.  */
+	  for (uids = ldap_first_entry (ldap_conn, res);
+	       uids;
+	       uids = ldap_next_entry (ldap_conn, uids))
+	    {
+	      vals = ldap_get_values (ldap_conn, uids, "pgpcertid");
+	      if (! vals)
+		continue;
+
+	      if (strcasecmp (certid[0], vals[0]) == 0)
+		{
+		  char **uidvals;
+
+		  es_fprintf (fp, "uid:");
+
+		  uidvals = ldap_get_values (ldap_conn,
+					     uids, "pgpuserid");
+		  if (uidvals)
+		    {
+		      /* Need to escape any colons */
+		      char *quoted = percent_escape (uidvals[0], NULL);
+		      es_fputs (quoted, fp);
+		      xfree (quoted);
+		      ldap_value_free (uidvals);
+		    }
+
+		  es_fprintf (fp, "\n");
+		}
+
+	      ldap_value_free(vals);
+	    }
+	}
+
+      ldap_value_free (certid);
+    }
+
+  return count;
+}
+
+
+/* Search the keyserver identified by URI for keys matching PATTERN
+   and write the result to OUTFP.  The search is done in pages and
+   each page is written as soon as it has been received.  */
 gpg_error_t
 ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
-		estream_t *r_fp)
+		estream_t outfp)
 {
   gpg_error_t err;
   int ldap_err;
@@ -1059,7 +1324,8 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
       goto out;
     }
 
-  /* Even if we have no results, we want to return a stream.  */
+  /* The first page is collected so that its key count can be given
+     in the info line if it is the only page.  */
   fp = es_fopenmem(0, "rw");
   if (!fp)
     {
@@ -1068,9 +1334,10 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
     }
 
   {
-    char **vals;
-    LDAPMessage *res, *each;
+    LDAPMessage *res;
+    struct berval cookie = { 0, NULL };
     int count = 0;
+    int npages = 0;
     strlist_t dupelist = NULL;
 
     /* The maximum size of the search, including the optional stuff
@@ -1084,37 +1351,49 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
     log_debug ("SEARCH '%s' => '%s' BEGIN\n", pattern, filter);
 
-    ldap_err = ldap_search_s (ldap_conn, basedn,
-			      LDAP_SCOPE_SUBTREE, filter, attrs, 0, &res);
-
-    xfree (filter);
-    filter = NULL;
-
-    if (ldap_err != LDAP_SUCCESS && ldap_err != LDAP_SIZELIMIT_EXCEEDED)
+    do
       {
-	err = ldap_err_to_gpg_err (ldap_err);
+	ldap_err = search_page (ldap_conn, basedn, filter, attrs,
+				&cookie, &res);
+	if (ldap_err != LDAP_SUCCESS && ldap_err != LDAP_SIZELIMIT_EXCEEDED)
+	  {
+	    err = ldap_err_to_gpg_err (ldap_err);
 
-	log_error ("SEARCH %s FAILED %d\n", pattern, err);
-	log_error ("gpgkeys: LDAP search error: %s\n",
-		   ldap_err2string (err));
-	goto out;
-    }
+	    log_error ("SEARCH %s FAILED %d\n", pattern, err);
+	    log_error ("gpgkeys: LDAP search error: %s\n",
+		       ldap_err2string (ldap_err));
+	    if (res)
+	      ldap_msgfree (res);
+	    break;
+	  }
 
-    /* The LDAP server doesn't return a real count of unique keys, so we
-       can't use ldap_count_entries here. */
-    for (each = ldap_first_entry (ldap_conn, res);
-	 each;
-	 each = ldap_next_entry (ldap_conn, each))
-      {
-	char **certid = ldap_get_values (ldap_conn, each, "pgpcertid");
-	if (certid && certid[0] && ! strlist_find (dupelist, certid[0]))
+	count += print_search_page (ldap_conn, res, &dupelist,
+				    npages? outfp : fp);
+	ldap_msgfree (res);
+
+	if (!npages++)
 	  {
-	    add_to_strlist (&dupelist, certid[0]);
-	    count++;
+	    /* The LDAP server doesn't return a real count of unique
+	       keys, so we can't use ldap_count_entries here.  If more
+	       pages follow the count is not known.  */
+	    if (cookie.bv_len && ldap_err == LDAP_SUCCESS)
+	      es_fputs ("info:1\n", outfp);
+	    else
+	      es_fprintf (outfp, "info:1:%d\n", count);
+	    es_fseek (fp, 0, SEEK_SET);
+	    err = copy_stream (fp, outfp);
+	    if (err)
+	      break;
+	  }
+	else if (es_fflush (outfp))
+	  {
+	    err = gpg_error_from_syserror ();
+	    break;
 	  }
       }
+    while (cookie.bv_len && ldap_err == LDAP_SUCCESS);
 
-    if (ldap_err == LDAP_SIZELIMIT_EXCEEDED)
+    if (!err && ldap_err == LDAP_SIZELIMIT_EXCEEDED)
       {
 	if (count == 1)
 	  log_error ("gpgkeys: search results exceeded server limit."
@@ -1124,170 +1403,16 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 		     "  First %d results shown.\n", count);
       }
 
-    free_strlist (dupelist);
-    dupelist = NULL;
-
-    if (count < 1)
-      es_fputs ("info:1:0\n", fp);
-    else
-      {
-	es_fprintf (fp, "info:1:%d\n", count);
-
-	for (each = ldap_first_entry (ldap_conn, res);
-	     each;
-	     each = ldap_next_entry (ldap_conn, each))
-	  {
-	    char **certid;
-	    LDAPMessage *uids;
-
-	    certid = ldap_get_values (ldap_conn, each, "pgpcertid");
-	    if (! certid || ! certid[0])
-	      continue;
-
-	    /* Have we seen this certid before? */
-	    if (! strlist_find (dupelist, certid[0]))
-	      {
-		add_to_strlist (&dupelist, certid[0]);
-
-		es_fprintf (fp, "pub:%s:",certid[0]);
-
-		vals = ldap_get_values (ldap_conn, each, "pgpkeytype");
-		if (vals)
-		  {
-		    /* The LDAP server doesn't exactly handle this
-		       well. */
-		    if (strcasecmp (vals[0], "RSA") == 0)
-		      es_fputs ("1", fp);
-		    else if (strcasecmp (vals[0], "DSS/DH") == 0)
-		      es_fputs ("17", fp);
-		    ldap_value_free (vals);
-		  }
-
-		es_fputc (':', fp);
-
-		vals = ldap_get_values (ldap_conn, each, "pgpkeysize");
-		if (vals)
-		  {
-		    /* Not sure why, but some keys are listed with a
-		       key size of 0.  Treat that like an unknown. */
-		    if (atoi (vals[0]) > 0)
-		      es_fprintf (fp, "%d", atoi (vals[0]));
-		    ldap_value_free (vals);
-		  }
-
-		es_fputc (':', fp);
-
-		/* YYYYMMDDHHmmssZ */
-
-		vals = ldap_get_values (ldap_conn, each, "pgpkeycreatetime");
-		if(vals && strlen (vals[0]) == 15)
-		  {
-		    es_fprintf (fp, "%u",
-				(unsigned int) ldap2epochtime(vals[0]));
-		    ldap_value_free (vals);
-		  }
-
-		es_fputc (':', fp);
-
-		vals = ldap_get_values (ldap_conn, each, "pgpkeyexpiretime");
-		if (vals && strlen (vals[0]) == 15)
-		  {
-		    es_fprintf (fp, "%u",
-				(unsigned int) ldap2epochtime (vals[0]));
-		    ldap_value_free (vals);
-		  }
-
-		es_fputc (':', fp);
-
-		vals = ldap_get_values (ldap_conn, each, "pgprevoked");
-		if (vals)
-		  {
-		    if (atoi (vals[0]) == 1)
-		      es_fprintf (fp, "r");
-		    ldap_value_free (vals);
-		  }
-
-		vals = ldap_get_values (ldap_conn, each, "pgpdisabled");
-		if (vals)
-		  {
-		    if (atoi (vals[0]) ==1)
-		      es_fprintf (fp, "d");
-		    ldap_value_free (vals);
-		  }
-
-#if 0
-		/* This is not yet specified in the keyserver
-		   protocol, but may be someday. */
-		es_fputc (':', fp);
-
-		vals = ldap_get_values (ldap_conn, each, "modifytimestamp");
-		if(vals && strlen (vals[0]) == 15)
-		  {
-		    es_fprintf (fp, "%u",
-				(unsigned int) ldap2epochtime (vals[0]));
-		    ldap_value_free (vals);
-		  }
+#ifdef USE_PAGED_RESULTS
+    ber_memfree (cookie.bv_val);
 #endif
-
-		es_fprintf (fp, "\n");
-
-		/* Now print all the uids that have this certid */
-		for (uids = ldap_first_entry (ldap_conn, res);
-		     uids;
-		     uids = ldap_next_entry (ldap_conn, uids))
-		  {
-		    vals = ldap_get_values (ldap_conn, uids, "pgpcertid");
-		    if (! vals)
-		      continue;
-
-		    if (strcasecmp (certid[0], vals[0]) == 0)
-		      {
-			char **uidvals;
-
-			es_fprintf (fp, "uid:");
-
-			uidvals = ldap_get_values (ldap_conn,
-						   uids, "pgpuserid");
-			if (uidvals)
-			  {
-			    /* Need to escape any colons */
-			    char *quoted = percent_escape (uidvals[0], NULL);
-			    es_fputs (quoted, fp);
-			    xfree (quoted);
-			    ldap_value_free (uidvals);
-			  }
-
-			es_fprintf (fp, "\n");
-		      }
-
-		    ldap_value_free(vals);
-		  }
-	      }
-
-	      ldap_value_free (certid);
-	  }
-      }
-
-    ldap_msgfree (res);
     free_strlist (dupelist);
   }
 
   log_debug ("SEARCH %s END\n", pattern);
 
  out:
-  if (err)
-    {
-      if (fp)
-	es_fclose (fp);
-    }
-  else
-    {
-      /* Return the read stream.  */
-      if (fp)
-	es_fseek (fp, 0, SEEK_SET);
-
-      *r_fp = fp;
-    }
+  es_fclose (fp);
 
   xfree (basedn);
 
@@ -1300,7 +1425,7 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 }
 
 
-
+
 /* A modlist describes a set of changes to an LDAP entry.  (An entry
    consists of 1 or more attributes.  Attributes are <name, value>
    pairs.  Note: an attribute may be multi-valued in which case
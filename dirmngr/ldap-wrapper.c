@@ -39,7 +39,13 @@
  *    cancellation of a query at any point of time.
  *
  * 4. Given that we are going out to the network and usually get back
- *    a long response, the fork/exec overhead is acceptable.
+ *    a long response, the fork/exec overhead is acceptable.  For many
+ *    short queries, as done for certificate lookups, it is not; thus
+ *    the default wrapper is run in its server mode and kept for a
+ *    while after a query.  A later query with the same connection
+ *    parameters is then sent to the idle wrapper, which also keeps
+ *    the connection to the LDAP server open.  The output of each
+ *    query is prefixed by its length.
  *
  * Note that under WindowsCE the number of processes is strongly
  * limited (32 processes including the kernel processes) and thus we
@@ -61,6 +67,7 @@
 
 #include "dirmngr.h"
 #include "../common/exechelp.h"
+#include "../common/host2net.h"
 #include "misc.h"
 #include "ldap-wrapper.h"
 
@@ -82,6 +89,10 @@
 
 #define TIMERTICK_INTERVAL 2
 
+/* Idle wrappers in server mode are terminated after this number of
+ * seconds.  */
+#define LDAP_HELPER_IDLE_TIMEOUT 60
+
 /* To keep track of the LDAP wrapper state we use this structure.  */
 struct wrapper_context_s
 {
@@ -102,6 +113,15 @@ struct wrapper_context_s
   size_t linelen;      /* Use size of LINE.  */
   time_t stamp;        /* The last time we noticed ativity.  */
   int reaper_idx;      /* Private to ldap_wrapper_thread.   */
+
+  /* The following fields are only used for wrappers running in
+   * server mode.  */
+  char *key;           /* The connection arguments or NULL if the
+                        * wrapper is not in server mode.  */
+  estream_t in_fp;     /* Connected with stdin of the ldap wrapper.  */
+  int busy;            /* The wrapper is used for a query.  */
+  int have_header;     /* The length of the current output is known.  */
+  size_t remaining;    /* Number of bytes left of the current output.  */
 };
 
 
@@ -177,12 +197,29 @@ destroy_wrapper (struct wrapper_context_s *ctx)
     }
   ksba_reader_release (ctx->reader);
   SAFE_CLOSE (ctx->fp);
+  SAFE_CLOSE (ctx->in_fp);
   SAFE_CLOSE (ctx->log_fp);
   xfree (ctx->line);
+  xfree (ctx->key);
   xfree (ctx);
 }
 
 
+/* Make sure that the server mode wrapper CTX won't be used again and
+ * that it terminates.  Must be called with the reaper list locked.  */
+static void
+discard_wrapper (struct wrapper_context_s *ctx)
+{
+  xfree (ctx->key);
+  ctx->key = NULL;
+  ctx->busy = 0;
+  SAFE_CLOSE (ctx->fp);
+  SAFE_CLOSE (ctx->in_fp);
+  if (ctx->pid != (pid_t)(-1))
+    gnupg_kill_process (ctx->pid);
+}
+
+
 /* Print the content of LINE to the log stream but make sure to only
    print complete lines.  Using NULL for LINE will flush any pending
    output.  LINE may be modified by this function. */
@@ -474,6 +511,19 @@ ldap_reaper_thread (void *dummy)
                   }
               }
 
+            /* Let idle wrappers in server mode terminate by closing
+             * their stdin.  */
+            if (ctx->key && ctx->in_fp && !ctx->busy
+                && ctx->stamp != (time_t)(-1)
+                && ctx->stamp + LDAP_HELPER_IDLE_TIMEOUT < time (NULL))
+              {
+                if (DBG_EXTPROG)
+                  log_debug ("ldap wrapper %d idle - closing\n",
+                             (int)ctx->pid);
+                SAFE_CLOSE (ctx->in_fp);
+                any_action = 1;
+              }
+
             /* Check whether we should terminate the process. */
             if (ctx->pid != (pid_t)(-1)
                 && ctx->stamp != (time_t)(-1) && ctx->stamp < exptime)
@@ -573,9 +623,15 @@ ldap_reaper_launch_thread (void)
 void
 ldap_wrapper_wait_connections ()
 {
+  struct wrapper_context_s *ctx;
+
   lock_reaper_list ();
   {
     shutting_down = 1;
+    /* Idle wrappers in server mode have not been killed.  */
+    for (ctx = reaper_list; ctx; ctx = ctx->next)
+      if (ctx->key && !ctx->busy)
+        discard_wrapper (ctx);
     if (npth_cond_signal (&reaper_run_cond))
       log_error ("%s: Ooops: signaling condition failed: %s\n",
                  __func__, gpg_strerror (gpg_error_from_syserror ()));
@@ -609,7 +665,19 @@ ldap_wrapper_release_context (ksba_reader_t reader)
                        ctx->ctrl, ctx->ctrl? ctx->ctrl->refcount:0);
 
           ctx->reader = NULL;
-          SAFE_CLOSE (ctx->fp);
+          /* A wrapper in server mode is kept for the next query if
+           * its output has been read completely.  */
+          if (ctx->key && ctx->fp && ctx->in_fp && !ctx->fp_err
+              && ctx->have_header && !ctx->remaining
+              && ctx->pid != (pid_t)(-1) && !ctx->ready && !shutting_down)
+            {
+              ctx->busy = 0;
+              ctx->stamp = time (NULL);
+            }
+          else if (ctx->key)
+            discard_wrapper (ctx);
+          else
+            SAFE_CLOSE (ctx->fp);
           if (ctx->ctrl)
             {
               ctx->ctrl->refcount--;
@@ -650,13 +718,13 @@ ldap_wrapper_connection_cleanup (ctrl_t ctrl)
 }
 
 
-/* This is the callback used by the ldap wrapper to feed the ksba
- * reader with the wrapper's stdout.  See the description of
- * ksba_reader_set_cb for details.  */
+/* Read up to COUNT bytes from the wrapper's stdout into BUFFER and
+ * store the number of bytes read at NREAD.  Returns -1 on EOF or
+ * error.  */
 static int
-reader_callback (void *cb_value, char *buffer, size_t count,  size_t *nread)
+read_wrapper_output (struct wrapper_context_s *ctx,
+                     char *buffer, size_t count, size_t *nread)
 {
-  struct wrapper_context_s *ctx = cb_value;
   size_t nleft = count;
   struct timespec abstime;
   struct timespec curtime;
@@ -672,9 +740,6 @@ reader_callback (void *cb_value, char *buffer, size_t count,  size_t *nread)
      reader may be detached from another stream to read other data and
      then it would be cumbersome to get back already buffered stuff).  */
 
-  if (!buffer && !count && !nread)
-    return -1; /* Rewind is not supported. */
-
   /* If we ever encountered a read error, don't continue (we don't want to
      possibly overwrite the last error cause).  Bail out also if the
      file descriptor has been closed. */
@@ -781,21 +846,178 @@ reader_callback (void *cb_value, char *buffer, size_t count,  size_t *nread)
 }
 
 
-/* Fork and exec the LDAP wrapper and return a new libksba reader
-   object at READER.  ARGV is a NULL terminated list of arguments for
-   the wrapper.  The function returns 0 on success or an error code.
+/* This is the callback used by the ldap wrapper to feed the ksba
+ * reader with the wrapper's stdout.  See the description of
+ * ksba_reader_set_cb for details.  In server mode the output of a
+ * query is prefixed by its length as 4 byte big endian value and only
+ * that many bytes are returned.  */
+static int
+reader_callback (void *cb_value, char *buffer, size_t count,  size_t *nread)
+{
+  struct wrapper_context_s *ctx = cb_value;
+  unsigned char hdr[4];
+  size_t off, n;
 
-   Special hack to avoid passing a password through the command line
-   which is globally visible: If the first element of ARGV is "--pass"
-   it will be removed and instead the environment variable
-   DIRMNGR_LDAP_PASS will be set to the next value of ARGV.  On modern
-   OSes the environment is not visible to other users.  For those old
-   systems where it can't be avoided, we don't want to go into the
-   hassle of passing the password via stdin; it's just too complicated
-   and an LDAP password used for public directory lookups should not
-   be that confidential.  */
-gpg_error_t
-ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
+  if (!buffer && !count && !nread)
+    return -1; /* Rewind is not supported. */
+
+  if (!ctx->key)
+    return read_wrapper_output (ctx, buffer, count, nread);
+
+  if (!ctx->have_header)
+    {
+      for (off=0; off < 4; off += n)
+        {
+          if (read_wrapper_output (ctx, (char*)hdr + off, 4 - off, &n))
+            {
+              SAFE_CLOSE (ctx->fp);
+              *nread = 0;
+              return -1;
+            }
+        }
+      ctx->remaining = buf32_to_size_t (hdr);
+      ctx->have_header = 1;
+    }
+
+  if (!ctx->remaining)
+    {
+      *nread = 0;
+      return -1; /* EOF. */
+    }
+  if (count > ctx->remaining)
+    count = ctx->remaining;
+  if (read_wrapper_output (ctx, buffer, count, nread))
+    {
+      *nread = 0;
+      return -1;
+    }
+  ctx->remaining -= *nread;
+  return 0;
+}
+
+
+/* Return true if ARG is an option of dirmngr_ldap which describes
+ * the query and not the connection.  Set R_WITHVALUE if the option
+ * takes a value.  */
+static int
+is_query_option (const char *arg, int *r_withvalue)
+{
+  *r_withvalue = (!strcmp (arg, "--dn")
+                  || !strcmp (arg, "--filter")
+                  || !strcmp (arg, "--attr"));
+  return *r_withvalue || !strcmp (arg, "--multi");
+}
+
+
+/* Return true if ARG is an option of dirmngr_ldap which takes a
+ * value and describes the connection.  */
+static int
+is_connection_option_with_value (const char *arg)
+{
+  return (!strcmp (arg, "--pass")
+          || !strcmp (arg, "--timeout")
+          || !strcmp (arg, "--proxy")
+          || !strcmp (arg, "--host")
+          || !strcmp (arg, "--port")
+          || !strcmp (arg, "--user"));
+}
+
+
+/* Split the wrapper arguments ARGV into the connection arguments,
+ * which are stored as NULL terminated array at R_CONNARGV, and the
+ * query.  The query is returned as a request line for the server
+ * mode of the wrapper at R_REQUEST.  A key identifying the connection
+ * arguments is stored at R_KEY.  The array does not copy the strings
+ * from ARGV.  */
+static gpg_error_t
+split_wrapper_args (const char *argv[], const char ***r_connargv,
+                    char **r_key, char **r_request)
+{
+  gpg_error_t err;
+  const char **connargv;
+  membuf_t key, request;
+  char *p;
+  int i, j, withvalue;
+
+  *r_connargv = NULL;
+  *r_key = NULL;
+  *r_request = NULL;
+
+  for (i = 0; argv[i]; i++)
+    ;
+  connargv = xtrycalloc (i + 2, sizeof *connargv);
+  if (!connargv)
+    return gpg_error_from_syserror ();
+
+  init_membuf (&key, 256);
+  init_membuf (&request, 256);
+  for (i = j = 0; argv[i]; i++)
+    {
+      if (is_query_option (argv[i], &withvalue) || *argv[i] != '-')
+        {
+          for (;;)
+            {
+              p = percent_plus_escape (argv[i]);
+              if (!p)
+                {
+                  err = gpg_error_from_syserror ();
+                  goto leave;
+                }
+              if (get_membuf_len (&request))
+                put_membuf (&request, " ", 1);
+              put_membuf_str (&request, p);
+              xfree (p);
+              if (!withvalue || !argv[i+1])
+                break;
+              withvalue = 0;
+              i++;
+            }
+        }
+      else
+        {
+          connargv[j++] = argv[i];
+          put_membuf_str (&key, argv[i]);
+          put_membuf (&key, "\n", 1);
+          if (is_connection_option_with_value (argv[i]) && argv[i+1])
+            {
+              connargv[j++] = argv[++i];
+              put_membuf_str (&key, argv[i]);
+              put_membuf (&key, "\n", 1);
+            }
+        }
+    }
+  put_membuf (&key, "", 1);
+  put_membuf (&request, "", 1);
+
+  *r_key = get_membuf (&key, NULL);
+  *r_request = get_membuf (&request, NULL);
+  if (!*r_key || !*r_request)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (*r_key);
+      *r_key = NULL;
+      xfree (*r_request);
+      *r_request = NULL;
+      xfree (connargv);
+      return err;
+    }
+  *r_connargv = connargv;
+  return 0;
+
+ leave:
+  xfree (get_membuf (&key, NULL));
+  xfree (get_membuf (&request, NULL));
+  xfree (connargv);
+  return err;
+}
+
+
+/* Fork and exec the LDAP wrapper program PGMNAME with the arguments
+ * ARGV and store a new context at R_CTX.  If SERVER is set the
+ * wrapper is started in server mode.  */
+static gpg_error_t
+spawn_wrapper (const char *pgmname, const char *argv[], int server,
+               struct wrapper_context_s **r_ctx)
 {
   gpg_error_t err;
   pid_t pid;
@@ -803,32 +1025,14 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
   int i;
   int j;
   const char **arg_list;
-  const char *pgmname;
-  estream_t outfp, errfp;
+  estream_t infp, outfp, errfp;
 
-  /* It would be too simple to connect stderr just to our logging
-     stream.  The problem is that if we are running multi-threaded
-     everything gets intermixed.  Clearly we don't want this.  So the
-     only viable solutions are either to have another thread
-     responsible for logging the messages or to add an option to the
-     wrapper module to do the logging on its own.  Given that we anyway
-     need a way to reap the child process and this is best done using a
-     general reaping thread, that thread can do the logging too. */
-  ldap_reaper_launch_thread ();
-
-  *reader = NULL;
-
-  /* Files: We need to prepare stdin and stdout.  We get stderr from
-     the function.  */
-  if (!opt.ldap_wrapper_program || !*opt.ldap_wrapper_program)
-    pgmname = gnupg_module_name (GNUPG_MODULE_NAME_DIRMNGR_LDAP);
-  else
-    pgmname = opt.ldap_wrapper_program;
+  *r_ctx = NULL;
 
   /* Create command line argument array.  */
   for (i = 0; argv[i]; i++)
     ;
-  arg_list = xtrycalloc (i + 2, sizeof *arg_list);
+  arg_list = xtrycalloc (i + 3, sizeof *arg_list);
   if (!arg_list)
     {
       err = gpg_error_from_syserror ();
@@ -844,6 +1048,8 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
       }
     else
       arg_list[j] = (char*) argv[i];
+  if (server)
+    arg_list[j] = "--server";
 
   ctx = xtrycalloc (1, sizeof *ctx);
   if (!ctx)
@@ -854,9 +1060,10 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
       return err;
     }
 
+  infp = NULL;
   err = gnupg_spawn_process (pgmname, arg_list,
                              NULL, NULL, GNUPG_SPAWN_NONBLOCK,
-                             NULL, &outfp, &errfp, &pid);
+                             server? &infp : NULL, &outfp, &errfp, &pid);
   xfree (arg_list);
   if (err)
     {
@@ -868,10 +1075,162 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
   ctx->pid = pid;
   ctx->printable_pid = (int) pid;
   ctx->fp = outfp;
+  ctx->in_fp = infp;
   ctx->log_fp = errfp;
+  ctx->stamp = time (NULL);
+
+  *r_ctx = ctx;
+  return 0;
+}
+
+
+/* Send the REQUEST line to the server mode wrapper CTX.  */
+static gpg_error_t
+send_request (struct wrapper_context_s *ctx, const char *request)
+{
+  if (es_fputs (request, ctx->in_fp) == EOF
+      || es_putc ('\n', ctx->in_fp) == EOF
+      || es_fflush (ctx->in_fp))
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Return an idle wrapper in server mode with the connection arguments
+ * KEY or NULL if there is none.  The returned wrapper is marked as
+ * busy.  */
+static struct wrapper_context_s *
+take_idle_wrapper (const char *key)
+{
+  struct wrapper_context_s *ctx;
+
+  lock_reaper_list ();
+  {
+    for (ctx = reaper_list; ctx; ctx = ctx->next)
+      if (ctx->key && !ctx->busy && !ctx->reader && !ctx->ready
+          && ctx->pid != (pid_t)(-1) && ctx->fp && ctx->in_fp
+          && !strcmp (ctx->key, key))
+        {
+          ctx->busy = 1;
+          break;
+        }
+  }
+  unlock_reaper_list ();
+  return ctx;
+}
+
+
+/* Fork and exec the LDAP wrapper and return a new libksba reader
+   object at READER.  ARGV is a NULL terminated list of arguments for
+   the wrapper.  The function returns 0 on success or an error code.
+
+   Unless a custom wrapper program has been configured, the wrapper is
+   run in server mode and an idle wrapper started with the same
+   connection arguments is used if available.
+
+   Special hack to avoid passing a password through the command line
+   which is globally visible: If the first element of ARGV is "--pass"
+   it will be removed and instead the environment variable
+   DIRMNGR_LDAP_PASS will be set to the next value of ARGV.  On modern
+   OSes the environment is not visible to other users.  For those old
+   systems where it can't be avoided, we don't want to go into the
+   hassle of passing the password via stdin; it's just too complicated
+   and an LDAP password used for public directory lookups should not
+   be that confidential.  */
+gpg_error_t
+ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
+{
+  gpg_error_t err;
+  struct wrapper_context_s *ctx;
+  const char *pgmname;
+  const char **connargv = NULL;
+  char *key = NULL;
+  char *request = NULL;
+  int server, is_new;
+
+  /* It would be too simple to connect stderr just to our logging
+     stream.  The problem is that if we are running multi-threaded
+     everything gets intermixed.  Clearly we don't want this.  So the
+     only viable solutions are either to have another thread
+     responsible for logging the messages or to add an option to the
+     wrapper module to do the logging on its own.  Given that we anyway
+     need a way to reap the child process and this is best done using a
+     general reaping thread, that thread can do the logging too. */
+  ldap_reaper_launch_thread ();
+
+  *reader = NULL;
+
+  /* Files: We need to prepare stdin and stdout.  We get stderr from
+     the function.  */
+  server = (!opt.ldap_wrapper_program || !*opt.ldap_wrapper_program);
+  if (server)
+    pgmname = gnupg_module_name (GNUPG_MODULE_NAME_DIRMNGR_LDAP);
+  else
+    pgmname = opt.ldap_wrapper_program;
+
+  if (!server)
+    {
+      err = spawn_wrapper (pgmname, argv, 0, &ctx);
+      if (err)
+        return err;
+      is_new = 1;
+    }
+  else
+    {
+      err = split_wrapper_args (argv, &connargv, &key, &request);
+      if (err)
+        {
+          log_error (_("error allocating memory: %s\n"), gpg_strerror (err));
+          return err;
+        }
+
+      ctx = take_idle_wrapper (key);
+      if (ctx)
+        {
+          is_new = 0;
+          if (DBG_EXTPROG)
+            log_debug ("ldap wrapper %d reused\n", (int)ctx->pid);
+          err = send_request (ctx, request);
+          if (err)
+            {
+              log_info ("error sending request to ldap wrapper %d: %s\n",
+                        ctx->printable_pid, gpg_strerror (err));
+              lock_reaper_list ();
+              discard_wrapper (ctx);
+              unlock_reaper_list ();
+              ctx = NULL;
+            }
+        }
+      if (!ctx)
+        {
+          is_new = 1;
+          err = spawn_wrapper (pgmname, connargv, 1, &ctx);
+          if (!err)
+            {
+              ctx->key = key;
+              key = NULL;
+              ctx->busy = 1;
+              err = send_request (ctx, request);
+              if (err)
+                {
+                  log_error ("error sending request to ldap wrapper %d: %s\n",
+                             ctx->printable_pid, gpg_strerror (err));
+                  destroy_wrapper (ctx);
+                }
+            }
+        }
+      xfree (connargv);
+      xfree (key);
+      xfree (request);
+      if (err)
+        return err;
+    }
+
   ctx->ctrl = ctrl;
   ctrl->refcount++;
   ctx->stamp = time (NULL);
+  ctx->have_header = 0;
+  ctx->remaining = 0;
 
   err = ksba_reader_new (reader);
   if (!err)
@@ -880,9 +1239,18 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
     {
       log_error (_("error initializing reader object: %s\n"),
                  gpg_strerror (err));
-      destroy_wrapper (ctx);
       ksba_reader_release (*reader);
       *reader = NULL;
+      ctx->ctrl->refcount--;
+      ctx->ctrl = NULL;
+      if (is_new)
+        destroy_wrapper (ctx);
+      else
+        {
+          lock_reaper_list ();
+          discard_wrapper (ctx);
+          unlock_reaper_list ();
+        }
       return err;
     }
 
@@ -890,8 +1258,11 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *reader, const char *argv[])
   lock_reaper_list ();
   {
     ctx->reader = *reader;
-    ctx->next = reaper_list;
-    reaper_list = ctx;
+    if (is_new)
+      {
+        ctx->next = reaper_list;
+        reaper_list = ctx;
+      }
     if (npth_cond_signal (&reaper_run_cond))
       log_error ("ldap-wrapper: Ooops: signaling condition failed: %s (%d)\n",
                  gpg_strerror (gpg_error_from_syserror ()), errno);
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include "dirmngr.h"
 #include "misc.h"
@@ -586,10 +587,407 @@ check_signature (ctrl_t ctrl,
 }
 
 
+/* The OCSP response cache.  Only the outcome of a fully verified
+ * response is cached; it is keyed by the fingerprint of the issuer
+ * certificate and the serial number of the target certificate.  An
+ * entry is used until the nextUpdate time of the response or, if the
+ * responder did not return one, for opt.ocsp_current_period seconds
+ * after the thisUpdate time.  The entries are also appended to the
+ * file OCSP_CACHE_FILE in the cache directory so that they survive a
+ * restart; the file is read on first use and compacted if it mainly
+ * holds expired entries.  */
+#define OCSP_CACHE_FILE    "ocsp-cache.txt"
+#define OCSP_CACHE_VERSION 1
+#define OCSP_CACHE_BUCKETS 256
+#define OCSP_CACHE_MAX     4096
+
+struct ocsp_cache_item_s
+{
+  struct ocsp_cache_item_s *next;
+  char issuer[41];                 /* Hex fingerprint of the issuer.  */
+  int revoked;                     /* The status is revoked, not good.  */
+  ksba_crl_reason_t reason;
+  ksba_isotime_t this_update;
+  ksba_isotime_t next_update;      /* Empty if not known.  */
+  ksba_isotime_t revocation_time;  /* Empty if not revoked.  */
+  ksba_isotime_t expires;          /* Do not use the entry after this.  */
+  char serial[1];                  /* Hex serial number.  */
+};
+typedef struct ocsp_cache_item_s *ocsp_cache_item_t;
+
+static struct
+{
+  int loaded;          /* The file has been read.  */
+  unsigned int count;  /* Number of entries.  */
+  ocsp_cache_item_t buckets[OCSP_CACHE_BUCKETS];
+} ocsp_cache;
+
+
+static unsigned int
+ocsp_cache_hash (const char *issuer, const char *serial)
+{
+  unsigned int h = 0;
+
+  for (; *issuer; issuer++)
+    h = h * 31 + *(const unsigned char *)issuer;
+  for (; *serial; serial++)
+    h = h * 31 + *(const unsigned char *)serial;
+  return h % OCSP_CACHE_BUCKETS;
+}
+
+
+/* Return the cache entry for (ISSUER,SERIAL) or NULL.  */
+static ocsp_cache_item_t
+ocsp_cache_find (const char *issuer, const char *serial)
+{
+  ocsp_cache_item_t item;
+
+  for (item = ocsp_cache.buckets[ocsp_cache_hash (issuer, serial)];
+       item; item = item->next)
+    if (!strcmp (item->issuer, issuer) && !strcmp (item->serial, serial))
+      return item;
+  return NULL;
+}
+
+
+/* Remove all entries expired at CURRENT_TIME.  If CURRENT_TIME is
+ * NULL all entries are removed.  */
+static void
+ocsp_cache_purge (const char *current_time)
+{
+  ocsp_cache_item_t item, *itemp;
+  int i;
+
+  for (i=0; i < OCSP_CACHE_BUCKETS; i++)
+    for (itemp = &ocsp_cache.buckets[i]; (item = *itemp); )
+      if (!current_time || strcmp (item->expires, current_time) <= 0)
+        {
+          *itemp = item->next;
+          xfree (item);
+          ocsp_cache.count--;
+        }
+      else
+        itemp = &item->next;
+}
+
+
+/* Insert ITEM into the cache replacing an existing entry.  */
+static void
+ocsp_cache_insert (ocsp_cache_item_t item)
+{
+  ocsp_cache_item_t old, *itemp;
+  unsigned int h = ocsp_cache_hash (item->issuer, item->serial);
+
+  for (itemp = &ocsp_cache.buckets[h]; (old = *itemp); itemp = &old->next)
+    if (!strcmp (old->issuer, item->issuer)
+        && !strcmp (old->serial, item->serial))
+      {
+        *itemp = old->next;
+        xfree (old);
+        ocsp_cache.count--;
+        break;
+      }
+  item->next = ocsp_cache.buckets[h];
+  ocsp_cache.buckets[h] = item;
+  ocsp_cache.count++;
+}
+
+
+static void
+ocsp_cache_write_item (estream_t fp, ocsp_cache_item_t item)
+{
+  es_fprintf (fp, "%c:%s:%s:%s:%s:%s:%s:%d:\n",
+              item->revoked? 'r':'g', item->issuer, item->serial,
+              item->this_update, item->next_update, item->expires,
+              item->revocation_time, (int)item->reason);
+}
+
+
+/* Parse the cache file LINE and return a new item or NULL.  */
+static ocsp_cache_item_t
+ocsp_cache_parse_line (char *line)
+{
+  ocsp_cache_item_t item;
+  char *fields[8];
+
+  if (split_fields_colon (line, fields, DIM (fields)) < DIM (fields))
+    return NULL;
+  if ((strcmp (fields[0], "g") && strcmp (fields[0], "r"))
+      || strlen (fields[1]) != 40 || !*fields[2]
+      || !string2isotime (NULL, fields[3])
+      || (*fields[4] && !string2isotime (NULL, fields[4]))
+      || !string2isotime (NULL, fields[5])
+      || (*fields[6] && !string2isotime (NULL, fields[6])))
+    return NULL;
+
+  item = xtrycalloc (1, sizeof *item + strlen (fields[2]));
+  if (!item)
+    return NULL;
+  item->revoked = (*fields[0] == 'r');
+  strcpy (item->issuer, fields[1]);
+  strcpy (item->serial, fields[2]);
+  string2isotime (item->this_update, fields[3]);
+  if (*fields[4])
+    string2isotime (item->next_update, fields[4]);
+  string2isotime (item->expires, fields[5]);
+  if (*fields[6])
+    string2isotime (item->revocation_time, fields[6]);
+  item->reason = atoi (fields[7]);
+  return item;
+}
+
+
+/* Write all entries of the cache to the cache file.  */
+static void
+ocsp_cache_rewrite (const char *fname)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  estream_t fp;
+  ocsp_cache_item_t item;
+  int i;
+
+  tmpfname = xtryasprintf ("%s.%lu.tmp", fname, (unsigned long)getpid ());
+  if (!tmpfname)
+    return;
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    {
+      log_error (_("error creating '%s': %s\n"), tmpfname, strerror (errno));
+      xfree (tmpfname);
+      return;
+    }
+  es_fprintf (fp, "# OCSP response cache - do not edit\nv:%d:\n",
+              OCSP_CACHE_VERSION);
+  for (i=0; i < OCSP_CACHE_BUCKETS; i++)
+    for (item = ocsp_cache.buckets[i]; item; item = item->next)
+      ocsp_cache_write_item (fp, item);
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error writing '%s': %s\n"), tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+  else if ((err = gnupg_rename_file (tmpfname, fname, NULL)))
+    {
+      log_error (_("error renaming '%s' to '%s': %s\n"),
+                 tmpfname, fname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+  xfree (tmpfname);
+}
+
+
+/* Read the cache file.  This is done on first use.  */
+static void
+ocsp_cache_load (void)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t linesize = 0;
+  size_t maxlen;
+  ssize_t len;
+  ksba_isotime_t current_time;
+  ocsp_cache_item_t item;
+  int version_okay = 0;
+  unsigned int nexpired = 0;
+
+  ocsp_cache.loaded = 1;
+  gnupg_get_isotime (current_time);
+
+  fname = make_filename (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_error (_("error opening '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+
+  maxlen = 1024;
+  while ((len = es_read_line (fp, &line, &linesize, &maxlen)) > 0)
+    {
+      if (!maxlen)
+        break;  /* Line too long; the file is corrupt.  */
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+      if (!*line || *line == '#')
+        continue;
+      if (!version_okay)
+        {
+          if (strncmp (line, "v:", 2) || atoi (line+2) != OCSP_CACHE_VERSION)
+            break;  /* Unknown version; rewrite the file.  */
+          version_okay = 1;
+          continue;
+        }
+      item = ocsp_cache_parse_line (line);
+      if (!item)
+        continue;
+      if (strcmp (item->expires, current_time) <= 0
+          || ocsp_cache.count >= OCSP_CACHE_MAX)
+        {
+          nexpired++;
+          xfree (item);
+          continue;
+        }
+      ocsp_cache_insert (item);
+    }
+  es_fclose (fp);
+  xfree (line);
+
+  if (opt.verbose)
+    log_info ("loaded %u cached OCSP responses (%u expired)\n",
+              ocsp_cache.count, nexpired);
+  if (!version_okay || nexpired > ocsp_cache.count)
+    ocsp_cache_rewrite (fname);
+  xfree (fname);
+}
+
+
+/* Return the cached status for the certificate with the hex
+ * SERIAL issued by the certificate with the hex fingerprint ISSUER or
+ * NULL if none is available.  */
+static ocsp_cache_item_t
+ocsp_cache_get (const char *issuer, const char *serial)
+{
+  ksba_isotime_t current_time;
+  ocsp_cache_item_t item;
+
+  if (!ocsp_cache.loaded)
+    ocsp_cache_load ();
+
+  item = ocsp_cache_find (issuer, serial);
+  if (!item)
+    return NULL;
+  gnupg_get_isotime (current_time);
+  if (strcmp (item->expires, current_time) <= 0)
+    return NULL;
+  return item;
+}
+
+
+/* Store the outcome of a verified OCSP response in the cache.  */
+static void
+ocsp_cache_put (const char *issuer, const char *serial,
+                ksba_status_t status, const ksba_isotime_t this_update,
+                const ksba_isotime_t next_update,
+                const ksba_isotime_t revocation_time,
+                ksba_crl_reason_t reason)
+{
+  ocsp_cache_item_t item;
+  ksba_isotime_t current_time;
+  char *fname;
+  estream_t fp;
+
+  if (status != KSBA_STATUS_GOOD && status != KSBA_STATUS_REVOKED)
+    return;
+  if (strlen (issuer) != 40 || !*serial)
+    return;
+
+  item = xtrycalloc (1, sizeof *item + strlen (serial));
+  if (!item)
+    return;
+  strcpy (item->issuer, issuer);
+  strcpy (item->serial, serial);
+  item->revoked = (status == KSBA_STATUS_REVOKED);
+  item->reason = item->revoked? reason : 0;
+  gnupg_copy_time (item->this_update, this_update);
+  if (*next_update)
+    {
+      gnupg_copy_time (item->next_update, next_update);
+      gnupg_copy_time (item->expires, next_update);
+    }
+  else
+    {
+      gnupg_copy_time (item->expires, this_update);
+      add_seconds_to_isotime (item->expires, opt.ocsp_current_period);
+    }
+  if (item->revoked)
+    gnupg_copy_time (item->revocation_time, revocation_time);
+
+  gnupg_get_isotime (current_time);
+  if (!*item->expires || strcmp (item->expires, current_time) <= 0)
+    {
+      xfree (item);
+      return;  /* Already expired.  */
+    }
+
+  if (!ocsp_cache.loaded)
+    ocsp_cache_load ();
+  if (ocsp_cache.count >= OCSP_CACHE_MAX)
+    ocsp_cache_purge (current_time);
+  if (ocsp_cache.count >= OCSP_CACHE_MAX)
+    {
+      xfree (item);
+      return;
+    }
+  ocsp_cache_insert (item);
+
+  /* Append the entry to the file.  A new file gets the version line
+   * first.  */
+  fname = make_filename (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  fp = es_fopen (fname, "a");
+  if (!fp)
+    log_error (_("error opening '%s': %s\n"), fname, strerror (errno));
+  else
+    {
+      if (!es_ftello (fp))
+        es_fprintf (fp, "# OCSP response cache - do not edit\nv:%d:\n",
+                    OCSP_CACHE_VERSION);
+      ocsp_cache_write_item (fp, item);
+      if (es_fclose (fp))
+        log_error (_("error writing '%s': %s\n"),
+                   fname, gpg_strerror (gpg_error_from_syserror ()));
+    }
+  xfree (fname);
+}
+
+
+/* Release the in-memory OCSP cache; it will be read again from the
+ * file on next use.  If REMOVE_FILE is set the file is also
+ * removed.  */
+void
+ocsp_cache_deinit (int remove_file)
+{
+  char *fname;
+
+  ocsp_cache_purge (NULL);
+  ocsp_cache.loaded = 0;
+  if (remove_file)
+    {
+      fname = make_filename (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+      if (gnupg_remove (fname) && errno != ENOENT)
+        log_error (_("error removing '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+    }
+}
+
+
+/* Invalidate the cached validation status of CERT.  This is done if
+ * the certificate has been revoked.  */
+static void
+invalidate_validated_at (ksba_cert_t cert)
+{
+  gpg_error_t err;
+  time_t validated_at = 0; /* That is: No cached validation available. */
+
+  err = ksba_cert_set_user_data (cert, "validated_at",
+                                 &validated_at, sizeof (validated_at));
+  if (err)
+    log_error ("set_user_data(validated_at) failed: %s\n",
+               gpg_strerror (err));
+  /* The certificate is anyway revoked, and that is a more important
+     message than the failure of our cache. */
+}
+
+
 /* Check whether the certificate either given by fingerprint CERT_FPR
    or directly through the CERT object is valid by running an OCSP
    transaction.  With FORCE_DEFAULT_RESPONDER set only the configured
-   default responder is used. */
+   default responder is used.  A cached status is used unless
+   FORCE_DEFAULT_RESPONDER is set. */
 gpg_error_t
 ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
               int force_default_responder)
@@ -611,6 +1009,10 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   char *oid;
   ksba_name_t name;
   fingerprint_list_t default_signer = NULL;
+  char *issuer_fpr = NULL;
+  char *serial = NULL;
+  ksba_sexp_t serialno;
+  ocsp_cache_item_t cached;
 
   /* Get the certificate.  */
   if (cert)
@@ -643,6 +1045,28 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
         }
     }
 
+  /* Check the cache.  */
+  issuer_fpr = get_fingerprint_hexstring (issuer_cert);
+  serialno = ksba_cert_get_serial (cert);
+  serial = serial_hex (serialno);
+  ksba_free (serialno);
+  if (serial && !force_default_responder
+      && (cached = ocsp_cache_get (issuer_fpr, serial)))
+    {
+      if (opt.verbose)
+        log_info ("using cached OCSP status: %s  (this=%s  next=%s)\n",
+                  cached->revoked? _("revoked"):_("good"),
+                  cached->this_update, cached->next_update);
+      if (cached->revoked)
+        {
+          invalidate_validated_at (cert);
+          err = gpg_error (GPG_ERR_CERT_REVOKED);
+        }
+      else
+        err = 0;
+      goto leave;
+    }
+
   /* Create an OCSP instance.  */
   err = ksba_ocsp_new (&ocsp);
   if (err)
@@ -769,19 +1193,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   /* In case the certificate has been revoked, we better invalidate
      our cached validation status. */
   if (status == KSBA_STATUS_REVOKED)
-    {
-      time_t validated_at = 0; /* That is: No cached validation available. */
-      err = ksba_cert_set_user_data (cert, "validated_at",
-                                     &validated_at, sizeof (validated_at));
-      if (err)
-        {
-          log_error ("set_user_data(validated_at) failed: %s\n",
-                     gpg_strerror (err));
-          err = 0; /* The certificate is anyway revoked, and that is a
-                      more important message than the failure of our
-                      cache. */
-        }
-    }
+    invalidate_validated_at (cert);
 
 
   if (opt.verbose)
@@ -863,6 +1275,10 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
         }
     }
 
+  /* Cache the status unless the response was not acceptable.  */
+  if (serial && (!err || gpg_err_code (err) == GPG_ERR_CERT_REVOKED))
+    ocsp_cache_put (issuer_fpr, serial, status, this_update, next_update,
+                    revocation_time, reason);
 
  leave:
   gcry_md_close (md);
@@ -872,6 +1288,8 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   ksba_cert_release (cert);
   ksba_ocsp_release (ocsp);
   xfree (url_buffer);
+  xfree (issuer_fpr);
+  xfree (serial);
   return err;
 }
 
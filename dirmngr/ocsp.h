@@ -28,4 +28,7 @@ gpg_error_t ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
 /* Release the list of OCSP certificates hold in the CTRL object. */
 void release_ctrl_ocsp_certs (ctrl_t ctrl);
 
+/* Release the OCSP response cache and optionally remove its file.  */
+void ocsp_cache_deinit (int remove_file);
+
 #endif /*OCSP_H*/
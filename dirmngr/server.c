@@ -33,6 +33,8 @@
 #include <unistd.h>
 #include <errno.h>
 
+#include <npth.h>
+
 #include "dirmngr.h"
 #include <assuan.h>
 
@@ -57,6 +59,7 @@
 #include "../common/mbox-util.h"
 #include "../common/zb32.h"
 #include "../common/server-help.h"
+#include "../common/metrics.h"
 
 /* To avoid DoS attacks we limit the size of a certificate to
    something reasonable.  The DoS was actually only an issue back when
@@ -77,6 +80,11 @@
    them such large blobs.  */
 #define MAX_KEYBLOCK_LENGTH (20*1024*1024)
 
+/* The maximum number of requests of the BATCH command and the number
+ * of those requests processed at the same time.  */
+#define MAX_BATCH_REQUESTS 256
+#define MAX_BATCH_JOBS 8
+
 
 #define PARM_ERROR(t) assuan_set_error (ctx, \
                                         gpg_error (GPG_ERR_ASS_PARAMETER), (t))
@@ -113,9 +121,43 @@ struct server_local_s
   size_t inhibit_data_logging_count;
   unsigned int inhibit_data_logging : 1;
   unsigned int inhibit_data_logging_now : 1;
+
+  /* If this flag is set data written up to a LF is sent to the
+   * client right away.  */
+  unsigned int flush_data_lines : 1;
+
+  /* The current request for the metrics and traces.  */
+  struct metric_request_s request;
+
+  /* Set while the current command holds a network job slot.  */
+  unsigned int netjob_slot : 1;
 };
 
 
+/* The commands which mainly wait for the network.  Only
+ * opt.max_network_jobs of them run at the same time so that they
+ * can't starve the validation commands which are answered from the
+ * caches.  */
+static const char * const network_commands[] =
+  {
+    "DNS_CERT", "WKD_GET", "LOOKUP", "LOADCRL", "KS_SEARCH", "KS_GET",
+    "KS_FETCH", "KS_PUT", "BATCH", "LOADSWDB", NULL
+  };
+
+/* The number of running and of waiting network commands.  */
+static unsigned int netjobs_active;
+static unsigned int netjobs_waiting;
+static npth_mutex_t netjobs_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t netjobs_cond = NPTH_COND_INITIALIZER;
+
+static uint64_t get_netjobs_active (void) { return netjobs_active; }
+static uint64_t get_netjobs_waiting (void) { return netjobs_waiting; }
+METRIC_DEFINE_FUNC (m_netjobs_active, "netjobs_active", get_netjobs_active);
+METRIC_DEFINE_FUNC (m_netjobs_waiting, "netjobs_waiting",
+                    get_netjobs_waiting);
+METRIC_DEFINE_HISTOGRAM (m_netjobs_wait, "netjobs_wait_usec");
+
+
 /* Cookie definition for assuan data line output.  */
 static gpgrt_ssize_t data_line_cookie_write (void *cookie,
                                              const void *buffer, size_t size);
@@ -234,6 +276,10 @@ data_line_write (assuan_context_t ctx, const void *buffer_arg, size_t size)
   else
     {
       err = assuan_send_data (ctx, buffer, size);
+      if (!err && size && buffer[size-1] == '\n'
+          && ctrl && ctrl->server_local
+          && ctrl->server_local->flush_data_lines)
+        err = assuan_send_data (ctx, NULL, 0); /* Flush line. */
       if (err)
         {
           gpg_err_set_errno (EIO);  /* For use by data_line_cookie_write.  */
@@ -642,6 +688,10 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
       int i = *value? atoi (value) : 0;
       ctrl->http_no_crl = !i;
     }
+  else if (!strcmp (key, "trace-id"))
+    {
+      err = metric_request_set_trace_id (&ctrl->server_local->request, value);
+    }
   else
     err = gpg_error (GPG_ERR_UNKNOWN_OPTION);
 
@@ -829,10 +879,12 @@ cmd_dns_cert (assuan_context_t ctx, char *line)
 
 
 
-/* Core of cmd_wkd_get and task_check_wkd_support.  If CTX is NULL
- * this function will not write anything to the assuan output.  */
+/* Core of cmd_wkd_get, cmd_batch and task_check_wkd_support.  If
+ * OUTSTREAM is not NULL the result is written to it; else if CTX is
+ * NULL this function will not write anything to the assuan output.  */
 static gpg_error_t
-proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
+proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, estream_t outstream,
+              char *line)
 {
   gpg_error_t err = 0;
   char *mbox = NULL;
@@ -851,6 +903,10 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
   int no_log = 0;
   char portstr[20] = { 0 };
   int subdomain_mode = 0;
+  char *addrspec = NULL;  /* The mailbox if the WKD cache is used.  */
+  char *source = NULL;
+  void *data = NULL;
+  size_t datalen;
 
   opt_submission_addr = has_option (line, "--submission-address");
   opt_policy_flags = has_option (line, "--policy-flags");
@@ -865,6 +921,16 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
       err = set_error (GPG_ERR_INV_USER_ID, "no mailbox in user id");
       goto leave;
     }
+  if (is_wkd_query && (ctx || outstream)
+      && (opt.wkd_cache_ttl || opt.wkd_cache_negative_ttl))
+    {
+      addrspec = xtrystrdup (mbox);
+      if (!addrspec)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
   *domain++ = 0;
   domain_orig = domain;
 
@@ -881,6 +947,49 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
         }
     }
 
+  /* Check whether we have a cached result for the address.  */
+  if (addrspec)
+    {
+      err = wkd_cache_get (addrspec, &data, &datalen, &source);
+      if (gpg_err_code (err) == GPG_ERR_NO_DATA)
+        {
+          dirmngr_status_printf (ctrl, "NOTE", "wkd_cached_result %u", err);
+          goto leave;
+        }
+      else if (!err)
+        {
+          if (source)
+            {
+              err = dirmngr_status_printf (ctrl, "SOURCE", "%s", source);
+              if (err)
+                goto leave;
+            }
+          if (ctrl->server_local)
+            {
+              ctrl->server_local->inhibit_data_logging = 1;
+              ctrl->server_local->inhibit_data_logging_now = 0;
+              ctrl->server_local->inhibit_data_logging_count = 0;
+            }
+          if (outstream)
+            {
+              if (es_write (outstream, data, datalen, NULL))
+                err = gpg_error_from_syserror ();
+            }
+          else
+            {
+              err = assuan_send_data (ctx, data, datalen);
+              if (!err)
+                err = assuan_send_data (ctx, NULL, 0);
+            }
+          if (ctrl->server_local)
+            ctrl->server_local->inhibit_data_logging = 0;
+          xfree (data);
+          data = NULL;
+          goto leave;
+        }
+      err = 0;
+    }
+
 
   /* First try the new "openpgp" subdomain.  We check that the domain
    * is valid because it is later used as an unescaped filename part
@@ -1036,16 +1145,24 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
       goto leave;
     }
 
-  /* Setup an output stream and perform the get.  */
+  /* Setup an output stream and perform the get.  If the result
+   * shall be cached the key is fetched into a memory stream first.  */
   {
     estream_t outfp;
 
-    outfp = ctx? es_fopencookie (ctx, "w", data_line_cookie_functions) : NULL;
-    if (!outfp && ctx)
+    if (outstream)
+      outfp = outstream;
+    else if (ctx)
+      outfp = es_fopencookie (ctx, "w", data_line_cookie_functions);
+    else
+      outfp = NULL;
+    if (!outfp && ctx && !outstream)
       err = set_error (GPG_ERR_ASS_GENERAL,
                        "error setting up a data stream");
     else
       {
+        estream_t memfp = NULL;
+
         if (ctrl->server_local)
           {
             if (no_log)
@@ -1053,10 +1170,33 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
             ctrl->server_local->inhibit_data_logging_now = 0;
             ctrl->server_local->inhibit_data_logging_count = 0;
           }
-        err = ks_action_fetch (ctrl, uri, outfp);
-        es_fclose (outfp);
+        if (addrspec && opt.wkd_cache_ttl)
+          memfp = es_fopenmem (0, "w+b");
+        err = ks_action_fetch (ctrl, uri, memfp? memfp : outfp);
+        if (memfp)
+          {
+            if (es_fclose_snatch (memfp, &data, &datalen))
+              {
+                if (!err)
+                  err = gpg_error_from_syserror ();
+              }
+            else if (!err)
+              {
+                if (datalen && es_fwrite (data, datalen, 1, outfp) != 1)
+                  err = gpg_error_from_syserror ();
+                else if (datalen)
+                  {
+                    source = strconcat ("https://", domain, portstr, NULL);
+                    wkd_cache_put (addrspec, data, datalen, source);
+                  }
+              }
+          }
+        if (outfp != outstream)
+          es_fclose (outfp);
         if (ctrl->server_local)
           ctrl->server_local->inhibit_data_logging = 0;
+        if (addrspec && gpg_err_code (err) == GPG_ERR_NO_DATA)
+          wkd_cache_put (addrspec, NULL, 0, NULL);
 
         /* Register the result under the domain name of MBOX. */
         switch (gpg_err_code (err))
@@ -1094,6 +1234,9 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
   xfree (encodedhash);
   xfree (mbox);
   xfree (domainbuf);
+  xfree (addrspec);
+  xfree (source);
+  es_free (data);
   return err;
 }
 
@@ -1109,7 +1252,7 @@ cmd_wkd_get (assuan_context_t ctx, char *line)
   ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err;
 
-  err = proc_wkd_get (ctrl, ctx, line);
+  err = proc_wkd_get (ctrl, ctx, NULL, line);
 
   return leave_cmd (ctx, err);
 }
@@ -1130,7 +1273,7 @@ task_check_wkd_support (ctrl_t ctrl, const char *domain)
     log_error ("%s: %s\n", __func__, gpg_strerror (gpg_error_from_syserror ()));
   else
     {
-      proc_wkd_get (ctrl, NULL, string);
+      proc_wkd_get (ctrl, NULL, NULL, string);
       xfree (string);
     }
 
@@ -2384,15 +2527,21 @@ cmd_ks_search (assuan_context_t ctx, char *line)
   if (err)
     goto leave;
 
-  /* Setup an output stream and perform the search.  */
+  /* Setup an output stream and perform the search.  The stream is
+   * line buffered and each line is sent right away so that the
+   * client can show the first results while the rest is still being
+   * received from the keyserver.  */
   outfp = es_fopencookie (ctx, "w", data_line_cookie_functions);
   if (!outfp)
     err = set_error (GPG_ERR_ASS_GENERAL, "error setting up a data stream");
   else
     {
+      es_setvbuf (outfp, NULL, _IOLBF, 0);
+      ctrl->server_local->flush_data_lines = 1;
       err = ks_action_search (ctrl, ctrl->server_local->keyservers,
 			      list, outfp);
       es_fclose (outfp);
+      ctrl->server_local->flush_data_lines = 0;
     }
 
  leave:
@@ -2403,11 +2552,12 @@ cmd_ks_search (assuan_context_t ctx, char *line)
 
 
 static const char hlp_ks_get[] =
-  "KS_GET {<pattern>}\n"
+  "KS_GET [--quick] [--parallel] {<pattern>}\n"
   "\n"
   "Get the keys matching PATTERN from the configured OpenPGP keyservers\n"
   "(see command KEYSERVER).  Each pattern should be a keyid, a fingerprint,\n"
-  "or an exact name indicated by the '=' prefix.";
+  "or an exact name indicated by the '=' prefix.  With --parallel the\n"
+  "keys are fetched in parallel from HKP keyservers.";
 static gpg_error_t
 cmd_ks_get (assuan_context_t ctx, char *line)
 {
@@ -2416,9 +2566,11 @@ cmd_ks_get (assuan_context_t ctx, char *line)
   strlist_t list, sl;
   char *p;
   estream_t outfp;
+  int parallel;
 
   if (has_option (line, "--quick"))
     ctrl->timeout = opt.connect_quick_timeout;
+  parallel = has_option (line, "--parallel");
   line = skip_options (line);
 
   /* Break the line into a strlist.  Each pattern is by
@@ -2460,7 +2612,8 @@ cmd_ks_get (assuan_context_t ctx, char *line)
       ctrl->server_local->inhibit_data_logging = 1;
       ctrl->server_local->inhibit_data_logging_now = 0;
       ctrl->server_local->inhibit_data_logging_count = 0;
-      err = ks_action_get (ctrl, ctrl->server_local->keyservers, list, outfp);
+      err = ks_action_get (ctrl, ctrl->server_local->keyservers, list,
+                           parallel, outfp);
       es_fclose (outfp);
       ctrl->server_local->inhibit_data_logging = 0;
     }
@@ -2509,9 +2662,359 @@ cmd_ks_fetch (assuan_context_t ctx, char *line)
 }
 
 
+
+/* A request of the BATCH command.  */
+struct batch_job_s
+{
+  struct batch_job_s *next;
+  struct batch_s *batch;         /* The batch this job belongs to.  */
+  struct server_control_s ctrl;  /* A private control object.  */
+  uri_item_t keyservers;         /* The keyservers used for KS_GET.  */
+  char *buffer;                  /* Allocated buffer for TAG and LINE.  */
+  char *tag;                     /* The tag assigned by the client.  */
+  char *line;                    /* The arguments of the request.  */
+  int is_wkd;                    /* This is a WKD_GET request.  */
+  npth_t thread;
+  int threaded;                  /* The job runs in its own thread.  */
+  int active;                    /* CTRL has been initialized.  */
+  int done;                      /* The request has been processed.  */
+  estream_t fp;                  /* The result in a memory stream.  */
+  gpg_error_t err;
+};
+
+/* The synchronization object of the BATCH command.  */
+struct batch_s
+{
+  npth_mutex_t lock;
+  npth_cond_t cond;  /* Signaled when a job is done.  */
+};
+
+
+/* Parse one request line of the BATCH command given by S and N and
+ * append it to the list at R_JOBS.  */
+static gpg_error_t
+parse_batch_request (const char *s, size_t n, struct batch_job_s **r_jobs)
+{
+  struct batch_job_s *job, *j;
+  char *p;
+
+  job = xtrycalloc (1, sizeof *job);
+  if (!job)
+    return gpg_error_from_syserror ();
+  job->buffer = xtrymalloc (n + 1);
+  if (!job->buffer)
+    {
+      xfree (job);
+      return gpg_error_from_syserror ();
+    }
+  memcpy (job->buffer, s, n);
+  job->buffer[n] = 0;
+
+  job->tag = job->buffer;
+  p = strchr (job->tag, ' ');
+  if (!p || p == job->tag || p - job->tag > 64)
+    goto inv_request;
+  *p++ = 0;
+  for (j = *r_jobs; j; j = j->next)
+    if (!strcmp (j->tag, job->tag))
+      goto inv_request;
+  while (spacep (p))
+    p++;
+  if (!strncmp (p, "KS_GET ", 7))
+    {
+      job->line = p + 7;
+      trim_spaces (job->line);
+      if (!*job->line || strchr (job->line, ' '))
+        goto inv_request;
+    }
+  else if (!strncmp (p, "WKD_GET ", 8))
+    {
+      job->line = p + 8;
+      job->is_wkd = 1;
+    }
+  else
+    goto inv_request;
+
+  while (*r_jobs)
+    r_jobs = &(*r_jobs)->next;
+  *r_jobs = job;
+  return 0;
+
+ inv_request:
+  log_info ("invalid BATCH request '%s'\n", job->buffer);
+  xfree (job->buffer);
+  xfree (job);
+  return gpg_error (GPG_ERR_INV_REQUEST);
+}
+
+
+/* The thread function to process a request of the BATCH command.  */
+static void *
+batch_job_thread (void *arg)
+{
+  struct batch_job_s *job = arg;
+  strlist_t sl;
+
+  job->fp = es_fopenmem (0, "w+b");
+  if (!job->fp)
+    job->err = gpg_error_from_syserror ();
+  else if (job->is_wkd)
+    job->err = proc_wkd_get (&job->ctrl, NULL, job->fp, job->line);
+  else if (!(sl = xtrymalloc (sizeof *sl + strlen (job->line))))
+    job->err = gpg_error_from_syserror ();
+  else
+    {
+      sl->next = NULL;
+      sl->flags = 0;
+      strcpy_escaped_plus (sl->d, job->line);
+      job->err = ks_action_get (&job->ctrl, job->keyservers, sl, 0, job->fp);
+      free_strlist (sl);
+    }
+
+  npth_mutex_lock (&job->batch->lock);
+  job->done = 1;
+  npth_cond_signal (&job->batch->cond);
+  npth_mutex_unlock (&job->batch->lock);
+  return NULL;
+}
+
+
+/* Send the result of JOB to the client.  */
+static gpg_error_t
+send_batch_result (assuan_context_t ctx, struct batch_job_s *job)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  estream_t outfp;
+
+  err = dirmngr_status (ctrl, "BATCH_BEGIN", job->tag, NULL);
+  if (err)
+    return err;
+
+  if (!job->err)
+    {
+      outfp = es_fopencookie (ctx, "w", data_line_cookie_functions);
+      if (!outfp)
+        return set_error (GPG_ERR_ASS_GENERAL,
+                          "error setting up a data stream");
+      ctrl->server_local->inhibit_data_logging = 1;
+      ctrl->server_local->inhibit_data_logging_now = 0;
+      ctrl->server_local->inhibit_data_logging_count = 0;
+      es_rewind (job->fp);
+      err = copy_stream (job->fp, outfp);
+      if (es_fclose (outfp) && !err)
+        err = gpg_error_from_syserror ();
+      ctrl->server_local->inhibit_data_logging = 0;
+      if (err)
+        return err;
+    }
+
+  return dirmngr_status_printf (ctrl, "BATCH_END", "%s %u",
+                                job->tag, job->err);
+}
+
+
+static const char hlp_batch[] =
+  "BATCH [--quick] [--deadline=SECONDS]\n"
+  "\n"
+  "Process several requests at once.  The requests are inquired\n"
+  "using the keyword REQUESTS; each line has one of the forms\n"
+  "\n"
+  "  <tag> KS_GET <pattern>\n"
+  "  <tag> WKD_GET [--submission-address|--policy-flags] <user_id>\n"
+  "\n"
+  "where <tag> is a unique string without spaces chosen by the client.\n"
+  "Up to 8 requests are processed concurrently and the results are\n"
+  "returned in the order the requests complete.  Each result is\n"
+  "returned as the status line\n"
+  "\n"
+  "  BATCH_BEGIN <tag>\n"
+  "\n"
+  "followed by the data lines and the status line\n"
+  "\n"
+  "  BATCH_END <tag> <error_code>\n"
+  "\n"
+  "--quick uses a shorter timeout for all requests.  With --deadline\n"
+  "no request is started after SECONDS have passed; those requests\n"
+  "fail with a timeout error and the timeout of the other requests\n"
+  "is limited to the remaining time.  The command itself fails only\n"
+  "if the requests could not be processed.";
+static gpg_error_t
+cmd_batch (assuan_context_t ctx, char *line)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  const char *s, *lf;
+  size_t n, len;
+  struct batch_s batch;
+  struct batch_job_s *jobs = NULL;
+  struct batch_job_s *job, *next_job;
+  npth_attr_t tattr;
+  unsigned int njobs, nrunning;
+  int quick;
+  time_t deadline, now;
+  const char *optval;
+  int rc;
+
+  quick = has_option (line, "--quick");
+  optval = option_value (line, "--deadline");
+  deadline = optval? time (NULL) + atoi (optval) : 0;
+  line = skip_options (line);
+  if (*line)
+    {
+      err = PARM_ERROR ("too many arguments");
+      goto leave;
+    }
+
+  err = assuan_inquire (ctx, "REQUESTS", &value, &valuelen,
+                        MAX_BATCH_REQUESTS * 1024);
+  if (err)
+    goto leave;
+
+  /* Parse the requests.  */
+  njobs = 0;
+  for (s = (const char *)value; valuelen; s = lf, valuelen -= n)
+    {
+      lf = memchr (s, '\n', valuelen);
+      lf = lf? lf + 1 : s + valuelen;
+      n = lf - s;
+      len = n;
+      if (len && s[len-1] == '\n')
+        len--;
+      if (len && s[len-1] == '\r')
+        len--;
+      if (!len)
+        continue;  /* Skip empty lines.  */
+      if (++njobs > MAX_BATCH_REQUESTS)
+        {
+          err = set_error (GPG_ERR_TOO_MANY, "too many requests");
+          goto leave;
+        }
+      err = parse_batch_request (s, len, &jobs);
+      if (gpg_err_code (err) == GPG_ERR_INV_REQUEST)
+        err = set_error (GPG_ERR_INV_REQUEST, "invalid request");
+      if (err)
+        goto leave;
+    }
+
+  for (job = jobs; job; job = job->next)
+    if (!job->is_wkd)
+      {
+        err = ensure_keyserver (ctrl);
+        if (err)
+          goto leave;
+        break;
+      }
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  npth_mutex_init (&batch.lock, NULL);
+  npth_cond_init (&batch.cond, NULL);
+
+  /* Run the jobs and send their results as soon as they are done.
+   * After an error sending a result we wait for the running jobs
+   * but do not start new ones.  */
+  nrunning = 0;
+  next_job = jobs;
+  for (;;)
+    {
+      while (!err && next_job && nrunning < MAX_BATCH_JOBS)
+        {
+          job = next_job;
+          next_job = job->next;
+
+          job->batch = &batch;
+          job->keyservers = ctrl->server_local->keyservers;
+          dirmngr_init_default_ctrl (&job->ctrl);
+          job->active = 1;
+          job->ctrl.timeout = quick? opt.connect_quick_timeout : ctrl->timeout;
+          if (deadline)
+            {
+              now = time (NULL);
+              if (now >= deadline)
+                {
+                  job->err = gpg_error (GPG_ERR_TIMEOUT);
+                  job->done = 1;
+                  nrunning++;
+                  continue;
+                }
+              if ((deadline - now) * 1000 < job->ctrl.timeout)
+                job->ctrl.timeout = (deadline - now) * 1000;
+            }
+          job->ctrl.http_no_crl = ctrl->http_no_crl;
+          xfree (job->ctrl.http_proxy);
+          job->ctrl.http_proxy = NULL;
+          if (ctrl->http_proxy
+              && !(job->ctrl.http_proxy = xtrystrdup (ctrl->http_proxy)))
+            {
+              job->err = gpg_error_from_syserror ();
+              job->done = 1;
+            }
+          else
+            {
+              rc = npth_create (&job->thread, &tattr, batch_job_thread, job);
+              if (rc)
+                batch_job_thread (job);  /* Do it in this thread.  */
+              else
+                job->threaded = 1;
+            }
+          nrunning++;
+        }
+      if (!nrunning)
+        break;
+
+      /* Wait for the next finished job.  */
+      npth_mutex_lock (&batch.lock);
+      for (;;)
+        {
+          for (job = jobs; job; job = job->next)
+            if (job->active && job->done)
+              break;
+          if (job)
+            break;
+          npth_cond_wait (&batch.cond, &batch.lock);
+        }
+      npth_mutex_unlock (&batch.lock);
+
+      if (job->threaded)
+        npth_join (job->thread, NULL);
+      job->threaded = 0;
+      nrunning--;
+      if (!err)
+        err = send_batch_result (ctx, job);
+      es_fclose (job->fp);
+      job->fp = NULL;
+      dirmngr_deinit_default_ctrl (&job->ctrl);
+      job->active = 0;
+      dirmngr_tick (ctrl);
+    }
+
+  npth_cond_destroy (&batch.cond);
+  npth_mutex_destroy (&batch.lock);
+  npth_attr_destroy (&tattr);
+
+ leave:
+  while ((job = jobs))
+    {
+      jobs = job->next;
+      xfree (job->buffer);
+      xfree (job);
+    }
+  xfree (value);
+  return leave_cmd (ctx, err);
+}
+
+
 
 static const char hlp_ks_put[] =
-  "KS_PUT\n"
+  "KS_PUT [--multi]\n"
   "\n"
   "Send a key to the configured OpenPGP keyservers.  The actual key material\n"
   "is then requested by Dirmngr using\n"
@@ -2526,7 +3029,12 @@ static const char hlp_ks_put[] =
   "  INQUIRE KEYBLOCK_INFO\n"
   "\n"
   "The client shall respond with a colon delimited info lines (the output\n"
-  "of 'for x in keys sigs; do gpg --list-$x --with-colons KEYID; done').\n";
+  "of 'for x in keys sigs; do gpg --list-$x --with-colons KEYID; done').\n"
+  "\n"
+  "With option --multi the keyblock may consist of several concatenated\n"
+  "keys which are sent to the keyservers using a single request.  No\n"
+  "KEYBLOCK_INFO is requested in this case and the command fails with\n"
+  "GPG_ERR_NOT_SUPPORTED if a configured keyserver is not an HKP server.\n";
 static gpg_error_t
 cmd_ks_put (assuan_context_t ctx, char *line)
 {
@@ -2535,15 +3043,28 @@ cmd_ks_put (assuan_context_t ctx, char *line)
   unsigned char *value = NULL;
   size_t valuelen;
   unsigned char *info = NULL;
-  size_t infolen;
+  size_t infolen = 0;
+  int opt_multi;
+  uri_item_t uri;
 
-  /* No options for now.  */
+  opt_multi = has_option (line, "--multi");
   line = skip_options (line);
 
   err = ensure_keyserver (ctrl);
   if (err)
     goto leave;
 
+  /* Only HKP servers take several keys with one request; LDAP
+   * servers need the meta data of each key.  */
+  if (opt_multi)
+    for (uri = ctrl->server_local->keyservers; uri; uri = uri->next)
+      if (!uri->parsed_uri->is_http)
+        {
+          err = set_error (GPG_ERR_NOT_SUPPORTED,
+                           "option --multi requires HKP keyservers");
+          goto leave;
+        }
+
   /* Ask for the key material.  */
   err = assuan_inquire (ctx, "KEYBLOCK",
                         &value, &valuelen, MAX_KEYBLOCK_LENGTH);
@@ -2561,12 +3082,15 @@ cmd_ks_put (assuan_context_t ctx, char *line)
 
   /* Ask for the key meta data. Not actually needed for HKP servers
      but we do it anyway to test the client implementation.  */
-  err = assuan_inquire (ctx, "KEYBLOCK_INFO",
-                        &info, &infolen, MAX_KEYBLOCK_LENGTH);
-  if (err)
+  if (!opt_multi)
     {
-      log_error (_("assuan_inquire failed: %s\n"), gpg_strerror (err));
-      goto leave;
+      err = assuan_inquire (ctx, "KEYBLOCK_INFO",
+                            &info, &infolen, MAX_KEYBLOCK_LENGTH);
+      if (err)
+        {
+          log_error (_("assuan_inquire failed: %s\n"), gpg_strerror (err));
+          goto leave;
+        }
     }
 
   /* Send the key.  */
@@ -2608,10 +3132,15 @@ static const char hlp_getinfo[] =
   "pid         - Return the process id of the server.\n"
   "tor         - Return OK if running in Tor mode\n"
   "dnsinfo     - Return info about the DNS resolver\n"
+  "dnscache    - Return the number of entries, hits, negative hits,\n"
+  "              and misses of the DNS cache\n"
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
   "workqueue   - Inspect the work queue\n"
-  "getenv NAME - Return value of envvar NAME\n";
+  "metrics     - Return the performance counters\n"
+  "getenv NAME - Return value of envvar NAME\n"
+  "cmd_has_option CMD OPT\n"
+  "            - Returns OK if command CMD has option OPT.\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
@@ -2674,11 +3203,55 @@ cmd_getinfo (assuan_context_t ctx, char *line)
         }
       err = 0;
     }
+  else if (!strcmp (line, "dnscache"))
+    {
+      unsigned int entries;
+      unsigned long hits, neg_hits, misses;
+      char buf[100];
+
+      get_dns_cache_stats (&entries, &hits, &neg_hits, &misses);
+      snprintf (buf, sizeof buf, "%u %lu %lu %lu",
+                entries, hits, neg_hits, misses);
+      err = assuan_send_data (ctx, buf, strlen (buf));
+    }
   else if (!strcmp (line, "workqueue"))
     {
       workqueue_dump_queue (ctrl);
       err = 0;
     }
+  else if (!strcmp (line, "metrics"))
+    {
+      char *s = metrics_format ();
+
+      if (!s)
+        err = gpg_error_from_syserror ();
+      else
+        err = assuan_send_data (ctx, s, strlen (s));
+      xfree (s);
+    }
+  else if (!strncmp (line, "cmd_has_option", 14)
+           && (line[14] == ' ' || line[14] == '\t' || !line[14]))
+    {
+      char *cmd, *cmdopt;
+
+      line += 14;
+      while (*line == ' ' || *line == '\t')
+        line++;
+      cmd = line;
+      while (*line && *line != ' ' && *line != '\t')
+        line++;
+      if (*line)
+        *line++ = 0;
+      while (*line == ' ' || *line == '\t')
+        line++;
+      cmdopt = line;
+      if (!*cmd || !*cmdopt)
+        err = gpg_error (GPG_ERR_MISSING_VALUE);
+      else if (!strcmp (cmd, "KS_PUT") && !strcmp (cmdopt, "multi"))
+        err = 0;
+      else
+        err = gpg_error (GPG_ERR_FALSE);
+    }
   else if (!strncmp (line, "getenv", 6)
            && (line[6] == ' ' || line[6] == '\t' || !line[6]))
     {
@@ -2741,18 +3314,115 @@ cmd_reloaddirmngr (assuan_context_t ctx, char *line)
 static const char hlp_flushcrls[] =
   "FLUSHCRLS\n"
   "\n"
-  "Remove all cached CRLs from memory and\n"
+  "Remove all cached CRLs and OCSP responses from memory and\n"
   "the file system.";
 static gpg_error_t
 cmd_flushcrls (assuan_context_t ctx, char *line)
 {
   (void)line;
 
+  ocsp_cache_deinit (1);
   return leave_cmd (ctx, crl_cache_flush () ? GPG_ERR_GENERAL : 0);
 }
 
 
+/* Wait until a network job slot is available if CMD is one of the
+ * network commands.  */
+static void
+acquire_netjob_slot (ctrl_t ctrl, const char *cmd)
+{
+  int i, res;
+  uint64_t start;
+
+  for (i=0; network_commands[i]; i++)
+    if (!strcmp (cmd, network_commands[i]))
+      break;
+  if (!network_commands[i])
+    return;
+
+  res = npth_mutex_lock (&netjobs_lock);
+  if (res)
+    log_fatal ("failed to acquire netjobs mutex: %s\n", strerror (res));
+  if (opt.max_network_jobs && netjobs_active >= opt.max_network_jobs)
+    {
+      start = metric_usec ();
+      netjobs_waiting++;
+      while (opt.max_network_jobs && netjobs_active >= opt.max_network_jobs)
+        npth_cond_wait (&netjobs_cond, &netjobs_lock);
+      netjobs_waiting--;
+      metric_observe (&m_netjobs_wait, metric_usec () - start);
+    }
+  else
+    metric_observe (&m_netjobs_wait, 0);
+  netjobs_active++;
+  ctrl->server_local->netjob_slot = 1;
+  npth_mutex_unlock (&netjobs_lock);
+}
+
+
+/* Release the network job slot of the current command.  */
+static void
+release_netjob_slot (ctrl_t ctrl)
+{
+  int res;
+
+  if (!ctrl->server_local->netjob_slot)
+    return;
+
+  res = npth_mutex_lock (&netjobs_lock);
+  if (res)
+    log_fatal ("failed to acquire netjobs mutex: %s\n", strerror (res));
+  netjobs_active--;
+  ctrl->server_local->netjob_slot = 0;
+  npth_cond_signal (&netjobs_cond);
+  npth_mutex_unlock (&netjobs_lock);
+}
+
+
 
+/* Called by libassuan before all commands.  */
+static gpg_error_t
+pre_cmd_notify (assuan_context_t ctx, const char *cmd)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  metric_request_begin (&ctrl->server_local->request, cmd);
+  acquire_netjob_slot (ctrl, cmd);
+  return 0;
+}
+
+
+/* Called by libassuan after all commands.  */
+static void
+post_cmd_notify (assuan_context_t ctx, gpg_error_t err)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  release_netjob_slot (ctrl);
+  metric_request_end (&ctrl->server_local->request, err);
+}
+
+
+/* The DNS cache keeps its own counters.  */
+static uint64_t
+dnscache_stat (int what)
+{
+  unsigned int entries;
+  unsigned long hits, neg_hits, misses;
+
+  get_dns_cache_stats (&entries, &hits, &neg_hits, &misses);
+  return what == 0? hits : what == 1? neg_hits : misses;
+}
+static uint64_t dnscache_hits (void) { return dnscache_stat (0); }
+static uint64_t dnscache_neg_hits (void) { return dnscache_stat (1); }
+static uint64_t dnscache_misses (void) { return dnscache_stat (2); }
+METRIC_DEFINE_COUNTER_FUNC (m_dnscache_hits, "dnscache_hits", dnscache_hits);
+METRIC_DEFINE_COUNTER_FUNC (m_dnscache_neg_hits, "dnscache_neg_hits",
+                            dnscache_neg_hits);
+METRIC_DEFINE_COUNTER_FUNC (m_dnscache_misses, "dnscache_misses",
+                            dnscache_misses);
+
+
 /* Tell the assuan library about our commands. */
 static int
 register_commands (assuan_context_t ctx)
@@ -2777,6 +3447,7 @@ register_commands (assuan_context_t ctx)
     { "KS_SEARCH",  cmd_ks_search,  hlp_ks_search },
     { "KS_GET",     cmd_ks_get,     hlp_ks_get },
     { "KS_FETCH",   cmd_ks_fetch,   hlp_ks_fetch },
+    { "BATCH",      cmd_batch,      hlp_batch },
     { "KS_PUT",     cmd_ks_put,     hlp_ks_put },
     { "GETINFO",    cmd_getinfo,    hlp_getinfo },
     { "LOADSWDB",   cmd_loadswdb,   hlp_loadswdb },
@@ -2794,6 +3465,14 @@ register_commands (assuan_context_t ctx)
       if (rc)
         return rc;
     }
+  assuan_register_pre_cmd_notify (ctx, pre_cmd_notify);
+  assuan_register_post_cmd_notify (ctx, post_cmd_notify);
+  metric_register (&m_dnscache_hits);
+  metric_register (&m_dnscache_neg_hits);
+  metric_register (&m_dnscache_misses);
+  metric_register (&m_netjobs_active);
+  metric_register (&m_netjobs_waiting);
+  metric_register (&m_netjobs_wait);
   return 0;
 }
 
@@ -2960,6 +3639,7 @@ start_command_handler (assuan_fd_t fd, unsigned int session_id)
   ctrl->server_local->ldapservers = NULL;
 
   release_ctrl_keyservers (ctrl);
+  release_netjob_slot (ctrl);
 
   ctrl->server_local->assuan_ctx = NULL;
   assuan_release (ctx);
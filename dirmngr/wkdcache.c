@@ -0,0 +1,446 @@
+/* wkdcache.c - Cache for the results of WKD lookups
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The domaininfo module remembers whether a domain supports WKD at
+ * all.  This module caches the result of the WKD key lookup for a
+ * mail address: either the key data or the fact that no key was
+ * found.  Found keys are kept for opt.wkd_cache_ttl seconds and
+ * not-found results for opt.wkd_cache_negative_ttl seconds; a TTL of
+ * 0 disables the respective kind of entries.  The entries are also
+ * appended to the file WKD_CACHE_FILE in the cache directory so that
+ * they survive a restart; the file is read on first use and
+ * compacted if it mainly holds expired entries.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirmngr.h"
+
+
+#define WKD_CACHE_FILE    "wkd-cache.txt"
+#define WKD_CACHE_VERSION 1
+#define WKD_CACHE_BUCKETS 103
+#define WKD_CACHE_MAX     1024
+
+/* Keys larger than this are not cached.  */
+#define WKD_CACHE_MAX_KEYSIZE (64*1024)
+
+
+struct wkd_cache_item_s
+{
+  struct wkd_cache_item_s *next;
+  time_t expires;        /* Do not use the entry after this time.  */
+  char *source;          /* The SOURCE status of the lookup or NULL.  */
+  unsigned char *data;   /* The key data or NULL for not-found.  */
+  size_t datalen;
+  char addrspec[1];
+};
+typedef struct wkd_cache_item_s *wkd_cache_item_t;
+
+static struct
+{
+  int loaded;          /* The file has been read.  */
+  unsigned int count;  /* Number of entries.  */
+  wkd_cache_item_t buckets[WKD_CACHE_BUCKETS];
+} wkd_cache;
+
+
+static unsigned int
+wkd_cache_hash (const char *addrspec)
+{
+  unsigned int h = 0;
+
+  for (; *addrspec; addrspec++)
+    h = h * 31 + *(const unsigned char *)addrspec;
+  return h % WKD_CACHE_BUCKETS;
+}
+
+
+static void
+wkd_cache_release_item (wkd_cache_item_t item)
+{
+  if (item)
+    {
+      xfree (item->source);
+      xfree (item->data);
+      xfree (item);
+    }
+}
+
+
+/* Return a new item for ADDRSPEC or NULL on error.  */
+static wkd_cache_item_t
+wkd_cache_new_item (const char *addrspec, time_t expires, const char *source,
+                    const void *data, size_t datalen)
+{
+  wkd_cache_item_t item;
+
+  item = xtrycalloc (1, sizeof *item + strlen (addrspec));
+  if (!item)
+    return NULL;
+  strcpy (item->addrspec, addrspec);
+  item->expires = expires;
+  if (source && *source && !(item->source = xtrystrdup (source)))
+    goto fail;
+  if (data)
+    {
+      item->data = xtrymalloc (datalen? datalen : 1);
+      if (!item->data)
+        goto fail;
+      memcpy (item->data, data, datalen);
+      item->datalen = datalen;
+    }
+  return item;
+
+ fail:
+  wkd_cache_release_item (item);
+  return NULL;
+}
+
+
+/* Remove all entries expired at NOW.  If NOW is 0 all entries are
+ * removed.  */
+static void
+wkd_cache_purge (time_t now)
+{
+  wkd_cache_item_t item, *itemp;
+  int i;
+
+  for (i=0; i < WKD_CACHE_BUCKETS; i++)
+    for (itemp = &wkd_cache.buckets[i]; (item = *itemp); )
+      if (!now || item->expires <= now)
+        {
+          *itemp = item->next;
+          wkd_cache_release_item (item);
+          wkd_cache.count--;
+        }
+      else
+        itemp = &item->next;
+}
+
+
+/* Insert ITEM into the cache replacing an existing entry.  */
+static void
+wkd_cache_insert (wkd_cache_item_t item)
+{
+  wkd_cache_item_t old, *itemp;
+  unsigned int h = wkd_cache_hash (item->addrspec);
+
+  for (itemp = &wkd_cache.buckets[h]; (old = *itemp); itemp = &old->next)
+    if (!strcmp (old->addrspec, item->addrspec))
+      {
+        *itemp = old->next;
+        wkd_cache_release_item (old);
+        wkd_cache.count--;
+        break;
+      }
+  item->next = wkd_cache.buckets[h];
+  wkd_cache.buckets[h] = item;
+  wkd_cache.count++;
+}
+
+
+/* Write ITEM to FP.  The address and the source are percent escaped
+ * and the key data is hex encoded.  */
+static void
+wkd_cache_write_item (estream_t fp, wkd_cache_item_t item)
+{
+  char *addrspec, *source, *hexdata;
+
+  addrspec = try_percent_escape (item->addrspec, NULL);
+  source = try_percent_escape (item->source? item->source : "", NULL);
+  hexdata = bin2hex (item->data? item->data : (unsigned char *)"",
+                     item->datalen, NULL);
+  if (addrspec && source && hexdata)
+    es_fprintf (fp, "%c:%lu:%s:%s:%s:\n",
+                item->data? 'k':'n', (unsigned long)item->expires,
+                addrspec, source, hexdata);
+  xfree (addrspec);
+  xfree (source);
+  xfree (hexdata);
+}
+
+
+/* Parse the cache file LINE and return a new item or NULL.  */
+static wkd_cache_item_t
+wkd_cache_parse_line (char *line)
+{
+  wkd_cache_item_t item;
+  char *fields[5];
+  size_t datalen;
+  void *data = NULL;
+
+  if (split_fields_colon (line, fields, DIM (fields)) < DIM (fields))
+    return NULL;
+  if ((strcmp (fields[0], "k") && strcmp (fields[0], "n"))
+      || !*fields[2] || (strlen (fields[4]) % 2))
+    return NULL;
+  percent_unescape_inplace (fields[2], 0);
+  percent_unescape_inplace (fields[3], 0);
+
+  datalen = strlen (fields[4]) / 2;
+  if (*fields[0] == 'k')
+    {
+      data = xtrymalloc (datalen? datalen : 1);
+      if (!data)
+        return NULL;
+      if (hex2bin (fields[4], data, datalen) < 0)
+        {
+          xfree (data);
+          return NULL;
+        }
+    }
+  item = wkd_cache_new_item (fields[2], (time_t)strtoul (fields[1], NULL, 10),
+                             fields[3], data, datalen);
+  xfree (data);
+  return item;
+}
+
+
+/* Write all entries of the cache to the cache file.  */
+static void
+wkd_cache_rewrite (const char *fname)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  estream_t fp;
+  wkd_cache_item_t item;
+  int i;
+
+  tmpfname = xtryasprintf ("%s.%lu.tmp", fname, (unsigned long)getpid ());
+  if (!tmpfname)
+    return;
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    {
+      log_error (_("error creating '%s': %s\n"), tmpfname, strerror (errno));
+      xfree (tmpfname);
+      return;
+    }
+  es_fprintf (fp, "# WKD result cache - do not edit\nv:%d:\n",
+              WKD_CACHE_VERSION);
+  for (i=0; i < WKD_CACHE_BUCKETS; i++)
+    for (item = wkd_cache.buckets[i]; item; item = item->next)
+      wkd_cache_write_item (fp, item);
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error writing '%s': %s\n"), tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+  else if ((err = gnupg_rename_file (tmpfname, fname, NULL)))
+    {
+      log_error (_("error renaming '%s' to '%s': %s\n"),
+                 tmpfname, fname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+  xfree (tmpfname);
+}
+
+
+/* Read the cache file.  This is done on first use.  */
+static void
+wkd_cache_load (void)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t linesize = 0;
+  size_t maxlen;
+  ssize_t len;
+  time_t now;
+  wkd_cache_item_t item;
+  int version_okay = 0;
+  unsigned int nexpired = 0;
+
+  wkd_cache.loaded = 1;
+  now = gnupg_get_time ();
+
+  fname = make_filename (opt.homedir_cache, WKD_CACHE_FILE, NULL);
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_error (_("error opening '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+
+  for (;;)
+    {
+      maxlen = 2 * WKD_CACHE_MAX_KEYSIZE + 1024;
+      len = es_read_line (fp, &line, &linesize, &maxlen);
+      if (len <= 0)
+        break;
+      if (!maxlen)
+        break;  /* Line too long; the file is corrupt.  */
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+      if (!*line || *line == '#')
+        continue;
+      if (!version_okay)
+        {
+          if (strncmp (line, "v:", 2) || atoi (line+2) != WKD_CACHE_VERSION)
+            break;  /* Unknown version; rewrite the file.  */
+          version_okay = 1;
+          continue;
+        }
+      item = wkd_cache_parse_line (line);
+      if (!item)
+        continue;
+      if (item->expires <= now || wkd_cache.count >= WKD_CACHE_MAX)
+        {
+          nexpired++;
+          wkd_cache_release_item (item);
+          continue;
+        }
+      wkd_cache_insert (item);
+    }
+  es_fclose (fp);
+  es_free (line);
+
+  if (opt.verbose)
+    log_info ("loaded %u cached WKD results (%u expired)\n",
+              wkd_cache.count, nexpired);
+  if (!version_okay || nexpired > wkd_cache.count)
+    wkd_cache_rewrite (fname);
+  xfree (fname);
+}
+
+
+/* Look up the cached WKD result for the mail address ADDRSPEC.
+ * Returns GPG_ERR_NOT_FOUND if nothing is cached and GPG_ERR_NO_DATA
+ * if it is known that there is no key.  On success the key is stored
+ * as a malloced buffer at R_DATA and R_DATALEN and the SOURCE status
+ * of the original lookup or NULL as a malloced string at R_SOURCE.  */
+gpg_error_t
+wkd_cache_get (const char *addrspec, void **r_data, size_t *r_datalen,
+               char **r_source)
+{
+  wkd_cache_item_t item;
+
+  *r_data = NULL;
+  *r_datalen = 0;
+  *r_source = NULL;
+
+  if (!opt.wkd_cache_ttl && !opt.wkd_cache_negative_ttl)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  if (!wkd_cache.loaded)
+    wkd_cache_load ();
+
+  for (item = wkd_cache.buckets[wkd_cache_hash (addrspec)];
+       item; item = item->next)
+    if (!strcmp (item->addrspec, addrspec))
+      break;
+  if (!item || item->expires <= gnupg_get_time ())
+    return gpg_error (GPG_ERR_NOT_FOUND);
+
+  if (!item->data)
+    return gpg_error (GPG_ERR_NO_DATA);
+
+  *r_data = xtrymalloc (item->datalen? item->datalen : 1);
+  if (!*r_data)
+    return gpg_error_from_syserror ();
+  memcpy (*r_data, item->data, item->datalen);
+  *r_datalen = item->datalen;
+  if (item->source && !(*r_source = xtrystrdup (item->source)))
+    {
+      gpg_error_t err = gpg_error_from_syserror ();
+      xfree (*r_data);
+      *r_data = NULL;
+      return err;
+    }
+  return 0;
+}
+
+
+/* Store the result of a WKD lookup for the mail address ADDRSPEC.
+ * DATA and DATALEN is the key; if DATA is NULL no key has been
+ * found.  SOURCE is the value of the SOURCE status line or NULL.  */
+void
+wkd_cache_put (const char *addrspec, const void *data, size_t datalen,
+               const char *source)
+{
+  wkd_cache_item_t item;
+  unsigned int ttl;
+  time_t now;
+  char *fname;
+  estream_t fp;
+
+  ttl = data? opt.wkd_cache_ttl : opt.wkd_cache_negative_ttl;
+  if (!ttl || datalen > WKD_CACHE_MAX_KEYSIZE)
+    return;
+
+  now = gnupg_get_time ();
+  item = wkd_cache_new_item (addrspec, now + ttl, source, data, datalen);
+  if (!item)
+    return;
+
+  if (!wkd_cache.loaded)
+    wkd_cache_load ();
+  if (wkd_cache.count >= WKD_CACHE_MAX)
+    wkd_cache_purge (now);
+  if (wkd_cache.count >= WKD_CACHE_MAX)
+    {
+      wkd_cache_release_item (item);
+      return;
+    }
+  wkd_cache_insert (item);
+
+  /* Append the entry to the file.  A new file gets the version line
+   * first.  */
+  fname = make_filename (opt.homedir_cache, WKD_CACHE_FILE, NULL);
+  fp = es_fopen (fname, "a");
+  if (!fp)
+    log_error (_("error opening '%s': %s\n"), fname, strerror (errno));
+  else
+    {
+      if (!es_ftello (fp))
+        es_fprintf (fp, "# WKD result cache - do not edit\nv:%d:\n",
+                    WKD_CACHE_VERSION);
+      wkd_cache_write_item (fp, item);
+      if (es_fclose (fp))
+        log_error (_("error writing '%s': %s\n"),
+                   fname, gpg_strerror (gpg_error_from_syserror ()));
+    }
+  xfree (fname);
+}
+
+
+/* Release the in-memory WKD cache; it will be read again from the
+ * file on next use.  If REMOVE_FILE is set the file is also
+ * removed.  */
+void
+wkd_cache_deinit (int remove_file)
+{
+  char *fname;
+
+  wkd_cache_purge (0);
+  wkd_cache.loaded = 0;
+  if (remove_file)
+    {
+      fname = make_filename (opt.homedir_cache, WKD_CACHE_FILE, NULL);
+      if (gnupg_remove (fname) && errno != ENOENT)
+        log_error (_("error removing '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+    }
+}
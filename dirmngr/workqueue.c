@@ -24,6 +24,7 @@
 #include <string.h>
 
 #include "dirmngr.h"
+#include "../common/metrics.h"
 
 
 /* An object for one item in the workqueue.  */
@@ -46,6 +47,8 @@ struct wqitem_s
 };
 typedef struct wqitem_s *wqitem_t;
 
+METRIC_DEFINE_GAUGE (m_entries, "workqueue_entries");
+
 
 /* The workque is a simple linked list.  */
 static wqitem_t workqueue;
@@ -111,6 +114,7 @@ workqueue_add_task (wqtask_t func, const char *args, unsigned int session_id,
         wi = wi->next;
       wi->next = item;
     }
+  metric_inc (&m_entries);
   return 0;
 }
 
@@ -121,6 +125,7 @@ static void
 run_a_task (ctrl_t ctrl, wqitem_t item)
 {
   log_assert (!item->next);
+  metric_dec (&m_entries);
 
   if (opt.verbose)
     log_info ("session %u: running %s(\"%s%s\")\n",
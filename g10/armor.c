@@ -650,9 +650,15 @@ fake_packet( armor_filter_context_t *afx, IOBUF a,
 		continue;
 	      }
 
-	    while( tempbuf_len < PARTIAL_CHUNK
-		   && afx->buffer_pos < afx->buffer_len )
-	      tempbuf[tempbuf_len++] = afx->buffer[afx->buffer_pos++];
+	    if( afx->buffer_pos < afx->buffer_len )
+	      {
+		n = afx->buffer_len - afx->buffer_pos;
+		if( n > PARTIAL_CHUNK - tempbuf_len )
+		  n = PARTIAL_CHUNK - tempbuf_len;
+		memcpy( tempbuf + tempbuf_len, afx->buffer + afx->buffer_pos, n );
+		tempbuf_len += n;
+		afx->buffer_pos += n;
+	      }
 	    if( tempbuf_len==PARTIAL_CHUNK )
 	      continue;
 	  }
@@ -1127,9 +1133,8 @@ armor_output_buf_as_radix64 (armor_filter_context_t *afx, IOBUF a,
   byte radbuf[sizeof (afx->radbuf)];
   byte outbuf[64 + sizeof (afx->eol)];
   unsigned int eollen = strlen (afx->eol);
-  u32 in, in2;
+  u32 in;
   int idx, idx2;
-  int i;
 
   idx = afx->idx;
   idx2 = afx->idx2;
@@ -1174,26 +1179,9 @@ armor_output_buf_as_radix64 (armor_filter_context_t *afx, IOBUF a,
       do
 	{
 	  /* idx and idx2 == 0 */
-
-	  for (i = 0; i < (64/8); i++)
-	    {
-	      in = (u32)buf[0] << (2 * 8);
-	      in |= (u32)buf[1] << (1 * 8);
-	      in |= (u32)buf[2] << (0 * 8);
-	      in2 = (u32)buf[3] << (2 * 8);
-	      in2 |= (u32)buf[4] << (1 * 8);
-	      in2 |= (u32)buf[5] << (0 * 8);
-	      outbuf[i*8+0] = bintoasc[(in >> 18) & 077];
-	      outbuf[i*8+1] = bintoasc[(in >> 12) & 077];
-	      outbuf[i*8+2] = bintoasc[(in >> 6) & 077];
-	      outbuf[i*8+3] = bintoasc[(in >> 0) & 077];
-	      outbuf[i*8+4] = bintoasc[(in2 >> 18) & 077];
-	      outbuf[i*8+5] = bintoasc[(in2 >> 12) & 077];
-	      outbuf[i*8+6] = bintoasc[(in2 >> 6) & 077];
-	      outbuf[i*8+7] = bintoasc[(in2 >> 0) & 077];
-	      buf+=6;
-	      size-=6;
-	    }
+	  b64enc_quads ((char *)outbuf, buf, (64/4));
+	  buf += (64/4)*3;
+	  size -= (64/4)*3;
 
 	  /* pgp doesn't like 72 here */
 	  iobuf_write (a, outbuf, 64 + eollen);
@@ -0,0 +1,315 @@
+/* benchmark.c - Measure the throughput of the filters
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The command --benchmark feeds synthetic data through the filters
+ * used by the encryption and signing commands, each alone and a few
+ * of them combined, and prints the throughput in a colon delimited
+ * format.  The output of the filters is discarded.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_GETTIMEOFDAY
+# include <sys/time.h>
+#endif
+#ifdef HAVE_GETRUSAGE
+# include <sys/resource.h>
+#endif
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/iobuf.h"
+#include "options.h"
+#include "packet.h"
+#include "filter.h"
+#include "main.h"
+
+
+/* The size of the synthetic data and of the writes done.  */
+#define BENCH_DATASIZE (1024*1024)
+#define BENCH_WRITESIZE (64*1024)
+
+/* The filters of a benchmark run.  */
+#define BENCH_ARMOR    1
+#define BENCH_COMPRESS 2
+#define BENCH_CFB      4
+#define BENCH_AEAD     8
+#define BENCH_MD       16
+
+static struct
+{
+  const char *name;
+  unsigned int filters;
+} benchmarks[] =
+  {
+    { "armor",         BENCH_ARMOR },
+    { "compress",      BENCH_COMPRESS },
+    { "cfb-mdc",       BENCH_CFB },
+    { "aead",          BENCH_AEAD },
+    { "md",            BENCH_MD },
+    { "compress+aead", BENCH_COMPRESS | BENCH_AEAD },
+    { "compress+aead+armor", BENCH_COMPRESS | BENCH_AEAD | BENCH_ARMOR },
+    { "compress+cfb-mdc", BENCH_COMPRESS | BENCH_CFB }
+  };
+
+
+/* Wall clock and CPU time in microseconds.  */
+struct bench_time_s
+{
+  uint64_t wall;
+  uint64_t cpu;
+};
+
+
+static void
+get_times (struct bench_time_s *t)
+{
+#ifdef HAVE_GETTIMEOFDAY
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  t->wall = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+  t->wall = (uint64_t)time (NULL) * 1000000;
+#endif
+#ifdef HAVE_GETRUSAGE
+  {
+    struct rusage ru;
+
+    /* This includes the worker threads.  */
+    getrusage (RUSAGE_SELF, &ru);
+    t->cpu = ((uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+              + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+  }
+#else
+  t->cpu = (uint64_t)clock () * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+
+/* The output filter at the end of the pipeline which counts and
+ * discards the data.  */
+static int
+discard_filter (void *opaque, int control, iobuf_t a,
+                byte *buf, size_t *ret_len)
+{
+  uint64_t *count = opaque;
+
+  (void)a;
+  (void)buf;
+
+  if (control == IOBUFCTRL_FLUSH)
+    *count += *ret_len;
+  else if (control == IOBUFCTRL_DESC)
+    mem2str (buf, "discard_filter", *ret_len);
+  return 0;
+}
+
+
+/* Create the synthetic data.  We use random words from a small
+ * alphabet so that the data is somewhat compressible.  */
+static byte *
+make_data (void)
+{
+  byte *data;
+  uint32_t x;
+  size_t i;
+
+  data = xtrymalloc (BENCH_DATASIZE);
+  if (!data)
+    return NULL;
+  gcry_create_nonce (&x, sizeof x);
+  for (i=0; i < BENCH_DATASIZE; i++)
+    {
+      x = x * 1103515245 + 12345;
+      switch ((x >> 16) % 40)
+        {
+        case 0: data[i] = '\n'; break;
+        case 1: case 2: case 3: case 4: case 5: data[i] = ' '; break;
+        default: data[i] = 'a' + (x >> 16) % 26; break;
+        }
+    }
+  return data;
+}
+
+
+/* Hash NBYTES of DATA using md_filter.  */
+static gpg_error_t
+run_md (const byte *data, uint64_t nbytes, uint64_t *r_count)
+{
+  gpg_error_t err;
+  md_filter_context_t mfx;
+  iobuf_t inp;
+  byte *buffer;
+  int n;
+
+  buffer = xtrymalloc (BENCH_WRITESIZE);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+
+  memset (&mfx, 0, sizeof mfx);
+  err = gcry_md_open (&mfx.md, DIGEST_ALGO_SHA256, 0);
+  if (err)
+    {
+      xfree (buffer);
+      return err;
+    }
+
+  for (*r_count = 0; *r_count < nbytes; )
+    {
+      inp = iobuf_temp_with_content (data, BENCH_DATASIZE);
+      iobuf_push_filter (inp, md_filter, &mfx);
+      while ((n = iobuf_read (inp, buffer, BENCH_WRITESIZE)) != -1)
+        *r_count += n;
+      iobuf_close (inp);
+    }
+  gcry_md_final (mfx.md);
+
+  gcry_md_close (mfx.md);
+  xfree (buffer);
+  return 0;
+}
+
+
+/* Write NBYTES of DATA through the output FILTERS.  */
+static gpg_error_t
+run_output (unsigned int filters, const byte *data, uint64_t nbytes,
+            uint64_t *r_count)
+{
+  gpg_error_t err;
+  armor_filter_context_t *afx = NULL;
+  compress_filter_context_t zfx;
+  cipher_filter_context_t cfx;
+  iobuf_t out;
+  uint64_t total;
+  size_t off;
+
+  memset (&zfx, 0, sizeof zfx);
+  memset (&cfx, 0, sizeof cfx);
+  *r_count = 0;
+
+  out = iobuf_temp ();
+  iobuf_push_filter (out, discard_filter, r_count);
+
+  if ((filters & BENCH_ARMOR))
+    {
+      afx = new_armor_context ();
+      push_armor_filter (afx, out);
+    }
+
+  if ((filters & (BENCH_CFB | BENCH_AEAD)))
+    {
+      cfx.dek = xtrycalloc_secure (1, sizeof *cfx.dek);
+      if (!cfx.dek)
+        {
+          err = gpg_error_from_syserror ();
+          iobuf_cancel (out);
+          release_armor_context (afx);
+          return err;
+        }
+      cfx.dek->algo = CIPHER_ALGO_AES256;
+      make_session_key (cfx.dek);
+      if ((filters & BENCH_AEAD))
+        cfx.dek->use_aead = AEAD_ALGO_OCB;
+      else
+        cfx.dek->use_mdc = 1;
+      iobuf_push_filter (out, cfx.dek->use_aead? cipher_filter_aead
+                         /**/                  : cipher_filter_cfb, &cfx);
+    }
+
+  if ((filters & BENCH_COMPRESS))
+    {
+      zfx.new_ctb = !!cfx.dek;
+      push_compress_filter (out, &zfx, COMPRESS_ALGO_ZIP);
+    }
+
+  err = 0;
+  for (total = 0; !err && total < nbytes; total += BENCH_DATASIZE)
+    for (off = 0; !err && off < BENCH_DATASIZE; off += BENCH_WRITESIZE)
+      err = iobuf_write (out, data + off, BENCH_WRITESIZE);
+
+  if (err)
+    iobuf_cancel (out);
+  else
+    err = iobuf_close (out);
+  release_armor_context (afx);
+  xfree (cfx.dek);
+  return err;
+}
+
+
+/* Run the benchmarks with NMIB mebibytes of data each.  */
+void
+run_benchmarks (unsigned int nmib)
+{
+  gpg_error_t err;
+  struct bench_time_s start, stop;
+  uint64_t nbytes, count, wall, cpu;
+  byte *data;
+  int i;
+
+  if (!nmib)
+    nmib = 64;
+  nbytes = (uint64_t)nmib * BENCH_DATASIZE;
+
+  data = make_data ();
+  if (!data)
+    {
+      log_error ("error allocating the benchmark data: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  for (i=0; i < DIM (benchmarks); i++)
+    {
+      get_times (&start);
+      if (benchmarks[i].filters == BENCH_MD)
+        err = run_md (data, nbytes, &count);
+      else
+        err = run_output (benchmarks[i].filters, data, nbytes, &count);
+      get_times (&stop);
+      if (err)
+        {
+          log_error ("benchmark '%s' failed: %s\n",
+                     benchmarks[i].name, gpg_strerror (err));
+          continue;
+        }
+
+      wall = stop.wall - start.wall;
+      cpu = stop.cpu - start.cpu;
+      if (!wall)
+        wall = 1;
+
+      /* Fields are: name, input bytes, output bytes, wall clock in
+       * microseconds, CPU time in microseconds, MiB per second, CPU
+       * nanoseconds per input byte.  */
+      es_printf ("bench:%s:%llu:%llu:%llu:%llu:%.1f:%.3f:\n",
+                 benchmarks[i].name,
+                 (unsigned long long)nbytes, (unsigned long long)count,
+                 (unsigned long long)wall, (unsigned long long)cpu,
+                 (double)nbytes / wall * 1000000 / (1024*1024),
+                 (double)cpu * 1000 / nbytes);
+      es_fflush (es_stdout);
+    }
+
+  xfree (data);
+}
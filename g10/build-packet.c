@@ -48,6 +48,10 @@ static int do_signature( IOBUF out, int ctb, PKT_signature *sig );
 static int do_onepass_sig( IOBUF out, int ctb, PKT_onepass_sig *ops );
 
 static int calc_header_length( u32 len, int new_ctb );
+
+/* The initial size of a subpacket area created by build_sig_subpkt.
+ * This is enough for the subpackets of a typical signature.  */
+#define SUBPKT_AREA_MIN_SIZE 128
 static int write_16(IOBUF inp, u16 a);
 static int write_32(IOBUF inp, u32 a);
 static int write_header( IOBUF out, int ctb, u32 len );
@@ -386,6 +390,50 @@ gpg_mpi_write_nohdr (iobuf_t out, gcry_mpi_t a)
 }
 
 
+/* Return the number of bytes gpg_mpi_write would write for A or 0 if
+ * it would fail.  This does not serialize non-opaque MPIs.  */
+static unsigned int
+mpi_write_length (gcry_mpi_t a)
+{
+  unsigned int nbits, n;
+
+  if (!gcry_mpi_get_flag (a, GCRYMPI_FLAG_OPAQUE)
+      && (nbits = gcry_mpi_get_nbits (a)) <= MAX_EXTERN_MPI_BITS)
+    return 2 + (nbits+7)/8;
+
+  /* Let gpg_mpi_write do the work for opaque MPIs.  For too large
+   * MPIs this also prints the diagnostic and returns an error.  */
+  if (gpg_mpi_write (NULL, a, &n))
+    return 0;
+  return n;
+}
+
+
+/* Return the number of bytes gpg_mpi_write_nohdr would write for A
+ * or 0 if it would fail.  */
+static unsigned int
+mpi_write_nohdr_length (gcry_mpi_t a)
+{
+  unsigned int nbits;
+
+  if (!gcry_mpi_get_flag (a, GCRYMPI_FLAG_OPAQUE))
+    return 0;
+  return gcry_mpi_get_opaque (a, &nbits)? (nbits+7)/8 : 0;
+}
+
+
+/* Return the number of bytes write_fake_data would write for A.  */
+static unsigned int
+fake_data_length (gcry_mpi_t a)
+{
+  unsigned int nbits;
+
+  if (!a || !gcry_mpi_get_flag (a, GCRYMPI_FLAG_OPAQUE))
+    return 0;
+  return gcry_mpi_get_opaque (a, &nbits)? (nbits+7)/8 : 0;
+}
+
+
 /* Calculate the length of a packet described by PKT.  */
 u32
 calc_packet_length( PACKET *pkt )
@@ -513,6 +561,74 @@ do_user_id( IOBUF out, int ctb, PKT_user_id *uid )
 }
 
 
+/* Return true if the I-th public parameter of PK is written without
+ * a length header.  */
+static int
+pk_param_is_nohdr (PKT_public_key *pk, int i)
+{
+  return ((pk->pubkey_algo == PUBKEY_ALGO_ECDSA && (i == 0))
+          || (pk->pubkey_algo == PUBKEY_ALGO_EDDSA && (i == 0))
+          || (pk->pubkey_algo == PUBKEY_ALGO_ECDH  && (i == 0 || i == 2)));
+}
+
+
+/* Serialize the public key PK without a secret part to OUT.  This is
+ * the common case and thus we compute the length of the packet first
+ * and write everything directly to OUT instead of using a temporary
+ * buffer.  See do_key for the other args.  */
+static int
+do_public_key (iobuf_t out, int ctb, PKT_public_key *pk)
+{
+  gpg_error_t err = 0;
+  int i, npkey;
+  unsigned int n;
+  u32 pkbytes = 0;
+  u32 len;
+  int is_v5 = (pk->version == 5);
+
+  npkey = pubkey_get_npkey (pk->pubkey_algo);
+  if (!npkey)
+    pkbytes = fake_data_length (pk->pkey[0]);
+  for (i=0; i < npkey; i++ )
+    {
+      if (pk_param_is_nohdr (pk, i))
+        {
+          n = mpi_write_nohdr_length (pk->pkey[i]);
+          if (!n && !gcry_mpi_get_flag (pk->pkey[i], GCRYMPI_FLAG_OPAQUE))
+            return gpg_error (GPG_ERR_BAD_MPI);
+        }
+      else if (!(n = mpi_write_length (pk->pkey[i])))
+        return gpg_error (GPG_ERR_TOO_LARGE);
+      pkbytes += n;
+    }
+
+  len = pkbytes;
+  len += 1; /* version number  */
+  len += 4; /* timestamp  */
+  len += 1; /* algo  */
+  if (is_v5)
+    len += 4; /* public key material count  */
+
+  write_header2 (out, ctb, len, 0);
+  iobuf_put (out, pk->version? pk->version : 4); /* version number  */
+  write_32 (out, pk->timestamp );
+  iobuf_put (out, pk->pubkey_algo);  /* algo */
+  if (is_v5)
+    write_32 (out, pkbytes);        /* public key material count  */
+
+  if (!npkey)
+    return write_fake_data (out, pk->pkey[0]);
+  for (i=0; i < npkey && !err; i++ )
+    {
+      if (pk_param_is_nohdr (pk, i))
+        err = gpg_mpi_write_nohdr (out, pk->pkey[i]);
+      else
+        err = gpg_mpi_write (out, pk->pkey[i], NULL);
+    }
+  return err;
+}
+
+
 /* Serialize the key (RFC 4880, Section 5.5) described by PK and write
  * it to OUT.
  *
@@ -541,6 +657,9 @@ do_key (iobuf_t out, int ctb, PKT_public_key *pk)
               || ctb_pkttype (ctb) == PKT_SECRET_KEY
               || ctb_pkttype (ctb) == PKT_SECRET_SUBKEY);
 
+  if (!pk->seckey_info)
+    return do_public_key (out, ctb, pk);
+
   /* The length of the body is stored in the packet's header, which
    * occurs before the body.  Unfortunately, we don't know the length
    * of the packet's body until we've written all of the data!  To
@@ -571,9 +690,7 @@ do_key (iobuf_t out, int ctb, PKT_public_key *pk)
 
   for (i=0; i < npkey; i++ )
     {
-      if (   (pk->pubkey_algo == PUBKEY_ALGO_ECDSA && (i == 0))
-          || (pk->pubkey_algo == PUBKEY_ALGO_EDDSA && (i == 0))
-          || (pk->pubkey_algo == PUBKEY_ALGO_ECDH  && (i == 0 || i == 2)))
+      if (pk_param_is_nohdr (pk, i))
         err = gpg_mpi_write_nohdr (a, pk->pkey[i]);
       else
         err = gpg_mpi_write (a, pk->pkey[i], NULL);
@@ -1195,13 +1312,19 @@ build_sig_subpkt (PKT_signature *sig, sigsubpkttype_t type,
         /*log_debug ("updating area for type %d\n", type );*/
     }
     else if (oldarea) {
-        newarea = xrealloc (oldarea, sizeof (*newarea) + n - 1);
-        newarea->size = n;
+        /* Grow the area in larger steps; a signature gets several
+           subpackets added one after the other.  */
+        size_t size = 2 * oldarea->size;
+        if (size < n)
+            size = n;
+        newarea = xrealloc (oldarea, sizeof (*newarea) + size - 1);
+        newarea->size = size;
         /*log_debug ("reallocating area for type %d\n", type );*/
     }
     else {
-        newarea = xmalloc (sizeof (*newarea) + n - 1);
-        newarea->size = n;
+        size_t size = n < SUBPKT_AREA_MIN_SIZE? SUBPKT_AREA_MIN_SIZE : n;
+        newarea = xmalloc (sizeof (*newarea) + size - 1);
+        newarea->size = size;
         /*log_debug ("allocating area for type %d\n", type );*/
     }
     newarea->len = n;
@@ -1645,70 +1768,84 @@ free_notation(struct notation *notation)
 }
 
 /* Serialize the signature packet (RFC 4880, Section 5.2) described by
-   SIG and write it to OUT.  */
+   SIG and write it to OUT.  The length of the packet is computed
+   first so that the packet can be written directly to OUT.  */
 static int
 do_signature( IOBUF out, int ctb, PKT_signature *sig )
 {
   int rc = 0;
   int n, i;
-  IOBUF a = iobuf_temp();
+  unsigned int mpilen;
+  size_t nhashed, nunhashed;
+  u32 len;
 
   log_assert (ctb_pkttype (ctb) == PKT_SIGNATURE);
 
   if ( !sig->version || sig->version == 3)
     {
-      iobuf_put( a, 3 );
-
       /* Version 3 packets don't support subpackets.  */
       log_assert (! sig->hashed);
       log_assert (! sig->unhashed);
     }
+
+  nhashed = sig->hashed? sig->hashed->len : 0;
+  nunhashed = sig->unhashed? sig->unhashed->len : 0;
+  n = pubkey_get_nsig( sig->pubkey_algo );
+
+  /* Compute the length of the body.  */
+  if ( sig->version < 4 )
+    len = 1 + 1 + 1 + 4 + 8 + 1 + 1;
+  else
+    len = 1 + 1 + 1 + 1 + 2 + nhashed + 2 + nunhashed;
+  len += 2;  /* digest_start */
+  if ( !n )
+    len += fake_data_length (sig->data[0]);
+  for (i=0; i < n; i++ )
+    {
+      if (!(mpilen = mpi_write_length (sig->data[i])))
+        return gpg_error (GPG_ERR_TOO_LARGE);
+      len += mpilen;
+    }
+
+  if ( is_RSA(sig->pubkey_algo) && sig->version < 4 )
+    write_sign_packet_header(out, ctb, len );
   else
-    iobuf_put( a, sig->version );
+    write_header(out, ctb, len );
+
+  if ( !sig->version || sig->version == 3)
+    iobuf_put( out, 3 );
+  else
+    iobuf_put( out, sig->version );
   if ( sig->version < 4 )
-    iobuf_put (a, 5 ); /* Constant used by pre-v4 signatures. */
-  iobuf_put (a, sig->sig_class );
+    iobuf_put (out, 5 ); /* Constant used by pre-v4 signatures. */
+  iobuf_put (out, sig->sig_class );
   if ( sig->version < 4 )
     {
-      write_32(a, sig->timestamp );
-      write_32(a, sig->keyid[0] );
-      write_32(a, sig->keyid[1] );
+      write_32(out, sig->timestamp );
+      write_32(out, sig->keyid[0] );
+      write_32(out, sig->keyid[1] );
     }
-  iobuf_put(a, sig->pubkey_algo );
-  iobuf_put(a, sig->digest_algo );
+  iobuf_put(out, sig->pubkey_algo );
+  iobuf_put(out, sig->digest_algo );
   if ( sig->version >= 4 )
     {
-      size_t nn;
       /* Timestamp and keyid must have been packed into the subpackets
 	 prior to the call of this function, because these subpackets
 	 are hashed. */
-      nn = sig->hashed? sig->hashed->len : 0;
-      write_16(a, nn);
-      if (nn)
-        iobuf_write( a, sig->hashed->data, nn );
-      nn = sig->unhashed? sig->unhashed->len : 0;
-      write_16(a, nn);
-      if (nn)
-        iobuf_write( a, sig->unhashed->data, nn );
+      write_16(out, nhashed);
+      if (nhashed)
+        iobuf_write( out, sig->hashed->data, nhashed );
+      write_16(out, nunhashed);
+      if (nunhashed)
+        iobuf_write( out, sig->unhashed->data, nunhashed );
     }
-  iobuf_put(a, sig->digest_start[0] );
-  iobuf_put(a, sig->digest_start[1] );
-  n = pubkey_get_nsig( sig->pubkey_algo );
+  iobuf_put(out, sig->digest_start[0] );
+  iobuf_put(out, sig->digest_start[1] );
   if ( !n )
-    write_fake_data( a, sig->data[0] );
+    rc = write_fake_data( out, sig->data[0] );
   for (i=0; i < n && !rc ; i++ )
-    rc = gpg_mpi_write (a, sig->data[i], NULL);
+    rc = gpg_mpi_write (out, sig->data[i], NULL);
 
-  if (!rc)
-    {
-      if ( is_RSA(sig->pubkey_algo) && sig->version < 4 )
-        write_sign_packet_header(out, ctb, iobuf_get_temp_length(a) );
-      else
-        write_header(out, ctb, iobuf_get_temp_length(a) );
-      rc = iobuf_write_temp( out, a );
-    }
-
-  iobuf_close(a);
   return rc;
 }
 
@@ -32,11 +32,13 @@
 
 #include "gpg.h"
 #include <assuan.h>
+#include <npth.h>
 #include "../common/util.h"
 #include "../common/membuf.h"
 #include "options.h"
 #include "../common/i18n.h"
 #include "../common/asshelp.h"
+#include "../common/metrics.h"
 #include "../common/sysutils.h"
 #include "call-agent.h"
 #include "../common/status.h"
@@ -49,6 +51,14 @@
 
 static assuan_context_t agent_ctx = NULL;
 static int did_early_card_test;
+/* Set if the agent does not support HAVEKEY --info.  */
+static int no_havekey_info;
+/* State of the import batch: 0 = none, 1 = requested, 2 = the agent
+ * defers the imported keys.  */
+static int import_key_batch;
+/* Support for EXPORT_KEY --multi: 0 = not yet checked, 1 = supported,
+ * 2 = not supported.  */
+static int export_key_multi;
 
 struct confirm_parm_s
 {
@@ -77,6 +87,27 @@ struct cipher_parm_s
   size_t ciphertextlen;
 };
 
+struct cipher_batch_parm_s
+{
+  struct default_inq_parm_s *dflt;
+  assuan_context_t ctx;
+  membuf_t ciphertexts;
+  int *paddings;
+  unsigned int nciphertexts;
+};
+
+struct cipher_trial_parm_s
+{
+  gpg_error_t *errs;
+  unsigned int nkeys;
+};
+
+struct signjobs_parm_s
+{
+  struct default_inq_parm_s *dflt;
+  membuf_t jobs;
+};
+
 struct writecert_parm_s
 {
   struct default_inq_parm_s *dflt;
@@ -258,6 +289,61 @@ warn_version_mismatch (assuan_context_t ctx, const char *servername, int mode)
 }
 
 
+/* Send the options of this process to the new agent connection CTX.
+ * Returns an error if setting the pinentry mode or the request origin
+ * failed.  */
+static gpg_error_t
+send_agent_options (assuan_context_t ctx)
+{
+  gpg_error_t rc = 0;
+
+  /* Tell the agent that we support Pinentry notifications.
+     No error checking so that it will work also with older
+     agents.  */
+  assuan_transact (ctx, "OPTION allow-pinentry-notify",
+                   NULL, NULL, NULL, NULL, NULL, NULL);
+  /* Tell the agent about what version we are aware.  This is
+     here used to indirectly enable GPG_ERR_FULLY_CANCELED.  */
+  assuan_transact (ctx, "OPTION agent-awareness=2.1.0",
+                   NULL, NULL, NULL, NULL, NULL, NULL);
+  /* Pass on the trace id for --trace-ipc.  */
+  send_trace_id (ctx, metric_trace_id ());
+  /* Pass on the pinentry mode.  */
+  if (opt.pinentry_mode)
+    {
+      char *tmp = xasprintf ("OPTION pinentry-mode=%s",
+                             str_pinentry_mode (opt.pinentry_mode));
+      rc = assuan_transact (ctx, tmp, NULL, NULL, NULL, NULL, NULL, NULL);
+      xfree (tmp);
+      if (rc)
+        {
+          log_error ("setting pinentry mode '%s' failed: %s\n",
+                     str_pinentry_mode (opt.pinentry_mode),
+                     gpg_strerror (rc));
+          write_status_error ("set_pinentry_mode", rc);
+        }
+    }
+
+  /* Pass on the request origin.  */
+  if (opt.request_origin)
+    {
+      char *tmp = xasprintf ("OPTION pretend-request-origin=%s",
+                             str_request_origin (opt.request_origin));
+      rc = assuan_transact (ctx, tmp, NULL, NULL, NULL, NULL, NULL, NULL);
+      xfree (tmp);
+      if (rc)
+        {
+          log_error ("setting request origin '%s' failed: %s\n",
+                     str_request_origin (opt.request_origin),
+                     gpg_strerror (rc));
+          write_status_error ("set_request_origin", rc);
+        }
+    }
+
+  return rc;
+}
+
+
 #define FLAG_FOR_CARD_SUPPRESS_ERRORS 2
 
 /* Try to connect to the agent via socket or fork it off and work by
@@ -295,48 +381,7 @@ start_agent (ctrl_t ctrl, int flag_for_card)
       else if (!rc
                && !(rc = warn_version_mismatch (agent_ctx, GPG_AGENT_NAME, 0)))
         {
-          /* Tell the agent that we support Pinentry notifications.
-             No error checking so that it will work also with older
-             agents.  */
-          assuan_transact (agent_ctx, "OPTION allow-pinentry-notify",
-                           NULL, NULL, NULL, NULL, NULL, NULL);
-          /* Tell the agent about what version we are aware.  This is
-             here used to indirectly enable GPG_ERR_FULLY_CANCELED.  */
-          assuan_transact (agent_ctx, "OPTION agent-awareness=2.1.0",
-                           NULL, NULL, NULL, NULL, NULL, NULL);
-          /* Pass on the pinentry mode.  */
-          if (opt.pinentry_mode)
-            {
-              char *tmp = xasprintf ("OPTION pinentry-mode=%s",
-                                     str_pinentry_mode (opt.pinentry_mode));
-              rc = assuan_transact (agent_ctx, tmp,
-                               NULL, NULL, NULL, NULL, NULL, NULL);
-              xfree (tmp);
-              if (rc)
-                {
-                  log_error ("setting pinentry mode '%s' failed: %s\n",
-                             str_pinentry_mode (opt.pinentry_mode),
-                             gpg_strerror (rc));
-                  write_status_error ("set_pinentry_mode", rc);
-                }
-            }
-
-          /* Pass on the request origin.  */
-          if (opt.request_origin)
-            {
-              char *tmp = xasprintf ("OPTION pretend-request-origin=%s",
-                                     str_request_origin (opt.request_origin));
-              rc = assuan_transact (agent_ctx, tmp,
-                               NULL, NULL, NULL, NULL, NULL, NULL);
-              xfree (tmp);
-              if (rc)
-                {
-                  log_error ("setting request origin '%s' failed: %s\n",
-                             str_request_origin (opt.request_origin),
-                             gpg_strerror (rc));
-                  write_status_error ("set_request_origin", rc);
-                }
-            }
+          rc = send_agent_options (agent_ctx);
 
           /* In DE_VS mode under Windows we require that the JENT RNG
            * is active.  */
@@ -2157,6 +2202,50 @@ agent_probe_secret_key (ctrl_t ctrl, PKT_public_key *pk)
   return 1;
 }
 
+
+/* Ask the agent how expensive it is to use the secret key for PK.
+ * Returns -1 if no secret key is available and otherwise one of:
+ *
+ *   0 = not protected or the passphrase is cached
+ *   1 = the smartcard with the key is inserted
+ *   2 = a passphrase needs to be entered
+ *   3 = the smartcard with the key needs to be inserted
+ */
+int
+agent_secret_key_cost (ctrl_t ctrl, PKT_public_key *pk)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  char *hexgrip;
+  struct keyinfo_data_parm_s keyinfo;
+
+  memset (&keyinfo, 0, sizeof keyinfo);
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return -1;
+
+  err = hexkeygrip_from_pk (pk, &hexgrip);
+  if (err)
+    return -1;
+
+  snprintf (line, sizeof line, "KEYINFO %s", hexgrip);
+  xfree (hexgrip);
+
+  err = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL,
+                         keyinfo_status_cb, &keyinfo);
+  xfree (keyinfo.serialno);
+  if (err)
+    return -1;
+
+  if (keyinfo.is_smartcard)
+    return keyinfo.card_available? 1 : 3;
+  if (keyinfo.cleartext || keyinfo.passphrase_cached)
+    return 0;
+  return 2;
+}
+
+
 /* Ask the agent whether a secret key is available for any of the
    keys (primary or sub) in KEYBLOCK.  Returns 0 if available.  */
 gpg_error_t
@@ -2209,6 +2298,158 @@ agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock)
 }
 
 
+/* Send the HAVEKEY --info command in LINE for the NKEYS keys starting
+ * at RANKS and store the returned ranks there.  */
+static gpg_error_t
+probe_secret_keys_chunk (const char *line, struct secret_key_rank_s *ranks,
+                         int nkeys)
+{
+  gpg_error_t err;
+  membuf_t data;
+  char *buf;
+  size_t len;
+  int i;
+
+  init_membuf (&data, 64);
+  err = assuan_transact (agent_ctx, line, put_membuf_cb, &data,
+                         NULL, NULL, NULL, NULL);
+  if (err)
+    {
+      xfree (get_membuf (&data, NULL));
+      return err;
+    }
+  buf = get_membuf (&data, &len);
+  if (!buf)
+    return gpg_error_from_syserror ();
+
+  if (len != nkeys)
+    err = gpg_error (GPG_ERR_INV_RESPONSE);
+  else
+    {
+      for (i=0; i < nkeys; i++)
+        {
+          if (buf[i] < '0' || buf[i] > '4')
+            {
+              err = gpg_error (GPG_ERR_INV_RESPONSE);
+              break;
+            }
+          ranks[i].rank = buf[i] - '0';
+        }
+    }
+  xfree (buf);
+  return err;
+}
+
+
+/* Ask the agent for the availability of the secret keys of all keys
+ * (primary and sub) in KEYBLOCK using as few round trips as possible.
+ * On success a newly allocated array is stored at R_RANKS which has
+ * an item for each key with the same value agent_probe_secret_key
+ * would return; it is terminated by an item with PK set to NULL and
+ * must be released with xfree.  An error is returned if the agent
+ * does not support this; the caller should then fall back to
+ * agent_probe_any_secret_key and agent_probe_secret_key.  */
+gpg_error_t
+agent_probe_secret_keys (ctrl_t ctrl, kbnode_t keyblock,
+                         struct secret_key_rank_s **r_ranks)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  char *p;
+  kbnode_t kbctx, node;
+  struct secret_key_rank_s *ranks;
+  int n, nkeys, first;
+  unsigned char grip[KEYGRIP_LEN];
+
+  *r_ranks = NULL;
+
+  if (no_havekey_info)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+
+  for (kbctx=NULL, n=0; (node = walk_kbnode (keyblock, &kbctx, 0)); )
+    if (node->pkt->pkttype == PKT_PUBLIC_KEY
+        || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+        || node->pkt->pkttype == PKT_SECRET_KEY
+        || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+      n++;
+  ranks = xtrycalloc (n + 1, sizeof *ranks);
+  if (!ranks)
+    return gpg_error_from_syserror ();
+
+  p = stpcpy (line, "HAVEKEY --info");
+  first = 0;
+  for (kbctx=NULL, n=nkeys=0; (node = walk_kbnode (keyblock, &kbctx, 0)); )
+    if (node->pkt->pkttype == PKT_PUBLIC_KEY
+        || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+        || node->pkt->pkttype == PKT_SECRET_KEY
+        || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+      {
+        if (nkeys && ((p - line) + 41) > (ASSUAN_LINELENGTH - 2))
+          {
+            err = probe_secret_keys_chunk (line, ranks + first, nkeys);
+            if (err)
+              goto leave;
+            p = stpcpy (line, "HAVEKEY --info");
+            first = n;
+            nkeys = 0;
+          }
+
+        ranks[n].pk = node->pkt->pkt.public_key;
+        err = keygrip_from_pk (ranks[n].pk, grip);
+        if (err)
+          goto leave;
+        *p++ = ' ';
+        bin2hex (grip, 20, p);
+        p += 40;
+        nkeys++;
+        n++;
+      }
+
+  if (nkeys)
+    err = probe_secret_keys_chunk (line, ranks + first, nkeys);
+
+ leave:
+  /* An old agent takes the option for a keygrip.  */
+  if (gpg_err_code (err) == GPG_ERR_ASS_PARAMETER)
+    no_havekey_info = 1;
+  if (err)
+    xfree (ranks);
+  else
+    *r_ranks = ranks;
+  return err;
+}
+
+
+/* Return the rank of the secret key for PK as found by
+ * agent_probe_secret_keys in RANKS.  Returns -1 if RANKS is NULL or
+ * PK is not listed.  */
+int
+agent_secret_key_rank (struct secret_key_rank_s *ranks, PKT_public_key *pk)
+{
+  if (ranks)
+    for (; ranks->pk; ranks++)
+      if (ranks->pk == pk)
+        return ranks->rank;
+  return -1;
+}
+
+
+/* Return true if any of the keys in RANKS has a secret key.  */
+int
+agent_any_secret_key_rank (struct secret_key_rank_s *ranks)
+{
+  if (ranks)
+    for (; ranks->pk; ranks++)
+      if (ranks->rank > 0)
+        return 1;
+  return 0;
+}
+
+
 
 /* Return the serial number for a secret key.  If the returned serial
    number is NULL, the key is not stored on a smartcard.  Caller needs
@@ -2318,16 +2559,13 @@ inq_genkey_parms (void *opaque, const char *line)
 }
 
 
-/* Call the agent to generate a new key.  KEYPARMS is the usual
-   S-expression giving the parameters of the key.  gpg-agent passes it
-   gcry_pk_genkey.  If NO_PROTECTION is true the agent is advised not
-   to protect the generated key.  If NO_PROTECTION is not set and
-   PASSPHRASE is not NULL the agent is requested to protect the key
-   with that passphrase instead of asking for one.  */
-gpg_error_t
-agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
-              const char *keyparms, int no_protection,
-              const char *passphrase, gcry_sexp_t *r_pubkey)
+/* Run a GENKEY transaction on the agent connection CTX.  See
+ * agent_genkey for the arguments.  */
+static gpg_error_t
+genkey_transact (ctrl_t ctrl, assuan_context_t ctx,
+                 char **cache_nonce_addr, char **passwd_nonce_addr,
+                 const char *keyparms, int no_protection,
+                 const char *passphrase, gcry_sexp_t *r_pubkey)
 {
   gpg_error_t err;
   struct genkey_parm_s gk_parm;
@@ -2340,18 +2578,13 @@ agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
 
   memset (&dfltparm, 0, sizeof dfltparm);
   dfltparm.ctrl = ctrl;
-
-  *r_pubkey = NULL;
-  err = start_agent (ctrl, 0);
-  if (err)
-    return err;
-  dfltparm.ctx = agent_ctx;
+  dfltparm.ctx = ctx;
 
   if (passwd_nonce_addr && *passwd_nonce_addr)
     ; /* A RESET would flush the passwd nonce cache.  */
   else
     {
-      err = assuan_transact (agent_ctx, "RESET",
+      err = assuan_transact (ctx, "RESET",
                              NULL, NULL, NULL, NULL, NULL, NULL);
       if (err)
         return err;
@@ -2371,7 +2604,7 @@ agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
             cache_nonce_addr && *cache_nonce_addr? *cache_nonce_addr:"");
   cn_parm.cache_nonce_addr = cache_nonce_addr;
   cn_parm.passwd_nonce_addr = NULL;
-  err = assuan_transact (agent_ctx, line,
+  err = assuan_transact (ctx, line,
                          put_membuf_cb, &data,
                          inq_genkey_parms, &gk_parm,
                          cache_nonce_status_cb, &cn_parm);
@@ -2393,7 +2626,136 @@ agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
 }
 
 
-
+/* Call the agent to generate a new key.  KEYPARMS is the usual
+   S-expression giving the parameters of the key.  gpg-agent passes it
+   gcry_pk_genkey.  If NO_PROTECTION is true the agent is advised not
+   to protect the generated key.  If NO_PROTECTION is not set and
+   PASSPHRASE is not NULL the agent is requested to protect the key
+   with that passphrase instead of asking for one.  */
+gpg_error_t
+agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
+              const char *keyparms, int no_protection,
+              const char *passphrase, gcry_sexp_t *r_pubkey)
+{
+  gpg_error_t err;
+
+  *r_pubkey = NULL;
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+
+  return genkey_transact (ctrl, agent_ctx, cache_nonce_addr, passwd_nonce_addr,
+                          keyparms, no_protection, passphrase, r_pubkey);
+}
+
+
+/* The state shared by the threads of agent_genkey_parallel.  */
+struct genkey_parallel_s
+{
+  ctrl_t ctrl;
+  agent_genkey_job_t jobs;  /* The jobs not yet started.  */
+};
+
+
+/* The thread function of agent_genkey_parallel.  It opens its own
+ * connection to the agent and runs jobs until none are left.  nPth
+ * switches threads only in blocking calls and thus taking a job from
+ * the shared list needs no lock.  */
+static void *
+genkey_parallel_thread (void *arg)
+{
+  struct genkey_parallel_s *parm = arg;
+  assuan_context_t ctx;
+  agent_genkey_job_t job;
+  gpg_error_t err;
+
+  err = start_new_gpg_agent (&ctx, GPG_ERR_SOURCE_DEFAULT,
+                             opt.agent_program,
+                             opt.lc_ctype, opt.lc_messages,
+                             opt.session_env,
+                             0, opt.verbose, DBG_IPC,
+                             NULL, NULL);
+  if (!err)
+    err = send_agent_options (ctx);
+  if (err)
+    {
+      log_info ("error connecting to the agent: %s\n", gpg_strerror (err));
+      assuan_release (ctx);
+      return NULL;
+    }
+
+  while ((job = parm->jobs))
+    {
+      parm->jobs = job->next;
+      job->err = genkey_transact (parm->ctrl, ctx, &job->cache_nonce, NULL,
+                                  job->keyparms, job->no_protection,
+                                  job->passphrase, &job->pubkey);
+      job->done = 1;
+    }
+
+  assuan_release (ctx);
+  return NULL;
+}
+
+
+/* Generate the keys described by the list JOBS using up to NCONN
+ * connections to the agent.  Each job is run like agent_genkey
+ * without a passwd nonce; the public key and the cache nonce are
+ * stored in the job and its DONE flag is set.  Jobs not done, for
+ * example because no connection could be opened, should be run
+ * again by the caller using agent_genkey.  The agent runs the
+ * requests of different connections in parallel.  */
+gpg_error_t
+agent_genkey_parallel (ctrl_t ctrl, agent_genkey_job_t jobs,
+                       unsigned int nconn)
+{
+  gpg_error_t err;
+  struct genkey_parallel_s parm;
+  npth_attr_t tattr;
+  npth_t *threads;
+  unsigned int i, nthreads;
+  int rc;
+
+  /* Make sure the agent is running before the threads connect.  */
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+
+  threads = xtrycalloc (nconn, sizeof *threads);
+  if (!threads)
+    return gpg_error_from_syserror ();
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      xfree (threads);
+      return gpg_error_from_errno (rc);
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+
+  parm.ctrl = ctrl;
+  parm.jobs = jobs;
+  for (nthreads=0; nthreads < nconn && parm.jobs; nthreads++)
+    {
+      rc = npth_create (threads + nthreads, &tattr,
+                        genkey_parallel_thread, &parm);
+      if (rc)
+        {
+          log_info ("error spawning thread: %s\n",
+                    gpg_strerror (gpg_error_from_errno (rc)));
+          break;
+        }
+    }
+  for (i=0; i < nthreads; i++)
+    npth_join (threads[i], NULL);
+
+  npth_attr_destroy (&tattr);
+  xfree (threads);
+  return 0;
+}
+
+
+
 /* Call the agent to read the public key part for a given keygrip.
  * Values from FROMCARD:
  *   0 - Standard
@@ -2547,23 +2909,152 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce,
 
 
 
-/* Handle a CIPHERTEXT inquiry.  Note, we only send the data,
-   assuan_transact takes care of flushing and writing the END. */
+/* Handle a SIGNJOBS inquiry.  */
 static gpg_error_t
-inq_ciphertext_cb (void *opaque, const char *line)
+inq_signjobs_cb (void *opaque, const char *line)
 {
-  struct cipher_parm_s *parm = opaque;
-  int rc;
+  struct signjobs_parm_s *parm = opaque;
+  const void *buf;
+  size_t len;
 
-  if (has_leading_keyword (line, "CIPHERTEXT"))
+  if (has_leading_keyword (line, "SIGNJOBS"))
     {
-      assuan_begin_confidential (parm->ctx);
-      rc = assuan_send_data (parm->dflt->ctx,
-                             parm->ciphertext, parm->ciphertextlen);
-      assuan_end_confidential (parm->ctx);
+      buf = peek_membuf (&parm->jobs, &len);
+      if (!buf)
+        return gpg_error_from_syserror ();
+      return assuan_send_data (parm->dflt->ctx, buf, len);
     }
-  else
-    rc = default_inq_cb (parm->dflt, line);
+
+  return default_inq_cb (parm->dflt, line);
+}
+
+
+/* Call the agent to create the NJOBS signatures for the digests
+   DIGESTS with the keys identified by the hex strings KEYGRIPS in one
+   go.  DIGESTALGOS gives the algorithm ids used to compute the digests
+   and DESCS the escaped descriptions of the keys, which may be NULL.
+   The agent creates signatures with on-disk keys concurrently.  On
+   success the signatures are stored at the array R_SIGVALS which
+   needs to have NJOBS elements.  An old agent returns
+   GPG_ERR_ASS_UNKNOWN_CMD.  */
+gpg_error_t
+agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce, unsigned int njobs,
+                    char **keygrips, char **descs,
+                    unsigned char **digests, int *digestalgos,
+                    gcry_sexp_t *r_sigvals)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  char hexdigest[2*64+1];
+  membuf_t data;
+  struct signjobs_parm_s parm;
+  struct default_inq_parm_s dfltparm;
+  unsigned char *buf = NULL;
+  size_t len, off, n;
+  unsigned int idx;
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+  dfltparm.ctrl = ctrl;
+
+  for (idx=0; idx < njobs; idx++)
+    r_sigvals[idx] = NULL;
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  err = assuan_transact (agent_ctx, "RESET",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    return err;
+
+  parm.dflt = &dfltparm;
+  init_membuf (&parm.jobs, 1024);
+  for (idx=0; idx < njobs; idx++)
+    {
+      n = gcry_md_get_algo_dlen (digestalgos[idx]);
+      if (!n || n > 64)
+        {
+          xfree (get_membuf (&parm.jobs, NULL));
+          return gpg_error (GPG_ERR_DIGEST_ALGO);
+        }
+      bin2hex (digests[idx], n, hexdigest);
+      put_membuf_printf (&parm.jobs, "%s %d %s%s%s\n",
+                         keygrips[idx], digestalgos[idx], hexdigest,
+                         descs[idx]? " ":"", descs[idx]? descs[idx]:"");
+    }
+
+  snprintf (line, sizeof line, "PKSIGN_MULTI%s%s",
+            cache_nonce? " -- ":"",
+            cache_nonce? cache_nonce:"");
+
+  init_membuf (&data, 1024);
+  if (DBG_CLOCK)
+    log_clock ("enter signing");
+  err = assuan_transact (agent_ctx, line,
+                         put_membuf_cb, &data,
+                         inq_signjobs_cb, &parm,
+                         NULL, NULL);
+  if (DBG_CLOCK)
+    log_clock ("leave signing");
+  xfree (get_membuf (&parm.jobs, NULL));
+  buf = get_membuf (&data, &len);
+  if (err)
+    goto leave;
+  if (!buf)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  for (off=0, idx=0; idx < njobs; off += n, idx++)
+    {
+      n = gcry_sexp_canon_len (buf + off, len - off, NULL, NULL);
+      if (!n)
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      err = gcry_sexp_sscan (&r_sigvals[idx], NULL, (char*)buf + off, n);
+      if (err)
+        goto leave;
+    }
+  if (off != len)
+    err = gpg_error (GPG_ERR_INV_SEXP); /* Trailing garbage.  */
+
+ leave:
+  xfree (buf);
+  if (err)
+    {
+      for (idx=0; idx < njobs; idx++)
+        {
+          gcry_sexp_release (r_sigvals[idx]);
+          r_sigvals[idx] = NULL;
+        }
+    }
+  return err;
+}
+
+
+
+/* Handle a CIPHERTEXT inquiry.  Note, we only send the data,
+   assuan_transact takes care of flushing and writing the END. */
+static gpg_error_t
+inq_ciphertext_cb (void *opaque, const char *line)
+{
+  struct cipher_parm_s *parm = opaque;
+  int rc;
+
+  if (has_leading_keyword (line, "CIPHERTEXT"))
+    {
+      assuan_begin_confidential (parm->ctx);
+      rc = assuan_send_data (parm->dflt->ctx,
+                             parm->ciphertext, parm->ciphertextlen);
+      assuan_end_confidential (parm->ctx);
+    }
+  else
+    rc = default_inq_cb (parm->dflt, line);
 
   return rc;
 }
@@ -2585,6 +3076,37 @@ padding_info_cb (void *opaque, const char *line)
 }
 
 
+/* Check the result S-expression {BUF,LEN} of a PKDECRYPT command which
+   has the form "(5:valueN:D)" and store the offset of the data D at
+   R_OFF and its length at R_N.  */
+static gpg_error_t
+parse_pkdecrypt_value (const char *buf, size_t len, size_t *r_off, size_t *r_n)
+{
+  const char *p;
+  char *endp;
+  size_t n;
+
+  if (len < 12 || memcmp (buf, "(5:value", 8) ) /* "(5:valueN:D)" */
+    return gpg_error (GPG_ERR_INV_SEXP);
+  if (buf[len-1] != ')')
+    return gpg_error (GPG_ERR_INV_SEXP);
+  len--; /* Drop the final close-paren. */
+  p = buf + 8; /* Skip leading parenthesis and the value tag. */
+  len -= 8;   /* Count only the data of the second part. */
+
+  n = strtoul (p, &endp, 10);
+  if (!n || *endp != ':')
+    return gpg_error (GPG_ERR_INV_SEXP);
+  endp++;
+  if (endp-p+n > len)
+    return gpg_error (GPG_ERR_INV_SEXP); /* Oops: Inconsistent S-Exp. */
+
+  *r_off = endp - buf;
+  *r_n = n;
+  return 0;
+}
+
+
 /* Call the agent to do a decrypt operation using the key identified
    by the hex string KEYGRIP and the input data S_CIPHERTEXT.  On the
    success the decoded value is stored verbatim at R_BUF and its
@@ -2601,8 +3123,8 @@ agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
   gpg_error_t err;
   char line[ASSUAN_LINELENGTH];
   membuf_t data;
-  size_t n, len;
-  char *p, *buf, *endp;
+  size_t n, len, off;
+  char *buf;
   struct default_inq_parm_s dfltparm;
 
   memset (&dfltparm, 0, sizeof dfltparm);
@@ -2673,40 +3195,376 @@ agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
       return gpg_error (GPG_ERR_INV_SEXP);
     }
 
-  if (len < 12 || memcmp (buf, "(5:value", 8) ) /* "(5:valueN:D)" */
+  while (len && buf[len-1] == 0)
+    len--;
+  err = parse_pkdecrypt_value (buf, len, &off, &n);
+  if (err)
     {
       xfree (buf);
-      return gpg_error (GPG_ERR_INV_SEXP);
+      return err;
     }
-  while (buf[len-1] == 0)
-    len--;
-  if (buf[len-1] != ')')
-    return gpg_error (GPG_ERR_INV_SEXP);
-  len--; /* Drop the final close-paren. */
-  p = buf + 8; /* Skip leading parenthesis and the value tag. */
-  len -= 8;   /* Count only the data of the second part. */
 
-  n = strtoul (p, &endp, 10);
-  if (!n || *endp != ':')
+  memmove (buf, buf + off, n);
+
+  *r_buflen = n;
+  *r_buf = buf;
+  return 0;
+}
+
+
+/* Inquiry callback for agent_pkdecrypt_batch.  */
+static gpg_error_t
+inq_ciphertexts_cb (void *opaque, const char *line)
+{
+  struct cipher_batch_parm_s *parm = opaque;
+  const void *buf;
+  size_t len;
+  int rc;
+
+  if (has_leading_keyword (line, "CIPHERTEXTS"))
     {
-      xfree (buf);
-      return gpg_error (GPG_ERR_INV_SEXP);
+      buf = peek_membuf (&parm->ciphertexts, &len);
+      if (!buf)
+        return gpg_error_from_syserror ();
+      assuan_begin_confidential (parm->ctx);
+      rc = assuan_send_data (parm->dflt->ctx, buf, len);
+      assuan_end_confidential (parm->ctx);
     }
-  endp++;
-  if (endp-p+n > len)
+  else
+    rc = default_inq_cb (parm->dflt, line);
+
+  return rc;
+}
+
+
+/* Status callback for agent_pkdecrypt_batch to collect the padding
+   info of the results.  */
+static gpg_error_t
+padding_batch_info_cb (void *opaque, const char *line)
+{
+  struct cipher_batch_parm_s *parm = opaque;
+  const char *s;
+  char *endp;
+  unsigned long idx;
+
+  if ((s=has_leading_keyword (line, "PADDING")))
+    {
+      idx = strtoul (s, &endp, 10);
+      if (endp != s && idx < parm->nciphertexts)
+        parm->paddings[idx] = atoi (endp);
+    }
+
+  return 0;
+}
+
+
+/* Call the agent to decrypt the NCIPHERTEXTS ciphertexts
+   S_CIPHERTEXTS using the key identified by the hex string KEYGRIP.
+   This is the same as calling agent_pkdecrypt for each of them but
+   the agent needs to read and unprotect the key only once.  On
+   success the decoded values are stored at the arrays R_BUFS and
+   R_BUFLENS and the padding information at R_PADDINGS; all arrays
+   need to have NCIPHERTEXTS elements and the caller needs to release
+   the buffers.  On error no buffers are returned.  */
+gpg_error_t
+agent_pkdecrypt_batch (ctrl_t ctrl, const char *keygrip, const char *desc,
+                       u32 *keyid, u32 *mainkeyid, int pubkey_algo,
+                       gcry_sexp_t *s_ciphertexts, unsigned int nciphertexts,
+                       unsigned char **r_bufs, size_t *r_buflens,
+                       int *r_paddings)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  membuf_t data;
+  struct cipher_batch_parm_s parm;
+  struct default_inq_parm_s dfltparm;
+  unsigned char *ciphertext;
+  size_t ciphertextlen, n, len, off, valoff;
+  char *buf = NULL;
+  unsigned int idx;
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+  dfltparm.ctrl = ctrl;
+  dfltparm.keyinfo.keyid       = keyid;
+  dfltparm.keyinfo.mainkeyid   = mainkeyid;
+  dfltparm.keyinfo.pubkey_algo = pubkey_algo;
+
+  if (!keygrip || strlen(keygrip) != 40 || !nciphertexts
+      || !s_ciphertexts || !r_bufs || !r_buflens || !r_paddings)
+    return gpg_error (GPG_ERR_INV_VALUE);
+
+  for (idx=0; idx < nciphertexts; idx++)
+    {
+      r_bufs[idx] = NULL;
+      r_paddings[idx] = -1;
+    }
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  err = assuan_transact (agent_ctx, "RESET",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    return err;
+
+  snprintf (line, sizeof line, "SETKEY %s", keygrip);
+  err = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    return err;
+
+  if (desc)
+    {
+      snprintf (line, DIM(line), "SETKEYDESC %s", desc);
+      err = assuan_transact (agent_ctx, line,
+                            NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        return err;
+    }
+
+  parm.dflt = &dfltparm;
+  parm.ctx = agent_ctx;
+  parm.paddings = r_paddings;
+  parm.nciphertexts = nciphertexts;
+  init_membuf (&parm.ciphertexts, 1024);
+  for (idx=0; idx < nciphertexts; idx++)
+    {
+      err = make_canon_sexp (s_ciphertexts[idx], &ciphertext, &ciphertextlen);
+      if (err)
+        {
+          xfree (get_membuf (&parm.ciphertexts, NULL));
+          return err;
+        }
+      put_membuf (&parm.ciphertexts, ciphertext, ciphertextlen);
+      xfree (ciphertext);
+    }
+
+  init_membuf_secure (&data, 1024);
+  err = assuan_transact (agent_ctx, "PKDECRYPT_BATCH",
+                         put_membuf_cb, &data,
+                         inq_ciphertexts_cb, &parm,
+                         padding_batch_info_cb, &parm);
+  xfree (get_membuf (&parm.ciphertexts, NULL));
+  buf = get_membuf (&data, &len);
+  if (err)
+    goto leave;
+  if (!buf)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  for (off=0, idx=0; idx < nciphertexts; off += n, idx++)
     {
+      n = gcry_sexp_canon_len (buf + off, len - off, NULL, NULL);
+      if (!n)
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP);
+          goto leave;
+        }
+      err = parse_pkdecrypt_value (buf + off, n, &valoff, r_buflens + idx);
+      if (err)
+        goto leave;
+      r_bufs[idx] = xtrymalloc_secure (r_buflens[idx]);
+      if (!r_bufs[idx])
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      memcpy (r_bufs[idx], buf + off + valoff, r_buflens[idx]);
+    }
+  if (off != len)
+    err = gpg_error (GPG_ERR_INV_SEXP); /* Trailing garbage.  */
+
+ leave:
+  if (buf)
+    {
+      wipememory (buf, len);
       xfree (buf);
-      return gpg_error (GPG_ERR_INV_SEXP); /* Oops: Inconsistent S-Exp. */
     }
+  if (err)
+    {
+      for (idx=0; idx < nciphertexts; idx++)
+        {
+          xfree (r_bufs[idx]);
+          r_bufs[idx] = NULL;
+        }
+    }
+  return err;
+}
 
-  memmove (buf, endp, n);
 
-  *r_buflen = n;
-  *r_buf = buf;
+/* Status callback for agent_pkdecrypt_trial to collect the keys
+   which could not be tried or used.  */
+static gpg_error_t
+trial_error_cb (void *opaque, const char *line)
+{
+  struct cipher_trial_parm_s *parm = opaque;
+  const char *s;
+  char *endp;
+  unsigned long idx;
+
+  if ((s=has_leading_keyword (line, "TRIAL_ERROR")))
+    {
+      idx = strtoul (s, &endp, 10);
+      if (endp != s && idx < parm->nkeys)
+        {
+          parm->errs[idx] = strtoul (endp, NULL, 10);
+          if (!parm->errs[idx])
+            parm->errs[idx] = gpg_error (GPG_ERR_GENERAL);
+        }
+    }
+
   return 0;
 }
 
 
+/* Call the agent to trial decrypt S_CIPHERTEXT with each of the
+   NKEYS keys identified by the hex strings KEYGRIPS.  The agent tries
+   all keys which can be used without user interaction concurrently.
+   For each key the result is stored at the arrays R_BUFS, R_BUFLENS
+   and R_ERRS, which all need to have NKEYS elements; the caller needs
+   to release the buffers.  An error in R_ERRS means that the key
+   could not be used; a returned buffer may still be garbage if the
+   key was not the one used for encryption.  The function returns an
+   error only if the operation as a whole failed; in particular
+   GPG_ERR_ASS_UNKNOWN_CMD is returned by old agents.  */
+gpg_error_t
+agent_pkdecrypt_trial (ctrl_t ctrl, char **keygrips, unsigned int nkeys,
+                       gcry_sexp_t s_ciphertext,
+                       unsigned char **r_bufs, size_t *r_buflens,
+                       gpg_error_t *r_errs)
+{
+  /* The number of keygrips which fit into one command line.  */
+  const unsigned int chunksize = (ASSUAN_LINELENGTH - 20) / 41;
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  membuf_t data;
+  struct cipher_parm_s parm;
+  struct cipher_trial_parm_s trialparm;
+  struct default_inq_parm_s dfltparm;
+  size_t n, len, off, valoff;
+  char *buf = NULL;
+  char *p;
+  unsigned int base, count, idx;
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+  dfltparm.ctrl = ctrl;
+
+  if (!keygrips || !nkeys || !s_ciphertext
+      || !r_bufs || !r_buflens || !r_errs)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  for (idx=0; idx < nkeys; idx++)
+    {
+      if (!keygrips[idx] || strlen (keygrips[idx]) != 40)
+        return gpg_error (GPG_ERR_INV_VALUE);
+      r_bufs[idx] = NULL;
+      r_buflens[idx] = 0;
+      r_errs[idx] = 0;
+    }
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  err = assuan_transact (agent_ctx, "RESET",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    return err;
+
+  parm.dflt = &dfltparm;
+  parm.ctx = agent_ctx;
+  err = make_canon_sexp (s_ciphertext, &parm.ciphertext, &parm.ciphertextlen);
+  if (err)
+    return err;
+
+  for (base=0; base < nkeys; base += count)
+    {
+      count = nkeys - base;
+      if (count > chunksize)
+        count = chunksize;
+
+      p = stpcpy (line, "PKDECRYPT_TRIAL");
+      for (idx=0; idx < count; idx++)
+        {
+          *p++ = ' ';
+          p = stpcpy (p, keygrips[base+idx]);
+        }
+
+      trialparm.errs = r_errs + base;
+      trialparm.nkeys = count;
+      init_membuf_secure (&data, 1024);
+      err = assuan_transact (agent_ctx, line,
+                             put_membuf_cb, &data,
+                             inq_ciphertext_cb, &parm,
+                             trial_error_cb, &trialparm);
+      buf = get_membuf (&data, &len);
+      if (err)
+        goto leave;
+      if (!buf)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+
+      /* The agent returns values only for the keys without an
+         error.  */
+      for (off=0, idx=base; idx < base + count; idx++)
+        {
+          if (r_errs[idx])
+            continue;
+          n = gcry_sexp_canon_len (buf + off, len - off, NULL, NULL);
+          if (!n)
+            {
+              err = gpg_error (GPG_ERR_INV_SEXP);
+              goto leave;
+            }
+          r_errs[idx] = parse_pkdecrypt_value (buf + off, n, &valoff,
+                                               r_buflens + idx);
+          if (!r_errs[idx])
+            {
+              r_bufs[idx] = xtrymalloc_secure (r_buflens[idx]);
+              if (!r_bufs[idx])
+                {
+                  err = gpg_error_from_syserror ();
+                  goto leave;
+                }
+              memcpy (r_bufs[idx], buf + off + valoff, r_buflens[idx]);
+            }
+          off += n;
+        }
+      if (off != len)
+        {
+          err = gpg_error (GPG_ERR_INV_SEXP); /* Trailing garbage.  */
+          goto leave;
+        }
+
+      wipememory (buf, len);
+      xfree (buf);
+      buf = NULL;
+    }
+
+ leave:
+  xfree (parm.ciphertext);
+  if (buf)
+    {
+      wipememory (buf, len);
+      xfree (buf);
+    }
+  if (err)
+    {
+      for (idx=0; idx < nkeys; idx++)
+        {
+          xfree (r_bufs[idx]);
+          r_bufs[idx] = NULL;
+        }
+    }
+  return err;
+}
+
+
 
 /* Retrieve a key encryption key from the agent.  With FOREXPORT true
    the key shall be used for export, with false for import.  On success
@@ -2807,9 +3665,19 @@ agent_import_key (ctrl_t ctrl, const char *desc, char **cache_nonce_addr,
   parm.key    = key;
   parm.keylen = keylen;
 
-  snprintf (line, sizeof line, "IMPORT_KEY%s%s%s%s",
+  /* Check that the gpg-agent is able to defer the keys.  */
+  if (import_key_batch == 1)
+    {
+      err = assuan_transact (agent_ctx,
+                             "GETINFO cmd_has_option IMPORT_KEY defer",
+                             NULL, NULL, NULL, NULL, NULL, NULL);
+      import_key_batch = err? 0 : 2;
+    }
+
+  snprintf (line, sizeof line, "IMPORT_KEY%s%s%s%s%s",
             unattended? " --unattended":"",
             force? " --force":"",
+            import_key_batch == 2? " --defer":"",
             cache_nonce_addr && *cache_nonce_addr? " ":"",
             cache_nonce_addr && *cache_nonce_addr? *cache_nonce_addr:"");
   cn_parm.cache_nonce_addr = cache_nonce_addr;
@@ -2823,6 +3691,36 @@ agent_import_key (ctrl_t ctrl, const char *desc, char **cache_nonce_addr,
 
 
 
+/* Start a batch of secret key imports.  The gpg-agent then protects
+ * the keys sent by agent_import_key in parallel and stores them only
+ * at agent_import_key_end_batch; errors of storing a key may thus be
+ * returned by a later agent_import_key.  */
+void
+agent_import_key_begin_batch (void)
+{
+  if (!import_key_batch)
+    import_key_batch = 1;
+}
+
+
+/* Store the keys of a batch started with agent_import_key_begin_batch
+ * and end the batch.  Returns the first error.  */
+gpg_error_t
+agent_import_key_end_batch (ctrl_t ctrl)
+{
+  int deferred = (import_key_batch == 2);
+
+  (void)ctrl;
+
+  import_key_batch = 0;
+  if (!deferred || !agent_ctx)
+    return 0;
+  return assuan_transact (agent_ctx, "IMPORT_KEY --flush",
+                          NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+
+
 /* Receive a secret key from the agent.  HEXKEYGRIP is the hexified
    keygrip, DESC a prompt to be displayed with the agent's passphrase
    question (needs to be plus+percent escaped).  if OPENPGP_PROTECTED
@@ -2894,6 +3792,169 @@ agent_export_key (ctrl_t ctrl, const char *hexkeygrip, const char *desc,
 }
 
 
+/* Parameter for export_keys_status_cb.  */
+struct export_keys_parm_s
+{
+  struct cache_nonce_parm_s cn_parm;
+  unsigned int nkeys;
+  size_t *lens;        /* The length of each key.  */
+  gpg_error_t *errs;   /* The error code of each key.  */
+  unsigned int nseen;  /* Number of result status lines seen.  */
+};
+
+
+/* Status callback for agent_export_keys.  */
+static gpg_error_t
+export_keys_status_cb (void *opaque, const char *line)
+{
+  struct export_keys_parm_s *parm = opaque;
+  const char *s;
+  char *endp;
+  unsigned long idx, ec, len;
+
+  if ((s = has_leading_keyword (line, "EXPORT_KEY_RESULT")))
+    {
+      idx = strtoul (s, &endp, 10);
+      ec = strtoul (endp, &endp, 10);
+      len = strtoul (endp, NULL, 10);
+      if (idx != parm->nseen || idx >= parm->nkeys)
+        return gpg_error (GPG_ERR_INV_RESPONSE);
+      parm->errs[idx] = ec;
+      parm->lens[idx] = ec? 0 : len;
+      parm->nseen++;
+      return 0;
+    }
+
+  return cache_nonce_status_cb (&parm->cn_parm, line);
+}
+
+
+/* Receive several secret keys from the agent with one request.
+ * HEXKEYGRIPS are the NKEYS hexified keygrips and DESC the prompt
+ * shown with the passphrase questions; the other arguments are as
+ * with agent_export_key.  The results for each key are stored at the
+ * arrays R_RESULTS, R_RESULTLENS and R_ERRS which need to have NKEYS
+ * elements.  Returns GPG_ERR_NOT_SUPPORTED if the agent is not able
+ * to do this; the caller should then use agent_export_key.  */
+gpg_error_t
+agent_export_keys (ctrl_t ctrl, char **hexkeygrips, unsigned int nkeys,
+                   const char *desc, int openpgp_protected,
+                   char **cache_nonce_addr,
+                   unsigned char **r_results, size_t *r_resultlens,
+                   gpg_error_t *r_errs,
+                   u32 *keyid, u32 *mainkeyid, int pubkey_algo)
+{
+  gpg_error_t err;
+  struct export_keys_parm_s parm;
+  membuf_t data;
+  size_t len, off;
+  unsigned char *buf;
+  unsigned int i;
+  char line[ASSUAN_LINELENGTH];
+  struct default_inq_parm_s dfltparm;
+
+  for (i=0; i < nkeys; i++)
+    {
+      r_results[i] = NULL;
+      r_resultlens[i] = 0;
+      r_errs[i] = gpg_error (GPG_ERR_NO_DATA);
+    }
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+  dfltparm.ctrl = ctrl;
+  dfltparm.keyinfo.keyid       = keyid;
+  dfltparm.keyinfo.mainkeyid   = mainkeyid;
+  dfltparm.keyinfo.pubkey_algo = pubkey_algo;
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  if (!export_key_multi)
+    {
+      err = assuan_transact (agent_ctx,
+                             "GETINFO cmd_has_option EXPORT_KEY multi",
+                             NULL, NULL, NULL, NULL, NULL, NULL);
+      export_key_multi = err? 2 : 1;
+    }
+  if (export_key_multi != 1)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  snprintf (line, DIM(line), "EXPORT_KEY %s%s%s --multi",
+            openpgp_protected ? "--openpgp ":"",
+            cache_nonce_addr && *cache_nonce_addr? "--cache-nonce=":"",
+            cache_nonce_addr && *cache_nonce_addr? *cache_nonce_addr:"");
+  for (i=0; i < nkeys; i++)
+    {
+      if (strlen (line) + 1 + strlen (hexkeygrips[i]) >= DIM(line))
+        return gpg_error (GPG_ERR_TOO_MANY);
+      strcat (line, " ");
+      strcat (line, hexkeygrips[i]);
+    }
+
+  if (desc)
+    {
+      char descline[ASSUAN_LINELENGTH];
+
+      snprintf (descline, DIM(descline), "SETKEYDESC %s", desc);
+      err = assuan_transact (agent_ctx, descline,
+                             NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        return err;
+    }
+
+  memset (&parm, 0, sizeof parm);
+  parm.cn_parm.cache_nonce_addr = cache_nonce_addr;
+  parm.nkeys = nkeys;
+  parm.lens = r_resultlens;
+  parm.errs = r_errs;
+
+  init_membuf_secure (&data, 1024);
+  err = assuan_transact (agent_ctx, line,
+                         put_membuf_cb, &data,
+                         default_inq_cb, &dfltparm,
+                         export_keys_status_cb, &parm);
+  buf = get_membuf (&data, &len);
+  if (!err && !buf)
+    err = gpg_error_from_syserror ();
+  if (!err && parm.nseen != nkeys)
+    err = gpg_error (GPG_ERR_INV_RESPONSE);
+
+  /* Split the concatenated wrapped keys.  */
+  for (off=0, i=0; !err && i < nkeys; i++)
+    {
+      if (r_errs[i])
+        continue;
+      if (r_resultlens[i] > len - off)
+        {
+          err = gpg_error (GPG_ERR_INV_RESPONSE);
+          break;
+        }
+      r_results[i] = xtrymalloc (r_resultlens[i]);
+      if (!r_results[i])
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      memcpy (r_results[i], buf + off, r_resultlens[i]);
+      off += r_resultlens[i];
+    }
+  xfree (buf);
+  if (err)
+    {
+      for (i=0; i < nkeys; i++)
+        {
+          xfree (r_results[i]);
+          r_results[i] = NULL;
+          r_resultlens[i] = 0;
+          r_errs[i] = err;
+        }
+    }
+  return err;
+}
+
+
 /* Status callback for handling confirmation.  */
 static gpg_error_t
 confirm_status_cb (void *opaque, const char *line)
@@ -176,10 +176,35 @@ unsigned long agent_get_s2k_count (void);
    0 if not available, positive value if the secret key is available. */
 int agent_probe_secret_key (ctrl_t ctrl, PKT_public_key *pk);
 
+/* Return the expected cost of using the secret key for PK; -1 if
+   there is no secret key.  */
+int agent_secret_key_cost (ctrl_t ctrl, PKT_public_key *pk);
+
 /* Ask the agent whether a secret key is available for any of the
    keys (primary or sub) in KEYBLOCK.  Returns 0 if available.  */
 gpg_error_t agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock);
 
+/* The availability of a secret key as returned by
+   agent_probe_secret_keys.  RANK has the same values as returned by
+   agent_probe_secret_key.  */
+struct secret_key_rank_s
+{
+  PKT_public_key *pk;
+  int rank;
+};
+
+/* Ask the agent for the availability of the secret keys of all keys
+   in KEYBLOCK in one go.  */
+gpg_error_t agent_probe_secret_keys (ctrl_t ctrl, kbnode_t keyblock,
+                                     struct secret_key_rank_s **r_ranks);
+
+/* Return the rank of PK from RANKS or -1 if not known.  */
+int agent_secret_key_rank (struct secret_key_rank_s *ranks,
+                           PKT_public_key *pk);
+
+/* Return true if any key in RANKS has a secret key.  */
+int agent_any_secret_key_rank (struct secret_key_rank_s *ranks);
+
 
 /* Return infos about the secret key with HEXKEYGRIP.  */
 gpg_error_t agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
@@ -192,6 +217,24 @@ gpg_error_t agent_genkey (ctrl_t ctrl,
                           const char *passphrase,
                           gcry_sexp_t *r_pubkey);
 
+/* A key to be generated by agent_genkey_parallel.  */
+typedef struct agent_genkey_job_s *agent_genkey_job_t;
+struct agent_genkey_job_s
+{
+  agent_genkey_job_t next;
+  const char *keyparms;
+  int no_protection;
+  const char *passphrase;
+  int done;             /* Set when the agent has been asked.  */
+  gpg_error_t err;      /* The result and ...  */
+  gcry_sexp_t pubkey;   /* ... the public key on success.  */
+  char *cache_nonce;
+};
+
+/* Generate several new keys in parallel.  */
+gpg_error_t agent_genkey_parallel (ctrl_t ctrl, agent_genkey_job_t jobs,
+                                   unsigned int nconn);
+
 /* Read a public key.  FROMCARD may be 0, 1, or 2. */
 gpg_error_t agent_readkey (ctrl_t ctrl, int fromcard, const char *hexkeygrip,
                            unsigned char **r_pubkey);
@@ -204,6 +247,13 @@ gpg_error_t agent_pksign (ctrl_t ctrl, const char *cache_nonce,
                           int digestalgo,
                           gcry_sexp_t *r_sigval);
 
+/* Create signatures with several keys.  */
+gpg_error_t agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                                unsigned int njobs,
+                                char **keygrips, char **descs,
+                                unsigned char **digests, int *digestalgos,
+                                gcry_sexp_t *r_sigvals);
+
 /* Decrypt a ciphertext.  */
 gpg_error_t agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
                              u32 *keyid, u32 *mainkeyid, int pubkey_algo,
@@ -211,6 +261,22 @@ gpg_error_t agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
                              unsigned char **r_buf, size_t *r_buflen,
                              int *r_padding);
 
+/* Decrypt several ciphertexts with the same key.  */
+gpg_error_t agent_pkdecrypt_batch (ctrl_t ctrl, const char *keygrip,
+                                   const char *desc,
+                                   u32 *keyid, u32 *mainkeyid, int pubkey_algo,
+                                   gcry_sexp_t *s_ciphertexts,
+                                   unsigned int nciphertexts,
+                                   unsigned char **r_bufs, size_t *r_buflens,
+                                   int *r_paddings);
+
+/* Trial decrypt a ciphertext with several keys.  */
+gpg_error_t agent_pkdecrypt_trial (ctrl_t ctrl,
+                                   char **keygrips, unsigned int nkeys,
+                                   gcry_sexp_t s_ciphertext,
+                                   unsigned char **r_bufs, size_t *r_buflens,
+                                   gpg_error_t *r_errs);
+
 /* Retrieve a key encryption key.  */
 gpg_error_t agent_keywrap_key (ctrl_t ctrl, int forexport,
                                void **r_kek, size_t *r_keklen);
@@ -221,6 +287,10 @@ gpg_error_t agent_import_key (ctrl_t ctrl, const char *desc,
                               size_t keylen, int unattended, int force,
                               u32 *keyid, u32 *mainkeyid, int pubkey_algo);
 
+/* Start and end a batch of key imports.  */
+void agent_import_key_begin_batch (void);
+gpg_error_t agent_import_key_end_batch (ctrl_t ctrl);
+
 /* Receive a key from the agent.  */
 gpg_error_t agent_export_key (ctrl_t ctrl, const char *keygrip,
                               const char *desc, int openpgp_protected,
@@ -228,6 +298,14 @@ gpg_error_t agent_export_key (ctrl_t ctrl, const char *keygrip,
                               unsigned char **r_result, size_t *r_resultlen,
                               u32 *keyid, u32 *mainkeyid, int pubkey_algo);
 
+/* Receive several keys from the agent.  */
+gpg_error_t agent_export_keys (ctrl_t ctrl, char **hexkeygrips,
+                               unsigned int nkeys, const char *desc,
+                               int openpgp_protected, char **cache_nonce_addr,
+                               unsigned char **r_results, size_t *r_resultlens,
+                               gpg_error_t *r_errs,
+                               u32 *keyid, u32 *mainkeyid, int pubkey_algo);
+
 /* Delete a key from the agent.  */
 gpg_error_t agent_delete_key (ctrl_t ctrl, const char *hexkeygrip,
                               const char *desc, int force);
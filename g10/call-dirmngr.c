@@ -36,6 +36,7 @@
 #include "options.h"
 #include "../common/i18n.h"
 #include "../common/asshelp.h"
+#include "../common/metrics.h"
 #include "../common/keyserver.h"
 #include "../common/status.h"
 #include "call-dirmngr.h"
@@ -46,6 +47,10 @@
  * reasonable.  So we set a generous limit of 256 KiB.  */
 #define MAX_WKD_RESULT_LENGTH   (256 * 1024)
 
+/* The maximum number of requests dirmngr accepts for one BATCH
+ * command.  */
+#define MAX_BATCH_REQUESTS 256
+
 
 /* Parameter structure used to gather status info.  Note that it is
  * also used for WKD requests.  */
@@ -96,6 +101,19 @@ struct dns_cert_parm_s
 };
 
 
+/* Parameter structure used with the BATCH command.  */
+struct batch_parm_s
+{
+  assuan_context_t ctx;
+  char **names;         /* The mail addresses to look up.  */
+  unsigned int nnames;  /* Number of items in NAMES.  */
+  estream_t *keys;      /* Array with the results for NAMES.  */
+  gpg_error_t *errs;    /* Array with the error codes for NAMES.  */
+  int current;          /* Index of the result being received or -1.  */
+  struct ks_status_parm_s stparm;  /* For the other status lines.  */
+};
+
+
 /* Data used to associate an session with dirmngr contexts.  We can't
    use a simple one to one mapping because we sometimes need two
    connections to the dirmngr; for example while doing a listing and
@@ -216,6 +234,7 @@ create_context (ctrl_t ctrl, assuan_context_t *r_ctx)
       /* Tell the dirmngr that we want to collect audit event. */
       /* err = assuan_transact (agent_ctx, "OPTION audit-events=1", */
       /*                        NULL, NULL, NULL, NULL, NULL, NULL); */
+      send_trace_id (ctx, metric_trace_id ());
       if (opt.keyserver_options.http_proxy)
         {
           line = xtryasprintf ("OPTION http-proxy=%s",
@@ -363,6 +382,34 @@ close_context (ctrl_t ctrl, assuan_context_t ctx)
 }
 
 
+/* Release the context CTX instead of returning it to the pool.  This
+   needs to be done if a transaction has been aborted by us; the
+   connection is then out of sync.  Closing it also lets the dirmngr
+   stop the operation.  */
+static void
+discard_context (ctrl_t ctrl, assuan_context_t ctx)
+{
+  dirmngr_local_t dml, *dmlp;
+
+  if (!ctx)
+    return;
+
+  for (dmlp = &ctrl->dirmngr_local; (dml = *dmlp); dmlp = &dml->next)
+    {
+      if (dml->ctx == ctx)
+        {
+          if (!dml->is_active)
+            log_fatal ("discarding inactive dirmngr context %p\n", ctx);
+          *dmlp = dml->next;
+          assuan_release (dml->ctx);
+          xfree (dml);
+          return;
+        }
+    }
+  log_fatal ("discarding unknown dirmngr ctx %p\n", ctx);
+}
+
+
 /* Clear the set_keyservers_done flag on context CTX.  */
 static void
 clear_context_flags (ctrl_t ctrl, assuan_context_t ctx)
@@ -635,7 +682,12 @@ gpg_dirmngr_ks_search (ctrl_t ctrl, const char *searchstr,
   xfree (parm.helpbuf);
   xfree (stparm.source);
 
-  close_context (ctrl, ctx);
+  /* If the callback stopped the search, for example because the user
+   * quit the selection, the rest of the result is still pending.  */
+  if (parm.lasterr)
+    discard_context (ctrl, ctx);
+  else
+    close_context (ctrl, ctx);
   return err;
 }
 
@@ -669,6 +721,8 @@ ks_get_data_cb (void *opaque, const void *data, size_t datalen)
    server.
 
    If QUICK is set the dirmngr is advised to use a shorter timeout.
+   If more than one pattern is given the dirmngr is asked to fetch
+   them in parallel; the keys are still returned in pattern order.
 
    If R_SOURCE is not NULL the source of the data is stored as a
    malloced string there.  If a source is not known NULL is stored.
@@ -726,7 +780,10 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
 
   /* Lump all patterns into one string.  */
   init_membuf (&mb, 1024);
-  put_membuf_str (&mb, quick? "KS_GET --quick --" : "KS_GET --");
+  put_membuf_str (&mb, quick? "KS_GET --quick" : "KS_GET");
+  if (pattern[0] && pattern[1])
+    put_membuf_str (&mb, " --parallel");
+  put_membuf_str (&mb, " --");
   for (idx=0; pattern[idx]; idx++)
     {
       put_membuf (&mb, " ", 1); /* Append Delimiter.  */
@@ -1132,6 +1189,46 @@ gpg_dirmngr_ks_put (ctrl_t ctrl, void *data, size_t datalen, kbnode_t keyblock)
 }
 
 
+/* Send several keys to the configured server using one request.
+ * {DATA,DATALEN} contains the concatenated keys in OpenPGP binary
+ * transport format.  Returns GPG_ERR_NOT_SUPPORTED if the dirmngr
+ * does not support this or if it uses a keyserver which requires
+ * that keys are sent one by one.  */
+gpg_error_t
+gpg_dirmngr_ks_put_many (ctrl_t ctrl, void *data, size_t datalen)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  struct ks_put_parm_s parm;
+
+  memset (&parm, 0, sizeof parm);
+
+  err = open_context (ctrl, &ctx);
+  if (err)
+    return err;
+
+  /* Older dirmngr versions ignore unknown options and would thus
+   * pass several keys to an LDAP keyserver.  */
+  if (assuan_transact (ctx, "GETINFO cmd_has_option KS_PUT multi",
+                       NULL, NULL, NULL, NULL, NULL, NULL))
+    {
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+
+  parm.ctx = ctx;
+  parm.data = data;
+  parm.datalen = datalen;
+
+  err = assuan_transact (ctx, "KS_PUT --multi", NULL, NULL,
+                         ks_put_inq_cb, &parm, NULL, NULL);
+
+ leave:
+  close_context (ctrl, ctx);
+  return err;
+}
+
+
 
 /* Data callback for the DNS_CERT and WKD_GET commands. */
 static gpg_error_t
@@ -1431,3 +1528,186 @@ gpg_dirmngr_wkd_get (ctrl_t ctrl, const char *name, int quick,
   close_context (ctrl, ctx);
   return err;
 }
+
+
+
+/* Inquiry callback for the BATCH command used by
+ * gpg_dirmngr_wkd_get_many.  */
+static gpg_error_t
+wkd_batch_inq_cb (void *opaque, const char *line)
+{
+  struct batch_parm_s *parm = opaque;
+  gpg_error_t err;
+  membuf_t mb;
+  unsigned int idx;
+  char *buf;
+  size_t buflen;
+
+  if (!has_leading_keyword (line, "REQUESTS"))
+    return gpg_error (GPG_ERR_ASS_UNKNOWN_INQUIRE);
+
+  /* We use the index as tag.  */
+  init_membuf (&mb, 1024);
+  for (idx=0; idx < parm->nnames; idx++)
+    put_membuf_printf (&mb, "%u WKD_GET -- %s\n", idx, parm->names[idx]);
+  buf = get_membuf (&mb, &buflen);
+  if (!buf)
+    return gpg_error_from_syserror ();
+  err = assuan_send_data (parm->ctx, buf, buflen);
+  xfree (buf);
+  return err;
+}
+
+
+/* Status callback for the BATCH command used by
+ * gpg_dirmngr_wkd_get_many.  */
+static gpg_error_t
+wkd_batch_status_cb (void *opaque, const char *line)
+{
+  struct batch_parm_s *parm = opaque;
+  const char *s;
+  char *endp;
+  unsigned long idx;
+
+  if ((s = has_leading_keyword (line, "BATCH_BEGIN")))
+    {
+      idx = strtoul (s, &endp, 10);
+      if (endp == s || idx >= parm->nnames || parm->keys[idx])
+        return gpg_error (GPG_ERR_INV_RESPONSE);
+      parm->keys[idx] = es_fopenmem (MAX_WKD_RESULT_LENGTH, "rwb");
+      if (!parm->keys[idx])
+        return gpg_error_from_syserror ();
+      parm->current = idx;
+    }
+  else if ((s = has_leading_keyword (line, "BATCH_END")))
+    {
+      idx = strtoul (s, &endp, 10);
+      if (endp == s || parm->current < 0 || idx != (unsigned long)parm->current)
+        return gpg_error (GPG_ERR_INV_RESPONSE);
+      parm->errs[idx] = strtoul (endp, NULL, 10);
+      if (parm->errs[idx])
+        {
+          es_fclose (parm->keys[idx]);
+          parm->keys[idx] = NULL;
+        }
+      else
+        es_rewind (parm->keys[idx]);
+      parm->current = -1;
+    }
+  else
+    return ks_status_cb (&parm->stparm, line);
+
+  return 0;
+}
+
+
+/* Data callback for the BATCH command used by
+ * gpg_dirmngr_wkd_get_many.  */
+static gpg_error_t
+wkd_batch_data_cb (void *opaque, const void *data, size_t datalen)
+{
+  struct batch_parm_s *parm = opaque;
+
+  if (!data)
+    return 0;  /* Ignore END commands.  */
+  if (parm->current < 0)
+    return gpg_error (GPG_ERR_INV_RESPONSE);
+
+  if (es_write (parm->keys[parm->current], data, datalen, NULL))
+    {
+      if (gpg_err_code_from_syserror () == GPG_ERR_ENOSPC)
+        return gpg_error (GPG_ERR_TOO_LARGE);
+      return gpg_error_from_syserror ();
+    }
+  return 0;
+}
+
+
+/* Ask the dirmngr to retrieve the keys for the NNAMES mail addresses
+ * in NAMES via the Web Key Directory.  In contrast to calling
+ * gpg_dirmngr_wkd_get for each address the lookups are done
+ * concurrently by the dirmngr.  If DEADLINE is not zero no lookup is
+ * started after that many seconds.  On return R_KEYS[i] is either
+ * NULL or an estream with the key for NAMES[i] and R_ERRS[i] has the
+ * error code of that lookup.  The function returns an error only if
+ * the lookups could not be done at all; for example if the dirmngr
+ * does not support the BATCH command.  */
+gpg_error_t
+gpg_dirmngr_wkd_get_many (ctrl_t ctrl, char **names, unsigned int nnames,
+                          unsigned int deadline,
+                          estream_t *r_keys, gpg_error_t *r_errs)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  struct batch_parm_s parm;
+  time_t endtime = 0;
+  time_t now;
+  unsigned int idx, n;
+  char line[ASSUAN_LINELENGTH];
+
+  for (idx=0; idx < nnames; idx++)
+    {
+      r_keys[idx] = NULL;
+      r_errs[idx] = gpg_error (GPG_ERR_NO_DATA);
+    }
+
+  err = open_context (ctrl, &ctx);
+  if (err)
+    return err;
+
+  if (deadline)
+    endtime = time (NULL) + deadline;
+
+  memset (&parm, 0, sizeof parm);
+  parm.ctx = ctx;
+  for (idx=0; idx < nnames; idx += n)
+    {
+      n = nnames - idx;
+      if (n > MAX_BATCH_REQUESTS)
+        n = MAX_BATCH_REQUESTS;
+
+      if (endtime)
+        {
+          now = time (NULL);
+          if (now >= endtime)
+            {
+              for (; idx < nnames; idx++)
+                r_errs[idx] = gpg_error (GPG_ERR_TIMEOUT);
+              break;
+            }
+          snprintf (line, sizeof line, "BATCH --deadline=%u",
+                    (unsigned int)(endtime - now));
+        }
+      else
+        strcpy (line, "BATCH");
+
+      parm.names = names + idx;
+      parm.nnames = n;
+      parm.keys = r_keys + idx;
+      parm.errs = r_errs + idx;
+      parm.current = -1;
+      err = assuan_transact (ctx, line, wkd_batch_data_cb, &parm,
+                             wkd_batch_inq_cb, &parm,
+                             wkd_batch_status_cb, &parm);
+      if (!err && parm.current >= 0)
+        err = gpg_error (GPG_ERR_INV_RESPONSE);  /* Truncated result.  */
+      if (err)
+        {
+          if (gpg_err_code (err) == GPG_ERR_ASS_UNKNOWN_CMD)
+            err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          break;
+        }
+    }
+
+  if (err)
+    {
+      for (idx=0; idx < nnames; idx++)
+        {
+          es_fclose (r_keys[idx]);
+          r_keys[idx] = NULL;
+        }
+    }
+  xfree (parm.stparm.source);
+  close_context (ctrl, ctx);
+  return err;
+}
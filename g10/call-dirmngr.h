@@ -32,6 +32,7 @@ gpg_error_t gpg_dirmngr_ks_fetch (ctrl_t ctrl,
                                   const char *url, estream_t *r_fp);
 gpg_error_t gpg_dirmngr_ks_put (ctrl_t ctrl, void *data, size_t datalen,
                                 kbnode_t keyblock);
+gpg_error_t gpg_dirmngr_ks_put_many (ctrl_t ctrl, void *data, size_t datalen);
 gpg_error_t gpg_dirmngr_dns_cert (ctrl_t ctrl,
                                   const char *name, const char *certtype,
                                   estream_t *r_key,
@@ -42,6 +43,10 @@ gpg_error_t gpg_dirmngr_get_pka (ctrl_t ctrl, const char *userid,
                                  char **r_url);
 gpg_error_t gpg_dirmngr_wkd_get (ctrl_t ctrl, const char *name, int quick,
                                  estream_t *r_key, char **r_url);
+gpg_error_t gpg_dirmngr_wkd_get_many (ctrl_t ctrl,
+                                      char **names, unsigned int nnames,
+                                      unsigned int deadline,
+                                      estream_t *r_keys, gpg_error_t *r_errs);
 
 
 #endif /*GNUPG_G10_CALL_DIRMNGR_H*/
@@ -37,6 +37,7 @@
 #include "options.h"
 #include "../common/i18n.h"
 #include "../common/asshelp.h"
+#include "../common/metrics.h"
 #include "../common/host2net.h"
 #include "../common/exechelp.h"
 #include "../common/status.h"
@@ -70,12 +71,26 @@ struct keyboxd_local_s
     /* The found keyblock or the parsing error.   */
     kbnode_t found_keyblock;
     gpg_error_t found_err;
+
+    /* If set the next frame is not parsed but stored as is in
+     * RAW_BUFFER.  This is used for batch searches.  */
+    unsigned int want_raw : 1;
+    char *raw_buffer;
+    size_t raw_length;
   } datastream;
 
   /* I/O buffer with the last search result or NULL.  Used if
    * D-lines are used to convey the keyblocks. */
   iobuf_t search_result;
 
+  /* The records returned by a batch search and the offset of the
+   * next record to return.  */
+  struct {
+    char *buffer;
+    size_t length;
+    size_t offset;
+  } batch;
+
   /* This flag set while an operation is running on this context.  */
   unsigned int is_active : 1;
 
@@ -85,11 +100,39 @@ struct keyboxd_local_s
 
   /* Flag indicating that a search reset is required.  */
   unsigned int need_search_reset : 1;
+
+  /* Flag indicating that the last search was a batch search and thus
+   * NEXT takes the results from BATCH.  */
+  unsigned int in_batch : 1;
+
+  /* Flag indicating that BATCH holds results prefetched by a NEXT
+   * command and that more results may be fetched from the keyboxd.  */
+  unsigned int in_prefetch : 1;
+
+  /* The number of results to request with the next prefetch.  */
+  unsigned int prefetch_count;
+
+  /* Flag indicating that a write batch has been started on this
+   * context.  */
+  unsigned int in_write_batch : 1;
 };
 
 
+/* The length of the header of each record returned by a batch
+ * search.  See the description of the SEARCH command in keyboxd.  */
+#define BATCH_HDRLEN (12 + UBID_LEN)
+
+/* The number of search results fetched at once when walking over the
+ * results of a search.  We start with a small number so that a
+ * search which expects only a few results does not wait for the
+ * keyboxd to scan for more and double it with each fetch.  */
+#define PREFETCH_MIN 8
+#define PREFETCH_MAX 256
+
+
 /* Local prototypes.  */
 static void *datastream_thread (void *arg);
+static void release_batch_result (keyboxd_local_t kbl);
 
 
 
@@ -129,6 +172,9 @@ gpg_keyboxd_deinit_session_data (ctrl_t ctrl)
         {
           es_fclose (kbl->datastream.fp);
           kbl->datastream.fp = NULL;
+          xfree (kbl->datastream.raw_buffer);
+          kbl->datastream.raw_buffer = NULL;
+          release_batch_result (kbl);
           assuan_release (kbl->ctx);
           kbl->ctx = NULL;
         }
@@ -208,6 +254,7 @@ create_new_context (ctrl_t ctrl, assuan_context_t *r_ctx)
   else if (!err && !(err = warn_version_mismatch (ctx, KEYBOXD_NAME)))
     {
       /* Place to emit global options.  */
+      send_trace_id (ctx, metric_trace_id ());
     }
 
   if (err)
@@ -436,6 +483,7 @@ keydb_release (KEYDB_HANDLE hd)
         log_clock ("close_context (found)");
       if (!kbl->is_active)
         log_fatal ("closing inactive keyboxd context %p\n", kbl);
+      release_batch_result (kbl);
       kbl->is_active = 0;
       hd->kbl = NULL;
       hd->ctrl = NULL;
@@ -458,11 +506,76 @@ keydb_lock (KEYDB_HANDLE hd)
 }
 
 
+/* Start a bulk update.  For the keyboxd this starts a write batch so
+ * that all keyblocks stored until keydb_bulk_end are committed
+ * together.  See internal_keydb_bulk_begin for the other
+ * resources.  */
+void
+keydb_bulk_begin (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  keyboxd_local_t kbl;
+
+  if (!opt.use_keyboxd)
+    {
+      internal_keydb_bulk_begin (ctrl);
+      return;
+    }
+  if (opt.dry_run)
+    return;
+
+  err = open_context (ctrl, &kbl);
+  if (err)
+    {
+      log_info ("can't start bulk update of the keyboxd: %s\n",
+                gpg_strerror (err));
+      return;
+    }
+  err = assuan_transact (kbl->ctx, "TRANSACTION BEGIN",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+  if (!err)
+    kbl->in_write_batch = 1;
+  else if (gpg_err_code (err) != GPG_ERR_ASS_UNKNOWN_CMD)
+    log_info ("can't start bulk update of the keyboxd: %s\n",
+              gpg_strerror (err));
+  kbl->is_active = 0;
+}
+
+
+/* Finish a bulk update started by keydb_bulk_begin.  */
+void
+keydb_bulk_end (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  keyboxd_local_t kbl;
+
+  if (!opt.use_keyboxd)
+    {
+      internal_keydb_bulk_end (ctrl);
+      return;
+    }
+
+  /* The context may be in use by a database handle but no command
+   * is running on it.  */
+  for (kbl = ctrl->keyboxd_local; kbl; kbl = kbl->next)
+    if (kbl->in_write_batch)
+      break;
+  if (!kbl)
+    return;
+  kbl->in_write_batch = 0;
+  err = assuan_transact (kbl->ctx, "TRANSACTION COMMIT",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    log_error (_("error writing keyring '%s': %s\n"),
+               "[keyboxd]", gpg_strerror (err));
+}
+
+
 
 /* FIXME: This helper is duplicates code of partse_keyblock_image.  */
 static gpg_error_t
 keydb_get_keyblock_do_parse (iobuf_t iobuf, int pk_no, int uid_no,
-                             kbnode_t *r_keyblock)
+                             int self_sigs_only, kbnode_t *r_keyblock)
 {
   gpg_error_t err;
   struct parse_packet_ctx_s parsectx;
@@ -471,6 +584,7 @@ keydb_get_keyblock_do_parse (iobuf_t iobuf, int pk_no, int uid_no,
   kbnode_t node, *tail;
   int in_cert, save_mode;
   int pk_count, uid_count;
+  u32 main_kid[2] = { 0, 0 };
 
   *r_keyblock = NULL;
 
@@ -544,6 +658,22 @@ keydb_get_keyblock_do_parse (iobuf_t iobuf, int pk_no, int uid_no,
         }
       in_cert = 1;
 
+      /* Skip third-party signatures if requested.  Key and subkey
+       * revocations are kept because they may have been issued by a
+       * designated revoker.  */
+      if (self_sigs_only && pkt->pkttype == PKT_SIGNATURE
+          && (pkt->pkt.signature->keyid[0] != main_kid[0]
+              || pkt->pkt.signature->keyid[1] != main_kid[1])
+          && !IS_KEY_REV (pkt->pkt.signature)
+          && !IS_SUBKEY_REV (pkt->pkt.signature))
+        {
+          free_packet (pkt, &parsectx);
+          init_packet (pkt);
+          continue;
+        }
+      if (pkt->pkttype == PKT_PUBLIC_KEY || pkt->pkttype == PKT_SECRET_KEY)
+        keyid_from_pk (pkt->pkt.public_key, main_kid);
+
       node = new_kbnode (pkt);
 
       switch (pkt->pkttype)
@@ -636,9 +766,39 @@ datastream_thread (void *arg)
       datalen = buf32_to_size_t (lenbuf);
       /* log_debug ("keyboxd announced %zu bytes\n", datalen); */
 
+      if (kbl->datastream.want_raw)
+        {
+          /* Read the records of a batch search.  */
+          char *buffer;
+
+          kbl->datastream.want_raw = 0;
+          buffer = xtrymalloc (datalen? datalen : 1);
+          if (!buffer)
+            err = gpg_error_from_syserror ();
+          else if (es_read (kbl->datastream.fp, buffer, datalen, &nread))
+            err = gpg_error_from_syserror ();
+          else if (nread != datalen)
+            err = gpg_error (GPG_ERR_EIO);
+          else
+            err = 0;
+          if (err)
+            {
+              log_error ("error reading data from keyboxd: %s\n",
+                         gpg_strerror (err));
+              xfree (buffer);
+              kbl->datastream.found_err = err;
+            }
+          else
+            {
+              kbl->datastream.raw_buffer = buffer;
+              kbl->datastream.raw_length = datalen;
+            }
+          goto signal;
+        }
+
       iobuf = iobuf_esopen (kbl->datastream.fp, "rb", 1, datalen);
       pk_no = uid_no = 0;  /* FIXME: Get this from the keyboxd.  */
-      err = keydb_get_keyblock_do_parse (iobuf, pk_no, uid_no, &keyblock);
+      err = keydb_get_keyblock_do_parse (iobuf, pk_no, uid_no, 0, &keyblock);
       iobuf_close (iobuf);
       if (!err)
         {
@@ -659,6 +819,7 @@ datastream_thread (void *arg)
           release_kbnode (tmpkeyblock);
         }
 
+    signal:
       /* Tell the main thread.  */
       lock_datastream (kbl);
       rc = npth_cond_signal (&kbl->datastream.cond);
@@ -709,7 +870,8 @@ keydb_get_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb)
     {
       pk_no = uid_no = 0;  /*FIXME: Get this from the keyboxd.  */
       err = keydb_get_keyblock_do_parse (hd->kbl->search_result,
-                                         pk_no, uid_no, ret_kb);
+                                         pk_no, uid_no,
+                                         hd->self_sigs_only, ret_kb);
       /* In contrast to the old code we close the iobuf here and thus
        * this function may be called only once to get a keyblock.  */
       iobuf_close (hd->kbl->search_result);
@@ -982,6 +1144,319 @@ search_status_cb (void *opaque, const char *line)
 }
 
 
+/* Release the records of a batch search stored at KBL.  */
+static void
+release_batch_result (keyboxd_local_t kbl)
+{
+  xfree (kbl->batch.buffer);
+  kbl->batch.buffer = NULL;
+  kbl->batch.length = kbl->batch.offset = 0;
+  kbl->in_batch = 0;
+  kbl->in_prefetch = 0;
+  kbl->prefetch_count = 0;
+}
+
+
+/* Return the next record of a batch search.  The keyblock is stored
+ * as search result and the index of the matching search description
+ * at R_DESCINDEX.  Returns GPG_ERR_NOT_FOUND if no more records are
+ * available.  */
+static gpg_error_t
+next_batch_result (KEYDB_HANDLE hd, size_t *r_descindex)
+{
+  keyboxd_local_t kbl = hd->kbl;
+  const unsigned char *p;
+  size_t datalen;
+
+  hd->last_ubid_valid = 0;
+  for (;;)
+    {
+      if (kbl->batch.length - kbl->batch.offset < BATCH_HDRLEN)
+        return gpg_error (GPG_ERR_NOT_FOUND);
+
+      p = (const unsigned char *)kbl->batch.buffer + kbl->batch.offset;
+      datalen = buf32_to_size_t (p);
+      if (datalen > kbl->batch.length - kbl->batch.offset - BATCH_HDRLEN)
+        {
+          log_error ("invalid batch record received from keyboxd\n");
+          kbl->batch.offset = kbl->batch.length;
+          return gpg_error (GPG_ERR_INV_RESPONSE);
+        }
+      kbl->batch.offset += BATCH_HDRLEN + datalen;
+
+      /* Silently skip all keys which are not OpenPGP keys.  */
+      if (buf32_to_uint (p + 8) == PUBKEY_TYPE_OPGP)
+        break;
+    }
+
+  if (r_descindex)
+    *r_descindex = buf32_to_size_t (p + 4);
+  memcpy (hd->last_ubid, p + 12, UBID_LEN);
+  hd->last_ubid_valid = 1;
+  hd->kbl->search_result = iobuf_temp_with_content (p + BATCH_HDRLEN,
+                                                    datalen);
+  return 0;
+}
+
+
+/* Format the search command for the description DESC into the
+ * buffer LINE of size LINESIZE.  PREFIX is the command and its
+ * options, for example "SEARCH --more".  */
+static gpg_error_t
+format_search_line (char *line, size_t linesize, const char *prefix,
+                    KEYDB_SEARCH_DESC *desc)
+{
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_EXACT:
+      snprintf (line, linesize, "%s =%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SUBSTR:
+      snprintf (line, linesize, "%s *%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAIL:
+      snprintf (line, linesize, "%s <%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAILSUB:
+      snprintf (line, linesize, "%s @%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_MAILEND:
+      snprintf (line, linesize, "%s .%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_WORDS:
+      snprintf (line, linesize, "%s +%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+      snprintf (line, linesize, "%s 0x%08lX", prefix,
+                (ulong)desc->u.kid[1]);
+      break;
+
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      snprintf (line, linesize, "%s 0x%08lX%08lX", prefix,
+                (ulong)desc->u.kid[0], (ulong)desc->u.kid[1]);
+      break;
+
+    case KEYDB_SEARCH_MODE_FPR:
+      {
+        unsigned char hexfpr[MAX_FINGERPRINT_LEN * 2 + 1];
+        log_assert (desc->fprlen <= MAX_FINGERPRINT_LEN);
+        bin2hex (desc->u.fpr, desc->fprlen, hexfpr);
+        snprintf (line, linesize, "%s 0x%s", prefix, hexfpr);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_ISSUER:
+      snprintf (line, linesize, "%s #/%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_ISSUER_SN:
+    case KEYDB_SEARCH_MODE_SN:
+      snprintf (line, linesize, "%s #%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_SUBJECT:
+      snprintf (line, linesize, "%s /%s", prefix, desc->u.name);
+      break;
+
+    case KEYDB_SEARCH_MODE_KEYGRIP:
+      {
+        unsigned char hexgrip[KEYGRIP_LEN * 2 + 1];
+        bin2hex (desc->u.grip, KEYGRIP_LEN, hexgrip);
+        snprintf (line, linesize, "%s &%s", prefix, hexgrip);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_UBID:
+      {
+        unsigned char hexubid[UBID_LEN * 2 + 1];
+        bin2hex (desc->u.ubid, UBID_LEN, hexubid);
+        snprintf (line, linesize, "%s ^%s", prefix, hexubid);
+      }
+      break;
+
+    case KEYDB_SEARCH_MODE_FIRST:
+      snprintf (line, linesize, "%s", prefix);
+      break;
+
+    case KEYDB_SEARCH_MODE_NEXT:
+      log_debug ("%s: mode next - we should not get to here!\n", __func__);
+      snprintf (line, linesize, "NEXT");
+      break;
+
+    default:
+      return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  return 0;
+
+
+}
+
+
+/* Send the command LINE which returns its results in the record
+ * format of "SEARCH --batch" and store the records at the handle.  */
+static gpg_error_t
+receive_batch_result (KEYDB_HANDLE hd, const char *line)
+{
+  gpg_error_t err;
+  membuf_t data;
+  size_t len;
+
+  if (hd->kbl->datastream.fp)
+    {
+      /* The records are received by the datastream thread as one
+       * frame.  Tell it not to parse that frame.  */
+      int rc;
+
+      lock_datastream (hd->kbl);
+      hd->kbl->datastream.found_err = 0;
+      hd->kbl->datastream.want_raw = 1;
+      unlock_datastream (hd->kbl);
+
+      err = assuan_transact (hd->kbl->ctx, line,
+                             NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        {
+          /* Nothing has been written to the data stream.  */
+          hd->kbl->datastream.want_raw = 0;
+          return err;
+        }
+
+      lock_datastream (hd->kbl);
+      if (!hd->kbl->datastream.raw_buffer && !hd->kbl->datastream.found_err)
+        {
+          rc = npth_cond_wait (&hd->kbl->datastream.cond,
+                               &hd->kbl->datastream.mutex);
+          if (rc)
+            {
+              err = gpg_error_from_errno (rc);
+              log_error ("%s: waiting on condition failed: %s\n",
+                         __func__, gpg_strerror (err));
+            }
+        }
+      if (!err)
+        err = hd->kbl->datastream.found_err;
+      hd->kbl->batch.buffer = hd->kbl->datastream.raw_buffer;
+      len = hd->kbl->datastream.raw_length;
+      hd->kbl->datastream.raw_buffer = NULL;
+      hd->kbl->datastream.raw_length = 0;
+      unlock_datastream (hd->kbl);
+      if (!err && !hd->kbl->batch.buffer)
+        err = gpg_error (GPG_ERR_INTERNAL);
+      if (err)
+        {
+          xfree (hd->kbl->batch.buffer);
+          hd->kbl->batch.buffer = NULL;
+          return err;
+        }
+    }
+  else /* D-line version if fd-passing was not successful.  */
+    {
+      init_membuf (&data, 8192);
+      err = assuan_transact (hd->kbl->ctx, line,
+                             put_membuf_cb, &data,
+                             NULL, NULL, NULL, NULL);
+      if (err)
+        {
+          xfree (get_membuf (&data, &len));
+          return err;
+        }
+
+      hd->kbl->batch.buffer = get_membuf (&data, &len);
+      if (!hd->kbl->batch.buffer)
+        return gpg_error_from_syserror ();
+    }
+
+  hd->kbl->batch.length = len;
+  hd->kbl->batch.offset = 0;
+  return 0;
+}
+
+
+/* Run a batch search for the NDESC descriptions in DESC.  All
+ * results are stored at the handle and then returned one by one by
+ * the next calls to keydb_search.  */
+static gpg_error_t
+batch_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+              size_t *r_descindex)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  size_t n;
+
+  /* Check all descriptions first so that we do not leave the keyboxd
+   * waiting for more patterns.  */
+  for (n=0; n < ndesc; n++)
+    if ((err = format_search_line (line, sizeof line, "SEARCH", desc + n)))
+      return err;
+
+  for (n=0; n + 1 < ndesc; n++)
+    {
+      err = format_search_line (line, sizeof line, "SEARCH --more", desc + n);
+      if (!err)
+        err = assuan_transact (hd->kbl->ctx, line,
+                               NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        return err;
+    }
+
+  err = format_search_line (line, sizeof line, "SEARCH --batch", desc + n);
+  if (err)
+    return err;
+
+  err = receive_batch_result (hd, line);
+  if (err)
+    return err;
+  hd->kbl->in_batch = 1;
+
+  return next_batch_result (hd, r_descindex);
+}
+
+
+/* Return the next result of the current search.  The results are
+ * fetched from the keyboxd in chunks so that walking over a large
+ * result set, as done by --list-keys, does not require a round trip
+ * to the keyboxd for each key.  */
+static gpg_error_t
+prefetch_search (KEYDB_HANDLE hd, size_t *r_descindex)
+{
+  keyboxd_local_t kbl = hd->kbl;
+  char line[ASSUAN_LINELENGTH];
+  gpg_error_t err;
+
+  if (kbl->in_prefetch)
+    {
+      err = next_batch_result (hd, r_descindex);
+      if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        return err;
+      /* The prefetched results are exhausted.  */
+      xfree (kbl->batch.buffer);
+      kbl->batch.buffer = NULL;
+      kbl->batch.length = kbl->batch.offset = 0;
+      kbl->in_prefetch = 0;
+    }
+
+  if (!kbl->prefetch_count)
+    kbl->prefetch_count = PREFETCH_MIN;
+  else if (kbl->prefetch_count < PREFETCH_MAX)
+    kbl->prefetch_count *= 2;
+
+  snprintf (line, sizeof line, "NEXT --count=%u", kbl->prefetch_count);
+  err = receive_batch_result (hd, line);
+  if (err)
+    return err;
+  kbl->in_prefetch = 1;
+
+  return next_batch_result (hd, r_descindex);
+}
+
+
 /* Search the database for keys matching the search description.  If
  * the DB contains any legacy keys, these are silently ignored.
  *
@@ -1048,7 +1523,13 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
     }
 
   /* Check whether this is a NEXT search.  */
-  if (!hd->kbl->need_search_reset)
+  if (!hd->kbl->need_search_reset && hd->kbl->in_batch)
+    {
+      /* The keyboxd has already returned all results of the batch.  */
+      err = next_batch_result (hd, descindex);
+      goto leave;
+    }
+  else if (!hd->kbl->need_search_reset)
     {
       /* No reset requested thus continue the search.  The keyboxd
        * keeps the context of the search and thus the NEXT operates on
@@ -1057,11 +1538,12 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
        * search pattern between searches but that is not anymore
        * supported by keyboxd and a cursory check does not show that
        * we actually made used of that misfeature.  */
-      snprintf (line, sizeof line, "NEXT");
-      goto do_search;
+      err = prefetch_search (hd, descindex);
+      goto leave;
     }
 
   hd->kbl->need_search_reset = 0;
+  release_batch_result (hd->kbl);
 
   if (!ndesc)
     {
@@ -1069,96 +1551,26 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       goto leave;
     }
 
-  /* FIXME: Implement --multi */
-  switch (desc->mode)
+  /* A batch search returns all results at once.  This is not
+   * possible for FIRST and NEXT which are meant to list the entire
+   * database.  */
+  if (ndesc > 1)
     {
-    case KEYDB_SEARCH_MODE_EXACT:
-      snprintf (line, sizeof line, "SEARCH =%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SUBSTR:
-      snprintf (line, sizeof line, "SEARCH *%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAIL:
-      snprintf (line, sizeof line, "SEARCH <%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAILSUB:
-      snprintf (line, sizeof line, "SEARCH @%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_MAILEND:
-      snprintf (line, sizeof line, "SEARCH .%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_WORDS:
-      snprintf (line, sizeof line, "SEARCH +%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SHORT_KID:
-      snprintf (line, sizeof line, "SEARCH 0x%08lX",
-                (ulong)desc->u.kid[1]);
-      break;
-
-    case KEYDB_SEARCH_MODE_LONG_KID:
-      snprintf (line, sizeof line, "SEARCH 0x%08lX%08lX",
-                (ulong)desc->u.kid[0], (ulong)desc->u.kid[1]);
-      break;
-
-    case KEYDB_SEARCH_MODE_FPR:
-      {
-        unsigned char hexfpr[MAX_FINGERPRINT_LEN * 2 + 1];
-        log_assert (desc[0].fprlen <= MAX_FINGERPRINT_LEN);
-        bin2hex (desc[0].u.fpr, desc[0].fprlen, hexfpr);
-        snprintf (line, sizeof line, "SEARCH 0x%s", hexfpr);
-      }
-      break;
-
-    case KEYDB_SEARCH_MODE_ISSUER:
-      snprintf (line, sizeof line, "SEARCH #/%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_ISSUER_SN:
-    case KEYDB_SEARCH_MODE_SN:
-      snprintf (line, sizeof line, "SEARCH #%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_SUBJECT:
-      snprintf (line, sizeof line, "SEARCH /%s", desc[0].u.name);
-      break;
-
-    case KEYDB_SEARCH_MODE_KEYGRIP:
-      {
-        unsigned char hexgrip[KEYGRIP_LEN * 2 + 1];
-        bin2hex (desc[0].u.grip, KEYGRIP_LEN, hexgrip);
-        snprintf (line, sizeof line, "SEARCH &%s", hexgrip);
-      }
-      break;
-
-    case KEYDB_SEARCH_MODE_UBID:
-      {
-        unsigned char hexubid[UBID_LEN * 2 + 1];
-        bin2hex (desc[0].u.ubid, UBID_LEN, hexubid);
-        snprintf (line, sizeof line, "SEARCH ^%s", hexubid);
-      }
-      break;
-
-    case KEYDB_SEARCH_MODE_FIRST:
-      snprintf (line, sizeof line, "SEARCH");
-      break;
-
-    case KEYDB_SEARCH_MODE_NEXT:
-      log_debug ("%s: mode next - we should not get to here!\n", __func__);
-      snprintf (line, sizeof line, "NEXT");
-      break;
-
-    default:
-      err = gpg_error (GPG_ERR_INV_ARG);
-      goto leave;
+      for (i = 0; i < ndesc; i++)
+        if (desc[i].mode == KEYDB_SEARCH_MODE_FIRST
+            || desc[i].mode == KEYDB_SEARCH_MODE_NEXT)
+          break;
+      if (i == ndesc)
+        {
+          err = batch_search (hd, desc, ndesc, descindex);
+          goto leave;
+        }
     }
 
- do_search:
+  err = format_search_line (line, sizeof line, "SEARCH", desc);
+  if (err)
+    goto leave;
+
   hd->last_ubid_valid = 0;
   if (hd->kbl->datastream.fp)
     {
@@ -32,12 +32,50 @@
 #include "packet.h"
 #include "options.h"
 #include "main.h"
+#include "workpool.h"
 
 
 /* The size of the buffer we allocate to encrypt the data.  This must
  * be a multiple of the OCB blocksize (16 byte).  */
 #define AEAD_ENC_BUFFER_SIZE (64*1024)
 
+/* The maximum amount of memory used for the chunk buffers of the
+ * parallel encryption.  Each buffer holds a complete chunk and thus
+ * the parallel mode is only used with a small enough chunk size.  */
+#define AEAD_PARALLEL_MAX_MEM (64*1024*1024)
+
+/* The maximum number of chunks processed in parallel.  Each one
+ * requires its own cipher handle in secure memory and that memory is
+ * quite limited.  */
+#define AEAD_PARALLEL_MAX_CHUNKS 8
+
+
+/* A chunk for the parallel encryption.  */
+struct aead_chunk_s
+{
+  struct workpool_job_s work;
+  gcry_cipher_hd_t cipher_hd;  /* The handle used for this chunk.  */
+  int busy;           /* The chunk has been submitted to the pool.  */
+  gpg_error_t err;    /* The result of the encryption.  */
+  size_t buflen;      /* Used length of BUFFER w/o the tag.  */
+  byte *buffer;       /* Room for a complete chunk and the tag.  */
+};
+
+/* The chunks are used as a ring buffer: The chunk at CUR is filled
+ * while the chunks after it are encrypted by the worker pool.  Before
+ * CUR is advanced to the next chunk that one is waited for and
+ * written out.  Thus the chunks are written in order.  */
+struct aead_chunk_pool_s
+{
+  unsigned int nchunks;
+  unsigned int cur;
+  struct aead_chunk_s chunks[1];
+};
+
+
+static void setup_chunk_pool (cipher_filter_context_t *cfx,
+                              enum gcry_cipher_modes ciphermode);
+
 
 /* Wrapper around iobuf_write to make sure that a proper error code is
  * always returned.  */
@@ -55,12 +93,13 @@ my_iobuf_write (iobuf_t a, const void *buffer, size_t buflen)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  If
- * FINAL is set the final AEAD chunk is processed.  This also reset
- * the encryption machinery so that the handle can be used for a new
- * chunk.  */
+/* Set the nonce and the additional data for the chunk with index
+ * CHUNKINDEX into the cipher handle HD.  If FINAL is set the final
+ * AEAD chunk is processed.  This also reset the encryption machinery
+ * so that the handle can be used for a new chunk.  */
 static gpg_error_t
-set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+set_chunk_nonce_and_ad (cipher_filter_context_t *cfx, gcry_cipher_hd_t hd,
+                        uint64_t chunkindex, int final)
 {
   gpg_error_t err;
   unsigned char nonce[16];
@@ -83,18 +122,18 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
       BUG ();
     }
 
-  nonce[i++] ^= cfx->chunkindex >> 56;
-  nonce[i++] ^= cfx->chunkindex >> 48;
-  nonce[i++] ^= cfx->chunkindex >> 40;
-  nonce[i++] ^= cfx->chunkindex >> 32;
-  nonce[i++] ^= cfx->chunkindex >> 24;
-  nonce[i++] ^= cfx->chunkindex >> 16;
-  nonce[i++] ^= cfx->chunkindex >>  8;
-  nonce[i++] ^= cfx->chunkindex;
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
 
   if (DBG_CRYPTO)
     log_printhex (nonce, 15, "nonce:");
-  err = gcry_cipher_setiv (cfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -103,14 +142,14 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
   ad[2] = cfx->dek->algo;
   ad[3] = cfx->dek->use_aead;
   ad[4] = cfx->chunkbyte;
-  ad[5] = cfx->chunkindex >> 56;
-  ad[6] = cfx->chunkindex >> 48;
-  ad[7] = cfx->chunkindex >> 40;
-  ad[8] = cfx->chunkindex >> 32;
-  ad[9] = cfx->chunkindex >> 24;
-  ad[10]= cfx->chunkindex >> 16;
-  ad[11]= cfx->chunkindex >>  8;
-  ad[12]= cfx->chunkindex;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
       ad[13] = cfx->total >> 56;
@@ -124,7 +163,15 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
     }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (cfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* Set the nonce and the additional data for the current chunk.  */
+static gpg_error_t
+set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+{
+  return set_chunk_nonce_and_ad (cfx, cfx->cipher_hd, cfx->chunkindex, final);
 }
 
 
@@ -200,6 +247,8 @@ write_header (cipher_filter_context_t *cfx, iobuf_t a)
   if (err)
     return err;
 
+  setup_chunk_pool (cfx, ciphermode);
+
   cfx->wrote_header = 1;
 
  leave:
@@ -253,6 +302,203 @@ write_final_chunk (cipher_filter_context_t *cfx, iobuf_t a)
 }
 
 
+/* Release the chunks of the parallel encryption.  This waits for
+ * chunks still being encrypted.  */
+static void
+release_chunk_pool (cipher_filter_context_t *cfx)
+{
+  struct aead_chunk_pool_s *pool = cfx->chunkpool;
+  struct aead_chunk_s *c;
+  unsigned int i;
+
+  if (!pool)
+    return;
+
+  for (i=0; i < pool->nchunks; i++)
+    {
+      c = pool->chunks + i;
+      if (c->busy)
+        workpool_wait (&c->work);
+      gcry_cipher_close (c->cipher_hd);
+      xfree (c->buffer);
+    }
+  xfree (pool);
+  cfx->chunkpool = NULL;
+}
+
+
+/* Prepare for parallel encryption.  If that is not possible or not
+ * useful CFX->CHUNKPOOL is left at NULL and the chunks are encrypted
+ * one after the other.  */
+static void
+setup_chunk_pool (cipher_filter_context_t *cfx,
+                  enum gcry_cipher_modes ciphermode)
+{
+  gpg_error_t err;
+  struct aead_chunk_pool_s *pool;
+  struct aead_chunk_s *c;
+  unsigned int nchunks, i;
+
+  /* With tiny chunks the threading overhead is larger than the gain;
+   * with huge chunks we would need too much memory.  */
+  if (cfx->chunksize < AEAD_ENC_BUFFER_SIZE
+      || cfx->chunksize + 16 > AEAD_PARALLEL_MAX_MEM / 3)
+    return;
+
+  /* Use two chunks per worker so that the workers can go on while
+   * the finished chunks are written and the next ones are filled.  */
+  nchunks = 2 * workpool_init ();
+  if (nchunks > AEAD_PARALLEL_MAX_CHUNKS)
+    nchunks = AEAD_PARALLEL_MAX_CHUNKS;
+  if (nchunks > AEAD_PARALLEL_MAX_MEM / (cfx->chunksize + 16))
+    nchunks = AEAD_PARALLEL_MAX_MEM / (cfx->chunksize + 16);
+  if (nchunks < 3)
+    return;
+
+  pool = xtrycalloc (1, sizeof *pool + (nchunks - 1) * sizeof *pool->chunks);
+  if (!pool)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  pool->nchunks = nchunks;
+  cfx->chunkpool = pool;
+
+  for (i=0; i < nchunks; i++)
+    {
+      c = pool->chunks + i;
+      c->buffer = xtrymalloc (cfx->chunksize + 16);
+      if (!c->buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = openpgp_cipher_open (&c->cipher_hd, cfx->dek->algo,
+                                 ciphermode, GCRY_CIPHER_SECURE);
+      if (!err)
+        err = gcry_cipher_setkey (c->cipher_hd,
+                                  cfx->dek->key, cfx->dek->keylen);
+      if (err)
+        goto leave;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("using %u chunks for parallel encryption\n", nchunks);
+
+ leave:
+  if (err)
+    {
+      if (opt.verbose)
+        log_info ("parallel encryption not possible: %s\n",
+                  gpg_strerror (err));
+      release_chunk_pool (cfx);
+    }
+}
+
+
+/* The job function to encrypt a chunk on the worker pool.  The nonce
+ * and the additional data have already been set.  */
+static void
+encrypt_chunk (void *arg)
+{
+  struct aead_chunk_s *c = arg;
+  gpg_error_t err;
+
+  err = gcry_cipher_final (c->cipher_hd);
+  if (!err)
+    err = gcry_cipher_encrypt (c->cipher_hd, c->buffer, c->buflen, NULL, 0);
+  if (!err)
+    err = gcry_cipher_gettag (c->cipher_hd, c->buffer + c->buflen, 16);
+  c->err = err;
+}
+
+
+/* Wait until the chunk C has been encrypted and write it along with
+ * its tag to stream A.  */
+static gpg_error_t
+flush_chunk (iobuf_t a, struct aead_chunk_s *c)
+{
+  gpg_error_t err;
+
+  if (!c->busy)
+    return 0;
+
+  workpool_wait (&c->work);
+  c->busy = 0;
+  err = c->err;
+  if (err)
+    log_error ("encrypting chunk failed: %s\n", gpg_strerror (err));
+  else
+    err = my_iobuf_write (a, c->buffer, c->buflen + 16);
+  c->buflen = 0;
+  return err;
+}
+
+
+/* Hand the current chunk over to the worker pool and advance to the
+ * next chunk.  If that one is still in use it is written to stream A
+ * first.  */
+static gpg_error_t
+submit_chunk (cipher_filter_context_t *cfx, iobuf_t a)
+{
+  struct aead_chunk_pool_s *pool = cfx->chunkpool;
+  struct aead_chunk_s *c = pool->chunks + pool->cur;
+  gpg_error_t err;
+
+  if (DBG_FILTER)
+    log_debug ("submitting chunk %ju (%zu bytes)\n",
+               (uintmax_t)cfx->chunkindex, c->buflen);
+
+  err = set_chunk_nonce_and_ad (cfx, c->cipher_hd, cfx->chunkindex, 0);
+  if (err)
+    return err;
+  cfx->chunkindex++;
+  cfx->total += c->buflen;
+
+  c->err = 0;
+  c->busy = 1;
+  c->work.fnc = encrypt_chunk;
+  c->work.arg = c;
+  workpool_submit (&c->work);
+
+  pool->cur = (pool->cur + 1) % pool->nchunks;
+  return flush_chunk (a, pool->chunks + pool->cur);
+}
+
+
+/* The flush sub-function of cipher_filter_aead for parallel
+ * encryption.  */
+static gpg_error_t
+do_flush_parallel (cipher_filter_context_t *cfx, iobuf_t a,
+                   byte *buf, size_t size)
+{
+  gpg_error_t err;
+  struct aead_chunk_s *c;
+  size_t n;
+
+  while (size)
+    {
+      c = cfx->chunkpool->chunks + cfx->chunkpool->cur;
+      n = cfx->chunksize - c->buflen;
+      if (n > size)
+        n = size;
+      memcpy (c->buffer + c->buflen, buf, n);
+      c->buflen += n;
+      buf  += n;
+      size -= n;
+
+      if (c->buflen == cfx->chunksize)
+        {
+          err = submit_chunk (cfx, a);
+          if (err)
+            return err;
+        }
+    }
+
+  return 0;
+}
+
+
 /* The core of the flush sub-function of cipher_filter_aead.   */
 static gpg_error_t
 do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
@@ -362,7 +608,20 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   if (DBG_FILTER)
     log_debug ("do_free: buflen=%zu\n", cfx->buflen);
 
-  if (cfx->buflen)
+  if (cfx->chunkpool)
+    {
+      struct aead_chunk_pool_s *pool = cfx->chunkpool;
+      unsigned int i;
+
+      /* Submit the last chunk and write all pending chunks.  */
+      if (pool->chunks[pool->cur].buflen)
+        err = submit_chunk (cfx, a);
+      for (i=1; !err && i <= pool->nchunks; i++)
+        err = flush_chunk (a, pool->chunks + (pool->cur + i) % pool->nchunks);
+      if (err)
+        goto leave;
+    }
+  else if (cfx->buflen)
     {
       if (DBG_FILTER)
         log_debug ("encrypting last %zu bytes of the last chunk\n",cfx->buflen);
@@ -405,6 +664,7 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   err = write_final_chunk (cfx, a);
 
  leave:
+  release_chunk_pool (cfx);
   xfree (cfx->buffer);
   cfx->buffer = NULL;
   gcry_cipher_close (cfx->cipher_hd);
@@ -432,6 +692,8 @@ cipher_filter_aead (void *opaque, int control,
     {
       if (!cfx->wrote_header && (rc=write_header (cfx, a)))
         ;
+      else if (cfx->chunkpool)
+        rc = do_flush_parallel (cfx, a, buf, size);
       else
         rc = do_flush (cfx, a, buf, size);
     }
@@ -35,10 +35,86 @@
 #include "main.h"
 #include "../common/i18n.h"
 #include "../common/status.h"
+#include "workpool.h"
 
 
 #define MIN_PARTIAL_SIZE 512
 
+/* The size of the slices of the data which are hashed and then
+ * encrypted while they are still in the cache.  */
+#define CFB_SLICE_SIZE (32*1024)
+
+/* The MDC is computed on a worker thread if at least this number of
+ * bytes are to be encrypted.  */
+#define CFB_PARALLEL_MINLEN (64*1024)
+
+
+/* A job to hash the data for the MDC while the main thread encrypts
+ * them.  */
+struct cfb_mdc_job_s
+{
+  struct workpool_job_s work;
+  gcry_md_hd_t md;
+  const byte *buf;
+  size_t len;
+};
+
+
+/* Worker function to hash the data for the MDC.  */
+static void
+mdc_hash_job (void *arg)
+{
+  struct cfb_mdc_job_s *job = arg;
+
+  gcry_md_write (job->md, job->buf, job->len);
+}
+
+
+/* Hash and encrypt the SIZE bytes at BUF into CFX->BUFFER.  With a
+ * large buffer and worker threads the hashing is done on a worker;
+ * otherwise the data is processed in slices so that it is read from
+ * the cache by the cipher.  */
+static void
+hash_and_encrypt (cipher_filter_context_t *cfx, const byte *buf, size_t size)
+{
+  size_t off, n;
+
+  if (!cfx->mdc_hash)
+    {
+      gcry_cipher_encrypt (cfx->cipher_hd, cfx->buffer, size, buf, size);
+      return;
+    }
+
+  if (size >= CFB_PARALLEL_MINLEN && !cfx->mdc_job && workpool_init ())
+    {
+      cfx->mdc_job = xtrycalloc (1, sizeof *cfx->mdc_job);
+      if (cfx->mdc_job)
+        {
+          cfx->mdc_job->work.fnc = mdc_hash_job;
+          cfx->mdc_job->work.arg = cfx->mdc_job;
+        }
+    }
+  if (size >= CFB_PARALLEL_MINLEN && cfx->mdc_job)
+    {
+      cfx->mdc_job->md = cfx->mdc_hash;
+      cfx->mdc_job->buf = buf;
+      cfx->mdc_job->len = size;
+      workpool_submit (&cfx->mdc_job->work);
+      gcry_cipher_encrypt (cfx->cipher_hd, cfx->buffer, size, buf, size);
+      workpool_wait (&cfx->mdc_job->work);
+      return;
+    }
+
+  for (off=0; off < size; off += n)
+    {
+      n = size - off;
+      if (n > CFB_SLICE_SIZE)
+        n = CFB_SLICE_SIZE;
+      gcry_md_write (cfx->mdc_hash, buf + off, n);
+      gcry_cipher_encrypt (cfx->cipher_hd, cfx->buffer + off, n, buf + off, n);
+    }
+}
+
 
 static void
 write_header (cipher_filter_context_t *cfx, iobuf_t a)
@@ -135,9 +211,18 @@ cipher_filter_cfb (void *opaque, int control,
       log_assert (a);
       if (!cfx->wrote_header)
         write_header (cfx, a);
-      if (cfx->mdc_hash)
-        gcry_md_write (cfx->mdc_hash, buf, size);
-      gcry_cipher_encrypt (cfx->cipher_hd, buf, size, NULL, 0);
+      /* BUF may be the caller's buffer handed over by iobuf_write and
+       * must thus not be modified.  */
+      if (size > cfx->bufsize)
+        {
+          xfree (cfx->buffer);
+          cfx->bufsize = 0;
+          cfx->buffer = xtrymalloc (size);
+          if (!cfx->buffer)
+            return gpg_error_from_syserror ();
+          cfx->bufsize = size;
+        }
+      hash_and_encrypt (cfx, buf, size);
       if (cfx->short_blklen_warn)
         {
           cfx->short_blklen_count += size;
@@ -150,7 +235,7 @@ cipher_filter_cfb (void *opaque, int control,
             }
         }
 
-      rc = iobuf_write (a, buf, size);
+      rc = iobuf_write (a, cfx->buffer, size);
     }
   else if (control == IOBUFCTRL_FREE)
     {
@@ -177,6 +262,11 @@ cipher_filter_cfb (void *opaque, int control,
 	}
 
       gcry_cipher_close (cfx->cipher_hd);
+      xfree (cfx->mdc_job);
+      cfx->mdc_job = NULL;
+      xfree (cfx->buffer);
+      cfx->buffer = NULL;
+      cfx->bufsize = 0;
     }
   else if (control == IOBUFCTRL_DESC)
     {
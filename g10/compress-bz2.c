@@ -29,6 +29,7 @@
 #include "filter.h"
 #include "main.h"
 #include "options.h"
+#include "../common/i18n.h"
 
 /* Note that the code in compress.c is nearly identical to the code
    here, so if you fix a bug here, look there to see if a matching bug
@@ -202,6 +203,13 @@ compress_filter_bz2( void *opaque, int control,
     }
   else if( control == IOBUFCTRL_FLUSH )
     {
+      if( !zfx->status && zfx->skip_incompressible
+	  && data_looks_incompressible (buf, size) )
+	{
+	  if( opt.verbose )
+	    log_info(_("data is not compressible - compression disabled\n"));
+	  zfx->status = 3;
+	}
       if( !zfx->status )
 	{
 	  PACKET pkt;
@@ -222,9 +230,14 @@ compress_filter_bz2( void *opaque, int control,
 	  zfx->status = 2;
 	}
 
-      bzs->next_in = buf;
-      bzs->avail_in = size;
-      rc = do_compress( zfx, bzs, BZ_RUN, a );
+      if( zfx->status == 3 )
+	rc = iobuf_write( a, buf, size );
+      else
+	{
+	  bzs->next_in = buf;
+	  bzs->avail_in = size;
+	  rc = do_compress( zfx, bzs, BZ_RUN, a );
+	}
     }
   else if( control == IOBUFCTRL_FREE )
     {
@@ -43,6 +43,8 @@
 #include "filter.h"
 #include "main.h"
 #include "options.h"
+#include "../common/i18n.h"
+#include "workpool.h"
 
 
 #ifdef __riscos__
@@ -56,7 +58,113 @@
 int compress_filter_bz2( void *opaque, int control,
 			 IOBUF a, byte *buf, size_t *ret_len);
 
+
+/* Minimum and maximum number of bytes used to estimate whether the
+ * data is compressible.  */
+#define ENTROPY_SAMPLE_MIN (16*1024)
+#define ENTROPY_SAMPLE_MAX (64*1024)
+
+
+/* Return true if the SIZE bytes at BUF, which are the start of the
+ * data to compress, look like random data.  This is the case for
+ * already compressed or encrypted data and compressing them again is
+ * a waste of time.  We estimate the collision entropy from the byte
+ * frequencies and consider data with more than 7.8 bits per byte as
+ * incompressible.  Random data of ENTROPY_SAMPLE_MIN bytes yields
+ * about 7.97 bits and deflated data about 7.89 bits; even a perfect
+ * order-0 coder could not save more than a few percent here.  */
+int
+data_looks_incompressible (const byte *buf, size_t size)
+{
+  u32 counts[256];
+  uint64_t sum;
+  size_t i;
+
+  if (size < ENTROPY_SAMPLE_MIN)
+    return 0;  /* Not enough data for a meaningful estimate.  */
+  if (size > ENTROPY_SAMPLE_MAX)
+    size = ENTROPY_SAMPLE_MAX;
+
+  memset (counts, 0, sizeof counts);
+  for (i=0; i < size; i++)
+    counts[buf[i]]++;
+  for (sum=i=0; i < 256; i++)
+    sum += (uint64_t)counts[i] * counts[i];
+
+  /* The collision entropy is -log2(sum/size^2); 2^7.8 is about 223. */
+  return sum * 223 < (uint64_t)size * size;
+}
+
+
 #ifdef HAVE_ZIP
+
+/* The size of the blocks for parallel compression.  Each block is
+ * compressed independently using the last DEFLATE_DICT_SIZE bytes of
+ * the previous block as preset dictionary, as done by pigz.  A
+ * smaller block size would increase the loss in compression ratio.
+ * The parallel mode is only used if there is more than one block.  */
+#define COMPRESS_PARALLEL_BLOCKSIZE (128*1024)
+
+/* The maximum number of blocks processed in parallel.  */
+#define COMPRESS_PARALLEL_MAX_BLOCKS 8
+
+/* The maximum window size of deflate.  */
+#define DEFLATE_DICT_SIZE 32768
+
+
+/* A block for parallel compression.  */
+struct compress_block_s
+{
+  struct workpool_job_s work;
+  z_stream zs;        /* The deflate stream used for this block.  */
+  int busy;           /* The block has been submitted to the pool.  */
+  int final;          /* This is the last block of the stream.  */
+  int want_adler;     /* Compute ADLER.  */
+  int zrc;            /* The result of deflate.  */
+  uLong adler;        /* The Adler-32 of the block.  */
+  size_t dictlen;     /* Used length of DICT.  */
+  size_t len;         /* Used length of INBUF.  */
+  size_t outlen;      /* Used length of OUTBUF.  */
+  size_t outsize;     /* Allocated length of OUTBUF.  */
+  byte *inbuf;        /* COMPRESS_PARALLEL_BLOCKSIZE bytes of input.  */
+  byte *outbuf;       /* Room for the compressed block.  */
+  byte dict[DEFLATE_DICT_SIZE];
+};
+
+/* The blocks are used as a ring buffer in the same way as the chunks
+ * of the parallel AEAD encryption: The block at CUR is filled while
+ * the blocks after it are compressed by the worker pool.  */
+struct compress_block_pool_s
+{
+  unsigned int nblocks;
+  unsigned int cur;
+  unsigned int nsubmitted;  /* Number of blocks submitted so far.  */
+  uLong adler;              /* The Adler-32 of all written blocks.  */
+  size_t dictlen;           /* Used length of DICT.  */
+  byte dict[DEFLATE_DICT_SIZE];  /* The tail of the last block.  */
+  struct compress_block_s blocks[1];
+};
+
+
+/* Return the zlib compression level to use.  */
+static int
+get_compress_level (void)
+{
+  int level;
+
+  if (opt.compress_level >= 1 && opt.compress_level <= 9)
+    level = opt.compress_level;
+  else if (opt.compress_level == -1)
+    level = Z_DEFAULT_COMPRESSION;
+  else
+    {
+      log_error ("invalid compression level; using default level\n");
+      level = Z_DEFAULT_COMPRESSION;
+    }
+  return level;
+}
+
+
 static void
 init_compress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -70,14 +178,7 @@ init_compress( compress_filter_context_t *zfx, z_stream *zs )
         zlib_initialized = riscos_load_module("ZLib", zlib_path, 1);
 #endif
 
-    if( opt.compress_level >= 1 && opt.compress_level <= 9 )
-	level = opt.compress_level;
-    else if( opt.compress_level == -1 )
-	level = Z_DEFAULT_COMPRESSION;
-    else {
-	log_error("invalid compression level; using default level\n");
-	level = Z_DEFAULT_COMPRESSION;
-    }
+    level = get_compress_level ();
 
     if( (rc = zfx->algo == 1? deflateInit2( zs, level, Z_DEFLATED,
 					    -13, 8, Z_DEFAULT_STRATEGY)
@@ -130,6 +231,278 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
     return 0;
 }
 
+
+/* Release the blocks of the parallel compression.  This waits for
+ * blocks still being compressed.  */
+static void
+release_block_pool (compress_filter_context_t *zfx)
+{
+  struct compress_block_pool_s *pool = zfx->blockpool;
+  struct compress_block_s *c;
+  unsigned int i;
+
+  if (!pool)
+    return;
+
+  for (i=0; i < pool->nblocks; i++)
+    {
+      c = pool->blocks + i;
+      if (c->busy)
+        workpool_wait (&c->work);
+      if (c->outbuf)
+        deflateEnd (&c->zs);
+      xfree (c->inbuf);
+      xfree (c->outbuf);
+    }
+  xfree (pool);
+  zfx->blockpool = NULL;
+}
+
+
+/* Prepare for parallel compression of ZIP and ZLIB streams.  If that
+ * is not possible ZFX->BLOCKPOOL is left at NULL and the regular
+ * sequential code is used.  */
+static void
+setup_block_pool (compress_filter_context_t *zfx)
+{
+  struct compress_block_pool_s *pool;
+  struct compress_block_s *c;
+  unsigned int nblocks, i;
+  int level, rc;
+
+  /* Use two blocks per worker so that the workers can go on while
+   * the finished blocks are written and the next ones are filled.  */
+  nblocks = 2 * workpool_init ();
+  if (nblocks > COMPRESS_PARALLEL_MAX_BLOCKS)
+    nblocks = COMPRESS_PARALLEL_MAX_BLOCKS;
+  if (nblocks < 3)
+    return;
+
+  pool = xtrycalloc (1, sizeof *pool + (nblocks - 1) * sizeof *pool->blocks);
+  if (!pool)
+    return;
+  pool->nblocks = nblocks;
+  pool->adler = adler32 (0L, Z_NULL, 0);
+  zfx->blockpool = pool;
+
+  level = get_compress_level ();
+  for (i=0; i < nblocks; i++)
+    {
+      c = pool->blocks + i;
+      c->want_adler = (zfx->algo == COMPRESS_ALGO_ZLIB);
+      c->inbuf = xtrymalloc (COMPRESS_PARALLEL_BLOCKSIZE);
+      if (!c->inbuf)
+        goto leave;
+      /* We always use raw deflate streams for the blocks; the zlib
+       * header and trailer are written by ourselves.  */
+      rc = deflateInit2 (&c->zs, level, Z_DEFLATED,
+                         zfx->algo == 1? -13 : -15, 8, Z_DEFAULT_STRATEGY);
+      if (rc != Z_OK)
+        goto leave;
+      /* A flush needs at most 5 bytes for the empty stored block
+       * plus the bits of a pending block.  */
+      c->outsize = deflateBound (&c->zs, COMPRESS_PARALLEL_BLOCKSIZE) + 16;
+      c->outbuf = xtrymalloc (c->outsize);
+      if (!c->outbuf)
+        {
+          deflateEnd (&c->zs);
+          goto leave;
+        }
+    }
+
+  if (DBG_FILTER)
+    log_debug ("using %u blocks for parallel compression\n", nblocks);
+  return;
+
+ leave:
+  if (opt.verbose)
+    log_info ("parallel compression not possible\n");
+  release_block_pool (zfx);
+}
+
+
+/* The job function to compress a block on the worker pool.  */
+static void
+compress_block (void *arg)
+{
+  struct compress_block_s *c = arg;
+  int zrc;
+
+  zrc = deflateReset (&c->zs);
+  if (zrc == Z_OK && c->dictlen)
+    zrc = deflateSetDictionary (&c->zs, c->dict, c->dictlen);
+  if (zrc == Z_OK)
+    {
+      c->zs.next_in = BYTEF_CAST (c->inbuf);
+      c->zs.avail_in = c->len;
+      c->zs.next_out = BYTEF_CAST (c->outbuf);
+      c->zs.avail_out = c->outsize;
+      /* All but the last block are terminated by a sync flush so
+       * that the next block starts at a byte boundary.  */
+      zrc = deflate (&c->zs, c->final? Z_FINISH : Z_SYNC_FLUSH);
+      if (c->final? zrc == Z_STREAM_END : (zrc == Z_OK && c->zs.avail_out))
+        zrc = Z_OK;
+      else if (zrc == Z_OK)
+        zrc = Z_BUF_ERROR;
+      c->outlen = c->outsize - c->zs.avail_out;
+    }
+  if (c->want_adler)
+    c->adler = adler32 (adler32 (0L, Z_NULL, 0), c->inbuf, c->len);
+  c->zrc = zrc;
+}
+
+
+/* Wait until the block C has been compressed and write it to stream
+ * A.  */
+static int
+flush_block (compress_filter_context_t *zfx, iobuf_t a,
+             struct compress_block_s *c)
+{
+  struct compress_block_pool_s *pool = zfx->blockpool;
+  int rc;
+
+  if (!c->busy)
+    return 0;
+
+  workpool_wait (&c->work);
+  c->busy = 0;
+  if (c->zrc != Z_OK)
+    log_fatal ("zlib deflate problem: rc=%d\n", c->zrc);
+  if (c->want_adler)
+    pool->adler = adler32_combine (pool->adler, c->adler, c->len);
+  c->len = 0;
+  if ((rc = iobuf_write (a, c->outbuf, c->outlen)))
+    log_debug ("deflate: iobuf_write failed\n");
+  return rc;
+}
+
+
+/* Hand the current block over to the worker pool and advance to the
+ * next block.  If that one is still in use it is written to stream A
+ * first.  FINAL indicates the last block of the stream.  */
+static int
+submit_block (compress_filter_context_t *zfx, iobuf_t a, int final)
+{
+  struct compress_block_pool_s *pool = zfx->blockpool;
+  struct compress_block_s *c = pool->blocks + pool->cur;
+  size_t n;
+  int rc;
+
+  if (!pool->nsubmitted && zfx->algo == COMPRESS_ALGO_ZLIB)
+    {
+      /* Write the zlib header in the same way deflateInit does.  */
+      int level = get_compress_level ();
+      unsigned int header = (Z_DEFLATED + ((15-8) << 4)) << 8;
+
+      if (level == Z_DEFAULT_COMPRESSION)
+        level = 6;
+      header |= (level < 2? 0 : level < 6? 1 : level == 6? 2 : 3) << 6;
+      header += 31 - (header % 31);
+      if ((rc = iobuf_put (a, header >> 8)) || (rc = iobuf_put (a, header)))
+        return rc;
+    }
+
+  memcpy (c->dict, pool->dict, pool->dictlen);
+  c->dictlen = pool->dictlen;
+  n = c->len < DEFLATE_DICT_SIZE? c->len : DEFLATE_DICT_SIZE;
+  memcpy (pool->dict, c->inbuf + c->len - n, n);
+  pool->dictlen = n;
+
+  if (DBG_FILTER)
+    log_debug ("submitting block %u (%zu bytes)\n", pool->nsubmitted, c->len);
+  pool->nsubmitted++;
+
+  c->final = final;
+  c->busy = 1;
+  c->work.fnc = compress_block;
+  c->work.arg = c;
+  workpool_submit (&c->work);
+
+  pool->cur = (pool->cur + 1) % pool->nblocks;
+  return flush_block (zfx, a, pool->blocks + pool->cur);
+}
+
+
+/* The flush sub-function of compress_filter for parallel
+ * compression.  */
+static int
+do_compress_parallel (compress_filter_context_t *zfx, iobuf_t a,
+                      const byte *buf, size_t size)
+{
+  struct compress_block_pool_s *pool = zfx->blockpool;
+  struct compress_block_s *c;
+  size_t n;
+  int rc;
+
+  while (size)
+    {
+      c = pool->blocks + pool->cur;
+      if (c->len == COMPRESS_PARALLEL_BLOCKSIZE)
+        {
+          /* We know now that the full block is not the last one.  */
+          if ((rc = submit_block (zfx, a, 0)))
+            return rc;
+          continue;
+        }
+      n = COMPRESS_PARALLEL_BLOCKSIZE - c->len;
+      if (n > size)
+        n = size;
+      memcpy (c->inbuf + c->len, buf, n);
+      c->len += n;
+      buf += n;
+      size -= n;
+    }
+
+  return 0;
+}
+
+
+/* Finish the parallel compression and write the pending blocks to
+ * stream A.  If all the data fits into one block it is compressed the
+ * usual way.  */
+static void
+finish_compress_parallel (compress_filter_context_t *zfx, iobuf_t a)
+{
+  struct compress_block_pool_s *pool = zfx->blockpool;
+  struct compress_block_s *c = pool->blocks + pool->cur;
+  unsigned int i;
+  byte trailer[4];
+
+  if (!pool->nsubmitted)
+    {
+      z_stream *zs = xmalloc_clear (sizeof *zs);
+
+      init_compress (zfx, zs);
+      zs->next_in = BYTEF_CAST (c->inbuf);
+      zs->avail_in = c->len;
+      do_compress (zfx, zs, Z_FINISH, a);
+      deflateEnd (zs);
+      xfree (zs);
+      xfree (zfx->outbuf); zfx->outbuf = NULL;
+      release_block_pool (zfx);
+      return;
+    }
+
+  if (submit_block (zfx, a, 1))
+    goto leave;
+  for (i=0; i < pool->nblocks; i++)
+    if (flush_block (zfx, a,
+                     pool->blocks + (pool->cur + i) % pool->nblocks))
+      goto leave;
+
+  if (zfx->algo == COMPRESS_ALGO_ZLIB)
+    {
+      trailer[0] = pool->adler >> 24;
+      trailer[1] = pool->adler >> 16;
+      trailer[2] = pool->adler >> 8;
+      trailer[3] = pool->adler;
+      iobuf_write (a, trailer, 4);
+    }
+
+ leave:
+  release_block_pool (zfx);
+}
+
 static void
 init_uncompress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -241,6 +614,13 @@ compress_filter( void *opaque, int control,
 	rc = do_uncompress( zfx, zs, a, ret_len );
     }
     else if( control == IOBUFCTRL_FLUSH ) {
+	if( !zfx->status && zfx->skip_incompressible
+	    && data_looks_incompressible (buf, size) ) {
+	    if( opt.verbose )
+		log_info(_("data is not compressible - "
+			   "compression disabled\n"));
+	    zfx->status = 3;
+	}
 	if( !zfx->status ) {
 	    PACKET pkt;
 	    PKT_compressed cd;
@@ -258,14 +638,23 @@ compress_filter( void *opaque, int control,
 	    pkt.pkt.compressed = &cd;
 	    if( build_packet( a, &pkt ))
 		log_bug("build_packet(PKT_COMPRESSED) failed\n");
-	    zs = zfx->opaque = xmalloc_clear( sizeof *zs );
-	    init_compress( zfx, zs );
+	    setup_block_pool (zfx);
+	    if (!zfx->blockpool) {
+		zs = zfx->opaque = xmalloc_clear( sizeof *zs );
+		init_compress( zfx, zs );
+	    }
 	    zfx->status = 2;
 	}
 
-	zs->next_in = BYTEF_CAST (buf);
-	zs->avail_in = size;
-	rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	if (zfx->status == 3)
+	    rc = iobuf_write (a, buf, size);
+	else if (zfx->blockpool)
+	    rc = do_compress_parallel (zfx, a, buf, size);
+	else {
+	    zs->next_in = BYTEF_CAST (buf);
+	    zs->avail_in = size;
+	    rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	}
     }
     else if( control == IOBUFCTRL_FREE ) {
 	if( zfx->status == 1 ) {
@@ -274,6 +663,8 @@ compress_filter( void *opaque, int control,
 	    zfx->opaque = NULL;
 	    xfree(zfx->outbuf); zfx->outbuf = NULL;
 	}
+	else if( zfx->status == 2 && zfx->blockpool )
+	    finish_compress_parallel (zfx, a);
 	else if( zfx->status == 2 ) {
 	    zs->next_in = BYTEF_CAST (buf);
 	    zs->avail_in = 0;
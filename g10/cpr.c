@@ -43,6 +43,10 @@
    this is NULL.  */
 static estream_t statusfp;
 
+/* While a block of status lines is collected, STATUSFP is a memory
+   stream and this is the real status stream.  */
+static estream_t status_block_fp;
+
 
 static void
 progress_cb (void *ctx, const char *what, int printchar,
@@ -93,6 +97,61 @@ status_currently_allowed (int no)
 }
 
 
+/* Return true if the status line NO needs to be flushed even in
+   buffered status mode.  These are the lines the caller may need to
+   see before gpg continues, like prompts and progress info.  */
+static int
+status_needs_flush (int no)
+{
+  switch (no)
+    {
+    case STATUS_GET_BOOL:
+    case STATUS_GET_LINE:
+    case STATUS_GET_HIDDEN:
+    case STATUS_NEED_PASSPHRASE:
+    case STATUS_NEED_PASSPHRASE_SYM:
+    case STATUS_NEED_PASSPHRASE_PIN:
+    case STATUS_USERID_HINT:
+    case STATUS_PINENTRY_LAUNCHED:
+    case STATUS_INQUIRE_MAXLEN:
+    case STATUS_PROGRESS:
+    case STATUS_FAILURE:
+      return 1; /* Yes. */
+    default:
+      break;
+    }
+  return 0; /* No. */
+}
+
+
+/* Finish the status line NO.  Unless --buffered-status is used the
+   line is flushed right away.  */
+static void
+status_line_done (int no)
+{
+  if (opt.buffered_status && !status_needs_flush (no))
+    return;
+  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
+    g10_exit (0);
+}
+
+
+/* Flush the status lines kept back by --buffered-status.  This is
+   called before prompting and at exit.  */
+void
+write_status_flush (void)
+{
+  static int busy;  /* Avoid recursion via g10_exit.  */
+
+  if (!statusfp || status_block_fp || busy)
+    return;
+  busy = 1;
+  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
+    g10_exit (0);
+  busy = 0;
+}
+
+
 void
 set_status_fd (int fd)
 {
@@ -101,6 +160,7 @@ set_status_fd (int fd)
   if (fd != -1 && last_fd == fd)
     return;
 
+  write_status_flush ();
   if (statusfp && statusfp != es_stdout && statusfp != es_stderr )
     es_fclose (statusfp);
   statusfp = NULL;
@@ -176,8 +236,7 @@ write_status_strings (int no, const char *text, ...)
       va_end (arg_ptr);
     }
   es_putc ('\n', statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_done (no);
 }
 
 
@@ -232,8 +291,7 @@ write_status_printf (int no, const char *format, ...)
       va_end (arg_ptr);
     }
   es_putc ('\n', statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_done (no);
 }
 
 
@@ -246,8 +304,7 @@ write_status_error (const char *where, gpg_error_t err)
 
   es_fprintf (statusfp, "[GNUPG:] %s %s %u\n",
               get_status_string (STATUS_ERROR), where, err);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_done (STATUS_ERROR);
 }
 
 
@@ -260,8 +317,7 @@ write_status_errcode (const char *where, int errcode)
 
   es_fprintf (statusfp, "[GNUPG:] %s %s %u\n",
               get_status_string (STATUS_ERROR), where, gpg_err_code (errcode));
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_done (STATUS_ERROR);
 }
 
 
@@ -278,8 +334,7 @@ write_status_failure (const char *where, gpg_error_t err)
   any_failure_printed = 1;
   es_fprintf (statusfp, "[GNUPG:] %s %s %u\n",
               get_status_string (STATUS_FAILURE), where, err);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_done (STATUS_FAILURE);
 }
 
 
@@ -358,8 +413,7 @@ write_status_text_and_buffer (int no, const char *string,
   while (len);
 
   es_putc ('\n',statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  status_line_done (no);
 }
 
 
@@ -399,6 +453,57 @@ write_status_begin_signing (gcry_md_hd_t md)
 }
 
 
+/* Start collecting the status lines in memory.  The lines are
+   written by write_status_end_block all at once.  This keeps the
+   status lines for one file together if several processes share the
+   status fd.  */
+void
+write_status_begin_block (void)
+{
+  estream_t fp;
+
+  if (!statusfp || status_block_fp)
+    return;
+
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    return; /* Write the lines directly.  */
+  status_block_fp = statusfp;
+  statusfp = fp;
+}
+
+
+/* Write the status lines collected since write_status_begin_block.
+   A block which fits into the buffer of the status stream is written
+   with a single system call.  */
+void
+write_status_end_block (void)
+{
+  void *buffer;
+  size_t buflen;
+
+  if (!status_block_fp)
+    return;
+
+  if (es_fclose_snatch (statusfp, &buffer, &buflen))
+    {
+      buffer = NULL;
+      buflen = 0;
+    }
+  statusfp = status_block_fp;
+  status_block_fp = NULL;
+
+  if (buflen)
+    {
+      es_fflush (statusfp);
+      if ((es_write (statusfp, buffer, buflen, NULL) || es_fflush (statusfp))
+          && opt.exit_on_status_write_error)
+        g10_exit (0);
+    }
+  es_free (buffer);
+}
+
+
 static int
 myread(int fd, void *buf, size_t count)
 {
@@ -505,6 +610,7 @@ cpr_get_no_help( const char *keyword, const char *prompt )
 
     if( opt.command_fd != -1 )
 	return do_get_from_fd ( keyword, 0, 0 );
+    write_status_flush ();
     for(;;) {
 	p = tty_get( prompt );
         return p;
@@ -518,6 +624,7 @@ cpr_get( const char *keyword, const char *prompt )
 
     if( opt.command_fd != -1 )
 	return do_get_from_fd ( keyword, 0, 0 );
+    write_status_flush ();
     for(;;) {
 	p = tty_get( prompt );
 	if( *p=='?' && !p[1] && !(keyword && !*keyword)) {
@@ -550,6 +657,7 @@ cpr_get_hidden( const char *keyword, const char *prompt )
 
     if( opt.command_fd != -1 )
 	return do_get_from_fd ( keyword, 1, 0 );
+    write_status_flush ();
     for(;;) {
 	p = tty_get_hidden( prompt );
 	if( *p == '?' && !p[1] ) {
@@ -578,6 +686,7 @@ cpr_get_answer_is_yes_def (const char *keyword, const char *prompt, int def_yes)
 
     if( opt.command_fd != -1 )
 	return !!do_get_from_fd ( keyword, 0, 1 );
+    write_status_flush ();
     for(;;) {
 	p = tty_get( prompt );
 	trim_spaces(p); /* it is okay to do this here */
@@ -608,6 +717,7 @@ cpr_get_answer_yes_no_quit( const char *keyword, const char *prompt )
 
     if( opt.command_fd != -1 )
 	return !!do_get_from_fd ( keyword, 0, 1 );
+    write_status_flush ();
     for(;;) {
 	p = tty_get( prompt );
 	trim_spaces(p); /* it is okay to do this here */
@@ -644,6 +754,7 @@ cpr_get_answer_okay_cancel (const char *keyword,
       return yes;
     }
 
+  write_status_flush ();
   for(;;)
     {
       p = tty_get( prompt );
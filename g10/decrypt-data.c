@@ -30,6 +30,14 @@
 #include "../common/i18n.h"
 #include "../common/status.h"
 #include "../common/compliance.h"
+#include "workpool.h"
+
+
+/* The maximum amount of memory used for the read ahead chunks of the
+ * parallel AEAD decryption and the maximum number of those chunks.
+ * See cipher-aead.c for the encryption side.  */
+#define AEAD_PARALLEL_MAX_MEM (64*1024*1024)
+#define AEAD_PARALLEL_MAX_CHUNKS 8
 
 
 static int aead_decode_filter (void *opaque, int control, iobuf_t a,
@@ -39,6 +47,30 @@ static int mdc_decode_filter ( void *opaque, int control, IOBUF a,
 static int decode_filter ( void *opaque, int control, IOBUF a,
 					byte *buf, size_t *ret_len);
 
+/* A read ahead chunk for the parallel AEAD decryption.  */
+struct aead_chunk_s
+{
+  struct workpool_job_s work;
+  gcry_cipher_hd_t cipher_hd;  /* The handle used for this chunk.  */
+  int busy;           /* The chunk has been submitted to the pool.  */
+  gpg_error_t err;    /* The result of the decryption.  */
+  size_t len;         /* Length of the data in BUFFER w/o the tag.  */
+  size_t off;         /* Offset of the not yet returned plaintext.  */
+  byte *buffer;       /* Room for a chunk, its tag and 16 more bytes.  */
+};
+
+/* The chunks are used as a ring buffer starting at HEAD, which is the
+ * chunk to return next.  */
+struct aead_chunk_pool_s
+{
+  unsigned int nchunks;
+  unsigned int head;
+  unsigned int count;   /* Number of chunks read ahead.  */
+  int final;            /* The final tag has been read into HOLDBACK.  */
+  gpg_error_t err;      /* An error to return for all further reads.  */
+  struct aead_chunk_s chunks[1];
+};
+
 /* Our context object.  */
 struct decode_filter_context_s
 {
@@ -94,10 +126,16 @@ struct decode_filter_context_s
   /* Remaining bytes in the packet according to the packet header.
    * Not used if PARTIAL is true.  */
   size_t length;
+
+  /* The chunks for parallel AEAD decryption or NULL.  */
+  struct aead_chunk_pool_s *chunkpool;
 };
 typedef struct decode_filter_context_s *decode_filter_ctx_t;
 
 
+static void aead_release_chunkpool (decode_filter_ctx_t dfx);
+
+
 /* Helper to release the decode context.  */
 static void
 release_dfx_context (decode_filter_ctx_t dfx)
@@ -108,6 +146,7 @@ release_dfx_context (decode_filter_ctx_t dfx)
   log_assert (dfx->refcount);
   if ( !--dfx->refcount )
     {
+      aead_release_chunkpool (dfx);
       gcry_cipher_close (dfx->cipher_hd);
       dfx->cipher_hd = NULL;
       gcry_md_close (dfx->mdc_hash);
@@ -117,12 +156,13 @@ release_dfx_context (decode_filter_ctx_t dfx)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  This
- * also reset the decryption machinery * so that the handle can be
- * used for a new chunk.  If FINAL is set the final AEAD chunk is
- * processed.  */
+/* Set the nonce and the additional data for the chunk with index
+ * CHUNKINDEX into the cipher handle HD.  This also reset the
+ * decryption machinery so that the handle can be used for a new
+ * chunk.  If FINAL is set the final AEAD chunk is processed.  */
 static gpg_error_t
-aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+aead_set_chunk_nonce_and_ad (decode_filter_ctx_t dfx, gcry_cipher_hd_t hd,
+                             uint64_t chunkindex, int final)
 {
   gpg_error_t err;
   unsigned char ad[21];
@@ -144,18 +184,18 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
     default:
       BUG ();
     }
-  nonce[i++] ^= dfx->chunkindex >> 56;
-  nonce[i++] ^= dfx->chunkindex >> 48;
-  nonce[i++] ^= dfx->chunkindex >> 40;
-  nonce[i++] ^= dfx->chunkindex >> 32;
-  nonce[i++] ^= dfx->chunkindex >> 24;
-  nonce[i++] ^= dfx->chunkindex >> 16;
-  nonce[i++] ^= dfx->chunkindex >>  8;
-  nonce[i++] ^= dfx->chunkindex;
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
 
   if (DBG_CRYPTO)
     log_printhex (nonce, i, "nonce:");
-  err = gcry_cipher_setiv (dfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -164,14 +204,14 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
   ad[2] = dfx->cipher_algo;
   ad[3] = dfx->aead_algo;
   ad[4] = dfx->chunkbyte;
-  ad[5] = dfx->chunkindex >> 56;
-  ad[6] = dfx->chunkindex >> 48;
-  ad[7] = dfx->chunkindex >> 40;
-  ad[8] = dfx->chunkindex >> 32;
-  ad[9] = dfx->chunkindex >> 24;
-  ad[10]= dfx->chunkindex >> 16;
-  ad[11]= dfx->chunkindex >>  8;
-  ad[12]= dfx->chunkindex;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
       ad[13] = dfx->total >> 56;
@@ -185,7 +225,16 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
     }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (dfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* Set the nonce and the additional data for the current chunk.  */
+static gpg_error_t
+aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+{
+  return aead_set_chunk_nonce_and_ad (dfx, dfx->cipher_hd,
+                                      dfx->chunkindex, final);
 }
 
 
@@ -211,6 +260,103 @@ aead_checktag (decode_filter_ctx_t dfx, int final, const void *tagbuf)
 }
 
 
+/* Release the chunks of the parallel decryption.  This waits for
+ * chunks still being decrypted.  */
+static void
+aead_release_chunkpool (decode_filter_ctx_t dfx)
+{
+  struct aead_chunk_pool_s *pool = dfx->chunkpool;
+  struct aead_chunk_s *c;
+  unsigned int i;
+
+  if (!pool)
+    return;
+
+  for (i=0; i < pool->nchunks; i++)
+    {
+      c = pool->chunks + i;
+      if (c->busy)
+        workpool_wait (&c->work);
+      gcry_cipher_close (c->cipher_hd);
+      if (c->buffer)
+        wipememory (c->buffer, dfx->chunksize + 32);
+      xfree (c->buffer);
+    }
+  xfree (pool);
+  dfx->chunkpool = NULL;
+}
+
+
+/* Prepare for parallel decryption using the key from DEK.  If that is
+ * not possible or not useful DFX->CHUNKPOOL is left at NULL and the
+ * chunks are decrypted one after the other.  */
+static void
+aead_setup_chunkpool (decode_filter_ctx_t dfx,
+                      enum gcry_cipher_modes ciphermode, DEK *dek)
+{
+  gpg_error_t err;
+  struct aead_chunk_pool_s *pool;
+  struct aead_chunk_s *c;
+  unsigned int nchunks, i;
+
+  /* A chunk is only returned after its tag has been checked; thus we
+   * need to keep complete chunks in memory.  */
+  if (dfx->chunksize < 64*1024
+      || dfx->chunksize + 32 > AEAD_PARALLEL_MAX_MEM / 3)
+    return;
+
+  nchunks = 2 * workpool_init ();
+  if (nchunks > AEAD_PARALLEL_MAX_CHUNKS)
+    nchunks = AEAD_PARALLEL_MAX_CHUNKS;
+  if (nchunks > AEAD_PARALLEL_MAX_MEM / (dfx->chunksize + 32))
+    nchunks = AEAD_PARALLEL_MAX_MEM / (dfx->chunksize + 32);
+  if (nchunks < 3)
+    return;
+
+  pool = xtrycalloc (1, sizeof *pool + (nchunks - 1) * sizeof *pool->chunks);
+  if (!pool)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  pool->nchunks = nchunks;
+  dfx->chunkpool = pool;
+
+  for (i=0; i < nchunks; i++)
+    {
+      c = pool->chunks + i;
+      c->buffer = xtrymalloc (dfx->chunksize + 32);
+      if (!c->buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = openpgp_cipher_open (&c->cipher_hd, dfx->cipher_algo,
+                                 ciphermode, GCRY_CIPHER_SECURE);
+      if (!err)
+        {
+          err = gcry_cipher_setkey (c->cipher_hd, dek->key, dek->keylen);
+          if (gpg_err_code (err) == GPG_ERR_WEAK_KEY)
+            err = 0;  /* Already diagnosed by the caller.  */
+        }
+      if (err)
+        goto leave;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("using %u chunks for parallel decryption\n", nchunks);
+
+ leave:
+  if (err)
+    {
+      if (opt.verbose)
+        log_info ("parallel decryption not possible: %s\n",
+                  gpg_strerror (err));
+      aead_release_chunkpool (dfx);
+    }
+}
+
+
 /****************
  * Decrypt the data, specified by ED with the key DEK.
  */
@@ -362,6 +508,11 @@ decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek)
           goto leave;
         }
 
+      /* With --decrypt-range chunks are skipped which does not work
+       * with the read ahead of the parallel decryption.  */
+      if (!opt.flags.decrypt_range)
+        aead_setup_chunkpool (dfx, ciphermode, dek);
+
       if (!ed->buf)
         {
           log_error(_("problem handling encrypted packet\n"));
@@ -596,6 +747,174 @@ fill_buffer (decode_filter_ctx_t dfx, iobuf_t stream,
 }
 
 
+/* The job function to decrypt a chunk on the worker pool.  The nonce
+ * and the additional data have already been set.  */
+static void
+aead_decrypt_chunk (void *arg)
+{
+  struct aead_chunk_s *c = arg;
+  gpg_error_t err;
+
+  err = gcry_cipher_final (c->cipher_hd);
+  if (!err)
+    err = gcry_cipher_decrypt (c->cipher_hd, c->buffer, c->len, NULL, 0);
+  if (!err)
+    err = gcry_cipher_checktag (c->cipher_hd, c->buffer + c->len, 16);
+  c->err = err;
+}
+
+
+/* Read the next chunk from stream A into the first free chunk of the
+ * pool and submit it for decryption.  To detect the last chunk we
+ * read 16 bytes more than the chunk and its tag; these bytes are
+ * kept in the holdback buffer for the next chunk.  After the EOF the
+ * holdback buffer has the final tag.  */
+static gpg_error_t
+aead_read_chunk (decode_filter_ctx_t dfx, iobuf_t a)
+{
+  gpg_error_t err;
+  struct aead_chunk_pool_s *pool = dfx->chunkpool;
+  struct aead_chunk_s *c;
+  size_t len;
+
+  c = pool->chunks + (pool->head + pool->count) % pool->nchunks;
+  memcpy (c->buffer, dfx->holdback, dfx->holdbacklen);
+  len = fill_buffer (dfx, a, c->buffer, dfx->chunksize + 32,
+                     dfx->holdbacklen);
+  dfx->holdbacklen = 0;
+  if (dfx->eof_seen && len == 16)
+    {
+      /* Only the final tag is left.  */
+      memcpy (dfx->holdback, c->buffer, 16);
+      dfx->holdbacklen = 16;
+      pool->final = 1;
+      return 0;
+    }
+  if (len < 33)
+    {
+      /* Not enough data for a chunk and the final tag.  */
+      return gpg_error (GPG_ERR_TRUNCATED);
+    }
+  len -= 16;
+  memcpy (dfx->holdback, c->buffer + len, 16);
+  dfx->holdbacklen = 16;
+  if (dfx->eof_seen)
+    pool->final = 1;
+
+  c->len = len - 16;
+  c->off = 0;
+  if (DBG_FILTER)
+    log_debug ("submitting chunk %ju (%zu bytes)%s\n",
+               (uintmax_t)dfx->chunkindex, c->len,
+               pool->final? " (last)":"");
+
+  err = aead_set_chunk_nonce_and_ad (dfx, c->cipher_hd, dfx->chunkindex, 0);
+  if (err)
+    return err;
+  dfx->chunkindex++;
+  dfx->total += c->len;
+
+  c->err = 0;
+  c->busy = 1;
+  c->work.fnc = aead_decrypt_chunk;
+  c->work.arg = c;
+  workpool_submit (&c->work);
+  pool->count++;
+  return 0;
+}
+
+
+/* The parallel version of aead_underflow.  The chunks are read ahead
+ * and decrypted by the worker pool; the plaintext of a chunk is
+ * returned only after its tag has been checked.  The number of bytes
+ * stored in BUF is returned at R_TOTALLEN.  */
+static gpg_error_t
+aead_underflow_parallel (decode_filter_ctx_t dfx, iobuf_t a,
+                         byte *buf, size_t size, size_t *r_totallen)
+{
+  gpg_error_t err = 0;
+  struct aead_chunk_pool_s *pool = dfx->chunkpool;
+  struct aead_chunk_s *c;
+  size_t totallen = 0;
+  size_t n;
+
+  if (pool->err)
+    {
+      err = pool->err;
+      goto leave;
+    }
+
+  while (totallen < size)
+    {
+      /* Keep the workers busy.  */
+      while (!pool->final && pool->count < pool->nchunks)
+        {
+          err = aead_read_chunk (dfx, a);
+          if (err)
+            goto leave;
+        }
+      if (!pool->count)
+        break;  /* Only the final tag is left.  */
+
+      c = pool->chunks + pool->head;
+      if (c->busy)
+        {
+          workpool_wait (&c->work);
+          c->busy = 0;
+          if (c->err)
+            {
+              err = c->err;
+              log_error ("decrypting chunk failed: %s\n", gpg_strerror (err));
+              goto leave;
+            }
+        }
+
+      n = c->len - c->off;
+      if (n > size - totallen)
+        n = size - totallen;
+      memcpy (buf + totallen, c->buffer + c->off, n);
+      c->off += n;
+      totallen += n;
+      if (c->off == c->len)
+        {
+          pool->head = (pool->head + 1) % pool->nchunks;
+          pool->count--;
+        }
+    }
+
+  if (pool->final && !pool->count)
+    {
+      /* Check the final chunk.  */
+      if (DBG_FILTER)
+        log_debug ("eof seen: holdback has the final tag\n");
+      err = aead_set_nonce_and_ad (dfx, 1);
+      if (err)
+        goto leave;
+      gcry_cipher_final (dfx->cipher_hd);
+      /* Decrypt an empty string (using HOLDBACK as a dummy).  */
+      err = gcry_cipher_decrypt (dfx->cipher_hd, dfx->holdback, 0, NULL, 0);
+      if (err)
+        {
+          log_error ("gcry_cipher_decrypt failed (final): %s\n",
+                     gpg_strerror (err));
+          goto leave;
+        }
+      err = aead_checktag (dfx, 1, dfx->holdback);
+      if (err)
+        goto leave;
+      err = gpg_error (GPG_ERR_EOF);
+      /* Done; further reads are handled by the EOF flag.  */
+      aead_release_chunkpool (dfx);
+    }
+
+ leave:
+  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+    pool->err = err;
+  *r_totallen = totallen;
+  return err;
+}
+
+
 /* The core of the AEAD decryption.  This is the underflow function of
  * the aead_decode_filter.  */
 static gpg_error_t
@@ -609,6 +928,12 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
 
   log_assert (size > 48); /* Our code requires at least this size.  */
 
+  if (dfx->chunkpool)
+    {
+      err = aead_underflow_parallel (dfx, a, buf, size, &totallen);
+      goto leave;
+    }
+
   /* Copy the rest from the last call of this function into BUF.  */
   len = dfx->holdbacklen;
   dfx->holdbacklen = 0;
@@ -850,7 +1175,7 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
   decode_filter_ctx_t dfx = opaque;
   int rc = 0;
 
-  if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen )
+  if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen && !dfx->chunkpool )
     {
       *ret_len = 0;
       rc = -1;
@@ -877,6 +1202,80 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
 }
 
 
+/* Skip up to NBYTES of the plaintext read from A without decrypting
+ * them.  This works only if the top filter of A is the AEAD decode
+ * filter; only the rest of the buffered data and entire chunks are
+ * skipped.  The tags of skipped chunks are not checked but their
+ * data is never returned.  The caller must make sure that more than
+ * NBYTES bytes of plaintext follow.  The number of skipped bytes is
+ * stored at R_SKIPPED; the caller needs to read the remaining bytes
+ * as usual.  */
+gpg_error_t
+decrypt_data_skip (iobuf_t a, uint64_t nbytes, uint64_t *r_skipped)
+{
+  decode_filter_ctx_t dfx;
+  size_t buffered, n, len;
+  uint64_t rest;
+  byte *tmp;
+
+  *r_skipped = 0;
+  if (a->filter != aead_decode_filter)
+    return 0;
+  dfx = a->filter_ov;
+  if (dfx->chunkpool || dfx->eof_seen)
+    return 0;
+
+  buffered = a->d.len - a->d.start;
+  if (nbytes <= buffered
+      || nbytes - buffered < dfx->chunksize - dfx->chunklen)
+    return 0;  /* Not worth the trouble.  */
+  if (buffered)
+    {
+      iobuf_read (a, NULL, buffered);
+      *r_skipped += buffered;
+      nbytes -= buffered;
+    }
+
+  tmp = xtrymalloc (32768);
+  if (!tmp)
+    return gpg_error_from_syserror ();
+
+  /* We are now at position DFX->TOTAL of the plaintext and skip the
+   * rest of the current chunk and then entire chunks.  Because more
+   * plaintext follows none of them is the last chunk.  */
+  while (nbytes >= dfx->chunksize - dfx->chunklen)
+    {
+      n = dfx->chunksize - dfx->chunklen;
+      rest = n + 16;  /* The tag follows the data.  */
+
+      len = rest < dfx->holdbacklen? rest : dfx->holdbacklen;
+      dfx->holdbacklen -= len;
+      memmove (dfx->holdback, dfx->holdback + len, dfx->holdbacklen);
+      rest -= len;
+      while (rest)
+        {
+          len = rest < 32768? rest : 32768;
+          if (fill_buffer (dfx, a->chain, tmp, len, 0) != len
+              || dfx->eof_seen)
+            {
+              xfree (tmp);
+              return gpg_error (GPG_ERR_TRUNCATED);
+            }
+          rest -= len;
+        }
+
+      dfx->total += n;
+      dfx->chunklen = 0;
+      dfx->chunkindex++;
+      *r_skipped += n;
+      nbytes -= n;
+    }
+
+  xfree (tmp);
+  return 0;
+}
+
+
 static int
 mdc_decode_filter (void *opaque, int control, IOBUF a,
                    byte *buf, size_t *ret_len)
@@ -177,13 +177,130 @@ decrypt_message_fd (ctrl_t ctrl, int input_fd, int output_fd)
 }
 
 
+/* The number of files for which decrypt_messages prefetches the
+ * session keys in one go.  */
+#define PREFETCH_FILES 64
+
+
+/* Register the PKESKs at the start of FILENAME for prefetching.  */
+static void
+prescan_message (const char *filename)
+{
+  IOBUF fp;
+  armor_filter_context_t *afx;
+  struct parse_packet_ctx_s parsectx;
+  PACKET pkt;
+  int rc;
+
+  fp = iobuf_open (filename);
+  if (!fp)
+    return;
+  iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+  if (is_secured_file (iobuf_get_fd (fp)))
+    {
+      iobuf_close (fp);
+      return;
+    }
+
+  if (!opt.no_armor && use_armor_filter (fp))
+    {
+      afx = new_armor_context ();
+      rc = push_armor_filter (afx, fp);
+      release_armor_context (afx);
+      if (rc)
+        {
+          iobuf_close (fp);
+          return;
+        }
+    }
+
+  init_packet (&pkt);
+  init_parse_packet (&parsectx, fp);
+  while (!parse_packet (&parsectx, &pkt))
+    {
+      if (pkt.pkttype == PKT_PUBKEY_ENC)
+        pubkey_enc_prefetch_add (pkt.pkt.pubkey_enc);
+      else if (pkt.pkttype != PKT_MARKER)
+        break;
+      free_packet (&pkt, &parsectx);
+    }
+  free_packet (&pkt, &parsectx);
+  deinit_parse_packet (&parsectx);
+  iobuf_close (fp);
+}
+
+
+/* Decrypt the file FILENAME for decrypt_messages.  */
+static void
+decrypt_one_message (ctrl_t ctrl, progress_filter_context_t *pfx,
+                     const char *filename)
+{
+  IOBUF fp;
+  char *p, *output;
+  int rc;
+
+  print_file_status(STATUS_FILE_START, filename, 3);
+  output = make_outfile_name(filename);
+  if (!output)
+    goto next_file;
+  fp = iobuf_open(filename);
+  if (fp)
+    iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+  if (fp && is_secured_file (iobuf_get_fd (fp)))
+    {
+      iobuf_close (fp);
+      fp = NULL;
+      gpg_err_set_errno (EPERM);
+    }
+  if (!fp)
+    {
+      log_error(_("can't open '%s'\n"), print_fname_stdin(filename));
+      goto next_file;
+    }
+
+  handle_progress (pfx, fp, filename);
+
+  if (!opt.no_armor)
+    {
+      if (use_armor_filter(fp))
+        {
+          armor_filter_context_t *afx = new_armor_context ();
+          rc = push_armor_filter (afx, fp);
+          if (rc)
+            log_error("failed to push armor filter");
+          release_armor_context (afx);
+        }
+    }
+  rc = proc_packets (ctrl,NULL, fp);
+  iobuf_close(fp);
+  if (rc)
+    log_error("%s: decryption failed: %s\n", print_fname_stdin(filename),
+              gpg_strerror (rc));
+  p = get_last_passphrase();
+  set_next_passphrase(p);
+  xfree (p);
+
+ next_file:
+  /* Note that we emit file_done even after an error. */
+  write_status( STATUS_FILE_DONE );
+  xfree(output);
+  reset_literals_seen();
+}
+
+
+/* Decrypt the NFILES files FILES or the files listed on stdin.  The
+ * files are processed in chunks of PREFETCH_FILES; the session keys
+ * of a chunk are first decrypted with one request to the agent for
+ * each key so that a protected key needs to be unprotected only
+ * once.  */
 void
 decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
 {
-  IOBUF fp;
   progress_filter_context_t *pfx;
-  char *p, *output = NULL;
-  int rc=0,use_stdin=0;
+  char *names[PREFETCH_FILES];
+  int nnames, idx, eof, use_stdin=0;
+  int fileidx = 0;
+  file_jobs_t jobs;
   unsigned int lno=0;
 
   if (opt.outfile)
@@ -197,86 +314,68 @@ decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
   if(!nfiles)
     use_stdin=1;
 
-  for(;;)
-    {
-      char line[2048];
-      char *filename=NULL;
-
-      if(use_stdin)
-	{
-	  if(fgets(line, DIM(line), stdin))
-	    {
-	      lno++;
-	      if (!*line || line[strlen(line)-1] != '\n')
-		log_error("input line %u too long or missing LF\n", lno);
-	      else
-		{
-		  line[strlen(line)-1] = '\0';
-		  filename=line;
-		}
-	    }
-	}
-      else
-	{
-	  if(nfiles)
-	    {
-	      filename=*files;
-	      nfiles--;
-	      files++;
-	    }
-	}
+  file_jobs_start (&jobs, nfiles);
 
-      if(filename==NULL)
-	break;
-
-      print_file_status(STATUS_FILE_START, filename, 3);
-      output = make_outfile_name(filename);
-      if (!output)
-        goto next_file;
-      fp = iobuf_open(filename);
-      if (fp)
-        iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
-      if (fp && is_secured_file (iobuf_get_fd (fp)))
+  for (eof=0; !eof; )
+    {
+      /* Collect the names of the next chunk of files.  */
+      for (nnames=0; nnames < PREFETCH_FILES && !eof; )
         {
-          iobuf_close (fp);
-          fp = NULL;
-          gpg_err_set_errno (EPERM);
+          char line[2048];
+          char *filename=NULL;
+
+          if(use_stdin)
+            {
+              if(fgets(line, DIM(line), stdin))
+                {
+                  lno++;
+                  if (!*line || line[strlen(line)-1] != '\n')
+                    log_error("input line %u too long or missing LF\n", lno);
+                  else
+                    {
+                      line[strlen(line)-1] = '\0';
+                      filename=line;
+                    }
+                }
+            }
+          else
+            {
+              for (; nfiles && !file_jobs_mine (&jobs, fileidx); fileidx++)
+                {
+                  nfiles--;
+                  files++;
+                }
+              if(nfiles)
+                {
+                  filename=*files;
+                  nfiles--;
+                  files++;
+                  fileidx++;
+                }
+            }
+
+          if(filename==NULL)
+            eof = 1;
+          else
+            names[nnames++] = xstrdup (filename);
         }
-      if (!fp)
+
+      if (nnames > 1 && !opt.override_session_key && !opt.list_only)
         {
-          log_error(_("can't open '%s'\n"), print_fname_stdin(filename));
-          goto next_file;
+          for (idx=0; idx < nnames; idx++)
+            prescan_message (names[idx]);
+          pubkey_enc_prefetch (ctrl);
         }
 
-      handle_progress (pfx, fp, filename);
-
-      if (!opt.no_armor)
+      for (idx=0; idx < nnames; idx++)
         {
-          if (use_armor_filter(fp))
-            {
-              armor_filter_context_t *afx = new_armor_context ();
-              rc = push_armor_filter (afx, fp);
-              if (rc)
-                log_error("failed to push armor filter");
-              release_armor_context (afx);
-            }
+          decrypt_one_message (ctrl, pfx, names[idx]);
+          xfree (names[idx]);
         }
-      rc = proc_packets (ctrl,NULL, fp);
-      iobuf_close(fp);
-      if (rc)
-        log_error("%s: decryption failed: %s\n", print_fname_stdin(filename),
-                  gpg_strerror (rc));
-      p = get_last_passphrase();
-      set_next_passphrase(p);
-      xfree (p);
-
-    next_file:
-      /* Note that we emit file_done even after an error. */
-      write_status( STATUS_FILE_DONE );
-      xfree(output);
-      reset_literals_seen();
+      pubkey_enc_prefetch_release ();
     }
 
   set_next_passphrase(NULL);
   release_progress_context (pfx);
+  file_jobs_finish (&jobs);
 }
@@ -39,6 +39,7 @@
 #include "../common/status.h"
 #include "pkglue.h"
 #include "../common/compliance.h"
+#include "workpool.h"
 
 
 static int encrypt_simple( const char *filename, int mode, int use_seskey );
@@ -487,7 +488,10 @@ encrypt_simple (const char *filename, int mode, int use_seskey)
   if ( do_compress )
     {
       if (cfx.dek && (cfx.dek->use_mdc || cfx.dek->use_aead))
-        zfx.new_ctb = 1;
+        {
+          zfx.new_ctb = 1;
+          zfx.skip_incompressible = 1;
+        }
       push_compress_filter (out, &zfx, default_compress_algo());
     }
 
@@ -914,7 +918,10 @@ encrypt_crypt (ctrl_t ctrl, int filefd, const char *filename,
       if (compr_algo)
         {
           if (cfx.dek && (cfx.dek->use_mdc || cfx.dek->use_aead))
-            zfx.new_ctb = 1;
+            {
+              zfx.new_ctb = 1;
+              zfx.skip_incompressible = 1;
+            }
           push_compress_filter (out,&zfx,compr_algo);
         }
     }
@@ -1067,17 +1074,14 @@ encrypt_filter (void *opaque, int control,
 }
 
 
-/*
- * Write a pubkey-enc packet for the public key PK to OUT.
- */
-int
-write_pubkey_enc (ctrl_t ctrl,
-                  PKT_public_key *pk, int throw_keyid, DEK *dek, iobuf_t out)
+/* Return a new pubkey-enc packet for PK and store the encoded session
+ * key of DEK at R_FRAME.  The caller then needs to encrypt R_FRAME
+ * into the packet using pk_encrypt.  */
+static PKT_pubkey_enc *
+prepare_pubkey_enc (PKT_public_key *pk, int throw_keyid, DEK *dek,
+                    gcry_mpi_t *r_frame)
 {
-  PACKET pkt;
   PKT_pubkey_enc *enc;
-  int rc;
-  gcry_mpi_t frame;
 
   print_pubkey_algo_note ( pk->pubkey_algo );
   enc = xmalloc_clear ( sizeof *enc );
@@ -1097,10 +1101,20 @@ write_pubkey_enc (ctrl_t ctrl,
    * for Elgamal).  We don't need frame anymore because we have
    * everything now in enc->data which is the passed to
    * build_packet().  */
-  frame = encode_session_key (pk->pubkey_algo, dek,
-                              pubkey_nbits (pk->pubkey_algo, pk->pkey));
-  rc = pk_encrypt (pk->pubkey_algo, enc->data, frame, pk, pk->pkey);
-  gcry_mpi_release (frame);
+  *r_frame = encode_session_key (pk->pubkey_algo, dek,
+                                 pubkey_nbits (pk->pubkey_algo, pk->pkey));
+  return enc;
+}
+
+
+/* Write the pubkey-enc packet ENC to OUT and release it.  RC is the
+ * result of pk_encrypt.  */
+static int
+finish_pubkey_enc (ctrl_t ctrl, PKT_pubkey_enc *enc, int rc, DEK *dek,
+                   iobuf_t out)
+{
+  PACKET pkt;
+
   if (rc)
     log_error ("pubkey_encrypt failed: %s\n", gpg_strerror (rc) );
   else
@@ -1130,12 +1144,101 @@ write_pubkey_enc (ctrl_t ctrl,
 }
 
 
+/*
+ * Write a pubkey-enc packet for the public key PK to OUT.
+ */
+int
+write_pubkey_enc (ctrl_t ctrl,
+                  PKT_public_key *pk, int throw_keyid, DEK *dek, iobuf_t out)
+{
+  PKT_pubkey_enc *enc;
+  int rc;
+  gcry_mpi_t frame;
+
+  enc = prepare_pubkey_enc (pk, throw_keyid, dek, &frame);
+  rc = pk_encrypt (pk, enc->data, frame);
+  gcry_mpi_release (frame);
+  return finish_pubkey_enc (ctrl, enc, rc, dek, out);
+}
+
+
+/* A job for the worker pool to encrypt the session key for one
+ * recipient.  */
+struct pkencjob_s
+{
+  struct workpool_job_s work;
+  PKT_public_key *pk;
+  PKT_pubkey_enc *enc;
+  gcry_mpi_t frame;
+  gpg_error_t err;
+};
+
+
+/* The job function for the worker pool.  pk_encrypt only works on
+ * its arguments; it logs only for crypto debugging, in which case the
+ * pool is not used, and on internal Libgcrypt errors.  */
+static void
+pkencjob_encrypt (void *arg)
+{
+  struct pkencjob_s *job = arg;
+
+  job->err = pk_encrypt (job->pk, job->enc->data, job->frame);
+}
+
+
+/* Encrypt the session key DEK for the NJOBS recipients of PK_LIST
+ * using the worker pool and write the packets in the order of
+ * PK_LIST.  */
+static int
+write_pubkey_enc_parallel (ctrl_t ctrl, PK_LIST pk_list, unsigned int njobs,
+                           DEK *dek, iobuf_t out)
+{
+  struct pkencjob_s *jobs;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  unsigned int i;
+  int rc = 0;
+
+  jobs = xcalloc (njobs, sizeof *jobs);
+  for (i=0; i < njobs; i++, pk_list = pk_list->next)
+    {
+      jobs[i].pk = pk_list->pk;
+      jobs[i].enc = prepare_pubkey_enc (pk_list->pk,
+                                        (opt.throw_keyids
+                                         || (pk_list->flags&1)),
+                                        dek, &jobs[i].frame);
+      /* Make sure that the cached fingerprint used by ECDH and the
+       * cached S-expression are not computed by the worker.  */
+      fingerprint_from_pk (pk_list->pk, fpr, NULL);
+      pk_prepare_sexp (pk_list->pk);
+      jobs[i].work.fnc = pkencjob_encrypt;
+      jobs[i].work.arg = jobs + i;
+      workpool_submit (&jobs[i].work);
+    }
+
+  /* We need to wait for all jobs even after an error.  */
+  for (i=0; i < njobs; i++)
+    {
+      workpool_wait (&jobs[i].work);
+      gcry_mpi_release (jobs[i].frame);
+      if (rc)
+        free_pubkey_enc (jobs[i].enc);
+      else
+        rc = finish_pubkey_enc (ctrl, jobs[i].enc, jobs[i].err, dek, out);
+    }
+  xfree (jobs);
+  return rc;
+}
+
+
 /*
  * Write pubkey-enc packets from the list of PKs to OUT.
  */
 static int
 write_pubkey_enc_from_list (ctrl_t ctrl, PK_LIST pk_list, DEK *dek, iobuf_t out)
 {
+  PK_LIST r;
+  unsigned int n;
+
   if (opt.throw_keyids && (PGP7 || PGP8))
     {
       log_info(_("option '%s' may not be used in %s mode\n"),
@@ -1144,6 +1247,13 @@ write_pubkey_enc_from_list (ctrl_t ctrl, PK_LIST pk_list, DEK *dek, iobuf_t out)
       compliance_failure();
     }
 
+  /* With many recipients the public key operations are run in
+   * parallel.  */
+  for (n=0, r=pk_list; r; r = r->next)
+    n++;
+  if (n > 1 && !DBG_CRYPTO && workpool_init ())
+    return write_pubkey_enc_parallel (ctrl, pk_list, n, dek, out);
+
   for ( ; pk_list; pk_list = pk_list->next )
     {
       PKT_public_key *pk = pk_list->pk;
@@ -1190,14 +1300,29 @@ encrypt_crypt_files (ctrl_t ctrl, int nfiles, char **files, strlist_t remusr)
     }
   else
     {
-      while (nfiles--)
+      file_jobs_t jobs;
+      pk_list_t pk_list = NULL;
+      int idx;
+
+      /* The workers don't prompt for recipients and each resolves
+       * them only once for all of its files.  */
+      file_jobs_start (&jobs, remusr? nfiles : 0);
+      for (idx=0; idx < nfiles; idx++)
         {
-          print_file_status(STATUS_FILE_START, *files, 2);
-          if ( (rc = encrypt_crypt (ctrl, -1, *files, remusr, 0, NULL, -1)) )
+          if (!file_jobs_mine (&jobs, idx))
+            continue;
+          print_file_status(STATUS_FILE_START, files[idx], 2);
+          rc = 0;
+          if (jobs.njobs > 1 && !pk_list)
+            rc = build_pk_list (ctrl, remusr, &pk_list);
+          if (!rc)
+            rc = encrypt_crypt (ctrl, -1, files[idx], remusr, 0, pk_list, -1);
+          if (rc)
             log_error("encryption of '%s' failed: %s\n",
-                      print_fname_stdin(*files), gpg_strerror (rc) );
+                      print_fname_stdin(files[idx]), gpg_strerror (rc) );
           write_status( STATUS_FILE_DONE );
-          files++;
         }
+      release_pk_list (pk_list);
+      file_jobs_finish (&jobs);
     }
 }
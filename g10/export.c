@@ -53,6 +53,21 @@ struct subkey_list_s
 typedef struct subkey_list_s *subkey_list_t;
 
 
+/* Maximum number of secret keys of a keyblock fetched from the agent
+ * with one request.  */
+#define MAX_SECKEY_PREFETCH 16
+
+/* An object to keep the secret keys prefetched from the agent.  */
+struct seckey_prefetch_s
+{
+  unsigned int count;
+  char *hexgrips[MAX_SECKEY_PREFETCH];
+  unsigned char *wrappedkeys[MAX_SECKEY_PREFETCH];
+  size_t wrappedkeylens[MAX_SECKEY_PREFETCH];
+  gpg_error_t errs[MAX_SECKEY_PREFETCH];
+};
+
+
 /* An object to track statistics for export operations.  */
 struct export_stats_s
 {
@@ -87,7 +102,8 @@ static struct export_filter_attic_s *export_filter_attic;
 
 /* Local prototypes.  */
 static int do_export (ctrl_t ctrl, strlist_t users, int secret,
-                      unsigned int options, export_stats_t stats);
+                      unsigned int options, export_stats_t stats,
+                      int out_fd);
 static int do_export_stream (ctrl_t ctrl, iobuf_t out,
                              strlist_t users, int secret,
                              kbnode_t *keyblock_out, unsigned int options,
@@ -205,6 +221,12 @@ parse_and_set_export_filter (const char *string)
   else
     err = gpg_error (GPG_ERR_INV_NAME);
 
+  if (!err)
+    {
+      recsel_set_propids (export_keep_uid, impex_filter_propid);
+      recsel_set_propids (export_drop_subkey, impex_filter_propid);
+    }
+
   return err;
 }
 
@@ -296,7 +318,19 @@ int
 export_pubkeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                 export_stats_t stats)
 {
-  return do_export (ctrl, users, 0, options, stats);
+  return do_export (ctrl, users, 0, options, stats, -1);
+}
+
+
+/*
+ * Same as export_pubkeys but write the keys to the file descriptor
+ * OUT_FD.  This is used by the server.
+ */
+int
+export_pubkeys_fd (ctrl_t ctrl, strlist_t users, unsigned int options,
+                   export_stats_t stats, int out_fd)
+{
+  return do_export (ctrl, users, 0, options, stats, out_fd);
 }
 
 
@@ -313,7 +347,7 @@ int
 export_seckeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                 export_stats_t stats)
 {
-  return do_export (ctrl, users, 1, options, stats);
+  return do_export (ctrl, users, 1, options, stats, -1);
 }
 
 
@@ -332,7 +366,7 @@ int
 export_secsubkeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                    export_stats_t stats)
 {
-  return do_export (ctrl, users, 2, options, stats);
+  return do_export (ctrl, users, 2, options, stats, -1);
 }
 
 
@@ -403,7 +437,7 @@ export_pubkey_buffer (ctrl_t ctrl, const char *keyspec, unsigned int options,
    options to apply.  */
 static int
 do_export (ctrl_t ctrl, strlist_t users, int secret, unsigned int options,
-           export_stats_t stats)
+           export_stats_t stats, int out_fd)
 {
   IOBUF out = NULL;
   int any, rc;
@@ -412,7 +446,7 @@ do_export (ctrl_t ctrl, strlist_t users, int secret, unsigned int options,
 
   memset( &zfx, 0, sizeof zfx);
 
-  rc = open_outfile (-1, NULL, 0, !!secret, &out );
+  rc = open_outfile (out_fd, NULL, 0, !!secret, &out );
   if (rc)
     return rc;
 
@@ -1213,41 +1247,19 @@ print_status_exported (PKT_public_key *pk)
 }
 
 
-/*
- * Receive a secret key from agent specified by HEXGRIP.
- *
- * Since the key data from the agent is encrypted, decrypt it using
- * CIPHERHD context.  Then, parse the decrypted key data into transfer
- * format, and put secret parameters into PK.
- *
- * If CLEARTEXT is 0, store the secret key material
- * passphrase-protected.  Otherwise, store secret key material in the
- * clear.
- *
- * CACHE_NONCE_ADDR is used to share nonce for multiple key retrievals.
- */
-gpg_error_t
-receive_seckey_from_agent (ctrl_t ctrl, gcry_cipher_hd_t cipherhd,
-                           int cleartext,
-                           char **cache_nonce_addr, const char *hexgrip,
-                           PKT_public_key *pk)
+/* Helper for receive_seckey_from_agent and the prefetched keys.  ERR
+ * is the result of the export request and WRAPPEDKEY of length
+ * WRAPPEDKEYLEN the received key; the function takes ownership of
+ * WRAPPEDKEY.  Errors are logged.  */
+static gpg_error_t
+unwrap_seckey_from_agent (gcry_cipher_hd_t cipherhd, int cleartext,
+                          const char *hexgrip, PKT_public_key *pk,
+                          gpg_error_t err,
+                          unsigned char *wrappedkey, size_t wrappedkeylen)
 {
-  gpg_error_t err = 0;
-  unsigned char *wrappedkey = NULL;
-  size_t wrappedkeylen;
   unsigned char *key = NULL;
   size_t keylen, realkeylen;
   gcry_sexp_t s_skey;
-  char *prompt;
-
-  if (opt.verbose)
-    log_info ("key %s: asking agent for the secret parts\n", hexgrip);
-
-  prompt = gpg_format_keydesc (ctrl, pk, FORMAT_KEYDESC_EXPORT,1);
-  err = agent_export_key (ctrl, hexgrip, prompt, !cleartext, cache_nonce_addr,
-                          &wrappedkey, &wrappedkeylen,
-			  pk->keyid, pk->main_keyid, pk->pubkey_algo);
-  xfree (prompt);
 
   if (err)
     goto unwraperror;
@@ -1294,6 +1306,44 @@ receive_seckey_from_agent (ctrl_t ctrl, gcry_cipher_hd_t cipherhd,
 }
 
 
+/*
+ * Receive a secret key from agent specified by HEXGRIP.
+ *
+ * Since the key data from the agent is encrypted, decrypt it using
+ * CIPHERHD context.  Then, parse the decrypted key data into transfer
+ * format, and put secret parameters into PK.
+ *
+ * If CLEARTEXT is 0, store the secret key material
+ * passphrase-protected.  Otherwise, store secret key material in the
+ * clear.
+ *
+ * CACHE_NONCE_ADDR is used to share nonce for multiple key retrievals.
+ */
+gpg_error_t
+receive_seckey_from_agent (ctrl_t ctrl, gcry_cipher_hd_t cipherhd,
+                           int cleartext,
+                           char **cache_nonce_addr, const char *hexgrip,
+                           PKT_public_key *pk)
+{
+  gpg_error_t err = 0;
+  unsigned char *wrappedkey = NULL;
+  size_t wrappedkeylen = 0;
+  char *prompt;
+
+  if (opt.verbose)
+    log_info ("key %s: asking agent for the secret parts\n", hexgrip);
+
+  prompt = gpg_format_keydesc (ctrl, pk, FORMAT_KEYDESC_EXPORT,1);
+  err = agent_export_key (ctrl, hexgrip, prompt, !cleartext, cache_nonce_addr,
+                          &wrappedkey, &wrappedkeylen,
+			  pk->keyid, pk->main_keyid, pk->pubkey_algo);
+  xfree (prompt);
+
+  return unwrap_seckey_from_agent (cipherhd, cleartext, hexgrip, pk,
+                                   err, wrappedkey, wrappedkeylen);
+}
+
+
 /* Write KEYBLOCK either to stdout or to the file set with the
  * --output option.  This is a simplified version of do_export_stream
  * which supports only a few export options.  */
@@ -1404,7 +1454,7 @@ apply_keep_uid_filter (ctrl_t ctrl, kbnode_t keyblock, recsel_expr_t selector)
       if (node->pkt->pkttype == PKT_USER_ID)
         {
           parm.node = node;
-          if (!recsel_select (selector, impex_filter_getval, &parm))
+          if (!recsel_select_id (selector, impex_filter_getval_id, &parm))
             {
               /* log_debug ("keep-uid: deleting '%s'\n", */
               /*            node->pkt->pkt.user_id->name); */
@@ -1446,7 +1496,7 @@ apply_drop_subkey_filter (ctrl_t ctrl, kbnode_t keyblock,
           || node->pkt->pkttype == PKT_SECRET_SUBKEY)
         {
           parm.node = node;
-          if (recsel_select (selector, impex_filter_getval, &parm))
+          if (recsel_select_id (selector, impex_filter_getval_id, &parm))
             {
               /*log_debug ("drop-subkey: deleting a key\n");*/
               /* The subkey packet and all following packets up to the
@@ -1592,6 +1642,298 @@ print_pka_or_dane_records (iobuf_t out, kbnode_t keyblock, PKT_public_key *pk,
 }
 
 
+/* Return true if do_export_one_keyblock would write all packets of
+ * the public KEYBLOCK unchanged with OPTIONS.  */
+static int
+keyblock_is_exported_verbatim (kbnode_t keyblock, unsigned int options)
+{
+  kbnode_t node;
+  PKT_signature *sig;
+  int i;
+
+  for (node = keyblock; node; node = node->next)
+    {
+      switch (node->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+          break;
+
+        case PKT_USER_ID:
+          if (!(options & EXPORT_ATTRIBUTES)
+              && node->pkt->pkt.user_id->attrib_data)
+            return 0;
+          break;
+
+        case PKT_SIGNATURE:
+          sig = node->pkt->pkt.signature;
+          if (!(options & EXPORT_LOCAL_SIGS) && !sig->flags.exportable)
+            return 0;
+          if (!(options & EXPORT_SENSITIVE_REVKEYS) && sig->revkey)
+            for (i = 0; i < sig->numrevkeys; i++)
+              if ((sig->revkey[i].class & 0x40))
+                return 0;
+          break;
+
+        default:
+          return 0;
+        }
+    }
+  return 1;
+}
+
+
+/* Return true if the raw keyblock {IMAGE,IMAGELEN} consists of
+ * exactly the packets of KEYBLOCK.  This is not the case if the
+ * parser skipped packets of the image.  Only the packet headers are
+ * looked at.  */
+static int
+image_matches_keyblock (const byte *image, size_t imagelen,
+                        kbnode_t keyblock)
+{
+  size_t off, pktlen, n;
+  unsigned int npkts = 0;
+  int c, tag;
+  kbnode_t node;
+
+  for (off = 0; off < imagelen; off += pktlen)
+    {
+      c = image[off++];
+      if (!(c & 0x80))
+        return 0;
+      if ((c & 0x40))
+        {
+          tag = (c & 0x3f);
+          if (off >= imagelen)
+            return 0;
+          c = image[off++];
+          if (c < 192)
+            pktlen = c;
+          else if (c < 224)
+            {
+              if (off >= imagelen)
+                return 0;
+              pktlen = ((c - 192) << 8) + image[off++] + 192;
+            }
+          else if (c == 255)
+            {
+              if (imagelen - off < 4)
+                return 0;
+              pktlen = buf32_to_size_t (image + off);
+              off += 4;
+            }
+          else
+            return 0;  /* Partial lengths are not used in keyblocks.  */
+        }
+      else
+        {
+          tag = ((c >> 2) & 0xf);
+          if ((c & 3) == 3)
+            return 0;  /* Indeterminate length.  */
+          n = 1 << (c & 3);
+          if (imagelen - off < n)
+            return 0;
+          for (pktlen = 0; n; n--)
+            pktlen = (pktlen << 8) | image[off++];
+        }
+      if (pktlen > imagelen - off)
+        return 0;
+
+      switch (tag)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+        case PKT_USER_ID:
+        case PKT_ATTRIBUTE:
+        case PKT_SIGNATURE:
+          npkts++;
+          break;
+        default:
+          return 0;
+        }
+    }
+
+  for (node = keyblock; node; node = node->next)
+    npkts--;
+  return !npkts;
+}
+
+
+/* Helper for do_export_stream which writes the keyblock last found
+ * via KDBHD verbatim to OUT.  KEYBLOCK is the parsed version of it.
+ * Returns GPG_ERR_TRUE if this is not possible and the caller needs
+ * to use do_export_one_keyblock.  */
+static gpg_error_t
+do_export_one_keyblock_verbatim (KEYDB_HANDLE kdbhd, kbnode_t keyblock,
+                                 iobuf_t out, unsigned int options,
+                                 export_stats_t stats, int *any)
+{
+  gpg_error_t err;
+  void *image;
+  size_t imagelen;
+
+  if (!keyblock_is_exported_verbatim (keyblock, options))
+    return gpg_error (GPG_ERR_TRUE);
+
+  err = keydb_get_keyblock_image (kdbhd, &image, &imagelen);
+  if (err)
+    return gpg_error (GPG_ERR_TRUE);
+  if (!image_matches_keyblock (image, imagelen, keyblock))
+    {
+      xfree (image);
+      return gpg_error (GPG_ERR_TRUE);
+    }
+
+  err = iobuf_write (out, image, imagelen);
+  xfree (image);
+  if (err)
+    {
+      log_error ("error writing keyblock: %s\n", gpg_strerror (err));
+      return err;
+    }
+  stats->exported++;
+  print_status_exported (keyblock->pkt->pkt.public_key);
+  *any = 1;
+  return 0;
+}
+
+
+/* Release the keys in PREFETCH which have not been used.  */
+static void
+release_seckey_prefetch (struct seckey_prefetch_s *prefetch)
+{
+  unsigned int i;
+
+  for (i=0; i < prefetch->count; i++)
+    {
+      xfree (prefetch->hexgrips[i]);
+      xfree (prefetch->wrappedkeys[i]);
+    }
+  prefetch->count = 0;
+}
+
+
+/* Fetch the passphrase protected secret keys of KEYBLOCK which will
+ * be exported by do_export_one_keyblock from the agent with one
+ * request.  The agent then needs to run the costly S2K of the
+ * re-protection only once per passphrase.  The keys are stored in
+ * PREFETCH.  Errors are not fatal because each key not in PREFETCH
+ * is requested on its own; only GPG_ERR_FULLY_CANCELED is
+ * returned.  */
+static gpg_error_t
+prefetch_seckeys (ctrl_t ctrl, kbnode_t keyblock, int secret,
+                  KEYDB_SEARCH_DESC *desc, size_t ndesc, size_t descindex,
+                  char **cache_nonce_addr, struct seckey_prefetch_s *prefetch)
+{
+  gpg_error_t err;
+  kbnode_t kbctx, node;
+  PKT_public_key *pk;
+  PKT_public_key *first_pk = NULL;
+  char *hexgrip;
+  char *serialno;
+  int cleartext;
+  char *prompt;
+  size_t j;
+
+  prefetch->count = 0;
+
+  for (kbctx=NULL; (node = walk_kbnode (keyblock, &kbctx, 0))
+         && prefetch->count < MAX_SECKEY_PREFETCH; )
+    {
+      if (node->pkt->pkttype == PKT_PUBLIC_KEY)
+        {
+          if (secret == 2)
+            continue;
+        }
+      else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        {
+          /* Same selection as in do_export_one_keyblock.  */
+          if (desc[descindex].exact)
+            {
+              for (j=0; j < ndesc; j++)
+                if (desc[j].exact && exact_subkey_match_p (desc+j, node))
+                  break;
+              if (!(j < ndesc))
+                continue;
+            }
+        }
+      else
+        continue;
+
+      pk = node->pkt->pkt.public_key;
+      if (pk->seckey_info || hexkeygrip_from_pk (pk, &hexgrip))
+        continue;
+      serialno = NULL;
+      cleartext = 0;
+      if (agent_get_keyinfo (ctrl, hexgrip, &serialno, &cleartext)
+          || serialno || cleartext)
+        {
+          /* Not available, on a card or not protected - nothing to
+           * gain from a batch.  */
+          xfree (serialno);
+          xfree (hexgrip);
+          continue;
+        }
+      if (!first_pk)
+        first_pk = pk;
+      prefetch->hexgrips[prefetch->count++] = hexgrip;
+    }
+
+  if (prefetch->count < 2)
+    {
+      release_seckey_prefetch (prefetch);
+      return 0;
+    }
+
+  if (opt.verbose)
+    log_info ("key %s: asking agent for the secret parts of %u keys\n",
+              keystr_from_pk (first_pk), prefetch->count);
+
+  prompt = gpg_format_keydesc (ctrl, first_pk, FORMAT_KEYDESC_EXPORT, 1);
+  err = agent_export_keys (ctrl, prefetch->hexgrips, prefetch->count,
+                           prompt, 1, cache_nonce_addr,
+                           prefetch->wrappedkeys, prefetch->wrappedkeylens,
+                           prefetch->errs, first_pk->keyid,
+                           first_pk->main_keyid, first_pk->pubkey_algo);
+  xfree (prompt);
+  if (err)
+    {
+      if (opt.verbose && gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+        log_info ("exporting several keys at once failed: %s\n",
+                  gpg_strerror (err));
+      release_seckey_prefetch (prefetch);
+      if (gpg_err_code (err) == GPG_ERR_FULLY_CANCELED)
+        return err;
+    }
+  return 0;
+}
+
+
+/* Take the key with HEXGRIP from PREFETCH.  Returns true and stores
+ * the key and the error code of its export at the provided addresses
+ * if it was prefetched.  */
+static int
+take_prefetched_seckey (struct seckey_prefetch_s *prefetch,
+                        const char *hexgrip, gpg_error_t *r_err,
+                        unsigned char **r_wrappedkey, size_t *r_wrappedkeylen)
+{
+  unsigned int i;
+
+  for (i=0; i < prefetch->count; i++)
+    if (prefetch->hexgrips[i] && !strcmp (prefetch->hexgrips[i], hexgrip))
+      {
+        *r_err = prefetch->errs[i];
+        *r_wrappedkey = prefetch->wrappedkeys[i];
+        *r_wrappedkeylen = prefetch->wrappedkeylens[i];
+        prefetch->wrappedkeys[i] = NULL;
+        xfree (prefetch->hexgrips[i]);
+        prefetch->hexgrips[i] = NULL;
+        return 1;
+      }
+  return 0;
+}
+
+
 /* Helper for do_export_stream which writes one keyblock to OUT.  */
 static gpg_error_t
 do_export_one_keyblock (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid,
@@ -1610,6 +1952,17 @@ do_export_one_keyblock (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid,
   PKT_public_key *pk;
   u32 subkidbuf[2], *subkid;
   kbnode_t kbctx, node;
+  struct seckey_prefetch_s prefetch;
+
+  prefetch.count = 0;
+  if (secret)
+    {
+      err = prefetch_seckeys (ctrl, keyblock, secret, desc, ndesc, descindex,
+                              &cache_nonce, &prefetch);
+      if (err)
+        goto leave;
+      err = gpg_error (GPG_ERR_NOT_FOUND);
+    }
 
   /* NB: walk_kbnode skips packets marked as deleted.  */
   for (kbctx=NULL; (node = walk_kbnode (keyblock, &kbctx, 0)); )
@@ -1820,9 +2173,18 @@ do_export_one_keyblock (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid,
             }
           else if (!err)
             {
-              err = receive_seckey_from_agent (ctrl, cipherhd,
-                                               cleartext, &cache_nonce,
-                                               hexgrip, pk);
+              unsigned char *wrappedkey;
+              size_t wrappedkeylen;
+
+              if (take_prefetched_seckey (&prefetch, hexgrip, &err,
+                                          &wrappedkey, &wrappedkeylen))
+                err = unwrap_seckey_from_agent (cipherhd, cleartext,
+                                                hexgrip, pk, err,
+                                                wrappedkey, wrappedkeylen);
+              else
+                err = receive_seckey_from_agent (ctrl, cipherhd,
+                                                 cleartext, &cache_nonce,
+                                                 hexgrip, pk);
               if (err)
                 {
                   if (gpg_err_code (err) == GPG_ERR_FULLY_CANCELED)
@@ -1889,6 +2251,7 @@ do_export_one_keyblock (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid,
     }
 
  leave:
+  release_seckey_prefetch (&prefetch);
   release_subkey_list (subkey_list);
   xfree (serialno);
   xfree (hexgrip);
@@ -1922,6 +2285,7 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
   gcry_cipher_hd_t cipherhd = NULL;
   struct export_stats_s dummystats;
   iobuf_t out_help = NULL;
+  int verbatim;
 
   if (!stats)
     stats = &dummystats;
@@ -1971,6 +2335,16 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
          this we need an extra flag to enable this feature.  */
     }
 
+  /* Without any filters the keyblocks of a keybox can be copied to
+   * the output without parsing and rebuilding all packets.  */
+  verbatim = (!secret && !keyblock_out && !out_help
+              && !export_keep_uid && !export_drop_subkey
+              && !(options & (EXPORT_CLEAN | EXPORT_MINIMAL | EXPORT_BACKUP
+                              | EXPORT_DROP_UIDS)));
+  for (descindex = 0; verbatim && descindex < ndesc; descindex++)
+    if (desc[descindex].exact)
+      verbatim = 0;
+
 #ifdef ENABLE_SELINUX_HACKS
   if (secret)
     {
@@ -2098,6 +2472,15 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
         }
 
       /* And write it. */
+      if (verbatim)
+        {
+          err = do_export_one_keyblock_verbatim (kdbhd, keyblock, out,
+                                                 options, stats, any);
+          if (!err)
+            continue;
+          if (gpg_err_code (err) != GPG_ERR_TRUE)
+            break;
+        }
       err = do_export_one_keyblock (ctrl, keyblock, keyid,
                                     out_help? out_help : out,
                                     secret, options, stats, any,
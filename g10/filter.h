@@ -27,6 +27,7 @@ typedef struct {
     gcry_md_hd_t md;      /* catch all */
     gcry_md_hd_t md2;     /* if we want to calculate an alternate hash */
     size_t maxbuf_size;
+    struct md_parallel_s *parallel; /* per-algo contexts or NULL */
 } md_filter_context_t;
 
 typedef struct {
@@ -81,6 +82,10 @@ struct compress_filter_context_s {
     int algo;	 /* compress algo */
     int algo1hack;
     int new_ctb;
+    /* Do not compress if the data looks incompressible.  */
+    int skip_incompressible;
+    /* The blocks for parallel compression or NULL.  */
+    struct compress_block_pool_s *blockpool;
     void (*release)(struct compress_filter_context_s*);
 };
 typedef struct compress_filter_context_s compress_filter_context_t;
@@ -132,6 +137,12 @@ typedef struct
   size_t bufsize;  /* Allocated length.  */
   size_t buflen;   /* Used length.       */
 
+  /* The chunks for parallel AEAD encryption or NULL.  */
+  struct aead_chunk_pool_s *chunkpool;
+
+  /* The job to compute the MDC on a worker thread or NULL.  */
+  struct cfb_mdc_job_s *mdc_job;
+
 } cipher_filter_context_t;
 
 
@@ -164,6 +175,8 @@ typedef struct {
 /*-- mdfilter.c --*/
 int md_filter( void *opaque, int control, iobuf_t a, byte *buf, size_t *ret_len);
 void free_md_filter_context( md_filter_context_t *mfx );
+void md_filter_setup_parallel (md_filter_context_t *mfx);
+gcry_md_hd_t md_filter_get_md (md_filter_context_t *mfx, int algo);
 
 /*-- armor.c --*/
 armor_filter_context_t *new_armor_context (void);
@@ -172,6 +185,7 @@ int push_armor_filter (armor_filter_context_t *afx, iobuf_t iobuf);
 int use_armor_filter( iobuf_t a );
 
 /*-- compress.c --*/
+int data_looks_incompressible (const byte *buf, size_t size);
 gpg_error_t push_compress_filter (iobuf_t out, compress_filter_context_t *zfx,
                                   int algo);
 gpg_error_t push_compress_filter2 (iobuf_t out,compress_filter_context_t *zfx,
@@ -28,6 +28,134 @@
 #include "packet.h"
 #include "../common/iobuf.h"
 #include "options.h"
+#include "../common/init.h"
+
+
+/* Parsing and releasing a keyblock with many signatures allocates and
+ * frees the same kinds of fixed-size objects again and again.  We
+ * keep released PACKET and PKT_signature objects on freelists so that
+ * the next keyblock can reuse them.  The objects are normal xmalloced
+ * blocks and may thus also be released with xfree.  */
+#define FREELIST_MAX 4096
+
+struct freelist_item_s
+{
+  struct freelist_item_s *next;
+};
+
+struct freelist_s
+{
+  struct freelist_item_s *head;
+  unsigned int count;
+};
+
+static struct freelist_s packet_freelist;
+static struct freelist_s signature_freelist;
+static int freelist_cleanup_registered;
+
+
+static void
+release_freelist (struct freelist_s *fl)
+{
+  struct freelist_item_s *item;
+
+  while ((item = fl->head))
+    {
+      fl->head = item->next;
+      xfree (item);
+    }
+  fl->count = 0;
+}
+
+
+static void
+release_freelists (void)
+{
+  release_freelist (&packet_freelist);
+  release_freelist (&signature_freelist);
+}
+
+
+/* Return an object from FL or NULL if the list is empty.  */
+static void *
+freelist_get (struct freelist_s *fl)
+{
+  struct freelist_item_s *item = fl->head;
+
+  if (item)
+    {
+      fl->head = item->next;
+      fl->count--;
+    }
+  return item;
+}
+
+
+/* Put the object P onto FL or release it if the list is full.  */
+static void
+freelist_put (struct freelist_s *fl, void *p)
+{
+  struct freelist_item_s *item = p;
+
+  if (!item)
+    return;
+  if (fl->count >= FREELIST_MAX)
+    {
+      xfree (item);
+      return;
+    }
+  if (!freelist_cleanup_registered)
+    {
+      freelist_cleanup_registered = 1;
+      register_mem_cleanup_func (release_freelists);
+    }
+  item->next = fl->head;
+  fl->head = item;
+  fl->count++;
+}
+
+
+/* Allocate and initialize a new PACKET.  Returns NULL on error.
+ * Release it with free_packet and release_packet_struct or xfree.  */
+PACKET *
+alloc_packet (void)
+{
+  PACKET *pkt;
+
+  pkt = freelist_get (&packet_freelist);
+  if (!pkt)
+    {
+      pkt = xtrymalloc (sizeof *pkt);
+      if (!pkt)
+        return NULL;
+    }
+  init_packet (pkt);
+  return pkt;
+}
+
+
+/* Release the PACKET structure PKT but not its content.  */
+void
+release_packet_struct (PACKET *pkt)
+{
+  freelist_put (&packet_freelist, pkt);
+}
+
+
+/* Allocate a cleared signature object.  Release it with
+ * free_seckey_enc.  */
+PKT_signature *
+alloc_signature (void)
+{
+  PKT_signature *sig;
+
+  sig = freelist_get (&signature_freelist);
+  if (sig)
+    memset (sig, 0, sizeof *sig);
+  else
+    sig = xmalloc_clear (sizeof *sig);
+  return sig;
+}
 
 
 /* This is mpi_copy with a fix for opaque MPIs which store a NULL
@@ -84,7 +212,7 @@ free_seckey_enc( PKT_signature *sig )
     }
   xfree (sig->signers_uid);
 
-  xfree(sig);
+  freelist_put (&signature_freelist, sig);
 }
 
 
@@ -132,6 +260,9 @@ release_public_key_parts (PKT_public_key *pk)
       xfree (pk->updateurl);
       pk->updateurl = NULL;
     }
+  gcry_sexp_release (pk->pkey_sexp);
+  pk->pkey_sexp = NULL;
+  pk->flags.keygrip_valid = 0;
 }
 
 
@@ -200,6 +331,7 @@ copy_public_key (PKT_public_key *d, PKT_public_key *s)
     d = xmalloc (sizeof *d);
   memcpy (d, s, sizeof *d);
   d->seckey_info = NULL;
+  d->pkey_sexp = NULL;
   d->user_id = scopy_user_id (s->user_id);
   d->prefs = copy_prefs (s->prefs);
 
@@ -120,27 +120,77 @@ typedef struct keyid_list
 
 
 #if MAX_PK_CACHE_ENTRIES
+/* The public key cache.  The entries are hashed by their long keyid
+ * and by their fingerprint.  They are also kept in a list ordered by
+ * their last use so that we can evict the least recently used entry
+ * if the cache is full.  */
+#define PK_CACHE_BUCKETS 1024  /* Must be a power of 2.  */
 typedef struct pk_cache_entry
 {
-  struct pk_cache_entry *next;
+  struct pk_cache_entry *kid_next;  /* Next entry in the keyid bucket. */
+  struct pk_cache_entry *fpr_next;  /* Next entry in the fpr bucket.   */
+  struct pk_cache_entry *lru_prev;  /* The more recently used entry.   */
+  struct pk_cache_entry *lru_next;  /* The less recently used entry.   */
   u32 keyid[2];
   PKT_public_key *pk;
 } *pk_cache_entry_t;
-static pk_cache_entry_t pk_cache;
+static pk_cache_entry_t pk_cache_kid[PK_CACHE_BUCKETS];
+static pk_cache_entry_t pk_cache_fpr[PK_CACHE_BUCKETS];
+static pk_cache_entry_t pk_cache_lru;      /* Most recently used.  */
+static pk_cache_entry_t pk_cache_lru_tail; /* Least recently used.  */
 static int pk_cache_entries;	/* Number of entries in pk cache.  */
 static int pk_cache_disabled;
+static struct
+{
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int evictions;
+} pk_cache_stats;
+
+#define PK_CACHE_KID_HASH(k) ((k)[1] & (PK_CACHE_BUCKETS - 1))
+#define PK_CACHE_FPR_HASH(f,n) (buf32_to_u32 ((f)+(n)-4) \
+                                & (PK_CACHE_BUCKETS - 1))
 #endif
 
+/* The results of merge_selfsigs for the last merged keyblocks.  The
+ * entries are indexed by a hash over the content of the keyblock.  */
+#define MERGE_MEMO_SIZE 64
+struct merge_memo_node_s
+{
+  int pkttype;
+  void *snap;                     /* A shallow copy of the packet.   */
+  prefitem_t *prefs;              /* A copy of the preferences.      */
+  struct revocation_key *revkey;  /* A copy of the revocation keys.  */
+};
+typedef struct merge_memo_s
+{
+  byte hash[20];        /* SHA-1 over the content of the keyblock.  */
+  u32 valid_until;      /* The result is valid until then or if 0
+                         * for ever.  */
+  int nnodes;
+  struct merge_memo_node_s *nodes;
+} *merge_memo_t;
+static merge_memo_t merge_memo[MERGE_MEMO_SIZE];
+static int merge_memo_disabled;
+static struct
+{
+  unsigned int hits;
+  unsigned int misses;
+} merge_memo_stats;
+
 #if MAX_UID_CACHE_ENTRIES < 5
 #error we really need the userid cache
 #endif
 
 static void merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock);
+static void merge_memo_release (merge_memo_t memo);
 static int lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
 		   kbnode_t *ret_keyblock, kbnode_t *ret_found_key);
 static kbnode_t finish_lookup (kbnode_t keyblock,
                                unsigned int req_usage, int want_exact,
-                               int want_secret, unsigned int *r_flags);
+                               int want_secret,
+                               struct secret_key_rank_s *secret_ranks,
+                               unsigned int *r_flags);
 static void print_status_key_considered (kbnode_t keyblock, unsigned int flags);
 
 
@@ -162,6 +212,127 @@ print_stats ()
 #endif
 
 
+#if MAX_PK_CACHE_ENTRIES
+/* Unlink CE from the LRU list.  */
+static void
+pk_cache_lru_unlink (pk_cache_entry_t ce)
+{
+  if (ce->lru_prev)
+    ce->lru_prev->lru_next = ce->lru_next;
+  else
+    pk_cache_lru = ce->lru_next;
+  if (ce->lru_next)
+    ce->lru_next->lru_prev = ce->lru_prev;
+  else
+    pk_cache_lru_tail = ce->lru_prev;
+}
+
+
+/* Put CE at the head of the LRU list.  */
+static void
+pk_cache_lru_push (pk_cache_entry_t ce)
+{
+  ce->lru_prev = NULL;
+  ce->lru_next = pk_cache_lru;
+  if (pk_cache_lru)
+    pk_cache_lru->lru_prev = ce;
+  else
+    pk_cache_lru_tail = ce;
+  pk_cache_lru = ce;
+}
+
+
+/* Remove the least recently used entry from the cache.  */
+static void
+pk_cache_evict (void)
+{
+  pk_cache_entry_t ce = pk_cache_lru_tail;
+  pk_cache_entry_t *cep;
+
+  if (!ce)
+    return;
+
+  for (cep = &pk_cache_kid[PK_CACHE_KID_HASH (ce->keyid)];
+       *cep != ce; cep = &(*cep)->kid_next)
+    ;
+  *cep = ce->kid_next;
+  for (cep = &pk_cache_fpr[PK_CACHE_FPR_HASH (ce->pk->fpr, ce->pk->fprlen)];
+       *cep != ce; cep = &(*cep)->fpr_next)
+    ;
+  *cep = ce->fpr_next;
+  pk_cache_lru_unlink (ce);
+
+  free_public_key (ce->pk);
+  xfree (ce);
+  pk_cache_entries--;
+  pk_cache_stats.evictions++;
+}
+
+
+/* Return the cache entry for KEYID or NULL if it is not cached.  The
+ * entry is marked as used.  */
+static pk_cache_entry_t
+pk_cache_lookup (u32 *keyid)
+{
+  pk_cache_entry_t ce;
+
+  for (ce = pk_cache_kid[PK_CACHE_KID_HASH (keyid)]; ce; ce = ce->kid_next)
+    if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
+      {
+        if (ce != pk_cache_lru)
+          {
+            pk_cache_lru_unlink (ce);
+            pk_cache_lru_push (ce);
+          }
+        pk_cache_stats.hits++;
+        return ce;
+      }
+
+  pk_cache_stats.misses++;
+  return NULL;
+}
+
+
+/* Return the cache entry for the fingerprint FPR of length FPRLEN or
+ * NULL if it is not cached.  The entry is marked as used.  */
+static pk_cache_entry_t
+pk_cache_lookup_fpr (const byte *fpr, size_t fprlen)
+{
+  pk_cache_entry_t ce;
+
+  for (ce = pk_cache_fpr[PK_CACHE_FPR_HASH (fpr, fprlen)];
+       ce; ce = ce->fpr_next)
+    if (ce->pk->fprlen == fprlen && !memcmp (ce->pk->fpr, fpr, fprlen))
+      {
+        if (ce != pk_cache_lru)
+          {
+            pk_cache_lru_unlink (ce);
+            pk_cache_lru_push (ce);
+          }
+        pk_cache_stats.hits++;
+        return ce;
+      }
+
+  pk_cache_stats.misses++;
+  return NULL;
+}
+#endif /*MAX_PK_CACHE_ENTRIES*/
+
+
+/* Dump the public key cache stats.  */
+void
+getkey_dump_stats (void)
+{
+#if MAX_PK_CACHE_ENTRIES
+  log_info ("pk_cache: entries=%d hits=%u misses=%u evictions=%u\n",
+            pk_cache_entries, pk_cache_stats.hits, pk_cache_stats.misses,
+            pk_cache_stats.evictions);
+#endif
+  log_info ("merge_memo: hits=%u misses=%u\n",
+            merge_memo_stats.hits, merge_memo_stats.misses);
+}
+
+
 /* Cache a copy of a public key in the public key cache.  PK is not
  * cached if caching is disabled (via getkey_disable_caches), if
  * PK->FLAGS.DONT_CACHE is set, we don't know how to derive a key id
@@ -178,7 +349,7 @@ void
 cache_public_key (PKT_public_key * pk)
 {
 #if MAX_PK_CACHE_ENTRIES
-  pk_cache_entry_t ce, ce2;
+  pk_cache_entry_t ce;
   u32 keyid[2];
 
   if (pk_cache_disabled)
@@ -199,7 +370,7 @@ cache_public_key (PKT_public_key * pk)
   else
     return; /* Don't know how to get the keyid.  */
 
-  for (ce = pk_cache; ce; ce = ce->next)
+  for (ce = pk_cache_kid[PK_CACHE_KID_HASH (keyid)]; ce; ce = ce->kid_next)
     if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
       {
 	if (DBG_CACHE)
@@ -207,35 +378,19 @@ cache_public_key (PKT_public_key * pk)
 	return;
       }
 
-  if (pk_cache_entries >= MAX_PK_CACHE_ENTRIES)
-    {
-      int n;
+  while (pk_cache_entries >= MAX_PK_CACHE_ENTRIES)
+    pk_cache_evict ();
 
-      /* Remove the last 50% of the entries.  */
-      for (ce = pk_cache, n = 0; ce && n < pk_cache_entries/2; n++)
-        ce = ce->next;
-      if (ce && ce != pk_cache && ce->next)
-        {
-          ce2 = ce->next;
-          ce->next = NULL;
-          ce = ce2;
-          for (; ce; ce = ce2)
-            {
-              ce2 = ce->next;
-              free_public_key (ce->pk);
-              xfree (ce);
-              pk_cache_entries--;
-            }
-        }
-      log_assert (pk_cache_entries < MAX_PK_CACHE_ENTRIES);
-    }
   pk_cache_entries++;
   ce = xmalloc (sizeof *ce);
-  ce->next = pk_cache;
-  pk_cache = ce;
   ce->pk = copy_public_key (NULL, pk);
   ce->keyid[0] = keyid[0];
   ce->keyid[1] = keyid[1];
+  ce->kid_next = pk_cache_kid[PK_CACHE_KID_HASH (keyid)];
+  pk_cache_kid[PK_CACHE_KID_HASH (keyid)] = ce;
+  ce->fpr_next = pk_cache_fpr[PK_CACHE_FPR_HASH (pk->fpr, pk->fprlen)];
+  pk_cache_fpr[PK_CACHE_FPR_HASH (pk->fpr, pk->fprlen)] = ce;
+  pk_cache_lru_push (ce);
 #endif
 }
 
@@ -264,19 +419,21 @@ getkey_disable_caches ()
 {
 #if MAX_PK_CACHE_ENTRIES
   {
-    pk_cache_entry_t ce, ce2;
+    while (pk_cache_entries)
+      pk_cache_evict ();
+    pk_cache_disabled = 1;
+  }
+#endif
+  {
+    int i;
 
-    for (ce = pk_cache; ce; ce = ce2)
+    for (i = 0; i < MERGE_MEMO_SIZE; i++)
       {
-	ce2 = ce->next;
-	free_public_key (ce->pk);
-	xfree (ce);
+        merge_memo_release (merge_memo[i]);
+        merge_memo[i] = NULL;
       }
-    pk_cache_disabled = 1;
-    pk_cache_entries = 0;
-    pk_cache = NULL;
+    merge_memo_disabled = 1;
   }
-#endif
   /* fixme: disable user id cache ? */
 }
 
@@ -308,6 +465,20 @@ pk_from_block (PKT_public_key *pk, kbnode_t keyblock, kbnode_t found_key)
 }
 
 
+/* Return true if the v4 or v5 fingerprint FPR of length FPRLEN
+ * yields the key id KEYID.  */
+static int
+fpr_matches_keyid (const byte *fpr, size_t fprlen, u32 *keyid)
+{
+  u32 kid[2];
+
+  if (fprlen != 20 && fprlen != 32)
+    return 0;
+  keyid_from_fingerprint (NULL, fpr, fprlen, kid);
+  return kid[0] == keyid[0] && kid[1] == keyid[1];
+}
+
+
 /* Specialized version of get_pubkey which retrieves the key based on
  * information in SIG.  In contrast to get_pubkey PK is required.  IF
  * FORCED_PK is not NULL, this public key is used and copied to PK. */
@@ -324,9 +495,14 @@ get_pubkey_for_sig (ctrl_t ctrl, PKT_public_key *pk, PKT_signature *sig,
       return 0;
     }
 
-  /* First try the new ISSUER_FPR info.  */
+  /* First try the new ISSUER_FPR info.  If the key id taken from
+   * the fingerprint matches the ISSUER_KEYID and that one is already
+   * known not to be in the database, the fingerprint search would
+   * only scan the database again in vain.  */
   fpr = issuer_fpr_raw (sig, &fprlen);
-  if (fpr && !get_pubkey_byfprint (ctrl, pk, NULL, fpr, fprlen))
+  if (fpr && !(fpr_matches_keyid (fpr, fprlen, sig->keyid)
+               && keydb_kid_not_found (sig->keyid))
+      && !get_pubkey_byfprint (ctrl, pk, NULL, fpr, fprlen))
     return 0;
 
   /* Fallback to use the ISSUER_KEYID.  */
@@ -334,6 +510,136 @@ get_pubkey_for_sig (ctrl_t ctrl, PKT_public_key *pk, PKT_signature *sig,
 }
 
 
+/* Compare function for qsort and bsearch over an array of key ids.  */
+static int
+cmp_keyids (const void *a, const void *b)
+{
+  const u32 *ka = a;
+  const u32 *kb = b;
+
+  if (ka[0] != kb[0])
+    return ka[0] < kb[0]? -1 : 1;
+  if (ka[1] != kb[1])
+    return ka[1] < kb[1]? -1 : 1;
+  return 0;
+}
+
+
+/* Load the public keys with the NKIDS key ids from the array KIDS
+ * into the public key cache using a single search over the database.
+ * Key ids which are not found are recorded as such by the key
+ * database.  This is used before checking a large number of
+ * signatures to avoid a separate database scan for each signer; the
+ * subsequent calls to get_pubkey_for_sig are then served from the
+ * caches.  Duplicates in KIDS are allowed.  Errors are ignored
+ * because the keys will be looked up again anyway.  */
+void
+prefetch_pubkeys (ctrl_t ctrl, u32 (*kids)[2], unsigned int nkids)
+{
+  KEYDB_HANDLE hd = NULL;
+  KEYDB_SEARCH_DESC *desc = NULL;
+  u32 (*want)[2] = NULL;
+  char *found = NULL;
+  unsigned int i, n, nwant;
+  size_t descindex;
+  kbnode_t keyblock, node;
+  gpg_error_t err;
+  u32 kid[2];
+  u32 (*item)[2];
+
+  if (!nkids)
+    return;
+
+  want = xtrycalloc (nkids, sizeof *want);
+  if (!want)
+    goto leave;
+
+  /* Collect the key ids which neither cache can answer.  */
+  for (i=nwant=0; i < nkids; i++)
+    {
+#if MAX_PK_CACHE_ENTRIES
+      pk_cache_entry_t ce;
+
+      for (ce = pk_cache_kid[PK_CACHE_KID_HASH (kids[i])]; ce;
+           ce = ce->kid_next)
+        if (ce->keyid[0] == kids[i][0] && ce->keyid[1] == kids[i][1])
+          break;
+      if (ce)
+        continue;
+#endif
+      if (keydb_kid_not_found (kids[i]))
+        continue;
+      want[nwant][0] = kids[i][0];
+      want[nwant][1] = kids[i][1];
+      nwant++;
+    }
+  if (nwant < 2)
+    goto leave;  /* Not worth it; get_pubkey does the same.  */
+
+  qsort (want, nwant, sizeof *want, cmp_keyids);
+  for (i=n=1; i < nwant; i++)
+    if (cmp_keyids (want[i], want[n-1]))
+      {
+        want[n][0] = want[i][0];
+        want[n][1] = want[i][1];
+        n++;
+      }
+  nwant = n;
+
+  desc = xtrycalloc (nwant, sizeof *desc);
+  found = xtrycalloc (nwant, 1);
+  if (!desc || !found)
+    goto leave;
+  for (i=0; i < nwant; i++)
+    {
+      desc[i].mode = KEYDB_SEARCH_MODE_LONG_KID;
+      desc[i].u.kid[0] = want[i][0];
+      desc[i].u.kid[1] = want[i][1];
+    }
+
+  hd = keydb_new (ctrl);
+  if (!hd)
+    goto leave;
+
+  while (!(err = keydb_search (hd, desc, nwant, &descindex)))
+    {
+      err = keydb_get_keyblock (hd, &keyblock);
+      if (err)
+        {
+          if (gpg_err_code (err) == GPG_ERR_LEGACY_KEY)
+            continue;
+          goto leave;
+        }
+      merge_selfsigs (ctrl, keyblock);
+      for (node = keyblock; node; node = node->next)
+        {
+          if (node->pkt->pkttype != PKT_PUBLIC_KEY
+              && node->pkt->pkttype != PKT_PUBLIC_SUBKEY)
+            continue;
+          keyid_from_pk (node->pkt->pkt.public_key, kid);
+          item = bsearch (kid, want, nwant, sizeof *want, cmp_keyids);
+          if (!item)
+            continue;
+          found[item - want] = 1;
+          cache_public_key (node->pkt->pkt.public_key);
+        }
+      release_kbnode (keyblock);
+    }
+
+  /* Only a complete scan tells us which keys are not available.  */
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    for (i=0; i < nwant; i++)
+      if (!found[i])
+        keydb_note_kid_not_found (want[i]);
+
+ leave:
+  keydb_release (hd);
+  xfree (found);
+  xfree (desc);
+  xfree (want);
+}
+
+
 /* Return the public key with the key id KEYID and store it at PK.
  * The resources in *PK should be released using
  * release_public_key_parts().  This function also stores a copy of
@@ -368,16 +674,15 @@ get_pubkey (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
          NULL as it does not guarantee that the user IDs are
          cached. */
       pk_cache_entry_t ce;
-      for (ce = pk_cache; ce; ce = ce->next)
-	{
-	  if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	    /* XXX: We don't check PK->REQ_USAGE here, but if we don't
-	       read from the cache, we do check it!  */
-	    {
-	      copy_public_key (pk, ce->pk);
-	      return 0;
-	    }
-	}
+
+      ce = pk_cache_lookup (keyid);
+      if (ce)
+        {
+          /* XXX: We don't check PK->REQ_USAGE here, but if we don't
+             read from the cache, we do check it!  */
+          copy_public_key (pk, ce->pk);
+          return 0;
+        }
     }
 #endif
   /* More init stuff.  */
@@ -469,17 +774,15 @@ get_pubkey_fast (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
     /* Try to get it from the cache */
     pk_cache_entry_t ce;
 
-    for (ce = pk_cache; ce; ce = ce->next)
+    ce = pk_cache_lookup (keyid);
+    if (ce
+        /* Only consider primary keys.  */
+        && ce->pk->keyid[0] == ce->pk->main_keyid[0]
+        && ce->pk->keyid[1] == ce->pk->main_keyid[1])
       {
-	if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1]
-	    /* Only consider primary keys.  */
-	    && ce->pk->keyid[0] == ce->pk->main_keyid[0]
-	    && ce->pk->keyid[1] == ce->pk->main_keyid[1])
-	  {
-	    if (pk)
-	      copy_public_key (pk, ce->pk);
-	    return 0;
-	  }
+        if (pk)
+          copy_public_key (pk, ce->pk);
+        return 0;
       }
   }
 #endif
@@ -861,6 +1164,25 @@ key_byname (ctrl_t ctrl, GETKEY_CTX *retctx, strlist_t namelist,
 }
 
 
+/* Return true if akl_prefetch failed to get a key for the mail
+ * address in NAME via WKD.  */
+static int
+akl_wkd_failed_p (ctrl_t ctrl, const char *name)
+{
+  char *mbox;
+  int result;
+
+  if (!ctrl || !ctrl->akl_wkd_failed)
+    return 0;
+  mbox = mailbox_from_userid (name, 0);
+  if (!mbox)
+    return 0;
+  result = !!strlist_find (ctrl->akl_wkd_failed, mbox);
+  xfree (mbox);
+  return result;
+}
+
+
 /* Find a public key identified by NAME.
  *
  * If name appears to be a valid RFC822 mailbox (i.e., email address)
@@ -1095,6 +1417,12 @@ get_pubkey_byname (ctrl_t ctrl, enum get_pubkey_modes mode,
 
 	    case AKL_WKD:
 	      mechanism_string = "WKD";
+              if (akl_wkd_failed_p (ctrl, name))
+                {
+                  /* Already tried by akl_prefetch.  */
+                  rc = GPG_ERR_NO_PUBKEY;
+                  break;
+                }
 	      glo_ctrl.in_auto_key_retrieve++;
 	      rc = keyserver_import_wkd (ctrl, name, 0, &fpr, &fpr_len);
 	      glo_ctrl.in_auto_key_retrieve--;
@@ -1232,6 +1560,133 @@ get_pubkey_byname (ctrl_t ctrl, enum get_pubkey_modes mode,
 }
 
 
+/* Look up the keys for the mail addresses in NAMES via WKD before
+ * they are resolved one by one by get_pubkey_byname.  This is only
+ * done if WKD is the first network mechanism of --auto-key-locate
+ * and only for addresses which are not found in the local keyring
+ * if that is searched first.  The lookups are done concurrently by
+ * the dirmngr and are bounded by --auto-key-locate-timeout; the
+ * found keys are imported.  The addresses for which no key was
+ * found are remembered in CTRL so that get_pubkey_byname does not
+ * look them up again.  akl_prefetch_release needs to be called to
+ * forget them.  Errors are not returned because the lookups are
+ * repeated by get_pubkey_byname anyway.  */
+void
+akl_prefetch (ctrl_t ctrl, strlist_t names)
+{
+  gpg_error_t err;
+  struct akl *akl;
+  int nodefault = 0;
+  int localfirst = 0;
+  strlist_t sl, namelist;
+  strlist_t mboxes = NULL;
+  char *mbox;
+  char **array = NULL;
+  gpg_error_t *errs = NULL;
+  unsigned int n, idx;
+  PKT_public_key pk;
+
+  for (akl = opt.auto_key_locate; akl; akl = akl->next)
+    if (akl->type == AKL_NODEFAULT || akl->type == AKL_LOCAL)
+      nodefault = 1;
+  for (akl = opt.auto_key_locate; akl; akl = akl->next)
+    if (akl->type == AKL_LOCAL)
+      localfirst = 1;
+    else if (akl->type != AKL_NODEFAULT)
+      break;
+  if (!akl || akl->type != AKL_WKD)
+    return;
+  if (!nodefault)
+    localfirst = 1;
+
+  /* Collect the mail addresses not yet available.  */
+  n = 0;
+  for (sl = names; sl; sl = sl->next)
+    {
+      if ((sl->flags & (PK_LIST_ENCRYPT_TO | PK_LIST_FROM_FILE)))
+        continue;
+      if (!is_valid_mailbox (sl->d)
+          && !(*sl->d == '<' && sl->d[1] && sl->d[strlen (sl->d)-1] == '>'
+               && is_valid_mailbox_mem (sl->d+1, strlen (sl->d)-2)))
+        continue;
+      mbox = mailbox_from_userid (sl->d, 0);
+      if (!mbox)
+        continue;
+      if (strlist_find (mboxes, mbox))
+        {
+          xfree (mbox);
+          continue;
+        }
+      if (localfirst)
+        {
+          memset (&pk, 0, sizeof pk);
+          pk.req_usage = PUBKEY_USAGE_ENC;
+          namelist = NULL;
+          add_to_strlist (&namelist, sl->d);
+          err = key_byname (ctrl, NULL, namelist, &pk, 0, 0, NULL, NULL);
+          free_strlist (namelist);
+          release_public_key_parts (&pk);
+          if (gpg_err_code (err) != GPG_ERR_NO_PUBKEY)
+            {
+              xfree (mbox);
+              continue;
+            }
+        }
+      add_to_strlist (&mboxes, mbox);
+      xfree (mbox);
+      n++;
+    }
+
+  /* For a single address there is nothing to do concurrently.  */
+  if (n < 2)
+    goto leave;
+
+  array = xtrycalloc (n, sizeof *array);
+  errs = xtrycalloc (n, sizeof *errs);
+  if (!array || !errs)
+    goto leave;
+  for (idx=0, sl = mboxes; sl; sl = sl->next)
+    array[idx++] = sl->d;
+
+  if (opt.verbose)
+    log_info ("looking up %u keys via WKD\n", n);
+  glo_ctrl.in_auto_key_retrieve++;
+  err = keyserver_import_wkd_many (ctrl, array, n, opt.akl_timeout, errs);
+  glo_ctrl.in_auto_key_retrieve--;
+  if (err)
+    {
+      if (opt.verbose)
+        log_info ("looking up several keys via WKD failed: %s\n",
+                  gpg_strerror (err));
+      goto leave;
+    }
+
+  for (idx=0; idx < n; idx++)
+    {
+      if (!errs[idx])
+        continue;
+      add_to_strlist (&ctrl->akl_wkd_failed, array[idx]);
+      if (gpg_err_code (errs[idx]) != GPG_ERR_NO_DATA || opt.verbose)
+        log_info (_("error retrieving '%s' via %s: %s\n"),
+                  array[idx], "WKD", gpg_strerror (errs[idx]));
+    }
+
+ leave:
+  xfree (errs);
+  xfree (array);
+  free_strlist (mboxes);
+}
+
+
+/* Forget the results of akl_prefetch.  */
+void
+akl_prefetch_release (ctrl_t ctrl)
+{
+  free_strlist (ctrl->akl_wkd_failed);
+  ctrl->akl_wkd_failed = NULL;
+}
+
+
 
 
 /* Comparison machinery for get_best_pubkey_byname.  */
@@ -1608,7 +2063,8 @@ get_pubkey_fromfile (ctrl_t ctrl, PKT_public_key *pk, const char *fname)
       /* Warning: node flag bits 0 and 1 should be preserved by
        * merge_selfsigs.  FIXME: Check whether this still holds. */
       merge_selfsigs (ctrl, keyblock);
-      found_key = finish_lookup (keyblock, pk->req_usage, 0, 0, &infoflags);
+      found_key = finish_lookup (keyblock, pk->req_usage, 0, 0, NULL,
+                                 &infoflags);
       print_status_key_considered (keyblock, infoflags);
       if (found_key)
         pk_from_block (pk, keyblock, found_key);
@@ -1708,6 +2164,23 @@ get_pubkey_byfprint (ctrl_t ctrl, PKT_public_key *pk, kbnode_t *r_keyblock,
   if (r_keyblock)
     *r_keyblock = NULL;
 
+#if MAX_PK_CACHE_ENTRIES
+  if (pk && !r_keyblock && !pk->req_usage
+      && (fprint_len == 32 || fprint_len == 20))
+    {
+      /* Try to get it from the cache.  We can't do this if a certain
+       * usage is requested because the cache ignores it.  */
+      pk_cache_entry_t ce;
+
+      ce = pk_cache_lookup_fpr (fprint, fprint_len);
+      if (ce)
+        {
+          copy_public_key (pk, ce->pk);
+          return 0;
+        }
+    }
+#endif
+
   if (fprint_len == 32 || fprint_len == 20 || fprint_len == 16)
     {
       struct getkey_ctx_s ctx;
@@ -3289,13 +3762,9 @@ merge_selfsigs_subkey (ctrl_t ctrl, kbnode_t keyblock, kbnode_t subnode)
 }
 
 
-/* Merge information from the self-signatures with the public key,
- * subkeys and user ids to make using them more easy.
- *
- * See documentation for merge_selfsigs_main, merge_selfsigs_subkey
- * and fixup_uidnode for exactly which fields are updated.  */
+/* Worker for merge_selfsigs.  */
 static void
-merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
+do_merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
 {
   KBNODE k;
   int revoked;
@@ -3398,6 +3867,356 @@ merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
 }
 
 
+/* Hash the content of KEYBLOCK into HASH which must have a size of
+ * 20 bytes.  This also computes the keyids of all keys.  Returns 0 on
+ * success.  */
+static gpg_error_t
+merge_memo_hash (kbnode_t keyblock, byte *hash, int *r_nnodes)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  kbnode_t k;
+  PKT_public_key *pk;
+  PKT_user_id *uid;
+  PKT_signature *sig;
+  byte buf[4];
+  unsigned char *tmp;
+  unsigned int nbits;
+  size_t n;
+  int i, nnodes;
+
+  err = gcry_md_open (&md, GCRY_MD_SHA1, 0);
+  if (err)
+    return err;
+
+  for (k = keyblock, nnodes = 0; k; k = k->next, nnodes++)
+    {
+      gcry_md_putc (md, k->pkt->pkttype);
+      switch (k->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+          pk = k->pkt->pkt.public_key;
+          keyid_from_pk (pk, NULL);
+          gcry_md_putc (md, pk->version);
+          gcry_md_putc (md, pk->fprlen);
+          gcry_md_write (md, pk->fpr, pk->fprlen);
+          break;
+
+        case PKT_USER_ID:
+          uid = k->pkt->pkt.user_id;
+          if (uid->attrib_data)
+            {
+              ulongtobuf (buf, uid->attrib_len);
+              gcry_md_write (md, buf, 4);
+              gcry_md_write (md, uid->attrib_data, uid->attrib_len);
+            }
+          else
+            {
+              ulongtobuf (buf, uid->len);
+              gcry_md_write (md, buf, 4);
+              gcry_md_write (md, uid->name, uid->len);
+            }
+          break;
+
+        case PKT_SIGNATURE:
+          sig = k->pkt->pkt.signature;
+          gcry_md_putc (md, sig->version);
+          gcry_md_putc (md, sig->sig_class);
+          gcry_md_putc (md, sig->pubkey_algo);
+          gcry_md_putc (md, sig->digest_algo);
+          gcry_md_write (md, sig->digest_start, 2);
+          ulongtobuf (buf, sig->timestamp);
+          gcry_md_write (md, buf, 4);
+          ulongtobuf (buf, sig->keyid[0]);
+          gcry_md_write (md, buf, 4);
+          ulongtobuf (buf, sig->keyid[1]);
+          gcry_md_write (md, buf, 4);
+          if (sig->hashed)
+            {
+              ulongtobuf (buf, sig->hashed->len);
+              gcry_md_write (md, buf, 4);
+              gcry_md_write (md, sig->hashed->data, sig->hashed->len);
+            }
+          if (sig->unhashed)
+            {
+              ulongtobuf (buf, sig->unhashed->len);
+              gcry_md_write (md, buf, 4);
+              gcry_md_write (md, sig->unhashed->data, sig->unhashed->len);
+            }
+          for (i = 0; i < PUBKEY_MAX_NSIG && sig->data[i]; i++)
+            {
+              if (gcry_mpi_get_flag (sig->data[i], GCRYMPI_FLAG_OPAQUE))
+                {
+                  const void *p = gcry_mpi_get_opaque (sig->data[i], &nbits);
+                  ulongtobuf (buf, nbits);
+                  gcry_md_write (md, buf, 4);
+                  gcry_md_write (md, p, (nbits+7)/8);
+                }
+              else if (!gcry_mpi_aprint (GCRYMPI_FMT_USG, &tmp, &n,
+                                         sig->data[i]))
+                {
+                  ulongtobuf (buf, n);
+                  gcry_md_write (md, buf, 4);
+                  gcry_md_write (md, tmp, n);
+                  gcry_free (tmp);
+                }
+              else
+                {
+                  gcry_md_close (md);
+                  return gpg_error (GPG_ERR_INV_VALUE);
+                }
+            }
+          break;
+
+        default:
+          break;
+        }
+    }
+
+  memcpy (hash, gcry_md_read (md, GCRY_MD_SHA1), 20);
+  gcry_md_close (md);
+  *r_nnodes = nnodes;
+  return 0;
+}
+
+
+/* Release the memo entry MEMO.  */
+static void
+merge_memo_release (merge_memo_t memo)
+{
+  int i;
+
+  if (!memo)
+    return;
+  for (i = 0; i < memo->nnodes; i++)
+    {
+      xfree (memo->nodes[i].snap);
+      xfree (memo->nodes[i].prefs);
+      xfree (memo->nodes[i].revkey);
+    }
+  xfree (memo->nodes);
+  xfree (memo);
+}
+
+
+/* Return a copy of the NREVKEYS revocation keys at REVKEY.  */
+static struct revocation_key *
+copy_revkeys (const struct revocation_key *revkey, int nrevkeys)
+{
+  struct revocation_key *copy;
+
+  if (!revkey || !nrevkeys)
+    return NULL;
+  copy = xmalloc (nrevkeys * sizeof *revkey);
+  memcpy (copy, revkey, nrevkeys * sizeof *revkey);
+  return copy;
+}
+
+
+/* Remember the state of the just merged KEYBLOCK with the content
+ * hash HASH.  */
+static void
+merge_memo_store (kbnode_t keyblock, const byte *hash, int nnodes)
+{
+  merge_memo_t memo;
+  kbnode_t k;
+  u32 now = make_timestamp ();
+  u32 t[2];
+  int i, j;
+
+  /* The validity of a key without a valid self-signature may depend
+   * on the ownertrust of its signers; don't remember it.  */
+  if (!keyblock->pkt->pkt.public_key->selfsigversion)
+    return;
+
+  memo = xmalloc_clear (sizeof *memo);
+  memcpy (memo->hash, hash, 20);
+  memo->nnodes = nnodes;
+  memo->nodes = xcalloc (nnodes, sizeof *memo->nodes);
+
+  for (k = keyblock, i = 0; k; k = k->next, i++)
+    {
+      struct merge_memo_node_s *node = memo->nodes + i;
+
+      t[0] = t[1] = 0;
+      node->pkttype = k->pkt->pkttype;
+      switch (k->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+          {
+            PKT_public_key *pk = k->pkt->pkt.public_key;
+
+            node->snap = xmalloc (sizeof *pk);
+            memcpy (node->snap, pk, sizeof *pk);
+            node->prefs = copy_prefs (pk->prefs);
+            node->revkey = copy_revkeys (pk->revkey, pk->numrevkeys);
+            t[0] = pk->timestamp;
+            t[1] = pk->expiredate;
+          }
+          break;
+
+        case PKT_USER_ID:
+          {
+            PKT_user_id *uid = k->pkt->pkt.user_id;
+
+            node->snap = xmalloc (sizeof *uid);
+            memcpy (node->snap, uid, sizeof *uid);
+            node->prefs = copy_prefs (uid->prefs);
+            t[0] = uid->expiredate;
+          }
+          break;
+
+        case PKT_SIGNATURE:
+          {
+            PKT_signature *sig = k->pkt->pkt.signature;
+
+            node->snap = xmalloc (sizeof *sig);
+            memcpy (node->snap, sig, sizeof *sig);
+            t[0] = sig->timestamp;
+            t[1] = sig->expiredate;
+          }
+          break;
+
+        default:
+          break;
+        }
+
+      /* The result changes when one of these dates passes.  */
+      for (j = 0; j < 2; j++)
+        if (t[j] > now && (!memo->valid_until || t[j] < memo->valid_until))
+          memo->valid_until = t[j];
+    }
+
+  i = hash[0] % MERGE_MEMO_SIZE;
+  merge_memo_release (merge_memo[i]);
+  merge_memo[i] = memo;
+}
+
+
+/* Apply the remembered result for the keyblock with the content HASH
+ * to KEYBLOCK.  Returns true if a matching entry was found.  */
+static int
+merge_memo_apply (kbnode_t keyblock, const byte *hash, int nnodes)
+{
+  merge_memo_t memo = merge_memo[hash[0] % MERGE_MEMO_SIZE];
+  kbnode_t k;
+  int i;
+
+  if (!memo || memo->nnodes != nnodes || memcmp (memo->hash, hash, 20))
+    {
+      merge_memo_stats.misses++;
+      return 0;
+    }
+  if (memo->valid_until && make_timestamp () >= memo->valid_until)
+    {
+      merge_memo_stats.misses++;
+      return 0;
+    }
+
+  for (k = keyblock, i = 0; k; k = k->next, i++)
+    {
+      struct merge_memo_node_s *node = memo->nodes + i;
+
+      log_assert (node->pkttype == k->pkt->pkttype);
+      switch (k->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+          {
+            PKT_public_key *pk = k->pkt->pkt.public_key;
+            PKT_public_key *snap = node->snap;
+
+            pk->main_keyid[0] = snap->main_keyid[0];
+            pk->main_keyid[1] = snap->main_keyid[1];
+            pk->flags.mdc = snap->flags.mdc;
+            pk->flags.aead = snap->flags.aead;
+            pk->flags.revoked = snap->flags.revoked;
+            pk->flags.maybe_revoked = snap->flags.maybe_revoked;
+            pk->flags.valid = snap->flags.valid;
+            pk->flags.backsig = snap->flags.backsig;
+            pk->flags.exact = snap->flags.exact;
+            pk->selfsigversion = snap->selfsigversion;
+            pk->pubkey_usage = snap->pubkey_usage;
+            pk->has_expired = snap->has_expired;
+            pk->expiredate = snap->expiredate;
+            pk->revoked = snap->revoked;
+            xfree (pk->prefs);
+            pk->prefs = copy_prefs (node->prefs);
+            xfree (pk->revkey);
+            pk->revkey = copy_revkeys (node->revkey, snap->numrevkeys);
+            pk->numrevkeys = pk->revkey? snap->numrevkeys : 0;
+          }
+          break;
+
+        case PKT_USER_ID:
+          {
+            PKT_user_id *uid = k->pkt->pkt.user_id;
+            PKT_user_id *snap = node->snap;
+
+            uid->flags.mdc = snap->flags.mdc;
+            uid->flags.aead = snap->flags.aead;
+            uid->flags.ks_modify = snap->flags.ks_modify;
+            uid->flags.primary = snap->flags.primary;
+            uid->flags.revoked = snap->flags.revoked;
+            uid->flags.expired = snap->flags.expired;
+            uid->created = snap->created;
+            uid->expiredate = snap->expiredate;
+            uid->help_key_expire = snap->help_key_expire;
+            uid->help_key_usage = snap->help_key_usage;
+            uid->selfsigversion = snap->selfsigversion;
+            xfree (uid->prefs);
+            uid->prefs = copy_prefs (node->prefs);
+          }
+          break;
+
+        case PKT_SIGNATURE:
+          k->pkt->pkt.signature->flags
+            = ((PKT_signature *)node->snap)->flags;
+          break;
+
+        default:
+          break;
+        }
+    }
+
+  merge_memo_stats.hits++;
+  return 1;
+}
+
+
+/* Merge information from the self-signatures with the public key,
+ * subkeys and user ids to make using them more easy.
+ *
+ * See documentation for merge_selfsigs_main, merge_selfsigs_subkey
+ * and fixup_uidnode for exactly which fields are updated.
+ *
+ * The results are memoized for a set of recently merged keyblocks;
+ * if a keyblock with the same content is merged again its state is
+ * restored from there.  */
+static void
+merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
+{
+  byte hash[20];
+  int nnodes;
+
+  if (merge_memo_disabled
+      || keyblock->pkt->pkttype != PKT_PUBLIC_KEY
+      || merge_memo_hash (keyblock, hash, &nnodes))
+    {
+      do_merge_selfsigs (ctrl, keyblock);
+      return;
+    }
+
+  if (merge_memo_apply (keyblock, hash, nnodes))
+    return;
+
+  do_merge_selfsigs (ctrl, keyblock);
+  merge_memo_store (keyblock, hash, nnodes);
+}
+
+
 
 /* See whether the key satisfies any additional requirements specified
  * in CTX.  If so, return the node of an appropriate key or subkey.
@@ -3447,7 +4266,8 @@ merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
  */
 static kbnode_t
 finish_lookup (kbnode_t keyblock, unsigned int req_usage, int want_exact,
-               int want_secret, unsigned int *r_flags)
+               int want_secret, struct secret_key_rank_s *secret_ranks,
+               unsigned int *r_flags)
 {
   kbnode_t k;
 
@@ -3592,7 +4412,12 @@ finish_lookup (kbnode_t keyblock, unsigned int req_usage, int want_exact,
 
           if (want_secret)
             {
-              int secret_key_avail = agent_probe_secret_key (NULL, pk);
+              int secret_key_avail;
+
+              /* Use the value from the batched query if we have one.  */
+              secret_key_avail = agent_secret_key_rank (secret_ranks, pk);
+              if (secret_key_avail < 0)
+                secret_key_avail = agent_probe_secret_key (NULL, pk);
 
               if (!secret_key_avail)
                 {
@@ -3759,6 +4584,7 @@ lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
   KBNODE keyblock = NULL;
   KBNODE found_key = NULL;
   unsigned int infoflags;
+  struct secret_key_rank_s *secret_ranks = NULL;
 
   log_assert (ret_found_key == NULL || ret_keyblock != NULL);
   if (ret_keyblock)
@@ -3776,7 +4602,13 @@ lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
       if (ctx->nitems && ctx->items->mode == KEYDB_SEARCH_MODE_FIRST)
 	ctx->items->mode = KEYDB_SEARCH_MODE_NEXT;
 
+      /* An encryption key lookup does not need the certifications;
+       * skipping them avoids stalls with flooded keys.  */
+      keydb_set_self_sigs_only (ctx->kr_handle,
+                                (!want_secret
+                                 && ctx->req_usage == PUBKEY_USAGE_ENC));
       rc = keydb_get_keyblock (ctx->kr_handle, &keyblock);
+      keydb_set_self_sigs_only (ctx->kr_handle, 0);
       if (rc)
 	{
 	  log_error ("keydb_get_keyblock failed: %s\n", gpg_strerror (rc));
@@ -3785,18 +4617,30 @@ lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
 
       if (want_secret)
 	{
-	  rc = agent_probe_any_secret_key (NULL, keyblock);
-	  if (gpg_err_code(rc) == GPG_ERR_NO_SECKEY)
-	    goto skip; /* No secret key available.  */
-	  if (rc)
-	    goto found; /* Unexpected error.  */
+          /* Ask for all keys of the keyblock in one go so that
+           * finish_lookup does not need to ask for each subkey.  */
+          xfree (secret_ranks);
+          if (!agent_probe_secret_keys (NULL, keyblock, &secret_ranks))
+            {
+              if (!agent_any_secret_key_rank (secret_ranks))
+                goto skip; /* No secret key available.  */
+            }
+          else
+            {
+              /* Probably an old agent.  */
+              rc = agent_probe_any_secret_key (NULL, keyblock);
+              if (gpg_err_code(rc) == GPG_ERR_NO_SECKEY)
+                goto skip; /* No secret key available.  */
+              if (rc)
+                goto found; /* Unexpected error.  */
+            }
 	}
 
       /* Warning: node flag bits 0 and 1 should be preserved by
        * merge_selfsigs.  */
       merge_selfsigs (ctrl, keyblock);
       found_key = finish_lookup (keyblock, ctx->req_usage, ctx->exact,
-                                 want_secret, &infoflags);
+                                 want_secret, secret_ranks, &infoflags);
       print_status_key_considered (keyblock, infoflags);
       if (found_key)
 	{
@@ -3838,6 +4682,7 @@ lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
     rc = want_secret? GPG_ERR_NO_SECKEY : GPG_ERR_NO_PUBKEY;
 
   release_kbnode (keyblock);
+  xfree (secret_ranks);
 
   if (ret_found_key)
     {
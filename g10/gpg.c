@@ -59,9 +59,11 @@
 #include "exec.h"
 #include "../common/gc-opt-flags.h"
 #include "../common/asshelp.h"
+#include "../common/metrics.h"
 #include "call-dirmngr.h"
 #include "tofu.h"
 #include "objcache.h"
+#include "sigcache.h"
 #include "../common/init.h"
 #include "../common/mbox-util.h"
 #include "../common/shareddefs.h"
@@ -107,8 +109,11 @@ enum cmd_and_opt_values
     aListSecretKeys = 'K',
     oBatch	  = 500,
     oMaxOutput,
+    oDecryptRange,
     oInputSizeHint,
     oChunkSize,
+    oJobs,
+    oTraceIPC,
     oSigNotation,
     oCertNotation,
     oShowNotation,
@@ -176,6 +181,7 @@ enum cmd_and_opt_values
     aDeArmor,
     aEnArmor,
     aGenRandom,
+    aBenchmark,
     aRebuildKeydbCaches,
     aCardStatus,
     aCardEdit,
@@ -323,6 +329,7 @@ enum cmd_and_opt_values
     oKeyServerOptions,
     oImportOptions,
     oImportFilter,
+    oImportMaxSigs,
     oExportOptions,
     oExportFilter,
     oListOptions,
@@ -373,6 +380,7 @@ enum cmd_and_opt_values
     oFixedListMode,
     oLegacyListMode,
     oNoSigCache,
+    oObjcacheSize,
     oAutoCheckTrustDB,
     oNoAutoCheckTrustDB,
     oPreservePermissions,
@@ -401,8 +409,10 @@ enum cmd_and_opt_values
     oNoMangleDosFilenames,
     oEnableProgressFilter,
     oMultifile,
+    oMultisig,
     oKeyidFormat,
     oExitOnStatusWriteError,
+    oBufferedStatus,
     oLimitCardInsertTries,
     oReaderPort,
     octapiDriver,
@@ -412,6 +422,7 @@ enum cmd_and_opt_values
     oNoRequireCrossCert,
     oAutoKeyLocate,
     oNoAutoKeyLocate,
+    oAutoKeyLocateTimeout,
     oEnableLargeRSA,
     oDisableLargeRSA,
     oEnableDSA2,
@@ -424,6 +435,7 @@ enum cmd_and_opt_values
     oPrintDANERecords,
     oTOFUDefaultPolicy,
     oTOFUDBFormat,
+    oTOFUJournal,
     oDefaultNewKeyAlgo,
     oWeakDigest,
     oUnwrap,
@@ -553,6 +565,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_c (aPrintMDs, "print-mds", "@"), /* old */
   ARGPARSE_c (aPrimegen, "gen-prime", "@" ),
   ARGPARSE_c (aGenRandom,"gen-random", "@" ),
+  ARGPARSE_c (aBenchmark, "benchmark", "@"),
   ARGPARSE_c (aServer,   "server",  N_("run in server mode")),
   ARGPARSE_c (aTOFUPolicy, "tofu-policy",
 	      N_("|VALUE|set the TOFU policy for a key")),
@@ -635,6 +648,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oKeyboxdProgram, "keyboxd-program", "@"),
   ARGPARSE_s_s (oDirmngrProgram, "dirmngr-program", "@"),
   ARGPARSE_s_n (oExitOnStatusWriteError, "exit-on-status-write-error", "@"),
+  ARGPARSE_s_n (oBufferedStatus, "buffered-status", "@"),
   ARGPARSE_s_i (oLimitCardInsertTries, "limit-card-insert-tries", "@"),
   ARGPARSE_s_n (oEnableProgressFilter, "enable-progress-filter", "@"),
   ARGPARSE_s_s (oTempDir,  "temp-directory", "@"),
@@ -677,6 +691,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oPreservePermissions, "preserve-permissions", "@"),
   ARGPARSE_s_i (oDefCertLevel, "default-cert-check-level", "@"), /* old */
   ARGPARSE_s_s (oTOFUDefaultPolicy, "tofu-default-policy", "@"),
+  ARGPARSE_s_n (oTOFUJournal, "tofu-journal", "@"),
   ARGPARSE_s_n (oLockOnce,     "lock-once", "@"),
   ARGPARSE_s_n (oLockMultiple, "lock-multiple", "@"),
   ARGPARSE_s_n (oLockNever,    "lock-never", "@"),
@@ -697,6 +712,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_header ("Input", N_("Options controlling the input")),
 
   ARGPARSE_s_n (oMultifile, "multifile", "@"),
+  ARGPARSE_s_n (oMultisig, "multisig", "@"),
   ARGPARSE_s_s (oInputSizeHint, "input-size-hint", "@"),
   ARGPARSE_s_n (oUtf8Strings,      "utf8-strings", "@"),
   ARGPARSE_s_n (oNoUtf8Strings, "no-utf8-strings", "@"),
@@ -720,6 +736,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oNoArmor, "no-armour", "@"),
   ARGPARSE_s_s (oOutput, "output", N_("|FILE|write output to FILE")),
   ARGPARSE_p_u (oMaxOutput, "max-output", "@"),
+  ARGPARSE_s_s (oDecryptRange, "decrypt-range", "@"),
   ARGPARSE_s_s (oComment, "comment", "@"),
   ARGPARSE_s_n (oDefaultComment, "default-comment", "@"),
   ARGPARSE_s_n (oNoComments, "no-comments", "@"),
@@ -745,6 +762,8 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oMangleDosFilenames,      "mangle-dos-filenames", "@"),
   ARGPARSE_s_n (oNoMangleDosFilenames, "no-mangle-dos-filenames", "@"),
   ARGPARSE_s_i (oChunkSize, "chunk-size", "@"),
+  ARGPARSE_s_i (oJobs, "jobs", "@"),
+  ARGPARSE_s_n (oTraceIPC, "trace-ipc", "@"),
   ARGPARSE_s_n (oNoSymkeyCache, "no-symkey-cache", "@"),
   ARGPARSE_s_n (oSkipVerify, "skip-verify", "@"),
   ARGPARSE_s_n (oListOnly, "list-only", "@"),
@@ -760,6 +779,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oAutoKeyLocate, "auto-key-locate",
               N_("|MECHANISMS|use MECHANISMS to locate keys by mail address")),
   ARGPARSE_s_n (oNoAutoKeyLocate, "no-auto-key-locate", "@"),
+  ARGPARSE_s_u (oAutoKeyLocateTimeout, "auto-key-locate-timeout", "@"),
   ARGPARSE_s_n (oAutoKeyImport,   "auto-key-import",
                 N_("import missing key from a signature")),
   ARGPARSE_s_n (oNoAutoKeyImport, "no-auto-key-import", "@"),
@@ -775,6 +795,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_s (oKeyOrigin, "key-origin", "@"),
   ARGPARSE_s_s (oImportOptions, "import-options", "@"),
   ARGPARSE_s_s (oImportFilter,  "import-filter", "@"),
+  ARGPARSE_s_u (oImportMaxSigs, "import-max-sigs", "@"),
   ARGPARSE_s_s (oExportOptions, "export-options", "@"),
   ARGPARSE_s_s (oExportFilter,  "export-filter", "@"),
   ARGPARSE_s_n (oMergeOnly,	  "merge-only", "@" ),
@@ -857,6 +878,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oEnableSpecialFilenames, "enable-special-filenames", "@"),
   ARGPARSE_s_n (oNoRandomSeedFile,  "no-random-seed-file", "@"),
   ARGPARSE_s_n (oNoSigCache,         "no-sig-cache", "@"),
+  ARGPARSE_s_u (oObjcacheSize,       "objcache-size", "@"),
   ARGPARSE_s_n (oIgnoreTimeConflict, "ignore-time-conflict", "@"),
   ARGPARSE_s_n (oIgnoreValidFrom,    "ignore-valid-from", "@"),
   ARGPARSE_s_n (oIgnoreCrcError, "ignore-crc-error", "@"),
@@ -1003,6 +1025,14 @@ static struct debug_flags_s debug_flags [] =
 /* The list of the default AKL methods.  */
 #define DEFAULT_AKL_LIST "local,wkd"
 
+/* The default for --auto-key-locate-timeout in seconds.  */
+#define DEFAULT_AKL_TIMEOUT 30
+
+/* The default for --import-max-sigs.  Even with the smallest
+ * signatures a keyblock with that many signatures does not fit into
+ * a keybox blob; thus the limit does not change what gets stored.  */
+#define DEFAULT_IMPORT_MAX_SIGS 100000
+
 
 int g10_errors_seen = 0;
 
@@ -1011,6 +1041,9 @@ static int maybe_setuid = 1;
 static unsigned int opt_set_iobuf_size;
 static unsigned int opt_set_iobuf_size_used;
 
+/* The start time of this process for --trace-ipc.  */
+static uint64_t trace_ipc_start;
+
 static char *build_list( const char *text, char letter,
 			 const char *(*mapf)(int), int (*chkf)(int) );
 static void set_cmd( enum cmd_and_opt_values *ret_cmd,
@@ -2315,6 +2348,7 @@ main (int argc, char **argv)
     char *pers_compress_list = NULL;
     int eyes_only=0;
     int multifile=0;
+    int multisig=0;
     int pwfd = -1;
     int ovrseskeyfd = -1;
     int fpr_maybe_cmd = 0; /* --fingerprint maybe a command.  */
@@ -2412,9 +2446,11 @@ main (int argc, char **argv)
     set_screen_dimensions ();
     opt.keyid_format = KF_NONE;
     opt.def_sig_expire = "0";
+    opt.import_max_sigs = DEFAULT_IMPORT_MAX_SIGS;
     opt.def_cert_expire = "0";
     gnupg_set_homedir (NULL);
     opt.passphrase_repeat = 1;
+    opt.akl_timeout = DEFAULT_AKL_TIMEOUT;
     opt.emit_version = 0;
     opt.weak_digests = NULL;
     opt.compliance = CO_GNUPG;
@@ -2600,6 +2636,7 @@ main (int argc, char **argv)
 	  case aDesigRevoke:
 	  case aPrimegen:
 	  case aGenRandom:
+	  case aBenchmark:
 	  case aPrintMD:
 	  case aPrintMDs:
 	  case aListTrustDB:
@@ -2674,6 +2711,23 @@ main (int argc, char **argv)
 
 	  case oMaxOutput: opt.max_output = pargs.r.ret_ulong; break;
 
+          case oDecryptRange:
+            {
+              const char *s = pargs.r.ret_str;
+
+              if (!digitp (s))
+                log_error (_("invalid argument for option \"%.50s\"\n"),
+                           "--decrypt-range");
+              else
+                {
+                  opt.range_offset = string_to_u64 (s);
+                  s = strchr (s, ':');
+                  opt.range_length = s? string_to_u64 (s+1) : 0;
+                  opt.flags.decrypt_range = 1;
+                }
+            }
+            break;
+
           case oInputSizeHint:
             opt.input_size_hint = string_to_u64 (pargs.r.ret_str);
             break;
@@ -2682,6 +2736,18 @@ main (int argc, char **argv)
             opt.chunk_size = pargs.r.ret_int;
             break;
 
+          case oJobs:
+            opt.jobs = pargs.r.ret_int;
+            break;
+
+          case oTraceIPC:
+            if (!*metric_trace_id ())
+              {
+                metric_new_trace_id ();
+                trace_ipc_start = metric_usec ();
+              }
+            break;
+
 	  case oQuiet: opt.quiet = 1; break;
 	  case oNoTTY: tty_no_terminal(1); break;
 	  case oDryRun: opt.dry_run = 1; break;
@@ -2904,6 +2970,9 @@ main (int argc, char **argv)
 	  case oTOFUDBFormat:
 	    obsolete_option (configname, pargs.lineno, "tofu-db-format");
 	    break;
+	  case oTOFUJournal:
+	    opt.tofu_journal = 1;
+	    break;
 
 	  case oForceOwnertrust:
 	    log_info(_("Note: %s is not for normal use!\n"),
@@ -3270,6 +3339,7 @@ main (int argc, char **argv)
 	    if (rc)
               log_error (_("invalid filter option: %s\n"), gpg_strerror (rc));
 	    break;
+	  case oImportMaxSigs: opt.import_max_sigs = pargs.r.ret_ulong; break;
 	  case oExportOptions:
 	    if(!parse_export_options(pargs.r.ret_str,&opt.export_options,1))
 	      {
@@ -3381,6 +3451,7 @@ main (int argc, char **argv)
             }
             break;
           case oNoSigCache: opt.no_sig_cache = 1; break;
+          case oObjcacheSize: objcache_set_size (pargs.r.ret_ulong); break;
 	  case oAllowNonSelfsignedUID: opt.allow_non_selfsigned_uid = 1; break;
 	  case oNoAllowNonSelfsignedUID: opt.allow_non_selfsigned_uid=0; break;
 	  case oAllowFreeformUID: opt.allow_freeform_uid = 1; break;
@@ -3506,6 +3577,7 @@ main (int argc, char **argv)
           case oNoMangleDosFilenames: opt.mangle_dos_filenames = 0; break;
           case oEnableProgressFilter: opt.enable_progress_filter = 1; break;
 	  case oMultifile: multifile=1; break;
+	  case oMultisig: multisig=1; break;
 	  case oKeyidFormat:
 	    if(ascii_strcasecmp(pargs.r.ret_str,"short")==0)
 	      opt.keyid_format=KF_SHORT;
@@ -3524,6 +3596,9 @@ main (int argc, char **argv)
           case oExitOnStatusWriteError:
             opt.exit_on_status_write_error = 1;
             break;
+          case oBufferedStatus:
+            opt.buffered_status = 1;
+            break;
 
 	  case oLimitCardInsertTries:
             opt.limit_card_insert_tries = pargs.r.ret_int;
@@ -3552,6 +3627,9 @@ main (int argc, char **argv)
 	  case oNoAutoKeyLocate:
 	    release_akl();
 	    break;
+	  case oAutoKeyLocateTimeout:
+            opt.akl_timeout = pargs.r.ret_ulong;
+            break;
 
 	  case oKeyOrigin:
 	    if(!parse_key_origin (pargs.r.ret_str))
@@ -4082,7 +4160,11 @@ main (int argc, char **argv)
     if (!opt.use_keyboxd
         && default_keyring >= 0
         && (ALWAYS_ADD_KEYRINGS
-            || (cmd != aDeArmor && cmd != aEnArmor && cmd != aGPGConfTest)))
+            || (cmd != aDeArmor && cmd != aEnArmor && cmd != aGPGConfTest
+                && cmd != aPrintMD && cmd != aPrintMDs && cmd != aGenRandom
+                && cmd != aBenchmark
+                && cmd != aPrimegen && cmd != aListConfig
+                && cmd != aListGcryptConfig)))
       {
 	if (!nrings || default_keyring > 0)  /* Add default ring. */
 	    keydb_add_resource ("pubring" EXTSEP_S GPGEXT_GPG,
@@ -4091,6 +4173,8 @@ main (int argc, char **argv)
           keydb_add_resource (sl->d, sl->flags);
       }
     FREE_STRLIST(nrings);
+    if (DBG_CLOCK)
+      log_clock ("keyrings registered");
 
     /* In loopback mode, never ask for the password multiple times.  */
     if (opt.pinentry_mode == PINENTRY_MODE_LOOPBACK)
@@ -4132,6 +4216,7 @@ main (int argc, char **argv)
       case aPrintMD:
       case aPrintMDs:
       case aGenRandom:
+      case aBenchmark:
       case aDeArmor:
       case aEnArmor:
       case aListConfig:
@@ -4160,6 +4245,9 @@ main (int argc, char **argv)
                  gpg_strerror (rc));
 #endif /*!NO_TRUST_MODELS*/
 
+    if (DBG_CLOCK)
+      log_clock ("setup done");
+
     switch (cmd)
       {
       case aStore:
@@ -4385,6 +4473,13 @@ main (int argc, char **argv)
 	    if ((rc = verify_files (ctrl, argc, argv)))
 	      log_error("verify files failed: %s\n", gpg_strerror (rc) );
 	  }
+	else if (multisig)
+	  {
+	    if (argc < 2)
+	      wrong_args ("--verify --multisig sigfiles datafile");
+	    if ((rc = verify_signature_files (ctrl, argc, argv)))
+	      log_error("verify signatures failed: %s\n", gpg_strerror (rc) );
+	  }
 	else
 	  {
 	    if ((rc = verify_signatures (ctrl, argc, argv)))
@@ -4872,6 +4967,12 @@ main (int argc, char **argv)
         wrong_args("--gen-prime not yet supported ");
 	break;
 
+      case aBenchmark:
+        if (argc > 1 || (argc && atoi (*argv) < 0))
+          wrong_args ("--benchmark [MiB]");
+        run_benchmarks (argc? atoi (*argv) : 0);
+        break;
+
       case aGenRandom:
 	{
 	    int level = argc ? atoi(*argv):0;
@@ -5213,14 +5314,22 @@ g10_exit( int rc )
    * status line. */
   if (rc)
     write_status_failure ("gpg-exit", gpg_error (GPG_ERR_GENERAL));
+  write_status_flush ();
 
   gcry_control (GCRYCTL_UPDATE_RANDOM_SEED_FILE);
   if (DBG_CLOCK)
     log_clock ("stop");
 
+  /* Close the trace of --trace-ipc.  */
+  if (*metric_trace_id ())
+    metric_trace_span (metric_trace_id (), "total",
+                       metric_usec () - trace_ipc_start,
+                       rc? gpg_error (GPG_ERR_GENERAL) : 0);
+
   if ( (opt.debug & DBG_MEMSTAT_VALUE) )
     {
       keydb_dump_stats ();
+      getkey_dump_stats ();
       sig_check_dump_stats ();
       objcache_dump_stats ();
       gcry_control (GCRYCTL_DUMP_MEMORY_STATS);
@@ -5229,6 +5338,8 @@ g10_exit( int rc )
   if (opt.debug)
     gcry_control (GCRYCTL_DUMP_SECMEM_STATS );
 
+  sigcache_flush ();
+
   gnupg_block_all_signals ();
   emergency_cleanup ();
 
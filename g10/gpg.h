@@ -110,6 +110,10 @@ struct server_control_s
 
   /* This is used to cache a key data base handle.  */
   KEYDB_HANDLE cached_getkey_kdb;
+
+  /* Mail addresses for which akl_prefetch could not get a key via
+   * WKD.  get_pubkey_byname does not try them again.  */
+  struct string_list *akl_wkd_failed;
 };
 
 
@@ -34,6 +34,7 @@
 #define GNUPG_LIBREADLINE_H_INCLUDED
 #include <readline/readline.h>
 #endif
+#include <npth.h>
 
 #define INCLUDED_BY_MAIN_MODULE 1
 #include "gpg.h"
@@ -68,6 +69,8 @@ enum cmd_and_opt_values {
   oWeakDigest,
   oEnableSpecialFilenames,
   oDebug,
+  oManifest,
+  oJobs,
   aTest
 };
 
@@ -91,6 +94,9 @@ static gpgrt_opt_t opts[] = {
                 N_("|ALGO|reject signatures made with ALGO")),
   ARGPARSE_s_n (oEnableSpecialFilenames, "enable-special-filenames", "@"),
   ARGPARSE_s_s (oDebug, "debug", "@"),
+  ARGPARSE_s_n (oManifest, "manifest",
+                N_("read the files to verify from stdin")),
+  ARGPARSE_s_i (oJobs, "jobs", "@"),
 
   ARGPARSE_end ()
 };
@@ -177,6 +183,7 @@ main( int argc, char **argv )
   strlist_t sl;
   strlist_t nrings = NULL;
   ctrl_t ctrl;
+  int manifest = 0;
 
   early_system_init ();
   gpgrt_set_strusage (my_strusage);
@@ -251,15 +258,24 @@ main( int argc, char **argv )
         case oEnableSpecialFilenames:
           enable_special_filenames ();
           break;
+        case oManifest: manifest = 1; break;
+        case oJobs: opt.jobs = pargs.r.ret_int; break;
         default : pargs.err = ARGPARSE_PRINT_ERROR; break;
 	}
     }
 
   gpgrt_argparse (NULL, &pargs, NULL);  /* Release internal state.  */
 
+  if (manifest && argc)
+    log_error (_("no files may be given with --manifest\n"));
+
   if (log_get_errorcount (0))
     g10_exit(2);
 
+  /* Init threading which is used by the worker pool.  */
+  npth_init ();
+  gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+
   if (opt.verbose > 1)
     set_packet_list_mode(1);
 
@@ -275,7 +291,11 @@ main( int argc, char **argv )
 
   ctrl = xcalloc (1, sizeof *ctrl);
 
-  if ((rc = verify_signatures (ctrl, argc, argv)))
+  if (manifest)
+    rc = verify_manifest (ctrl);
+  else
+    rc = verify_signatures (ctrl, argc, argv);
+  if (rc)
     log_error("verify signatures failed: %s\n", gpg_strerror (rc) );
 
   keydb_release (ctrl->cached_getkey_kdb);
@@ -467,6 +487,18 @@ keyserver_import_wkd (ctrl_t ctrl, const char *name, int quick,
   return GPG_ERR_BUG;
 }
 
+gpg_error_t
+keyserver_import_wkd_many (ctrl_t ctrl, char **mboxes, unsigned int nmboxes,
+                           unsigned int deadline, gpg_error_t *r_errs)
+{
+  (void)ctrl;
+  (void)mboxes;
+  (void)nmboxes;
+  (void)deadline;
+  (void)r_errs;
+  return GPG_ERR_BUG;
+}
+
 int
 keyserver_import_name (const char *name,struct keyserver_spec *spec)
 {
@@ -698,6 +730,31 @@ agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock)
   return gpg_error (GPG_ERR_NO_SECKEY);
 }
 
+gpg_error_t
+agent_probe_secret_keys (ctrl_t ctrl, kbnode_t keyblock,
+                         struct secret_key_rank_s **r_ranks)
+{
+  (void)ctrl;
+  (void)keyblock;
+  *r_ranks = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+int
+agent_secret_key_rank (struct secret_key_rank_s *ranks, PKT_public_key *pk)
+{
+  (void)ranks;
+  (void)pk;
+  return -1;
+}
+
+int
+agent_any_secret_key_rank (struct secret_key_rank_s *ranks)
+{
+  (void)ranks;
+  return 0;
+}
+
 gpg_error_t
 agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
                    char **r_serialno, int *r_cleartext)
@@ -43,6 +43,8 @@
 #include "key-check.h"
 #include "key-clean.h"
 
+#include <npth.h>
+
 
 struct import_stats_s
 {
@@ -62,6 +64,7 @@ struct import_stats_s
   ulong n_sigs_cleaned;
   ulong n_uids_cleaned;
   ulong v3keys;   /* Number of V3 keys seen.  */
+  int need_revalidation; /* Deferred revalidation_mark in bulk mode.  */
 };
 
 
@@ -102,7 +105,7 @@ static int import (ctrl_t ctrl,
 		   unsigned char **fpr, size_t *fpr_len, unsigned int options,
 		   import_screener_t screener, void *screener_arg,
                    int origin, const char *url);
-static int read_block (IOBUF a, unsigned int options,
+static int read_block (ctrl_t ctrl, IOBUF a, unsigned int options,
                        PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys);
 static void revocation_present (ctrl_t ctrl, kbnode_t keyblock);
 static gpg_error_t import_one (ctrl_t ctrl,
@@ -161,6 +164,19 @@ cleanup_import_globals (void)
 }
 
 
+/* Mark the trustdb for revalidation.  In bulk mode this is done once
+ * at the end of the import.  */
+static void
+import_revalidation_mark (ctrl_t ctrl, struct import_stats_s *stats,
+                          unsigned int options)
+{
+  if ((options & IMPORT_BULK))
+    stats->need_revalidation = 1;
+  else
+    revalidation_mark (ctrl);
+}
+
+
 int
 parse_import_options(char *str,unsigned int *options,int noisy)
 {
@@ -196,6 +212,9 @@ parse_import_options(char *str,unsigned int *options,int noisy)
       {"self-sigs-only", IMPORT_SELF_SIGS_ONLY, NULL,
        N_("ignore key-signatures which are not self-signatures")},
 
+      {"bulk", IMPORT_BULK, NULL,
+       N_("write all imported keys in one go")},
+
       {"import-export", IMPORT_EXPORT, NULL,
        N_("run import filters and export key immediately")},
 
@@ -266,6 +285,12 @@ parse_and_set_import_filter (const char *string)
   else
     err = gpg_error (GPG_ERR_INV_NAME);
 
+  if (!err)
+    {
+      recsel_set_propids (import_filter.keep_uid, impex_filter_propid);
+      recsel_set_propids (import_filter.drop_sig, impex_filter_propid);
+    }
+
   return err;
 }
 
@@ -377,7 +402,8 @@ read_key_from_file_or_buffer (ctrl_t ctrl, const char *fname,
     }
 
   /* Read the first non-v3 keyblock.  */
-  while (!(err = read_block (inp, 0, &pending_pkt, &keyblock, &v3keys)))
+  while (!(err = read_block (NULL, inp, 0,
+                             &pending_pkt, &keyblock, &v3keys)))
     {
       if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
         break;
@@ -513,6 +539,12 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
   if (!stats)
     stats = import_new_stats_handle ();
 
+  if ((options & IMPORT_BULK))
+    {
+      keydb_bulk_begin (ctrl);
+      agent_import_key_begin_batch ();
+    }
+
   if (inp)
     {
       err = import (ctrl, inp, "[stream]", stats, fpr, fpr_len, options,
@@ -554,6 +586,25 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
 	}
     }
 
+  if ((options & IMPORT_BULK))
+    {
+      gpg_error_t err2 = agent_import_key_end_batch (ctrl);
+
+      if (err2)
+        {
+          log_error (_("error storing the imported secret keys: %s\n"),
+                     gpg_strerror (err2));
+          if (!err)
+            err = err2;
+        }
+      keydb_bulk_end (ctrl);
+      if (stats->need_revalidation)
+        {
+          revalidation_mark (ctrl);
+          stats->need_revalidation = 0;
+        }
+    }
+
   if (!stats_handle)
     {
       if ((options & (IMPORT_SHOW | IMPORT_DRY_RUN))
@@ -613,6 +664,318 @@ import_keys_es_stream (ctrl_t ctrl, estream_t fp,
 }
 
 
+/* Import the KEYBLOCK read by import.  This takes ownership of
+ * KEYBLOCK.  SECATTIC is the PGP desktop kludge state of the caller.
+ * If the import shall stop without an error true is stored at
+ * R_STOP.  */
+static int
+import_keyblock (ctrl_t ctrl, kbnode_t keyblock, kbnode_t *secattic,
+                 struct import_stats_s *stats,
+                 unsigned char **fpr, size_t *fpr_len, unsigned int options,
+                 import_screener_t screener, void *screener_arg,
+                 int origin, const char *url, int *r_stop)
+{
+  int rc = 0;
+
+  *r_stop = 0;
+
+  if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
+    {
+      rc = import_one (ctrl, keyblock,
+                       stats, fpr, fpr_len, options, 0, 0,
+                       screener, screener_arg, origin, url, NULL);
+      if (*secattic)
+        {
+          byte tmpfpr[MAX_FINGERPRINT_LEN];
+          size_t tmpfprlen;
+
+          if (!rc && !(opt.dry_run || (options & IMPORT_DRY_RUN)))
+            {
+              /* Kudge for PGP desktop - see below.  */
+              fingerprint_from_pk (keyblock->pkt->pkt.public_key,
+                                   tmpfpr, &tmpfprlen);
+              rc = import_matching_seckeys (ctrl, *secattic,
+                                            tmpfpr, tmpfprlen,
+                                            stats, opt.batch);
+            }
+          release_kbnode (*secattic);
+          *secattic = NULL;
+        }
+    }
+  else if (keyblock->pkt->pkttype == PKT_SECRET_KEY)
+    {
+      release_kbnode (*secattic);
+      *secattic = NULL;
+      rc = import_secret_one (ctrl, keyblock, stats,
+                              opt.batch, options, 0,
+                              screener, screener_arg, secattic);
+      keyblock = NULL;  /* Ownership was transferred.  */
+      if (*secattic)
+        {
+          if (gpg_err_code (rc) == GPG_ERR_NO_PUBKEY)
+            rc = 0; /* Try import after the next pubkey.  */
+
+          /* The attic is a workaround for the peculiar PGP
+           * Desktop method of exporting a secret key: The
+           * exported file is the concatenation of two armored
+           * keyblocks; first the private one and then the public
+           * one.  The strange thing is that the secret one has no
+           * binding signatures at all and thus we have not
+           * imported it.  The attic stores that secret keys and
+           * we try to import it once after the very next public
+           * keyblock.  */
+        }
+    }
+  else if (keyblock->pkt->pkttype == PKT_SIGNATURE
+           && IS_KEY_REV (keyblock->pkt->pkt.signature) )
+    {
+      release_kbnode (*secattic);
+      *secattic = NULL;
+      rc = import_revoke_cert (ctrl, keyblock, options, stats);
+    }
+  else
+    {
+      release_kbnode (*secattic);
+      *secattic = NULL;
+      log_info (_("skipping block of type %d\n"), keyblock->pkt->pkttype);
+    }
+  release_kbnode (keyblock);
+
+  /* fixme: we should increment the not imported counter but
+     this does only make sense if we keep on going despite of
+     errors.  For now we do this only if the imported key is too
+     large. */
+  if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
+        && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
+    {
+      stats->not_imported++;
+      rc = 0;
+    }
+  else if (rc)
+    return rc;
+
+  if (!(++stats->count % 100) && !opt.quiet)
+    log_info (_("%lu keys processed so far\n"), stats->count );
+
+  if (origin == KEYORG_WKD && stats->count >= 5)
+    {
+      /* We limit the number of keys _received_ from the WKD to 5.
+       * In fact there should be only one key but some sites want
+       * to store a few expired keys there also.  gpg's key
+       * selection will later figure out which key to use.  Note
+       * that for WKD we always return the fingerprint of the
+       * first imported key.  */
+      log_info ("import from WKD stopped after %d keys\n", 5);
+      *r_stop = 1;
+    }
+
+  return 0;
+}
+
+
+/* The queue used to pass keyblocks from the reader thread to the
+ * importing thread in bulk mode.  */
+#define IMPORT_QUEUE_SIZE 64
+
+struct import_queue_s
+{
+  npth_mutex_t lock;  /* Protects all fields below.  */
+  npth_cond_t cond;   /* Signaled on each change.  */
+  ctrl_t ctrl;
+  IOBUF inp;
+  unsigned int options;
+  kbnode_t blocks[IMPORT_QUEUE_SIZE];
+  unsigned int head;  /* Index of the first block.  */
+  unsigned int count; /* Number of blocks in the queue.  */
+  int v3keys;         /* Number of V3 keys seen by the reader.  */
+  int rc;             /* The final return code of read_block.  */
+  int eof;            /* The reader has finished.  */
+  int stop;           /* The reader shall stop.  */
+};
+
+
+static void
+import_queue_lock (struct import_queue_s *q)
+{
+  int res = npth_mutex_lock (&q->lock);
+  if (res)
+    log_fatal ("%s: failed to acquire mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+static void
+import_queue_unlock (struct import_queue_s *q)
+{
+  int res = npth_mutex_unlock (&q->lock);
+  if (res)
+    log_fatal ("%s: failed to release mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* The reader thread of import_pipelined.  */
+static void *
+import_reader_thread (void *arg)
+{
+  struct import_queue_s *q = arg;
+  PACKET *pending_pkt = NULL;
+  kbnode_t keyblock = NULL;
+  int v3keys;
+  int rc;
+
+  for (;;)
+    {
+      rc = read_block (q->ctrl, q->inp, q->options, &pending_pkt, &keyblock,
+                       &v3keys);
+
+      import_queue_lock (q);
+      q->v3keys += v3keys;
+      if (rc)
+        {
+          q->rc = rc;
+          q->eof = 1;
+          npth_cond_broadcast (&q->cond);
+          import_queue_unlock (q);
+          break;
+        }
+      while (q->count == IMPORT_QUEUE_SIZE && !q->stop)
+        npth_cond_wait (&q->cond, &q->lock);
+      if (q->stop)
+        {
+          q->eof = 1;
+          import_queue_unlock (q);
+          release_kbnode (keyblock);
+          break;
+        }
+      q->blocks[(q->head + q->count) % IMPORT_QUEUE_SIZE] = keyblock;
+      q->count++;
+      npth_cond_broadcast (&q->cond);
+      import_queue_unlock (q);
+    }
+
+  if (pending_pkt)
+    {
+      free_packet (pending_pkt, NULL);
+      xfree (pending_pkt);
+    }
+  return NULL;
+}
+
+
+/* A variant of the read loop of import used in bulk mode.  The
+ * keyblocks are parsed by a separate thread and the importing thread
+ * takes all queued keyblocks at once, verifies their self-signatures
+ * in one batch on the verification pool and then imports them in
+ * order.  While this thread waits for the verification the reader
+ * thread parses the next keyblocks.  The result is stored at R_RC
+ * with the same semantics as read_block's return value.  Returns
+ * false if the reader thread could not be started; the caller should
+ * then use the regular loop.  */
+static int
+import_pipelined (ctrl_t ctrl, IOBUF inp, struct import_stats_s *stats,
+                  unsigned char **fpr, size_t *fpr_len, unsigned int options,
+                  import_screener_t screener, void *screener_arg,
+                  int origin, const char *url, int *r_rc)
+{
+  struct import_queue_s *q;
+  kbnode_t batch[IMPORT_QUEUE_SIZE];
+  kbnode_t secattic = NULL;
+  unsigned int nbatch, i;
+  npth_attr_t tattr;
+  npth_t thread;
+  int rc = 0;
+  int stop = 0;
+  int res;
+
+  q = xtrycalloc (1, sizeof *q);
+  if (!q)
+    return 0;
+  q->ctrl = ctrl;
+  q->inp = inp;
+  q->options = options;
+  res = npth_mutex_init (&q->lock, NULL);
+  if (res)
+    {
+      xfree (q);
+      return 0;
+    }
+  res = npth_cond_init (&q->cond, NULL);
+  if (res)
+    {
+      npth_mutex_destroy (&q->lock);
+      xfree (q);
+      return 0;
+    }
+  res = npth_attr_init (&tattr);
+  if (!res)
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+      res = npth_create (&thread, &tattr, import_reader_thread, q);
+      npth_attr_destroy (&tattr);
+    }
+  if (res)
+    {
+      log_info ("error spawning import reader thread: %s\n",
+                gpg_strerror (gpg_error_from_errno (res)));
+      npth_cond_destroy (&q->cond);
+      npth_mutex_destroy (&q->lock);
+      xfree (q);
+      return 0;
+    }
+
+  while (!rc && !stop)
+    {
+      import_queue_lock (q);
+      while (!q->count && !q->eof)
+        npth_cond_wait (&q->cond, &q->lock);
+      nbatch = q->count;
+      for (i=0; i < nbatch; i++)
+        batch[i] = q->blocks[(q->head + i) % IMPORT_QUEUE_SIZE];
+      q->head = 0;
+      q->count = 0;
+      npth_cond_broadcast (&q->cond);
+      import_queue_unlock (q);
+      if (!nbatch)
+        break;  /* EOF or read error.  */
+
+      /* This does not print anything; the diagnostics of the
+       * signature checks are still printed by import_one.  */
+      precheck_keyblock_signatures (ctrl, batch, nbatch);
+
+      for (i=0; i < nbatch && !rc && !stop; i++)
+        {
+          rc = import_keyblock (ctrl, batch[i], &secattic, stats,
+                                fpr, fpr_len, options,
+                                screener, screener_arg, origin, url, &stop);
+          batch[i] = NULL;
+        }
+      for (; i < nbatch; i++)
+        release_kbnode (batch[i]);
+    }
+
+  /* Stop the reader and release what it has queued.  */
+  import_queue_lock (q);
+  q->stop = 1;
+  npth_cond_broadcast (&q->cond);
+  import_queue_unlock (q);
+  npth_join (thread, NULL);
+  for (i=0; i < q->count; i++)
+    release_kbnode (q->blocks[(q->head + i) % IMPORT_QUEUE_SIZE]);
+
+  stats->v3keys += q->v3keys;
+  if (!rc && !stop)
+    rc = q->rc;
+
+  release_kbnode (secattic);
+  npth_cond_destroy (&q->cond);
+  npth_mutex_destroy (&q->lock);
+  xfree (q);
+  *r_rc = rc;
+  return 1;
+}
+
+
 static int
 import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
 	unsigned char **fpr,size_t *fpr_len, unsigned int options,
@@ -626,6 +989,7 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
   kbnode_t secattic = NULL;  /* Kludge for PGP desktop percularity */
   int rc = 0;
   int v3keys;
+  int stop;
 
   getkey_disable_caches ();
 
@@ -639,99 +1003,25 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
       release_armor_context (afx);
     }
 
-  while (!(rc = read_block (inp, options, &pending_pkt, &keyblock, &v3keys)))
+  if ((options & IMPORT_BULK)
+      && import_pipelined (ctrl, inp, stats, fpr, fpr_len, options,
+                           screener, screener_arg, origin, url, &rc))
+    goto leave;
+
+  while (!(rc = read_block (ctrl, inp, options,
+                            &pending_pkt, &keyblock, &v3keys)))
     {
       stats->v3keys += v3keys;
-      if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
-        {
-          rc = import_one (ctrl, keyblock,
-                           stats, fpr, fpr_len, options, 0, 0,
-                           screener, screener_arg, origin, url, NULL);
-          if (secattic)
-            {
-              byte tmpfpr[MAX_FINGERPRINT_LEN];
-              size_t tmpfprlen;
-
-              if (!rc && !(opt.dry_run || (options & IMPORT_DRY_RUN)))
-                {
-                  /* Kudge for PGP desktop - see below.  */
-                  fingerprint_from_pk (keyblock->pkt->pkt.public_key,
-                                       tmpfpr, &tmpfprlen);
-                  rc = import_matching_seckeys (ctrl, secattic,
-                                                tmpfpr, tmpfprlen,
-                                                stats, opt.batch);
-                }
-              release_kbnode (secattic);
-              secattic = NULL;
-            }
-        }
-      else if (keyblock->pkt->pkttype == PKT_SECRET_KEY)
-        {
-          release_kbnode (secattic);
-          secattic = NULL;
-          rc = import_secret_one (ctrl, keyblock, stats,
-                                  opt.batch, options, 0,
-                                  screener, screener_arg, &secattic);
-          keyblock = NULL;  /* Ownership was transferred.  */
-          if (secattic)
-            {
-              if (gpg_err_code (rc) == GPG_ERR_NO_PUBKEY)
-                rc = 0; /* Try import after the next pubkey.  */
-
-              /* The attic is a workaround for the peculiar PGP
-               * Desktop method of exporting a secret key: The
-               * exported file is the concatenation of two armored
-               * keyblocks; first the private one and then the public
-               * one.  The strange thing is that the secret one has no
-               * binding signatures at all and thus we have not
-               * imported it.  The attic stores that secret keys and
-               * we try to import it once after the very next public
-               * keyblock.  */
-            }
-        }
-      else if (keyblock->pkt->pkttype == PKT_SIGNATURE
-               && IS_KEY_REV (keyblock->pkt->pkt.signature) )
-        {
-          release_kbnode (secattic);
-          secattic = NULL;
-          rc = import_revoke_cert (ctrl, keyblock, options, stats);
-        }
-      else
-        {
-          release_kbnode (secattic);
-          secattic = NULL;
-          log_info (_("skipping block of type %d\n"), keyblock->pkt->pkttype);
-	}
-      release_kbnode (keyblock);
-
-      /* fixme: we should increment the not imported counter but
-         this does only make sense if we keep on going despite of
-         errors.  For now we do this only if the imported key is too
-         large. */
-      if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
-            && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
-        {
-          stats->not_imported++;
-        }
-      else if (rc)
+      rc = import_keyblock (ctrl, keyblock, &secattic, stats,
+                            fpr, fpr_len, options,
+                            screener, screener_arg, origin, url, &stop);
+      keyblock = NULL;
+      if (rc || stop)
         break;
-
-      if (!(++stats->count % 100) && !opt.quiet)
-        log_info (_("%lu keys processed so far\n"), stats->count );
-
-      if (origin == KEYORG_WKD && stats->count >= 5)
-        {
-          /* We limit the number of keys _received_ from the WKD to 5.
-           * In fact there should be only one key but some sites want
-           * to store a few expired keys there also.  gpg's key
-           * selection will later figure out which key to use.  Note
-           * that for WKD we always return the fingerprint of the
-           * first imported key.  */
-          log_info ("import from WKD stopped after %d keys\n", 5);
-          break;
-        }
     }
   stats->v3keys += v3keys;
+
+ leave:
   if (rc == -1)
     rc = 0;
   else if (rc && gpg_err_code (rc) != GPG_ERR_INV_KEYRING)
@@ -778,7 +1068,8 @@ import_old_secring (ctrl_t ctrl, const char *fname)
 
   getkey_disable_caches();
   stats = import_new_stats_handle ();
-  while (!(err = read_block (inp, 0, &pending_pkt, &keyblock, &v3keys)))
+  while (!(err = read_block (NULL, inp, 0,
+                             &pending_pkt, &keyblock, &v3keys)))
     {
       if (keyblock->pkt->pkttype == PKT_SECRET_KEY)
         {
@@ -899,11 +1190,18 @@ valid_keyblock_packet (int pkttype)
  * set.  PENDING_PKT should be initialized to NULL and not changed by
  * the caller.
  *
+ * To keep the memory used for flooded keys bounded, signatures which
+ * import_one would remove anyway are dropped while reading: All
+ * non-self-signatures with IMPORT_SELF_SIGS_ONLY, the signatures on
+ * the user ids with IMPORT_DROP_UIDS and, if CTRL is not NULL, those
+ * selected by the drop-sig import filter.  Non-self-signatures
+ * exceeding opt.import_max_sigs are dropped as well.
+ *
  * Returns 0 for okay, -1 no more blocks, or any other errorcode.  The
  * integer at R_V3KEY counts the number of unsupported v3 keyblocks.
  */
 static int
-read_block( IOBUF a, unsigned int options,
+read_block (ctrl_t ctrl, IOBUF a, unsigned int options,
             PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys)
 {
   int rc;
@@ -915,6 +1213,14 @@ read_block( IOBUF a, unsigned int options,
   u32 keyid[2];
   int got_keyid = 0;
   unsigned int dropped_nonselfsigs = 0;
+  int in_uid = 0;        /* Set after the first user id or attribute.  */
+  int drop_uid = 0;      /* Set after the first user id with
+                          * IMPORT_DROP_UIDS.  */
+  int seen_subkey = 0;   /* Set after the first subkey.  */
+  unsigned int nonselfsigs = 0;
+  unsigned int dropped_filtered = 0;
+  unsigned int dropped_capped = 0;
+  PKT_signature *sig;
 
   *r_v3keys = 0;
 
@@ -1044,11 +1350,9 @@ read_block( IOBUF a, unsigned int options,
         case PKT_SIGNATURE:
           if (!in_cert)
             goto x_default;
-          if (!(options & IMPORT_SELF_SIGS_ONLY))
-            goto x_default;
           log_assert (got_keyid);
-	  if (pkt->pkt.signature->keyid[0] == keyid[0]
-              && pkt->pkt.signature->keyid[1] == keyid[1])
+          sig = pkt->pkt.signature;
+	  if (sig->keyid[0] == keyid[0] && sig->keyid[1] == keyid[1])
 	    { /* This is likely a self-signature.  We import this one.
                * Eventually we should use the ISSUER_FPR to compare
                * self-signatures, but that will work only for v5 keys
@@ -1059,14 +1363,66 @@ read_block( IOBUF a, unsigned int options,
                * key-signatures.  A verification will be done later in
                * the processing anyway.  Here we want a cheap an early
                * way to drop non-self-signatures.  */
+              if (drop_uid && !seen_subkey)
+                goto drop_sig;  /* Removed with its user id anyway.  */
               goto x_default;
             }
-          /* Skip this signature.  */
-          dropped_nonselfsigs++;
+          if ((options & IMPORT_SELF_SIGS_ONLY))
+            {
+              dropped_nonselfsigs++;
+              goto drop_sig;
+            }
+          if (drop_uid && !seen_subkey)
+            goto drop_sig;
+          /* The drop-sig filter as done by apply_drop_sig_filter.  */
+          if (ctrl && import_filter.drop_sig && in_uid && !seen_subkey
+              && !(keyid[0] == sig->keyid[0] || keyid[1] == sig->keyid[1])
+              && (IS_UID_SIG (sig) || IS_UID_REV (sig)))
+            {
+              struct impex_filter_parm_s parm;
+              struct kbnode_struct tmpnode;
+
+              memset (&tmpnode, 0, sizeof tmpnode);
+              tmpnode.pkt = pkt;
+              parm.ctrl = ctrl;
+              parm.node = &tmpnode;
+              if (recsel_select_id (import_filter.drop_sig,
+                                    impex_filter_getval_id, &parm))
+                {
+                  dropped_filtered++;
+                  goto drop_sig;
+                }
+            }
+          if (opt.import_max_sigs && nonselfsigs >= opt.import_max_sigs)
+            {
+              dropped_capped++;
+              goto drop_sig;
+            }
+          nonselfsigs++;
+          goto x_default;
+
+        drop_sig:
           free_packet (pkt, &parsectx);
           init_packet(pkt);
           break;
 
+        case PKT_USER_ID:
+          /* Like remove_all_uids we drop everything from the first
+           * user id up to the first subkey.  The user ids are kept
+           * for the import screener.  */
+          if ((options & IMPORT_DROP_UIDS)
+              && in_cert && root->pkt->pkttype == PKT_PUBLIC_KEY)
+            drop_uid = 1;
+          /*FALLTHRU*/
+        case PKT_ATTRIBUTE:
+          in_uid = 1;
+          goto x_default;
+
+        case PKT_PUBLIC_SUBKEY:
+        case PKT_SECRET_SUBKEY:
+          seen_subkey = 1;
+          goto x_default;
+
         case PKT_PUBLIC_KEY:
         case PKT_SECRET_KEY:
           if (!got_keyid)
@@ -1094,7 +1450,12 @@ read_block( IOBUF a, unsigned int options,
                   lastnode->next = new_kbnode (pkt);
                   lastnode = lastnode->next;
                 }
-              pkt = xmalloc (sizeof *pkt);
+              pkt = alloc_packet ();
+              if (!pkt)
+                {
+                  rc = gpg_error_from_syserror ();
+                  goto ready;
+                }
             }
           else
             free_packet (pkt, &parsectx);
@@ -1113,10 +1474,16 @@ read_block( IOBUF a, unsigned int options,
     *ret_root = root;
   free_packet (pkt, &parsectx);
   deinit_parse_packet (&parsectx);
-  xfree( pkt );
+  release_packet_struct (pkt);
   if (!rc && dropped_nonselfsigs && opt.verbose)
     log_info ("key %s: number of dropped non-self-signatures: %u\n",
               keystr (keyid), dropped_nonselfsigs);
+  if (!rc && dropped_filtered && opt.verbose)
+    log_info ("key %s: number of signatures dropped by the filter: %u\n",
+              keystr (keyid), dropped_filtered);
+  if (!rc && dropped_capped)
+    log_info ("key %s: too many signatures - %u dropped\n",
+              keystr (keyid), dropped_capped);
 
   return rc;
 }
@@ -1403,9 +1770,80 @@ check_prefs (ctrl_t ctrl, kbnode_t keyblock)
 }
 
 
+/* The properties known by impex_filter_getval_id.  */
+enum impex_filter_props
+  {
+    IMPEX_PROP_UNKNOWN = 0,
+    IMPEX_PROP_UID,
+    IMPEX_PROP_MBOX,
+    IMPEX_PROP_PRIMARY,
+    IMPEX_PROP_EXPIRED,
+    IMPEX_PROP_REVOKED,
+    IMPEX_PROP_SIG_CREATED,
+    IMPEX_PROP_SIG_CREATED_D,
+    IMPEX_PROP_SIG_ALGO,
+    IMPEX_PROP_SIG_DIGEST_ALGO,
+    IMPEX_PROP_SECRET,
+    IMPEX_PROP_KEY_ALGO,
+    IMPEX_PROP_KEY_CREATED,
+    IMPEX_PROP_KEY_CREATED_D,
+    IMPEX_PROP_DISABLED,
+    IMPEX_PROP_USAGE,
+    IMPEX_PROP_FPR
+  };
+
+static struct
+{
+  const char *name;
+  int id;
+} impex_filter_propnames[] =
+  {
+    { "uid",             IMPEX_PROP_UID },
+    { "mbox",            IMPEX_PROP_MBOX },
+    { "primary",         IMPEX_PROP_PRIMARY },
+    { "expired",         IMPEX_PROP_EXPIRED },
+    { "revoked",         IMPEX_PROP_REVOKED },
+    { "sig_created",     IMPEX_PROP_SIG_CREATED },
+    { "sig_created_d",   IMPEX_PROP_SIG_CREATED_D },
+    { "sig_algo",        IMPEX_PROP_SIG_ALGO },
+    { "sig_digest_algo", IMPEX_PROP_SIG_DIGEST_ALGO },
+    { "secret",          IMPEX_PROP_SECRET },
+    { "key_algo",        IMPEX_PROP_KEY_ALGO },
+    { "key_created",     IMPEX_PROP_KEY_CREATED },
+    { "key_created_d",   IMPEX_PROP_KEY_CREATED_D },
+    { "disabled",        IMPEX_PROP_DISABLED },
+    { "usage",           IMPEX_PROP_USAGE },
+    { "fpr",             IMPEX_PROP_FPR }
+  };
+
+
+/* Return the id of the filter property PROPNAME or 0 if it is not
+ * known.  This is used with recsel_set_propids.  */
+int
+impex_filter_propid (const char *propname)
+{
+  int i;
+
+  for (i=0; i < DIM (impex_filter_propnames); i++)
+    if (!strcmp (propname, impex_filter_propnames[i].name))
+      return impex_filter_propnames[i].id;
+  return IMPEX_PROP_UNKNOWN;
+}
+
+
 /* Helper for apply_*_filter in import.c and export.c.  */
 const char *
 impex_filter_getval (void *cookie, const char *propname)
+{
+  return impex_filter_getval_id (cookie, impex_filter_propid (propname),
+                                 propname);
+}
+
+
+/* Same as impex_filter_getval but takes the id of the property as
+ * returned by impex_filter_propid.  */
+const char *
+impex_filter_getval_id (void *cookie, int propid, const char *propname)
 {
   /* FIXME: Malloc our static buffers and access them via PARM.  */
   struct impex_filter_parm_s *parm = cookie;
@@ -1414,6 +1852,7 @@ impex_filter_getval (void *cookie, const char *propname)
   static char numbuf[20];
   const char *result;
 
+  (void)propname;
   log_assert (ctrl && ctrl->magic == SERVER_CONTROL_MAGIC);
 
   if (node->pkt->pkttype == PKT_USER_ID
@@ -1421,9 +1860,9 @@ impex_filter_getval (void *cookie, const char *propname)
     {
       PKT_user_id *uid = node->pkt->pkt.user_id;
 
-      if (!strcmp (propname, "uid"))
+      if (propid == IMPEX_PROP_UID)
         result = uid->name;
-      else if (!strcmp (propname, "mbox"))
+      else if (propid == IMPEX_PROP_MBOX)
         {
           if (!uid->mbox)
             {
@@ -1431,15 +1870,15 @@ impex_filter_getval (void *cookie, const char *propname)
             }
           result = uid->mbox;
         }
-      else if (!strcmp (propname, "primary"))
+      else if (propid == IMPEX_PROP_PRIMARY)
         {
           result = uid->flags.primary? "1":"0";
         }
-      else if (!strcmp (propname, "expired"))
+      else if (propid == IMPEX_PROP_EXPIRED)
         {
           result = uid->flags.expired? "1":"0";
         }
-      else if (!strcmp (propname, "revoked"))
+      else if (propid == IMPEX_PROP_REVOKED)
         {
           result = uid->flags.revoked? "1":"0";
         }
@@ -1450,26 +1889,26 @@ impex_filter_getval (void *cookie, const char *propname)
     {
       PKT_signature *sig = node->pkt->pkt.signature;
 
-      if (!strcmp (propname, "sig_created"))
+      if (propid == IMPEX_PROP_SIG_CREATED)
         {
           snprintf (numbuf, sizeof numbuf, "%lu", (ulong)sig->timestamp);
           result = numbuf;
         }
-      else if (!strcmp (propname, "sig_created_d"))
+      else if (propid == IMPEX_PROP_SIG_CREATED_D)
         {
           result = dateonlystr_from_sig (sig);
         }
-      else if (!strcmp (propname, "sig_algo"))
+      else if (propid == IMPEX_PROP_SIG_ALGO)
         {
           snprintf (numbuf, sizeof numbuf, "%d", sig->pubkey_algo);
           result = numbuf;
         }
-      else if (!strcmp (propname, "sig_digest_algo"))
+      else if (propid == IMPEX_PROP_SIG_DIGEST_ALGO)
         {
           snprintf (numbuf, sizeof numbuf, "%d", sig->digest_algo);
           result = numbuf;
         }
-      else if (!strcmp (propname, "expired"))
+      else if (propid == IMPEX_PROP_EXPIRED)
         {
           result = sig->flags.expired? "1":"0";
         }
@@ -1483,38 +1922,38 @@ impex_filter_getval (void *cookie, const char *propname)
     {
       PKT_public_key *pk = node->pkt->pkt.public_key;
 
-      if (!strcmp (propname, "secret"))
+      if (propid == IMPEX_PROP_SECRET)
         {
           result = (node->pkt->pkttype == PKT_SECRET_KEY
                     || node->pkt->pkttype == PKT_SECRET_SUBKEY)? "1":"0";
         }
-      else if (!strcmp (propname, "key_algo"))
+      else if (propid == IMPEX_PROP_KEY_ALGO)
         {
           snprintf (numbuf, sizeof numbuf, "%d", pk->pubkey_algo);
           result = numbuf;
         }
-      else if (!strcmp (propname, "key_created"))
+      else if (propid == IMPEX_PROP_KEY_CREATED)
         {
           snprintf (numbuf, sizeof numbuf, "%lu", (ulong)pk->timestamp);
           result = numbuf;
         }
-      else if (!strcmp (propname, "key_created_d"))
+      else if (propid == IMPEX_PROP_KEY_CREATED_D)
         {
           result = dateonlystr_from_pk (pk);
         }
-      else if (!strcmp (propname, "expired"))
+      else if (propid == IMPEX_PROP_EXPIRED)
         {
           result = pk->has_expired? "1":"0";
         }
-      else if (!strcmp (propname, "revoked"))
+      else if (propid == IMPEX_PROP_REVOKED)
         {
           result = pk->flags.revoked? "1":"0";
         }
-      else if (!strcmp (propname, "disabled"))
+      else if (propid == IMPEX_PROP_DISABLED)
         {
           result = pk_is_disabled (pk)? "1":"0";
         }
-      else if (!strcmp (propname, "usage"))
+      else if (propid == IMPEX_PROP_USAGE)
         {
           snprintf (numbuf, sizeof numbuf, "%s%s%s%s%s",
                     (pk->pubkey_usage & PUBKEY_USAGE_ENC)?"e":"",
@@ -1524,7 +1963,7 @@ impex_filter_getval (void *cookie, const char *propname)
                     (pk->pubkey_usage & PUBKEY_USAGE_UNKNOWN)?"?":"");
           result = numbuf;
         }
-      else if (!strcmp (propname, "fpr"))
+      else if (propid == IMPEX_PROP_FPR)
         {
           hexfingerprint (pk, parm->hexfpr, sizeof parm->hexfpr);
           result = parm->hexfpr;
@@ -1557,7 +1996,7 @@ apply_keep_uid_filter (ctrl_t ctrl, kbnode_t keyblock, recsel_expr_t selector)
       if (node->pkt->pkttype == PKT_USER_ID)
         {
           parm.node = node;
-          if (!recsel_select (selector, impex_filter_getval, &parm))
+          if (!recsel_select_id (selector, impex_filter_getval_id, &parm))
             {
 
               /* log_debug ("keep-uid: deleting '%s'\n", */
@@ -1620,7 +2059,7 @@ apply_drop_sig_filter (ctrl_t ctrl, kbnode_t keyblock, recsel_expr_t selector)
       if (IS_UID_SIG(sig) || IS_UID_REV(sig))
         {
           parm.node = node;
-          if (recsel_select (selector, impex_filter_getval, &parm))
+          if (recsel_select_id (selector, impex_filter_getval_id, &parm))
             delete_kbnode (node);
         }
     }
@@ -1837,6 +2276,48 @@ update_key_origin (kbnode_t keyblock, u32 curtime, int origin, const char *url)
 }
 
 
+/* Compute the SHA-1 digest over the OpenPGP packets of KEYBLOCK and
+ * store it at DIGEST which must provide space for 20 bytes.  Deleted
+ * nodes and the meta data (key origin etc.) are not included.  This
+ * is used to detect whether a merge actually changed a keyblock.  */
+static gpg_error_t
+hash_keyblock_packets (kbnode_t keyblock, byte *digest)
+{
+  gpg_error_t err;
+  iobuf_t iobuf;
+  kbnode_t kbctx, node;
+
+  iobuf = iobuf_temp ();
+  for (kbctx = NULL; (node = walk_kbnode (keyblock, &kbctx, 0));)
+    {
+      switch (node->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+        case PKT_SIGNATURE:
+        case PKT_USER_ID:
+        case PKT_ATTRIBUTE:
+          break;
+        default:
+          continue;
+        }
+
+      err = build_packet (iobuf, node->pkt);
+      if (err)
+        {
+          iobuf_close (iobuf);
+          return err;
+        }
+    }
+
+  gcry_md_hash_buffer (GCRY_MD_SHA1, digest,
+                       iobuf_get_temp_buffer (iobuf),
+                       iobuf_get_temp_length (iobuf));
+  iobuf_close (iobuf);
+  return 0;
+}
+
+
 /*
  * Try to import one keyblock. Return an error only in serious cases,
  * but never for an invalid keyblock.  It uses log_error to increase
@@ -2145,7 +2626,7 @@ import_one_real (ctrl_t ctrl,
 
           clear_ownertrusts (ctrl, pk);
           if (non_self)
-            revalidation_mark (ctrl);
+            import_revalidation_mark (ctrl, stats, options);
         }
 
       /* Release the handle and thus unlock the keyring asap.  */
@@ -2177,6 +2658,8 @@ import_one_real (ctrl_t ctrl,
     {
       int n_uids, n_sigs, n_subk, n_sigs_cleaned, n_uids_cleaned;
       u32 curtime = make_timestamp ();
+      byte orig_digest[20], new_digest[20];
+      int have_orig_digest;
 
       /* Compare the original against the new key; just to be sure nothing
        * weird is going on */
@@ -2187,6 +2670,12 @@ import_one_real (ctrl_t ctrl,
           goto leave;
         }
 
+      /* Remember the original packets so that we can detect whether
+       * the merge changed anything.  For example a refresh may bring
+       * in superseded self-signatures which are removed again by
+       * import-clean.  */
+      have_orig_digest = !hash_keyblock_packets (keyblock_orig, orig_digest);
+
       /* Make sure the original direct key sigs are all sane.  */
       n_sigs_cleaned = fix_bad_direct_key_sigs (ctrl, keyblock_orig, keyid);
       if (n_sigs_cleaned)
@@ -2215,6 +2704,20 @@ import_one_real (ctrl_t ctrl,
                              NULL, NULL);
         }
 
+      /* A merge which results in the very same packets is not written
+       * back because the key origin meta data alone does not justify
+       * a rewrite of the keyblock.  */
+      if ((n_uids || n_sigs || n_subk || n_sigs_cleaned || n_uids_cleaned)
+          && have_orig_digest
+          && !hash_keyblock_packets (keyblock_orig, new_digest)
+          && !memcmp (orig_digest, new_digest, sizeof new_digest))
+        {
+          if (opt.verbose)
+            log_info ("key %s: merged key is identical to our copy\n",
+                      keystr (keyid));
+          n_uids = n_sigs = n_subk = n_sigs_cleaned = n_uids_cleaned = 0;
+        }
+
       if (n_uids || n_sigs || n_subk || n_sigs_cleaned || n_uids_cleaned)
         {
           /* Unless we are in restore mode apply meta data to the
@@ -2238,7 +2741,7 @@ import_one_real (ctrl_t ctrl,
             log_error (_("error writing keyring '%s': %s\n"),
                        keydb_get_resource_name (hd), gpg_strerror (err));
           else if (non_self)
-            revalidation_mark (ctrl);
+            import_revalidation_mark (ctrl, stats, options);
 
           /* Release the handle and thus unlock the keyring asap.  */
           keydb_release (hd);
@@ -3515,7 +4018,7 @@ import_revoke_cert (ctrl_t ctrl, kbnode_t node, unsigned int options,
       if (get_ownertrust (ctrl, pk) == TRUST_ULTIMATE)
         clear_ownertrusts (ctrl, pk);
 
-      revalidation_mark (ctrl);
+      import_revalidation_mark (ctrl, stats, options);
     }
   stats->n_revoc++;
 
@@ -3557,6 +4060,10 @@ chk_self_sigs (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid, int *non_self)
   int rc;
   kbnode_t n;
 
+  /* Verify the self-signatures up front; the checks below then use
+     the cached results.  */
+  precheck_key_signatures (ctrl, keyblock);
+
   for (n=keyblock; (n = find_next_kbnode (n, 0)); )
     {
       if (n->pkt->pkttype == PKT_PUBLIC_SUBKEY)
@@ -3979,6 +4486,160 @@ remove_all_non_self_sigs (kbnode_t *keyblock, u32 *keyid)
 }
 
 
+/* A hash set of signatures used to detect duplicates while merging
+ * keyblocks in linear time.  Flooded keys may carry 100k and more
+ * certifications and the pairwise comparison we used before took
+ * hours for them.  The items are linked by their index so that the
+ * item array can be reallocated.  */
+struct sig_set_item_s
+{
+  PKT_signature *sig;
+  u32 hash;
+  unsigned int next;   /* Index + 1 of the next item in the bucket.  */
+};
+
+struct sig_set_s
+{
+  unsigned int *buckets;  /* Index + 1 of the first item or 0.  */
+  unsigned int nbuckets;  /* A power of 2.  */
+  struct sig_set_item_s *items;
+  unsigned int nitems;
+  unsigned int size;      /* Allocated number of items.  */
+};
+typedef struct sig_set_s *sig_set_t;
+
+
+/* Return a hash over the signature values of SIG.  Signatures which
+ * are equal according to cmp_signatures have the same hash.  */
+static u32
+sig_data_hash (PKT_signature *sig)
+{
+  u32 hash;
+  int i, n, bit;
+
+  hash = sig->keyid[0] ^ (sig->keyid[1] * 16777619) ^ sig->pubkey_algo;
+  n = pubkey_get_nsig (sig->pubkey_algo);
+  for (i=0; i < n && sig->data[i]; i++)
+    {
+      if (gcry_mpi_get_flag (sig->data[i], GCRYMPI_FLAG_OPAQUE))
+        {
+          const unsigned char *p;
+          unsigned int nbits, nbytes;
+
+          p = gcry_mpi_get_opaque (sig->data[i], &nbits);
+          nbytes = (nbits + 7) / 8;
+          for (; p && nbytes; p++, nbytes--)
+            hash = (hash * 31) + *p;
+        }
+      else
+        {
+          /* The low bits of the values are sufficiently random.  */
+          hash = (hash * 31) + gcry_mpi_get_nbits (sig->data[i]);
+          for (bit=0; bit < 32; bit++)
+            if (gcry_mpi_test_bit (sig->data[i], bit))
+              hash ^= (1u << bit);
+        }
+    }
+  return hash;
+}
+
+
+/* Return a hash over the issuer and the class of SIG.  */
+static u32
+sig_class_hash (PKT_signature *sig)
+{
+  return sig->keyid[0] ^ (sig->keyid[1] * 16777619) ^ sig->sig_class;
+}
+
+
+static void
+sig_set_release (sig_set_t set)
+{
+  if (!set)
+    return;
+  xfree (set->buckets);
+  xfree (set->items);
+  xfree (set);
+}
+
+
+/* Create a new signature set for about N items.  */
+static sig_set_t
+sig_set_new (unsigned int n)
+{
+  sig_set_t set;
+
+  set = xcalloc (1, sizeof *set);
+  set->nbuckets = 64;
+  while (set->nbuckets < n && set->nbuckets < (1u<<24))
+    set->nbuckets *= 2;
+  set->buckets = xcalloc (set->nbuckets, sizeof *set->buckets);
+  return set;
+}
+
+
+/* Add SIG with HASH to SET.  */
+static void
+sig_set_add (sig_set_t set, PKT_signature *sig, u32 hash)
+{
+  unsigned int idx, n;
+
+  if (set->nitems == set->size)
+    {
+      set->size = set->size? set->size * 2 : 64;
+      set->items = xrealloc (set->items, set->size * sizeof *set->items);
+    }
+
+  if (set->nitems >= 2 * set->nbuckets && set->nbuckets < (1u<<24))
+    {
+      /* Rehash into twice the number of buckets.  */
+      xfree (set->buckets);
+      set->nbuckets *= 2;
+      set->buckets = xcalloc (set->nbuckets, sizeof *set->buckets);
+      for (n=0; n < set->nitems; n++)
+        {
+          idx = set->items[n].hash & (set->nbuckets - 1);
+          set->items[n].next = set->buckets[idx];
+          set->buckets[idx] = n + 1;
+        }
+    }
+
+  n = set->nitems++;
+  set->items[n].sig = sig;
+  set->items[n].hash = hash;
+  idx = hash & (set->nbuckets - 1);
+  set->items[n].next = set->buckets[idx];
+  set->buckets[idx] = n + 1;
+}
+
+
+/* Return the item of SET with HASH for which CMP (ITEMSIG, SIG)
+ * returns 0 or NULL if there is none.  */
+static struct sig_set_item_s *
+sig_set_find (sig_set_t set, PKT_signature *sig, u32 hash,
+              int (*cmp)(PKT_signature *, PKT_signature *))
+{
+  unsigned int n;
+
+  for (n = set->buckets[hash & (set->nbuckets - 1)]; n;
+       n = set->items[n-1].next)
+    if (set->items[n-1].hash == hash && !cmp (set->items[n-1].sig, sig))
+      return set->items + n - 1;
+  return NULL;
+}
+
+
+/* Compare function for sig_set_find to find signatures with the same
+ * issuer and class.  */
+static int
+cmp_sig_issuer_class (PKT_signature *a, PKT_signature *b)
+{
+  return !(a->keyid[0] == b->keyid[0]
+           && a->keyid[1] == b->keyid[1]
+           && a->sig_class == b->sig_class);
+}
+
+
 /*
  * It may happen that the imported keyblock has duplicated user IDs.
  * We check this here and collapse those user IDs together with their
@@ -4014,6 +4675,7 @@ collapse_uids (kbnode_t *keyblock)
 	    {
 	      /* We have a duplicated uid */
 	      kbnode_t sig1,last;
+	      sig_set_t sigs;
 
 	      any=1;
 
@@ -4038,10 +4700,13 @@ collapse_uids (kbnode_t *keyblock)
 	      uid1->next=uid2;
 	      delete_kbnode(uid2);
 
-	      /* Now dedupe uid1 */
+	      /* Now dedupe uid1: Keep the first of equal signatures
+	         and delete the others.  */
+	      sigs = sig_set_new (0);
 	      for(sig1=uid1->next;sig1;sig1=sig1->next)
 		{
-		  kbnode_t sig2;
+		  PKT_signature *sig;
+		  u32 hash;
 
 		  if(is_deleted_kbnode(sig1))
 		    continue;
@@ -4054,29 +4719,14 @@ collapse_uids (kbnode_t *keyblock)
 		  if(sig1->pkt->pkttype!=PKT_SIGNATURE)
 		    continue;
 
-		  for(sig2=sig1->next,last=sig1;sig2;last=sig2,sig2=sig2->next)
-		    {
-		      if(is_deleted_kbnode(sig2))
-			continue;
-
-		      if(sig2->pkt->pkttype==PKT_USER_ID
-			 || sig2->pkt->pkttype==PKT_PUBLIC_SUBKEY
-			 || sig2->pkt->pkttype==PKT_SECRET_SUBKEY)
-			break;
-
-		      if(sig2->pkt->pkttype!=PKT_SIGNATURE)
-			continue;
-
-		      if(cmp_signatures(sig1->pkt->pkt.signature,
-					sig2->pkt->pkt.signature)==0)
-			{
-			  /* We have a match, so delete the second
-			     signature */
-			  delete_kbnode(sig2);
-			  sig2=last;
-			}
-		    }
+		  sig = sig1->pkt->pkt.signature;
+		  hash = sig_data_hash (sig);
+		  if (sig_set_find (sigs, sig, hash, cmp_signatures))
+		    delete_kbnode (sig1);
+		  else
+		    sig_set_add (sigs, sig, hash);
 		}
+	      sig_set_release (sigs);
 	    }
 	}
     }
@@ -4205,7 +4855,28 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
 	      int *n_uids, int *n_sigs, int *n_subk )
 {
   kbnode_t onode, node;
-  int rc, found;
+  int rc;
+  sig_set_t revsigs, keysigs;
+  PKT_signature *sig;
+  u32 hash;
+
+  /* Collect the revocation certificates and direct key signatures we
+   * already have.  */
+  revsigs = sig_set_new (0);
+  keysigs = sig_set_new (0);
+  for (onode=keyblock_orig->next; onode; onode=onode->next)
+    {
+      if (onode->pkt->pkttype == PKT_USER_ID)
+        break;
+      else if (onode->pkt->pkttype == PKT_SIGNATURE)
+        {
+          sig = onode->pkt->pkt.signature;
+          if (IS_KEY_REV (sig))
+            sig_set_add (revsigs, sig, sig_data_hash (sig));
+          else if (IS_KEY_SIG (sig))
+            sig_set_add (keysigs, sig, sig_data_hash (sig));
+        }
+    }
 
   /* 1st: handle revocation certificates */
   for (node=keyblock->next; node; node=node->next )
@@ -4216,24 +4887,13 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
                && IS_KEY_REV (node->pkt->pkt.signature))
         {
           /* check whether we already have this */
-          found = 0;
-          for (onode=keyblock_orig->next; onode; onode=onode->next)
-            {
-              if (onode->pkt->pkttype == PKT_USER_ID )
-                break;
-              else if (onode->pkt->pkttype == PKT_SIGNATURE
-                       && IS_KEY_REV (onode->pkt->pkt.signature)
-                       && !cmp_signatures(onode->pkt->pkt.signature,
-                                          node->pkt->pkt.signature))
-                {
-                  found = 1;
-                  break;
-                }
-	    }
-          if (!found)
+          sig = node->pkt->pkt.signature;
+          hash = sig_data_hash (sig);
+          if (!sig_set_find (revsigs, sig, hash, cmp_signatures))
             {
               kbnode_t n2 = clone_kbnode(node);
               insert_kbnode( keyblock_orig, n2, 0 );
+              sig_set_add (revsigs, n2->pkt->pkt.signature, hash);
               n2->flag |= NODE_FLAG_A;
               ++*n_sigs;
               if(!opt.quiet)
@@ -4256,24 +4916,13 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
                && IS_KEY_SIG (node->pkt->pkt.signature))
         {
           /* check whether we already have this */
-          found = 0;
-          for (onode=keyblock_orig->next; onode; onode=onode->next)
-            {
-              if (onode->pkt->pkttype == PKT_USER_ID)
-                break;
-              else if (onode->pkt->pkttype == PKT_SIGNATURE
-                       && IS_KEY_SIG (onode->pkt->pkt.signature)
-                       && !cmp_signatures(onode->pkt->pkt.signature,
-                                          node->pkt->pkt.signature))
-                {
-                  found = 1;
-                  break;
-		}
-	    }
-          if (!found )
+          sig = node->pkt->pkt.signature;
+          hash = sig_data_hash (sig);
+          if (!sig_set_find (keysigs, sig, hash, cmp_signatures))
             {
               kbnode_t n2 = clone_kbnode(node);
               insert_kbnode( keyblock_orig, n2, 0 );
+              sig_set_add (keysigs, n2->pkt->pkt.signature, hash);
               n2->flag |= NODE_FLAG_A;
               ++*n_sigs;
               if(!opt.quiet)
@@ -4283,6 +4932,9 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
 	}
     }
 
+  sig_set_release (revsigs);
+  sig_set_release (keysigs);
+
   /* 3rd: try to merge new certificates in */
   for (onode=keyblock_orig->next; onode; onode=onode->next)
     {
@@ -4463,11 +5115,21 @@ static int
 merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
 {
   kbnode_t n, n2;
-  int found = 0;
+  sig_set_t sigs;
+  u32 hash;
+  unsigned int count = 0;
 
   log_assert (dst->pkt->pkttype == PKT_USER_ID);
   log_assert (src->pkt->pkttype == PKT_USER_ID);
 
+  for (n2=dst->next; n2 && n2->pkt->pkttype != PKT_USER_ID; n2 = n2->next)
+    count++;
+  sigs = sig_set_new (count);
+  for (n2=dst->next; n2 && n2->pkt->pkttype != PKT_USER_ID; n2 = n2->next)
+    if (n2->pkt->pkttype == PKT_SIGNATURE)
+      sig_set_add (sigs, n2->pkt->pkt.signature,
+                   sig_data_hash (n2->pkt->pkt.signature));
+
   for (n=src->next; n && n->pkt->pkttype != PKT_USER_ID; n = n->next)
     {
       if (n->pkt->pkttype != PKT_SIGNATURE )
@@ -4476,26 +5138,22 @@ merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
           || IS_SUBKEY_REV (n->pkt->pkt.signature) )
         continue; /* skip signatures which are only valid on subkeys */
 
-      found = 0;
-      for (n2=dst->next; n2 && n2->pkt->pkttype != PKT_USER_ID; n2 = n2->next)
-        if (!cmp_signatures(n->pkt->pkt.signature,n2->pkt->pkt.signature))
-          {
-            found++;
-            break;
-          }
-      if (!found )
+      hash = sig_data_hash (n->pkt->pkt.signature);
+      if (!sig_set_find (sigs, n->pkt->pkt.signature, hash, cmp_signatures))
         {
           /* This signature is new or newer, append N to DST.
            * We add a clone to the original keyblock, because this
            * one is released first */
           n2 = clone_kbnode(n);
           insert_kbnode( dst, n2, PKT_SIGNATURE );
+          sig_set_add (sigs, n2->pkt->pkt.signature, hash);
           n2->flag |= NODE_FLAG_A;
           n->flag |= NODE_FLAG_A;
           ++*n_sigs;
 	}
     }
 
+  sig_set_release (sigs);
   return 0;
 }
 
@@ -4507,11 +5165,34 @@ static int
 merge_keysigs (kbnode_t dst, kbnode_t src, int *n_sigs)
 {
   kbnode_t n, n2;
-  int found = 0;
+  sig_set_t newest;
+  struct sig_set_item_s *item;
+  PKT_signature *sig;
+  u32 hash;
 
   log_assert (dst->pkt->pkttype == PKT_PUBLIC_SUBKEY
               || dst->pkt->pkttype == PKT_SECRET_SUBKEY);
 
+  /* A signature is only merged if DST has no signature of the same
+   * class by the same issuer which is at least as new.  Thus we only
+   * need to keep the newest signature for each issuer and class.  */
+  newest = sig_set_new (0);
+  for (n2=dst->next; n2; n2 = n2->next)
+    {
+      if (n2->pkt->pkttype == PKT_PUBLIC_SUBKEY
+          || n2->pkt->pkttype == PKT_PUBLIC_KEY )
+        break;
+      if (n2->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = n2->pkt->pkt.signature;
+      hash = sig_class_hash (sig);
+      item = sig_set_find (newest, sig, hash, cmp_sig_issuer_class);
+      if (!item)
+        sig_set_add (newest, sig, hash);
+      else if (sig->timestamp > item->sig->timestamp)
+        item->sig = sig;
+    }
+
   for (n=src->next; n ; n = n->next)
     {
       if (n->pkt->pkttype == PKT_PUBLIC_SUBKEY
@@ -4520,39 +5201,27 @@ merge_keysigs (kbnode_t dst, kbnode_t src, int *n_sigs)
       if (n->pkt->pkttype != PKT_SIGNATURE )
         continue;
 
-      found = 0;
-      for (n2=dst->next; n2; n2 = n2->next)
-        {
-          if (n2->pkt->pkttype == PKT_PUBLIC_SUBKEY
-              || n2->pkt->pkttype == PKT_PUBLIC_KEY )
-            break;
-          if (n2->pkt->pkttype == PKT_SIGNATURE
-              && (n->pkt->pkt.signature->keyid[0]
-                  == n2->pkt->pkt.signature->keyid[0])
-              && (n->pkt->pkt.signature->keyid[1]
-                  == n2->pkt->pkt.signature->keyid[1])
-              && (n->pkt->pkt.signature->timestamp
-                  <= n2->pkt->pkt.signature->timestamp)
-              && (n->pkt->pkt.signature->sig_class
-                  == n2->pkt->pkt.signature->sig_class))
-            {
-              found++;
-              break;
-	    }
-	}
-      if (!found )
+      sig = n->pkt->pkt.signature;
+      hash = sig_class_hash (sig);
+      item = sig_set_find (newest, sig, hash, cmp_sig_issuer_class);
+      if (!item || sig->timestamp > item->sig->timestamp)
         {
           /* This signature is new or newer, append N to DST.
            * We add a clone to the original keyblock, because this
            * one is released first */
           n2 = clone_kbnode(n);
           insert_kbnode( dst, n2, PKT_SIGNATURE );
+          if (item)
+            item->sig = n2->pkt->pkt.signature;
+          else
+            sig_set_add (newest, n2->pkt->pkt.signature, hash);
           n2->flag |= NODE_FLAG_A;
           n->flag |= NODE_FLAG_A;
           ++*n_sigs;
 	}
     }
 
+  sig_set_release (newest);
   return 0;
 }
 
@@ -118,7 +118,7 @@ release_kbnode( KBNODE n )
 	n2 = n->next;
 	if( !is_cloned_kbnode(n) ) {
             free_packet (n->pkt, NULL);
-            xfree( n->pkt );
+            release_packet_struct (n->pkt);
 	}
 	free_node( n );
 	n = n2;
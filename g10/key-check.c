@@ -351,6 +351,14 @@ key_check_all_keysigs (ctrl_t ctrl, int mode, kbnode_t kb,
 
           sig = n->pkt->pkt.signature;
 
+          /* A signature found good by an earlier call (e.g. by a
+           * previous command in the same --edit-key session) is still
+           * good as long as it stays below the same component.  Only
+           * this function moves signatures to another component and
+           * it does so only to the component they are good over.  */
+          if (sig->flags.component_ok)
+            break;
+
           pending_desc = xasprintf ("  sig: class: 0x%x, issuer: %s,"
                                     " timestamp: %s (%lld), digest: %02x %02x",
                                     sig->sig_class,
@@ -502,6 +510,8 @@ key_check_all_keysigs (ctrl_t ctrl, int mode, kbnode_t kb,
              key signed by Bob, the signature may be good, but we
              haven't checked that Bob is a designated revoker.  */
           /* cache_sig_result (sig, rc); */
+          if (!rc)
+            sig->flags.component_ok = 1;
 
           {
             int has_selfsig = 0;
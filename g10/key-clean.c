@@ -35,6 +35,28 @@
 #include "key-clean.h"
 
 
+/* An entry of the table used by mark_usable_uid_certs to find the
+ * latest signature of each signer.  */
+struct signer_item_s
+{
+  u32 kid[2];           /* The key id of the signer.  */
+  kbnode_t signode;     /* The best signature seen so far.  */
+  u32 sigdate;          /* Its creation date.  */
+  unsigned int next;    /* Index + 1 of the next item in the bucket.  */
+};
+
+
+/* Return true if SIG is a certification which is neither revocable
+ * nor expired at CURTIME.  */
+static int
+is_lasting_cert (PKT_signature *sig, u32 curtime)
+{
+  return (IS_UID_SIG (sig)
+          && !sig->flags.revocable
+          && (!sig->expiredate || sig->expiredate > curtime));
+}
+
+
 /*
  * Mark the signature of the given UID which are used to certify it.
  * To do this, we first revmove all signatures which are not valid and
@@ -49,14 +71,18 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
                        u32 *main_kid, struct key_item *klist,
                        u32 curtime, u32 *next_expire)
 {
-  kbnode_t node;
+  kbnode_t node, n, signode;
   PKT_signature *sig;
-
-  /* First check all signatures.  */
+  u32 (*kids)[2];
+  unsigned int ncheck, ncand, nitems, nbuckets, i, idx;
+  unsigned int *buckets;
+  struct signer_item_s *items, *item;
+
+  /* First select the signatures to check.  They are temporary marked
+   * with flag bit 10.  */
+  ncheck = 0;
   for (node=uidnode->next; node; node = node->next)
     {
-      int rc;
-
       node->flag &= ~(1<<8 | 1<<9 | 1<<10 | 1<<11 | 1<<12);
       if (node->pkt->pkttype == PKT_USER_ID
           || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
@@ -76,6 +102,47 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
 		     invalid signature */
       if (klist && !is_in_klist (klist, sig))
         continue;  /* no need to check it then */
+      node->flag |= 1<<10;
+      ncheck++;
+    }
+  /* Reset the remaining flags. */
+  for (; node; node = node->next)
+    node->flag &= ~(1<<8 | 1<<9 | 1<<10 | 1<<11 | 1<<12);
+
+  if (!ncheck)
+    return;
+
+  /* Look up the keys of all signers whose signatures have not yet
+   * been verified at once instead of one database search per
+   * signature.  */
+  kids = xtrycalloc (ncheck, sizeof *kids);
+  if (kids)
+    {
+      for (i=0, node=uidnode->next; node && i < ncheck; node = node->next)
+        if ((node->flag & (1<<10))
+            && (opt.no_sig_cache || !node->pkt->pkt.signature->flags.checked))
+          {
+            kids[i][0] = node->pkt->pkt.signature->keyid[0];
+            kids[i][1] = node->pkt->pkt.signature->keyid[1];
+            i++;
+          }
+      prefetch_pubkeys (ctrl, kids, i);
+      xfree (kids);
+    }
+
+  /* Now check the selected signatures.  */
+  ncand = 0;
+  for (node=uidnode->next; node; node = node->next)
+    {
+      int rc;
+
+      if (node->pkt->pkttype == PKT_USER_ID
+          || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+          || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+        break;
+      if (!(node->flag & (1<<10)))
+        continue;
+      node->flag &= ~(1<<10);
       if ((rc=check_key_signature (ctrl, keyblock, node, NULL)))
 	{
 	  /* we ignore anything that won't verify, but tag the
@@ -85,101 +152,96 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
           continue;
         }
       node->flag |= 1<<9;
+      ncand++;
     }
-  /* Reset the remaining flags. */
-  for (; node; node = node->next)
-    node->flag &= ~(1<<8 | 1<<9 | 1<<10 | 1<<11 | 1<<12);
+
+  if (!ncand)
+    return;
 
   /* kbnode flag usage: bit 9 is here set for signatures to consider,
-   * bit 10 will be set by the loop to keep track of keyIDs already
-   * processed, bit 8 will be set for the usable signatures, and bit
-   * 11 will be set for usable revocations. */
+   * bit 10 will be set by the loop to keep track of signatures
+   * already processed, bit 8 will be set for the usable signatures,
+   * and bit 11 will be set for usable revocations.
+   *
+   * For each signer figure out the latest valid cert.  The
+   * signatures are grouped by the key id of the signer using a hash
+   * table so that a single pass in keyblock order suffices.  */
+  for (nbuckets = 16; nbuckets < ncand; nbuckets <<= 1)
+    ;
+  buckets = xcalloc (nbuckets, sizeof *buckets);
+  items = xcalloc (ncand, sizeof *items);
+  nitems = 0;
 
-  /* For each cert figure out the latest valid one.  */
   for (node=uidnode->next; node; node = node->next)
     {
-      KBNODE n, signode;
-      u32 kid[2];
-      u32 sigdate;
-
-      if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+      if (node->pkt->pkttype == PKT_USER_ID
+          || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
           || node->pkt->pkttype == PKT_SECRET_SUBKEY)
         break;
       if ( !(node->flag & (1<<9)) )
         continue; /* not a node to look at */
-      if ( (node->flag & (1<<10)) )
-        continue; /* signature with a keyID already processed */
       node->flag |= (1<<10); /* mark this node as processed */
       sig = node->pkt->pkt.signature;
-      signode = node;
-      sigdate = sig->timestamp;
-      kid[0] = sig->keyid[0]; kid[1] = sig->keyid[1];
 
-      /* Now find the latest and greatest signature */
-      for (n=uidnode->next; n; n = n->next)
+      idx = (sig->keyid[1] ^ sig->keyid[0]) & (nbuckets - 1);
+      for (i = buckets[idx]; i; i = items[i-1].next)
+        if (items[i-1].kid[0] == sig->keyid[0]
+            && items[i-1].kid[1] == sig->keyid[1])
+          break;
+      if (!i)
         {
-          if (n->pkt->pkttype == PKT_PUBLIC_SUBKEY
-              || n->pkt->pkttype == PKT_SECRET_SUBKEY)
-            break;
-          if ( !(n->flag & (1<<9)) )
-            continue;
-          if ( (n->flag & (1<<10)) )
-            continue; /* shortcut already processed signatures */
-          sig = n->pkt->pkt.signature;
-          if (kid[0] != sig->keyid[0] || kid[1] != sig->keyid[1])
-            continue;
-          n->flag |= (1<<10); /* mark this node as processed */
-
-	  /* If signode is nonrevocable and unexpired and n isn't,
-             then take signode (skip).  It doesn't matter which is
-             older: if signode was older then we don't want to take n
-             as signode is nonrevocable.  If n was older then we're
-             automatically fine. */
-
-	  if(((IS_UID_SIG(signode->pkt->pkt.signature) &&
-	       !signode->pkt->pkt.signature->flags.revocable &&
-	       (signode->pkt->pkt.signature->expiredate==0 ||
-		signode->pkt->pkt.signature->expiredate>curtime))) &&
-	     (!(IS_UID_SIG(n->pkt->pkt.signature) &&
-		!n->pkt->pkt.signature->flags.revocable &&
-		(n->pkt->pkt.signature->expiredate==0 ||
-		 n->pkt->pkt.signature->expiredate>curtime))))
-	    continue;
-
-	  /* If n is nonrevocable and unexpired and signode isn't,
-             then take n.  Again, it doesn't matter which is older: if
-             n was older then we don't want to take signode as n is
-             nonrevocable.  If signode was older then we're
-             automatically fine. */
-
-	  if((!(IS_UID_SIG(signode->pkt->pkt.signature) &&
-		!signode->pkt->pkt.signature->flags.revocable &&
-		(signode->pkt->pkt.signature->expiredate==0 ||
-		 signode->pkt->pkt.signature->expiredate>curtime))) &&
-	     ((IS_UID_SIG(n->pkt->pkt.signature) &&
-	       !n->pkt->pkt.signature->flags.revocable &&
-	       (n->pkt->pkt.signature->expiredate==0 ||
-		n->pkt->pkt.signature->expiredate>curtime))))
-            {
-              signode = n;
-              sigdate = sig->timestamp;
-	      continue;
-            }
+          /* First signature of this signer.  */
+          item = items + nitems++;
+          item->kid[0] = sig->keyid[0];
+          item->kid[1] = sig->keyid[1];
+          item->signode = node;
+          item->sigdate = sig->timestamp;
+          item->next = buckets[idx];
+          buckets[idx] = nitems;
+          continue;
+        }
+      item = items + i - 1;
+      signode = item->signode;
+      n = node;
+
+      /* If signode is nonrevocable and unexpired and n isn't, then
+         take signode (skip).  It doesn't matter which is older: if
+         signode was older then we don't want to take n as signode is
+         nonrevocable.  If n was older then we're automatically
+         fine. */
+      if (is_lasting_cert (signode->pkt->pkt.signature, curtime)
+          && !is_lasting_cert (sig, curtime))
+        continue;
 
-	  /* At this point, if it's newer, it goes in as the only
-             remaining possibilities are signode and n are both either
-             revocable or expired or both nonrevocable and unexpired.
-             If the timestamps are equal take the later ordered
-             packet, presuming that the key packets are hopefully in
-             their original order. */
+      /* If n is nonrevocable and unexpired and signode isn't, then
+         take n.  Again, it doesn't matter which is older: if n was
+         older then we don't want to take signode as n is
+         nonrevocable.  If signode was older then we're automatically
+         fine. */
+      if (!is_lasting_cert (signode->pkt->pkt.signature, curtime)
+          && is_lasting_cert (sig, curtime))
+        {
+          item->signode = n;
+          item->sigdate = sig->timestamp;
+          continue;
+        }
 
-          if (sig->timestamp >= sigdate)
-            {
-              signode = n;
-              sigdate = sig->timestamp;
-            }
+      /* At this point, if it's newer, it goes in as the only
+         remaining possibilities are signode and n are both either
+         revocable or expired or both nonrevocable and unexpired.  If
+         the timestamps are equal take the later ordered packet,
+         presuming that the key packets are hopefully in their
+         original order. */
+      if (sig->timestamp >= item->sigdate)
+        {
+          item->signode = n;
+          item->sigdate = sig->timestamp;
         }
+    }
 
+  for (item = items; item < items + nitems; item++)
+    {
+      signode = item->signode;
       sig = signode->pkt->pkt.signature;
       if (IS_UID_SIG (sig))
         { /* this seems to be a usable one which is not revoked.
@@ -205,6 +267,9 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
       else
 	signode->flag |= (1<<11);
     }
+
+  xfree (items);
+  xfree (buckets);
 }
 
 
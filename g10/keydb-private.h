@@ -52,6 +52,8 @@ struct resource_item
     KEYBOX_HANDLE kb;
   } u;
   void *token;
+  char *fname;                   /* The name of the file.  */
+  unsigned int need_compress:1;  /* A compress run is due (keybox).  */
 };
 
 
@@ -76,6 +78,8 @@ struct keyblock_cache {
   /* Offset of the record in the keybox.  */
   int resource;
   off_t offset;
+  /* The search started at the beginning of the database.  */
+  int from_reset;
 };
 
 
@@ -86,6 +90,9 @@ struct keydb_handle_s
   /* Flag set if this handles pertains to call-keyboxd.c.  */
   int use_keyboxd;
 
+  /* If set, keydb_get_keyblock skips third-party signatures.  */
+  int self_sigs_only;
+
   /* BEGIN USE_KEYBOXD */
   /* (These fields are only valid if USE_KEYBOXD is set.) */
 
@@ -130,6 +137,13 @@ struct keydb_handle_s
   /* If set, this disables the use of the keyblock cache.  */
   int no_caching;
 
+  /* If set, the process wide keyblock cache is not used.  */
+  int no_shared_cache;
+
+  /* The last search was answered from the process wide keyblock
+     cache; the found state of the keybox is not yet set.  */
+  int shared_hit;
+
   /* Whether the next search will be from the beginning of the
      database (and thus consider all records).  */
   int is_reset;
@@ -160,6 +174,8 @@ struct keydb_handle_s
 gpg_error_t internal_keydb_init (KEYDB_HANDLE hd);
 void internal_keydb_deinit (KEYDB_HANDLE hd);
 gpg_error_t internal_keydb_lock (KEYDB_HANDLE hd);
+void internal_keydb_bulk_begin (ctrl_t ctrl);
+void internal_keydb_bulk_end (ctrl_t ctrl);
 
 gpg_error_t internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb);
 gpg_error_t internal_keydb_update_keyblock (ctrl_t ctrl,
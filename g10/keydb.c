@@ -36,6 +36,7 @@
 #include "../kbx/keybox.h"
 #include "keydb.h"
 #include "../common/i18n.h"
+#include "../common/membuf.h"
 
 #include "keydb-private.h"  /* For struct keydb_handle_s */
 
@@ -52,6 +53,12 @@ static void *primary_keydb;
 /* Whether we have successfully registered any resource.  */
 static int any_registered;
 
+/* Whether a compress run for at least one resource is due.  */
+static int any_need_compress;
+
+/* Incremented for each change of the key database by this process.  */
+static unsigned int keydb_change_count;
+
 /* Looking up keys is expensive.  To hide the cost, we cache whether
    keys exist in the key database.  Then, if we know a key does not
    exist, we don't have to spend time looking it up.  This
@@ -83,6 +90,53 @@ struct
   unsigned int flushes; /* The number of flushes.  */
 } kid_not_found_stats;
 
+/* A process wide cache of keyblocks found by a fingerprint search.
+ * The keyblock cache of a handle (see keydb-private.h) only helps if
+ * the same handle is used again; gpg however uses several handles
+ * (getkey, trustdb, import) which look up the same keys.  Like the
+ * per-handle cache we store the image of the keyblock and not the
+ * parsed keyblock because callers modify the returned keyblock.  A
+ * hit skips the search and the read of the blob.  The entries are
+ * kept in LRU order and the entire cache is flushed on a write to
+ * the database or if keydb_get_change_stamp tells us that another
+ * process modified a resource.  */
+#define SHARED_KB_CACHE_BUCKETS     64
+#define SHARED_KB_CACHE_MAX_ENTRIES 256
+#define SHARED_KB_CACHE_MAX_BYTES   (8*1024*1024)
+
+struct shared_kb_cache_item
+{
+  struct shared_kb_cache_item *next;      /* Next in the hash bucket.  */
+  struct shared_kb_cache_item *lru_prev;  /* Next more recently used.  */
+  struct shared_kb_cache_item *lru_next;  /* Next less recently used.  */
+  byte fpr[MAX_FINGERPRINT_LEN];
+  byte fprlen;
+  int resource;      /* Index of the resource.  */
+  off_t offset;      /* Offset of the last byte of the record.  */
+  int pk_no;
+  int uid_no;
+  size_t imagelen;
+  byte image[1];
+};
+
+static struct
+{
+  struct shared_kb_cache_item *buckets[SHARED_KB_CACHE_BUCKETS];
+  struct shared_kb_cache_item *lru_head;
+  struct shared_kb_cache_item *lru_tail;
+  unsigned int count;   /* Number of cached keyblocks.  */
+  size_t bytes;         /* Size of the cached images.  */
+  u32 stamp;            /* The change stamp of the database.  */
+} shared_kb_cache;
+
+struct
+{
+  unsigned int hits;      /* Searches answered from the cache.  */
+  unsigned int misses;    /* Searches not found in the cache.  */
+  unsigned int evictions; /* Entries removed to make room.  */
+  unsigned int flushes;   /* Number of flushes.  */
+} shared_kb_cache_stats;
+
 struct
 {
   unsigned int handles; /* Number of handles created.  */
@@ -189,6 +243,169 @@ kid_not_found_flush (void)
 }
 
 
+/* Remove ITEM from the shared keyblock cache and free it.  */
+static void
+shared_kb_cache_remove (struct shared_kb_cache_item *item)
+{
+  struct shared_kb_cache_item **pp;
+
+  for (pp = &shared_kb_cache.buckets[item->fpr[item->fprlen-1]
+                                     % SHARED_KB_CACHE_BUCKETS];
+       *pp; pp = &(*pp)->next)
+    if (*pp == item)
+      {
+        *pp = item->next;
+        break;
+      }
+
+  if (item->lru_prev)
+    item->lru_prev->lru_next = item->lru_next;
+  else
+    shared_kb_cache.lru_head = item->lru_next;
+  if (item->lru_next)
+    item->lru_next->lru_prev = item->lru_prev;
+  else
+    shared_kb_cache.lru_tail = item->lru_prev;
+
+  shared_kb_cache.count--;
+  shared_kb_cache.bytes -= item->imagelen;
+  xfree (item);
+}
+
+
+/* Flush the shared keyblock cache.  */
+static void
+shared_kb_cache_flush (void)
+{
+  if (!shared_kb_cache.count)
+    return;
+
+  if (DBG_CACHE)
+    log_debug ("keydb: shared_kb_cache_flush\n");
+  while (shared_kb_cache.lru_head)
+    shared_kb_cache_remove (shared_kb_cache.lru_head);
+  shared_kb_cache_stats.flushes++;
+}
+
+
+/* Check that the shared keyblock cache matches the current state of
+ * the database and flush it if not.  Returns false if the state can't
+ * be determined and thus the cache may not be used.  */
+static int
+shared_kb_cache_check (void)
+{
+  u32 stamp;
+
+  if (!keydb_get_change_stamp (&stamp))
+    {
+      shared_kb_cache_flush ();
+      return 0;
+    }
+  if (stamp != shared_kb_cache.stamp)
+    {
+      shared_kb_cache_flush ();
+      shared_kb_cache.stamp = stamp;
+    }
+  return 1;
+}
+
+
+/* Return the shared cache entry for the fingerprint FPR of length
+ * FPRLEN or NULL if there is none.  */
+static struct shared_kb_cache_item *
+shared_kb_cache_get (const byte *fpr, int fprlen)
+{
+  struct shared_kb_cache_item *item;
+
+  if (!shared_kb_cache_check ())
+    return NULL;
+
+  for (item = shared_kb_cache.buckets[fpr[fprlen-1] % SHARED_KB_CACHE_BUCKETS];
+       item; item = item->next)
+    if (item->fprlen == fprlen && !memcmp (item->fpr, fpr, fprlen))
+      break;
+  if (!item)
+    {
+      shared_kb_cache_stats.misses++;
+      return NULL;
+    }
+
+  /* Move to the head of the LRU list.  */
+  if (item->lru_prev)
+    {
+      item->lru_prev->lru_next = item->lru_next;
+      if (item->lru_next)
+        item->lru_next->lru_prev = item->lru_prev;
+      else
+        shared_kb_cache.lru_tail = item->lru_prev;
+      item->lru_prev = NULL;
+      item->lru_next = shared_kb_cache.lru_head;
+      shared_kb_cache.lru_head->lru_prev = item;
+      shared_kb_cache.lru_head = item;
+    }
+  shared_kb_cache_stats.hits++;
+  return item;
+}
+
+
+/* Store the keyblock image IMAGE of length IMAGELEN found by a search
+ * for the fingerprint in the per-handle keyblock cache KBC into the
+ * shared keyblock cache.  */
+static void
+shared_kb_cache_put (struct keyblock_cache *kbc,
+                     const byte *image, size_t imagelen)
+{
+  struct shared_kb_cache_item *item;
+  size_t n;
+
+  if (imagelen > SHARED_KB_CACHE_MAX_BYTES / 16)
+    return;  /* Don't let a single large key flush the cache.  */
+  if (!shared_kb_cache_check ())
+    return;
+
+  n = kbc->fpr[kbc->fprlen-1] % SHARED_KB_CACHE_BUCKETS;
+  for (item = shared_kb_cache.buckets[n]; item; item = item->next)
+    if (item->fprlen == kbc->fprlen && !memcmp (item->fpr, kbc->fpr,
+                                                 kbc->fprlen))
+      {
+        shared_kb_cache_remove (item);
+        break;
+      }
+
+  while (shared_kb_cache.lru_tail
+         && (shared_kb_cache.count >= SHARED_KB_CACHE_MAX_ENTRIES
+             || shared_kb_cache.bytes + imagelen > SHARED_KB_CACHE_MAX_BYTES))
+    {
+      shared_kb_cache_remove (shared_kb_cache.lru_tail);
+      shared_kb_cache_stats.evictions++;
+    }
+
+  item = xtrymalloc (sizeof *item + imagelen);
+  if (!item)
+    return;  /* Not a problem - it is just a cache.  */
+  memcpy (item->fpr, kbc->fpr, kbc->fprlen);
+  item->fprlen = kbc->fprlen;
+  item->resource = kbc->resource;
+  item->offset = kbc->offset;
+  item->pk_no = kbc->pk_no;
+  item->uid_no = kbc->uid_no;
+  item->imagelen = imagelen;
+  memcpy (item->image, image, imagelen);
+
+  item->next = shared_kb_cache.buckets[n];
+  shared_kb_cache.buckets[n] = item;
+  item->lru_prev = NULL;
+  item->lru_next = shared_kb_cache.lru_head;
+  if (shared_kb_cache.lru_head)
+    shared_kb_cache.lru_head->lru_prev = item;
+  else
+    shared_kb_cache.lru_tail = item;
+  shared_kb_cache.lru_head = item;
+  shared_kb_cache.count++;
+  shared_kb_cache.bytes += imagelen;
+}
+
+
 static void
 keyblock_cache_clear (struct keydb_handle_s *hd)
 {
@@ -197,6 +414,42 @@ keyblock_cache_clear (struct keydb_handle_s *hd)
   hd->keyblock_cache.iobuf = NULL;
   hd->keyblock_cache.resource = -1;
   hd->keyblock_cache.offset = -1;
+  hd->keyblock_cache.from_reset = 0;
+}
+
+
+/* A search answered from the shared keyblock cache does not set the
+ * found state of the keybox.  Functions which need that state call
+ * this to repeat the search for the cached fingerprint.  */
+static gpg_error_t
+resolve_shared_hit (KEYDB_HANDLE hd)
+{
+  KEYBOX_HANDLE kb;
+  KEYDB_SEARCH_DESC desc;
+  unsigned long skipped = 0;
+  gpg_error_t err;
+
+  if (!hd->shared_hit)
+    return 0;
+  hd->shared_hit = 0;
+
+  if (hd->found < 0 || hd->found >= hd->used
+      || hd->active[hd->found].type != KEYDB_RESOURCE_TYPE_KEYBOX)
+    return gpg_error (GPG_ERR_VALUE_NOT_FOUND);
+  kb = hd->active[hd->found].u.kb;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_FPR;
+  memcpy (desc.u.fpr, hd->keyblock_cache.fpr, hd->keyblock_cache.fprlen);
+  desc.fprlen = hd->keyblock_cache.fprlen;
+
+  keybox_search_reset (kb);
+  do
+    err = keybox_search (kb, &desc, 1, KEYBOX_BLOBTYPE_PGP, NULL, &skipped);
+  while (err == GPG_ERR_LEGACY_KEY);
+  if (err == -1 || gpg_err_code (err) == GPG_ERR_EOF)
+    err = gpg_error (GPG_ERR_VALUE_NOT_FOUND);
+  return err;
 }
 
 
@@ -704,6 +957,7 @@ keydb_add_resource (const char *url, unsigned int flags)
               all_resources[used_resources].type = rt;
               all_resources[used_resources].u.kr = NULL; /* Not used here */
               all_resources[used_resources].token = token;
+              all_resources[used_resources].fname = xstrdup (filename);
               used_resources++;
             }
         }
@@ -730,27 +984,17 @@ keydb_add_resource (const char *url, unsigned int flags)
               err = gpg_error (GPG_ERR_RESOURCE_LIMIT);
             else
               {
-                KEYBOX_HANDLE kbxhd;
-
                 if ((flags & KEYDB_RESOURCE_FLAG_PRIMARY))
                   primary_keydb = token;
                 all_resources[used_resources].type = rt;
                 all_resources[used_resources].u.kb = NULL; /* Not used here */
                 all_resources[used_resources].token = token;
-
-                /* Do a compress run if needed and no other user is
-                 * currently using the keybox. */
-                kbxhd = keybox_new_openpgp (token, 0);
-                if (kbxhd)
-                  {
-                    if (!keybox_lock (kbxhd, 1, 0))
-                      {
-                        keybox_compress (kbxhd);
-                        keybox_lock (kbxhd, 0, 0);
-                      }
-
-                    keybox_release (kbxhd);
-                  }
+                all_resources[used_resources].fname = xstrdup (filename);
+                /* The compress run is done on first use so that
+                 * commands not using the keybox do not need to take
+                 * the lock.  */
+                all_resources[used_resources].need_compress = 1;
+                any_need_compress = 1;
 
                 used_resources++;
               }
@@ -810,6 +1054,106 @@ keydb_dump_stats (void)
             kid_not_found_stats.count,
             kid_not_found_stats.peak,
             kid_not_found_stats.flushes);
+  log_info ("keyblock_cache: count=%u bytes=%lu hits=%u misses=%u"
+            " evictions=%u flushes=%u\n",
+            shared_kb_cache.count,
+            (unsigned long)shared_kb_cache.bytes,
+            shared_kb_cache_stats.hits,
+            shared_kb_cache_stats.misses,
+            shared_kb_cache_stats.evictions,
+            shared_kb_cache_stats.flushes);
+}
+
+
+/* Store a value describing the current state of the key database at
+ * R_STAMP.  The value changes if this or another process modifies
+ * one of the resources; changes by other processes are detected by
+ * the size, mtime and inode of the files.  Returns false if changes
+ * can't be detected; this is the case with the keyboxd.  */
+int
+keydb_get_change_stamp (u32 *r_stamp)
+{
+  struct stat st;
+  u32 stamp;
+  int i;
+
+  if (opt.use_keyboxd)
+    return 0;
+
+  stamp = keydb_change_count;
+  for (i=0; i < used_resources; i++)
+    {
+      if (stat (all_resources[i].fname, &st))
+        return 0;
+      stamp = stamp * 31 + (u32)st.st_size;
+      stamp = stamp * 31 + (u32)st.st_mtime;
+      stamp = stamp * 31 + (u32)st.st_ino;
+    }
+  *r_stamp = stamp;
+  return 1;
+}
+
+
+/* Return true if a previous search has shown that no key with the
+ * key id KID is in the database.  This is only known for local
+ * resources; with the keyboxd false is always returned.  */
+int
+keydb_kid_not_found (u32 *kid)
+{
+  if (opt.use_keyboxd)
+    return 0;
+  return kid_not_found_p (kid) == 1;
+}
+
+
+/* Record that no key with the key id KID is in the database.  The
+ * caller must have done a complete search starting at a reset
+ * handle to learn that.  This is used by callers which look up
+ * several keys with a single search and thus can't rely on
+ * keydb_search to fill the cache.  */
+void
+keydb_note_kid_not_found (u32 *kid)
+{
+  if (opt.use_keyboxd)
+    return;
+  if (!kid_not_found_p (kid))
+    kid_not_found_insert (kid);
+}
+
+
+/* Do the compress runs deferred by keydb_add_resource.  This is only
+ * done if there are no open handles which might still use the old
+ * file.  */
+static void
+compress_resources (void)
+{
+  KEYBOX_HANDLE kbxhd;
+  int i;
+
+  if (active_handles)
+    return;
+  any_need_compress = 0;
+
+  for (i=0; i < used_resources; i++)
+    {
+      if (!all_resources[i].need_compress)
+        continue;
+      all_resources[i].need_compress = 0;
+
+      /* Do a compress run if needed and no other user is currently
+       * using the keybox. */
+      kbxhd = keybox_new_openpgp (all_resources[i].token, 0);
+      if (kbxhd)
+        {
+          if (!keybox_lock (kbxhd, 1, 0))
+            {
+              keybox_compress (kbxhd);
+              keybox_lock (kbxhd, 0, 0);
+            }
+
+          keybox_release (kbxhd);
+        }
+    }
 }
 
 
@@ -828,6 +1172,9 @@ internal_keydb_init (KEYDB_HANDLE hd)
   hd->saved_found = -1;
   hd->is_reset = 1;
 
+  if (any_need_compress)
+    compress_resources ();
+
   log_assert (used_resources <= MAX_KEYDB_RESOURCES);
   for (i=j=0; ! die && i < used_resources; i++)
     {
@@ -932,6 +1279,20 @@ keydb_disable_caching (KEYDB_HANDLE hd)
 }
 
 
+/* Set a flag on the handle so that keydb_get_keyblock returns only the
+ * key packets, the user IDs and the self-signatures.  This is meant
+ * for encryption key lookups which do not need the certifications
+ * and must not be stalled by keys with a huge number of them.  The
+ * keyblocks returned in this mode must never be written back.  The
+ * flag is cleared by calling this function with YES set to false.  */
+void
+keydb_set_self_sigs_only (KEYDB_HANDLE hd, int yes)
+{
+  if (hd)
+    hd->self_sigs_only = !!yes;
+}
+
+
 /* Return the file name of the resource in which the current search
  * result was found or, if there is no search result, the filename of
  * the current resource (i.e., the resource that the file position
@@ -1083,6 +1444,9 @@ keydb_push_found_state (KEYDB_HANDLE hd)
   if (!hd)
     return;
 
+  if (resolve_shared_hit (hd))
+    hd->found = -1;
+
   if (hd->found < 0 || hd->found >= hd->used)
     {
       hd->saved_found = -1;
@@ -1136,9 +1500,12 @@ keydb_pop_found_state (KEYDB_HANDLE hd)
 
 
 
+/* Parse the keyblock in IOBUF.  If SELF_SIGS_ONLY is set all
+ * signatures not issued by the primary key are skipped, except for
+ * revocations.  */
 static gpg_error_t
 parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
-                      kbnode_t *r_keyblock)
+                      int self_sigs_only, kbnode_t *r_keyblock)
 {
   gpg_error_t err;
   struct parse_packet_ctx_s parsectx;
@@ -1147,13 +1514,13 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
   kbnode_t node, *tail;
   int in_cert, save_mode;
   int pk_count, uid_count;
+  u32 main_kid[2] = { 0, 0 };
 
   *r_keyblock = NULL;
 
-  pkt = xtrymalloc (sizeof *pkt);
+  pkt = alloc_packet ();
   if (!pkt)
     return gpg_error_from_syserror ();
-  init_packet (pkt);
   init_parse_packet (&parsectx, iobuf);
   save_mode = set_packet_list_mode (0);
   in_cert = 0;
@@ -1220,6 +1587,22 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
         }
       in_cert = 1;
 
+      /* Skip third-party signatures if requested.  Key and subkey
+       * revocations are kept because they may have been issued by a
+       * designated revoker.  */
+      if (self_sigs_only && pkt->pkttype == PKT_SIGNATURE
+          && (pkt->pkt.signature->keyid[0] != main_kid[0]
+              || pkt->pkt.signature->keyid[1] != main_kid[1])
+          && !IS_KEY_REV (pkt->pkt.signature)
+          && !IS_SUBKEY_REV (pkt->pkt.signature))
+        {
+          free_packet (pkt, &parsectx);
+          init_packet (pkt);
+          continue;
+        }
+      if (pkt->pkttype == PKT_PUBLIC_KEY || pkt->pkttype == PKT_SECRET_KEY)
+        keyid_from_pk (pkt->pkt.public_key, main_kid);
+
       node = new_kbnode (pkt);
 
       switch (pkt->pkttype)
@@ -1246,13 +1629,12 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
       else
         *tail = node;
       tail = &node->next;
-      pkt = xtrymalloc (sizeof *pkt);
+      pkt = alloc_packet ();
       if (!pkt)
         {
           err = gpg_error_from_syserror ();
           break;
         }
-      init_packet (pkt);
     }
   set_packet_list_mode (save_mode);
 
@@ -1268,7 +1650,7 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
     }
   free_packet (pkt, &parsectx);
   deinit_parse_packet (&parsectx);
-  xfree (pkt);
+  release_packet_struct (pkt);
   return err;
 }
 
@@ -1303,7 +1685,7 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 	  err = parse_keyblock_image (hd->keyblock_cache.iobuf,
 				      hd->keyblock_cache.pk_no,
 				      hd->keyblock_cache.uid_no,
-				      ret_kb);
+				      hd->self_sigs_only, ret_kb);
 	  if (err)
 	    keyblock_cache_clear (hd);
 	  if (DBG_CLOCK)
@@ -1330,9 +1712,19 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 
         err = keybox_get_keyblock (hd->active[hd->found].u.kb,
                                    &iobuf, &pk_no, &uid_no);
+        if (!err && hd->keyblock_cache.state == KEYBLOCK_CACHE_PREPARED
+            && hd->keyblock_cache.from_reset && !hd->no_shared_cache)
+          {
+            hd->keyblock_cache.pk_no  = pk_no;
+            hd->keyblock_cache.uid_no = uid_no;
+            shared_kb_cache_put (&hd->keyblock_cache,
+                                 iobuf_get_temp_buffer (iobuf),
+                                 iobuf_get_temp_length (iobuf));
+          }
         if (!err)
           {
-            err = parse_keyblock_image (iobuf, pk_no, uid_no, ret_kb);
+            err = parse_keyblock_image (iobuf, pk_no, uid_no,
+                                        hd->self_sigs_only, ret_kb);
             if (!err && hd->keyblock_cache.state == KEYBLOCK_CACHE_PREPARED)
               {
                 hd->keyblock_cache.state     = KEYBLOCK_CACHE_FILLED;
@@ -1359,6 +1751,61 @@ internal_keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 }
 
 
+/* Return the raw OpenPGP image of the keyblock last found by
+ * keydb_search in a newly allocated buffer stored at (R_IMAGE,
+ * R_IMAGELEN).  The image is the keyblock as stored in the keybox;
+ * keydb_get_keyblock returns the parsed version of it.  This is only
+ * supported for keybox resources; for other resources
+ * GPG_ERR_NOT_SUPPORTED is returned.  */
+gpg_error_t
+keydb_get_keyblock_image (KEYDB_HANDLE hd, void **r_image, size_t *r_imagelen)
+{
+  gpg_error_t err;
+  iobuf_t iobuf = NULL;
+  int pk_no, uid_no;
+  membuf_t mb;
+  char buffer[4096];
+  int n;
+
+  *r_image = NULL;
+  *r_imagelen = 0;
+
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (hd->use_keyboxd)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  if (hd->keyblock_cache.state == KEYBLOCK_CACHE_FILLED)
+    {
+      err = iobuf_seek (hd->keyblock_cache.iobuf, 0);
+      if (err)
+        return err;
+      iobuf = hd->keyblock_cache.iobuf;
+    }
+  else
+    {
+      if (hd->found < 0 || hd->found >= hd->used)
+        return gpg_error (GPG_ERR_VALUE_NOT_FOUND);
+      if (hd->active[hd->found].type != KEYDB_RESOURCE_TYPE_KEYBOX)
+        return gpg_error (GPG_ERR_NOT_SUPPORTED);
+      err = keybox_get_keyblock (hd->active[hd->found].u.kb,
+                                 &iobuf, &pk_no, &uid_no);
+      if (err)
+        return err;
+    }
+
+  init_membuf (&mb, 4096);
+  while ((n = iobuf_read (iobuf, buffer, sizeof buffer)) > 0)
+    put_membuf (&mb, buffer, n);
+  if (iobuf != hd->keyblock_cache.iobuf)
+    iobuf_close (iobuf);
+  *r_image = get_membuf (&mb, r_imagelen);
+  if (!*r_image)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
 /* Update the keyblock KB (i.e., extract the fingerprint and find the
  * corresponding keyblock in the keyring).
  * keydb_update_keyblock diverts to here in the non-keyboxd mode.
@@ -1382,12 +1829,15 @@ internal_keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   PKT_public_key *pk;
   KEYDB_SEARCH_DESC desc;
   size_t len;
+  int saved_no_shared_cache;
 
   log_assert (!hd->use_keyboxd);
   pk = kb->pkt->pkt.public_key;
 
   kid_not_found_flush ();
+  shared_kb_cache_flush ();
   keyblock_cache_clear (hd);
+  keydb_change_count++;
 
   if (opt.dry_run)
     return 0;
@@ -1410,8 +1860,13 @@ internal_keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   else
     log_bug ("%s: Unsupported key length: %zu\n", __func__, len);
 
+  /* We need the real position of the keyblock in the keybox and thus
+   * must not take a shortcut via the shared keyblock cache.  */
   keydb_search_reset (hd);
+  saved_no_shared_cache = hd->no_shared_cache;
+  hd->no_shared_cache = 1;
   err = keydb_search (hd, &desc, 1, NULL);
+  hd->no_shared_cache = saved_no_shared_cache;
   if (err)
     return gpg_error (GPG_ERR_VALUE_NOT_FOUND);
   log_assert (hd->found >= 0 && hd->found < hd->used);
@@ -1468,7 +1923,9 @@ internal_keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   log_assert (!hd->use_keyboxd);
 
   kid_not_found_flush ();
+  shared_kb_cache_flush ();
   keyblock_cache_clear (hd);
+  keydb_change_count++;
 
   if (opt.dry_run)
     return 0;
@@ -1532,7 +1989,12 @@ internal_keydb_delete_keyblock (KEYDB_HANDLE hd)
   log_assert (!hd->use_keyboxd);
 
   kid_not_found_flush ();
+  shared_kb_cache_flush ();
+  rc = resolve_shared_hit (hd);
   keyblock_cache_clear (hd);
+  keydb_change_count++;
+  if (rc)
+    return rc;
 
   if (hd->found < 0 || hd->found >= hd->used)
     return gpg_error (GPG_ERR_VALUE_NOT_FOUND);
@@ -1661,6 +2123,74 @@ keydb_rebuild_caches (ctrl_t ctrl, int noisy)
 }
 
 
+/* Helper for internal_keydb_bulk_begin and internal_keydb_bulk_end.  */
+static void
+bulk_update (int begin)
+{
+  gpg_error_t err;
+  KEYBOX_HANDLE kbxhd;
+  int i;
+
+  for (i=0; i < used_resources; i++)
+    {
+      if (all_resources[i].type != KEYDB_RESOURCE_TYPE_KEYBOX
+          || !keybox_is_writable (all_resources[i].token))
+        continue;
+
+      kbxhd = keybox_new_openpgp (all_resources[i].token, 0);
+      if (!kbxhd)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error creating keybox handle: %s\n", gpg_strerror (err));
+          continue;
+        }
+      if (begin)
+        {
+          err = keybox_bulk_begin (kbxhd);
+          if (err)
+            log_info ("can't start bulk update of '%s': %s\n",
+                      keybox_get_resource_name (kbxhd), gpg_strerror (err));
+        }
+      else
+        {
+          err = keybox_bulk_end (kbxhd);
+          if (err)
+            log_error (_("error writing keyring '%s': %s\n"),
+                       keybox_get_resource_name (kbxhd), gpg_strerror (err));
+        }
+      keybox_release (kbxhd);
+    }
+}
+
+
+/* Start a bulk update.  Until internal_keydb_bulk_end is called,
+ * keyblocks inserted into or updated in a keybox are appended to the
+ * file instead of rewriting the entire file and the keybox stays
+ * locked.  Keyrings are not affected.  */
+void
+internal_keydb_bulk_begin (ctrl_t ctrl)
+{
+  (void)ctrl;
+
+  if (opt.dry_run)
+    return;
+  bulk_update (1);
+}
+
+
+/* Finish a bulk update started by internal_keydb_bulk_begin.  This
+ * compacts the changed keyboxes in one go.  */
+void
+internal_keydb_bulk_end (ctrl_t ctrl)
+{
+  (void)ctrl;
+
+  if (opt.dry_run)
+    return;
+  bulk_update (0);
+}
+
+
 /* Return the number of skipped blocks (because they were too large to
    read from a keybox) since the last search reset.  */
 unsigned long
@@ -1688,6 +2218,7 @@ internal_keydb_search_reset (KEYDB_HANDLE hd)
 
   keyblock_cache_clear (hd);
 
+  hd->shared_hit = 0;
   hd->skipped_long_blobs = 0;
   hd->current = 0;
   hd->found = -1;
@@ -1741,6 +2272,7 @@ internal_keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   /* If an entry is already in the cache, then don't add it again.  */
   int already_in_cache = 0;
   int fprlen;
+  struct shared_kb_cache_item *item;
 
   log_assert (!hd->use_keyboxd);
 
@@ -1792,6 +2324,47 @@ internal_keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       return 0;
     }
 
+  /* The shared cache only stores the first match of a search from
+     the start of the database and can thus only answer such a
+     search.  */
+  hd->shared_hit = 0;
+  if (!hd->no_caching
+      && !hd->no_shared_cache
+      && was_reset
+      && ndesc == 1
+      && fprlen
+      && (item = shared_kb_cache_get (desc[0].u.fpr, fprlen))
+      && item->resource < hd->used
+      && hd->active[item->resource].type == KEYDB_RESOURCE_TYPE_KEYBOX)
+    {
+      keyblock_cache_clear (hd);
+      hd->keyblock_cache.iobuf
+        = iobuf_temp_with_content ((const char *)item->image, item->imagelen);
+      if (hd->keyblock_cache.iobuf)
+        {
+          hd->keyblock_cache.state = KEYBLOCK_CACHE_FILLED;
+          memcpy (hd->keyblock_cache.fpr, item->fpr, item->fprlen);
+          hd->keyblock_cache.fprlen = item->fprlen;
+          hd->keyblock_cache.pk_no = item->pk_no;
+          hd->keyblock_cache.uid_no = item->uid_no;
+          hd->keyblock_cache.resource = item->resource;
+          hd->keyblock_cache.offset = item->offset;
+
+          if (DBG_CLOCK)
+            log_clock ("%s leave (shared cache)", __func__);
+
+          hd->current = hd->found = item->resource;
+          keybox_search_reset (hd->active[hd->current].u.kb);
+          keybox_seek (hd->active[hd->current].u.kb, item->offset + 1);
+          hd->is_reset = 0;
+          hd->shared_hit = 1;
+          if (descindex)
+            *descindex = 0;
+          keydb_stats.found_cached++;
+          return 0;
+        }
+    }
+
   rc = -1;
   while ((rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
          && hd->current >= 0 && hd->current < hd->used)
@@ -1863,6 +2436,7 @@ internal_keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
         = keybox_offset (hd->active[hd->current].u.kb) - 1;
       memcpy (hd->keyblock_cache.fpr, desc[0].u.fpr, fprlen);
       hd->keyblock_cache.fprlen = fprlen;
+      hd->keyblock_cache.from_reset = was_reset;
     }
 
   if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND
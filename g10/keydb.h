@@ -187,6 +187,10 @@ gpg_error_t keydb_lock (KEYDB_HANDLE hd);
 /* Return the keyblock last found by keydb_search.  */
 gpg_error_t keydb_get_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb);
 
+/* Return the raw image of the keyblock last found by keydb_search.  */
+gpg_error_t keydb_get_keyblock_image (KEYDB_HANDLE hd,
+                                      void **r_image, size_t *r_imagelen);
+
 /* Update the keyblock KB.  */
 gpg_error_t keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb);
 
@@ -221,12 +225,21 @@ gpg_error_t keydb_add_resource (const char *url, unsigned int flags);
 
 /* Dump some statistics to the log.  */
 void keydb_dump_stats (void);
+int keydb_get_change_stamp (u32 *r_stamp);
+
+/* Query and update the cache of key ids known not to be in the
+   database.  */
+int keydb_kid_not_found (u32 *kid);
+void keydb_note_kid_not_found (u32 *kid);
 
 /* Set a flag on the handle to suppress use of cached results.  This
    is required for updating a keyring and for key listings.  Fixme:
    Using a new parameter for keydb_new might be a better solution.  */
 void keydb_disable_caching (KEYDB_HANDLE hd);
 
+/* Return only the self-signatures with the keyblocks.  */
+void keydb_set_self_sigs_only (KEYDB_HANDLE hd, int yes);
+
 /* Save the last found state and invalidate the current selection.  */
 void keydb_push_found_state (KEYDB_HANDLE hd);
 
@@ -242,6 +255,11 @@ gpg_error_t keydb_locate_writable (KEYDB_HANDLE hd);
 /* Rebuild the on-disk caches of all key resources.  */
 void keydb_rebuild_caches (ctrl_t ctrl, int noisy);
 
+/* Start and finish a bulk update of all keybox resources or the
+ * keyboxd.  */
+void keydb_bulk_begin (ctrl_t ctrl);
+void keydb_bulk_end (ctrl_t ctrl);
+
 /* Return the number of skipped blocks (because they were to large to
    read from a keybox) since the last search reset.  */
 unsigned long keydb_get_skipped_counter (KEYDB_HANDLE hd);
@@ -326,11 +344,17 @@ void cache_public_key( PKT_public_key *pk );
 /* Disable and drop the public key cache.  */
 void getkey_disable_caches(void);
 
+/* Dump the public key cache stats.  */
+void getkey_dump_stats (void);
+
 /* Return the public key used for signature SIG and store it at PK.  */
 gpg_error_t get_pubkey_for_sig (ctrl_t ctrl,
                                 PKT_public_key *pk, PKT_signature *sig,
                                 PKT_public_key *forced_pk);
 
+/* Load the public keys with the given key ids into the cache.  */
+void prefetch_pubkeys (ctrl_t ctrl, u32 (*kids)[2], unsigned int nkids);
+
 /* Return the public key with the key id KEYID and store it at PK.  */
 int get_pubkey (ctrl_t ctrl, PKT_public_key *pk, u32 *keyid);
 
@@ -382,6 +406,10 @@ gpg_error_t get_best_pubkey_byname (ctrl_t ctrl, enum get_pubkey_modes mode,
                                     const char *name, KBNODE *ret_keyblock,
                                     int include_unusable);
 
+/* Look up the keys for several mail addresses at once.  */
+void akl_prefetch (ctrl_t ctrl, strlist_t names);
+void akl_prefetch_release (ctrl_t ctrl);
+
 /* Get a public key directly from file FNAME.  */
 gpg_error_t get_pubkey_fromfile (ctrl_t ctrl,
                                  PKT_public_key *pk, const char *fname);
@@ -48,7 +48,7 @@
 
 
 /* The default algorithms.  If you change them, you should ensure the value
-   is inside the bounds enforced by ask_keysize and gen_xxx.  See also
+   is inside the bounds enforced by ask_keysize and keyparms_xxx.  See also
    get_keysize_range which encodes the allowed ranges.  */
 #define DEFAULT_STD_KEY_PARAM  "rsa3072/cert,sign+rsa3072/encr"
 #define FUTURE_STD_KEY_PARAM   "ed25519/cert,sign+cv25519/encr"
@@ -114,6 +114,16 @@ struct para_data_s {
     } u;
 };
 
+/* A parameter block queued in batched mode.  */
+struct batch_block_s
+{
+  struct para_data_s *para;
+  unsigned int keygen_flags;  /* The flags in effect for this block.  */
+  char *keyparms[2];          /* The parameters of the primary key and
+                               * the subkey or NULL.  */
+  struct agent_genkey_job_s genkey[2];  /* The keys generated in advance.  */
+};
+
 struct output_control_s
 {
   int lnr;
@@ -126,6 +136,15 @@ struct output_control_s
     IOBUF stream;
     armor_filter_context_t *afx;
   } pub;
+  /* In batched mode the parameter blocks are queued and then
+   * generated in one go.  */
+  struct {
+    int active;
+    struct batch_block_s *blocks;
+    unsigned int nblocks;
+    unsigned int size;
+  } batch;
+  struct batch_block_s *pregen;  /* The block being generated.  */
 };
 
 
@@ -1518,22 +1537,37 @@ do_create_from_keygrip (ctrl_t ctrl, int algo,
 }
 
 
-/* Common code for the key generation function gen_xxx.  */
+/* Common code for the key generation of do_create.  If PREGEN is
+ * not NULL and holds a key generated for KEYPARMS, that key is used
+ * instead of asking the agent.  */
 static int
 common_gen (const char *keyparms, int algo, const char *algoelem,
             kbnode_t pub_root, u32 timestamp, u32 expireval, int is_subkey,
             int keygen_flags, const char *passphrase,
-            char **cache_nonce_addr, char **passwd_nonce_addr)
+            char **cache_nonce_addr, char **passwd_nonce_addr,
+            agent_genkey_job_t pregen)
 {
   int err;
   PACKET *pkt;
   PKT_public_key *pk;
   gcry_sexp_t s_key;
 
-  err = agent_genkey (NULL, cache_nonce_addr, passwd_nonce_addr, keyparms,
-                      !!(keygen_flags & KEYGEN_FLAG_NO_PROTECTION),
-                      passphrase,
-                      &s_key);
+  if (pregen && pregen->pubkey && !strcmp (pregen->keyparms, keyparms))
+    {
+      s_key = pregen->pubkey;
+      pregen->pubkey = NULL;
+      if (cache_nonce_addr && !*cache_nonce_addr)
+        {
+          *cache_nonce_addr = pregen->cache_nonce;
+          pregen->cache_nonce = NULL;
+        }
+      err = 0;
+    }
+  else
+    err = agent_genkey (NULL, cache_nonce_addr, passwd_nonce_addr, keyparms,
+                        !!(keygen_flags & KEYGEN_FLAG_NO_PROTECTION),
+                        passphrase,
+                        &s_key);
   if (err)
     {
       log_error ("agent_genkey failed: %s\n", gpg_strerror (err) );
@@ -1586,15 +1620,12 @@ common_gen (const char *keyparms, int algo, const char *algoelem,
 
 
 /*
- * Generate an Elgamal key.
+ * Create the parameters for an Elgamal key.
  */
-static int
-gen_elg (int algo, unsigned int nbits, KBNODE pub_root,
-         u32 timestamp, u32 expireval, int is_subkey,
-         int keygen_flags, const char *passphrase,
-         char **cache_nonce_addr, char **passwd_nonce_addr)
+static gpg_error_t
+keyparms_elg (int algo, unsigned int nbits, int keygen_flags, int silent,
+              char **r_keyparms)
 {
-  int err;
   char *keyparms;
   char nbitsstr[35];
 
@@ -1603,18 +1634,21 @@ gen_elg (int algo, unsigned int nbits, KBNODE pub_root,
   if (nbits < 1024)
     {
       nbits = 2048;
-      log_info (_("keysize invalid; using %u bits\n"), nbits );
+      if (!silent)
+        log_info (_("keysize invalid; using %u bits\n"), nbits );
     }
   else if (nbits > 4096)
     {
       nbits = 4096;
-      log_info (_("keysize invalid; using %u bits\n"), nbits );
+      if (!silent)
+        log_info (_("keysize invalid; using %u bits\n"), nbits );
     }
 
   if ((nbits % 32))
     {
       nbits = ((nbits + 31) / 32) * 32;
-      log_info (_("keysize rounded up to %u bits\n"), nbits );
+      if (!silent)
+        log_info (_("keysize rounded up to %u bits\n"), nbits );
     }
 
   /* Note that we use transient-key only if no-protection has also
@@ -1628,30 +1662,19 @@ gen_elg (int algo, unsigned int nbits, KBNODE pub_root,
                             && (keygen_flags & KEYGEN_FLAG_NO_PROTECTION))?
                            "(transient-key)" : "" );
   if (!keyparms)
-    err = gpg_error_from_syserror ();
-  else
-    {
-      err = common_gen (keyparms, algo, "pgy",
-                        pub_root, timestamp, expireval, is_subkey,
-                        keygen_flags, passphrase,
-                        cache_nonce_addr, passwd_nonce_addr);
-      xfree (keyparms);
-    }
-
-  return err;
+    return gpg_error_from_syserror ();
+  *r_keyparms = keyparms;
+  return 0;
 }
 
 
 /*
- * Generate an DSA key
+ * Create the parameters for a DSA key
  */
 static gpg_error_t
-gen_dsa (unsigned int nbits, KBNODE pub_root,
-         u32 timestamp, u32 expireval, int is_subkey,
-         int keygen_flags, const char *passphrase,
-         char **cache_nonce_addr, char **passwd_nonce_addr)
+keyparms_dsa (unsigned int nbits, int keygen_flags, int silent,
+              char **r_keyparms)
 {
-  int err;
   unsigned int qbits;
   char *keyparms;
   char nbitsstr[35];
@@ -1660,18 +1683,21 @@ gen_dsa (unsigned int nbits, KBNODE pub_root,
   if (nbits < 768)
     {
       nbits = 2048;
-      log_info(_("keysize invalid; using %u bits\n"), nbits );
+      if (!silent)
+        log_info(_("keysize invalid; using %u bits\n"), nbits );
     }
   else if ( nbits > 3072 )
     {
       nbits = 3072;
-      log_info(_("keysize invalid; using %u bits\n"), nbits );
+      if (!silent)
+        log_info(_("keysize invalid; using %u bits\n"), nbits );
     }
 
   if( (nbits % 64) )
     {
       nbits = ((nbits + 63) / 64) * 64;
-      log_info(_("keysize rounded up to %u bits\n"), nbits );
+      if (!silent)
+        log_info(_("keysize rounded up to %u bits\n"), nbits );
     }
 
   /* To comply with FIPS rules we round up to the next value unless in
@@ -1679,7 +1705,8 @@ gen_dsa (unsigned int nbits, KBNODE pub_root,
   if (!opt.expert && nbits > 1024 && (nbits % 1024))
     {
       nbits = ((nbits + 1023) / 1024) * 1024;
-      log_info(_("keysize rounded up to %u bits\n"), nbits );
+      if (!silent)
+        log_info(_("keysize rounded up to %u bits\n"), nbits );
     }
 
   /*
@@ -1704,7 +1731,7 @@ gen_dsa (unsigned int nbits, KBNODE pub_root,
   else
     qbits = 160;
 
-  if (qbits != 160 )
+  if (qbits != 160 && !silent)
     log_info (_("WARNING: some OpenPGP programs can't"
                 " handle a DSA key with this digest size\n"));
 
@@ -1717,31 +1744,20 @@ gen_dsa (unsigned int nbits, KBNODE pub_root,
                             && (keygen_flags & KEYGEN_FLAG_NO_PROTECTION))?
                            "(transient-key)" : "" );
   if (!keyparms)
-    err = gpg_error_from_syserror ();
-  else
-    {
-      err = common_gen (keyparms, PUBKEY_ALGO_DSA, "pqgy",
-                        pub_root, timestamp, expireval, is_subkey,
-                        keygen_flags, passphrase,
-                        cache_nonce_addr, passwd_nonce_addr);
-      xfree (keyparms);
-    }
-
-  return err;
+    return gpg_error_from_syserror ();
+  *r_keyparms = keyparms;
+  return 0;
 }
 
 
 
 /*
- * Generate an ECC key
+ * Create the parameters for an ECC key
  */
 static gpg_error_t
-gen_ecc (int algo, const char *curve, kbnode_t pub_root,
-         u32 timestamp, u32 expireval, int is_subkey,
-         int keygen_flags, const char *passphrase,
-         char **cache_nonce_addr, char **passwd_nonce_addr)
+keyparms_ecc (int algo, const char *curve, int keygen_flags,
+              char **r_keyparms)
 {
-  gpg_error_t err;
   char *keyparms;
 
   log_assert (algo == PUBKEY_ALGO_ECDSA
@@ -1783,30 +1799,19 @@ gen_ecc (int algo, const char *curve, kbnode_t pub_root,
         " transient-key" : ""));
 
   if (!keyparms)
-    err = gpg_error_from_syserror ();
-  else
-    {
-      err = common_gen (keyparms, algo, "",
-                        pub_root, timestamp, expireval, is_subkey,
-                        keygen_flags, passphrase,
-                        cache_nonce_addr, passwd_nonce_addr);
-      xfree (keyparms);
-    }
-
-  return err;
+    return gpg_error_from_syserror ();
+  *r_keyparms = keyparms;
+  return 0;
 }
 
 
 /*
- * Generate an RSA key.
+ * Create the parameters for an RSA key.
  */
-static int
-gen_rsa (int algo, unsigned int nbits, KBNODE pub_root,
-         u32 timestamp, u32 expireval, int is_subkey,
-         int keygen_flags, const char *passphrase,
-         char **cache_nonce_addr, char **passwd_nonce_addr)
+static gpg_error_t
+keyparms_rsa (int algo, unsigned int nbits, int keygen_flags, int silent,
+              char **r_keyparms)
 {
-  int err;
   char *keyparms;
   char nbitsstr[35];
   const unsigned maxsize = (opt.flags.large_rsa ? 8192 : 4096);
@@ -1819,18 +1824,21 @@ gen_rsa (int algo, unsigned int nbits, KBNODE pub_root,
   if (nbits < 1024)
     {
       nbits = 3072;
-      log_info (_("keysize invalid; using %u bits\n"), nbits );
+      if (!silent)
+        log_info (_("keysize invalid; using %u bits\n"), nbits );
     }
   else if (nbits > maxsize)
     {
       nbits = maxsize;
-      log_info (_("keysize invalid; using %u bits\n"), nbits );
+      if (!silent)
+        log_info (_("keysize invalid; using %u bits\n"), nbits );
     }
 
   if ((nbits % 32))
     {
       nbits = ((nbits + 31) / 32) * 32;
-      log_info (_("keysize rounded up to %u bits\n"), nbits );
+      if (!silent)
+        log_info (_("keysize rounded up to %u bits\n"), nbits );
     }
 
   snprintf (nbitsstr, sizeof nbitsstr, "%u", nbits);
@@ -1840,17 +1848,9 @@ gen_rsa (int algo, unsigned int nbits, KBNODE pub_root,
                             && (keygen_flags & KEYGEN_FLAG_NO_PROTECTION))?
                            "(transient-key)" : "" );
   if (!keyparms)
-    err = gpg_error_from_syserror ();
-  else
-    {
-      err = common_gen (keyparms, algo, "ne",
-                        pub_root, timestamp, expireval, is_subkey,
-                        keygen_flags, passphrase,
-                        cache_nonce_addr, passwd_nonce_addr);
-      xfree (keyparms);
-    }
-
-  return err;
+    return gpg_error_from_syserror ();
+  *r_keyparms = keyparms;
+  return 0;
 }
 
 
@@ -3162,15 +3162,60 @@ ask_user_id (int mode, int full, KBNODE keyblock)
 }
 
 
+/* Create the S-expression with the parameters for a new key of ALGO
+ * and store it at R_KEYPARMS.  The names of the public key parameters
+ * are stored at R_ALGOELEM.  With SILENT set adjustments of the key
+ * size are not logged.  */
+static gpg_error_t
+make_keyparms (int algo, unsigned int nbits, const char *curve,
+               int keygen_flags, int silent,
+               char **r_keyparms, const char **r_algoelem)
+{
+  gpg_error_t err;
+
+  *r_keyparms = NULL;
+  if (algo == PUBKEY_ALGO_ELGAMAL_E)
+    {
+      err = keyparms_elg (algo, nbits, keygen_flags, silent, r_keyparms);
+      *r_algoelem = "pgy";
+    }
+  else if (algo == PUBKEY_ALGO_DSA)
+    {
+      err = keyparms_dsa (nbits, keygen_flags, silent, r_keyparms);
+      *r_algoelem = "pqgy";
+    }
+  else if (algo == PUBKEY_ALGO_ECDSA
+           || algo == PUBKEY_ALGO_EDDSA
+           || algo == PUBKEY_ALGO_ECDH)
+    {
+      err = keyparms_ecc (algo, curve, keygen_flags, r_keyparms);
+      *r_algoelem = "";
+    }
+  else if (algo == PUBKEY_ALGO_RSA)
+    {
+      err = keyparms_rsa (algo, nbits, keygen_flags, silent, r_keyparms);
+      *r_algoelem = "ne";
+    }
+  else
+    BUG();
+
+  return err;
+}
+
+
 /* Basic key generation.  Here we divert to the actual generation
-   routines based on the requested algorithm.  */
+   routines based on the requested algorithm.  PREGEN is an optional
+   key generated in advance by the batched mode.  */
 static int
 do_create (int algo, unsigned int nbits, const char *curve, kbnode_t pub_root,
            u32 timestamp, u32 expiredate, int is_subkey,
            int keygen_flags, const char *passphrase,
-           char **cache_nonce_addr, char **passwd_nonce_addr)
+           char **cache_nonce_addr, char **passwd_nonce_addr,
+           agent_genkey_job_t pregen)
 {
   gpg_error_t err;
+  char *keyparms;
+  const char *algoelem;
 
   /* Fixme: The entropy collecting message should be moved to a
      libgcrypt progress handler.  */
@@ -3181,26 +3226,14 @@ do_create (int algo, unsigned int nbits, const char *curve, kbnode_t pub_root,
 "disks) during the prime generation; this gives the random number\n"
 "generator a better chance to gain enough entropy.\n") );
 
-  if (algo == PUBKEY_ALGO_ELGAMAL_E)
-    err = gen_elg (algo, nbits, pub_root, timestamp, expiredate, is_subkey,
-                   keygen_flags, passphrase,
-                   cache_nonce_addr, passwd_nonce_addr);
-  else if (algo == PUBKEY_ALGO_DSA)
-    err = gen_dsa (nbits, pub_root, timestamp, expiredate, is_subkey,
-                   keygen_flags, passphrase,
-                   cache_nonce_addr, passwd_nonce_addr);
-  else if (algo == PUBKEY_ALGO_ECDSA
-           || algo == PUBKEY_ALGO_EDDSA
-           || algo == PUBKEY_ALGO_ECDH)
-    err = gen_ecc (algo, curve, pub_root, timestamp, expiredate, is_subkey,
-                   keygen_flags, passphrase,
-                   cache_nonce_addr, passwd_nonce_addr);
-  else if (algo == PUBKEY_ALGO_RSA)
-    err = gen_rsa (algo, nbits, pub_root, timestamp, expiredate, is_subkey,
-                   keygen_flags, passphrase,
-                   cache_nonce_addr, passwd_nonce_addr);
-  else
-    BUG();
+  err = make_keyparms (algo, nbits, curve, keygen_flags, 0,
+                       &keyparms, &algoelem);
+  if (!err)
+    err = common_gen (keyparms, algo, algoelem,
+                      pub_root, timestamp, expiredate, is_subkey,
+                      keygen_flags, passphrase,
+                      cache_nonce_addr, passwd_nonce_addr, pregen);
+  xfree (keyparms);
 
   return err;
 }
@@ -3996,6 +4029,27 @@ get_parameter_bool (struct para_data_s *para, enum para_name key)
 }
 
 
+/* Queue the parameter block PARA for batched mode.  PARA is now owned
+ * by the queue.  */
+static void
+batch_add_block (struct output_control_s *outctrl, struct para_data_s *para)
+{
+  struct batch_block_s *block;
+
+  if (outctrl->batch.nblocks == outctrl->batch.size)
+    {
+      outctrl->batch.size = outctrl->batch.size? 2 * outctrl->batch.size : 16;
+      outctrl->batch.blocks = xrealloc (outctrl->batch.blocks,
+                                        (outctrl->batch.size
+                                         * sizeof *outctrl->batch.blocks));
+    }
+  block = outctrl->batch.blocks + outctrl->batch.nblocks++;
+  memset (block, 0, sizeof *block);
+  block->para = para;
+  block->keygen_flags = outctrl->keygen_flags;
+}
+
+
 static int
 proc_parameter_file (ctrl_t ctrl, struct para_data_s *para, const char *fname,
                      struct output_control_s *outctrl, int card )
@@ -4195,11 +4249,118 @@ proc_parameter_file (ctrl_t ctrl, struct para_data_s *para, const char *fname,
       append_to_parameter (para, r);
     }
 
-  do_generate_keypair (ctrl, para, outctrl, card );
+  if (outctrl->batch.active)
+    batch_add_block (outctrl, para);
+  else
+    do_generate_keypair (ctrl, para, outctrl, card );
   return 0;
 }
 
 
+/* Generate the keys of the parameter blocks queued in batched mode.
+ * For each chunk of --jobs blocks the keys which do not require a
+ * passphrase entry are first generated by the agent in parallel.
+ * The keyblocks of the chunk are then completed one after the other.
+ * The chunks are kept small because the cache nonces used for the
+ * self-signatures expire after a short time.  All keyblocks are
+ * written with a single bulk update of the keydb and the trustdb.  */
+static void
+batch_generate (ctrl_t ctrl, struct output_control_s *outctrl)
+{
+  struct batch_block_s *block;
+  agent_genkey_job_t jobs, job;
+  agent_genkey_job_t *jobtail;
+  struct para_data_s *para;
+  const char *passphrase, *algoelem;
+  unsigned int saved_flags, start, end, i, n;
+  int use_bulk;
+
+  if (!outctrl->batch.nblocks)
+    return;
+
+  use_bulk = !outctrl->dryrun && !outctrl->use_files;
+  if (use_bulk)
+    {
+      keydb_bulk_begin (ctrl);
+      trustdb_bulk_begin (ctrl);
+    }
+
+  saved_flags = outctrl->keygen_flags;
+  for (start=0; start < outctrl->batch.nblocks; start = end)
+    {
+      end = start + opt.jobs;
+      if (end > outctrl->batch.nblocks)
+        end = outctrl->batch.nblocks;
+
+      jobs = NULL;
+      jobtail = &jobs;
+      for (i=start; !outctrl->dryrun && i < end; i++)
+        {
+          block = outctrl->batch.blocks + i;
+          para = block->para;
+          passphrase = get_parameter_passphrase (para);
+          if (!(block->keygen_flags & KEYGEN_FLAG_NO_PROTECTION)
+              && !passphrase)
+            continue;  /* The agent would ask for a passphrase.  */
+
+          for (n=0; n < 2; n++)
+            {
+              if (n && !get_parameter (para, pSUBKEYTYPE))
+                continue;
+              if (get_parameter (para, n? pSUBKEYGRIP : pKEYGRIP))
+                continue;
+              if (make_keyparms (get_parameter_algo (ctrl, para,
+                                                     n? pSUBKEYTYPE : pKEYTYPE,
+                                                     NULL),
+                                 get_parameter_uint (para, n? pSUBKEYLENGTH
+                                                     /**/ : pKEYLENGTH),
+                                 get_parameter_value (para, n? pSUBKEYCURVE
+                                                      /**/ : pKEYCURVE),
+                                 block->keygen_flags, 1,
+                                 &block->keyparms[n], &algoelem))
+                continue;
+              job = block->genkey + n;
+              job->keyparms = block->keyparms[n];
+              job->no_protection = !!(block->keygen_flags
+                                      & KEYGEN_FLAG_NO_PROTECTION);
+              job->passphrase = passphrase;
+              *jobtail = job;
+              jobtail = &job->next;
+            }
+        }
+
+      /* Keys not generated here are generated later as usual.  */
+      if (jobs)
+        agent_genkey_parallel (ctrl, jobs, opt.jobs);
+
+      for (i=start; i < end; i++)
+        {
+          block = outctrl->batch.blocks + i;
+          outctrl->keygen_flags = block->keygen_flags;
+          outctrl->pregen = block;
+          do_generate_keypair (ctrl, block->para, outctrl, 0);
+          outctrl->pregen = NULL;
+
+          for (n=0; n < 2; n++)
+            {
+              gcry_sexp_release (block->genkey[n].pubkey);
+              xfree (block->genkey[n].cache_nonce);
+              xfree (block->keyparms[n]);
+            }
+          release_parameter_list (block->para);
+        }
+    }
+  outctrl->keygen_flags = saved_flags;
+  outctrl->batch.nblocks = 0;
+
+  if (use_bulk)
+    {
+      keydb_bulk_end (ctrl);
+      trustdb_bulk_end (ctrl);
+    }
+}
+
+
 /****************
  * Kludge to allow non interactive key generation controlled
  * by a parameter file.
@@ -4248,6 +4409,8 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
 
     memset( &outctrl, 0, sizeof( outctrl ) );
     outctrl.pub.afx = new_armor_context ();
+    /* With --jobs the keys are generated in batched mode.  */
+    outctrl.batch.active = opt.jobs > 1;
 
     if( !fname || !*fname)
       fname = "-";
@@ -4294,8 +4457,10 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
 	    trim_trailing_ws( value, strlen(value) );
 	    if( !ascii_strcasecmp( keyword, "%echo" ) )
 		log_info("%s\n", value );
-	    else if( !ascii_strcasecmp( keyword, "%dry-run" ) )
+	    else if( !ascii_strcasecmp( keyword, "%dry-run" ) ) {
+		batch_generate (ctrl, &outctrl);
 		outctrl.dryrun = 1;
+	    }
 	    else if( !ascii_strcasecmp( keyword, "%ask-passphrase" ) )
               ; /* Dummy for backward compatibility. */
 	    else if( !ascii_strcasecmp( keyword, "%no-ask-passphrase" ) )
@@ -4309,6 +4474,8 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
 		if (proc_parameter_file (ctrl, para, fname, &outctrl, 0 ))
                   print_status_key_not_created
                     (get_parameter_value (para, pHANDLE));
+		else if (outctrl.batch.active)
+		  para = NULL;  /* Queued.  */
 		release_parameter_list( para );
 		para = NULL;
 	    }
@@ -4316,6 +4483,7 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
 		if( outctrl.pub.fname && !strcmp( outctrl.pub.fname, value ) )
 		    ; /* still the same file - ignore it */
 		else {
+		    batch_generate (ctrl, &outctrl);
 		    xfree( outctrl.pub.newfname );
 		    outctrl.pub.newfname = xstrdup( value );
 		    outctrl.use_files = 1;
@@ -4365,6 +4533,8 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
 	    if (proc_parameter_file (ctrl, para, fname, &outctrl, 0 ))
               print_status_key_not_created
                 (get_parameter_value (para, pHANDLE));
+	    else if (outctrl.batch.active)
+	      para = NULL;  /* Queued.  */
 	    release_parameter_list( para );
 	    para = NULL;
 	}
@@ -4401,7 +4571,11 @@ read_parameter_file (ctrl_t ctrl, const char *fname )
 	outctrl.lnr = lnr;
 	if (proc_parameter_file (ctrl, para, fname, &outctrl, 0 ))
           print_status_key_not_created (get_parameter_value (para, pHANDLE));
+	else if (outctrl.batch.active)
+	  para = NULL;  /* Queued.  */
     }
+    batch_generate (ctrl, &outctrl);
+    xfree (outctrl.batch.blocks);
 
     if( outctrl.use_files ) { /* close open streams */
 	iobuf_close( outctrl.pub.stream );
@@ -5367,7 +5541,8 @@ do_generate_keypair (ctrl_t ctrl, struct para_data_s *para,
                      expire, 0,
                      keygen_flags,
                      get_parameter_passphrase (para),
-                     &cache_nonce, NULL);
+                     &cache_nonce, NULL,
+                     outctrl->pregen? &outctrl->pregen->genkey[0] : NULL);
   else
     err = gen_card_key (1, algo,
                         1, pub_root, &keytimestamp,
@@ -5445,7 +5620,8 @@ do_generate_keypair (ctrl_t ctrl, struct para_data_s *para,
                            get_parameter_u32 (para, pSUBKEYEXPIRE), 1,
                            s? KEYGEN_FLAG_NO_PROTECTION : keygen_flags,
                            get_parameter_passphrase (para),
-                           &cache_nonce, NULL);
+                           &cache_nonce, NULL,
+                           outctrl->pregen? &outctrl->pregen->genkey[1]:NULL);
           /* Get the pointer to the generated public subkey packet.  */
           if (!err)
             {
@@ -5851,7 +6027,7 @@ generate_subkeypair (ctrl_t ctrl, kbnode_t keyblock, const char *algostr,
 
       err = do_create (algo, nbits, curve,
                        keyblock, cur_time, expire, 1, keygen_flags,
-                       passwd, &cache_nonce, &passwd_nonce);
+                       passwd, &cache_nonce, &passwd_nonce, NULL);
     }
   if (err)
     goto leave;
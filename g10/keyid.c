@@ -966,13 +966,20 @@ format_hexfingerprint (const char *fingerprint, char *buffer, size_t buflen)
 
 /* Return the so called KEYGRIP which is the SHA-1 hash of the public
    key parameters expressed as an canonical encoded S-Exp.  ARRAY must
-   be 20 bytes long.  Returns 0 on success or an error code.  */
+   be 20 bytes long.  Returns 0 on success or an error code.  The
+   keygrip is cached in PK.  */
 gpg_error_t
 keygrip_from_pk (PKT_public_key *pk, unsigned char *array)
 {
   gpg_error_t err;
   gcry_sexp_t s_pkey;
 
+  if (pk->flags.keygrip_valid)
+    {
+      memcpy (array, pk->keygrip, KEYGRIP_LEN);
+      return 0;
+    }
+
   if (DBG_PACKET)
     log_debug ("get_keygrip for public key\n");
 
@@ -1045,7 +1052,8 @@ keygrip_from_pk (PKT_public_key *pk, unsigned char *array)
     {
       if (DBG_PACKET)
         log_printhex (array, 20, "keygrip=");
-      /* FIXME: Save the keygrip in PK.  */
+      memcpy (pk->keygrip, array, KEYGRIP_LEN);
+      pk->flags.keygrip_valid = 1;
     }
   gcry_sexp_release (s_pkey);
 
@@ -44,6 +44,7 @@
 #include "../common/mbox-util.h"
 #include "../common/zb32.h"
 #include "tofu.h"
+#include "objcache.h"
 #include "../common/compliance.h"
 #include "../common/pkscreening.h"
 
@@ -62,6 +63,9 @@ struct keylist_context
   int no_key;      /* Counter used if CHECK_SIGS is set.  */
   int oth_err;     /* Counter used if CHECK_SIGS is set.  */
   int no_validity; /* Do not show validity.  */
+  /* The availability of the secret keys of the current keyblock or
+   * NULL if not known.  */
+  struct secret_key_rank_s *secret_ranks;
 };
 
 
@@ -78,7 +82,47 @@ static estream_t attrib_fp;
 static void
 keylist_context_release (struct keylist_context *listctx)
 {
-  (void)listctx; /* Nothing to release.  */
+  xfree (listctx->secret_ranks);
+  listctx->secret_ranks = NULL;
+}
+
+
+/* Ask the agent in one go for the secret keys of all keys in
+ * KEYBLOCK and store the result in LISTCTX.  Returns true if any
+ * secret key is available.  */
+static int
+probe_secret_keys (struct keylist_context *listctx, kbnode_t keyblock)
+{
+  xfree (listctx->secret_ranks);
+  if (!agent_probe_secret_keys (NULL, keyblock, &listctx->secret_ranks))
+    return agent_any_secret_key_rank (listctx->secret_ranks);
+
+  /* Probably an old agent.  */
+  return !agent_probe_any_secret_key (NULL, keyblock);
+}
+
+
+/* Return 0 if the secret key of PK with the keygrip HEXGRIP is
+ * available and store the serial number of the card at R_SERIALNO
+ * if it is stored on a card.  This is the same as agent_get_keyinfo
+ * but uses the information from LISTCTX if possible.  */
+static gpg_error_t
+get_secret_keyinfo (struct keylist_context *listctx, PKT_public_key *pk,
+                    const char *hexgrip, char **r_serialno)
+{
+  switch (agent_secret_key_rank (listctx->secret_ranks, pk))
+    {
+    case 0:
+      *r_serialno = NULL;
+      return gpg_error (GPG_ERR_NO_SECKEY);
+    case 1:
+    case 3:
+      *r_serialno = NULL;
+      return 0;  /* Not a card key.  */
+    default:
+      /* Unknown or we need the serial number.  */
+      return agent_get_keyinfo (NULL, hexgrip, r_serialno, NULL);
+    }
 }
 
 
@@ -507,6 +551,11 @@ print_signature_stats (struct keylist_context *s)
 }
 
 
+/* The number of keyblocks read ahead by list_all.  Their
+ * self-signatures are verified in parallel before they are listed.  */
+#define LIST_BATCH_SIZE 64
+
+
 /* List all keys.  If SECRET is true only secret keys are listed.  If
    MARK_SECRET is true secret keys are indicated in a public key
    listing.  */
@@ -515,7 +564,11 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
 {
   KEYDB_HANDLE hd;
   KBNODE keyblock = NULL;
+  kbnode_t batch[LIST_BATCH_SIZE];
+  const char *resnames[LIST_BATCH_SIZE];
+  unsigned int nbatch, i;
   int rc = 0;
+  int failed = 0;
   int any_secret;
   const char *lastresname, *resname;
   struct keylist_context listctx;
@@ -539,50 +592,80 @@ list_all (ctrl_t ctrl, int secret, int mark_secret)
   lastresname = NULL;
   do
     {
-      if (secret)
-        glo_ctrl.silence_parse_warnings++;
-      rc = keydb_get_keyblock (hd, &keyblock);
-      if (secret)
-        glo_ctrl.silence_parse_warnings--;
-      if (rc)
-	{
-          if (gpg_err_code (rc) == GPG_ERR_LEGACY_KEY)
-            continue;  /* Skip legacy keys.  */
-	  log_error ("keydb_get_keyblock failed: %s\n", gpg_strerror (rc));
-	  goto leave;
-	}
+      /* Read a batch of keyblocks.  */
+      nbatch = 0;
+      do
+        {
+          if (secret)
+            glo_ctrl.silence_parse_warnings++;
+          rc = keydb_get_keyblock (hd, &keyblock);
+          if (secret)
+            glo_ctrl.silence_parse_warnings--;
+          if (rc)
+            {
+              if (gpg_err_code (rc) == GPG_ERR_LEGACY_KEY)
+                continue;  /* Skip legacy keys.  */
+              log_error ("keydb_get_keyblock failed: %s\n",
+                         gpg_strerror (rc));
+              failed = 1;
+              break;
+            }
+          resnames[nbatch] = keydb_get_resource_name (hd);
+          batch[nbatch++] = keyblock;
+          keyblock = NULL;
+        }
+      while (nbatch < LIST_BATCH_SIZE && !(rc = keydb_search_next (hd)));
 
-      if (secret || mark_secret)
-        any_secret = !agent_probe_any_secret_key (NULL, keyblock);
-      else
-        any_secret = 0;
+      /* The workers verify the self-signatures of the entire batch
+       * while the keyblocks are still listed in keyring order by
+       * this thread.  In a secret key listing most keyblocks are
+       * skipped and thus we don't do this.  */
+      if (!secret)
+        precheck_keyblock_signatures (ctrl, batch, nbatch);
 
-      if (secret && !any_secret)
-        ; /* Secret key listing requested but this isn't one.  */
-      else
+      for (i=0; i < nbatch; i++)
         {
-          if (!opt.with_colons && !(opt.list_options & LIST_SHOW_ONLY_FPR_MBOX))
+          keyblock = batch[i];
+          batch[i] = NULL;
+
+          if (secret || mark_secret)
+            any_secret = probe_secret_keys (&listctx, keyblock);
+          else
+            any_secret = 0;
+
+          if (secret && !any_secret)
+            ; /* Secret key listing requested but this isn't one.  */
+          else
             {
-              resname = keydb_get_resource_name (hd);
-              if (lastresname != resname)
+              if (!opt.with_colons
+                  && !(opt.list_options & LIST_SHOW_ONLY_FPR_MBOX))
                 {
-                  int i;
+                  resname = resnames[i];
+                  if (lastresname != resname)
+                    {
+                      int n;
 
-                  es_fprintf (es_stdout, "%s\n", resname);
-                  for (i = strlen (resname); i; i--)
-                    es_putc ('-', es_stdout);
-                  es_putc ('\n', es_stdout);
-                  lastresname = resname;
+                      es_fprintf (es_stdout, "%s\n", resname);
+                      for (n = strlen (resname); n; n--)
+                        es_putc ('-', es_stdout);
+                      es_putc ('\n', es_stdout);
+                      lastresname = resname;
+                    }
                 }
+              merge_keys_and_selfsig (ctrl, keyblock);
+              /* Feed the user id cache so that it can be used to print
+               * signatures by this key without another lookup.  */
+              cache_put_keyblock (keyblock);
+              list_keyblock (ctrl, keyblock, secret, any_secret,
+                             opt.fingerprint, &listctx);
             }
-          merge_keys_and_selfsig (ctrl, keyblock);
-          list_keyblock (ctrl, keyblock, secret, any_secret, opt.fingerprint,
-                         &listctx);
+          release_kbnode (keyblock);
+          keyblock = NULL;
         }
-      release_kbnode (keyblock);
-      keyblock = NULL;
+      if (failed)
+        goto leave;
     }
-  while (!(rc = keydb_search_next (hd)));
+  while (!rc && !(rc = keydb_search_next (hd)));
   es_fflush (es_stdout);
   if (rc && gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
     log_error ("keydb_search_next failed: %s\n", gpg_strerror (rc));
@@ -643,9 +726,12 @@ list_one (ctrl_t ctrl, strlist_t names, int secret, int mark_secret)
        * MARK_SECRET set (ie. option --with-secret) we have to test
        * for a secret key, though.  */
       if (secret)
-        any_secret = 1;
+        {
+          probe_secret_keys (&listctx, keyblock);
+          any_secret = 1;
+        }
       else if (mark_secret)
-        any_secret = !agent_probe_any_secret_key (NULL, keyblock);
+        any_secret = probe_secret_keys (&listctx, keyblock);
       else
         any_secret = 0;
 
@@ -971,7 +1057,7 @@ list_keyblock_print (ctrl_t ctrl, kbnode_t keyblock, int secret, int fpr,
   if (secret)
     {
       /* Encode some info about the secret key in SECRET.  */
-      if (!agent_get_keyinfo (NULL, hexgrip, &serialno, NULL))
+      if (!get_secret_keyinfo (listctx, pk, hexgrip, &serialno))
         secret = serialno? 3 : 1;
       else
         secret = 2;  /* Key not found.  */
@@ -1121,7 +1207,7 @@ list_keyblock_print (ctrl_t ctrl, kbnode_t keyblock, int secret, int fpr,
             }
           if (secret)
             {
-              if (!agent_get_keyinfo (NULL, hexgrip, &serialno, NULL))
+              if (!get_secret_keyinfo (listctx, pk2, hexgrip, &serialno))
                 secret = serialno? 3 : 1;
               else
                 secret = 2;  /* Key not found.  */
@@ -1405,10 +1491,12 @@ print_compliance_flags (PKT_public_key *pk,
 
 /* List a key in colon mode.  If SECRET is true this is a secret key
    record (i.e. requested via --list-secret-key).  If HAS_SECRET a
-   secret key is available even if SECRET is not set.  */
+   secret key is available even if SECRET is not set.  LISTCTX may
+   provide the availability of the secret keys.  */
 static void
 list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
-                     int secret, int has_secret)
+                     int secret, int has_secret,
+                     struct keylist_context *listctx)
 {
   int rc;
   KBNODE kbctx;
@@ -1450,7 +1538,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
     }
   stubkey = 0;
   if ((secret || has_secret)
-      && agent_get_keyinfo (NULL, hexgrip, &serialno, NULL))
+      && get_secret_keyinfo (listctx, pk, hexgrip, &serialno))
     stubkey = 1;  /* Key not found.  */
 
   keyid_from_pk (pk, keyid);
@@ -1616,7 +1704,7 @@ list_keyblock_colon (ctrl_t ctrl, kbnode_t keyblock,
             }
           stubkey = 0;
           if ((secret||has_secret)
-              && agent_get_keyinfo (NULL, hexgrip, &serialno, NULL))
+              && get_secret_keyinfo (listctx, pk2, hexgrip, &serialno))
             stubkey = 1;  /* Key not found.  */
 
 	  keyid_from_pk (pk2, keyid2);
@@ -1897,8 +1985,11 @@ list_keyblock (ctrl_t ctrl,
 {
   reorder_keyblock (keyblock);
 
+  if (opt.check_sigs)
+    precheck_key_signatures (ctrl, keyblock);
+
   if (opt.with_colons)
-    list_keyblock_colon (ctrl, keyblock, secret, has_secret);
+    list_keyblock_colon (ctrl, keyblock, secret, has_secret, listctx);
   else if ((opt.list_options & LIST_SHOW_ONLY_FPR_MBOX))
     {
       if (!listctx->no_validity)
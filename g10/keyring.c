@@ -35,6 +35,7 @@
 #include "options.h"
 #include "main.h" /*for check_key_signature()*/
 #include "../common/i18n.h"
+#include "../common/host2net.h"
 #include "../kbx/keybox.h"
 
 
@@ -177,6 +178,390 @@ key_present_hash_update_from_kb (key_present_hash_t tbl, KBNODE node)
     }
 }
 
+/* An index file may be stored next to a keyring file with the suffix
+ * ".idx" appended.  It maps the keyids of all keys and subkeys to the
+ * offsets of their keyblocks and allows keyring_search to visit only
+ * those keyblocks for keyid and fingerprint searches.  The candidate
+ * keyblocks are checked using the regular search predicates.  The
+ * index records the size, mtime and inode of the keyring file it
+ * describes and is ignored if they do not match.  It is written by a
+ * search which had to scan the entire keyring.
+ *
+ * All integers are stored in network byte order.
+ *
+ * - b4   Magic 'KRGi'
+ * - byte Version number (1)
+ * - b3   RFU
+ * - u32  Number of entries
+ * - u32  RFU
+ * - u64  Size of the keyring file
+ * - u64  Modification time of the keyring file
+ * - u64  Inode number of the keyring file
+ * - NENTRIES times, sorted in ascending order:
+ *   - b8   The keyid with the low 32 bits stored first so that a
+ *          short keyid is a prefix of the long keyid.
+ *   - u64  Offset of the keyblock in the keyring file.
+ */
+#define KRIDX_MAGIC    "KRGi"
+#define KRIDX_VERSION  1
+#define KRIDX_HDRLEN   40
+#define KRIDX_ENTRYLEN 16
+
+/* Keyring files of at least this size get an index.  */
+#define KRIDX_MIN_KEYRING_SIZE (1024*1024)
+
+/* The entries collected for a new index while scanning a keyring.  */
+struct kridx_builder_s
+{
+  int active;             /* Entries are being collected.  */
+  struct stat st;         /* The keyring file being scanned.  */
+  size_t nentries;
+  size_t allocated;
+  unsigned char *entries;
+};
+
+
+static void
+kridx_put_u64 (unsigned char *p, uint64_t val)
+{
+  ulongtobuf (p,   (u32)(val >> 32));
+  ulongtobuf (p+4, (u32)val);
+}
+
+static uint64_t
+kridx_get_u64 (const unsigned char *p)
+{
+  return (((uint64_t)buf32_to_u32 (p)) << 32) | buf32_to_u32 (p+4);
+}
+
+
+/* Fill the 24 byte buffer HDR with the identification of the keyring
+ * file described by ST.  */
+static void
+kridx_stat_to_hdr (unsigned char *hdr, struct stat *st)
+{
+  kridx_put_u64 (hdr,    (uint64_t)st->st_size);
+  kridx_put_u64 (hdr+8,  (uint64_t)st->st_mtime);
+  kridx_put_u64 (hdr+16, (uint64_t)st->st_ino);
+}
+
+
+/* Open the index of the keyring FNAME described by ST and return the
+ * number of entries at R_NENTRIES.  Returns NULL if there is no index
+ * or if it does not match the keyring file.  */
+static FILE *
+kridx_open (const char *fname, struct stat *st, size_t *r_nentries)
+{
+  char *idxfname;
+  FILE *fp;
+  unsigned char hdr[KRIDX_HDRLEN];
+  unsigned char tmp[24];
+
+  idxfname = strconcat (fname, EXTSEP_S "idx", NULL);
+  if (!idxfname)
+    return NULL;
+  fp = fopen (idxfname, "rb");
+  xfree (idxfname);
+  if (!fp)
+    return NULL;
+
+  kridx_stat_to_hdr (tmp, st);
+  if (fread (hdr, KRIDX_HDRLEN, 1, fp) != 1
+      || memcmp (hdr, KRIDX_MAGIC, 4)
+      || hdr[4] != KRIDX_VERSION
+      || memcmp (hdr+16, tmp, 24))
+    {
+      fclose (fp);
+      return NULL;
+    }
+  *r_nentries = buf32_to_size_t (hdr+8);
+  return fp;
+}
+
+
+/* Append to the array at R_OFFSETS the offsets of all entries of the
+ * index FP with NENTRIES entries whose keyid starts with the
+ * PREFIXLEN bytes at PREFIX.  */
+static gpg_error_t
+kridx_lookup (FILE *fp, size_t nentries,
+              const unsigned char *prefix, size_t prefixlen,
+              off_t **r_offsets, size_t *r_count, size_t *r_alloced)
+{
+  unsigned char entry[KRIDX_ENTRYLEN];
+  size_t lo, hi, mid;
+  off_t *tmp;
+
+  /* Find the first entry not less than PREFIX.  */
+  lo = 0;
+  hi = nentries;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (fseeko (fp, KRIDX_HDRLEN + (off_t)mid * KRIDX_ENTRYLEN, SEEK_SET)
+          || fread (entry, KRIDX_ENTRYLEN, 1, fp) != 1)
+        return gpg_error (GPG_ERR_INV_KEYRING);
+      if (memcmp (entry, prefix, prefixlen) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (lo >= nentries
+      || fseeko (fp, KRIDX_HDRLEN + (off_t)lo * KRIDX_ENTRYLEN, SEEK_SET))
+    return 0;
+  for (; lo < nentries; lo++)
+    {
+      if (fread (entry, KRIDX_ENTRYLEN, 1, fp) != 1)
+        return gpg_error (GPG_ERR_INV_KEYRING);
+      if (memcmp (entry, prefix, prefixlen))
+        break;
+      if (*r_count == *r_alloced)
+        {
+          *r_alloced = *r_alloced? 2 * *r_alloced : 16;
+          tmp = xtryrealloc (*r_offsets, *r_alloced * sizeof *tmp);
+          if (!tmp)
+            return gpg_error_from_syserror ();
+          *r_offsets = tmp;
+        }
+      (*r_offsets)[(*r_count)++] = kridx_get_u64 (entry + 8);
+    }
+  return 0;
+}
+
+
+static int
+kridx_compare_offsets (const void *a, const void *b)
+{
+  off_t x = *(const off_t *)a;
+  off_t y = *(const off_t *)b;
+
+  return x < y? -1 : x > y;
+}
+
+
+/* Look up the keyblocks matching the NDESC search descriptions DESC in
+ * the index of the keyring FNAME opened at IOBUF.  On success an
+ * ascending array of keyblock offsets is stored at R_OFFSETS and its
+ * length at R_COUNT.  Returns an error if no index is available or if
+ * it can't be used for DESC.  */
+static gpg_error_t
+kridx_search (const char *fname, iobuf_t iobuf,
+              KEYDB_SEARCH_DESC *desc, size_t ndesc,
+              off_t **r_offsets, size_t *r_count)
+{
+  gpg_error_t err = 0;
+  struct stat st;
+  FILE *fp;
+  size_t nentries, n, i, j, alloced;
+  unsigned char prefix[8];
+  size_t prefixlen;
+
+  *r_offsets = NULL;
+  *r_count = 0;
+
+  if (!ndesc)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  for (n=0; n < ndesc; n++)
+    if (!(desc[n].mode == KEYDB_SEARCH_MODE_SHORT_KID
+          || desc[n].mode == KEYDB_SEARCH_MODE_LONG_KID
+          || (desc[n].mode == KEYDB_SEARCH_MODE_FPR
+              && (desc[n].fprlen == 20 || desc[n].fprlen == 32))))
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  if (fstat (iobuf_get_fd (iobuf), &st))
+    return gpg_error_from_syserror ();
+  fp = kridx_open (fname, &st, &nentries);
+  if (!fp)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+
+  alloced = 0;
+  for (n=0; n < ndesc && !err; n++)
+    {
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_SHORT_KID:
+          ulongtobuf (prefix, desc[n].u.kid[1]);
+          prefixlen = 4;
+          break;
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          ulongtobuf (prefix, desc[n].u.kid[1]);
+          ulongtobuf (prefix+4, desc[n].u.kid[0]);
+          prefixlen = 8;
+          break;
+        default: /* KEYDB_SEARCH_MODE_FPR */
+          if (desc[n].fprlen == 20)
+            {
+              memcpy (prefix, desc[n].u.fpr + 16, 4);
+              memcpy (prefix+4, desc[n].u.fpr + 12, 4);
+            }
+          else
+            {
+              memcpy (prefix, desc[n].u.fpr + 4, 4);
+              memcpy (prefix+4, desc[n].u.fpr, 4);
+            }
+          prefixlen = 8;
+          break;
+        }
+      err = kridx_lookup (fp, nentries, prefix, prefixlen,
+                          r_offsets, r_count, &alloced);
+    }
+  fclose (fp);
+  if (err)
+    {
+      xfree (*r_offsets);
+      *r_offsets = NULL;
+      *r_count = 0;
+      return err;
+    }
+
+  /* Sort the offsets and remove duplicates.  */
+  if (*r_count > 1)
+    {
+      qsort (*r_offsets, *r_count, sizeof **r_offsets, kridx_compare_offsets);
+      for (i=j=1; i < *r_count; i++)
+        if ((*r_offsets)[i] != (*r_offsets)[j-1])
+          (*r_offsets)[j++] = (*r_offsets)[i];
+      *r_count = j;
+    }
+  return 0;
+}
+
+
+/* Prepare BUILDER for collecting the entries of a new index while the
+ * keyring FNAME opened at IOBUF is scanned.  This is only done for
+ * large keyrings or if an index already exists.  */
+static void
+kridx_builder_init (struct kridx_builder_s *builder,
+                    const char *fname, iobuf_t iobuf)
+{
+  char *idxfname;
+
+  memset (builder, 0, sizeof *builder);
+  if (fstat (iobuf_get_fd (iobuf), &builder->st))
+    return;
+  if (builder->st.st_size < KRIDX_MIN_KEYRING_SIZE)
+    {
+      idxfname = strconcat (fname, EXTSEP_S "idx", NULL);
+      if (!idxfname || access (idxfname, F_OK))
+        {
+          xfree (idxfname);
+          return;
+        }
+      xfree (idxfname);
+    }
+  builder->active = 1;
+}
+
+
+/* Add the key KID of the keyblock at OFFSET to BUILDER.  */
+static void
+kridx_builder_add (struct kridx_builder_s *builder, u32 *kid, off_t offset)
+{
+  unsigned char *tmp, *p;
+
+  if (!builder->active)
+    return;
+  if (builder->nentries == builder->allocated)
+    {
+      builder->allocated = builder->allocated? 2 * builder->allocated : 1024;
+      tmp = xtryrealloc (builder->entries,
+                         builder->allocated * KRIDX_ENTRYLEN);
+      if (!tmp)
+        {
+          builder->active = 0;
+          return;
+        }
+      builder->entries = tmp;
+    }
+  p = builder->entries + builder->nentries++ * KRIDX_ENTRYLEN;
+  ulongtobuf (p, kid[1]);
+  ulongtobuf (p+4, kid[0]);
+  kridx_put_u64 (p+8, (uint64_t)offset);
+}
+
+
+static int
+kridx_compare_entries (const void *a, const void *b)
+{
+  return memcmp (a, b, KRIDX_ENTRYLEN);
+}
+
+
+/* Write the entries collected by BUILDER as index of the keyring
+ * FNAME.  Errors are not fatal because the index is only a hint.  */
+static void
+kridx_builder_store (struct kridx_builder_s *builder, const char *fname)
+{
+  gpg_error_t err;
+  unsigned char hdr[KRIDX_HDRLEN];
+  char *idxfname, *tmpfname;
+  FILE *fp;
+
+  if (!builder->active)
+    return;
+
+  idxfname = strconcat (fname, EXTSEP_S "idx", NULL);
+  tmpfname = idxfname? strconcat (idxfname, EXTSEP_S "tmp", NULL) : NULL;
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  if (builder->nentries)
+    qsort (builder->entries, builder->nentries, KRIDX_ENTRYLEN,
+           kridx_compare_entries);
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, KRIDX_MAGIC, 4);
+  hdr[4] = KRIDX_VERSION;
+  ulongtobuf (hdr+8, builder->nentries);
+  kridx_stat_to_hdr (hdr+16, &builder->st);
+
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fwrite (hdr, KRIDX_HDRLEN, 1, fp) != 1
+      || (builder->nentries
+          && fwrite (builder->entries, KRIDX_ENTRYLEN, builder->nentries, fp)
+          != builder->nentries))
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  err = gnupg_rename_file (tmpfname, idxfname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+
+ leave:
+  if (err && DBG_LOOKUP)
+    log_debug ("%s: error writing index for '%s': %s\n",
+               __func__, fname, gpg_strerror (err));
+  xfree (tmpfname);
+  xfree (idxfname);
+}
+
+
+static void
+kridx_builder_release (struct kridx_builder_s *builder)
+{
+  xfree (builder->entries);
+  builder->entries = NULL;
+  builder->active = 0;
+}
+
+
 /*
  * Register a filename for plain keyring files.  ptr is set to a
  * pointer to be used to create a handles etc, or the already-issued
@@ -976,6 +1361,12 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   PKT_user_id *uid = NULL;
   PKT_public_key *pk = NULL;
   u32 aki[2];
+  int use_index = 0;
+  int idx_next = 0;
+  off_t *idx_offsets = NULL;
+  size_t idx_count = 0;
+  size_t idx_pos = 0;
+  struct kridx_builder_s builder;
 
   /* figure out what information we need */
   need_uid = need_words = need_keyid = need_fpr = any_skip = 0;
@@ -1095,6 +1486,29 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   pk_no = uid_no = 0;
   initial_skip = 1; /* skip until we see the start of a keyblock */
   scanned_from_start = iobuf_tell (hd->current.iobuf) == 0;
+  memset (&builder, 0, sizeof builder);
+  if (scanned_from_start)
+    {
+      /* A search for keyids or fingerprints from the start may visit
+       * only the keyblocks listed in the index.  Otherwise we
+       * collect the entries for a new index while scanning.  */
+      if (!kridx_search (hd->current.kr->fname, hd->current.iobuf,
+                         desc, ndesc, &idx_offsets, &idx_count))
+        {
+          if (DBG_LOOKUP)
+            log_debug ("%s: index yields %zu candidates\n",
+                       __func__, idx_count);
+          use_index = idx_next = 1;
+          scanned_from_start = 0;
+        }
+      else
+        {
+          kridx_builder_init (&builder, hd->current.kr->fname,
+                              hd->current.iobuf);
+          if (builder.active)
+            need_keyid = 1;
+        }
+    }
   if (DBG_LOOKUP)
     log_debug ("%s: %ssearching from start of resource.\n",
                __func__, scanned_from_start ? "" : "not ");
@@ -1104,9 +1518,32 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       byte afp[MAX_FINGERPRINT_LEN];
       size_t an;
 
+      if (idx_next)
+        {
+          /* Continue with the next candidate keyblock.  */
+          idx_next = 0;
+          if (idx_pos >= idx_count)
+            {
+              rc = -1;
+              break;
+            }
+          if (iobuf_seek (hd->current.iobuf, idx_offsets[idx_pos]))
+            {
+              log_error ("can't seek '%s'\n", hd->current.kr->fname);
+              rc = gpg_error (GPG_ERR_KEYRING_OPEN);
+              break;
+            }
+          idx_pos++;
+          deinit_parse_packet (&parsectx);
+          init_parse_packet (&parsectx, hd->current.iobuf);
+        }
+
       rc = search_packet (&parsectx, &pkt, &offset, need_uid);
       if (ignore_legacy && gpg_err_code (rc) == GPG_ERR_LEGACY_KEY)
         {
+          /* Legacy keys are not indexed and thus an index would not
+           * find them with IGNORE_LEGACY not set.  */
+          kridx_builder_release (&builder);
           free_packet (&pkt, &parsectx);
           continue;
         }
@@ -1115,6 +1552,13 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 
       if (pkt.pkttype == PKT_PUBLIC_KEY  || pkt.pkttype == PKT_SECRET_KEY)
         {
+          if (use_index && offset != idx_offsets[idx_pos-1])
+            {
+              /* The candidate keyblock did not match.  */
+              free_packet (&pkt, &parsectx);
+              idx_next = 1;
+              continue;
+            }
           main_offset = offset;
           pk_no = uid_no = 0;
           initial_skip = 0;
@@ -1143,6 +1587,7 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
             }
           if (need_keyid)
             keyid_from_pk (pk, aki);
+          kridx_builder_add (&builder, aki, main_offset);
 
           if (use_key_present_hash
               && !key_present_hash_ready
@@ -1245,6 +1690,7 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
         log_debug ("%s: no matches (EOF)\n", __func__);
 
       hd->current.eof = 1;
+      kridx_builder_store (&builder, hd->current.kr->fname);
       /* if we scanned all keyrings, we are sure that
        * all known key IDs are in our offtbl, mark that. */
       if (use_key_present_hash
@@ -1284,6 +1730,8 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   free_packet (&pkt, &parsectx);
   deinit_parse_packet (&parsectx);
   set_packet_list_mode(save_mode);
+  kridx_builder_release (&builder);
+  xfree (idx_offsets);
   return rc;
 }
 
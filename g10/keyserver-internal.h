@@ -47,6 +47,10 @@ gpg_error_t keyserver_import_pka (ctrl_t ctrl, const char *name,
                                   unsigned char **fpr,size_t *fpr_len);
 gpg_error_t keyserver_import_wkd (ctrl_t ctrl, const char *name, int quick,
                                   unsigned char **fpr, size_t *fpr_len);
+gpg_error_t keyserver_import_wkd_many (ctrl_t ctrl,
+                                       char **mboxes, unsigned int nmboxes,
+                                       unsigned int deadline,
+                                       gpg_error_t *r_errs);
 int keyserver_import_name (ctrl_t ctrl,
                            const char *name,unsigned char **fpr,size_t *fpr_len,
                            struct keyserver_spec *keyserver);
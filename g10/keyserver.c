@@ -823,10 +823,12 @@ search_line_handler (void *opaque, int special, char *line)
       line = NULL;
     }
 
-  /* Print the received line.  */
+  /* Print the received line.  The search result arrives line by
+     line; flush so that a consumer sees it as soon as we do.  */
   if (opt.with_colons && line)
     {
       es_printf ("%s\n", line);
+      es_fflush (es_stdout);
     }
 
   /* Look for an info: line.  The only current info: values defined
@@ -1595,7 +1597,7 @@ keyserver_get_chunk (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
      single request will be rejected only later by gpg_dirmngr_ks_get
      but we are sure that R_NDESC_USED has been updated.  This avoids
      a possible indefinite loop.  */
-  linelen = 17; /* "KS_GET --quick --" */
+  linelen = 28; /* "KS_GET --quick --parallel --" */
   for (npat=npat_fpr=0, idx=0; idx < ndesc; idx++)
     {
       int quiet = 0;
@@ -1780,14 +1782,108 @@ keyserver_get (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
 }
 
 
-/* Send all keys specified by KEYSPECS to the configured keyserver.  */
+/* Export the key specified by KEYSPEC and send it to the keyserver.
+ * KSURL is only used for diagnostics.  If NOINFO is set the "sending
+ * key" info has already been printed.  */
 static gpg_error_t
-keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
+keyserver_put_one (ctrl_t ctrl, const char *keyspec, const char *ksurl,
+                   int noinfo)
+{
+  gpg_error_t err;
+  void *data;
+  size_t datalen;
+  kbnode_t keyblock;
+
+  err = export_pubkey_buffer (ctrl, keyspec,
+                              opt.keyserver_options.export_options,
+                              NULL, 0, NULL,
+                              &keyblock, &data, &datalen);
+  if (err)
+    {
+      log_error (_("skipped \"%s\": %s\n"), keyspec, gpg_strerror (err));
+      return err;
+    }
+
+  if (!opt.quiet && !noinfo)
+    log_info (_("sending key %s to %s\n"),
+              keystr (keyblock->pkt->pkt.public_key->keyid),
+              ksurl?ksurl:"[?]");
+
+  err = gpg_dirmngr_ks_put (ctrl, data, datalen, keyblock);
+  release_kbnode (keyblock);
+  xfree (data);
+  if (err)
+    {
+      write_status_error ("keyserver_send", err);
+      log_error (_("keyserver send failed: %s\n"), gpg_strerror (err));
+    }
+  return err;
+}
+
 
+/* Send the NKEYS keys collected in MB to the keyserver using one
+ * request.  KEYSPECS has the specifications of these keys; they are
+ * used to send the keys one by one if the batch is not accepted.  If
+ * the dirmngr can't send several keys at once R_NOMULTI is set.  */
+static gpg_error_t
+keyserver_put_flush (ctrl_t ctrl, membuf_t *mb, const char **keyspecs,
+                     int nkeys, const char *ksurl, int *r_nomulti)
 {
   gpg_error_t err;
+  void *data;
+  size_t datalen;
+  int i;
+
+  data = get_membuf (mb, &datalen);
+  if (!data)
+    return gpg_error_from_syserror ();
+
+  err = gpg_dirmngr_ks_put_many (ctrl, data, datalen);
+  xfree (data);
+  if (!err)
+    return 0;
+
+  if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+    *r_nomulti = 1;
+  else if (opt.verbose)
+    log_info ("sending %d keys at once failed: %s - sending them singly\n",
+              nkeys, gpg_strerror (err));
+
+  /* Either the keyserver rejected one of the keys or it can't take
+   * several keys.  Send them one by one so that the error is
+   * reported for the offending key only.  */
+  err = 0;
+  for (i=0; i < nkeys; i++)
+    {
+      gpg_error_t err2 = keyserver_put_one (ctrl, keyspecs[i], ksurl, 1);
+      if (err2)
+        err = err2;
+    }
+  return err;
+}
+
+
+/* Maximum number of keys and of bytes sent to an HKP keyserver with
+ * one request.  Due to armoring and URL escaping the request is about
+ * three times the given size.  */
+#define KS_PUT_BATCH_KEYS 100
+#define KS_PUT_BATCH_SIZE (512*1024)
+
+/* Send all keys specified by KEYSPECS to the configured keyserver.
+ * If the dirmngr supports it, several keys are sent with one
+ * request.  */
+static gpg_error_t
+keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
+{
+  gpg_error_t err = 0;
+  gpg_error_t err2;
   strlist_t kspec;
   char *ksurl;
+  membuf_t mb;
+  const char *batchspecs[KS_PUT_BATCH_KEYS];
+  int nbatch = 0;
+  size_t batchsize = 0;
+  int nomulti = 0;
 
   if (!keyspecs)
     return 0;  /* Return success if the list is empty.  */
@@ -1798,40 +1894,79 @@ keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
       return gpg_error (GPG_ERR_NO_KEYSERVER);
     }
 
+  /* A single key is sent the old way.  */
+  if (!keyspecs->next)
+    nomulti = 1;
+
   for (kspec = keyspecs; kspec; kspec = kspec->next)
     {
       void *data;
       size_t datalen;
       kbnode_t keyblock;
 
-      err = export_pubkey_buffer (ctrl, kspec->d,
-                                  opt.keyserver_options.export_options,
-                                  NULL, 0, NULL,
-                                  &keyblock, &data, &datalen);
-      if (err)
-        log_error (_("skipped \"%s\": %s\n"), kspec->d, gpg_strerror (err));
-      else
+      if (nomulti)
         {
-          if (!opt.quiet)
-            log_info (_("sending key %s to %s\n"),
-                      keystr (keyblock->pkt->pkt.public_key->keyid),
-                      ksurl?ksurl:"[?]");
-
-          err = gpg_dirmngr_ks_put (ctrl, data, datalen, keyblock);
-          release_kbnode (keyblock);
-          xfree (data);
-          if (err)
-            {
-              write_status_error ("keyserver_send", err);
-              log_error (_("keyserver send failed: %s\n"), gpg_strerror (err));
-            }
+          err2 = keyserver_put_one (ctrl, kspec->d, ksurl, 0);
+          if (err2)
+            err = err2;
+          continue;
+        }
+
+      err2 = export_pubkey_buffer (ctrl, kspec->d,
+                                   opt.keyserver_options.export_options,
+                                   NULL, 0, NULL,
+                                   &keyblock, &data, &datalen);
+      if (err2)
+        {
+          log_error (_("skipped \"%s\": %s\n"), kspec->d, gpg_strerror (err2));
+          err = err2;
+          continue;
+        }
+
+      if (!opt.quiet)
+        log_info (_("sending key %s to %s\n"),
+                  keystr (keyblock->pkt->pkt.public_key->keyid),
+                  ksurl?ksurl:"[?]");
+      release_kbnode (keyblock);
+
+      if (nbatch && batchsize + datalen > KS_PUT_BATCH_SIZE)
+        {
+          err2 = keyserver_put_flush (ctrl, &mb, batchspecs, nbatch,
+                                      ksurl, &nomulti);
+          if (err2)
+            err = err2;
+          nbatch = 0;
+        }
+      if (!nbatch)
+        {
+          init_membuf (&mb, datalen > 8192? datalen : 8192);
+          batchsize = 0;
+        }
+      put_membuf (&mb, data, datalen);
+      xfree (data);
+      batchspecs[nbatch++] = kspec->d;
+      batchsize += datalen;
+
+      if (nbatch == KS_PUT_BATCH_KEYS)
+        {
+          err2 = keyserver_put_flush (ctrl, &mb, batchspecs, nbatch,
+                                      ksurl, &nomulti);
+          if (err2)
+            err = err2;
+          nbatch = 0;
         }
     }
+  if (nbatch)
+    {
+      err2 = keyserver_put_flush (ctrl, &mb, batchspecs, nbatch,
+                                  ksurl, &nomulti);
+      if (err2)
+        err = err2;
+    }
 
   xfree (ksurl);
 
   return err;
-
 }
 
 
@@ -2021,6 +2156,42 @@ keyserver_import_pka (ctrl_t ctrl, const char *name,
 }
 
 
+/* Import the key KEY received via WKD for the mail address MBOX.
+ * URL is the source of the key or NULL.  FPR and FPR_LEN are passed
+ * to import_keys_es_stream.  */
+static gpg_error_t
+import_wkd_key (ctrl_t ctrl, const char *mbox, estream_t key,
+                const char *url, unsigned char **fpr, size_t *fpr_len)
+{
+  gpg_error_t err;
+  int armor_status = opt.no_armor;
+  import_filter_t save_filt;
+
+  /* Keys returned via WKD are in binary format.  However, we
+   * relax that requirement and allow also for armored data.  */
+  opt.no_armor = 0;
+  save_filt = save_and_clear_import_filter ();
+  if (!save_filt)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      char *filtstr = es_bsprintf ("keep-uid=mbox = %s", mbox);
+      err = filtstr? 0 : gpg_error_from_syserror ();
+      if (!err)
+        err = parse_and_set_import_filter (filtstr);
+      xfree (filtstr);
+      if (!err)
+        err = import_keys_es_stream (ctrl, key, NULL, fpr, fpr_len,
+                                     IMPORT_NO_SECKEY,
+                                     NULL, NULL, KEYORG_WKD, url);
+    }
+
+  restore_import_filter (save_filt);
+  opt.no_armor = armor_status;
+  return err;
+}
+
+
 /* Import a key using the Web Key Directory protocol.  */
 gpg_error_t
 keyserver_import_wkd (ctrl_t ctrl, const char *name, int quick,
@@ -2043,42 +2214,50 @@ keyserver_import_wkd (ctrl_t ctrl, const char *name, int quick,
     }
 
   err = gpg_dirmngr_wkd_get (ctrl, mbox, quick, &key, &url);
-  if (err)
-    ;
-  else if (key)
-    {
-      int armor_status = opt.no_armor;
-      import_filter_t save_filt;
+  if (!err && key)
+    err = import_wkd_key (ctrl, mbox, key, url, fpr, fpr_len);
+  es_fclose (key);
 
-      /* Keys returned via WKD are in binary format.  However, we
-       * relax that requirement and allow also for armored data.  */
-      opt.no_armor = 0;
-      save_filt = save_and_clear_import_filter ();
-      if (!save_filt)
-        err = gpg_error_from_syserror ();
-      else
-        {
-          char *filtstr = es_bsprintf ("keep-uid=mbox = %s", mbox);
-          err = filtstr? 0 : gpg_error_from_syserror ();
-          if (!err)
-            err = parse_and_set_import_filter (filtstr);
-          xfree (filtstr);
-          if (!err)
-            err = import_keys_es_stream (ctrl, key, NULL, fpr, fpr_len,
-                                         IMPORT_NO_SECKEY,
-                                         NULL, NULL, KEYORG_WKD, url);
+  xfree (url);
+  xfree (mbox);
+  return err;
+}
 
-        }
 
-      restore_import_filter (save_filt);
-      opt.no_armor = armor_status;
+/* Import the keys for the NMBOXES mail addresses in MBOXES using the
+ * Web Key Directory protocol.  The lookups are done concurrently by
+ * the dirmngr; no lookup is started after DEADLINE seconds unless
+ * DEADLINE is zero.  The result of each lookup and import is stored
+ * in R_ERRS.  An error is returned only if the lookups could not be
+ * done at all.  */
+gpg_error_t
+keyserver_import_wkd_many (ctrl_t ctrl, char **mboxes, unsigned int nmboxes,
+                           unsigned int deadline, gpg_error_t *r_errs)
+{
+  gpg_error_t err;
+  estream_t *keys;
+  unsigned int idx;
+
+  keys = xtrycalloc (nmboxes, sizeof *keys);
+  if (!keys)
+    return gpg_error_from_syserror ();
 
-      es_fclose (key);
-      key = NULL;
+  err = gpg_dirmngr_wkd_get_many (ctrl, mboxes, nmboxes, deadline,
+                                  keys, r_errs);
+  if (!err)
+    {
+      /* The imports are done one after the other because they need
+       * to change the global import filter.  */
+      for (idx=0; idx < nmboxes; idx++)
+        {
+          if (!r_errs[idx] && keys[idx])
+            r_errs[idx] = import_wkd_key (ctrl, mboxes[idx], keys[idx],
+                                          NULL, NULL, NULL);
+          es_fclose (keys[idx]);
+        }
     }
 
-  xfree (url);
-  xfree (mbox);
+  xfree (keys);
   return err;
 }
 
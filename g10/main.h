@@ -201,6 +201,22 @@ unsigned int pubkey_nbits( int algo, gcry_mpi_t *pkey );
 int mpi_print (estream_t stream, gcry_mpi_t a, int mode);
 unsigned int ecdsa_qbits_from_Q (unsigned int qbits);
 
+/* The worker processes used for a multi-file command.  */
+#define MAX_FILE_JOBS 64
+typedef struct
+{
+  int njobs;      /* Number of workers including the parent.  */
+  int worker;     /* The index of this process; 0 for the parent.  */
+  pid_t pids[MAX_FILE_JOBS];  /* The workers or -1 if not started.  */
+} file_jobs_t;
+
+void file_jobs_start (file_jobs_t *jobs, int nfiles);
+int  file_jobs_mine (file_jobs_t *jobs, int idx);
+int  file_jobs_finish (file_jobs_t *jobs);
+
+
+/*-- benchmark.c --*/
+void run_benchmarks (unsigned int nmib);
 
 /*-- cpr.c --*/
 void set_status_fd ( int fd );
@@ -220,6 +236,9 @@ void write_status_text_and_buffer ( int no, const char *text,
                                     const char *buffer, size_t len, int wrap );
 
 void write_status_begin_signing (gcry_md_hd_t md);
+void write_status_begin_block (void);
+void write_status_end_block (void);
+void write_status_flush (void);
 
 
 int cpr_enabled(void);
@@ -261,6 +280,8 @@ int write_pubkey_enc (ctrl_t ctrl, PKT_public_key *pk, int throw_keyid,
 /*-- sign.c --*/
 int sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 	       int do_encrypt, strlist_t remusr, const char *outfile );
+int sign_file_fd (ctrl_t ctrl, int inp_fd, int out_fd, int detached,
+                  strlist_t locusr);
 int clearsign_file (ctrl_t ctrl,
                     const char *fname, strlist_t locusr, const char *outfile);
 int sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr);
@@ -288,6 +309,23 @@ int check_key_signature2 (ctrl_t ctrl, kbnode_t root, kbnode_t node,
                           PKT_public_key *check_pk, PKT_public_key *ret_pk,
                           int *is_selfsig, u32 *r_expiredate, int *r_expired);
 
+/* Verify the self-signatures of KEYBLOCK in parallel and cache the
+   results in the signature packets.  */
+void precheck_key_signatures (ctrl_t ctrl, kbnode_t keyblock);
+/* Ditto for several keyblocks at once.  */
+void precheck_keyblock_signatures (ctrl_t ctrl, kbnode_t *keyblocks,
+                                   unsigned int nkeyblocks);
+/* Verify the certifications on the user ids of KEYBLOCKS accepted
+   by FILTER in parallel.  */
+void precheck_certifications (ctrl_t ctrl,
+                              kbnode_t *keyblocks, unsigned int nkeyblocks,
+                              int (*filter) (void *opaque, PKT_signature *sig),
+                              void *opaque);
+/* Verify the data signatures SIGS over DIGEST in parallel.  */
+void precheck_data_signatures (ctrl_t ctrl, PKT_signature **sigs,
+                               unsigned int nsigs, gcry_md_hd_t digest,
+                               const void *extrahash, size_t extrahashlen);
+
 /* Returns whether SIGNER generated the signature SIG over the packet
    PACKET, which is a key, subkey or uid, and comes from the key block
    KB.  If SIGNER is NULL, it is looked up based on the information in
@@ -395,7 +433,10 @@ struct impex_filter_parm_s
   char hexfpr[2*MAX_FINGERPRINT_LEN + 1];
 };
 
+int impex_filter_propid (const char *propname);
 const char *impex_filter_getval (void *cookie, const char *propname);
+const char *impex_filter_getval_id (void *cookie, int propid,
+                                    const char *propname);
 gpg_error_t transfer_secret_keys (ctrl_t ctrl, struct import_stats_s *stats,
                                   kbnode_t sec_keyblock, int batch, int force,
                                   int only_marked);
@@ -423,6 +464,8 @@ int exact_subkey_match_p (KEYDB_SEARCH_DESC *desc, kbnode_t node);
 
 int export_pubkeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                     export_stats_t stats);
+int export_pubkeys_fd (ctrl_t ctrl, strlist_t users, unsigned int options,
+                       export_stats_t stats, int out_fd);
 int export_seckeys (ctrl_t ctrl, strlist_t users, unsigned int options,
                     export_stats_t stats);
 int export_secsubkeys (ctrl_t ctrl, strlist_t users, unsigned int options,
@@ -489,7 +532,9 @@ void print_key_line (ctrl_t ctrl, estream_t fp, PKT_public_key *pk, int secret);
 /*-- verify.c --*/
 void print_file_status( int status, const char *name, int what );
 int verify_signatures (ctrl_t ctrl, int nfiles, char **files );
+int verify_signature_files (ctrl_t ctrl, int nfiles, char **files);
 int verify_files (ctrl_t ctrl, int nfiles, char **files );
+int verify_manifest (ctrl_t ctrl);
 int gpg_verify (ctrl_t ctrl, int sig_fd, int data_fd, estream_t out_fp);
 
 /*-- decrypt.c --*/
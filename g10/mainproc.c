@@ -1146,6 +1146,9 @@ do_check_sig (CTX c, kbnode_t node, const void *extrahash, size_t extrahashlen,
   rc = check_signature2 (c->ctrl, sig, md, extrahash, extrahashlen,
                          forced_pk,
                          NULL, is_expkey, is_revkey, r_pk);
+  /* A result of precheck_data_signatures is only valid for the first
+   * check; a later one may use a different key.  */
+  sig->flags.checked = 0;
   if (! rc)
     md_good = md;
   else if (gpg_err_code (rc) == GPG_ERR_BAD_SIGNATURE && md2)
@@ -2550,6 +2553,50 @@ check_sig_and_print (CTX c, kbnode_t node)
 }
 
 
+/* Verify the data signatures following NODE in parallel so that the
+ * subsequent calls to check_sig_and_print only need to look at the
+ * results.  The signatures are still checked and printed in order by
+ * the caller.  */
+static void
+precheck_sigs (CTX c, kbnode_t node)
+{
+  PKT_signature **sigs;
+  const void *extrahash = NULL;
+  size_t extrahashlen = 0;
+  unsigned int nsigs = 0;
+  kbnode_t n;
+
+  if (opt.skip_verify || !c->mfx.md || c->mfx.md2)
+    return;
+
+  for (n = node; n; n = find_next_kbnode (n, PKT_SIGNATURE))
+    if (n->pkt->pkttype == PKT_SIGNATURE)
+      nsigs++;
+  if (nsigs < 2)
+    return;
+  sigs = xtrycalloc (nsigs, sizeof *sigs);
+  if (!sigs)
+    return;
+  nsigs = 0;
+  for (n = node; n; n = find_next_kbnode (n, PKT_SIGNATURE))
+    if (n->pkt->pkttype == PKT_SIGNATURE)
+      sigs[nsigs++] = n->pkt->pkt.signature;
+
+  for (n = c->list; n; n = n->next)
+    if (n->pkt->pkttype == PKT_GPG_CONTROL
+        && n->pkt->pkt.gpg_control->control == CTRLPKT_PLAINTEXT_MARK)
+      {
+        extrahash = n->pkt->pkt.gpg_control->data;
+        extrahashlen = n->pkt->pkt.gpg_control->datalen;
+        break;
+      }
+
+  precheck_data_signatures (c->ctrl, sigs, nsigs, c->mfx.md,
+                            extrahash, extrahashlen);
+  xfree (sigs);
+}
+
+
 /*
  * Process the tree which starts at node
  */
@@ -2640,6 +2687,7 @@ proc_tree (CTX c, kbnode_t node)
           return;
         }
 
+      precheck_sigs (c, node);
       for (n1 = node; (n1 = find_next_kbnode (n1, PKT_SIGNATURE));)
         check_sig_and_print (c, n1);
 
@@ -2659,6 +2707,7 @@ proc_tree (CTX c, kbnode_t node)
           return;
         }
 
+      precheck_sigs (c, node);
       for (n1 = node; (n1 = find_next_kbnode (n1, PKT_SIGNATURE));)
         check_sig_and_print (c, n1);
 
@@ -2787,6 +2836,7 @@ proc_tree (CTX c, kbnode_t node)
 
       if (multiple_ok)
         {
+          precheck_sigs (c, node);
           for (n1 = node; n1; (n1 = find_next_kbnode(n1, PKT_SIGNATURE)))
 	    check_sig_and_print (c, n1);
         }
@@ -28,8 +28,146 @@
 #include "../common/iobuf.h"
 #include "../common/util.h"
 #include "filter.h"
+#include "workpool.h"
 
 
+/* Maximum number of digest algorithms we hash in parallel.  */
+#define MD_PARALLEL_MAX 8
+
+/* Do not bother the workers with less than this number of bytes.  */
+#define MD_PARALLEL_MINLEN 4096
+
+
+/* One digest algorithm hashed by a worker.  */
+struct md_parallel_job_s
+{
+  struct workpool_job_s work;
+  int algo;
+  gcry_md_hd_t md;
+  const byte *buf;
+  size_t len;
+};
+
+/* The per-algorithm contexts used by md_filter in parallel mode.  */
+struct md_parallel_s
+{
+  int njobs;
+  struct md_parallel_job_s jobs[MD_PARALLEL_MAX];
+};
+
+
+/* Worker function for the parallel mode.  */
+static void
+hash_job (void *arg)
+{
+  struct md_parallel_job_s *job = arg;
+
+  gcry_md_write (job->md, job->buf, job->len);
+}
+
+
+/* Hash LEN bytes at BUF with all algorithms of the parallel mode.
+ * The main thread takes care of the first algorithm and the workers
+ * of the others; all of them read from the same buffer.  */
+static void
+parallel_write (struct md_parallel_s *par, const byte *buf, size_t len)
+{
+  int i;
+
+  if (len < MD_PARALLEL_MINLEN)
+    {
+      for (i=0; i < par->njobs; i++)
+        gcry_md_write (par->jobs[i].md, buf, len);
+      return;
+    }
+
+  for (i=1; i < par->njobs; i++)
+    {
+      par->jobs[i].buf = buf;
+      par->jobs[i].len = len;
+      workpool_submit (&par->jobs[i].work);
+    }
+  gcry_md_write (par->jobs[0].md, buf, len);
+  for (i=1; i < par->njobs; i++)
+    workpool_wait (&par->jobs[i].work);
+}
+
+
+/* Release the parallel mode contexts of MFX.  */
+static void
+release_parallel (md_filter_context_t *mfx)
+{
+  int i;
+
+  if (!mfx->parallel)
+    return;
+  for (i=0; i < mfx->parallel->njobs; i++)
+    gcry_md_close (mfx->parallel->jobs[i].md);
+  xfree (mfx->parallel);
+  mfx->parallel = NULL;
+}
+
+
+/* Switch MFX to parallel mode if more than one digest algorithm is
+ * enabled in MFX->MD and we have worker threads.  In this mode each
+ * algorithm is computed by its own context on a separate thread;
+ * MFX->MD is then not updated by md_filter and the caller needs to
+ * use md_filter_get_md to retrieve the context for an algorithm.
+ * This needs to be called after all algorithms have been enabled and
+ * before any data has been hashed.  Note that MFX->MD2 is not
+ * supported by this mode.  */
+void
+md_filter_setup_parallel (md_filter_context_t *mfx)
+{
+  struct md_parallel_s *par;
+  int algo, nalgos;
+
+  if (mfx->parallel || !mfx->md || mfx->md2)
+    return;
+
+  nalgos = 0;
+  for (algo=1; algo < 256; algo++)
+    if (gcry_md_is_enabled (mfx->md, algo))
+      nalgos++;
+  if (nalgos < 2 || nalgos > MD_PARALLEL_MAX || !workpool_init ())
+    return;
+
+  par = xtrycalloc (1, sizeof *par);
+  if (!par)
+    return;  /* Simply use the standard mode.  */
+  mfx->parallel = par;
+  for (algo=1; algo < 256; algo++)
+    if (gcry_md_is_enabled (mfx->md, algo))
+      {
+        struct md_parallel_job_s *job = par->jobs + par->njobs;
+
+        if (gcry_md_open (&job->md, algo, 0))
+          {
+            release_parallel (mfx);
+            return;
+          }
+        job->algo = algo;
+        job->work.fnc = hash_job;
+        job->work.arg = job;
+        par->njobs++;
+      }
+}
+
+
+/* Return the context holding the digest for ALGO.  This is MFX->MD
+ * unless MFX is in parallel mode.  */
+gcry_md_hd_t
+md_filter_get_md (md_filter_context_t *mfx, int algo)
+{
+  int i;
+
+  if (mfx->parallel)
+    for (i=0; i < mfx->parallel->njobs; i++)
+      if (mfx->parallel->jobs[i].algo == algo)
+        return mfx->parallel->jobs[i].md;
+  return mfx->md;
+}
+
 
 /****************
  * This filter is used to collect a message digest
@@ -47,7 +185,9 @@ md_filter( void *opaque, int control,
 	    size = mfx->maxbuf_size;
 	i = iobuf_read( a, buf, size );
 	if( i == -1 ) i = 0;
-	if( i ) {
+	if( i && mfx->parallel )
+	    parallel_write (mfx->parallel, buf, i);
+	else if( i ) {
 	    gcry_md_write(mfx->md, buf, i );
 	    if( mfx->md2 )
 		gcry_md_write(mfx->md2, buf, i );
@@ -67,6 +207,7 @@ free_md_filter_context( md_filter_context_t *mfx )
 {
     gcry_md_close(mfx->md);
     gcry_md_close(mfx->md2);
+    release_parallel (mfx);
     mfx->md = NULL;
     mfx->md2 = NULL;
     mfx->maxbuf_size = 0;
@@ -37,6 +37,9 @@
 #ifdef ENABLE_SELINUX_HACKS
 #include <sys/stat.h>
 #endif
+#ifndef HAVE_W32_SYSTEM
+#include <sys/wait.h>
+#endif
 
 #ifdef HAVE_W32_SYSTEM
 #include <time.h>
@@ -1889,3 +1892,105 @@ additional_weak_digest (const char* digestname)
   weak->next = opt.weak_digests;
   opt.weak_digests = weak;
 }
+
+
+/* Start the worker processes for a command processing NFILES files
+ * as requested by --jobs.  The workers are forked before any file is
+ * processed and thus they do not share any state like open key
+ * databases or an agent connection.  Each process handles the files
+ * for which file_jobs_mine returns true and then calls
+ * file_jobs_finish; this terminates the workers and lets the parent
+ * wait for them.  The parent also processes the files of workers
+ * which could not be started.  */
+void
+file_jobs_start (file_jobs_t *jobs, int nfiles)
+{
+  int i;
+
+  memset (jobs, 0, sizeof *jobs);
+  jobs->njobs = opt.jobs;
+  if (jobs->njobs > nfiles)
+    jobs->njobs = nfiles;
+  if (jobs->njobs > MAX_FILE_JOBS)
+    jobs->njobs = MAX_FILE_JOBS;
+#ifdef HAVE_W32_SYSTEM
+  jobs->njobs = 1;
+#endif
+  if (jobs->njobs < 2)
+    {
+      jobs->njobs = 1;
+      return;
+    }
+
+#ifndef HAVE_W32_SYSTEM
+  es_fflush (es_stdout);
+  es_fflush (es_stderr);
+  jobs->pids[0] = (pid_t)(-1);
+  for (i=1; i < jobs->njobs; i++)
+    {
+      jobs->pids[i] = fork ();
+      if (jobs->pids[i] == (pid_t)(-1))
+        log_error ("error forking worker process: %s\n", strerror (errno));
+      else if (!jobs->pids[i])
+        {
+          jobs->worker = i;
+          return;
+        }
+    }
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
+/* Return true if the file with index IDX is to be processed by this
+ * process.  */
+int
+file_jobs_mine (file_jobs_t *jobs, int idx)
+{
+  int worker = idx % jobs->njobs;
+
+  if (worker == jobs->worker)
+    return 1;
+  return !jobs->worker && jobs->pids[worker] == (pid_t)(-1);
+}
+
+
+/* Finish the processing of the files.  Returns the number of
+ * workers which failed.  A worker which only saw errors like a bad
+ * signature sets g10_errors_seen of the parent.  */
+int
+file_jobs_finish (file_jobs_t *jobs)
+{
+  int nfailed = 0;
+#ifndef HAVE_W32_SYSTEM
+  int i, status;
+
+  if (jobs->njobs < 2)
+    return 0;
+
+  if (jobs->worker)
+    {
+      es_fflush (es_stdout);
+      es_fflush (es_stderr);
+      _exit (log_get_errorcount (0)? 2 : g10_errors_seen? 1 : 0);
+    }
+
+  for (i=1; i < jobs->njobs; i++)
+    {
+      if (jobs->pids[i] == (pid_t)(-1))
+        continue;
+      while (waitpid (jobs->pids[i], &status, 0) == (pid_t)(-1)
+             && errno == EINTR)
+        ;
+      if (WIFEXITED (status) && WEXITSTATUS (status) == 1)
+        g10_errors_seen = 1;  /* E.g. a bad signature.  */
+      else if (!WIFEXITED (status) || WEXITSTATUS (status))
+        {
+          log_inc_errorcount ();
+          nfailed++;
+        }
+    }
+#else
+  (void)jobs;
+#endif /*!HAVE_W32_SYSTEM*/
+  return nfailed;
+}
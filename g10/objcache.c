@@ -38,6 +38,9 @@
 #define NO_OF_KEY_ITEM_BUCKETS    383
 #define MAX_KEY_ITEMS_PER_BUCKET  20
 
+/* The number of keys per user id used to size the uid table.  */
+#define KEYS_PER_UID_ITEM         4
+
 
 /* An object to store a user id.  This describes an item in the linked
  * lists of a bucket in hash table.  The reference count will
@@ -76,9 +79,28 @@ static unsigned int key_table_max;    /* Max. # of items in a bucket.  */
 static unsigned int key_table_added;  /* # of items added.   */
 static unsigned int key_table_dropped;/* # of items dropped.  */
 static key_item_t key_item_attic;     /* List of freed items.  */
+static unsigned int key_table_lookups;/* # of user id lookups.  */
+static unsigned int key_table_hits;   /* # of user ids found.  */
+
+/* The number of buckets requested by objcache_set_size or 0.  */
+static size_t requested_key_buckets;
 
 
 
+/* Size the cache for about NKEYS keys; 0 selects the default.  This
+ * has only an effect if called before the cache is used.  */
+void
+objcache_set_size (unsigned int nkeys)
+{
+  if (key_table || uid_table)
+    return;
+  if (!nkeys)
+    requested_key_buckets = 0;
+  else
+    requested_key_buckets = (nkeys / MAX_KEY_ITEMS_PER_BUCKET) | 1;
+}
+
+
 /* Dump stats.  */
 void
 objcache_dump_stats (void)
@@ -117,6 +139,8 @@ objcache_dump_stats (void)
             count, key_table_added, key_table_dropped,
             empty, minlen > 0? minlen : 0, maxlen,
             key_table_size, key_table_max, attic);
+  log_info ("objcache: lookups=%u hits=%u\n",
+            key_table_lookups, key_table_hits);
 
   count = empty = 0;
   minlen = -1;
@@ -170,14 +194,17 @@ uid_table_hasher (const char *name, unsigned namelen)
 }
 
 
-/* Run time allocation of the uid table.  This allows us to eventually
- * add an option to gpg to control the size.  */
+/* Run time allocation of the uid table.  The size can be changed
+ * using objcache_set_size.  */
 static void
 uid_table_init (void)
 {
   if (uid_table)
     return;
-  uid_table_size = NO_OF_UID_ITEM_BUCKETS;
+  if (requested_key_buckets)
+    uid_table_size = (requested_key_buckets / KEYS_PER_UID_ITEM) | 1;
+  else
+    uid_table_size = NO_OF_UID_ITEM_BUCKETS;
   uid_table_max = MAX_UID_ITEMS_PER_BUCKET;
   uid_table = xcalloc (uid_table_size, sizeof *uid_table);
 }
@@ -310,14 +337,17 @@ key_table_hasher (u32 *keyid)
 }
 
 
-/* Run time allocation of the key table.  This allows us to eventually
- * add an option to gpg to control the size.  */
+/* Run time allocation of the key table.  The size can be changed
+ * using objcache_set_size.  */
 static void
 key_table_init (void)
 {
   if (key_table)
     return;
-  key_table_size = NO_OF_KEY_ITEM_BUCKETS;
+  if (requested_key_buckets)
+    key_table_size = requested_key_buckets;
+  else
+    key_table_size = NO_OF_KEY_ITEM_BUCKETS;
   key_table_max  = MAX_KEY_ITEMS_PER_BUCKET;
   key_table = xcalloc (key_table_size, sizeof *key_table);
 }
@@ -620,6 +650,7 @@ cache_get_uid_bykid (u32 *keyid, unsigned int *r_length)
   if (r_length)
     *r_length = 0;
 
+  key_table_lookups++;
   ki = key_table_get (NULL, keyid);
   if (!ki)
     return NULL; /* Not found or duplicate keyid.  */
@@ -635,6 +666,7 @@ cache_get_uid_bykid (u32 *keyid, unsigned int *r_length)
           if (r_length)
             *r_length = ki->ui->namelen;
           ki->usecount++;
+          key_table_hits++;
         }
     }
 
@@ -659,6 +691,7 @@ cache_get_uid_byfpr (const byte *fpr, size_t fprlen, size_t *r_length)
   if (r_length)
     *r_length = 0;
 
+  key_table_lookups++;
   if (!key_table)
     return NULL;
 
@@ -682,6 +715,7 @@ cache_get_uid_byfpr (const byte *fpr, size_t fprlen, size_t *r_length)
           if (r_length)
             *r_length = ki->ui->namelen;
           ki->usecount++;
+          key_table_hits++;
         }
     }
 
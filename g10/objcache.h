@@ -21,6 +21,7 @@
 #ifndef GNUPG_G10_OBJCACHE_H
 #define GNUPG_G10_OBJCACHE_H
 
+void objcache_set_size (unsigned int nkeys);
 void objcache_dump_stats (void);
 void cache_put_keyblock (kbnode_t keyblock);
 char *cache_get_uid_bykid (u32 *keyid, unsigned int *r_length);
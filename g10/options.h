@@ -49,6 +49,11 @@ struct
   estream_t outfp;  /* Hack, sometimes used in place of outfile.  */
   off_t max_output;
 
+  /* The part of the plaintext written with --decrypt-range.  A
+   * length of 0 means up to the end.  */
+  uint64_t range_offset;
+  uint64_t range_length;
+
   /* If > 0 a hint with the expected number of input data bytes.  This
    * is not necessary an exact number but intended to be used for
    * progress info and to decide on how to allocate buffers.  */
@@ -57,6 +62,9 @@ struct
   /* The AEAD chunk size expressed as a power of 2.  */
   int chunk_size;
 
+  /* The number of worker processes used by the multi-file commands.  */
+  int jobs;
+
   int dry_run;
   int autostart;
   int list_only;
@@ -140,6 +148,7 @@ struct
       TM_ALWAYS, TM_DIRECT, TM_AUTO, TM_TOFU, TM_TOFU_PGP
     } trust_model;
   enum tofu_policy tofu_default_policy;
+  int tofu_journal;     /* Queue TOFU observations in a journal.  */
   int force_ownertrust;
   enum gnupg_compliance_mode compliance;
   enum
@@ -169,6 +178,7 @@ struct
   int exec_disable;
   int exec_path_set;
   unsigned int import_options;
+  unsigned int import_max_sigs; /* Max. non-self-sigs per keyblock.  */
   unsigned int export_options;
   unsigned int list_options;
   unsigned int verify_options;
@@ -223,6 +233,9 @@ struct
   /* If true, let write failures on the status-fd exit the process. */
   int exit_on_status_write_error;
 
+  /* If true, do not flush the status-fd after each line.  */
+  int buffered_status;
+
   /* If > 0, limit the number of card insertion prompts to this
      value. */
   int limit_card_insert_tries;
@@ -235,6 +248,7 @@ struct
     unsigned int require_cross_cert:1;
 
     unsigned int use_embedded_filename:1;
+    unsigned int decrypt_range:1;
     unsigned int utf8_filename:1;
     unsigned int dsa2:1;
     unsigned int allow_weak_digest_algos:1;
@@ -272,6 +286,10 @@ struct
     struct akl *next;
   } *auto_key_locate;
 
+  /* The deadline in seconds for looking up several keys at once via
+   * the auto-key-locate mechanisms or 0 for none.  */
+  unsigned int akl_timeout;
+
   /* The value of --key-origin.  See parse_key_origin().  */
   int key_origin;
   char *key_origin_url;
@@ -369,6 +387,7 @@ EXTERN_UNLESS_MAIN_MODULE int memory_stat_debug_mode;
 #define IMPORT_DRY_RUN                   (1<<12)
 #define IMPORT_DROP_UIDS                 (1<<13)
 #define IMPORT_SELF_SIGS_ONLY            (1<<14)
+#define IMPORT_BULK                      (1<<15)
 
 #define EXPORT_LOCAL_SIGS                (1<<0)
 #define EXPORT_ATTRIBUTES                (1<<1)
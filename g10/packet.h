@@ -227,6 +227,8 @@ typedef struct
     unsigned key_block:1;   /* A key block subpacket is present.  */
     unsigned expired:1;
     unsigned pka_tried:1;   /* Set if we tried to retrieve the PKA record. */
+    unsigned component_ok:1;/* key_check_all_keysigs found the signature
+                               good over the preceding component.  */
   } flags;
   /* The key that allegedly generated this signature.  (Directly
      serialized in v3 sigs; for v4 sigs, this must be explicitly added
@@ -410,6 +412,7 @@ typedef struct
   u32     keyid[2];
   /* Fingerprint of the key.  Only valid if FPRLEN is not 0.  */
   byte    fpr[MAX_FINGERPRINT_LEN];
+  byte    keygrip[KEYGRIP_LEN]; /* Cache for keygrip_from_pk.  */
   prefitem_t *prefs;      /* list of preferences (may be NULL) */
   struct
   {
@@ -429,6 +432,7 @@ typedef struct
     unsigned int backsig:2;       /* 0=none, 1=bad, 2=good.  */
     unsigned int serialno_valid:1;/* SERIALNO below is valid.  */
     unsigned int exact:1;         /* Found via exact (!) search.  */
+    unsigned int keygrip_valid:1; /* KEYGRIP below is valid.  */
   } flags;
   PKT_user_id *user_id;   /* If != NULL: found by that uid. */
   struct revocation_key *revkey;
@@ -451,6 +455,10 @@ typedef struct
      returns 0, then the algorithm is not understood and the PKEY
      contains a single opaque MPI.)  (Serialized.)  */
   gcry_mpi_t  pkey[PUBKEY_MAX_NSKEY]; /* Right, NSKEY elements.  */
+  /* NULL or the public parameters of PKEY as S-expression as used by
+     Libgcrypt.  This is a cache maintained by pk_verify and
+     pk_encrypt; it is not copied by copy_public_key.  */
+  gcry_sexp_t pkey_sexp;
 } PKT_public_key;
 
 /* Evaluates as true if the pk is disabled, and false if it isn't.  If
@@ -883,6 +891,9 @@ struct notation *sig_to_notation(PKT_signature *sig);
 void free_notation(struct notation *notation);
 
 /*-- free-packet.c --*/
+PACKET *alloc_packet (void);
+void release_packet_struct (PACKET *pkt);
+PKT_signature *alloc_signature (void);
 void free_symkey_enc( PKT_symkey_enc *enc );
 void free_pubkey_enc( PKT_pubkey_enc *enc );
 void free_seckey_enc( PKT_signature *enc );
@@ -921,6 +932,9 @@ gpg_error_t check_signature2 (ctrl_t ctrl,
 
 /*-- pubkey-enc.c --*/
 gpg_error_t get_session_key (ctrl_t ctrl, struct pubkey_enc_list *k, DEK *dek);
+void pubkey_enc_prefetch_add (PKT_pubkey_enc *enc);
+void pubkey_enc_prefetch (ctrl_t ctrl);
+void pubkey_enc_prefetch_release (void);
 gpg_error_t get_override_session_key (DEK *dek, const char *string);
 
 /*-- compress.c --*/
@@ -929,6 +943,8 @@ int handle_compressed (ctrl_t ctrl, void *ctx, PKT_compressed *cd,
 
 /*-- encr-data.c --*/
 int decrypt_data (ctrl_t ctrl, void *ctx, PKT_encrypted *ed, DEK *dek );
+gpg_error_t decrypt_data_skip (iobuf_t a, uint64_t nbytes,
+                               uint64_t *r_skipped);
 
 /*-- plaintext.c --*/
 gpg_error_t get_output_file (const byte *embedded_name, int embedded_namelen,
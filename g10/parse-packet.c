@@ -89,6 +89,60 @@ static int parse_mdc (IOBUF inp, int pkttype, unsigned long pktlen,
 static int parse_gpg_control (IOBUF inp, int pkttype, unsigned long pktlen,
 			      PACKET * packet, int partial);
 
+/* Decode the packet header at BUF which has BUFLEN valid bytes.  On
+ * success the packet type and length are stored at R_PKTTYPE and
+ * R_PKTLEN and the length of the header is returned.  Zero is
+ * returned for headers not handled here: if BUF is too short, for
+ * invalid headers and for partial or indeterminate lengths.  The
+ * caller then needs to use the byte-wise code of parse which also
+ * prints the diagnostics.  */
+static int
+decode_packet_header (const byte *buf, int buflen,
+                      int *r_pkttype, unsigned long *r_pktlen)
+{
+  int ctb = buf[0];
+  int lenbytes, i;
+  unsigned long pktlen;
+
+  if (!(ctb & 0x80) || buflen < 2)
+    return 0;
+
+  if ((ctb & 0x40))
+    {
+      *r_pkttype = ctb & 0x3f;
+      if (buf[1] < 192)
+        {
+          *r_pktlen = buf[1];
+          return 2;
+        }
+      if (buf[1] < 224)
+        {
+          if (buflen < 3)
+            return 0;
+          *r_pktlen = (buf[1] - 192) * 256 + buf[2] + 192;
+          return 3;
+        }
+      if (buf[1] == 255 && buflen >= 6)
+        {
+          *r_pktlen = buf32_to_ulong (buf + 2);
+          return 6;
+        }
+      return 0;
+    }
+
+  if ((ctb & 3) == 3)
+    return 0;
+  lenbytes = 1 << (ctb & 3);
+  if (buflen < 1 + lenbytes)
+    return 0;
+  for (pktlen = 0, i = 1; i <= lenbytes; i++)
+    pktlen = (pktlen << 8) | buf[i];
+  *r_pkttype = (ctb >> 2) & 0xf;
+  *r_pktlen = pktlen;
+  return 1 + lenbytes;
+}
+
+
 /* Read a 16-bit value in MSB order (big endian) from an iobuf.  */
 static unsigned short
 read_16 (IOBUF inp)
@@ -159,18 +213,14 @@ mpi_read (iobuf_t inp, unsigned int *ret_nread, int secure)
   p = buf;
   p[0] = c1;
   p[1] = c2;
-  for (i = 0; i < nbytes; i++)
-    {
-      if (nread == nmax)
-	goto overflow;
-
-      c = iobuf_get (inp);
-      if (c == -1)
-	goto leave;
-
-      p[i + 2] = c;
-      nread ++;
-    }
+  /* Read the value in one go; this is much faster than reading it
+     byte by byte for the many signatures of a keyblock.  */
+  i = nbytes < nmax - nread? nbytes : nmax - nread;
+  if (i && iobuf_read (inp, p + 2, i) != i)
+    goto leave;
+  nread += i;
+  if (i < nbytes)
+    goto overflow;
 
   if (gcry_mpi_scan (&a, GCRYMPI_FMT_PGP, buf, nread, &nread))
     a = NULL;
@@ -585,6 +635,19 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
   else
     pos = 0; /* (silence compiler warning) */
 
+  /* Fast path: Peek at the buffered data and decode the entire header
+   * in one go.  A limit set on INP (which also sets NOFAST) is not
+   * honored by iobuf_peek and thus we can't do this in that case.  */
+  if (!inp->nofast
+      && (hdrlen = iobuf_peek (inp, hdr, 6)) > 0
+      && (hdrlen = decode_packet_header (hdr, hdrlen, &pkttype, &pktlen)))
+    {
+      iobuf_read (inp, NULL, hdrlen);
+      ctb = hdr[0];
+      new_ctb = !!(ctb & 0x40);
+      goto header_done;
+    }
+
   /* The first byte of a packet is the so-called tag.  The highest bit
      must be set.  */
   if ((ctb = iobuf_get (inp)) == -1)
@@ -725,6 +788,7 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
 	}
     }
 
+ header_done:
   /* Sometimes the decompressing layer enters an error state in which
      it simply outputs 0xff for every byte read.  If we have a stream
      of 0xff bytes, then it will be detected as a new format packet
@@ -818,7 +882,7 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
       rc = parse_pubkeyenc (inp, pkttype, pktlen, pkt);
       break;
     case PKT_SIGNATURE:
-      pkt->pkt.signature = xmalloc_clear (sizeof *pkt->pkt.signature);
+      pkt->pkt.signature = alloc_signature ();
       rc = parse_signature (inp, pkttype, pktlen, pkt->pkt.signature);
       break;
     case PKT_ONEPASS_SIG:
@@ -1989,6 +2053,52 @@ parse_revkeys (PKT_signature * sig)
 }
 
 
+/* Return a bitmap with bit N set if a subpacket of type N is present
+ * in AREA.  Types above 63 are ignored.  If the area is malformed all
+ * bits are set so that the caller falls back to parse_sig_subpkt.  */
+static uint64_t
+subpkt_type_map (const subpktarea_t *area)
+{
+  const byte *buffer;
+  size_t buflen, n;
+  uint64_t map = 0;
+
+  if (!area)
+    return 0;
+
+  buffer = area->data;
+  buflen = area->len;
+  while (buflen)
+    {
+      n = *buffer++;
+      buflen--;
+      if (n == 255)  /* 4 byte length header.  */
+        {
+          if (buflen < 4)
+            return ~(uint64_t)0;
+          n = buf32_to_size_t (buffer);
+          buffer += 4;
+          buflen -= 4;
+        }
+      else if (n >= 192)  /* 2 byte encoded length header.  */
+        {
+          if (buflen < 2)
+            return ~(uint64_t)0;
+          n = ((n - 192) << 8) + *buffer + 192;
+          buffer++;
+          buflen--;
+        }
+      if (!n || buflen < n)
+        return ~(uint64_t)0;
+      if ((*buffer & 0x7f) < 64)
+        map |= (uint64_t)1 << (*buffer & 0x7f);
+      buffer += n;
+      buflen -= n;
+    }
+  return map;
+}
+
+
 int
 parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 		 PKT_signature * sig)
@@ -2125,6 +2235,13 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
     {
       const byte *p;
       size_t len;
+      uint64_t hmap;
+
+      /* Most of the lookups below are for subpackets which are
+       * usually not present.  Instead of scanning the hashed area
+       * for each of them we first get the types present.  */
+      hmap = subpkt_type_map (sig->hashed);
+#define HAS_HASHED_SUBPKT(t) (hmap & ((uint64_t)1 << (t)))
 
       /* Set sig->flags.unknown_critical if there is a critical bit
        * set for packets which we do not understand.  */
@@ -2132,7 +2249,8 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 	  || !parse_sig_subpkt (sig, 0, SIGSUBPKT_TEST_CRITICAL, NULL))
 	sig->flags.unknown_critical = 1;
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_SIG_CREATED, NULL);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_SIG_CREATED)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_SIG_CREATED, NULL);
       if (p)
 	sig->timestamp = buf32_to_u32 (p);
       else if (!(sig->pubkey_algo >= 100 && sig->pubkey_algo <= 110)
@@ -2142,7 +2260,8 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
       /* Set the key id.  We first try the issuer fingerprint and if
        * it is a v4 signature the fallback to the issuer.  Note that
        * only the issuer packet is also searched in the unhashed area.  */
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_ISSUER_FPR, &len);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_ISSUER_FPR)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_ISSUER_FPR, &len);
       if (p && len == 21 && p[0] == 4)
         {
           sig->keyid[0] = buf32_to_u32 (p + 1 + 12);
@@ -2162,21 +2281,25 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 	       && opt.verbose && !glo_ctrl.silence_parse_warnings)
 	log_info ("signature packet without keyid\n");
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_SIG_EXPIRE, NULL);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_SIG_EXPIRE)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_SIG_EXPIRE, NULL);
       if (p && buf32_to_u32 (p))
 	sig->expiredate = sig->timestamp + buf32_to_u32 (p);
       if (sig->expiredate && sig->expiredate <= make_timestamp ())
 	sig->flags.expired = 1;
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_POLICY, NULL);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_POLICY)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_POLICY, NULL);
       if (p)
 	sig->flags.policy_url = 1;
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_PREF_KS, NULL);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_PREF_KS)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_PREF_KS, NULL);
       if (p)
 	sig->flags.pref_ks = 1;
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_SIGNERS_UID, &len);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_SIGNERS_UID)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_SIGNERS_UID, &len);
       if (p && len)
         {
           char *mbox;
@@ -2195,19 +2318,23 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
             }
         }
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_KEY_BLOCK, NULL);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_KEY_BLOCK)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_KEY_BLOCK, NULL);
       if (p)
         sig->flags.key_block = 1;
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_NOTATION, NULL);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_NOTATION)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_NOTATION, NULL);
       if (p)
 	sig->flags.notation = 1;
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_REVOCABLE, NULL);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_REVOCABLE)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_REVOCABLE, NULL);
       if (p && *p == 0)
 	sig->flags.revocable = 0;
 
-      p = parse_sig_subpkt (sig, 1, SIGSUBPKT_TRUST, &len);
+      p = !HAS_HASHED_SUBPKT (SIGSUBPKT_TRUST)? NULL
+        : parse_sig_subpkt (sig, 1, SIGSUBPKT_TRUST, &len);
       if (p && len == 2)
 	{
 	  sig->trust_depth = p[0];
@@ -2236,6 +2363,7 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
       /* Find all revocation keys.  */
       if (sig->sig_class == 0x1F)
 	parse_revkeys (sig);
+#undef HAS_HASHED_SUBPKT
     }
 
   if (list_mode)
@@ -47,6 +47,28 @@ static char *fd_passwd = NULL;
 static char *next_pw = NULL;
 static char *last_pw = NULL;
 
+/* The maximum number of keys kept in the S2K cache.  */
+#define S2K_CACHE_SIZE 16
+
+/* An item of the cache for keys derived with the iterated and salted
+ * S2K.  Decrypting many messages encrypted with the same passphrase
+ * and S2K parameters would otherwise run the expensive KDF for each
+ * message.  The items are allocated in secure memory.  */
+struct s2k_cache_item_s
+{
+  struct s2k_cache_item_s *next;
+  int hash_algo;
+  byte salt[8];
+  u32 count;
+  int keylen;
+  byte key[32];
+  char pw[1];   /* The passphrase used to derive the key.  */
+};
+typedef struct s2k_cache_item_s *s2k_cache_item_t;
+
+/* The S2K cache with the most recently used item first.  */
+static s2k_cache_item_t s2k_cache;
+
 
 int
 have_static_passphrase()
@@ -231,6 +253,103 @@ passphrase_get (int nocache, const char *cacheid, int repeat,
 }
 
 
+/* Release the S2K cache item ITEM.  */
+static void
+s2k_cache_release_item (s2k_cache_item_t item)
+{
+  wipememory (item, sizeof *item + strlen (item->pw));
+  xfree (item);
+}
+
+
+/* Look up the key of KEYLEN bytes derived from PW with S2K in the S2K
+ * cache and store it at KEY.  Returns true if found.  */
+static int
+s2k_cache_get (const char *pw, STRING2KEY *s2k, int keylen, byte *key)
+{
+  s2k_cache_item_t item, prev;
+
+  for (prev = NULL, item = s2k_cache; item; prev = item, item = item->next)
+    if (item->hash_algo == s2k->hash_algo
+        && item->count == s2k->count
+        && item->keylen == keylen
+        && !memcmp (item->salt, s2k->salt, 8)
+        && !strcmp (item->pw, pw))
+      break;
+  if (!item)
+    return 0;
+
+  if (prev)
+    {
+      /* Move to the front.  */
+      prev->next = item->next;
+      item->next = s2k_cache;
+      s2k_cache = item;
+    }
+  memcpy (key, item->key, keylen);
+  if (DBG_CRYPTO)
+    log_debug ("using cached S2K key\n");
+  return 1;
+}
+
+
+/* Store the key KEY of KEYLEN bytes derived from PW with S2K in the
+ * S2K cache.  */
+static void
+s2k_cache_put (const char *pw, STRING2KEY *s2k, int keylen, const byte *key)
+{
+  s2k_cache_item_t item, prev;
+  int n;
+
+  if (keylen > (int)sizeof item->key)
+    return;
+
+  item = xtrymalloc_secure (sizeof *item + strlen (pw));
+  if (!item)
+    return;  /* The cache is only an optimization.  */
+  item->hash_algo = s2k->hash_algo;
+  memcpy (item->salt, s2k->salt, 8);
+  item->count = s2k->count;
+  item->keylen = keylen;
+  memcpy (item->key, key, keylen);
+  strcpy (item->pw, pw);
+  item->next = s2k_cache;
+  s2k_cache = item;
+
+  /* Drop the least recently used item if the cache is full.  */
+  for (n = 1, prev = s2k_cache; prev->next; prev = prev->next, n++)
+    if (n == S2K_CACHE_SIZE)
+      {
+        s2k_cache_release_item (prev->next);
+        prev->next = NULL;
+        break;
+      }
+}
+
+
+/* Remove all keys derived with the 8 byte SALT from the S2K cache.  */
+static void
+s2k_cache_remove (const byte *salt)
+{
+  s2k_cache_item_t item, prev, next;
+
+  for (prev = NULL, item = s2k_cache; item; item = next)
+    {
+      next = item->next;
+      if (!memcmp (item->salt, salt, 8))
+        {
+          if (prev)
+            prev->next = next;
+          else
+            s2k_cache = next;
+          s2k_cache_release_item (item);
+        }
+      else
+        prev = item;
+    }
+}
+
+
 /*
  * Clear the cached passphrase with CACHEID.
  */
@@ -238,6 +357,13 @@ void
 passphrase_clear_cache (const char *cacheid)
 {
   int rc;
+  byte salt[8];
+
+  /* The cache id of a symmetric key is "S" followed by the hex
+   * encoded salt; derived keys for that salt may be wrong as well.  */
+  if (cacheid && *cacheid == 'S' && strlen (cacheid) == 1+16
+      && hex2bin (cacheid + 1, salt, 8) == 16)
+    s2k_cache_remove (salt);
 
   rc = agent_clear_passphrase (cacheid);
   if (rc)
@@ -364,16 +490,29 @@ passphrase_to_dek (int cipher_algo, STRING2KEY *s2k,
     {
       gpg_error_t err;
 
+      int use_s2k_cache;
+
       dek->keylen = openpgp_cipher_get_algo_keylen (dek->algo);
       if (!(dek->keylen > 0 && dek->keylen <= DIM(dek->key)))
         BUG ();
-      err = gcry_kdf_derive (pw, strlen (pw),
-                             s2k->mode == 3? GCRY_KDF_ITERSALTED_S2K :
-                             s2k->mode == 1? GCRY_KDF_SALTED_S2K :
-                             /* */           GCRY_KDF_SIMPLE_S2K,
-                             s2k->hash_algo, s2k->salt, 8,
-                             S2K_DECODE_COUNT(s2k->count),
-                             dek->keylen, dek->key);
+
+      /* Only the iterated S2K is expensive enough to be cached.  A
+       * newly created key uses a fresh salt and thus won't hit.  */
+      use_s2k_cache = (s2k->mode == 3 && !create && !nocache && pw);
+      if (use_s2k_cache && s2k_cache_get (pw, s2k, dek->keylen, dek->key))
+        err = 0;
+      else
+        {
+          err = gcry_kdf_derive (pw, strlen (pw),
+                                 s2k->mode == 3? GCRY_KDF_ITERSALTED_S2K :
+                                 s2k->mode == 1? GCRY_KDF_SALTED_S2K :
+                                 /* */           GCRY_KDF_SIMPLE_S2K,
+                                 s2k->hash_algo, s2k->salt, 8,
+                                 S2K_DECODE_COUNT(s2k->count),
+                                 dek->keylen, dek->key);
+          if (!err && use_s2k_cache)
+            s2k_cache_put (pw, s2k, dek->keylen, dek->key);
+        }
       if (err)
         {
           log_error ("gcry_kdf_derive failed: %s", gpg_strerror (err));
@@ -759,6 +759,134 @@ default_recipient (ctrl_t ctrl)
 }
 
 
+/* In server mode a client often encrypts many messages to the same
+ * recipients.  To avoid the key lookup and the validity check for
+ * each message we cache the keys found by find_and_check_key.  The
+ * cache is flushed if the key database or the trustdb changes.  */
+#define RECP_CACHE_SIZE 32
+#define RECP_CACHE_TTL  300  /* Seconds.  */
+
+struct recp_cache_item_s
+{
+  struct recp_cache_item_s *next;
+  PKT_public_key *pk;   /* The checked key.  */
+  unsigned int use;     /* The requested usage.  */
+  u32 created;          /* Time the item was created.  */
+  char name[1];         /* The user id as given by the client.  */
+};
+typedef struct recp_cache_item_s *recp_cache_item_t;
+
+static recp_cache_item_t recp_cache;
+static u32 recp_cache_keydb_stamp;
+static u32 recp_cache_tdb_stamp;
+
+
+static void
+recp_cache_flush (void)
+{
+  recp_cache_item_t item;
+
+  while ((item = recp_cache))
+    {
+      recp_cache = item->next;
+      free_public_key (item->pk);
+      xfree (item);
+    }
+}
+
+
+/* Flush the cache if the databases changed since it was filled.
+ * Returns false if the cache may not be used.  */
+static int
+recp_cache_check (void)
+{
+  u32 keydb_stamp, tdb_stamp;
+
+  if (opt.trust_model == TM_TOFU || opt.trust_model == TM_TOFU_PGP)
+    return 0;  /* The validity changes with each use.  */
+
+  if (!keydb_get_change_stamp (&keydb_stamp)
+      || !trustdb_get_change_stamp (&tdb_stamp))
+    {
+      recp_cache_flush ();
+      return 0;
+    }
+  if (keydb_stamp != recp_cache_keydb_stamp
+      || tdb_stamp != recp_cache_tdb_stamp)
+    {
+      recp_cache_flush ();
+      recp_cache_keydb_stamp = keydb_stamp;
+      recp_cache_tdb_stamp = tdb_stamp;
+    }
+  return 1;
+}
+
+
+/* Return a copy of the cached key for NAME and USE or NULL.  */
+static PKT_public_key *
+recp_cache_get (const char *name, unsigned int use)
+{
+  recp_cache_item_t item, prev;
+  u32 now = make_timestamp ();
+
+  for (prev=NULL, item=recp_cache; item; prev=item, item=item->next)
+    if (item->use == use && !strcmp (item->name, name))
+      break;
+  if (!item)
+    return NULL;
+
+  if (now - item->created > RECP_CACHE_TTL
+      || (item->pk->expiredate && item->pk->expiredate <= now))
+    {
+      /* Too old or the key expired meanwhile.  */
+      if (prev)
+        prev->next = item->next;
+      else
+        recp_cache = item->next;
+      free_public_key (item->pk);
+      xfree (item);
+      return NULL;
+    }
+
+  if (prev)
+    {
+      /* Move to the front so that the oldest item is dropped first.  */
+      prev->next = item->next;
+      item->next = recp_cache;
+      recp_cache = item;
+    }
+  return copy_public_key (NULL, item->pk);
+}
+
+
+/* Put a copy of PK into the cache for NAME and USE.  */
+static void
+recp_cache_put (const char *name, unsigned int use, PKT_public_key *pk)
+{
+  recp_cache_item_t item, prev;
+  int count;
+
+  item = xtrymalloc (sizeof *item + strlen (name));
+  if (!item)
+    return;
+  strcpy (item->name, name);
+  item->use = use;
+  item->created = make_timestamp ();
+  item->pk = copy_public_key (NULL, pk);
+  item->next = recp_cache;
+  recp_cache = item;
+
+  for (count=0, prev=item; prev->next; prev=prev->next)
+    if (++count == RECP_CACHE_SIZE)
+      {
+        free_public_key (prev->next->pk);
+        xfree (prev->next);
+        prev->next = NULL;
+        break;
+      }
+}
+
+
 /* Helper for build_pk_list to find and check one key.  This helper is
  * also used directly in server mode by the RECIPIENTS command.  On
  * success the new key is added to PK_LIST_ADDR.  NAME is the user id
@@ -773,10 +901,19 @@ find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
   int rc;
   PKT_public_key *pk;
   KBNODE keyblock = NULL;
+  int use_cache;
 
   if (!name || !*name)
     return gpg_error (GPG_ERR_INV_USER_ID);
 
+  use_cache = (ctrl->server_local && !from_file && recp_cache_check ());
+  if (use_cache && (pk = recp_cache_get (name, use)))
+    {
+      if (DBG_LOOKUP)
+        log_debug ("%s: using cached key for '%s'\n", __func__, name);
+      goto add_key;
+    }
+
   pk = xtrycalloc (1, sizeof *pk);
   if (!pk)
     return gpg_error_from_syserror ();
@@ -841,6 +978,10 @@ find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
         }
     }
 
+  if (use_cache)
+    recp_cache_put (name, use, pk);
+
+ add_key:
   /* Skip the actual key if the key is already present in the
      list.  */
   if (!key_present_in_pk_list (*pk_list_addr, pk))
@@ -1046,6 +1187,11 @@ build_pk_list (ctrl_t ctrl, strlist_t rcpts, PK_LIST *ret_pk_list)
         }
     }
 
+  /* Locate missing keys of several recipients at once instead of
+   * waiting for each lookup in the loops below.  */
+  if (any_recipients)
+    akl_prefetch (ctrl, remusr);
+
   /* If we don't have any recipients yet and we are not in batch mode
      drop into interactive selection mode. */
   if ( !any_recipients && !opt.batch )
@@ -1292,6 +1438,7 @@ build_pk_list (ctrl_t ctrl, strlist_t rcpts, PK_LIST *ret_pk_list)
 
  fail:
 
+  akl_prefetch_release (ctrl);
   if ( rc )
     release_pk_list( pk_list );
   else
@@ -48,71 +48,115 @@ get_mpi_from_sexp (gcry_sexp_t sexp, const char *item, int mpifmt)
 
 
 
-/****************
- * Emulate our old PK interface here - sometime in the future we might
- * change the internal design to directly fit to libgcrypt.
- */
-int
-pk_verify (pubkey_algo_t pkalgo, gcry_mpi_t hash,
-           gcry_mpi_t *data, gcry_mpi_t *pkey)
+/* Build the public key S-expression for the key PK and store it at
+ * R_SEXP.  */
+static gpg_error_t
+build_pkey_sexp (PKT_public_key *pk, gcry_sexp_t *r_sexp)
 {
-  gcry_sexp_t s_sig, s_hash, s_pkey;
-  int rc;
-  unsigned int neededfixedlen = 0;
+  pubkey_algo_t algo = pk->pubkey_algo;
+  gcry_mpi_t *pkey = pk->pkey;
+  gpg_error_t err;
+  char *curve;
 
-  /* Make a sexp from pkey.  */
-  if (pkalgo == PUBKEY_ALGO_DSA)
-    {
-      rc = gcry_sexp_build (&s_pkey, NULL,
-			    "(public-key(dsa(p%m)(q%m)(g%m)(y%m)))",
-			    pkey[0], pkey[1], pkey[2], pkey[3]);
-    }
-  else if (pkalgo == PUBKEY_ALGO_ELGAMAL_E || pkalgo == PUBKEY_ALGO_ELGAMAL)
+  *r_sexp = NULL;
+  if (algo == PUBKEY_ALGO_DSA)
     {
-      rc = gcry_sexp_build (&s_pkey, NULL,
-			    "(public-key(elg(p%m)(g%m)(y%m)))",
-			    pkey[0], pkey[1], pkey[2]);
+      err = gcry_sexp_build (r_sexp, NULL,
+                             "(public-key(dsa(p%m)(q%m)(g%m)(y%m)))",
+                             pkey[0], pkey[1], pkey[2], pkey[3]);
     }
-  else if (pkalgo == PUBKEY_ALGO_RSA || pkalgo == PUBKEY_ALGO_RSA_S)
+  else if (algo == PUBKEY_ALGO_ELGAMAL_E || algo == PUBKEY_ALGO_ELGAMAL)
     {
-      rc = gcry_sexp_build (&s_pkey, NULL,
-			    "(public-key(rsa(n%m)(e%m)))", pkey[0], pkey[1]);
+      err = gcry_sexp_build (r_sexp, NULL,
+                             "(public-key(elg(p%m)(g%m)(y%m)))",
+                             pkey[0], pkey[1], pkey[2]);
     }
-  else if (pkalgo == PUBKEY_ALGO_ECDSA)
+  else if (is_RSA (algo))
     {
-      char *curve = openpgp_oid_to_str (pkey[0]);
-      if (!curve)
-        rc = gpg_error_from_syserror ();
-      else
-        {
-          rc = gcry_sexp_build (&s_pkey, NULL,
-                                "(public-key(ecdsa(curve %s)(q%m)))",
-                                curve, pkey[1]);
-          xfree (curve);
-        }
+      err = gcry_sexp_build (r_sexp, NULL,
+                             "(public-key(rsa(n%m)(e%m)))", pkey[0], pkey[1]);
     }
-  else if (pkalgo == PUBKEY_ALGO_EDDSA)
+  else if (algo == PUBKEY_ALGO_ECDSA
+           || algo == PUBKEY_ALGO_EDDSA
+           || algo == PUBKEY_ALGO_ECDH)
     {
-      char *curve = openpgp_oid_to_str (pkey[0]);
+      curve = openpgp_oid_to_str (pkey[0]);
       if (!curve)
-        rc = gpg_error_from_syserror ();
+        err = gpg_error_from_syserror ();
       else
         {
-          rc = gcry_sexp_build (&s_pkey, NULL,
-                                "(public-key(ecc(curve %s)"
-                                "(flags eddsa)(q%m)))",
-                                curve, pkey[1]);
+          if (algo == PUBKEY_ALGO_ECDSA)
+            err = gcry_sexp_build (r_sexp, NULL,
+                                   "(public-key(ecdsa(curve %s)(q%m)))",
+                                   curve, pkey[1]);
+          else if (algo == PUBKEY_ALGO_EDDSA)
+            err = gcry_sexp_build (r_sexp, NULL,
+                                   "(public-key(ecc(curve %s)"
+                                   "(flags eddsa)(q%m)))",
+                                   curve, pkey[1]);
+          else if (openpgp_oid_is_cv25519 (pkey[0]))
+            err = gcry_sexp_build (r_sexp, NULL,
+                                   "(public-key(ecdh(curve%s)"
+                                   "(flags djb-tweak)(q%m)))",
+                                   curve, pkey[1]);
+          else
+            err = gcry_sexp_build (r_sexp, NULL,
+                                   "(public-key(ecdh(curve%s)(q%m)))",
+                                   curve, pkey[1]);
           xfree (curve);
         }
-
-      if (openpgp_oid_is_ed25519 (pkey[0]))
-        neededfixedlen = 256 / 8;
     }
   else
+    err = gpg_error (GPG_ERR_PUBKEY_ALGO);
+
+  return err;
+}
+
+
+/* Make sure that the public key S-expression of PK is cached in PK.
+ * pk_verify and pk_encrypt do this on their own; this function needs
+ * to be called before PK is handed to threads of the worker pool
+ * because the cache is not protected by a lock.  */
+gpg_error_t
+pk_prepare_sexp (PKT_public_key *pk)
+{
+  gpg_error_t err;
+
+  if (pk->pkey_sexp)
+    return 0;
+  err = build_pkey_sexp (pk, &pk->pkey_sexp);
+  if (err)
+    pk->pkey_sexp = NULL;
+  return err;
+}
+
+
+/****************
+ * Emulate our old PK interface here - sometime in the future we might
+ * change the internal design to directly fit to libgcrypt.  The
+ * S-expression with the public key is cached in PK.
+ */
+int
+pk_verify (PKT_public_key *pk, gcry_mpi_t hash, gcry_mpi_t *data)
+{
+  pubkey_algo_t pkalgo = pk->pubkey_algo;
+  gcry_sexp_t s_sig, s_hash;
+  int rc;
+  unsigned int neededfixedlen = 0;
+
+  if (pkalgo != PUBKEY_ALGO_DSA
+      && pkalgo != PUBKEY_ALGO_ELGAMAL_E && pkalgo != PUBKEY_ALGO_ELGAMAL
+      && pkalgo != PUBKEY_ALGO_RSA && pkalgo != PUBKEY_ALGO_RSA_S
+      && pkalgo != PUBKEY_ALGO_ECDSA && pkalgo != PUBKEY_ALGO_EDDSA)
     return GPG_ERR_PUBKEY_ALGO;
 
+  /* Make a sexp from pkey.  */
+  rc = pk_prepare_sexp (pk);
   if (rc)
-    BUG ();  /* gcry_sexp_build should never fail.  */
+    return rc;
+
+  if (pkalgo == PUBKEY_ALGO_EDDSA && openpgp_oid_is_ed25519 (pk->pkey[0]))
+    neededfixedlen = 256 / 8;
 
   /* Put hash into a S-Exp s_hash. */
   if (pkalgo == PUBKEY_ALGO_EDDSA)
@@ -221,11 +265,10 @@ pk_verify (pubkey_algo_t pkalgo, gcry_mpi_t hash,
     BUG ();
 
   if (!rc)
-    rc = gcry_pk_verify (s_sig, s_hash, s_pkey);
+    rc = gcry_pk_verify (s_sig, s_hash, pk->pkey_sexp);
 
   gcry_sexp_release (s_sig);
   gcry_sexp_release (s_hash);
-  gcry_sexp_release (s_pkey);
   return rc;
 }
 
@@ -234,33 +277,22 @@ pk_verify (pubkey_algo_t pkalgo, gcry_mpi_t hash,
 
 /****************
  * Emulate our old PK interface here - sometime in the future we might
- * change the internal design to directly fit to libgcrypt.
- * PK is only required to compute the fingerprint for ECDH.
+ * change the internal design to directly fit to libgcrypt.  The
+ * S-expression with the public key is cached in PK.
  */
 int
-pk_encrypt (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
-            PKT_public_key *pk, gcry_mpi_t *pkey)
+pk_encrypt (PKT_public_key *pk, gcry_mpi_t *resarr, gcry_mpi_t data)
 {
+  pubkey_algo_t algo = pk->pubkey_algo;
+  gcry_mpi_t *pkey = pk->pkey;
   gcry_sexp_t s_ciph = NULL;
   gcry_sexp_t s_data = NULL;
-  gcry_sexp_t s_pkey = NULL;
   int rc;
 
-  /* Make a sexp from pkey.  */
-  if (algo == PUBKEY_ALGO_ELGAMAL || algo == PUBKEY_ALGO_ELGAMAL_E)
-    {
-      rc = gcry_sexp_build (&s_pkey, NULL,
-			    "(public-key(elg(p%m)(g%m)(y%m)))",
-			    pkey[0], pkey[1], pkey[2]);
-      /* Put DATA into a simplified S-expression.  */
-      if (!rc)
-        rc = gcry_sexp_build (&s_data, NULL, "%m", data);
-    }
-  else if (algo == PUBKEY_ALGO_RSA || algo == PUBKEY_ALGO_RSA_E)
+  if (algo == PUBKEY_ALGO_ELGAMAL || algo == PUBKEY_ALGO_ELGAMAL_E
+      || algo == PUBKEY_ALGO_RSA || algo == PUBKEY_ALGO_RSA_E)
     {
-      rc = gcry_sexp_build (&s_pkey, NULL,
-			    "(public-key(rsa(n%m)(e%m)))",
-			    pkey[0], pkey[1]);
+      rc = pk_prepare_sexp (pk);
       /* Put DATA into a simplified S-expression.  */
       if (!rc)
         rc = gcry_sexp_build (&s_data, NULL, "%m", data);
@@ -272,26 +304,11 @@ pk_encrypt (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
       rc = pk_ecdh_generate_ephemeral_key (pkey, &k);
       if (!rc)
         {
-          char *curve;
-
-          curve = openpgp_oid_to_str (pkey[0]);
-          if (!curve)
-            rc = gpg_error_from_syserror ();
-          else
-            {
-              int with_djb_tweak_flag = openpgp_oid_is_cv25519 (pkey[0]);
-
-              /* Now use the ephemeral secret to compute the shared point.  */
-              rc = gcry_sexp_build (&s_pkey, NULL,
-                                    with_djb_tweak_flag ?
-                                    "(public-key(ecdh(curve%s)(flags djb-tweak)(q%m)))"
-                                    : "(public-key(ecdh(curve%s)(q%m)))",
-                                    curve, pkey[1]);
-              xfree (curve);
-              /* Put K into a simplified S-expression.  */
-              if (!rc)
-                rc = gcry_sexp_build (&s_data, NULL, "%m", k);
-            }
+          /* Now use the ephemeral secret to compute the shared point.  */
+          rc = pk_prepare_sexp (pk);
+          /* Put K into a simplified S-expression.  */
+          if (!rc)
+            rc = gcry_sexp_build (&s_data, NULL, "%m", k);
           gcry_mpi_release (k);
         }
     }
@@ -300,10 +317,9 @@ pk_encrypt (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
 
   /* Pass it to libgcrypt. */
   if (!rc)
-    rc = gcry_pk_encrypt (&s_ciph, s_data, s_pkey);
+    rc = gcry_pk_encrypt (&s_ciph, s_data, pk->pkey_sexp);
 
   gcry_sexp_release (s_data);
-  gcry_sexp_release (s_pkey);
 
   if (rc)
     ;
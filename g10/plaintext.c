@@ -27,6 +27,11 @@
 #ifdef HAVE_DOSISH_SYSTEM
 # include <fcntl.h> /* for setmode() */
 #endif
+#ifdef HAVE_MMAP
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
 
 #include "gpg.h"
 #include "../common/util.h"
@@ -221,6 +226,109 @@ get_output_file (const byte *embedded_name, int embedded_namelen,
   return 0;
 }
 
+/* Store at R_OFF the offset into the LEN bytes at position POS of
+ * the literal data where the data to write starts and return the
+ * number of bytes to write.  Without --decrypt-range these are all
+ * bytes.  */
+static size_t
+range_clip (uint64_t pos, size_t len, size_t *r_off)
+{
+  uint64_t start, end;
+
+  *r_off = 0;
+  if (!opt.flags.decrypt_range)
+    return len;
+
+  start = opt.range_offset;
+  end = start + opt.range_length;
+  if (!opt.range_length || end < start)
+    end = (uint64_t)(-1);
+  if (pos + len <= start || pos >= end)
+    return 0;
+  if (pos < start)
+    {
+      *r_off = start - pos;
+      len -= start - pos;
+      pos = start;
+    }
+  if (pos + len > end)
+    len = end - pos;
+  return len;
+}
+
+
+/* Skip the data of PT at position POS which is not part of the
+ * --decrypt-range without decrypting it.  The number of skipped
+ * bytes is stored at R_SKIPPED.  */
+static gpg_error_t
+range_skip (PKT_plaintext *pt, uint64_t pos, uint64_t *r_skipped)
+{
+  uint64_t n;
+
+  *r_skipped = 0;
+  if (pos < opt.range_offset)
+    n = opt.range_offset - pos;
+  else if (opt.range_length && pos - opt.range_offset >= opt.range_length)
+    n = pt->len;
+  else
+    return 0;
+  /* Keep the last byte so that the decryption layer does not need to
+   * care about the last chunk.  */
+  if (n >= pt->len)
+    n = pt->len - 1;
+  if (!n)
+    return 0;
+  return decrypt_data_skip (pt->buf, n, r_skipped);
+}
+
+
+/* Hash the clear text signed data in {BUF,LEN} into MD.  Line
+ * endings are hashed as CR,LF but the line ending of the last line is
+ * not hashed; thus a line ending is only hashed when the next
+ * character is seen.  STATE carries this over to the next call; it
+ * must be initialized to 0 and is 1 after a CR and 2 after a line
+ * ending.  Runs of ordinary characters are hashed at once.  */
+static void
+hash_clearsig_block (gcry_md_hd_t md, const byte *buf, size_t len,
+                     int *state)
+{
+  size_t i = 0;
+  size_t start;
+
+  while (i < len)
+    {
+      if (*state == 2)
+        {
+          gcry_md_write (md, "\r\n", 2);
+          *state = 0;
+        }
+      if (*state == 1)
+        {
+          if (buf[i] == '\n')
+            *state = 2;
+          else
+            {
+              gcry_md_putc (md, '\r');
+              if (buf[i] != '\r')
+                {
+                  *state = 0;
+                  continue;  /* Hash the character in state 0.  */
+                }
+            }
+          i++;
+          continue;
+        }
+
+      for (start = i; i < len && buf[i] != '\r' && buf[i] != '\n'; i++)
+        ;
+      if (i > start)
+        gcry_md_write (md, buf + start, i - start);
+      if (i < len)
+        *state = buf[i++] == '\r'? 1 : 2;
+    }
+}
+
+
 /* Handle a plaintext packet.  If MFX is not NULL, update the MDs
  * Note: We should have used the filter stuff here, but we have to add
  * some easy mimic to set a read limit, so we calculate only the bytes
@@ -244,6 +352,9 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
   else
     convert = 0;
 
+  if (convert && opt.flags.decrypt_range && !nooutput)
+    log_info ("note: %s is ignored for text mode data\n", "--decrypt-range");
+
   /* Let people know what the plaintext info is. This allows the
      receiving program to try and do something different based on the
      format code (say, recode UTF-8 to local). */
@@ -331,9 +442,31 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
       else  /* Binary mode.  */
 	{
 	  byte *buffer = xmalloc (32768);
+	  uint64_t pos = 0;
+	  uint64_t skipped;
+	  size_t off, n;
+
 	  while (pt->len)
 	    {
-	      int len = pt->len > 32768 ? 32768 : pt->len;
+	      int len;
+
+	      /* Without a signature to verify we don't need to decrypt
+	       * the data outside of the requested range.  */
+	      if (opt.flags.decrypt_range && !mfx->md)
+		{
+		  err = range_skip (pt, pos, &skipped);
+		  if (err)
+		    {
+		      log_error ("problem reading source (%u bytes remaining)\n",
+				 (unsigned) pt->len);
+		      xfree (buffer);
+		      goto leave;
+		    }
+		  pos += skipped;
+		  pt->len -= skipped;
+		}
+
+	      len = pt->len > 32768 ? 32768 : pt->len;
 	      len = iobuf_read (pt->buf, buffer, len);
 	      if (len == -1)
 		{
@@ -345,9 +478,10 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		}
 	      if (mfx->md)
 		gcry_md_write (mfx->md, buffer, len);
-	      if (fp)
+	      n = range_clip (pos, len, &off);
+	      if (fp && n)
 		{
-		  if (opt.max_output && (count += len) > opt.max_output)
+		  if (opt.max_output && (count += n) > opt.max_output)
 		    {
 		      log_error ("error writing to '%s': %s\n",
 				 fname, "exceeded --max-output limit\n");
@@ -355,7 +489,7 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      xfree (buffer);
 		      goto leave;
 		    }
-		  else if (es_fwrite (buffer, 1, len, fp) != len)
+		  else if (es_fwrite (buffer + off, 1, n, fp) != n)
 		    {
 		      err = gpg_error_from_syserror ();
 		      log_error ("error writing to '%s': %s\n",
@@ -364,6 +498,7 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      goto leave;
 		    }
 		}
+	      pos += len;
 	      pt->len -= len;
 	    }
 	  xfree (buffer);
@@ -407,6 +542,8 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	{			/* binary mode */
 	  byte *buffer;
 	  int eof_seen = 0;
+	  uint64_t pos = 0;
+	  size_t off, n;
 
           buffer = xtrymalloc (32768);
           if (!buffer)
@@ -430,9 +567,11 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		eof_seen = 1;
 	      if (mfx->md)
 		gcry_md_write (mfx->md, buffer, len);
-	      if (fp)
+	      n = range_clip (pos, len, &off);
+	      pos += len;
+	      if (fp && n)
 		{
-		  if (opt.max_output && (count += len) > opt.max_output)
+		  if (opt.max_output && (count += n) > opt.max_output)
 		    {
 		      log_error ("error writing to '%s': %s\n",
 				 fname, "exceeded --max-output limit\n");
@@ -440,7 +579,7 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      xfree (buffer);
 		      goto leave;
 		    }
-		  else if (es_fwrite (buffer, 1, len, fp) != len)
+		  else if (es_fwrite (buffer + off, 1, n, fp) != n)
 		    {
 		      err = gpg_error_from_syserror ();
 		      log_error ("error writing to '%s': %s\n",
@@ -456,61 +595,48 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
     }
   else /* Clear text signature - don't hash the last CR,LF.   */
     {
+      byte *buffer;
+      int eof_seen = 0;
       int state = 0;
 
-      while ((c = iobuf_get (pt->buf)) != -1)
+      buffer = xtrymalloc (32768);
+      if (!buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+
+      while (!eof_seen)
 	{
+	  /* See the binary mode case for the reason of the EOF check.  */
+	  int len = iobuf_read (pt->buf, buffer, 32768);
+	  if (len == -1)
+	    break;
+	  if (len < 32768)
+	    eof_seen = 1;
 	  if (fp)
 	    {
-	      if (opt.max_output && (++count) > opt.max_output)
+	      if (opt.max_output && (count += len) > opt.max_output)
 		{
 		  log_error ("error writing to '%s': %s\n",
 			     fname, "exceeded --max-output limit\n");
 		  err = gpg_error (GPG_ERR_TOO_LARGE);
+		  xfree (buffer);
 		  goto leave;
 		}
-	      else if (es_putc (c, fp) == EOF)
+	      else if (es_fwrite (buffer, 1, len, fp) != (size_t)len)
 		{
 		  err = gpg_error_from_syserror ();
 		  log_error ("error writing to '%s': %s\n",
 			     fname, gpg_strerror (err));
+		  xfree (buffer);
 		  goto leave;
 		}
 	    }
-	  if (!mfx->md)
-	    continue;
-	  if (state == 2)
-	    {
-	      gcry_md_putc (mfx->md, '\r');
-	      gcry_md_putc (mfx->md, '\n');
-	      state = 0;
-	    }
-	  if (!state)
-	    {
-	      if (c == '\r')
-		state = 1;
-	      else if (c == '\n')
-		state = 2;
-	      else
-		gcry_md_putc (mfx->md, c);
-	    }
-	  else if (state == 1)
-	    {
-	      if (c == '\n')
-		state = 2;
-	      else
-		{
-		  gcry_md_putc (mfx->md, '\r');
-		  if (c == '\r')
-		    state = 1;
-		  else
-		    {
-		      state = 0;
-		      gcry_md_putc (mfx->md, c);
-		    }
-		}
-	    }
+	  if (mfx->md)
+	    hash_clearsig_block (mfx->md, buffer, len, &state);
 	}
+      xfree (buffer);
       pt->buf = NULL;
     }
 
@@ -584,13 +710,65 @@ do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
     }
   else
     {
-      while ((c = iobuf_get (fp)) != -1)
+      byte *buffer;
+      int len;
+
+      /* Hash in large blocks so that the digest functions work on
+       * whole buffers and not on single bytes.  */
+      buffer = xmalloc (32768);
+      while ((len = iobuf_read (fp, buffer, 32768)) != -1)
 	{
 	  if (md)
-	    gcry_md_putc (md, c);
+	    gcry_md_write (md, buffer, len);
 	}
+      xfree (buffer);
+    }
+}
+
+
+#ifdef HAVE_MMAP
+/* The size of the windows used to map a file for hashing.  */
+#define HASH_MMAP_WINDOW (64*1024*1024)
+
+/* Hash the regular file FD from its current position to its end into
+ * MD by mapping it into memory; this avoids copying the data through
+ * the iobuf layer.  The file position is left at the end of the
+ * hashed data, thus if the file can't be mapped (or only partially)
+ * the caller simply continues to hash by reading from FD.  */
+static void
+hash_mapped_file (gcry_md_hd_t md, int fd)
+{
+  struct stat st;
+  off_t start, off;
+  long pagesize;
+  size_t skip, len;
+  void *p;
+
+  if (fd == -1 || fstat (fd, &st) || !S_ISREG (st.st_mode))
+    return;
+  pagesize = sysconf (_SC_PAGESIZE);
+  start = lseek (fd, 0, SEEK_CUR);
+  if (pagesize <= 0 || start == (off_t)-1 || start >= st.st_size)
+    return;
+
+  /* mmap requires the offset to be a multiple of the page size.  */
+  skip = start % pagesize;
+  for (off = start - skip; off < st.st_size; off += len, skip = 0)
+    {
+      if (st.st_size - off > HASH_MMAP_WINDOW)
+        len = HASH_MMAP_WINDOW;
+      else
+        len = st.st_size - off;
+      p = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, off);
+      if (p == MAP_FAILED)
+        break;
+      gcry_md_write (md, (char *)p + skip, len - skip);
+      munmap (p, len);
     }
+  if (off > start)
+    lseek (fd, off, SEEK_SET);
 }
+#endif /*HAVE_MMAP*/
 
 
 /****************
@@ -726,6 +904,12 @@ hash_datafiles (gcry_md_hd_t md, gcry_md_hd_t md2, strlist_t files,
 	  return rc;
 	}
       handle_progress (pfx, fp, sl->d);
+#ifdef HAVE_MMAP
+      /* Without text mode and progress filter we can hash the file
+       * directly.  */
+      if (md && !md2 && !textmode && !pfx)
+        hash_mapped_file (md, iobuf_get_fd (fp));
+#endif
       do_hash (md, md2, fp, textmode);
       iobuf_close (fp);
     }
@@ -763,6 +947,10 @@ hash_datafile_by_fd (gcry_md_hd_t md, gcry_md_hd_t md2, int data_fd,
 
   handle_progress (pfx, fp, NULL);
 
+#ifdef HAVE_MMAP
+  if (md && !md2 && !textmode && !pfx)
+    hash_mapped_file (md, data_fd);
+#endif
   do_hash (md, md2, fp, textmode);
 
   iobuf_close (fp);
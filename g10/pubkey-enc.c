@@ -38,8 +38,40 @@
 #include "../common/compliance.h"
 
 
+/* An item of the prefetched session key frames.  */
+struct prefetch_item_s
+{
+  struct prefetch_item_s *next;
+  u32 keyid[2];
+  int pubkey_algo;
+  int done;                  /* Prefetching has been tried.  */
+  gcry_sexp_t s_data;        /* The ciphertext ...  */
+  unsigned char *data;       /* ... and in canonical encoding.  */
+  size_t datalen;
+  char *keygrip;             /* The keygrip of the key used.  */
+  byte *frame;               /* The decrypted frame or NULL.  */
+  size_t nframe;
+  int padding;
+};
+typedef struct prefetch_item_s *prefetch_item_t;
+
+/* The list of PKESKs registered for prefetching.  */
+static prefetch_item_t prefetch_list;
+
+/* A secret key already tried by try_hidden_recipients for an
+ * anonymous PKESK.  */
+struct tried_key_s
+{
+  struct tried_key_s *next;
+  struct pubkey_enc_list *enc;
+  u32 keyid[2];
+};
+typedef struct tried_key_s *tried_key_t;
+
+
 static gpg_error_t get_it (ctrl_t ctrl, struct pubkey_enc_list *k,
-                           DEK *dek, PKT_public_key *sk, u32 *keyid);
+                           DEK *dek, PKT_public_key *sk, u32 *keyid,
+                           byte *trial_frame, size_t trial_nframe);
 
 
 /* Check that the given algo is mentioned in one of the valid user-ids. */
@@ -67,6 +99,360 @@ is_algo_in_prefs (kbnode_t keyblock, preftype_t type, int algo)
 }
 
 
+/* Return true if the ciphertext ENC may have been created with the
+ * secret key SK.  This is a cheap check on the size of the
+ * ciphertext to avoid useless trial decryptions.  */
+static int
+enc_size_matches (struct pubkey_enc_list *enc, PKT_public_key *sk)
+{
+  if (sk->pubkey_algo != enc->pubkey_algo || !enc->data[0] || !sk->pkey[0])
+    return 0;
+
+  switch (sk->pubkey_algo)
+    {
+    case PUBKEY_ALGO_ECDH:
+      /* The ephemeral point is on the curve of the key and thus has
+       * the same length as the public point.  */
+      return (sk->pkey[1]
+              && ((gcry_mpi_get_nbits (enc->data[0]) + 7) / 8
+                  == (gcry_mpi_get_nbits (sk->pkey[1]) + 7) / 8));
+
+    case PUBKEY_ALGO_RSA:
+    case PUBKEY_ALGO_RSA_E:
+    case PUBKEY_ALGO_ELGAMAL:
+    case PUBKEY_ALGO_ELGAMAL_E:
+      /* The ciphertext is reduced modulo n or p, respectively.  */
+      return (gcry_mpi_get_nbits (enc->data[0])
+              <= gcry_mpi_get_nbits (sk->pkey[0]));
+
+    default:
+      return 0;
+    }
+}
+
+
+/* Return true if the secret key with KEYID has already been tried for
+ * ENC.  */
+static int
+key_was_tried (tried_key_t tried, struct pubkey_enc_list *enc, u32 *keyid)
+{
+  for (; tried; tried = tried->next)
+    if (tried->enc == enc
+        && tried->keyid[0] == keyid[0] && tried->keyid[1] == keyid[1])
+      return 1;
+  return 0;
+}
+
+
+/* Try to find the session key of a message with only hidden
+ * recipients by asking the agent to trial decrypt each PKESK with all
+ * matching secret keys at once.  The agent skips keys which would
+ * require user interaction; they are left to the regular processing
+ * in get_session_key.  On success the session key is stored at DEK
+ * and 0 is returned.  The keys which have been tried are stored at
+ * R_TRIED so that get_session_key does not try them again; the caller
+ * needs to release that list.  */
+static gpg_error_t
+try_hidden_recipients (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek,
+                       tried_key_t *r_tried)
+{
+  gpg_error_t err;
+  void *enum_context = NULL;
+  PKT_public_key *sk;
+  PKT_public_key **sks = NULL;
+  PKT_public_key **cands = NULL;
+  char **keygrips = NULL;
+  unsigned char **frames = NULL;
+  size_t *nframes = NULL;
+  gpg_error_t *errs = NULL;
+  unsigned int nsks, allocated, ncands, idx, i;
+  struct pubkey_enc_list *k;
+  gcry_sexp_t s_data;
+  u32 keyid[2];
+
+  /* Only if all recipients are hidden.  Otherwise the lookup by
+   * keyid is the cheaper way to find our key.  */
+  for (k = list; k; k = k->next)
+    if (k->keyid[0] || k->keyid[1])
+      return gpg_error (GPG_ERR_NO_SECKEY);
+
+  /* Collect all secret keys which may be used for decryption.  The
+   * keys are owned by the enumeration context.  */
+  nsks = allocated = 0;
+  for (;;)
+    {
+      sk = xtrycalloc (1, sizeof *sk);
+      if (!sk)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = enum_secret_keys (ctrl, &enum_context, sk);
+      if (err)
+        break;
+
+      if (!(sk->pubkey_usage & PUBKEY_USAGE_ENC)
+          || !gnupg_pk_is_allowed (opt.compliance, PK_USE_DECRYPTION,
+                                   sk->pubkey_algo,
+                                   sk->pkey, nbits_from_pk (sk), NULL))
+        continue;
+
+      if (nsks == allocated)
+        {
+          PKT_public_key **tmp;
+
+          allocated += 16;
+          tmp = xtryrealloc (sks, allocated * sizeof *sks);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+          sks = tmp;
+        }
+      sks[nsks++] = sk;
+    }
+  if (gpg_err_code (err) != GPG_ERR_EOF)
+    goto leave;
+  err = gpg_error (GPG_ERR_NO_SECKEY);
+  if (nsks < 2)
+    goto leave;  /* Not worth the trouble.  */
+
+  cands = xtrycalloc (nsks, sizeof *cands);
+  keygrips = xtrycalloc (nsks, sizeof *keygrips);
+  frames = xtrycalloc (nsks, sizeof *frames);
+  nframes = xtrycalloc (nsks, sizeof *nframes);
+  errs = xtrycalloc (nsks, sizeof *errs);
+  if (!cands || !keygrips || !frames || !nframes || !errs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  for (k = list; k; k = k->next)
+    {
+      if (openpgp_pk_test_algo2 (k->pubkey_algo, PUBKEY_USAGE_ENC))
+        continue;
+
+      for (ncands = idx = 0; idx < nsks; idx++)
+        if (enc_size_matches (k, sks[idx])
+            && !hexkeygrip_from_pk (sks[idx], &keygrips[ncands]))
+          cands[ncands++] = sks[idx];
+      if (ncands < 2)
+        {
+          for (i=0; i < ncands; i++)
+            {
+              xfree (keygrips[i]);
+              keygrips[i] = NULL;
+            }
+          continue;
+        }
+
+      if (opt.verbose)
+        log_info (_("trying %u secret keys for the anonymous recipient\n"),
+                  ncands);
+      err = build_enc_sexp (k->pubkey_algo, k->data, &s_data);
+      if (!err)
+        {
+          err = agent_pkdecrypt_trial (ctrl, keygrips, ncands, s_data,
+                                       frames, nframes, errs);
+          gcry_sexp_release (s_data);
+        }
+      for (i=0; i < ncands; i++)
+        {
+          xfree (keygrips[i]);
+          keygrips[i] = NULL;
+        }
+      if (err)
+        {
+          if (gpg_err_code (err) != GPG_ERR_ASS_UNKNOWN_CMD)
+            log_info ("trial decryption failed: %s\n", gpg_strerror (err));
+          err = gpg_error (GPG_ERR_NO_SECKEY);
+          goto leave;
+        }
+
+      /* Check the frames in the order of the keys.  */
+      err = gpg_error (GPG_ERR_NO_SECKEY);
+      for (i=0; i < ncands; i++)
+        {
+          if (!frames[i])
+            {
+              if (DBG_CRYPTO)
+                log_debug ("trial decryption skipped key %s: %s\n",
+                           keystr_from_pk (cands[i]), gpg_strerror (errs[i]));
+              continue;
+            }
+
+          keyid_from_pk (cands[i], keyid);
+          note_key_tried (r_tried, k, keyid);
+
+          if (!opt.quiet)
+            log_info (_("anonymous recipient; trying secret key %s ...\n"),
+                      keystr (keyid));
+          err = get_it (ctrl, k, dek, cands[i], keyid, frames[i], nframes[i]);
+          frames[i] = NULL;  /* Now owned by get_it.  */
+          k->result = err;
+          if (!err)
+            {
+              if (!opt.quiet)
+                log_info (_("okay, we are the anonymous recipient.\n"));
+              break;
+            }
+        }
+      for (i=0; i < ncands; i++)
+        if (frames[i])
+          {
+            wipememory (frames[i], nframes[i]);
+            xfree (frames[i]);
+            frames[i] = NULL;
+          }
+      if (!err)
+        goto leave;
+      err = gpg_error (GPG_ERR_NO_SECKEY);
+    }
+
+ leave:
+  xfree (cands);
+  xfree (keygrips);
+  xfree (frames);
+  xfree (nframes);
+  xfree (errs);
+  xfree (sks);
+  enum_secret_keys (ctrl, &enum_context, NULL);  /* free context */
+  return err;
+}
+
+
+/* Add the secret key KEYID for ENC to the list at R_TRIED.  */
+static void
+note_key_tried (tried_key_t *r_tried, struct pubkey_enc_list *enc,
+                u32 *keyid)
+{
+  tried_key_t tried;
+
+  tried = xtrycalloc (1, sizeof *tried);
+  if (tried)
+    {
+      tried->enc = enc;
+      tried->keyid[0] = keyid[0];
+      tried->keyid[1] = keyid[1];
+      tried->next = *r_tried;
+      *r_tried = tried;
+    }
+}
+
+
+/* A candidate for try_cheapest_keys.  */
+struct cost_item_s
+{
+  struct pubkey_enc_list *enc;
+  PKT_public_key *pk;
+  int cost;    /* As returned by agent_secret_key_cost.  */
+  int seq;     /* The original order.  */
+};
+
+
+/* qsort helper for try_cheapest_keys.  */
+static int
+cmp_cost_items (const void *a_arg, const void *b_arg)
+{
+  const struct cost_item_s *a = a_arg;
+  const struct cost_item_s *b = b_arg;
+
+  if (a->cost != b->cost)
+    return a->cost - b->cost;
+  return a->seq - b->seq;
+}
+
+
+/* If several PKESKs in LIST are addressed to our keys, try them in
+ * the order of the expected cost: Keys which can be used without user
+ * interaction first, then keys on an inserted smartcard, then keys
+ * requiring a passphrase, and finally keys on a smartcard which is
+ * not inserted.  On success the session key is stored at DEK and 0 is
+ * returned.  The keys which have been tried are stored at R_TRIED so
+ * that get_session_key does not try them again; the caller needs to
+ * release that list.  */
+static gpg_error_t
+try_cheapest_keys (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek,
+                   tried_key_t *r_tried)
+{
+  gpg_error_t err = gpg_error (GPG_ERR_NO_SECKEY);
+  struct cost_item_s *items = NULL;
+  struct pubkey_enc_list *k;
+  PKT_public_key *pk;
+  unsigned int n, nitems, idx;
+
+  for (n=0, k = list; k; k = k->next)
+    if (k->keyid[0] || k->keyid[1])
+      n++;
+  if (n < 2)
+    return err;  /* Nothing to sort.  */
+
+  items = xtrycalloc (n, sizeof *items);
+  if (!items)
+    return gpg_error_from_syserror ();
+
+  for (nitems=0, k = list; k; k = k->next)
+    {
+      if (!k->keyid[0] && !k->keyid[1])
+        continue;
+      if (openpgp_pk_test_algo2 (k->pubkey_algo, PUBKEY_USAGE_ENC))
+        continue;
+
+      pk = xtrycalloc (1, sizeof *pk);
+      if (!pk)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (get_pubkey (ctrl, pk, k->keyid)
+          || pk->pubkey_algo != k->pubkey_algo
+          || !(pk->pubkey_usage & PUBKEY_USAGE_ENC)
+          || !gnupg_pk_is_allowed (opt.compliance, PK_USE_DECRYPTION,
+                                   pk->pubkey_algo,
+                                   pk->pkey, nbits_from_pk (pk), NULL))
+        {
+          free_public_key (pk);
+          continue;
+        }
+      items[nitems].enc = k;
+      items[nitems].pk = pk;
+      items[nitems].seq = nitems;
+      nitems++;
+    }
+  if (nitems < 2)
+    goto leave;
+
+  for (idx=0; idx < nitems; idx++)
+    items[idx].cost = agent_secret_key_cost (ctrl, items[idx].pk);
+  qsort (items, nitems, sizeof *items, cmp_cost_items);
+
+  for (idx=0; idx < nitems; idx++)
+    {
+      if (items[idx].cost < 0)
+        continue;  /* No secret key.  */
+
+      if (DBG_CRYPTO)
+        log_debug ("trying key %s with cost %d\n",
+                   keystr (items[idx].enc->keyid), items[idx].cost);
+      note_key_tried (r_tried, items[idx].enc, items[idx].enc->keyid);
+      err = get_it (ctrl, items[idx].enc, dek, items[idx].pk,
+                    items[idx].enc->keyid, NULL, 0);
+      items[idx].enc->result = err;
+      if (!err || gpg_err_code (err) == GPG_ERR_FULLY_CANCELED)
+        goto leave;
+    }
+  err = gpg_error (GPG_ERR_NO_SECKEY);
+
+ leave:
+  for (idx=0; idx < nitems; idx++)
+    free_public_key (items[idx].pk);
+  xfree (items);
+  return err;
+}
+
+
 /*
  * Get the session key from a pubkey enc packet and return it in DEK,
  * which should have been allocated in secure memory by the caller.
@@ -80,10 +466,28 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
   u32 keyid[2];
   int search_for_secret_keys = 1;
   struct pubkey_enc_list *k;
+  tried_key_t tried = NULL;
+  tried_key_t t;
 
   if (DBG_CLOCK)
     log_clock ("get_session_key enter");
 
+  /* For hidden recipients first try all keys which can be used without
+   * user interaction at once.  Otherwise try the keys to which the
+   * message is addressed in the order of their costs.  */
+  if (!opt.skip_hidden_recipients
+      && !try_hidden_recipients (ctrl, list, dek, &tried))
+    {
+      err = 0;
+      search_for_secret_keys = 0;
+    }
+  else
+    {
+      err = try_cheapest_keys (ctrl, list, dek, &tried);
+      if (!err || gpg_err_code (err) == GPG_ERR_FULLY_CANCELED)
+        search_for_secret_keys = 0;
+    }
+
   while (search_for_secret_keys)
     {
       sk = xmalloc_clear (sizeof *sk);
@@ -106,8 +510,11 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
           continue;
         }
 
-      /* FIXME: The list needs to be sorted so that we try the keys in
-       * an appropriate order.  For example:
+      /* FIXME: The keys to which the message is addressed have
+       * already been tried in the order of their cost by
+       * try_cheapest_keys.  For the remaining keys the list needs to
+       * be sorted so that we try the keys in an appropriate order.
+       * For example:
        * - On-disk keys w/o protection
        * - On-disk keys with a cached passphrase
        * - On-card keys of an active card
@@ -132,6 +539,8 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
             continue;
 
           keyid_from_pk (sk, keyid);
+          if (key_was_tried (tried, k, keyid))
+            continue;
 
           if (!k->keyid[0] && !k->keyid[1])
             {
@@ -148,7 +557,7 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
           else
             continue;
 
-          err = get_it (ctrl, k, dek, sk, keyid);
+          err = get_it (ctrl, k, dek, sk, keyid, NULL, 0);
           k->result = err;
           if (!err)
             {
@@ -165,6 +574,11 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
         }
     }
   enum_secret_keys (ctrl, &enum_context, NULL);  /* free context */
+  while ((t = tried))
+    {
+      tried = t->next;
+      xfree (t);
+    }
 
   if (gpg_err_code (err) == GPG_ERR_EOF)
     {
@@ -182,9 +596,249 @@ get_session_key (ctrl_t ctrl, struct pubkey_enc_list *list, DEK *dek)
 }
 
 
+/* Convert the encrypted session key DATA for PUBKEY_ALGO to an
+ * S-expression as expected by the agent and store it at R_SEXP.  */
+static gpg_error_t
+build_enc_sexp (int pubkey_algo, gcry_mpi_t *data, gcry_sexp_t *r_sexp)
+{
+  gpg_error_t err;
+
+  if (pubkey_algo == PUBKEY_ALGO_ELGAMAL
+      || pubkey_algo == PUBKEY_ALGO_ELGAMAL_E)
+    {
+      if (!data[0] || !data[1])
+        err = gpg_error (GPG_ERR_BAD_MPI);
+      else
+        err = gcry_sexp_build (r_sexp, NULL, "(enc-val(elg(a%m)(b%m)))",
+                               data[0], data[1]);
+    }
+  else if (pubkey_algo == PUBKEY_ALGO_RSA
+           || pubkey_algo == PUBKEY_ALGO_RSA_E)
+    {
+      if (!data[0])
+        err = gpg_error (GPG_ERR_BAD_MPI);
+      else
+        err = gcry_sexp_build (r_sexp, NULL, "(enc-val(rsa(a%m)))",
+                               data[0]);
+    }
+  else if (pubkey_algo == PUBKEY_ALGO_ECDH)
+    {
+      if (!data[0] || !data[1])
+        err = gpg_error (GPG_ERR_BAD_MPI);
+      else
+        err = gcry_sexp_build (r_sexp, NULL, "(enc-val(ecdh(s%m)(e%m)))",
+                               data[1], data[0]);
+    }
+  else
+    err = gpg_error (GPG_ERR_BUG);
+
+  return err;
+}
+
+
+/* Register the PKESK ENC for the next call of
+ * pubkey_enc_prefetch.  */
+void
+pubkey_enc_prefetch_add (PKT_pubkey_enc *enc)
+{
+  prefetch_item_t item;
+
+  if (!enc->keyid[0] && !enc->keyid[1])
+    return;  /* We can't map anonymous recipients to a key.  */
+  if (openpgp_pk_test_algo2 (enc->pubkey_algo, PUBKEY_USAGE_ENC))
+    return;
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return;
+  item->keyid[0] = enc->keyid[0];
+  item->keyid[1] = enc->keyid[1];
+  item->pubkey_algo = enc->pubkey_algo;
+  item->padding = -1;
+  if (build_enc_sexp (enc->pubkey_algo, enc->data, &item->s_data)
+      || make_canon_sexp (item->s_data, &item->data, &item->datalen))
+    {
+      gcry_sexp_release (item->s_data);
+      xfree (item);
+      return;
+    }
+  item->next = prefetch_list;
+  prefetch_list = item;
+}
+
+
+/* Decrypt the frames of all PKESKs registered with
+ * pubkey_enc_prefetch_add which are encrypted to the same key in one
+ * go.  This allows the agent to read and unprotect each key only once
+ * for many messages.  The frames are later used by get_session_key
+ * instead of asking the agent again; errors are ignored because in
+ * this case get_session_key does the usual processing.  */
+void
+pubkey_enc_prefetch (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  prefetch_item_t item, it;
+  PKT_public_key *pk;
+  gcry_sexp_t *s_datas;
+  unsigned char **frames;
+  size_t *nframes;
+  int *paddings;
+  unsigned int n, idx;
+  char *keygrip, *desc;
+
+  for (item = prefetch_list; item; item = item->next)
+    {
+      if (item->done)
+        continue;
+
+      /* Collect all other PKESKs for the same key.  */
+      for (n=0, it = item; it; it = it->next)
+        if (!it->done && it->keyid[0] == item->keyid[0]
+            && it->keyid[1] == item->keyid[1])
+          {
+            it->done = 1;
+            n++;
+          }
+      if (n < 2)
+        continue;  /* Not worth the trouble.  */
+
+      pk = xtrycalloc (1, sizeof *pk);
+      if (!pk)
+        return;
+      keygrip = NULL;
+      s_datas = NULL;
+      frames = NULL;
+      nframes = NULL;
+      paddings = NULL;
+      if (get_pubkey (ctrl, pk, item->keyid)
+          || pk->pubkey_algo != item->pubkey_algo
+          || !(pk->pubkey_usage & PUBKEY_USAGE_ENC)
+          || !agent_probe_secret_key (ctrl, pk)
+          || hexkeygrip_from_pk (pk, &keygrip))
+        goto next;
+
+      s_datas = xtrycalloc (n, sizeof *s_datas);
+      frames = xtrycalloc (n, sizeof *frames);
+      nframes = xtrycalloc (n, sizeof *nframes);
+      paddings = xtrycalloc (n, sizeof *paddings);
+      if (!s_datas || !frames || !nframes || !paddings)
+        goto next;
+      for (idx=0, it = item; it; it = it->next)
+        if (it->keyid[0] == item->keyid[0] && it->keyid[1] == item->keyid[1]
+            && it->pubkey_algo == item->pubkey_algo)
+          s_datas[idx++] = it->s_data;
+      n = idx;
+
+      if (opt.verbose)
+        log_info (_("decrypting %u session keys with key %s\n"),
+                  n, keystr (item->keyid));
+      desc = gpg_format_keydesc (ctrl, pk, FORMAT_KEYDESC_NORMAL, 1);
+      err = agent_pkdecrypt_batch (ctrl, keygrip, desc, pk->keyid,
+                                   pk->main_keyid, pk->pubkey_algo,
+                                   s_datas, n, frames, nframes, paddings);
+      xfree (desc);
+      if (err)
+        {
+          if (opt.verbose)
+            log_info ("batch decryption failed: %s\n", gpg_strerror (err));
+          if (gpg_err_code (err) == GPG_ERR_CANCELED
+              || gpg_err_code (err) == GPG_ERR_FULLY_CANCELED)
+            item = NULL;  /* Stop prefetching.  */
+          goto next;
+        }
+
+      for (idx=0, it = item; it; it = it->next)
+        if (it->keyid[0] == item->keyid[0] && it->keyid[1] == item->keyid[1]
+            && it->pubkey_algo == item->pubkey_algo)
+          {
+            it->keygrip = xtrystrdup (keygrip);
+            if (it->keygrip)
+              {
+                it->frame = frames[idx];
+                it->nframe = nframes[idx];
+                it->padding = paddings[idx];
+              }
+            else
+              xfree (frames[idx]);
+            idx++;
+          }
+
+    next:
+      xfree (s_datas);
+      xfree (frames);
+      xfree (nframes);
+      xfree (paddings);
+      xfree (keygrip);
+      free_public_key (pk);
+      if (!item)
+        break;
+    }
+}
+
+
+/* Release all items registered for prefetching.  */
+void
+pubkey_enc_prefetch_release (void)
+{
+  prefetch_item_t item;
+
+  while ((item = prefetch_list))
+    {
+      prefetch_list = item->next;
+      gcry_sexp_release (item->s_data);
+      xfree (item->data);
+      xfree (item->keygrip);
+      if (item->frame)
+        {
+          wipememory (item->frame, item->nframe);
+          xfree (item->frame);
+        }
+      xfree (item);
+    }
+}
+
+
+/* Take the prefetched frame for the ciphertext S_DATA and the key
+ * KEYGRIP.  On success the frame is stored at R_FRAME which the caller
+ * needs to release, its length at R_NFRAME and the padding
+ * information at R_PADDING.  Returns false if no such frame
+ * exists.  */
+static int
+take_prefetched_frame (const char *keygrip, gcry_sexp_t s_data,
+                       byte **r_frame, size_t *r_nframe, int *r_padding)
+{
+  prefetch_item_t item;
+  unsigned char *data;
+  size_t datalen;
+
+  if (!prefetch_list || make_canon_sexp (s_data, &data, &datalen))
+    return 0;
+
+  for (item = prefetch_list; item; item = item->next)
+    if (item->frame && !strcmp (item->keygrip, keygrip)
+        && item->datalen == datalen && !memcmp (item->data, data, datalen))
+      break;
+  xfree (data);
+  if (!item)
+    return 0;
+
+  *r_frame = item->frame;
+  *r_nframe = item->nframe;
+  *r_padding = item->padding;
+  item->frame = NULL;
+  return 1;
+}
+
+
+/* Decrypt the PKESK ENC with the secret key SK which has the keyid
+ * KEYID and store the session key at DEK.  If TRIAL_FRAME is not NULL
+ * it is the already decrypted frame of length TRIAL_NFRAME as
+ * returned by agent_pkdecrypt_trial; the function takes ownership of
+ * it.  */
 static gpg_error_t
 get_it (ctrl_t ctrl,
-        struct pubkey_enc_list *enc, DEK *dek, PKT_public_key *sk, u32 *keyid)
+        struct pubkey_enc_list *enc, DEK *dek, PKT_public_key *sk, u32 *keyid,
+        byte *trial_frame, size_t trial_nframe)
 {
   gpg_error_t err;
   byte *frame = NULL;
@@ -207,35 +861,7 @@ get_it (ctrl_t ctrl,
     goto leave;
 
   /* Convert the data to an S-expression.  */
-  if (sk->pubkey_algo == PUBKEY_ALGO_ELGAMAL
-      || sk->pubkey_algo == PUBKEY_ALGO_ELGAMAL_E)
-    {
-      if (!enc->data[0] || !enc->data[1])
-        err = gpg_error (GPG_ERR_BAD_MPI);
-      else
-        err = gcry_sexp_build (&s_data, NULL, "(enc-val(elg(a%m)(b%m)))",
-                               enc->data[0], enc->data[1]);
-    }
-  else if (sk->pubkey_algo == PUBKEY_ALGO_RSA
-           || sk->pubkey_algo == PUBKEY_ALGO_RSA_E)
-    {
-      if (!enc->data[0])
-        err = gpg_error (GPG_ERR_BAD_MPI);
-      else
-        err = gcry_sexp_build (&s_data, NULL, "(enc-val(rsa(a%m)))",
-                               enc->data[0]);
-    }
-  else if (sk->pubkey_algo == PUBKEY_ALGO_ECDH)
-    {
-      if (!enc->data[0] || !enc->data[1])
-        err = gpg_error (GPG_ERR_BAD_MPI);
-      else
-        err = gcry_sexp_build (&s_data, NULL, "(enc-val(ecdh(s%m)(e%m)))",
-                               enc->data[1], enc->data[0]);
-    }
-  else
-    err = gpg_error (GPG_ERR_BUG);
-
+  err = build_enc_sexp (sk->pubkey_algo, enc->data, &s_data);
   if (err)
     goto leave;
 
@@ -245,12 +871,26 @@ get_it (ctrl_t ctrl,
       log_assert (fpn == 20);
     }
 
-  /* Decrypt. */
-  desc = gpg_format_keydesc (ctrl, sk, FORMAT_KEYDESC_NORMAL, 1);
-  err = agent_pkdecrypt (NULL, keygrip,
-                         desc, sk->keyid, sk->main_keyid, sk->pubkey_algo,
-                         s_data, &frame, &nframe, &padding);
-  xfree (desc);
+  /* Decrypt unless we already did this with pubkey_enc_prefetch or
+   * try_hidden_recipients.  */
+  if (trial_frame)
+    {
+      frame = trial_frame;
+      nframe = trial_nframe;
+      trial_frame = NULL;
+      padding = -1;
+      err = 0;
+    }
+  else if (take_prefetched_frame (keygrip, s_data, &frame, &nframe, &padding))
+    err = 0;
+  else
+    {
+      desc = gpg_format_keydesc (ctrl, sk, FORMAT_KEYDESC_NORMAL, 1);
+      err = agent_pkdecrypt (NULL, keygrip,
+                             desc, sk->keyid, sk->main_keyid, sk->pubkey_algo,
+                             s_data, &frame, &nframe, &padding);
+      xfree (desc);
+    }
   gcry_sexp_release (s_data);
   if (err)
     goto leave;
@@ -472,6 +1112,11 @@ get_it (ctrl_t ctrl,
   }
 
  leave:
+  if (trial_frame)
+    {
+      wipememory (trial_frame, trial_nframe);
+      xfree (trial_frame);
+    }
   xfree (frame);
   xfree (keygrip);
   return err;
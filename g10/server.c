@@ -51,6 +51,9 @@ struct server_local_s
   /* List of prepared recipients.  */
   pk_list_t recplist;
 
+  /* List of the user ids of the signers set by SIGNER.  */
+  strlist_t signerlist;
+
   /* Set if pinentry notifications should be passed back to the
      client. */
   int allow_pinentry_notify;
@@ -69,6 +72,63 @@ close_message_fd (ctrl_t ctrl)
     }
 }
 
+
+/* Note that it is sufficient to allocate the target string D as
+   long as the source string S, i.e.: strlen(s)+1; */
+static void
+strcpy_escaped_plus (char *d, const char *s)
+{
+  while (*s)
+    {
+      if (*s == '%' && s[1] && s[2])
+        {
+          s++;
+          *d++ = xtoi_2 (s);
+          s += 2;
+        }
+      else if (*s == '+')
+        *d++ = ' ', s++;
+      else
+        *d++ = *s++;
+    }
+  *d = 0;
+}
+
+
+/* Break LINE down into a string list and store it at R_LIST.  The
+ * words are plus-percent unescaped.  */
+static gpg_error_t
+line_to_strlist (char *line, strlist_t *r_list)
+{
+  char *p;
+  strlist_t list, sl;
+
+  list = NULL;
+  for (p=line; *p; line = p)
+    {
+      while (*p && *p != ' ')
+        p++;
+      if (*p)
+        *p++ = 0;
+      if (*line)
+        {
+          sl = xtrymalloc (sizeof *sl + strlen (line));
+          if (!sl)
+            {
+              gpg_error_t err = gpg_error_from_syserror ();
+              free_strlist (list);
+              return err;
+            }
+          sl->flags = 0;
+          strcpy_escaped_plus (sl->d, line);
+          sl->next = list;
+          list = sl;
+        }
+    }
+  *r_list = list;
+  return 0;
+}
+
 
 /* Called by libassuan for Assuan options.  See the Assuan manual for
    details. */
@@ -126,6 +186,8 @@ reset_notify (assuan_context_t ctx, char *line)
 
   release_pk_list (ctrl->server_local->recplist);
   ctrl->server_local->recplist = NULL;
+  free_strlist (ctrl->server_local->signerlist);
+  ctrl->server_local->signerlist = NULL;
 
   close_message_fd (ctrl);
   assuan_close_input_fd (ctx);
@@ -234,9 +296,30 @@ cmd_recipient (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_signer (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  strlist_t sl = NULL;
+  SK_LIST sk_list = NULL;
+
+  if (!*line)
+    return set_error (GPG_ERR_ASS_PARAMETER, "no user id given");
+
+  /* Check the key now so that the client gets an error right here;
+   * the actual signing key is selected again by SIGN.  */
+  add_to_strlist (&sl, line);
+  err = build_sk_list (ctrl, sl, &sk_list, PUBKEY_USAGE_SIG);
+  release_sk_list (sk_list);
+  if (!err)
+    {
+      sl->next = ctrl->server_local->signerlist;
+      ctrl->server_local->signerlist = sl;
+      sl = NULL;
+    }
+  free_strlist (sl);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "SIGNER", gpg_strerror (err));
+  return err;
 }
 
 
@@ -428,9 +511,31 @@ cmd_verify (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_sign (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  int inp_fd, out_fd;
+  int detached;
+
+  detached = has_option (line, "--detached");
+
+  inp_fd = translate_sys2libc_fd (assuan_get_input_fd (ctx), 0);
+  if (inp_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_INPUT, NULL);
+  out_fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+  if (out_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_OUTPUT, NULL);
+
+  err = sign_file_fd (ctrl, inp_fd, out_fd, detached,
+                      ctrl->server_local->signerlist);
+
+  /* Close and reset the fds. */
+  close_message_fd (ctrl);
+  assuan_close_input_fd (ctx);
+  assuan_close_output_fd (ctx);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "SIGN", gpg_strerror (err));
+  return err;
 }
 
 
@@ -442,9 +547,40 @@ cmd_sign (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_import (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  int inp_fd;
+  estream_t fp;
+  import_stats_t stats;
+
+  (void)line; /* LINE is not used.  */
+
+  inp_fd = translate_sys2libc_fd (assuan_get_input_fd (ctx), 0);
+  if (inp_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_INPUT, NULL);
+
+  fp = es_fdopen_nc (inp_fd, "rb");
+  if (!fp)
+    err = set_error (gpg_err_code_from_syserror (), "fdopen() failed");
+  else
+    {
+      stats = import_new_stats_handle ();
+      err = import_keys_es_stream (ctrl, fp, stats, NULL, NULL,
+                                   opt.import_options, NULL, NULL,
+                                   KEYORG_UNKNOWN, NULL);
+      import_print_stats (stats);
+      import_release_stats_handle (stats);
+      es_fclose (fp);
+    }
+
+  /* Close and reset the fds. */
+  close_message_fd (ctrl);
+  assuan_close_input_fd (ctx);
+  assuan_close_output_fd (ctx);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "IMPORT", gpg_strerror (err));
+  return err;
 }
 
 
@@ -462,23 +598,62 @@ cmd_import (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_export (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  strlist_t list;
+  int out_fd;
+
+  if (has_option (line, "--data"))
+    return set_error (GPG_ERR_NOT_IMPLEMENTED, "option --data");
+  line = skip_options (line);
+
+  out_fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+  if (out_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_OUTPUT, NULL);
+
+  err = line_to_strlist (line, &list);
+  if (!err)
+    err = export_pubkeys_fd (ctrl, list, opt.export_options, NULL, out_fd);
+  free_strlist (list);
+
+  /* Close and reset the fds. */
+  close_message_fd (ctrl);
+  assuan_close_input_fd (ctx);
+  assuan_close_output_fd (ctx);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "EXPORT", gpg_strerror (err));
+  return err;
 }
 
 
 
-/*  DELKEYS
+/*  DELKEYS <fingerprints>
 
-    Fixme
+    Delete the public keys given by their fingerprints.  The usual
+    rules of --delete-keys apply; in particular the server needs to
+    run with --batch and --yes.
 */
 static gpg_error_t
 cmd_delkeys (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  strlist_t list;
+
+  err = line_to_strlist (line, &list);
+  if (!err)
+    {
+      if (!list)
+        err = set_error (GPG_ERR_NO_USER_ID, "no key given");
+      else
+        err = delete_keys (ctrl, list, 0, 0);
+    }
+  free_strlist (list);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "DELKEYS", gpg_strerror (err));
+  return err;
 }
 
 
@@ -753,6 +928,7 @@ gpg_server (ctrl_t ctrl)
   if (ctrl->server_local)
     {
       release_pk_list (ctrl->server_local->recplist);
+      free_strlist (ctrl->server_local->signerlist);
 
       xfree (ctrl->server_local);
       ctrl->server_local = NULL;
@@ -34,6 +34,8 @@
 #include "options.h"
 #include "pkglue.h"
 #include "../common/compliance.h"
+#include "workpool.h"
+#include "sigcache.h"
 
 static int check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 				gcry_md_hd_t digest,
@@ -458,56 +460,13 @@ check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 }
 
 
-/* This function is similar to check_signature_end, but it only checks
- * whether the signature was generated by PK.  It does not check
- * expiration, revocation, etc.  */
-static int
-check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
-                            gcry_md_hd_t digest,
-                            const void *extrahash, size_t extrahashlen)
+/* Hash the trailer of SIG into DIGEST and finalize it.  This
+ * completes the hashing started by the caller over the signed data.
+ * EXTRAHASH and EXTRAHASHLEN are as described for check_signature2.  */
+static void
+finish_signature_digest (PKT_signature *sig, gcry_md_hd_t digest,
+                         const void *extrahash, size_t extrahashlen)
 {
-  gcry_mpi_t result = NULL;
-  int rc = 0;
-  const struct weakhash *weak;
-
-  if (!opt.flags.allow_weak_digest_algos)
-    {
-      for (weak = opt.weak_digests; weak; weak = weak->next)
-        if (sig->digest_algo == weak->algo)
-          {
-            print_digest_rejected_note(sig->digest_algo);
-            return GPG_ERR_DIGEST_ALGO;
-          }
-    }
-
-  /* For key signatures check that the key has a cert usage.  We may
-   * do this only for subkeys because the primary may always issue key
-   * signature.  The latter may not be reflected in the pubkey_usage
-   * field because we need to check the key signatures to extract the
-   * key usage.  */
-  if (!pk->flags.primary
-      && IS_CERT (sig) && !(pk->pubkey_usage & PUBKEY_USAGE_CERT))
-    {
-      rc = gpg_error (GPG_ERR_WRONG_KEY_USAGE);
-      if (!opt.quiet)
-        log_info (_("bad key signature from key %s: %s (0x%02x, 0x%x)\n"),
-                  keystr_from_pk (pk), gpg_strerror (rc),
-                  sig->sig_class, pk->pubkey_usage);
-      return rc;
-    }
-
-  /* For data signatures check that the key has sign usage.  */
-  if (!IS_BACK_SIG (sig) && IS_SIG (sig)
-      && !(pk->pubkey_usage & PUBKEY_USAGE_SIG))
-    {
-      rc = gpg_error (GPG_ERR_WRONG_KEY_USAGE);
-      if (!opt.quiet)
-        log_info (_("bad data signature from key %s: %s (0x%02x, 0x%x)\n"),
-                  keystr_from_pk (pk), gpg_strerror (rc),
-                  sig->sig_class, pk->pubkey_usage);
-      return rc;
-    }
-
   /* Make sure the digest algo is enabled (in case of a detached
    * signature).  */
   gcry_md_enable (digest, sig->digest_algo);
@@ -588,20 +547,169 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
       buf[i++] = n;
       gcry_md_write (digest, buf, i);
     }
-    gcry_md_final( digest );
+  gcry_md_final (digest);
+}
+
+
+/* Hash the MPI A with a length prefix into MD.  */
+static void
+hash_sigcache_mpi (gcry_md_hd_t md, gcry_mpi_t a)
+{
+  const void *p;
+  unsigned char *buf = NULL;
+  unsigned int nbits;
+  size_t n;
+  byte lenbuf[4];
+
+  if (gcry_mpi_get_flag (a, GCRYMPI_FLAG_OPAQUE))
+    {
+      p = gcry_mpi_get_opaque (a, &nbits);
+      n = (nbits + 7) / 8;
+    }
+  else if (!gcry_mpi_aprint (GCRYMPI_FMT_USG, &buf, &n, a))
+    p = buf;
+  else
+    {
+      p = NULL;
+      n = 0;
+    }
+
+  lenbuf[0] = n >> 24;
+  lenbuf[1] = n >> 16;
+  lenbuf[2] = n >> 8;
+  lenbuf[3] = n;
+  gcry_md_write (md, lenbuf, 4);
+  if (p)
+    gcry_md_write (md, p, n);
+  gcry_free (buf);
+}
+
+
+/* Compute the key for the persistent signature cache for signature
+ * SIG made by PK.  DIGEST is the finalized hash over the signed
+ * material.  The key is stored at KEY which must have room for
+ * SIGCACHE_KEYLEN bytes.  Returns true on success.  */
+static int
+make_sigcache_key (byte *key, PKT_public_key *pk, PKT_signature *sig,
+                   gcry_md_hd_t digest)
+{
+  gcry_md_hd_t md;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  const byte *p;
+  int i, nsig;
+
+  nsig = pubkey_get_nsig (sig->pubkey_algo);
+  if (!nsig || !sig->data[0])
+    return 0;
+  p = gcry_md_read (digest, sig->digest_algo);
+  if (!p)
+    return 0;
+  if (gcry_md_open (&md, GCRY_MD_SHA256, 0))
+    return 0;
+
+  fingerprint_from_pk (pk, fpr, &fprlen);
+  gcry_md_write (md, fpr, fprlen);
+  gcry_md_putc (md, sig->pubkey_algo);
+  gcry_md_putc (md, sig->digest_algo);
+  gcry_md_write (md, p, gcry_md_get_algo_dlen (sig->digest_algo));
+  for (i=0; i < nsig && sig->data[i]; i++)
+    hash_sigcache_mpi (md, sig->data[i]);
+
+  memcpy (key, gcry_md_read (md, GCRY_MD_SHA256), SIGCACHE_KEYLEN);
+  gcry_md_close (md);
+  return 1;
+}
+
 
-    /* Convert the digest to an MPI.  */
-    result = encode_md_value (pk, digest, sig->digest_algo );
-    if (!result)
+/* This function is similar to check_signature_end, but it only checks
+ * whether the signature was generated by PK.  It does not check
+ * expiration, revocation, etc.  */
+static int
+check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
+                            gcry_md_hd_t digest,
+                            const void *extrahash, size_t extrahashlen)
+{
+  gcry_mpi_t result = NULL;
+  int rc = 0;
+  const struct weakhash *weak;
+  byte cachekey[SIGCACHE_KEYLEN];
+  int have_cachekey = 0;
+
+  if (!opt.flags.allow_weak_digest_algos)
+    {
+      for (weak = opt.weak_digests; weak; weak = weak->next)
+        if (sig->digest_algo == weak->algo)
+          {
+            print_digest_rejected_note(sig->digest_algo);
+            return GPG_ERR_DIGEST_ALGO;
+          }
+    }
+
+  /* For key signatures check that the key has a cert usage.  We may
+   * do this only for subkeys because the primary may always issue key
+   * signature.  The latter may not be reflected in the pubkey_usage
+   * field because we need to check the key signatures to extract the
+   * key usage.  */
+  if (!pk->flags.primary
+      && IS_CERT (sig) && !(pk->pubkey_usage & PUBKEY_USAGE_CERT))
+    {
+      rc = gpg_error (GPG_ERR_WRONG_KEY_USAGE);
+      if (!opt.quiet)
+        log_info (_("bad key signature from key %s: %s (0x%02x, 0x%x)\n"),
+                  keystr_from_pk (pk), gpg_strerror (rc),
+                  sig->sig_class, pk->pubkey_usage);
+      return rc;
+    }
+
+  /* For data signatures check that the key has sign usage.  */
+  if (!IS_BACK_SIG (sig) && IS_SIG (sig)
+      && !(pk->pubkey_usage & PUBKEY_USAGE_SIG))
+    {
+      rc = gpg_error (GPG_ERR_WRONG_KEY_USAGE);
+      if (!opt.quiet)
+        log_info (_("bad data signature from key %s: %s (0x%02x, 0x%x)\n"),
+                  keystr_from_pk (pk), gpg_strerror (rc),
+                  sig->sig_class, pk->pubkey_usage);
+      return rc;
+    }
+
+  finish_signature_digest (sig, digest, extrahash, extrahashlen);
+
+  /* Key signatures are verified over and over again; check whether
+   * an earlier process already verified this one.  */
+  if (IS_CERT (sig) && !opt.no_sig_cache)
+    have_cachekey = make_sigcache_key (cachekey, pk, sig, digest);
+
+  if (have_cachekey && sigcache_lookup (cachekey))
+    rc = 0;
+  else if (sig->flags.checked
+           && (sig->sig_class == 0x00 || sig->sig_class == 0x01))
+    {
+      /* Already verified by precheck_data_signatures; the result is
+       * used only once.  */
+      rc = sig->flags.valid? 0 : gpg_error (GPG_ERR_BAD_SIGNATURE);
+      sig->flags.checked = 0;
+      sig->flags.valid = 0;
+    }
+  else
+    {
+      /* Convert the digest to an MPI.  */
+      result = encode_md_value (pk, digest, sig->digest_algo );
+      if (!result)
         return GPG_ERR_GENERAL;
 
-    /* Verify the signature.  */
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("enter pk_verify");
-    rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("leave pk_verify");
-    gcry_mpi_release (result);
+      /* Verify the signature.  */
+      if (DBG_CLOCK && sig->sig_class <= 0x01)
+        log_clock ("enter pk_verify");
+      rc = pk_verify (pk, result, sig->data);
+      if (DBG_CLOCK && sig->sig_class <= 0x01)
+        log_clock ("leave pk_verify");
+      gcry_mpi_release (result);
+
+      if (!rc && have_cachekey)
+        sigcache_put (cachekey);
+    }
 
   if (!rc && sig->flags.unknown_critical)
     {
@@ -1254,3 +1362,515 @@ check_key_signature2 (ctrl_t ctrl,
 
   return rc;
 }
+
+
+/*
+ * Parallel verification of self-signatures.
+ */
+
+/* A verification job for the worker pool.  */
+struct sigjob_s
+{
+  struct workpool_job_s work;
+  PKT_public_key *pk;   /* The key used for verification.  */
+  PKT_signature *sig;   /* The signature to verify.  */
+  gcry_mpi_t hash;      /* The encoded digest of the signed data.  */
+  gpg_error_t err;      /* The result of pk_verify.  */
+  int have_cachekey;    /* CACHEKEY is valid.  */
+  byte cachekey[SIGCACHE_KEYLEN]; /* The key for the signature cache.  */
+};
+
+
+/* The job function for the worker pool.  pk_verify only works on
+ * its arguments and thus this is safe while the main thread waits
+ * for the batch; the S-expression cached in PK has already been
+ * built by collect_sigjobs.  */
+static void
+sigjob_verify (void *arg)
+{
+  struct sigjob_s *job = arg;
+
+  job->err = pk_verify (job->pk, job->hash, job->sig->data);
+}
+
+
+/* Return true if the signature SIG by the key PK can be verified by
+ * the pool.  This rejects all signatures for which
+ * check_signature_end_simple would print a diagnostic before the
+ * actual verification; those are left to the regular code so that
+ * the diagnostics are printed exactly once and in order.  */
+static int
+sigjob_acceptable (PKT_public_key *pk, PKT_signature *sig)
+{
+  const struct weakhash *weak;
+  size_t qbits;
+
+  if (sig->flags.unknown_critical)
+    return 0;
+  if (openpgp_pk_test_algo (sig->pubkey_algo)
+      || openpgp_md_test_algo (sig->digest_algo))
+    return 0;
+  if (sig->pubkey_algo != pk->pubkey_algo)
+    return 0;
+
+  if (!opt.flags.allow_weak_digest_algos)
+    for (weak = opt.weak_digests; weak; weak = weak->next)
+      if (sig->digest_algo == weak->algo)
+        return 0;
+
+  /* Mirror the checks of encode_md_value which would log an
+   * error.  */
+  if (pk->pubkey_algo == PUBKEY_ALGO_DSA
+      || pk->pubkey_algo == PUBKEY_ALGO_ECDSA)
+    {
+      qbits = gcry_mpi_get_nbits (pk->pkey[1]);
+      if (pk->pubkey_algo == PUBKEY_ALGO_ECDSA)
+        qbits = ecdsa_qbits_from_Q (qbits);
+      if ((qbits % 8) || qbits < 160)
+        return 0;
+      if (qbits > 512)
+        qbits = 512;
+      if (gcry_md_get_algo_dlen (sig->digest_algo) < qbits/8)
+        return 0;
+    }
+
+  return 1;
+}
+
+
+/* Add jobs for the self-signatures of KEYBLOCK to the array at R_JOBS
+ * with *R_NJOBS used and *R_JOBSIZE allocated items.  */
+static gpg_error_t
+collect_sigjobs (kbnode_t keyblock, struct sigjob_s **r_jobs,
+                 unsigned int *r_njobs, unsigned int *r_jobsize)
+{
+  PKT_public_key *pk;
+  kbnode_t node;
+  kbnode_t unode = NULL;  /* The last user id node.  */
+  kbnode_t snode = NULL;  /* The last subkey node.  */
+  PKT_signature *sig;
+  struct sigjob_s *tmp;
+  gcry_md_hd_t md;
+  gcry_mpi_t hash;
+  u32 keyid[2];
+  byte cachekey[SIGCACHE_KEYLEN];
+  int have_cachekey;
+
+  if (!keyblock || keyblock->pkt->pkttype != PKT_PUBLIC_KEY)
+    return 0;
+
+  pk = keyblock->pkt->pkt.public_key;
+  keyid_from_pk (pk, keyid);
+
+  for (node = keyblock->next; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_USER_ID)
+        {
+          unode = node;
+          continue;
+        }
+      if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        {
+          snode = node;
+          continue;
+        }
+      if (node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+
+      sig = node->pkt->pkt.signature;
+      if (sig->flags.checked
+          || keyid[0] != sig->keyid[0] || keyid[1] != sig->keyid[1])
+        continue;
+
+      if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
+        ;
+      else if (IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig))
+        {
+          if (!snode)
+            continue;
+        }
+      else if (IS_UID_SIG (sig) || IS_UID_REV (sig))
+        {
+          if (!unode)
+            continue;
+        }
+      else
+        continue;
+
+      if (!pk->flags.primary || !sigjob_acceptable (pk, sig))
+        continue;
+
+      /* The S-expression cached in PK must not be built by the
+       * workers.  */
+      if (pk_prepare_sexp (pk))
+        continue;
+
+      if (gcry_md_open (&md, sig->digest_algo, 0))
+        BUG ();
+      hash_public_key (md, pk);
+      if (IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig))
+        hash_public_key (md, snode->pkt->pkt.public_key);
+      else if (IS_UID_SIG (sig) || IS_UID_REV (sig))
+        hash_uid_packet (unode->pkt->pkt.user_id, md, sig);
+      finish_signature_digest (sig, md, NULL, 0);
+      have_cachekey = make_sigcache_key (cachekey, pk, sig, md);
+      if (have_cachekey && sigcache_lookup (cachekey))
+        {
+          gcry_md_close (md);
+          cache_sig_result (sig, 0);
+          continue;
+        }
+      hash = encode_md_value (pk, md, sig->digest_algo);
+      gcry_md_close (md);
+      if (!hash)
+        continue;
+
+      if (*r_njobs == *r_jobsize)
+        {
+          tmp = xtryrealloc (*r_jobs, (*r_jobsize + 16) * sizeof *tmp);
+          if (!tmp)
+            {
+              gcry_mpi_release (hash);
+              return gpg_error_from_syserror ();
+            }
+          *r_jobs = tmp;
+          *r_jobsize += 16;
+        }
+      tmp = *r_jobs + (*r_njobs)++;
+      tmp->pk = pk;
+      tmp->sig = sig;
+      tmp->hash = hash;
+      tmp->err = 0;
+      tmp->have_cachekey = have_cachekey;
+      if (have_cachekey)
+        memcpy (tmp->cachekey, cachekey, SIGCACHE_KEYLEN);
+    }
+
+  return 0;
+}
+
+
+/* Verify the self-signatures of the NKEYBLOCKS keyblocks in
+ * KEYBLOCKS in parallel and store the results in the signature cache
+ * flags.  This does not print anything and does not change the
+ * result of any later check_key_signature call; it merely lets those
+ * calls use the cached result.  The callers thus still process the
+ * signatures in keyblock order and their output is not affected.
+ * Signatures which need a key lookup or which already have a cached
+ * result are ignored, as are keyblocks not starting with a public
+ * key.  */
+void
+precheck_keyblock_signatures (ctrl_t ctrl,
+                              kbnode_t *keyblocks, unsigned int nkeyblocks)
+{
+  struct sigjob_s *jobs = NULL;
+  unsigned int njobs = 0;
+  unsigned int jobsize = 0;
+  unsigned int i;
+
+  (void)ctrl;
+
+  if (opt.no_sig_cache)
+    return;
+
+  for (i=0; i < nkeyblocks; i++)
+    if (collect_sigjobs (keyblocks[i], &jobs, &njobs, &jobsize))
+      goto leave;  /* Fallback to sequential checking.  */
+
+  /* A single job is not worth the thread switching.  */
+  if (njobs < 2 || !workpool_init ())
+    goto leave;
+
+  for (i=0; i < njobs; i++)
+    {
+      jobs[i].work.fnc = sigjob_verify;
+      jobs[i].work.arg = jobs + i;
+      workpool_submit (&jobs[i].work);
+    }
+  for (i=0; i < njobs; i++)
+    {
+      workpool_wait (&jobs[i].work);
+      cache_sig_result (jobs[i].sig, jobs[i].err);
+      if (!jobs[i].err && jobs[i].have_cachekey)
+        sigcache_put (jobs[i].cachekey);
+    }
+
+ leave:
+  for (i=0; i < njobs; i++)
+    gcry_mpi_release (jobs[i].hash);
+  xfree (jobs);
+}
+
+
+/* Verify the certifications on the user ids of the NKEYBLOCKS
+ * keyblocks in KEYBLOCKS in parallel.  Only the certifications for
+ * which FILTER, called with OPAQUE, returns true are considered.  The
+ * signing keys are looked up here, the public key operations are run
+ * by the worker pool.  Good results are stored in the signature cache
+ * and are thus used by the next check_key_signature for that
+ * certification; that call still does all the other checks and
+ * prints the diagnostics.  */
+void
+precheck_certifications (ctrl_t ctrl,
+                         kbnode_t *keyblocks, unsigned int nkeyblocks,
+                         int (*filter) (void *opaque, PKT_signature *sig),
+                         void *opaque)
+{
+  struct sigjob_s *jobs = NULL;
+  struct sigjob_s *tmp;
+  unsigned int njobs = 0;
+  unsigned int jobsize = 0;
+  unsigned int i;
+  kbnode_t node, unode;
+  PKT_public_key *pripk;
+  PKT_public_key *pk = NULL;
+  PKT_signature *sig;
+  gcry_md_hd_t md;
+  gcry_mpi_t hash;
+  u32 keyid[2];
+  byte cachekey[SIGCACHE_KEYLEN];
+
+  if (opt.no_sig_cache || !workpool_init ())
+    return;
+
+  for (i=0; i < nkeyblocks; i++)
+    {
+      if (!keyblocks[i] || keyblocks[i]->pkt->pkttype != PKT_PUBLIC_KEY)
+        continue;
+      pripk = keyblocks[i]->pkt->pkt.public_key;
+      keyid_from_pk (pripk, keyid);
+
+      unode = NULL;
+      for (node = keyblocks[i]->next; node; node = node->next)
+        {
+          if (node->pkt->pkttype == PKT_USER_ID)
+            {
+              unode = node;
+              continue;
+            }
+          if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+            unode = NULL;
+          if (!unode || node->pkt->pkttype != PKT_SIGNATURE)
+            continue;
+
+          /* Self-signatures are handled by
+           * precheck_keyblock_signatures and SHA-1 certifications
+           * are rejected anyway.  */
+          sig = node->pkt->pkt.signature;
+          if (sig->flags.checked
+              || !IS_CERT (sig) || !(IS_UID_SIG (sig) || IS_UID_REV (sig))
+              || (keyid[0] == sig->keyid[0] && keyid[1] == sig->keyid[1])
+              || (sig->digest_algo == DIGEST_ALGO_SHA1
+                  && !opt.flags.allow_weak_key_signatures)
+              || openpgp_md_test_algo (sig->digest_algo)
+              || !filter (opaque, sig))
+            continue;
+
+          if (!pk)
+            {
+              pk = xtrycalloc (1, sizeof *pk);
+              if (!pk)
+                goto leave;
+            }
+          pk->req_usage = PUBKEY_USAGE_CERT;
+          if (get_pubkey_for_sig (ctrl, pk, sig, NULL))
+            {
+              release_public_key_parts (pk);
+              memset (pk, 0, sizeof *pk);
+              continue;
+            }
+          if ((!pk->flags.primary && !(pk->pubkey_usage & PUBKEY_USAGE_CERT))
+              || !sigjob_acceptable (pk, sig))
+            {
+              release_public_key_parts (pk);
+              memset (pk, 0, sizeof *pk);
+              continue;
+            }
+
+          if (gcry_md_open (&md, sig->digest_algo, 0))
+            BUG ();
+          hash_public_key (md, pripk);
+          hash_uid_packet (unode->pkt->pkt.user_id, md, sig);
+          finish_signature_digest (sig, md, NULL, 0);
+          if (!make_sigcache_key (cachekey, pk, sig, md)
+              || sigcache_lookup (cachekey)
+              || !(hash = encode_md_value (pk, md, sig->digest_algo)))
+            {
+              gcry_md_close (md);
+              release_public_key_parts (pk);
+              memset (pk, 0, sizeof *pk);
+              continue;
+            }
+          gcry_md_close (md);
+
+          if (njobs == jobsize)
+            {
+              tmp = xtryrealloc (jobs, (jobsize + 16) * sizeof *tmp);
+              if (!tmp)
+                {
+                  gcry_mpi_release (hash);
+                  goto leave;
+                }
+              jobs = tmp;
+              jobsize += 16;
+            }
+          tmp = jobs + njobs++;
+          tmp->pk = pk;
+          tmp->sig = sig;
+          tmp->hash = hash;
+          tmp->err = 0;
+          tmp->have_cachekey = 1;
+          memcpy (tmp->cachekey, cachekey, SIGCACHE_KEYLEN);
+          pk = NULL;
+        }
+    }
+
+  /* A single job is not worth the thread switching.  */
+  if (njobs > 1)
+    {
+      for (i=0; i < njobs; i++)
+        {
+          jobs[i].work.fnc = sigjob_verify;
+          jobs[i].work.arg = jobs + i;
+          workpool_submit (&jobs[i].work);
+        }
+      for (i=0; i < njobs; i++)
+        {
+          workpool_wait (&jobs[i].work);
+          if (!jobs[i].err)
+            sigcache_put (jobs[i].cachekey);
+        }
+    }
+
+ leave:
+  if (pk)
+    free_public_key (pk);
+  for (i=0; i < njobs; i++)
+    {
+      gcry_mpi_release (jobs[i].hash);
+      free_public_key (jobs[i].pk);
+    }
+  xfree (jobs);
+}
+
+
+/* Same as precheck_keyblock_signatures for just one KEYBLOCK.  */
+void
+precheck_key_signatures (ctrl_t ctrl, kbnode_t keyblock)
+{
+  precheck_keyblock_signatures (ctrl, &keyblock, 1);
+}
+
+
+/* Verify the data signatures SIGS of a message in parallel.  NSIGS is
+ * the number of signatures and DIGEST the hash context over the
+ * signed data with all required algorithms enabled.  EXTRAHASH and
+ * EXTRAHASHLEN are as described for check_signature2.  The signing
+ * keys are looked up here, the public key operations are run by the
+ * worker pool.  The result of a good or bad signature is stored in
+ * the signature cache flags and then taken by the next
+ * check_signature2 for that signature.  The callers thus still check
+ * and print the signatures in order.  Signatures which would print a
+ * diagnostic or whose key is not available are left to the regular
+ * code.  */
+void
+precheck_data_signatures (ctrl_t ctrl, PKT_signature **sigs,
+                          unsigned int nsigs, gcry_md_hd_t digest,
+                          const void *extrahash, size_t extrahashlen)
+{
+  struct sigjob_s *jobs;
+  unsigned int njobs = 0;
+  unsigned int i;
+  PKT_signature *sig;
+  PKT_public_key *pk = NULL;
+  gcry_md_hd_t md;
+  gcry_mpi_t hash;
+
+  /* A single job is not worth the thread switching.  */
+  if (nsigs < 2 || DBG_CLOCK || !workpool_init ())
+    return;
+
+  jobs = xtrycalloc (nsigs, sizeof *jobs);
+  if (!jobs)
+    return;
+
+  for (i=0; i < nsigs; i++)
+    {
+      sig = sigs[i];
+      if (sig->flags.checked
+          || (sig->sig_class != 0x00 && sig->sig_class != 0x01))
+        continue;
+      if (openpgp_md_test_algo (sig->digest_algo)
+          || !gnupg_digest_is_allowed (opt.compliance, 0, sig->digest_algo)
+          || !gcry_md_is_enabled (digest, sig->digest_algo))
+        continue;
+
+      if (!pk)
+        {
+          pk = xtrycalloc (1, sizeof *pk);
+          if (!pk)
+            break;
+        }
+      if (get_pubkey_for_sig (ctrl, pk, sig, NULL))
+        {
+          release_public_key_parts (pk);
+          memset (pk, 0, sizeof *pk);
+          continue;
+        }
+      if (!pk->flags.valid
+          || !(pk->pubkey_usage & PUBKEY_USAGE_SIG)
+          || !gnupg_pk_is_allowed (opt.compliance, PK_USE_VERIFICATION,
+                                   pk->pubkey_algo, pk->pkey,
+                                   nbits_from_pk (pk), NULL)
+          || !sigjob_acceptable (pk, sig))
+        {
+          release_public_key_parts (pk);
+          memset (pk, 0, sizeof *pk);
+          continue;
+        }
+
+      if (gcry_md_copy (&md, digest))
+        BUG ();
+      finish_signature_digest (sig, md, extrahash, extrahashlen);
+      hash = encode_md_value (pk, md, sig->digest_algo);
+      gcry_md_close (md);
+      if (!hash)
+        {
+          release_public_key_parts (pk);
+          memset (pk, 0, sizeof *pk);
+          continue;
+        }
+
+      jobs[njobs].pk = pk;
+      jobs[njobs].sig = sig;
+      jobs[njobs].hash = hash;
+      njobs++;
+      pk = NULL;
+    }
+  if (pk)
+    free_public_key (pk);
+
+  if (njobs > 1)
+    {
+      for (i=0; i < njobs; i++)
+        {
+          jobs[i].work.fnc = sigjob_verify;
+          jobs[i].work.arg = jobs + i;
+          workpool_submit (&jobs[i].work);
+        }
+      for (i=0; i < njobs; i++)
+        {
+          workpool_wait (&jobs[i].work);
+          if (!jobs[i].err
+              || gpg_err_code (jobs[i].err) == GPG_ERR_BAD_SIGNATURE)
+            cache_sig_result (jobs[i].sig, jobs[i].err);
+        }
+    }
+
+  for (i=0; i < njobs; i++)
+    {
+      gcry_mpi_release (jobs[i].hash);
+      free_public_key (jobs[i].pk);
+    }
+  xfree (jobs);
+}
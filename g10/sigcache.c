@@ -0,0 +1,270 @@
+/* sigcache.c - Persistent cache of verified key signatures
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The signature cache remembers the key signatures which have been
+ * verified as good across invocations of gpg.  The flags in
+ * PKT_signature only live as long as the keyblock and the keybox
+ * does not store them; thus without this cache each process verifies
+ * all key signatures again.
+ *
+ * A cache entry is a SHA-256 hash over the fingerprint of the signing
+ * key, the digest of the signed material and the signature itself
+ * (see sig-check.c).  Thus an entry only matches exactly the same
+ * signature by the same key over the same data.  The file is a magic
+ * followed by the raw entries; new entries are appended in batches.
+ * As with the signature cache flags stored in keyring files, a user
+ * who does not trust the integrity of the home directory can use
+ * --no-sig-cache.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/i18n.h"
+#include "../common/host2net.h"
+#include "options.h"
+#include "sigcache.h"
+
+
+/* The name of the cache file in the home directory.  */
+#define SIGCACHE_NAME "sigcache.dat"
+
+/* The magic at the start of the file.  */
+#define SIGCACHE_MAGIC "GPGsigc1"
+#define SIGCACHE_MAGICLEN 8
+
+/* Start the file from scratch if it has more entries.  */
+#define SIGCACHE_MAX_ENTRIES (1024*1024)
+
+/* Number of new entries collected before they are written.  */
+#define SIGCACHE_BATCH 256
+
+
+static struct
+{
+  int loaded;           /* The file has been read.  */
+  int rewrite;          /* Truncate the file on the next flush.  */
+  char *fname;          /* The name of the file.  */
+  byte *table;          /* Open addressing hash table of keys.  */
+  unsigned int size;    /* Number of slots in TABLE (power of 2).  */
+  unsigned int count;   /* Number of used slots.  */
+  byte *pending;        /* New keys to be written.  */
+  unsigned int npending;
+} sigcache;
+
+/* An all zero key marks an empty slot.  */
+static const byte empty_slot[SIGCACHE_KEYLEN];
+
+
+/* Return the slot of TABLE with SIZE slots for KEY.  This is either
+ * the slot holding KEY or an empty slot.  */
+static byte *
+find_slot (byte *table, unsigned int size, const byte *key)
+{
+  unsigned int idx;
+  byte *slot;
+
+  /* The keys are hash values and thus we can simply use some of
+   * their bits as index.  */
+  idx = buf32_to_uint (key);
+  for (;;)
+    {
+      slot = table + (idx & (size - 1)) * SIGCACHE_KEYLEN;
+      if (!memcmp (slot, key, SIGCACHE_KEYLEN)
+          || !memcmp (slot, empty_slot, SIGCACHE_KEYLEN))
+        return slot;
+      idx++;
+    }
+}
+
+
+/* Insert KEY into the hash table.  Returns 1 if it was added, 0 if
+ * it was already there and -1 on error.  */
+static int
+insert_key (const byte *key)
+{
+  byte *slot, *newtable;
+  unsigned int i, newsize;
+
+  if (!memcmp (key, empty_slot, SIGCACHE_KEYLEN))
+    return 0;  /* Can't be stored.  */
+
+  if (sigcache.count * 2 >= sigcache.size)
+    {
+      newsize = sigcache.size? sigcache.size * 2 : 1024;
+      newtable = xtrycalloc (newsize, SIGCACHE_KEYLEN);
+      if (!newtable)
+        return -1;
+      for (i=0; i < sigcache.size; i++)
+        {
+          slot = sigcache.table + i * SIGCACHE_KEYLEN;
+          if (memcmp (slot, empty_slot, SIGCACHE_KEYLEN))
+            memcpy (find_slot (newtable, newsize, slot),
+                    slot, SIGCACHE_KEYLEN);
+        }
+      xfree (sigcache.table);
+      sigcache.table = newtable;
+      sigcache.size = newsize;
+    }
+
+  slot = find_slot (sigcache.table, sigcache.size, key);
+  if (!memcmp (slot, key, SIGCACHE_KEYLEN))
+    return 0;
+  memcpy (slot, key, SIGCACHE_KEYLEN);
+  sigcache.count++;
+  return 1;
+}
+
+
+/* Read the cache file into the hash table.  */
+static void
+load_cache (void)
+{
+  estream_t fp;
+  byte buffer[SIGCACHE_KEYLEN];
+  size_t nread;
+  unsigned int nentries = 0;
+
+  sigcache.loaded = 1;
+  sigcache.fname = make_filename (gnupg_homedir (), SIGCACHE_NAME, NULL);
+
+  fp = es_fopen (sigcache.fname, "rb");
+  if (!fp)
+    return;  /* No cache yet.  */
+
+  if (es_read (fp, buffer, SIGCACHE_MAGICLEN, &nread)
+      || nread != SIGCACHE_MAGICLEN
+      || memcmp (buffer, SIGCACHE_MAGIC, SIGCACHE_MAGICLEN))
+    {
+      if (opt.verbose)
+        log_info (_("ignoring invalid signature cache '%s'\n"),
+                  sigcache.fname);
+      sigcache.rewrite = 1;
+      es_fclose (fp);
+      return;
+    }
+
+  /* A partial entry at the end is ignored.  */
+  while (!es_read (fp, buffer, SIGCACHE_KEYLEN, &nread)
+         && nread == SIGCACHE_KEYLEN)
+    {
+      if (++nentries > SIGCACHE_MAX_ENTRIES)
+        {
+          sigcache.rewrite = 1;
+          break;
+        }
+      if (insert_key (buffer) < 0)
+        break;
+    }
+  es_fclose (fp);
+}
+
+
+/* Return true if KEY is in the cache, i.e. the signature it
+ * describes has already been verified as good.  */
+int
+sigcache_lookup (const byte *key)
+{
+  if (opt.no_sig_cache)
+    return 0;
+  if (!sigcache.loaded)
+    load_cache ();
+  if (!sigcache.count)
+    return 0;
+
+  return !memcmp (find_slot (sigcache.table, sigcache.size, key),
+                  key, SIGCACHE_KEYLEN);
+}
+
+
+/* Add KEY describing a good signature to the cache.  */
+void
+sigcache_put (const byte *key)
+{
+  if (opt.no_sig_cache)
+    return;
+  if (!sigcache.loaded)
+    load_cache ();
+
+  if (insert_key (key) < 1)
+    return;
+
+  if (!sigcache.pending)
+    {
+      sigcache.pending = xtrymalloc (SIGCACHE_BATCH * SIGCACHE_KEYLEN);
+      if (!sigcache.pending)
+        return;
+    }
+  memcpy (sigcache.pending + sigcache.npending * SIGCACHE_KEYLEN,
+          key, SIGCACHE_KEYLEN);
+  if (++sigcache.npending == SIGCACHE_BATCH)
+    sigcache_flush ();
+}
+
+
+/* Write the new entries to the cache file.  This is called at
+ * exit.  */
+void
+sigcache_flush (void)
+{
+  estream_t fp;
+
+  if (!sigcache.npending && !sigcache.rewrite)
+    return;
+
+  /* We use append mode so that concurrent processes do not overwrite
+   * each other's entries.  */
+  fp = es_fopen (sigcache.fname,
+                 sigcache.rewrite? "wb,mode=-rw" : "ab,mode=-rw");
+  if (!fp)
+    goto leave;
+  if (es_fseek (fp, 0, SEEK_END) || es_ftello (fp) < 0)
+    goto leave;
+  if (!es_ftello (fp)
+      && es_write (fp, SIGCACHE_MAGIC, SIGCACHE_MAGICLEN, NULL))
+    goto leave;
+  if (sigcache.npending
+      && es_write (fp, sigcache.pending,
+                   sigcache.npending * SIGCACHE_KEYLEN, NULL))
+    goto leave;
+  if (es_fclose (fp))
+    {
+      fp = NULL;
+      goto leave;
+    }
+  fp = NULL;
+  sigcache.npending = 0;
+  sigcache.rewrite = 0;
+  return;
+
+ leave:
+  /* Failing to update the cache is not an error; the signatures are
+   * simply verified again next time.  */
+  if (opt.verbose)
+    log_info (_("error writing signature cache '%s': %s\n"),
+              sigcache.fname, strerror (errno));
+  es_fclose (fp);
+  sigcache.npending = 0;
+  sigcache.rewrite = 0;
+}
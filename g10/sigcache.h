@@ -0,0 +1,31 @@
+/* sigcache.h - Persistent cache of verified key signatures
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef GNUPG_G10_SIGCACHE_H
+#define GNUPG_G10_SIGCACHE_H
+
+/* The length of a key in the signature cache.  */
+#define SIGCACHE_KEYLEN 32
+
+int  sigcache_lookup (const byte *key);
+void sigcache_put (const byte *key);
+void sigcache_flush (void);
+
+#endif /*GNUPG_G10_SIGCACHE_H*/
@@ -404,18 +404,10 @@ hash_sigversion_to_magic (gcry_md_hd_t md, const PKT_signature *sig,
 }
 
 
-/* Perform the sign operation.  If CACHE_NONCE is given the agent is
- * advised to use that cached passphrase for the key.  SIGNHINTS has
- * hints so that we can do some additional checks. */
-static int
-do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
-	 gcry_md_hd_t md, int mdalgo,
-         const char *cache_nonce, unsigned int signhints)
+/* Check that the key PKSK has not been created after SIG.  */
+static gpg_error_t
+check_sign_time (PKT_public_key *pksk, PKT_signature *sig)
 {
-  gpg_error_t err;
-  byte *dp;
-  char *hexgrip;
-
   if (pksk->timestamp > sig->timestamp )
     {
       ulong d = pksk->timestamp - sig->timestamp;
@@ -427,6 +419,21 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
       if (!opt.ignore_time_conflict)
         return gpg_error (GPG_ERR_TIME_CONFLICT);
     }
+  return 0;
+}
+
+
+/* Check that the key PKSK may be used to create SIG over the digest
+ * in MD using the hash algorithm MDALGO (0 to use the one from MD) and
+ * prepare SIG for the signing.  SIGNHINTS has hints so that we can do
+ * some additional checks.  On success a pointer to the digest to sign
+ * is stored at R_DIGEST; SIG->DIGEST_ALGO has been set.  */
+static gpg_error_t
+do_sign_prepare (PKT_public_key *pksk, PKT_signature *sig,
+                 gcry_md_hd_t md, int mdalgo, unsigned int signhints,
+                 byte **r_digest)
+{
+  byte *dp;
 
   print_pubkey_algo_note (pksk->pubkey_algo);
 
@@ -442,8 +449,7 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
        * that this will render dsa1024 keys unsuitable for such
        * keysigs and in turn the WoT. */
       print_sha1_keysig_rejected_note ();
-      err = gpg_error (GPG_ERR_DIGEST_ALGO);
-      goto leave;
+      return gpg_error (GPG_ERR_DIGEST_ALGO);
     }
 
   /* Check compliance.  */
@@ -452,8 +458,7 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
       log_error (_("digest algorithm '%s' may not be used in %s mode\n"),
 		 gcry_md_algo_name (mdalgo),
 		 gnupg_compliance_option_string (opt.compliance));
-      err = gpg_error (GPG_ERR_DIGEST_ALGO);
-      goto leave;
+      return gpg_error (GPG_ERR_DIGEST_ALGO);
     }
 
   if (! gnupg_pk_is_allowed (opt.compliance, PK_USE_SIGNING, pksk->pubkey_algo,
@@ -462,18 +467,16 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
       log_error (_("key %s may not be used for signing in %s mode\n"),
                  keystr_from_pk (pksk),
                  gnupg_compliance_option_string (opt.compliance));
-      err = gpg_error (GPG_ERR_PUBKEY_ALGO);
-      goto leave;
+      return gpg_error (GPG_ERR_PUBKEY_ALGO);
     }
 
   if (!gnupg_rng_is_compliant (opt.compliance))
     {
-      err = gpg_error (GPG_ERR_FORBIDDEN);
       log_error (_("%s is not compliant with %s mode\n"),
                  "RNG",
                  gnupg_compliance_option_string (opt.compliance));
-      write_status_error ("random-compliance", err);
-      goto leave;
+      write_status_error ("random-compliance", gpg_error (GPG_ERR_FORBIDDEN));
+      return gpg_error (GPG_ERR_FORBIDDEN);
     }
 
   print_digest_algo_note (mdalgo);
@@ -486,41 +489,38 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
   mpi_release (sig->data[1]);
   sig->data[1] = NULL;
 
+  *r_digest = dp;
+  return 0;
+}
 
-  err = hexkeygrip_from_pk (pksk, &hexgrip);
-  if (!err)
-    {
-      char *desc;
-      gcry_sexp_t s_sigval;
-
-      desc = gpg_format_keydesc (ctrl, pksk, FORMAT_KEYDESC_NORMAL, 1);
-      err = agent_pksign (NULL/*ctrl*/, cache_nonce, hexgrip, desc,
-                          pksk->keyid, pksk->main_keyid, pksk->pubkey_algo,
-                          dp, gcry_md_get_algo_dlen (mdalgo), mdalgo,
-                          &s_sigval);
-      xfree (desc);
-
-      if (err)
-        ;
-      else if (pksk->pubkey_algo == GCRY_PK_RSA
-               || pksk->pubkey_algo == GCRY_PK_RSA_S)
-        sig->data[0] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
-      else if (openpgp_oid_is_ed25519 (pksk->pkey[0]))
-        {
-          sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_OPAQUE);
-          sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_OPAQUE);
-        }
-      else
-        {
-          sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_USG);
-          sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
-        }
 
-      gcry_sexp_release (s_sigval);
+/* Store the signature S_SIGVAL as returned by the agent for the key
+ * PKSK in SIG.  */
+static void
+sig_from_sigval (PKT_public_key *pksk, PKT_signature *sig,
+                 gcry_sexp_t s_sigval)
+{
+  if (pksk->pubkey_algo == GCRY_PK_RSA
+      || pksk->pubkey_algo == GCRY_PK_RSA_S)
+    sig->data[0] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
+  else if (openpgp_oid_is_ed25519 (pksk->pkey[0]))
+    {
+      sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_OPAQUE);
+      sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_OPAQUE);
     }
-  xfree (hexgrip);
+  else
+    {
+      sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_USG);
+      sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
+    }
+}
 
- leave:
+
+/* Print the result ERR of creating SIG with the key PKSK.  */
+static void
+print_sign_result (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
+                   gpg_error_t err)
+{
   if (err)
     log_error (_("signing failed: %s\n"), gpg_strerror (err));
   else
@@ -535,6 +535,132 @@ do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
           xfree (ustr);
 	}
     }
+}
+
+
+/* Ask the agent to sign the digest DP with the key PKSK and store the
+ * signature in SIG which has been prepared by do_sign_prepare.  If
+ * CACHE_NONCE is given the agent is advised to use that cached
+ * passphrase for the key.  */
+static gpg_error_t
+do_sign_digest (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
+                byte *dp, const char *cache_nonce)
+{
+  gpg_error_t err;
+  char *hexgrip;
+  char *desc;
+  gcry_sexp_t s_sigval;
+  int mdalgo = sig->digest_algo;
+
+  err = hexkeygrip_from_pk (pksk, &hexgrip);
+  if (err)
+    return err;
+
+  desc = gpg_format_keydesc (ctrl, pksk, FORMAT_KEYDESC_NORMAL, 1);
+  err = agent_pksign (NULL/*ctrl*/, cache_nonce, hexgrip, desc,
+                      pksk->keyid, pksk->main_keyid, pksk->pubkey_algo,
+                      dp, gcry_md_get_algo_dlen (mdalgo), mdalgo,
+                      &s_sigval);
+  xfree (desc);
+  xfree (hexgrip);
+
+  if (!err)
+    sig_from_sigval (pksk, sig, s_sigval);
+  gcry_sexp_release (s_sigval);
+  return err;
+}
+
+
+/* Perform the sign operation.  If CACHE_NONCE is given the agent is
+ * advised to use that cached passphrase for the key.  SIGNHINTS has
+ * hints so that we can do some additional checks. */
+static int
+do_sign (ctrl_t ctrl, PKT_public_key *pksk, PKT_signature *sig,
+	 gcry_md_hd_t md, int mdalgo,
+         const char *cache_nonce, unsigned int signhints)
+{
+  gpg_error_t err;
+  byte *dp;
+
+  err = check_sign_time (pksk, sig);
+  if (err)
+    return err;
+
+  err = do_sign_prepare (pksk, sig, md, mdalgo, signhints, &dp);
+  if (!err)
+    err = do_sign_digest (ctrl, pksk, sig, dp, cache_nonce);
+  print_sign_result (ctrl, pksk, sig, err);
+  return err;
+}
+
+
+/* Create the NSIGS signatures SIGS with the keys PKS over the digests
+ * DIGESTS using one request to the agent.  This allows the agent to
+ * create the signatures concurrently.  Returns GPG_ERR_NOT_SUPPORTED
+ * if this is not possible; the caller should then use do_sign for
+ * each signature.  */
+static gpg_error_t
+do_sign_multi (ctrl_t ctrl, PKT_public_key **pks, PKT_signature **sigs,
+               byte **digests, unsigned int nsigs, const char *cache_nonce)
+{
+  gpg_error_t err;
+  char **keygrips;
+  char **descs;
+  int *mdalgos;
+  gcry_sexp_t *s_sigvals;
+  unsigned int i;
+
+  /* With loopback the passphrase inquiries need to know the key.  */
+  if (nsigs < 2 || opt.pinentry_mode == PINENTRY_MODE_LOOPBACK)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  keygrips = xtrycalloc (nsigs, sizeof *keygrips);
+  descs = xtrycalloc (nsigs, sizeof *descs);
+  mdalgos = xtrycalloc (nsigs, sizeof *mdalgos);
+  s_sigvals = xtrycalloc (nsigs, sizeof *s_sigvals);
+  if (!keygrips || !descs || !mdalgos || !s_sigvals)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=0; i < nsigs; i++)
+    {
+      err = hexkeygrip_from_pk (pks[i], &keygrips[i]);
+      if (err)
+        goto leave;
+      descs[i] = gpg_format_keydesc (ctrl, pks[i], FORMAT_KEYDESC_NORMAL, 1);
+      mdalgos[i] = sigs[i]->digest_algo;
+    }
+
+  err = agent_pksign_multi (NULL/*ctrl*/, cache_nonce, nsigs,
+                            keygrips, descs, digests, mdalgos, s_sigvals);
+  if (gpg_err_code (err) == GPG_ERR_ASS_UNKNOWN_CMD)
+    {
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+
+  for (i=0; i < nsigs; i++)
+    {
+      if (!err)
+        sig_from_sigval (pks[i], sigs[i], s_sigvals[i]);
+      gcry_sexp_release (s_sigvals[i]);
+      print_sign_result (ctrl, pks[i], sigs[i], err);
+      if (err)
+        break;
+    }
+
+ leave:
+  if (keygrips)
+    for (i=0; i < nsigs; i++)
+      xfree (keygrips[i]);
+  if (descs)
+    for (i=0; i < nsigs; i++)
+      xfree (descs[i]);
+  xfree (keygrips);
+  xfree (descs);
+  xfree (mdalgos);
+  xfree (s_sigvals);
   return err;
 }
 
@@ -901,33 +1027,57 @@ write_plaintext_packet (iobuf_t out, iobuf_t inp,
 
 
 /*
- * Write the signatures from the SK_LIST to OUT. HASH must be a
- * non-finalized hash which will not be changes here.  EXTRAHASH is
- * either NULL or the extra data tro be hashed into v5 signatures.
+ * Write the signatures from the SK_LIST to OUT. MFX must have a
+ * non-finalized hash which will not be changes here; the context for
+ * each signature is taken from it using md_filter_get_md.  EXTRAHASH
+ * is either NULL or the extra data tro be hashed into v5 signatures.
  */
 static int
 write_signature_packets (ctrl_t ctrl,
-                         SK_LIST sk_list, IOBUF out, gcry_md_hd_t hash,
+                         SK_LIST sk_list, IOBUF out, md_filter_context_t *mfx,
                          pt_extra_hash_data_t extrahash,
                          int sigclass, u32 timestamp, u32 duration,
 			 int status_letter, const char *cache_nonce)
 {
   SK_LIST sk_rover;
+  PKT_public_key **pks = NULL;
+  PKT_signature **sigs = NULL;
+  gcry_md_hd_t *mds = NULL;
+  byte **digests = NULL;
+  unsigned int nsigs, i;
+  gpg_error_t err = 0;
+
+  for (nsigs=0, sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
+    nsigs++;
+  if (!nsigs)
+    return 0;
 
-  /* Loop over the certificates with secret keys. */
-  for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
+  pks = xtrycalloc (nsigs, sizeof *pks);
+  sigs = xtrycalloc (nsigs, sizeof *sigs);
+  mds = xtrycalloc (nsigs, sizeof *mds);
+  digests = xtrycalloc (nsigs, sizeof *digests);
+  if (!pks || !sigs || !mds || !digests)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Build the signature packets for all certificates with secret
+   * keys.  */
+  for (i=0, sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next, i++)
     {
       PKT_public_key *pk;
       PKT_signature *sig;
       gcry_md_hd_t md;
-      gpg_error_t err;
 
-      pk = sk_rover->pk;
+      pk = pks[i] = sk_rover->pk;
 
-      /* Build the signature packet.  */
-      sig = xtrycalloc (1, sizeof *sig);
+      sig = sigs[i] = xtrycalloc (1, sizeof *sig);
       if (!sig)
-        return gpg_error_from_syserror ();
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
 
       if (pk->version >= 5)
         sig->version = 5;  /* Required for v5 keys.  */
@@ -945,8 +1095,9 @@ write_signature_packets (ctrl_t ctrl,
         sig->expiredate = sig->timestamp + duration;
       sig->sig_class = sigclass;
 
-      if (gcry_md_copy (&md, hash))
+      if (gcry_md_copy (&mds[i], md_filter_get_md (mfx, sig->digest_algo)))
         BUG ();
+      md = mds[i];
 
       build_sig_subpkt_from_sig (sig, pk);
       mk_notation_policy_etc (ctrl, sig, NULL, pk);
@@ -958,32 +1109,66 @@ write_signature_packets (ctrl_t ctrl,
       gcry_md_final (md);
 
       if (!err)
-        err = do_sign (ctrl, pk, sig, md, hash_for (pk), cache_nonce, 0);
-      gcry_md_close (md);
+        err = check_sign_time (pk, sig);
       if (!err)
         {
-          /* Write the packet.  */
-          PACKET pkt;
-
-          init_packet (&pkt);
-          pkt.pkttype = PKT_SIGNATURE;
-          pkt.pkt.signature = sig;
-          err = build_packet (out, &pkt);
-          if (!err && is_status_enabled())
-            print_status_sig_created (pk, sig, status_letter);
-          free_packet (&pkt, NULL);
+          err = do_sign_prepare (pk, sig, md, hash_for (pk), 0, &digests[i]);
           if (err)
-            log_error ("build signature packet failed: %s\n",
-                       gpg_strerror (err));
-	}
-      else
-        free_seckey_enc (sig);
+            print_sign_result (ctrl, pk, sig, err);
+        }
+      if (err)
+        goto leave;
+    }
+
+  /* Create the signatures.  With several keys we ask the agent to
+   * create them at once so that it may do this concurrently.  */
+  err = do_sign_multi (ctrl, pks, sigs, digests, nsigs, cache_nonce);
+  if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+    {
+      for (err = 0, i=0; !err && i < nsigs; i++)
+        {
+          err = do_sign_digest (ctrl, pks[i], sigs[i], digests[i],
+                                cache_nonce);
+          print_sign_result (ctrl, pks[i], sigs[i], err);
+        }
+    }
+  if (err)
+    goto leave;
 
+  /* Write the packets in the order of SK_LIST.  */
+  for (i=0; i < nsigs; i++)
+    {
+      PACKET pkt;
+
+      init_packet (&pkt);
+      pkt.pkttype = PKT_SIGNATURE;
+      pkt.pkt.signature = sigs[i];
+      sigs[i] = NULL;
+      err = build_packet (out, &pkt);
+      if (!err && is_status_enabled())
+        print_status_sig_created (pks[i], pkt.pkt.signature, status_letter);
+      free_packet (&pkt, NULL);
       if (err)
-        return err;
+        {
+          log_error ("build signature packet failed: %s\n",
+                     gpg_strerror (err));
+          goto leave;
+        }
     }
 
-  return 0;
+ leave:
+  for (i=0; i < nsigs; i++)
+    {
+      if (sigs && sigs[i])
+        free_seckey_enc (sigs[i]);
+      if (mds)
+        gcry_md_close (mds[i]);
+    }
+  xfree (pks);
+  xfree (sigs);
+  xfree (mds);
+  xfree (digests);
+  return err;
 }
 
 
@@ -998,10 +1183,15 @@ write_signature_packets (ctrl_t ctrl,
  * If OUTFILE is not NULL; this file is used for output and the function
  * does not ask for overwrite permission; output is then always
  * uncompressed, non-armored and in binary mode.
+ * If INP_FD is not -1 the data is read from this file descriptor
+ * instead of FILENAMES.  If OUT_FD is not -1 the output is written to
+ * this file descriptor; OUTFILE must then be NULL.
  */
-int
-sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
-	   int encryptflag, strlist_t remusr, const char *outfile )
+static int
+do_sign_file (ctrl_t ctrl, strlist_t filenames, int inp_fd,
+              int detached, strlist_t locusr,
+              int encryptflag, strlist_t remusr,
+              const char *outfile, int out_fd)
 {
   const char *fname;
   armor_filter_context_t *afx;
@@ -1029,7 +1219,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
   efx.ctrl = ctrl;
   init_packet (&pkt);
 
-  if (filenames)
+  if (filenames && inp_fd == -1)
     {
       fname = filenames->d;
       multifile = !!filenames->next;
@@ -1063,7 +1253,10 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
     inp = NULL;     /* we do it later */
   else
     {
-      inp = iobuf_open(fname);
+      if (inp_fd != -1)
+        inp = iobuf_fdopen_nc (inp_fd, "rb");
+      else
+        inp = iobuf_open(fname);
       if (inp && is_secured_file (iobuf_get_fd (inp)))
         {
           iobuf_close (inp);
@@ -1099,7 +1292,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
       else if (opt.verbose)
         log_info (_("writing to '%s'\n"), outfile);
     }
-  else if ((rc = open_outfile (-1, fname,
+  else if ((rc = open_outfile (out_fd, fname,
                                opt.armor? 1 : detached? 2 : 0, 0, &out)))
     {
       goto leave;
@@ -1202,6 +1395,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 
   for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
     gcry_md_enable (mfx.md, hash_for (sk_rover->pk));
+  md_filter_setup_parallel (&mfx);
 
   if (!multifile)
     iobuf_push_filter (inp, md_filter, &mfx);
@@ -1328,7 +1522,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
     goto leave;
 
   /* Write the signatures. */
-  rc = write_signature_packets (ctrl, sk_list, out, mfx.md, extrahash,
+  rc = write_signature_packets (ctrl, sk_list, out, &mfx, extrahash,
                                 opt.textmode && !outfile? 0x01 : 0x00,
                                 0, duration, detached ? 'D':'S', NULL);
   if (rc)
@@ -1345,7 +1539,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
         write_status (STATUS_END_ENCRYPTION);
     }
   iobuf_close (inp);
-  gcry_md_close (mfx.md);
+  free_md_filter_context (&mfx);
   release_sk_list (sk_list);
   release_pk_list (pk_list);
   recipient_digest_algo = 0;
@@ -1356,6 +1550,26 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 }
 
 
+int
+sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
+	   int encryptflag, strlist_t remusr, const char *outfile )
+{
+  return do_sign_file (ctrl, filenames, -1, detached, locusr,
+                       encryptflag, remusr, outfile, -1);
+}
+
+
+/* Same as sign_file but read the data from INP_FD and write the
+ * signature to OUT_FD.  This is used by the server.  */
+int
+sign_file_fd (ctrl_t ctrl, int inp_fd, int out_fd, int detached,
+              strlist_t locusr)
+{
+  return do_sign_file (ctrl, NULL, inp_fd, detached, locusr, 0, NULL,
+                       NULL, out_fd);
+}
+
+
 /*
  * Make a clear signature.  Note that opt.armor is not needed.
  */
@@ -1366,6 +1580,7 @@ clearsign_file (ctrl_t ctrl,
   armor_filter_context_t *afx;
   progress_filter_context_t *pfx;
   gcry_md_hd_t textmd = NULL;
+  md_filter_context_t mfx;
   iobuf_t inp = NULL;
   iobuf_t out = NULL;
   PACKET pkt;
@@ -1482,7 +1697,9 @@ clearsign_file (ctrl_t ctrl,
   push_armor_filter (afx, out);
 
   /* Write the signatures.  */
-  rc = write_signature_packets (ctrl, sk_list, out, textmd, NULL, 0x01, 0,
+  memset (&mfx, 0, sizeof mfx);
+  mfx.md = textmd;
+  rc = write_signature_packets (ctrl, sk_list, out, &mfx, NULL, 0x01, 0,
                                 duration, 'C', NULL);
   if (rc)
     goto leave;
@@ -1602,6 +1819,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
 
   for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
     gcry_md_enable (mfx.md, hash_for (sk_rover->pk));
+  md_filter_setup_parallel (&mfx);
 
   iobuf_push_filter (inp, md_filter, &mfx);
 
@@ -1634,7 +1852,10 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
   if (default_compress_algo())
     {
       if (cfx.dek && (cfx.dek->use_mdc || cfx.dek->use_aead))
-        zfx.new_ctb = 1;
+        {
+          zfx.new_ctb = 1;
+          zfx.skip_incompressible = 1;
+        }
       push_compress_filter (out, &zfx,default_compress_algo() );
     }
 
@@ -1656,7 +1877,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
 
   /* Write the signatures.  */
   /* (current filters: zip - encrypt - armor) */
-  rc = write_signature_packets (ctrl, sk_list, out, mfx.md, extrahash,
+  rc = write_signature_packets (ctrl, sk_list, out, &mfx, extrahash,
                                 opt.textmode? 0x01 : 0x00,
                                 0, duration, 'S', NULL);
   if (rc)
@@ -1673,7 +1894,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
     }
   iobuf_close (inp);
   release_sk_list (sk_list);
-  gcry_md_close (mfx.md);
+  free_md_filter_context (&mfx);
   xfree (cfx.dek);
   xfree (s2k);
   release_progress_context (pfx);
@@ -152,6 +152,16 @@ import_ownertrust (ctrl_t ctrl, const char *fname )
 	return;
       }
 
+    /* Collect all updates and write them at once.  */
+    rc = tdbio_begin_transaction ();
+    if (rc)
+      {
+        log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc) );
+        if (!is_stdin)
+          es_fclose (fp);
+        return;
+      }
+
     while (es_fgets (line, DIM(line)-1, fp)) {
 	TRUSTREC rec;
 
@@ -228,7 +238,10 @@ import_ownertrust (ctrl_t ctrl, const char *fname )
     if (!is_stdin)
 	es_fclose (fp);
 
-    if (any)
+    rc = tdbio_end_transaction ();
+    if (rc)
+      log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc) );
+    else if (any)
       {
         revalidation_mark (ctrl);
         rc = tdbio_sync ();
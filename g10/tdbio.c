@@ -60,11 +60,14 @@
  * Yes, this is a very simple implementation. We should really
  * use a page aligned buffer and read complete pages.
  * To implement a simple trannsaction system, this is sufficient.
+ * All entries are linked via NEXT; the used ones are also in the hash
+ * table and the unused ones in the free list, both linked via HNEXT.
  */
 typedef struct cache_ctrl_struct *CACHE_CTRL;
 struct cache_ctrl_struct
 {
   CACHE_CTRL next;
+  CACHE_CTRL hnext;
   struct {
     unsigned used:1;
     unsigned dirty:1;
@@ -77,12 +80,22 @@ struct cache_ctrl_struct
    transaction this may not be sufficient and thus we may increase it
    then up to the HARD limit.  */
 #define MAX_CACHE_ENTRIES_SOFT	200
-#define MAX_CACHE_ENTRIES_HARD	10000
+#define MAX_CACHE_ENTRIES_HARD	200000
+
+/* Number of slots in the hash table used to find cached records.  */
+#define CACHE_HASH_SIZE 8192
+
+/* A hash list of the trustdb with this number of records is replaced
+ * by a hash table for the next byte of the key.  */
+#define HASHLIST_SPLIT_RECORDS 8
 
 
 /* The cache is controlled by these variables.  */
 static CACHE_CTRL cache_list;
+static CACHE_CTRL cache_hash[CACHE_HASH_SIZE];
+static CACHE_CTRL cache_unused;
 static int cache_entries;
+static int cache_dirty_entries;
 static int cache_is_dirty;
 
 
@@ -114,13 +127,16 @@ static unsigned int is_locked;
 /* The file descriptor of the trustdb.  */
 static int  db_fd = -1;
 
-/* A flag indicating that a transaction is active.  */
-/* static int in_transaction;   Not yet used. */
+/* A flag indicating that a transaction is active and another one
+ * indicating that the current transaction had to write records.  */
+static int in_transaction;
+static int transaction_flushed;
 
 
 
 static void open_db (void);
 static void create_hashtable (ctrl_t ctrl, TRUSTREC *vr, int type);
+static ulong append_new_records (int count);
 
 
 
@@ -188,6 +204,46 @@ release_write_lock (void)
  ************* record cache **********
  *************************************/
 
+/*
+ * Return the cache entry for RECNUM or NULL if it is not cached.
+ */
+static CACHE_CTRL
+find_cache_item (ulong recno)
+{
+  CACHE_CTRL r;
+
+  for (r = cache_hash[recno % CACHE_HASH_SIZE]; r; r = r->hnext)
+    if (r->recno == recno)
+      return r;
+  return NULL;
+}
+
+
+/*
+ * Remove the used entry R from the hash table and put it onto the
+ * list of unused entries.
+ */
+static void
+drop_cache_item (CACHE_CTRL r)
+{
+  CACHE_CTRL *rp;
+
+  for (rp = &cache_hash[r->recno % CACHE_HASH_SIZE]; *rp; rp = &(*rp)->hnext)
+    if (*rp == r)
+      {
+        *rp = r->hnext;
+        break;
+      }
+  if (r->flags.dirty)
+    cache_dirty_entries--;
+  r->flags.used = 0;
+  r->flags.dirty = 0;
+  r->hnext = cache_unused;
+  cache_unused = r;
+  cache_entries--;
+}
+
+
 /*
  * Get the data from the record cache and return a pointer into that
  * cache.  Caller should copy the returned data.  NULL is returned on
@@ -198,12 +254,8 @@ get_record_from_cache (ulong recno)
 {
   CACHE_CTRL r;
 
-  for (r = cache_list; r; r = r->next)
-    {
-      if (r->flags.used && r->recno == recno)
-        return r->data;
-    }
-  return NULL;
+  r = find_cache_item (recno);
+  return r? r->data : NULL;
 }
 
 
@@ -233,6 +285,8 @@ write_cache_item (CACHE_CTRL r)
                  r->recno, n, strerror (errno) );
       return err;
     }
+  if (r->flags.dirty)
+    cache_dirty_entries--;
   r->flags.dirty = 0;
   return 0;
 }
@@ -247,144 +301,77 @@ write_cache_item (CACHE_CTRL r)
 static int
 put_record_into_cache (ulong recno, const char *data)
 {
-  CACHE_CTRL r, unused;
-  int dirty_count = 0;
-  int clean_count = 0;
+  CACHE_CTRL r;
+  int clean_count;
 
   /* See whether we already cached this one.  */
-  for (unused = NULL, r = cache_list; r; r = r->next)
+  r = find_cache_item (recno);
+  if (r)
     {
-      if (!r->flags.used)
-        {
-          if (!unused)
-            unused = r;
-	}
-      else if (r->recno == recno)
+      if (!r->flags.dirty)
         {
-          if (!r->flags.dirty)
+          /* Hmmm: should we use a copy and compare? */
+          if (memcmp (r->data, data, TRUST_RECORD_LEN))
             {
-              /* Hmmm: should we use a copy and compare? */
-              if (memcmp (r->data, data, TRUST_RECORD_LEN))
-                {
-                  r->flags.dirty = 1;
-                  cache_is_dirty = 1;
-		}
-	    }
-          memcpy (r->data, data, TRUST_RECORD_LEN);
-          return 0;
-	}
-      if (r->flags.used)
-        {
-          if (r->flags.dirty)
-            dirty_count++;
-          else
-            clean_count++;
-	}
-    }
-
-  /* Not in the cache: add a new entry. */
-  if (unused)
-    {
-      /* Reuse this entry. */
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
-    }
-
-  /* See whether we reached the limit. */
-  if (cache_entries < MAX_CACHE_ENTRIES_SOFT)
-    {
-      /* No: Put into cache.  */
-      r = xmalloc (sizeof *r);
-      r->flags.used = 1;
-      r->recno = recno;
+              r->flags.dirty = 1;
+              cache_dirty_entries++;
+              cache_is_dirty = 1;
+            }
+        }
       memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      r->next = cache_list;
-      cache_list = r;
-      cache_is_dirty = 1;
-      cache_entries++;
       return 0;
     }
 
-  /* Cache is full: discard some clean entries.  */
-  if (clean_count)
+  /* Not in the cache: make room for a new entry unless we have an
+   * unused one or did not yet reach the limit.  */
+  clean_count = cache_entries - cache_dirty_entries;
+  if (cache_unused || cache_entries < MAX_CACHE_ENTRIES_SOFT)
+    ;
+  else if (clean_count)
     {
       int n;
 
-      /* We discard a third of the clean entries.  */
+      /* Cache is full: We discard a third of the clean entries.  */
       n = clean_count / 3;
       if (!n)
         n = 1;
 
-      for (unused = NULL, r = cache_list; r; r = r->next)
+      for (r = cache_list; r && n; r = r->next)
         {
           if (r->flags.used && !r->flags.dirty)
             {
-              if (!unused)
-                unused = r;
-              r->flags.used = 0;
-              cache_entries--;
-              if (!--n)
-                break;
+              drop_cache_item (r);
+              n--;
 	    }
 	}
-
-      /* Now put into the cache.  */
-      log_assert (unused);
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
     }
-
-  /* No clean entries: We have to flush some dirty entries.  */
-#if 0 /* Transactions are not yet used.  */
-  if (in_transaction)
+  else if (in_transaction && cache_entries < MAX_CACHE_ENTRIES_HARD)
     {
-      /* But we can't do this while in a transaction.  Thus we
-       * increase the cache size instead.  */
-      if (cache_entries < MAX_CACHE_ENTRIES_HARD)
-        {
-          if (opt.debug && !(cache_entries % 100))
-            log_debug ("increasing tdbio cache size\n");
-          r = xmalloc (sizeof *r);
-          r->flags.used = 1;
-          r->recno = recno;
-          memcpy (r->data, data, TRUST_RECORD_LEN);
-          r->flags.dirty = 1;
-          r->next = cache_list;
-          cache_list = r;
-          cache_is_dirty = 1;
-          cache_entries++;
-          return 0;
-	}
-      /* Hard limit for the cache size reached.  */
-      log_info (_("trustdb transaction too large\n"));
-      return GPG_ERR_RESOURCE_LIMIT;
+      /* We can't flush dirty entries while in a transaction.  Thus
+       * we increase the cache size instead.  */
+      if (opt.debug && !(cache_entries % 1000))
+        log_debug ("increasing tdbio cache size\n");
     }
-#endif
-
-  if (dirty_count)
+  else
     {
       int n;
 
+      /* No clean entries: We have to flush some dirty entries.  If
+       * we are in a transaction this means that it is too large and
+       * can't be canceled anymore.  */
+      if (in_transaction && !transaction_flushed)
+        {
+          log_info (_("trustdb transaction too large\n"));
+          transaction_flushed = 1;
+        }
+
       /* Discard some dirty entries. */
-      n = dirty_count / 5;
+      n = cache_dirty_entries / 5;
       if (!n)
         n = 1;
 
       take_write_lock ();
-      for (unused = NULL, r = cache_list; r; r = r->next)
+      for (r = cache_list; r && n; r = r->next)
         {
           if (r->flags.used && r->flags.dirty)
             {
@@ -392,31 +379,39 @@ put_record_into_cache (ulong recno, const char *data)
 
               rc = write_cache_item (r);
               if (rc)
-                return rc;
-              if (!unused)
-                unused = r;
-              r->flags.used = 0;
-              cache_entries--;
-              if (!--n)
-                break;
+                {
+                  release_write_lock ();
+                  return rc;
+                }
+              drop_cache_item (r);
+              n--;
 	    }
 	}
       release_write_lock ();
-
-      /* Now put into the cache.  */
-      log_assert (unused);
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
     }
 
-  /* We should never reach this.  */
-  BUG();
+  /* Now put into the cache.  */
+  if (cache_unused)
+    {
+      r = cache_unused;
+      cache_unused = r->hnext;
+    }
+  else
+    {
+      r = xmalloc (sizeof *r);
+      r->next = cache_list;
+      cache_list = r;
+    }
+  r->flags.used = 1;
+  r->flags.dirty = 1;
+  r->recno = recno;
+  memcpy (r->data, data, TRUST_RECORD_LEN);
+  r->hnext = cache_hash[recno % CACHE_HASH_SIZE];
+  cache_hash[recno % CACHE_HASH_SIZE] = r;
+  cache_dirty_entries++;
+  cache_is_dirty = 1;
+  cache_entries++;
+  return 0;
 }
 
 
@@ -429,7 +424,8 @@ tdbio_is_dirty()
 
 
 /*
- * Flush the cache.  This cannot be used while in a transaction.
+ * Flush the cache.  While in a transaction this is deferred to
+ * tdbio_end_transaction.
  */
 int
 tdbio_sync()
@@ -439,10 +435,8 @@ tdbio_sync()
 
     if( db_fd == -1 )
 	open_db();
-#if 0 /* Transactions are not yet used.  */
     if( in_transaction )
-	log_bug("tdbio: syncing while in transaction\n");
-#endif
+	return 0;
 
     if( !cache_is_dirty )
 	return 0;
@@ -453,8 +447,11 @@ tdbio_sync()
     for( r = cache_list; r; r = r->next ) {
 	if( r->flags.used && r->flags.dirty ) {
 	    int rc = write_cache_item( r );
-	    if( rc )
+	    if( rc ) {
+		if (did_lock)
+		    release_write_lock ();
 		return rc;
+	    }
 	}
     }
     cache_is_dirty = 0;
@@ -465,17 +462,16 @@ tdbio_sync()
 }
 
 
-#if 0  /* Not yet used.  */
 /*
  * Simple transactions system:
  * Everything between begin_transaction and end/cancel_transaction
  * is not immediately written but at the time of end_transaction.
- *
- * NOTE: The transaction code is disabled in the 1.2 branch, as it is
- * not yet used.
+ * This is mainly used to batch a large number of updates into one
+ * sync.  If a transaction does not fit into the cache some records
+ * are written early and the transaction can't be canceled anymore.
  */
 int
-tdbio_begin_transaction ()  /* Not yet used.  */
+tdbio_begin_transaction ()
 {
   int rc;
 
@@ -486,11 +482,12 @@ tdbio_begin_transaction ()  /* Not yet used.  */
   if (rc)
     return rc;
   in_transaction = 1;
+  transaction_flushed = 0;
   return 0;
 }
 
 int
-tdbio_end_transaction ()  /* Not yet used.  */
+tdbio_end_transaction ()
 {
   int rc;
 
@@ -506,12 +503,18 @@ tdbio_end_transaction ()  /* Not yet used.  */
 }
 
 int
-tdbio_cancel_transaction () /* Not yet used.  */
+tdbio_cancel_transaction ()
 {
   CACHE_CTRL r;
 
   if (!in_transaction)
     log_bug ("tdbio: no active transaction\n");
+  in_transaction = 0;
+  if (transaction_flushed)
+    {
+      log_error (_("trustdb transaction too large\n"));
+      return gpg_error (GPG_ERR_RESOURCE_LIMIT);
+    }
 
   /* Remove all dirty marked entries, so that the original ones are
    * read back the next time.  */
@@ -520,18 +523,13 @@ tdbio_cancel_transaction () /* Not yet used.  */
       for (r = cache_list; r; r = r->next)
         {
           if (r->flags.used && r->flags.dirty)
-            {
-              r->flags.used = 0;
-              cache_entries--;
-	    }
+            drop_cache_item (r);
 	}
       cache_is_dirty = 0;
     }
 
-  in_transaction = 0;
   return 0;
 }
-#endif  /* Not yet used.  */
 
 
 
@@ -1033,6 +1031,71 @@ get_trusthashrec (ctrl_t ctrl)
 
 
 
+static int do_upd_hashtable (ctrl_t ctrl, ulong table, byte *key, int keylen,
+                             int level, ulong newrecnum);
+
+/*
+ * Replace the hash list starting at record ITEM by a new hash table
+ * for the next level of the key.  The list is referenced by slot MSB
+ * of the hash table record HTBLREC at LEVEL.  The items of the list
+ * must be trust records.  The new table is returned at R_TABLE.
+ *
+ * Return: 0 on success or an error code.
+ */
+static int
+split_hashlist (ctrl_t ctrl, TRUSTREC *htblrec, int msb, ulong item,
+                int level, ulong *r_table)
+{
+  TRUSTREC rec, tmp;
+  ulong table, recnum;
+  int i, n, rc;
+
+  /* The records of a table must be consecutive; thus we can't use
+   * free records.  */
+  n = (256+ITEMS_PER_HTBL_RECORD-1) / ITEMS_PER_HTBL_RECORD;
+  table = append_new_records (n);
+  for (i=0; i < n; i++)
+    {
+      memset (&rec, 0, sizeof rec);
+      rec.rectype = RECTYPE_HTBL;
+      rec.recnum = table + i;
+      rc = tdbio_write_record (ctrl, &rec);
+      if (rc)
+        return rc;
+    }
+
+  /* Move the items to the new table and release the list.  */
+  for (recnum = item; recnum; recnum = rec.r.hlst.next)
+    {
+      rc = tdbio_read_record (recnum, &rec, RECTYPE_HLST);
+      if (rc)
+        return rc;
+      for (i=0; i < ITEMS_PER_HLST_RECORD; i++)
+        {
+          if (!rec.r.hlst.rnum[i])
+            continue;
+          rc = tdbio_read_record (rec.r.hlst.rnum[i], &tmp, RECTYPE_TRUST);
+          if (!rc)
+            rc = do_upd_hashtable (ctrl, table, tmp.r.trust.fingerprint, 20,
+                                   level + 1, tmp.recnum);
+          if (rc)
+            return rc;
+        }
+      rc = tdbio_delete_record (ctrl, recnum);
+      if (rc)
+        return rc;
+    }
+
+  htblrec->r.htbl.item[msb % ITEMS_PER_HTBL_RECORD] = table;
+  rc = tdbio_write_record (ctrl, htblrec);
+  if (rc)
+    return rc;
+
+  *r_table = table;
+  return 0;
+}
+
+
 /*
  * Update a hashtable in the trustdb.  TABLE gives the start of the
  * table, KEY and KEYLEN are the key, NEWRECNUM is the record number
@@ -1042,11 +1105,20 @@ get_trusthashrec (ctrl_t ctrl)
  */
 static int
 upd_hashtable (ctrl_t ctrl, ulong table, byte *key, int keylen, ulong newrecnum)
+{
+  return do_upd_hashtable (ctrl, table, key, keylen, 0, newrecnum);
+}
+
+
+/* Worker for upd_hashtable starting at LEVEL of the key.  */
+static int
+do_upd_hashtable (ctrl_t ctrl, ulong table, byte *key, int keylen,
+                  int level, ulong newrecnum)
 {
   TRUSTREC lastrec, rec;
   ulong hashrec, item;
   int msb;
-  int level = 0;
+  int nlist;
   int rc, i;
 
   hashrec = table;
@@ -1097,7 +1169,7 @@ upd_hashtable (ctrl_t ctrl, ulong table, byte *key, int keylen, ulong newrecnum)
       else if (rec.rectype == RECTYPE_HLST) /* Extend the list.  */
         {
           /* Check whether the key is already in this list. */
-          for (;;)
+          for (nlist=1;; nlist++)
             {
               for (i=0; i < ITEMS_PER_HLST_RECORD; i++)
                 {
@@ -1120,6 +1192,24 @@ upd_hashtable (ctrl_t ctrl, ulong table, byte *key, int keylen, ulong newrecnum)
                 break; /* key is not in the list */
 	    }
 
+          /* If the list gets too long we replace it by a table for
+           * the next byte of the key.  lookup_hashtable has always
+           * been able to handle such nested tables.  */
+          if (nlist >= HASHLIST_SPLIT_RECORDS && level + 1 < keylen
+              && keylen == 20)
+            {
+              rc = split_hashlist (ctrl, &lastrec, msb, item, level,
+                                   &hashrec);
+              if (rc)
+                {
+                  log_error ("upd_hashtable: split hlst failed: %s\n",
+                             gpg_strerror (rc));
+                  return rc;
+                }
+              level++;
+              goto next_level;
+            }
+
           /* Find the next free entry and put it in.  */
           for (;;)
             {
@@ -1798,7 +1888,6 @@ tdbio_delete_record (ctrl_t ctrl, ulong recnum)
 ulong
 tdbio_new_recnum (ctrl_t ctrl)
 {
-  off_t offset;
   ulong recnum;
   TRUSTREC vr, rec;
   int rc;
@@ -1832,43 +1921,62 @@ tdbio_new_recnum (ctrl_t ctrl)
                    db_name, gpg_strerror (rc));
     }
   else /* Not found - append a new record.  */
+    recnum = append_new_records (1);
+
+  return recnum ;
+}
+
+
+/*
+ * Append COUNT unused records to the trustdb and return the record
+ * number of the first one.
+ */
+static ulong
+append_new_records (int count)
+{
+  off_t offset;
+  ulong recnum;
+  TRUSTREC rec;
+  int i, rc;
+
+  offset = lseek (db_fd, 0, SEEK_END);
+  if (offset == (off_t)(-1))
+    log_fatal ("trustdb: lseek to end failed: %s\n", strerror (errno));
+  recnum = offset / TRUST_RECORD_LEN;
+  log_assert (recnum); /* This will never be the first record */
+  /* We must write the records, so that the next call to this
+   * function returns other recnums.  */
+  memset (&rec, 0, sizeof rec);
+  rec.rectype = 0; /* unused record */
+  rc = 0;
+  if (lseek( db_fd, recnum * TRUST_RECORD_LEN, SEEK_SET) == -1)
     {
-      offset = lseek (db_fd, 0, SEEK_END);
-      if (offset == (off_t)(-1))
-        log_fatal ("trustdb: lseek to end failed: %s\n", strerror (errno));
-      recnum = offset / TRUST_RECORD_LEN;
-      log_assert (recnum); /* This will never be the first record */
-      /* We must write a record, so that the next call to this
-       * function returns another recnum.  */
-      memset (&rec, 0, sizeof rec);
-      rec.rectype = 0; /* unused record */
-      rec.recnum = recnum;
-      rc = 0;
-      if (lseek( db_fd, recnum * TRUST_RECORD_LEN, SEEK_SET) == -1)
-        {
-          rc = gpg_error_from_syserror ();
-          log_error (_("trustdb rec %lu: lseek failed: %s\n"),
-                     recnum, strerror (errno));
-	}
-      else
+      rc = gpg_error_from_syserror ();
+      log_error (_("trustdb rec %lu: lseek failed: %s\n"),
+                 recnum, strerror (errno));
+    }
+  else
+    {
+      for (i=0; i < count && !rc; i++)
         {
           int n;
 
+          rec.recnum = recnum + i;
           n = write (db_fd, &rec, TRUST_RECORD_LEN);
           if (n != TRUST_RECORD_LEN)
             {
               rc = gpg_error_from_syserror ();
               log_error (_("trustdb rec %lu: write failed (n=%d): %s\n"),
-                         recnum, n, gpg_strerror (rc));
-	    }
-	}
-
-      if (rc)
-        log_fatal (_("%s: failed to append a record: %s\n"),
-                   db_name, gpg_strerror (rc));
+                         recnum + i, n, gpg_strerror (rc));
+            }
+        }
     }
 
-  return recnum ;
+  if (rc)
+    log_fatal (_("%s: failed to append a record: %s\n"),
+               db_name, gpg_strerror (rc));
+
+  return recnum;
 }
 
 
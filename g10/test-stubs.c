@@ -225,6 +225,18 @@ keyserver_import_wkd (ctrl_t ctrl, const char *name, int quick,
   return GPG_ERR_BUG;
 }
 
+gpg_error_t
+keyserver_import_wkd_many (ctrl_t ctrl, char **mboxes, unsigned int nmboxes,
+                           unsigned int deadline, gpg_error_t *r_errs)
+{
+  (void)ctrl;
+  (void)mboxes;
+  (void)nmboxes;
+  (void)deadline;
+  (void)r_errs;
+  return GPG_ERR_BUG;
+}
+
 int
 keyserver_import_name (const char *name,struct keyserver_spec *spec)
 {
@@ -455,6 +467,31 @@ agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock)
   return gpg_error (GPG_ERR_NO_SECKEY);
 }
 
+gpg_error_t
+agent_probe_secret_keys (ctrl_t ctrl, kbnode_t keyblock,
+                         struct secret_key_rank_s **r_ranks)
+{
+  (void)ctrl;
+  (void)keyblock;
+  *r_ranks = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+int
+agent_secret_key_rank (struct secret_key_rank_s *ranks, PKT_public_key *pk)
+{
+  (void)ranks;
+  (void)pk;
+  return -1;
+}
+
+int
+agent_any_secret_key_rank (struct secret_key_rank_s *ranks)
+{
+  (void)ranks;
+  return 0;
+}
+
 gpg_error_t
 agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
                    char **r_serialno, int *r_cleartext)
@@ -42,6 +42,8 @@
 #include "../common/mkdir_p.h"
 #include "gpgsql.h"
 #include "../common/status.h"
+#include "../common/dotlock.h"
+#include "../common/sysutils.h"
 
 #include "tofu.h"
 
@@ -61,12 +63,30 @@
    To initialize this or get the current singleton, call opendbs().
    There is no need to explicitly release it; cleanup is done when the
    CTRL object is released.  */
+
+/* The number of transaction levels for which we keep the savepoint
+   statements prepared.  */
+#define SAVEPOINT_CACHE_LEVELS 4
+
+/* The journal of pending observations is merged into the database
+   once it has grown to this size.  */
+#define JOURNAL_MERGE_SIZE (32*1024)
+
 struct tofu_dbs_s
 {
   sqlite3 *db;
   char *want_lock_file;
   time_t want_lock_file_ctime;
 
+  /* The journal with pending observations (see --tofu-journal), the
+   * name used while merging it, and their locks.  */
+  char *journal_file;
+  char *journal_merge_file;
+  dotlock_t journal_lock;
+  dotlock_t journal_merge_lock;
+  /* Set if the journal is large enough to be merged.  */
+  int journal_needs_merge;
+
   struct
   {
     sqlite3_stmt *savepoint_batch;
@@ -75,6 +95,7 @@ struct tofu_dbs_s
     sqlite3_stmt *record_binding_get_old_policy;
     sqlite3_stmt *record_binding_update;
     sqlite3_stmt *get_policy_select_policy_and_conflict;
+    sqlite3_stmt *get_policy_prefetch_bindings;
     sqlite3_stmt *get_trust_bindings_with_this_email;
     sqlite3_stmt *get_trust_gather_other_user_ids;
     sqlite3_stmt *get_trust_gather_signature_stats;
@@ -82,11 +103,25 @@ struct tofu_dbs_s
     sqlite3_stmt *register_already_seen;
     sqlite3_stmt *register_signature;
     sqlite3_stmt *register_encryption;
+    sqlite3_stmt *show_statistics_signatures;
+    sqlite3_stmt *show_statistics_signature_days;
+    sqlite3_stmt *show_statistics_encryptions;
+    sqlite3_stmt *show_statistics_encryption_days;
+    sqlite3_stmt *savepoint_inner[SAVEPOINT_CACHE_LEVELS];
+    sqlite3_stmt *savepoint_release[SAVEPOINT_CACHE_LEVELS];
   } s;
 
   int in_batch_transaction;
   int in_transaction;
   time_t batch_update_started;
+
+  /* The bindings of the key with the fingerprint PREFETCH_FPR as
+   * read by get_prefetched_policy.  Each binding is given by 4
+   * strings: the email, the policy, the conflict and the effective
+   * policy.  This is only valid while we hold the batch
+   * transaction.  */
+  char *prefetch_fpr;
+  strlist_t prefetch_rows;
 };
 
 
@@ -163,6 +198,36 @@ tofu_policy_to_trust_level (enum tofu_policy policy)
 
 
 
+/* Forget the bindings cached by get_prefetched_policy.  This needs
+   to be called after any change to the bindings table and when the
+   batch transaction ends.  */
+static void
+drop_prefetched_bindings (tofu_dbs_t dbs)
+{
+  xfree (dbs->prefetch_fpr);
+  dbs->prefetch_fpr = NULL;
+  free_strlist (dbs->prefetch_rows);
+  dbs->prefetch_rows = NULL;
+}
+
+
+/* Execute the statement "VERB innerLEVEL;".  The statements for the
+   first levels are cached in the array CACHE, which has
+   SAVEPOINT_CACHE_LEVELS elements.  CACHE may be NULL.  */
+static int
+exec_savepoint (tofu_dbs_t dbs, sqlite3_stmt **cache, const char *verb,
+                int level, char **r_err)
+{
+  char sql[50];
+
+  snprintf (sql, sizeof sql, "%s inner%d;", verb, level);
+  return gpgsql_stepx (dbs->db,
+                       cache && level <= SAVEPOINT_CACHE_LEVELS
+                       ? &cache[level - 1] : NULL,
+                       NULL, NULL, r_err, sql, GPGSQL_ARG_END);
+}
+
+
 /* Start a transaction on DB.  If ONLY_BATCH is set, then this will
    start a batch transaction if we haven't started a batch transaction
    and one has been requested.  */
@@ -247,9 +312,8 @@ begin_transaction (ctrl_t ctrl, int only_batch)
   log_assert (dbs->in_transaction >= 0);
   dbs->in_transaction ++;
 
-  rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
-                           "savepoint inner%d;",
-                           dbs->in_transaction);
+  rc = exec_savepoint (dbs, dbs->s.savepoint_inner, "savepoint",
+                       dbs->in_transaction, &err);
   if (rc)
     {
       log_error (_("error beginning transaction on TOFU database: %s\n"),
@@ -292,6 +356,7 @@ end_transaction (ctrl_t ctrl, int only_batch)
            * batch mode.  */
           dbs->in_batch_transaction = 0;
           dbs->in_transaction = 0;
+          drop_prefetched_bindings (dbs);
 
           rc = gpgsql_stepx (dbs->db, &dbs->s.savepoint_batch_commit,
                              NULL, NULL, &err,
@@ -314,8 +379,8 @@ end_transaction (ctrl_t ctrl, int only_batch)
   log_assert (dbs);
   log_assert (dbs->in_transaction > 0);
 
-  rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
-                           "release inner%d;", dbs->in_transaction);
+  rc = exec_savepoint (dbs, dbs->s.savepoint_release, "release",
+                       dbs->in_transaction, &err);
 
   dbs->in_transaction --;
 
@@ -343,9 +408,8 @@ rollback_transaction (ctrl_t ctrl)
 
   /* Be careful to not undo any progress made by closed transactions in
      batch mode.  */
-  rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
-                           "rollback to inner%d;",
-                           dbs->in_transaction);
+  rc = exec_savepoint (dbs, NULL, "rollback to", dbs->in_transaction, &err);
+  drop_prefetched_bindings (dbs);
 
   dbs->in_transaction --;
 
@@ -978,6 +1042,9 @@ opendbs (ctrl_t ctrl)
           ctrl->tofu.dbs = xmalloc_clear (sizeof *ctrl->tofu.dbs);
           ctrl->tofu.dbs->db = db;
           ctrl->tofu.dbs->want_lock_file = xasprintf ("%s-want-lock", filename);
+          ctrl->tofu.dbs->journal_file = xasprintf ("%s-pending", filename);
+          ctrl->tofu.dbs->journal_merge_file
+            = xasprintf ("%s-pending.merge", filename);
         }
 
       xfree (filename);
@@ -1011,6 +1078,11 @@ tofu_closedbs (ctrl_t ctrl)
     sqlite3_finalize (*statements);
 
   sqlite3_close (dbs->db);
+  drop_prefetched_bindings (dbs);
+  dotlock_destroy (dbs->journal_lock);
+  dotlock_destroy (dbs->journal_merge_lock);
+  xfree (dbs->journal_file);
+  xfree (dbs->journal_merge_file);
   xfree (dbs->want_lock_file);
   xfree (dbs);
   ctrl->tofu.dbs = NULL;
@@ -1112,6 +1184,7 @@ record_binding (tofu_dbs_t dbs, const char *fingerprint, const char *email,
       goto leave;
     }
 
+  drop_prefetched_bindings (dbs);
   rc = gpgsql_stepx
     (dbs->db, &dbs->s.record_binding_update, NULL, NULL, &err,
      "insert or replace into bindings\n"
@@ -2030,6 +2103,52 @@ ask_about_binding (ctrl_t ctrl,
   signature_stats_free (stats);
 }
 
+/* Store the policy, the conflict and the effective policy of the
+ * binding <FINGERPRINT, EMAIL> at R_RESULTS in the same form as the
+ * query in get_policy.  If the binding is not known R_RESULTS is not
+ * changed.  All bindings of FINGERPRINT are read with one query and
+ * kept until the bindings table is changed or the batch transaction
+ * ends.  Thus a listing needs one query per key and not one for each
+ * user id.  Returns an SQLite error code and sets R_ERR on error.  */
+static int
+get_prefetched_policy (tofu_dbs_t dbs, const char *fingerprint,
+                       const char *email, strlist_t *r_results, char **r_err)
+{
+  strlist_t iter;
+  int rc;
+
+  log_assert (dbs->in_batch_transaction);
+
+  if (!dbs->prefetch_fpr || strcmp (dbs->prefetch_fpr, fingerprint))
+    {
+      drop_prefetched_bindings (dbs);
+      rc = gpgsql_stepx (dbs->db, &dbs->s.get_policy_prefetch_bindings,
+                         strings_collect_cb2, &dbs->prefetch_rows, r_err,
+                         "select email, policy, conflict, effective_policy"
+                         " from bindings where fingerprint = ?",
+                         GPGSQL_ARG_STRING, fingerprint,
+                         GPGSQL_ARG_END);
+      if (rc)
+        {
+          drop_prefetched_bindings (dbs);
+          return rc;
+        }
+      dbs->prefetch_fpr = xstrdup (fingerprint);
+    }
+
+  for (iter = dbs->prefetch_rows; iter; iter = iter->next->next->next->next)
+    if (!strcmp (iter->d, email))
+      {
+        add_to_strlist (r_results, iter->next->next->next->d);
+        add_to_strlist (r_results, iter->next->next->d);
+        add_to_strlist (r_results, iter->next->d);
+        break;
+      }
+
+  return 0;
+}
+
+
 /* Return the set of keys that conflict with the binding <fingerprint,
    email> (including the binding itself, which will be first in the
    list).  For each returned key also sets BINDING_NEW, etc.  */
@@ -2342,13 +2461,17 @@ get_policy (ctrl_t ctrl, tofu_dbs_t dbs, PKT_public_key *pk,
      (TOFU_POLICY_NONE cannot appear in the DB.  Thus, if POLICY is
      still TOFU_POLICY_NONE after executing the query, then the
      result set was empty.)  */
-  rc = gpgsql_stepx (dbs->db, &dbs->s.get_policy_select_policy_and_conflict,
-                      strings_collect_cb2, &results, &err,
-                      "select policy, conflict, effective_policy from bindings\n"
-                      " where fingerprint = ? and email = ?",
-                      GPGSQL_ARG_STRING, fingerprint,
-                      GPGSQL_ARG_STRING, email,
-                      GPGSQL_ARG_END);
+  if (dbs->in_batch_transaction)
+    rc = get_prefetched_policy (dbs, fingerprint, email, &results, &err);
+  else
+    rc = gpgsql_stepx
+      (dbs->db, &dbs->s.get_policy_select_policy_and_conflict,
+       strings_collect_cb2, &results, &err,
+       "select policy, conflict, effective_policy from bindings\n"
+       " where fingerprint = ? and email = ?",
+       GPGSQL_ARG_STRING, fingerprint,
+       GPGSQL_ARG_STRING, email,
+       GPGSQL_ARG_END);
   if (rc)
     {
       log_error (_("error reading TOFU database: %s\n"), err);
@@ -2818,6 +2941,7 @@ get_trust (ctrl_t ctrl, PKT_public_key *pk,
     {
       /* We don't immediately set the effective policy to 'ask,
          because  */
+      drop_prefetched_bindings (dbs);
       rc = gpgsql_exec_printf
         (dbs->db, NULL, NULL, &sqerr,
          "update bindings set effective_policy = %d, conflict = %Q"
@@ -3008,14 +3132,17 @@ show_statistics (tofu_dbs_t dbs,
   fingerprint_pp = format_hexfingerprint (fingerprint, NULL, 0);
 
   /* Get the signature stats.  */
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.show_statistics_signatures,
+     strings_collect_cb2, &strlist, &err,
      "select count (*), coalesce (min (signatures.time), 0),\n"
      "  coalesce (max (signatures.time), 0)\n"
      " from signatures\n"
      " left join bindings on signatures.binding = bindings.oid\n"
-     " where fingerprint = %Q and email = %Q;",
-     fingerprint, email);
+     " where fingerprint = ? and email = ?;",
+     GPGSQL_ARG_STRING, fingerprint,
+     GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_END);
   if (rc)
     {
       log_error (_("error reading TOFU database: %s\n"), err);
@@ -3024,15 +3151,18 @@ show_statistics (tofu_dbs_t dbs,
       rc = gpg_error (GPG_ERR_GENERAL);
       goto out;
     }
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.show_statistics_signature_days,
+     strings_collect_cb2, &strlist, &err,
      "select count (*) from\n"
      "  (select round(signatures.time / (24 * 60 * 60)) day\n"
      "    from signatures\n"
      "    left join bindings on signatures.binding = bindings.oid\n"
-     "    where fingerprint = %Q and email = %Q\n"
+     "    where fingerprint = ? and email = ?\n"
      "    group by day);",
-     fingerprint, email);
+     GPGSQL_ARG_STRING, fingerprint,
+     GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_END);
   if (rc)
     {
       log_error (_("error reading TOFU database: %s\n"), err);
@@ -3062,14 +3192,17 @@ show_statistics (tofu_dbs_t dbs,
     }
 
   /* Get the encryption stats.  */
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.show_statistics_encryptions,
+     strings_collect_cb2, &strlist, &err,
      "select count (*), coalesce (min (encryptions.time), 0),\n"
      "  coalesce (max (encryptions.time), 0)\n"
      " from encryptions\n"
      " left join bindings on encryptions.binding = bindings.oid\n"
-     " where fingerprint = %Q and email = %Q;",
-     fingerprint, email);
+     " where fingerprint = ? and email = ?;",
+     GPGSQL_ARG_STRING, fingerprint,
+     GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_END);
   if (rc)
     {
       log_error (_("error reading TOFU database: %s\n"), err);
@@ -3078,15 +3211,18 @@ show_statistics (tofu_dbs_t dbs,
       rc = gpg_error (GPG_ERR_GENERAL);
       goto out;
     }
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.show_statistics_encryption_days,
+     strings_collect_cb2, &strlist, &err,
      "select count (*) from\n"
      "  (select round(encryptions.time / (24 * 60 * 60)) day\n"
      "    from encryptions\n"
      "    left join bindings on encryptions.binding = bindings.oid\n"
-     "    where fingerprint = %Q and email = %Q\n"
+     "    where fingerprint = ? and email = ?\n"
      "    group by day);",
-     fingerprint, email);
+     GPGSQL_ARG_STRING, fingerprint,
+     GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_END);
   if (rc)
     {
       log_error (_("error reading TOFU database: %s\n"), err);
@@ -3296,6 +3432,390 @@ email_from_user_id (const char *user_id)
   return email;
 }
 
+/* Store the signature SIG_DIGEST with the binding <FINGERPRINT,
+   EMAIL> in the signatures table unless it is already known.  NOW is
+   the time the signature was observed.  */
+static gpg_error_t
+record_signature (tofu_dbs_t dbs, const char *fingerprint,
+                  const char *email, time_t sig_time,
+                  const char *sig_digest, const char *origin, time_t now)
+{
+  gpg_error_t rc;
+  char *sqlerr = NULL;
+  unsigned long c;
+
+  /* If we've already seen this signature before, then don't add
+     it again.  */
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.register_already_seen,
+     get_single_unsigned_long_cb2, &c, &sqlerr,
+     "select count (*)\n"
+     " from signatures left join bindings\n"
+     "  on signatures.binding = bindings.oid\n"
+     " where fingerprint = ? and email = ? and sig_time = ?\n"
+     "  and sig_digest = ?",
+     GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_LONG_LONG, (long long) sig_time,
+     GPGSQL_ARG_STRING, sig_digest,
+     GPGSQL_ARG_END);
+  if (rc)
+    {
+      log_error (_("error reading TOFU database: %s\n"), sqlerr);
+      print_further_info ("checking existence");
+      sqlite3_free (sqlerr);
+      rc = gpg_error (GPG_ERR_GENERAL);
+    }
+  else if (c > 1)
+    /* Duplicates!  This should not happen.  In particular,
+       because <fingerprint, email, sig_time, sig_digest> is the
+       primary key!  */
+    log_debug ("SIGNATURES DB contains duplicate records"
+               " <key: %s, email: %s, time: 0x%lx, sig: %s,"
+               " origin: %s>."
+               "  Please report.\n",
+               fingerprint, email, (unsigned long) sig_time,
+               sig_digest, origin);
+  else if (c == 1)
+    {
+      if (DBG_TRUST)
+        log_debug ("Already observed the signature and binding"
+                   " <key: %s, email: %s, time: 0x%lx, sig: %s,"
+                   " origin: %s>\n",
+                   fingerprint, email, (unsigned long) sig_time,
+                   sig_digest, origin);
+    }
+  else if (opt.dry_run)
+    {
+      log_info ("TOFU database update skipped due to --dry-run\n");
+    }
+  else
+    /* This is the first time that we've seen this signature and
+       binding.  Record it.  */
+    {
+      if (DBG_TRUST)
+        log_debug ("TOFU: Saving signature"
+                   " <key: %s, user id: %s, sig: %s>\n",
+                   fingerprint, email, sig_digest);
+
+      log_assert (c == 0);
+
+      rc = gpgsql_stepx
+        (dbs->db, &dbs->s.register_signature, NULL, NULL, &sqlerr,
+         "insert into signatures\n"
+         " (binding, sig_digest, origin, sig_time, time)\n"
+         " values\n"
+         " ((select oid from bindings\n"
+         "    where fingerprint = ? and email = ?),\n"
+         "  ?, ?, ?, ?);",
+         GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
+         GPGSQL_ARG_STRING, sig_digest, GPGSQL_ARG_STRING, origin,
+         GPGSQL_ARG_LONG_LONG, (long long) sig_time,
+         GPGSQL_ARG_LONG_LONG, (long long) now,
+         GPGSQL_ARG_END);
+      if (rc)
+        {
+          log_error (_("error updating TOFU database: %s\n"), sqlerr);
+          print_further_info ("insert signatures");
+          sqlite3_free (sqlerr);
+          rc = gpg_error (GPG_ERR_GENERAL);
+        }
+    }
+
+  return rc;
+}
+
+
+/* Store an encryption to the binding <FINGERPRINT, EMAIL> at time NOW
+   in the encryptions table.  */
+static gpg_error_t
+record_encryption (tofu_dbs_t dbs, const char *fingerprint,
+                   const char *email, time_t now)
+{
+  gpg_error_t rc;
+  char *sqlerr = NULL;
+
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.register_encryption, NULL, NULL, &sqlerr,
+     "insert into encryptions\n"
+     " (binding, time)\n"
+     " values\n"
+     " ((select oid from bindings\n"
+     "    where fingerprint = ? and email = ?),\n"
+     "  ?);",
+     GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_LONG_LONG, (long long) now,
+     GPGSQL_ARG_END);
+  if (rc)
+    {
+      log_error (_("error updating TOFU database: %s\n"), sqlerr);
+      print_further_info ("insert encryption");
+      sqlite3_free (sqlerr);
+      rc = gpg_error (GPG_ERR_GENERAL);
+    }
+
+  return rc;
+}
+
+
+/* Create the lock *R_LOCK for FNAME if needed and take it.  TIMEOUT
+   is passed to dotlock_take.  */
+static gpg_error_t
+take_journal_lock (dotlock_t *r_lock, const char *fname, long timeout)
+{
+  gpg_error_t err;
+
+  if (!*r_lock)
+    {
+      *r_lock = dotlock_create (fname, 0);
+      if (!*r_lock)
+        {
+          err = gpg_error_from_syserror ();
+          log_info ("can't allocate lock for '%s': %s\n",
+                    fname, gpg_strerror (err));
+          return err;
+        }
+    }
+
+  if (dotlock_take (*r_lock, timeout))
+    {
+      err = gpg_error_from_syserror ();
+      /* A failure to get the merge lock is expected.  */
+      if (timeout)
+        log_info ("can't lock '%s': %s\n", fname, gpg_strerror (err));
+      return err;
+    }
+
+  return 0;
+}
+
+
+/* Append the observation LINE to the journal of pending
+   observations.  The journal is merged into the database by
+   merge_journal.  Appending a line to a file does not need to wait
+   for other processes using the database and can be done without
+   syncing the file.  */
+static gpg_error_t
+append_to_journal (tofu_dbs_t dbs, const char *line)
+{
+  gpg_error_t err;
+  estream_t fp;
+  struct stat statbuf;
+
+  if (opt.dry_run)
+    {
+      log_info ("TOFU database update skipped due to --dry-run\n");
+      return 0;
+    }
+
+  err = take_journal_lock (&dbs->journal_lock, dbs->journal_file, -1);
+  if (err)
+    return err;
+
+  fp = es_fopen (dbs->journal_file, "a");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error creating '%s': %s\n"),
+                 dbs->journal_file, gpg_strerror (err));
+    }
+  else
+    {
+      if (es_fputs (line, fp))
+        err = gpg_error_from_syserror ();
+      if (es_fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+      if (err)
+        log_error (_("error writing '%s': %s\n"),
+                   dbs->journal_file, gpg_strerror (err));
+      else if (!stat (dbs->journal_file, &statbuf)
+               && statbuf.st_size >= JOURNAL_MERGE_SIZE)
+        dbs->journal_needs_merge = 1;
+    }
+
+  dotlock_release (dbs->journal_lock);
+  return err;
+}
+
+
+/* Queue the observation of a signature for record_signature.  */
+static gpg_error_t
+journal_signature (tofu_dbs_t dbs, const char *fingerprint,
+                   const char *email, time_t sig_time,
+                   const char *sig_digest, const char *origin, time_t now)
+{
+  gpg_error_t err;
+  char *email_esc, *origin_esc, *line;
+
+  email_esc = percent_plus_escape (email);
+  origin_esc = percent_plus_escape (origin);
+  if (!email_esc || !origin_esc)
+    line = NULL;
+  else
+    line = xtryasprintf ("s %s %s %lld %s %s %lld\n",
+                         fingerprint, email_esc, (long long)sig_time,
+                         sig_digest, origin_esc, (long long)now);
+  if (!line)
+    err = gpg_error_from_syserror ();
+  else
+    err = append_to_journal (dbs, line);
+
+  xfree (line);
+  xfree (origin_esc);
+  xfree (email_esc);
+  return err;
+}
+
+
+/* Queue the observation of an encryption for record_encryption.  */
+static gpg_error_t
+journal_encryption (tofu_dbs_t dbs, const char *fingerprint,
+                    const char *email, time_t now)
+{
+  gpg_error_t err;
+  char *email_esc, *line;
+
+  email_esc = percent_plus_escape (email);
+  if (!email_esc)
+    line = NULL;
+  else
+    line = xtryasprintf ("e %s %s %lld\n",
+                         fingerprint, email_esc, (long long)now);
+  if (!line)
+    err = gpg_error_from_syserror ();
+  else
+    err = append_to_journal (dbs, line);
+
+  xfree (line);
+  xfree (email_esc);
+  return err;
+}
+
+
+/* Store the observation given by the journal line LINE.  LINE is
+   modified.  */
+static gpg_error_t
+merge_journal_line (tofu_dbs_t dbs, char *line)
+{
+  char *fields[7];
+  int n;
+
+  n = split_fields (line, fields, DIM (fields));
+  if (n == 7 && !strcmp (fields[0], "s"))
+    {
+      percent_plus_unescape_inplace (fields[2], 0);
+      percent_plus_unescape_inplace (fields[5], 0);
+      return record_signature (dbs, fields[1], fields[2],
+                               (time_t)strtoll (fields[3], NULL, 10),
+                               fields[4], fields[5],
+                               (time_t)strtoll (fields[6], NULL, 10));
+    }
+  else if (n == 4 && !strcmp (fields[0], "e"))
+    {
+      percent_plus_unescape_inplace (fields[2], 0);
+      return record_encryption (dbs, fields[1], fields[2],
+                                (time_t)strtoll (fields[3], NULL, 10));
+    }
+
+  log_info ("TOFU: ignoring invalid journal line\n");
+  return 0;
+}
+
+
+/* Merge the pending observations from the journal into the database.
+   To keep appending cheap the journal is first renamed so that other
+   processes start a new journal while we merge.  A merge file left
+   over by an interrupted merge is finished first.  This function may
+   only be called outside of a transaction; it commits any batch
+   transaction.  */
+static void
+merge_journal (ctrl_t ctrl)
+{
+  tofu_dbs_t dbs = ctrl->tofu.dbs;
+  gpg_error_t err;
+  estream_t fp = NULL;
+  char *line = NULL;
+  size_t linesize = 0;
+  ssize_t len;
+  int in_transaction = 0;
+
+  log_assert (dbs->in_transaction == 0);
+  dbs->journal_needs_merge = 0;
+
+  if (access (dbs->journal_file, F_OK)
+      && access (dbs->journal_merge_file, F_OK))
+    return;  /* Nothing to do.  */
+
+  /* Only one process merges at a time.  */
+  if (take_journal_lock (&dbs->journal_merge_lock,
+                         dbs->journal_merge_file, 0))
+    return;
+
+  if (access (dbs->journal_merge_file, F_OK))
+    {
+      err = take_journal_lock (&dbs->journal_lock, dbs->journal_file, -1);
+      if (err)
+        goto leave;
+      err = gnupg_rename_file (dbs->journal_file, dbs->journal_merge_file,
+                               NULL);
+      dotlock_release (dbs->journal_lock);
+      if (err)
+        goto leave;
+    }
+
+  fp = es_fopen (dbs->journal_merge_file, "r");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"),
+                 dbs->journal_merge_file, gpg_strerror (err));
+      goto leave;
+    }
+
+  err = begin_transaction (ctrl, 0);
+  if (err)
+    goto leave;
+  in_transaction = 1;
+
+  while ((len = es_read_line (fp, &line, &linesize, NULL)) > 0)
+    {
+      if (line[len-1] != '\n')
+        break;  /* Ignore an incomplete last line.  */
+      err = merge_journal_line (dbs, line);
+      if (err)
+        goto leave;
+    }
+  if (len < 0)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("error reading '%s': %s\n"),
+                 dbs->journal_merge_file, gpg_strerror (err));
+      goto leave;
+    }
+
+  in_transaction = 0;
+  err = end_transaction (ctrl, 0);
+  /* Make sure the changes are committed before we remove the
+   * journal.  */
+  if (!err)
+    err = end_transaction (ctrl, 2);
+  if (!err)
+    {
+      es_fclose (fp);
+      fp = NULL;
+      if (gnupg_remove (dbs->journal_merge_file))
+        log_error (_("error removing '%s': %s\n"), dbs->journal_merge_file,
+                   gpg_strerror (gpg_error_from_syserror ()));
+    }
+
+ leave:
+  if (in_transaction)
+    rollback_transaction (ctrl);
+  es_free (line);
+  es_fclose (fp);
+  dotlock_release (dbs->journal_merge_lock);
+}
+
+
 /* Register the signature with the bindings <fingerprint, USER_ID>,
    for each USER_ID in USER_ID_LIST.  The fingerprint is taken from
    the primary key packet PK.
@@ -3328,9 +3848,7 @@ tofu_register_signature (ctrl_t ctrl,
   char *fingerprint = NULL;
   strlist_t user_id;
   char *email = NULL;
-  char *sqlerr = NULL;
   char *sig_digest = NULL;
-  unsigned long c;
 
   dbs = opendbs (ctrl);
   if (! dbs)
@@ -3385,82 +3903,12 @@ tofu_register_signature (ctrl_t ctrl,
           break;
         }
 
-      /* If we've already seen this signature before, then don't add
-         it again.  */
-      rc = gpgsql_stepx
-        (dbs->db, &dbs->s.register_already_seen,
-         get_single_unsigned_long_cb2, &c, &sqlerr,
-         "select count (*)\n"
-         " from signatures left join bindings\n"
-         "  on signatures.binding = bindings.oid\n"
-         " where fingerprint = ? and email = ? and sig_time = ?\n"
-         "  and sig_digest = ?",
-         GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
-         GPGSQL_ARG_LONG_LONG, (long long) sig_time,
-         GPGSQL_ARG_STRING, sig_digest,
-         GPGSQL_ARG_END);
-      if (rc)
-        {
-          log_error (_("error reading TOFU database: %s\n"), sqlerr);
-          print_further_info ("checking existence");
-          sqlite3_free (sqlerr);
-          rc = gpg_error (GPG_ERR_GENERAL);
-        }
-      else if (c > 1)
-        /* Duplicates!  This should not happen.  In particular,
-           because <fingerprint, email, sig_time, sig_digest> is the
-           primary key!  */
-        log_debug ("SIGNATURES DB contains duplicate records"
-                   " <key: %s, email: %s, time: 0x%lx, sig: %s,"
-                   " origin: %s>."
-                   "  Please report.\n",
-                   fingerprint, email, (unsigned long) sig_time,
-                   sig_digest, origin);
-      else if (c == 1)
-        {
-          if (DBG_TRUST)
-            log_debug ("Already observed the signature and binding"
-                       " <key: %s, email: %s, time: 0x%lx, sig: %s,"
-                       " origin: %s>\n",
-                       fingerprint, email, (unsigned long) sig_time,
-                       sig_digest, origin);
-        }
-      else if (opt.dry_run)
-        {
-          log_info ("TOFU database update skipped due to --dry-run\n");
-        }
+      if (opt.tofu_journal)
+        rc = journal_signature (dbs, fingerprint, email, sig_time,
+                                sig_digest, origin, now);
       else
-        /* This is the first time that we've seen this signature and
-           binding.  Record it.  */
-        {
-          if (DBG_TRUST)
-            log_debug ("TOFU: Saving signature"
-                       " <key: %s, user id: %s, sig: %s>\n",
-                       fingerprint, email, sig_digest);
-
-          log_assert (c == 0);
-
-          rc = gpgsql_stepx
-            (dbs->db, &dbs->s.register_signature, NULL, NULL, &sqlerr,
-             "insert into signatures\n"
-             " (binding, sig_digest, origin, sig_time, time)\n"
-             " values\n"
-             " ((select oid from bindings\n"
-             "    where fingerprint = ? and email = ?),\n"
-             "  ?, ?, ?, ?);",
-             GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
-             GPGSQL_ARG_STRING, sig_digest, GPGSQL_ARG_STRING, origin,
-             GPGSQL_ARG_LONG_LONG, (long long) sig_time,
-             GPGSQL_ARG_LONG_LONG, (long long) now,
-             GPGSQL_ARG_END);
-          if (rc)
-            {
-              log_error (_("error updating TOFU database: %s\n"), sqlerr);
-              print_further_info ("insert signatures");
-              sqlite3_free (sqlerr);
-              rc = gpg_error (GPG_ERR_GENERAL);
-            }
-        }
+        rc = record_signature (dbs, fingerprint, email, sig_time,
+                               sig_digest, origin, now);
 
       xfree (email);
 
@@ -3474,6 +3922,9 @@ tofu_register_signature (ctrl_t ctrl,
   else
     rc = end_transaction (ctrl, 0);
 
+  if (!rc && dbs->journal_needs_merge && !dbs->in_transaction)
+    merge_journal (ctrl);
+
   xfree (fingerprint);
   xfree (sig_digest);
 
@@ -3492,7 +3943,6 @@ tofu_register_encryption (ctrl_t ctrl,
   int free_user_id_list = 0;
   char *fingerprint = NULL;
   strlist_t user_id;
-  char *sqlerr = NULL;
   int in_batch = 0;
 
   dbs = opendbs (ctrl);
@@ -3588,24 +4038,10 @@ tofu_register_encryption (ctrl_t ctrl,
 
       free_strlist (conflict_set);
 
-      rc = gpgsql_stepx
-        (dbs->db, &dbs->s.register_encryption, NULL, NULL, &sqlerr,
-         "insert into encryptions\n"
-         " (binding, time)\n"
-         " values\n"
-         " ((select oid from bindings\n"
-         "    where fingerprint = ? and email = ?),\n"
-         "  ?);",
-         GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
-         GPGSQL_ARG_LONG_LONG, (long long) now,
-         GPGSQL_ARG_END);
-      if (rc)
-        {
-          log_error (_("error updating TOFU database: %s\n"), sqlerr);
-          print_further_info ("insert encryption");
-          sqlite3_free (sqlerr);
-          rc = gpg_error (GPG_ERR_GENERAL);
-        }
+      if (opt.tofu_journal)
+        rc = journal_encryption (dbs, fingerprint, email, now);
+      else
+        rc = record_encryption (dbs, fingerprint, email, now);
 
       xfree (email);
     }
@@ -3614,6 +4050,9 @@ tofu_register_encryption (ctrl_t ctrl,
   if (in_batch)
     tofu_end_batch_update (ctrl);
 
+  if (!rc && dbs->journal_needs_merge && !dbs->in_transaction)
+    merge_journal (ctrl);
+
   release_kbnode (kb);
   if (free_user_id_list)
     free_strlist (user_id_list);
@@ -3715,6 +4154,10 @@ tofu_write_tfs_record (ctrl_t ctrl, estream_t fp,
       err = gpg_error_from_syserror ();
       goto leave;
     }
+  /* The statistics shall include all observations.  */
+  if (!dbs->in_transaction)
+    merge_journal (ctrl);
+
   email = email_from_user_id (user_id);
   policy = get_policy (ctrl, dbs, pk, fingerprint, user_id, email, NULL, now);
 
@@ -4023,6 +4466,7 @@ tofu_notice_key_changed (ctrl_t ctrl, kbnode_t kb)
   if (!fingerprint)
     return gpg_error_from_syserror ();
 
+  drop_prefetched_bindings (dbs);
   rc = gpgsql_stepx (dbs->db, NULL, NULL, NULL, &sqlerr,
                      "update bindings set effective_policy = ?"
                      " where fingerprint = ?;",
@@ -304,6 +304,42 @@ revalidation_mark (ctrl_t ctrl)
 }
 
 
+/* Start a bulk update of the trustdb.  The changes are written by
+ * trustdb_bulk_end.  */
+void
+trustdb_bulk_begin (ctrl_t ctrl)
+{
+#ifndef NO_TRUST_MODELS
+  tdb_bulk_begin (ctrl);
+#else
+  (void)ctrl;
+#endif
+}
+
+
+void
+trustdb_bulk_end (ctrl_t ctrl)
+{
+#ifndef NO_TRUST_MODELS
+  tdb_bulk_end (ctrl);
+#else
+  (void)ctrl;
+#endif
+}
+
+
+int
+trustdb_get_change_stamp (u32 *r_stamp)
+{
+#ifndef NO_TRUST_MODELS
+  return tdb_get_change_stamp (r_stamp);
+#else
+  *r_stamp = 0;
+  return 1;
+#endif
+}
+
+
 void
 check_trustdb_stale (ctrl_t ctrl)
 {
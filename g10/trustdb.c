@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "gpg.h"
 #include "../common/status.h"
@@ -50,6 +52,31 @@ typedef struct key_item **KeyHashTable; /* see new_key_hash_table() */
 struct key_array
 {
   KBNODE keyblock;
+  int cached;       /* KEYBLOCK is owned by the keyblock cache.  */
+};
+
+/*
+ * The reverse signer index maps the key ID of a signer to the key IDs
+ * of the keys which carry a signature from it.  It is used to find
+ * the keys which need to be looked at in the next level of the web
+ * of trust.
+ */
+struct signer_item
+{
+  struct signer_item *next;
+  u32 kid[2];           /* The key ID of the signer.  */
+  unsigned int nkeys;   /* Number of key IDs in KEYS.  */
+  unsigned int size;    /* Allocated number of key IDs in KEYS.  */
+  u32 *keys;            /* The key IDs of the signed keys.  */
+};
+typedef struct signer_item **SignerIndex; /* see new_signer_index() */
+
+/* The parameter for search_skipfnc.  */
+struct skipfnc_parm_s
+{
+  KeyHashTable full_trust;  /* Keys which need no more checking.  */
+  KeyHashTable candidates;  /* If not NULL only look at these keys.  */
+  struct keyblock_cache_s *kbcache; /* If not NULL skip these keys.  */
 };
 
 
@@ -68,6 +95,12 @@ static struct key_item *utk_list;      /* all ultimately trusted keys */
 
 static int pending_check_trustdb;
 
+/* Incremented for each change of the trust values by this process.  */
+static unsigned int tdb_change_count;
+
+/* Set while a bulk update started by tdb_bulk_begin is active.  */
+static int bulk_transaction;
+
 static int validate_keys (ctrl_t ctrl, int interactive);
 
 
@@ -99,6 +132,13 @@ release_key_items (struct key_item *k)
 
 #define KEY_HASH_TABLE_SIZE 1024
 
+/* The number of keyblocks whose certifications are verified in
+ * parallel by validate_key_list.  */
+#define VALIDATE_BATCH_SIZE 64
+
+/* The maximum number of keyblocks kept by the keyblock cache.  */
+#define MAX_CACHED_KEYBLOCKS 10000
+
 /*
  * For fast keylook up we need a hash table.  Each byte of a KeyID
  * should be distributed equally over the 256 possible values (except
@@ -162,6 +202,212 @@ add_key_hash_table (KeyHashTable tbl, u32 *kid)
   tbl[i] = kk;
 }
 
+/*
+ * Create a new reverse signer index.  It uses the same hashing as
+ * the key hash table.
+ */
+static SignerIndex
+new_signer_index (void)
+{
+  return xmalloc_clear (KEY_HASH_TABLE_SIZE * sizeof (struct signer_item *));
+}
+
+static void
+release_signer_index (SignerIndex idx)
+{
+  struct signer_item *s, *s2;
+  int i;
+
+  if (!idx)
+    return;
+  for (i=0; i < KEY_HASH_TABLE_SIZE; i++)
+    for (s = idx[i]; s; s = s2)
+      {
+        s2 = s->next;
+        xfree (s->keys);
+        xfree (s);
+      }
+  xfree (idx);
+}
+
+/*
+ * Record in IDX that the key KID has a signature by SIGNER.
+ */
+static void
+add_signer_index (SignerIndex idx, u32 *signer, u32 *kid)
+{
+  int i = signer[1] % KEY_HASH_TABLE_SIZE;
+  struct signer_item *s;
+
+  for (s = idx[i]; s; s = s->next)
+    if (s->kid[0] == signer[0] && s->kid[1] == signer[1])
+      break;
+  if (!s)
+    {
+      s = xmalloc_clear (sizeof *s);
+      s->kid[0] = signer[0];
+      s->kid[1] = signer[1];
+      s->next = idx[i];
+      idx[i] = s;
+    }
+  else if (s->nkeys && s->keys[2*(s->nkeys-1)] == kid[0]
+           && s->keys[2*(s->nkeys-1)+1] == kid[1])
+    return; /* Another signature on the same key.  */
+
+  if (s->nkeys == s->size)
+    {
+      s->size += 16;
+      s->keys = xrealloc (s->keys, 2 * s->size * sizeof *s->keys);
+    }
+  s->keys[2*s->nkeys] = kid[0];
+  s->keys[2*s->nkeys+1] = kid[1];
+  s->nkeys++;
+}
+
+/*
+ * Add all signatures of KEYBLOCK to the reverse signer index IDX.
+ * Self-signatures are not of interest.  Returns true if KEYBLOCK has
+ * a signature by another key.
+ */
+static int
+index_keyblock_signers (SignerIndex idx, kbnode_t keyblock)
+{
+  kbnode_t node;
+  PKT_signature *sig;
+  u32 main_kid[2];
+  int any = 0;
+
+  keyid_from_pk (keyblock->pkt->pkt.public_key, main_kid);
+  for (node = keyblock->next; node; node = node->next)
+    if (node->pkt->pkttype == PKT_SIGNATURE)
+      {
+        sig = node->pkt->pkt.signature;
+        if (sig->keyid[0] != main_kid[0] || sig->keyid[1] != main_kid[1])
+          {
+            add_signer_index (idx, sig->keyid, main_kid);
+            any = 1;
+          }
+      }
+  return any;
+}
+
+/*
+ * Add the keys signed by any key in KLIST to the hash table TBL.
+ * Returns the number of keys found in the index.
+ */
+static unsigned int
+add_signed_keys (SignerIndex idx, struct key_item *klist, KeyHashTable tbl)
+{
+  struct key_item *k;
+  struct signer_item *s;
+  unsigned int i, count = 0;
+
+  for (k = klist; k; k = k->next)
+    for (s = idx[k->kid[1] % KEY_HASH_TABLE_SIZE]; s; s = s->next)
+      if (s->kid[0] == k->kid[0] && s->kid[1] == k->kid[1])
+        {
+          for (i=0; i < s->nkeys; i++)
+            add_key_hash_table (tbl, s->keys + 2*i);
+          count += s->nkeys;
+          break;
+        }
+  return count;
+}
+
+/*
+ * The keyblock cache keeps the prepared keyblocks of the keys which
+ * carry a signature by another key.  Only those keys can become
+ * candidates for the deeper levels of the web of trust.  Together
+ * with the reverse signer index this lets the later levels work
+ * entirely in memory instead of reading and parsing the keyblocks
+ * again for each level.  It uses the same hashing as the key hash
+ * table.
+ */
+struct kbcache_item
+{
+  struct kbcache_item *next;
+  u32 kid[2];           /* The key ID of the primary key.  */
+  kbnode_t keyblock;    /* The merged keyblock.  */
+};
+
+struct keyblock_cache_s
+{
+  unsigned int count;   /* The number of cached keyblocks.  */
+  struct kbcache_item *tbl[KEY_HASH_TABLE_SIZE];
+};
+typedef struct keyblock_cache_s *KeyblockCache;
+
+static KeyblockCache
+new_keyblock_cache (void)
+{
+  return xmalloc_clear (sizeof (struct keyblock_cache_s));
+}
+
+static void
+release_keyblock_cache (KeyblockCache kbc)
+{
+  struct kbcache_item *c, *c2;
+  int i;
+
+  if (!kbc)
+    return;
+  for (i=0; i < KEY_HASH_TABLE_SIZE; i++)
+    for (c = kbc->tbl[i]; c; c = c2)
+      {
+        c2 = c->next;
+        release_kbnode (c->keyblock);
+        xfree (c);
+      }
+  xfree (kbc);
+}
+
+/*
+ * Return the cached keyblock for the key KID or NULL.
+ */
+static kbnode_t
+get_keyblock_cache (KeyblockCache kbc, u32 *kid)
+{
+  struct kbcache_item *c;
+
+  for (c = kbc->tbl[kid[1] % KEY_HASH_TABLE_SIZE]; c; c = c->next)
+    if (c->kid[0] == kid[0] && c->kid[1] == kid[1])
+      return c->keyblock;
+  return NULL;
+}
+
+/*
+ * Return true if KEYBLOCK is owned by the cache KBC.
+ */
+static int
+keyblock_is_cached (KeyblockCache kbc, kbnode_t keyblock)
+{
+  return (kbc && get_keyblock_cache
+          (kbc, pk_keyid (keyblock->pkt->pkt.public_key)) == keyblock);
+}
+
+/*
+ * Store KEYBLOCK in the cache KBC.  On success the cache takes
+ * ownership of KEYBLOCK and true is returned.
+ */
+static int
+put_keyblock_cache (KeyblockCache kbc, kbnode_t keyblock)
+{
+  u32 *kid = pk_keyid (keyblock->pkt->pkt.public_key);
+  struct kbcache_item *c;
+  int i = kid[1] % KEY_HASH_TABLE_SIZE;
+
+  if (kbc->count >= MAX_CACHED_KEYBLOCKS || get_keyblock_cache (kbc, kid))
+    return 0;
+  c = xmalloc (sizeof *c);
+  c->kid[0] = kid[0];
+  c->kid[1] = kid[1];
+  c->keyblock = keyblock;
+  c->next = kbc->tbl[i];
+  kbc->tbl[i] = c;
+  kbc->count++;
+  return 1;
+}
+
 /*
  * Release a key_array
  */
@@ -172,7 +418,8 @@ release_key_array ( struct key_array *keys )
 
     if (keys) {
         for (k=keys; k->keyblock; k++)
-            release_kbnode (k->keyblock);
+            if (!k->cached)
+                release_kbnode (k->keyblock);
         xfree (keys);
     }
 }
@@ -593,6 +840,46 @@ update_trustdb (ctrl_t ctrl)
 	      trust_model_string(opt.trust_model));
 }
 
+/* Start collecting the trustdb updates of a bulk operation.  Until
+ * tdb_bulk_end is called the changed records are kept in the cache
+ * and written in one go.  */
+void
+tdb_bulk_begin (ctrl_t ctrl)
+{
+  int rc;
+
+  init_trustdb (ctrl, 0);
+  if (trustdb_args.no_trustdb && opt.trust_model == TM_ALWAYS)
+    return;
+  if (bulk_transaction)
+    return;
+
+  rc = tdbio_begin_transaction ();
+  if (rc)
+    log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc) );
+  else
+    bulk_transaction = 1;
+}
+
+
+/* Write the updates collected since tdb_bulk_begin.  */
+void
+tdb_bulk_end (ctrl_t ctrl)
+{
+  int rc;
+
+  (void)ctrl;
+
+  if (!bulk_transaction)
+    return;
+  bulk_transaction = 0;
+
+  rc = tdbio_end_transaction ();
+  if (rc)
+    log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc) );
+}
+
+
 void
 tdb_revalidation_mark (ctrl_t ctrl)
 {
@@ -605,6 +892,32 @@ tdb_revalidation_mark (ctrl_t ctrl)
   if (tdbio_write_nextcheck (ctrl, 1))
     do_sync ();
   pending_check_trustdb = 1;
+  tdb_change_count++;
+}
+
+
+/* Store a value describing the current state of the trustdb at
+ * R_STAMP.  Changes by other processes are detected by the size,
+ * mtime and inode of the file.  Returns false if the state can't be
+ * determined.  */
+int
+tdb_get_change_stamp (u32 *r_stamp)
+{
+  const char *fname = tdbio_get_dbname ();
+  struct stat st;
+  u32 stamp;
+
+  stamp = tdb_change_count;
+  if (fname)
+    {
+      if (stat (fname, &st))
+        return 0;
+      stamp = stamp * 31 + (u32)st.st_size;
+      stamp = stamp * 31 + (u32)st.st_mtime;
+      stamp = stamp * 31 + (u32)st.st_ino;
+    }
+  *r_stamp = stamp;
+  return 1;
 }
 
 int
@@ -914,6 +1227,7 @@ update_validity (ctrl_t ctrl, PKT_public_key *pk, PKT_user_id *uid,
   gpg_error_t err;
   ulong recno;
 
+  tdb_change_count++;
   namehash_from_uid(uid);
 
   err = read_trust_record (ctrl, pk, &trec);
@@ -1587,6 +1901,39 @@ sanitize_regexp(const char *old)
   return new;
 }
 
+/* The compiled regexps of the trust signatures.  The same few
+   regexps are checked against the user IDs of many keys, thus we
+   keep them for a run of validate_keys.  */
+struct regexp_cache_s
+{
+  struct regexp_cache_s *next;
+  char *expr;     /* The regexp as found in the signature.  */
+  char *regexp;   /* The sanitized regexp.  */
+  int valid;      /* PAT has been compiled successfully.  */
+  regex_t pat;
+};
+static struct regexp_cache_s *regexp_cache;
+
+
+/* Release all compiled regexps.  */
+static void
+release_regexp_cache (void)
+{
+  struct regexp_cache_s *rc, *rc_next;
+
+  for (rc = regexp_cache; rc; rc = rc_next)
+    {
+      rc_next = rc->next;
+      if (rc->valid)
+        regfree (&rc->pat);
+      xfree (rc->regexp);
+      xfree (rc->expr);
+      xfree (rc);
+    }
+  regexp_cache = NULL;
+}
+
+
 /* Used by validate_one_keyblock to confirm a regexp within a trust
    signature.  Returns 1 for match, and 0 for no match or regex
    error. */
@@ -1594,27 +1941,26 @@ static int
 check_regexp(const char *expr,const char *string)
 {
   int ret;
-  char *regexp;
-
-  regexp=sanitize_regexp(expr);
+  struct regexp_cache_s *rc;
 
-  {
-    regex_t pat;
+  for (rc = regexp_cache; rc; rc = rc->next)
+    if (!strcmp (rc->expr, expr))
+      break;
+  if (!rc)
+    {
+      rc = xcalloc (1, sizeof *rc);
+      rc->expr = xstrdup (expr);
+      rc->regexp = sanitize_regexp (expr);
+      rc->valid = !regcomp (&rc->pat, rc->regexp, REG_ICASE|REG_EXTENDED);
+      rc->next = regexp_cache;
+      regexp_cache = rc;
+    }
 
-    ret=regcomp(&pat,regexp,REG_ICASE|REG_EXTENDED);
-    if(ret==0)
-      {
-	ret=regexec(&pat,string,0,NULL,0);
-	regfree(&pat);
-      }
-    ret=(ret==0);
-  }
+  ret = rc->valid && !regexec (&rc->pat, string, 0, NULL, 0);
 
   if(DBG_TRUST)
     log_debug("regexp '%s' ('%s') on '%s': %s\n",
-	      regexp,expr,string,ret?"YES":"NO");
-
-  xfree(regexp);
+	      rc->regexp,expr,string,ret?"YES":"NO");
 
   return ret;
 }
@@ -1799,44 +2145,191 @@ validate_one_keyblock (ctrl_t ctrl, kbnode_t kb, struct key_item *klist,
 static int
 search_skipfnc (void *opaque, u32 *kid, int dummy_uid_no)
 {
+  struct skipfnc_parm_s *parm = opaque;
+
   (void)dummy_uid_no;
-  return test_key_hash_table ((KeyHashTable)opaque, kid);
+  return (test_key_hash_table (parm->full_trust, kid)
+          || (parm->candidates
+              && !test_key_hash_table (parm->candidates, kid))
+          || (parm->kbcache && get_keyblock_cache (parm->kbcache, kid)));
+}
+
+
+/* Filter for precheck_certifications to select the certifications
+ * which validate_one_keyblock checks via mark_usable_uid_certs.  */
+static int
+precheck_filter (void *opaque, PKT_signature *sig)
+{
+  struct key_item *klist = opaque;
+
+  if (sig->sig_class >= 0x11 && sig->sig_class <= 0x13
+      && sig->sig_class - 0x10 < opt.min_cert_level)
+    return 0;
+  return !!is_in_klist (klist, sig);
+}
+
+
+/* Validate the NBATCH keyblocks in BATCH for validate_key_list and
+ * append the suitable ones to the key array at R_KEYS with *R_NKEYS
+ * used and room for *R_MAXKEYS items.  The keyblocks are consumed.
+ * The keys at one depth are independent and thus the certifications
+ * of the entire batch are first verified in parallel.  */
+static void
+validate_keyblock_batch (ctrl_t ctrl, kbnode_t *batch, unsigned int nbatch,
+                         KeyHashTable full_trust, KeyblockCache kbcache,
+                         struct key_item *klist,
+                         u32 curtime, u32 *next_expire,
+                         struct key_array **r_keys,
+                         size_t *r_nkeys, size_t *r_maxkeys)
+{
+  kbnode_t keyblock, node;
+  PKT_public_key *pk;
+  unsigned int i;
+  int cached;
+
+  precheck_certifications (ctrl, batch, nbatch, precheck_filter, klist);
+
+  for (i=0; i < nbatch; i++)
+    {
+      keyblock = batch[i];
+      batch[i] = NULL;
+      pk = keyblock->pkt->pkt.public_key;
+      cached = keyblock_is_cached (kbcache, keyblock);
+
+      /* The same key may be stored in several keyrings; a copy
+       * earlier in the batch may have been marked already.  */
+      if (test_key_hash_table (full_trust, pk_keyid (pk)))
+        ;
+      else if (validate_one_keyblock (ctrl, keyblock, klist,
+                                      curtime, next_expire))
+        {
+          if (pk->expiredate && pk->expiredate >= curtime
+              && pk->expiredate < *next_expire)
+            *next_expire = pk->expiredate;
+
+          if (*r_nkeys == *r_maxkeys) {
+            *r_maxkeys += 1000;
+            *r_keys = xrealloc (*r_keys, (*r_maxkeys+1) * sizeof **r_keys);
+          }
+          (*r_keys)[*r_nkeys].keyblock = keyblock;
+          (*r_keys)[*r_nkeys].cached = cached;
+          (*r_nkeys)++;
+
+	  /* Optimization - if all uids are fully trusted, then we
+	     never need to consider this key as a candidate again. */
+
+	  for (node=keyblock; node; node = node->next)
+	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
+	      break;
+
+	  if(node==NULL)
+	    mark_keyblock_seen (full_trust, keyblock);
+
+          keyblock = NULL;
+        }
+
+      if (!cached)
+        release_kbnode (keyblock);
+    }
 }
 
 
 /*
  * Scan all keys and return a key_array of all suitable keys from
  * kllist.  The caller has to pass keydb handle so that we don't use
- * to create our own.  Returns either a key_array or NULL in case of
- * an error.  No results found are indicated by an empty array.
- * Caller hast to release the returned array.
+ * to create our own.  If CANDIDATES is not NULL only the keys in
+ * this hash table are considered.  If SIDX is not NULL the signatures
+ * of all scanned keys are added to this reverse signer index and the
+ * keys with a signature by another key are stored in the keyblock
+ * cache KBCACHE.  With CANDIDATES the keys found in KBCACHE are taken
+ * from there and the keydb is only scanned if a candidate is
+ * missing.  Returns either a key_array or NULL in case of an error.
+ * No results found are indicated by an empty array.  Caller hast to
+ * release the returned array.
  */
 static struct key_array *
 validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
+                   KeyHashTable candidates, SignerIndex sidx,
+                   KeyblockCache kbcache,
                    struct key_item *klist, u32 curtime, u32 *next_expire)
 {
+  struct skipfnc_parm_s parm;
   KBNODE keyblock = NULL;
+  kbnode_t batch[VALIDATE_BATCH_SIZE];
+  unsigned int nbatch = 0;
   struct key_array *keys = NULL;
   size_t nkeys, maxkeys;
   int rc;
   KEYDB_SEARCH_DESC desc;
+  struct key_item *k;
+  int i, any_signed;
 
   maxkeys = 1000;
   keys = xmalloc ((maxkeys+1) * sizeof *keys);
   nkeys = 0;
 
+  /* Take the cached candidates.  */
+  if (candidates && kbcache)
+    {
+      int need_scan = 0;
+
+      for (i=0; i < KEY_HASH_TABLE_SIZE; i++)
+        for (k = candidates[i]; k; k = k->next)
+          {
+            PKT_public_key *pk;
+
+            if (test_key_hash_table (full_trust, k->kid))
+              continue;
+            keyblock = get_keyblock_cache (kbcache, k->kid);
+            if (!keyblock)
+              {
+                need_scan = 1;
+                continue;
+              }
+
+            /* Reset what validate_one_keyblock set for the last
+             * level.  */
+            clear_kbnode_flags (keyblock);
+            pk = keyblock->pkt->pkt.public_key;
+            pk->trust_depth = 0;
+            pk->trust_value = 0;
+            pk->trust_regexp = NULL;
+
+            batch[nbatch++] = keyblock;
+            keyblock = NULL;
+            if (nbatch == VALIDATE_BATCH_SIZE)
+              {
+                validate_keyblock_batch (ctrl, batch, nbatch, full_trust,
+                                         kbcache, klist, curtime, next_expire,
+                                         &keys, &nkeys, &maxkeys);
+                nbatch = 0;
+              }
+          }
+      validate_keyblock_batch (ctrl, batch, nbatch, full_trust, kbcache,
+                               klist, curtime, next_expire,
+                               &keys, &nkeys, &maxkeys);
+      nbatch = 0;
+      if (!need_scan)
+        {
+          keys[nkeys].keyblock = NULL;
+          return keys;
+        }
+    }
+
   rc = keydb_search_reset (hd);
   if (rc)
     {
       log_error ("keydb_search_reset failed: %s\n", gpg_strerror (rc));
-      xfree (keys);
-      return NULL;
+      goto die;
     }
 
   memset (&desc, 0, sizeof desc);
   desc.mode = KEYDB_SEARCH_MODE_FIRST;
+  parm.full_trust = full_trust;
+  parm.candidates = candidates;
+  parm.kbcache = candidates? kbcache : NULL;
   desc.skipfnc = search_skipfnc;
-  desc.skipfncvalue = full_trust;
+  desc.skipfncvalue = &parm;
   rc = keydb_search (hd, &desc, 1, NULL);
   if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND)
     {
@@ -1870,6 +2363,16 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
           continue;
         }
 
+      any_signed = sidx? index_keyblock_signers (sidx, keyblock) : 0;
+
+      /* Not all backends support the skip function.  */
+      if (search_skipfnc (&parm, pk_keyid (keyblock->pkt->pkt.public_key), 0))
+        {
+          release_kbnode (keyblock);
+          keyblock = NULL;
+          continue;
+        }
+
       /* prepare the keyblock for further processing */
       merge_keys_and_selfsig (ctrl, keyblock);
       clear_kbnode_flags (keyblock);
@@ -1878,37 +2381,24 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
         {
           /* it does not make sense to look further at those keys */
           mark_keyblock_seen (full_trust, keyblock);
-        }
-      else if (validate_one_keyblock (ctrl, keyblock, klist,
-                                      curtime, next_expire))
-        {
-	  KBNODE node;
-
-          if (pk->expiredate && pk->expiredate >= curtime
-              && pk->expiredate < *next_expire)
-            *next_expire = pk->expiredate;
-
-          if (nkeys == maxkeys) {
-            maxkeys += 1000;
-            keys = xrealloc (keys, (maxkeys+1) * sizeof *keys);
-          }
-          keys[nkeys++].keyblock = keyblock;
-
-	  /* Optimization - if all uids are fully trusted, then we
-	     never need to consider this key as a candidate again. */
-
-	  for (node=keyblock; node; node = node->next)
-	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
-	      break;
-
-	  if(node==NULL)
-	    mark_keyblock_seen (full_trust, keyblock);
-
+          release_kbnode (keyblock);
           keyblock = NULL;
+          continue;
         }
 
-      release_kbnode (keyblock);
+      /* Keep the keys which may be candidates for the next levels.  */
+      if (any_signed && kbcache)
+        put_keyblock_cache (kbcache, keyblock);
+
+      batch[nbatch++] = keyblock;
       keyblock = NULL;
+      if (nbatch == VALIDATE_BATCH_SIZE)
+        {
+          validate_keyblock_batch (ctrl, batch, nbatch, full_trust, kbcache,
+                                   klist, curtime, next_expire,
+                                   &keys, &nkeys, &maxkeys);
+          nbatch = 0;
+        }
     }
   while (!(rc = keydb_search (hd, &desc, 1, NULL)));
 
@@ -1918,10 +2408,19 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
       goto die;
     }
 
+  validate_keyblock_batch (ctrl, batch, nbatch, full_trust, kbcache,
+                           klist, curtime, next_expire,
+                           &keys, &nkeys, &maxkeys);
   keys[nkeys].keyblock = NULL;
   return keys;
 
  die:
+  while (nbatch)
+    {
+      keyblock = batch[--nbatch];
+      if (!keyblock_is_cached (kbcache, keyblock))
+        release_kbnode (keyblock);
+    }
   keys[nkeys].keyblock = NULL;
   release_key_array (keys);
   return NULL;
@@ -2009,6 +2508,10 @@ validate_keys (ctrl_t ctrl, int interactive)
   int depth;
   int ot_unknown, ot_undefined, ot_never, ot_marginal, ot_full, ot_ultimate;
   KeyHashTable stored,used,full_trust;
+  KeyHashTable candidates = NULL;
+  SignerIndex sidx = NULL;
+  KeyblockCache kbcache = NULL;
+  int in_transaction = 0;
   u32 start_time, next_expire;
 
   /* Make sure we have all sigs cached.  TODO: This is going to
@@ -2027,6 +2530,21 @@ validate_keys (ctrl_t ctrl, int interactive)
   stored = new_key_hash_table ();
   used = new_key_hash_table ();
   full_trust = new_key_hash_table ();
+  sidx = new_signer_index ();
+  kbcache = new_keyblock_cache ();
+
+  /* All records are rewritten; write them in one go.  A bulk update
+   * already collects the records.  */
+  if (!bulk_transaction)
+    {
+      rc = tdbio_begin_transaction ();
+      if (rc)
+        {
+          log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc) );
+          goto leave;
+        }
+      in_transaction = 1;
+    }
 
   reset_trust_records (ctrl);
 
@@ -2146,9 +2664,24 @@ validate_keys (ctrl_t ctrl, int interactive)
 	  valids++;
         }
 
-      /* Find all keys which are signed by a key in kdlist */
-      keys = validate_key_list (ctrl, kdb, full_trust, klist,
-				start_time, &next_expire);
+      /* Find all keys which are signed by a key in kdlist.  The first
+         run scans all keys and builds the reverse signer index; the
+         later runs only need to look at the keys signed by a key in
+         klist.  */
+      if (!depth)
+        keys = validate_key_list (ctrl, kdb, full_trust, NULL, sidx, kbcache,
+                                  klist, start_time, &next_expire);
+      else
+        {
+          release_key_hash_table (candidates);
+          candidates = new_key_hash_table ();
+          if (add_signed_keys (sidx, klist, candidates))
+            keys = validate_key_list (ctrl, kdb, full_trust, candidates,
+                                      NULL, kbcache, klist,
+                                      start_time, &next_expire);
+          else
+            keys = xmalloc_clear (sizeof *keys);
+        }
       if (!keys)
         {
           log_error ("validate_key_list failed\n");
@@ -2231,6 +2764,20 @@ validate_keys (ctrl_t ctrl, int interactive)
   release_key_hash_table (full_trust);
   release_key_hash_table (used);
   release_key_hash_table (stored);
+  release_key_hash_table (candidates);
+  release_signer_index (sidx);
+  release_keyblock_cache (kbcache);
+  release_regexp_cache ();
+  if (in_transaction)
+    {
+      int rc2 = tdbio_end_transaction ();
+      if (rc2)
+        {
+          log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc2) );
+          if (!rc)
+            rc = rc2;
+        }
+    }
   if (!rc && !quit) /* mark trustDB as checked */
     {
       int rc2;
@@ -62,6 +62,9 @@ void update_ownertrust (ctrl_t ctrl,
 int clear_ownertrusts (ctrl_t ctrl, PKT_public_key *pk);
 
 void revalidation_mark (ctrl_t ctrl);
+void trustdb_bulk_begin (ctrl_t ctrl);
+void trustdb_bulk_end (ctrl_t ctrl);
+int trustdb_get_change_stamp (u32 *r_stamp);
 void check_trustdb_stale (ctrl_t ctrl);
 void check_or_update_trustdb (ctrl_t ctrl);
 
@@ -90,7 +93,10 @@ const char *trust_model_string (int model);
 gpg_error_t init_trustdb (ctrl_t ctrl, int no_create);
 int have_trustdb (ctrl_t ctrl);
 void tdb_check_trustdb_stale (ctrl_t ctrl);
+void tdb_bulk_begin (ctrl_t ctrl);
+void tdb_bulk_end (ctrl_t ctrl);
 void tdb_revalidation_mark (ctrl_t ctrl);
+int tdb_get_change_stamp (u32 *r_stamp);
 int trustdb_pending_check(void);
 void tdb_check_or_update (ctrl_t ctrl);
 
@@ -35,6 +35,7 @@
 #include "filter.h"
 #include "../common/ttyio.h"
 #include "../common/i18n.h"
+#include "../common/membuf.h"
 
 
 /****************
@@ -127,6 +128,104 @@ verify_signatures (ctrl_t ctrl, int nfiles, char **files )
 
 
 
+/* Read the detached signature file FNAME, remove a possible armor
+ * and append the packets to MB.  */
+static gpg_error_t
+read_signature_file (const char *fname, membuf_t *mb)
+{
+  gpg_error_t err = 0;
+  IOBUF fp;
+  armor_filter_context_t *afx = NULL;
+  char buffer[4096];
+  int n;
+
+  fp = iobuf_open (fname);
+  if (fp && is_secured_file (iobuf_get_fd (fp)))
+    {
+      iobuf_close (fp);
+      fp = NULL;
+      gpg_err_set_errno (EPERM);
+    }
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"),
+                 print_fname_stdin (fname), gpg_strerror (err));
+      return err;
+    }
+
+  if (!opt.no_armor && use_armor_filter (fp))
+    {
+      afx = new_armor_context ();
+      push_armor_filter (afx, fp);
+    }
+
+  while ((n = iobuf_read (fp, buffer, sizeof buffer)) != -1)
+    put_membuf (mb, buffer, n);
+  if (iobuf_error (fp))
+    {
+      err = iobuf_error (fp);
+      log_error (_("error reading '%s': %s\n"),
+                 print_fname_stdin (fname), gpg_strerror (err));
+    }
+
+  iobuf_close (fp);
+  release_armor_context (afx);
+  return err;
+}
+
+
+/****************
+ * Verify the data in the last of the NFILES FILES against the
+ * detached signatures in the other files.  The signatures are
+ * processed as one message so that the data is hashed only once with
+ * all required digest algorithms.
+ */
+int
+verify_signature_files (ctrl_t ctrl, int nfiles, char **files)
+{
+  gpg_error_t err = 0;
+  membuf_t mb;
+  char *buffer;
+  size_t buflen;
+  IOBUF fp;
+  strlist_t sl = NULL;
+  int i;
+
+  if (nfiles < 2)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  init_membuf (&mb, 4096);
+  for (i=0; i < nfiles - 1 && !err; i++)
+    err = read_signature_file (files[i], &mb);
+  buffer = get_membuf (&mb, &buflen);
+  if (!buffer)
+    return err? err : gpg_error_from_syserror ();
+  if (err)
+    {
+      xfree (buffer);
+      return err;
+    }
+
+  fp = iobuf_temp_with_content (buffer, buflen);
+  xfree (buffer);
+  add_to_strlist (&sl, files[nfiles-1]);
+  err = proc_signature_packets (ctrl, NULL, fp, sl, files[0]);
+  free_strlist (sl);
+  iobuf_close (fp);
+  if (err == -1 || gpg_err_code (err) == GPG_ERR_NO_DATA)
+    {
+      log_error (_("the signature could not be verified.\n"
+                   "Please remember that the signature file (.sig or .asc)\n"
+                   "should be the first file given on the command line.\n"));
+      err = 0;
+    }
+
+  return err;
+}
+
+
+
 void
 print_file_status( int status, const char *name, int what )
 {
@@ -215,12 +314,19 @@ verify_files (ctrl_t ctrl, int nfiles, char **files )
 
     }
     else {  /* take filenames from the array */
+        file_jobs_t jobs;
+
+        file_jobs_start (&jobs, nfiles);
 	for(i=0; i < nfiles; i++ )
           {
+            if (!file_jobs_mine (&jobs, i))
+              continue;
             rc = verify_one_file (ctrl, files[i]);
             if (!first_rc)
               first_rc = rc;
           }
+        if (file_jobs_finish (&jobs) && !first_rc)
+          first_rc = gpg_error (GPG_ERR_GENERAL);
     }
 
     return first_rc;
@@ -229,6 +335,80 @@ verify_files (ctrl_t ctrl, int nfiles, char **files )
 
 
 
+/****************
+ * Verify the files listed in a manifest read from stdin.  Each line
+ * gives the name of a signature file, optionally followed by a TAB
+ * and the name of the signed data file.  The output for each file is
+ * enclosed in FILE_START and FILE_DONE status lines.  The files are
+ * distributed over the --jobs worker processes; the key database
+ * stays open and its caches warm for all files of a worker.
+ */
+int
+verify_manifest (ctrl_t ctrl)
+{
+    char line[2048];
+    unsigned int lno = 0;
+    strlist_t list = NULL;
+    strlist_t sl;
+    char **lines;
+    char *files[2];
+    char *p;
+    file_jobs_t jobs;
+    int i, nlines, rc;
+    int first_rc = 0;
+
+    while( fgets(line, DIM(line), stdin) ) {
+	lno++;
+	if( !*line || line[strlen(line)-1] != '\n' ) {
+	    log_error(_("input line %u too long or missing LF\n"), lno );
+	    free_strlist (list);
+	    return GPG_ERR_GENERAL;
+	}
+	line[strlen(line)-1] = 0;
+	if (!*line)
+	    continue;
+	append_to_strlist (&list, line);
+    }
+
+    nlines = strlist_length (list);
+    lines = xcalloc (nlines+1, sizeof *lines);
+    for (i=0, sl=list; sl; sl = sl->next)
+	lines[i++] = sl->d;
+
+    file_jobs_start (&jobs, nlines);
+    for (i=0; i < nlines; i++)
+      {
+        if (!file_jobs_mine (&jobs, i))
+          continue;
+
+        files[0] = lines[i];
+        files[1] = NULL;
+        p = strchr (lines[i], '\t');
+        if (p)
+          {
+            *p++ = 0;
+            files[1] = p;
+          }
+
+        if (jobs.njobs > 1)
+          write_status_begin_block ();
+        print_file_status (STATUS_FILE_START, files[0], 1);
+        rc = verify_signatures (ctrl, files[1]? 2 : 1, files);
+        write_status (STATUS_FILE_DONE);
+        write_status_end_block ();
+        reset_literals_seen ();
+        if (!first_rc)
+          first_rc = rc;
+      }
+    if (file_jobs_finish (&jobs) && !first_rc)
+      first_rc = gpg_error (GPG_ERR_GENERAL);
+
+    xfree (lines);
+    free_strlist (list);
+    return first_rc;
+}
+
+
 /* Perform a verify operation.  To verify detached signatures, DATA_FD
    shall be the descriptor of the signed data; for regular signatures
    it needs to be -1.  If OUT_FP is not NULL and DATA_FD is not -1 the
@@ -0,0 +1,196 @@
+/* workpool.c - A pool of worker threads
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The worker pool is used to run CPU bound jobs, like signature
+ * verification or the encryption of AEAD chunks, in parallel.  The
+ * workers are started on first use and are kept for the lifetime of
+ * the process so that the thread startup cost is paid only once.
+ * npth is cooperative; thus the workers run the actual job function
+ * after releasing the npth lock.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <npth.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "options.h"
+#include "workpool.h"
+
+
+/* Maximum number of worker threads.  */
+#define MAX_WORKPOOL_THREADS 8
+
+
+static struct
+{
+  int initialized;        /* The pool has been set up.  */
+  unsigned int nworkers;  /* Number of running workers.  */
+  npth_mutex_t lock;      /* Protects the fields below.  */
+  npth_cond_t work_cond;  /* Signaled when new jobs are available.  */
+  npth_cond_t done_cond;  /* Signaled when a job has finished.  */
+  workpool_job_t head;    /* The queue of jobs not yet started.  */
+  workpool_job_t tail;
+} workpool;
+
+
+static void
+workpool_lock (void)
+{
+  int rc = npth_mutex_lock (&workpool.lock);
+  if (rc)
+    log_fatal ("%s: failed to acquire mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+static void
+workpool_unlock (void)
+{
+  int rc = npth_mutex_unlock (&workpool.lock);
+  if (rc)
+    log_fatal ("%s: failed to release mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+/* The thread function of a pool worker.  */
+static void *
+workpool_worker (void *arg)
+{
+  workpool_job_t job;
+
+  (void)arg;
+
+  workpool_lock ();
+  for (;;)
+    {
+      while (!workpool.head)
+        npth_cond_wait (&workpool.work_cond, &workpool.lock);
+      job = workpool.head;
+      workpool.head = job->next;
+      if (!workpool.head)
+        workpool.tail = NULL;
+      workpool_unlock ();
+
+      npth_unprotect ();
+      job->fnc (job->arg);
+      npth_protect ();
+
+      workpool_lock ();
+      job->done = 1;
+      npth_cond_broadcast (&workpool.done_cond);
+    }
+
+  return NULL;
+}
+
+
+/* Start the worker pool.  Returns the number of workers or 0 if the
+ * pool can't be used; the caller should then do the work itself.
+ * There is no point in using the pool on a single CPU system and thus
+ * 0 is also returned in that case.  */
+unsigned int
+workpool_init (void)
+{
+  long ncpu = 1;
+  npth_attr_t tattr;
+  npth_t thread;
+  int i, rc;
+
+  if (workpool.initialized)
+    return workpool.nworkers;
+  workpool.initialized = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  if (ncpu < 2)
+    return 0;
+  if (ncpu > MAX_WORKPOOL_THREADS)
+    ncpu = MAX_WORKPOOL_THREADS;
+
+  rc = npth_mutex_init (&workpool.lock, NULL);
+  if (!rc)
+    rc = npth_cond_init (&workpool.work_cond, NULL);
+  if (!rc)
+    rc = npth_cond_init (&workpool.done_cond, NULL);
+  if (!rc)
+    rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      log_info ("error initializing the worker pool: %s\n",
+                gpg_strerror (gpg_error_from_errno (rc)));
+      return 0;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+
+  for (i=0; i < ncpu; i++)
+    {
+      rc = npth_create (&thread, &tattr, workpool_worker, NULL);
+      if (rc)
+        {
+          log_info ("error spawning worker thread: %s\n",
+                    gpg_strerror (gpg_error_from_errno (rc)));
+          break;
+        }
+      workpool.nworkers++;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (opt.verbose > 1 && workpool.nworkers)
+    log_info ("started %u worker threads\n", workpool.nworkers);
+  return workpool.nworkers;
+}
+
+
+/* Queue JOB for the worker pool.  The pool must have been started
+ * successfully.  JOB must stay valid until workpool_wait returned
+ * for it.  */
+void
+workpool_submit (workpool_job_t job)
+{
+  log_assert (workpool.nworkers);
+
+  job->next = NULL;
+  job->done = 0;
+  workpool_lock ();
+  if (workpool.tail)
+    workpool.tail->next = job;
+  else
+    workpool.head = job;
+  workpool.tail = job;
+  npth_cond_signal (&workpool.work_cond);
+  workpool_unlock ();
+}
+
+
+/* Wait until the submitted JOB has been finished.  */
+void
+workpool_wait (workpool_job_t job)
+{
+  workpool_lock ();
+  while (!job->done)
+    npth_cond_wait (&workpool.done_cond, &workpool.lock);
+  workpool_unlock ();
+}
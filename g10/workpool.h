@@ -0,0 +1,41 @@
+/* workpool.h - A pool of worker threads
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef GNUPG_G10_WORKPOOL_H
+#define GNUPG_G10_WORKPOOL_H
+
+/* A job for the worker pool.  The caller sets FNC and ARG; the other
+ * fields are used by the pool.  FNC is called without holding the
+ * npth lock and thus it may only work on the data passed via ARG;
+ * in particular it may not call any log function.  */
+typedef struct workpool_job_s *workpool_job_t;
+struct workpool_job_s
+{
+  workpool_job_t next;
+  void (*fnc) (void *arg);
+  void *arg;
+  int done;
+};
+
+unsigned int workpool_init (void);
+void workpool_submit (workpool_job_t job);
+void workpool_wait (workpool_job_t job);
+
+#endif /*GNUPG_G10_WORKPOOL_H*/
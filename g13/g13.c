@@ -61,6 +61,7 @@ enum cmd_and_opt_values {
   aGPGConfTest,
   aCreate,
   aMount,
+  aMountMany,
   aUmount,
   aSuspend,
   aResume,
@@ -115,6 +116,8 @@ static gpgrt_opt_t opts[] = {
 
   ARGPARSE_c (aCreate, "create", N_("Create a new file system container")),
   ARGPARSE_c (aMount,  "mount",  N_("Mount a file system container") ),
+  ARGPARSE_c (aMountMany, "mount-many",
+              N_("Mount several file system containers") ),
   ARGPARSE_c (aUmount, "umount", N_("Unmount a file system container") ),
   ARGPARSE_c (aSuspend, "suspend", N_("Suspend a file system container") ),
   ARGPARSE_c (aResume,  "resume",  N_("Resume a file system container") ),
@@ -488,6 +491,7 @@ main (int argc, char **argv)
 
         case aServer:
         case aMount:
+        case aMountMany:
         case aUmount:
         case aSuspend:
         case aResume:
@@ -778,6 +782,15 @@ main (int argc, char **argv)
       }
       break;
 
+    case aMountMany: /* Mount several containers.  */
+      {
+        if (argc < 1)
+          wrong_args ("--mount-many filename[=mountpoint]...");
+        start_idle_task ();
+        err = g13_mount_containers (&ctrl, argv, argc);
+      }
+      break;
+
     case aUmount: /* Unmount a mounted container.  */
       {
         if (argc != 1)
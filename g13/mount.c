@@ -25,6 +25,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "g13.h"
 #include "../common/i18n.h"
@@ -41,31 +42,65 @@
 #include "call-syshelp.h"
 
 
-/* Mount the container with name FILENAME at MOUNTPOINT.  */
-gpg_error_t
-g13_mount_container (ctrl_t ctrl, const char *filename, const char *mountpoint)
+/* The maximum number of keyblobs decrypted at the same time by
+ * g13_mount_containers.  */
+#define MAX_DECRYPT_THREADS 8
+
+
+/* The state of one mount operation.  */
+struct mount_job_s
 {
-  gpg_error_t err;
+  ctrl_t ctrl;
+  const char *filename;    /* The container or its block device.  */
+  const char *mountpoint;  /* The mountpoint.  */
+  int needs_syshelp;
   dotlock_t lock;
-  int needs_syshelp = 0;
-  void *enckeyblob = NULL;
+  void *enckeyblob;
   size_t enckeybloblen;
-  void *keyblob = NULL;
+  void *keyblob;
   size_t keybloblen;
-  tupledesc_t tuples = NULL;
-  size_t n;
-  const unsigned char *value;
-  int conttype;
-  unsigned int rid;
-  char *mountpoint_buffer = NULL;
-  char *blockdev_buffer = NULL;
+  char *mountpoint_buffer;
+  char *blockdev_buffer;
+  gpg_error_t err;         /* Used by the decrypt thread.  */
+};
+typedef struct mount_job_s *mount_job_t;
+
+
+/* Release the resources of JOB.  */
+static void
+release_mount_job (mount_job_t job)
+{
+  xfree (job->keyblob);
+  job->keyblob = NULL;
+  xfree (job->enckeyblob);
+  job->enckeyblob = NULL;
+  dotlock_destroy (job->lock);
+  job->lock = NULL;
+  xfree (job->mountpoint_buffer);
+  job->mountpoint_buffer = NULL;
+  xfree (job->blockdev_buffer);
+  job->blockdev_buffer = NULL;
+}
+
+
+/* Prepare the mount of the container with name FILENAME at
+ * MOUNTPOINT: Locate the container, take the lock and read the
+ * encrypted keyblob.  JOB is initialized by this function.  */
+static gpg_error_t
+prepare_mount (ctrl_t ctrl, mount_job_t job,
+               const char *filename, const char *mountpoint)
+{
+  gpg_error_t err;
+
+  memset (job, 0, sizeof *job);
+  job->ctrl = ctrl;
 
   /* Decide whether we need to use the g13-syshelp.  */
-  err = call_syshelp_find_device (ctrl, filename, &blockdev_buffer);
+  err = call_syshelp_find_device (ctrl, filename, &job->blockdev_buffer);
   if (!err)
     {
-      needs_syshelp = 1;
-      filename = blockdev_buffer;
+      job->needs_syshelp = 1;
+      filename = job->blockdev_buffer;
     }
   else if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
     {
@@ -79,79 +114,100 @@ g13_mount_container (ctrl_t ctrl, const char *filename, const char *mountpoint)
       if (access (filename, R_OK))
         return gpg_error_from_syserror ();
     }
+  job->filename = filename;
 
   if (!mountpoint)
     {
-      mountpoint_buffer = xtrystrdup ("/tmp/g13-XXXXXX");
-      if (!mountpoint_buffer)
+      job->mountpoint_buffer = xtrystrdup ("/tmp/g13-XXXXXX");
+      if (!job->mountpoint_buffer)
         return gpg_error_from_syserror ();
-      if (!gnupg_mkdtemp (mountpoint_buffer))
+      if (!gnupg_mkdtemp (job->mountpoint_buffer))
         {
           err = gpg_error_from_syserror ();
           log_error (_("can't create directory '%s': %s\n"),
                      "/tmp/g13-XXXXXX", gpg_strerror (err));
-          xfree (mountpoint_buffer);
           return err;
         }
-      mountpoint = mountpoint_buffer;
+      mountpoint = job->mountpoint_buffer;
     }
+  job->mountpoint = mountpoint;
 
-  err = 0;
-  if (needs_syshelp)
-    lock = NULL;
-  else
+  if (!job->needs_syshelp)
     {
-      /* Try to take a lock.  */
-      lock = dotlock_create (filename, 0);
-      if (!lock)
-        {
-          xfree (mountpoint_buffer);
-          return gpg_error_from_syserror ();
-        }
+      struct stat sb;
 
-      if (dotlock_take (lock, 0))
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-    }
+      /* Try to take a lock.  */
+      job->lock = dotlock_create (filename, 0);
+      if (!job->lock)
+        return gpg_error_from_syserror ();
 
-  /* Check again that the file exists.  */
-  if (!needs_syshelp)
-    {
-      struct stat sb;
+      if (dotlock_take (job->lock, 0))
+        return gpg_error_from_syserror ();
 
+      /* Check again that the file exists.  */
       if (stat (filename, &sb))
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
+        return gpg_error_from_syserror ();
     }
 
   /* Read the encrypted keyblob.  */
-  if (needs_syshelp)
+  if (job->needs_syshelp)
     {
       err = call_syshelp_set_device (ctrl, filename);
       if (err)
-        goto leave;
-      err = call_syshelp_get_keyblob (ctrl, &enckeyblob, &enckeybloblen);
+        return err;
+      err = call_syshelp_get_keyblob (ctrl, &job->enckeyblob,
+                                      &job->enckeybloblen);
     }
   else
-    err = g13_keyblob_read (filename, &enckeyblob, &enckeybloblen);
-  if (err)
-    goto leave;
+    err = g13_keyblob_read (filename, &job->enckeyblob, &job->enckeybloblen);
+
+  return err;
+}
+
+
+/* Decrypt the keyblob of JOB.  */
+static gpg_error_t
+decrypt_mount_keyblob (mount_job_t job)
+{
+  gpg_error_t err;
 
-  /* Decrypt that keyblob and store it in a tuple descriptor.  */
-  err = g13_keyblob_decrypt (ctrl, enckeyblob, enckeybloblen,
-                             &keyblob, &keybloblen);
+  err = g13_keyblob_decrypt (job->ctrl, job->enckeyblob, job->enckeybloblen,
+                             &job->keyblob, &job->keybloblen);
   if (err)
-    goto leave;
-  xfree (enckeyblob);
-  enckeyblob = NULL;
+    return err;
+  xfree (job->enckeyblob);
+  job->enckeyblob = NULL;
+  return 0;
+}
+
+
+/* Thread to run decrypt_mount_keyblob.  */
+static void *
+decrypt_thread (void *arg)
+{
+  mount_job_t job = arg;
 
-  err = create_tupledesc (&tuples, keyblob, keybloblen);
+  job->err = decrypt_mount_keyblob (job);
+  return NULL;
+}
+
+
+/* Mount the container of JOB using the decrypted keyblob.  */
+static gpg_error_t
+finish_mount (mount_job_t job)
+{
+  gpg_error_t err;
+  ctrl_t ctrl = job->ctrl;
+  tupledesc_t tuples = NULL;
+  size_t n;
+  const unsigned char *value;
+  int conttype;
+  unsigned int rid;
+
+  /* Store the keyblob in a tuple descriptor.  */
+  err = create_tupledesc (&tuples, job->keyblob, job->keybloblen);
   if (!err)
-    keyblob = NULL;
+    job->keyblob = NULL;
   else
     {
       if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
@@ -172,7 +228,8 @@ g13_mount_container (ctrl_t ctrl, const char *filename, const char *mountpoint)
       err = gpg_error (GPG_ERR_NOT_SUPPORTED);
       goto leave;
     }
-  err = be_mount_container (ctrl, conttype, filename, mountpoint, tuples, &rid);
+  err = be_mount_container (ctrl, conttype, job->filename, job->mountpoint,
+                            tuples, &rid);
   if (err)
     ;
   else if (conttype == CONTTYPE_DM_CRYPT)
@@ -182,13 +239,13 @@ g13_mount_container (ctrl_t ctrl, const char *filename, const char *mountpoint)
       /* Unless this is a DM-CRYPT mount we put it into our mounttable
          so that we can manage the mounts ourselves.  For dm-crypt we
          do not keep a process to monitor he mounts (for now).  */
-      err = mountinfo_add_mount (filename, mountpoint, conttype, rid,
-                                 !!mountpoint_buffer);
+      err = mountinfo_add_mount (job->filename, job->mountpoint, conttype,
+                                 rid, !!job->mountpoint_buffer);
       /* Fixme: What shall we do if this fails?  Add a provisional
          mountinfo entry first and remove it on error? */
       if (!err)
         {
-          char *tmp = percent_plus_escape (mountpoint);
+          char *tmp = percent_plus_escape (job->mountpoint);
           if (!tmp)
             err = gpg_error_from_syserror ();
           else
@@ -201,15 +258,122 @@ g13_mount_container (ctrl_t ctrl, const char *filename, const char *mountpoint)
 
  leave:
   destroy_tupledesc (tuples);
-  xfree (keyblob);
-  xfree (enckeyblob);
-  dotlock_destroy (lock);
-  xfree (mountpoint_buffer);
-  xfree (blockdev_buffer);
   return err;
 }
 
 
+/* Mount the container with name FILENAME at MOUNTPOINT.  */
+gpg_error_t
+g13_mount_container (ctrl_t ctrl, const char *filename, const char *mountpoint)
+{
+  gpg_error_t err;
+  struct mount_job_s job;
+
+  err = prepare_mount (ctrl, &job, filename, mountpoint);
+  if (!err)
+    err = decrypt_mount_keyblob (&job);
+  if (!err)
+    err = finish_mount (&job);
+  release_mount_job (&job);
+  return err;
+}
+
+
+/* Mount the NSPECS containers described by SPECS.  Each item is the
+ * name of a container optionally followed by an equal sign and the
+ * mountpoint.  The keyblobs are first read and then decrypted
+ * concurrently; the actual mounts are done one after the other.  An
+ * error is printed for each container which could not be mounted and
+ * the first error is returned.  */
+gpg_error_t
+g13_mount_containers (ctrl_t ctrl, char **specs, int nspecs)
+{
+  gpg_error_t err;
+  gpg_error_t firsterr = 0;
+  mount_job_t jobs;
+  char **names;
+  char *p;
+  npth_attr_t tattr;
+  npth_t threads[MAX_DECRYPT_THREADS];
+  int started[MAX_DECRYPT_THREADS];
+  int i, j, n;
+
+  jobs = xtrycalloc (nspecs, sizeof *jobs);
+  if (!jobs)
+    return gpg_error_from_syserror ();
+  names = xtrycalloc (nspecs, sizeof *names);
+  if (!names)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (jobs);
+      return err;
+    }
+
+  /* Read all keyblobs.  A failed job keeps its error in ERR and is
+   * skipped by the next steps.  */
+  for (i=0; i < nspecs; i++)
+    {
+      names[i] = xtrystrdup (specs[i]);
+      if (!names[i])
+        {
+          jobs[i].err = gpg_error_from_syserror ();
+          continue;
+        }
+      p = strchr (names[i], '=');
+      if (p)
+        *p++ = 0;
+      jobs[i].err = prepare_mount (ctrl, jobs + i, names[i],
+                                   p && *p? p : NULL);
+    }
+
+  /* Decrypt the keyblobs; each gpg process is run by its own thread.  */
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < nspecs; i += n)
+    {
+      n = nspecs - i;
+      if (n > MAX_DECRYPT_THREADS)
+        n = MAX_DECRYPT_THREADS;
+      for (j=0; j < n; j++)
+        {
+          started[j] = 0;
+          if (jobs[i+j].err)
+            continue;
+          if (!npth_create (&threads[j], &tattr, decrypt_thread, jobs + i + j))
+            started[j] = 1;
+          else  /* Could not create a thread; do it ourselves.  */
+            jobs[i+j].err = decrypt_mount_keyblob (jobs + i + j);
+        }
+      for (j=0; j < n; j++)
+        if (started[j])
+          npth_join (threads[j], NULL);
+    }
+  npth_attr_destroy (&tattr);
+
+  /* Mount the containers.  */
+  for (i=0; i < nspecs; i++)
+    {
+      err = jobs[i].err;
+      if (!err)
+        err = finish_mount (jobs + i);
+      if (err)
+        {
+          log_error ("error mounting container '%s': %s <%s>\n",
+                     names[i]? names[i] : specs[i],
+                     gpg_strerror (err), gpg_strsource (err));
+          if (!firsterr)
+            firsterr = err;
+        }
+      release_mount_job (jobs + i);
+      xfree (names[i]);
+    }
+
+  xfree (names);
+  xfree (jobs);
+  return firsterr;
+}
+
+
 /* Unmount the container with name FILENAME or the one mounted at
    MOUNTPOINT.  If both are given the FILENAME takes precedence.  */
 gpg_error_t
@@ -23,6 +23,7 @@
 gpg_error_t g13_mount_container (ctrl_t ctrl,
                                  const char *filename,
                                  const char *mountpoint);
+gpg_error_t g13_mount_containers (ctrl_t ctrl, char **specs, int nspecs);
 gpg_error_t g13_umount_container (ctrl_t ctrl,
                                   const char *filename,
                                   const char *mountpoint);
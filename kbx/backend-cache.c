@@ -38,12 +38,23 @@
 #include "keybox-defs.h"
 
 
-/* Standard values for the number of buckets and the threshold we use
- * to flush items.  */
+/* The initial number of buckets of the hash tables.  The tables are
+ * grown as needed so that the average number of items per bucket
+ * does not exceed ITEMS_PER_BUCKET_THRESHOLD.  */
 #define NO_OF_KEY_ITEM_BUCKETS          383
-#define KEY_ITEMS_PER_BUCKET_THRESHOLD  40
 #define NO_OF_BLOB_BUCKETS              383
-#define BLOBS_PER_BUCKET_THRESHOLD      20
+#define ITEMS_PER_BUCKET_THRESHOLD      4
+
+/* The default memory budget of the cache in bytes.  This can be
+ * changed with --cache-size.  Of the budget 1/8 is reserved for the
+ * key table and the rest used for the blobs.  */
+#define DEFAULT_CACHE_SIZE  (64 * 1024 * 1024)
+
+/* The maximum value of the usecount.  The usecount is used by the
+ * CLOCK algorithm to decide which items to evict; each sweep of the
+ * clock hand halves it.  Limiting it makes sure that a once popular
+ * item ages out after a few sweeps.  */
+#define MAX_USECOUNT  15
 
 
 /* Our definition of the backend handle.  */
@@ -69,7 +80,9 @@ typedef struct blob_s
 
 static blob_t *blob_table;                /* Hash table with the blobs.   */
 static size_t blob_table_size;            /* Number of allocated buckets. */
-static unsigned int blob_table_threshold; /* Max. # of items per bucket.  */
+static unsigned int blob_table_count;     /* Number of items in the table.*/
+static size_t blob_table_bytes;           /* Memory used by the items.    */
+static size_t blob_table_hand;            /* The clock hand for eviction. */
 static unsigned int blob_table_added;     /* Number of items added.       */
 static unsigned int blob_table_dropped;   /* Number of items dropped.     */
 static blob_t blob_attic;                 /* List of freed blobs.         */
@@ -115,32 +128,62 @@ typedef struct key_item_s
 
 static key_item_t *key_table;            /* Hash table with the keys.    */
 static size_t key_table_size;            /* Number of allocated buckets. */
-static unsigned int key_table_threshold; /* Max. # of items per bucket.  */
+static unsigned int key_table_count;     /* Number of items in the table.*/
+static size_t key_table_bytes;           /* Memory used by the items.    */
+static size_t key_table_hand;            /* The clock hand for eviction. */
 static unsigned int key_table_added;     /* Number of items added.       */
 static unsigned int key_table_dropped;   /* Number of items dropped.     */
 static key_item_t key_item_attic;        /* List of freed items.         */
 
+/* Statistics on the cache lookups.  */
+static unsigned long cache_hits;
+static unsigned long cache_misses;
 
 
-
-/* The hash function we use for the key_table.  Must not call a system
- * function.  */
+
+/* Return the memory budget of the entire cache in bytes.  */
+static size_t
+cache_budget (void)
+{
+  return opt.cache_size? opt.cache_size : DEFAULT_CACHE_SIZE;
+}
+
+
+/* Return the memory budget of the blob table.  */
+static size_t
+blob_table_budget (void)
+{
+  size_t budget = cache_budget ();
+
+  return budget - budget / 8;
+}
+
+
+/* Return the memory budget of the key table.  */
+static size_t
+key_table_budget (void)
+{
+  return cache_budget () / 8;
+}
+
+
+/* The hash function we use for the blob_table.  Must not call a
+ * system function.  */
 static inline unsigned int
 blob_table_hasher (const unsigned char *ubid)
 {
-  return (ubid[0] << 16 | ubid[1]) % blob_table_size;
+  return buf32_to_uint (ubid) % blob_table_size;
 }
 
 
-/* Runtime allocation of the key table.  This allows us to eventually
- * add an option to control the size.  */
+/* Runtime allocation of the blob table.  The table is later grown
+ * by blob_table_maybe_grow as needed.  */
 static gpg_error_t
 blob_table_init (void)
 {
   if (blob_table)
     return 0;
   blob_table_size = NO_OF_BLOB_BUCKETS;
-  blob_table_threshold  = BLOBS_PER_BUCKET_THRESHOLD;
   blob_table = xtrycalloc (blob_table_size, sizeof *blob_table);
   if (!blob_table)
     return gpg_error_from_syserror ();
@@ -168,39 +211,93 @@ blob_unref (blob_t blob)
 
 
 /* Given the hash value and the ubid, find the blob in the bucket.
- * Returns NULL if not found or the blob item if found.  Always
- * returns the the number of items searched, which is in the case of a
- * not-found the length of the chain.  */
+ * Returns NULL if not found or the blob item if found.  */
 static blob_t
-find_blob (unsigned int hash, const unsigned char *ubid,
-           unsigned int *r_count)
+find_blob (unsigned int hash, const unsigned char *ubid)
 {
   blob_t b;
-  unsigned int count = 0;
 
-  for (b = blob_table[hash]; b; b = b->next, count++)
+  for (b = blob_table[hash]; b; b = b->next)
     if (!memcmp (b->ubid, ubid, UBID_LEN))
       break;
-  if (r_count)
-    *r_count = count;
   return b;
 }
 
 
-/* Helper for the qsort in key_table_put.  */
-static int
-compare_blobs (const void *arg_a, const void *arg_b)
+/* Grow the blob table if the average chain got too long.  If we
+ * can't allocate a new table we keep on using the old one.  */
+static void
+blob_table_maybe_grow (void)
 {
-  const blob_t a = *(const blob_t *)arg_a;
-  const blob_t b = *(const blob_t *)arg_b;
+  blob_t *newtable, *oldtable, b, b_next;
+  size_t newsize, oldsize, idx;
+  unsigned int hash;
 
-  /* Reverse sort on the usecount.  */
-  if (a->usecount > b->usecount)
-    return -1;
-  else if (a->usecount == b->usecount)
-    return 0;
-  else
-    return 1;
+  if (blob_table_count / ITEMS_PER_BUCKET_THRESHOLD < blob_table_size)
+    return;
+
+  newsize = 2 * blob_table_size + 1;
+  newtable = xtrycalloc (newsize, sizeof *newtable);
+  if (!newtable)
+    {
+      log_info ("Note: malloc failed while growing the blob cache: %s\n",
+                gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  /* Move all items to the new table.  Note that we may not use any
+   * system call here.  */
+  oldtable = blob_table;
+  oldsize = blob_table_size;
+  blob_table = newtable;
+  blob_table_size = newsize;
+  for (idx=0; idx < oldsize; idx++)
+    for (b = oldtable[idx]; b; b = b_next)
+      {
+        b_next = b->next;
+        hash = blob_table_hasher (b->ubid);
+        b->next = blob_table[hash];
+        blob_table[hash] = b;
+      }
+  blob_table_hand = 0;
+  xfree (oldtable);
+
+  if (DBG_CACHE)
+    log_debug ("cache: blob table grown to %zu buckets\n", newsize);
+}
+
+
+/* Evict blobs using the CLOCK algorithm until NEEDED more bytes fit
+ * into the budget of the blob table.  The clock hand moves over the
+ * buckets; all blobs of a bucket with a usecount of zero are evicted
+ * and the usecount of the others is halved.  */
+static void
+blob_table_evict (size_t needed)
+{
+  size_t budget = blob_table_budget ();
+  blob_t b, *bp;
+
+  while (blob_table_count && blob_table_bytes + needed > budget)
+    {
+      if (blob_table_hand >= blob_table_size)
+        blob_table_hand = 0;
+      for (bp = &blob_table[blob_table_hand]; (b = *bp); )
+        {
+          if (b->usecount)
+            {
+              b->usecount /= 2;
+              bp = &b->next;
+              continue;
+            }
+          *bp = b->next;
+          b->next = NULL;
+          blob_table_count--;
+          blob_table_bytes -= sizeof *b + b->datalen;
+          blob_table_dropped++;
+          blob_unref (b);
+        }
+      blob_table_hand++;
+    }
 }
 
 
@@ -212,14 +309,22 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
 {
   unsigned int hash;
   blob_t b;
-  unsigned int count, n;
+  unsigned int n;
   void *blobdatacopy = NULL;
 
+  /* Do not let a single huge blob flush a large part of the cache.  */
+  if (blobdatalen > blob_table_budget () / 4)
+    return;
+
   hash = blob_table_hasher (ubid);
  find_again:
-  b = find_blob (hash, ubid, &count);
+  b = find_blob (hash, ubid);
   if (b)
     {
+      /* The blob has been read again from the database; count this
+       * as a use so that the hot set reflects it.  */
+      if (b->usecount < MAX_USECOUNT)
+        b->usecount++;
       xfree (blobdatacopy);
       return;  /* Already got this blob.  */
     }
@@ -237,71 +342,8 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
       memcpy (blobdatacopy, blobdata, blobdatalen);
     }
 
-  /* If the bucket is full remove a couple of items. */
-  if (count >= blob_table_threshold)
-    {
-      blob_t list_head, *list_tailp, b_next;
-      blob_t *array;
-      int narray, idx;
-
-      /* Unlink from the global list so that other threads don't
-       * disturb us.  If another thread adds or removes something only
-       * one will be the winner.  Bad luck for the dropped cache items
-       * but after all it is just a cache.  */
-      list_head = blob_table[hash];
-      blob_table[hash] = NULL;
-
-      /* Put all items into an array for sorting.  */
-      array = xtrycalloc (count, sizeof *array);
-      if (!array)
-        {
-          /* That's bad; give up all  items of the bucket.  */
-          log_info ("Note: malloc failed while purging blobs from the "
-                    "cache: %s\n", gpg_strerror (gpg_error_from_syserror ()));
-          goto leave_drop;
-        }
-      narray = 0;
-      for (b = list_head; b; b = b_next)
-        {
-          b_next = b->next;
-          array[narray++] = b;
-          b->next = NULL;
-        }
-      log_assert (narray == count);
-
-      /* Sort the array and put half of it onto a new list.  */
-      qsort (array, narray, sizeof *array, compare_blobs);
-      list_head = NULL;
-      list_tailp = &list_head;
-      for (idx=0; idx < narray/2; idx++)
-        {
-          *list_tailp = array[idx];
-          list_tailp = &array[idx]->next;
-        }
-
-      /* Put the new list into the bucket.  */
-      b = blob_table[hash];
-      blob_table[hash] = list_head;
-      list_head = b;
-
-      /* Free the remaining items and the array.  */
-      for (; idx < narray; idx++)
-        {
-          blob_unref (array[idx]);
-          blob_table_dropped++;
-        }
-      xfree (array);
-
-    leave_drop:
-      /* Free any items added in the meantime by other threads.  This
-       * is also used in case of a malloc problem (which won't update
-       * the counters, though). */
-      for ( ; list_head; list_head = b_next)
-        {
-          b_next = list_head->next;
-          blob_unref (list_head);
-        }
-    }
+  /* Make room for the new item.  */
+  blob_table_evict (sizeof *b + blobdatalen);
 
   /* Add an item to the bucket.  We allocate a whole block of items
    * for cache performance reasons.  */
@@ -343,7 +385,11 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
   b->refcount = 1;
   b->next = blob_table[hash];
   blob_table[hash] = b;
+  blob_table_count++;
+  blob_table_bytes += sizeof *b + blobdatalen;
   blob_table_added++;
+
+  blob_table_maybe_grow ();
 }
 
 
@@ -356,10 +402,11 @@ blob_table_get (const unsigned char *ubid)
   blob_t b;
 
   hash = blob_table_hasher (ubid);
-  b = find_blob (hash, ubid, NULL);
+  b = find_blob (hash, ubid);
   if (b)
     {
-      b->usecount++;
+      if (b->usecount < MAX_USECOUNT)
+        b->usecount++;
       b->refcount++;
       return b;  /* Found  */
     }
@@ -368,7 +415,7 @@ blob_table_get (const unsigned char *ubid)
 }
 
 
-
+
 /* The hash function we use for the key_table.  Must not call a system
  * function.  */
 static inline unsigned int
@@ -378,15 +425,14 @@ key_table_hasher (u32 kid_l)
 }
 
 
-/* Runtime allocation of the key table.  This allows us to eventually
- * add an option to control the size.  */
+/* Runtime allocation of the key table.  The table is later grown by
+ * key_table_maybe_grow as needed.  */
 static gpg_error_t
 key_table_init (void)
 {
   if (key_table)
     return 0;
   key_table_size = NO_OF_KEY_ITEM_BUCKETS;
-  key_table_threshold  = KEY_ITEMS_PER_BUCKET_THRESHOLD;
   key_table = xtrycalloc (key_table_size, sizeof *key_table);
   if (!key_table)
     return gpg_error_from_syserror ();
@@ -421,40 +467,105 @@ key_item_unref (key_item_t ki)
 
 
 /* Given the hash value and the search info, find the key item in the
- * bucket.  Return NULL if not found or the key item if found.  Always
- * returns the the number of items searched, which is in the case of a
- * not-found the length of the chain.  Note that FPR may only be NULL
- * if FPRLEN is 0. */
+ * bucket.  Return NULL if not found or the key item if found.  */
 static key_item_t
-find_in_chain (unsigned int hash, u32 kid_h, u32 kid_l,
-               unsigned int *r_count)
+find_in_chain (unsigned int hash, u32 kid_h, u32 kid_l)
 {
   key_item_t ki = key_table[hash];
-  unsigned int count = 0;
 
-  for (; ki; ki = ki->next, count++)
+  for (; ki; ki = ki->next)
     if (ki->kid_h == kid_h && ki->kid_l == kid_l)
       break;
-  if (r_count)
-    *r_count = count;
   return ki;
 }
 
 
-/* Helper for the qsort in key_table_put.  */
-static int
-compare_key_items (const void *arg_a, const void *arg_b)
+/* Grow the key table if the average chain got too long.  If we can't
+ * allocate a new table we keep on using the old one.  */
+static void
+key_table_maybe_grow (void)
 {
-  const key_item_t a = *(const key_item_t *)arg_a;
-  const key_item_t b = *(const key_item_t *)arg_b;
+  key_item_t *newtable, *oldtable, ki, ki_next;
+  size_t newsize, oldsize, idx;
+  unsigned int hash;
 
-  /* Reverse sort on the usecount.  */
-  if (a->usecount > b->usecount)
-    return -1;
-  else if (a->usecount == b->usecount)
-    return 0;
-  else
-    return 1;
+  if (key_table_count / ITEMS_PER_BUCKET_THRESHOLD < key_table_size)
+    return;
+
+  newsize = 2 * key_table_size + 1;
+  newtable = xtrycalloc (newsize, sizeof *newtable);
+  if (!newtable)
+    {
+      log_info ("Note: malloc failed while growing the key cache: %s\n",
+                gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  /* Move all items to the new table.  Note that we may not use any
+   * system call here.  */
+  oldtable = key_table;
+  oldsize = key_table_size;
+  key_table = newtable;
+  key_table_size = newsize;
+  for (idx=0; idx < oldsize; idx++)
+    for (ki = oldtable[idx]; ki; ki = ki_next)
+      {
+        ki_next = ki->next;
+        hash = key_table_hasher (ki->kid_l);
+        ki->next = key_table[hash];
+        key_table[hash] = ki;
+      }
+  key_table_hand = 0;
+  xfree (oldtable);
+
+  if (DBG_CACHE)
+    log_debug ("cache: key table grown to %zu buckets\n", newsize);
+}
+
+
+/* Return the memory used by the key item KI and its bloblist.  */
+static size_t
+key_item_size (key_item_t ki)
+{
+  size_t n = sizeof *ki;
+  bloblist_t bl;
+
+  for (bl = ki->blist; bl; bl = bl->next)
+    n += sizeof *bl;
+  return n;
+}
+
+
+/* Evict key items using the CLOCK algorithm until NEEDED more bytes
+ * fit into the budget of the key table.  See blob_table_evict for
+ * details.  */
+static void
+key_table_evict (size_t needed)
+{
+  size_t budget = key_table_budget ();
+  key_item_t ki, *kip;
+
+  while (key_table_count && key_table_bytes + needed > budget)
+    {
+      if (key_table_hand >= key_table_size)
+        key_table_hand = 0;
+      for (kip = &key_table[key_table_hand]; (ki = *kip); )
+        {
+          if (ki->usecount)
+            {
+              ki->usecount /= 2;
+              kip = &ki->next;
+              continue;
+            }
+          *kip = ki->next;
+          ki->next = NULL;
+          key_table_count--;
+          key_table_bytes -= key_item_size (ki);
+          key_table_dropped++;
+          key_item_unref (ki);
+        }
+      key_table_hand++;
+    }
 }
 
 
@@ -545,85 +656,6 @@ new_bloblist_item (const unsigned char *fpr, unsigned int fprlen,
 }
 
 
-/* If the list of key item in the bucken HASH is full remove a couple
- * of them.  On error a diagnostic is printed and an error code
- * return.  Note that the error code GPG_ERR_TRUE is returned if any
- * flush and thus system calls were done.
- */
-static gpg_error_t
-maybe_flush_some_key_buckets (unsigned int hash, unsigned int count)
-{
-  gpg_error_t err;
-  key_item_t ki, list_head, *list_tailp, ki_next;
-  key_item_t *array;
-  int narray, idx;
-
-  if (count < key_table_threshold)
-    return 0;  /* Nothing to do.  */
-
-  /* Unlink from the global list so that other threads don't disturb
-   * us.  If another thread adds or removes something only one will be
-   * the winner.  Bad luck for the dropped cache items but after all
-   * it is just a cache.  */
-  list_head = key_table[hash];
-  key_table[hash] = NULL;
-
-  /* Put all items into an array for sorting.  */
-  array = xtrycalloc (count, sizeof *array);
-  if (!array)
-    {
-      /* That's bad; give up all items of the bucket.  */
-      err = gpg_error_from_syserror ();
-      log_info ("Note: malloc failed while purging from the cache: %s\n",
-                gpg_strerror (err));
-      goto leave;
-    }
-  narray = 0;
-  for (ki = list_head; ki; ki = ki_next)
-    {
-      ki_next = ki->next;
-      array[narray++] = ki;
-      ki->next = NULL;
-    }
-  log_assert (narray == count);
-
-  /* Sort the array and put half of it onto a new list.  */
-  qsort (array, narray, sizeof *array, compare_key_items);
-  list_head = NULL;
-  list_tailp = &list_head;
-  for (idx=0; idx < narray/2; idx++)
-    {
-      *list_tailp = array[idx];
-      list_tailp = &array[idx]->next;
-    }
-
-  /* Put the new list into the bucket.  */
-  ki = key_table[hash];
-  key_table[hash] = list_head;
-  list_head = ki;
-
-  /* Free the remaining items and the array.  */
-  for (; idx < narray; idx++)
-    {
-      key_item_unref (array[idx]);
-      key_table_dropped++;
-    }
-  xfree (array);
-  err = gpg_error (GPG_ERR_TRUE);
-
- leave:
-  /* Free any items added in the meantime by other threads.  This is
-   * also used in case of a malloc problem (which won't update the
-   * counters, though). */
-  for ( ; list_head; list_head = ki_next)
-    {
-      ki_next = list_head->next;
-      key_item_unref (list_head);
-    }
-  return err;
-}
-
-
 /* This is the core of
  *   key_table_put,
  *   key_table_put_no_fpr,
@@ -637,14 +669,14 @@ do_key_table_put (u32 kid_h, u32 kid_l,
   unsigned int hash;
   key_item_t ki;
   bloblist_t bl, bl_tail;
-  unsigned int count;
   int do_find_again;
   int mark_not_found = !fpr;
+  int evicted = 0;
 
   hash = key_table_hasher (kid_l);
  find_again:
   do_find_again = 0;
-  ki = find_in_chain (hash, kid_h, kid_l, &count);
+  ki = find_in_chain (hash, kid_h, kid_l);
   if (ki)
     {
       if (mark_not_found)
@@ -673,16 +705,16 @@ do_key_table_put (u32 kid_h, u32 kid_l,
         bl_tail->next = bl;
       else
         ki->blist = bl;
+      key_table_bytes += sizeof *bl;
 
       return;
     }
 
-  /* If the bucket is full remove a couple of items. */
-  if (maybe_flush_some_key_buckets (hash, count))
+  /* Make room for the new item.  */
+  if (!evicted)
     {
-      /* During the function call another thread might have changed
-       * the bucket.  Thus we need to start over.  */
-      do_find_again = 1;
+      key_table_evict (sizeof *ki + (mark_not_found? 0 : sizeof *bl));
+      evicted = 1;
     }
 
   if (!key_item_attic)
@@ -720,7 +752,11 @@ do_key_table_put (u32 kid_h, u32 kid_l,
 
   ki->next = key_table[hash];
   key_table[hash] = ki;
+  key_table_count++;
+  key_table_bytes += key_item_size (ki);
   key_table_added++;
+
+  key_table_maybe_grow ();
 }
 
 
@@ -793,10 +829,11 @@ key_table_get (u32 kid_h, u32 kid_l)
   key_item_t ki;
 
   hash = key_table_hasher (kid_l);
-  ki = find_in_chain (hash, kid_h, kid_l, NULL);
+  ki = find_in_chain (hash, kid_h, kid_l);
   if (ki)
     {
-      ki->usecount++;
+      if (ki->usecount < MAX_USECOUNT)
+        ki->usecount++;
       ki->refcount++;
       return ki;  /* Found  */
     }
@@ -1078,6 +1115,12 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
     err = gpg_error (GPG_ERR_EOF);
 
  leave:
+  if (!desc)
+    ; /* Reset operation.  */
+  else if (!err || gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    cache_hits++;
+  else if (gpg_err_code (err) == GPG_ERR_EOF)
+    cache_misses++;
   return err;
 }
 
@@ -1198,3 +1241,92 @@ be_cache_not_found (ctrl_t ctrl, enum pubkey_types pubkey_type,
         }
     }
 }
+
+
+/* Return statistics about the cache at STATS.  */
+void
+be_cache_get_stats (struct be_cache_stats_s *stats)
+{
+  memset (stats, 0, sizeof *stats);
+  stats->hits = cache_hits;
+  stats->misses = cache_misses;
+  stats->evictions = (unsigned long)blob_table_dropped + key_table_dropped;
+  stats->nblobs = blob_table_count;
+  stats->nkeys = key_table_count;
+  stats->bytes = blob_table_bytes + key_table_bytes;
+  stats->budget = cache_budget ();
+}
+
+
+/* Return true if the blob with UBID is in the cache.  */
+int
+be_cache_has_blob (const unsigned char *ubid)
+{
+  if (!blob_table)
+    return 0;
+  return !!find_blob (blob_table_hasher (ubid), ubid);
+}
+
+
+/* Helper for be_cache_get_hotset to sort by descending usecount.  */
+static int
+compare_blobs_by_usecount (const void *a_arg, const void *b_arg)
+{
+  const blob_t a = *(const blob_t *)a_arg;
+  const blob_t b = *(const blob_t *)b_arg;
+
+  if (a->usecount > b->usecount)
+    return -1;
+  if (a->usecount < b->usecount)
+    return 1;
+  return 0;
+}
+
+
+/* Return the UBIDs of up to MAXITEMS cached blobs, the most used
+ * blobs first.  On success a malloced array of UBID_LEN sized items
+ * is stored at R_UBIDS and the number of items at R_COUNT.  */
+gpg_error_t
+be_cache_get_hotset (unsigned int maxitems,
+                     unsigned char **r_ubids, unsigned int *r_count)
+{
+  blob_t *list, b;
+  unsigned char *ubids;
+  unsigned int nalloc, n, idx;
+  size_t bucket;
+
+  *r_ubids = NULL;
+  *r_count = 0;
+
+  nalloc = blob_table_count;
+  if (!nalloc)
+    return 0;
+  list = xtrycalloc (nalloc, sizeof *list);
+  if (!list)
+    return gpg_error_from_syserror ();
+  ubids = xtrymalloc ((size_t)(nalloc < maxitems? nalloc : maxitems)
+                      * UBID_LEN + 1);
+  if (!ubids)
+    {
+      gpg_error_t err = gpg_error_from_syserror ();
+      xfree (list);
+      return err;
+    }
+
+  /* The table may have changed during the mallocs and thus we stop
+   * at NALLOC items.  Note that we may not use any system call from
+   * here on.  */
+  for (n=0, bucket=0; bucket < blob_table_size && n < nalloc; bucket++)
+    for (b = blob_table[bucket]; b && n < nalloc; b = b->next)
+      list[n++] = b;
+  qsort (list, n, sizeof *list, compare_blobs_by_usecount);
+  if (n > maxitems)
+    n = maxitems;
+  for (idx=0; idx < n; idx++)
+    memcpy (ubids + idx * UBID_LEN, list[idx]->ubid, UBID_LEN);
+
+  xfree (list);
+  *r_ubids = ubids;
+  *r_count = n;
+  return 0;
+}
@@ -453,3 +453,26 @@ be_kbx_delete (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request)
  leave:
   return err;
 }
+
+
+/* Do one step of the incremental compaction of the keybox.
+ * BACKEND_HD is the handle for this backend.  On success R_MORE is set
+ * to true if another step may reclaim more space.  */
+gpg_error_t
+be_kbx_compact_step (ctrl_t ctrl, backend_handle_t backend_hd, int *r_more)
+{
+  gpg_error_t err;
+  KEYBOX_HANDLE kbx_hd;
+
+  (void)ctrl;
+
+  log_assert (backend_hd && backend_hd->db_type == DB_TYPE_KBX);
+
+  *r_more = 0;
+  kbx_hd = keybox_new_openpgp (backend_hd->token, 0);
+  if (!kbx_hd)
+    return gpg_error_from_syserror ();
+  err = keybox_compact_step (kbx_hd, r_more);
+  keybox_release (kbx_hd);
+  return err;
+}
@@ -61,10 +61,47 @@ struct backend_handle_s
 };
 
 
+/* The slots of the prepared statement cache.  There is one slot for
+ * each search mode supported by run_select_statement.  */
+enum select_slots
+  {
+   SELECT_SLOT_EXACT,
+   SELECT_SLOT_MAIL,
+   SELECT_SLOT_MAILSUB,
+   SELECT_SLOT_SUBSTR,
+   SELECT_SLOT_LONG_KID,
+   SELECT_SLOT_FPR,
+   SELECT_SLOT_KEYGRIP,
+   SELECT_SLOT_UBID,
+   SELECT_SLOT_FIRST,
+   N_SELECT_SLOTS
+  };
+
+
+/* A read-only database connection used for searching.  Using a
+ * separate connection for each request gives each search its own
+ * read snapshot of the database so that a concurrent STORE does
+ * neither block the search nor change its results.  The connections
+ * are kept in a pool when not in use so that the prepared statements
+ * can be re-used by the next request.  */
+struct read_conn_s
+{
+  struct read_conn_s *next;  /* Next idle connection in the pool.  */
+  sqlite3 *db;
+  /* The prepared select statements indexed by enum select_slots.  */
+  sqlite3_stmt *stmts[N_SELECT_SLOTS];
+};
+typedef struct read_conn_s *read_conn_t;
+
+
 /* Definition of local request data.  */
 struct be_sqlite_local_s
 {
-  /* The statement object of the current select command.  */
+  /* The read connection used by this request.  */
+  read_conn_t conn;
+
+  /* The statement object of the current select command.  This is
+   * owned by CONN.  */
   sqlite3_stmt *select_stmt;
 
   /* The search mode represented by the current select command.  */
@@ -73,18 +110,47 @@ struct be_sqlite_local_s
   /* The select statement has been executed with success.  */
   int select_done;
 
+  /* The select runs on the write connection because a batch
+   * transaction is open.  SELECT_STMT is then owned by this object
+   * and not by CONN.  */
+  int use_write_conn;
+
   /* The last row has already been reached.  */
   int select_eof;
 };
 
 
-/* The Mutex we use to protect all our SQLite calls.  */
+/* The Mutex we use to protect all our SQLite calls which modify the
+ * database.  Searches use their own connection and need no lock.  */
 static npth_mutex_t database_mutex = NPTH_MUTEX_INITIALIZER;
 /* The one and only database handle. */
 static sqlite3 *database_hd;
 /* A lockfile used make sure only we are accessing the database.  */
 static dotlock_t database_lock;
 
+/* The maximum number of idle read connections kept in the pool.
+ * Connections beyond that number are closed when released.  */
+#define MAX_IDLE_READ_CONNS 16
+
+/* The pool of idle read connections and the number of items.  */
+static read_conn_t idle_read_conns;
+static unsigned int n_idle_read_conns;
+
+/* The number of writes after which a batch transaction is committed
+ * even if the batch has not yet ended.  */
+#define MAX_BATCH_WRITES 2000
+
+/* The number of connections which started a write batch.  While this
+ * is not zero all writes are collected in one transaction; each write
+ * uses a savepoint so that a failed write does not affect the others.
+ * Searches use the write connection while that transaction is open so
+ * that the clients see their own uncommitted writes.  */
+static unsigned int batch_refcount;
+/* The batch transaction has been started.  */
+static int batch_in_transaction;
+/* The number of writes in the batch transaction.  */
+static unsigned int batch_nwrites;
+
 
 static struct
 {
@@ -288,14 +354,15 @@ run_sql_reset (sqlite3_stmt *stmt)
 }
 
 
-/* Run an SQL prepare for SQLSTR and return a statement at R_STMT.  */
+/* Run an SQL prepare for SQLSTR on the connection DB and return a
+ * statement at R_STMT.  */
 static gpg_error_t
-run_sql_prepare (const char *sqlstr, sqlite3_stmt **r_stmt)
+run_sql_prepare_db (sqlite3 *db, const char *sqlstr, sqlite3_stmt **r_stmt)
 {
   gpg_error_t err;
   int res;
 
-  res = sqlite3_prepare_v2 (database_hd, sqlstr, -1, r_stmt, NULL);
+  res = sqlite3_prepare_v2 (db, sqlstr, -1, r_stmt, NULL);
   if (res)
     err = diag_prepare_err (res, sqlstr);
   else
@@ -304,6 +371,14 @@ run_sql_prepare (const char *sqlstr, sqlite3_stmt **r_stmt)
 }
 
 
+/* Run an SQL prepare for SQLSTR and return a statement at R_STMT.  */
+static gpg_error_t
+run_sql_prepare (const char *sqlstr, sqlite3_stmt **r_stmt)
+{
+  return run_sql_prepare_db (database_hd, sqlstr, r_stmt);
+}
+
+
 /* Helper to bind a BLOB parameter to a statement.  */
 static gpg_error_t
 run_sql_bind_blob (sqlite3_stmt *stmt, int no,
@@ -486,6 +561,112 @@ run_sql_statement (const char *sqlstr)
 }
 
 
+/* Commit the transaction of a write batch.  Must be called with the
+ * mutex held.  */
+static gpg_error_t
+commit_batch (void)
+{
+  gpg_error_t err;
+
+  if (!batch_in_transaction)
+    return 0;
+  batch_in_transaction = 0;
+  err = run_sql_statement ("commit");
+  if (err)
+    {
+      log_error ("committing the batch of %u writes failed: %s\n",
+                 batch_nwrites, gpg_strerror (err));
+      if (run_sql_statement ("rollback"))
+        log_error ("Warning: database rollback failed - should not happen!\n");
+    }
+  else if (opt.verbose)
+    log_info ("committed a batch of %u writes\n", batch_nwrites);
+  batch_nwrites = 0;
+  return err;
+}
+
+
+/* Start a write operation.  This is a transaction of its own unless
+ * a write batch is active; then a savepoint in the batch transaction
+ * is used.  Must be called with the mutex held.  */
+static gpg_error_t
+begin_write (void)
+{
+  gpg_error_t err;
+
+  if (!batch_refcount)
+    return run_sql_statement ("begin transaction");
+
+  if (!batch_in_transaction)
+    {
+      err = run_sql_statement ("begin transaction");
+      if (err)
+        return err;
+      batch_in_transaction = 1;
+      batch_nwrites = 0;
+    }
+  return run_sql_statement ("savepoint write_op");
+}
+
+
+/* Finish a write operation started by begin_write.  ERR is the
+ * result of the write operation; if it is an error the operation is
+ * rolled back.  Returns ERR or the error from the commit.  */
+static gpg_error_t
+end_write (gpg_error_t err)
+{
+  if (!batch_in_transaction)
+    {
+      if (!err)
+        return run_sql_statement ("commit");
+      if (run_sql_statement ("rollback"))
+        log_error ("Warning: database rollback failed - should not happen!\n");
+      return err;
+    }
+
+  if (err)
+    {
+      if (run_sql_statement ("rollback to write_op")
+          || run_sql_statement ("release write_op"))
+        log_error ("Warning: database rollback failed - should not happen!\n");
+      return err;
+    }
+
+  err = run_sql_statement ("release write_op");
+  if (!err && ++batch_nwrites >= MAX_BATCH_WRITES)
+    err = commit_batch ();
+  return err;
+}
+
+
+/* Start a write batch.  All writes until the matching call of
+ * be_sqlite_end_batch are committed together.  Batches of several
+ * connections are merged.  */
+void
+be_sqlite_begin_batch (void)
+{
+  acquire_mutex ();
+  batch_refcount++;
+  release_mutex ();
+}
+
+
+/* End a write batch started by be_sqlite_begin_batch.  The writes are
+ * committed when the last batch ends.  */
+gpg_error_t
+be_sqlite_end_batch (void)
+{
+  gpg_error_t err = 0;
+
+  acquire_mutex ();
+  log_assert (batch_refcount);
+  if (!--batch_refcount)
+    err = commit_batch ();
+  release_mutex ();
+  return err;
+}
+
+
 /* Create and initialize a new SQL database file if it does not
  * exists; else open it and check that all required objects are
  * available.  */
@@ -546,6 +727,20 @@ create_or_open_database (const char *filename)
   /* Enable extended error codes.  */
   sqlite3_extended_result_codes (database_hd, 1);
 
+  /* Use the write-ahead log so that readers using their own
+   * connection are not blocked by a writer.  The journal mode is
+   * persistent and thus this is only needed once for a database but
+   * it does not harm to do it on each start.  */
+  res = sqlite3_exec (database_hd, "PRAGMA journal_mode = WAL",
+                      NULL, NULL, NULL);
+  if (res)
+    {
+      err = gpg_error (gpg_err_code_from_sqlite (res));
+      log_error ("error enabling WAL mode for '%s': %s\n",
+                 filename, sqlite3_errstr (res));
+      goto leave;
+    }
+
   /* Create the tables if needed.  */
   for (idx=0; idx < DIM(table_definitions); idx++)
     {
@@ -625,16 +820,109 @@ be_sqlite_release_resource (ctrl_t ctrl, backend_handle_t hd)
 }
 
 
+/* Close the read connection CONN and release its statements.  */
+static void
+close_read_conn (read_conn_t conn)
+{
+  int i;
+
+  if (!conn)
+    return;
+  for (i=0; i < N_SELECT_SLOTS; i++)
+    if (conn->stmts[i])
+      sqlite3_finalize (conn->stmts[i]);
+  /* Note that sqlite3_close_v2 accepts NULL.  */
+  sqlite3_close_v2 (conn->db);
+  xfree (conn);
+}
+
+
+/* Get a read connection for FILENAME from the pool or open a new one
+ * and store it at R_CONN.  */
+static gpg_error_t
+get_read_conn (const char *filename, read_conn_t *r_conn)
+{
+  gpg_error_t err;
+  read_conn_t conn;
+  int res;
+
+  if (idle_read_conns)
+    {
+      conn = idle_read_conns;
+      idle_read_conns = conn->next;
+      n_idle_read_conns--;
+      conn->next = NULL;
+      *r_conn = conn;
+      return 0;
+    }
+
+  *r_conn = NULL;
+  conn = xtrycalloc (1, sizeof *conn);
+  if (!conn)
+    return gpg_error_from_syserror ();
+
+  res = sqlite3_open_v2 (filename, &conn->db,
+                         (SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX),
+                         NULL);
+  if (res)
+    {
+      err = gpg_error (gpg_err_code_from_sqlite (res));
+      log_error ("error opening '%s' for reading: %s\n",
+                 filename, sqlite3_errstr (res));
+      close_read_conn (conn);
+      return err;
+    }
+  sqlite3_extended_result_codes (conn->db, 1);
+  *r_conn = conn;
+  return 0;
+}
+
+
+/* Put the read connection CONN back into the pool.  All statements
+ * are reset so that they do not keep a read snapshot.  */
+static void
+put_read_conn (read_conn_t conn)
+{
+  int i;
+
+  if (!conn)
+    return;
+
+  if (n_idle_read_conns >= MAX_IDLE_READ_CONNS)
+    {
+      close_read_conn (conn);
+      return;
+    }
+
+  for (i=0; i < N_SELECT_SLOTS; i++)
+    if (conn->stmts[i])
+      {
+        sqlite3_reset (conn->stmts[i]);
+        sqlite3_clear_bindings (conn->stmts[i]);
+      }
+  conn->next = idle_read_conns;
+  idle_read_conns = conn;
+  n_idle_read_conns++;
+}
+
+
 /* Helper for be_find_request_part to initialize a sqlite request part.  */
 gpg_error_t
 be_sqlite_init_local (backend_handle_t backend_hd, db_request_part_t part)
 {
-  (void)backend_hd;
+  gpg_error_t err;
 
   part->besqlite = xtrycalloc (1, sizeof *part->besqlite);
   if (!part->besqlite)
     return gpg_error_from_syserror ();
-  return 0;
+
+  err = get_read_conn (backend_hd->filename, &part->besqlite->conn);
+  if (err)
+    {
+      xfree (part->besqlite);
+      part->besqlite = NULL;
+    }
+  return err;
 }
 
 
@@ -642,12 +930,36 @@ be_sqlite_init_local (backend_handle_t backend_hd, db_request_part_t part)
 void
 be_sqlite_release_local (be_sqlite_local_t ctx)
 {
-  if (ctx->select_stmt)
+  if (!ctx)
+    return;
+  if (ctx->use_write_conn && ctx->select_stmt)
     sqlite3_finalize (ctx->select_stmt);
+  put_read_conn (ctx->conn);
   xfree (ctx);
 }
 
 
+/* Return the slot of the statement cache for the search MODE or -1
+ * if the mode is not supported.  */
+static int
+select_slot_from_mode (KeydbSearchMode mode)
+{
+  switch (mode)
+    {
+    case KEYDB_SEARCH_MODE_EXACT:    return SELECT_SLOT_EXACT;
+    case KEYDB_SEARCH_MODE_MAIL:     return SELECT_SLOT_MAIL;
+    case KEYDB_SEARCH_MODE_MAILSUB:  return SELECT_SLOT_MAILSUB;
+    case KEYDB_SEARCH_MODE_SUBSTR:   return SELECT_SLOT_SUBSTR;
+    case KEYDB_SEARCH_MODE_LONG_KID: return SELECT_SLOT_LONG_KID;
+    case KEYDB_SEARCH_MODE_FPR:      return SELECT_SLOT_FPR;
+    case KEYDB_SEARCH_MODE_KEYGRIP:  return SELECT_SLOT_KEYGRIP;
+    case KEYDB_SEARCH_MODE_UBID:     return SELECT_SLOT_UBID;
+    case KEYDB_SEARCH_MODE_FIRST:    return SELECT_SLOT_FIRST;
+    default:                         return -1;
+    }
+}
+
+
 /* Run a select for the search given by (DESC,NDESC).  The data is not
  * returned but stored in the request item.  */
 static gpg_error_t
@@ -656,6 +968,8 @@ run_select_statement (be_sqlite_local_t ctx,
 {
   gpg_error_t err = 0;
   unsigned int descidx;
+  int slot;
+  sqlite3 *db;
 
   descidx = 0; /* Fixme: take from context.  */
   if (descidx >= ndesc)
@@ -664,15 +978,27 @@ run_select_statement (be_sqlite_local_t ctx,
       goto leave;
     }
 
-  /* Check whether we can re-use the current select statement.  */
-  if (!ctx->select_stmt)
-    ;
-  else if (ctx->select_mode != desc[descidx].mode)
-    {
-      sqlite3_finalize (ctx->select_stmt);
-      ctx->select_stmt = NULL;
-    }
-
+  /* A new select ends the read snapshot of the current statement.  A
+   * statement on the write connection is not cached.  */
+  if (ctx->select_stmt && ctx->use_write_conn)
+    sqlite3_finalize (ctx->select_stmt);
+  else if (ctx->select_stmt && (batch_in_transaction
+                                || ctx->select_mode != desc[descidx].mode))
+    sqlite3_reset (ctx->select_stmt);
+  ctx->select_stmt = NULL;
+
+  /* While a write batch is open the select needs to see the
+   * uncommitted writes and thus runs on the write connection.  */
+  ctx->use_write_conn = batch_in_transaction;
+  db = ctx->use_write_conn? database_hd : ctx->conn->db;
+
+  /* Take the select statement from the cache.  For unsupported modes
+   * no statement is prepared and the switch below returns an
+   * error.  */
+  slot = select_slot_from_mode (desc[descidx].mode);
+  if (ctx->use_write_conn)
+    slot = -1;
+  ctx->select_stmt = slot >= 0? ctx->conn->stmts[slot] : NULL;
   ctx->select_mode = desc[descidx].mode;
 
   /* Prepare the select and bind the parameters.  */
@@ -694,30 +1020,33 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_EXACT:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE u.uid = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE u.uid = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_text (ctx->select_stmt, 1, desc[descidx].u.name);
       break;
 
     case KEYDB_SEARCH_MODE_MAIL:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE u.addrspec = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE u.addrspec = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_text (ctx->select_stmt, 1, desc[descidx].u.name);
       break;
 
     case KEYDB_SEARCH_MODE_MAILSUB:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE u.addrspec LIKE ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE u.addrspec LIKE ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_text_like (ctx->select_stmt, 1,
                                       desc[descidx].u.name);
@@ -725,10 +1054,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_SUBSTR:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE u.uid LIKE ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, userid as u"
+                                  " WHERE u.uid LIKE ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_text_like (ctx->select_stmt, 1,
                                       desc[descidx].u.name);
@@ -773,10 +1103,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_LONG_KID:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.kid = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, fingerprint as f"
+                                  " WHERE p.ubid = f.ubid AND f.kid = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_int64 (ctx->select_stmt, 1,
                                   kid_from_u32 (desc[descidx].u.kid));
@@ -784,10 +1115,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_FPR:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.fpr = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, fingerprint as f"
+                                  " WHERE p.ubid = f.ubid AND f.fpr = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.fpr, desc[descidx].fprlen);
@@ -795,10 +1127,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_KEYGRIP:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.keyblob"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.keygrip = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT p.ubid, p.type, p.keyblob"
+                                  " FROM pubkey as p, fingerprint as f"
+                                  " WHERE p.ubid = f.ubid AND f.keygrip = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.grip, KEYGRIP_LEN);
@@ -806,10 +1139,11 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_UBID:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT ubid, type, keyblob"
-                               " FROM pubkey"
-                               " WHERE ubid = ?1",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT ubid, type, keyblob"
+                                  " FROM pubkey"
+                                  " WHERE ubid = ?1",
+                                  &ctx->select_stmt);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.ubid, UBID_LEN);
@@ -817,9 +1151,10 @@ run_select_statement (be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_FIRST:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT ubid, type, keyblob"
-                               " FROM pubkey ORDER by ubid",
-                               &ctx->select_stmt);
+        err = run_sql_prepare_db (db,
+                                  "SELECT ubid, type, keyblob"
+                                  " FROM pubkey ORDER by ubid",
+                                  &ctx->select_stmt);
       break;
 
     case KEYDB_SEARCH_MODE_NEXT:
@@ -831,6 +1166,10 @@ run_select_statement (be_sqlite_local_t ctx,
       break;
     }
 
+  /* Put a newly prepared statement into the cache.  */
+  if (slot >= 0 && ctx->select_stmt)
+    ctx->conn->stmts[slot] = ctx->select_stmt;
+
  leave:
   return err;
 }
@@ -847,11 +1186,15 @@ be_sqlite_search (ctrl_t ctrl,
   gpg_error_t err;
   db_request_part_t part;
   be_sqlite_local_t ctx;
+  sqlite3 *db;
 
   log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
   log_assert (request);
 
-  acquire_mutex ();
+  /* Note that we do not need to take the mutex here because the
+   * select runs on the request's own read connection.  During a
+   * write batch the select runs on the write connection; this is
+   * fine because SQLite calls do not yield to other threads.  */
 
   /* Find the specific request part or allocate it.  */
   err = be_find_request_part (backend_hd, request, &part);
@@ -862,6 +1205,8 @@ be_sqlite_search (ctrl_t ctrl,
   if (!desc)
     {
       /* Reset */
+      if (ctx->select_stmt)
+        sqlite3_reset (ctx->select_stmt);
       ctx->select_done = 0;
       ctx->select_eof = 0;
       err = 0;
@@ -885,6 +1230,7 @@ be_sqlite_search (ctrl_t ctrl,
     }
 
   show_sqlstmt (ctx->select_stmt);
+  db = ctx->use_write_conn? database_hd : ctx->conn->db;
 
   /* SQL select succeeded - get the first or next row. */
   err = run_sql_step_for_select (ctx->select_stmt);
@@ -899,7 +1245,7 @@ be_sqlite_search (ctrl_t ctrl,
       n = sqlite3_column_bytes (ctx->select_stmt, 0);
       if (!ubid || n < 0)
         {
-          if (!ubid && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+          if (!ubid && sqlite3_errcode (db) == SQLITE_NOMEM)
             err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           else
             err = gpg_error (GPG_ERR_DB_CORRUPTED);
@@ -916,7 +1262,7 @@ be_sqlite_search (ctrl_t ctrl,
         }
 
       n = sqlite3_column_int (ctx->select_stmt, 1);
-      if (!n && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+      if (!n && sqlite3_errcode (db) == SQLITE_NOMEM)
         {
           err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           show_sqlstmt (ctx->select_stmt);
@@ -930,7 +1276,7 @@ be_sqlite_search (ctrl_t ctrl,
       n = sqlite3_column_bytes (ctx->select_stmt, 2);
       if (!keyblob || n < 0)
         {
-          if (!keyblob && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+          if (!keyblob && sqlite3_errcode (db) == SQLITE_NOMEM)
             err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           else
             err = gpg_error (GPG_ERR_DB_CORRUPTED);
@@ -957,7 +1303,6 @@ be_sqlite_search (ctrl_t ctrl,
     }
 
  leave:
-  release_mutex ();
   return err;
 }
 
@@ -1145,7 +1490,7 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
     goto leave;
   /* ctx = part->besqlite; */
 
-  err = run_sql_statement ("begin transaction");
+  err = begin_write ();
   if (err)
     goto leave;
   in_transaction = 1;
@@ -1217,13 +1562,8 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
     }
 
  leave:
-  if (in_transaction && !err)
-    err = run_sql_statement ("commit");
-  else if (in_transaction)
-    {
-      if (run_sql_statement ("rollback"))
-        log_error ("Warning: database rollback failed - should not happen!\n");
-    }
+  if (in_transaction)
+    err = end_write (err);
   if (got_mutex)
     release_mutex ();
   if (info_valid)
@@ -1258,7 +1598,7 @@ be_sqlite_delete (ctrl_t ctrl, backend_handle_t backend_hd,
     goto leave;
   /* ctx = part->besqlite; */
 
-  err = run_sql_statement ("begin transaction");
+  err = begin_write ();
   if (err)
     goto leave;
   in_transaction = 1;
@@ -1276,13 +1616,8 @@ be_sqlite_delete (ctrl_t ctrl, backend_handle_t backend_hd,
  leave:
   if (stmt)
     sqlite3_finalize (stmt);
-  if (in_transaction && !err)
-    err = run_sql_statement ("commit");
-  else if (in_transaction)
-    {
-      if (run_sql_statement ("rollback"))
-        log_error ("Warning: database rollback failed - should not happen!\n");
-    }
+  if (in_transaction)
+    err = end_write (err);
   release_mutex ();
   return err;
 }
@@ -28,6 +28,7 @@
 #include "../common/i18n.h"
 #include "../common/asshelp.h"
 #include "../common/tlv.h"
+#include "../common/host2net.h"
 #include "backend.h"
 #include "keybox-defs.h"
 
@@ -162,6 +163,53 @@ be_find_request_part (backend_handle_t backend_hd, db_request_t request,
 }
 
 
+/* Helper for be_return_pubkey to return a blob in batch mode.  Each
+ * blob is returned as a record consisting of a header and the blob:
+ *
+ *   u32  Length of the blob
+ *   u32  Index of the matching search descriptor
+ *   u32  The pubkey type
+ *   b20  The UBID
+ *
+ * Blobs which have already been returned in the same batch are
+ * silently skipped.  */
+static gpg_error_t
+return_batch_pubkey (ctrl_t ctrl, const void *buffer, size_t buflen,
+                     enum pubkey_types pubkey_type, const unsigned char *ubid)
+{
+  unsigned char hdr[12 + UBID_LEN];
+  unsigned int n;
+  gpg_error_t err;
+
+  for (n=0; n < ctrl->batch.nubids; n++)
+    if (!memcmp (ctrl->batch.ubids + n * UBID_LEN, ubid, UBID_LEN))
+      return 0;  /* Already returned.  */
+
+  if (ctrl->batch.nubids == ctrl->batch.ubidsize)
+    {
+      unsigned char *tmp;
+
+      n = ctrl->batch.ubidsize + 32;
+      tmp = xtryrealloc (ctrl->batch.ubids, n * UBID_LEN);
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      ctrl->batch.ubids = tmp;
+      ctrl->batch.ubidsize = n;
+    }
+  memcpy (ctrl->batch.ubids + ctrl->batch.nubids * UBID_LEN, ubid, UBID_LEN);
+  ctrl->batch.nubids++;
+
+  ulongtobuf (hdr, ctrl->no_data_return? 0 : buflen);
+  ulongtobuf (hdr + 4, ctrl->batch.descidx);
+  ulongtobuf (hdr + 8, pubkey_type);
+  memcpy (hdr + 12, ubid, UBID_LEN);
+  err = kbxd_write_data_line (ctrl, hdr, sizeof hdr);
+  if (!err && !ctrl->no_data_return)
+    err = kbxd_write_data_line (ctrl, buffer, buflen);
+  return err;
+}
+
+
 /* Return the public key (BUFFER,BUFLEN) which has the type
  * PUBKEY_TYPE to the caller.  */
 gpg_error_t
@@ -171,6 +219,9 @@ be_return_pubkey (ctrl_t ctrl, const void *buffer, size_t buflen,
   gpg_error_t err;
   char hexubid[2*UBID_LEN+1];
 
+  if (ctrl->batch_mode)
+    return return_batch_pubkey (ctrl, buffer, buflen, pubkey_type, ubid);
+
   bin2hex (ubid, UBID_LEN, hexubid);
   err = status_printf (ctrl, "PUBKEY_INFO", "%d %s", pubkey_type, hexubid);
   if (err)
@@ -120,6 +120,19 @@ gpg_error_t be_ubid_from_blob (const void *blob, size_t bloblen,
                                enum pubkey_types *r_pktype, char *r_ubid);
 
 
+/* Statistics of the cache as returned by be_cache_get_stats.  */
+struct be_cache_stats_s
+{
+  unsigned long hits;       /* Number of lookups answered by the cache. */
+  unsigned long misses;     /* Number of lookups not in the cache.      */
+  unsigned long evictions;  /* Number of items evicted.                 */
+  unsigned int nblobs;      /* Number of cached blobs.                  */
+  unsigned int nkeys;       /* Number of cached key items.              */
+  size_t bytes;             /* Memory used by the cached items.         */
+  size_t budget;            /* The memory budget of the cache.          */
+};
+
+
 /*-- backend-cache.c --*/
 gpg_error_t be_cache_initialize (void);
 gpg_error_t be_cache_add_resource (ctrl_t ctrl, backend_handle_t *r_hd);
@@ -133,6 +146,11 @@ void be_cache_pubkey (ctrl_t ctrl, const unsigned char *ubid,
                       enum pubkey_types pubkey_type);
 void be_cache_not_found (ctrl_t ctrl, enum pubkey_types pubkey_type,
                          KEYDB_SEARCH_DESC *desc, unsigned int ndesc);
+void be_cache_get_stats (struct be_cache_stats_s *stats);
+int be_cache_has_blob (const unsigned char *ubid);
+gpg_error_t be_cache_get_hotset (unsigned int maxitems,
+                                 unsigned char **r_ubids,
+                                 unsigned int *r_count);
 
 
 /*-- backend-kbx.c --*/
@@ -156,6 +174,8 @@ gpg_error_t be_kbx_update (ctrl_t ctrl, backend_handle_t backend_hd,
                            const void *blob, size_t bloblen);
 gpg_error_t be_kbx_delete (ctrl_t ctrl, backend_handle_t backend_hd,
                            db_request_t request);
+gpg_error_t be_kbx_compact_step (ctrl_t ctrl, backend_handle_t backend_hd,
+                                 int *r_more);
 
 
 /*-- backend-sqlite.c --*/
@@ -176,6 +196,8 @@ gpg_error_t be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
                              const void *blob, size_t bloblen);
 gpg_error_t be_sqlite_delete (ctrl_t ctrl, backend_handle_t backend_hd,
                               db_request_t request, const unsigned char *ubid);
+void be_sqlite_begin_batch (void);
+gpg_error_t be_sqlite_end_batch (void);
 
 
 #endif /*KBX_BACKEND_H*/
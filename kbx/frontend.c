@@ -26,8 +26,10 @@
 
 #include "keyboxd.h"
 #include <assuan.h>
+#include <npth.h>
 #include "../common/i18n.h"
 #include "../common/userids.h"
+#include "../common/host2net.h"
 #include "backend.h"
 #include "frontend.h"
 
@@ -39,14 +41,66 @@ struct
   backend_handle_t backend_handle;
 } the_database;
 
+/* An optional read-only keybox searched after THE_DATABASE.  This
+ * allows sharing one large keybox between many home directories;
+ * changes are always stored in THE_DATABASE.  */
+struct
+{
+  backend_handle_t backend_handle;
+  char *filename;
+} the_system_database;
+
 
 
-/* Take a lock for reading the databases.  */
+/* The lock used to allow any number of readers but only one writer
+ * to access the database.  */
+static npth_rwlock_t database_rwlock;
+
+/* The number of compaction steps done by one call of
+ * kbxd_compact_database.  */
+#define COMPACT_STEPS_PER_CALL 16
+
+/* The name of the file below "$GNUPGHOME/public-keys.d/" used to keep
+ * the hot set of the cache between runs of the daemon, its magic and
+ * its version.  The file consists of a 16 byte header followed by the
+ * UBIDs of the most used blobs:
+ *
+ *   b4   Magic "KBXH"
+ *   byte Version
+ *   b3   Reserved
+ *   u32  Number of UBIDs
+ *   b4   Reserved
+ */
+#define HOTSET_FILE_NAME  "cache-hotset"
+#define HOTSET_MAGIC      "KBXH"
+#define HOTSET_VERSION    1
+#define HOTSET_HDRLEN     16
+
+/* The maximum number of UBIDs kept in the hot set file.  */
+#define MAX_HOTSET_ITEMS  10000
+
+/* Set if a store or delete may have left space to be reclaimed by
+ * kbxd_compact_database.  We start with it set to take care of
+ * deleted blobs left over from a previous run.  */
+static int compact_pending = 1;
+
+
+/* Take a lock for reading the databases.  The SQLite backend provides
+ * its own snapshot isolation for readers and thus we do not need to
+ * block readers while a writer is active.  */
 static void
 take_read_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  if (the_database.db_type == DB_TYPE_SQLITE)
+    return;
+
+  res = npth_rwlock_rdlock (&database_rwlock);
+  if (res)
+    log_fatal ("failed to acquire database read lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  ctrl->have_db_lock = 1;
 }
 
 
@@ -54,8 +108,13 @@ take_read_lock (ctrl_t ctrl)
 static void
 take_read_write_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  res = npth_rwlock_wrlock (&database_rwlock);
+  if (res)
+    log_fatal ("failed to acquire database write lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  ctrl->have_db_lock = 1;
 }
 
 
@@ -64,8 +123,16 @@ take_read_write_lock (ctrl_t ctrl)
 static void
 release_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  int res;
+
+  if (!ctrl->have_db_lock)
+    return;
+
+  res = npth_rwlock_unlock (&database_rwlock);
+  if (res)
+    log_fatal ("failed to release database lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  ctrl->have_db_lock = 0;
 }
 
 
@@ -83,6 +150,7 @@ kbxd_set_database (ctrl_t ctrl, const char *filename_arg, int readonly)
   enum database_types db_type = 0;
   backend_handle_t handle = NULL;
   unsigned int n;
+  int res;
 
   /* Do tilde expansion etc. */
   if (strchr (filename_arg, DIRSEP_C)
@@ -105,6 +173,16 @@ kbxd_set_database (ctrl_t ctrl, const char *filename_arg, int readonly)
       goto leave;
     }
 
+  /* Init the database lock.  */
+  res = npth_rwlock_init (&database_rwlock, NULL);
+  if (res)
+    {
+      err = gpg_error_from_errno (res);
+      log_error ("error initializing the database lock: %s\n",
+                 gpg_strerror (err));
+      goto leave;
+    }
+
   /* Init the cache.  */
   err = be_cache_initialize ();
   if (err)
@@ -161,12 +239,77 @@ kbxd_set_database (ctrl_t ctrl, const char *filename_arg, int readonly)
 }
 
 
+/* Set the read-only system keybox to FILENAME.  It is searched after
+ * the database of the home directory.  Only the keybox format is
+ * supported because its files can be mapped into memory and thus
+ * their pages and their index are shared by all keyboxd processes
+ * using them.  This function must be called at daemon startup after
+ * kbxd_set_database.  */
+gpg_error_t
+kbxd_set_system_database (ctrl_t ctrl, const char *filename_arg)
+{
+  gpg_error_t err;
+  char *filename;
+  size_t n;
+
+  filename = make_filename (filename_arg, NULL);
+
+  if (the_system_database.backend_handle)
+    {
+      log_error ("error: only one system keybox allowed\n");
+      err = gpg_error (GPG_ERR_CONFLICT);
+      goto leave;
+    }
+  if (!the_database.db_type)
+    {
+      err = gpg_error (GPG_ERR_NOT_INITIALIZED);
+      goto leave;
+    }
+
+  n = strlen (filename);
+  if (!(n > 4 && !strcmp (filename + n - 4, ".kbx")))
+    {
+      log_error (_("can't use file '%s': %s\n"), filename, _("unknown suffix"));
+      err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+      goto leave;
+    }
+
+  err = be_kbx_add_resource (ctrl, &the_system_database.backend_handle,
+                             filename, 1);
+  if (err)
+    goto leave;
+  the_system_database.filename = filename;
+  filename = NULL;
+
+ leave:
+  if (err)
+    log_error ("error setting system keybox '%s': %s\n",
+               filename, gpg_strerror (err));
+  xfree (filename);
+  return err;
+}
+
+
+/* Return true if the blob with UBID is stored in the system keybox.  */
+static int
+in_system_database (ctrl_t ctrl, db_request_t request,
+                    const unsigned char *ubid)
+{
+  if (!the_system_database.backend_handle)
+    return 0;
+  return !be_kbx_seek (ctrl, the_system_database.backend_handle,
+                       request, ubid);
+}
+
+
 /* Release all per session objects.  */
 void
 kbxd_release_session_info (ctrl_t ctrl)
 {
   if (!ctrl)
     return;
+  if (ctrl->in_write_batch)
+    kbxd_end_batch (ctrl);
   be_release_request (ctrl->opgp_req);
   ctrl->opgp_req = NULL;
   be_release_request (ctrl->x509_req);
@@ -246,6 +389,9 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
           err = gpg_error (GPG_ERR_INTERNAL);
           break;
         }
+      if (!err && the_system_database.backend_handle)
+        err = be_kbx_search (ctrl, the_system_database.backend_handle,
+                             request, NULL, 0);
       if (err)
         {
           log_error ("error during the %ssearch reset: %s\n",
@@ -263,7 +409,18 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
     }
 
   /* Divert to the backend for the actual search.  */
-  switch (the_database.db_type)
+ again:
+  if (request->next_dbidx)
+    {
+      /* The database of the homedir has been searched; continue with
+       * the system keybox if there is one.  */
+      if (request->next_dbidx == 1 && the_system_database.backend_handle)
+        err = be_kbx_search (ctrl, the_system_database.backend_handle,
+                             request, desc, ndesc);
+      else
+        err = gpg_error (GPG_ERR_EOF);
+    }
+  else switch (the_database.db_type)
     {
     case DB_TYPE_CACHE:
       err = be_cache_search (ctrl, the_database.backend_handle, request,
@@ -307,6 +464,8 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
             goto leave;
         }
       request->next_dbidx++;
+      if (request->next_dbidx == 1 && the_system_database.backend_handle)
+        goto again;
       /* FIXME: We need to see which pubkey type we need to insert.  */
       be_cache_not_found (ctrl, PUBKEY_TYPE_UNKNOWN, desc, ndesc);
       err = gpg_error (GPG_ERR_NOT_FOUND);
@@ -322,6 +481,100 @@ kbxd_search (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
 }
 
 
+/* Run a search for each of the descriptors in (DESC,NDESC) and return
+ * all matching blobs, each prefixed by a record header with the index
+ * of the matching descriptor, in one go to the caller.  A blob is
+ * returned only once even if it is matched by several descriptors.
+ * Returns 0 if at least one blob was found and GPG_ERR_NOT_FOUND if
+ * none was found.  */
+gpg_error_t
+kbxd_search_batch (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, unsigned int ndesc)
+{
+  gpg_error_t err = 0;
+  unsigned int n;
+  int any_found = 0;
+
+  if (DBG_CLOCK)
+    log_clock ("%s: enter", __func__);
+
+  if (!desc || !ndesc)
+    {
+      err = gpg_error (GPG_ERR_INV_ARG);
+      goto leave;
+    }
+
+  ctrl->batch_mode = 1;
+  ctrl->batch.nubids = 0;
+  for (n=0; n < ndesc; n++)
+    {
+      ctrl->batch.descidx = n;
+      err = kbxd_search (ctrl, desc + n, 1, 1);
+      while (!err)
+        {
+          any_found = 1;
+          err = kbxd_search (ctrl, desc + n, 1, 0);
+        }
+      if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        goto leave;
+    }
+  err = any_found? 0 : gpg_error (GPG_ERR_NOT_FOUND);
+
+ leave:
+  ctrl->batch_mode = 0;
+  xfree (ctrl->batch.ubids);
+  ctrl->batch.ubids = NULL;
+  ctrl->batch.nubids = ctrl->batch.ubidsize = 0;
+  if (DBG_CLOCK)
+    log_clock ("%s: leave (%s)", __func__, err? "not found" : "found");
+  return err;
+}
+
+
+/* Continue the last search for (DESC,NDESC) and return up to COUNT
+ * of the next matching blobs in one go using the same record format
+ * as kbxd_search_batch.  The index of the matching descriptor in the
+ * record header is always 0.  This allows a client to walk a large
+ * result set with only a few round trips.  Returns 0 if at least one
+ * blob was found and GPG_ERR_NOT_FOUND if none was found.  */
+gpg_error_t
+kbxd_search_next_batch (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc,
+                        unsigned int ndesc, unsigned int count)
+{
+  gpg_error_t err = 0;
+  unsigned int n;
+
+  if (DBG_CLOCK)
+    log_clock ("%s: enter", __func__);
+
+  if (!desc || !ndesc || !count)
+    {
+      err = gpg_error (GPG_ERR_INV_ARG);
+      goto leave;
+    }
+
+  ctrl->batch_mode = 1;
+  ctrl->batch.nubids = 0;
+  ctrl->batch.descidx = 0;
+  for (n=0; n < count; n++)
+    {
+      err = kbxd_search (ctrl, desc, ndesc, 0);
+      if (err)
+        break;
+    }
+  if (n && gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    err = 0;
+
+ leave:
+  ctrl->batch_mode = 0;
+  xfree (ctrl->batch.ubids);
+  ctrl->batch.ubids = NULL;
+  ctrl->batch.nubids = ctrl->batch.ubidsize = 0;
+  if (DBG_CLOCK)
+    log_clock ("%s: leave (%s)", __func__, err? "not found" : "found");
+  return err;
+}
+
+
 
 /* Store; that is insert or update the key (BLOB,BLOBLEN).  MODE
  * controls whether only updates or only inserts are allowed.  */
@@ -364,6 +617,12 @@ kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen,
   if (err)
     goto leave;
 
+  /* The system keybox is read-only and thus an update of a key
+   * stored there inserts a copy into the database of the homedir
+   * which is then found first.  */
+  if (mode == KBXD_STORE_UPDATE && in_system_database (ctrl, request, ubid))
+    mode = KBXD_STORE_AUTO;
+
   if (the_database.db_type == DB_TYPE_KBX)
     {
       err = be_kbx_seek (ctrl, the_database.backend_handle, request, ubid);
@@ -409,6 +668,8 @@ kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen,
 
 
  leave:
+  if (!err)
+    compact_pending = 1;
   release_lock (ctrl);
   if (DBG_CLOCK)
     log_clock ("%s: leave", __func__);
@@ -456,7 +717,13 @@ kbxd_delete (ctrl_t ctrl, const unsigned char *ubid)
         ; /* Found - we can delete.  */
       else if (gpg_err_code (err) == GPG_ERR_EOF)
         {
-          err = gpg_error (GPG_ERR_NOT_FOUND);
+          if (in_system_database (ctrl, request, ubid))
+            {
+              log_info ("key is stored in the read-only system keybox\n");
+              err = gpg_error (GPG_ERR_EACCES);
+            }
+          else
+            err = gpg_error (GPG_ERR_NOT_FOUND);
           goto leave;
         }
       else
@@ -466,6 +733,8 @@ kbxd_delete (ctrl_t ctrl, const unsigned char *ubid)
           goto leave;
         }
       err = be_kbx_delete (ctrl, the_database.backend_handle, request);
+      if (!err)
+        compact_pending = 1;
     }
   else if (the_database.db_type == DB_TYPE_SQLITE)
     {
@@ -485,3 +754,230 @@ kbxd_delete (ctrl_t ctrl, const unsigned char *ubid)
     log_clock ("%s: leave", __func__);
   return err;
 }
+
+
+/* Start a write batch for the connection CTRL.  The writes of all
+ * connections are committed together when the last batch ends.  A
+ * write batch is only used by the SQLite backend; for the other
+ * backends this is a no-op.  */
+gpg_error_t
+kbxd_begin_batch (ctrl_t ctrl)
+{
+  if (ctrl->in_write_batch)
+    return gpg_error (GPG_ERR_CONFLICT);
+
+  if (the_database.db_type == DB_TYPE_SQLITE)
+    be_sqlite_begin_batch ();
+  ctrl->in_write_batch = 1;
+  return 0;
+}
+
+
+/* End the write batch of the connection CTRL.  */
+gpg_error_t
+kbxd_end_batch (ctrl_t ctrl)
+{
+  gpg_error_t err = 0;
+
+  if (!ctrl->in_write_batch)
+    return gpg_error (GPG_ERR_NO_OBJ);
+
+  if (the_database.db_type == DB_TYPE_SQLITE)
+    err = be_sqlite_end_batch ();
+  ctrl->in_write_batch = 0;
+  return err;
+}
+
+
+/* Write the UBIDs of the most used blobs in the cache to the hot set
+ * file so that kbxd_preload_cache can load them after a restart.  */
+gpg_error_t
+kbxd_save_cache_hotset (void)
+{
+  gpg_error_t err;
+  char *fname;
+  char *tmpfname = NULL;
+  unsigned char *ubids = NULL;
+  unsigned int nubids;
+  unsigned char hdr[HOTSET_HDRLEN];
+  estream_t fp;
+
+  fname = make_filename_try (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                             HOTSET_FILE_NAME, NULL);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  err = be_cache_get_hotset (MAX_HOTSET_ITEMS, &ubids, &nubids);
+  if (err)
+    goto leave;
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, HOTSET_MAGIC, 4);
+  hdr[4] = HOTSET_VERSION;
+  ulongtobuf (hdr+8, nubids);
+
+  fp = es_fopen (tmpfname, "wb,mode=-rw-------");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (es_fwrite (hdr, sizeof hdr, 1, fp) != 1
+      || (nubids && es_fwrite (ubids, UBID_LEN, nubids, fp) != nubids))
+    {
+      err = gpg_error_from_syserror ();
+      es_fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+  else if (opt.verbose)
+    log_info ("saved %u items of the cache to '%s'\n", nubids, fname);
+
+ leave:
+  if (err)
+    log_error ("error writing '%s': %s\n", fname, gpg_strerror (err));
+  xfree (ubids);
+  xfree (tmpfname);
+  xfree (fname);
+  return err;
+}
+
+
+/* Read the hot set file written by kbxd_save_cache_hotset and load
+ * the listed blobs from the database into the cache.  The items are
+ * loaded in the order of the file, that is the most used first, and
+ * loading stops when the cache is full.  CTRL must be a control
+ * object without a connection.  The number of loaded blobs is stored
+ * at R_COUNT.  */
+gpg_error_t
+kbxd_preload_cache (ctrl_t ctrl, unsigned int *r_count)
+{
+  gpg_error_t err;
+  char *fname;
+  estream_t fp = NULL;
+  unsigned char hdr[HOTSET_HDRLEN];
+  KEYDB_SEARCH_DESC desc;
+  struct be_cache_stats_s stats;
+  unsigned int nubids, n;
+
+  *r_count = 0;
+
+  fname = make_filename_try (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                             HOTSET_FILE_NAME, NULL);
+  if (!fname)
+    return gpg_error_from_syserror ();
+
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+        err = 0;  /* Nothing saved yet.  */
+      goto leave;
+    }
+  if (es_fread (hdr, sizeof hdr, 1, fp) != 1)
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+  if (memcmp (hdr, HOTSET_MAGIC, 4) || hdr[4] != HOTSET_VERSION)
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+  nubids = buf32_to_uint (hdr+8);
+
+  ctrl->no_data_return = 1;
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_UBID;
+  for (n=0; n < nubids; n++)
+    {
+      if (es_fread (desc.u.ubid, UBID_LEN, 1, fp) != 1)
+        {
+          err = gpg_error (GPG_ERR_INV_OBJ);
+          break;
+        }
+      if (be_cache_has_blob (desc.u.ubid))
+        continue;
+
+      /* Once the cache is full, loading less used items would only
+       * evict those loaded before.  */
+      be_cache_get_stats (&stats);
+      if (stats.bytes >= stats.budget)
+        break;
+
+      err = kbxd_search (ctrl, &desc, 1, 1);
+      if (!err)
+        (*r_count)++;
+      else if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+        err = 0;  /* Deleted meanwhile.  */
+      else
+        break;
+    }
+
+ leave:
+  if (err)
+    log_error ("error preloading the cache from '%s': %s\n",
+               fname, gpg_strerror (err));
+  else if (opt.verbose)
+    log_info ("preloaded %u items into the cache\n", *r_count);
+  es_fclose (fp);
+  xfree (fname);
+  return err;
+}
+
+
+/* Do a few steps of the incremental compaction of the database.  This
+ * is called by the ticker and does nothing if any connection holds a
+ * lock on the database.  Each step moves at most one blob and thus
+ * readers are never held off for long.  Returns true if more steps
+ * are needed.  */
+int
+kbxd_compact_database (void)
+{
+  gpg_error_t err = 0;
+  int res, n;
+  int more = 0;
+
+  if (!compact_pending || the_database.db_type != DB_TYPE_KBX)
+    return 0;
+
+  res = npth_rwlock_trywrlock (&database_rwlock);
+  if (res)
+    return 1;  /* Busy - try again later.  */
+
+  for (n=0; n < COMPACT_STEPS_PER_CALL; n++)
+    {
+      err = be_kbx_compact_step (NULL, the_database.backend_handle, &more);
+      if (err || !more)
+        break;
+    }
+
+  res = npth_rwlock_unlock (&database_rwlock);
+  if (res)
+    log_fatal ("failed to release database lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+
+  if (err)
+    {
+      log_error ("error compacting the database: %s\n", gpg_strerror (err));
+      more = 0;
+    }
+  compact_pending = more;
+  return more;
+}
@@ -25,15 +25,26 @@
 
 gpg_error_t kbxd_set_database (ctrl_t ctrl,
                                const char *filename_arg, int readonly);
+gpg_error_t kbxd_set_system_database (ctrl_t ctrl, const char *filename_arg);
 
 void kbxd_release_session_info (ctrl_t ctrl);
 
 gpg_error_t kbxd_search (ctrl_t ctrl,
                          KEYDB_SEARCH_DESC *desc, unsigned int ndesc,
                          int reset);
+gpg_error_t kbxd_search_batch (ctrl_t ctrl,
+                               KEYDB_SEARCH_DESC *desc, unsigned int ndesc);
+gpg_error_t kbxd_search_next_batch (ctrl_t ctrl,
+                                    KEYDB_SEARCH_DESC *desc,
+                                    unsigned int ndesc, unsigned int count);
 gpg_error_t kbxd_store (ctrl_t ctrl, const void *blob, size_t bloblen,
                         enum kbxd_store_modes mode);
 gpg_error_t kbxd_delete (ctrl_t ctrl, const unsigned char *ubid);
+gpg_error_t kbxd_begin_batch (ctrl_t ctrl);
+gpg_error_t kbxd_end_batch (ctrl_t ctrl);
+gpg_error_t kbxd_save_cache_hotset (void);
+gpg_error_t kbxd_preload_cache (ctrl_t ctrl, unsigned int *r_count);
+int kbxd_compact_database (void);
 
 
 #endif /*KBX_FRONTEND_H*/
@@ -36,6 +36,9 @@
 #include "../common/userids.h"
 #include "../common/asshelp.h"
 #include "../common/host2net.h"
+#include "../common/membuf.h"
+#include "../common/metrics.h"
+#include "backend.h"
 #include "frontend.h"
 
 
@@ -86,6 +89,13 @@ struct server_local_s
 
   /* If not NULL write output to this stream instead of using D lines.  */
   estream_t outstream;
+
+  /* Buffer to collect the records of a batch search while OUTSTREAM
+   * is used.  */
+  membuf_t batchbuf;
+
+  /* The current request for the metrics and traces.  */
+  struct metric_request_s request;
 };
 
 
@@ -151,6 +161,28 @@ kbxd_writen (estream_t fp, const void *buffer, size_t length)
 }
 
 
+/* Write (BUFFER,SIZE) as one frame to the output stream FP.  A frame
+ * is the data prefixed with its length as a 4 byte big endian
+ * number.  */
+static gpg_error_t
+kbxd_write_frame (estream_t fp, const void *buffer, size_t size)
+{
+  gpg_error_t err;
+  unsigned char lenbuf[4];
+
+  ulongtobuf (lenbuf, size);
+  err = kbxd_writen (fp, lenbuf, 4);
+  if (!err)
+    err = kbxd_writen (fp, buffer, size);
+  if (!err && es_fflush (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing OUTPUT: %s\n", gpg_strerror (err));
+    }
+  return err;
+}
+
+
 /* A wrapper around assuan_send_data which makes debugging the output
  * in verbose mode easier.  It also takes CTRL as argument.  */
 gpg_error_t
@@ -163,21 +195,20 @@ kbxd_write_data_line (ctrl_t ctrl, const void *buffer_arg, size_t size)
   if (!ctx) /* Oops - no assuan context.  */
     return gpg_error (GPG_ERR_NOT_PROCESSED);
 
+  /* The records of a batch search are collected so that they can be
+   * written as one frame to the output stream.  */
+  if (ctrl && ctrl->server_local && ctrl->server_local->outstream
+      && ctrl->batch_mode)
+    {
+      put_membuf (&ctrl->server_local->batchbuf, buffer, size);
+      err = 0;
+      goto leave;
+    }
+
   /* Write toa file descriptor if enabled.  */
   if (ctrl && ctrl->server_local && ctrl->server_local->outstream)
     {
-      unsigned char lenbuf[4];
-
-      ulongtobuf (lenbuf, size);
-      err = kbxd_writen (ctrl->server_local->outstream, lenbuf, 4);
-      if (!err)
-        err = kbxd_writen (ctrl->server_local->outstream, buffer, size);
-      if (!err && es_fflush (ctrl->server_local->outstream))
-        {
-          err = gpg_error_from_syserror ();
-          log_error ("error writing OUTPUT: %s\n", gpg_strerror (err));
-        }
-
+      err = kbxd_write_frame (ctrl->server_local->outstream, buffer, size);
       goto leave;
     }
 
@@ -268,6 +299,10 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
       if (!ctrl->lc_messages)
         return out_of_core ();
     }
+  else if (!strcmp (key, "trace-id"))
+    {
+      err = metric_request_set_trace_id (&ctrl->server_local->request, value);
+    }
   else
     err = gpg_error (GPG_ERR_UNKNOWN_OPTION);
 
@@ -277,26 +312,41 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
 
 
 static const char hlp_search[] =
-  "SEARCH [--no-data] [[--more] PATTERN]\n"
+  "SEARCH [--no-data] [[--more|--batch] PATTERN]\n"
   "\n"
   "Search for the keys identified by PATTERN.  With --more more\n"
   "patterns to be used for the search are expected with the next\n"
   "command.  With --no-data only the search status is returned but\n"
-  "not the actual data.  See also \"NEXT\".";
+  "not the actual data.  See also \"NEXT\".\n"
+  "\n"
+  "With --batch all keys matching any of the patterns are returned at\n"
+  "once as D-lines or, if an OUTPUT fd is set, as one frame.  Each key\n"
+  "is prefixed by a header consisting of the length of the key, the\n"
+  "index of the matching pattern and the pubkey type, all as 4 byte\n"
+  "big endian numbers, followed by the 20 byte UBID.  A NEXT command\n"
+  "is not possible after a batch search.";
 static gpg_error_t
 cmd_search (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
-  int opt_more, opt_no_data;
+  int opt_more, opt_no_data, opt_batch;
+  int batchbuf_used = 0;
   gpg_error_t err;
   unsigned int n, k;
 
   opt_no_data = has_option (line, "--no-data");
   opt_more = has_option (line, "--more");
+  opt_batch = has_option (line, "--batch");
   line = skip_options (line);
 
   ctrl->server_local->search_any_found = 0;
 
+  if (opt_more && opt_batch)
+    {
+      err = set_error (GPG_ERR_CONFLICT, "--more given with --batch");
+      goto leave;
+    }
+
   if (!*line)
     {
       if (opt_more)
@@ -304,6 +354,11 @@ cmd_search (assuan_context_t ctx, char *line)
           err = set_error (GPG_ERR_INV_ARG, "--more but no pattern");
           goto leave;
         }
+      else if (opt_batch)
+        {
+          err = set_error (GPG_ERR_INV_ARG, "--batch but no pattern");
+          goto leave;
+        }
       else if (!*line && ctrl->server_local->search_expecting_more)
         {
           /* It would be too surprising to first set a pattern but
@@ -381,8 +436,18 @@ cmd_search (assuan_context_t ctx, char *line)
   ctrl->server_local->inhibit_data_logging_count = 0;
   ctrl->no_data_return = opt_no_data;
   err = prepare_outstream (ctrl);
+  if (!err && opt_batch && ctrl->server_local->outstream)
+    {
+      init_membuf (&ctrl->server_local->batchbuf, 8192);
+      batchbuf_used = 1;
+    }
   if (err)
     ;
+  else if (opt_batch && ctrl->server_local->multi_search_desc_len)
+    err = kbxd_search_batch (ctrl, ctrl->server_local->multi_search_desc,
+                             ctrl->server_local->multi_search_desc_len);
+  else if (opt_batch)
+    err = kbxd_search_batch (ctrl, &ctrl->server_local->search_desc, 1);
   else if (ctrl->server_local->multi_search_desc_len)
     err = kbxd_search (ctrl, ctrl->server_local->multi_search_desc,
                        ctrl->server_local->multi_search_desc_len, 1);
@@ -391,10 +456,34 @@ cmd_search (assuan_context_t ctx, char *line)
   if (err)
     goto leave;
 
+  /* A batch search has already returned everything.  If the output
+   * stream is used, all records are now written as one frame.  */
+  if (opt_batch)
+    {
+      ctrl->server_local->multi_search_desc_len = 0;
+      if (batchbuf_used)
+        {
+          void *data;
+          size_t datalen;
+
+          batchbuf_used = 0;
+          data = get_membuf (&ctrl->server_local->batchbuf, &datalen);
+          if (!data)
+            err = gpg_error_from_syserror ();
+          else
+            err = kbxd_write_frame (ctrl->server_local->outstream,
+                                    data, datalen);
+          xfree (data);
+        }
+      goto leave;
+    }
+
   /* Set a flag for use by NEXT.  */
   ctrl->server_local->search_any_found = 1;
 
  leave:
+  if (batchbuf_used)
+    xfree (get_membuf (&ctrl->server_local->batchbuf, NULL));
   if (err)
     ctrl->server_local->multi_search_desc_len = 0;
   ctrl->no_data_return = 0;
@@ -404,17 +493,32 @@ cmd_search (assuan_context_t ctx, char *line)
 
 
 static const char hlp_next[] =
-  "NEXT [--no-data]\n"
+  "NEXT [--no-data] [--count=N]\n"
   "\n"
-  "Get the next search result from a previous search.";
+  "Get the next search result from a previous search.  With --count\n"
+  "up to N results are returned at once using the record format of\n"
+  "\"SEARCH --batch\"; the search may then be continued with further\n"
+  "NEXT commands.";
 static gpg_error_t
 cmd_next (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
   int opt_no_data;
+  unsigned int opt_count = 0;
+  int batchbuf_used = 0;
+  const char *s;
   gpg_error_t err;
 
   opt_no_data = has_option (line, "--no-data");
+  if ((s = option_value (line, "--count")))
+    {
+      opt_count = strtoul (s, NULL, 10);
+      if (!opt_count)
+        {
+          err = set_error (GPG_ERR_INV_ARG, "invalid value for --count");
+          goto leave;
+        }
+    }
   line = skip_options (line);
 
   if (*line)
@@ -434,6 +538,11 @@ cmd_next (assuan_context_t ctx, char *line)
   ctrl->server_local->inhibit_data_logging_count = 0;
   ctrl->no_data_return = opt_no_data;
   err = prepare_outstream (ctrl);
+  if (!err && opt_count && ctrl->server_local->outstream)
+    {
+      init_membuf (&ctrl->server_local->batchbuf, 8192);
+      batchbuf_used = 1;
+    }
   if (err)
     ;
   else if (ctrl->server_local->multi_search_desc_len)
@@ -444,8 +553,13 @@ cmd_next (assuan_context_t ctx, char *line)
           == KEYDB_SEARCH_MODE_FIRST)
         ctrl->server_local->multi_search_desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
 
-      err = kbxd_search (ctrl, ctrl->server_local->multi_search_desc,
-                         ctrl->server_local->multi_search_desc_len, 0);
+      if (opt_count)
+        err = kbxd_search_next_batch
+          (ctrl, ctrl->server_local->multi_search_desc,
+           ctrl->server_local->multi_search_desc_len, opt_count);
+      else
+        err = kbxd_search (ctrl, ctrl->server_local->multi_search_desc,
+                           ctrl->server_local->multi_search_desc_len, 0);
     }
   else
     {
@@ -453,12 +567,34 @@ cmd_next (assuan_context_t ctx, char *line)
       if (ctrl->server_local->search_desc.mode == KEYDB_SEARCH_MODE_FIRST)
         ctrl->server_local->search_desc.mode = KEYDB_SEARCH_MODE_NEXT;
 
-      err = kbxd_search (ctrl, &ctrl->server_local->search_desc, 1, 0);
+      if (opt_count)
+        err = kbxd_search_next_batch (ctrl, &ctrl->server_local->search_desc,
+                                      1, opt_count);
+      else
+        err = kbxd_search (ctrl, &ctrl->server_local->search_desc, 1, 0);
     }
   if (err)
     goto leave;
 
+  /* With --count all records are written as one frame.  */
+  if (batchbuf_used)
+    {
+      void *data;
+      size_t datalen;
+
+      batchbuf_used = 0;
+      data = get_membuf (&ctrl->server_local->batchbuf, &datalen);
+      if (!data)
+        err = gpg_error_from_syserror ();
+      else
+        err = kbxd_write_frame (ctrl->server_local->outstream,
+                                data, datalen);
+      xfree (data);
+    }
+
  leave:
+  if (batchbuf_used)
+    xfree (get_membuf (&ctrl->server_local->batchbuf, NULL));
   ctrl->no_data_return = 0;
   ctrl->server_local->inhibit_data_logging = 0;
   return leave_cmd (ctx, err);
@@ -563,6 +699,66 @@ cmd_delete (assuan_context_t ctx, char *line)
 }
 
 
+static const char hlp_transaction[] =
+  "TRANSACTION BEGIN|COMMIT\n"
+  "\n"
+  "Start or end a write batch.  The keys stored or deleted while a\n"
+  "batch is active are committed together to the database which is\n"
+  "much faster than one commit per key.  Searches return the keys\n"
+  "written in the batch even before the commit.  Batches of several\n"
+  "connections are merged and committed when the last one ends;\n"
+  "an open batch is ended when the connection is closed.  A failed\n"
+  "STORE or DELETE does not affect the other writes of the batch.";
+static gpg_error_t
+cmd_transaction (assuan_context_t ctx, char *line)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+
+  line = skip_options (line);
+  if (!strcmp (line, "BEGIN"))
+    err = kbxd_begin_batch (ctrl);
+  else if (!strcmp (line, "COMMIT"))
+    err = kbxd_end_batch (ctrl);
+  else
+    err = set_error (GPG_ERR_ASS_PARAMETER, "BEGIN or COMMIT expected");
+
+  return leave_cmd (ctx, err);
+}
+
+
+static const char hlp_preload[] =
+  "PRELOAD [--save]\n"
+  "\n"
+  "Load the blobs listed in the hot set file into the cache.  This is\n"
+  "done in the background and the command returns immediately.  With\n"
+  "--save the most used blobs of the cache are instead written to the\n"
+  "hot set file.  With option --cache-preload this is done at shutdown\n"
+  "and the file is loaded at startup.";
+static gpg_error_t
+cmd_preload (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  int opt_save;
+
+  opt_save = has_option (line, "--save");
+  line = skip_options (line);
+  if (*line)
+    {
+      err = set_error (GPG_ERR_ASS_PARAMETER, "no arguments expected");
+      goto leave;
+    }
+
+  if (opt_save)
+    err = kbxd_save_cache_hotset ();
+  else
+    err = kbxd_start_cache_preload ();
+
+ leave:
+  return leave_cmd (ctx, err);
+}
+
+
 
 static const char hlp_getinfo[] =
   "GETINFO <what>\n"
@@ -574,13 +770,19 @@ static const char hlp_getinfo[] =
   "pid         - Return the process id of the server.\n"
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
-  "getenv NAME - Return value of envvar NAME\n";
+  "getenv NAME - Return value of envvar NAME\n"
+  "cache_stats - Return statistics about the cache.  These are\n"
+  "              the number of hits, misses and evicted items, the\n"
+  "              number of cached blobs and keys, the used memory\n"
+  "              and the memory budget.\n"
+  "metrics     - Return the performance counters.\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err;
   char numbuf[50];
+  char buffer[200];
 
   if (!strcmp (line, "version"))
     {
@@ -604,6 +806,27 @@ cmd_getinfo (assuan_context_t ctx, char *line)
       snprintf (numbuf, sizeof numbuf, "%u", ctrl->server_local->session_id);
       err = assuan_send_data (ctx, numbuf, strlen (numbuf));
     }
+  else if (!strcmp (line, "cache_stats"))
+    {
+      struct be_cache_stats_s stats;
+
+      be_cache_get_stats (&stats);
+      snprintf (buffer, sizeof buffer, "%lu %lu %lu %u %u %lu %lu",
+                stats.hits, stats.misses, stats.evictions,
+                stats.nblobs, stats.nkeys,
+                (unsigned long)stats.bytes, (unsigned long)stats.budget);
+      err = assuan_send_data (ctx, buffer, strlen (buffer));
+    }
+  else if (!strcmp (line, "metrics"))
+    {
+      char *s = metrics_format ();
+
+      if (!s)
+        err = gpg_error_from_syserror ();
+      else
+        err = assuan_send_data (ctx, s, strlen (s));
+      xfree (s);
+    }
   else if (!strncmp (line, "getenv", 6)
            && (line[6] == ' ' || line[6] == '\t' || !line[6]))
     {
@@ -671,6 +894,53 @@ static const char hlp_output[] =
   "file descriptor currently in flight will be used.";
 
 
+/* Called by libassuan before all commands.  */
+static gpg_error_t
+pre_cmd_notify (assuan_context_t ctx, const char *cmd)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  metric_request_begin (&ctrl->server_local->request, cmd);
+  return 0;
+}
+
+
+/* Called by libassuan after all commands.  */
+static void
+post_cmd_notify (assuan_context_t ctx, gpg_error_t err)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  metric_request_end (&ctrl->server_local->request, err);
+}
+
+
+/* The blob cache keeps its own counters.  */
+static uint64_t
+cache_stat (int what)
+{
+  struct be_cache_stats_s stats;
+
+  be_cache_get_stats (&stats);
+  switch (what)
+    {
+    case 0:  return stats.hits;
+    case 1:  return stats.misses;
+    case 2:  return stats.evictions;
+    default: return stats.bytes;
+    }
+}
+static uint64_t cache_hits (void) { return cache_stat (0); }
+static uint64_t cache_misses (void) { return cache_stat (1); }
+static uint64_t cache_evictions (void) { return cache_stat (2); }
+static uint64_t cache_bytes (void) { return cache_stat (3); }
+METRIC_DEFINE_COUNTER_FUNC (m_cache_hits, "cache_hits", cache_hits);
+METRIC_DEFINE_COUNTER_FUNC (m_cache_misses, "cache_misses", cache_misses);
+METRIC_DEFINE_COUNTER_FUNC (m_cache_evictions, "cache_evictions",
+                            cache_evictions);
+METRIC_DEFINE_FUNC (m_cache_bytes, "cache_bytes", cache_bytes);
+
+
 /* Tell the assuan library about our commands. */
 static int
 register_commands (assuan_context_t ctx)
@@ -684,6 +954,8 @@ register_commands (assuan_context_t ctx)
     { "NEXT",       cmd_next,       hlp_next   },
     { "STORE",      cmd_store,      hlp_store  },
     { "DELETE",     cmd_delete,     hlp_delete  },
+    { "TRANSACTION",cmd_transaction,hlp_transaction },
+    { "PRELOAD",    cmd_preload,    hlp_preload },
     { "GETINFO",    cmd_getinfo,    hlp_getinfo },
     { "OUTPUT",     NULL,           hlp_output },
     { "KILLKEYBOXD",cmd_killkeyboxd,hlp_killkeyboxd },
@@ -699,6 +971,12 @@ register_commands (assuan_context_t ctx)
       if (rc)
         return rc;
     }
+  assuan_register_pre_cmd_notify (ctx, pre_cmd_notify);
+  assuan_register_post_cmd_notify (ctx, post_cmd_notify);
+  metric_register (&m_cache_hits);
+  metric_register (&m_cache_misses);
+  metric_register (&m_cache_evictions);
+  metric_register (&m_cache_bytes);
   return 0;
 }
 
@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <assert.h>
+#include <npth.h>
 
 #include <gpg-error.h>
 #include "../common/logging.h"
@@ -37,9 +38,17 @@
 #include "../common/i18n.h"
 #include "keybox-defs.h"
 #include "../common/init.h"
+#include "../common/sysutils.h"
 #include <gcrypt.h>
 
 
+/* Number of keyblocks processed by one conversion job.  */
+#define CONVERT_BATCH 512
+
+/* Maximum number of worker threads used for a conversion.  */
+#define CONVERT_MAX_THREADS 8
+
+
 enum cmd_and_opt_values {
   aNull = 0,
   oArmor	  = 'a',
@@ -85,7 +94,7 @@ static gpgrt_opt_t opts[] = {
   { oTo,   "to",   4, "|N|last record to export" },
 /*   { oArmor, "armor",     0, N_("create ascii armored output")}, */
 /*   { oArmor, "armour",     0, "@" }, */
-/*   { oOutput, "output",    2, N_("use as output file")}, */
+  { oOutput, "output",    2, N_("|FILE|write a keybox file to FILE")},
   { oVerbose, "verbose",   0, N_("verbose") },
   { oQuiet,	"quiet",   0, N_("be somewhat more quiet") },
   { oDryRun, "dry-run",   0, N_("do not make any changes") },
@@ -463,6 +472,368 @@ import_openpgp (const char *filename, int dryrun)
 }
 
 
+/* One keyblock of a conversion job.  */
+struct convert_item_s
+{
+  const unsigned char *image;  /* The keyblock in the input buffer.  */
+  size_t imagelen;
+  gpg_error_t parse_err;       /* Error parsing the keyblock.  */
+  gpg_error_t err;             /* Error creating the blob.  */
+  struct _keybox_openpgp_info info;  /* Only valid if !PARSE_ERR.  */
+  KEYBOXBLOB blob;             /* Only valid if !PARSE_ERR && !ERR.  */
+};
+
+/* A batch of keyblocks to be converted by a worker thread.  */
+struct convert_job_s
+{
+  struct convert_job_s *next;  /* Next job in the work queue.  */
+  struct convert_job_s *next_pending;  /* Next job to write out.  */
+  int done;                    /* The job has been processed.  */
+  size_t nitems;
+  struct convert_item_s items[CONVERT_BATCH];
+};
+
+/* The work queue of the conversion threads.  */
+static struct
+{
+  npth_mutex_t lock;
+  npth_cond_t work_cond;   /* Signaled when new jobs are available.  */
+  npth_cond_t done_cond;   /* Signaled when a job has been processed.  */
+  struct convert_job_s *head;
+  struct convert_job_s *tail;
+} convert_queue;
+
+
+/* Parse all keyblocks of JOB and create their blobs.  This runs
+ * without the npth lock and may thus not log anything.  */
+static void
+convert_job (struct convert_job_s *job)
+{
+  struct convert_item_s *item;
+  size_t n;
+
+  for (n=0; n < job->nitems; n++)
+    {
+      item = job->items + n;
+      item->parse_err = _keybox_parse_openpgp (item->image, item->imagelen,
+                                               NULL, &item->info);
+      if (!item->parse_err)
+        item->err = _keybox_create_openpgp_blob (&item->blob, &item->info,
+                                                 item->image, item->imagelen,
+                                                 0);
+    }
+}
+
+
+/* The thread function of a conversion worker.  */
+static void *
+convert_worker (void *arg)
+{
+  struct convert_job_s *job;
+
+  (void)arg;
+
+  npth_mutex_lock (&convert_queue.lock);
+  for (;;)
+    {
+      while (!convert_queue.head)
+        npth_cond_wait (&convert_queue.work_cond, &convert_queue.lock);
+      job = convert_queue.head;
+      convert_queue.head = job->next;
+      if (!convert_queue.head)
+        convert_queue.tail = NULL;
+      npth_mutex_unlock (&convert_queue.lock);
+
+      npth_unprotect ();
+      convert_job (job);
+      npth_protect ();
+
+      npth_mutex_lock (&convert_queue.lock);
+      job->done = 1;
+      npth_cond_broadcast (&convert_queue.done_cond);
+    }
+
+  return NULL;
+}
+
+
+/* Start the conversion worker threads and return their number.  */
+static unsigned int
+start_convert_workers (void)
+{
+  long ncpu = 1;
+  npth_attr_t tattr;
+  npth_t thread;
+  unsigned int nworkers = 0;
+  int i;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  if (ncpu < 2)
+    return 0;
+  if (ncpu > CONVERT_MAX_THREADS)
+    ncpu = CONVERT_MAX_THREADS;
+
+  npth_init ();
+  if (npth_mutex_init (&convert_queue.lock, NULL)
+      || npth_cond_init (&convert_queue.work_cond, NULL)
+      || npth_cond_init (&convert_queue.done_cond, NULL)
+      || npth_attr_init (&tattr))
+    return 0;
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  for (i=0; i < ncpu; i++)
+    {
+      if (npth_create (&thread, &tattr, convert_worker, NULL))
+        break;
+      nworkers++;
+    }
+  npth_attr_destroy (&tattr);
+  return nworkers;
+}
+
+
+/* Create a job with the next keyblocks from the buffer at
+ * R_P,R_BUFLEN and advance the buffer.  Sets R_EOF at the end of
+ * the buffer or on a packet error.  Returns NULL if no keyblock is
+ * left.  */
+static struct convert_job_s *
+make_convert_job (const char *filename, const unsigned char *buffer,
+                  const unsigned char **r_p, size_t *r_buflen, int *r_eof)
+{
+  gpg_error_t err;
+  struct convert_job_s *job;
+  size_t n;
+
+  job = xtrycalloc (1, sizeof *job);
+  if (!job)
+    log_fatal ("can't allocate job: %s\n", strerror (errno));
+
+  while (job->nitems < CONVERT_BATCH)
+    {
+      err = _keybox_split_openpgp (*r_p, *r_buflen, &n);
+      if (err)
+        {
+          if (gpg_err_code (err) != GPG_ERR_NO_DATA)
+            log_error ("%s: invalid OpenPGP data at offset %lu: %s\n",
+                       filename, (unsigned long)(*r_p - buffer),
+                       gpg_strerror (err));
+          *r_eof = 1;
+          break;
+        }
+      job->items[job->nitems].image = *r_p;
+      job->items[job->nitems].imagelen = n;
+      job->nitems++;
+      *r_p += n;
+      *r_buflen -= n;
+    }
+
+  if (!job->nitems)
+    {
+      xfree (job);
+      job = NULL;
+    }
+  return job;
+}
+
+
+/* Convert the OpenPGP keyring FILENAME to the keybox file OUTFILE
+ * and write the index for OUTFILE.  The keyring is split into
+ * batches of keyblocks which are parsed and converted to blobs by a
+ * pool of threads; the blobs are written in the original order by
+ * the main thread, which at the same time adds them to the index.  */
+static void
+convert_openpgp (const char *filename, const char *outfile)
+{
+  gpg_error_t err;
+  char *buffer;
+  size_t buflen;
+  const unsigned char *p;
+  char *tmpfname;
+  FILE *fp;
+  unsigned int nworkers;
+  unsigned int ninflight = 0;
+  struct convert_job_s *pending = NULL, **pending_tail = &pending;
+  struct convert_job_s *job;
+  struct convert_item_s *item;
+  keybox_index_t idx;
+  const unsigned char *image;
+  size_t imagelen, n;
+  off_t off;
+  int eof = 0;
+  int write_error = 0;
+  unsigned long count = 0;
+
+  buffer = read_file (filename, &buflen);
+  if (!buffer)
+    return;
+  p = (const unsigned char *)buffer;
+
+  tmpfname = strconcat (outfile, EXTSEP_S "tmp", NULL);
+  if (!tmpfname)
+    log_fatal ("can't allocate buffer: %s\n", strerror (errno));
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      log_error ("can't create '%s': %s\n", tmpfname, strerror (errno));
+      xfree (tmpfname);
+      xfree (buffer);
+      return;
+    }
+
+  err = _keybox_write_header_blob (fp, NULL, 1);
+  if (err)
+    {
+      log_error ("%s: error writing header blob: %s\n",
+                 tmpfname, gpg_strerror (err));
+      write_error = 1;
+    }
+  off = 32;
+
+  idx = _keybox_index_new ();
+  if (!idx)
+    log_fatal ("can't allocate index: %s\n", strerror (errno));
+
+  nworkers = start_convert_workers ();
+
+  while (!write_error)
+    {
+      /* Keep the workers busy but limit the memory used for blobs
+       * not yet written.  */
+      while (!eof && ninflight < 2 * nworkers + 1)
+        {
+          job = make_convert_job (filename, (unsigned char *)buffer,
+                                  &p, &buflen, &eof);
+          if (!job)
+            break;
+          if (nworkers)
+            {
+              npth_mutex_lock (&convert_queue.lock);
+              if (convert_queue.tail)
+                convert_queue.tail->next = job;
+              else
+                convert_queue.head = job;
+              convert_queue.tail = job;
+              npth_cond_signal (&convert_queue.work_cond);
+              npth_mutex_unlock (&convert_queue.lock);
+            }
+          else
+            {
+              convert_job (job);
+              job->done = 1;
+            }
+          *pending_tail = job;
+          pending_tail = &job->next_pending;
+          ninflight++;
+        }
+
+      job = pending;
+      if (!job)
+        break;
+      pending = job->next_pending;
+      if (!pending)
+        pending_tail = &pending;
+      ninflight--;
+
+      if (nworkers)
+        {
+          npth_mutex_lock (&convert_queue.lock);
+          while (!job->done)
+            npth_cond_wait (&convert_queue.done_cond, &convert_queue.lock);
+          npth_mutex_unlock (&convert_queue.lock);
+        }
+
+      for (n=0; n < job->nitems; n++)
+        {
+          item = job->items + n;
+          if (item->parse_err)
+            {
+              if (gpg_err_code (item->parse_err)
+                  != GPG_ERR_UNSUPPORTED_ALGORITHM)
+                log_info ("%s: failed to parse OpenPGP keyblock: %s\n",
+                          filename, gpg_strerror (item->parse_err));
+              continue;
+            }
+          if (item->err)
+            log_error ("%s: failed to create OpenPGP keyblock: %s\n",
+                       filename, gpg_strerror (item->err));
+          else if (!write_error)
+            {
+              image = _keybox_get_blob_image (item->blob, &imagelen);
+              err = _keybox_write_blob (item->blob, fp);
+              if (err)
+                {
+                  log_error ("%s: failed to write OpenPGP keyblock: %s\n",
+                             tmpfname, gpg_strerror (err));
+                  write_error = 1;
+                }
+              else
+                {
+                  if (idx && _keybox_index_add_blob (idx, image, imagelen,
+                                                     off, &item->info))
+                    {
+                      _keybox_index_release (idx);
+                      idx = NULL;
+                    }
+                  off += imagelen;
+                  count++;
+                }
+            }
+          _keybox_release_blob (item->blob);
+          _keybox_destroy_openpgp_info (&item->info);
+        }
+      xfree (job);
+    }
+
+  /* On a write error we need to wait for the jobs still running.  */
+  while ((job = pending))
+    {
+      pending = job->next_pending;
+      if (nworkers)
+        {
+          npth_mutex_lock (&convert_queue.lock);
+          while (!job->done)
+            npth_cond_wait (&convert_queue.done_cond, &convert_queue.lock);
+          npth_mutex_unlock (&convert_queue.lock);
+        }
+      for (n=0; n < job->nitems; n++)
+        if (!job->items[n].parse_err)
+          {
+            _keybox_release_blob (job->items[n].blob);
+            _keybox_destroy_openpgp_info (&job->items[n].info);
+          }
+      xfree (job);
+    }
+
+  if (fclose (fp) && !write_error)
+    {
+      log_error ("error closing '%s': %s\n", tmpfname, strerror (errno));
+      write_error = 1;
+    }
+  if (write_error)
+    gnupg_remove (tmpfname);
+  else if ((err = gnupg_rename_file (tmpfname, outfile, NULL)))
+    {
+      log_error ("renaming '%s' to '%s' failed: %s\n",
+                 tmpfname, outfile, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+  else
+    {
+      log_info ("%s: %lu keyblocks converted\n", outfile, count);
+      if (!idx)
+        log_info ("%s: no index created\n", outfile);
+      else if ((err = _keybox_index_store (idx, outfile)))
+        log_error ("%s: error writing index: %s\n",
+                   outfile, gpg_strerror (err));
+    }
+
+  _keybox_index_release (idx);
+  xfree (tmpfname);
+  xfree (buffer);
+}
+
+
 
 
 int
@@ -472,6 +843,7 @@ main (int argc, char **argv)
   enum cmd_and_opt_values cmd = 0;
   unsigned long from = 0, to = ULONG_MAX;
   int dry_run = 0;
+  const char *outfile = NULL;
 
   early_system_init ();
   gpgrt_set_strusage( my_strusage );
@@ -522,6 +894,7 @@ main (int argc, char **argv)
         case oTo: to = pargs.r.ret_ulong; break;
 
         case oDryRun: dry_run = 1; break;
+        case oOutput: outfile = pargs.r.ret_str; break;
 
         default:
           pargs.err = 2;
@@ -577,6 +950,13 @@ main (int argc, char **argv)
             _keybox_dump_cut_records (*argv, from, to, stdout);
         }
     }
+  else if (cmd == aImportOpenPGP && outfile && !dry_run)
+    {
+      if (argc > 1)
+        log_error ("only one file may be converted using --output\n");
+      else
+        convert_openpgp (argc? *argv : "-", outfile);
+    }
   else if (cmd == aImportOpenPGP)
     {
       if (!argc)
@@ -49,7 +49,9 @@
    - u32  RFU
    - u32  file_created_at
    - u32  last_maintenance_run
-   - u32  RFU
+   - u32  Number of bytes in blobs marked as deleted since the last
+          maintenance run.  Used to decide whether a compress run is
+          needed.  (Was RFU before 2.3; older versions write 0.)
    - u32  RFU
 
 ** The OpenPGP and X.509 blobs
@@ -85,7 +87,10 @@
              to the version 2 blob format.
       - u16  Key flags
              bit 0 = qualified signature (not yet implemented}
+             bit 1 = the keygrip is valid.
       - u16  RFU
+      - b20  keygrip.  Only present if the size of the structure is
+             at least 48; older versions did not write it.
       - bN   Optional filler up to the specified length of this
              structure.
      Version 2 blob:
@@ -94,9 +99,10 @@
              right filled with zeroes.
       - u16  Key flags
              bit 0 = qualified signature (not yet implemented}
+             bit 1 = the keygrip is valid.
              bit 7 = 32 byte fingerprint in use.
       - u16  RFU
-      - b20  keygrip
+      - b20  keygrip.  Older versions wrote zeroes here.
       - bN   Optional filler up to the specified length of this
              structure.
    - u16  Size of the serial number (may be zero)
@@ -127,6 +133,10 @@
              - 0x00000002 = bad signature
              - 0x10000000 = valid and expires at some date in 1978.
              - 0xffffffff = valid and does not expire
+             X.509 uses exactly one signature; a value other than
+             0 is the first 4 bytes of the fingerprint of the
+             issuer certificate which was used to successfully
+             verify the signature (1 if those bytes are zero).
    - u8	Assigned ownertrust [X509: not used]
    - u8	All_Validity
         OpenPGP: See ../g10/trustdb/TRUST_* [not yet used]
@@ -200,6 +210,7 @@ struct keyboxblob_key {
   ulong  off_kid_addr;
   u16    flags;
   u16    fprlen;  /* Either 20 or 32 */
+  unsigned char grip[20];  /* Valid if flags has KEYBOX_KEYFLAG_GRIP.  */
 };
 struct keyboxblob_uid {
   u32    off;
@@ -216,17 +227,11 @@ struct keyid_list {
     byte kid[8];
 };
 
-struct fixup_list {
-    struct fixup_list *next;
-    u32 off;
-    u32 val;
-};
-
-
 struct keyboxblob {
   byte *blob;
   size_t bloblen;
   off_t fileoffset;
+  int blob_is_ref;  /* BLOB is owned by the caller (e.g. mapped file).  */
 
   /* stuff used only by keybox_create_blob */
   unsigned char *serialbuf;
@@ -238,8 +243,6 @@ struct keyboxblob {
   struct keyboxblob_uid *uids;
   int nsigs;
   u32  *sigs;
-  struct fixup_list *fixups;
-  int fixup_out_of_core;
 
   struct keyid_list *temp_kids;
   struct membuf bufbuf; /* temporary store for the blob */
@@ -271,7 +274,7 @@ put_membuf (struct membuf *mb, const void *buf, size_t len)
   if (mb->out_of_core)
     return;
 
-  if (mb->len + len >= mb->size)
+  if (mb->len + len > mb->size)
     {
       char *p;
 
@@ -339,25 +342,24 @@ put32 (struct membuf *mb, u32 a )
 
 
 
-/* Store a value in the fixup list */
+/* Store VAL at offset OFF of the blob.  All fixups refer to fields
+ * which have already been written, thus we can patch the buffer
+ * directly instead of keeping a list of fixups until the end.  */
 static void
 add_fixup (KEYBOXBLOB blob, u32 off, u32 val)
 {
-  struct fixup_list *fl;
+  struct membuf *a = blob->buf;
+  unsigned char *p;
 
-  if (blob->fixup_out_of_core)
+  if (a->out_of_core)
     return;
 
-  fl = xtrycalloc(1, sizeof *fl);
-  if (!fl)
-    blob->fixup_out_of_core = 1;
-  else
-    {
-      fl->off = off;
-      fl->val = val;
-      fl->next = blob->fixups;
-      blob->fixups = fl;
-    }
+  log_assert (off + 4 <= a->len);
+  p = (unsigned char *)a->buf + off;
+  p[0] = val >> 24;
+  p[1] = val >> 16;
+  p[2] = val >>  8;
+  p[3] = val;
 }
 
 
@@ -413,6 +415,11 @@ pgp_create_key_part_single (KEYBOXBLOB blob, int n,
   else
     blob->keys[n].off_kid = 0; /* Will be fixed up later */
   blob->keys[n].flags = 0;
+  if (kinfo->have_grip)
+    {
+      memcpy (blob->keys[n].grip, kinfo->grip, 20);
+      blob->keys[n].flags |= KEYBOX_KEYFLAG_GRIP;
+    }
   return 0;
 }
 
@@ -537,6 +544,33 @@ write_stored_kid (KEYBOXBLOB blob, int seqno)
   never_reached ();
 }
 
+/* Return the exact length of the OpenPGP blob which will be created
+ * by create_blob_header, pgp_create_blob_keyblock and
+ * create_blob_finish for a keyblock image of length IMAGELEN.  This
+ * needs to be kept in sync with those functions.  */
+static size_t
+pgp_blob_length (KEYBOXBLOB blob, size_t imagelen, int want_fpr32)
+{
+  size_t n;
+  int i;
+
+  n = 4 + 1 + 1 + 2 + 4 + 4;                        /* Header.  */
+  n += 2 + 2 + blob->nkeys * (want_fpr32? (32 + 2 + 2 + 20)
+                                        : (20 + 4 + 2 + 2 + 20));
+  n += 2 + blob->seriallen;
+  n += 2 + 2 + blob->nuids * (4 + 4 + 2 + 1 + 1);
+  n += 2 + 2 + blob->nsigs * 4;
+  n += 1 + 1 + 2 + 4 + 4 + 4 + 4;
+  if (!want_fpr32)
+    for (i=0; i < blob->nkeys; i++)
+      if (blob->keys[i].off_kid)
+        n += 8;                                     /* Stored v3 keyid.  */
+  n += imagelen;
+  n += 20;                                          /* Checksum.  */
+  return n;
+}
+
+
 /* Release a list of key IDs */
 static void
 release_kid_list (struct keyid_list *kl)
@@ -572,7 +606,7 @@ create_blob_header (KEYBOXBLOB blob, int blobtype, int as_ephemeral,
   if (want_fpr32)
     put16 ( a, 32 + 2 + 2 + 20);  /* size of key info */
   else
-    put16 ( a, 20 + 4 + 2 + 2 );  /* size of key info */
+    put16 ( a, 20 + 4 + 2 + 2 + 20);  /* size of key info */
   for ( i=0; i < blob->nkeys; i++ )
     {
       if (want_fpr32)
@@ -584,8 +618,7 @@ create_blob_header (KEYBOXBLOB blob, int blobtype, int as_ephemeral,
           else
             put16 ( a, blob->keys[i].flags);
           put16 ( a, 0 ); /* reserved */
-          /* FIXME: Put the real grip here instead of the filler.  */
-          put_membuf (a, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 20);
+          put_membuf (a, blob->keys[i].grip, 20);
         }
       else
         {
@@ -595,6 +628,7 @@ create_blob_header (KEYBOXBLOB blob, int blobtype, int as_ephemeral,
           put32 ( a, 0 ); /* offset to keyid, fixed up later */
           put16 ( a, blob->keys[i].flags );
           put16 ( a, 0 ); /* reserved */
+          put_membuf (a, blob->keys[i].grip, 20);
         }
     }
 
@@ -693,6 +727,9 @@ create_blob_finish (KEYBOXBLOB blob)
   /* Write placeholders for the checksum.  */
   put_membuf (a, NULL, 20);
 
+  /* fixup the length */
+  add_fixup (blob, 0, a->len);
+
   /* get the memory area */
   n = 0; /* (Just to avoid compiler warning.) */
   p = get_membuf (a, &n);
@@ -700,49 +737,56 @@ create_blob_finish (KEYBOXBLOB blob)
     return gpg_error (GPG_ERR_ENOMEM);
   assert (n >= 20);
 
-  /* fixup the length */
-  add_fixup (blob, 0, n);
-
-  /* do the fixups */
-  if (blob->fixup_out_of_core)
-    {
-      xfree (p);
-      return gpg_error (GPG_ERR_ENOMEM);
-    }
-
-  {
-    struct fixup_list *fl, *next;
-    for (fl = blob->fixups; fl; fl = next)
-      {
-        assert (fl->off+4 <= n);
-        p[fl->off+0] = fl->val >> 24;
-        p[fl->off+1] = fl->val >> 16;
-        p[fl->off+2] = fl->val >>  8;
-        p[fl->off+3] = fl->val;
-        next = fl->next;
-        xfree (fl);
-      }
-    blob->fixups = NULL;
-  }
-
   /* Compute and store the SHA-1 checksum. */
   gcry_md_hash_buffer (GCRY_MD_SHA1, p + n - 20, p, n - 40);
 
-  pp = xtrymalloc (n);
-  if ( !pp )
+  /* OpenPGP blobs are allocated with their exact size; for X.509
+   * blobs we give back the slack of the growing buffer.  */
+  if (a->size > n)
     {
-      xfree (p);
-      return gpg_error_from_syserror ();
+      pp = xtryrealloc (p, n);
+      if (pp)
+        p = pp;
     }
-  memcpy (pp , p, n);
-  xfree (p);
-  blob->blob = pp;
+  blob->blob = p;
   blob->bloblen = n;
 
   return 0;
 }
 
 
+/* Grow the OpenPGP or X.509 blob BLOB to NEWLEN bytes by inserting
+ * zero bytes in front of the checksum.  That space is allowed by the
+ * format as the RFU area after the keyblock or certificate.  This is
+ * used to store an updated blob in the slot of the old one.  */
+gpg_error_t
+_keybox_pad_blob (KEYBOXBLOB blob, size_t newlen)
+{
+  unsigned char *p;
+  size_t n = blob->bloblen;
+
+  if (blob->blob_is_ref || n < 40 || newlen < n)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (newlen == n)
+    return 0;
+
+  p = xtryrealloc (blob->blob, newlen);
+  if (!p)
+    return gpg_error_from_syserror ();
+  memmove (p + newlen - 20, p + n - 20, 20);
+  memset (p + n - 20, 0, newlen - n);
+  p[0] = newlen >> 24;
+  p[1] = newlen >> 16;
+  p[2] = newlen >>  8;
+  p[3] = newlen;
+  /* Same as in create_blob_finish.  */
+  gcry_md_hash_buffer (GCRY_MD_SHA1, p + newlen - 20, p, newlen - 40);
+  blob->blob = p;
+  blob->bloblen = newlen;
+  return 0;
+}
+
+
 
 gpg_error_t
 _keybox_create_openpgp_blob (KEYBOXBLOB *r_blob,
@@ -814,7 +858,8 @@ _keybox_create_openpgp_blob (KEYBOXBLOB *r_blob,
   pgp_create_uid_part (blob, info);
   pgp_create_sig_part (blob, NULL);
 
-  init_membuf (&blob->bufbuf, 1024);
+  /* Allocate the blob in one go.  */
+  init_membuf (&blob->bufbuf, pgp_blob_length (blob, imagelen, need_fpr32));
   blob->buf = &blob->bufbuf;
   err = create_blob_header (blob, KEYBOX_BLOBTYPE_PGP,
                             as_ephemeral, need_fpr32);
@@ -1078,11 +1123,62 @@ _keybox_release_blob (KEYBOXBLOB blob)
     xfree (blob->uids[i].name);
   xfree (blob->uids );
   xfree (blob->sigs );
-  xfree (blob->blob );
+  if (!blob->blob_is_ref)
+    xfree (blob->blob );
   xfree (blob );
 }
 
 
+/* Create a new blob object which references an image owned by the
+ * caller.  The image is set using _keybox_set_blob_ref.  */
+gpg_error_t
+_keybox_new_blob_ref (KEYBOXBLOB *r_blob)
+{
+  KEYBOXBLOB blob;
+
+  *r_blob = NULL;
+  blob = xtrycalloc (1, sizeof *blob);
+  if (!blob)
+    return gpg_error_from_syserror ();
+  blob->blob_is_ref = 1;
+  *r_blob = blob;
+  return 0;
+}
+
+
+/* Let the reference blob BLOB point to {IMAGE,IMAGELEN} which is
+ * stored at file offset OFF.  */
+void
+_keybox_set_blob_ref (KEYBOXBLOB blob,
+                      const unsigned char *image, size_t imagelen, off_t off)
+{
+  log_assert (blob->blob_is_ref);
+  blob->blob = (byte*)image;
+  blob->bloblen = imagelen;
+  blob->fileoffset = off;
+}
+
+
+/* Store a new blob with a private copy of the image of BLOB at
+ * R_BLOB.  */
+gpg_error_t
+_keybox_copy_blob (KEYBOXBLOB *r_blob, KEYBOXBLOB blob)
+{
+  gpg_error_t err;
+  unsigned char *image;
+
+  *r_blob = NULL;
+  image = xtrymalloc (blob->bloblen);
+  if (!image)
+    return gpg_error_from_syserror ();
+  memcpy (image, blob->blob, blob->bloblen);
+  err = _keybox_new_blob (r_blob, image, blob->bloblen, blob->fileoffset);
+  if (err)
+    xfree (image);
+  return err;
+}
+
+
 
 const unsigned char *
 _keybox_get_blob_image ( KEYBOXBLOB blob, size_t *n )
@@ -1098,6 +1194,32 @@ _keybox_get_blob_fileoffset (KEYBOXBLOB blob)
 }
 
 
+/* Return a pointer to the 20 byte keygrip of the IDX-th key stored
+ * in the OpenPGP blob IMAGE,IMAGELEN.  NULL is returned if the blob
+ * has no such key or if the keygrip has not been stored.  */
+const unsigned char *
+_keybox_get_blob_keygrip (const unsigned char *image, size_t imagelen,
+                          size_t idx)
+{
+  size_t nkeys, keyinfolen, pos;
+  int fpr32;
+
+  if (imagelen < 20 || image[4] != KEYBOX_BLOBTYPE_PGP)
+    return NULL;
+  fpr32 = image[5] == 2;
+  nkeys = buf16_to_ulong (image + 16);
+  keyinfolen = buf16_to_ulong (image + 18);
+  if (idx >= nkeys || keyinfolen < (fpr32? 56 : 48))
+    return NULL;
+  pos = 20 + idx * keyinfolen;
+  if ((uint64_t)pos + keyinfolen > (uint64_t)imagelen)
+    return NULL;
+  if (!(buf16_to_uint (image + pos + (fpr32? 32 : 24)) & KEYBOX_KEYFLAG_GRIP))
+    return NULL;
+  return image + pos + (fpr32? 36 : 28);
+}
+
+
 
 void
 _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp)
@@ -1112,6 +1234,9 @@ _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp)
       blob->blob[20+2] = (val >>  8);
       blob->blob[20+3] = (val      );
 
+      /* The compress run removes all deleted blobs.  */
+      memset (blob->blob + 24, 0, 4);
+
       if (for_openpgp)
         blob->blob[7] |= 0x02;  /* OpenPGP data may be available.  */
     }
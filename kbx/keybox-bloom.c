@@ -0,0 +1,391 @@
+/* keybox-bloom.c - Bloom filter for keyid lookups
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Each keybox resource may have an in-memory bloom filter over the
+ * low 32 bits of the keyids of all keys in the keybox file.  It
+ * allows keybox_search to reject a search for keyids or fingerprints
+ * which are not in the keybox without reading the file; this is the
+ * common case for a mail gateway checking signatures of unknown
+ * issuers.  Like the index the filter records the size, mtime and
+ * inode of the file it describes and is ignored if they do not
+ * match.  Changes done by this process are applied to the filter by
+ * keybox-update; keys of deleted blobs are not removed from the
+ * filter because this merely yields a false positive.
+ *
+ * The filter is not built when the keybox is opened but after a
+ * search for a keyid failed; processes which only look up existing
+ * keys thus never pay for it.  If an index was used for the failed
+ * search the miss was cheap and we build the filter only after
+ * BLOOM_INDEX_MISSES such misses.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "keybox-defs.h"
+#include "../common/host2net.h"
+#include "../common/metrics.h"
+
+#define get16(a) buf16_to_ulong ((a))
+
+
+/* The number of bits per key with the number of bits rounded up to a
+ * power of two and the number of bits probed per key.  This gives a
+ * false positive rate below 0.2%.  */
+#define BLOOM_BITS_PER_KEY 16
+#define BLOOM_PROBES       6
+
+/* The minimum size of the filter in bits.  */
+#define BLOOM_MIN_BITS     4096
+
+/* The number of cheap misses after which a filter is built.  */
+#define BLOOM_INDEX_MISSES 8
+
+METRIC_DEFINE_COUNTER (m_bloom_rejects, "bloom_rejects");
+
+
+struct keybox_bloom_s
+{
+  u32 mask;         /* Number of bits minus one.  */
+  size_t nkeys;     /* Number of keys added.  */
+  size_t maxkeys;   /* Drop the filter if more keys are added.  */
+
+  /* The identification of the keybox file described.  */
+  off_t size;
+  time_t mtime;
+  ino_t ino;
+
+  unsigned char bits[1];
+};
+
+
+static void
+bloom_release (KB_NAME kb)
+{
+  xfree (kb->bloom);
+  kb->bloom = NULL;
+}
+
+
+/* Return true if the file described by ST is the one described by
+ * the filter BF.  */
+static int
+bloom_matches (keybox_bloom_t bf, struct stat *st)
+{
+  return (bf->size == st->st_size
+          && bf->mtime == st->st_mtime
+          && bf->ino == st->st_ino);
+}
+
+
+static void
+bloom_stamp (keybox_bloom_t bf, struct stat *st)
+{
+  bf->size = st->st_size;
+  bf->mtime = st->st_mtime;
+  bf->ino = st->st_ino;
+}
+
+
+/* The finalizer of Murmur3.  Keyids are random anyway but the probes
+ * need to be independent.  */
+static u32
+mix32 (u32 h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+
+static void
+bloom_set (keybox_bloom_t bf, u32 kid)
+{
+  u32 h1, h2;
+  int i;
+
+  h1 = mix32 (kid);
+  h2 = mix32 (kid ^ 0x9e3779b9) | 1;
+  for (i=0; i < BLOOM_PROBES; i++, h1 += h2)
+    bf->bits[(h1 & bf->mask) >> 3] |= 1 << (h1 & 7);
+}
+
+
+static int
+bloom_test (keybox_bloom_t bf, u32 kid)
+{
+  u32 h1, h2;
+  int i;
+
+  h1 = mix32 (kid);
+  h2 = mix32 (kid ^ 0x9e3779b9) | 1;
+  for (i=0; i < BLOOM_PROBES; i++, h1 += h2)
+    if (!(bf->bits[(h1 & bf->mask) >> 3] & (1 << (h1 & 7))))
+      return 0;
+  return 1;
+}
+
+
+/* Add the low 32 bits of the keyids of all keys in the blob
+ * {BUFFER,LENGTH} to BF.  The keyid is taken from the fingerprint the
+ * same way the search functions do it.  Returns the number of keys.
+ * If BF is NULL the keys are only counted.  */
+static size_t
+add_blob_keys (keybox_bloom_t bf, const unsigned char *buffer, size_t length)
+{
+  size_t pos, off;
+  size_t nkeys, keyinfolen;
+  int idx, fpr32;
+
+  if (length < 40 || buffer[4] == KEYBOX_BLOBTYPE_HEADER)
+    return 0;
+  fpr32 = buffer[5] == 2;
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  if (keyinfolen < (fpr32?56:28))
+    return 0; /* Invalid blob; the search functions won't match it.  */
+  pos = 20;
+  if (pos + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
+    return 0; /* Out of bounds.  */
+
+  if (bf)
+    for (idx=0; idx < nkeys; idx++)
+      {
+        off = pos + idx*keyinfolen;
+        if (fpr32 && (get16 (buffer + off + 32) & 0x80))
+          bloom_set (bf, buf32_to_u32 (buffer + off + 4));
+        else
+          bloom_set (bf, buf32_to_u32 (buffer + off + 16));
+      }
+  return nkeys;
+}
+
+
+/* Store the low 32 bits of the keyid searched for by DESC at R_KID.
+ * Returns false if DESC can't be checked using the filter.  */
+static int
+desc_to_kid (KEYBOX_SEARCH_DESC *desc, u32 *r_kid)
+{
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      *r_kid = desc->u.kid[1];
+      return 1;
+    case KEYDB_SEARCH_MODE_FPR:
+      if (desc->fprlen == 20)
+        *r_kid = buf32_to_u32 (desc->u.fpr + 16);
+      else if (desc->fprlen == 32)
+        *r_kid = buf32_to_u32 (desc->u.fpr + 4);
+      else
+        return 0;
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+
+/* Return true if the filter can be used for all of the NDESC search
+ * descriptions DESC.  */
+static int
+bloom_usable (KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+{
+  size_t n;
+  u32 kid;
+
+  if (!ndesc)
+    return 0;
+  for (n=0; n < ndesc; n++)
+    if (!desc_to_kid (desc + n, &kid))
+      return 0;
+  return 1;
+}
+
+
+/* Return true if none of the NDESC search descriptions DESC can
+ * match a blob in the file opened at HD.  */
+int
+_keybox_bloom_reject (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+{
+  keybox_bloom_t bf = hd->kb->bloom;
+  struct stat st;
+  size_t n;
+  u32 kid;
+
+  if (!bf || !hd->fp || !bloom_usable (desc, ndesc))
+    return 0;
+  if (fstat (fileno (hd->fp), &st) || !bloom_matches (bf, &st))
+    return 0;
+
+  for (n=0; n < ndesc; n++)
+    {
+      desc_to_kid (desc + n, &kid);
+      if (bloom_test (bf, kid))
+        return 0;
+    }
+  metric_inc (&m_bloom_rejects);
+  return 1;
+}
+
+
+/* Build a new filter from the mapped file of HD.  */
+static void
+bloom_build (KEYBOX_HANDLE hd)
+{
+  KB_NAME kb = hd->kb;
+  keybox_bloom_t bf;
+  KEYBOXBLOB blob;
+  struct stat st;
+  const unsigned char *buffer;
+  size_t length, nkeys, nbits;
+  off_t off;
+  int pass, rc;
+
+  bloom_release (kb);
+  if (!hd->map.image)
+    return;  /* We need a mapped file to make this cheap.  */
+  if (fstat (fileno (hd->fp), &st) || st.st_size != (off_t)hd->map.size)
+    return;
+  if (_keybox_new_blob_ref (&blob))
+    return;
+
+  /* In the first pass we count the keys to size the filter.  */
+  bf = NULL;
+  nkeys = 0;
+  for (pass=0; pass < 2; pass++)
+    {
+      off = 0;
+      while ((rc = _keybox_read_mapped_blob (blob, hd->map.image,
+                                             hd->map.size, &off)) != -1)
+        {
+          if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE)
+            continue;  /* The search functions skip them as well.  */
+          if (rc)
+            {
+              xfree (bf);
+              _keybox_release_blob (blob);
+              return;
+            }
+          buffer = _keybox_get_blob_image (blob, &length);
+          if (pass)
+            add_blob_keys (bf, buffer, length);
+          else
+            nkeys += add_blob_keys (NULL, buffer, length);
+        }
+
+      if (!pass)
+        {
+          for (nbits = BLOOM_MIN_BITS;
+               nbits < nkeys * BLOOM_BITS_PER_KEY && nbits < 0x80000000;
+               nbits <<= 1)
+            ;
+          bf = xtrycalloc (1, sizeof *bf + nbits / 8);
+          if (!bf)
+            {
+              _keybox_release_blob (blob);
+              return;
+            }
+          bf->mask = nbits - 1;
+          bf->nkeys = nkeys;
+          bf->maxkeys = nbits / BLOOM_BITS_PER_KEY * 2;
+        }
+    }
+  _keybox_release_blob (blob);
+
+  bloom_stamp (bf, &st);
+  kb->bloom = bf;
+}
+
+
+/* This is called after a search using DESC at HD failed.  FULL_SCAN
+ * tells whether the entire file had to be read for it.  */
+void
+_keybox_bloom_miss (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                    int full_scan)
+{
+  KB_NAME kb = hd->kb;
+  struct stat st;
+
+  if (!hd->fp || !bloom_usable (desc, ndesc))
+    return;
+  if (kb->bloom && !fstat (fileno (hd->fp), &st)
+      && bloom_matches (kb->bloom, &st))
+    return;  /* A false positive.  */
+  if (!full_scan && ++kb->bloom_misses < BLOOM_INDEX_MISSES)
+    return;
+  kb->bloom_misses = 0;
+  bloom_build (hd);
+}
+
+
+/* This needs to be called by the update functions before the keybox
+ * file of KB is changed.  The keybox must be locked.  */
+void
+_keybox_bloom_begin_update (KB_NAME kb)
+{
+  struct stat st;
+
+  if (kb->bloom && (stat (kb->fname, &st) || !bloom_matches (kb->bloom, &st)))
+    bloom_release (kb);
+}
+
+
+/* This needs to be called by the update functions after the keybox
+ * file of KB has been changed, successfully or not.  BLOB is the new
+ * blob or NULL if no blob has been added.  */
+void
+_keybox_bloom_end_update (KB_NAME kb, KEYBOXBLOB blob)
+{
+  keybox_bloom_t bf = kb->bloom;
+  const unsigned char *buffer;
+  size_t length;
+  struct stat st;
+
+  if (!bf)
+    return;
+
+  if (blob)
+    {
+      buffer = _keybox_get_blob_image (blob, &length);
+      bf->nkeys += add_blob_keys (bf, buffer, length);
+      if (bf->nkeys > bf->maxkeys)
+        {
+          bloom_release (kb);  /* Too many false positives.  */
+          return;
+        }
+    }
+
+  if (stat (kb->fname, &st))
+    bloom_release (kb);
+  else
+    bloom_stamp (bf, &st);
+}
+
@@ -38,6 +38,8 @@
 
 
 typedef struct keyboxblob *KEYBOXBLOB;
+typedef struct keybox_index_s *keybox_index_t;
+typedef struct keybox_bloom_s *keybox_bloom_t;
 
 
 typedef struct keybox_name *KB_NAME;
@@ -65,6 +67,23 @@ struct keybox_name
   /* Not yet used.  */
   int did_full_scan;
 
+  /* State of a bulk update; see keybox_bulk_begin.  */
+  struct {
+    int active;             /* A bulk update is in progress.  */
+    int changed;            /* The file has been modified.  */
+    keybox_index_t idx;     /* The in-memory index or NULL.  */
+  } bulk;
+
+  /* The read-only mapping of the index file; see keybox-index.c.  */
+  struct {
+    unsigned char *image;   /* The mapped index file or NULL.  */
+    size_t size;            /* The length of IMAGE.  */
+  } idxmap;
+
+  /* The filter for keyid searches or NULL; see keybox-bloom.c.  */
+  keybox_bloom_t bloom;
+  unsigned int bloom_misses;
+
   /* The name of the resource file. */
   char fname[1];
 };
@@ -85,6 +104,10 @@ struct keybox_handle {
   int error;
   int ephemeral;
   int for_openpgp;        /* Used by gpg.  */
+  struct {
+    unsigned char *image; /* The mapped keybox file or NULL.  */
+    size_t size;          /* The length of IMAGE.  */
+  } map;
   struct keybox_found_s found;
   struct keybox_found_s saved_found;
   struct {
@@ -100,6 +123,7 @@ struct _keybox_openpgp_key_info
   struct _keybox_openpgp_key_info *next;
   int algo;
   int version;
+  int have_grip;  /* GRIP is valid.  */
   unsigned char grip[20];
   unsigned char keyid[8];
   int fprlen;  /* Either 16, 20 or 32 */
@@ -158,21 +182,69 @@ int  _keybox_new_blob (KEYBOXBLOB *r_blob,
                        unsigned char *image, size_t imagelen,
                        off_t off);
 void _keybox_release_blob (KEYBOXBLOB blob);
+gpg_error_t _keybox_new_blob_ref (KEYBOXBLOB *r_blob);
+void _keybox_set_blob_ref (KEYBOXBLOB blob,
+                           const unsigned char *image, size_t imagelen,
+                           off_t off);
+gpg_error_t _keybox_copy_blob (KEYBOXBLOB *r_blob, KEYBOXBLOB blob);
 const unsigned char *_keybox_get_blob_image (KEYBOXBLOB blob, size_t *n);
 off_t _keybox_get_blob_fileoffset (KEYBOXBLOB blob);
+const unsigned char *_keybox_get_blob_keygrip (const unsigned char *image,
+                                               size_t imagelen, size_t idx);
 void _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp);
+gpg_error_t _keybox_pad_blob (KEYBOXBLOB blob, size_t newlen);
 
 /*-- keybox-openpgp.c --*/
 gpg_error_t _keybox_parse_openpgp (const unsigned char *image, size_t imagelen,
                                    size_t *nparsed,
                                    keybox_openpgp_info_t info);
+gpg_error_t _keybox_parse_openpgp_for_blob (const unsigned char *image,
+                                            size_t imagelen, size_t *nparsed,
+                                            keybox_openpgp_info_t info);
+gpg_error_t _keybox_split_openpgp (const unsigned char *image,
+                                   size_t imagelen, size_t *r_len);
 void _keybox_destroy_openpgp_info (keybox_openpgp_info_t info);
 
 
 /*-- keybox-file.c --*/
 int _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted);
+int _keybox_read_mapped_blob (KEYBOXBLOB blob, const unsigned char *image,
+                              size_t size, off_t *r_off);
+void _keybox_map_file (KEYBOX_HANDLE hd);
+void _keybox_unmap_file (KEYBOX_HANDLE hd);
 int _keybox_write_blob (KEYBOXBLOB blob, FILE *fp);
 
+/*-- keybox-index.c --*/
+keybox_index_t _keybox_index_new (void);
+void _keybox_index_release (keybox_index_t idx);
+keybox_index_t _keybox_index_load (const char *fname, int *r_exists);
+gpg_error_t _keybox_index_add_blob (keybox_index_t idx,
+                                    const unsigned char *image,
+                                    size_t imagelen, off_t off,
+                                    keybox_openpgp_info_t info);
+void _keybox_index_update_offsets (keybox_index_t idx,
+                                   off_t off, off_t delta);
+void _keybox_index_remap (keybox_index_t idx, const off_t *map, size_t nmap);
+int _keybox_index_is_fresh (const char *fname);
+int _keybox_index_wanted (const char *fname, off_t filesize);
+gpg_error_t _keybox_index_touch (const char *fname);
+gpg_error_t _keybox_index_store (keybox_index_t idx, const char *fname);
+gpg_error_t _keybox_index_rebuild (const char *fname);
+keybox_index_t _keybox_index_bulk_load (const char *fname);
+void _keybox_index_remove (const char *fname);
+gpg_error_t _keybox_index_search (FILE *fp, KB_NAME kb,
+                                  KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                                  off_t **r_offsets, size_t *r_count);
+
+/*-- keybox-bloom.c --*/
+int _keybox_bloom_reject (KEYBOX_HANDLE hd,
+                          KEYBOX_SEARCH_DESC *desc, size_t ndesc);
+void _keybox_bloom_miss (KEYBOX_HANDLE hd,
+                         KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                         int full_scan);
+void _keybox_bloom_begin_update (KB_NAME kb);
+void _keybox_bloom_end_update (KB_NAME kb, KEYBOXBLOB blob);
+
 /*-- keybox-search.c --*/
 gpg_err_code_t _keybox_get_flag_location (const unsigned char *buffer,
                                           size_t length,
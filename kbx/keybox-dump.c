@@ -289,6 +289,14 @@ _keybox_dump_blob (KEYBOXBLOB blob, FILE *fp)
           kflags = get16 (p + 24 );
         }
       fprintf( fp, "\nKey-Flags[%lu]: %04lX\n", n, kflags);
+      if ((kflags & KEYBOX_KEYFLAG_GRIP)
+          && keyinfolen >= (is_fpr32? 56 : 48))
+        {
+          fprintf (fp, "Key-Grip[%lu]: ", n);
+          for (i=0; i < 20; i++ )
+            fprintf (fp, "%02X", p[(is_fpr32? 36 : 28) + i]);
+          putc ('\n', fp);
+        }
     }
 
   /* serial number */
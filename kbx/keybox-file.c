@@ -23,8 +23,14 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#ifdef HAVE_MMAP
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+#endif
 
 #include "keybox-defs.h"
+#include "../common/host2net.h"
 
 
 #define IMAGELEN_LIMIT (5*1024*1024)
@@ -128,6 +134,84 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
 }
 
 
+/* Same as _keybox_read_blob but read from the mapped file {IMAGE,SIZE}
+ * at offset *R_OFF.  On success the reference blob BLOB is set to
+ * the mapped blob and *R_OFF is advanced to the next blob.  */
+int
+_keybox_read_mapped_blob (KEYBOXBLOB blob, const unsigned char *image,
+                          size_t size, off_t *r_off)
+{
+  size_t off = *r_off;
+  size_t imagelen;
+
+ again:
+  if (off >= size)
+    return -1; /* eof */
+  if (size - off < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  imagelen = buf32_to_size_t (image + off);
+  if (imagelen < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  if (imagelen > size - off)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  if (!image[off+4])
+    {
+      /* Special treatment for empty blobs. */
+      off += imagelen;
+      *r_off = off;
+      goto again;
+    }
+
+  *r_off = off + imagelen;
+  if (imagelen > IMAGELEN_LIMIT) /* Sanity check. */
+    return gpg_error (GPG_ERR_TOO_LARGE);
+
+  _keybox_set_blob_ref (blob, image + off, imagelen, off);
+  return 0;
+}
+
+
+/* Map the keybox file opened at HD into memory.  This is a no-op if
+ * the file is already mapped or if mapping fails; in the latter case
+ * the search functions use the stdio read functions.  */
+void
+_keybox_map_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  struct stat st;
+  void *p;
+
+  if (hd->map.image || !hd->fp)
+    return;
+  if (fstat (fileno (hd->fp), &st) || !st.st_size
+      || (off_t)(size_t)st.st_size != st.st_size)
+    return;
+  p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fileno (hd->fp), 0);
+  if (p == MAP_FAILED)
+    return;
+  hd->map.image = p;
+  hd->map.size = st.st_size;
+#else
+  (void)hd;
+#endif
+}
+
+
+/* Release the mapping of HD.  */
+void
+_keybox_unmap_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  if (hd->map.image)
+    munmap (hd->map.image, hd->map.size);
+#endif
+  hd->map.image = NULL;
+  hd->map.size = 0;
+}
+
+
 /* Write the block to the current file position */
 int
 _keybox_write_blob (KEYBOXBLOB blob, FILE *fp)
@@ -0,0 +1,1518 @@
+/* keybox-index.c - Sidecar index for keybox files
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * The index file is stored next to the keybox file with the suffix
+ * ".idx" appended.  It maps keyids, keygrips, the subject and
+ * issuer names of X.509 certificates and the trigrams of all user
+ * IDs to the file offsets of the blobs carrying them and allows
+ * keybox_search to visit only those blobs instead of scanning the
+ * entire file.  The index is
+ * only a hint: each candidate blob is checked using the regular
+ * search predicates, thus false positives are harmless.  To avoid
+ * false negatives the index records the size, mtime and inode of the
+ * keybox file it describes and is ignored if they do not match.
+ * Because all updates of a keybox file replace it using a rename, a
+ * change of the keybox by a version of GnuPG not knowing about the
+ * index is reliably detected.
+ *
+ * Searches map the index file read-only and keep the mapping with
+ * the resource until the index does not anymore match the keybox.
+ * All processes using the same keybox thus share one copy of the
+ * index in the page cache instead of each reading it again for
+ * every search.  The index file is only replaced by a rename and
+ * only its header is updated in place, thus an existing mapping
+ * never changes under a reader except for the stamp.
+ *
+ * All integers are stored in network byte order.
+ *
+ * - b4   Magic 'KBXi'
+ * - byte Version number (3)
+ * - byte Flags
+ *        bit 0 - Keygrips are not available for all blobs.
+ * - u16  RFU
+ * - u32  Number of entries
+ * - u32  RFU
+ * - u64  Size of the keybox file
+ * - u64  Modification time of the keybox file
+ * - u64  Inode number of the keybox file
+ * - NENTRIES times, sorted in ascending order:
+ *   - byte Entry type (1 = keyid, 2 = keygrip, 3 = subject,
+ *          4 = issuer and serial number, 5 = user ID trigram)
+ *   - b3   RFU
+ *   - b8   Key.  For a keyid the low 32 bits are stored first so
+ *          that a short keyid is a prefix of the long keyid.  For a
+ *          keygrip the first 8 bytes of the keygrip.  For the names
+ *          the first 8 bytes of the SHA-1 hash of the subject DN
+ *          or of the issuer DN, a zero byte and the serial number.
+ *          For a trigram the three bytes with ASCII letters mapped
+ *          to lowercase followed by zero bytes.
+ *
+ * Version 1 did not have the entries for names and version 2 not
+ * those for trigrams; such an index is ignored and rebuilt on the
+ * next update.
+ *
+ * Each distinct trigram of the user IDs (and X.509 names) of a blob
+ * is stored once for the blob.  A user ID or mail address search
+ * for a string of at least 3 bytes looks up some of the trigrams of
+ * the search string and visits only the blobs having all of them.
+ * The user ID matching of keybox_search folds only ASCII letters,
+ * thus a matching user ID always contains the folded trigrams.
+ *   - u64  Offset of the blob in the keybox file.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
+#include "keybox-defs.h"
+#include <gcrypt.h>
+#include "../common/host2net.h"
+
+
+#define INDEX_MAGIC      "KBXi"
+#define INDEX_VERSION    3
+#define INDEX_HDRLEN     40
+#define INDEX_ENTRYLEN   20
+#define INDEX_KEYOFF     4   /* Offset of the key in an entry.  */
+#define INDEX_KEYLEN     8
+
+#define INDEX_TYPE_KEYID   1
+#define INDEX_TYPE_KEYGRIP 2
+#define INDEX_TYPE_SUBJECT 3
+#define INDEX_TYPE_ISSUER_SN 4
+#define INDEX_TYPE_TRIGRAM 5
+
+#define INDEX_FLAG_PARTIAL_GRIPS 1
+
+/* Keybox files of at least this size get an index.  */
+#define INDEX_MIN_KEYBOX_SIZE (2*1024*1024)
+
+
+/* The maximum number of trigrams of a search string looked up.  */
+#define MAX_SEARCH_TRIGRAMS 8
+
+
+/* The initial number of hash buckets of a bulk index.  */
+#define BULK_MIN_BUCKETS 1024
+
+/* End of a hash chain.  */
+#define NO_ENTRY ((size_t)-1)
+
+
+/* An in-memory copy of an index.  */
+struct keybox_index_s
+{
+  unsigned int flags;
+  size_t nentries;
+  size_t allocated;
+  unsigned char *entries;  /* NENTRIES * INDEX_ENTRYLEN bytes.  */
+
+  /* The following fields are only used by an index used for a bulk
+   * update (i.e. BUCKETS is not NULL).  In that case the first
+   * NSORTED entries are sorted and the entries appended later are
+   * found using a hash table on the first four bytes of their key.
+   * CHAIN links the appended entry N at index N - NSORTED.  */
+  size_t nsorted;
+  size_t nbuckets;    /* A power of two.  */
+  size_t *buckets;
+  size_t chainsize;
+  size_t *chain;
+};
+
+
+static void
+put_u64 (unsigned char *p, uint64_t val)
+{
+  ulongtobuf (p,   (u32)(val >> 32));
+  ulongtobuf (p+4, (u32)val);
+}
+
+static uint64_t
+get_u64 (const unsigned char *p)
+{
+  return (((uint64_t)buf32_to_u32 (p)) << 32) | buf32_to_u32 (p+4);
+}
+
+
+/* Return a malloced string with the name of the index file for the
+ * keybox FNAME.  */
+static char *
+index_fname (const char *fname)
+{
+  return strconcat (fname, EXTSEP_S "idx", NULL);
+}
+
+
+/* Fill the 24 byte buffer HDR with the file identification of the
+ * keybox file described by ST.  The layout matches the one of the
+ * file header at offset 16.  */
+static void
+stat_to_hdr (unsigned char *hdr, struct stat *st)
+{
+  put_u64 (hdr,    (uint64_t)st->st_size);
+  put_u64 (hdr+8,  (uint64_t)st->st_mtime);
+  put_u64 (hdr+16, (uint64_t)st->st_ino);
+}
+
+
+keybox_index_t
+_keybox_index_new (void)
+{
+  return xtrycalloc (1, sizeof (struct keybox_index_s));
+}
+
+
+void
+_keybox_index_release (keybox_index_t idx)
+{
+  if (!idx)
+    return;
+  xfree (idx->entries);
+  xfree (idx->buckets);
+  xfree (idx->chain);
+  xfree (idx);
+}
+
+
+static size_t
+bulk_hash (keybox_index_t idx, int type, const unsigned char *key)
+{
+  return (buf32_to_size_t (key) ^ type) & (idx->nbuckets - 1);
+}
+
+
+/* Link the entry N of the bulk index IDX into the hash table.  */
+static void
+bulk_link (keybox_index_t idx, size_t n)
+{
+  const unsigned char *p = idx->entries + n * INDEX_ENTRYLEN;
+  size_t h = bulk_hash (idx, p[0], p + INDEX_KEYOFF);
+
+  idx->chain[n - idx->nsorted] = idx->buckets[h];
+  idx->buckets[h] = n;
+}
+
+
+/* Replace the hash table of IDX by one with NBUCKETS buckets.  */
+static gpg_error_t
+bulk_rehash (keybox_index_t idx, size_t nbuckets)
+{
+  size_t *buckets;
+  size_t n;
+
+  buckets = xtrymalloc (nbuckets * sizeof *buckets);
+  if (!buckets)
+    return gpg_error_from_syserror ();
+  for (n=0; n < nbuckets; n++)
+    buckets[n] = NO_ENTRY;
+  xfree (idx->buckets);
+  idx->buckets = buckets;
+  idx->nbuckets = nbuckets;
+  for (n=idx->nsorted; n < idx->nentries; n++)
+    bulk_link (idx, n);
+  return 0;
+}
+
+
+static gpg_error_t
+add_entry (keybox_index_t idx, int type, const unsigned char *key, off_t off)
+{
+  unsigned char *p;
+
+  if (idx->nentries >= idx->allocated)
+    {
+      size_t newsize = idx->allocated? idx->allocated * 2 : 256;
+
+      p = xtryrealloc (idx->entries, newsize * INDEX_ENTRYLEN);
+      if (!p)
+        return gpg_error_from_syserror ();
+      idx->entries = p;
+      idx->allocated = newsize;
+    }
+  if (idx->buckets && idx->nentries - idx->nsorted >= idx->chainsize)
+    {
+      size_t newsize = idx->chainsize? idx->chainsize * 2 : 256;
+      size_t *tmp = xtryrealloc (idx->chain, newsize * sizeof *tmp);
+
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      idx->chain = tmp;
+      idx->chainsize = newsize;
+    }
+  p = idx->entries + idx->nentries * INDEX_ENTRYLEN;
+  memset (p, 0, INDEX_KEYOFF);
+  p[0] = type;
+  memcpy (p + INDEX_KEYOFF, key, INDEX_KEYLEN);
+  put_u64 (p + INDEX_KEYOFF + INDEX_KEYLEN, (uint64_t)off);
+  idx->nentries++;
+
+  if (idx->buckets)
+    {
+      bulk_link (idx, idx->nentries - 1);
+      /* Keep the chains short; a failed rehash is not a problem.  */
+      if (idx->nentries - idx->nsorted > 2 * idx->nbuckets)
+        bulk_rehash (idx, 2 * idx->nbuckets);
+    }
+  return 0;
+}
+
+
+/* Store the index key for the keyid given by MKID and LKID at KEY.  */
+static void
+kid_to_key (unsigned char *key, u32 mkid, u32 lkid)
+{
+  ulongtobuf (key,   lkid);
+  ulongtobuf (key+4, mkid);
+}
+
+
+/* Store the index key for the fingerprint FPR of length FPRLEN at
+ * KEY.  Returns false if no key can be derived.  */
+static int
+fpr_to_key (unsigned char *key, const unsigned char *fpr, int fprlen)
+{
+  if (fprlen == 20)
+    kid_to_key (key, buf32_to_u32 (fpr+12), buf32_to_u32 (fpr+16));
+  else if (fprlen == 32)
+    kid_to_key (key, buf32_to_u32 (fpr), buf32_to_u32 (fpr+4));
+  else
+    return 0;
+  return 1;
+}
+
+
+/* Store the index key for the subject DN NAME of length NAMELEN at
+ * KEY.  */
+static void
+subject_to_key (unsigned char *key, const void *name, size_t namelen)
+{
+  unsigned char digest[20];
+
+  gcry_md_hash_buffer (GCRY_MD_SHA1, digest, name, namelen);
+  memcpy (key, digest, INDEX_KEYLEN);
+}
+
+
+/* Store the index key for the issuer DN NAME of length NAMELEN and
+ * the binary serial number SN of length SNLEN at KEY.  */
+static void
+issuer_sn_to_key (unsigned char *key, const void *name, size_t namelen,
+                  const void *sn, size_t snlen)
+{
+  gcry_buffer_t iov[3];
+  unsigned char digest[20];
+
+  memset (iov, 0, sizeof iov);
+  iov[0].data = (void *)name;
+  iov[0].len  = namelen;
+  iov[1].data = "";
+  iov[1].len  = 1;
+  iov[2].data = (void *)sn;
+  iov[2].len  = snlen;
+  gcry_md_hash_buffers (GCRY_MD_SHA1, 0, digest, iov, 3);
+  memcpy (key, digest, INDEX_KEYLEN);
+}
+
+
+/* Add the subject and issuer entries for the X.509 blob at
+ * IMAGE,IMAGELEN stored at offset OFF.  POS is the offset of the
+ * serial number in the blob.  The first user ID of an X.509 blob is
+ * the issuer and the second the subject; empty names never match a
+ * search and thus need no entry.  */
+static gpg_error_t
+add_x509_names (keybox_index_t idx, const unsigned char *image,
+                size_t imagelen, size_t pos, off_t off)
+{
+  gpg_error_t err;
+  unsigned char key[INDEX_KEYLEN];
+  const unsigned char *sn;
+  size_t snlen, nuids, uidinfolen, nameoff, namelen;
+
+  if (pos + 2 > imagelen)
+    return 0;
+  snlen = buf16_to_ulong (image + pos);
+  sn = image + pos + 2;
+  pos += 2 + snlen;
+  if (pos + 4 > imagelen)
+    return 0;
+  nuids = buf16_to_ulong (image + pos);
+  uidinfolen = buf16_to_ulong (image + pos + 2);
+  pos += 4;
+  if (uidinfolen < 12 || nuids < 2
+      || pos + (uint64_t)uidinfolen * nuids > (uint64_t)imagelen)
+    return 0;
+
+  /* The issuer.  */
+  nameoff = buf32_to_size_t (image + pos);
+  namelen = buf32_to_size_t (image + pos + 4);
+  if ((uint64_t)nameoff + (uint64_t)namelen > (uint64_t)imagelen)
+    return 0;
+  if (namelen)
+    {
+      issuer_sn_to_key (key, image + nameoff, namelen, sn, snlen);
+      err = add_entry (idx, INDEX_TYPE_ISSUER_SN, key, off);
+      if (err)
+        return err;
+    }
+
+  /* The subject.  */
+  pos += uidinfolen;
+  nameoff = buf32_to_size_t (image + pos);
+  namelen = buf32_to_size_t (image + pos + 4);
+  if ((uint64_t)nameoff + (uint64_t)namelen > (uint64_t)imagelen)
+    return 0;
+  if (namelen)
+    {
+      subject_to_key (key, image + nameoff, namelen);
+      err = add_entry (idx, INDEX_TYPE_SUBJECT, key, off);
+      if (err)
+        return err;
+    }
+
+  return 0;
+}
+
+
+/* Store the index key for the trigram at S at KEY.  */
+static void
+trigram_to_key (unsigned char *key, const unsigned char *s)
+{
+  key[0] = ascii_tolower (s[0]);
+  key[1] = ascii_tolower (s[1]);
+  key[2] = ascii_tolower (s[2]);
+  memset (key+3, 0, INDEX_KEYLEN - 3);
+}
+
+
+static int
+compare_trigrams (const void *a, const void *b)
+{
+  return memcmp (a, b, 3);
+}
+
+
+/* Add the trigram entries for the user IDs of the blob at
+ * IMAGE,IMAGELEN stored at offset OFF.  POS is the offset of the
+ * serial number in the blob.  */
+static gpg_error_t
+add_uid_trigrams (keybox_index_t idx, const unsigned char *image,
+                  size_t imagelen, size_t pos, off_t off)
+{
+  gpg_error_t err = 0;
+  unsigned char key[INDEX_KEYLEN];
+  unsigned char *tri = NULL;
+  size_t ntri = 0;
+  size_t total = 0;
+  size_t nuids, uidinfolen, nameoff, namelen, n, i;
+
+  if (pos + 2 > imagelen)
+    return 0;
+  pos += 2 + buf16_to_ulong (image + pos);
+  if (pos + 4 > imagelen)
+    return 0;
+  nuids = buf16_to_ulong (image + pos);
+  uidinfolen = buf16_to_ulong (image + pos + 2);
+  pos += 4;
+  if (uidinfolen < 12
+      || pos + (uint64_t)uidinfolen * nuids > (uint64_t)imagelen)
+    return 0;
+
+  for (n=0; n < nuids; n++)
+    {
+      namelen = buf32_to_size_t (image + pos + n*uidinfolen + 4);
+      if (namelen > 2)
+        total += namelen - 2;
+    }
+  if (!total)
+    return 0;
+
+  /* Collect all trigrams so that each is stored only once.  */
+  tri = xtrymalloc (3 * total);
+  if (!tri)
+    return gpg_error_from_syserror ();
+  for (n=0; n < nuids; n++)
+    {
+      nameoff = buf32_to_size_t (image + pos + n*uidinfolen);
+      namelen = buf32_to_size_t (image + pos + n*uidinfolen + 4);
+      if ((uint64_t)nameoff + (uint64_t)namelen > (uint64_t)imagelen)
+        break;  /* keybox_search stops here as well.  */
+      for (i=0; i + 2 < namelen; i++)
+        {
+          trigram_to_key (key, image + nameoff + i);
+          memcpy (tri + 3*ntri++, key, 3);
+        }
+    }
+
+  qsort (tri, ntri, 3, compare_trigrams);
+  memset (key, 0, sizeof key);
+  for (n=0; n < ntri && !err; n++)
+    {
+      if (n && !memcmp (tri + 3*n, tri + 3*(n-1), 3))
+        continue;
+      memcpy (key, tri + 3*n, 3);
+      err = add_entry (idx, INDEX_TYPE_TRIGRAM, key, off);
+    }
+
+  xfree (tri);
+  return err;
+}
+
+
+/* Add the entries for the blob at IMAGE,IMAGELEN which is stored at
+ * offset OFF of the keybox file.  INFO may be given to avoid parsing
+ * the OpenPGP keyblock again.  */
+gpg_error_t
+_keybox_index_add_blob (keybox_index_t idx,
+                        const unsigned char *image, size_t imagelen,
+                        off_t off, keybox_openpgp_info_t info)
+{
+  gpg_error_t err;
+  size_t nkeys, keyinfolen, pos, n;
+  int fpr32, fprlen;
+  unsigned char key[INDEX_KEYLEN];
+  struct _keybox_openpgp_info tmpinfo;
+  struct _keybox_openpgp_key_info *k;
+
+  if (imagelen < 40)
+    return 0;
+  if (image[4] != KEYBOX_BLOBTYPE_PGP && image[4] != KEYBOX_BLOBTYPE_X509)
+    return 0;
+  fpr32 = image[5] == 2;
+
+  nkeys = buf16_to_ulong (image + 16);
+  keyinfolen = buf16_to_ulong (image + 18);
+  if (keyinfolen < (fpr32?56:28))
+    return 0; /* Invalid blob.  */
+  if (20 + (uint64_t)keyinfolen*nkeys > (uint64_t)imagelen)
+    return 0; /* Out of bounds.  */
+
+  for (n=0; n < nkeys; n++)
+    {
+      pos = 20 + n*keyinfolen;
+      if (fpr32)
+        fprlen = (buf16_to_ulong (image + pos + 32) & 0x80)? 32:20;
+      else
+        fprlen = 20;
+      if (fpr_to_key (key, image + pos, fprlen))
+        {
+          err = add_entry (idx, INDEX_TYPE_KEYID, key, off);
+          if (err)
+            return err;
+        }
+    }
+
+  err = add_uid_trigrams (idx, image, imagelen, 20 + keyinfolen*nkeys, off);
+  if (err)
+    return err;
+
+  if (image[4] != KEYBOX_BLOBTYPE_PGP)
+    {
+      /* We can't compute the keygrips of X.509 certificates here.  */
+      idx->flags |= INDEX_FLAG_PARTIAL_GRIPS;
+      return add_x509_names (idx, image, imagelen, 20 + keyinfolen*nkeys,
+                             off);
+    }
+
+  if (!info)
+    {
+      size_t cert_off, cert_len;
+
+      /* Take the keygrips from the blob if they are all stored.  */
+      for (n=0; n < nkeys; n++)
+        if (!_keybox_get_blob_keygrip (image, imagelen, n))
+          break;
+      if (n == nkeys)
+        {
+          err = 0;
+          for (n=0; n < nkeys && !err; n++)
+            err = add_entry (idx, INDEX_TYPE_KEYGRIP,
+                             _keybox_get_blob_keygrip (image, imagelen, n),
+                             off);
+          return err;
+        }
+
+      cert_off = buf32_to_size_t (image+8);
+      cert_len = buf32_to_size_t (image+12);
+      if ((uint64_t)cert_off+(uint64_t)cert_len > (uint64_t)imagelen
+          || _keybox_parse_openpgp (image + cert_off, cert_len, NULL,
+                                    &tmpinfo))
+        {
+          idx->flags |= INDEX_FLAG_PARTIAL_GRIPS;
+          return 0;
+        }
+      info = &tmpinfo;
+    }
+
+  err = add_entry (idx, INDEX_TYPE_KEYGRIP, info->primary.grip, off);
+  if (!err && info->nsubkeys)
+    {
+      for (k = &info->subkeys; k && !err; k = k->next)
+        err = add_entry (idx, INDEX_TYPE_KEYGRIP, k->grip, off);
+    }
+
+  if (info == &tmpinfo)
+    _keybox_destroy_openpgp_info (&tmpinfo);
+  return err;
+}
+
+
+/* Remove all entries for the blob at offset OFF and adjust the
+ * offsets of all blobs stored after that blob by DELTA.  */
+void
+_keybox_index_update_offsets (keybox_index_t idx, off_t off, off_t delta)
+{
+  size_t n, dst;
+  unsigned char *p;
+  uint64_t entryoff;
+
+  for (n=dst=0; n < idx->nentries; n++)
+    {
+      p = idx->entries + n * INDEX_ENTRYLEN;
+      entryoff = get_u64 (p + INDEX_KEYOFF + INDEX_KEYLEN);
+      if (entryoff == (uint64_t)off)
+        continue;
+      if (delta && entryoff > (uint64_t)off)
+        put_u64 (p + INDEX_KEYOFF + INDEX_KEYLEN, entryoff + delta);
+      if (dst != n)
+        memcpy (idx->entries + dst * INDEX_ENTRYLEN, p, INDEX_ENTRYLEN);
+      dst++;
+    }
+  idx->nentries = dst;
+}
+
+
+/* Map the offsets of all entries using the table MAP with NMAP pairs
+ * of old and new offsets sorted by the old offset.  Entries for
+ * offsets not in MAP are removed.  This is used after a compress
+ * run.  */
+void
+_keybox_index_remap (keybox_index_t idx, const off_t *map, size_t nmap)
+{
+  size_t n, dst, lo, hi, mid;
+  unsigned char *p;
+  off_t entryoff;
+
+  for (n=dst=0; n < idx->nentries; n++)
+    {
+      p = idx->entries + n * INDEX_ENTRYLEN;
+      entryoff = get_u64 (p + INDEX_KEYOFF + INDEX_KEYLEN);
+      lo = 0;
+      hi = nmap;
+      while (lo < hi)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (map[2*mid] < entryoff)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      if (lo >= nmap || map[2*lo] != entryoff)
+        continue; /* Blob has been removed.  */
+      put_u64 (p + INDEX_KEYOFF + INDEX_KEYLEN, (uint64_t)map[2*lo+1]);
+      if (dst != n)
+        memcpy (idx->entries + dst * INDEX_ENTRYLEN, p, INDEX_ENTRYLEN);
+      dst++;
+    }
+  idx->nentries = dst;
+}
+
+
+/* Open the index for the keybox described by FNAME and ST and read
+ * its header into HDR.  Returns NULL if no index exists or if the
+ * index does not match the keybox file.  */
+static FILE *
+open_index (const char *fname, struct stat *st, unsigned char *hdr)
+{
+  char *idxfname;
+  FILE *fp;
+  unsigned char tmp[24];
+
+  idxfname = index_fname (fname);
+  if (!idxfname)
+    return NULL;
+  fp = fopen (idxfname, "rb");
+  xfree (idxfname);
+  if (!fp)
+    return NULL;
+
+  stat_to_hdr (tmp, st);
+  if (fread (hdr, INDEX_HDRLEN, 1, fp) != 1
+      || memcmp (hdr, INDEX_MAGIC, 4)
+      || hdr[4] != INDEX_VERSION
+      || memcmp (hdr+16, tmp, 24))
+    {
+      fclose (fp);
+      return NULL;
+    }
+  return fp;
+}
+
+
+/* Release the mapping of the index of KB.  */
+static void
+unmap_index (KB_NAME kb)
+{
+#ifdef HAVE_MMAP
+  if (kb->idxmap.image)
+    munmap (kb->idxmap.image, kb->idxmap.size);
+#endif
+  kb->idxmap.image = NULL;
+  kb->idxmap.size = 0;
+}
+
+
+/* Return the mapped index of the keybox KB if it matches the keybox
+ * file described by ST; NULL is returned if there is no such index
+ * or mapping is not possible.  An existing mapping is used if it is
+ * still valid.  Note that the returned image is only valid until the
+ * next call of this function for KB.  */
+static const unsigned char *
+map_index (KB_NAME kb, struct stat *st)
+{
+#ifdef HAVE_MMAP
+  unsigned char tmp[24];
+  unsigned char hdr[INDEX_HDRLEN];
+  struct stat idxst;
+  FILE *fp;
+  void *p;
+
+  stat_to_hdr (tmp, st);
+  if (kb->idxmap.image && !memcmp (kb->idxmap.image+16, tmp, 24))
+    return kb->idxmap.image;
+  unmap_index (kb);
+
+  fp = open_index (kb->fname, st, hdr);
+  if (!fp)
+    return NULL;
+  if (!fstat (fileno (fp), &idxst)
+      && (off_t)(size_t)idxst.st_size == idxst.st_size
+      && (idxst.st_size >= INDEX_HDRLEN
+          + (off_t)buf32_to_size_t (hdr+8) * INDEX_ENTRYLEN))
+    {
+      p = mmap (NULL, idxst.st_size, PROT_READ, MAP_SHARED,
+                fileno (fp), 0);
+      if (p != MAP_FAILED)
+        {
+          kb->idxmap.image = p;
+          kb->idxmap.size = idxst.st_size;
+          /* The header might have been touched meanwhile.  */
+          if (memcmp (kb->idxmap.image, hdr, 16)
+              || memcmp (kb->idxmap.image+16, tmp, 24))
+            unmap_index (kb);
+        }
+    }
+  fclose (fp);
+  return kb->idxmap.image;
+#else
+  (void)kb;
+  (void)st;
+  return NULL;
+#endif
+}
+
+
+/* Load the index for the keybox file FNAME.  Returns NULL if there
+ * is no index or the index is stale.  If R_EXISTS is not NULL it is
+ * set to true if an index file exists, regardless of its state.  */
+keybox_index_t
+_keybox_index_load (const char *fname, int *r_exists)
+{
+  struct stat st;
+  unsigned char hdr[INDEX_HDRLEN];
+  keybox_index_t idx;
+  FILE *fp;
+  size_t n;
+
+  if (r_exists)
+    {
+      char *idxfname = index_fname (fname);
+
+      *r_exists = idxfname && !access (idxfname, F_OK);
+      xfree (idxfname);
+    }
+
+  if (stat (fname, &st))
+    return NULL;
+  fp = open_index (fname, &st, hdr);
+  if (!fp)
+    return NULL;
+
+  idx = _keybox_index_new ();
+  if (!idx)
+    goto leave;
+  idx->flags = hdr[5];
+  n = buf32_to_size_t (hdr+8);
+  if (n)
+    {
+      idx->entries = xtrymalloc (n * INDEX_ENTRYLEN);
+      if (!idx->entries
+          || fread (idx->entries, INDEX_ENTRYLEN, n, fp) != n)
+        {
+          _keybox_index_release (idx);
+          idx = NULL;
+          goto leave;
+        }
+      idx->nentries = idx->allocated = n;
+    }
+
+ leave:
+  fclose (fp);
+  return idx;
+}
+
+
+/* Return true if an index for the keybox file FNAME exists and
+ * matches the current state of the keybox file.  */
+int
+_keybox_index_is_fresh (const char *fname)
+{
+  struct stat st;
+  unsigned char hdr[INDEX_HDRLEN];
+  FILE *fp;
+
+  if (stat (fname, &st))
+    return 0;
+  fp = open_index (fname, &st, hdr);
+  if (!fp)
+    return 0;
+  fclose (fp);
+  return 1;
+}
+
+
+/* Return true if an index shall be created for the keybox file FNAME
+ * of size FILESIZE.  We do this for large keyboxes or if an index
+ * already exists.  */
+int
+_keybox_index_wanted (const char *fname, off_t filesize)
+{
+  char *idxfname;
+  int exists;
+
+  if (filesize >= INDEX_MIN_KEYBOX_SIZE)
+    return 1;
+  idxfname = index_fname (fname);
+  exists = idxfname && !access (idxfname, F_OK);
+  xfree (idxfname);
+  return exists;
+}
+
+
+/* Update the header of the index of FNAME after an in-place
+ * modification of the keybox file FNAME which did not change the
+ * offsets of the blobs.  This must only be called if the index was
+ * fresh before that modification.  */
+gpg_error_t
+_keybox_index_touch (const char *fname)
+{
+  gpg_error_t err = 0;
+  struct stat st;
+  unsigned char tmp[24];
+  char *idxfname;
+  FILE *fp;
+
+  if (stat (fname, &st))
+    return gpg_error_from_syserror ();
+  idxfname = index_fname (fname);
+  if (!idxfname)
+    return gpg_error_from_syserror ();
+  fp = fopen (idxfname, "r+b");
+  xfree (idxfname);
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  stat_to_hdr (tmp, &st);
+  if (fseeko (fp, 16, SEEK_SET) || fwrite (tmp, 24, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  return err;
+}
+
+
+static int
+compare_entries (const void *a, const void *b)
+{
+  return memcmp (a, b, INDEX_ENTRYLEN);
+}
+
+
+/* Sort IDX and write it as index for the keybox file FNAME.  The
+ * keybox file must already have its final state.  */
+gpg_error_t
+_keybox_index_store (keybox_index_t idx, const char *fname)
+{
+  gpg_error_t err;
+  struct stat st;
+  unsigned char hdr[INDEX_HDRLEN];
+  char *idxfname, *tmpfname;
+  FILE *fp;
+
+  if (stat (fname, &st))
+    return gpg_error_from_syserror ();
+
+  idxfname = index_fname (fname);
+  if (!idxfname)
+    return gpg_error_from_syserror ();
+  tmpfname = strconcat (idxfname, EXTSEP_S "tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (idxfname);
+      return err;
+    }
+
+  if (idx->nentries)
+    qsort (idx->entries, idx->nentries, INDEX_ENTRYLEN, compare_entries);
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, INDEX_MAGIC, 4);
+  hdr[4] = INDEX_VERSION;
+  hdr[5] = idx->flags;
+  ulongtobuf (hdr+8, idx->nentries);
+  stat_to_hdr (hdr+16, &st);
+
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fwrite (hdr, INDEX_HDRLEN, 1, fp) != 1
+      || (idx->nentries
+          && fwrite (idx->entries, INDEX_ENTRYLEN, idx->nentries, fp)
+          != idx->nentries))
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  err = gnupg_rename_file (tmpfname, idxfname, NULL);
+  if (err)
+    gnupg_remove (tmpfname);
+
+ leave:
+  xfree (tmpfname);
+  xfree (idxfname);
+  return err;
+}
+
+
+/* Create a new index for the keybox file FNAME by scanning the
+ * entire file and store it at R_IDX.  */
+static gpg_error_t
+build_index (const char *fname, keybox_index_t *r_idx)
+{
+  gpg_error_t err;
+  keybox_index_t idx;
+  KEYBOXBLOB blob;
+  const unsigned char *image;
+  size_t imagelen;
+  FILE *fp;
+
+  *r_idx = NULL;
+  idx = _keybox_index_new ();
+  if (!idx)
+    return gpg_error_from_syserror ();
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      _keybox_index_release (idx);
+      return err;
+    }
+
+  while (!(err = _keybox_read_blob (&blob, fp, NULL)))
+    {
+      image = _keybox_get_blob_image (blob, &imagelen);
+      err = _keybox_index_add_blob (idx, image, imagelen,
+                                    _keybox_get_blob_fileoffset (blob), NULL);
+      _keybox_release_blob (blob);
+      if (err)
+        break;
+    }
+  fclose (fp);
+  if (err == -1)
+    {
+      *r_idx = idx;
+      return 0;
+    }
+  _keybox_index_release (idx);
+  return err;
+}
+
+
+/* Create the index for the keybox file FNAME by scanning the entire
+ * file.  */
+gpg_error_t
+_keybox_index_rebuild (const char *fname)
+{
+  gpg_error_t err;
+  keybox_index_t idx;
+
+  err = build_index (fname, &idx);
+  if (!err)
+    err = _keybox_index_store (idx, fname);
+  else if (gpg_err_code (err) == GPG_ERR_TOO_LARGE)
+    err = 0; /* We can't properly index such a file; ignore it.  */
+
+  _keybox_index_release (idx);
+  return err;
+}
+
+
+/* Return an in-memory index for a bulk update of the keybox file
+ * FNAME.  The index is taken from the index file or, if that is not
+ * available, created by scanning FNAME.  Blobs appended during the
+ * bulk update are added using _keybox_index_add_blob and can be
+ * found right away by _keybox_index_search.  The caller needs to make
+ * sure that the file is not modified by other means.  Returns NULL if
+ * no index can be provided.  */
+keybox_index_t
+_keybox_index_bulk_load (const char *fname)
+{
+  keybox_index_t idx;
+
+  idx = _keybox_index_load (fname, NULL);
+  if (!idx)
+    {
+      if (build_index (fname, &idx))
+        return NULL;
+      if (idx->nentries)
+        qsort (idx->entries, idx->nentries, INDEX_ENTRYLEN, compare_entries);
+    }
+
+  idx->nsorted = idx->nentries;
+  if (bulk_rehash (idx, BULK_MIN_BUCKETS))
+    {
+      _keybox_index_release (idx);
+      return NULL;
+    }
+  return idx;
+}
+
+
+/* Remove the index of the keybox file FNAME.  */
+void
+_keybox_index_remove (const char *fname)
+{
+  char *idxfname = index_fname (fname);
+
+  if (idxfname)
+    gnupg_remove (idxfname);
+  xfree (idxfname);
+}
+
+
+/* Append OFF to the array at R_OFFSETS.  */
+static gpg_error_t
+add_offset (off_t off, off_t **r_offsets, size_t *r_count, size_t *r_alloced)
+{
+  if (*r_count >= *r_alloced)
+    {
+      size_t newsize = *r_alloced? *r_alloced * 2 : 8;
+      off_t *tmp = xtryrealloc (*r_offsets, newsize * sizeof *tmp);
+
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      *r_offsets = tmp;
+      *r_alloced = newsize;
+    }
+  (*r_offsets)[(*r_count)++] = off;
+  return 0;
+}
+
+
+/* Append the offsets of all entries matching the first CMPLEN bytes
+ * of WANT in the NENTRIES sorted ENTRIES.  */
+static gpg_error_t
+lookup_prefix_sorted (const unsigned char *entries, size_t nentries,
+                      const unsigned char *want, size_t cmplen,
+                      off_t **r_offsets, size_t *r_count, size_t *r_alloced)
+{
+  gpg_error_t err;
+  const unsigned char *entry;
+  size_t lo, hi, mid;
+
+  lo = 0;
+  hi = nentries;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (memcmp (entries + mid * INDEX_ENTRYLEN, want, cmplen) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  for (; lo < nentries; lo++)
+    {
+      entry = entries + lo * INDEX_ENTRYLEN;
+      if (memcmp (entry, want, cmplen))
+        break;
+      err = add_offset (get_u64 (entry+INDEX_KEYOFF+INDEX_KEYLEN),
+                        r_offsets, r_count, r_alloced);
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
+/* Same as lookup_prefix but for the bulk index MEMIDX.  */
+static gpg_error_t
+lookup_prefix_mem (keybox_index_t memidx, const unsigned char *want,
+                   size_t cmplen,
+                   off_t **r_offsets, size_t *r_count, size_t *r_alloced)
+{
+  gpg_error_t err;
+  const unsigned char *entry;
+  size_t lo;
+
+  /* The sorted part.  */
+  err = lookup_prefix_sorted (memidx->entries, memidx->nsorted, want, cmplen,
+                              r_offsets, r_count, r_alloced);
+  if (err)
+    return err;
+
+  /* The appended entries.  */
+  for (lo = memidx->buckets[bulk_hash (memidx, want[0], want+INDEX_KEYOFF)];
+       lo != NO_ENTRY; lo = memidx->chain[lo - memidx->nsorted])
+    {
+      entry = memidx->entries + lo * INDEX_ENTRYLEN;
+      if (memcmp (entry, want, cmplen))
+        continue;
+      err = add_offset (get_u64 (entry+INDEX_KEYOFF+INDEX_KEYLEN),
+                        r_offsets, r_count, r_alloced);
+      if (err)
+        return err;
+    }
+
+  return 0;
+}
+
+
+/* Append to the array at R_OFFSETS the offsets of all entries of
+ * TYPE whose keys start with the PREFIXLEN bytes at PREFIX.  IMAGE
+ * is the mapped index or, if it is NULL, FP the open index with
+ * NENTRIES.  If MEMIDX is not NULL, MEMIDX is used instead.
+ * PREFIXLEN must be at least 4.  */
+static gpg_error_t
+lookup_prefix (FILE *fp, const unsigned char *image,
+               keybox_index_t memidx, size_t nentries, int type,
+               const unsigned char *prefix, size_t prefixlen,
+               off_t **r_offsets, size_t *r_count, size_t *r_alloced)
+{
+  gpg_error_t err;
+  unsigned char want[INDEX_KEYOFF + INDEX_KEYLEN];
+  unsigned char entry[INDEX_ENTRYLEN];
+  size_t lo, hi, mid, cmplen;
+
+  memset (want, 0, sizeof want);
+  want[0] = type;
+  memcpy (want + INDEX_KEYOFF, prefix, prefixlen);
+  cmplen = INDEX_KEYOFF + prefixlen;
+
+  if (memidx)
+    return lookup_prefix_mem (memidx, want, cmplen,
+                              r_offsets, r_count, r_alloced);
+  if (image)
+    return lookup_prefix_sorted (image + INDEX_HDRLEN, nentries,
+                                 want, cmplen, r_offsets, r_count, r_alloced);
+
+  /* Find the first entry not less than WANT.  */
+  lo = 0;
+  hi = nentries;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (fseeko (fp, INDEX_HDRLEN + (off_t)mid * INDEX_ENTRYLEN, SEEK_SET)
+          || fread (entry, INDEX_ENTRYLEN, 1, fp) != 1)
+        return gpg_error (GPG_ERR_INV_KEYRING);
+      if (memcmp (entry, want, cmplen) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (lo >= nentries
+      || fseeko (fp, INDEX_HDRLEN + (off_t)lo * INDEX_ENTRYLEN, SEEK_SET))
+    return 0;
+  for (; lo < nentries; lo++)
+    {
+      if (fread (entry, INDEX_ENTRYLEN, 1, fp) != 1)
+        return gpg_error (GPG_ERR_INV_KEYRING);
+      if (memcmp (entry, want, cmplen))
+        break;
+      err = add_offset (get_u64 (entry+INDEX_KEYOFF+INDEX_KEYLEN),
+                        r_offsets, r_count, r_alloced);
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
+/* Store the index key for the issuer and serial number search DESC
+ * at KEY.  A serial number given as hex string is converted the same
+ * way keybox_search does it.  */
+static gpg_error_t
+desc_to_issuer_sn_key (unsigned char *key, KEYBOX_SEARCH_DESC *desc)
+{
+  const unsigned char *s;
+  unsigned char *sn, *p;
+  size_t i, snlen;
+
+  if (desc->snlen != -1)
+    {
+      issuer_sn_to_key (key, desc->u.name, strlen (desc->u.name),
+                        desc->sn, desc->snlen);
+      return 0;
+    }
+
+  for (s = desc->sn, i=0; *s && *s != '/'; s++, i++)
+    ;
+  snlen = (i+1)/2;
+  sn = p = xtrymalloc (snlen + 1);
+  if (!sn)
+    return gpg_error_from_syserror ();
+  s = desc->sn;
+  if ((i & 1))
+    {
+      *p++ = xtoi_1 (s);
+      s++;
+    }
+  for (; *s && *s != '/';  s += 2)
+    *p++ = xtoi_2 (s);
+  issuer_sn_to_key (key, desc->u.name, strlen (desc->u.name), sn, snlen);
+  xfree (sn);
+  return 0;
+}
+
+
+static int
+compare_offsets (const void *a, const void *b)
+{
+  off_t x = *(const off_t *)a;
+  off_t y = *(const off_t *)b;
+
+  return x < y? -1 : x > y? 1 : 0;
+}
+
+
+/* Sort the array OFFSETS with COUNT items, remove duplicates and
+ * return the new count.  */
+static size_t
+unique_offsets (off_t *offsets, size_t count)
+{
+  size_t n, i;
+
+  if (count < 2)
+    return count;
+  qsort (offsets, count, sizeof *offsets, compare_offsets);
+  for (n=i=1; n < count; n++)
+    if (offsets[n] != offsets[i-1])
+      offsets[i++] = offsets[n];
+  return i;
+}
+
+
+/* Return the search string of the user ID search DESC and store its
+ * length at R_LEN.  The angle brackets of a mail address are not
+ * needed for the trigram lookup and are skipped.  */
+static const unsigned char *
+desc_to_uid_string (KEYBOX_SEARCH_DESC *desc, size_t *r_len)
+{
+  const char *s = desc->u.name;
+  size_t len;
+
+  if ((desc->mode == KEYDB_SEARCH_MODE_MAIL
+       || desc->mode == KEYDB_SEARCH_MODE_MAILSUB) && *s == '<')
+    s++;
+  len = strlen (s);
+  if ((desc->mode == KEYDB_SEARCH_MODE_MAIL
+       || desc->mode == KEYDB_SEARCH_MODE_MAILSUB)
+      && len && s[len-1] == '>')
+    len--;
+  *r_len = len;
+  return (const unsigned char *)s;
+}
+
+
+/* Append to the array at R_OFFSETS the offsets of all blobs which
+ * carry up to MAX_SEARCH_TRIGRAMS trigrams spread over the string
+ * S of length LEN.  LEN must be at least 3.  */
+static gpg_error_t
+lookup_trigrams (FILE *fp, const unsigned char *image,
+                 keybox_index_t memidx, size_t nentries,
+                 const unsigned char *s, size_t len,
+                 off_t **r_offsets, size_t *r_count, size_t *r_alloced)
+{
+  gpg_error_t err = 0;
+  unsigned char key[INDEX_KEYLEN];
+  size_t ntri = len - 2;
+  size_t step, n, i, j, k;
+  off_t *cand = NULL;
+  size_t ncand = 0;
+  size_t alloced = 0;
+  off_t *tmp = NULL;
+  size_t ntmp, tmpalloced = 0;
+
+  step = ntri > MAX_SEARCH_TRIGRAMS? ntri / MAX_SEARCH_TRIGRAMS : 1;
+  for (n=0; n < ntri; n += step)
+    {
+      trigram_to_key (key, s + n);
+      if (!n)
+        {
+          err = lookup_prefix (fp, image, memidx, nentries,
+                               INDEX_TYPE_TRIGRAM, key, INDEX_KEYLEN,
+                               &cand, &ncand, &alloced);
+          if (err)
+            goto leave;
+          ncand = unique_offsets (cand, ncand);
+        }
+      else
+        {
+          /* Keep only the candidates also having this trigram.  */
+          ntmp = 0;
+          err = lookup_prefix (fp, image, memidx, nentries,
+                               INDEX_TYPE_TRIGRAM, key, INDEX_KEYLEN,
+                               &tmp, &ntmp, &tmpalloced);
+          if (err)
+            goto leave;
+          ntmp = unique_offsets (tmp, ntmp);
+          for (i=j=k=0; i < ncand && j < ntmp; )
+            {
+              if (cand[i] < tmp[j])
+                i++;
+              else if (cand[i] > tmp[j])
+                j++;
+              else
+                {
+                  cand[k++] = cand[i];
+                  i++;
+                  j++;
+                }
+            }
+          ncand = k;
+        }
+      if (!ncand)
+        break;
+    }
+
+  for (i=0; i < ncand && !err; i++)
+    err = add_offset (cand[i], r_offsets, r_count, r_alloced);
+
+ leave:
+  xfree (tmp);
+  xfree (cand);
+  return err;
+}
+
+
+/* Look up the candidate blobs for the search descriptions DESC using
+ * the index of the keybox KB whose file is opened as FP.  On success
+ * a malloced array with the sorted and unique offsets of all
+ * candidate blobs is stored at R_OFFSETS and their number at
+ * R_COUNT.  If a bulk update is active its in-memory index is used
+ * instead of the index file.  An error is returned if the index
+ * can't be used for DESC or is not available; the caller should
+ * then fall back to a linear scan.  */
+gpg_error_t
+_keybox_index_search (FILE *fp, KB_NAME kb,
+                      KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                      off_t **r_offsets, size_t *r_count)
+{
+  gpg_error_t err = 0;
+  keybox_index_t memidx = kb->bulk.idx;
+  struct stat st;
+  unsigned char hdr[INDEX_HDRLEN];
+  unsigned char key[INDEX_KEYLEN];
+  const unsigned char *image = NULL;
+  const unsigned char *uidstr;
+  size_t uidlen;
+  FILE *idxfp = NULL;
+  size_t n;
+  size_t nentries = 0;
+  unsigned int flags;
+  size_t count = 0;
+  size_t alloced = 0;
+  off_t *offsets = NULL;
+
+  *r_offsets = NULL;
+  *r_count = 0;
+
+  if (!ndesc)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  for (n=0; n < ndesc; n++)
+    {
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_SHORT_KID:
+        case KEYDB_SEARCH_MODE_LONG_KID:
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+        case KEYDB_SEARCH_MODE_UBID:
+          break;
+        case KEYDB_SEARCH_MODE_FPR:
+          if (desc[n].fprlen != 20 && desc[n].fprlen != 32)
+            return gpg_error (GPG_ERR_NOT_SUPPORTED);
+          break;
+        case KEYDB_SEARCH_MODE_SUBJECT:
+          if (!desc[n].u.name)
+            return gpg_error (GPG_ERR_NOT_SUPPORTED);
+          break;
+        case KEYDB_SEARCH_MODE_ISSUER_SN:
+          if (!desc[n].u.name || !desc[n].sn)
+            return gpg_error (GPG_ERR_NOT_SUPPORTED);
+          break;
+        case KEYDB_SEARCH_MODE_EXACT:
+        case KEYDB_SEARCH_MODE_SUBSTR:
+        case KEYDB_SEARCH_MODE_MAIL:
+        case KEYDB_SEARCH_MODE_MAILSUB:
+          if (!desc[n].u.name)
+            return gpg_error (GPG_ERR_NOT_SUPPORTED);
+          desc_to_uid_string (desc + n, &uidlen);
+          if (uidlen < 3)
+            return gpg_error (GPG_ERR_NOT_SUPPORTED);
+          break;
+        default:
+          return gpg_error (GPG_ERR_NOT_SUPPORTED);
+        }
+    }
+
+  if (memidx)
+    flags = memidx->flags;
+  else
+    {
+      if (fstat (fileno (fp), &st))
+        return gpg_error_from_syserror ();
+      image = map_index (kb, &st);
+      if (image)
+        memcpy (hdr, image, INDEX_HDRLEN);
+      else if (!(idxfp = open_index (kb->fname, &st, hdr)))
+        return gpg_error (GPG_ERR_NOT_FOUND);
+      nentries = buf32_to_size_t (hdr+8);
+      flags = hdr[5];
+    }
+
+  for (n=0; n < ndesc && !err; n++)
+    {
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_SHORT_KID:
+          ulongtobuf (key, desc[n].u.kid[1]);
+          err = lookup_prefix (idxfp, image, memidx, nentries,
+                               INDEX_TYPE_KEYID, key, 4,
+                               &offsets, &count, &alloced);
+          break;
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          kid_to_key (key, desc[n].u.kid[0], desc[n].u.kid[1]);
+          err = lookup_prefix (idxfp, image, memidx, nentries,
+                               INDEX_TYPE_KEYID, key, INDEX_KEYLEN,
+                               &offsets, &count, &alloced);
+          break;
+        case KEYDB_SEARCH_MODE_FPR:
+          fpr_to_key (key, desc[n].u.fpr, desc[n].fprlen);
+          err = lookup_prefix (idxfp, image, memidx, nentries,
+                               INDEX_TYPE_KEYID, key, INDEX_KEYLEN,
+                               &offsets, &count, &alloced);
+          break;
+        case KEYDB_SEARCH_MODE_UBID:
+          /* The UBID is the fingerprint of the primary key truncated
+           * to 20 bytes; we don't know the key version thus we need
+           * to try both ways of deriving the keyid.  */
+          fpr_to_key (key, desc[n].u.ubid, 20);
+          err = lookup_prefix (idxfp, image, memidx, nentries,
+                               INDEX_TYPE_KEYID, key, INDEX_KEYLEN,
+                               &offsets, &count, &alloced);
+          if (!err)
+            {
+              kid_to_key (key, buf32_to_u32 (desc[n].u.ubid),
+                          buf32_to_u32 (desc[n].u.ubid+4));
+              err = lookup_prefix (idxfp, image, memidx, nentries,
+                                   INDEX_TYPE_KEYID, key, INDEX_KEYLEN,
+                                   &offsets, &count, &alloced);
+            }
+          break;
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+          if ((flags & INDEX_FLAG_PARTIAL_GRIPS))
+            err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          else
+            err = lookup_prefix (idxfp, image, memidx, nentries,
+                                 INDEX_TYPE_KEYGRIP,
+                                 desc[n].u.grip, INDEX_KEYLEN,
+                                 &offsets, &count, &alloced);
+          break;
+        case KEYDB_SEARCH_MODE_SUBJECT:
+          subject_to_key (key, desc[n].u.name, strlen (desc[n].u.name));
+          err = lookup_prefix (idxfp, image, memidx, nentries,
+                               INDEX_TYPE_SUBJECT, key, INDEX_KEYLEN,
+                               &offsets, &count, &alloced);
+          break;
+        case KEYDB_SEARCH_MODE_ISSUER_SN:
+          err = desc_to_issuer_sn_key (key, desc + n);
+          if (!err)
+            err = lookup_prefix (idxfp, image, memidx, nentries,
+                                 INDEX_TYPE_ISSUER_SN, key, INDEX_KEYLEN,
+                                 &offsets, &count, &alloced);
+          break;
+        case KEYDB_SEARCH_MODE_EXACT:
+        case KEYDB_SEARCH_MODE_SUBSTR:
+        case KEYDB_SEARCH_MODE_MAIL:
+        case KEYDB_SEARCH_MODE_MAILSUB:
+          uidstr = desc_to_uid_string (desc + n, &uidlen);
+          err = lookup_trigrams (idxfp, image, memidx, nentries,
+                                 uidstr, uidlen,
+                                 &offsets, &count, &alloced);
+          break;
+        default:
+          break;
+        }
+    }
+  if (idxfp)
+    fclose (idxfp);
+  if (err)
+    {
+      xfree (offsets);
+      return err;
+    }
+
+  count = unique_offsets (offsets, count);
+
+  *r_offsets = offsets;
+  *r_count = count;
+  return 0;
+}
@@ -63,6 +63,10 @@ keybox_register_file (const char *fname, int secret, void **r_token)
   kr->lockhd = NULL;
   kr->is_locked = 0;
   kr->did_full_scan = 0;
+  memset (&kr->bulk, 0, sizeof kr->bulk);
+  memset (&kr->idxmap, 0, sizeof kr->idxmap);
+  kr->bloom = NULL;
+  kr->bloom_misses = 0;
   /* keep a list of all issued pointers */
   kr->next = kb_names;
   kb_names = kr;
@@ -177,6 +181,7 @@ keybox_release (KEYBOX_HANDLE hd)
     }
   _keybox_release_blob (hd->found.blob);
   _keybox_release_blob (hd->saved_found.blob);
+  _keybox_unmap_file (hd);
   if (hd->fp)
     {
       fclose (hd->fp);
@@ -250,6 +255,7 @@ _keybox_close_file (KEYBOX_HANDLE hd)
   for (idx=0; idx < hd->kb->handle_table_size; idx++)
     if ((roverhd = hd->kb->handle_table[idx]))
       {
+        _keybox_unmap_file (roverhd);
         if (roverhd->fp)
           {
             fclose (roverhd->fp);
@@ -314,7 +320,8 @@ keybox_lock (KEYBOX_HANDLE hd, int yes, long timeout)
     }
   else /* Release the lock.  */
     {
-      if (kb->is_locked)
+      /* During a bulk update the lock is kept until keybox_bulk_end.  */
+      if (kb->is_locked && !kb->bulk.active)
         {
           if (dotlock_release (kb->lockhd))
             {
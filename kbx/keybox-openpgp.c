@@ -252,9 +252,12 @@ keygrip_from_keyparm (int algo, struct keyparm_s *kp, unsigned char *grip)
 }
 
 
-/* Parse a key packet and store the information in KI. */
+/* Parse a key packet and store the information in KI.  The keygrip
+ * is only computed if WANT_GRIP is set; otherwise it is zeroed.  If
+ * WANT_GRIP is 2 a failure to compute the keygrip is not an error
+ * but only leaves KI->HAVE_GRIP unset.  */
 static gpg_error_t
-parse_key (const unsigned char *data, size_t datalen,
+parse_key (const unsigned char *data, size_t datalen, int want_grip,
            struct _keybox_openpgp_key_info *ki)
 {
   gpg_error_t err;
@@ -387,9 +390,17 @@ parse_key (const unsigned char *data, size_t datalen,
         }
     }
 
-  err = keygrip_from_keyparm (algorithm, keyparm, ki->grip);
-  if (err)
-    goto leave;
+  ki->have_grip = 0;
+  if (want_grip)
+    {
+      err = keygrip_from_keyparm (algorithm, keyparm, ki->grip);
+      if (err && want_grip != 2)
+        goto leave;
+      ki->have_grip = !err;
+      err = 0;
+    }
+  else
+    memset (ki->grip, 0, 20);
 
   if (version < 4)
     {
@@ -491,16 +502,11 @@ parse_key (const unsigned char *data, size_t datalen,
 }
 
 
-
-/* The caller must pass the address of an INFO structure which will
-   get filled on success with information pertaining to the OpenPGP
-   keyblock IMAGE of length IMAGELEN.  Note that a caller does only
-   need to release this INFO structure if the function returns
-   success.  If NPARSED is not NULL the actual number of bytes parsed
-   will be stored at this address.  */
-gpg_error_t
-_keybox_parse_openpgp (const unsigned char *image, size_t imagelen,
-                       size_t *nparsed, keybox_openpgp_info_t info)
+/* Worker for _keybox_parse_openpgp and _keybox_parse_openpgp_for_blob.
+ * See parse_key for the meaning of WANT_GRIPS.  */
+static gpg_error_t
+parse_openpgp (const unsigned char *image, size_t imagelen,
+               size_t *nparsed, int want_grips, keybox_openpgp_info_t info)
 {
   gpg_error_t err = 0;
   const unsigned char *image_start, *data;
@@ -576,7 +582,7 @@ _keybox_parse_openpgp (const unsigned char *image, size_t imagelen,
         }
       else if (pkttype == PKT_PUBLIC_KEY || pkttype == PKT_SECRET_KEY)
         {
-          err = parse_key (data, datalen, &info->primary);
+          err = parse_key (data, datalen, want_grips, &info->primary);
           if (err)
             break;
         }
@@ -591,7 +597,7 @@ _keybox_parse_openpgp (const unsigned char *image, size_t imagelen,
           info->nsubkeys++;
           if (info->nsubkeys == 1)
             {
-              err = parse_key (data, datalen, &info->subkeys);
+              err = parse_key (data, datalen, want_grips, &info->subkeys);
               if (err)
                 {
                   info->nsubkeys--;
@@ -613,7 +619,7 @@ _keybox_parse_openpgp (const unsigned char *image, size_t imagelen,
                   err = gpg_error_from_syserror ();
                   break;
                 }
-              err = parse_key (data, datalen, k);
+              err = parse_key (data, datalen, want_grips, k);
               if (err)
                 {
                   xfree (k);
@@ -660,6 +666,66 @@ _keybox_parse_openpgp (const unsigned char *image, size_t imagelen,
 }
 
 
+
+/* The caller must pass the address of an INFO structure which will
+   get filled on success with information pertaining to the OpenPGP
+   keyblock IMAGE of length IMAGELEN.  Note that a caller does only
+   need to release this INFO structure if the function returns
+   success.  If NPARSED is not NULL the actual number of bytes parsed
+   will be stored at this address.  */
+gpg_error_t
+_keybox_parse_openpgp (const unsigned char *image, size_t imagelen,
+                       size_t *nparsed, keybox_openpgp_info_t info)
+{
+  return parse_openpgp (image, imagelen, nparsed, 1, info);
+}
+
+
+/* Same as _keybox_parse_openpgp but keys for which no keygrip can be
+ * computed are not an error.  This is used to create a keybox blob
+ * which stores the keygrips so that they need not be computed again
+ * by searches and the index.  */
+gpg_error_t
+_keybox_parse_openpgp_for_blob (const unsigned char *image, size_t imagelen,
+                                size_t *nparsed, keybox_openpgp_info_t info)
+{
+  return parse_openpgp (image, imagelen, nparsed, 2, info);
+}
+
+
+/* Store at R_LEN the length of the OpenPGP keyblock at the start of
+ * IMAGE,IMAGELEN.  The keyblock ends right before the next public or
+ * secret key packet.  The packets are not parsed; this is used to
+ * split a keyring into keyblocks which are then parsed independently
+ * by _keybox_parse_openpgp.  Returns GPG_ERR_NO_DATA if IMAGELEN is
+ * zero.  */
+gpg_error_t
+_keybox_split_openpgp (const unsigned char *image, size_t imagelen,
+                       size_t *r_len)
+{
+  gpg_error_t err;
+  const unsigned char *data;
+  size_t n, datalen;
+  int pkttype;
+  int first = 1;
+
+  *r_len = 0;
+  while (image)
+    {
+      err = next_packet (&image, &imagelen, &data, &datalen, &pkttype, &n);
+      if (err)
+        return err;
+      if (first)
+        first = 0;
+      else if (pkttype == PKT_PUBLIC_KEY || pkttype == PKT_SECRET_KEY)
+        break;
+      *r_len += n;
+    }
+
+  return 0;
+}
+
+
 /* Release any malloced data in INFO but not INFO itself! */
 void
 _keybox_destroy_openpgp_info (keybox_openpgp_info_t info)
@@ -40,6 +40,17 @@ struct sn_array_s {
     unsigned char *sn;
 };
 
+/* The keyid and fingerprint descriptors of a search sorted by the
+ * low 32 bits of the keyid.  This is used to check all of them with
+ * one pass over the key table of a blob.  */
+struct kid_table_s {
+  size_t nitems;
+  struct {
+    u32 lkid;
+    size_t descidx;
+  } items[1];
+};
+
 
 #define get32(a) buf32_to_ulong ((a))
 #define get16(a) buf16_to_ulong ((a))
@@ -59,6 +70,20 @@ blob_get_blob_flags (KEYBOXBLOB blob)
 }
 
 
+static inline unsigned int
+blob_get_version (KEYBOXBLOB blob)
+{
+  const unsigned char *buffer;
+  size_t length;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 8)
+    return 0; /* oops */
+
+  return buffer[5];
+}
+
+
 /* Return the first keyid from the blob.  Returns true if
    available.  */
 static int
@@ -557,22 +582,36 @@ blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr,
 
 
 /* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.
- * We don't have the keygrips as meta data, thus we need to parse the
- * certificate. Fixme: We might want to return proper error codes
- * instead of failing a search for invalid certificates etc.  */
+ * Blobs written by older versions don't have the keygrips as meta
+ * data, thus we need to parse the certificate in this case.  Fixme:
+ * We might want to return proper error codes instead of failing a
+ * search for invalid certificates etc.  */
 static int
 blob_openpgp_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
 {
   int rc = 0;
-  const unsigned char *buffer;
+  const unsigned char *buffer, *kg;
   size_t length;
   size_t cert_off, cert_len;
+  size_t nkeys, idx;
   struct _keybox_openpgp_info info;
   struct _keybox_openpgp_key_info *k;
 
   buffer = _keybox_get_blob_image (blob, &length);
   if (length < 40)
     return 0; /* Too short. */
+
+  nkeys = get16 (buffer + 16);
+  for (idx=0; idx < nkeys; idx++)
+    {
+      kg = _keybox_get_blob_keygrip (buffer, length, idx);
+      if (!kg)
+        break;
+      if (!memcmp (kg, grip, 20))
+        return 1;
+    }
+  if (nkeys && idx == nkeys)
+    return 0; /* All keygrips are stored and none matched.  */
   cert_off = get32 (buffer+8);
   cert_len = get32 (buffer+12);
   if ((uint64_t)cert_off+(uint64_t)cert_len > (uint64_t)length)
@@ -886,6 +925,7 @@ keybox_search_reset (KEYBOX_HANDLE hd)
         {
           /* Ooops.  Seek did not work.  Close so that the search will
            * open the file again.  */
+          _keybox_unmap_file (hd);
           fclose (hd->fp);
           hd->fp = NULL;
         }
@@ -896,6 +936,117 @@ keybox_search_reset (KEYBOX_HANDLE hd)
 }
 
 
+static int
+compare_kid_table_items (const void *a, const void *b)
+{
+  const u32 x = *(const u32 *)a;
+  const u32 y = *(const u32 *)b;
+
+  return x < y? -1 : x > y? 1 : 0;
+}
+
+
+/* Create a table with all keyid and 20 byte fingerprint descriptors
+ * of DESC for use by kid_table_match.  Returns NULL if there are less
+ * than two such descriptors or on error; the caller then checks the
+ * descriptors one by one.  */
+static struct kid_table_s *
+make_kid_table (KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+{
+  struct kid_table_s *table;
+  size_t n, count;
+
+  for (count=n=0; n < ndesc; n++)
+    if (desc[n].mode == KEYDB_SEARCH_MODE_SHORT_KID
+        || desc[n].mode == KEYDB_SEARCH_MODE_LONG_KID
+        || (desc[n].mode == KEYDB_SEARCH_MODE_FPR && desc[n].fprlen == 20))
+      count++;
+  if (count < 2)
+    return NULL;
+
+  table = xtrymalloc (sizeof *table + (count - 1) * sizeof *table->items);
+  if (!table)
+    return NULL;
+  table->nitems = 0;
+  for (n=0; n < ndesc; n++)
+    {
+      if (desc[n].mode == KEYDB_SEARCH_MODE_SHORT_KID
+          || desc[n].mode == KEYDB_SEARCH_MODE_LONG_KID)
+        table->items[table->nitems].lkid = desc[n].u.kid[1];
+      else if (desc[n].mode == KEYDB_SEARCH_MODE_FPR && desc[n].fprlen == 20)
+        table->items[table->nitems].lkid = get32 (desc[n].u.fpr + 16);
+      else
+        continue;
+      table->items[table->nitems++].descidx = n;
+    }
+  qsort (table->items, table->nitems, sizeof *table->items,
+         compare_kid_table_items);
+  return table;
+}
+
+
+/* Check all descriptors of TABLE against the keys of the version 1
+ * BLOB.  Returns the lowest index of the matching descriptors and
+ * stores the key number as used by has_long_kid et al. at R_PK_NO.
+ * Returns -1 if no descriptor matches.  */
+static int
+kid_table_match (struct kid_table_s *table, KEYBOX_SEARCH_DESC *desc,
+                 KEYBOXBLOB blob, int *r_pk_no)
+{
+  const unsigned char *buffer, *fpr;
+  size_t length;
+  size_t nkeys, keyinfolen;
+  size_t lo, hi, mid, n;
+  int idx;
+  int found = -1;
+  u32 lkid;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return -1; /* blob too short */
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18 );
+  if (keyinfolen < 28)
+    return -1; /* invalid blob */
+  if (20 + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
+    return -1; /* out of bounds */
+
+  for (idx=0; idx < nkeys; idx++)
+    {
+      fpr = buffer + 20 + idx*keyinfolen;
+      lkid = get32 (fpr + 16);
+
+      lo = 0;
+      hi = table->nitems;
+      while (lo < hi)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (table->items[mid].lkid < lkid)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      for (; lo < table->nitems && table->items[lo].lkid == lkid; lo++)
+        {
+          n = table->items[lo].descidx;
+          if (found != -1 && n >= (size_t)found)
+            continue; /* We already have a better match.  */
+          if (desc[n].mode == KEYDB_SEARCH_MODE_LONG_KID
+              && get32 (fpr + 12) != desc[n].u.kid[0])
+            continue;
+          if (desc[n].mode == KEYDB_SEARCH_MODE_FPR
+              && memcmp (fpr, desc[n].u.fpr, 20))
+            continue;
+          found = n;
+          *r_pk_no = idx+1;
+        }
+    }
+
+  return found;
+}
+
+
 /* Note: When in ephemeral mode the search function does visit all
    blobs but in standard mode, blobs flagged as ephemeral are ignored.
    If WANT_BLOBTYPE is not 0 only blobs of this type are considered.
@@ -913,6 +1064,16 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
   struct sn_array_s *sn_array = NULL;
   int pk_no, uid_no;
   off_t lastfoundoff;
+  off_t *idx_offsets = NULL;
+  size_t idx_count = 0;
+  size_t idx_pos = 0;
+  int use_index = 0;
+  KEYBOXBLOB mapblob = NULL;
+  off_t mapoff = 0;
+  struct kid_table_s *kid_table = NULL;
+  int use_kid_table;
+  int kid_desc = -1;
+  int kid_pk_no = 0;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -1058,6 +1219,41 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         }
     }
 
+  /* A search for keyids or fingerprints not in the keybox can often
+   * be rejected using the in-memory filter.  */
+  if (_keybox_bloom_reject (hd, desc, ndesc))
+    {
+      rc = -1;
+      goto leave;
+    }
+
+  /* If the search is for keyids, fingerprints, keygrips, names or
+   * user IDs only, we try to use the index to jump directly to the
+   * candidate blobs.  If no usable index is available we do a linear
+   * scan.  */
+  if (!_keybox_index_search (hd->fp, hd->kb, desc, ndesc,
+                             &idx_offsets, &idx_count))
+    {
+      off_t curoff = ftello (hd->fp);
+
+      use_index = 1;
+      while (idx_pos < idx_count && idx_offsets[idx_pos] < curoff)
+        idx_pos++;
+    }
+
+  /* With several keyid or fingerprint descriptors we check them all
+   * in one pass over the key table of a blob.  */
+  kid_table = make_kid_table (desc, ndesc);
+
+  /* If possible we run the search predicates directly on the mapped
+   * file and copy only the blob we eventually return.  */
+  _keybox_map_file (hd);
+  if (hd->map.image)
+    {
+      mapoff = ftello (hd->fp);
+      if (mapoff == (off_t)-1 || _keybox_new_blob_ref (&mapblob))
+        mapblob = NULL;
+    }
 
   pk_no = uid_no = 0;
   for (;;)
@@ -1065,8 +1261,34 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       unsigned int blobflags;
       int blobtype;
 
-      _keybox_release_blob (blob); blob = NULL;
-      rc = _keybox_read_blob (&blob, hd->fp, NULL);
+      if (blob != mapblob)
+        _keybox_release_blob (blob);
+      blob = NULL;
+      if (use_index)
+        {
+          if (idx_pos >= idx_count)
+            {
+              rc = -1;  /* No more candidates.  */
+              break;
+            }
+          if (mapblob)
+            mapoff = idx_offsets[idx_pos];
+          else if (fseeko (hd->fp, idx_offsets[idx_pos], SEEK_SET))
+            {
+              rc = gpg_error_from_syserror ();
+              break;
+            }
+          idx_pos++;
+        }
+      if (mapblob)
+        {
+          rc = _keybox_read_mapped_blob (mapblob, hd->map.image,
+                                         hd->map.size, &mapoff);
+          if (!rc)
+            blob = mapblob;
+        }
+      else
+        rc = _keybox_read_blob (&blob, hd->fp, NULL);
       if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
           && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
         {
@@ -1077,6 +1299,10 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       if (rc)
         break;
 
+      if (use_index
+          && _keybox_get_blob_fileoffset (blob) != idx_offsets[idx_pos-1])
+        continue; /* The blob has been deleted; we got the next one.  */
+
       blobtype = blob_get_type (blob);
       if (blobtype == KEYBOX_BLOBTYPE_HEADER)
         continue;
@@ -1087,6 +1313,13 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       if (!hd->ephemeral && (blobflags & 2))
         continue; /* Not in ephemeral mode but blob is flagged ephemeral.  */
 
+      /* The table is only used for version 1 blobs; for the others
+       * we check the descriptors one by one.  Note that a version 1
+       * blob can't match a fingerprint not of 20 bytes.  */
+      use_kid_table = (kid_table && blob_get_version (blob) == 1);
+      if (use_kid_table)
+        kid_desc = kid_table_match (kid_table, desc, blob, &kid_pk_no);
+
       for (n=0; n < ndesc; n++)
         {
           switch (desc[n].mode)
@@ -1138,18 +1371,25 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_SHORT_KID:
-              pk_no = has_short_kid (blob, desc[n].u.kid[1]);
-              if (pk_no)
-                goto found;
-              break;
             case KEYDB_SEARCH_MODE_LONG_KID:
-              pk_no = has_long_kid (blob, desc[n].u.kid[0], desc[n].u.kid[1]);
-              if (pk_no)
-                goto found;
-              break;
-
             case KEYDB_SEARCH_MODE_FPR:
-              pk_no = has_fingerprint (blob, desc[n].u.fpr, desc[n].fprlen);
+              if (use_kid_table)
+                {
+                  if (n == kid_desc)
+                    {
+                      pk_no = kid_pk_no;
+                      goto found;
+                    }
+                  break;
+                }
+              else if (desc[n].mode == KEYDB_SEARCH_MODE_SHORT_KID)
+                pk_no = has_short_kid (blob, desc[n].u.kid[1]);
+              else if (desc[n].mode == KEYDB_SEARCH_MODE_LONG_KID)
+                pk_no = has_long_kid (blob, desc[n].u.kid[0],
+                                      desc[n].u.kid[1]);
+              else
+                pk_no = has_fingerprint (blob, desc[n].u.fpr,
+                                         desc[n].fprlen);
               if (pk_no)
                 goto found;
               break;
@@ -1192,6 +1432,23 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         break; /* got it */
     }
 
+  if (rc == -1)
+    _keybox_bloom_miss (hd, desc, ndesc, !use_index);
+
+ leave:
+  if (mapblob)
+    {
+      /* Sync the file position with the mapped read position and make
+       * a copy of the found blob.  */
+      if (fseeko (hd->fp, mapoff, SEEK_SET) && (!rc || rc == -1))
+        rc = gpg_error_from_syserror ();
+      if (!rc)
+        rc = _keybox_copy_blob (&blob, mapblob);
+      else
+        blob = NULL;
+      _keybox_release_blob (mapblob);
+    }
+
   if (!rc)
     {
       hd->found.blob = blob;
@@ -1211,6 +1468,8 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
 
   if (sn_array)
     release_sn_array (sn_array, ndesc);
+  xfree (idx_offsets);
+  xfree (kid_table);
 
   return rc;
 }
@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <assert.h>
 
 #include "keybox-defs.h"
@@ -38,6 +39,9 @@
 #define FILECOPY_UPDATE 3
 
 
+static int do_compress (KEYBOX_HANDLE hd, int force);
+
+
 #if !defined(HAVE_FSEEKO) && !defined(fseeko)
 
 #ifdef HAVE_LIMITS_H
@@ -154,6 +158,49 @@ rename_tmp_file (const char *bakfname, const char *tmpfname,
 
 
 
+/* Bring the index of the keybox FNAME in sync after a successful
+ * blob_filecopy operation of MODE.  IDX is the index loaded before
+ * the operation or NULL if it was not available; IDX_EXISTS tells
+ * whether a probably stale index file exists.  BLOB is the new blob
+ * stored at BLOB_OFF; OLD_BLOBLEN is the length of the replaced or
+ * deleted blob.  Errors are not fatal because a stale index is
+ * detected and ignored by the search functions.  */
+static void
+update_index (const char *fname, int mode, keybox_index_t idx, int idx_exists,
+              KEYBOXBLOB blob, off_t blob_off, off_t old_bloblen)
+{
+  gpg_error_t err;
+  const unsigned char *image;
+  size_t imagelen = 0;
+
+  if (!idx)
+    {
+      /* Rebuild an existing but stale index.  */
+      if (idx_exists)
+        {
+          err = _keybox_index_rebuild (fname);
+          if (err)
+            log_info ("error rebuilding index for '%s': %s\n",
+                      fname, gpg_strerror (err));
+        }
+      return;
+    }
+
+  image = blob? _keybox_get_blob_image (blob, &imagelen) : NULL;
+  if (mode == FILECOPY_DELETE || mode == FILECOPY_UPDATE)
+    _keybox_index_update_offsets (idx, blob_off,
+                                  (off_t)imagelen - old_bloblen);
+  err = 0;
+  if (image && (mode == FILECOPY_INSERT || mode == FILECOPY_UPDATE))
+    err = _keybox_index_add_blob (idx, image, imagelen, blob_off, NULL);
+  if (!err)
+    err = _keybox_index_store (idx, fname);
+  if (err)
+    log_info ("error updating index for '%s': %s\n",
+              fname, gpg_strerror (err));
+}
+
+
 /* Perform insert/delete/update operation.  MODE is one of
    FILECOPY_INSERT, FILECOPY_DELETE, FILECOPY_UPDATE.  FOR_OPENPGP
    indicates that this is called due to an OpenPGP keyblock change.  */
@@ -167,6 +214,10 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
   char *tmpfname = NULL;
   char buffer[4096];  /* (Must be at least 32 bytes) */
   int nread, nbytes;
+  keybox_index_t idx = NULL;
+  int idx_exists = 0;
+  off_t blob_off = start_offset;
+  off_t old_bloblen = 0;
 
   /* Open the source file. Because we do a rename, we have to check the
      permissions of the file */
@@ -174,6 +225,8 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
     return gpg_error_from_syserror ();
 
   fp = fopen (fname, "rb");
+  if (fp)
+    idx = _keybox_index_load (fname, &idx_exists);
   if (mode == FILECOPY_INSERT && !fp && errno == ENOENT)
     {
       /* Insert mode but file does not exist:
@@ -293,19 +346,22 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
         {
           fclose (fp);
           fclose (newfp);
-          return rc;
+          goto leave;
         }
+      old_bloblen = ftello (fp) - start_offset;
     }
 
   /* Do an insert or update. */
   if ( mode == FILECOPY_INSERT || mode == FILECOPY_UPDATE )
     {
+      if (mode == FILECOPY_INSERT)
+        blob_off = ftello (newfp);
       rc = _keybox_write_blob (blob, newfp);
       if (rc)
         {
           fclose (fp);
           fclose (newfp);
-          return rc;
+          goto leave;
         }
     }
 
@@ -345,14 +401,269 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
     }
 
   rc = rename_tmp_file (bakfname, tmpfname, fname, secret);
+  if (!rc)
+    update_index (fname, mode, idx, idx_exists, blob, blob_off, old_bloblen);
 
  leave:
+  _keybox_index_release (idx);
   xfree(bakfname);
   xfree(tmpfname);
   return rc;
 }
 
 
+/* Add DELTA to the number of deleted bytes recorded in the header
+ * blob of the keybox file open at FP.  */
+static gpg_error_t
+account_deleted_bytes (FILE *fp, off_t delta)
+{
+  unsigned char hdr[32];
+  uint64_t n;
+
+  if (fseeko (fp, 0, SEEK_SET))
+    return gpg_error_from_syserror ();
+  if (fread (hdr, sizeof hdr, 1, fp) != 1)
+    return 0;  /* No header blob; nothing to record.  */
+  if (hdr[4] != KEYBOX_BLOBTYPE_HEADER || buf32_to_size_t (hdr) < 32)
+    return 0;
+
+  n = buf32_to_u32 (hdr + 24);
+  if (delta < 0)
+    n = (uint64_t)-delta > n? 0 : n + delta;
+  else if ((n += delta) > 0xffffffff)
+    n = 0xffffffff;
+  ulongtobuf (hdr + 24, (u32)n);
+  if (fseeko (fp, 24, SEEK_SET) || fwrite (hdr + 24, 4, 1, fp) != 1)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Mark the blob at offset OFF of the keybox file FNAME as deleted by
+ * changing its type in place.  */
+static gpg_error_t
+mark_blob_deleted (const char *fname, off_t off)
+{
+  gpg_error_t err;
+  FILE *fp;
+  unsigned char lenbuf[4];
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  if (fseeko (fp, off, SEEK_SET) || fread (lenbuf, 4, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+  else if (fseeko (fp, off + 4, SEEK_SET))
+    err = gpg_error_from_syserror ();
+  else if (putc (0, fp) == EOF)
+    err = gpg_error_from_syserror ();
+  else
+    err = account_deleted_bytes (fp, (off_t)buf32_to_size_t (lenbuf));
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+
+  return err;
+}
+
+
+/* Append BLOB to the keybox file FNAME and store its offset at
+ * R_OFF.  FOR_OPENPGP tells whether BLOB is an OpenPGP blob.  */
+static gpg_error_t
+append_blob (const char *fname, KEYBOXBLOB blob, int for_openpgp,
+             off_t *r_off)
+{
+  gpg_error_t err = 0;
+  FILE *fp;
+  unsigned char buffer[8];
+  off_t off = 0;
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  /* Make sure that the openpgp flag is set in the header.  */
+  if (for_openpgp && fread (buffer, sizeof buffer, 1, fp) == 1
+      && buffer[4] == KEYBOX_BLOBTYPE_HEADER && !(buffer[7] & 0x02))
+    {
+      if (fseeko (fp, 7, SEEK_SET)
+          || putc (buffer[7] | 0x02, fp) == EOF)
+        err = gpg_error_from_syserror ();
+    }
+
+  if (!err && (fseeko (fp, 0, SEEK_END) || (off = ftello (fp)) == (off_t)-1))
+    err = gpg_error_from_syserror ();
+  if (!err)
+    {
+      err = _keybox_write_blob (blob, fp);
+      /* Do not leave a partial blob at the end of the file.  */
+      if (err && ftruncate (fileno (fp), off))
+        log_error ("error truncating '%s': %s\n", fname, strerror (errno));
+    }
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    *r_off = off;
+  return err;
+}
+
+
+/* Append BLOB to the keybox file of HD.  This is used instead of
+ * blob_filecopy during a bulk update.  FOR_OPENPGP tells whether BLOB
+ * is an OpenPGP blob.  */
+static gpg_error_t
+bulk_append (KEYBOX_HANDLE hd, KEYBOXBLOB blob, int for_openpgp)
+{
+  gpg_error_t err;
+  const unsigned char *image;
+  size_t imagelen;
+  off_t off;
+
+  err = append_blob (hd->kb->fname, blob, for_openpgp, &off);
+  if (err)
+    return err;
+
+  hd->kb->bulk.changed = 1;
+  if (hd->kb->bulk.idx)
+    {
+      image = _keybox_get_blob_image (blob, &imagelen);
+      if (_keybox_index_add_blob (hd->kb->bulk.idx, image, imagelen,
+                                  off, NULL))
+        {
+          /* Without a complete index we need to scan the file.  */
+          _keybox_index_release (hd->kb->bulk.idx);
+          hd->kb->bulk.idx = NULL;
+        }
+    }
+  return 0;
+}
+
+
+/* Replace the blob at offset OFF of the keybox file FNAME by BLOB
+ * without copying the file.  If BLOB is not larger than the old blob
+ * and does not waste more than half of its space, it is padded to the
+ * old length and written in place so that the order of the keyblocks
+ * is kept.  Otherwise BLOB is appended and the old blob is marked as
+ * deleted; this is done in that order so that a crash leaves a
+ * duplicate instead of a lost keyblock.  The next compress run
+ * removes the deleted blob.  */
+static gpg_error_t
+blob_replace (const char *fname, KEYBOXBLOB blob, off_t off)
+{
+  gpg_error_t err;
+  keybox_index_t idx;
+  int idx_exists;
+  FILE *fp;
+  unsigned char lenbuf[4];
+  size_t oldlen, newlen;
+  off_t newoff;
+
+  if (access (fname, W_OK))
+    return gpg_error_from_syserror ();
+
+  idx = _keybox_index_load (fname, &idx_exists);
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fseeko (fp, off, SEEK_SET) || fread (lenbuf, 4, 1, fp) != 1)
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      goto leave;
+    }
+  oldlen = buf32_to_size_t (lenbuf);
+  _keybox_get_blob_image (blob, &newlen);
+
+  if (newlen <= oldlen && oldlen - newlen <= oldlen / 2)
+    {
+      err = _keybox_pad_blob (blob, oldlen);
+      if (!err && fseeko (fp, off, SEEK_SET))
+        err = gpg_error_from_syserror ();
+      if (!err)
+        err = _keybox_write_blob (blob, fp);
+      if (fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+      newoff = off;
+    }
+  else
+    {
+      fclose (fp);
+      err = append_blob (fname, blob, 1, &newoff);
+      if (!err)
+        err = mark_blob_deleted (fname, off);
+    }
+
+  if (!err)
+    update_index (fname, FILECOPY_INSERT, idx, idx_exists, blob, newoff, 0);
+
+ leave:
+  _keybox_index_release (idx);
+  return err;
+}
+
+
+/* Start a bulk update of the keybox of HD.  Until keybox_bulk_end is
+ * called new and updated keyblocks are appended to the file instead
+ * of rewriting the entire file for each change, the keybox is kept
+ * locked, and searches use an in-memory index.  */
+gpg_error_t
+keybox_bulk_begin (KEYBOX_HANDLE hd)
+{
+  gpg_error_t err;
+  KB_NAME kb;
+
+  if (!hd || !hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  kb = hd->kb;
+  if (kb->bulk.active)
+    return 0;
+
+  err = keybox_lock (hd, 1, -1);
+  if (err)
+    return err;
+
+  _keybox_close_file (hd);
+  kb->bulk.active = 1;
+  kb->bulk.changed = 0;
+  kb->bulk.idx = _keybox_index_bulk_load (kb->fname);
+  return 0;
+}
+
+
+/* Finish a bulk update of the keybox of HD.  This compacts the file
+ * if it has been changed, rebuilds the index file, and releases the
+ * lock.  */
+gpg_error_t
+keybox_bulk_end (KEYBOX_HANDLE hd)
+{
+  gpg_error_t err = 0;
+  KB_NAME kb;
+
+  if (!hd || !hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  kb = hd->kb;
+  if (!kb->bulk.active)
+    return 0;
+
+  _keybox_close_file (hd);
+  _keybox_index_release (kb->bulk.idx);
+  kb->bulk.idx = NULL;
+  kb->bulk.active = 0;
+
+  if (kb->bulk.changed)
+    err = do_compress (hd, 1);
+  kb->bulk.changed = 0;
+
+  keybox_lock (hd, 0, 0);
+  return err;
+}
+
+
 /* Insert the OpenPGP keyblock {IMAGE,IMAGELEN} into HD. */
 gpg_error_t
 keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
@@ -377,7 +688,7 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
      the write operation.  */
   _keybox_close_file (hd);
 
-  err = _keybox_parse_openpgp (image, imagelen, &nparsed, &info);
+  err = _keybox_parse_openpgp_for_blob (image, imagelen, &nparsed, &info);
   if (err)
     return err;
   assert (nparsed <= imagelen);
@@ -386,7 +697,12 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   _keybox_destroy_openpgp_info (&info);
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      _keybox_bloom_begin_update (hd->kb);
+      if (hd->kb->bulk.active)
+        err = bulk_append (hd, blob, 1);
+      else
+        err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      _keybox_bloom_end_update (hd->kb, blob);
       _keybox_release_blob (blob);
       /*    if (!rc && !hd->secret && kb_offtbl) */
       /*      { */
@@ -428,7 +744,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   _keybox_close_file (hd);
 
   /* Build a new blob.  */
-  err = _keybox_parse_openpgp (image, imagelen, &nparsed, &info);
+  err = _keybox_parse_openpgp_for_blob (image, imagelen, &nparsed, &info);
   if (err)
     return err;
   assert (nparsed <= imagelen);
@@ -436,10 +752,25 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
                                      hd->ephemeral);
   _keybox_destroy_openpgp_info (&info);
 
-  /* Update the keyblock.  */
+  /* Update the keyblock.  In bulk mode the old blob is marked as
+   * deleted and the new one appended; the next compress run removes
+   * the old one.  Otherwise the blob is replaced without copying the
+   * entire file.  */
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_UPDATE, fname, blob, hd->secret, 1, off);
+      _keybox_bloom_begin_update (hd->kb);
+      if (hd->kb->bulk.active)
+        {
+          err = mark_blob_deleted (fname, off);
+          if (!err)
+            {
+              hd->kb->bulk.changed = 1;
+              err = bulk_append (hd, blob, 1);
+            }
+        }
+      else
+        err = blob_replace (fname, blob, off);
+      _keybox_bloom_end_update (hd->kb, blob);
       _keybox_release_blob (blob);
     }
   return err;
@@ -472,7 +803,12 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   rc = _keybox_create_x509_blob (&blob, cert, sha1_digest, hd->ephemeral);
   if (!rc)
     {
-      rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      _keybox_bloom_begin_update (hd->kb);
+      if (hd->kb->bulk.active)
+        rc = bulk_append (hd, blob, 0);
+      else
+        rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      _keybox_bloom_end_update (hd->kb, blob);
       _keybox_release_blob (blob);
       /*    if (!rc && !hd->secret && kb_offtbl) */
       /*      { */
@@ -508,6 +844,7 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   size_t flag_pos, flag_size;
   const unsigned char *buffer;
   size_t length;
+  int idx_fresh;
 
   (void)idx;  /* Not yet used.  */
 
@@ -535,9 +872,14 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   off += flag_pos;
 
   _keybox_close_file (hd);
+  idx_fresh = _keybox_index_is_fresh (fname);
+  _keybox_bloom_begin_update (hd->kb);
   fp = fopen (hd->kb->fname, "r+b");
   if (!fp)
-    return gpg_error_from_syserror ();
+    {
+      _keybox_bloom_end_update (hd->kb, NULL);
+      return gpg_error_from_syserror ();
+    }
 
   ec = 0;
   if (fseeko (fp, off, SEEK_SET))
@@ -570,6 +912,11 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
       if (!ec)
         ec = gpg_err_code_from_syserror ();
     }
+  _keybox_bloom_end_update (hd->kb, NULL);
+
+  /* The offsets did not change; thus the index is still valid.  */
+  if (!ec && idx_fresh)
+    _keybox_index_touch (fname);
 
   return gpg_error (ec);
 }
@@ -581,8 +928,8 @@ keybox_delete (KEYBOX_HANDLE hd)
 {
   off_t off;
   const char *fname;
-  FILE *fp;
   int rc;
+  int idx_fresh;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -597,34 +944,29 @@ keybox_delete (KEYBOX_HANDLE hd)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
-  off += 4;
 
   _keybox_close_file (hd);
-  fp = fopen (hd->kb->fname, "r+b");
-  if (!fp)
-    return gpg_error_from_syserror ();
-
-  if (fseeko (fp, off, SEEK_SET))
-    rc = gpg_error_from_syserror ();
-  else if (putc (0, fp) == EOF)
-    rc = gpg_error_from_syserror ();
-  else
-    rc = 0;
-
-  if (fclose (fp))
-    {
-      if (!rc)
-        rc = gpg_error_from_syserror ();
-    }
+  idx_fresh = _keybox_index_is_fresh (fname);
+  _keybox_bloom_begin_update (hd->kb);
+  rc = mark_blob_deleted (fname, off);
+  _keybox_bloom_end_update (hd->kb, NULL);
+  if (!rc && hd->kb->bulk.active)
+    hd->kb->bulk.changed = 1;
+
+  /* The entries of the deleted blob are kept in the index; the search
+   * function skips them because the blob is marked as empty.  */
+  if (!rc && idx_fresh)
+    _keybox_index_touch (fname);
 
   return rc;
 }
 
 
 /* Compress the keybox file.  This should be run with the file
-   locked. */
-int
-keybox_compress (KEYBOX_HANDLE hd)
+   locked.  Unless FORCE is set this is only done if the last run
+   was at least 3 hours ago.  */
+static int
+do_compress (KEYBOX_HANDLE hd, int force)
 {
   int read_rc, rc;
   const char *fname;
@@ -636,6 +978,13 @@ keybox_compress (KEYBOX_HANDLE hd)
   u32 cut_time;
   int any_changes = 0;
   int skipped_deleted;
+  keybox_index_t idx = NULL;
+  keybox_index_t newidx = NULL;
+  off_t *idxmap = NULL;
+  size_t idxmap_len = 0;
+  size_t idxmap_size = 0;
+  off_t newoff;
+  struct stat st;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -664,18 +1013,22 @@ keybox_compress (KEYBOX_HANDLE hd)
     }
 
   /* A quick test to see if we need to compress the file at all.  We
-     schedule a compress run after 3 hours. */
-  if ( !_keybox_read_blob (&blob, fp, NULL) )
+     schedule a compress run after 3 hours or earlier if a quarter of
+     the file consists of deleted blobs. */
+  if (!force && !_keybox_read_blob (&blob, fp, NULL))
     {
       const unsigned char *buffer;
       size_t length;
 
       buffer = _keybox_get_blob_image (blob, &length);
-      if (length > 4 && buffer[4] == KEYBOX_BLOBTYPE_HEADER)
+      if (length >= 32 && buffer[4] == KEYBOX_BLOBTYPE_HEADER)
         {
           u32 last_maint = buf32_to_u32 (buffer+20);
+          u32 deleted = buf32_to_u32 (buffer+24);
 
-          if ( (last_maint + 3*3600) > make_timestamp () )
+          if ( (last_maint + 3*3600) > make_timestamp ()
+               && (fstat (fileno (fp), &st)
+                   || (uint64_t)deleted * 4 < (uint64_t)st.st_size))
             {
               fclose (fp);
               _keybox_release_blob (blob);
@@ -695,6 +1048,13 @@ keybox_compress (KEYBOX_HANDLE hd)
       return rc;;
     }
 
+  /* If we have a valid index we only need to update the offsets.
+   * Otherwise we create a new index if desired.  */
+  idx = _keybox_index_load (fname, NULL);
+  if (!idx && !fstat (fileno (fp), &st)
+      && _keybox_index_wanted (fname, st.st_size))
+    newidx = _keybox_index_new ();
+
 
   /* Processing loop.  By reading using _keybox_read_blob we
      automagically skip any blobs flagged as deleted.  Thus what we
@@ -767,9 +1127,36 @@ keybox_compress (KEYBOX_HANDLE hd)
             }
         }
 
+      newoff = ftello (newfp);
       rc = _keybox_write_blob (blob, newfp);
       if (rc)
         break;
+
+      if (idx)
+        {
+          if (idxmap_len >= idxmap_size)
+            {
+              off_t *tmp;
+
+              idxmap_size = idxmap_size? idxmap_size * 2 : 1024;
+              tmp = xtryrealloc (idxmap, 2 * idxmap_size * sizeof *tmp);
+              if (!tmp)
+                {
+                  rc = gpg_error_from_syserror ();
+                  break;
+                }
+              idxmap = tmp;
+            }
+          idxmap[2*idxmap_len] = _keybox_get_blob_fileoffset (blob);
+          idxmap[2*idxmap_len+1] = newoff;
+          idxmap_len++;
+        }
+      else if (newidx)
+        {
+          rc = _keybox_index_add_blob (newidx, buffer, length, newoff, NULL);
+          if (rc)
+            break;
+        }
     }
   if (skipped_deleted)
     any_changes = 1;
@@ -785,13 +1172,260 @@ keybox_compress (KEYBOX_HANDLE hd)
   if (fclose(newfp) && !rc)
     rc = gpg_error_from_syserror ();
 
-  /* Rename or remove the temporary file. */
+  /* Rename or remove the temporary file.  The compress run only
+   * removes blobs and thus the filter is still valid.  */
   if (rc || !any_changes)
     gnupg_remove (tmpfname);
   else
-    rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+    {
+      _keybox_bloom_begin_update (hd->kb);
+      rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+      _keybox_bloom_end_update (hd->kb, NULL);
+    }
+
+  /* Update the index.  If nothing changed an existing index is still
+   * valid.  */
+  if (!rc && ((idx && any_changes) || newidx))
+    {
+      gpg_error_t err;
+
+      if (idx)
+        _keybox_index_remap (idx, idxmap, idxmap_len);
+      err = _keybox_index_store (idx? idx : newidx, fname);
+      if (err)
+        log_info ("error updating index for '%s': %s\n",
+                  fname, gpg_strerror (err));
+    }
 
+  _keybox_index_release (idx);
+  _keybox_index_release (newidx);
+  xfree (idxmap);
   xfree(bakfname);
   xfree(tmpfname);
   return rc;
 }
+
+
+int
+keybox_compress (KEYBOX_HANDLE hd)
+{
+  return do_compress (hd, 0);
+}
+
+
+/* Return true if the blob {BUFFER,LENGTH} is an ephemeral blob which
+ * is older than CUT_TIME.  */
+static int
+is_expired_ephemeral (const unsigned char *buffer, size_t length,
+                      u32 cut_time)
+{
+  size_t pos, size;
+  u32 created_at;
+
+  if (_keybox_get_flag_location (buffer, length,
+                                 KEYBOX_FLAG_BLOB, &pos, &size)
+      || size != 2
+      || !(buf16_to_uint (buffer+pos) & KEYBOX_FLAG_BLOB_EPHEMERAL))
+    return 0;
+  if (_keybox_get_flag_location (buffer, length,
+                                 KEYBOX_FLAG_CREATED_AT, &pos, &size)
+      || size != 4)
+    return 0;
+  created_at = buf32_to_u32 (buffer+pos);
+  return created_at && created_at < cut_time;
+}
+
+
+/* Do one step of an incremental compaction of the keybox file of HD.
+ * Unlike keybox_compress this does not copy the file but shrinks it
+ * from the tail: Deleted blobs at the end of the file are cut off,
+ * expired ephemeral blobs at the end are removed, and otherwise the
+ * last blob is moved into the first run of deleted blobs large
+ * enough to hold it.  Each step reads the blob headers and writes at
+ * most one blob, so that the caller can interleave the steps with
+ * other work.  On success R_MORE is set to true if another step may
+ * reclaim more space.  This should be run with the file locked.  */
+gpg_error_t
+keybox_compact_step (KEYBOX_HANDLE hd, int *r_more)
+{
+  gpg_error_t err;
+  const char *fname;
+  FILE *fp = NULL;
+  keybox_index_t idx = NULL;
+  int idx_exists;
+  KEYBOXBLOB blob = NULL;
+  const unsigned char *buffer;
+  unsigned char hdr[5];
+  struct stat st;
+  off_t off, end_live, last_off, run_off, newoff;
+  size_t len, last_len, run_len, restlen;
+  int moved = 0;
+
+  *r_more = 0;
+  if (!hd || !hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  if (hd->secret)
+    return gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+  fname = hd->kb->fname;
+  if (!fname)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  if (hd->kb->bulk.active)
+    {
+      *r_more = 1;  /* Try again after the bulk update.  */
+      return 0;
+    }
+
+  /* We are going to truncate the file and thus must not keep any
+   * mapping of it.  */
+  _keybox_close_file (hd);
+
+  if (access (fname, W_OK))
+    return gpg_error_from_syserror ();
+  idx = _keybox_index_load (fname, &idx_exists);
+  _keybox_bloom_begin_update (hd->kb);
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fstat (fileno (fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Find the last blob which is not deleted.  */
+  end_live = last_off = 0;
+  last_len = 0;
+  for (off = 0; off < st.st_size; off += len)
+    {
+      if (fseeko (fp, off, SEEK_SET) || fread (hdr, 5, 1, fp) != 1)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      len = buf32_to_size_t (hdr);
+      if (len < 5 || (off_t)len > st.st_size - off)
+        {
+          err = gpg_error (GPG_ERR_INV_KEYRING);
+          goto leave;
+        }
+      if (hdr[4] != KEYBOX_BLOBTYPE_EMPTY)
+        {
+          last_off = off;
+          last_len = len;
+          end_live = off + len;
+        }
+    }
+
+  if (end_live < st.st_size)
+    {
+      /* Cut off the deleted blobs at the end.  */
+      if (ftruncate (fileno (fp), end_live))
+        err = gpg_error_from_syserror ();
+      else
+        err = account_deleted_bytes (fp, end_live - st.st_size);
+      *r_more = !err;
+      goto leave;
+    }
+  if (!last_off)
+    {
+      err = 0;  /* Only the header blob is left.  */
+      goto leave;
+    }
+
+  if (fseeko (fp, last_off, SEEK_SET))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = _keybox_read_blob (&blob, fp, NULL);
+  if (err)
+    goto leave;
+  buffer = _keybox_get_blob_image (blob, &len);
+  if (buffer[4] == KEYBOX_BLOBTYPE_HEADER)
+    goto leave;  /* Never move a header blob.  */
+  if (is_expired_ephemeral (buffer, len, make_timestamp () - 86400))
+    {
+      if (ftruncate (fileno (fp), last_off))
+        err = gpg_error_from_syserror ();
+      *r_more = !err;
+      goto leave;
+    }
+
+  /* Find the first run of deleted blobs before the last blob which is
+   * large enough to take it.  */
+  run_off = 0;
+  run_len = 0;
+  for (off = 0; off < last_off && run_len < last_len; off += len)
+    {
+      if (fseeko (fp, off, SEEK_SET) || fread (hdr, 5, 1, fp) != 1)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      len = buf32_to_size_t (hdr);
+      if (hdr[4] != KEYBOX_BLOBTYPE_EMPTY)
+        run_len = 0;
+      else
+        {
+          if (!run_len)
+            run_off = off;
+          run_len += len;
+        }
+    }
+  if (run_len < last_len)
+    goto leave;  /* No space for the last blob; we are done.  */
+
+  /* Copy the last blob into the run.  A remainder too short to be
+   * useful as a later target is added to the blob as padding;
+   * otherwise it is turned into a single deleted blob.  The last blob
+   * is cut off only after it has been written to its new place so
+   * that a crash leaves a duplicate and not a lost keyblock.  */
+  restlen = run_len - last_len;
+  if (restlen && restlen < 32)
+    {
+      err = _keybox_pad_blob (blob, run_len);
+      if (err)
+        goto leave;
+      restlen = 0;
+    }
+  newoff = run_off;
+  if (fseeko (fp, newoff, SEEK_SET))
+    err = gpg_error_from_syserror ();
+  else
+    err = _keybox_write_blob (blob, fp);
+  if (!err && restlen)
+    {
+      unsigned char stub[5];
+
+      ulongtobuf (stub, restlen);
+      stub[4] = KEYBOX_BLOBTYPE_EMPTY;
+      if (fwrite (stub, 5, 1, fp) != 1)
+        err = gpg_error_from_syserror ();
+    }
+  if (!err && fflush (fp))
+    err = gpg_error_from_syserror ();
+  if (err)
+    goto leave;
+  moved = 1;
+  if (ftruncate (fileno (fp), last_off))
+    err = gpg_error_from_syserror ();
+  else
+    err = account_deleted_bytes (fp, -(off_t)(run_len - restlen));
+  *r_more = !err;
+
+ leave:
+  if (fp && fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (!err && (moved || *r_more))
+    update_index (fname, FILECOPY_INSERT, idx, idx_exists,
+                  moved? blob : NULL, moved? newoff : 0, 0);
+  /* The keys of a moved blob are already in the filter.  */
+  _keybox_bloom_end_update (hd->kb, NULL);
+  _keybox_index_release (idx);
+  _keybox_release_blob (blob);
+  return err;
+}
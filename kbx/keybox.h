@@ -53,6 +53,9 @@ typedef enum
 #define KEYBOX_FLAG_BLOB_SECRET     1
 #define KEYBOX_FLAG_BLOB_EPHEMERAL  2
 
+/* Flag values of the key information in a blob.  */
+#define KEYBOX_KEYFLAG_GRIP         2  /* The keygrip is valid.  */
+
 /* The keybox blob types.  */
 typedef enum
   {
@@ -121,6 +124,9 @@ int keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value);
 
 int keybox_delete (KEYBOX_HANDLE hd);
 int keybox_compress (KEYBOX_HANDLE hd);
+gpg_error_t keybox_compact_step (KEYBOX_HANDLE hd, int *r_more);
+gpg_error_t keybox_bulk_begin (KEYBOX_HANDLE hd);
+gpg_error_t keybox_bulk_end (KEYBOX_HANDLE hd);
 
 
 /*--  --*/
@@ -90,6 +90,9 @@ enum cmd_and_opt_values
     oFakedSystemTime,
     oListenBacklog,
     oDisableCheckOwnSocket,
+    oCacheSize,
+    oSystemKeybox,
+    oCachePreload,
 
     oDummy
   };
@@ -121,6 +124,13 @@ static gpgrt_opt_t opts[] = {
 
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
 
+  ARGPARSE_s_u (oCacheSize, "cache-size",
+                N_("|N|use up to N MiB of memory for the cache")),
+  ARGPARSE_s_s (oSystemKeybox, "system-keybox",
+                N_("|FILE|also search the read-only keybox FILE")),
+  ARGPARSE_s_n (oCachePreload, "cache-preload",
+                N_("keep the cache contents across restarts")),
+
   ARGPARSE_end () /* End of list */
 };
 
@@ -169,6 +179,9 @@ static int startup_signal_mask_valid;
 /* Flag to indicate that a shutdown was requested.  */
 static int shutdown_pending;
 
+/* Flag indicating that a cache preload thread is running.  */
+static int cache_preload_running;
+
 /* Counter for the currently running own socket checks.  */
 static int check_own_socket_running;
 
@@ -379,6 +392,7 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.verbose = 0;
       opt.debug = 0;
       disable_check_own_socket = 0;
+      opt.cache_size = 0;
       return 1;
     }
 
@@ -406,6 +420,10 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
 
     case oDisableCheckOwnSocket: disable_check_own_socket = 1; break;
 
+    case oCacheSize:
+      opt.cache_size = (size_t)pargs->r.ret_ulong * 1024 * 1024;
+      break;
+
     default:
       return 0; /* not handled */
     }
@@ -463,6 +481,7 @@ main (int argc, char **argv )
   int is_daemon = 0;
   int nodetach = 0;
   char *logfile = NULL;
+  char *system_keybox = NULL;
   int gpgconf_list = 0;
   int debug_wait = 0;
   struct assuan_malloc_hooks malloc_hooks;
@@ -573,6 +592,8 @@ main (int argc, char **argv )
         case oLogFile: logfile = pargs.r.ret_str; break;
         case oServer: pipe_server = 1; break;
         case oDaemon: is_daemon = 1; break;
+        case oSystemKeybox: system_keybox = pargs.r.ret_str; break;
+        case oCachePreload: opt.cache_preload = 1; break;
         case oFakedSystemTime:
           {
             time_t faked_time = isotime2epoch (pargs.r.ret_str);
@@ -701,6 +722,8 @@ main (int argc, char **argv )
 
       /* kbxd_set_database (ctrl, "pubring.kbx", 0); */
       kbxd_set_database (ctrl, "pubring.db", 0);
+      if (system_keybox)
+        kbxd_set_system_database (ctrl, system_keybox);
 
       kbxd_start_command_handler (ctrl, GNUPG_INVALID_FD, 0);
       kbxd_deinit_default_ctrl (ctrl);
@@ -836,13 +859,19 @@ main (int argc, char **argv )
         kbxd_init_default_ctrl (ctrl);
         /* kbxd_set_database (ctrl, "pubring.kbx", 0); */
         kbxd_set_database (ctrl, "pubring.db", 0);
+        if (system_keybox)
+          kbxd_set_system_database (ctrl, system_keybox);
         kbxd_deinit_default_ctrl (ctrl);
         xfree (ctrl);
       }
 
       log_info ("%s %s started\n", gpgrt_strusage(11), gpgrt_strusage(13));
+      if (opt.cache_preload)
+        kbxd_start_cache_preload ();
       handle_connections (fd);
       assuan_sock_close (fd);
+      if (opt.cache_preload)
+        kbxd_save_cache_hotset ();
     }
 
   return 0;
@@ -1278,6 +1307,10 @@ handle_tick (void)
       shutdown_pending = 1;
       log_info ("homedir has been removed - shutting down\n");
     }
+
+  /* Reclaim space in the database while we are idle.  */
+  if (!shutdown_pending && !active_connections)
+    kbxd_compact_database ();
 }
 
 
@@ -1293,6 +1326,62 @@ kbxd_sighup_action (void)
 }
 
 
+/* The thread loading the cache from the hot set file.  */
+static void *
+cache_preload_thread (void *arg)
+{
+  ctrl_t ctrl;
+  unsigned int count;
+
+  (void)arg;
+
+  ctrl = xtrycalloc (1, sizeof *ctrl);
+  if (!ctrl)
+    {
+      log_error ("error allocating connection control data: %s\n",
+                 strerror (errno) );
+      goto leave;
+    }
+  kbxd_init_default_ctrl (ctrl);
+  kbxd_preload_cache (ctrl, &count);
+  kbxd_deinit_default_ctrl (ctrl);
+  xfree (ctrl);
+
+ leave:
+  cache_preload_running = 0;
+  return NULL;
+}
+
+
+/* Start a thread to load the blobs listed in the hot set file into
+ * the cache.  This is done at startup with --cache-preload and by
+ * the PRELOAD command.  */
+gpg_error_t
+kbxd_start_cache_preload (void)
+{
+  npth_t thread;
+  npth_attr_t tattr;
+  int res;
+
+  if (cache_preload_running)
+    return gpg_error (GPG_ERR_EALREADY);
+
+  res = npth_attr_init (&tattr);
+  if (res)
+    return gpg_error_from_errno (res);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  cache_preload_running = 1;
+  res = npth_create (&thread, &tattr, cache_preload_thread, NULL);
+  if (res)
+    {
+      cache_preload_running = 0;
+      log_error ("error spawning cache_preload_thread: %s\n", strerror (res));
+    }
+  npth_attr_destroy (&tattr);
+  return res? gpg_error_from_errno (res) : 0;
+}
+
+
 /* A helper function to handle SIGUSR2.  */
 static void
 kbxd_sigusr2_action (void)
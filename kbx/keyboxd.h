@@ -45,6 +45,12 @@ struct
   /* True if we are running detached from the tty. */
   int running_detached;
 
+  /* The memory budget of the cache in bytes or 0 for the default.  */
+  size_t cache_size;
+
+  /* Save the hot set of the cache at shutdown and load it at startup.  */
+  int cache_preload;
+
 } opt;
 
 
@@ -111,8 +117,19 @@ struct server_control_s
   db_request_t opgp_req;
   db_request_t x509_req;
 
+  /* State of a batch search as run by kbxd_search_batch.  */
+  struct {
+    unsigned int descidx;   /* Index of the descriptor being searched.  */
+    unsigned char *ubids;   /* The UBIDs of the blobs already returned.  */
+    unsigned int nubids;    /* Number of UBIDs in UBIDS.  */
+    unsigned int ubidsize;  /* Allocated number of UBIDs in UBIDS.  */
+  } batch;
+
   /* Flags for the current request.  */
   unsigned int no_data_return : 1;  /* Used by SEARCH and NEXT.  */
+  unsigned int batch_mode : 1;      /* Used by SEARCH --batch.  */
+  unsigned int have_db_lock : 1;    /* Used by frontend.c.  */
+  unsigned int in_write_batch : 1;  /* Used by TRANSACTION.  */
 };
 
 
@@ -155,6 +172,7 @@ void kbxd_set_progress_cb (void (*cb)(ctrl_t ctrl, const char *what,
 const char *get_kbxd_socket_name (void);
 int get_kbxd_active_connection_count (void);
 void kbxd_sighup_action (void);
+gpg_error_t kbxd_start_cache_preload (void);
 
 
 /*-- kbxserver.c --*/
@@ -48,9 +48,11 @@
 #endif /*GNUPG_MAJOR_VERSION*/
 
 #include "../common/host2net.h"
+#include "../common/metrics.h"
 
 #include "iso7816.h"
 #include "apdu.h"
+#include "atr.h"
 #define CCID_DRIVER_INCLUDE_USB_IDS 1
 #include "ccid-driver.h"
 
@@ -87,6 +89,9 @@ static struct pcsc_global_data {
   HANDLE context;
   int count;
   const char *rdrname[MAX_READER];
+  int monitor_running;      /* The monitor thread is running.  */
+  HANDLE monitor_context;   /* The PC/SC context used by the monitor.  */
+  unsigned int monitor_gen; /* Bumped when the set of readers changes.  */
 } pcsc;
 
 /* A structure to collect information pertaining to one reader
@@ -109,6 +114,8 @@ struct reader_table_s {
   int (*set_prompt_cb)(int, void (*) (void *, int), void*);
   int (*pinpad_verify)(int, int, int, int, int, pininfo_t *);
   int (*pinpad_modify)(int, int, int, int, int, pininfo_t *);
+  int (*begin_transaction)(int);
+  int (*end_transaction)(int);
 
   struct {
     ccid_driver_t handle;
@@ -121,6 +128,7 @@ struct reader_table_s {
     int pinmin;
     int pinmax;
     pcsc_dword_t current_state;
+    int in_transaction;  /* An explicit transaction is active.  */
   } pcsc;
 #ifdef USE_G10CODE_RAPDU
   struct {
@@ -134,6 +142,8 @@ struct reader_table_s {
                                               supports variable length pinpad
                                               input.  */
   unsigned int require_get_status:1;
+  unsigned int no_extlen:1; /* Extended length APDUs failed.  */
+  struct apdu_stats_s stats; /* Statistics about the APDU traffic.  */
   unsigned char atr[33];
   size_t atrlen;           /* A zero length indicates that the ATR has
                               not yet been read; i.e. the card is not
@@ -198,6 +208,12 @@ static npth_mutex_t reader_table_lock;
 #define PCSC_STATE_CHANGED     0x0002  /* State has changed.  */
 #define PCSC_STATE_UNKNOWN     0x0004  /* Reader unknown.  */
 #define PCSC_STATE_UNAVAILABLE 0x0008  /* Status unavailable.  */
+
+#define PCSC_INFINITE          0xffffffff
+
+/* The timeout used by the monitor thread if the set of readers can't
+   be changed by cancelling the wait.  */
+#define PCSC_MONITOR_TIMEOUT   2000
 #define PCSC_STATE_EMPTY       0x0010  /* Card removed.  */
 #define PCSC_STATE_PRESENT     0x0020  /* Card inserted.  */
 #define PCSC_STATE_ATRMATCH    0x0040  /* ATR matches card. */
@@ -346,6 +362,7 @@ long (* DLSTDCALL pcsc_control) (HANDLE card,
                                  void *recv_buffer,
                                  pcsc_dword_t recv_len,
                                  pcsc_dword_t *bytes_returned);
+long (* DLSTDCALL pcsc_cancel) (HANDLE context);
 
 
 /*  Prototypes.  */
@@ -366,13 +383,39 @@ static int pcsc_pinpad_modify (int slot, int class, int ins, int p0, int p1,
       Helper
  */
 
+METRIC_DEFINE_HISTOGRAM (m_apdu_usec, "apdu_usec");
+
+/* Return a timestamp in microseconds for the statistics.  */
+static unsigned long long
+stats_time (void)
+{
+#ifdef USE_NPTH
+  struct timespec ts;
+
+  npth_clock_gettime (&ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  return (unsigned long long)time (NULL) * 1000000;
+#endif
+}
+
+
 static int
 lock_slot (int slot)
 {
 #ifdef USE_NPTH
   int err;
+  unsigned long long started;
 
-  err = npth_mutex_lock (&reader_table[slot].lock);
+  err = npth_mutex_trylock (&reader_table[slot].lock);
+  if (err == EBUSY)
+    {
+      /* Only measure the time if we need to wait.  */
+      started = stats_time ();
+      err = npth_mutex_lock (&reader_table[slot].lock);
+      if (!err)
+        reader_table[slot].stats.lock_time += stats_time () - started;
+    }
   if (err)
     {
       log_error ("failed to acquire apdu lock: %s\n", strerror (err));
@@ -453,11 +496,15 @@ new_reader_slot (void)
   reader_table[reader].set_prompt_cb = NULL;
   reader_table[reader].pinpad_verify = pcsc_pinpad_verify;
   reader_table[reader].pinpad_modify = pcsc_pinpad_modify;
+  reader_table[reader].begin_transaction = NULL;
+  reader_table[reader].end_transaction = NULL;
 
   reader_table[reader].is_t0 = 1;
   reader_table[reader].is_spr532 = 0;
   reader_table[reader].pinpad_varlen_supported = 0;
   reader_table[reader].require_get_status = 1;
+  reader_table[reader].no_extlen = 0;
+  memset (&reader_table[reader].stats, 0, sizeof reader_table[reader].stats);
   reader_table[reader].pcsc.verify_ioctl = 0;
   reader_table[reader].pcsc.modify_ioctl = 0;
   reader_table[reader].pcsc.pinmin = -1;
@@ -763,6 +810,7 @@ pcsc_send_apdu (int slot, unsigned char *apdu, size_t apdulen,
       || err == PCSC_W_REMOVED_CARD)
     {
       reader_table[slot].pcsc.current_state = PCSC_STATE_UNAWARE;
+      reader_table[slot].pcsc.in_transaction = 0;
       scd_kick_the_loop ();
     }
 
@@ -770,6 +818,54 @@ pcsc_send_apdu (int slot, unsigned char *apdu, size_t apdulen,
 }
 
 
+/* Start an explicit PC/SC transaction on SLOT.  Without it each
+   SCardTransmit acquires and releases the card on its own, which
+   requires a round trip to the PC/SC service.  */
+static int
+pcsc_begin_transaction_reader (int slot)
+{
+  long err;
+
+  if (!reader_table[slot].pcsc.card || reader_table[slot].pcsc.in_transaction)
+    return 0;
+
+  err = pcsc_begin_transaction (reader_table[slot].pcsc.card);
+  if (err)
+    {
+      if (DBG_CARD_IO)
+        log_debug ("pcsc_begin_transaction failed: %s (0x%lx)\n",
+                   pcsc_error_string (err), err);
+      return pcsc_error_to_sw (err);
+    }
+  reader_table[slot].pcsc.in_transaction = 1;
+  return 0;
+}
+
+
+/* End the transaction started by pcsc_begin_transaction_reader.  */
+static int
+pcsc_end_transaction_reader (int slot)
+{
+  long err;
+
+  if (!reader_table[slot].pcsc.in_transaction)
+    return 0;
+  reader_table[slot].pcsc.in_transaction = 0;
+  if (!reader_table[slot].pcsc.card)
+    return 0;
+
+  err = pcsc_end_transaction (reader_table[slot].pcsc.card, PCSC_LEAVE_CARD);
+  if (err)
+    {
+      if (DBG_CARD_IO)
+        log_debug ("pcsc_end_transaction failed: %s (0x%lx)\n",
+                   pcsc_error_string (err), err);
+      return pcsc_error_to_sw (err);
+    }
+  return 0;
+}
+
+
 /* Do some control with the value of IOCTL_CODE to the card inserted
    to SLOT.  Input buffer is specified by CNTLBUF of length LEN.
    Output buffer is specified by BUFFER of length *BUFLEN, and the
@@ -795,10 +891,168 @@ control_pcsc (int slot, pcsc_dword_t ioctl_code,
 }
 
 
+#ifdef USE_NPTH
+/* The monitor thread waits for status changes of all PC/SC readers in
+   use and kicks the main loop of scdaemon if one happens.  This way
+   there is no need to poll the readers periodically.  The thread
+   uses a context of its own because a PC/SC context may not be used
+   by two threads at the same time.  It terminates when the last
+   PC/SC reader has been closed.  */
+static void *
+pcsc_monitor_thread (void *arg)
+{
+  struct pcsc_readerstate_s rdrstates[MAX_READER];
+  struct pcsc_readerstate_s oldstates[MAX_READER];
+  char *names[MAX_READER];
+  pcsc_dword_t timeout;
+  unsigned int gen;
+  int i, j, n, nold, changed;
+  long err;
+
+  (void)arg;
+
+  timeout = pcsc_cancel? PCSC_INFINITE : PCSC_MONITOR_TIMEOUT;
+  memset (names, 0, sizeof names);
+  nold = 0;
+  for (;;)
+    {
+      /* Build the list of readers to watch.  We keep the state of
+         readers we already know so that a change occurring while we
+         were not waiting is noticed.  */
+      gen = pcsc.monitor_gen;
+      memset (rdrstates, 0, sizeof rdrstates);
+      for (i=n=0; i < MAX_READER; i++)
+        if (reader_table[i].used && reader_table[i].rdrname
+            && reader_table[i].get_status_reader == pcsc_get_status)
+          {
+            rdrstates[n].reader = xtrystrdup (reader_table[i].rdrname);
+            if (!rdrstates[n].reader)
+              continue;
+            rdrstates[n].current_state = PCSC_STATE_UNAWARE;
+            for (j=0; j < nold; j++)
+              if (!strcmp (oldstates[j].reader, rdrstates[n].reader))
+                rdrstates[n].current_state = oldstates[j].current_state;
+            n++;
+          }
+      for (j=0; j < nold; j++)
+        xfree (names[j]);
+      for (j=0; j < n; j++)
+        names[j] = (char *)rdrstates[j].reader;
+      nold = 0;
+      if (!n)
+        break;
+
+      while (gen == pcsc.monitor_gen)
+        {
+          npth_unprotect ();
+          err = pcsc_get_status_change (pcsc.monitor_context, timeout,
+                                        rdrstates, n);
+          npth_protect ();
+          if (err == PCSC_E_TIMEOUT || err == PCSC_E_CANCELLED)
+            continue;
+          if (err)
+            {
+              /* Let the main loop find out what happened and try
+                 again later.  */
+              if (DBG_CARD_IO)
+                log_debug ("pcsc monitor: pcsc_get_status_change failed:"
+                           " %s (0x%lx)\n", pcsc_error_string (err), err);
+              scd_kick_the_loop ();
+              npth_sleep (1);
+              for (j=0; j < n; j++)
+                rdrstates[j].current_state = PCSC_STATE_UNAWARE;
+              break;
+            }
+
+          changed = 0;
+          for (j=0; j < n; j++)
+            if ((rdrstates[j].event_state & PCSC_STATE_CHANGED))
+              {
+                if (rdrstates[j].current_state != PCSC_STATE_UNAWARE)
+                  changed = 1;
+                rdrstates[j].current_state =
+                  (rdrstates[j].event_state & ~PCSC_STATE_CHANGED);
+              }
+          if (changed)
+            {
+              if (DBG_CARD_IO)
+                log_debug ("pcsc monitor: reader status changed\n");
+              scd_kick_the_loop ();
+            }
+        }
+
+      memcpy (oldstates, rdrstates, sizeof oldstates);
+      nold = n;
+    }
+
+  pcsc_release_context (pcsc.monitor_context);
+  pcsc.monitor_context = 0;
+  pcsc.monitor_running = 0;
+  return NULL;
+}
+#endif /*USE_NPTH*/
+
+
+/* Tell the monitor thread that the set of PC/SC readers has changed.
+   If START is set, the monitor is started if it is not yet running.
+   Returns true if the monitor is running.  */
+static int
+pcsc_monitor_update (int start)
+{
+#ifdef USE_NPTH
+  npth_attr_t tattr;
+  npth_t thread;
+  long err;
+
+  pcsc.monitor_gen++;
+  if (pcsc.monitor_running)
+    {
+      if (pcsc_cancel)
+        pcsc_cancel (pcsc.monitor_context);
+      return 1;
+    }
+
+  if (!start)
+    return 0;
+
+  err = pcsc_establish_context (PCSC_SCOPE_SYSTEM, NULL, NULL,
+                                &pcsc.monitor_context);
+  if (err)
+    {
+      log_error ("pcsc_establish_context failed: %s (0x%lx)\n",
+                 pcsc_error_string (err), err);
+      return 0;
+    }
+
+  err = npth_attr_init (&tattr);
+  if (!err)
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+      err = npth_create (&thread, &tattr, pcsc_monitor_thread, NULL);
+      npth_attr_destroy (&tattr);
+    }
+  if (err)
+    {
+      log_error ("error spawning pcsc monitor thread: %s\n", strerror (err));
+      pcsc_release_context (pcsc.monitor_context);
+      pcsc.monitor_context = 0;
+      return 0;
+    }
+  npth_setname_np (thread, "pcsc-monitor");
+  pcsc.monitor_running = 1;
+  return 1;
+#else
+  (void)start;
+  return 0;
+#endif
+}
+
+
 static int
 close_pcsc_reader (int slot)
 {
   (void)slot;
+  pcsc_monitor_update (0);
   if (--pcsc.count == 0)
     {
       int i;
@@ -880,6 +1134,8 @@ disconnect_pcsc_card (int slot)
   if (!reader_table[slot].pcsc.card)
     return 0;
 
+  /* Disconnecting also ends an active transaction.  */
+  reader_table[slot].pcsc.in_transaction = 0;
   err = pcsc_disconnect (reader_table[slot].pcsc.card, PCSC_LEAVE_CARD);
   if (err)
     {
@@ -1113,6 +1369,7 @@ pcsc_init (void)
       pcsc_transmit          = dlsym (handle, "SCardTransmit");
       pcsc_set_timeout       = dlsym (handle, "SCardSetTimeout");
       pcsc_control           = dlsym (handle, "SCardControl");
+      pcsc_cancel            = dlsym (handle, "SCardCancel");
 
       if (!pcsc_establish_context
           || !pcsc_release_context
@@ -1185,6 +1442,7 @@ open_pcsc_reader (const char *rdrname)
     }
 
   reader_table[slot].pcsc.card = 0;
+  reader_table[slot].pcsc.in_transaction = 0;
   reader_table[slot].atrlen = 0;
 
   reader_table[slot].connect_card = connect_pcsc_card;
@@ -1194,8 +1452,14 @@ open_pcsc_reader (const char *rdrname)
   reader_table[slot].get_status_reader = pcsc_get_status;
   reader_table[slot].send_apdu_reader = pcsc_send_apdu;
   reader_table[slot].dump_status_reader = dump_pcsc_reader_status;
+  reader_table[slot].begin_transaction = pcsc_begin_transaction_reader;
+  reader_table[slot].end_transaction = pcsc_end_transaction_reader;
 
   pcsc.count++;
+  /* With the monitor thread status changes kick the main loop and
+     thus a periodical check is not required.  */
+  if (pcsc_monitor_update (1))
+    reader_table[slot].require_get_status = 0;
   dump_reader_status (slot);
   unlock_slot (slot);
   return slot;
@@ -1945,7 +2209,7 @@ apdu_dev_list_start (const char *portstr, struct dev_list **l_p)
 
       if (dl->idx_max == 0)
         {
-          if (DBG_READER)
+          if (DBG_CARD_IO)
             log_debug ("leave: apdu_open_reader => slot=-1 (no ccid)\n");
 
           xfree (dl);
@@ -2094,7 +2358,7 @@ apdu_open_reader (struct dev_list *dl)
         {
           unsigned int bai = ccid_get_BAI (dl->idx, dl->table);
 
-          if (DBG_READER)
+          if (DBG_CARD_IO)
             log_debug ("apdu_open_reader: BAI=%x\n", bai);
 
           /* Check identity by BAI against already opened HANDLEs.  */
@@ -2106,7 +2370,7 @@ apdu_open_reader (struct dev_list *dl)
 
           if (slot == MAX_READER)
             { /* Found a new device.  */
-              if (DBG_READER)
+              if (DBG_CARD_IO)
                 log_debug ("apdu_open_reader: new device=%x\n", bai);
 
               slot = open_ccid_reader (dl);
@@ -2143,7 +2407,7 @@ apdu_open_reader (struct dev_list *dl)
         {
           const char *rdrname = pcsc.rdrname[dl->idx];
 
-          if (DBG_READER)
+          if (DBG_CARD_IO)
             log_debug ("apdu_open_reader: %s\n", rdrname);
 
           /* Check the identity of reader against already opened one.  */
@@ -2154,7 +2418,7 @@ apdu_open_reader (struct dev_list *dl)
 
           if (slot == MAX_READER)
             { /* Found a new device.  */
-              if (DBG_READER)
+              if (DBG_CARD_IO)
                 log_debug ("apdu_open_reader: new device=%s\n", rdrname);
 
               /* When reader string is specified, check if it is the one.  */
@@ -2240,7 +2504,7 @@ apdu_close_reader (int slot)
 
   if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
     {
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_close_reader => SW_HOST_NO_DRIVER\n");
       return SW_HOST_NO_DRIVER;
     }
@@ -2251,14 +2515,14 @@ apdu_close_reader (int slot)
        * When the reader/token was removed it might come here.
        * It should go through to call CLOSE_READER even if we got an error.
        */
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("apdu_close_reader => 0x%x (apdu_disconnect)\n", sw);
     }
   if (reader_table[slot].close_reader)
     {
       sw = reader_table[slot].close_reader (slot);
       reader_table[slot].used = 0;
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_close_reader => 0x%x (close_reader)\n", sw);
       return sw;
     }
@@ -2332,7 +2596,7 @@ apdu_connect (int slot)
 
   if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
     {
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_connect => SW_HOST_NO_DRIVER\n");
       return -1;
     }
@@ -2391,7 +2655,7 @@ apdu_disconnect (int slot)
 
   if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
     {
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_disconnect => SW_HOST_NO_DRIVER\n");
       return SW_HOST_NO_DRIVER;
     }
@@ -2462,6 +2726,58 @@ apdu_set_prompt_cb (int slot, void (*cb) (void *, int), void *cb_arg)
 }
 
 
+/* Start a transaction with the card in reader SLOT so that the
+   following APDUs are sent without the reader driver acquiring the
+   card for each of them.  This is used while a card is locked for an
+   operation.  Backends without transactions do nothing.  */
+int
+apdu_begin_transaction (int slot)
+{
+  int sw;
+
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
+    return SW_HOST_NO_DRIVER;
+
+  if (reader_table[slot].begin_transaction)
+    {
+      sw = lock_slot (slot);
+      if (!sw)
+        {
+          sw = reader_table[slot].begin_transaction (slot);
+          unlock_slot (slot);
+        }
+    }
+  else
+    sw = 0;
+  return sw;
+}
+
+
+/* End a transaction started with apdu_begin_transaction.  It is not
+   an error if there is no active transaction.  */
+int
+apdu_end_transaction (int slot)
+{
+  int sw;
+
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
+    return SW_HOST_NO_DRIVER;
+
+  if (reader_table[slot].end_transaction)
+    {
+      sw = lock_slot (slot);
+      if (!sw)
+        {
+          sw = reader_table[slot].end_transaction (slot);
+          unlock_slot (slot);
+        }
+    }
+  else
+    sw = 0;
+  return sw;
+}
+
+
 /* Do a reset for the card in reader at SLOT. */
 int
 apdu_reset (int slot)
@@ -2473,14 +2789,14 @@ apdu_reset (int slot)
 
   if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
     {
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_reset => SW_HOST_NO_DRIVER\n");
       return SW_HOST_NO_DRIVER;
     }
 
   if ((sw = lock_slot (slot)))
     {
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_reset => sw=0x%x (lock_slot)\n", sw);
       return sw;
     }
@@ -2508,13 +2824,13 @@ apdu_get_atr (int slot, size_t *atrlen)
 
   if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
     {
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_get_atr => NULL (bad slot)\n");
       return NULL;
     }
   if (!reader_table[slot].atrlen)
     {
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_get_atr => NULL (no ATR)\n");
       return NULL;
     }
@@ -2522,7 +2838,7 @@ apdu_get_atr (int slot, size_t *atrlen)
   buf = xtrymalloc (reader_table[slot].atrlen);
   if (!buf)
     {
-      if (DBG_READER)
+      if (DBG_CARD_IO)
         log_debug ("leave: apdu_get_atr => NULL (out of core)\n");
       return NULL;
     }
@@ -2683,10 +2999,28 @@ send_apdu (int slot, unsigned char *apdu, size_t apdulen,
     return SW_HOST_NO_DRIVER;
 
   if (reader_table[slot].send_apdu_reader)
-    return reader_table[slot].send_apdu_reader (slot,
-                                                apdu, apdulen,
-                                                buffer, buflen,
-                                                pininfo);
+    {
+      struct apdu_stats_s *stats = &reader_table[slot].stats;
+      unsigned long long started, elapsed;
+      int rc;
+
+      started = stats_time ();
+      rc = reader_table[slot].send_apdu_reader (slot, apdu, apdulen,
+                                                buffer, buflen, pininfo);
+      elapsed = stats_time () - started;
+
+      stats->apdus++;
+      stats->bytes_sent += apdulen;
+      if (rc)
+        stats->errors++;
+      else
+        stats->bytes_received += *buflen;
+      stats->card_time += elapsed;
+      if (elapsed > stats->card_time_max)
+        stats->card_time_max = elapsed;
+      metric_observe (&m_apdu_usec, elapsed);
+      return rc;
+    }
   else
     return SW_HOST_NOT_SUPPORTED;
 }
@@ -3351,6 +3685,57 @@ apdu_get_reader_name (int slot)
   return reader_table[slot].rdrname;
 }
 
+
+/* Return the maximum number of data bytes which may be requested
+   from the card in SLOT with one extended length APDU or 0 if
+   extended length APDUs can't be used.  This requires that the card
+   announces support for them in its ATR and that the reader is able
+   to transfer them.  */
+unsigned int
+apdu_get_max_extlen (int slot)
+{
+  reader_table_t rt;
+
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used)
+    return 0;
+  rt = reader_table + slot;
+
+  if (!rt->atrlen || rt->is_t0 || rt->no_extlen)
+    return 0;
+#ifdef HAVE_LIBUSB
+  if (rt->send_apdu_reader == send_apdu_ccid
+      && !ccid_extended_length_p (rt->ccid.handle))
+    return 0;
+#endif
+  if (!atr_extended_length_p (rt->atr, rt->atrlen))
+    return 0;
+
+  return 65535;
+}
+
+
+/* Store the statistics about the APDU traffic of SLOT at R_STATS.
+   They are cleared when a reader is opened.  */
+int
+apdu_get_stats (int slot, struct apdu_stats_s *r_stats)
+{
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used)
+    return SW_HOST_NO_DRIVER;
+  *r_stats = reader_table[slot].stats;
+  return 0;
+}
+
+
+/* Tell the APDU layer that the card in SLOT failed to process an
+   extended length APDU.  apdu_get_max_extlen will then return 0
+   until the card has been removed.  */
+void
+apdu_disable_extlen (int slot)
+{
+  if (slot >= 0 && slot < MAX_READER && reader_table[slot].used)
+    reader_table[slot].no_extlen = 1;
+}
+
 gpg_error_t
 apdu_init (void)
 {
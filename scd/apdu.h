@@ -87,6 +87,20 @@ struct dev_list;
 #define APDU_CARD_ACTIVE   (4)    /* Card is active.  */
 
 
+/* Statistics about the APDU traffic of a reader.  Times are given in
+   microseconds.  */
+struct apdu_stats_s
+{
+  unsigned long apdus;                /* Number of APDUs sent.  */
+  unsigned long errors;               /* Number of failed transfers.  */
+  unsigned long long bytes_sent;
+  unsigned long long bytes_received;
+  unsigned long long card_time;       /* Time spent in the transfers.  */
+  unsigned long long card_time_max;   /* Longest transfer.  */
+  unsigned long long lock_time;       /* Time spent waiting for the lock.  */
+};
+
+
 gpg_error_t apdu_init (void);
 
 gpg_error_t apdu_dev_list_start (const char *portstr, struct dev_list **l_p);
@@ -119,6 +133,8 @@ int apdu_disconnect (int slot);
 
 int apdu_set_progress_cb (int slot, gcry_handler_progress_t cb, void *cb_arg);
 int apdu_set_prompt_cb (int slot, void (*cb) (void *, int), void *cb_arg);
+int apdu_begin_transaction (int slot);
+int apdu_end_transaction (int slot);
 
 int apdu_reset (int slot);
 int apdu_get_status (int slot, int hang, unsigned int *status);
@@ -142,5 +158,8 @@ int apdu_send_direct (int slot, size_t extended_length,
                       int handle_more, unsigned int *r_sw,
                       unsigned char **retbuf, size_t *retbuflen);
 const char *apdu_get_reader_name (int slot);
+unsigned int apdu_get_max_extlen (int slot);
+int apdu_get_stats (int slot, struct apdu_stats_s *r_stats);
+void apdu_disable_extlen (int slot);
 
 #endif /*APDU_H*/
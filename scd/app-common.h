@@ -113,6 +113,22 @@ struct card_ctx_s {
    * put the active app at the head of the list.  */
   app_t app;
 
+  /* The keygrips of keys found on this card by app_do_with_keygrip
+   * along with the type of the application handling them.  This is
+   * used to route requests for a keygrip to this card without
+   * locking the other cards.  */
+  struct {
+    char keygrip_str[41];
+    apptype_t apptype;
+  } known_keys[8];
+  unsigned int known_keys_next;  /* The entry to replace next.  */
+
+  /* Used by lock_card to collect statistics about the operation done
+   * while the card is locked.  */
+  unsigned long long op_start;      /* Time the lock was acquired.  */
+  unsigned long long op_lock_time;  /* Time spent waiting for the lock.  */
+  unsigned long op_apdus;           /* APDUs sent before the operation.  */
+
   /* Various flags.  */
   unsigned int reset_requested:1;
   unsigned int periodical_check_needed:1;
@@ -223,6 +239,12 @@ gpg_error_t app_help_get_keygrip_string (ksba_cert_t cert, char *hexkeygrip,
 gpg_error_t app_help_pubkey_from_cert (const void *cert, size_t certlen,
                                        unsigned char **r_pk, size_t *r_pklen);
 size_t app_help_read_length_of_cert (int slot, int fid, size_t *r_certoff);
+gpg_error_t app_help_get_cached (app_t app, const char *name,
+                                 const void *stamp, size_t stamplen,
+                                 unsigned char **r_data, size_t *r_datalen);
+void app_help_put_cached (app_t app, const char *name,
+                          const void *stamp, size_t stamplen,
+                          const void *data, size_t datalen);
 
 
 /*-- app.c --*/
@@ -232,6 +254,7 @@ const char *strapptype (apptype_t t);
 void app_update_priority_list (const char *arg);
 gpg_error_t app_send_card_list (ctrl_t ctrl);
 gpg_error_t app_send_active_apps (card_t card, ctrl_t ctrl);
+char *app_get_stats (void);
 char *card_get_serialno (card_t card);
 char *app_get_serialno (app_t app);
 
@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "scdaemon.h"
 #include "iso7816.h"
@@ -246,3 +248,197 @@ app_help_read_length_of_cert (int slot, int fid, size_t *r_certoff)
 
   return resultlen;
 }
+
+
+/* The name of the directory below the homedir used by the functions
+ * app_help_get_cached and app_help_put_cached.  */
+#define CARD_CACHE_DIR "card-cache.d"
+
+/* Files larger than this are not considered as cache files.  */
+#define CARD_CACHE_MAXSIZE (64*1024)
+
+/* The magic at the start of a cache file.  The magic is followed by
+ * the SHA-1 of the stamp, the SHA-1 of the data and the data.  */
+#define CARD_CACHE_MAGIC "SCC1"
+
+
+/* Return the malloced name of the cache file for the object NAME of
+ * APP or NULL on error.  The file name is derived from the serial
+ * number of the card, the application and NAME.  */
+static char *
+card_cache_fname (app_t app, const char *name)
+{
+  gcry_md_hd_t md;
+  char *serialno;
+  char hexname[2*20+1];
+
+  serialno = app_get_serialno (app);
+  if (!serialno)
+    return NULL;
+  if (gcry_md_open (&md, GCRY_MD_SHA1, 0))
+    {
+      xfree (serialno);
+      return NULL;
+    }
+  gcry_md_write (md, serialno, strlen (serialno) + 1);
+  gcry_md_write (md, strapptype (app->apptype),
+                 strlen (strapptype (app->apptype)) + 1);
+  gcry_md_write (md, name, strlen (name));
+  bin2hex (gcry_md_read (md, GCRY_MD_SHA1), 20, hexname);
+  gcry_md_close (md);
+  xfree (serialno);
+
+  return make_filename_try (gnupg_homedir (), CARD_CACHE_DIR, hexname, NULL);
+}
+
+
+/* Read the object NAME of APP from the on-disk cache.  STAMP of
+ * length STAMPLEN identifies the version of the object; it must
+ * be the same as given to app_help_put_cached.  Callers should
+ * include the serial number of the card, a change counter or a hash
+ * of the directory files into the stamp.  On success the object is
+ * stored in a new buffer at R_DATA and its length at R_DATALEN.
+ * GPG_ERR_NOT_FOUND is returned if the object is not cached.  */
+gpg_error_t
+app_help_get_cached (app_t app, const char *name,
+                     const void *stamp, size_t stamplen,
+                     unsigned char **r_data, size_t *r_datalen)
+{
+  gpg_error_t err;
+  char *fname;
+  estream_t fp;
+  unsigned char *buffer = NULL;
+  size_t buflen, nread;
+  unsigned char digest[20];
+  size_t hdrlen = strlen (CARD_CACHE_MAGIC) + 20 + 20;
+
+  *r_data = NULL;
+  *r_datalen = 0;
+
+  fname = card_cache_fname (app, name);
+  if (!fname)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  fp = es_fopen (fname, "rb");
+  xfree (fname);
+  if (!fp)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+
+  buffer = xtrymalloc (CARD_CACHE_MAXSIZE);
+  if (!buffer)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (es_read (fp, buffer, CARD_CACHE_MAXSIZE, &nread)
+      || nread <= hdrlen || nread == CARD_CACHE_MAXSIZE)
+    {
+      err = gpg_error (GPG_ERR_NOT_FOUND);
+      goto leave;
+    }
+  buflen = nread;
+
+  if (memcmp (buffer, CARD_CACHE_MAGIC, strlen (CARD_CACHE_MAGIC)))
+    {
+      err = gpg_error (GPG_ERR_NOT_FOUND);
+      goto leave;
+    }
+  gcry_md_hash_buffer (GCRY_MD_SHA1, digest, stamp, stamplen);
+  if (memcmp (buffer + strlen (CARD_CACHE_MAGIC), digest, 20))
+    {
+      err = gpg_error (GPG_ERR_NOT_FOUND); /* Outdated.  */
+      goto leave;
+    }
+  gcry_md_hash_buffer (GCRY_MD_SHA1, digest,
+                       buffer + hdrlen, buflen - hdrlen);
+  if (memcmp (buffer + strlen (CARD_CACHE_MAGIC) + 20, digest, 20))
+    {
+      log_info ("card cache: ignoring corrupted file for '%s'\n", name);
+      err = gpg_error (GPG_ERR_NOT_FOUND);
+      goto leave;
+    }
+
+  memmove (buffer, buffer + hdrlen, buflen - hdrlen);
+  *r_data = buffer;
+  *r_datalen = buflen - hdrlen;
+  buffer = NULL;
+  err = 0;
+
+ leave:
+  xfree (buffer);
+  es_fclose (fp);
+  return err;
+}
+
+
+/* Store the object NAME of APP with DATA of length DATALEN in the
+ * on-disk cache using STAMP of length STAMPLEN to identify the
+ * version.  Errors are not returned because the data will simply be
+ * read from the card again.  */
+void
+app_help_put_cached (app_t app, const char *name,
+                     const void *stamp, size_t stamplen,
+                     const void *data, size_t datalen)
+{
+  gpg_error_t err;
+  char *dname = NULL;
+  char *fname = NULL;
+  char *tmpfname = NULL;
+  estream_t fp = NULL;
+  unsigned char digest[20];
+  struct stat statbuf;
+
+  if (datalen + 50 >= CARD_CACHE_MAXSIZE)
+    return;
+
+  dname = make_filename_try (gnupg_homedir (), CARD_CACHE_DIR, NULL);
+  fname = card_cache_fname (app, name);
+  if (fname)
+    tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!dname || !fname || !tmpfname)
+    goto leave;
+
+  if (stat (dname, &statbuf) && errno == ENOENT
+      && gnupg_mkdir (dname, "-rwx"))
+    {
+      err = gpg_error_from_syserror ();
+      log_info ("can't create directory '%s': %s\n", dname,
+                gpg_strerror (err));
+      goto leave;
+    }
+
+  fp = es_fopen (tmpfname, "wb,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_info ("can't create '%s': %s\n", tmpfname, gpg_strerror (err));
+      goto leave;
+    }
+  es_fputs (CARD_CACHE_MAGIC, fp);
+  gcry_md_hash_buffer (GCRY_MD_SHA1, digest, stamp, stamplen);
+  es_fwrite (digest, 20, 1, fp);
+  gcry_md_hash_buffer (GCRY_MD_SHA1, digest, data, datalen);
+  es_fwrite (digest, 20, 1, fp);
+  es_fwrite (data, datalen, 1, fp);
+  if (es_fclose (fp))
+    {
+      fp = NULL;
+      err = gpg_error_from_syserror ();
+      log_info ("error writing '%s': %s\n", tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  fp = NULL;
+
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    {
+      log_info ("error renaming '%s': %s\n", tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+
+ leave:
+  es_fclose (fp);
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (dname);
+}
@@ -779,7 +779,10 @@ basic_pin_checks (const char *pinvalue, int minlen, int maxlen)
 }
 
 
-/* Verify the PIN if required.  */
+/* Verify the PIN if required.  TCOS keeps the PIN verified until the
+ * card is reset or, for signature PINs, until the key has been used;
+ * we ask the card for the status first and skip the prompt and the
+ * VERIFY if it tells us that the PIN is still validated.  */
 static gpg_error_t
 verify_pin (app_t app, int pwid, const char *desc,
             gpg_error_t (*pincb)(void*, const char *, char **),
@@ -788,6 +791,14 @@ verify_pin (app_t app, int pwid, const char *desc,
   pininfo_t pininfo;
   int rc;
 
+  if (iso7816_verify_status (app_get_slot (app), pwid)
+      == ISO7816_VERIFY_NOT_NEEDED)
+    {
+      if (opt.verbose)
+        log_info ("nks: PIN %d is still verified\n", pwid);
+      return 0;
+    }
+
   if (!desc)
     desc = "PIN";
 
@@ -98,11 +98,11 @@ static struct {
   { 0x006E, 1,    0, 1, 0, 0, 0, 0, "Application Related Data" },
   { 0x004F, 0, 0x6E, 1, 0, 0, 0, 0, "AID" },
   { 0x0073, 1,    0, 1, 0, 0, 0, 0, "Discretionary Data Objects" },
-  { 0x0047, 0, 0x6E, 1, 1, 0, 0, 0, "Card Capabilities" },
-  { 0x00C0, 0, 0x6E, 1, 1, 0, 0, 0, "Extended Card Capabilities" },
-  { 0x00C1, 0, 0x6E, 1, 1, 0, 0, 0, "Algorithm Attributes Signature" },
-  { 0x00C2, 0, 0x6E, 1, 1, 0, 0, 0, "Algorithm Attributes Decryption" },
-  { 0x00C3, 0, 0x6E, 1, 1, 0, 0, 0, "Algorithm Attributes Authentication" },
+  { 0x0047, 0, 0x6E, 1, 0, 0, 0, 0, "Card Capabilities" },
+  { 0x00C0, 0, 0x6E, 1, 0, 0, 0, 0, "Extended Card Capabilities" },
+  { 0x00C1, 0, 0x6E, 1, 0, 0, 0, 0, "Algorithm Attributes Signature" },
+  { 0x00C2, 0, 0x6E, 1, 0, 0, 0, 0, "Algorithm Attributes Decryption" },
+  { 0x00C3, 0, 0x6E, 1, 0, 0, 0, 0, "Algorithm Attributes Authentication" },
   { 0x00C4, 0, 0x6E, 1, 0, 1, 1, 0, "CHV Status Bytes" },
   { 0x00C5, 0, 0x6E, 1, 0, 0, 0, 0, "Fingerprints" },
   { 0x00C6, 0, 0x6E, 1, 0, 0, 0, 0, "CA Fingerprints" },
@@ -173,6 +173,8 @@ struct app_local_s {
                            because the length of an S-expression is
                            implicitly available.  */
     unsigned char keygrip_str[41]; /* The keygrip, null terminated */
+    gpg_error_t read_err; /* The error returned by the card if it has
+                             no key; used to avoid asking again.  */
   } pk[3];
 
   unsigned char status_indicator; /* The card status indicator.  */
@@ -273,6 +275,7 @@ static gpg_error_t do_auth (app_t app, ctrl_t ctrl, const char *keyidstr,
                             const void *indata, size_t indatalen,
                             unsigned char **outdata, size_t *outdatalen);
 static void parse_algorithm_attribute (app_t app, int keyno);
+static void flush_cache (app_t app);
 static gpg_error_t change_keyattr_from_string
                            (app_t app, ctrl_t ctrl,
                             gpg_error_t (*pincb)(void*, const char *, char **),
@@ -331,14 +334,9 @@ do_deinit (app_t app)
 {
   if (app && app->app_local)
     {
-      struct cache_s *c, *c2;
       int i;
 
-      for (c = app->app_local->cache; c; c = c2)
-        {
-          c2 = c->next;
-          xfree (c);
-        }
+      flush_cache (app);
 
       for (i=0; i < DIM (app->app_local->pk); i++)
         {
@@ -534,6 +532,24 @@ flush_cache (app_t app)
 }
 
 
+/* Flush the cached DOs and the cached public key describing the key
+   KEYNO.  This needs to be called by all functions which change or
+   delete a key on the card.  The other cached DOs are still valid. */
+static void
+flush_key_cache (app_t app, int keyno)
+{
+  flush_cache_item (app, 0xC1 + keyno);
+  flush_cache_item (app, 0xC5);
+  flush_cache_item (app, 0xCD);
+
+  xfree (app->app_local->pk[keyno].key);
+  app->app_local->pk[keyno].key = NULL;
+  app->app_local->pk[keyno].keylen = 0;
+  app->app_local->pk[keyno].read_done = 0;
+  app->app_local->pk[keyno].read_err = 0;
+}
+
+
 /* Get the DO identified by TAG from the card in SLOT and return a
    buffer with its content in RESULT and NBYTES.  The return value is
    NULL if not found or a pointer which must be used to release the
@@ -1817,6 +1833,8 @@ get_public_key (app_t app, int keyno)
   /* Already cached? */
   if (app->app_local->pk[keyno].read_done)
     return 0;
+  if (app->app_local->pk[keyno].read_err)
+    return app->app_local->pk[keyno].read_err;
 
   xfree (app->app_local->pk[keyno].key);
   app->app_local->pk[keyno].key = NULL;
@@ -1849,6 +1867,12 @@ get_public_key (app_t app, int keyno)
       if (err)
         {
           log_error (_("reading public key failed: %s\n"), gpg_strerror (err));
+          /* Remember that there is no such key so that a scan for
+             keygrips does not ask the card again.  */
+          if (gpg_err_code (err) == GPG_ERR_NO_OBJ
+              || gpg_err_code (err) == GPG_ERR_ENOENT
+              || gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+            app->app_local->pk[keyno].read_err = err;
           goto leave;
         }
 
@@ -3665,7 +3689,8 @@ change_keyattr (app_t app, ctrl_t ctrl,
                keyno+1);
   else
     log_info ("key attribute of OPENPGP.%d changed\n", keyno+1);
-  flush_cache (app);
+  /* Changing the attribute deletes the key.  */
+  flush_key_cache (app, keyno);
   parse_algorithm_attribute (app, keyno);
   app->did_chv1 = 0;
   app->did_chv2 = 0;
@@ -4082,11 +4107,7 @@ rsa_writekey (app_t app, ctrl_t ctrl,
     }
 
   /* We need to remove the cached public key.  */
-  xfree (app->app_local->pk[keyno].key);
-  app->app_local->pk[keyno].key = NULL;
-  app->app_local->pk[keyno].keylen = 0;
-  app->app_local->pk[keyno].read_done = 0;
-
+  flush_key_cache (app, keyno);
 
   if (app->app_local->extcap.is_v2)
     {
@@ -4441,10 +4462,7 @@ ecc_writekey (app_t app, ctrl_t ctrl,
     log_info ("ECC private key size is %u bytes\n", (unsigned int)ecc_d_len);
 
   /* We need to remove the cached public key.  */
-  xfree (app->app_local->pk[keyno].key);
-  app->app_local->pk[keyno].key = NULL;
-  app->app_local->pk[keyno].keylen = 0;
-  app->app_local->pk[keyno].read_done = 0;
+  flush_key_cache (app, keyno);
 
   if (app->app_local->extcap.is_v2)
     {
@@ -4605,15 +4623,9 @@ do_genkey (app_t app, ctrl_t ctrl,  const char *keyref, const char *keyalgo,
   if (!digitp (keynostr) || keyno < 0 || keyno > 2)
     return gpg_error (GPG_ERR_INV_ID);
 
-  /* We flush the cache to increase the traffic before a key
-     generation.  This _might_ help a card to gather more entropy. */
-  flush_cache (app);
-
-  /* Obviously we need to remove the cached public key.  */
-  xfree (app->app_local->pk[keyno].key);
-  app->app_local->pk[keyno].key = NULL;
-  app->app_local->pk[keyno].keylen = 0;
-  app->app_local->pk[keyno].read_done = 0;
+  /* Obviously we need to remove the cached public key and the DOs
+     describing the key.  */
+  flush_key_cache (app, keyno);
 
   /* Check whether a key already exists.  */
   err = does_key_exist (app, keyno, 1, force);
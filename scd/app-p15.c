@@ -42,6 +42,7 @@
 #include "iso7816.h"
 #include "../common/i18n.h"
 #include "../common/tlv.h"
+#include "../common/host2net.h"
 #include "apdu.h" /* fixme: we should move the card detection to a
                      separate file */
 
@@ -255,6 +256,10 @@ struct aodf_object_s
   /* Flags to indicate whether fields are valid.  */
   unsigned int have_off:1;
 
+  /* Flag indicating that this PIN has already been verified for one
+   * of the keys.  */
+  unsigned int pin_verified:1;
+
   /* Length and allocated buffer with the Id of this object. */
   size_t objidlen;
   unsigned char *objid;
@@ -369,9 +374,19 @@ struct app_local_s
   /* Information on all authentication objects. */
   aodf_object_t auth_object_info;
 
+  /* A hash over all CDFs as read from the card.  This is part of the
+   * stamp for the certificates in the on-disk cache.  */
+  unsigned char cdf_digest[20];
+
 };
 
 
+/* The number of bytes read from the start of a certificate file to
+ * check whether a cached copy is still valid.  This covers the
+ * length and the serial number of the certificate.  */
+#define CERT_STAMP_LEN 64
+
+
 /*** Local prototypes.  ***/
 static gpg_error_t keygrip_from_prkdf (app_t app, prkdf_object_t prkdf);
 static gpg_error_t readcert_by_cdf (app_t app, cdf_object_t cdf,
@@ -1403,6 +1418,18 @@ read_ef_cdf (app_t app, unsigned short fid, cdf_object_t *result)
   if (err)
     return err;
 
+  /* Chain the CDF into the digest over all CDFs.  */
+  {
+    gcry_buffer_t iov[2];
+
+    memset (iov, 0, sizeof iov);
+    iov[0].data = app->app_local->cdf_digest;
+    iov[0].len = 20;
+    iov[1].data = buffer;
+    iov[1].len = buflen;
+    gcry_md_hash_buffers (GCRY_MD_SHA1, 0, app->app_local->cdf_digest, iov, 2);
+  }
+
   p = buffer;
   n = buflen;
 
@@ -2884,6 +2911,51 @@ do_learn_status (app_t app, ctrl_t ctrl, unsigned int flags)
 }
 
 
+/* Return a stamp for the on-disk cache of the certificate described
+   by CDF whose file starts with the HEADLEN bytes at HEAD.  The
+   malloced stamp is stored at R_STAMP and its length at R_STAMPLEN;
+   the name for the cache at R_NAME.  */
+static gpg_error_t
+make_cert_stamp (app_t app, cdf_object_t cdf,
+                 const unsigned char *head, size_t headlen,
+                 unsigned char **r_stamp, size_t *r_stamplen, char **r_name)
+{
+  unsigned char *stamp, *p;
+  size_t stamplen;
+  int i;
+
+  stamplen = 20 + cdf->objidlen + 2*cdf->pathlen + 8 + headlen;
+  stamp = p = xtrymalloc (stamplen);
+  if (!stamp)
+    return gpg_error_from_syserror ();
+  memcpy (p, app->app_local->cdf_digest, 20);
+  p += 20;
+  memcpy (p, cdf->objid, cdf->objidlen);
+  p += cdf->objidlen;
+  for (i=0; i < cdf->pathlen; i++)
+    {
+      *p++ = cdf->path[i] >> 8;
+      *p++ = cdf->path[i];
+    }
+  ulongtobuf (p, cdf->off);
+  ulongtobuf (p+4, cdf->len);
+  p += 8;
+  memcpy (p, head, headlen);
+
+  *r_name = xtrymalloc (10 + 2*cdf->objidlen + 1);
+  if (!*r_name)
+    {
+      xfree (stamp);
+      return gpg_error_from_syserror ();
+    }
+  bin2hex (cdf->objid, cdf->objidlen, stpcpy (*r_name, "p15-cert-"));
+
+  *r_stamp = stamp;
+  *r_stamplen = stamplen;
+  return 0;
+}
+
+
 /* Read a certifciate using the information in CDF and return the
    certificate in a newly llocated buffer R_CERT and its length
    R_CERTLEN. */
@@ -2899,6 +2971,11 @@ readcert_by_cdf (app_t app, cdf_object_t cdf,
   size_t totobjlen, objlen, hdrlen;
   int rootca;
   int i;
+  unsigned char *head = NULL;
+  size_t headlen;
+  unsigned char *stamp = NULL;
+  size_t stamplen;
+  char *cachename = NULL;
 
   *r_cert = NULL;
   *r_certlen = 0;
@@ -2921,6 +2998,24 @@ readcert_by_cdf (app_t app, cdf_object_t cdf,
   if (err)
     goto leave;
 
+  /* Check the on-disk cache.  Its stamp covers the CDFs and the
+     start of the certificate file; reading the latter needs only one
+     short APDU.  */
+  if (!iso7816_read_binary_ext (app_get_slot (app), 1, cdf->off,
+                                (cdf->len && cdf->len < CERT_STAMP_LEN)?
+                                cdf->len : CERT_STAMP_LEN,
+                                &head, &headlen)
+      && headlen
+      && !make_cert_stamp (app, cdf, head, headlen,
+                           &stamp, &stamplen, &cachename)
+      && !app_help_get_cached (app, cachename, stamp, stamplen,
+                               r_cert, r_certlen))
+    {
+      if (opt.verbose)
+        log_info ("p15: using cached certificate '%s'\n", cachename);
+      goto cache_it;
+    }
+
   err = iso7816_read_binary_ext (app_get_slot (app), 1, cdf->off, cdf->len,
                                  &buffer, &buflen);
   if (!err && (!buflen || *buffer == 0xff))
@@ -2994,6 +3089,11 @@ readcert_by_cdf (app_t app, cdf_object_t cdf,
   buffer = NULL;
   *r_certlen = totobjlen;
 
+  if (stamp)
+    app_help_put_cached (app, cachename, stamp, stamplen,
+                         *r_cert, *r_certlen);
+
+ cache_it:
   /* Try to cache it. */
   if (!cdf->image && (cdf->image = xtrymalloc (*r_certlen)))
     {
@@ -3004,6 +3104,9 @@ readcert_by_cdf (app_t app, cdf_object_t cdf,
 
  leave:
   xfree (buffer);
+  xfree (head);
+  xfree (stamp);
+  xfree (cachename);
   return err;
 }
 
@@ -3455,6 +3558,7 @@ verify_pin (app_t app,
             log_info ("p15: PIN has %d attempts left\n", remaining);
           /* On error or if less than 3 better ask. */
           prkdf->pin_verified = 0;
+          aodf->pin_verified = 0;
         }
     }
   else
@@ -3464,6 +3568,15 @@ verify_pin (app_t app,
   if (prkdf->pin_verified)
     return 0;  /* Already done.  */
 
+  /* The card keeps the PIN verified for all keys protected by it.
+   * Keys for qualified signatures are excluded because many cards
+   * require a verification right before each such signature.  */
+  if (aodf->pin_verified && !prkdf->usageflags.non_repudiation)
+    {
+      prkdf->pin_verified = 1;
+      return 0;
+    }
+
   if (prkdf->usageflags.non_repudiation
       && (app->app_local->card_type == CARD_TYPE_BELPIC
           || app->app_local->card_product == CARD_PRODUCT_DTRUST))
@@ -3620,6 +3733,7 @@ verify_pin (app_t app,
   if (opt.verbose)
     log_info ("p15: PIN verification succeeded\n");
   prkdf->pin_verified = 1;
+  aodf->pin_verified = 1;
 
   return 0;
 }
@@ -49,6 +49,41 @@ static npth_cond_t notify_cond;
  * (described by app_t) on the same physical token. */
 static card_t card_top;
 
+/* The operations for which statistics are collected.  */
+enum card_ops
+  {
+    OP_READCERT,
+    OP_READKEY,
+    OP_GETATTR,
+    OP_SIGN,
+    OP_AUTH,
+    OP_DECIPHER,
+    OP_WRITEKEY,
+    OP_GENKEY
+  };
+
+/* Statistics about the operations done by all cards.  Times are given
+ * in microseconds.  They are shown by "GETINFO stats".  */
+static struct
+{
+  const char *name;
+  unsigned long count;
+  unsigned long errors;
+  unsigned long apdus;
+  unsigned long long time;
+  unsigned long long lock_time;
+} op_stats[] =
+  {
+    { "readcert" },
+    { "readkey" },
+    { "getattr" },
+    { "sign" },
+    { "auth" },
+    { "decipher" },
+    { "writekey" },
+    { "genkey" }
+  };
+
 
 /* The list of application names and their select function.  If no
  * specific application is selected the first available application on
@@ -73,6 +108,23 @@ static struct app_priority_list_s app_priority_list[] =
   };
 
 
+/* The number of ATRs for which we remember the application.  */
+#define MAX_KNOWN_ATRS 16
+
+/* A table with the ATRs of the cards seen so far along with the
+ * application selected for them.  app_new_register tries this
+ * application first so that plugging in a token again does not run
+ * through all the failing selects of the applications with a higher
+ * priority.  Protected by CARD_LIST_LOCK.  */
+static struct
+{
+  size_t atrlen;
+  unsigned char atr[33];
+  apptype_t apptype;
+} known_atrs[MAX_KNOWN_ATRS];
+static unsigned int known_atrs_next;  /* The entry to replace next.  */
+
+
 
 
 
@@ -219,6 +271,17 @@ print_progress_line (void *opaque, const char *what, int pc, int cur, int tot)
 }
 
 
+/* Return a timestamp in microseconds for the statistics.  */
+static unsigned long long
+stats_time (void)
+{
+  struct timespec ts;
+
+  npth_clock_gettime (&ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
 /* Lock the CARD.  This function shall be used right before calling
  * any of the actual application functions to serialize access to the
  * reader.  We do this always even if the card is not actually used.
@@ -230,14 +293,67 @@ print_progress_line (void *opaque, const char *what, int pc, int cur, int tot)
 static gpg_error_t
 lock_card (card_t card, ctrl_t ctrl)
 {
-  if (npth_mutex_lock (&card->lock))
+  struct apdu_stats_s stats;
+  unsigned long long started;
+  int rc;
+
+  started = stats_time ();
+  rc = npth_mutex_trylock (&card->lock);
+  if (rc == EBUSY)
+    rc = npth_mutex_lock (&card->lock);
+  if (rc)
     {
-      gpg_error_t err = gpg_error_from_syserror ();
+      gpg_error_t err = gpg_error_from_errno (rc);
       log_error ("failed to acquire CARD lock for %p: %s\n",
                  card, gpg_strerror (err));
       return err;
     }
 
+  card->op_start = stats_time ();
+  card->op_lock_time = card->op_start - started;
+  card->op_apdus = apdu_get_stats (card->slot, &stats)? 0 : stats.apdus;
+
+  apdu_set_progress_cb (card->slot, print_progress_line, ctrl);
+  apdu_set_prompt_cb (card->slot, popup_prompt, ctrl);
+
+  /* An operation usually takes several APDUs; with PC/SC we keep the
+   * card acquired for all of them.  Errors are not fatal because the
+   * APDUs then just run without an explicit transaction.  */
+  apdu_begin_transaction (card->slot);
+
+  return 0;
+}
+
+
+/* Add the statistics of the operation OP, which has been done on the
+ * locked CARD with the result ERR, to the table OP_STATS.  This needs
+ * to be called right before the card is unlocked.  */
+static void
+account_op (card_t card, enum card_ops op, gpg_error_t err)
+{
+  struct apdu_stats_s stats;
+
+  op_stats[op].count++;
+  if (err)
+    op_stats[op].errors++;
+  if (!apdu_get_stats (card->slot, &stats) && stats.apdus >= card->op_apdus)
+    op_stats[op].apdus += stats.apdus - card->op_apdus;
+  op_stats[op].time += stats_time () - card->op_start;
+  op_stats[op].lock_time += card->op_lock_time;
+}
+
+
+/* Same as lock_card but return GPG_ERR_EBUSY instead of waiting if
+ * CARD is locked by another connection.  */
+static gpg_error_t
+trylock_card (card_t card, ctrl_t ctrl)
+{
+  int rc;
+
+  rc = npth_mutex_trylock (&card->lock);
+  if (rc)
+    return gpg_error_from_errno (rc);
+
   apdu_set_progress_cb (card->slot, print_progress_line, ctrl);
   apdu_set_prompt_cb (card->slot, popup_prompt, ctrl);
 
@@ -249,6 +365,7 @@ lock_card (card_t card, ctrl_t ctrl)
 static void
 unlock_card (card_t card)
 {
+  apdu_end_transaction (card->slot);
   apdu_set_progress_cb (card->slot, NULL, NULL);
   apdu_set_prompt_cb (card->slot, NULL, NULL);
 
@@ -261,6 +378,69 @@ unlock_card (card_t card)
 }
 
 
+/* Return the card which is known to have the key KEYGRIP_STR and
+ * store the type of the application handling it at R_APPTYPE.
+ * Returns NULL if not known.  The caller must hold CARD_LIST_LOCK.
+ * Note that the list of known keys of a card is only changed by
+ * connections holding the lock of that card; because nPth does not
+ * switch threads while we are scanning the list this is fine.  */
+static card_t
+find_known_key (const char *keygrip_str, apptype_t *r_apptype)
+{
+  card_t c;
+  int i;
+
+  for (c = card_top; c; c = c->next)
+    for (i=0; i < DIM (c->known_keys); i++)
+      if (!strcmp (c->known_keys[i].keygrip_str, keygrip_str))
+        {
+          *r_apptype = c->known_keys[i].apptype;
+          return c;
+        }
+  return NULL;
+}
+
+
+/* Remember that the key KEYGRIP_STR is on the locked CARD and handled
+ * by APPTYPE.  */
+static void
+remember_known_key (card_t card, const char *keygrip_str, apptype_t apptype)
+{
+  int i;
+
+  if (strlen (keygrip_str) != 40)
+    return;
+
+  i = card->known_keys_next++ % DIM (card->known_keys);
+  strcpy (card->known_keys[i].keygrip_str, keygrip_str);
+  card->known_keys[i].apptype = apptype;
+}
+
+
+/* Forget that the key KEYGRIP_STR is on the locked CARD.  */
+static void
+forget_known_key (card_t card, const char *keygrip_str)
+{
+  int i;
+
+  for (i=0; i < DIM (card->known_keys); i++)
+    if (!strcmp (card->known_keys[i].keygrip_str, keygrip_str))
+      *card->known_keys[i].keygrip_str = 0;
+}
+
+
+/* Forget all known keys of the locked CARD.  This needs to be called
+ * after the keys on the card have been changed.  */
+static void
+forget_known_keys (card_t card)
+{
+  int i;
+
+  for (i=0; i < DIM (card->known_keys); i++)
+    *card->known_keys[i].keygrip_str = 0;
+}
+
+
 /* This function may be called to print information pertaining to the
  * current state of this module to the log. */
 void
@@ -419,6 +599,61 @@ card_reset (card_t card, ctrl_t ctrl, int send_reset)
   return err;
 }
 
+/* Return the application remembered for the card in SLOT or
+ * APPTYPE_NONE.  */
+static apptype_t
+lookup_atr_apptype (int slot)
+{
+  unsigned char *atr;
+  size_t atrlen;
+  apptype_t apptype = APPTYPE_NONE;
+  int i;
+
+  atr = apdu_get_atr (slot, &atrlen);
+  if (!atr)
+    return APPTYPE_NONE;
+  for (i=0; i < DIM (known_atrs); i++)
+    if (known_atrs[i].atrlen == atrlen
+        && !memcmp (known_atrs[i].atr, atr, atrlen))
+      {
+        apptype = known_atrs[i].apptype;
+        break;
+      }
+  xfree (atr);
+  return apptype;
+}
+
+
+/* Remember that APPTYPE has been selected for the card in SLOT.  */
+static void
+remember_atr_apptype (int slot, apptype_t apptype)
+{
+  unsigned char *atr;
+  size_t atrlen;
+  int i;
+
+  atr = apdu_get_atr (slot, &atrlen);
+  if (!atr)
+    return;
+  if (atrlen <= sizeof known_atrs[0].atr)
+    {
+      for (i=0; i < DIM (known_atrs); i++)
+        if (known_atrs[i].atrlen == atrlen
+            && !memcmp (known_atrs[i].atr, atr, atrlen))
+          break;
+      if (i == DIM (known_atrs))
+        {
+          i = known_atrs_next;
+          known_atrs_next = (known_atrs_next + 1) % DIM (known_atrs);
+          memcpy (known_atrs[i].atr, atr, atrlen);
+          known_atrs[i].atrlen = atrlen;
+        }
+      known_atrs[i].apptype = apptype;
+    }
+  xfree (atr);
+}
+
+
 static gpg_error_t
 app_new_register (int slot, ctrl_t ctrl, const char *name,
                   int periodical_check_needed)
@@ -429,6 +664,7 @@ app_new_register (int slot, ctrl_t ctrl, const char *name,
   unsigned char *result = NULL;
   size_t resultlen;
   int want_undefined;
+  apptype_t known_apptype;
   int i;
 
   /* Need to allocate a new card object  */
@@ -613,6 +849,23 @@ app_new_register (int slot, ctrl_t ctrl, const char *name,
       err = gpg_error (GPG_ERR_NOT_FOUND);
     }
 
+  /* If we have seen a card with the same ATR before, try the
+   * application selected for it first.  */
+  known_apptype = (err && !name)? lookup_atr_apptype (slot) : APPTYPE_NONE;
+  for (i=0; known_apptype && app_priority_list[i].name; i++)
+    if (app_priority_list[i].apptype == known_apptype)
+      {
+        if (is_app_allowed (app_priority_list[i].name))
+          {
+            if (opt.verbose)
+              log_info ("trying application '%s' used for this ATR\n",
+                        app_priority_list[i].name);
+            if (!app_priority_list[i].select_func (app))
+              err = 0;
+          }
+        break;
+      }
+
   /* Find the first available app if NAME is NULL or the matching
    * NAME but only if that application is also enabled.  */
   for (i=0; err && app_priority_list[i].name; i++)
@@ -639,6 +892,9 @@ app_new_register (int slot, ctrl_t ctrl, const char *name,
       return err;
     }
 
+  if (app->apptype && app->apptype != APPTYPE_UNDEFINED)
+    remember_atr_apptype (slot, app->apptype);
+
   card->periodical_check_needed = periodical_check_needed;
   card->next = card_top;
   card_top = card;
@@ -1020,6 +1276,42 @@ get_supported_applications (void)
 }
 
 
+/* Return a malloced string with the statistics about the APDU traffic
+ * of all cards and the operations done.  One item per line, fields
+ * delimited by colons:
+ *
+ *   reader:SLOT:APDUS:ERRORS:SENT:RECEIVED:USEC:MAXUSEC:LOCKUSEC
+ *   op:NAME:COUNT:ERRORS:APDUS:USEC:LOCKUSEC
+ *
+ * Returns NULL on error.  Because nPth does not switch threads while
+ * we are building the string there is no need to lock the list of
+ * cards.  */
+char *
+app_get_stats (void)
+{
+  membuf_t mb;
+  struct apdu_stats_s stats;
+  card_t c;
+  int idx;
+
+  init_membuf (&mb, 512);
+  for (c = card_top; c; c = c->next)
+    if (!apdu_get_stats (c->slot, &stats))
+      put_membuf_printf (&mb, "reader:%d:%lu:%lu:%llu:%llu:%llu:%llu:%llu\n",
+                         c->slot, stats.apdus, stats.errors,
+                         stats.bytes_sent, stats.bytes_received,
+                         stats.card_time, stats.card_time_max,
+                         stats.lock_time);
+  for (idx=0; idx < DIM (op_stats); idx++)
+    put_membuf_printf (&mb, "op:%s:%lu:%lu:%lu:%llu:%llu\n",
+                       op_stats[idx].name, op_stats[idx].count,
+                       op_stats[idx].errors, op_stats[idx].apdus,
+                       op_stats[idx].time, op_stats[idx].lock_time);
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
+
+
 /* Deallocate the application.  */
 static void
 deallocate_card (card_t card)
@@ -1445,6 +1737,7 @@ app_readcert (card_t card, ctrl_t ctrl, const char *certid,
       err = card->app->fnc.readcert (card->app, certid, cert, certlen);
     }
 
+  account_op (card, OP_READCERT, err);
   unlock_card (card);
   return err;
 }
@@ -1487,6 +1780,7 @@ app_readkey (card_t card, ctrl_t ctrl, const char *keyid, unsigned int flags,
       err = card->app->fnc.readkey (card->app, ctrl, keyid, flags, pk, pklen);
     }
 
+  account_op (card, OP_READKEY, err);
   unlock_card (card);
   return err;
 }
@@ -1537,6 +1831,7 @@ app_getattr (card_t card, ctrl_t ctrl, const char *name)
       err = card->app->fnc.getattr (card->app, ctrl, name);
     }
 
+  account_op (card, OP_GETATTR, err);
   unlock_card (card);
   return err;
 }
@@ -1568,6 +1863,9 @@ app_setattr (card_t card, ctrl_t ctrl, const char *name,
                    card->slot, xstrapptype (card->app), name);
       err = card->app->fnc.setattr (card->app, ctrl, name, pincb, pincb_arg,
                                     value, valuelen);
+      /* A new key attribute deletes the key.  */
+      if (!strcmp (name, "KEY-ATTR"))
+        forget_known_keys (card);
     }
 
   unlock_card (card);
@@ -1608,6 +1906,7 @@ app_sign (card_t card, ctrl_t ctrl, const char *keyidstr, int hashalgo,
                                  outdata, outdatalen);
     }
 
+  account_op (card, OP_SIGN, err);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation sign result: %s\n", gpg_strerror (err));
@@ -1649,6 +1948,7 @@ app_auth (card_t card, ctrl_t ctrl, const char *keyidstr,
                                  outdata, outdatalen);
     }
 
+  account_op (card, OP_AUTH, err);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation auth result: %s\n", gpg_strerror (err));
@@ -1693,6 +1993,7 @@ app_decipher (card_t card, ctrl_t ctrl, const char *keyidstr,
                                      r_info);
     }
 
+  account_op (card, OP_DECIPHER, err);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation decipher result: %s\n", gpg_strerror (err));
@@ -1763,8 +2064,10 @@ app_writekey (card_t card, ctrl_t ctrl,
                    card->slot, xstrapptype (card->app), keyidstr);
       err = card->app->fnc.writekey (card->app, ctrl, keyidstr, flags,
                                      pincb, pincb_arg, keydata, keydatalen);
+      forget_known_keys (card);
     }
 
+  account_op (card, OP_WRITEKEY, err);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation writekey result: %s\n", gpg_strerror (err));
@@ -1798,8 +2101,10 @@ app_genkey (card_t card, ctrl_t ctrl, const char *keynostr,
                    card->slot, xstrapptype (card->app), keynostr);
       err = card->app->fnc.genkey (card->app, ctrl, keynostr, keytype, flags,
                                    createtime, pincb, pincb_arg);
+      forget_known_keys (card);
     }
 
+  account_op (card, OP_GENKEY, err);
   unlock_card (card);
   if (opt.verbose)
     log_info ("operation genkey result: %s\n", gpg_strerror (err));
@@ -1976,9 +2281,17 @@ scd_update_reader_status_file (void)
       int sw;
       unsigned int status;
 
-      lock_card (card, NULL);
       card_next = card->next;
 
+      /* Do not wait for a card used by a connection because that
+       * would also block all connections using other cards.  The
+       * card is checked again at the next tick.  */
+      if (trylock_card (card, NULL))
+        {
+          periodical_check_needed = 1;
+          continue;
+        }
+
       if (card->reset_requested)
         status = 0;
       else
@@ -2233,6 +2546,53 @@ app_switch_active_app (card_t card, ctrl_t ctrl, const char *appname)
 }
 
 
+/* Helper for app_do_with_keygrip to execute ACTION for each app of
+ * the locked CARD.  Returns true and stores the app at R_APP if
+ * KEYGRIP_STR was found.  */
+static int
+with_keygrip_card (card_t card, ctrl_t ctrl, int action,
+                   const char *keygrip_str, int capability, app_t *r_app)
+{
+  app_t a, a_prev = NULL;
+
+  for (a = card->app; a; a = a->next)
+    {
+      if (!a->fnc.with_keygrip)
+        continue;
+
+      /* Note that we need to do a re-select even for the current
+       * app because the last selected application (e.g. after
+       * init) might be a different one and we do not run
+       * maybe_switch_app here.  Of course we we do this only iff
+       * we have an additional app. */
+      if (card->app->next)
+        {
+          if (run_reselect (ctrl, card, a, a_prev))
+            continue;
+        }
+      a_prev = a;
+
+      if (DBG_APP)
+        log_debug ("slot %d, app %s: calling with_keygrip(%s)\n",
+                   card->slot, xstrapptype (a),
+                   action == KEYGRIP_ACTION_SEND_DATA? "send_data":
+                   action == KEYGRIP_ACTION_WRITE_STATUS? "status":
+                   action == KEYGRIP_ACTION_LOOKUP? "lookup":"?");
+      if (!a->fnc.with_keygrip (a, ctrl, action, keygrip_str, capability))
+        {
+          *r_app = a;
+          return 1;  /* ACTION_LOOKUP succeeded.  */
+        }
+    }
+
+  /* Select the first app again.  */
+  if (card->app->next)
+    run_reselect (ctrl, card, card->app, a_prev);
+
+  return 0;
+}
+
+
 /* Execute an action for each app.  ACTION can be one of:
  *
  * - KEYGRIP_ACTION_SEND_DATA
@@ -2262,67 +2622,60 @@ card_t
 app_do_with_keygrip (ctrl_t ctrl, int action, const char *keygrip_str,
                      int capability)
 {
-  int locked = 0;
   card_t c;
-  app_t a, a_prev;
+  app_t a = NULL;
+  apptype_t apptype;
 
   npth_mutex_lock (&card_list_lock);
 
+  /* Try the card we already know has the key.  For a lookup there is
+   * no need to ask the card; in particular we do not need to wait for
+   * the card if another connection is using it.  */
+  if (keygrip_str && (c = find_known_key (keygrip_str, &apptype)))
+    {
+      if (action == KEYGRIP_ACTION_LOOKUP)
+        {
+          if (c->app && c->app->apptype != apptype)
+            ctrl->current_apptype = apptype;
+          goto leave;
+        }
+
+      if (lock_card (c, ctrl))
+        {
+          c = NULL;
+          goto leave;
+        }
+      if (with_keygrip_card (c, ctrl, action, keygrip_str, capability, &a))
+        goto found;
+      forget_known_key (c, keygrip_str);
+      unlock_card (c);
+    }
+
   for (c = card_top; c; c = c->next)
     {
       if (lock_card (c, ctrl))
         {
           c = NULL;
-          goto leave_the_loop;
+          goto leave;
         }
-      locked = 1;
-      a_prev = NULL;
-      for (a = c->app; a; a = a->next)
+      if (with_keygrip_card (c, ctrl, action, keygrip_str, capability, &a))
         {
-          if (!a->fnc.with_keygrip)
-            continue;
-
-          /* Note that we need to do a re-select even for the current
-           * app because the last selected application (e.g. after
-           * init) might be a different one and we do not run
-           * maybe_switch_app here.  Of course we we do this only iff
-           * we have an additional app. */
-          if (c->app->next)
-            {
-              if (run_reselect (ctrl, c, a, a_prev))
-                continue;
-            }
-          a_prev = a;
-
-          if (DBG_APP)
-            log_debug ("slot %d, app %s: calling with_keygrip(%s)\n",
-                       c->slot, xstrapptype (a),
-                       action == KEYGRIP_ACTION_SEND_DATA? "send_data":
-                       action == KEYGRIP_ACTION_WRITE_STATUS? "status":
-                       action == KEYGRIP_ACTION_LOOKUP? "lookup":"?");
-          if (!a->fnc.with_keygrip (a, ctrl, action, keygrip_str, capability))
-            goto leave_the_loop; /* ACTION_LOOKUP succeeded.  */
+          if (keygrip_str)
+            remember_known_key (c, keygrip_str, a->apptype);
+          goto found;
         }
-
-      /* Select the first app again.  */
-      if (c->app->next)
-        run_reselect (ctrl, c, c->app, a_prev);
-
       unlock_card (c);
-      locked = 0;
     }
+  goto leave;
 
- leave_the_loop:
+ found:
   /* Force switching of the app if the selected one is not the current
    * one.  Changing the current apptype is sufficient to do this.  */
-  if (c && c->app && c->app->apptype != a->apptype)
+  if (c->app && c->app->apptype != a->apptype)
     ctrl->current_apptype = a->apptype;
+  unlock_card (c);
 
-  if (locked && c)
-    {
-      unlock_card (c);
-      locked = 0;
-    }
+ leave:
   npth_mutex_unlock (&card_list_lock);
   return c;
 }
@@ -288,3 +288,63 @@ atr_dump (const void *buffer, size_t buflen)
 
   return result;
 }
+
+
+/* Return true if the ATR in (BUFFER,BUFLEN) indicates that the card
+   supports extended Lc and Le fields.  This is taken from the card
+   capabilities in the historical bytes (ISO 7816-4, 8.1.1.2.7).  */
+int
+atr_extended_length_p (const void *buffer, size_t buflen)
+{
+  const unsigned char *atr = buffer;
+  size_t idx;
+  int n_historical, y;
+  const unsigned char *hist;
+  size_t histlen;
+
+  if (buflen < 2 || (*atr != 0x3b && *atr != 0x3f))
+    return 0;
+  n_historical = (atr[1] & 0x0f);
+  y = atr[1];
+  idx = 2;
+  for (;;)
+    {
+      idx += !!(y & 0x10) + !!(y & 0x20) + !!(y & 0x40);
+      if (!(y & 0x80))
+        break;
+      if (idx >= buflen)
+        return 0;
+      y = atr[idx++];
+    }
+  if (idx + n_historical > buflen)
+    return 0;
+  hist = atr + idx;
+  histlen = n_historical;
+
+  /* We only understand the compact-TLV formats.  With a category
+     indicator of 0 the last 3 bytes are the status indicator.  */
+  if (histlen < 1 || (*hist != 0x00 && *hist != 0x80))
+    return 0;
+  if (!*hist)
+    {
+      if (histlen < 4)
+        return 0;
+      histlen -= 3;
+    }
+  hist++;
+  histlen--;
+
+  while (histlen)
+    {
+      unsigned int tag = (*hist >> 4);
+      unsigned int len = (*hist & 0x0f);
+
+      if (len + 1 > histlen)
+        return 0;
+      if (tag == 7 && len >= 3)
+        return !!(hist[3] & 0x40);  /* Card capabilities.  */
+      hist += len + 1;
+      histlen -= len + 1;
+    }
+  return 0;
+}
@@ -21,6 +21,7 @@
 #define ATR_H
 
 char *atr_dump (const void *buffer, size_t buflen);
+int atr_extended_length_p (const void *buffer, size_t buflen);
 
 
 
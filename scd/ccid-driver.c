@@ -108,6 +108,11 @@
 */
 #define CCID_MAX_BUF (2048+7+10)
 
+/* The maximum size of a CCID message used for APDU level exchanges.
+   This is large enough for an extended length APDU with the CCID
+   header.  */
+#define CCID_MAX_EXTBUF (65544+10)
+
 /* CCID command timeout.  */
 #define CCID_CMD_TIMEOUT (5*1000)
 
@@ -1698,6 +1703,18 @@ ccid_open_reader (const char *spec_reader_name, int idx,
 }
 
 
+/* Return true if extended length APDUs can be sent to the reader
+   HANDLE.  This is not the case for readers which only support short
+   APDU level exchanges.  */
+int
+ccid_extended_length_p (ccid_driver_t handle)
+{
+  if (handle->apdu_level == 1)
+    return handle->id_vendor == VENDOR_OMNIKEY; /* Via escape TPDUs.  */
+  return 1;
+}
+
+
 int
 ccid_require_get_status (ccid_driver_t handle)
 {
@@ -2860,7 +2877,8 @@ ccid_transceive_apdu_level (ccid_driver_t handle,
                             size_t *nresp)
 {
   int rc;
-  unsigned char msg[CCID_MAX_BUF];
+  unsigned char *msg;
+  size_t msgsize;
   const unsigned char *apdu_p;
   size_t apdu_part_len;
   size_t msglen;
@@ -2868,16 +2886,29 @@ ccid_transceive_apdu_level (ccid_driver_t handle,
   int bwi = 0;
   unsigned char chain = 0;
 
-  if (apdu_len == 0 || apdu_len > sizeof (msg) - 10)
+  if (apdu_len == 0 || apdu_len > CCID_MAX_EXTBUF - 10)
     return CCID_DRIVER_ERR_INV_VALUE; /* Invalid length. */
 
+  /* Use the largest message the reader supports so that an extended
+     length APDU and its response need only one transfer.  */
+  msgsize = handle->max_ccid_msglen;
+  if (msgsize < CCID_MAX_BUF)
+    msgsize = CCID_MAX_BUF;
+  else if (msgsize > CCID_MAX_EXTBUF)
+    msgsize = CCID_MAX_EXTBUF;
+  msg = malloc (msgsize);
+  if (!msg)
+    return CCID_DRIVER_ERR_OUT_OF_CORE;
+
   apdu_p = apdu_buf;
   while (1)
     {
       apdu_part_len = apdu_len;
-      if (apdu_part_len > handle->max_ccid_msglen - 10)
+      if (apdu_part_len > handle->max_ccid_msglen - 10
+          || apdu_part_len > msgsize - 10)
         {
-          apdu_part_len = handle->max_ccid_msglen - 10;
+          apdu_part_len = (handle->max_ccid_msglen < msgsize?
+                           handle->max_ccid_msglen : msgsize) - 10;
           chain |= 0x01;
         }
 
@@ -2893,15 +2924,15 @@ ccid_transceive_apdu_level (ccid_driver_t handle,
 
       rc = bulk_out (handle, msg, msglen, 0);
       if (rc)
-        return rc;
+        goto leave;
 
       apdu_p += apdu_part_len;
       apdu_len -= apdu_part_len;
 
-      rc = bulk_in (handle, msg, sizeof msg, &msglen,
+      rc = bulk_in (handle, msg, msgsize, &msglen,
                     RDR_to_PC_DataBlock, seqno, CCID_CMD_TIMEOUT, 0);
       if (rc)
-        return rc;
+        goto leave;
 
       if (!(chain & 0x01))
         break;
@@ -2931,12 +2962,12 @@ ccid_transceive_apdu_level (ccid_driver_t handle,
 
       rc = bulk_out (handle, msg, msglen, 0);
       if (rc)
-        return rc;
+        goto leave;
 
-      rc = bulk_in (handle, msg, sizeof msg, &msglen,
+      rc = bulk_in (handle, msg, msgsize, &msglen,
                     RDR_to_PC_DataBlock, seqno, CCID_CMD_TIMEOUT, 0);
       if (rc)
-        return rc;
+        goto leave;
     }
 
   if (resp)
@@ -2946,13 +2977,17 @@ ccid_transceive_apdu_level (ccid_driver_t handle,
           DEBUGOUT_2 ("provided buffer too short for received data "
                       "(%u/%u)\n",
                       (unsigned int)apdu_len, (unsigned int)maxresplen);
-          return CCID_DRIVER_ERR_INV_VALUE;
+          rc = CCID_DRIVER_ERR_INV_VALUE;
+          goto leave;
         }
 
       *nresp = apdu_len;
     }
+  rc = 0;
 
-  return 0;
+ leave:
+  free (msg);
+  return rc;
 }
 
 
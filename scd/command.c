@@ -41,6 +41,7 @@
 #endif
 #include "../common/asshelp.h"
 #include "../common/server-help.h"
+#include "../common/metrics.h"
 
 /* Maximum length allowed as a PIN; used for INQUIRE NEEDPIN.  That
  * length needs to small compared to the maximum Assuan line length.  */
@@ -97,6 +98,9 @@ struct server_local_s
 
   /* If set to true, status change will be reported. */
   unsigned int watching_status:1;
+
+  /* The current request for the metrics and traces.  */
+  struct metric_request_s request;
 };
 
 
@@ -203,6 +207,11 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
       ctrl->server_local->event_signal = i;
 #endif
     }
+  else if (!strcmp (key, "trace-id"))
+    {
+      return metric_request_set_trace_id (&ctrl->server_local->request,
+                                          value);
+    }
 
  return 0;
 }
@@ -834,6 +843,7 @@ static gpg_error_t
 pin_cb (void *opaque, const char *info, char **retstr)
 {
   assuan_context_t ctx = opaque;
+  ctrl_t ctrl;
   char *command;
   int rc;
   unsigned char *value;
@@ -867,6 +877,12 @@ pin_cb (void *opaque, const char *info, char **retstr)
   *retstr = NULL;
   log_debug ("asking for PIN '%s'\n", info);
 
+  /* Do not keep the card acquired while the user is typing; Windows
+   * resets a card if a transaction is idle for more than 5 seconds.  */
+  ctrl = assuan_get_pointer (ctx);
+  if (ctrl && ctrl->card_ctx)
+    apdu_end_transaction (ctrl->card_ctx->slot);
+
   rc = gpgrt_asprintf (&command, "NEEDPIN %s", info);
   if (rc < 0)
     return gpg_error (gpg_err_code_from_errno (errno));
@@ -1716,7 +1732,12 @@ static const char hlp_getinfo[] =
   "  all_active_apps\n"
   "              - Return a list of active apps on all inserted cards.\n"
   "  cmd_has_option CMD OPT\n"
-  "               - Returns OK if command CMD has option OPT.\n";
+  "               - Returns OK if command CMD has option OPT.\n"
+  "  stats       - Return statistics about the APDU traffic of all\n"
+  "                readers and the operations done.  One item per line,\n"
+  "                fields delimited by colons, first field is either\n"
+  "                \"reader\" or \"op\".  Times are given in microseconds.\n"
+  "  metrics     - Return the performance counters.\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
@@ -1819,6 +1840,24 @@ cmd_getinfo (assuan_context_t ctx, char *line)
         rc = 0;
       xfree (s);
     }
+  else if (!strcmp (line, "stats"))
+    {
+      char *s = app_get_stats ();
+      if (s)
+        rc = assuan_send_data (ctx, s, strlen (s));
+      else
+        rc = gpg_error_from_syserror ();
+      xfree (s);
+    }
+  else if (!strcmp (line, "metrics"))
+    {
+      char *s = metrics_format ();
+      if (s)
+        rc = assuan_send_data (ctx, s, strlen (s));
+      else
+        rc = gpg_error_from_syserror ();
+      xfree (s);
+    }
   else if (!strcmp (line, "card_list"))
     {
       ctrl_t ctrl = assuan_get_pointer (ctx);
@@ -2215,6 +2254,35 @@ command_has_option (const char *cmd, const char *cmdopt)
 }
 
 
+/* Called by libassuan before all commands.  */
+static gpg_error_t
+pre_cmd_notify (assuan_context_t ctx, const char *cmd)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  metric_request_begin (&ctrl->server_local->request, cmd);
+  return 0;
+}
+
+
+/* Called by libassuan after all commands.  */
+static void
+post_cmd_notify (assuan_context_t ctx, gpg_error_t err)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  metric_request_end (&ctrl->server_local->request, err);
+}
+
+
+static uint64_t
+connection_count (void)
+{
+  return get_active_connection_count ();
+}
+METRIC_DEFINE_FUNC (m_connections, "connections", connection_count);
+
+
 /* Tell the assuan library about our commands */
 static int
 register_commands (assuan_context_t ctx)
@@ -2266,8 +2334,11 @@ register_commands (assuan_context_t ctx)
     }
   assuan_set_hello_line (ctx, "GNU Privacy Guard's Smartcard server ready");
 
+  assuan_register_pre_cmd_notify (ctx, pre_cmd_notify);
+  assuan_register_post_cmd_notify (ctx, post_cmd_notify);
   assuan_register_reset_notify (ctx, reset_notify);
   assuan_register_option_handler (ctx, option_handler);
+  metric_register (&m_connections);
   return 0;
 }
 
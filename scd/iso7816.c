@@ -895,7 +895,18 @@ iso7816_read_binary_ext (int slot, int extended_mode,
     {
       buffer = NULL;
       bufferlen = 0;
-      n = read_all? 0 : nmax;
+      if (!read_all)
+        n = nmax;
+      else if (extended_mode > 0)
+        {
+          /* Le=0 would ask for 65536 bytes; we can't read beyond
+             offset 32767 anyway.  */
+          n = 32768 - offset;
+          if (extended_mode > 1 && n > extended_mode)
+            n = extended_mode;
+        }
+      else
+        n = 0;
       sw = apdu_send_le (slot, extended_mode, 0x00, CMD_READ_BINARY,
                          ((offset>>8) & 0xff), (offset & 0xff) , -1, NULL,
                          n, &buffer, &bufferlen);
@@ -966,6 +977,26 @@ gpg_error_t
 iso7816_read_binary (int slot, size_t offset, size_t nmax,
                      unsigned char **result, size_t *resultlen)
 {
+  gpg_error_t err;
+  unsigned int maxlen;
+
+  /* Use extended length APDUs if the card and the reader support
+     them; reading a certificate then takes one APDU instead of one
+     for each 256 bytes.  */
+  maxlen = apdu_get_max_extlen (slot);
+  if (maxlen > 256 && (!nmax || nmax > 256))
+    {
+      err = iso7816_read_binary_ext (slot, maxlen, offset, nmax,
+                                     result, resultlen);
+      if (gpg_err_code (err) != GPG_ERR_INV_VALUE
+          && gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+        return err;
+
+      /* The card announced extended length support but failed to
+         work with it.  Don't try again.  */
+      apdu_disable_extlen (slot);
+    }
+
   return iso7816_read_binary_ext (slot, 0, offset, nmax, result, resultlen);
 }
 
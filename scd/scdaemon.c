@@ -216,15 +216,13 @@ static struct debug_flags_s debug_flags [] =
    change.
 
    For a card reader with an interrupt endpoint, this timer is not
-   used with the internal CCID driver.
-
-   This is not too good for power saving but given that there is no
-   easy way to block on card status changes it is the best we can do.
-   For PC/SC we could in theory use an extra thread to wait for status
-   changes but that requires a native thread because there is no way
-   to make the underlying PC/SC card change function block using a Npth
-   mechanism.  Given that a native thread could only be used under W32
-   we don't do that at all.  */
+   used with the internal CCID driver.  For PC/SC readers a thread in
+   apdu.c waits for status changes and kicks the loop; the timer is
+   then only used if that thread could not be started.
+
+   The timer is thus only required for CCID readers without an
+   interrupt endpoint; there is no way to learn about a card removal
+   for those readers without asking them.  */
 #define TIMERTICK_INTERVAL_SEC     (0)
 #define TIMERTICK_INTERVAL_USEC    (500000)
 
@@ -36,6 +36,7 @@
 #include "../kbx/keybox.h" /* for KEYBOX_FLAG_* */
 #include "../common/i18n.h"
 #include "../common/tlv.h"
+#include "../common/host2net.h"
 
 
 /* Object to keep track of certain root certificates. */
@@ -58,6 +59,52 @@ struct chain_item_s
 typedef struct chain_item_s *chain_item_t;
 
 
+/* Cache of successfully validated chains.  A gateway verifying many
+   messages from the same senders would otherwise look up the chain,
+   check all signatures and ask the dirmngr for each message.  The
+   entries are keyed by the fingerprint of the target certificate and
+   the parameters of the validation; they are used until the first
+   certificate of the chain expires but at most for
+   opt.validation_cache_ttl seconds.  */
+#define CHAIN_CACHE_BUCKETS 64
+#define CHAIN_CACHE_MAX     512
+
+struct chain_cache_item_s
+{
+  struct chain_cache_item_s *next;
+  unsigned char fpr[20];    /* SHA-1 fingerprint of the target cert.  */
+  unsigned int flags;       /* The VALIDATE_FLAG_* used.  */
+  int use_ocsp;             /* The CTRL's use_ocsp and offline flags.  */
+  int offline;
+  ksba_isotime_t checktime; /* The check time for the chain model.  */
+  time_t expires;           /* The entry may not be used after this.  */
+  ksba_isotime_t exptime;   /* The expiration time of the chain.  */
+  unsigned int retflags;    /* The flags returned by the validation.  */
+};
+typedef struct chain_cache_item_s *chain_cache_item_t;
+
+static chain_cache_item_t chain_cache[CHAIN_CACHE_BUCKETS];
+static unsigned int chain_cache_count;
+
+
+/* Cache of successful revocation checks of CA certificates.  A
+   listing of many certificates with validation checks the same
+   intermediate and root certificates for each listed certificate;
+   this cache avoids asking the dirmngr again.  It is only active
+   between gpgsm_begin_validation_batch and
+   gpgsm_end_validation_batch.  */
+struct ca_status_item_s
+{
+  struct ca_status_item_s *next;
+  unsigned char fpr[20];    /* SHA-1 fingerprint of the CA cert.  */
+  int mode;                 /* The OCSP mode used for the check.  */
+};
+typedef struct ca_status_item_s *ca_status_item_t;
+
+static ca_status_item_t ca_status_cache[CHAIN_CACHE_BUCKETS];
+static int ca_status_batch;
+
+
 static int is_root_cert (ksba_cert_t cert,
                          const char *issuerdn, const char *subjectdn);
 static int get_regtp_ca_info (ctrl_t ctrl, ksba_cert_t cert, int *chainlen);
@@ -143,6 +190,75 @@ compare_certs (ksba_cert_t a, ksba_cert_t b)
 }
 
 
+/* Return the stamp used to remember in the keybox that the signature
+   of a certificate has been verified using ISSUER_CERT.  This is the
+   first 4 bytes of the issuer's fingerprint; a stamp of 0 is used by
+   the keybox for "not checked" and thus mapped to 1.  */
+static u32
+issuer_sig_stamp (ksba_cert_t issuer_cert)
+{
+  unsigned char fpr[20];
+  u32 stamp;
+
+  if (!gpgsm_get_fingerprint (issuer_cert, 0, fpr, NULL))
+    return 0;
+  stamp = buf32_to_u32 (fpr);
+  return stamp? stamp : 1;
+}
+
+
+/* Check the signature on CERT using ISSUER_CERT like
+   gpgsm_check_cert_sig does but skip the public key operation if a
+   previous check with the same issuer has been recorded in the
+   keybox.  keydb_get_cert attaches the recorded stamp to the
+   certificate as user data "sig-stamp"; certificates not taken from
+   the keybox have no stamp and are always checked.  The stamp merely
+   identifies a certificate which already passed a check; the issuer
+   certificate itself is still validated by the caller.  */
+static int
+check_cert_sig (ctrl_t ctrl, ksba_cert_t issuer_cert, ksba_cert_t cert)
+{
+  unsigned char buf[4];
+  size_t buflen;
+  u32 stamp;
+  int rc;
+
+  stamp = issuer_sig_stamp (issuer_cert);
+  if (stamp
+      && !ksba_cert_get_user_data (cert, "sig-stamp", buf, sizeof buf,
+                                   &buflen)
+      && buflen == 4)
+    {
+      if (buf32_to_u32 (buf) == stamp)
+        {
+          if (DBG_X509)
+            log_debug ("signature already verified according to keybox\n");
+          return 0;
+        }
+    }
+  else
+    stamp = 0;  /* Not from the keybox - nothing to record.  */
+
+  rc = gpgsm_check_cert_sig (issuer_cert, cert);
+  if (!rc && stamp)
+    {
+      /* The keybox may be read-only; thus errors are not fatal.  */
+      if (keydb_set_cert_flags (ctrl, cert, 1, KEYBOX_FLAG_SIG_INFO, 0,
+                                ~0U, stamp))
+        log_info ("error recording the signature check in the keybox\n");
+      else
+        {
+          buf[0] = stamp >> 24;
+          buf[1] = stamp >> 16;
+          buf[2] = stamp >> 8;
+          buf[3] = stamp;
+          ksba_cert_set_user_data (cert, "sig-stamp", buf, 4);
+        }
+    }
+  return rc;
+}
+
+
 /* Return true if CERT has the validityModel extensions and defines
    the use of the chain model.  */
 static int
@@ -1040,6 +1156,79 @@ gpgsm_is_root_cert (ksba_cert_t cert)
 }
 
 
+/* Start a batch of validations, for example a key listing.  Within
+   a batch the successful revocation checks of CA certificates are
+   cached.  Batches may be nested.  */
+void
+gpgsm_begin_validation_batch (void)
+{
+  ca_status_batch++;
+}
+
+
+/* End a batch of validations started with
+   gpgsm_begin_validation_batch.  */
+void
+gpgsm_end_validation_batch (void)
+{
+  ca_status_item_t ci;
+  int i;
+
+  if (!ca_status_batch || --ca_status_batch)
+    return;
+
+  for (i=0; i < CHAIN_CACHE_BUCKETS; i++)
+    while ((ci = ca_status_cache[i]))
+      {
+        ca_status_cache[i] = ci->next;
+        xfree (ci);
+      }
+}
+
+
+/* Return true if CERT is a CA certificate whose revocation check in
+   MODE succeeded in the current batch.  FPR receives the fingerprint
+   of CERT; it is set to all zeroes if CERT shall not be cached.  */
+static int
+ca_status_cache_find (ksba_cert_t cert, int mode, unsigned char *fpr)
+{
+  ca_status_item_t ci;
+  int is_ca;
+
+  memset (fpr, 0, 20);
+  if (!ca_status_batch)
+    return 0;
+  if (ksba_cert_is_ca (cert, &is_ca, NULL) || !is_ca)
+    return 0;
+  if (!gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL))
+    return 0;
+  for (ci = ca_status_cache[*fpr % CHAIN_CACHE_BUCKETS]; ci; ci = ci->next)
+    if (!memcmp (ci->fpr, fpr, 20) && ci->mode == mode)
+      return 1;
+  return 0;
+}
+
+
+/* Store the successful revocation check of the CA certificate with
+   the fingerprint FPR in MODE.  */
+static void
+ca_status_cache_put (const unsigned char *fpr, int mode)
+{
+  static const unsigned char zeroes[20];
+  ca_status_item_t ci;
+
+  if (!ca_status_batch || !memcmp (fpr, zeroes, 20))
+    return;
+  ci = xtrycalloc (1, sizeof *ci);
+  if (!ci)
+    return;
+  memcpy (ci->fpr, fpr, 20);
+  ci->mode = mode;
+  ci->next = ca_status_cache[*fpr % CHAIN_CACHE_BUCKETS];
+  ca_status_cache[*fpr % CHAIN_CACHE_BUCKETS] = ci;
+}
+
+
 /* This is a helper for gpgsm_validate_chain. */
 static gpg_error_t
 is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
@@ -1047,6 +1236,8 @@ is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
                      int *any_revoked, int *any_no_crl, int *any_crl_too_old)
 {
   gpg_error_t err;
+  int mode;
+  unsigned char fpr[20];
 
   if (ctrl->offline || (opt.no_crl_check && !ctrl->use_ocsp))
     {
@@ -1073,10 +1264,17 @@ is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
         }
     }
 
-  err = gpgsm_dirmngr_isvalid (ctrl,
-                               subject_cert, issuer_cert,
-                               force_ocsp? 2 : !!ctrl->use_ocsp);
+  mode = force_ocsp? 2 : !!ctrl->use_ocsp;
+  if (ca_status_cache_find (subject_cert, mode, fpr))
+    {
+      audit_log_ok (ctrl->audit, AUDIT_CRL_CHECK, 0);
+      return 0;
+    }
+
+  err = gpgsm_dirmngr_isvalid (ctrl, subject_cert, issuer_cert, mode);
   audit_log_ok (ctrl->audit, AUDIT_CRL_CHECK, err);
+  if (!err)
+    ca_status_cache_put (fpr, mode);
 
   if (err)
     {
@@ -1122,6 +1320,90 @@ is_cert_still_valid (ctrl_t ctrl, int force_ocsp, int lm, estream_t fp,
 }
 
 
+/* Return the cache entry of the validated chain of CERT for the
+ * parameters CTRL, CHECKTIME and FLAGS or NULL if there is none.  */
+static chain_cache_item_t
+chain_cache_find (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
+                  unsigned int flags, unsigned char *fpr)
+{
+  chain_cache_item_t ci;
+
+  if (!gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL))
+    return NULL;
+  for (ci = chain_cache[*fpr % CHAIN_CACHE_BUCKETS]; ci; ci = ci->next)
+    if (!memcmp (ci->fpr, fpr, 20)
+        && ci->flags == flags
+        && ci->use_ocsp == !!ctrl->use_ocsp
+        && ci->offline == !!ctrl->offline
+        && (!(flags & VALIDATE_FLAG_CHAIN_MODEL)
+            || !strcmp (ci->checktime, checktime)))
+      return ci;
+  return NULL;
+}
+
+
+/* Remove all entries from the chain cache which expired at NOW.  If
+ * NOW is 0 all entries are removed.  */
+static void
+chain_cache_purge (time_t now)
+{
+  chain_cache_item_t ci, *cip;
+  int i;
+
+  for (i=0; i < CHAIN_CACHE_BUCKETS; i++)
+    for (cip = &chain_cache[i]; (ci = *cip); )
+      if (!now || ci->expires <= now)
+        {
+          *cip = ci->next;
+          xfree (ci);
+          chain_cache_count--;
+        }
+      else
+        cip = &ci->next;
+}
+
+
+/* Store the successful validation of CERT in the chain cache.  */
+static void
+chain_cache_put (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
+                 unsigned int flags, const ksba_isotime_t exptime,
+                 unsigned int retflags)
+{
+  chain_cache_item_t ci;
+  unsigned char fpr[20];
+  time_t now, t;
+
+  now = gnupg_get_time ();
+  ci = chain_cache_find (ctrl, cert, checktime, flags, fpr);
+  if (!ci)
+    {
+      if (chain_cache_count >= CHAIN_CACHE_MAX)
+        chain_cache_purge (now);
+      if (chain_cache_count >= CHAIN_CACHE_MAX)
+        chain_cache_purge (0);
+      ci = xtrycalloc (1, sizeof *ci);
+      if (!ci)
+        return;
+      memcpy (ci->fpr, fpr, 20);
+      ci->flags = flags;
+      ci->use_ocsp = !!ctrl->use_ocsp;
+      ci->offline = !!ctrl->offline;
+      if ((flags & VALIDATE_FLAG_CHAIN_MODEL))
+        gnupg_copy_time (ci->checktime, checktime);
+      ci->next = chain_cache[*fpr % CHAIN_CACHE_BUCKETS];
+      chain_cache[*fpr % CHAIN_CACHE_BUCKETS] = ci;
+      chain_cache_count++;
+    }
+
+  ci->expires = now + opt.validation_cache_ttl;
+  if (*exptime && (t = isotime2epoch (exptime)) != (time_t)(-1)
+      && t < ci->expires)
+    ci->expires = t;
+  gnupg_copy_time (ci->exptime, exptime);
+  ci->retflags = retflags;
+}
+
+
 /* Helper for gpgsm_validate_chain to check the validity period of
    SUBJECT_CERT.  The caller needs to pass EXPTIME which will be
    updated to the nearest expiration time seen.  A DEPTH of 0 indicates
@@ -1691,7 +1973,7 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
           gpgsm_dump_cert ("issuer", issuer_cert);
         }
 
-      rc = gpgsm_check_cert_sig (issuer_cert, subject_cert);
+      rc = check_cert_sig (ctrl, issuer_cert, subject_cert);
       if (rc)
         {
           do_list (0, listmode, listfp, _("certificate has a BAD signature"));
@@ -1983,6 +2265,11 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
   int rc;
   struct rootca_flags_s rootca_flags;
   unsigned int dummy_retflags;
+  unsigned int orig_flags;
+  int use_cache;
+  chain_cache_item_t ci;
+  unsigned char fpr[20];
+  ksba_isotime_t exptime;
 
   if (!retflags)
     retflags = &dummy_retflags;
@@ -1993,15 +2280,32 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
     flags |= VALIDATE_FLAG_CHAIN_MODEL;
   else if (ctrl->validation_model == 2)
     flags |= VALIDATE_FLAG_STEED;
+  orig_flags = flags;
+
+  /* Listings and audit logs need the details of a full validation.  */
+  use_cache = (opt.validation_cache_ttl && !listmode && !ctrl->audit
+               && !opt.no_chain_validation);
+  if (use_cache
+      && (ci = chain_cache_find (ctrl, cert, checktime, flags, fpr))
+      && ci->expires > gnupg_get_time ())
+    {
+      if (r_exptime)
+        gnupg_copy_time (r_exptime, ci->exptime);
+      *retflags = ci->retflags;
+      if (opt.verbose)
+        log_info (_("using cached result of the chain validation\n"));
+      return 0;
+    }
 
   /* If the chain model was forced, set this immediately into
      RETFLAGS.  */
   *retflags = (flags & VALIDATE_FLAG_CHAIN_MODEL);
 
   memset (&rootca_flags, 0, sizeof rootca_flags);
+  *exptime = 0;
 
   rc = do_validate_chain (ctrl, cert, checktime,
-                          r_exptime, listmode, listfp, flags,
+                          exptime, listmode, listfp, flags,
                           &rootca_flags);
   if (!rc && (flags & VALIDATE_FLAG_STEED))
     {
@@ -2013,12 +2317,17 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
     {
       do_list (0, listmode, listfp, _("switching to chain model"));
       rc = do_validate_chain (ctrl, cert, checktime,
-                              r_exptime, listmode, listfp,
+                              exptime, listmode, listfp,
                               (flags |= VALIDATE_FLAG_CHAIN_MODEL),
                               &rootca_flags);
       *retflags |= VALIDATE_FLAG_CHAIN_MODEL;
     }
 
+  if (r_exptime)
+    gnupg_copy_time (r_exptime, exptime);
+  if (!rc && use_cache)
+    chain_cache_put (ctrl, cert, checktime, orig_flags, exptime, *retflags);
+
   if (opt.verbose)
     do_list (0, listmode, listfp, _("validation model used: %s"),
              (*retflags & VALIDATE_FLAG_STEED)?
@@ -2109,7 +2418,7 @@ gpgsm_basic_cert_check (ctrl_t ctrl, ksba_cert_t cert)
           goto leave;
         }
 
-      rc = gpgsm_check_cert_sig (issuer_cert, cert);
+      rc = check_cert_sig (ctrl, issuer_cert, cert);
       if (rc)
         {
           log_error ("certificate has a BAD signature: %s\n",
@@ -274,6 +274,7 @@ gpgsm_decrypt (ctrl_t ctrl, int in_fd, estream_t out_fp)
       log_error ("fdopen() failed: %s\n", strerror (errno));
       goto leave;
     }
+  gpgsm_setup_input_stream (in_fp, in_fd);
 
   rc = gnupg_ksba_create_reader
     (&b64reader, ((ctrl->is_pem? GNUPG_KSBA_IO_PEM : 0)
@@ -56,9 +56,10 @@ struct encrypt_cb_parm_s
   int eof_seen;
   int ready;
   int readerror;
-  int bufsize;
+  size_t bufsize;
   unsigned char *buffer;
-  int buflen;
+  size_t bufstart;  /* Offset of the first unused byte in BUFFER.  */
+  size_t buflen;    /* Number of unused bytes starting at BUFSTART.  */
 };
 
 
@@ -242,45 +243,49 @@ encrypt_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
   if (count < blklen)
     BUG ();
 
-  if (!parm->eof_seen)
-    { /* fillup the buffer */
-      p = parm->buffer;
-      for (n=parm->buflen; n < parm->bufsize; n++)
+  if (!parm->eof_seen && parm->buflen < blklen)
+    { /* Refill the buffer; the remaining partial block is moved to
+         the start so that we can read a large chunk at once. */
+      if (parm->bufstart)
         {
-          int c = es_getc (parm->fp);
-          if (c == EOF)
-            {
-              if (es_ferror (parm->fp))
-                {
-                  parm->readerror = errno;
-                  return -1;
-                }
-              parm->eof_seen = 1;
-              break;
-            }
-          p[n] = c;
+          memmove (parm->buffer, parm->buffer + parm->bufstart,
+                   parm->buflen);
+          parm->bufstart = 0;
         }
-      parm->buflen = n;
+      if (es_read (parm->fp, parm->buffer + parm->buflen,
+                   parm->bufsize - parm->buflen, &n))
+        {
+          parm->readerror = errno;
+          return -1;
+        }
+      if (n < parm->bufsize - parm->buflen)
+        parm->eof_seen = 1;
+      parm->buflen += n;
     }
 
+  p = parm->buffer + parm->bufstart;
   n = parm->buflen < count? parm->buflen : count;
   n = n/blklen * blklen;
   if (n)
     { /* encrypt the stuff */
-      gcry_cipher_encrypt (parm->dek->chd, buffer, n, parm->buffer, n);
+      gcry_cipher_encrypt (parm->dek->chd, buffer, n, p, n);
       *nread = n;
-      /* Who cares about cycles, take the easy way and shift the buffer */
+      parm->bufstart += n;
       parm->buflen -= n;
-      memmove (parm->buffer, parm->buffer+n, parm->buflen);
     }
   else if (parm->eof_seen)
     { /* no complete block but eof: add padding */
       /* fixme: we should try to do this also in the above code path */
       int i, npad = blklen - (parm->buflen % blklen);
-      p = parm->buffer;
+      if (parm->bufstart)
+        {
+          memmove (parm->buffer, p, parm->buflen);
+          parm->bufstart = 0;
+          p = parm->buffer;
+        }
       for (n=parm->buflen, i=0; n < parm->bufsize && i < npad; n++, i++)
         p[n] = npad;
-      gcry_cipher_encrypt (parm->dek->chd, buffer, n, parm->buffer, n);
+      gcry_cipher_encrypt (parm->dek->chd, buffer, n, p, n);
       *nread = n;
       parm->ready = 1;
     }
@@ -354,6 +359,7 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
       log_error ("fdopen() failed: %s\n", strerror (errno));
       goto leave;
     }
+  gpgsm_setup_input_stream (data_fp, data_fd);
 
   err = ksba_reader_new (&reader);
   if (err)
@@ -456,8 +462,9 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
     }
 
   encparm.dek = dek;
-  /* Use a ~8k (AES) or ~4k (3DES) buffer */
-  encparm.bufsize = 500 * dek->ivlen;
+  /* Use a large buffer so that the input is read in large chunks; it
+     needs to be a multiple of the block length.  */
+  encparm.bufsize = GPGSM_STREAM_BUFSIZE / dek->ivlen * dek->ivlen;
   encparm.buffer = xtrymalloc (encparm.bufsize);
   if (!encparm.buffer)
     {
@@ -138,6 +138,8 @@ enum cmd_and_opt_values {
   oBase64,
   oNoArmor,
   oP12Charset,
+  oBulkImport,
+  oServerSocket,
 
   oCompliance,
 
@@ -150,6 +152,7 @@ enum cmd_and_opt_values {
 
   oDisableOCSP,
   oEnableOCSP,
+  oValidationCacheTTL,
 
   oIncludeCerts,
   oPolicyFile,
@@ -351,6 +354,8 @@ static gpgrt_opt_t opts[] = {
                 N_("fetch missing issuer certificates")),
   ARGPARSE_s_s (oP12Charset, "p12-charset",
                 N_("|NAME|use encoding NAME for PKCS#12 passphrases")),
+  ARGPARSE_s_n (oBulkImport, "bulk-import", "@"),
+  ARGPARSE_s_s (oServerSocket, "server-socket", "@"),
 
 
   ARGPARSE_header ("Keylist", N_("Options controlling key listings")),
@@ -380,6 +385,7 @@ static gpgrt_opt_t opts[] = {
                 "enable-trusted-cert-crl-check", "@"),
   ARGPARSE_s_n (oDisableOCSP, "disable-ocsp", "@"),
   ARGPARSE_s_n (oEnableOCSP,  "enable-ocsp", N_("check validity using OCSP")),
+  ARGPARSE_s_i (oValidationCacheTTL, "validation-cache-ttl", "@"),
   ARGPARSE_s_n (oDisablePolicyChecks, "disable-policy-checks",
                 N_("do not check certificate policies")),
   ARGPARSE_s_n (oEnablePolicyChecks, "enable-policy-checks", "@"),
@@ -976,6 +982,7 @@ main ( int argc, char **argv)
   int with_fpr = 0;
   const char *forced_digest_algo = NULL;
   const char *extra_digest_algo = NULL;
+  const char *server_socket = NULL;
   enum cmd_and_opt_values cmd = 0;
   struct server_control_s ctrl;
   certlist_t recplist = NULL;
@@ -1223,6 +1230,9 @@ main ( int argc, char **argv)
           opt.p12_charset = pargs.r.ret_str;
           break;
 
+        case oBulkImport: opt.bulk_import = 1; break;
+        case oServerSocket: server_socket = pargs.r.ret_str; break;
+
         case oPassphraseFD:
 	  pwfd = translate_sys2libc_fd_int (pargs.r.ret_int, 0);
 	  break;
@@ -1281,6 +1291,9 @@ main ( int argc, char **argv)
         case oEnableOCSP:
           ctrl.use_ocsp = opt.enable_ocsp = 1;
           break;
+        case oValidationCacheTTL:
+          opt.validation_cache_ttl = pargs.r.ret_int > 0? pargs.r.ret_int : 0;
+          break;
 
         case oIncludeCerts:
           ctrl.include_certs = default_include_certs = pargs.r.ret_int;
@@ -1897,7 +1910,7 @@ main ( int argc, char **argv)
           gnupg_sleep (debug_wait);
           log_debug ("... okay\n");
          }
-      gpgsm_server (recplist);
+      gpgsm_server (recplist, server_socket);
       break;
 
     case aCallDirmngr:
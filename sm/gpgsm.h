@@ -39,6 +39,9 @@
 
 #define MAX_DIGEST_LEN 64
 
+/* The size of the buffers used to stream the data of the CMS objects.  */
+#define GPGSM_STREAM_BUFSIZE (64*1024)
+
 struct keyserver_spec
 {
   struct keyserver_spec *next;
@@ -98,6 +101,8 @@ struct
   const char *p12_charset; /* Use this charset for encoding the
                               pkcs#12 passphrase.  */
 
+  int bulk_import;  /* Store imported certificates in one update.  */
+
 
   const char *def_cipher_algoid;  /* cipher algorithm to use if
                                      nothing else is specified */
@@ -129,6 +134,8 @@ struct
   int force_crl_refresh;    /* Force refreshing the CRL. */
   int enable_issuer_based_crl_check; /* Backward compatibility hack.  */
   int enable_ocsp;          /* Default to use OCSP checks. */
+  unsigned int validation_cache_ttl; /* Seconds to cache a successful
+                                        chain validation.  */
 
   char *policy_file;        /* full pathname of policy file */
   int no_policy_check;      /* ignore certificate policies */
@@ -266,7 +273,7 @@ void gpgsm_init_default_ctrl (struct server_control_s *ctrl);
 int  gpgsm_parse_validation_model (const char *model);
 
 /*-- server.c --*/
-void gpgsm_server (certlist_t default_recplist);
+void gpgsm_server (certlist_t default_recplist, const char *socket_name);
 gpg_error_t gpgsm_status (ctrl_t ctrl, int no, const char *text);
 gpg_error_t gpgsm_status2 (ctrl_t ctrl, int no, ...) GPGRT_ATTR_SENTINEL(0);
 gpg_error_t gpgsm_status_with_err_code (ctrl_t ctrl, int no, const char *text,
@@ -341,6 +348,8 @@ int gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert,
                           int listmode, estream_t listfp,
                           unsigned int flags, unsigned int *retflags);
 int gpgsm_basic_cert_check (ctrl_t ctrl, ksba_cert_t cert);
+void gpgsm_begin_validation_batch (void);
+void gpgsm_end_validation_batch (void);
 
 /*-- certlist.c --*/
 int gpgsm_cert_use_sign_p (ksba_cert_t cert, int silent);
@@ -455,6 +464,7 @@ int gpgsm_dirmngr_run_command (ctrl_t ctrl, const char *command,
 
 /*-- misc.c --*/
 void setup_pinentry_env (void);
+void gpgsm_setup_input_stream (estream_t fp, int fd);
 gpg_error_t transform_sigval (const unsigned char *sigval, size_t sigvallen,
                               int mdalgo,
                               unsigned char **r_newsigval,
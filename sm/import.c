@@ -36,6 +36,7 @@
 #include "../common/sysutils.h"
 #include "../kbx/keybox.h" /* for KEYBOX_FLAG_* */
 #include "../common/membuf.h"
+#include "../common/host2net.h"
 #include "minip12.h"
 
 /* The arbitrary limit of one PKCS#12 object.  */
@@ -53,6 +54,23 @@ struct stats_s {
  };
 
 
+/* The number of hash buckets for the certificates already stored
+   during a bulk import.  */
+#define BULK_SEEN_BUCKETS 4096
+
+/* An item of the table of certificates already stored during a bulk
+   import.  */
+struct bulk_seen_s
+{
+  struct bulk_seen_s *next;
+  unsigned char fpr[20];
+};
+
+/* The table of fingerprints of the certificates already stored during
+   the current bulk import or NULL if no bulk import is active.  */
+static struct bulk_seen_s **bulk_seen;
+
+
 struct rsa_secret_key_s
 {
   gcry_mpi_t n;	    /* public modulus */
@@ -163,11 +181,73 @@ print_imported_summary (ctrl_t ctrl, struct stats_s *stats)
 
 
 
+/* Start a bulk import if requested.  */
+static void
+bulk_import_begin (ctrl_t ctrl)
+{
+  if (!opt.bulk_import || bulk_seen)
+    return;
+  bulk_seen = xtrycalloc (BULK_SEEN_BUCKETS, sizeof *bulk_seen);
+  if (!bulk_seen)
+    log_info ("bulk import disabled: %s\n",
+              gpg_strerror (gpg_error_from_syserror ()));
+  else
+    keydb_bulk_begin (ctrl);
+}
+
+
+/* Finish a bulk import started by bulk_import_begin.  */
+static void
+bulk_import_end (ctrl_t ctrl)
+{
+  struct bulk_seen_s *item, *next;
+  int i;
+
+  if (!bulk_seen)
+    return;
+  keydb_bulk_end (ctrl);
+  for (i=0; i < BULK_SEEN_BUCKETS; i++)
+    for (item = bulk_seen[i]; item; item = next)
+      {
+        next = item->next;
+        xfree (item);
+      }
+  xfree (bulk_seen);
+  bulk_seen = NULL;
+}
+
+
+/* Return true if the certificate with the fingerprint FPR has already
+   been stored during the current bulk import.  If MARK is set the
+   certificate is remembered as stored.  */
+static int
+bulk_seen_fpr (const unsigned char *fpr, int mark)
+{
+  struct bulk_seen_s *item;
+  unsigned int h;
+
+  if (!bulk_seen)
+    return 0;
+  h = buf32_to_uint (fpr) % BULK_SEEN_BUCKETS;
+  for (item = bulk_seen[h]; item; item = item->next)
+    if (!memcmp (item->fpr, fpr, 20))
+      return 1;
+  if (mark && (item = xtrymalloc (sizeof *item)))
+    {
+      memcpy (item->fpr, fpr, 20);
+      item->next = bulk_seen[h];
+      bulk_seen[h] = item;
+    }
+  return 0;
+}
+
+
 static void
 check_and_store (ctrl_t ctrl, struct stats_s *stats,
                  ksba_cert_t cert, int depth)
 {
   int rc;
+  unsigned char fpr[20];
 
   if (stats)
     stats->count++;
@@ -180,6 +260,17 @@ check_and_store (ctrl_t ctrl, struct stats_s *stats,
       return;
     }
 
+  /* In bulk mode a certificate which has already been stored, either
+     as listed in the input or as issuer, needs no further checks.  */
+  if (bulk_seen && gpgsm_get_fingerprint (cert, 0, fpr, NULL)
+      && bulk_seen_fpr (fpr, 0))
+    {
+      print_imported_status (ctrl, cert, 0);
+      if (stats)
+        stats->unchanged++;
+      return;
+    }
+
   /* Some basic checks, but don't care about missing certificates;
      this is so that we are able to import entire certificate chains
      w/o requiring a special order (i.e. root-CA first).  This used
@@ -203,6 +294,9 @@ check_and_store (ctrl_t ctrl, struct stats_s *stats,
         {
           ksba_cert_t next = NULL;
 
+          if (bulk_seen && gpgsm_get_fingerprint (cert, 0, fpr, NULL))
+            bulk_seen_fpr (fpr, 1);
+
           if (!existed)
             {
               print_imported_status (ctrl, cert, 1);
@@ -522,7 +616,11 @@ gpgsm_import (ctrl_t ctrl, int in_fd, int reimport_mode)
   if (reimport_mode)
     rc = reimport_one (ctrl, &stats, in_fd);
   else
-    rc = import_one (ctrl, &stats, in_fd);
+    {
+      bulk_import_begin (ctrl);
+      rc = import_one (ctrl, &stats, in_fd);
+      bulk_import_end (ctrl);
+    }
   print_imported_summary (ctrl, &stats);
   /* If we never printed an error message do it now so that a command
      line invocation will return with an error (log_error keeps a
@@ -542,6 +640,7 @@ gpgsm_import_files (ctrl_t ctrl, int nfiles, char **files,
 
   memset (&stats, 0, sizeof stats);
 
+  bulk_import_begin (ctrl);
   if (!nfiles)
     rc = import_one (ctrl, &stats, 0);
   else
@@ -555,6 +654,7 @@ gpgsm_import_files (ctrl_t ctrl, int nfiles, char **files,
             rc = 0;
         }
     }
+  bulk_import_end (ctrl);
   print_imported_summary (ctrl, &stats);
   /* If we never printed an error message do it now so that a command
      line invocation will return with an error (log_error keeps a
@@ -715,6 +715,22 @@ keydb_get_cert (KEYDB_HANDLE hd, ksba_cert_t *r_cert)
       break;
     case KEYDB_RESOURCE_TYPE_KEYBOX:
       rc = keybox_get_cert (hd->active[hd->found].u.kr, r_cert);
+      if (!rc)
+        {
+          unsigned int stamp;
+          unsigned char buf[4];
+
+          /* Attach the recorded signature check; see certchain.c. */
+          if (!keybox_get_flags (hd->active[hd->found].u.kr,
+                                 KEYBOX_FLAG_SIG_INFO, 0, &stamp) && stamp)
+            {
+              buf[0] = stamp >> 24;
+              buf[1] = stamp >> 16;
+              buf[2] = stamp >> 8;
+              buf[3] = stamp;
+              ksba_cert_set_user_data (*r_cert, "sig-stamp", buf, 4);
+            }
+        }
       break;
     }
 
@@ -995,6 +1011,70 @@ keydb_locate_writable (KEYDB_HANDLE hd, const char *reserved)
   return -1;
 }
 
+/* Helper for keydb_bulk_begin and keydb_bulk_end.  */
+static void
+bulk_update (int begin)
+{
+  gpg_error_t err;
+  KEYBOX_HANDLE kbxhd;
+  int i;
+
+  for (i=0; i < used_resources; i++)
+    {
+      if (all_resources[i].type != KEYDB_RESOURCE_TYPE_KEYBOX
+          || !keybox_is_writable (all_resources[i].token))
+        continue;
+
+      kbxhd = keybox_new_x509 (all_resources[i].token, 0);
+      if (!kbxhd)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error creating keybox handle: %s\n", gpg_strerror (err));
+          continue;
+        }
+      if (begin)
+        {
+          err = keybox_bulk_begin (kbxhd);
+          if (err)
+            log_info ("can't start bulk update of '%s': %s\n",
+                      keybox_get_resource_name (kbxhd), gpg_strerror (err));
+        }
+      else
+        {
+          err = keybox_bulk_end (kbxhd);
+          if (err)
+            log_error ("error writing keybox '%s': %s\n",
+                       keybox_get_resource_name (kbxhd), gpg_strerror (err));
+        }
+      keybox_release (kbxhd);
+    }
+}
+
+
+/* Start a bulk update.  Until keydb_bulk_end is called, certificates
+ * inserted into a keybox are appended to the file instead of
+ * rewriting the entire file, searches use an in-memory index, and
+ * the keybox stays locked.  */
+void
+keydb_bulk_begin (ctrl_t ctrl)
+{
+  (void)ctrl;
+
+  bulk_update (1);
+}
+
+
+/* Finish a bulk update started by keydb_bulk_begin.  This compacts
+ * the changed keyboxes in one go.  */
+void
+keydb_bulk_end (ctrl_t ctrl)
+{
+  (void)ctrl;
+
+  bulk_update (0);
+}
+
+
 /*
  * Rebuild the caches of all key resources.
  */
@@ -68,6 +68,8 @@ int keydb_search_subject (ctrl_t ctrl, KEYDB_HANDLE hd, const char *issuer);
 
 int keydb_store_cert (ctrl_t ctrl, ksba_cert_t cert, int ephemeral,
                       int *existed);
+void keydb_bulk_begin (ctrl_t ctrl);
+void keydb_bulk_end (ctrl_t ctrl);
 gpg_error_t keydb_set_cert_flags (ctrl_t ctrl, ksba_cert_t cert, int ephemeral,
                                   int which, int idx,
                                   unsigned int mask, unsigned int value);
@@ -1426,6 +1426,7 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
   const char *lastresname, *resname;
   int have_secret;
   int want_ephemeral = ctrl->with_ephemeral_keys;
+  int in_batch = 0;
 
   hd = keydb_new ();
   if (!hd)
@@ -1495,6 +1496,14 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
      currently we stop at the first match.  To do this we need an
      extra flag to enable this feature so */
 
+  /* The certificates usually share a few CA certificates; thus we
+     check their revocation status only once per listing.  */
+  if (ctrl->with_validation)
+    {
+      gpgsm_begin_validation_batch ();
+      in_batch = 1;
+    }
+
   /* Suppress duplicates at least when they follow each other.  */
   lastresname = NULL;
   while (!(rc = keydb_search (ctrl, hd, desc, ndesc)))
@@ -1588,6 +1597,8 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
     log_error ("keydb_search failed: %s\n", gpg_strerror (rc));
 
  leave:
+  if (in_batch)
+    gpgsm_end_validation_batch ();
   ksba_cert_release (cert);
   ksba_cert_release (lastcert);
   xfree (desc);
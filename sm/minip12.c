@@ -425,6 +425,117 @@ string_to_key (int id, char *salt, size_t saltlen, int iter, const char *pw,
 }
 
 
+/* Deriving the keys is the most expensive part of parsing a PKCS#12
+ * object because the iteration count is usually 2048 or more and each
+ * bag needs two derivations for the key and the IV.  Several bags of
+ * one object often use the same salt and the charset fallback of
+ * decrypt_block derives them again for each try.  We thus cache the
+ * derived keys during p12_parse.  The cache is kept in secure memory
+ * and identifies the passphrase by its hash.  */
+#define KDF_CACHE_SIZE     8
+#define KDF_CACHE_MAXSALT 32
+#define KDF_CACHE_MAXKEY  32
+#define KDF_CACHE_PBKDF2  0x100  /* ID used for PBKDF2.  */
+
+struct kdf_cache_item_s
+{
+  int id;      /* The PKCS#12 ID or KDF_CACHE_PBKDF2; 0 if unused.  */
+  int iter;
+  size_t saltlen;
+  size_t keylen;
+  unsigned char salt[KDF_CACHE_MAXSALT];
+  unsigned char pwhash[20];
+  unsigned char key[KDF_CACHE_MAXKEY];
+};
+
+static struct kdf_cache_item_s *kdf_cache;
+static unsigned int kdf_cache_next;
+
+
+static void
+kdf_cache_clear (void)
+{
+  if (kdf_cache)
+    {
+      wipememory (kdf_cache, KDF_CACHE_SIZE * sizeof *kdf_cache);
+      gcry_free (kdf_cache);
+      kdf_cache = NULL;
+    }
+  kdf_cache_next = 0;
+}
+
+
+/* Copy a cached key of KEYLEN bytes to KEYBUF.  Returns true if a key
+ * was found.  */
+static int
+kdf_cache_get (int id, const char *salt, size_t saltlen, int iter,
+               const char *pw, size_t keylen, unsigned char *keybuf)
+{
+  unsigned char pwhash[20];
+  int i;
+
+  if (!kdf_cache || saltlen > KDF_CACHE_MAXSALT || keylen > KDF_CACHE_MAXKEY)
+    return 0;
+
+  gcry_md_hash_buffer (GCRY_MD_SHA1, pwhash, pw, strlen (pw));
+  for (i=0; i < KDF_CACHE_SIZE; i++)
+    if (kdf_cache[i].id == id
+        && kdf_cache[i].iter == iter
+        && kdf_cache[i].keylen == keylen
+        && kdf_cache[i].saltlen == saltlen
+        && !memcmp (kdf_cache[i].salt, salt, saltlen)
+        && !memcmp (kdf_cache[i].pwhash, pwhash, 20))
+      {
+        memcpy (keybuf, kdf_cache[i].key, keylen);
+        wipememory (pwhash, sizeof pwhash);
+        return 1;
+      }
+  wipememory (pwhash, sizeof pwhash);
+  return 0;
+}
+
+
+static void
+kdf_cache_put (int id, const char *salt, size_t saltlen, int iter,
+               const char *pw, size_t keylen, const unsigned char *key)
+{
+  struct kdf_cache_item_s *item;
+
+  if (saltlen > KDF_CACHE_MAXSALT || keylen > KDF_CACHE_MAXKEY)
+    return;
+  if (!kdf_cache)
+    {
+      kdf_cache = gcry_calloc_secure (KDF_CACHE_SIZE, sizeof *kdf_cache);
+      if (!kdf_cache)
+        return;
+    }
+
+  item = kdf_cache + kdf_cache_next;
+  kdf_cache_next = (kdf_cache_next + 1) % KDF_CACHE_SIZE;
+  item->id = id;
+  item->iter = iter;
+  item->saltlen = saltlen;
+  memcpy (item->salt, salt, saltlen);
+  gcry_md_hash_buffer (GCRY_MD_SHA1, item->pwhash, pw, strlen (pw));
+  item->keylen = keylen;
+  memcpy (item->key, key, keylen);
+}
+
+
+/* Same as string_to_key but use the cache.  */
+static int
+cached_string_to_key (int id, char *salt, size_t saltlen, int iter,
+                      const char *pw, int req_keylen, unsigned char *keybuf)
+{
+  if (kdf_cache_get (id, salt, saltlen, iter, pw, req_keylen, keybuf))
+    return 0;
+  if (string_to_key (id, salt, saltlen, iter, pw, req_keylen, keybuf))
+    return -1;
+  kdf_cache_put (id, salt, saltlen, iter, pw, req_keylen, keybuf);
+  return 0;
+}
+
+
 static int
 set_key_iv (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
             const char *pw, int keybytes)
@@ -433,7 +544,7 @@ set_key_iv (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
   int rc;
 
   assert (keybytes == 5 || keybytes == 24);
-  if (string_to_key (1, salt, saltlen, iter, pw, keybytes, keybuf))
+  if (cached_string_to_key (1, salt, saltlen, iter, pw, keybytes, keybuf))
     return -1;
   rc = gcry_cipher_setkey (chd, keybuf, keybytes);
   if (rc)
@@ -442,7 +553,7 @@ set_key_iv (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
       return -1;
     }
 
-  if (string_to_key (2, salt, saltlen, iter, pw, 8, keybuf))
+  if (cached_string_to_key (2, salt, saltlen, iter, pw, 8, keybuf))
     return -1;
   rc = gcry_cipher_setiv (chd, keybuf, 8);
   if (rc)
@@ -469,14 +580,20 @@ set_key_iv_pbes2 (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
   if (!keybuf)
     return -1;
 
-  rc = gcry_kdf_derive (pw, strlen (pw),
-                        GCRY_KDF_PBKDF2, GCRY_MD_SHA1,
-                        salt, saltlen, iter, keylen, keybuf);
-  if (rc)
+  if (!kdf_cache_get (KDF_CACHE_PBKDF2, salt, saltlen, iter, pw,
+                      keylen, keybuf))
     {
-      log_error ("gcry_kdf_derive failed: %s\n", gpg_strerror (rc));
-      gcry_free (keybuf);
-      return -1;
+      rc = gcry_kdf_derive (pw, strlen (pw),
+                            GCRY_KDF_PBKDF2, GCRY_MD_SHA1,
+                            salt, saltlen, iter, keylen, keybuf);
+      if (rc)
+        {
+          log_error ("gcry_kdf_derive failed: %s\n", gpg_strerror (rc));
+          gcry_free (keybuf);
+          return -1;
+        }
+      kdf_cache_put (KDF_CACHE_PBKDF2, salt, saltlen, iter, pw,
+                     keylen, keybuf);
     }
 
   rc = gcry_cipher_setkey (chd, keybuf, keylen);
@@ -498,8 +615,12 @@ set_key_iv_pbes2 (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
 }
 
 
+/* En- or decrypt the LENGTH bytes at BUFFER in place.  If INPUT is not
+ * NULL the LENGTH bytes at INPUT are processed instead and the result is
+ * stored at BUFFER.  */
 static void
-crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
+crypt_block (unsigned char *buffer, const void *input, size_t length,
+             char *salt, size_t saltlen,
              int iter, const void *iv, size_t ivlen,
              const char *pw, int cipher_algo, int encrypt)
 {
@@ -523,8 +644,10 @@ crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
       goto leave;
     }
 
-  rc = encrypt? gcry_cipher_encrypt (chd, buffer, length, NULL, 0)
-              : gcry_cipher_decrypt (chd, buffer, length, NULL, 0);
+  rc = encrypt? gcry_cipher_encrypt (chd, buffer, length,
+                                     input, input? length : 0)
+              : gcry_cipher_decrypt (chd, buffer, length,
+                                     input, input? length : 0);
 
   if (rc)
     {
@@ -621,9 +744,8 @@ decrypt_block (const void *ciphertext, unsigned char *plaintext, size_t length,
           log_info ("decryption failed; trying charset '%s'\n",
                     charsets[charsetidx]);
         }
-      memcpy (plaintext, ciphertext, length);
-      crypt_block (plaintext, length, salt, saltlen, iter, iv, ivlen,
-                   convertedpw? convertedpw:pw, cipher_algo, 0);
+      crypt_block (plaintext, ciphertext, length, salt, saltlen, iter,
+                   iv, ivlen, convertedpw? convertedpw:pw, cipher_algo, 0);
       if (check_fnc (plaintext, length))
         break; /* Decryption succeeded. */
     }
@@ -1658,6 +1780,7 @@ p12_parse (const unsigned char *buffer, size_t length, const char *pw,
     }
 
   gcry_free (cram_buffer);
+  kdf_cache_clear ();
   return result;
  bailout:
   log_error ("error at \"%s\", offset %u\n",
@@ -1671,6 +1794,7 @@ p12_parse (const unsigned char *buffer, size_t length, const char *pw,
       gcry_free (result);
     }
   gcry_free (cram_buffer);
+  kdf_cache_clear ();
   return NULL;
 }
 
@@ -2458,7 +2582,7 @@ p12_build (gcry_mpi_t *kparms, const void *cert, size_t certlen,
 
       /* Encrypt it. */
       gcry_randomize (salt, 8, GCRY_STRONG_RANDOM);
-      crypt_block (buffer, buflen, salt, 8, 2048, NULL, 0, pw,
+      crypt_block (buffer, NULL, buflen, salt, 8, 2048, NULL, 0, pw,
                    GCRY_CIPHER_RFC2268_40, 1);
 
       /* Encode the encrypted stuff into a bag. */
@@ -2481,7 +2605,7 @@ p12_build (gcry_mpi_t *kparms, const void *cert, size_t certlen,
 
       /* Encrypt it. */
       gcry_randomize (salt, 8, GCRY_STRONG_RANDOM);
-      crypt_block (buffer, buflen, salt, 8, 2048, NULL, 0,
+      crypt_block (buffer, NULL, buflen, salt, 8, 2048, NULL, 0,
                    pw, GCRY_CIPHER_3DES, 1);
 
       /* Encode the encrypted stuff into a bag. */
@@ -24,6 +24,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#ifdef HAVE_POSIX_FADVISE
+# include <fcntl.h>
+#endif
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
@@ -35,6 +38,23 @@
 #include "../common/sexp-parse.h"
 
 
+/* Prepare the stream FP, which has just been opened on FD, for
+   reading a large amount of data.  We use a large stream buffer so
+   that the data is read in large chunks and tell the kernel that FD
+   is read sequentially so that it reads ahead while we are busy with
+   the crypto.  Errors are not fatal and thus ignored.  */
+void
+gpgsm_setup_input_stream (estream_t fp, int fd)
+{
+  es_setvbuf (fp, NULL, _IOFBF, GPGSM_STREAM_BUFSIZE);
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+  (void)fd;
+#endif
+}
+
+
 /* Setup the environment so that the pinentry is able to get all
    required information.  This is used prior to an exec of the
    protect-tool. */
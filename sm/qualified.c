@@ -24,19 +24,41 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "gpgsm.h"
 #include "../common/i18n.h"
 #include <ksba.h>
 
 
-/* We open the file only once and keep the open file pointer as well
-   as the name of the file here.  Note that, a listname not equal to
-   NULL indicates that this module has been initialized and if the
-   LISTFP is also NULL, no list of qualified signatures exists. */
+/* The name of the list file and the file pointer used while
+   reading it.  */
 static char *listname;
 static FILE *listfp;
 
+/* The list is parsed only once into this hash table and parsed again
+   only if the modification time or the size of the file changed.  */
+#define QUALIFIED_BUCKETS 64
+
+struct qualified_item_s
+{
+  struct qualified_item_s *next;
+  unsigned char fpr[20];  /* The SHA-1 fingerprint of the root cert.  */
+  char country[3];        /* The country code.  */
+};
+typedef struct qualified_item_s *qualified_item_t;
+
+static struct
+{
+  int loaded;              /* The list has been read.  */
+  int exists;              /* The file exists.  */
+  time_t mtime;            /* Modification time and size of the file */
+  off_t size;              /* at the time it was read.  */
+  gpg_error_t err;         /* The error which stopped the reading.  */
+  qualified_item_t table[QUALIFIED_BUCKETS];
+} qlist;
+
 
 /* Read the trustlist and return entry by entry.  KEY must point to a
    buffer of at least 41 characters. COUNTRY shall be a buffer of at
@@ -49,25 +71,12 @@ static FILE *listfp;
 static gpg_error_t
 read_list (char *key, char *country, int *lnr)
 {
-  gpg_error_t err;
   int c, i, j;
   char *p, line[256];
 
   *key = 0;
   *country = 0;
 
-  if (!listname)
-    {
-      listname = make_filename (gnupg_sysconfdir (), "qualified.txt", NULL);
-      listfp = fopen (listname, "r");
-      if (!listfp && errno != ENOENT)
-        {
-          err = gpg_error_from_syserror ();
-          log_error (_("can't open '%s': %s\n"), listname, gpg_strerror (err));
-          return err;
-        }
-    }
-
   if (!listfp)
     return gpg_error (GPG_ERR_EOF);
 
@@ -129,6 +138,110 @@ read_list (char *key, char *country, int *lnr)
 
 
 
+/* Release all items of the parsed list.  */
+static void
+release_qualified_table (void)
+{
+  qualified_item_t qi;
+  int i;
+
+  for (i=0; i < QUALIFIED_BUCKETS; i++)
+    while ((qi = qlist.table[i]))
+      {
+        qlist.table[i] = qi->next;
+        xfree (qi);
+      }
+}
+
+
+/* Return the item for the fingerprint FPR or NULL.  */
+static qualified_item_t
+find_qualified_item (const unsigned char *fpr)
+{
+  qualified_item_t qi;
+
+  for (qi = qlist.table[fpr[0] % QUALIFIED_BUCKETS]; qi; qi = qi->next)
+    if (!memcmp (qi->fpr, fpr, 20))
+      return qi;
+  return NULL;
+}
+
+
+/* Make sure that the list of qualified certificates is loaded and up
+   to date.  The file is parsed again only if it changed.  Parsing
+   stops at the first error; the entries read so far are used and
+   the error is returned for certificates not found.  */
+static void
+load_qualified_list (void)
+{
+  gpg_error_t err;
+  struct stat st;
+  char key[41];
+  char country[3];
+  int lnr = 0;
+  qualified_item_t qi;
+
+  if (!listname)
+    listname = make_filename (gnupg_sysconfdir (), "qualified.txt", NULL);
+
+  if (stat (listname, &st))
+    {
+      if (qlist.loaded && !qlist.exists)
+        return;
+      err = errno == ENOENT? 0 : gpg_error_from_syserror ();
+      release_qualified_table ();
+      qlist.loaded = 1;
+      qlist.exists = 0;
+      qlist.err = err;
+      if (err)
+        log_error (_("can't open '%s': %s\n"), listname, gpg_strerror (err));
+      return;
+    }
+  if (qlist.loaded && qlist.exists
+      && qlist.mtime == st.st_mtime && qlist.size == st.st_size)
+    return;
+
+  release_qualified_table ();
+  qlist.loaded = 1;
+  qlist.exists = 1;
+  qlist.mtime = st.st_mtime;
+  qlist.size = st.st_size;
+  qlist.err = 0;
+
+  listfp = fopen (listname, "r");
+  if (!listfp)
+    {
+      qlist.err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"),
+                 listname, gpg_strerror (qlist.err));
+      return;
+    }
+
+  while (!(err = read_list (key, country, &lnr)))
+    {
+      qi = xtrycalloc (1, sizeof *qi);
+      if (!qi)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      hex2bin (key, qi->fpr, 20);
+      strcpy (qi->country, country);
+      if (find_qualified_item (qi->fpr))
+        xfree (qi);  /* Only the first entry counts.  */
+      else
+        {
+          qi->next = qlist.table[qi->fpr[0] % QUALIFIED_BUCKETS];
+          qlist.table[qi->fpr[0] % QUALIFIED_BUCKETS] = qi;
+        }
+    }
+  if (gpg_err_code (err) != GPG_ERR_EOF)
+    qlist.err = err;
+
+  fclose (listfp);
+  listfp = NULL;
+}
+
 
 /* Check whether the certificate CERT is included in the list of
    qualified certificates.  This list is similar to the "trustlist.txt"
@@ -145,40 +258,28 @@ read_list (char *key, char *country, int *lnr)
 gpg_error_t
 gpgsm_is_in_qualified_list (ctrl_t ctrl, ksba_cert_t cert, char *country)
 {
-  gpg_error_t err;
-  char *fpr;
-  char key[41];
-  char mycountry[3];
-  int lnr = 0;
+  unsigned char fpr[20];
+  qualified_item_t qi;
 
   (void)ctrl;
 
   if (country)
     *country = 0;
 
-  fpr = gpgsm_get_fingerprint_hexstring (cert, GCRY_MD_SHA1);
-  if (!fpr)
+  if (!gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL))
     return gpg_error (GPG_ERR_GENERAL);
 
-  if (listfp)
-    {
-      /* W32ce has no rewind, thus we use the equivalent code.  */
-      fseek (listfp, 0, SEEK_SET);
-      clearerr (listfp);
-    }
-  while (!(err = read_list (key, mycountry, &lnr)))
+  load_qualified_list ();
+
+  qi = find_qualified_item (fpr);
+  if (qi)
     {
-      if (!strcmp (key, fpr))
-        break;
+      if (country)
+        strcpy (country, qi->country);
+      return 0;
     }
-  if (gpg_err_code (err) == GPG_ERR_EOF)
-    err = gpg_error (GPG_ERR_NOT_FOUND);
-
-  if (!err && country)
-    strcpy (country, mycountry);
 
-  xfree (fpr);
-  return err;
+  return qlist.err? qlist.err : gpg_error (GPG_ERR_NOT_FOUND);
 }
 
 
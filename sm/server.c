@@ -25,10 +25,15 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#ifndef HAVE_W32_SYSTEM
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif /*HAVE_W32_SYSTEM*/
 #include <unistd.h>
 
 #include "gpgsm.h"
 #include <assuan.h>
+#include "../common/i18n.h"
 #include "../common/sysutils.h"
 #include "../common/server-help.h"
 #include "../common/asshelp.h"
@@ -1335,15 +1340,14 @@ register_commands (assuan_context_t ctx)
   return 0;
 }
 
-/* Startup the server. DEFAULT_RECPLIST is the list of recipients as
-   set from the command line or config file.  We only require those
-   marked as encrypt-to. */
-void
-gpgsm_server (certlist_t default_recplist)
+/* Serve the client connected to CTX using a fresh control object.
+   DEFAULT_RECPLIST is the list of recipients as set from the command
+   line or config file.  We only require those marked as
+   encrypt-to. */
+static void
+serve_connection (assuan_context_t ctx, certlist_t default_recplist)
 {
   int rc;
-  assuan_fd_t filedes[2];
-  assuan_context_t ctx;
   struct server_control_s ctrl;
   static const char hello[] = ("GNU Privacy Guard's S/M server "
                                VERSION " ready");
@@ -1351,33 +1355,6 @@ gpgsm_server (certlist_t default_recplist)
   memset (&ctrl, 0, sizeof ctrl);
   gpgsm_init_default_ctrl (&ctrl);
 
-  /* We use a pipe based server so that we can work from scripts.
-     assuan_init_pipe_server will automagically detect when we are
-     called with a socketpair and ignore FILEDES in this case. */
-#ifdef HAVE_W32CE_SYSTEM
-  #define SERVER_STDIN es_fileno(es_stdin)
-  #define SERVER_STDOUT es_fileno(es_stdout)
-#else
-#define SERVER_STDIN 0
-#define SERVER_STDOUT 1
-#endif
-  filedes[0] = assuan_fdopen (SERVER_STDIN);
-  filedes[1] = assuan_fdopen (SERVER_STDOUT);
-  rc = assuan_new (&ctx);
-  if (rc)
-    {
-      log_error ("failed to allocate assuan context: %s\n",
-                 gpg_strerror (rc));
-      gpgsm_exit (2);
-    }
-
-  rc = assuan_init_pipe_server (ctx, filedes);
-  if (rc)
-    {
-      log_error ("failed to initialize the server: %s\n",
-                 gpg_strerror (rc));
-      gpgsm_exit (2);
-    }
   rc = register_commands (ctx);
   if (rc)
     {
@@ -1449,6 +1426,166 @@ gpgsm_server (certlist_t default_recplist)
 
   audit_release (ctrl.audit);
   ctrl.audit = NULL;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Create a listening socket with NAME.  Returns the socket or
+ * GNUPG_INVALID_FD on error.  */
+static gnupg_fd_t
+create_server_socket (const char *name)
+{
+  gnupg_fd_t fd;
+  struct sockaddr_un *unaddr;
+  socklen_t len;
+  int redirected;
+  int rc;
+
+  fd = assuan_sock_new (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == GNUPG_INVALID_FD)
+    {
+      log_error (_("can't create socket: %s\n"), strerror (errno));
+      return GNUPG_INVALID_FD;
+    }
+
+  unaddr = xcalloc (1, sizeof *unaddr);
+  if (assuan_sock_set_sockaddr_un (name, (struct sockaddr*)unaddr,
+                                   &redirected))
+    {
+      if (errno == ENAMETOOLONG)
+        log_error (_("socket name '%s' is too long\n"), name);
+      else
+        log_error ("error preparing socket '%s': %s\n",
+                   name, gpg_strerror (gpg_error_from_syserror ()));
+      goto fail;
+    }
+  len = SUN_LEN (unaddr);
+
+  rc = assuan_sock_bind (fd, (struct sockaddr*)unaddr, len);
+  if (rc == -1 && errno == EADDRINUSE)
+    {
+      /* A stale socket from a previous run.  */
+      gnupg_remove (unaddr->sun_path);
+      rc = assuan_sock_bind (fd, (struct sockaddr*)unaddr, len);
+    }
+  if (rc == -1)
+    {
+      log_error (_("error binding socket to '%s': %s\n"),
+                 unaddr->sun_path,
+                 gpg_strerror (gpg_error_from_syserror ()));
+      goto fail;
+    }
+  if (gnupg_chmod (unaddr->sun_path, "-rwx"))
+    log_error (_("can't set permissions of '%s': %s\n"),
+               unaddr->sun_path, strerror (errno));
+
+  if (listen (FD2INT (fd), 5) == -1)
+    {
+      log_error (_("listen() failed: %s\n"),
+                 gpg_strerror (gpg_error_from_syserror ()));
+      goto fail;
+    }
+
+  if (opt.verbose)
+    log_info (_("listening on socket '%s'\n"), unaddr->sun_path);
+  xfree (unaddr);
+  return fd;
+
+ fail:
+  xfree (unaddr);
+  assuan_sock_close (fd);
+  return GNUPG_INVALID_FD;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Run the server.  If SOCKET_NAME is NULL the commands are read from
+ * stdin.  Otherwise we listen on the socket SOCKET_NAME and serve
+ * one client after the other; each connection gets its own control
+ * object but the process keeps the keybox and the connections to the
+ * gpg-agent and the dirmngr open.  */
+void
+gpgsm_server (certlist_t default_recplist, const char *socket_name)
+{
+  int rc;
+  assuan_fd_t filedes[2];
+  assuan_context_t ctx;
+
+  if (socket_name)
+    {
+#ifdef HAVE_W32_SYSTEM
+      log_error ("option %s is not supported on this platform\n",
+                 "--server-socket");
+      gpgsm_exit (2);
+#else
+      gnupg_fd_t listen_fd;
+      int fd;
+
+      listen_fd = create_server_socket (socket_name);
+      if (listen_fd == GNUPG_INVALID_FD)
+        gpgsm_exit (2);
+
+      for (;;)
+        {
+          fd = accept (FD2INT (listen_fd), NULL, NULL);
+          if (fd == -1)
+            {
+              if (errno == EINTR)
+                continue;
+              log_error ("accept failed: %s\n", strerror (errno));
+              break;
+            }
+
+          rc = assuan_new (&ctx);
+          if (!rc)
+            rc = assuan_init_socket_server (ctx, INT2FD (fd),
+                                            ASSUAN_SOCKET_SERVER_ACCEPTED);
+          if (rc)
+            {
+              log_error ("failed to initialize the server: %s\n",
+                         gpg_strerror (rc));
+              close (fd);
+            }
+          else
+            serve_connection (ctx, default_recplist);
+          /* This also closes FD.  */
+          assuan_release (ctx);
+        }
+
+      assuan_sock_close (listen_fd);
+      return;
+#endif /*!HAVE_W32_SYSTEM*/
+    }
+
+  /* We use a pipe based server so that we can work from scripts.
+     assuan_init_pipe_server will automagically detect when we are
+     called with a socketpair and ignore FILEDES in this case. */
+#ifdef HAVE_W32CE_SYSTEM
+  #define SERVER_STDIN es_fileno(es_stdin)
+  #define SERVER_STDOUT es_fileno(es_stdout)
+#else
+#define SERVER_STDIN 0
+#define SERVER_STDOUT 1
+#endif
+  filedes[0] = assuan_fdopen (SERVER_STDIN);
+  filedes[1] = assuan_fdopen (SERVER_STDOUT);
+  rc = assuan_new (&ctx);
+  if (rc)
+    {
+      log_error ("failed to allocate assuan context: %s\n",
+                 gpg_strerror (rc));
+      gpgsm_exit (2);
+    }
+
+  rc = assuan_init_pipe_server (ctx, filedes);
+  if (rc)
+    {
+      log_error ("failed to initialize the server: %s\n",
+                 gpg_strerror (rc));
+      gpgsm_exit (2);
+    }
+
+  serve_connection (ctx, default_recplist);
 
   assuan_release (ctx);
 }
@@ -55,29 +55,36 @@ hash_data (int fd, gcry_md_hd_t md)
 {
   gpg_error_t err = 0;
   estream_t fp;
-  char buffer[4096];
-  int nread;
+  char *buffer;
+  size_t nread;
+
+  buffer = xtrymalloc (GPGSM_STREAM_BUFSIZE);
+  if (!buffer)
+    return gpg_error_from_syserror ();
 
   fp = es_fdopen_nc (fd, "rb");
   if (!fp)
     {
       err = gpg_error_from_syserror ();
       log_error ("fdopen(%d) failed: %s\n", fd, gpg_strerror (err));
+      xfree (buffer);
       return err;
     }
+  gpgsm_setup_input_stream (fp, fd);
 
   do
     {
-      nread = es_fread (buffer, 1, DIM(buffer), fp);
+      if (es_read (fp, buffer, GPGSM_STREAM_BUFSIZE, &nread))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("read error on fd %d: %s\n", fd, gpg_strerror (err));
+          break;
+        }
       gcry_md_write (md, buffer, nread);
     }
   while (nread);
-  if (es_ferror (fp))
-    {
-      err = gpg_error_from_syserror ();
-      log_error ("read error on fd %d: %s\n", fd, gpg_strerror (err));
-    }
   es_fclose (fp);
+  xfree (buffer);
   return err;
 }
 
@@ -125,6 +132,7 @@ gpgsm_verify (ctrl_t ctrl, int in_fd, int data_fd, estream_t out_fp)
       log_error ("fdopen() failed: %s\n", strerror (errno));
       goto leave;
     }
+  gpgsm_setup_input_stream (in_fp, in_fd);
 
   rc = gnupg_ksba_create_reader
     (&b64reader, ((ctrl->is_pem? GNUPG_KSBA_IO_PEM : 0)
@@ -34,6 +34,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef HAVE_GETTIMEOFDAY
+# include <sys/time.h>
+#endif
 
 #if HAVE_LIBREADLINE
 #define GNUPG_LIBREADLINE_H_INCLUDED
@@ -532,6 +535,36 @@ do_get_time (scheme *sc, pointer args)
   FFI_RETURN_INT (sc, gnupg_get_time ());
 }
 
+/* Return the milliseconds since the first call.  We don't use the
+ * epoch because that would overflow a 32 bit long.  */
+static pointer
+do_get_time_msec (scheme *sc, pointer args)
+{
+  FFI_PROLOG ();
+  static time_t base;
+  long msec;
+  FFI_ARGS_DONE_OR_RETURN (sc, args);
+#ifdef HAVE_GETTIMEOFDAY
+  {
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    if (!base)
+      base = tv.tv_sec;
+    msec = (long)(tv.tv_sec - base) * 1000 + tv.tv_usec / 1000;
+  }
+#else
+  {
+    time_t now = time (NULL);
+
+    if (!base)
+      base = now;
+    msec = (long)(now - base) * 1000;
+  }
+#endif
+  FFI_RETURN_INT (sc, msec);
+}
+
 static pointer
 do_getpid (scheme *sc, pointer args)
 {
@@ -1382,6 +1415,7 @@ ffi_init (scheme *sc, const char *argv0, const char *scriptname,
   ffi_define_function (sc, rmdir);
   ffi_define_function (sc, get_isotime);
   ffi_define_function (sc, get_time);
+  ffi_define_function (sc, get_time_msec);
   ffi_define_function (sc, getpid);
 
   /* Random numbers.  */
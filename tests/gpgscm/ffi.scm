@@ -49,3 +49,6 @@
 
 ;; Get the current time in seconds since the epoch.
 (ffi-define (get-time))
+
+;; Get the time in milliseconds since the first call.
+(ffi-define (get-time-msec))
@@ -106,7 +106,21 @@ int tracing;
 
 
 #ifndef CELL_SEGSIZE
-#define CELL_SEGSIZE    5000  /* # of cells in one segment */
+#define CELL_SEGSIZE    5000  /* # of cells in the first segments */
+#endif
+
+/* New segments are half as large as the heap, but not larger than
+ * this.  Growing the segments keeps the number of segments, and
+ * hence the cost of inserting a new one, small for large heaps.  */
+#ifndef CELL_MAXSEGSIZE
+#define CELL_MAXSEGSIZE (1 << 20)
+#endif
+
+/* Less than 1/CELL_MINFREE of the heap should not be free after a
+ * garbage collector run, or the time spent collecting grows with
+ * the amount of live data instead of with the amount of garbage.  */
+#ifndef CELL_MINFREE
+#define CELL_MINFREE    3
 #endif
 
 /* If less than # of cells are recovered in a garbage collector run,
@@ -162,6 +176,7 @@ pointer COMPILE_HOOK;  /* *compile-hook* */
 
 pointer free_cell;       /* pointer to top of free cells */
 long    fcells;          /* # of free cells */
+long    ncells;          /* # of cells in all segments */
 size_t  inhibit_gc;      /* nesting of gc_disable */
 size_t  reserved_cells;  /* # of reserved cells */
 #ifndef NDEBUG
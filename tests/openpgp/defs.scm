@@ -115,6 +115,7 @@
   '((gpgv "GPGV" "g10/gpgv")
     (gpg-connect-agent "GPG_CONNECT_AGENT" "tools/gpg-connect-agent")
     (gpgconf "GPGCONF" "tools/gpgconf")
+    (keyboxd "KEYBOXD" "kbx/keyboxd")
     (gpg-preset-passphrase "GPG_PRESET_PASSPHRASE"
 			   "agent/gpg-preset-passphrase")
     (gpgtar "GPGTAR" "tools/gpgtar")
@@ -0,0 +1,209 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2020 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Measure the keyring operations on a large synthetic keyring.  This
+;; is not part of the test suite; run it using
+;;
+;;   make -C tests/openpgp check TESTS=keyring-benchmark.scm
+;;
+;; The size of the keyring is controlled by environment variables:
+;;
+;;   BENCH_KEYS     Number of keys to generate (default 1000).
+;;   BENCH_SIGNERS  Number of keys which certify the others (default 10).
+;;   BENCH_SIGS     Certifications on each key (default 1).
+;;   BENCH_LOOKUPS  Number of fingerprint lookups (default 100).
+;;   BENCH_CACHE    Absolute name of a file with the exported keys.
+;;                  If it exists no keys are generated and the keys
+;;                  from the file are used; otherwise the generated
+;;                  keys are stored there so that the next run can
+;;                  skip the slow generation.
+;;   BENCH_KEYBOXD  If set to "yes" also measure the keyboxd.
+;;
+;; For each operation a line
+;;
+;;   bench:NAME:COUNT:MSEC:PER-SECOND:
+;;
+;; is printed.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-environment)
+
+(define (getenv-number key default)
+  (let ((value (string->number (getenv' key (number->string default)))))
+    (if (and (number? value) (>= value 0))
+	value
+	(fail "Invalid value for" key))))
+
+(define nkeys (getenv-number "BENCH_KEYS" 1000))
+(define nsigners (max 1 (min nkeys (getenv-number "BENCH_SIGNERS" 10))))
+(define nsigs (min (- nsigners 1) (getenv-number "BENCH_SIGS" 1)))
+(define nlookups (getenv-number "BENCH_LOOKUPS" 100))
+(define cache-file (getenv' "BENCH_CACHE" "bench-keys.gpg"))
+(define keyring "bench.kbx")
+
+(if (= 0 nkeys)
+    (fail "BENCH_KEYS must not be zero"))
+
+;; Return the milliseconds it took to run THUNK.
+(define (time-it thunk)
+  (let ((start (get-time-msec)))
+    (thunk)
+    (max 1 (- (get-time-msec) start))))
+
+(define (report name count msec)
+  (info (string-append "bench:" name
+		       ":" (number->string count)
+		       ":" (number->string msec)
+		       ":" (number->string (quotient (* count 1000) msec))
+		       ":")))
+
+;; Run THUNK and report the time it took to do COUNT things.
+(define (bench name count thunk)
+  (report name count (time-it thunk)))
+
+;; Return the fingerprints of the primary keys in the colon listing S
+;; as a vector.
+(define (listing->fprs s)
+  (let loop ((lines (string-split-newlines s)) (pub? #f) (acc '()))
+    (if (null? lines)
+	(list->vector (reverse acc))
+	(let ((fields (string-split (car lines) #\:)))
+	  (cond
+	   ((string=? (car fields) "pub")
+	    (loop (cdr lines) #t acc))
+	   ((and pub? (string=? (car fields) "fpr"))
+	    (loop (cdr lines) #f (cons (:fpr fields) acc)))
+	   (else
+	    (loop (cdr lines) pub? acc)))))))
+
+;; Write the parameters to generate N keys to the file NAME.
+(define (write-key-parameters name n)
+  (catch #f (unlink name))
+  (letfd ((fd (open name (logior O_WRONLY O_CREAT O_BINARY) #o600)))
+    (let ((port (fdopen fd "wb")))
+      (do ((i 0 (+ i 1))) ((= i n))
+	(display (string-append
+		  "Key-Type: EdDSA\n"
+		  "Key-Curve: ed25519\n"
+		  "Key-Usage: sign,cert\n"
+		  "Name-Real: Bench Key " (number->string i) "\n"
+		  "Name-Email: bench" (number->string i) "@example.org\n"
+		  "Expire-Date: 0\n"
+		  "%no-protection\n"
+		  "%transient-key\n"
+		  "%commit\n")
+		 port)))))
+
+;; Certify the key FPR with NSIGS keys from SIGNERS, starting at a
+;; random one and skipping the key itself.
+(define (certify fpr signers)
+  (let loop ((k (random nsigners)) (n 0) (args '()))
+    (cond
+     ((= n nsigs)
+      (unless (null? args)
+	      (call-check `(,@GPG --yes ,@args --quick-sign-key ,fpr))))
+     ((string=? fpr (vector-ref signers k))
+      (loop (modulo (+ k 1) nsigners) n args))
+     (else
+      (loop (modulo (+ k 1) nsigners) (+ n 1)
+	    `(-u ,(string-append (vector-ref signers k) "!") ,@args))))))
+
+(define (create-keys)
+  (info "Generating" nkeys "keys, this may take a while")
+  (write-key-parameters "bench-keys.parm" nkeys)
+  (bench "generate" nkeys
+	 (lambda ()
+	   (call-check `(,@GPG --quiet --generate-key "bench-keys.parm"))))
+
+  (let* ((fprs (listing->fprs
+		(call-check `(,@GPG --with-colons --list-keys))))
+	 (signers (vector-head fprs nsigners)))
+    (unless (> nsigs 0)
+	    (info "No certifications requested"))
+    (when (> nsigs 0)
+	  (info "Adding" nsigs "certifications to each key")
+	  (bench "certify" (* nsigs (vector-length fprs))
+		 (lambda ()
+		   (do ((i 0 (+ i 1))) ((= i (vector-length fprs)))
+		     (if (= 0 (modulo (+ i 1) 1000))
+			 (log " " (+ i 1) "keys done"))
+		     (certify (vector-ref fprs i) signers))))))
+
+  (call-check `(,@GPG --yes --output ,cache-file --export)))
+
+(define (vector-head v n)
+  (let ((r (make-vector n)))
+    (do ((i 0 (+ i 1))) ((= i n) r)
+      (vector-set! r i (vector-ref v i)))))
+
+;; Pick N random fingerprints from FPRS.
+(define (random-fprs fprs n)
+  (let loop ((i 0) (acc '()))
+    (if (= i n)
+	acc
+	(loop (+ i 1)
+	      (cons (vector-ref fprs (random (vector-length fprs))) acc)))))
+
+(if (file-exists? cache-file)
+    (info "Using the keys from" cache-file)
+    (create-keys))
+
+(define BENCH `(,@GPG --no-default-keyring --keyring ,keyring
+		      --trustdb-name bench.trustdb))
+
+(define fprs #f)
+(define (count-keys) (vector-length fprs))
+
+;; We know the number of keys imported only after listing them.
+(catch #f (unlink keyring))
+(let* ((import-msec
+	(time-it (lambda ()
+		   (call-check `(,@BENCH --quiet --import ,cache-file)))))
+       (list-msec
+	(time-it (lambda ()
+		   (set! fprs (listing->fprs
+			       (call-check `(,@BENCH --with-colons
+						    --list-keys))))))))
+  (report "import" (count-keys) import-msec)
+  (report "list-keys" (count-keys) list-msec))
+(if (= 0 (vector-length fprs))
+    (fail "No keys in" keyring))
+
+(define lookups (random-fprs fprs nlookups))
+(bench "lookup-fpr" nlookups
+       (lambda () (call-check `(,@BENCH --with-colons --list-keys ,@lookups))))
+
+(bench "check-trustdb" (count-keys)
+       (lambda ()
+	 (call-check `(,@BENCH --trust-model pgp
+			       --trusted-key ,(vector-ref fprs 0)
+			       --check-trustdb))))
+
+(if (string=? "yes" (getenv "BENCH_KEYBOXD"))
+    (let ((KBX `(,@GPG --use-keyboxd
+		       --keyboxd-program ,(tool 'keyboxd))))
+      (bench "keyboxd-import" (count-keys)
+	     (lambda () (call-check `(,@KBX --quiet --import ,cache-file))))
+      (bench "keyboxd-lookup-fpr" nlookups
+	     (lambda ()
+	       (call-check `(,@KBX --with-colons --list-keys ,@lookups))))
+      (call-check `(,(tool 'gpg-connect-agent) --keyboxd
+		    --keyboxd-program ,(tool 'keyboxd)
+		    KILLKEYBOXD /bye)))
+    (info "Skipping the keyboxd, set BENCH_KEYBOXD=yes to measure it"))
@@ -1607,6 +1607,90 @@ scd_checkpin (const char *serialno)
 }
 
 
+/* Sign the SHA-256 hash in DATA or decrypt the ciphertext in DATA,
+ * depending on DECRYPT, with the key KEYREF by passing the respective
+ * commands directly to the scdaemon.  This is used for benchmarking
+ * and thus the result is not returned.  */
+gpg_error_t
+scd_pkop (int decrypt, const char *keyref, const void *data, size_t datalen)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  struct default_inq_parm_s dfltparm;
+  const unsigned char *s = data;
+  membuf_t result;
+  size_t len;
+  char *p;
+  int i;
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+
+  err = start_agent (0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  for (len = 0; len < datalen;)
+    {
+      p = stpcpy (line, "SCD SETDATA ");
+      if (len)
+        p = stpcpy (p, "--append ");
+      for (i=0; len < datalen && (i*2 < DIM(line)-50); i++, len++)
+        {
+          sprintf (p, "%02X", s[len]);
+          p += 2;
+        }
+      err = assuan_transact (agent_ctx, line,
+                             NULL, NULL, NULL, NULL, NULL, NULL);
+      if (err)
+        return err;
+    }
+
+  if (decrypt)
+    snprintf (line, sizeof line, "SCD PKDECRYPT %s", keyref);
+  else
+    snprintf (line, sizeof line, "SCD PKSIGN --hash=sha256 %s", keyref);
+  init_membuf (&result, 1024);
+  err = assuan_transact (agent_ctx, line,
+                         put_membuf_cb, &result,
+                         default_inq_cb, &dfltparm,
+                         NULL, NULL);
+  xfree (get_membuf (&result, &len));
+  return status_sc_op_failure (err);
+}
+
+
+/* Return the APDU and operation statistics of the scdaemon as a
+ * malloced string at R_STATS.  See "GETINFO stats" of the scdaemon
+ * for the format.  */
+gpg_error_t
+scd_get_stats (char **r_stats)
+{
+  gpg_error_t err;
+  membuf_t data;
+
+  *r_stats = NULL;
+  err = start_agent (0);
+  if (err)
+    return err;
+
+  init_membuf (&data, 512);
+  err = assuan_transact (agent_ctx, "SCD GETINFO stats",
+                         put_membuf_cb, &data,
+                         NULL, NULL, NULL, NULL);
+  if (err)
+    {
+      xfree (get_membuf (&data, NULL));
+      return err;
+    }
+  put_membuf (&data, "", 1);
+  *r_stats = get_membuf (&data, NULL);
+  if (!*r_stats)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
 /* Return the S2K iteration count as computed by gpg-agent.  On error
  * print a warning and return a default value. */
 unsigned long
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #ifdef HAVE_LIBREADLINE
 # define GNUPG_LIBREADLINE_H_INCLUDED
 # include <readline/readline.h>
@@ -3004,6 +3005,246 @@ cmd_yubikey (card_info_t info, char *argstr)
   return err;
 }
 
+
+/* Return the time in microseconds for benchmarking.  */
+static unsigned long long
+benchmark_time (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/* Parse the "op:NAME:..." line of the scdaemon statistics STATS and
+ * store its values COUNT, ERRORS, APDUS, USEC and LOCKUSEC at
+ * R_VALUES.  All values are set to zero if NAME is not found.  */
+static void
+parse_op_stats (const char *stats, const char *name,
+                unsigned long long r_values[5])
+{
+  const char *s;
+  char *endp;
+  size_t n = strlen (name);
+  int i;
+
+  memset (r_values, 0, 5 * sizeof *r_values);
+  for (s = stats; s && *s; s = strchr (s, '\n'), s = s? s+1 : NULL)
+    if (!strncmp (s, "op:", 3) && !strncmp (s+3, name, n) && s[3+n] == ':')
+      {
+        s += 3 + n;
+        for (i=0; i < 5 && *s == ':'; i++, s = endp)
+          r_values[i] = strtoull (s+1, &endp, 10);
+        break;
+      }
+}
+
+
+/* Create the data for a decryption with the public key KEY.  For RSA
+ * we encrypt a random session key; for ECDH we use the public point
+ * of the key itself as the ephemeral key.  */
+static gpg_error_t
+benchmark_decrypt_data (gcry_sexp_t key, unsigned char **r_data,
+                        size_t *r_datalen)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_data = NULL;
+  gcry_sexp_t s_ciph = NULL;
+  gcry_sexp_t l = NULL;
+  unsigned char sesskey[32];
+  const char *s;
+  size_t n;
+
+  *r_data = NULL;
+  if ((l = gcry_sexp_find_token (key, "q", 0)))
+    ;
+  else if (gcry_sexp_find_token (key, "n", 0))
+    {
+      gcry_randomize (sesskey, sizeof sesskey, GCRY_STRONG_RANDOM);
+      err = gcry_sexp_build (&s_data, NULL, "(data (flags pkcs1)(value %b))",
+                             (int)sizeof sesskey, sesskey);
+      if (!err)
+        err = gcry_pk_encrypt (&s_ciph, s_data, key);
+      if (err)
+        goto leave;
+      l = gcry_sexp_find_token (s_ciph, "a", 0);
+    }
+  else
+    {
+      err = gpg_error (GPG_ERR_PUBKEY_ALGO);
+      goto leave;
+    }
+
+  s = l? gcry_sexp_nth_data (l, 1, &n) : NULL;
+  if (!s || !n)
+    {
+      err = gpg_error (GPG_ERR_INV_SEXP);
+      goto leave;
+    }
+  *r_data = xtrymalloc (n);
+  if (!*r_data)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  memcpy (*r_data, s, n);
+  *r_datalen = n;
+  err = 0;
+
+ leave:
+  gcry_sexp_release (l);
+  gcry_sexp_release (s_ciph);
+  gcry_sexp_release (s_data);
+  return err;
+}
+
+
+static int
+cmp_ulonglong (const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+
+  return x < y? -1 : x > y;
+}
+
+
+static gpg_error_t
+cmd_benchmark (card_info_t info, char *argstr)
+{
+  gpg_error_t err;
+  estream_t fp = opt.interactive? NULL : es_stdout;
+  int opt_decrypt;
+  char *argv[2];
+  int argc;
+  char *keyref_buffer = NULL;
+  char *keyref;
+  unsigned long count, i;
+  gcry_sexp_t key = NULL;
+  unsigned char *data = NULL;
+  size_t datalen;
+  unsigned char hash[32];
+  unsigned long long *times = NULL;
+  unsigned long long started, total;
+  unsigned long long before[5], after[5];
+  char *stats = NULL;
+
+  if (!info)
+    return print_help
+      ("BENCHMARK [--decrypt] KEYREF [N]\n\n"
+       "Sign N (default 10) random hashes or decrypt N ciphertexts\n"
+       "with the key KEYREF and show the time taken along with the\n"
+       "statistics of the scdaemon.",
+       APP_TYPE_OPENPGP, APP_TYPE_PIV, APP_TYPE_NKS, APP_TYPE_P15, 0);
+
+  opt_decrypt = has_leading_option (argstr, "--decrypt");
+  argstr = skip_options (argstr);
+
+  argc = split_fields (argstr, argv, DIM (argv));
+  if (argc < 1)
+    {
+      err = gpg_error (GPG_ERR_INV_ARG);
+      goto leave;
+    }
+  count = argc > 1? strtoul (argv[1], NULL, 10) : 10;
+  if (count < 1 || count > 100000)
+    {
+      err = gpg_error (GPG_ERR_INV_ARG);
+      goto leave;
+    }
+
+  /* Upcase the keyref; prepend cardtype if needed.  */
+  keyref = argv[0];
+  if (!strchr (keyref, '.'))
+    keyref_buffer = xstrconcat (app_type_string (info->apptype), ".",
+                                keyref, NULL);
+  else
+    keyref_buffer = xstrdup (keyref);
+  ascii_strupr (keyref_buffer);
+  keyref = keyref_buffer;
+
+  if (opt_decrypt)
+    {
+      err = scd_readkey (keyref, &key);
+      if (!err)
+        err = benchmark_decrypt_data (key, &data, &datalen);
+      if (err)
+        goto leave;
+    }
+
+  times = xtrycalloc (count, sizeof *times);
+  if (!times)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* The first operation may ask for the PIN and is thus not part of
+   * the measurement.  */
+  gcry_create_nonce (hash, sizeof hash);
+  if (opt_decrypt)
+    err = scd_pkop (1, keyref, data, datalen);
+  else
+    err = scd_pkop (0, keyref, hash, sizeof hash);
+  if (err)
+    goto leave;
+
+  err = scd_get_stats (&stats);
+  if (err)
+    goto leave;
+  parse_op_stats (stats, opt_decrypt? "decipher" : "sign", before);
+  xfree (stats);
+  stats = NULL;
+
+  for (total=i=0; i < count; i++)
+    {
+      gcry_create_nonce (hash, sizeof hash);
+      started = benchmark_time ();
+      if (opt_decrypt)
+        err = scd_pkop (1, keyref, data, datalen);
+      else
+        err = scd_pkop (0, keyref, hash, sizeof hash);
+      times[i] = benchmark_time () - started;
+      if (err)
+        goto leave;
+      total += times[i];
+    }
+
+  err = scd_get_stats (&stats);
+  if (err)
+    goto leave;
+  parse_op_stats (stats, opt_decrypt? "decipher" : "sign", after);
+  for (i=0; i < 5; i++)
+    after[i] = after[i] >= before[i]? after[i] - before[i] : 0;
+
+  qsort (times, count, sizeof *times, cmp_ulonglong);
+  tty_fprintf (fp, "%lu %s operations in %llu ms\n", count,
+               opt_decrypt? "decrypt" : "sign", total / 1000);
+  tty_fprintf (fp, "     min: %8.2f ms\n", times[0] / 1000.0);
+  tty_fprintf (fp, "  median: %8.2f ms\n", times[count/2] / 1000.0);
+  tty_fprintf (fp, "     p90: %8.2f ms\n", times[(count-1)*90/100] / 1000.0);
+  tty_fprintf (fp, "     p99: %8.2f ms\n", times[(count-1)*99/100] / 1000.0);
+  tty_fprintf (fp, "     max: %8.2f ms\n", times[count-1] / 1000.0);
+  if (after[0])
+    {
+      tty_fprintf (fp, "scdaemon: %.1f APDUs/op, %.2f ms/op in scdaemon,"
+                   " %.2f ms/op waiting for locks\n",
+                   (double)after[2] / after[0],
+                   after[3] / 1000.0 / after[0],
+                   after[4] / 1000.0 / after[0]);
+    }
+  tty_fprintf (fp, "%s", stats);
+
+ leave:
+  xfree (stats);
+  xfree (times);
+  xfree (data);
+  gcry_sexp_release (key);
+  xfree (keyref_buffer);
+  return err;
+}
+
 
 
 /* Data used by the command parser.  This needs to be outside of the
@@ -3015,7 +3256,7 @@ enum cmdids
     cmdNAME, cmdURL, cmdFETCH, cmdLOGIN, cmdLANG, cmdSALUT, cmdCAFPR,
     cmdFORCESIG, cmdGENERATE, cmdPASSWD, cmdPRIVATEDO, cmdWRITECERT,
     cmdREADCERT, cmdWRITEKEY,  cmdUNBLOCK, cmdFACTRST, cmdKDFSETUP,
-    cmdUIF, cmdAUTH, cmdYUBIKEY,
+    cmdUIF, cmdAUTH, cmdYUBIKEY, cmdBENCHMARK,
     cmdINVCMD
   };
 
@@ -3055,6 +3296,7 @@ static struct
   { "writecert", cmdWRITECERT,  N_("store a certificate to a data object")},
   { "writekey",  cmdWRITEKEY,   N_("store a private key to a data object")},
   { "yubikey",   cmdYUBIKEY,    N_("Yubikey management commands")},
+  { "benchmark", cmdBENCHMARK,  N_("measure the speed of key operations")},
   { NULL, cmdINVCMD, NULL }
 };
 
@@ -3176,6 +3418,7 @@ dispatch_command (card_info_t info, const char *orig_command)
     case cmdKDFSETUP:     err = cmd_kdfsetup (info, argstr); break;
     case cmdUIF:          err = cmd_uif (info, argstr); break;
     case cmdYUBIKEY:      err = cmd_yubikey (info, argstr); break;
+    case cmdBENCHMARK:    err = cmd_benchmark (info, argstr); break;
 
     case cmdINVCMD:
     default:
@@ -3397,6 +3640,7 @@ interactive_loop (void)
         case cmdKDFSETUP:  err = cmd_kdfsetup (info, argstr); break;
         case cmdUIF:       err = cmd_uif (info, argstr); break;
         case cmdYUBIKEY:   err = cmd_yubikey (info, argstr); break;
+        case cmdBENCHMARK: err = cmd_benchmark (info, argstr); break;
 
         case cmdINVCMD:
         default:
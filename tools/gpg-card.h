@@ -226,6 +226,9 @@ gpg_error_t scd_cardlist (strlist_t *result);
 gpg_error_t scd_applist (strlist_t *result, int all);
 gpg_error_t scd_change_pin (const char *pinref, int reset_mode);
 gpg_error_t scd_checkpin (const char *serialno);
+gpg_error_t scd_pkop (int decrypt, const char *keyref,
+                      const void *data, size_t datalen);
+gpg_error_t scd_get_stats (char **r_stats);
 
 unsigned long agent_get_s2k_count (void);
 
@@ -33,6 +33,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/wait.h>
+#endif
 
 #define INCLUDED_BY_MAIN_MODULE 1
 #include "../common/util.h"
@@ -52,6 +55,9 @@
 /* The time we wait for a confirmation response.  */
 #define PENDING_TTL (86400 * 3)  /* 3 days.  */
 
+/* The maximum number of processes for --jobs.  */
+#define MAX_JOBS 64
+
 
 /* Constants to identify the commands and options. */
 enum cmd_and_opt_values
@@ -79,6 +85,7 @@ enum cmd_and_opt_values
     oHeader,
     oWithDir,
     oWithFile,
+    oJobs,
 
     oDummy
   };
@@ -118,6 +125,7 @@ static gpgrt_opt_t opts[] = {
                 "|NAME=VALUE|add \"NAME: VALUE\" as header to all mails"),
   ARGPARSE_s_n (oWithDir, "with-dir", "@"),
   ARGPARSE_s_n (oWithFile, "with-file", "@"),
+  ARGPARSE_s_i (oJobs, "jobs", "|N|run up to N worker processes"),
 
   ARGPARSE_end ()
 };
@@ -152,6 +160,14 @@ static int opt_with_dir;
 /* Flag for --with-file.  */
 static int opt_with_file;
 
+/* The worker processes started by start_workers.  */
+static struct
+{
+  int njobs;      /* Number of processes including the parent.  */
+  int worker;     /* 0 for the parent or the number of this worker.  */
+  pid_t pids[MAX_JOBS];  /* The workers or -1 if not started.  */
+} workers;
+
 
 /* Prototypes.  */
 static gpg_error_t get_domain_list (strlist_t *r_list);
@@ -163,6 +179,7 @@ static gpg_error_t command_list_domains (void);
 static gpg_error_t command_revoke_key (const char *mailaddr);
 static gpg_error_t command_check_key (const char *mailaddr);
 static gpg_error_t command_cron (void);
+static gpg_error_t command_receive_files (int nfiles, char **files);
 
 
 
@@ -251,6 +268,9 @@ parse_arguments (gpgrt_argparse_t *pargs, gpgrt_opt_t *popts)
         case oWithFile:
           opt_with_file = 1;
           break;
+        case oJobs:
+          opt.jobs = pargs->r.ret_int;
+          break;
 
 	case aReceive:
         case aCron:
@@ -371,9 +391,10 @@ main (int argc, char **argv)
   switch (cmd)
     {
     case aReceive:
-      if (argc)
-        wrong_args ("--receive");
-      err = wks_receive (es_stdin, command_receive_cb, NULL);
+      if (!argc)
+        err = wks_receive (es_stdin, command_receive_cb, NULL);
+      else
+        err = command_receive_files (argc, argv);
       break;
 
     case aCron:
@@ -1605,6 +1626,149 @@ command_receive_cb (void *opaque, const char *mediatype,
 }
 
 
+
+/* Start the worker processes for a command processing NITEMS items
+ * as requested by --jobs.  Each process handles the items for which
+ * my_work_item returns true and then calls finish_workers; this
+ * terminates the workers and lets the parent wait for them.  The
+ * parent also processes the items of workers which could not be
+ * started.  */
+static void
+start_workers (int nitems)
+{
+  int i;
+
+  memset (&workers, 0, sizeof workers);
+  workers.njobs = opt.jobs;
+  if (workers.njobs > nitems)
+    workers.njobs = nitems;
+  if (workers.njobs > MAX_JOBS)
+    workers.njobs = MAX_JOBS;
+#ifdef HAVE_W32_SYSTEM
+  workers.njobs = 1;
+#endif
+  if (workers.njobs < 2)
+    {
+      workers.njobs = 1;
+      return;
+    }
+
+#ifndef HAVE_W32_SYSTEM
+  es_fflush (es_stdout);
+  es_fflush (es_stderr);
+  workers.pids[0] = (pid_t)(-1);
+  for (i=1; i < workers.njobs; i++)
+    {
+      workers.pids[i] = fork ();
+      if (workers.pids[i] == (pid_t)(-1))
+        log_error ("error forking worker process: %s\n", strerror (errno));
+      else if (!workers.pids[i])
+        {
+          workers.worker = i;
+          return;
+        }
+    }
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
+/* Return true if the item with index IDX is to be processed by this
+ * process.  */
+static int
+my_work_item (int idx)
+{
+  int worker = idx % workers.njobs;
+
+  if (worker == workers.worker)
+    return 1;
+  return !workers.worker && workers.pids[worker] == (pid_t)(-1);
+}
+
+
+/* Finish the processing of the items.  Terminates a worker process
+ * and lets the parent wait for all workers.  */
+static void
+finish_workers (void)
+{
+#ifndef HAVE_W32_SYSTEM
+  int i, status;
+
+  if (workers.njobs < 2)
+    return;
+
+  if (workers.worker)
+    {
+      es_fflush (es_stdout);
+      es_fflush (es_stderr);
+      _exit (log_get_errorcount (0)? 1 : 0);
+    }
+
+  for (i=1; i < workers.njobs; i++)
+    {
+      if (workers.pids[i] == (pid_t)(-1))
+        continue;
+      while (waitpid (workers.pids[i], &status, 0) == (pid_t)(-1)
+             && errno == EINTR)
+        ;
+      if (!WIFEXITED (status) || WEXITSTATUS (status))
+        log_inc_errorcount ();
+    }
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
+/* Process the Web Key Service mails in the NFILES FILES.  Each file
+ * holds one mail; this allows an MTA to spool the mails for a batch
+ * run.  Unless the mails are written to stdout or a file the mails
+ * are processed by up to --jobs processes.  */
+static gpg_error_t
+command_receive_files (int nfiles, char **files)
+{
+  gpg_error_t err;
+  gpg_error_t firsterr = 0;
+  estream_t fp;
+  int i;
+
+  if (opt.use_sendmail && !opt.output)
+    start_workers (nfiles);
+  else
+    {
+      if (opt.jobs > 1)
+        log_info ("note: option '%s' is only used with '%s'\n",
+                  "--jobs", "--send");
+      memset (&workers, 0, sizeof workers);
+      workers.njobs = 1;
+    }
+
+  for (i=0; i < nfiles; i++)
+    {
+      if (!my_work_item (i))
+        continue;
+      fp = es_fopen (files[i], "rb");
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("can't open '%s': %s\n", files[i], gpg_strerror (err));
+        }
+      else
+        {
+          if (opt.verbose)
+            log_info ("processing '%s'\n", files[i]);
+          err = wks_receive (fp, command_receive_cb, NULL);
+          es_fclose (fp);
+          if (err)
+            log_error ("error processing '%s': %s\n",
+                       files[i], gpg_strerror (err));
+        }
+      if (err && !firsterr)
+        firsterr = err;
+    }
+
+  finish_workers ();
+  return firsterr;
+}
+
+
 
 /* Return a list of all configured domains.  Each list element is the
  * top directory for the domain.  To figure out the actual domain
@@ -1770,15 +1934,20 @@ expire_pending_confirmations (strlist_t domaindirs)
   gpg_error_t err = 0;
   strlist_t sl;
   const char *domain;
+  int i;
 
-  for (sl = domaindirs; sl; sl = sl->next)
+  start_workers (strlist_length (domaindirs));
+  for (i=0, sl = domaindirs; sl; i++, sl = sl->next)
     {
+      if (!my_work_item (i))
+        continue;
       domain = strrchr (sl->d, '/');
       log_assert (domain);
       domain++;
 
       expire_one_domain (sl->d, domain);
     }
+  finish_workers ();
 
   return err;
 }
@@ -43,6 +43,7 @@ struct
   const char *directory;
   const char *default_from;
   strlist_t extra_headers;
+  int jobs;
 } opt;
 
 /* Debug values and macros.  */
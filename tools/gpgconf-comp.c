@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <time.h>
 #include <stdarg.h>
@@ -48,6 +49,8 @@
 #include "../common/exechelp.h"
 #include "../common/sysutils.h"
 #include "../common/status.h"
+#include "../common/exectool.h"
+#include "../common/membuf.h"
 
 #include "../common/gc-opt-flags.h"
 #include "gpgconf.h"
@@ -874,6 +877,75 @@ gc_component_reload (int component)
 }
 
 
+/* Print the output of "GETINFO metrics" of all running daemons to
+ * OUT.  Each line is prefixed with the name of the daemon.  Daemons
+ * which are not running are not started and silently skipped.  The
+ * scdaemon is asked through the agent.  */
+void
+gc_component_show_metrics (estream_t out)
+{
+  static const struct {
+    const char *name;
+    const char *flag;
+    const char *command;
+  } daemons[] = {
+    { GPG_AGENT_NAME, NULL,        "GETINFO metrics" },
+    { SCDAEMON_NAME,  NULL,        "SCD GETINFO metrics" },
+    { DIRMNGR_NAME,   "--dirmngr", "GETINFO metrics" },
+    { KEYBOXD_NAME,   "--keyboxd", "GETINFO metrics" }
+  };
+  gpg_error_t err;
+  const char *pgmname;
+  const char *argv[12];
+  char *result, *line, *p;
+  int d, i;
+
+  pgmname = gnupg_module_name (GNUPG_MODULE_NAME_CONNECT_AGENT);
+  for (d=0; d < DIM (daemons); d++)
+    {
+      i = 0;
+      argv[i++] = "--quiet";  /* Tells gnupg_exec_tool to be quiet.  */
+      if (!gnupg_default_homedir_p ())
+        {
+          argv[i++] = "--homedir";
+          argv[i++] = gnupg_homedir ();
+        }
+      if (daemons[d].flag)
+        argv[i++] = daemons[d].flag;
+      argv[i++] = "--no-autostart";
+      argv[i++] = "--decode";
+      if (!strcmp (daemons[d].name, SCDAEMON_NAME))
+        {
+          /* Don't let the agent start the scdaemon.  */
+          argv[i++] = "-s";
+          argv[i++] = "GETINFO scd_running";
+          argv[i++] = "/if ${! $?}";
+          argv[i++] = daemons[d].command;
+          argv[i++] = "/end";
+        }
+      else
+        argv[i++] = daemons[d].command;
+      argv[i++] = "/bye";
+      argv[i] = NULL;
+      log_assert (i < DIM (argv));
+
+      err = gnupg_exec_tool (pgmname, argv, NULL, &result, NULL);
+      if (err)
+        continue;  /* Most likely not running.  */
+
+      for (line = result; line && *line; line = p)
+        {
+          p = strchr (line, '\n');
+          if (p)
+            *p++ = 0;
+          if (line[0] == 'D' && line[1] == ' ' && line[2])
+            es_fprintf (out, "%s:%s\n", daemons[d].name, line + 2);
+        }
+      xfree (result);
+    }
+}
+
+
 
 /* More or less Robust version of dgettext.  It has the side effect of
    switching the codeset to utf-8 because this is what we want to
@@ -1497,18 +1569,343 @@ find_option (gc_component_id_t component, const char *name)
 
 
 
-/* Retrieve the options for the component COMPONENT.  With
+/* The outputs of the commands used to query the options of a
+ * component are cached in the file OPTION_CACHE_NAME in the home
+ * directory.  An entry is valid as long as the program, the language
+ * and the version of gpgconf do not change.  The file looks like
+ *
+ *   P <program name>
+ *   S <stamp>
+ *   T <length>
+ *   <output of --dump-option-table>
+ *   L <length>
+ *   <output of --gpgconf-list>
+ */
+#define OPTION_CACHE_NAME "gpgconf.cache"
+
+/* The commands to query a component.  */
+static const char *query_commands[2] =
+  { "--dump-option-table", "--gpgconf-list" };
+
+/* An entry of the option cache.  */
+struct option_cache_s
+{
+  struct option_cache_s *next;
+  char *pgmname;
+  char *stamp;         /* NULL if the entry shall not be stored.  */
+  char *output[2];     /* The output of the QUERY_COMMANDS.  */
+};
+typedef struct option_cache_s *option_cache_t;
+
+static option_cache_t option_cache;
+static int option_cache_loaded;
+static int option_cache_dirty;
+
+/* The state of the query of one component.  */
+struct component_query_s
+{
+  const char *pgmname;  /* NULL if the component is not queried.  */
+  option_cache_t entry;
+  int running;          /* The processes below have been spawned.  */
+  estream_t outfp[2];
+  pid_t pid[2];
+};
+
+
+/* Return a malloced string to check whether the cached output for
+ * PGMNAME is still valid or NULL if the program can't be stat-ed.  */
+static char *
+make_option_cache_stamp (const char *pgmname)
+{
+  struct stat sb;
+  const char *envvars[] = { "LANGUAGE", "LC_ALL", "LC_MESSAGES", "LANG" };
+  char *stamp, *tmp;
+  const char *s;
+  int i;
+
+  if (stat (pgmname, &sb))
+    return NULL;
+  stamp = xasprintf ("%s %llu %lld", VERSION,
+                     (unsigned long long)sb.st_size,
+                     (long long)sb.st_mtime);
+  /* The option descriptions are translated.  */
+  for (i=0; i < DIM (envvars); i++)
+    {
+      s = getenv (envvars[i]);
+      tmp = xstrconcat (stamp, " ", s? s : "-", NULL);
+      xfree (stamp);
+      stamp = tmp;
+    }
+  return stamp;
+}
+
+
+/* Read N bytes from FP into a malloced string.  Returns NULL on
+ * error.  */
+static char *
+read_cache_data (estream_t fp, size_t n)
+{
+  char *buf;
+  size_t nread;
+
+  buf = xmalloc (n + 1);
+  if (es_read (fp, buf, n, &nread) || nread != n)
+    {
+      xfree (buf);
+      return NULL;
+    }
+  buf[n] = 0;
+  return buf;
+}
+
+
+/* Load the option cache.  Errors are ignored; an unreadable cache is
+ * considered to be empty.  */
+static void
+load_option_cache (void)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t length;
+  option_cache_t entry = NULL;
+  int i;
+
+  if (option_cache_loaded)
+    return;
+  option_cache_loaded = 1;
+
+  fname = make_filename (gnupg_homedir (), OPTION_CACHE_NAME, NULL);
+  fp = es_fopen (fname, "rb");
+  xfree (fname);
+  if (!fp)
+    return;
+
+  while ((length = es_read_line (fp, &line, &line_len, NULL)) > 0)
+    {
+      if (line[length - 1] == '\n')
+        line[--length] = 0;
+      if (length < 2 || line[1] != ' ')
+        break;
+      if (*line == 'P')
+        {
+          entry = xcalloc (1, sizeof *entry);
+          entry->pgmname = xstrdup (line + 2);
+          entry->next = option_cache;
+          option_cache = entry;
+        }
+      else if (*line == 'S' && entry && !entry->stamp)
+        entry->stamp = xstrdup (line + 2);
+      else if ((*line == 'T' || *line == 'L') && entry && entry->stamp)
+        {
+          i = *line == 'L';
+          if (entry->output[i]
+              || !(entry->output[i] = read_cache_data (fp, atoi (line+2))))
+            break;
+        }
+      else
+        break;
+    }
+  es_fclose (fp);
+  xfree (line);
+
+  /* Invalidate incomplete entries.  */
+  for (entry = option_cache; entry; entry = entry->next)
+    if (!entry->output[0] || !entry->output[1])
+      {
+        xfree (entry->stamp);
+        entry->stamp = NULL;
+      }
+}
+
+
+/* Write the option cache back if it has been changed.  */
+static void
+save_option_cache (void)
+{
+  gpg_error_t err;
+  char *fname, *tmpfname;
+  estream_t fp;
+  option_cache_t entry;
+  int i;
+
+  if (!option_cache_dirty)
+    return;
+  option_cache_dirty = 0;
+
+  fname = make_filename (gnupg_homedir (), OPTION_CACHE_NAME, NULL);
+  tmpfname = xstrconcat (fname, ".tmp", NULL);
+  fp = es_fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      if (opt.verbose)
+        gc_error (0, errno, "can't create '%s'", tmpfname);
+      goto leave;
+    }
+  for (entry = option_cache; entry; entry = entry->next)
+    {
+      if (!entry->stamp)
+        continue;
+      es_fprintf (fp, "P %s\nS %s\n", entry->pgmname, entry->stamp);
+      for (i=0; i < 2; i++)
+        {
+          es_fprintf (fp, "%c %zu\n", i? 'L':'T', strlen (entry->output[i]));
+          es_fputs (entry->output[i], fp);
+        }
+    }
+  if (es_fclose (fp))
+    {
+      if (opt.verbose)
+        gc_error (0, errno, "error writing '%s'", tmpfname);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    {
+      if (opt.verbose)
+        gc_error (0, 0, "error renaming '%s': %s",
+                  tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+    }
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+}
+
+
+/* Prepare the query Q of the options of COMPONENT.  If the output of
+ * the component is not cached the processes are spawned.  With
  * ONLY_INSTALLED set components which are not installed are silently
- * ignored. */
+ * ignored.  */
 static void
-retrieve_options_from_program (gc_component_id_t component, int only_installed)
+start_component_query (gc_component_id_t component, int only_installed,
+                       struct component_query_s *q)
 {
   gpg_error_t err;
   const char *pgmname;
   const char *argv[2];
-  estream_t outfp;
+  option_cache_t entry;
+  char *stamp;
+  int i;
+
+  pgmname = (gc_component[component].module_name
+             ? gnupg_module_name (gc_component[component].module_name)
+             : gc_component[component].program );
+
+  if (only_installed && access (pgmname, X_OK))
+    {
+      return;  /* The component is not installed.  */
+    }
+  q->pgmname = pgmname;
+
+  stamp = make_option_cache_stamp (pgmname);
+  for (entry = option_cache; entry; entry = entry->next)
+    if (!strcmp (entry->pgmname, pgmname))
+      break;
+  if (entry && entry->stamp && stamp && !strcmp (entry->stamp, stamp))
+    {
+      xfree (stamp);
+      q->entry = entry;
+      return;  /* Cache hit.  */
+    }
+
+  if (!entry)
+    {
+      entry = xcalloc (1, sizeof *entry);
+      entry->pgmname = xstrdup (pgmname);
+      entry->next = option_cache;
+      option_cache = entry;
+    }
+  xfree (entry->stamp);
+  entry->stamp = stamp;
+  for (i=0; i < 2; i++)
+    {
+      xfree (entry->output[i]);
+      entry->output[i] = NULL;
+    }
+  q->entry = entry;
+
+  for (i=0; i < 2; i++)
+    {
+      argv[0] = query_commands[i];
+      argv[1] = NULL;
+      err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
+                                 NULL, &q->outfp[i], NULL, &q->pid[i]);
+      if (err)
+        {
+          gc_error (1, 0, "could not gather %s from '%s': %s",
+                    i? "active options" : "option table",
+                    pgmname, gpg_strerror (err));
+        }
+    }
+  q->running = 1;
+}
+
+
+/* Collect the output of the processes of the query Q.  */
+static void
+finish_component_query (struct component_query_s *q)
+{
+  gpg_error_t err;
+  membuf_t mb;
+  char buffer[4096];
+  size_t nread;
   int exitcode;
-  pid_t pid;
+  int i;
+
+  if (!q->running)
+    return;
+  q->running = 0;
+
+  for (i=0; i < 2; i++)
+    {
+      init_membuf (&mb, 4096);
+      while (!es_read (q->outfp[i], buffer, sizeof buffer, &nread) && nread)
+        put_membuf (&mb, buffer, nread);
+      if (es_ferror (q->outfp[i]))
+        gc_error (1, errno, "error reading from %s", q->pgmname);
+      if (es_fclose (q->outfp[i]))
+        gc_error (1, errno, "error closing %s", q->pgmname);
+      put_membuf (&mb, "", 1);
+      q->entry->output[i] = get_membuf (&mb, NULL);
+      if (!q->entry->output[i])
+        gc_error (1, errno, "error reading from %s", q->pgmname);
+
+      err = gnupg_wait_process (q->pgmname, q->pid[i], 1, &exitcode);
+      if (err)
+        gc_error (1, 0, "running %s failed (exitcode=%d): %s",
+                  q->pgmname, exitcode, gpg_strerror (err));
+      gnupg_release_process (q->pid[i]);
+    }
+  if (q->entry->stamp)
+    option_cache_dirty = 1;
+}
+
+
+/* Open a memory stream to read the cached output OUTPUT.  */
+static estream_t
+open_query_output (const char *output)
+{
+  estream_t fp;
+
+  fp = es_fopenmem_init (0, "rb", output, strlen (output));
+  if (!fp)
+    gc_error (1, errno, "error creating a memory stream");
+  return fp;
+}
+
+
+/* Retrieve the options for the component COMPONENT from the output
+ * ENTRY of its query.  */
+static void
+retrieve_options_from_program (gc_component_id_t component,
+                               option_cache_t entry)
+{
+  const char *pgmname = entry->pgmname;
+  estream_t outfp;
   known_option_t *known_option;
   gc_option_t *option;
   char *line = NULL;
@@ -1526,27 +1923,8 @@ retrieve_options_from_program (gc_component_id_t component, int only_installed)
   size_t opt_info_size = 0;           /* Its allocated length.       */
   int i;
 
-  pgmname = (gc_component[component].module_name
-             ? gnupg_module_name (gc_component[component].module_name)
-             : gc_component[component].program );
-
-  if (only_installed && access (pgmname, X_OK))
-    {
-      return;  /* The component is not installed.  */
-    }
-
-
   /* First we need to read the option table from the program.  */
-  argv[0] = "--dump-option-table";
-  argv[1] = NULL;
-  err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
-                             NULL, &outfp, NULL, &pid);
-  if (err)
-    {
-      gc_error (1, 0, "could not gather option table from '%s': %s",
-                pgmname, gpg_strerror (err));
-    }
-
+  outfp = open_query_output (entry->output[0]);
   while ((length = es_read_line (outfp, &line, &line_len, NULL)) > 0)
     {
       char *fields[4];
@@ -1682,28 +2060,13 @@ retrieve_options_from_program (gc_component_id_t component, int only_installed)
     gc_error (1, errno, "error closing %s", pgmname);
   log_assert (opt_table_used == opt_info_used);
 
-  err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
-  if (err)
-    gc_error (1, 0, "running %s failed (exitcode=%d): %s",
-              pgmname, exitcode, gpg_strerror (err));
-  gnupg_release_process (pid);
-
   /* Make the gpgrt option table and the internal option table available.  */
   gc_component[component].opt_table = opt_table;
   gc_component[component].options = opt_info;
 
 
   /* Now read the default options.  */
-  argv[0] = "--gpgconf-list";
-  argv[1] = NULL;
-  err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
-                             NULL, &outfp, NULL, &pid);
-  if (err)
-    {
-      gc_error (1, 0, "could not gather active options from '%s': %s",
-                pgmname, gpg_strerror (err));
-    }
-
+  outfp = open_query_output (entry->output[1]);
   while ((length = es_read_line (outfp, &line, &line_len, NULL)) > 0)
     {
       char *linep;
@@ -1786,12 +2149,6 @@ retrieve_options_from_program (gc_component_id_t component, int only_installed)
   if (es_fclose (outfp))
     gc_error (1, errno, "error closing %s", pgmname);
 
-  err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
-  if (err)
-    gc_error (1, 0, "running %s failed (exitcode=%d): %s",
-              pgmname, exitcode, gpg_strerror (err));
-  gnupg_release_process (pid);
-
 
   /* At this point, we can parse the configuration file.  */
   config_name = gc_component[component].option_config_filename;
@@ -1899,24 +2256,41 @@ retrieve_options_from_program (gc_component_id_t component, int only_installed)
 void
 gc_component_retrieve_options (int component)
 {
+  struct component_query_s queries[GC_COMPONENT_NR];
   int process_all = 0;
+  int first, last;
 
   if (component == -1)
     {
       process_all = 1;
-      component = 0;
+      first = 0;
+      last = GC_COMPONENT_NR - 1;
     }
+  else
+    first = last = component;
 
-  do
+  load_option_cache ();
+  memset (queries, 0, sizeof queries);
+
+  /* Start all queries first so that the components not in the cache
+   * run in parallel.  */
+  for (component = first; component <= last; component++)
     {
       if (component == GC_COMPONENT_PINENTRY)
         continue; /* Skip this dummy component.  */
 
       if (gc_component[component].program)
-        retrieve_options_from_program (component, process_all);
+        start_component_query (component, process_all, queries + component);
     }
-  while (process_all && ++component < GC_COMPONENT_NR);
 
+  for (component = first; component <= last; component++)
+    if (queries[component].pgmname)
+      {
+        finish_component_query (queries + component);
+        retrieve_options_from_program (component, queries[component].entry);
+      }
+
+  save_option_cache ();
 }
 
 
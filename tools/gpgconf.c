@@ -67,7 +67,8 @@ enum cmd_and_opt_values
     aCreateSocketDir,
     aRemoveSocketDir,
     aApplyProfile,
-    aReload
+    aReload,
+    aShowMetrics
   };
 
 
@@ -96,6 +97,8 @@ static gpgrt_opt_t opts[] =
     { aReload,        "reload", 256, N_("reload all or a given component")},
     { aLaunch,        "launch", 256, N_("launch a given component")},
     { aKill,          "kill", 256,   N_("kill a given component")},
+    { aShowMetrics,   "show-metrics", 256,
+      N_("show the performance counters of the daemons")},
     { aCreateSocketDir, "create-socketdir", 256, "@"},
     { aRemoveSocketDir, "remove-socketdir", 256, "@"},
 
@@ -594,6 +597,7 @@ main (int argc, char **argv)
         case aReload:
         case aLaunch:
         case aKill:
+        case aShowMetrics:
         case aCreateSocketDir:
         case aRemoveSocketDir:
 	  cmd = pargs.r_opt;
@@ -764,6 +768,10 @@ main (int argc, char **argv)
         }
       break;
 
+    case aShowMetrics:
+      gc_component_show_metrics (get_outfp (&outfp));
+      break;
+
     case aListConfig:
       if (gc_process_gpgconf_conf (fname, 0, 0, get_outfp (&outfp)))
         gpgconf_failure (0);
@@ -94,6 +94,9 @@ void gc_component_kill (int component);
 /* Reload given component.  */
 void gc_component_reload (int component);
 
+/* Print the metrics of all running daemons.  */
+void gc_component_show_metrics (estream_t out);
+
 /* List all components that are available.  */
 void gc_component_list_components (estream_t out);
 
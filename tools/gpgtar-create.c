@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #ifdef HAVE_W32_SYSTEM
 # define WIN32_LEAN_AND_MEAN
 # include <windows.h>
@@ -36,7 +37,8 @@
 #include <assert.h>
 
 #include "../common/i18n.h"
-#include "../common/exectool.h"
+#include "../common/util.h"
+#include "../common/exechelp.h"
 #include "../common/sysutils.h"
 #include "../common/ccparray.h"
 #include "gpgtar.h"
@@ -46,6 +48,13 @@
 #endif
 
 
+/* The maximum number of regular files opened ahead of the one being
+ * written and the maximum amount of their data for which read-ahead
+ * is requested.  */
+#define PREFETCH_FILES 32
+#define PREFETCH_BYTES (16*1024*1024)
+
+
 /* Object to control the file scanning.  */
 struct scanctrl_s;
 typedef struct scanctrl_s *scanctrl_t;
@@ -57,6 +66,15 @@ struct scanctrl_s
 };
 
 
+/* State of the read-ahead of the files to be archived.  */
+struct prefetch_s
+{
+  tar_header_t next;         /* The next entry to look at.  */
+  unsigned int nfiles;       /* Number of files opened ahead.  */
+  unsigned long long nbytes; /* The total size of these files.  */
+};
+
+
 
 
 /* Given a fresh header object HDR with only the name field set, try
@@ -651,6 +669,35 @@ build_header (void *record, tar_header_t hdr)
 }
 
 
+/* Open the regular files following the one being written and ask
+ * the system to read them in the background.  With trees of many
+ * small files the time to open and read them is then overlapped with
+ * writing the archive.  The archive order is not affected.  Errors
+ * are ignored here because write_file will report them.  */
+static void
+prefetch_files (struct prefetch_s *pf)
+{
+  tar_header_t hdr;
+
+  while (pf->next && pf->nfiles < PREFETCH_FILES
+         && pf->nbytes < PREFETCH_BYTES)
+    {
+      hdr = pf->next;
+      pf->next = hdr->next;
+      if (hdr->typeflag != TF_REGULAR)
+        continue;
+      hdr->prefetch_fp = es_fopen (hdr->name, "rb");
+      if (!hdr->prefetch_fp)
+        continue;
+#ifdef HAVE_POSIX_FADVISE
+      posix_fadvise (es_fileno (hdr->prefetch_fp), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+      pf->nfiles++;
+      pf->nbytes += hdr->size;
+    }
+}
+
+
 static gpg_error_t
 write_file (estream_t stream, tar_header_t hdr)
 {
@@ -673,7 +720,10 @@ write_file (estream_t stream, tar_header_t hdr)
 
   if (hdr->typeflag == TF_REGULAR)
     {
-      infp = es_fopen (hdr->name, "rb");
+      infp = hdr->prefetch_fp;
+      hdr->prefetch_fp = NULL;
+      if (!infp)
+        infp = es_fopen (hdr->name, "rb");
       if (!infp)
         {
           err = gpg_error_from_syserror ();
@@ -754,6 +804,8 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
   tar_header_t hdr, *start_tail;
   estream_t outstream = NULL;
   estream_t cipher_stream = NULL;
+  pid_t pid = (pid_t)(-1);
+  struct prefetch_s prefetch;
   int eof_seen = 0;
 
   if (!inpattern)
@@ -876,37 +928,12 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
   if (outstream == es_stdout)
     es_set_binary (es_stdout);
 
-  if (encrypt || sign)
-    {
-      cipher_stream = outstream;
-      outstream = es_fopenmem (0, "rwb");
-      if (! outstream)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-    }
-
-  for (hdr = scanctrl->flist; hdr; hdr = hdr->next)
-    {
-      err = write_file (outstream, hdr);
-      if (err)
-        goto leave;
-    }
-  err = write_eof_mark (outstream);
-  if (err)
-    goto leave;
-
   if (encrypt || sign)
     {
       strlist_t arg;
       ccparray_t ccp;
       const char **argv;
 
-      err = es_fseek (outstream, 0, SEEK_SET);
-      if (err)
-        goto leave;
-
       /* '--encrypt' may be combined with '--symmetric', but 'encrypt'
          is set either way.  Clear it if no recipients are specified.
          XXX: Fix command handling.  */
@@ -941,23 +968,62 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
           goto leave;
         }
 
-      err = gnupg_exec_tool_stream (opt.gpg_program, argv,
-                                    outstream, NULL, cipher_stream, NULL, NULL);
+      /* The archive is written directly to gpg which in turn writes
+       * to the output file.  */
+      cipher_stream = outstream;
+      outstream = NULL;
+      err = gpgtar_start_gpg (argv, cipher_stream, 1, &outstream, &pid);
       xfree (argv);
       if (err)
         goto leave;
     }
 
+  memset (&prefetch, 0, sizeof prefetch);
+  prefetch.next = scanctrl->flist;
+  for (hdr = scanctrl->flist; hdr; hdr = hdr->next)
+    {
+      if (hdr->prefetch_fp)
+        {
+          prefetch.nfiles--;
+          prefetch.nbytes -= hdr->size;
+        }
+      prefetch_files (&prefetch);
+      err = write_file (outstream, hdr);
+      if (err)
+        goto leave;
+    }
+  err = write_eof_mark (outstream);
+  if (err)
+    goto leave;
+
+  if (pid != (pid_t)(-1))
+    {
+      err = gpgtar_finish_gpg (outstream, 1, pid);
+      outstream = NULL;
+      pid = (pid_t)(-1);
+      if (err)
+        goto leave;
+    }
+
  leave:
+  if (pid != (pid_t)(-1))
+    {
+      gpgtar_finish_gpg (outstream, 1, pid);
+      outstream = NULL;
+    }
   if (!err)
     {
-      gpg_error_t first_err;
-      if (outstream != es_stdout)
+      gpg_error_t first_err = 0;
+      if (!outstream)
+        ;
+      else if (outstream != es_stdout)
         first_err = es_fclose (outstream);
       else
         first_err = es_fflush (outstream);
       outstream = NULL;
-      if (cipher_stream != es_stdout)
+      if (!cipher_stream)
+        ;
+      else if (cipher_stream != es_stdout)
         err = es_fclose (cipher_stream);
       else
         err = es_fflush (cipher_stream);
@@ -980,6 +1046,7 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
   while ( (hdr = scanctrl->flist) )
     {
       scanctrl->flist = hdr->next;
+      es_fclose (hdr->prefetch_fp);
       xfree (hdr);
     }
   return err;
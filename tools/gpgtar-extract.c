@@ -28,7 +28,8 @@
 #include <assert.h>
 
 #include "../common/i18n.h"
-#include "../common/exectool.h"
+#include "../common/util.h"
+#include "../common/exechelp.h"
 #include "../common/sysutils.h"
 #include "../common/ccparray.h"
 #include "gpgtar.h"
@@ -285,6 +286,7 @@ gpgtar_extract (const char *filename, int decrypt)
   gpg_error_t err;
   estream_t stream;
   estream_t cipher_stream = NULL;
+  pid_t pid = (pid_t)(-1);
   tar_header_t header = NULL;
   const char *dirprefix = NULL;
   char *dirname = NULL;
@@ -318,14 +320,6 @@ gpgtar_extract (const char *filename, int decrypt)
       ccparray_t ccp;
       const char **argv;
 
-      cipher_stream = stream;
-      stream = es_fopenmem (0, "rwb");
-      if (! stream)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-
       ccparray_init (&ccp, 0);
 
       ccparray_put (&ccp, "--decrypt");
@@ -340,15 +334,16 @@ gpgtar_extract (const char *filename, int decrypt)
           goto leave;
         }
 
-      err = gnupg_exec_tool_stream (opt.gpg_program, argv,
-                                    cipher_stream, NULL, stream, NULL, NULL);
+      /* gpg reads the input file directly and we read the archive
+       * from its output.  */
+      cipher_stream = stream;
+      err = gpgtar_start_gpg (argv, cipher_stream, 0, &stream, &pid);
       xfree (argv);
       if (err)
-        goto leave;
-
-      err = es_fseek (stream, 0, SEEK_SET);
-      if (err)
-        goto leave;
+        {
+          stream = cipher_stream;
+          goto leave;
+        }
     }
 
   if (opt.directory)
@@ -403,6 +398,13 @@ gpgtar_extract (const char *filename, int decrypt)
  leave:
   xfree (header);
   xfree (dirname);
+  if (pid != (pid_t)(-1))
+    {
+      gpg_error_t err2 = gpgtar_finish_gpg (stream, 0, pid);
+      if (!err)
+        err = err2;
+      stream = cipher_stream;
+    }
   if (stream != es_stdin)
     es_fclose (stream);
   if (stream != cipher_stream)
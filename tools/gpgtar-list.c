@@ -26,7 +26,7 @@
 
 #include "../common/i18n.h"
 #include "gpgtar.h"
-#include "../common/exectool.h"
+#include "../common/exechelp.h"
 #include "../common/ccparray.h"
 
 
@@ -236,6 +236,21 @@ skip_data (estream_t stream, tarinfo_t info, tar_header_t header)
   char record[RECORDSIZE];
   unsigned long long n;
 
+  /* A truncated archive is detected while reading the next header.  */
+  if (info->seekable && header->nrecords
+      && header->nrecords < ((unsigned long long)1 << 52))
+    {
+      if (es_fseeko (stream, (gpgrt_off_t)(header->nrecords * RECORDSIZE),
+                     SEEK_CUR))
+        {
+          log_error ("error seeking in '%s': %s\n", es_fname_get (stream),
+                     gpg_strerror (gpg_error_from_syserror ()));
+          return -1;
+        }
+      info->nblocks += header->nrecords;
+      return 0;
+    }
+
   for (n=0; n < header->nrecords; n++)
     {
       if (read_record (stream, record))
@@ -294,6 +309,7 @@ gpgtar_list (const char *filename, int decrypt)
   gpg_error_t err;
   estream_t stream;
   estream_t cipher_stream = NULL;
+  pid_t pid = (pid_t)(-1);
   tar_header_t header = NULL;
   struct tarinfo_s tarinfo_buffer;
   tarinfo_t tarinfo = &tarinfo_buffer;
@@ -325,14 +341,6 @@ gpgtar_list (const char *filename, int decrypt)
       ccparray_t ccp;
       const char **argv;
 
-      cipher_stream = stream;
-      stream = es_fopenmem (0, "rwb");
-      if (! stream)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-
       ccparray_init (&ccp, 0);
 
       ccparray_put (&ccp, "--decrypt");
@@ -347,15 +355,23 @@ gpgtar_list (const char *filename, int decrypt)
           goto leave;
         }
 
-      err = gnupg_exec_tool_stream (opt.gpg_program, argv,
-                                    cipher_stream, NULL, stream, NULL, NULL);
+      /* gpg reads the input file directly and we read the archive
+       * from its output.  */
+      cipher_stream = stream;
+      err = gpgtar_start_gpg (argv, cipher_stream, 0, &stream, &pid);
       xfree (argv);
       if (err)
-        goto leave;
-
-      err = es_fseek (stream, 0, SEEK_SET);
-      if (err)
-        goto leave;
+        {
+          stream = cipher_stream;
+          goto leave;
+        }
+    }
+  else if (!es_fseeko (stream, 0, SEEK_CUR))
+    {
+      /* Listing a plain archive stored in a file does not require to
+       * read the data of the members.  We test this before the first
+       * read so that a failed seek can't harm the stream.  */
+      tarinfo->seekable = 1;
     }
 
   for (;;)
@@ -375,6 +391,13 @@ gpgtar_list (const char *filename, int decrypt)
 
  leave:
   xfree (header);
+  if (pid != (pid_t)(-1))
+    {
+      gpg_error_t err2 = gpgtar_finish_gpg (stream, 0, pid);
+      if (!err)
+        err = err2;
+      stream = cipher_stream;
+    }
   if (stream != es_stdin)
     es_fclose (stream);
   if (stream != cipher_stream)
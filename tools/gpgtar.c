@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 
 #define INCLUDED_BY_MAIN_MODULE 1
 #include "../common/util.h"
@@ -43,6 +44,7 @@
 #include "../common/openpgpdefs.h"
 #include "../common/init.h"
 #include "../common/strlist.h"
+#include "../common/exechelp.h"
 
 #include "gpgtar.h"
 
@@ -569,6 +571,80 @@ write_record (estream_t stream, const void *record)
 }
 
 
+/* Start gpg with the arguments ARGV to process the archive from or
+ * to FILE.  If TO_GPG is set the archive is written by the caller to
+ * the stream stored at R_FP and gpg writes its output to FILE;
+ * otherwise gpg reads FILE and the caller reads the archive from the
+ * stream at R_FP.  gpg thus works directly on FILE and only the
+ * archive passes through a pipe; nothing is buffered here.  The
+ * process id of gpg is stored at R_PID and gpgtar_finish_gpg must be
+ * called to close the stream and wait for gpg.  */
+gpg_error_t
+gpgtar_start_gpg (const char **argv, estream_t file, int to_gpg,
+                  estream_t *r_fp, pid_t *r_pid)
+{
+  gpg_error_t err;
+  int filedes[2];
+
+  *r_fp = NULL;
+  *r_pid = (pid_t)(-1);
+
+  if (es_fflush (file))
+    return gpg_error_from_syserror ();
+
+  if (to_gpg)
+    err = gnupg_create_outbound_pipe (filedes, r_fp, 0);
+  else
+    err = gnupg_create_inbound_pipe (filedes, r_fp, 0);
+  if (err)
+    return err;
+
+  err = gnupg_spawn_process_fd (opt.gpg_program, argv,
+                                to_gpg? filedes[0] : es_fileno (file),
+                                to_gpg? es_fileno (file) : filedes[1],
+                                es_fileno (es_stderr), r_pid);
+  /* Close the end of the pipe used by gpg.  */
+  close (to_gpg? filedes[0] : filedes[1]);
+  if (err)
+    {
+      log_error ("error running '%s': %s\n",
+                 opt.gpg_program, gpg_strerror (err));
+      es_fclose (*r_fp);
+      *r_fp = NULL;
+    }
+  return err;
+}
+
+
+/* Close the stream FP returned by gpgtar_start_gpg and wait for the
+ * gpg process PID to terminate.  TO_GPG must have the same value as
+ * used with gpgtar_start_gpg; if it is not set the rest of the output
+ * of gpg is read and discarded so that gpg does not fail writing to a
+ * closed pipe.  Returns an error if gpg failed.  */
+gpg_error_t
+gpgtar_finish_gpg (estream_t fp, int to_gpg, pid_t pid)
+{
+  gpg_error_t err = 0;
+  gpg_error_t err2;
+  char buffer[4096];
+  size_t nread;
+
+  if (fp && !to_gpg)
+    while (!es_read (fp, buffer, sizeof buffer, &nread) && nread)
+      ;
+  if (fp && es_fclose (fp))
+    err = gpg_error_from_syserror ();
+  if (pid != (pid_t)(-1))
+    {
+      err2 = gnupg_wait_process (opt.gpg_program, pid, 1, NULL);
+      if (!err)
+        err = err2;
+      gnupg_release_process (pid);
+    }
+  return err;
+}
+
+
 /* Return true if FP is an unarmored OpenPGP message.  Note that this
    function reads a few bytes from FP but pushes them back.  */
 #if 0
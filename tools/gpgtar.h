@@ -48,6 +48,8 @@ struct tarinfo_s
 {
   unsigned long long nblocks;     /* Count of processed blocks.  */
   unsigned long long headerblock; /* Number of current header block. */
+  int seekable;                   /* The data records may be skipped
+                                     by seeking.  */
 };
 typedef struct tarinfo_s *tarinfo_t;
 
@@ -121,6 +123,8 @@ struct tar_header_s
 
   unsigned long long nrecords; /* Number of data records.  */
 
+  estream_t prefetch_fp;    /* The file opened ahead by gpgtar_create.  */
+
   char name[1];             /* Filename (dynamically extended).  */
 };
 
@@ -128,6 +132,9 @@ struct tar_header_s
 /*-- gpgtar.c --*/
 gpg_error_t read_record (estream_t stream, void *record);
 gpg_error_t write_record (estream_t stream, const void *record);
+gpg_error_t gpgtar_start_gpg (const char **argv, estream_t file, int to_gpg,
+                              estream_t *r_fp, pid_t *r_pid);
+gpg_error_t gpgtar_finish_gpg (estream_t fp, int to_gpg, pid_t pid);
 
 /*-- gpgtar-create.c --*/
 gpg_error_t gpgtar_create (char **inpattern, int encrypt, int sign);
@@ -691,6 +691,9 @@ mime_parser_parse (mime_parser_t ctx, estream_t fp)
       log_error ("can't open mail parser: %s", gpg_strerror (err));
       goto leave;
     }
+  /* We process the parts one after the other and never look back;
+   * thus there is no need to keep them.  */
+  rfc822parse_set_streaming (msg, 1);
 
   /* Fixme: We should not use fgets because it can't cope with
      embedded nul characters. */
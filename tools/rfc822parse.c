@@ -86,6 +86,7 @@ struct part
   struct part *down;      /* A contained part. */
   HDR_LINE hdr_lines;       /* Header lines os that part. */
   HDR_LINE *hdr_lines_tail; /* Helper for adding lines. */
+  size_t hdr_size;          /* Total length of the header lines. */
   char *boundary;           /* Only used in the first part. */
 };
 typedef struct part *part_t;
@@ -97,6 +98,8 @@ struct rfc822parse_context
   int callback_error;
   int in_body;
   int in_preamble;      /* Whether we are before the first boundary. */
+  int streaming;        /* Release finished parts; see
+                           rfc822parse_set_streaming.  */
   part_t parts;         /* The tree of parts. */
   part_t current_part;  /* Whom we are processing (points into parts). */
   const char *boundary; /* Current boundary. */
@@ -347,6 +350,20 @@ rfc822parse_close (rfc822parse_t msg)
     }
 }
 
+/* Switch the streaming mode of MSG on if YES is true.  In this mode
+ * a part is released as soon as the next part at the same level
+ * starts, thus the memory used does not grow with the number of
+ * parts and the size of the header block of a part is limited to
+ * RFC822PARSE_MAX_HEADER_SIZE bytes.  The header lines of a part can
+ * then only be retrieved while the part or one of its sub-parts is
+ * processed.  The body lines are never stored.  */
+void
+rfc822parse_set_streaming (rfc822parse_t msg, int yes)
+{
+  msg->streaming = !!yes;
+}
+
+
 static part_t
 find_parent (part_t tree, part_t target)
 {
@@ -478,6 +495,20 @@ transition_to_header (rfc822parse_t msg)
   if (!part)
     return -1;
 
+  if (msg->streaming)
+    {
+      part_t parent = find_parent (msg->parts, msg->current_part);
+
+      /* The finished part is the only child; replace it.  */
+      if (parent && parent->down == msg->current_part)
+        {
+          parent->down = part;
+          release_part (msg->current_part);
+          msg->current_part = part;
+          return 0;
+        }
+    }
+
   msg->current_part->right = part;
   msg->current_part = part;
   return 0;
@@ -505,6 +536,15 @@ insert_header (rfc822parse_t msg, const unsigned char *line, size_t length)
     do_callback (msg, RFC822PARSE_BEGIN_HEADER);
 
   length = length_sans_trailing_ws (line, length);
+  if (msg->streaming)
+    {
+      if (msg->current_part->hdr_size + length > RFC822PARSE_MAX_HEADER_SIZE)
+        {
+          errno = E2BIG;
+          return -1;
+        }
+      msg->current_part->hdr_size += length;
+    }
   hdr = malloc (sizeof (*hdr) + length);
   if (!hdr)
     return -1;
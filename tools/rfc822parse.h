@@ -51,7 +51,11 @@ typedef int (*rfc822parse_cb_t) (void *opaque,
 int rfc822_valid_header_name_p (const char *name);
 void rfc822_capitalize_header_name (char *name);
 
+/* The maximum size of the header block of a part in streaming mode.  */
+#define RFC822PARSE_MAX_HEADER_SIZE (256*1024)
+
 rfc822parse_t rfc822parse_open (rfc822parse_cb_t cb, void *opaque_value);
+void rfc822parse_set_streaming (rfc822parse_t msg, int yes);
 
 void rfc822parse_close (rfc822parse_t msg);
 
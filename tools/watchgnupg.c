@@ -63,6 +63,7 @@
 
 static int verbose;
 static int time_only;
+static int traces;
 
 static void
 die (const char *format, ...)
@@ -137,6 +138,26 @@ typedef struct client_s *client_t;
 static client_t client_list;
 
 
+/* The spans of a trace with the same program and command.  */
+struct span_s {
+  struct span_s *next;
+  unsigned int count;      /* Number of spans.  */
+  unsigned int errors;     /* Number of spans with an error.  */
+  unsigned long long usec; /* Total time of the spans.  */
+  char name[1];            /* "PGMNAME COMMAND" */
+};
+
+/* The spans of one trace id collected with --traces.  */
+struct trace_s {
+  struct trace_s *next;
+  struct span_s *spans;
+  char id[17];
+};
+
+/* The list of all open traces.  */
+static struct trace_s *trace_list;
+
+
 
 
 static void
@@ -158,6 +179,113 @@ print_fd_and_time (int fd)
 }
 
 
+/* Print the summary of the trace T and remove it from the list.
+ * TOTAL is the time of the entire trace.  */
+static void
+print_trace (struct trace_s *t, unsigned long long total)
+{
+  struct trace_s **tp;
+  struct span_s *sp, *sp_next;
+
+  for (tp = &trace_list; *tp; tp = &(*tp)->next)
+    if (*tp == t)
+      {
+        *tp = t->next;
+        break;
+      }
+
+  printf ("    - trace %s: %llu usec total\n", t->id, total);
+  for (sp = t->spans; sp; sp = sp_next)
+    {
+      sp_next = sp->next;
+      printf ("    -   %-32s %5u calls %10llu usec %3u errors\n",
+              sp->name, sp->count, sp->usec, sp->errors);
+      free (sp);
+    }
+  free (t);
+}
+
+
+/* Record the span from the log line LINE of length LEN if it has the
+ * format "trace:ID:PGMNAME:COMMAND:USEC:ERRCODE:".  The summary of a
+ * trace is printed when the "total" span of gpg arrives.  */
+static void
+note_trace (const char *line, size_t len)
+{
+  char buffer[256];
+  char name[256];
+  char *fields[6];
+  char *p;
+  int nfields;
+  struct trace_s *t;
+  struct span_s *sp;
+
+  if (len >= sizeof buffer)
+    return;
+  memcpy (buffer, line, len);
+  buffer[len] = 0;
+  if (!(p = strstr (buffer, "trace:")))
+    return;
+  for (nfields = 0; nfields < 6 && p; nfields++)
+    {
+      fields[nfields] = p;
+      if ((p = strchr (p, ':')))
+        *p++ = 0;
+    }
+  if (nfields < 6 || !*fields[1] || strlen (fields[1]) >= sizeof t->id)
+    return;
+
+  for (t = trace_list; t; t = t->next)
+    if (!strcmp (t->id, fields[1]))
+      break;
+  if (!t)
+    {
+      t = xcalloc (1, sizeof *t);
+      strcpy (t->id, fields[1]);
+      t->next = trace_list;
+      trace_list = t;
+    }
+
+  if (!strcmp (fields[3], "total"))
+    {
+      print_trace (t, strtoull (fields[4], NULL, 10));
+      return;
+    }
+
+  snprintf (name, sizeof name, "%s %s", fields[2], fields[3]);
+  for (sp = t->spans; sp; sp = sp->next)
+    if (!strcmp (sp->name, name))
+      break;
+  if (!sp)
+    {
+      sp = xcalloc (1, sizeof *sp + strlen (name));
+      strcpy (sp->name, name);
+      sp->next = t->spans;
+      t->spans = sp;
+    }
+  sp->count++;
+  sp->usec += strtoull (fields[4], NULL, 10);
+  if (atoi (fields[5]))
+    sp->errors++;
+}
+
+
+/* Append N bytes from LINE to the buffer of client C.  */
+static void
+append_to_buffer (client_t c, const char *line, size_t n)
+{
+  if (c->len + n >= c->size)
+    {
+      c->size += ((n + 255) & ~255);
+      c->buffer = (c->buffer
+                   ? xrealloc (c->buffer, c->size)
+                   : xmalloc (c->size));
+    }
+  memcpy (c->buffer + c->len, line, n);
+  c->len += n;
+}
+
+
 /* Print LINE for the client identified by C.  Calling this function
    with LINE set to NULL, will flush the internal buffer. */
 static void
@@ -173,6 +301,8 @@ print_line (client_t c, const char *line)
           print_fd_and_time (c->fd);
           fwrite (c->buffer, c->len, 1, stdout);
           putc ('\n', stdout);
+          if (traces)
+            note_trace (c->buffer, c->len);
           c->len = 0;
         }
       return;
@@ -184,24 +314,21 @@ print_line (client_t c, const char *line)
       if (c->buffer && c->len)
         {
           fwrite (c->buffer, c->len, 1, stdout);
+          if (traces)
+            {
+              append_to_buffer (c, line, s - line);
+              note_trace (c->buffer, c->len);
+            }
           c->len = 0;
         }
+      else if (traces)
+        note_trace (line, s - line);
       fwrite (line, s - line + 1, 1, stdout);
       line = s + 1;
     }
   n = strlen (line);
   if (n)
-    {
-      if (c->len + n >= c->size)
-        {
-          c->size += ((n + 255) & ~255);
-          c->buffer = (c->buffer
-                       ? xrealloc (c->buffer, c->size)
-                       : xmalloc (c->size));
-        }
-      memcpy (c->buffer + c->len, line, n);
-      c->len += n;
-    }
+    append_to_buffer (c, line, n);
 }
 
 
@@ -359,6 +486,7 @@ print_version (int with_help)
        "  --force       delete an already existing socket file\n"
        "  --verbose     enable extra informational output\n"
        "  --time-only   print only the time; not a full timestamp\n"
+       "  --traces      summarize the traces of gpg --trace-ipc\n"
        "  --homedir DIR use DIR for gpgconf's --homedir option\n"
        "  --version     print version of the program and exit\n"
        "  --help        display this help and exit\n"
@@ -411,6 +539,11 @@ main (int argc, char **argv)
           time_only = 1;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--traces"))
+        {
+          traces = 1;
+          argc--; argv++;
+        }
       else if (!strcmp (*argv, "--force"))
         {
           force = 1;
@@ -40,6 +40,12 @@
 /* Limit of acceptable encrypted data.  */
 #define MAX_ENCRYPTED 100000
 
+/* Limit of acceptable key data.  */
+#define MAX_KEY_DATA 100000
+
+/* Limit of acceptable confirmation data.  */
+#define MAX_WKD_DATA 10000
+
 /* Data for a received object.  */
 struct receive_ctx_s
 {
@@ -308,7 +314,7 @@ new_part (void *cookie, const char *mediatype, const char *mediasubtype)
         }
       else
         {
-          ctx->key_data = es_fopenmem (0, "w+b");
+          ctx->key_data = es_fopenmem (MAX_KEY_DATA, "w+b");
           if (!ctx->key_data)
             {
               err = gpg_error_from_syserror ();
@@ -333,7 +339,7 @@ new_part (void *cookie, const char *mediatype, const char *mediasubtype)
         }
       else
         {
-          ctx->wkd_data = es_fopenmem (0, "w+b");
+          ctx->wkd_data = es_fopenmem (MAX_WKD_DATA, "w+b");
           if (!ctx->wkd_data)
             {
               err = gpg_error_from_syserror ();
@@ -383,13 +389,23 @@ part_data (void *cookie, const void *data, size_t datalen)
         {
           if (es_write (ctx->key_data, data, datalen, NULL)
               || es_fputs ("\n", ctx->key_data))
-            return gpg_error_from_syserror ();
+            {
+              gpg_error_t err = gpg_error_from_syserror ();
+              log_error ("error collecting key data: %s\n",
+                         gpg_strerror (err));
+              return err;
+            }
         }
       if (ctx->collect_wkd_data)
         {
           if (es_write (ctx->wkd_data, data, datalen, NULL)
               || es_fputs ("\n", ctx->wkd_data))
-            return gpg_error_from_syserror ();
+            {
+              gpg_error_t err = gpg_error_from_syserror ();
+              log_error ("error collecting wks data: %s\n",
+                         gpg_strerror (err));
+              return err;
+            }
         }
     }
   else